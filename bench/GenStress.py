@@ -0,0 +1,137 @@
+# Usage:
+#   python3 GenStress.py <kind> <n> <output directory>
+#   python3 GenStress.py all 10 stress/
+#
+# Writes a synthetic C input of the given kind at size <n> to
+# '<output directory>/<kind>_<n>.c' (with any headers it needs beside it),
+# and prints its path. Each kind scales one thing production code has a lot
+# of, linearly in <n>, so that the compiler's time and memory should grow
+# linearly too (see 'RunScale.py'):
+#
+#   huge_fn      1000 * n statements in one function (reg_alloc)
+#   big_switch   100 * n cases in one switch (compile_switch)
+#   many_macros  200 * n macros, each expanding the one before (substitute,
+#                and 'set_union' on the hide sets)
+#   big_init     a 16 KB * n initialiser, as bytes and as structs
+#                (compile_global)
+#   include_chain  10 * n headers, each including the next (compile it from
+#                the output directory; headers are found relative to it)
+#
+# So n = 50 is a 50k statement function, a 5k case switch, 10k macros, and a
+# 800 KB initialiser.
+
+import sys, os
+
+def gen_huge_fn(n, out_dir):
+    num_vars, num_stmts = 32, 1000 * n
+    lines = ["int huge(int x) {"]
+    for i in range(num_vars):
+        lines.append("\tint a%d = x + %d;" % (i, i))
+    for i in range(num_stmts):
+        dst, l, r = i % num_vars, (i * 7 + 3) % num_vars, (i * 13 + 5) % num_vars
+        if i % 50 == 49: # Some control flow, so it's not one huge BB
+            lines.append("\tif (a%d > %d) a%d = a%d - %d;" % (l, i, dst, r, i % 17))
+        else:
+            lines.append("\ta%d = a%d + a%d * %d - %d;" % (dst, l, r, i % 9 + 1, i % 100))
+    lines.append("\treturn " + " + ".join("a%d" % i for i in range(num_vars)) + ";")
+    lines.append("}")
+    lines.append("int main() {\n\treturn huge(3) & 255;\n}")
+    return "\n".join(lines) + "\n"
+
+def gen_big_switch(n, out_dir):
+    num_cases = 100 * n
+    lines = ["int sw(int x) {", "\tint r = 0;", "\tswitch (x) {"]
+    for i in range(num_cases):
+        # Clusters of 10 with gaps between them, so it's not one jump table
+        lines.append("\tcase %d: r = x * %d + %d; break;" %
+                     (i * 3 + (i // 10) * 1000, i % 7 + 1, i % 13))
+    lines.append("\tdefault: r = -1;")
+    lines.append("\t}")
+    lines.append("\treturn r;")
+    lines.append("}")
+    lines.append("int main() {\n\treturn sw(%d) & 255;\n}" % (num_cases * 2))
+    return "\n".join(lines) + "\n"
+
+def gen_many_macros(n, out_dir):
+    num_macros = 200 * n
+    lines = ["#define M0(x) ((x) + 1)", "#define ID(x) x"]
+    for i in range(1, num_macros):
+        if i % 20 == 0: # Restart the chain, so the nesting stays bounded
+            lines.append("#define M%d(x) ID((x) ^ %d)" % (i, i % 251))
+        else:
+            lines.append("#define M%d(x) M%d(ID(x) + %d)" % (i, i - 1, i % 10))
+    lines.append("int main() {")
+    lines.append("\tint s = 0;")
+    for i in range(0, num_macros, 2):
+        lines.append("\ts = M%d(s) & 1023;" % i)
+    lines.append("\treturn s & 255;")
+    lines.append("}")
+    return "\n".join(lines) + "\n"
+
+def gen_big_init(n, out_dir):
+    num_bytes = 16 * 1024 * n
+    lines = ["unsigned char bytes[] = {"]
+    for i in range(0, num_bytes, 16):
+        lines.append("\t" + ", ".join("%d" % ((i + j) * 31 % 256) for j in range(16)) + ",")
+    lines.append("};")
+    lines.append("struct Entry { int key; short a, b; char *name; };")
+    lines.append("struct Entry entries[] = {")
+    for i in range(num_bytes // 16):
+        lines.append("\t{ %d, %d, .b = %d, \"e%d\" }," % (i, i % 300, i % 7, i % 100))
+    lines.append("};")
+    lines.append("int main() {")
+    lines.append("\treturn (bytes[%d] + entries[%d].a) & 255;" % (num_bytes - 1, num_bytes // 16 - 1))
+    lines.append("}")
+    return "\n".join(lines) + "\n"
+
+def gen_include_chain(n, out_dir):
+    depth = 10 * n
+    for i in range(depth):
+        with open(os.path.join(out_dir, "chain_%d_%d.h" % (n, i)), "w") as f:
+            f.write("#ifndef CHAIN_%d\n#define CHAIN_%d\n" % (i, i))
+            f.write("static int chain%d(int x) { return x + %d; }\n" % (i, i % 10))
+            if i + 1 < depth:
+                f.write("#include \"chain_%d_%d.h\"\n" % (n, i + 1))
+            f.write("#endif\n")
+    lines = ["#include \"chain_%d_0.h\"" % n]
+    lines.append("int main() {")
+    lines.append("\tint s = 0;")
+    for i in range(0, depth, max(depth // 50, 1)):
+        lines.append("\ts = chain%d(s);" % i)
+    lines.append("\treturn s & 255;")
+    lines.append("}")
+    return "\n".join(lines) + "\n"
+
+KINDS = [
+    ("huge_fn", gen_huge_fn),
+    ("big_switch", gen_big_switch),
+    ("many_macros", gen_many_macros),
+    ("big_init", gen_big_init),
+    ("include_chain", gen_include_chain),
+]
+
+def write_input(kind, n, out_dir):
+    gen = dict(KINDS)[kind]
+    path = os.path.join(out_dir, "%s_%d.c" % (kind, n))
+    src = gen(n, out_dir)
+    with open(path, "w") as f:
+        f.write(src)
+    return path
+
+def main(argv):
+    if len(argv) != 4:
+        print("Usage: python3 GenStress.py <kind> <n> <output directory>")
+        print("Kinds: all, " + ", ".join(k for k, _ in KINDS))
+        return 1
+    kind, n, out_dir = argv[1], int(argv[2]), argv[3]
+    if kind != "all" and kind not in dict(KINDS):
+        print("Unknown kind '" + kind + "'")
+        return 1
+    os.makedirs(out_dir, exist_ok=True)
+    for k, _ in KINDS:
+        if kind == "all" or kind == k:
+            print(write_input(k, n, out_dir))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
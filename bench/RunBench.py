@@ -0,0 +1,385 @@
+# Usage:
+#   python3 RunBench.py <path to Cosec executable> [options]
+#   python3 ../bench/RunBench.py ./Cosec --scale 4 --runs 10
+#
+# Options:
+#   --scale <n>     Size of the synthesised compile corpus (default 1)
+#   --runs <n>      Times to repeat each measurement (default 5)
+#   --compile-only  Skip the generated-code benchmarks
+#   --run-only      Skip the compile-throughput benchmarks
+#   --keep          Don't delete the generated corpus afterwards
+#   --perf          Collect hardware counters too: per compiler phase (with
+#                   '--perf-counters'), and for each kernel (with 'perf stat')
+#   --json <file>   Write the results to <file>, with the commit they're for
+#   -- <flags>      Passed on to every Cosec invocation (e.g. -fregalloc=linear)
+#
+# Compile throughput is measured over a corpus that's synthesised at the given
+# scale (huge functions, deep macro nesting, big switches, many globals, many
+# functions). Each file is compiled with '--time-report' to get per-phase
+# times. The kernels in 'kernels/' are then compiled (straight to an object
+# file, so NASM isn't needed), linked with 'cc', checked against their
+# '// expect: N', and timed.
+#
+# Hardware counters (cycles, instructions, branch misses, L1 and LLC misses,
+# page faults) are only read where the kernel allows it; ones that can't be
+# read are left out. Comparing the JSON from two commits shows IPC
+# regressions in a phase directly, not just the change in its time.
+
+import subprocess, sys, os, re, time, statistics, tempfile, shutil, json
+
+GREEN = "\033[1m\033[92m"
+RED =   "\033[1m\033[91m"
+CLEAR = "\033[0m"
+
+obj_format = "macho64" if sys.platform == "darwin" else "elf64"
+cc_bin = "cc"
+
+
+# ---- Corpus ----------------------------------------------------------------
+
+def gen_huge_fn(scale):
+    num_vars, num_stmts = 16, 2000 * scale
+    lines = ["int huge(int x) {"]
+    for i in range(num_vars):
+        lines.append("\tint a%d = x + %d;" % (i, i))
+    for i in range(num_stmts):
+        dst, l, r = i % num_vars, (i * 7 + 3) % num_vars, (i * 3 + 1) % num_vars
+        lines.append("\ta%d = a%d + a%d * %d - %d;" % (dst, l, r, i % 9 + 1, i % 100))
+    lines.append("\treturn " + " + ".join("a%d" % i for i in range(num_vars)) + ";")
+    lines.append("}")
+    lines.append("int main() {\n\treturn huge(3) & 255;\n}")
+    return "\n".join(lines) + "\n"
+
+def gen_macro_nesting(scale):
+    depth, uses = 100 * scale, 200 * scale
+    lines = ["#define M0(x) ((x) + 1)"]
+    for i in range(1, depth):
+        lines.append("#define M%d(x) M%d((x) + %d)" % (i, i - 1, i % 10))
+    lines.append("int main() {")
+    lines.append("\tint s = 0;")
+    for i in range(uses):
+        lines.append("\ts = M%d(s) & 1023;" % (depth - 1 - i % depth))
+    lines.append("\treturn s & 255;")
+    lines.append("}")
+    return "\n".join(lines) + "\n"
+
+def gen_big_switch(scale):
+    num_cases = 1000 * scale
+    lines = ["int sw(int x) {", "\tswitch (x) {"]
+    for i in range(num_cases):
+        lines.append("\tcase %d: return x * %d + %d;" % (i * 3, i % 7 + 1, i % 13))
+    lines.append("\tdefault: return 0;")
+    lines.append("\t}")
+    lines.append("}")
+    lines.append("int main() {")
+    lines.append("\tint s = 0;")
+    lines.append("\tfor (int i = 0; i < %d; i++) {" % (num_cases * 3))
+    lines.append("\t\ts += sw(i);")
+    lines.append("\t}")
+    lines.append("\treturn s & 255;")
+    lines.append("}")
+    return "\n".join(lines) + "\n"
+
+def gen_many_globals(scale):
+    num_globals = 5000 * scale
+    lines = []
+    for i in range(num_globals):
+        lines.append("int g%d = %d;" % (i, i % 1000))
+        if i % 10 == 0:
+            lines.append("int *p%d = &g%d;" % (i, i))
+    lines.append("int main() {")
+    lines.append("\tint s = 0;")
+    for i in range(0, num_globals, 50):
+        lines.append("\ts += g%d + *p%d;" % (i, i))
+    lines.append("\treturn s & 255;")
+    lines.append("}")
+    return "\n".join(lines) + "\n"
+
+def gen_many_fns(scale):
+    num_fns = 1000 * scale
+    lines = ["int f0(int x) { return x + 1; }"]
+    for i in range(1, num_fns):
+        lines.append("int f%d(int x) {\n\tint y = x * %d;\n\tif (y > 1000) {\n"
+                     "\t\ty = y - 1000;\n\t}\n\treturn f%d(y) + %d;\n}"
+                     % (i, i % 5 + 1, i - 1, i % 3))
+    lines.append("int main() {\n\treturn f%d(1) & 255;\n}" % (num_fns - 1))
+    return "\n".join(lines) + "\n"
+
+CORPUS = [
+    ("huge_fn", gen_huge_fn),
+    ("macro_nesting", gen_macro_nesting),
+    ("big_switch", gen_big_switch),
+    ("many_globals", gen_many_globals),
+    ("many_fns", gen_many_fns),
+]
+
+def write_corpus(corpus_dir, scale):
+    paths = []
+    for name, gen in CORPUS:
+        path = os.path.join(corpus_dir, name + ".c")
+        with open(path, "w") as f:
+            f.write(gen(scale))
+        paths.append(path)
+    return paths
+
+
+# ---- Measurement -----------------------------------------------------------
+
+def summarise(samples):
+    mean = statistics.mean(samples)
+    stdev = statistics.stdev(samples) if len(samples) > 1 else 0.0
+    return mean, stdev, min(samples)
+
+PERF_EVENTS = ["cycles", "instructions", "branch-misses", "L1-dcache-load-misses",
+               "LLC-load-misses", "page-faults"]
+
+# Column names in '--perf-counters' to the names 'perf stat' uses
+PERF_COLUMNS = ["cycles", "instructions", None, "branch-misses", "L1-dcache-load-misses",
+                "LLC-load-misses", "page-faults"] # 'None' for IPC
+
+# Returns {phase: wall ms}, the total token count, and {phase: {event: count}}
+# from '--time-report' (the counters only with '--perf-counters')
+def parse_time_report(stderr):
+    phases, tokens, counters = {}, 0, {}
+    table = None
+    for line in stderr.splitlines():
+        cols = line.split()
+        if len(cols) == 0:
+            table = None
+        elif cols[0] == "phase" or cols[0] == "counters":
+            table = cols[0]
+        elif table == "phase" and cols[0] == "total":
+            tokens = int(cols[4])
+            table = None
+        elif table == "phase":
+            phases[cols[0]] = float(cols[1])
+        elif table == "counters" and cols[0] != "total":
+            values = {}
+            for event, value in zip(PERF_COLUMNS, cols[1:]):
+                if event and value != "-":
+                    values[event] = float(value)
+            counters[cols[0]] = values
+    return phases, tokens, counters
+
+# Returns {event: count} for running 'cmd' under 'perf stat', or None if it
+# can't be (no 'perf', or counters not permitted)
+def perf_stat(cmd):
+    if not shutil.which("perf"):
+        return None
+    result = subprocess.run(["perf", "stat", "-x", ",", "-e", ",".join(PERF_EVENTS)] + cmd,
+                            capture_output=True, text=True)
+    counts = {}
+    for line in result.stderr.splitlines():
+        cols = line.split(",")
+        if len(cols) >= 3 and cols[2] in PERF_EVENTS:
+            try:
+                counts[cols[2]] = float(cols[0])
+            except ValueError: # '<not supported>' or '<not counted>'
+                pass
+    return counts or None
+
+def mean_counters(samples):
+    events = {}
+    for counts in samples:
+        for event, value in counts.items():
+            events.setdefault(event, []).append(value)
+    means = {e: statistics.mean(v) for e, v in events.items()}
+    if means.get("cycles"):
+        if "instructions" in means:
+            means["ipc"] = means["instructions"] / means["cycles"]
+    return means
+
+def compile_file(cosec_bin, flags, path, out, extra=[]):
+    start = time.perf_counter()
+    result = subprocess.run([cosec_bin] + flags + extra + ["-fformat=" + obj_format, path, "-o", out],
+                            capture_output=True, text=True)
+    return result, time.perf_counter() - start
+
+def bench_compile(cosec_bin, flags, paths, runs, work_dir, perf, results):
+    print("Compile throughput (%d runs each)" % runs)
+    print("%-16s %8s %12s %10s %10s %12s %12s" %
+          ("file", "lines", "mean (ms)", "stdev", "min (ms)", "lines/s", "tokens/s"))
+    all_phases, all_counters = {}, {}
+    ok = True
+    for path in paths:
+        name = os.path.splitext(os.path.basename(path))[0]
+        with open(path) as f:
+            num_lines = sum(1 for _ in f)
+        times, tokens, phases, counters = [], 0, {}, {}
+        for _ in range(runs):
+            result, elapsed = compile_file(cosec_bin, flags, path, os.path.join(work_dir, name + ".o"),
+                                           ["--perf-counters" if perf else "--time-report"])
+            if result.returncode != 0:
+                print("%-16s %s" % (name, RED + "FAILED to compile" + CLEAR))
+                print(result.stdout + result.stderr[-2000:])
+                ok = False
+                break
+            times.append(elapsed)
+            run_phases, tokens, run_counters = parse_time_report(result.stderr)
+            for phase, ms in run_phases.items():
+                phases.setdefault(phase, []).append(ms)
+            for phase, counts in run_counters.items():
+                counters.setdefault(phase, []).append(counts)
+        if len(times) < runs:
+            continue
+        mean, stdev, best = summarise(times)
+        print("%-16s %8d %12.2f %10.2f %10.2f %12.0f %12.0f" %
+              (name, num_lines, mean * 1e3, stdev * 1e3, best * 1e3,
+               num_lines / mean, tokens / mean))
+        all_phases[name] = phases
+        all_counters[name] = {p: mean_counters(c) for p, c in counters.items()}
+        results[name] = {
+            "lines": num_lines, "tokens": tokens,
+            "mean_ms": mean * 1e3, "stdev_ms": stdev * 1e3, "min_ms": best * 1e3,
+            "phases": {p: dict(all_counters[name].get(p, {}), ms=statistics.mean(ms))
+                       for p, ms in phases.items()},
+        }
+
+    # Mean time per phase for each file
+    if all_phases:
+        names = list(all_phases.keys())
+        phase_names = list(next(iter(all_phases.values())).keys())
+        print()
+        print("Mean time per phase (ms)")
+        print("%-16s" % "phase" + "".join(" %13s" % n for n in names))
+        for phase in phase_names:
+            row = "%-16s" % phase
+            for n in names:
+                samples = all_phases[n].get(phase, [0.0])
+                row += " %13.3f" % statistics.mean(samples)
+            print(row)
+
+    # Instructions per cycle for each phase, where the counters could be read
+    if perf and any(c.get("ipc") for f in all_counters.values() for c in f.values()):
+        print()
+        print("IPC per phase")
+        print("%-16s" % "phase" + "".join(" %13s" % n for n in names))
+        for phase in phase_names:
+            row = "%-16s" % phase
+            for n in names:
+                ipc = all_counters[n].get(phase, {}).get("ipc")
+                row += " %13s" % ("%.2f" % ipc if ipc else "-")
+            print(row)
+    elif perf:
+        print()
+        print("Hardware counters unavailable for the compiler's phases")
+    print()
+    return ok
+
+def bench_kernels(cosec_bin, flags, kernel_dir, runs, work_dir, perf, results):
+    print("Generated code (%d runs each)" % runs)
+    print("%-16s %12s %10s %10s%s" % ("kernel", "mean (ms)", "stdev", "min (ms)",
+                                      " %8s" % "IPC" if perf else ""))
+    ok = True
+    for file in sorted(os.listdir(kernel_dir)):
+        if not file.endswith(".c"):
+            continue
+        name = os.path.splitext(file)[0]
+        path = os.path.join(kernel_dir, file)
+        with open(path) as f:
+            expected = int(re.search(r'\/\/ expect\: (\d+)', f.read()).groups()[0])
+        obj = os.path.join(work_dir, name + ".o")
+        exe = os.path.join(work_dir, name)
+        result, _ = compile_file(cosec_bin, flags, path, obj)
+        if result.returncode == 0:
+            result = subprocess.run([cc_bin, "-o", exe, obj], capture_output=True, text=True)
+        if result.returncode != 0:
+            print("%-16s %s" % (name, RED + "FAILED to build" + CLEAR))
+            print(result.stdout + result.stderr)
+            ok = False
+            continue
+        times, counters = [], []
+        for _ in range(runs):
+            start = time.perf_counter()
+            result = subprocess.run([exe], capture_output=True)
+            times.append(time.perf_counter() - start)
+            if result.returncode != expected:
+                break
+            if perf: # Separately, so 'perf' isn't in the times
+                counts = perf_stat([exe])
+                if counts:
+                    counters.append(counts)
+        if result.returncode != expected:
+            print("%-16s %s (expected %d, got %d)" %
+                  (name, RED + "WRONG" + CLEAR, expected, result.returncode))
+            ok = False
+            continue
+        mean, stdev, best = summarise(times)
+        counts = mean_counters(counters)
+        ipc = " %8s" % ("%.2f" % counts["ipc"] if "ipc" in counts else "-") if perf else ""
+        print("%-16s %12.2f %10.2f %10.2f%s" % (name, mean * 1e3, stdev * 1e3, best * 1e3, ipc))
+        results[name] = dict(counts, mean_ms=mean * 1e3, stdev_ms=stdev * 1e3, min_ms=best * 1e3)
+    print()
+    return ok
+
+
+# ---- Main ------------------------------------------------------------------
+
+# The commit of the tree the benchmarks are in, if it's a git checkout
+def git_commit():
+    bench_dir = os.path.dirname(os.path.abspath(__file__))
+    result = subprocess.run(["git", "-C", bench_dir, "rev-parse", "HEAD"],
+                            capture_output=True, text=True)
+    return result.stdout.strip() if result.returncode == 0 else None
+
+def main(argv):
+    if len(argv) < 2:
+        print("Usage: python3 RunBench.py <path to Cosec executable> [options]")
+        return 1
+    cosec_bin = os.path.abspath(argv[1])
+    scale, runs, compile_only, run_only, keep = 1, 5, False, False, False
+    perf, json_path = False, None
+    flags = []
+    i = 2
+    while i < len(argv):
+        arg = argv[i]
+        if arg == "--scale":
+            scale = int(argv[i + 1])
+            i += 1
+        elif arg == "--runs":
+            runs = int(argv[i + 1])
+            i += 1
+        elif arg == "--compile-only":
+            compile_only = True
+        elif arg == "--run-only":
+            run_only = True
+        elif arg == "--keep":
+            keep = True
+        elif arg == "--perf":
+            perf = True
+        elif arg == "--json":
+            json_path = argv[i + 1]
+            i += 1
+        elif arg == "--":
+            flags = argv[i + 1:]
+            break
+        else:
+            print("Unknown option '" + arg + "'")
+            return 1
+        i += 1
+
+    work_dir = tempfile.mkdtemp(prefix="cosec-bench-")
+    results = {"commit": git_commit(), "flags": flags, "scale": scale, "runs": runs,
+               "compile": {}, "kernels": {}}
+    ok = True
+    try:
+        if not run_only:
+            paths = write_corpus(work_dir, scale)
+            ok = bench_compile(cosec_bin, flags, paths, runs, work_dir, perf,
+                               results["compile"]) and ok
+        if not compile_only:
+            kernel_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)), "kernels")
+            ok = bench_kernels(cosec_bin, flags, kernel_dir, runs, work_dir, perf,
+                               results["kernels"]) and ok
+    finally:
+        if keep:
+            print("Corpus kept in '" + work_dir + "'")
+        else:
+            shutil.rmtree(work_dir)
+    if json_path:
+        with open(json_path, "w") as f:
+            json.dump(results, f, indent=2)
+        print("Results written to '" + json_path + "'")
+    return 0 if ok else 1
+
+sys.exit(main(sys.argv))
@@ -0,0 +1,174 @@
+# Usage:
+#   python3 RunScale.py <path to Cosec executable> [options]
+#   python3 ../bench/RunScale.py ./Cosec --sizes 1,2,4,8,16,32,64
+#
+# Options:
+#   --sizes <list>  Comma separated sizes to generate each input at (default
+#                   1,2,4,8,16)
+#   --kinds <list>  Comma separated kinds of input (default all; see
+#                   'GenStress.py')
+#   --limit <x>     Growth exponent above which a curve is flagged (default
+#                   1.3; 1 is linear, 2 quadratic)
+#   --keep          Don't delete the generated inputs afterwards
+#   -- <flags>      Passed on to every Cosec invocation
+#
+# Compiles each input from 'GenStress.py' at every size with '--time-report',
+# and prints how the time of the phases that input stresses, the total time,
+# and the peak RSS grow with the size. The growth exponent k (time ~ n^k) is
+# fitted over the sizes where the phase takes long enough to measure. Curves
+# above '--limit' are flagged, with the code they point at, and make the
+# script exit with 1.
+
+import subprocess, sys, os, math, tempfile, shutil
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import GenStress
+
+GREEN = "\033[1m\033[92m"
+RED =   "\033[1m\033[91m"
+CLEAR = "\033[0m"
+
+obj_format = "macho64" if sys.platform == "darwin" else "elf64"
+
+# The phases each kind of input stresses, and the code in them it's aimed at
+WATCHED = {
+    "huge_fn":       [("reg_alloc", "reg_alloc"), ("assemble", "assemble_fn"),
+                      ("schedule", "schedule_fn")],
+    "big_switch":    [("compile", "compile_switch")],
+    "many_macros":   [("parse", "substitute and set_union (hide sets)")],
+    "big_init":      [("parse", "parse_init"), ("compile", "compile_global"),
+                      ("encode", "encode_x64")],
+    "include_chain": [("parse", "include")],
+}
+
+MIN_MS = 2.0 # Phase times below this are noise, and left out of the fit
+
+# Returns {phase: wall ms} (summed if a phase runs more than once) and the
+# peak RSS in KB from '--time-report'
+def parse_time_report(stderr):
+    phases, rss = {}, 0
+    in_phases = False
+    for line in stderr.splitlines():
+        cols = line.split()
+        if len(cols) == 0:
+            in_phases = False
+        elif cols[0] == "phase":
+            in_phases = True
+        elif line.startswith("max resident set size:"):
+            rss = int(cols[4])
+        elif in_phases:
+            phases[cols[0]] = phases.get(cols[0], 0.0) + float(cols[1])
+    return phases, rss
+
+# Least squares slope of log(y) against log(x), over the points where y is
+# at least 'floor'; None if there aren't two such points
+def growth_exponent(xs, ys, floor):
+    pts = [(math.log(x), math.log(y)) for x, y in zip(xs, ys) if y >= floor]
+    if len(pts) < 2:
+        return None
+    mx = sum(p[0] for p in pts) / len(pts)
+    my = sum(p[1] for p in pts) / len(pts)
+    num = sum((p[0] - mx) * (p[1] - my) for p in pts)
+    den = sum((p[0] - mx) ** 2 for p in pts)
+    return num / den if den > 0 else None
+
+def run_kind(cosec_bin, flags, kind, sizes, limit, work_dir):
+    print(kind)
+    rows = [] # (n, phases, rss)
+    for n in sizes:
+        path = GenStress.write_input(kind, n, work_dir)
+        # From the input's directory, so its own '#include's are found
+        result = subprocess.run([cosec_bin] + flags + ["--time-report", "-fformat=" + obj_format,
+                                 os.path.basename(path), "-o", "%s_%d.o" % (kind, n)],
+                                cwd=work_dir, capture_output=True, text=True)
+        if result.returncode != 0:
+            print("  n=%-6d %s" % (n, RED + "FAILED to compile" + CLEAR))
+            print(result.stdout + result.stderr[-2000:])
+            return False
+        phases, rss = parse_time_report(result.stderr)
+        rows.append((n, phases, rss))
+
+    watched = WATCHED.get(kind, [])
+    columns = [p for p, _ in watched] + ["total"]
+    print("  %-8s" % "n" + "".join(" %12s" % (c + " ms") for c in columns) + " %12s" % "rss (KB)")
+    for n, phases, rss in rows:
+        row = "  %-8d" % n
+        for c in columns:
+            row += " %12.2f" % phases.get(c, 0.0)
+        print(row + " %12d" % rss)
+
+    ok = True
+    xs = [n for n, _, _ in rows]
+    fits = [(p, code, [phases.get(p, 0.0) for _, phases, _ in rows], MIN_MS) for p, code in watched]
+    # Any other phase that's slow enough to measure, in case it's one the
+    # input wasn't aimed at
+    for p in rows[-1][1]:
+        if p != "total" and p not in dict(watched):
+            fits.append((p, None, [phases.get(p, 0.0) for _, phases, _ in rows], MIN_MS))
+    fits.append(("total", None, [phases.get("total", 0.0) for _, phases, _ in rows], MIN_MS))
+    fits.append(("rss", None, [rss for _, _, rss in rows], 0))
+    for name, code, ys, floor in fits:
+        k = growth_exponent(xs, ys, floor)
+        unwatched = code is None and name not in ("total", "rss")
+        if unwatched and (k is None or k <= limit):
+            continue # Only worth mentioning if it's flagged
+        if k is None:
+            print("  %-16s %s" % (name, "too fast to measure"))
+        elif k > limit:
+            print("  %-16s k = %.2f  %s" % (name, k, RED + "SUPER-LINEAR" + CLEAR) +
+                  (" (" + code + ")" if code else ""))
+            ok = False
+        else:
+            print("  %-16s k = %.2f  %s" % (name, k, GREEN + "ok" + CLEAR))
+    print()
+    return ok
+
+
+# ---- Main ------------------------------------------------------------------
+
+def main(argv):
+    if len(argv) < 2:
+        print("Usage: python3 RunScale.py <path to Cosec executable> [options]")
+        return 1
+    cosec_bin = os.path.abspath(argv[1])
+    sizes, kinds, limit, keep = [1, 2, 4, 8, 16], [k for k, _ in GenStress.KINDS], 1.3, False
+    flags = []
+    i = 2
+    while i < len(argv):
+        arg = argv[i]
+        if arg == "--sizes":
+            sizes = [int(s) for s in argv[i + 1].split(",")]
+            i += 1
+        elif arg == "--kinds":
+            kinds = argv[i + 1].split(",")
+            i += 1
+        elif arg == "--limit":
+            limit = float(argv[i + 1])
+            i += 1
+        elif arg == "--keep":
+            keep = True
+        elif arg == "--":
+            flags = argv[i + 1:]
+            break
+        else:
+            print("Unknown option '" + arg + "'")
+            return 1
+        i += 1
+    for kind in kinds:
+        if kind not in dict(GenStress.KINDS):
+            print("Unknown kind '" + kind + "'")
+            return 1
+
+    work_dir = tempfile.mkdtemp(prefix="cosec-scale-")
+    ok = True
+    try:
+        for kind in kinds:
+            ok = run_kind(cosec_bin, flags, kind, sizes, limit, work_dir) and ok
+    finally:
+        if keep:
+            print("Inputs kept in '" + work_dir + "'")
+        else:
+            shutil.rmtree(work_dir)
+    return 0 if ok else 1
+
+sys.exit(main(sys.argv))
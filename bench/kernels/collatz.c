@@ -0,0 +1,21 @@
+// Division, multiplication, and data-dependent branches
+int main() {
+	int best = 0, best_len = 0;
+	for (int i = 1; i < 1000000; i++) {
+		long long n = i;
+		int len = 1;
+		while (n != 1) {
+			if (n % 2 == 0) {
+				n = n / 2;
+			} else {
+				n = 3 * n + 1;
+			}
+			len++;
+		}
+		if (len > best_len) {
+			best_len = len;
+			best = i;
+		}
+	}
+	return best % 256; // expect: 167
+}
@@ -0,0 +1,11 @@
+// Recursive calls
+int fib(int n) {
+	if (n < 2) {
+		return n;
+	}
+	return fib(n - 1) + fib(n - 2);
+}
+
+int main() {
+	return fib(30) % 256; // expect: 40
+}
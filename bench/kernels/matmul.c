@@ -0,0 +1,29 @@
+// Two-dimensional array indexing
+int a[128][128];
+int b[128][128];
+int c[128][128];
+
+int main() {
+	int n = 128;
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			a[i][j] = i + j;
+			b[i][j] = i - j;
+			c[i][j] = 0;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			int sum = 0;
+			for (int k = 0; k < n; k++) {
+				sum += a[i][k] * b[k][j];
+			}
+			c[i][j] = sum;
+		}
+	}
+	int check = 0;
+	for (int i = 0; i < n; i++) {
+		check = check * 31 + c[i][(i * 7) % n];
+	}
+	return (check ^ (check >> 12)) & 255; // expect: 30
+}
@@ -0,0 +1,22 @@
+// Byte array stores and loads in nested loops
+char composite[2000000];
+
+int main() {
+	int n = 2000000;
+	int count = 0;
+	for (int rep = 0; rep < 4; rep++) {
+		count = 0;
+		for (int i = 0; i < n; i++) {
+			composite[i] = 0;
+		}
+		for (int i = 2; i < n; i++) {
+			if (!composite[i]) {
+				count++;
+				for (int j = i + i; j < n; j += i) {
+					composite[j] = 1;
+				}
+			}
+		}
+	}
+	return count % 256; // expect: 197
+}
@@ -0,0 +1,26 @@
+// Insertion sort over pseudo-random data
+int v[20000];
+
+int main() {
+	int n = 20000;
+	unsigned int seed = 12345;
+	for (int i = 0; i < n; i++) {
+		seed = seed * 1103515245 + 12345;
+		v[i] = (seed >> 8) % 100000;
+	}
+	for (int i = 1; i < n; i++) {
+		int x = v[i];
+		int j = i - 1;
+		while (j >= 0 && v[j] > x) {
+			v[j + 1] = v[j];
+			j--;
+		}
+		v[j + 1] = x;
+	}
+	for (int i = 1; i < n; i++) {
+		if (v[i - 1] > v[i]) {
+			return 255;
+		}
+	}
+	return (v[n / 2] + v[0]) % 256; // expect: 178
+}
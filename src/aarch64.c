@@ -0,0 +1,2061 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "aarch64.h"
+#include "analysis.h"
+#include "layout.h"
+#include "stack_slots.h"
+#include "stats.h"
+#include "error.h"
+
+// Instruction selection for AArch64 follows 'assemble.c', which it shares the
+// IR preparation, the stack slot allocator, and the register allocator with.
+// What's different is that there are no memory operands besides those of
+// loads and stores, so loads are always put in a vreg where they're defined;
+// arithmetic takes three operands; and every comparison sets the flags for a
+// 'b.cond', 'cset', or 'csel' straight after it.
+//
+// The stack frame is always set up by 'stp x29, x30, [sp, #-16]!' and 'mov
+// x29, sp', so stack slots are off x29 (there's no '-fomit-frame-pointer'),
+// and the arguments passed to us on the stack are above the saved x29 and x30.
+// x16 and x17 are never allocated, and are left for the encoder (see
+// 'aarch64_encode.c'); x18 is the platform register, and x29 and x30 are the
+// frame pointer and link register
+
+#define STACK_ALIGN 16
+
+typedef struct { // Per-function assembler
+    Fn *fn;
+    BB *bb;
+    int next_gpr, next_fpr;
+    int has_allocs; // Anything left on the stack that a callee could use
+    int ret_ptr;    // vreg with where to return an aggregate (see 'place_ret')
+    int line;       // Of the IR instruction being assembled
+    int *phi_in;    // Per phi (by 'n') in a BB with its address taken; the
+                    // vreg its predecessors copy into (see 'phi_dst')
+} Assembler;
+
+static Assembler * new_asm(Fn *fn) {
+    Assembler *a = malloc(sizeof(Assembler));
+    a->fn = fn;
+    a->bb = fn->entry;
+    a->next_gpr = A64_LAST_GPR;
+    a->next_fpr = A64_LAST_FPR;
+    a->has_allocs = 0;
+    a->ret_ptr = R_NONE;
+    a->line = 0;
+    a->phi_in = NULL;
+    fn->dyn_stack = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            a->has_allocs |= ins->op == IR_ALLOC;
+            fn->dyn_stack |= ins->op == IR_ALLOC && ins->count;
+        }
+    }
+    fn->stack_size = fn->out_args_size = 0;
+    fn->aligned_size = fn->frame_align = 0;
+    fn->patch_with_stack_size = vec_new();
+    fn->jump_tables = vec_new();
+    return a;
+}
+
+
+// ---- Instructions ----------------------------------------------------------
+
+// Leaves off the storage for any operands it won't have
+static AsmIns * alloc_asm(int op, size_t size) {
+    AsmIns *ins = arena_alloc(ARENA_ASM, size);
+    STATS[STAT_ASM_INS]++;
+    ins->next = ins->prev = NULL;
+    ins->bb = NULL;
+    ins->op = op;
+    ins->line = 0;
+    ins->l = ins->r = ins->r2 = NULL;
+    ins->block = NULL;
+    ins->callee = NULL;
+    ins->n = 0;
+    return ins;
+}
+
+static AsmIns * asm0(int op) {
+    return alloc_asm(op, offsetof(AsmIns, l_opr));
+}
+
+// Copies an operand into the instruction's own storage for it
+static AsmOpr * own_opr(AsmOpr *store, AsmOpr *opr) {
+    if (!opr) {
+        return NULL;
+    }
+    *store = *opr;
+    return store;
+}
+
+static AsmIns * asm1(int op, AsmOpr *l) {
+    AsmIns *ins = alloc_asm(op, offsetof(AsmIns, r_opr));
+    ins->l = own_opr(&ins->l_opr, l);
+    return ins;
+}
+
+static AsmIns * asm2(int op, AsmOpr *l, AsmOpr *r) {
+    AsmIns *ins = alloc_asm(op, sizeof(AsmIns));
+    ins->l = own_opr(&ins->l_opr, l);
+    ins->r = own_opr(&ins->r_opr, r);
+    return ins;
+}
+
+static AsmIns * asm3(int op, AsmOpr *l, AsmOpr *r, AsmOpr *r2) {
+    AsmIns *ins = asm2(op, l, r);
+    ins->r2 = r2;
+    return ins;
+}
+
+static AsmIns * emit_to_bb(BB *bb, AsmIns *ins) {
+    ins->bb = bb;
+    ins->prev = bb->asm_last;
+    if (bb->asm_last) {
+        bb->asm_last->next = ins;
+    } else {
+        bb->asm_head = ins;
+    }
+    bb->asm_last = ins;
+    return ins;
+}
+
+static AsmIns * emit(Assembler *a, AsmIns *ins) {
+    ins->line = a->line;
+    return emit_to_bb(a->bb, ins);
+}
+
+static AsmIns * emit_before(AsmIns *before, AsmIns *ins) {
+    ins->bb = before->bb;
+    ins->next = before;
+    ins->prev = before->prev;
+    if (before->prev) {
+        before->prev->next = ins;
+    } else {
+        before->bb->asm_head = ins;
+    }
+    before->prev = ins;
+    return ins;
+}
+
+static AsmIns * emit_after(AsmIns *after, AsmIns *ins) {
+    ins->bb = after->bb;
+    ins->prev = after;
+    ins->next = after->next;
+    if (after->next) {
+        after->next->prev = ins;
+    } else {
+        after->bb->asm_last = ins;
+    }
+    after->next = ins;
+    return ins;
+}
+
+
+// ---- Operands --------------------------------------------------------------
+
+static AsmOpr * discharge(Assembler *a, IrIns *ir);
+
+static AsmOpr * opr_new(int k) {
+    AsmOpr *opr = arena_alloc(ARENA_ASM, sizeof(AsmOpr));
+    opr->k = k;
+    return opr;
+}
+
+static AsmOpr * opr_imm(uint64_t imm) {
+    AsmOpr *opr = opr_new(OPR_IMM);
+    opr->imm = imm;
+    return opr;
+}
+
+static int is_fp_zero(IrIns *ir) {
+    return ir->op == IR_FP && fp_bits(ir) == 0;
+}
+
+static AsmOpr * opr_fp(IrIns *ir) {
+    AsmOpr *opr = opr_new(ir->t->k == IRT_F32 ? OPR_F32 : OPR_F64);
+    opr->fp = fp_bits(ir);
+    return opr;
+}
+
+static AsmOpr * opr_gpr(int reg, int size) {
+    AsmOpr *opr = opr_new(OPR_GPR);
+    opr->reg = reg;
+    opr->size = size;
+    return opr;
+}
+
+// i8s and i16s live in w registers too, with their upper bits undefined
+static AsmOpr * opr_gpr_t(int reg, IrType *t) {
+    switch (t->k) {
+        case IRT_I8: case IRT_I16: case IRT_I32: return opr_gpr(reg, R32);
+        case IRT_I64: case IRT_PTR: case IRT_ARR: case IRT_STRUCT: return opr_gpr(reg, R64);
+        default: UNREACHABLE();
+    }
+    return NULL;
+}
+
+// An 's' (R32) or 'd' (R64) register
+static AsmOpr * opr_fpr(int reg, int size) {
+    AsmOpr *opr = opr_new(OPR_XMM);
+    opr->reg = reg;
+    opr->size = size;
+    return opr;
+}
+
+static int is_fpr(IrType *t) {
+    return t->k == IRT_F32 || t->k == IRT_F64;
+}
+
+static int fpr_size(IrType *t) {
+    return t->k == IRT_F32 ? R32 : R64;
+}
+
+static AsmOpr * opr_bb(BB *bb) {
+    AsmOpr *opr = opr_new(OPR_BB);
+    opr->bb = bb;
+    return opr;
+}
+
+static AsmOpr * opr_bb_addr(BB *bb) {
+    AsmOpr *opr = opr_new(OPR_BB_ADDR);
+    opr->bb = bb;
+    return opr;
+}
+
+static AsmOpr * opr_label(char *label) {
+    AsmOpr *opr = opr_new(OPR_LABEL);
+    opr->label = label;
+    return opr;
+}
+
+static AsmOpr * opr_table(size_t idx) {
+    AsmOpr *opr = opr_new(OPR_TABLE);
+    opr->table = idx;
+    return opr;
+}
+
+static AsmOpr * opr_deref(char *label) {
+    AsmOpr *opr = opr_new(OPR_DEREF);
+    opr->label = label;
+    return opr;
+}
+
+static AsmOpr * opr_got(char *label) {
+    AsmOpr *got = opr_new(OPR_GOTPCREL);
+    got->label = label;
+    got->bytes = 8;
+    return got;
+}
+
+static AsmOpr * opr_mem_reg(int reg) {
+    AsmOpr *mem = opr_new(OPR_MEM); // [<reg>]
+    mem->base = reg;
+    mem->base_size = R64;
+    mem->scale = 1;
+    return mem;
+}
+
+// Stack slots are below x29; arguments passed on the stack are above it (past
+// the saved x29 and x30)
+static AsmOpr * opr_frame(int64_t disp, size_t bytes) {
+    AsmOpr *mem = opr_mem_reg(X29); // [x29 + <disp>]
+    mem->disp = disp;
+    mem->frame = FRAME_TOP;
+    mem->bytes = bytes;
+    return mem;
+}
+
+// 'disp' bytes into an IR_ALLOC's stack slot; an over-aligned one's is off sp
+// (see 'realign_frame')
+static AsmOpr * opr_alloc(IrIns *alloc, int64_t disp) {
+    if (!is_overaligned(alloc->alloc_t)) {
+        return opr_frame(disp - (int64_t) alloc->stack_slot, 0); // [x29 - <stack slot>]
+    }
+    AsmOpr *mem = opr_mem_reg(XSP); // [sp + <out args> + <slot>]
+    mem->disp = (int64_t) alloc->stack_slot + disp;
+    mem->frame = FRAME_ALIGNED;
+    return mem;
+}
+
+static AsmOpr * next_vreg(Assembler *a, IrType *t) {
+    STATS[STAT_VREGS]++;
+    if (is_fpr(t)) {
+        return opr_fpr(a->next_fpr++, fpr_size(t));
+    } else {
+        return opr_gpr_t(a->next_gpr++, t);
+    }
+}
+
+static AsmOpr * next_ptr_vreg(Assembler *a) {
+    STATS[STAT_VREGS]++;
+    return opr_gpr(a->next_gpr++, R64);
+}
+
+// A move between two registers (or of a constant) of type 't'
+static AsmIns * mov_ins(AsmOpr *dst, AsmOpr *src) {
+    return asm2(dst->k == OPR_XMM ? A64_FMOV : A64_MOV, dst, src);
+}
+
+// Thread-locals are off the thread pointer in 'tpidr_el0', at an offset that's
+// fixed at link time if they're defined in this file ('TLS_LOCAL_EXEC'), and
+// otherwise loaded from the GOT
+static void emit_tls_addr(Assembler *a, AsmOpr *dst, Global *g) {
+    AsmOpr *tp = opr_new(OPR_TPOFF);
+    if (TLS_LOCAL_EXEC && g->k != G_NONE) {
+        tp->label = g->label;
+        emit(a, asm2(A64_LEA, dst, tp)); // mrs; add :tprel_hi12:; add :tprel_lo12_nc:
+        return;
+    }
+    AsmOpr *got = opr_new(OPR_GOTTPOFF);
+    got->label = g->label;
+    got->bytes = 8;
+    AsmOpr *off = next_ptr_vreg(a), *base = next_ptr_vreg(a);
+    emit(a, asm2(A64_LDR, off, got));  // adrp; ldr :gottprel_lo12:
+    emit(a, asm2(A64_LEA, base, tp));  // mrs <base>, tpidr_el0
+    emit(a, asm3(A64_ADD, dst, base, off));
+}
+
+// A preemptible global's address is loaded from the GOT; anything else's is
+// worked out relative to the pc with 'adrp' and 'add'
+static void emit_global_addr(Assembler *a, AsmOpr *dst, Global *g) {
+    if (g->is_tls) {
+        emit_tls_addr(a, dst, g);
+    } else if (is_preemptible(g)) {
+        emit(a, asm2(A64_LDR, dst, opr_got(g->label))); // adrp; ldr :got_lo12:
+    } else {
+        emit(a, asm2(A64_LEA, dst, opr_deref(g->label))); // adrp; add :lo12:
+    }
+}
+
+// A PTRADD that's folded into its loads and stores (see 'mark_addr_folds') is
+// '[base, #disp]' or '[base, idx]'; the encoder works out how to reach any
+// displacement
+static AsmOpr * opr_mem_from_ptradd(Assembler *a, IrIns *ptradd) {
+    IrIns *base = ptradd->base, *off = ptradd->offset;
+    int64_t disp = off->op == IR_IMM ? (int64_t) off->imm : 0;
+    AsmOpr *mem;
+    if (base->op == IR_ALLOC && !is_dyn_alloc(a->fn, base)) {
+        mem = opr_alloc(base, disp);
+    } else {
+        AsmOpr *reg = discharge(a, base);
+        assert(reg->k == OPR_GPR && reg->size == R64);
+        mem = opr_mem_reg(reg->reg);
+        mem->disp = disp;
+    }
+    if (off->op != IR_IMM) {
+        AsmOpr *idx = discharge(a, off);
+        assert(idx->k == OPR_GPR && idx->size == R64);
+        mem->idx = idx->reg;
+        mem->idx_size = R64;
+    }
+    return mem;
+}
+
+// Memory at 'ptr', accessing 'to_load' (or NULL if it's not accessed)
+static AsmOpr * load_ptr(Assembler *a, IrIns *ptr, IrType *to_load) {
+    assert(ptr->t->k == IRT_PTR);
+    AsmOpr *mem;
+    if (ptr->op == IR_ALLOC && !is_dyn_alloc(a->fn, ptr)) {
+        mem = opr_alloc(ptr, 0);
+    } else if (ptr->op == IR_PTRADD && ptr->fold > 0) {
+        mem = opr_mem_from_ptradd(a, ptr);
+    } else {
+        AsmOpr *reg = discharge(a, ptr);
+        assert(reg->k == OPR_GPR && reg->size == R64);
+        mem = opr_mem_reg(reg->reg);
+    }
+    if (to_load) {
+        assert(to_load->size <= 8);
+        mem->bytes = to_load->size;
+    }
+    return mem;
+}
+
+// Atomic instructions only take an address in a register
+static AsmOpr * atomic_mem(Assembler *a, IrIns *ptr, IrType *t) {
+    AsmOpr *mem = opr_mem_reg(discharge(a, ptr)->reg);
+    mem->bytes = t->size;
+    return mem;
+}
+
+
+// ---- Operand Discharge -----------------------------------------------------
+
+// Integer conditions by comparison; floating point ones are false if either
+// side is a NaN (e.g., 'mi' rather than 'lt' for IR_FLT)
+static int COND[IR_LAST] = {
+    [IR_EQ] = COND_EQ, [IR_NEQ] = COND_NE,
+    [IR_SLT] = COND_LT, [IR_SLE] = COND_LE, [IR_SGT] = COND_GT, [IR_SGE] = COND_GE,
+    [IR_ULT] = COND_LO, [IR_ULE] = COND_LS, [IR_UGT] = COND_HI, [IR_UGE] = COND_HS,
+    [IR_FLT] = COND_MI, [IR_FLE] = COND_LS, [IR_FGT] = COND_GT, [IR_FGE] = COND_GE,
+};
+
+static void asm_cmp(Assembler *a, IrIns *ir);
+
+// Emit assembly to put the result of an instruction into a vreg
+static AsmOpr * discharge(Assembler *a, IrIns *ir) {
+    // Always re-materialise constants and the address of an IR_ALLOC in a
+    // stack slot, rather than reusing a vreg that might not be defined on
+    // every path to this use
+    int remat = ir->op == IR_IMM || ir->op == IR_FP || ir->op == IR_GLOBAL ||
+                ir->op == IR_BB_ADDR || (ir->op == IR_ALLOC && !is_dyn_alloc(a->fn, ir));
+    if (!remat && ir->vreg != R_NONE) { // Already in a vreg
+        return is_fpr(ir->t) ? opr_fpr(ir->vreg, fpr_size(ir->t)) : opr_gpr_t(ir->vreg, ir->t);
+    }
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    switch (ir->op) {
+    case IR_IMM: emit(a, asm2(A64_MOV, dst, opr_imm(ir->imm))); break;
+    case IR_FP:  emit(a, asm2(A64_FMOV, dst, is_fp_zero(ir) ? opr_imm(0) : opr_fp(ir))); break;
+    case IR_GLOBAL: emit_global_addr(a, dst, ir->g); break;
+    case IR_BB_ADDR: emit(a, asm2(A64_LEA, dst, opr_bb_addr(ir->label_bb))); break;
+    case IR_LOAD: emit(a, asm2(A64_LDR, dst, load_ptr(a, ir->src, ir->t))); break;
+    case IR_ALLOC: emit(a, asm2(A64_LEA, dst, opr_alloc(ir, 0))); break;
+    case IR_EQ:  case IR_NEQ:
+    case IR_SLT: case IR_SLE: case IR_SGT: case IR_SGE:
+    case IR_ULT: case IR_ULE: case IR_UGT: case IR_UGE:
+    case IR_FLT: case IR_FLE: case IR_FGT: case IR_FGE:
+        asm_cmp(a, ir);
+        emit(a, asm1(A64_CSET + COND[ir->op], opr_gpr(dst->reg, R32)));
+        break;
+    default: UNREACHABLE();
+    }
+    return dst;
+}
+
+// A zero can be the zero register, wherever a register's read
+static AsmOpr * inline_zero(Assembler *a, IrIns *ir) {
+    if ((ir->op == IR_IMM && ir->imm == 0) || is_fp_zero(ir)) {
+        return opr_imm(0);
+    }
+    return discharge(a, ir);
+}
+
+// Arithmetic takes a 12-bit immediate (or a bitmask, for 'and', 'orr', and
+// 'eor'), which the encoder checks; any other constant goes through x16
+static AsmOpr * inline_imm(Assembler *a, IrIns *ir) {
+    if (ir->op == IR_IMM) {
+        return opr_imm(ir->imm);
+    }
+    return discharge(a, ir);
+}
+
+// An i8 or i16 in a w register, with its upper bits set by extending it
+static AsmOpr * extend_small(Assembler *a, AsmOpr *opr, IrType *t, int is_signed) {
+    if (t->size >= 4) {
+        return opr;
+    }
+    int op = t->size == 1 ? (is_signed ? A64_SXTB : A64_UXTB) : (is_signed ? A64_SXTH : A64_UXTH);
+    AsmOpr *ext = next_vreg(a, irt_scalar(IRT_I32));
+    emit(a, asm2(op, ext, opr));
+    return ext;
+}
+
+// The value of an i8 or i16 constant, as it is once extended
+static uint64_t extend_imm(uint64_t imm, size_t size, int is_signed) {
+    if (size >= 8) {
+        return imm;
+    }
+    int shift = 64 - (int) size * 8;
+    return is_signed ? (uint64_t) ((int64_t) (imm << shift) >> shift) : (imm << shift) >> shift;
+}
+
+
+// ---- Block Moves -----------------------------------------------------------
+
+// Copies and zeroing of blocks of memory are unrolled into 8, 4, 2, and 1-byte
+// moves through a GPR up to this many bytes; anything bigger, or of unknown
+// size, calls 'memcpy' or 'memset' (as GCC does on AArch64)
+#define MAX_UNROLLED_MOVE 128
+
+static AsmOpr * opr_offset(AsmOpr *mem, size_t offset, size_t bytes) {
+    AsmOpr *part = opr_new(OPR_MEM);
+    *part = *mem;
+    part->disp += (int64_t) offset;
+    part->bytes = bytes;
+    return part;
+}
+
+// Memory at a pointer, or at an aggregate value, that can be offset into
+static AsmOpr * agg_mem(Assembler *a, IrIns *agg) {
+    if (agg->t->k == IRT_PTR && agg->op != IR_GLOBAL) {
+        return load_ptr(a, agg, NULL);
+    }
+    AsmOpr *ptr = discharge(a, agg);
+    assert(ptr->k == OPR_GPR && ptr->size == R64);
+    return opr_mem_reg(ptr->reg);
+}
+
+// The address of a memory operand, in a register
+static AsmOpr * mem_addr(Assembler *a, AsmOpr *mem) {
+    if (mem->frame == 0 && mem->idx == R_NONE && mem->disp == 0) {
+        return opr_gpr(mem->base, R64);
+    }
+    AsmOpr *addr = next_ptr_vreg(a);
+    AsmOpr *src = opr_offset(mem, 0, 0);
+    emit(a, asm2(A64_LEA, addr, src));
+    return addr;
+}
+
+// Calls 'memcpy(dst, src, len)', or 'memset(dst, 0, len)' if 'src' is NULL.
+// Everything's in a vreg before any of the argument registers are set
+static void emit_mem_call(Assembler *a, AsmOpr *dst, AsmOpr *src, AsmOpr *len) {
+    AsmOpr *d = mem_addr(a, dst);
+    AsmOpr *s = src ? mem_addr(a, src) : NULL;
+    emit(a, asm2(A64_MOV, opr_gpr(X0, R64), d));
+    emit(a, asm2(A64_MOV, opr_gpr(X1, R64), s ? s : opr_imm(0)));
+    emit(a, asm2(A64_MOV, opr_gpr(X2, R64), len));
+    char *fn = prepend_underscore(src ? "memcpy" : "memset");
+    emit(a, asm1(A64_BL, opr_label(fn)));
+}
+
+static size_t piece_size(size_t left) {
+    size_t bytes = 8;
+    while (bytes > left) {
+        bytes /= 2;
+    }
+    return bytes;
+}
+
+static void emit_copy(Assembler *a, AsmOpr *dst, AsmOpr *src, size_t size) {
+    if (size > MAX_UNROLLED_MOVE) {
+        emit_mem_call(a, dst, src, opr_imm(size));
+        return;
+    }
+    AsmOpr *tmp = NULL;
+    for (size_t offset = 0; offset < size;) {
+        size_t bytes = piece_size(size - offset);
+        if (!tmp) {
+            tmp = next_ptr_vreg(a);
+        }
+        AsmOpr *r = opr_gpr(tmp->reg, bytes == 8 ? R64 : R32);
+        emit(a, asm2(A64_LDR, r, opr_offset(src, offset, bytes)));
+        emit(a, asm2(A64_STR, opr_offset(dst, offset, bytes), r));
+        offset += bytes;
+    }
+}
+
+static void emit_zero(Assembler *a, AsmOpr *dst, size_t size) {
+    if (size > MAX_UNROLLED_MOVE) {
+        emit_mem_call(a, dst, NULL, opr_imm(size));
+        return;
+    }
+    for (size_t offset = 0; offset < size;) {
+        size_t bytes = piece_size(size - offset);
+        emit(a, asm2(A64_STR, opr_offset(dst, offset, bytes), opr_imm(0))); // str xzr
+        offset += bytes;
+    }
+}
+
+static void asm_copy(Assembler *a, IrIns *ir) {
+    AsmOpr *dst = agg_mem(a, ir->dst);
+    AsmOpr *src = agg_mem(a, ir->src);
+    if (ir->len->op == IR_IMM) {
+        emit_copy(a, dst, src, ir->len->imm);
+    } else {
+        emit_mem_call(a, dst, src, discharge(a, ir->len));
+    }
+}
+
+static void asm_zero(Assembler *a, IrIns *ir) {
+    AsmOpr *dst = agg_mem(a, ir->ptr);
+    if (ir->size->op == IR_IMM) {
+        emit_zero(a, dst, ir->size->imm);
+    } else {
+        emit_mem_call(a, dst, NULL, discharge(a, ir->size));
+    }
+}
+
+
+// ---- Calling Convention ----------------------------------------------------
+
+// Arguments and return values are passed as AAPCS64 lays out. Integers and
+// pointers go in x0-x7, and floats in v0-v7. An aggregate (a pointer to its
+// contents in the IR) of 1 to 4 floats or doubles of the same type (a
+// 'homogeneous floating point aggregate') goes in consecutive v registers,
+// one member each; any other aggregate of up to 16 bytes goes in 1 or 2 x
+// registers; and bigger ones are copied by the caller, which passes a pointer
+// to the copy instead. Anything that doesn't fit in the registers left goes
+// on the stack, in 8 byte units. An aggregate that's returned in memory goes
+// where x8 points
+
+#define GPR_ARGS (TARGET->gpr_args)
+#define FPR_ARGS (TARGET->fpr_args)
+
+typedef struct {
+    int num_regs;     // 0 if passed on the stack
+    int regs[4];
+    int is_fpr;       // In v registers
+    size_t stride;    // Bytes of the value in each register
+    int by_ref;       // Passed as a pointer to a copy
+    size_t stack_off; // From the first argument on the stack
+} ArgLoc;
+
+typedef struct {
+    int num_gprs, num_fprs; // Used so far
+    size_t stack_size;      // Of the arguments on the stack so far
+} ArgState;
+
+// Counts the floating point members of 't', which all have to be 'elem'
+static int count_hfa_members(IrType *t, IrType **elem) {
+    switch (t->k) {
+    case IRT_F32: case IRT_F64:
+        if (*elem && *elem != t) {
+            return -1;
+        }
+        *elem = t;
+        return 1;
+    case IRT_ARR: {
+        int n = count_hfa_members(t->elem, elem);
+        return n < 0 || t->len > 4 ? -1 : n * (int) t->len;
+    }
+    case IRT_STRUCT: {
+        int n = 0;
+        for (size_t i = 0; i < vec_len(t->fields) && n >= 0 && n <= 4; i++) {
+            IrField *f = vec_get(t->fields, i);
+            int m = count_hfa_members(f->t, elem);
+            n = m < 0 ? -1 : n + m;
+        }
+        return n;
+    }
+    default:
+        return -1;
+    }
+}
+
+// The number of members if 't' is a homogeneous floating point aggregate (a
+// float or double on its own counts too), otherwise 0
+static int hfa_members(IrType *t, IrType **elem) {
+    *elem = NULL;
+    if (is_fpr(t)) {
+        *elem = t;
+        return 1;
+    } else if (t->k != IRT_STRUCT) {
+        return 0;
+    }
+    int n = count_hfa_members(t, elem);
+    return n >= 1 && n <= 4 && n * (*elem)->size == t->size ? n : 0;
+}
+
+static ArgLoc place_arg(ArgState *s, IrType *t) {
+    ArgLoc loc = {0};
+    IrType *elem;
+    int n = hfa_members(t, &elem);
+    size_t size = t->size, align = t->align;
+    if (n > 0) {
+        if (s->num_fprs + n <= TARGET->num_fpr_args) {
+            loc.num_regs = n;
+            loc.is_fpr = 1;
+            loc.stride = elem->size;
+            for (int i = 0; i < n; i++) {
+                loc.regs[i] = FPR_ARGS[s->num_fprs++];
+            }
+            return loc;
+        }
+        s->num_fprs = TARGET->num_fpr_args;
+    } else {
+        if (t->k == IRT_STRUCT && t->size > 16) {
+            loc.by_ref = 1;
+            size = align = 8;
+        }
+        n = size > 8 ? 2 : 1;
+        if (n == 2 && align == 16) {
+            s->num_gprs += s->num_gprs & 1; // Starts at an even register
+        }
+        if (s->num_gprs + n <= TARGET->num_gpr_args) {
+            loc.num_regs = n;
+            loc.stride = 8;
+            for (int i = 0; i < n; i++) {
+                loc.regs[i] = GPR_ARGS[s->num_gprs++];
+            }
+            return loc;
+        }
+        s->num_gprs = TARGET->num_gpr_args;
+    }
+    s->stack_size += pad(s->stack_size, align > 8 ? align : 8);
+    loc.stack_off = s->stack_size;
+    s->stack_size += size + pad(size, 8);
+    return loc;
+}
+
+// Aggregates bigger than 16 bytes (that aren't homogeneous floating point
+// aggregates) are returned in memory, at the address the caller passes in x8
+static ArgLoc place_ret(IrType *t) {
+    ArgLoc loc = {0};
+    IrType *elem;
+    int n = hfa_members(t, &elem);
+    if (n > 0) {
+        loc.num_regs = n;
+        loc.is_fpr = 1;
+        loc.stride = elem->size;
+        for (int i = 0; i < n; i++) {
+            loc.regs[i] = FPR_ARGS[i];
+        }
+    } else if (t->size <= 16) {
+        loc.num_regs = t->size > 8 ? 2 : 1;
+        loc.stride = 8;
+        for (int i = 0; i < loc.num_regs; i++) {
+            loc.regs[i] = TARGET->gpr_rets[i];
+        }
+    }
+    return loc;
+}
+
+static int returns_in_mem(IrType *t) {
+    return t->k == IRT_STRUCT && place_ret(t).num_regs == 0;
+}
+
+static ArgLoc param_loc(Fn *fn, size_t idx) {
+    ArgState s = {0}; // The pointer for a return in memory is in x8
+    ArgLoc loc;
+    for (size_t i = 0; i <= idx; i++) {
+        loc = place_arg(&s, vec_get(fn->params, i));
+    }
+    return loc;
+}
+
+// Arguments passed on the stack are stored at the bottom of our stack frame
+// just before the call, so they're at the top of the callee's
+static AsmOpr * opr_out_arg(size_t offset, size_t bytes) {
+    AsmOpr *mem = opr_mem_reg(XSP); // [sp + <offset>]
+    mem->disp = (int64_t) offset;
+    mem->bytes = bytes;
+    return mem;
+}
+
+// Arguments passed to us on the stack are above the saved x29 and x30
+static AsmOpr * opr_in_arg(size_t offset, size_t bytes) {
+    return opr_frame(16 + (int64_t) offset, bytes);
+}
+
+// A stack slot big enough to hold every register of an aggregate in full
+static AsmOpr * agg_slot(Assembler *a, IrType *t) {
+    size_t slot = alloc_stack_slot(a->fn, t->size + pad(t->size, 8),
+                                   t->align > 8 ? t->align : 8);
+    return opr_frame(-((int64_t) slot), 0);
+}
+
+// Loading the last x register of an aggregate in one go would read past its
+// end if it isn't 1, 2, 4, or 8 bytes, so it's copied to a stack slot first
+static AsmOpr * loadable_agg(Assembler *a, AsmOpr *mem, IrType *t) {
+    size_t rest = t->size % 8;
+    if (rest == 3 || rest > 4) {
+        AsmOpr *slot = agg_slot(a, t);
+        emit_copy(a, slot, mem, t->size);
+        return slot;
+    }
+    return mem;
+}
+
+static void load_parts(Assembler *a, ArgLoc *loc, AsmOpr *mem, IrType *t) {
+    for (int i = 0; i < loc->num_regs; i++) {
+        size_t offset = (size_t) i * loc->stride;
+        if (loc->is_fpr) {
+            AsmOpr *dst = opr_fpr(loc->regs[i], loc->stride == 4 ? R32 : R64);
+            emit(a, asm2(A64_LDR, dst, opr_offset(mem, offset, loc->stride)));
+            continue;
+        }
+        size_t bytes = t->size - offset;
+        if (bytes >= 8 || bytes == 3 || bytes > 4) {
+            bytes = 8; // See 'loadable_agg'
+        }
+        AsmOpr *dst = opr_gpr(loc->regs[i], bytes == 8 ? R64 : R32);
+        emit(a, asm2(A64_LDR, dst, opr_offset(mem, offset, bytes)));
+    }
+}
+
+static void store_parts(Assembler *a, ArgLoc *loc, AsmOpr *mem) {
+    for (int i = 0; i < loc->num_regs; i++) {
+        AsmOpr *dst = opr_offset(mem, (size_t) i * loc->stride, loc->stride);
+        AsmOpr *src = loc->is_fpr ? opr_fpr(loc->regs[i], loc->stride == 4 ? R32 : R64) :
+                                    opr_gpr(loc->regs[i], R64);
+        emit(a, asm2(A64_STR, dst, src));
+    }
+}
+
+static void asm_farg(Assembler *a, IrIns *ir) {
+    ArgLoc loc = param_loc(a->fn, ir->arg_idx);
+    AsmOpr *dst = next_vreg(a, ir->t); // vreg for the result
+    ir->vreg = dst->reg;
+    if (ir->t->k == IRT_STRUCT) { // Point to the aggregate
+        if (loc.by_ref && loc.num_regs == 0) {
+            emit(a, asm2(A64_LDR, dst, opr_in_arg(loc.stack_off, 8)));
+        } else if (loc.by_ref) {
+            emit(a, asm2(A64_MOV, dst, opr_gpr(loc.regs[0], R64)));
+        } else if (loc.num_regs == 0) {
+            emit(a, asm2(A64_LEA, dst, opr_in_arg(loc.stack_off, 0)));
+        } else {
+            AsmOpr *agg = agg_slot(a, ir->t);
+            store_parts(a, &loc, agg);
+            emit(a, asm2(A64_LEA, dst, agg));
+        }
+        return;
+    }
+    AsmOpr *src;
+    if (loc.num_regs == 0) {
+        src = opr_in_arg(loc.stack_off, ir->t->size);
+        emit(a, asm2(A64_LDR, dst, src));
+        return;
+    } else if (is_fpr(ir->t)) {
+        src = opr_fpr(loc.regs[0], fpr_size(ir->t));
+    } else {
+        src = opr_gpr_t(loc.regs[0], ir->t);
+    }
+    emit(a, mov_ins(dst, src));
+}
+
+
+// ---- Constants and Memory Operations ---------------------------------------
+
+// Only records the constant for the file's constant pool (see 'fp_pool');
+// it's loaded wherever it's used, unless 'fmov' can take it as an immediate
+static void asm_fp(Assembler *a, IrIns *ir) {
+    if (is_fp_zero(ir)) {
+        return;
+    }
+    uint64_t *bits = malloc(sizeof(uint64_t));
+    *bits = fp_bits(ir);
+    vec_push(ir->t->k == IRT_F32 ? a->fn->f32s : a->fn->f64s, bits);
+}
+
+static void asm_store(Assembler *a, IrIns *ir) {
+    AsmOpr *src = inline_zero(a, ir->src); // 'str wzr'
+    emit(a, asm2(A64_STR, load_ptr(a, ir->dst, ir->src->t), src));
+}
+
+static void asm_ptradd(Assembler *a, IrIns *ir) {
+    if (ir->fold > 0) {
+        return; // Folded into every load and store that uses it
+    }
+    AsmOpr *l = discharge(a, ir->base);
+    AsmOpr *r = inline_imm(a, ir->offset);
+    if (r->k == OPR_IMM && r->imm == 0) {
+        ir->vreg = l->reg;
+        return; // Doesn't modify the pointer
+    }
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    emit(a, asm3(A64_ADD, dst, l, r));
+}
+
+// A VLA moves sp down by its size, rounded up to keep sp 16 byte aligned, and
+// starts above the arguments for calls (see 'dyn_frame'), as on x86-64
+static void asm_dyn_alloc(Assembler *a, IrIns *ir) {
+    IrType *t = ir->alloc_t;
+    size_t align = t->align > STACK_ALIGN ? t->align : STACK_ALIGN;
+    size_t extra = align - STACK_ALIGN; // To round the start up to 'align'
+    AsmOpr *sp = opr_gpr(XSP, R64);
+    if (ir->count) {
+        assert(ir->count->t->size == 8); // A 'size_t' (see 'compile_vla')
+        AsmOpr *size = discharge(a, ir->count);
+        if (t->size != 1) {
+            AsmOpr *scaled = next_ptr_vreg(a);
+            AsmOpr *elem = next_ptr_vreg(a);
+            emit(a, asm2(A64_MOV, elem, opr_imm(t->size)));
+            emit(a, asm3(A64_MUL, scaled, size, elem));
+            size = scaled;
+        }
+        AsmOpr *rounded = next_ptr_vreg(a);
+        emit(a, asm3(A64_ADD, rounded, size, opr_imm(STACK_ALIGN - 1 + extra)));
+        emit(a, asm3(A64_AND, rounded, rounded, opr_imm(-(uint64_t) STACK_ALIGN)));
+        emit(a, asm3(A64_SUB, sp, sp, rounded));
+    } else {
+        size_t size = t->size + pad(t->size, STACK_ALIGN) + extra;
+        emit(a, asm3(A64_SUB, sp, sp, opr_imm(size)));
+    }
+    AsmOpr *bottom = opr_mem_reg(XSP); // [sp + <out args>]
+    bottom->frame = FRAME_DYN;
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    emit(a, asm2(A64_LEA, dst, bottom));
+    if (extra > 0) {
+        emit(a, asm3(A64_ADD, dst, dst, opr_imm(align - 1)));
+        emit(a, asm3(A64_AND, dst, dst, opr_imm(-(uint64_t) align)));
+    }
+}
+
+
+// ---- Arithmetic ------------------------------------------------------------
+
+static int ARITH_OP[IR_LAST] = {
+    [IR_ADD] = A64_ADD, [IR_SUB] = A64_SUB, [IR_MUL] = A64_MUL,
+    [IR_BIT_AND] = A64_AND, [IR_BIT_OR] = A64_ORR, [IR_BIT_XOR] = A64_EOR,
+};
+
+static int FP_ARITH_OP[IR_LAST] = {
+    [IR_ADD] = A64_FADD, [IR_SUB] = A64_FSUB, [IR_MUL] = A64_FMUL, [IR_FDIV] = A64_FDIV,
+};
+
+static int is_commutative(int op) {
+    return op == IR_ADD || op == IR_MUL || op == IR_BIT_AND || op == IR_BIT_OR ||
+           op == IR_BIT_XOR;
+}
+
+// A constant on the left of a subtract is a register; zero is the zero
+// register (so '0 - x' is a 'neg'). 'mul' only takes registers
+static void asm_arith(Assembler *a, IrIns *ir) {
+    if (is_fpr(ir->t)) {
+        AsmOpr *l = discharge(a, ir->l);
+        AsmOpr *r = discharge(a, ir->r);
+        AsmOpr *dst = next_vreg(a, ir->t);
+        ir->vreg = dst->reg;
+        emit(a, asm3(FP_ARITH_OP[ir->op], dst, l, r));
+        return;
+    }
+    IrIns *l = ir->l, *r = ir->r;
+    if (is_commutative(ir->op) && l->op == IR_IMM && r->op != IR_IMM) {
+        l = ir->r;
+        r = ir->l;
+    }
+    AsmOpr *lo;
+    if (l->op == IR_IMM && l->imm == 0 && r->op != IR_IMM) {
+        lo = opr_gpr(XZR, ir->t->size == 8 ? R64 : R32);
+    } else {
+        lo = discharge(a, l);
+    }
+    AsmOpr *ro = ir->op == IR_MUL ? discharge(a, r) : inline_imm(a, r);
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    emit(a, asm3(ARITH_OP[ir->op], dst, lo, ro));
+}
+
+// 'sdiv' and 'udiv' don't give a remainder, so it's 'l - (l / r) * r'
+static void asm_div_mod(Assembler *a, IrIns *ir) {
+    int is_signed = ir->op == IR_SDIV || ir->op == IR_SMOD;
+    AsmOpr *l = extend_small(a, discharge(a, ir->l), ir->t, is_signed);
+    AsmOpr *r = extend_small(a, discharge(a, ir->r), ir->t, is_signed);
+    int op = is_signed ? A64_SDIV : A64_UDIV;
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    if (ir->op == IR_SDIV || ir->op == IR_UDIV) {
+        emit(a, asm3(op, dst, l, r));
+        return;
+    }
+    AsmOpr *q = next_vreg(a, ir->t), *prod = next_vreg(a, ir->t);
+    emit(a, asm3(op, q, l, r));
+    emit(a, asm3(A64_MUL, prod, q, r));
+    emit(a, asm3(A64_SUB, dst, l, prod));
+}
+
+// Shifts only look at the bottom 5 or 6 bits of the count, so those are all
+// that matter of an i8 or i16 count too; a right shift of an i8 or i16 needs
+// its upper bits set first
+static void asm_sh(Assembler *a, IrIns *ir) {
+    int op = ir->op == IR_SHL ? A64_LSL : (ir->op == IR_SAR ? A64_ASR : A64_LSR);
+    AsmOpr *l = discharge(a, ir->l);
+    if (op != A64_LSL) {
+        l = extend_small(a, l, ir->t, op == A64_ASR);
+    }
+    AsmOpr *r;
+    if (ir->r->op == IR_IMM) {
+        r = opr_imm(ir->r->imm & (l->size == R64 ? 63 : 31));
+    } else {
+        r = opr_gpr(discharge(a, ir->r)->reg, l->size);
+    }
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    emit(a, asm3(op, dst, l, r));
+}
+
+static void asm_bits(Assembler *a, IrIns *ir) {
+    AsmOpr *src = discharge(a, ir->l);
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    switch (ir->op) {
+    case IR_POPCNT: { // There's only a vector 'cnt', of each byte
+        src = extend_small(a, src, ir->l->t, 0);
+        AsmOpr *v = next_vreg(a, irt_scalar(IRT_F64));
+        emit(a, asm2(A64_FMOV, opr_fpr(v->reg, src->size), src));
+        emit(a, asm1(A64_CNT, v));
+        emit(a, asm2(A64_FMOV, dst, opr_fpr(v->reg, dst->size)));
+        break;
+    }
+    case IR_CTZ: {
+        AsmOpr *rev = next_vreg(a, ir->l->t);
+        emit(a, asm2(A64_RBIT, rev, src));
+        emit(a, asm2(A64_CLZ, dst, rev));
+        break;
+    }
+    case IR_CLZ:
+        if (ir->l->t->size < 4) {
+            AsmOpr *n = next_vreg(a, ir->t);
+            emit(a, asm2(A64_CLZ, n, extend_small(a, src, ir->l->t, 0)));
+            emit(a, asm3(A64_SUB, dst, n, opr_imm(32 - ir->l->t->size * 8)));
+        } else {
+            emit(a, asm2(A64_CLZ, dst, src));
+        }
+        break;
+    case IR_BSWAP:
+        emit(a, asm2(ir->t->size == 2 ? A64_REV16 : A64_REV, dst, src));
+        break;
+    default: UNREACHABLE();
+    }
+}
+
+
+// ---- Conversions -----------------------------------------------------------
+
+// Truncation reads the same register at the narrower size, so it's a 'mov' at
+// the source's size into a new vreg, which the coalescer removes; likewise
+// IR_ANYEXT, whose new bits don't matter
+static void asm_trunc(Assembler *a, IrIns *ir) {
+    AsmOpr *src = inline_imm(a, ir->l);
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    emit(a, asm2(A64_MOV, opr_gpr_t(dst->reg, ir->l->t), src));
+}
+
+static int SEXT_OP[] = { [1] = A64_SXTB, [2] = A64_SXTH, [4] = A64_SXTW, };
+static int ZEXT_OP[] = { [1] = A64_UXTB, [2] = A64_UXTH, [4] = A64_UXTW, };
+
+static void asm_ext(Assembler *a, IrIns *ir) {
+    size_t from = ir->l->t->size;
+    int is_signed = ir->op == IR_SEXT;
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    if (ir->l->op == IR_IMM) {
+        emit(a, asm2(A64_MOV, dst, opr_imm(extend_imm(ir->l->imm, from, is_signed))));
+    } else if (from == 8 || ir->op == IR_BITCAST) { // Same size
+        emit(a, asm2(A64_MOV, dst, discharge(a, ir->l)));
+    } else {
+        int op = is_signed ? SEXT_OP[from] : ZEXT_OP[from];
+        emit(a, asm2(op, dst, discharge(a, ir->l)));
+    }
+}
+
+static void asm_fp_conv(Assembler *a, IrIns *ir) {
+    AsmOpr *src = discharge(a, ir->l);
+    int op;
+    switch (ir->op) {
+    case IR_FTRUNC: case IR_FEXT: op = A64_FCVT; break;
+    case IR_FP2I: op = A64_FCVTZS; break;
+    case IR_I2FP:
+        op = A64_SCVTF;
+        src = extend_small(a, src, ir->l->t, 1);
+        break;
+    default: UNREACHABLE(); return;
+    }
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    emit(a, asm2(op, dst, src));
+}
+
+
+// ---- Control Flow ----------------------------------------------------------
+
+static int is_reg_opr(AsmOpr *opr) {
+    return opr->k == OPR_GPR || opr->k == OPR_XMM;
+}
+
+static int same_reg(AsmOpr *l, AsmOpr *r) {
+    return is_reg_opr(l) && l->k == r->k && l->reg == r->reg;
+}
+
+// Phis are lowered to a parallel copy at the end of each predecessor, as in
+// 'assemble.c'. Every source is a register or a constant, so there's nothing
+// to load before the copies start
+static AsmOpr * phi_dst(Assembler *a, IrIns *phi) {
+    if (!phi->bb->addr_taken) {
+        return discharge(a, phi);
+    }
+    int reg = a->phi_in[phi->n];
+    return is_fpr(phi->t) ? opr_fpr(reg, fpr_size(phi->t)) : opr_gpr_t(reg, phi->t);
+}
+
+static void asm_phi_copies(Assembler *a, BB *pred, BB *bb) {
+    size_t num_phis = 0;
+    for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+        num_phis += ins->op == IR_PHI;
+    }
+    if (num_phis == 0) {
+        return;
+    }
+    IrIns *phis[num_phis];
+    AsmOpr *dsts[num_phis], *srcs[num_phis];
+    size_t num_copies = 0;
+    for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+        if (ins->op != IR_PHI) {
+            continue;
+        }
+        size_t j = 0;
+        while (vec_get(ins->preds, j) != pred) {
+            j++;
+        }
+        IrIns *def = vec_get(ins->defs, j);
+        AsmOpr *dst = phi_dst(a, ins);
+        AsmOpr *src = is_fpr(ins->t) ? discharge(a, def) : inline_imm(a, def);
+        if (!same_reg(dst, src)) { // Skip 'a = phi(a, ...)'
+            phis[num_copies] = ins;
+            dsts[num_copies] = dst;
+            srcs[num_copies] = src;
+            num_copies++;
+        }
+    }
+
+    size_t num_left = num_copies;
+    int done[num_copies];
+    memset(done, 0, sizeof(done));
+    while (num_left > 0) {
+        int progress = 0;
+        for (size_t i = 0; i < num_copies; i++) { // Copies that block nothing
+            if (done[i] || !is_reg_opr(srcs[i])) {
+                continue;
+            }
+            int blocks = 0;
+            for (size_t j = 0; j < num_copies && !blocks; j++) {
+                blocks = !done[j] && j != i && same_reg(srcs[j], dsts[i]);
+            }
+            if (!blocks) {
+                emit(a, mov_ins(dsts[i], srcs[i]));
+                done[i] = 1;
+                num_left--;
+                progress = 1;
+            }
+        }
+        if (progress) {
+            continue;
+        }
+        size_t i = 0; // Only cycles (and constants) are left
+        while (i < num_copies && (done[i] || !is_reg_opr(srcs[i]))) {
+            i++;
+        }
+        if (i == num_copies) {
+            break;
+        }
+        AsmOpr *tmp = next_vreg(a, phis[i]->t);
+        emit(a, mov_ins(tmp, dsts[i]));
+        for (size_t j = 0; j < num_copies; j++) {
+            if (!done[j] && same_reg(srcs[j], dsts[i])) {
+                srcs[j] = tmp;
+            }
+        }
+    }
+    for (size_t i = 0; i < num_copies; i++) {
+        if (!done[i]) {
+            emit(a, mov_ins(dsts[i], srcs[i]));
+        }
+    }
+}
+
+static void asm_br(Assembler *a, IrIns *ir) {
+    asm_phi_copies(a, ir->bb, ir->br);
+    if (ir->br == ir->bb->next) {
+        return; // Don't emit anything for a branch to next BB
+    }
+    emit(a, asm1(A64_B, opr_bb(ir->br)));
+}
+
+// The jump table holds the offset of each BB from the start of the table, as
+// on x86-64:
+//   cmp <idx>, #<len - 1>
+//   b.hi <default>
+//   adr <table>, <fn>.T<n>
+//   ldr <entry>, [<table>, <idx>, lsl #3]
+//   add <target>, <table>, <entry>
+//   br <target>
+static void asm_switch(Assembler *a, IrIns *ir) {
+    AsmOpr *idx = discharge(a, ir->idx);
+    assert(idx->k == OPR_GPR && idx->size == R64);
+    if (!ir->in_range) {
+        emit(a, asm2(A64_CMP, idx, opr_imm(vec_len(ir->table) - 1)));
+        emit(a, asm1(A64_B_COND + COND_HI, opr_bb(ir->default_br)));
+    }
+    AsmOpr *table = next_ptr_vreg(a);
+    emit(a, asm2(A64_LEA, table, opr_table(vec_len(a->fn->jump_tables))));
+    vec_push(a->fn->jump_tables, ir->table);
+    AsmOpr *entry = opr_mem_reg(table->reg); // [<table>, <idx>, lsl #3]
+    entry->idx = idx->reg;
+    entry->idx_size = R64;
+    entry->scale = 8;
+    entry->bytes = 8;
+    AsmOpr *offset = next_ptr_vreg(a), *target = next_ptr_vreg(a);
+    emit(a, asm2(A64_LDR, offset, entry));
+    emit(a, asm3(A64_ADD, target, table, offset));
+    emit(a, asm1(A64_BR, target));
+}
+
+// 'goto *' jumps to the address in a vreg, after the copies for every target's
+// phis (see 'phi_dst' in 'assemble.c')
+static void asm_indirect_br(Assembler *a, IrIns *ir) {
+    AsmOpr *dest = discharge(a, ir->dest);
+    for (size_t i = 0; i < vec_len(ir->targets); i++) {
+        asm_phi_copies(a, ir->bb, vec_get(ir->targets, i));
+    }
+    emit(a, asm1(A64_BR, dest));
+}
+
+static void asm_phi(Assembler *a, IrIns *ir) {
+    if (ir->bb->addr_taken) {
+        emit(a, mov_ins(discharge(a, ir), phi_dst(a, ir)));
+    }
+}
+
+// Sets the flags for the comparison 'ir'. An i8 or i16 is extended first (by
+// its sign for a signed comparison), and a constant is extended to match;
+// 'cmp' takes a 12-bit immediate (or its negation, as a 'cmn'), and 'fcmp'
+// only takes zero
+static void asm_cmp(Assembler *a, IrIns *ir) {
+    IrType *t = ir->l->t;
+    if (is_fpr(t)) {
+        AsmOpr *l = discharge(a, ir->l);
+        AsmOpr *r = is_fp_zero(ir->r) ? opr_imm(0) : discharge(a, ir->r);
+        emit(a, asm2(A64_FCMP, l, r));
+        return;
+    }
+    int is_signed = ir->op >= IR_SLT && ir->op <= IR_SGE;
+    AsmOpr *l = extend_small(a, discharge(a, ir->l), t, is_signed);
+    AsmOpr *r;
+    if (ir->r->op == IR_IMM) {
+        r = opr_imm(extend_imm(ir->r->imm, t->size, is_signed));
+    } else {
+        r = extend_small(a, discharge(a, ir->r), t, is_signed);
+    }
+    emit(a, asm2(A64_CMP, l, r));
+}
+
+static void asm_condbr(Assembler *a, IrIns *ir) {
+    int negated;
+    IrIns *cond = fuse_cond(ir->cond, &negated);
+    assert(is_cmp(cond));
+    BB *on_true = negated ? ir->false : ir->true;
+    BB *on_false = negated ? ir->true : ir->false;
+    asm_cmp(a, cond);
+    int c = COND[cond->op];
+    if (on_true == ir->bb->next) { // True case falls through
+        emit(a, asm1(A64_B_COND + (c ^ 1), opr_bb(on_false)));
+    } else {
+        emit(a, asm1(A64_B_COND + c, opr_bb(on_true)));
+        if (on_false != ir->bb->next) { // Neither case falls through
+            emit(a, asm1(A64_B, opr_bb(on_false)));
+        }
+    }
+}
+
+// 'csel' (or 'fcsel') picks between two registers on the comparison's flags,
+// which is re-emitted if it's only used by branches and selects (see
+// 'mark_branch_conds'), or otherwise tests the boolean
+static void asm_select(Assembler *a, IrIns *ir) {
+    IrIns *sel = ir->sel;
+    AsmOpr *t = discharge(a, ir->l);
+    AsmOpr *f = discharge(a, ir->r);
+    int c;
+    if (is_cmp(sel) && sel->fold > 0) {
+        int negated;
+        IrIns *cmp = fuse_cond(sel, &negated);
+        asm_cmp(a, cmp);
+        c = COND[cmp->op] ^ negated;
+    } else {
+        emit(a, asm2(A64_CMP, discharge(a, sel), opr_imm(0)));
+        c = COND_NE;
+    }
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    emit(a, asm3((is_fpr(ir->t) ? A64_FCSEL : A64_CSEL) + c, dst, t, f));
+}
+
+static IrIns * after_cargs(IrIns *call) {
+    IrIns *ins = call->next;
+    while (ins && ins->op == IR_CARG) {
+        ins = ins->next;
+    }
+    return ins;
+}
+
+// As on x86-64 (see 'is_tail_call' in 'assemble.c'), a call followed by a
+// return of its result is a branch that reuses our stack frame, if the callee
+// can't be handed a pointer into it: every argument has to be in registers,
+// and none of them can be a copy made by us
+static int is_tail_call(Assembler *a, IrIns *call) {
+    IrIns *ret = after_cargs(call);
+    if (a->has_allocs || a->fn->instrument || !ret || ret->op != IR_RET ||
+            (ret->ret && ret->ret != call) || call->t->k == IRT_STRUCT) {
+        return 0;
+    }
+    ArgState s = {0};
+    for (IrIns *ins = call->next; ins && ins->op == IR_CARG; ins = ins->next) {
+        if (place_arg(&s, ins->t).by_ref) {
+            return 0;
+        }
+    }
+    return s.stack_size == 0;
+}
+
+// A call to a global goes straight to its label (through a PLT stub if the
+// linker decides it needs one), or with '-fno-plt', through its GOT entry if
+// it might be in another module
+static AsmOpr * call_target(Assembler *a, IrIns *fn) {
+    if (fn->op == IR_GLOBAL && !fn->g->is_tls) {
+        Global *g = fn->g;
+        int via_got = !PLT && g->linkage != LINK_STATIC && !is_hidden(g) &&
+                      (g->k == G_NONE || is_preemptible(g));
+        return via_got ? opr_got(g->label) : opr_label(g->label);
+    }
+    return discharge(a, fn);
+}
+
+static void asm_postamble(Assembler *a);
+
+static void asm_call(Assembler *a, IrIns *ir) {
+    size_t nargs = 0;
+    for (IrIns *ins = ir->next; ins && ins->op == IR_CARG; ins = ins->next) {
+        nargs++;
+    }
+    IrIns *cargs[nargs];
+    size_t i = 0;
+    for (IrIns *ins = ir->next; ins && ins->op == IR_CARG; ins = ins->next) {
+        cargs[i++] = ins;
+    }
+
+    // Work out where each argument goes, and reserve space at the bottom of
+    // the stack frame for the ones passed on the stack
+    ArgState s = {0};
+    ArgLoc locs[nargs];
+    for (i = 0; i < nargs; i++) {
+        locs[i] = place_arg(&s, cargs[i]->t);
+    }
+    if (s.stack_size > a->fn->out_args_size) {
+        a->fn->out_args_size = s.stack_size;
+    }
+
+    // Everything's put in a vreg before any of the argument registers are
+    // set, since pregs aren't kept free across instructions (see 'reg_alloc');
+    // that includes the copies of aggregates passed by reference
+    AsmOpr *args[nargs];
+    for (i = 0; i < nargs; i++) {
+        IrIns *arg = cargs[i]->arg;
+        IrType *t = cargs[i]->t;
+        if (arg->t->k == IRT_STRUCT || t->k == IRT_STRUCT) {
+            args[i] = agg_mem(a, arg);
+            if (locs[i].by_ref) {
+                AsmOpr *copy = agg_slot(a, t);
+                emit_copy(a, copy, args[i], t->size);
+                args[i] = mem_addr(a, copy);
+            } else if (locs[i].num_regs > 0 && !locs[i].is_fpr) {
+                args[i] = loadable_agg(a, args[i], t);
+            }
+        } else if (locs[i].num_regs > 0) {
+            args[i] = is_fpr(t) ? discharge(a, arg) : inline_imm(a, arg);
+        } else {
+            args[i] = inline_zero(a, arg);
+        }
+    }
+    AsmOpr *fn = call_target(a, ir->fn);
+
+    // Copy arguments onto the stack
+    for (i = 0; i < nargs; i++) {
+        IrType *t = cargs[i]->t;
+        if (locs[i].num_regs > 0) {
+            continue;
+        } else if (locs[i].by_ref) {
+            emit(a, asm2(A64_STR, opr_out_arg(locs[i].stack_off, 8), args[i]));
+        } else if (t->k == IRT_STRUCT) {
+            emit_copy(a, opr_out_arg(locs[i].stack_off, 0), args[i], t->size);
+        } else {
+            emit(a, asm2(A64_STR, opr_out_arg(locs[i].stack_off, t->size), args[i]));
+        }
+    }
+
+    // Move arguments into their registers
+    for (i = 0; i < nargs; i++) {
+        IrType *t = cargs[i]->t;
+        if (locs[i].num_regs == 0) {
+            continue;
+        } else if (locs[i].by_ref) {
+            emit(a, asm2(A64_MOV, opr_gpr(locs[i].regs[0], R64), args[i]));
+        } else if (t->k == IRT_STRUCT) {
+            load_parts(a, &locs[i], args[i], t);
+        } else if (is_fpr(t)) {
+            emit(a, asm2(A64_FMOV, opr_fpr(locs[i].regs[0], fpr_size(t)), args[i]));
+        } else {
+            emit(a, asm2(A64_MOV, opr_gpr_t(locs[i].regs[0], t), args[i]));
+        }
+    }
+    AsmOpr *ret_mem = NULL;
+    if (returns_in_mem(ir->t)) { // Point x8 at a stack slot
+        ret_mem = agg_slot(a, ir->t);
+        emit(a, asm2(A64_LEA, opr_gpr(X8, R64), ret_mem));
+    }
+
+    // Emit a tail call; the target goes in x9 (which isn't callee-saved or an
+    // argument) if it's in a register, since that might be a callee-saved one
+    // that the postamble restores
+    if (is_tail_call(a, ir)) {
+        if (fn->k == OPR_GPR) {
+            AsmOpr *x9 = opr_gpr(X9, R64);
+            emit(a, asm2(A64_MOV, x9, fn));
+            fn = x9;
+        }
+        asm_postamble(a);
+        AsmIns *tail = emit(a, asm1(A64_TAIL_CALL, fn));
+        tail->callee = static_callee(ir->fn);
+        return;
+    }
+
+    AsmIns *call = emit(a, asm1(A64_BL, fn));
+    call->callee = static_callee(ir->fn);
+
+    // Get return value
+    if (ir->t->k == IRT_STRUCT) { // Point to the aggregate
+        AsmOpr *dst = next_vreg(a, ir->t);
+        ir->vreg = dst->reg;
+        if (!ret_mem) {
+            ArgLoc loc = place_ret(ir->t);
+            ret_mem = agg_slot(a, ir->t);
+            store_parts(a, &loc, ret_mem);
+        }
+        emit(a, asm2(A64_LEA, dst, ret_mem));
+    } else if (ir->t->k != IRT_VOID) {
+        AsmOpr *dst = next_vreg(a, ir->t); // New vreg for the result
+        ir->vreg = dst->reg;
+        if (is_fpr(ir->t)) {
+            emit(a, asm2(A64_FMOV, dst, opr_fpr(V0, fpr_size(ir->t))));
+        } else {
+            emit(a, asm2(A64_MOV, dst, opr_gpr_t(X0, ir->t)));
+        }
+    }
+}
+
+static void asm_hook(Assembler *a, char *hook);
+
+static void asm_ret(Assembler *a, IrIns *ir) {
+    IrIns *call = ir->prev;
+    while (call && call->op == IR_CARG) {
+        call = call->prev;
+    }
+    if (call && call->op == IR_CALL && is_tail_call(a, call)) {
+        return; // Already returned by the callee
+    }
+    if (a->fn->instrument) { // Before the return value's put in place
+        asm_hook(a, HOOK_EXIT);
+    }
+    IrType *t = a->fn->ret;
+    if (ir->ret && t->k == IRT_STRUCT) {
+        AsmOpr *src = agg_mem(a, ir->ret);
+        if (a->ret_ptr != R_NONE) { // Copy to where the caller asked
+            emit_copy(a, opr_mem_reg(a->ret_ptr), src, t->size);
+        } else {
+            ArgLoc loc = place_ret(t);
+            load_parts(a, &loc, loc.is_fpr ? src : loadable_agg(a, src, t), t);
+        }
+    } else if (ir->ret && is_fpr(ir->ret->t)) {
+        AsmOpr *val = discharge(a, ir->ret);
+        emit(a, asm2(A64_FMOV, opr_fpr(V0, fpr_size(ir->ret->t)), val));
+    } else if (ir->ret) {
+        AsmOpr *val = inline_imm(a, ir->ret);
+        emit(a, asm2(A64_MOV, opr_gpr_t(X0, ir->ret->t), val));
+    }
+    asm_postamble(a);
+    emit(a, asm0(A64_RET));
+}
+
+
+// ---- Atomics ---------------------------------------------------------------
+
+// An acquire load is 'ldar', and a release store 'stlr', which between them
+// are sequentially consistent too; relaxed ones are ordinary loads and
+// stores. Read-modify-writes are 'ldaxr'/'stlxr' loops (see 'aarch64.h'),
+// which are full barriers as far as other atomics go
+
+static void asm_atomic_load(Assembler *a, IrIns *ir) {
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    int op = ir->order == MO_RELAXED ? A64_LDR : A64_LDAR;
+    emit(a, asm2(op, dst, atomic_mem(a, ir->addr, ir->t)));
+}
+
+static void asm_atomic_store(Assembler *a, IrIns *ir) {
+    AsmOpr *val = discharge(a, ir->val);
+    int op = ir->order == MO_RELAXED ? A64_STR : A64_STLR;
+    emit(a, asm2(op, atomic_mem(a, ir->addr, ir->val->t), val));
+}
+
+// The old value ends up in the operand that went in (see 'A64_DEFS_LEFT')
+static void asm_atomic_rmw(Assembler *a, IrIns *ir, int op) {
+    IrType *t = ir->val->t;
+    AsmOpr *mem = atomic_mem(a, ir->addr, t);
+    AsmOpr *dst = next_vreg(a, t);
+    ir->vreg = dst->reg;
+    if (op == A64_CAS) {
+        AsmOpr *val = discharge(a, ir->val);
+        emit(a, asm2(A64_MOV, dst, inline_imm(a, ir->expected)));
+        emit(a, asm3(A64_CAS, dst, mem, val));
+    } else {
+        emit(a, asm2(A64_MOV, dst, inline_imm(a, ir->val)));
+        emit(a, asm2(op, dst, mem));
+    }
+}
+
+
+// ---- Functions, Basic Blocks, and Instructions -----------------------------
+
+static void asm_ins(Assembler *a, IrIns *ir) {
+    if ((ir->t && ir->t->k == IRT_VEC) || ir->op == IR_REDUCE) { // See 'Target.vectors'
+        error("vectors aren't supported on aarch64");
+    }
+    switch (ir->op) {
+    // Constants and globals
+    case IR_IMM:    break; // Always inlined
+    case IR_FP:     asm_fp(a, ir); break;
+    case IR_GLOBAL: break; // Always inlined
+    case IR_BB_ADDR: break; // Always inlined
+
+        // Memory access
+    case IR_FARG:   asm_farg(a, ir); break;
+    case IR_ALLOC: // Otherwise given a slot by 'assign_stack_slots'
+        if (is_dyn_alloc(a->fn, ir)) {
+            asm_dyn_alloc(a, ir);
+        }
+        break;
+    case IR_LOAD:   discharge(a, ir); break;
+    case IR_STORE:  asm_store(a, ir); break;
+    case IR_COPY:   asm_copy(a, ir); break;
+    case IR_ZERO:   asm_zero(a, ir); break;
+    case IR_PTRADD: asm_ptradd(a, ir); break;
+    case IR_PREFETCH:
+        emit(a, asm2(A64_PRFM, load_ptr(a, ir->ptr, NULL), opr_imm((uint64_t) ir->locality)));
+        break;
+    case IR_STACK_SAVE:
+        ir->vreg = next_vreg(a, ir->t)->reg;
+        emit(a, asm2(A64_MOV, opr_gpr(ir->vreg, R64), opr_gpr(XSP, R64)));
+        break;
+    case IR_STACK_RESTORE:
+        emit(a, asm2(A64_MOV, opr_gpr(XSP, R64), discharge(a, ir->ptr)));
+        break;
+
+        // Atomics
+    case IR_ATOMIC_LOAD:  asm_atomic_load(a, ir); break;
+    case IR_ATOMIC_STORE: asm_atomic_store(a, ir); break;
+    case IR_ATOMIC_XCHG:  asm_atomic_rmw(a, ir, A64_SWP); break;
+    case IR_ATOMIC_ADD:   asm_atomic_rmw(a, ir, A64_LDADD); break;
+    case IR_ATOMIC_CAS:   asm_atomic_rmw(a, ir, A64_CAS); break;
+    case IR_FENCE:
+        if (ir->order != MO_RELAXED) {
+            emit(a, asm0(A64_DMB));
+        }
+        break;
+
+        // Arithmetic
+    case IR_ADD: case IR_SUB: case IR_MUL: case IR_FDIV:
+    case IR_BIT_AND: case IR_BIT_OR: case IR_BIT_XOR:
+        asm_arith(a, ir);
+        break;
+    case IR_UMULH: {
+        AsmOpr *l = discharge(a, ir->l), *r = discharge(a, ir->r);
+        AsmOpr *dst = next_vreg(a, ir->t);
+        ir->vreg = dst->reg;
+        emit(a, asm3(A64_UMULH, dst, l, r));
+        break;
+    }
+    case IR_SDIV: case IR_UDIV: case IR_SMOD: case IR_UMOD:
+        asm_div_mod(a, ir);
+        break;
+    case IR_SHL: case IR_SAR: case IR_SHR:
+        asm_sh(a, ir);
+        break;
+    case IR_POPCNT: case IR_CTZ: case IR_CLZ: case IR_BSWAP:
+        asm_bits(a, ir);
+        break;
+
+        // Comparisons
+    case IR_EQ:  case IR_NEQ:
+    case IR_SLT: case IR_SLE: case IR_SGT: case IR_SGE:
+    case IR_ULT: case IR_ULE: case IR_UGT: case IR_UGE:
+    case IR_FLT: case IR_FLE: case IR_FGT: case IR_FGE:
+        if (ir->fold < 0) {
+            discharge(a, ir);
+        }
+        break; // Otherwise handled by CONDBR or SELECT
+
+        // Conversions
+    case IR_TRUNC: case IR_ANYEXT: case IR_PTR2I:
+        asm_trunc(a, ir);
+        break;
+    case IR_SEXT: case IR_ZEXT: case IR_I2PTR: case IR_BITCAST:
+        asm_ext(a, ir);
+        break;
+    case IR_FTRUNC: case IR_FEXT: case IR_FP2I: case IR_I2FP:
+        asm_fp_conv(a, ir);
+        break;
+
+        // Control flow
+    case IR_SELECT: asm_select(a, ir); break;
+    case IR_PHI:    asm_phi(a, ir); break; // Copies at the end of each pred
+    case IR_BR:     asm_br(a, ir); break;
+    case IR_CONDBR: asm_condbr(a, ir); break;
+    case IR_SWITCH: asm_switch(a, ir); break;
+    case IR_INDIRECT_BR: asm_indirect_br(a, ir); break;
+    case IR_CALL:   asm_call(a, ir); break;
+    case IR_CARG:   break; // Handled by IR_CALL
+    case IR_ASM:    error("inline assembly isn't supported on aarch64");
+    case IR_ASMIN: case IR_ASMOUT: break; // Handled by IR_ASM
+    case IR_RET:    asm_ret(a, ir); break;
+    case IR_UNREACHABLE: emit(a, asm0(A64_BRK)); break;
+    default: UNREACHABLE();
+    }
+}
+
+static void asm_bb(Assembler *a, BB *bb) {
+    int enter_hook = bb == a->fn->entry && a->fn->instrument;
+    for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+        if (enter_hook && ins->op != IR_FARG) { // Once the arguments are read
+            asm_hook(a, HOOK_ENTER);
+            enter_hook = 0;
+        }
+        a->line = ins->line;
+        asm_ins(a, ins);
+    }
+}
+
+// The NOPs for '-fpatchable-function-entry' go before anything else
+static void asm_preamble(Assembler *a) {
+    for (int i = 0; i < a->fn->patchable_entry; i++) {
+        emit(a, asm0(A64_NOP));
+    }
+    AsmOpr *sp = opr_gpr(XSP, R64);
+    emit(a, asm0(A64_PUSH_FRAME));                                // stp x29, x30, [sp, #-16]!
+    emit(a, asm2(A64_MOV, opr_gpr(X29, R64), sp));                // mov x29, sp
+    AsmIns *patch = emit(a, asm3(A64_SUB, sp, sp, opr_imm(0)));   // sub sp, sp, #<stack size>
+    vec_push(a->fn->patch_with_stack_size, patch);
+}
+
+static void asm_postamble(Assembler *a) {
+    AsmOpr *sp = opr_gpr(XSP, R64);
+    AsmIns *patch = emit(a, asm3(A64_ADD, sp, sp, opr_imm(0)));   // add sp, sp, #<stack size>
+    emit(a, asm0(A64_POP_FRAME));                                 // ldp x29, x30, [sp], #16
+    vec_push(a->fn->patch_with_stack_size, patch);
+}
+
+// Calls a '-finstrument-functions' hook with the function's own address and
+// its return address, which the prologue saved just above x29
+static void asm_hook(Assembler *a, char *hook) {
+    emit_global_addr(a, opr_gpr(X0, R64), a->fn->instrument);
+    emit(a, asm2(A64_LDR, opr_gpr(X1, R64), opr_frame(8, 8)));
+    emit(a, asm1(A64_BL, opr_label(prepend_underscore(hook))));
+}
+
+
+// ---- Preparing the IR ------------------------------------------------------
+
+// Whether the use of 'def' in 'user' (at operand 'opr') is as the address of
+// a load or store
+static int is_addr_use(IrIns *user, IrIns **opr) {
+    return user->op == IR_LOAD || (user->op == IR_STORE && opr == &user->dst) ||
+           (user->op == IR_PREFETCH && opr == &user->ptr);
+}
+
+// Nothing is emitted for a PTRADD that's only used as the address of loads
+// and stores, which is folded into each of them instead: '[base, #disp]' for
+// a constant offset, or '[base, idx]' for a 64-bit one (not off a stack
+// slot, which is already off x29)
+static void mark_addr_folds(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op != IR_PTRADD) {
+                continue;
+            }
+            IrIns *base = ins->base, *off = ins->offset;
+            int in_slot = base->op == IR_ALLOC && !is_dyn_alloc(fn, base);
+            ins->fold = off->op == IR_IMM || (off->t->size == 8 && !in_slot);
+        }
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                IrIns *def = *oprs[i];
+                if (def->op == IR_PTRADD && def->fold > 0 && !is_addr_use(ins, oprs[i])) {
+                    def->fold = 0;
+                }
+            }
+            for (size_t i = 0; ins->op == IR_PHI && i < vec_len(ins->defs); i++) {
+                IrIns *def = vec_get(ins->defs, i);
+                def->fold = def->op == IR_PTRADD ? 0 : def->fold;
+            }
+        }
+    }
+}
+
+// Loads are always discharged where they're defined, and so are comparisons,
+// unless they're only used by branches and selects
+static void mark_folds(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            ins->fold = ins->op == IR_LOAD || is_cmp(ins) ? -1 : 0;
+        }
+    }
+    mark_addr_folds(fn);
+    mark_branch_conds(fn);
+}
+
+static void prepare_fn(Fn *fn) {
+    analyse_cfg(fn);
+    split_critical_edges(fn);
+    analyse_cfg(fn);
+    layout_bbs(fn);
+    mark_folds(fn);
+}
+
+
+// ---- Functions -------------------------------------------------------------
+
+void a64_assemble_fn(Fn *fn) {
+    if (CODEGEN_STATS) {
+        codegen_stats_begin(fn);
+    }
+    prepare_fn(fn);
+    Assembler *a = new_asm(fn);
+    assign_stack_slots(fn);
+    a->phi_in = calloc(number_ir(fn), sizeof(int));
+    for (BB *bb = fn->entry; bb; bb = bb->next) { // Phis need vregs up front
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_PHI) {
+                ins->vreg = next_vreg(a, ins->t)->reg;
+            }
+            if (ins->op == IR_PHI && bb->addr_taken) {
+                a->phi_in[ins->n] = next_vreg(a, ins->t)->reg;
+            }
+        }
+    }
+    asm_preamble(a);
+    if (returns_in_mem(fn->ret)) {
+        AsmOpr *ptr = next_ptr_vreg(a);
+        a->ret_ptr = ptr->reg;
+        emit(a, asm2(A64_MOV, ptr, opr_gpr(X8, R64)));
+    }
+
+    // Assemble in reverse postorder so values are always defined before their
+    // uses (BBs still come out in their original order)
+    Vec *rpo = rev_postorder(fn);
+    for (size_t i = 0; i < vec_len(rpo); i++) {
+        a->bb = vec_get(rpo, i);
+        asm_bb(a, a->bb);
+    }
+    vec_free(rpo);
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        if (bb->rpo == -1) { // Unreachable
+            a->bb = bb;
+            asm_bb(a, bb);
+        }
+    }
+    fn->num_gprs = a->next_gpr;
+    fn->num_sse = a->next_fpr;
+    free(a->phi_in);
+}
+
+
+// ---- Stack Frame -----------------------------------------------------------
+
+// Saves 'reg' after the function's prologue and restores it before every
+// epilogue
+void a64_save_callee_saved(Fn *fn, int reg) {
+    size_t slot = alloc_stack_slot(fn, 8, 8);
+    AsmIns *prologue = vec_get(fn->patch_with_stack_size, 0);
+    emit_after(prologue, asm2(A64_STR, opr_frame(-((int64_t) slot), 8), opr_gpr(reg, R64)));
+    for (size_t i = 1; i < vec_len(fn->patch_with_stack_size); i++) {
+        AsmIns *epilogue = vec_get(fn->patch_with_stack_size, i);
+        emit_before(epilogue, asm2(A64_LDR, opr_gpr(reg, R64), opr_frame(-((int64_t) slot), 8)));
+    }
+}
+
+// A spilled FPR only ever holds a float or double, so its slot only needs the
+// 'd' register
+static AsmOpr * opr_reg(int k, int reg) {
+    return k == OPR_GPR ? opr_gpr(reg, R64) : opr_fpr(reg, R64);
+}
+
+void a64_spill_load(AsmIns *before, int k, int reg, size_t slot) {
+    emit_before(before, asm2(A64_LDR, opr_reg(k, reg), opr_frame(-((int64_t) slot), 8)));
+}
+
+void a64_spill_store(AsmIns *after, int k, int reg, size_t slot) {
+    emit_after(after, asm2(A64_STR, opr_frame(-((int64_t) slot), 8), opr_reg(k, reg)));
+}
+
+void a64_split_copy(BB *bb, AsmIns *before, int k, int dst, int src) {
+    AsmIns *ins = mov_ins(opr_reg(k, dst), opr_reg(k, src));
+    if (before) {
+        emit_before(before, ins);
+    } else {
+        emit_to_bb(bb, ins);
+    }
+}
+
+// Re-emits 'def' (a 'mov' of a constant, or an address) before 'before', into
+// 'reg' instead
+void a64_spill_remat(AsmIns *before, AsmIns *def, int reg) {
+    AsmOpr *dst = opr_new(def->l->k), *src = opr_new(def->r->k);
+    *dst = *def->l;
+    *src = *def->r; // The frame's patched by copying stack slots, not in place
+    dst->reg = reg;
+    emit_before(before, asm2(def->op, dst, src));
+}
+
+static int is_leaf(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            if (ins->op == A64_BL) {
+                return 0;
+            }
+        }
+    }
+    return 1; // Tail calls don't count; they leave x30 as they found it
+}
+
+static int is_frame_opr(AsmOpr *opr) {
+    return opr && opr->k == OPR_MEM && opr->frame;
+}
+
+static int uses_frame(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            AsmOpr **oprs[MAX_INS_OPRS];
+            int num_oprs = ins_oprs(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                if (is_frame_opr(*oprs[i])) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Adds 'by' to the displacement of every stack slot from 'frame'. Operands
+// can be shared between instructions, so they're copied rather than patched
+// in place
+static void patch_frame_oprs(Fn *fn, int frame, int64_t by) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            AsmOpr **oprs[MAX_INS_OPRS];
+            int num_oprs = ins_oprs(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                if (is_frame_opr(*oprs[i]) && (*oprs[i])->frame == frame) {
+                    AsmOpr *patched = opr_new(OPR_MEM);
+                    *patched = **oprs[i];
+                    patched->disp += by;
+                    *oprs[i] = patched;
+                }
+            }
+        }
+    }
+}
+
+// Deletes the 'stp' and 'mov x29, sp' before the 'sub sp', and the 'ldp'
+// after every 'add sp'
+static void delete_frame_ptr(Fn *fn) {
+    AsmIns *prologue = vec_get(fn->patch_with_stack_size, 0);
+    delete_asm(prologue->prev->prev);
+    delete_asm(prologue->prev);
+    for (size_t i = 1; i < vec_len(fn->patch_with_stack_size); i++) {
+        AsmIns *epilogue = vec_get(fn->patch_with_stack_size, i);
+        assert(epilogue->next->op == A64_POP_FRAME);
+        delete_asm(epilogue->next);
+    }
+}
+
+// Where sp moves at run time, each epilogue puts it back with 'mov sp, x29'
+static void restore_sp_from_fp(Fn *fn) {
+    for (size_t i = 1; i < vec_len(fn->patch_with_stack_size); i++) {
+        AsmIns *epilogue = vec_get(fn->patch_with_stack_size, i);
+        epilogue->op = A64_MOV;
+        *epilogue->r = *opr_gpr(X29, R64);
+        epilogue->r2 = NULL;
+    }
+}
+
+static void patch_prologue(Fn *fn) {
+    AsmIns *prologue = vec_get(fn->patch_with_stack_size, 0);
+    if (fn->stack_size == 0) {
+        delete_asm(prologue);
+    } else {
+        prologue->r2->imm = fn->stack_size;
+    }
+}
+
+// With over-aligned objects, the prologue rounds sp down below the stack
+// slots, then makes room for the objects and the arguments for calls (as in
+// 'assemble.c'):
+//   sub sp, sp, #<slots>; mov x16, sp; and sp, x16, #-<align>; sub sp, sp, #<rest>
+static void realign_frame(Fn *fn) {
+    size_t align = fn->frame_align;
+    size_t out_args = fn->out_args_size + pad(fn->out_args_size, align);
+    size_t rest = out_args + fn->aligned_size;
+    rest += pad(rest, align);
+    patch_frame_oprs(fn, FRAME_ALIGNED, (int64_t) out_args);
+    AsmIns *prologue = vec_get(fn->patch_with_stack_size, 0);
+    AsmOpr *sp = opr_gpr(XSP, R64);
+    AsmIns *and = asm1(A64_ALIGN_SP, opr_imm(align));
+    emit_after(prologue, and);
+    emit_after(and, asm3(A64_SUB, sp, sp, opr_imm(rest)));
+    restore_sp_from_fp(fn);
+    patch_prologue(fn);
+    fn->frame_size = 16 + fn->stack_size + (align - STACK_ALIGN) + rest;
+}
+
+// With VLAs, sp moves at run time (see 'asm_dyn_alloc'), and the VLAs start
+// above the arguments for calls
+static void dyn_frame(Fn *fn) {
+    size_t out_args = fn->out_args_size + pad(fn->out_args_size, STACK_ALIGN);
+    patch_frame_oprs(fn, FRAME_DYN, (int64_t) out_args);
+    fn->stack_size += out_args;
+    fn->frame_size = 16 + fn->stack_size; // x29 and x30 too
+    restore_sp_from_fp(fn);
+    patch_prologue(fn);
+}
+
+// The stack frame holds the stack slots at the top, and the arguments for
+// calls that pass some on the stack at the bottom. A leaf function that
+// doesn't need any stack doesn't save x29 and x30 either
+void a64_patch_stack_sizes(Fn *fn) {
+    int leaf = is_leaf(fn);
+    fn->stack_size += pad(fn->stack_size, STACK_ALIGN);
+    if (fn->dyn_stack) {
+        dyn_frame(fn);
+        return;
+    }
+    if (fn->frame_align > 0) {
+        realign_frame(fn);
+        return;
+    }
+    fn->stack_size += fn->out_args_size + pad(fn->out_args_size, STACK_ALIGN);
+    int frame_ptr = 1;
+    if (fn->stack_size == 0 && leaf && !uses_frame(fn)) {
+        delete_frame_ptr(fn);
+        frame_ptr = 0;
+    }
+    fn->frame_size = (frame_ptr ? 16 : 0) + fn->stack_size;
+    for (size_t i = 0; i < vec_len(fn->patch_with_stack_size); i++) {
+        AsmIns *ins = vec_get(fn->patch_with_stack_size, i);
+        if (fn->stack_size == 0) {
+            delete_asm(ins);
+        } else {
+            assert(ins->r2->k == OPR_IMM);
+            ins->r2->imm = fn->stack_size;
+        }
+    }
+}
+
+
+// ---- Peephole Optimisation -------------------------------------------------
+
+static BB * next_non_empty(BB *bb) {
+    for (bb = bb->next; bb && !bb->asm_head; bb = bb->next);
+    return bb;
+}
+
+// 'b' to the BB that comes next anyway
+static int b_next(AsmIns *ins) {
+    if (ins->op != A64_B || ins->l->k != OPR_BB || ins->next ||
+            ins->l->bb != next_non_empty(ins->bb)) {
+        return 0;
+    }
+    delete_asm(ins);
+    return 1;
+}
+
+// 'b' or 'b.cond' to a BB that only branches somewhere else goes straight there
+static int b_chain(AsmIns *ins) {
+    if ((ins->op != A64_B && (ins->op < A64_B_COND || ins->op >= A64_B_COND + NUM_CONDS)) ||
+            ins->l->k != OPR_BB) {
+        return 0;
+    }
+    BB *target = ins->l->bb;
+    AsmIns *b = target->asm_head;
+    if (!b || b->next || b->op != A64_B || b->l->k != OPR_BB || b->l->bb == target) {
+        return 0;
+    }
+    ins->l = b->l;
+    return 1;
+}
+
+// A move of a register to itself, left by the register allocator. A 'mov w'
+// zeros the upper half, but nothing reads the upper bits of a 32-bit value
+static int self_mov(AsmIns *ins) {
+    if ((ins->op != A64_MOV && ins->op != A64_FMOV) || !is_reg_opr(ins->l) ||
+            !same_reg(ins->l, ins->r) || ins->l->size != ins->r->size) {
+        return 0;
+    }
+    delete_asm(ins);
+    return 1;
+}
+
+static int (*PEEPHOLES[])(AsmIns *ins) = { b_next, b_chain, self_mov, };
+
+#define NUM_PEEPHOLES (sizeof(PEEPHOLES) / sizeof(PEEPHOLES[0]))
+
+static int peephole_bb(BB *bb) {
+    int changed = 0;
+    AsmIns *ins = bb->asm_head;
+    while (ins) {
+        AsmIns *next = ins->next; // In case 'ins' is deleted
+        for (size_t i = 0; i < NUM_PEEPHOLES; i++) {
+            if (PEEPHOLES[i](ins)) {
+                changed = 1;
+                next = ins->prev ? ins->prev->next : bb->asm_head;
+                break;
+            }
+        }
+        ins = next;
+    }
+    return changed;
+}
+
+static int falls_through(BB *bb) {
+    AsmIns *last = bb->asm_last;
+    return !last || (last->op != A64_B && last->op != A64_BR && last->op != A64_RET &&
+                     last->op != A64_TAIL_CALL && last->op != A64_BRK);
+}
+
+// Deletes the code in BBs that nothing branches to (directly, through a jump
+// table, or by its address) or falls through into
+static int remove_dead_bbs(Fn *fn) {
+    size_t num_bbs = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->n = num_bbs++;
+    }
+    int *jumped_to = calloc(num_bbs, sizeof(int));
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            if (ins->l && ins->l->k == OPR_BB) {
+                jumped_to[ins->l->bb->n] = 1;
+            }
+        }
+    }
+    for (size_t i = 0; i < vec_len(fn->jump_tables); i++) {
+        Vec *table = vec_get(fn->jump_tables, i);
+        for (size_t j = 0; j < vec_len(table); j++) {
+            jumped_to[((BB *) vec_get(table, j))->n] = 1;
+        }
+    }
+    int changed = 0;
+    int reachable = 1;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        reachable = reachable || jumped_to[bb->n] || bb == fn->entry ||
+                    bb->addr_taken;
+        if (!reachable && bb->asm_head) {
+            bb->asm_head = bb->asm_last = NULL;
+            changed = 1;
+        }
+        reachable = reachable && falls_through(bb);
+    }
+    free(jumped_to);
+    return changed;
+}
+
+void a64_peephole_fn(Fn *fn) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (BB *bb = fn->entry; bb; bb = bb->next) {
+            changed |= peephole_bb(bb);
+        }
+        changed |= remove_dead_bbs(fn);
+    }
+    if (fn->codegen) {
+        codegen_stats_end(fn);
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef COSEC_AARCH64_H
+#define COSEC_AARCH64_H
+
+#include "target.h"
+
+// AArch64 with the AAPCS64 calling convention (as on Linux), selected with
+// '--target=aarch64'. Instruction selection, the stack frame, and spill code
+// are in 'aarch64.c'; the assembly text (for the GNU assembler, since there's
+// no object file writer for AArch64) in 'aarch64_encode.c'.
+//
+// Operands reuse the x86-64 kinds: OPR_GPR for the x registers (R32 is the w
+// half of one), and OPR_XMM for the v registers, with R32 for an 's' and R64
+// for a 'd'. As on x86-64, an i8 or i16 lives in a w register with its upper
+// bits undefined, and is extended explicitly wherever they'd be read. x16 and
+// x17 (the intra-procedure-call scratch registers) are never allocated; the
+// encoder uses them to build immediates and addresses that don't fit in an
+// instruction
+
+enum { // General-purpose registers
+    X0 = 1, X1, X2, X3, X4, X5, X6, X7, X8, X9, X10, X11, X12, X13, X14, X15,
+    X16, X17, X18, X19, X20, X21, X22, X23, X24, X25, X26, X27, X28,
+    X29, // Frame pointer
+    X30, // Link register
+    XSP, // 'sp'; register 31 as a base or in 'add'
+    XZR, // 'xzr'; register 31 everywhere else
+    A64_LAST_GPR, // Separates virtual and physical registers
+};
+
+enum { // Floating point (SIMD) registers
+    V0 = 1, V1, V2, V3, V4, V5, V6, V7, V8, V9, V10, V11, V12, V13, V14, V15,
+    V16, V17, V18, V19, V20, V21, V22, V23, V24, V25, V26, V27, V28, V29,
+    V30, V31,
+    A64_LAST_FPR,
+};
+
+enum { // Condition codes, in their encoding order; 'cond ^ 1' is the inverse
+    COND_EQ, COND_NE, COND_HS, COND_LO, COND_MI, COND_PL, COND_VS, COND_VC,
+    COND_HI, COND_LS, COND_GE, COND_LT, COND_GT, COND_LE,
+    NUM_CONDS,
+};
+
+enum { // AArch64 opcodes, after the x86-64 ones (see 'target.h')
+    // Moves and memory access. Loads are 'ldr reg, mem' and stores 'str mem,
+    // reg'; the access size is the memory operand's 'bytes'
+    A64_MOV = X64_LAST,
+    A64_FMOV,
+    A64_SXTB, A64_SXTH, A64_SXTW,
+    A64_UXTB, A64_UXTH, A64_UXTW,
+    A64_LDR,
+    A64_STR,
+    A64_LEA, // An address: 'add', 'adrp' and 'add', 'adr', or 'mrs'
+
+    // Integer arithmetic, 'op dst, l, r' (r2 is 'r')
+    A64_ADD, A64_SUB, A64_MUL, A64_UMULH, A64_SDIV, A64_UDIV,
+    A64_AND, A64_ORR, A64_EOR, A64_LSL, A64_LSR, A64_ASR,
+    A64_CLZ, A64_RBIT, A64_REV, A64_REV16,
+    A64_CNT, // 'cnt' and 'addv' over the low 8 bytes of a v register
+
+    // Floating point arithmetic and conversions
+    A64_FADD, A64_FSUB, A64_FMUL, A64_FDIV,
+    A64_FCVT, A64_SCVTF, A64_FCVTZS,
+
+    // Comparisons; each conditional opcode is followed by the rest of the
+    // conditions (e.g., 'A64_CSET + COND_NE')
+    A64_CMP,
+    A64_FCMP,
+    A64_CSET,
+    A64_CSEL = A64_CSET + NUM_CONDS,
+    A64_FCSEL = A64_CSEL + NUM_CONDS,
+
+    // Stack frame
+    A64_PUSH_FRAME = A64_FCSEL + NUM_CONDS, // stp x29, x30, [sp, #-16]!
+    A64_POP_FRAME,                          // ldp x29, x30, [sp], #16
+    A64_ALIGN_SP,                           // Rounds sp down to 'l'
+
+    // Control flow
+    A64_B,
+    A64_B_COND,
+    A64_BR = A64_B_COND + NUM_CONDS,
+    A64_RET,
+    A64_BL,
+    A64_TAIL_CALL,
+
+    // Atomics. The read-modify-writes are 'ldaxr'/'stlxr' loops through x16
+    // and x17 (the single instructions need ARMv8.1), with the address in a
+    // register; the old value ends up in 'l'
+    A64_LDAR,
+    A64_STLR,
+    A64_SWP,   // 'l' in: the new value
+    A64_LDADD, // 'l' in: what to add
+    A64_CAS,   // 'l' in: the expected value; 'r2' is the new one
+    A64_DMB,
+
+    A64_PRFM, // 'r' is the IR_PREFETCH's locality
+    A64_BRK,
+    A64_NOP,
+    A64_LAST,
+};
+
+// Instruction selection and the stack frame ('aarch64.c'); see 'assemble.h'
+// for what each does
+void a64_assemble_fn(Fn *fn);
+void a64_save_callee_saved(Fn *fn, int reg);
+void a64_spill_load(AsmIns *before, int k, int reg, size_t slot);
+void a64_spill_store(AsmIns *after, int k, int reg, size_t slot);
+void a64_spill_remat(AsmIns *before, AsmIns *def, int reg);
+void a64_split_copy(BB *bb, AsmIns *before, int k, int dst, int src);
+void a64_patch_stack_sizes(Fn *fn);
+void a64_peephole_fn(Fn *fn);
+
+// Assembly text for the GNU assembler ('aarch64_encode.c')
+void a64_encode_fn(Buf *b, Global *g);
+void a64_encode_with(FILE *out, Vec *globals, Buf **fn_text);
+void a64_print_gpr(FILE *out, int reg, int size);
+void a64_print_fpr(FILE *out, int reg);
+
+#endif
@@ -0,0 +1,1383 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "aarch64.h"
+#include "encode.h"
+
+// Assembly text for the GNU assembler (or 'llvm-mc'), which does the encoding.
+// What instruction selection leaves to this is everything that depends on
+// the final registers and stack frame: immediates that don't fit in an
+// instruction are built in x16 with 'movz' and 'movk', and memory operands
+// that an instruction can't address go through x16 and x17 (see
+// 'encode_mem'). Labels drop their leading '_' (see 'prepend_underscore'), as
+// the ELF symbols do; the BBs and constants are local ('.L') labels
+
+#define BB_PREFIX    ".BB"
+#define TABLE_PREFIX ".T"
+
+typedef struct {
+    char *s;
+    size_t len;
+} Name;
+
+#define N(s) { s, sizeof(s) - 1 }
+
+static Name COND_NAMES[NUM_CONDS] = {
+    N("eq"), N("ne"), N("hs"), N("lo"), N("mi"), N("pl"), N("vs"), N("vc"),
+    N("hi"), N("ls"), N("ge"), N("lt"), N("gt"), N("le"),
+};
+
+// Only the opcodes that are encoded as a single instruction of the same name
+static Name A64_OPCODES[A64_LAST - X64_LAST] = {
+    [A64_SXTB - X64_LAST] = N("sxtb"), [A64_SXTH - X64_LAST] = N("sxth"),
+    [A64_SXTW - X64_LAST] = N("sxtw"), [A64_UXTB - X64_LAST] = N("uxtb"),
+    [A64_UXTH - X64_LAST] = N("uxth"),
+    [A64_ADD - X64_LAST] = N("add"), [A64_SUB - X64_LAST] = N("sub"),
+    [A64_MUL - X64_LAST] = N("mul"), [A64_UMULH - X64_LAST] = N("umulh"),
+    [A64_SDIV - X64_LAST] = N("sdiv"), [A64_UDIV - X64_LAST] = N("udiv"),
+    [A64_AND - X64_LAST] = N("and"), [A64_ORR - X64_LAST] = N("orr"),
+    [A64_EOR - X64_LAST] = N("eor"), [A64_LSL - X64_LAST] = N("lsl"),
+    [A64_LSR - X64_LAST] = N("lsr"), [A64_ASR - X64_LAST] = N("asr"),
+    [A64_CLZ - X64_LAST] = N("clz"), [A64_RBIT - X64_LAST] = N("rbit"),
+    [A64_REV - X64_LAST] = N("rev"), [A64_REV16 - X64_LAST] = N("rev16"),
+    [A64_FADD - X64_LAST] = N("fadd"), [A64_FSUB - X64_LAST] = N("fsub"),
+    [A64_FMUL - X64_LAST] = N("fmul"), [A64_FDIV - X64_LAST] = N("fdiv"),
+    [A64_FCVT - X64_LAST] = N("fcvt"), [A64_SCVTF - X64_LAST] = N("scvtf"),
+    [A64_FCVTZS - X64_LAST] = N("fcvtzs"),
+};
+
+static Name PRFM_OPS[] = { // By locality
+    N("pldl1strm"), N("pldl3keep"), N("pldl2keep"), N("pldl1keep"),
+};
+
+static void emit(Buf *b, Name name) {
+    assert(name.s);
+    buf_nprint(b, name.s, name.len);
+}
+
+#define EMIT(b, str) buf_nprint((b), (str), sizeof(str) - 1)
+
+static void emit_uint(Buf *b, uint64_t v) {
+    char digits[20];
+    int n = 20;
+    do {
+        digits[--n] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    buf_nprint(b, &digits[n], (size_t) (20 - n));
+}
+
+static void emit_int(Buf *b, int64_t v) {
+    if (v < 0) {
+        buf_push(b, '-');
+        emit_uint(b, -(uint64_t) v);
+    } else {
+        emit_uint(b, (uint64_t) v);
+    }
+}
+
+static void emit_hex(Buf *b, uint64_t v) {
+    char digits[16];
+    int n = 16;
+    do {
+        digits[--n] = "0123456789abcdef"[v & 0xf];
+        v >>= 4;
+    } while (v > 0);
+    EMIT(b, "0x");
+    buf_nprint(b, &digits[n], (size_t) (16 - n));
+}
+
+// Whether the assembler would read 'name' as a register (e.g., 'fp' or 'x3')
+static int is_reg_name(char *name) {
+    static char *ALIASES[] = { "sp", "wsp", "fp", "lr", "xzr", "wzr", };
+    for (size_t i = 0; i < sizeof(ALIASES) / sizeof(ALIASES[0]); i++) {
+        if (strcmp(name, ALIASES[i]) == 0) {
+            return 1;
+        }
+    }
+    if (!strchr("xwvbhsdq", name[0]) || !isdigit(name[1])) {
+        return 0;
+    }
+    char *end;
+    unsigned long n = strtoul(&name[1], &end, 10);
+    return *end == '\0' && n <= 31;
+}
+
+// A label without its leading '_', for a local label to start with
+static void emit_name(Buf *b, char *label) {
+    buf_print(b, label[0] == '_' ? &label[1] : label);
+}
+
+// A label as its ELF symbol, quoted if it would be read as a register
+static void emit_sym(Buf *b, char *label) {
+    char *name = label[0] == '_' ? &label[1] : label;
+    if (is_reg_name(name)) {
+        buf_push(b, '"');
+        buf_print(b, name);
+        buf_push(b, '"');
+    } else {
+        buf_print(b, name);
+    }
+}
+
+static void emit_sym_offset(Buf *b, char *label, int64_t offset) {
+    emit_sym(b, label);
+    if (offset != 0) {
+        buf_push(b, offset > 0 ? '+' : '-');
+        emit_uint(b, offset > 0 ? (uint64_t) offset : -(uint64_t) offset);
+    }
+}
+
+static void emit_pool_label(Buf *b, int k, uint64_t bits) {
+    EMIT(b, ".L");
+    emit_name(b, fp_label(k, bits));
+}
+
+static void emit_bb_label(Buf *b, Global *g, BB *bb) {
+    EMIT(b, ".L");
+    emit_name(b, g->label);
+    EMIT(b, BB_PREFIX);
+    emit_uint(b, bb->n);
+}
+
+static void emit_table_label(Buf *b, Global *g, size_t idx) {
+    EMIT(b, ".L");
+    emit_name(b, g->label);
+    EMIT(b, TABLE_PREFIX);
+    emit_uint(b, idx);
+}
+
+
+// ---- Registers -------------------------------------------------------------
+
+static void emit_gpr(Buf *b, int reg, int size) {
+    assert(size == R32 || size == R64);
+    if (reg == XSP) {
+        buf_print(b, size == R64 ? "sp" : "wsp");
+    } else if (reg == XZR) {
+        buf_print(b, size == R64 ? "xzr" : "wzr");
+    } else if (reg < A64_LAST_GPR) { // Physical
+        buf_push(b, size == R64 ? 'x' : 'w');
+        emit_uint(b, (uint64_t) (reg - X0));
+    } else { // Virtual
+        buf_push(b, '%');
+        emit_uint(b, (uint64_t) (reg - A64_LAST_GPR));
+        buf_push(b, size == R64 ? 'x' : 'w');
+    }
+}
+
+// 'kind' is 's', 'd', 'b', or 'v' (for the '.8b' vector 'cnt' counts over)
+static void emit_fpr_kind(Buf *b, int reg, char kind) {
+    if (reg < A64_LAST_FPR) { // Physical
+        buf_push(b, kind);
+        emit_uint(b, (uint64_t) (reg - V0));
+    } else { // Virtual
+        buf_push(b, '%');
+        emit_uint(b, (uint64_t) (reg - A64_LAST_FPR));
+        buf_push(b, kind);
+    }
+    if (kind == 'v') {
+        EMIT(b, ".8b");
+    }
+}
+
+static void emit_fpr(Buf *b, int reg, int size) {
+    emit_fpr_kind(b, reg, size == R64 ? 'd' : 's');
+}
+
+// A register operand; a zero constant is the zero register
+static void emit_reg(Buf *b, AsmOpr *opr, int size) {
+    switch (opr->k) {
+    case OPR_GPR: emit_gpr(b, opr->reg, size); break;
+    case OPR_XMM: emit_fpr(b, opr->reg, size); break;
+    case OPR_IMM: assert(opr->imm == 0); emit_gpr(b, XZR, size); break;
+    default: UNREACHABLE();
+    }
+}
+
+// The size of register to access 'bytes' of memory with
+static int mem_reg_size(size_t bytes) {
+    return bytes == 8 ? R64 : R32;
+}
+
+static void flush(FILE *out, Buf *b) {
+    fwrite(b->data, 1, b->len, out);
+    free(b->data);
+    free(b);
+}
+
+void a64_print_gpr(FILE *out, int reg, int size) {
+    Buf *b = buf_new();
+    emit_gpr(b, reg, size == R64 ? R64 : R32);
+    flush(out, b);
+}
+
+void a64_print_fpr(FILE *out, int reg) {
+    Buf *b = buf_new();
+    emit_fpr(b, reg, R64);
+    flush(out, b);
+}
+
+static void start_ins(Buf *b, char *op) {
+    buf_push(b, '\t');
+    buf_print(b, op);
+    buf_push(b, ' ');
+}
+
+static void sep(Buf *b) {
+    EMIT(b, ", ");
+}
+
+
+// ---- Immediates ------------------------------------------------------------
+
+static uint64_t truncate_imm(uint64_t imm, int size) {
+    return size == R64 ? imm : imm & 0xffffffff;
+}
+
+// Sign extends a constant at 'size'
+static int64_t signed_imm(uint64_t imm, int size) {
+    return size == R64 ? (int64_t) imm : (int64_t) (int32_t) (uint32_t) imm;
+}
+
+// Whether 'imm' is a logical immediate: a repeating element of 2, 4, ..., or
+// 64 bits, which is a (rotated) run of ones
+static int is_bitmask_imm(uint64_t imm, int size) {
+    if (size == R32) {
+        imm &= 0xffffffff;
+        imm |= imm << 32;
+    }
+    if (imm == 0 || imm == ~(uint64_t) 0) {
+        return 0;
+    }
+    int bits = 64;
+    while (bits > 2) { // Find the smallest element
+        int half = bits / 2;
+        uint64_t mask = ((uint64_t) 1 << half) - 1;
+        if ((imm & mask) != ((imm >> half) & mask)) {
+            break;
+        }
+        bits = half;
+    }
+    uint64_t mask = bits == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << bits) - 1;
+    uint64_t elem = imm & mask;
+    if (elem & 1) { // A run that wraps around is the inverse of one that doesn't
+        elem = ~elem & mask;
+    }
+    while (!(elem & 1)) {
+        elem >>= 1;
+    }
+    return (elem & (elem + 1)) == 0;
+}
+
+static int num_chunks(int size) {
+    return size == R64 ? 4 : 2;
+}
+
+static unsigned chunk(uint64_t imm, int i) {
+    return (unsigned) (imm >> (16 * i)) & 0xffff;
+}
+
+// Whether 'mov' takes 'imm': a single 'movz' or 'movn', or an 'orr' of a
+// logical immediate
+static int is_mov_imm(uint64_t imm, int size) {
+    int zeros = 0, ones = 0;
+    for (int i = 0; i < num_chunks(size); i++) {
+        zeros += chunk(imm, i) == 0;
+        ones += chunk(imm, i) == 0xffff;
+    }
+    return zeros >= num_chunks(size) - 1 || ones >= num_chunks(size) - 1 ||
+           is_bitmask_imm(imm, size);
+}
+
+// 'mov' if it'll take it, otherwise a 'movz' (or 'movn', if more of the
+// 16-bit chunks are all ones) and a 'movk' for each of the other chunks
+static void encode_mov_imm(Buf *b, int reg, int size, uint64_t imm) {
+    imm = truncate_imm(imm, size);
+    if (is_mov_imm(imm, size)) {
+        start_ins(b, "mov");
+        emit_gpr(b, reg, size);
+        EMIT(b, ", #");
+        emit_int(b, signed_imm(imm, size));
+        buf_push(b, '\n');
+        return;
+    }
+    int zeros = 0, ones = 0;
+    for (int i = 0; i < num_chunks(size); i++) {
+        zeros += chunk(imm, i) == 0;
+        ones += chunk(imm, i) == 0xffff;
+    }
+    unsigned fill = ones > zeros ? 0xffff : 0;
+    int first = 1;
+    for (int i = 0; i < num_chunks(size); i++) {
+        unsigned c = chunk(imm, i);
+        if (c == fill) {
+            continue;
+        }
+        start_ins(b, first ? (fill ? "movn" : "movz") : "movk");
+        emit_gpr(b, reg, size);
+        EMIT(b, ", #");
+        emit_hex(b, first && fill ? (~c & 0xffff) : c);
+        EMIT(b, ", lsl #");
+        emit_uint(b, (uint64_t) (16 * i));
+        buf_push(b, '\n');
+        first = 0;
+    }
+}
+
+// Whether 'add' and 'sub' take 'imm': 12 bits, optionally shifted left by 12
+static int is_arith_imm(uint64_t imm) {
+    return imm < 4096 || ((imm & 0xfff) == 0 && imm < (1 << 24));
+}
+
+static void emit_arith_imm(Buf *b, uint64_t imm) {
+    EMIT(b, "#");
+    if (imm < 4096) {
+        emit_uint(b, imm);
+    } else {
+        emit_uint(b, imm >> 12);
+        EMIT(b, ", lsl #12");
+    }
+}
+
+// 'add' or 'sub' of a constant, flipped for a negative one, or through x16 for
+// one it won't take
+static void encode_add_imm(Buf *b, int is_sub, AsmOpr *dst, AsmOpr *l, uint64_t imm) {
+    int size = dst->size;
+    int64_t v = signed_imm(imm, size);
+    if (v < 0 && v != INT64_MIN) {
+        is_sub = !is_sub;
+        v = -v;
+    }
+    if (v >= 0 && is_arith_imm((uint64_t) v)) {
+        start_ins(b, is_sub ? "sub" : "add");
+        emit_gpr(b, dst->reg, size);
+        sep(b);
+        emit_gpr(b, l->reg, size);
+        sep(b);
+        emit_arith_imm(b, (uint64_t) v);
+        buf_push(b, '\n');
+        return;
+    }
+    encode_mov_imm(b, X16, size, imm);
+    start_ins(b, is_sub ? "sub" : "add");
+    emit_gpr(b, dst->reg, size);
+    sep(b);
+    emit_gpr(b, l->reg, size);
+    sep(b);
+    emit_gpr(b, X16, size);
+    if (dst->reg == XSP || l->reg == XSP) {
+        EMIT(b, ", uxtx"); // Only the extended register form takes sp
+    }
+    buf_push(b, '\n');
+}
+
+// Whether 'fmov' takes a floating point constant: 1.0 to 1.9375 in 16ths,
+// times 2^-3 to 2^4
+static int is_fmov_imm(uint64_t bits, int k) {
+    int exp;
+    uint64_t frac;
+    if (k == OPR_F32) {
+        exp = (int) ((bits >> 23) & 0xff) - 127;
+        frac = bits & 0x7fffff;
+        return (frac & 0x7ffff) == 0 && exp >= -3 && exp <= 4;
+    } else {
+        exp = (int) ((bits >> 52) & 0x7ff) - 1023;
+        frac = bits & 0xfffffffffffff;
+        return (frac & 0xffffffffffff) == 0 && exp >= -3 && exp <= 4;
+    }
+}
+
+static void emit_fmov_imm(Buf *b, uint64_t bits, int k) {
+    double d;
+    if (k == OPR_F32) {
+        uint32_t bits32 = (uint32_t) bits;
+        float f;
+        memcpy(&f, &bits32, sizeof(f));
+        d = f;
+    } else {
+        memcpy(&d, &bits, sizeof(d));
+    }
+    buf_printf(b, "#%.10f", d); // Exact; none has more than 7 decimal places
+}
+
+
+// ---- Memory Operands -------------------------------------------------------
+
+typedef struct {
+    int base, idx;
+    int shift;    // Of 'idx'
+    int64_t disp; // If there's no 'idx'
+    int unscaled; // 'ldur' rather than 'ldr'
+} MemAddr;
+
+static int log2_scale(int scale) {
+    int shift = 0;
+    while ((1 << shift) < scale) {
+        shift++;
+    }
+    return shift;
+}
+
+// Works out how to address 'mem' with a load or store of 'bytes' (0 for
+// 'prfm', which is scaled like an 8 byte load): '[base, idx, lsl #n]' if the
+// index is scaled by 1 or the access's size, otherwise the address goes in
+// x17 first; and then '[base, #disp]' scaled by the access's size, '[base,
+// #disp]' unscaled ('ldur') for -256 to 255, or '[base, x16]' with the
+// displacement in x16
+static MemAddr encode_mem(Buf *b, AsmOpr *mem, size_t bytes) {
+    size_t size = bytes ? bytes : 8;
+    MemAddr addr = { .base = mem->base, .idx = R_NONE, .disp = mem->disp };
+    if (mem->idx != R_NONE) {
+        int scale = mem->scale ? mem->scale : 1;
+        if (mem->disp == 0 && (scale == 1 || (size_t) scale == size)) {
+            addr.idx = mem->idx;
+            addr.shift = log2_scale(scale);
+            return addr;
+        }
+        start_ins(b, "add");
+        emit_gpr(b, X17, R64);
+        sep(b);
+        emit_gpr(b, mem->base, R64);
+        sep(b);
+        emit_gpr(b, mem->idx, R64);
+        if (mem->base == XSP) {
+            EMIT(b, ", uxtx #");
+        } else {
+            EMIT(b, ", lsl #");
+        }
+        emit_uint(b, (uint64_t) log2_scale(scale));
+        buf_push(b, '\n');
+        addr.base = X17;
+    }
+    int64_t disp = addr.disp;
+    if (disp >= 0 && disp % (int64_t) size == 0 && disp / (int64_t) size < 4096) {
+        return addr;
+    } else if (disp >= -256 && disp < 256) {
+        addr.unscaled = 1;
+        return addr;
+    }
+    encode_mov_imm(b, X16, R64, (uint64_t) disp);
+    addr.idx = X16;
+    addr.shift = 0;
+    addr.disp = 0;
+    return addr;
+}
+
+static void emit_mem(Buf *b, MemAddr *addr) {
+    buf_push(b, '[');
+    emit_gpr(b, addr->base, R64);
+    if (addr->idx != R_NONE) {
+        sep(b);
+        emit_gpr(b, addr->idx, R64);
+        if (addr->shift > 0) {
+            EMIT(b, ", lsl #");
+            emit_uint(b, (uint64_t) addr->shift);
+        }
+    } else if (addr->disp != 0) {
+        EMIT(b, ", #");
+        emit_int(b, addr->disp);
+    }
+    buf_push(b, ']');
+}
+
+// 'ldr' or 'str' (or 'ldur' or 'stur'), with a 'b' or 'h' for 1 and 2 byte
+// GPR accesses
+static void start_mem_ins(Buf *b, int is_store, MemAddr *addr, AsmOpr *reg, size_t bytes) {
+    buf_push(b, '\t');
+    buf_print(b, is_store ? (addr->unscaled ? "stur" : "str") :
+                            (addr->unscaled ? "ldur" : "ldr"));
+    if (reg->k != OPR_XMM && bytes == 1) {
+        buf_push(b, 'b');
+    } else if (reg->k != OPR_XMM && bytes == 2) {
+        buf_push(b, 'h');
+    }
+    buf_push(b, ' ');
+}
+
+// A load from the GOT: 'adrp' for its page, and 'ldr' with its offset into it
+static void encode_got_load(Buf *b, int reg, char *label, char *page, char *lo12) {
+    start_ins(b, "adrp");
+    emit_gpr(b, reg, R64);
+    sep(b);
+    buf_print(b, page);
+    emit_sym(b, label);
+    buf_push(b, '\n');
+    start_ins(b, "ldr");
+    emit_gpr(b, reg, R64);
+    EMIT(b, ", [");
+    emit_gpr(b, reg, R64);
+    sep(b);
+    buf_print(b, lo12);
+    emit_sym(b, label);
+    EMIT(b, "]\n");
+}
+
+static void encode_ldr(Buf *b, AsmIns *ins) {
+    AsmOpr *dst = ins->l, *src = ins->r;
+    if (src->k == OPR_GOTPCREL) {
+        encode_got_load(b, dst->reg, src->label, ":got:", ":got_lo12:");
+        return;
+    } else if (src->k == OPR_GOTTPOFF) {
+        encode_got_load(b, dst->reg, src->label, ":gottprel:", ":gottprel_lo12:");
+        return;
+    }
+    MemAddr addr = encode_mem(b, src, src->bytes);
+    start_mem_ins(b, 0, &addr, dst, src->bytes);
+    if (dst->k == OPR_XMM) {
+        emit_fpr(b, dst->reg, src->bytes == 8 ? R64 : R32);
+    } else {
+        emit_gpr(b, dst->reg, mem_reg_size(src->bytes));
+    }
+    sep(b);
+    emit_mem(b, &addr);
+    buf_push(b, '\n');
+}
+
+static void encode_str(Buf *b, AsmIns *ins) {
+    AsmOpr *dst = ins->l, *src = ins->r;
+    MemAddr addr = encode_mem(b, dst, dst->bytes);
+    start_mem_ins(b, 1, &addr, src, dst->bytes);
+    if (src->k == OPR_XMM) {
+        emit_fpr(b, src->reg, dst->bytes == 8 ? R64 : R32);
+    } else {
+        emit_reg(b, src, mem_reg_size(dst->bytes));
+    }
+    sep(b);
+    emit_mem(b, &addr);
+    buf_push(b, '\n');
+}
+
+static void encode_prfm(Buf *b, AsmIns *ins) {
+    MemAddr addr = encode_mem(b, ins->l, 0);
+    start_ins(b, addr.unscaled ? "prfum" : "prfm");
+    emit(b, PRFM_OPS[ins->r->imm]);
+    sep(b);
+    emit_mem(b, &addr);
+    buf_push(b, '\n');
+}
+
+
+// ---- Instructions ----------------------------------------------------------
+
+static void encode_lea(Buf *b, Global *g, AsmIns *ins) {
+    AsmOpr *dst = ins->l, *src = ins->r;
+    switch (src->k) {
+    case OPR_DEREF: // adrp <dst>, <sym>; add <dst>, <dst>, :lo12:<sym>
+        start_ins(b, "adrp");
+        emit_gpr(b, dst->reg, R64);
+        sep(b);
+        emit_sym(b, src->label);
+        buf_push(b, '\n');
+        start_ins(b, "add");
+        emit_gpr(b, dst->reg, R64);
+        sep(b);
+        emit_gpr(b, dst->reg, R64);
+        EMIT(b, ", :lo12:");
+        emit_sym(b, src->label);
+        buf_push(b, '\n');
+        return;
+    case OPR_BB_ADDR:
+        start_ins(b, "adr");
+        emit_gpr(b, dst->reg, R64);
+        sep(b);
+        emit_bb_label(b, g, src->bb);
+        buf_push(b, '\n');
+        return;
+    case OPR_TABLE:
+        start_ins(b, "adr");
+        emit_gpr(b, dst->reg, R64);
+        sep(b);
+        emit_table_label(b, g, src->table);
+        buf_push(b, '\n');
+        return;
+    case OPR_TPOFF: // The thread pointer, plus a thread-local's offset from it
+        start_ins(b, "mrs");
+        emit_gpr(b, dst->reg, R64);
+        EMIT(b, ", tpidr_el0\n");
+        if (src->label) {
+            start_ins(b, "add");
+            emit_gpr(b, dst->reg, R64);
+            sep(b);
+            emit_gpr(b, dst->reg, R64);
+            EMIT(b, ", #:tprel_hi12:");
+            emit_sym(b, src->label);
+            EMIT(b, ", lsl #12\n");
+            start_ins(b, "add");
+            emit_gpr(b, dst->reg, R64);
+            sep(b);
+            emit_gpr(b, dst->reg, R64);
+            EMIT(b, ", #:tprel_lo12_nc:");
+            emit_sym(b, src->label);
+            buf_push(b, '\n');
+        }
+        return;
+    case OPR_MEM:
+        break;
+    default: UNREACHABLE();
+    }
+    AsmOpr base = { .k = OPR_GPR, .reg = src->base, .size = R64 };
+    if (src->idx != R_NONE) { // add <dst>, <base>, <idx>, lsl #<n>
+        start_ins(b, "add");
+        emit_gpr(b, dst->reg, R64);
+        sep(b);
+        emit_gpr(b, src->base, R64);
+        sep(b);
+        emit_gpr(b, src->idx, R64);
+        EMIT(b, src->base == XSP ? ", uxtx #" : ", lsl #");
+        emit_uint(b, (uint64_t) log2_scale(src->scale ? src->scale : 1));
+        buf_push(b, '\n');
+        base.reg = dst->reg;
+        if (src->disp == 0) {
+            return;
+        }
+    }
+    AsmOpr d = *dst;
+    d.size = R64;
+    encode_add_imm(b, 0, &d, &base, (uint64_t) src->disp);
+}
+
+// 'mov' between GPRs (at the destination's size), of a constant, or to or
+// from sp
+static void encode_mov(Buf *b, AsmIns *ins) {
+    AsmOpr *dst = ins->l, *src = ins->r;
+    if (src->k == OPR_IMM) {
+        encode_mov_imm(b, dst->reg, dst->size, src->imm);
+        return;
+    }
+    start_ins(b, "mov");
+    emit_gpr(b, dst->reg, dst->size);
+    sep(b);
+    emit_gpr(b, src->reg, dst->size);
+    buf_push(b, '\n');
+}
+
+static void encode_fmov(Buf *b, AsmIns *ins) {
+    AsmOpr *dst = ins->l, *src = ins->r;
+    if ((src->k == OPR_F32 || src->k == OPR_F64) && !is_fmov_imm(src->fp, src->k)) {
+        // adrp x16, <const>; ldr <dst>, [x16, :lo12:<const>]
+        start_ins(b, "adrp");
+        emit_gpr(b, X16, R64);
+        sep(b);
+        emit_pool_label(b, src->k, src->fp);
+        buf_push(b, '\n');
+        start_ins(b, "ldr");
+        emit_fpr(b, dst->reg, dst->size);
+        EMIT(b, ", [x16, :lo12:");
+        emit_pool_label(b, src->k, src->fp);
+        EMIT(b, "]\n");
+        return;
+    }
+    start_ins(b, "fmov");
+    emit_reg(b, dst, dst->size);
+    sep(b);
+    if (src->k == OPR_F32 || src->k == OPR_F64) {
+        emit_fmov_imm(b, src->fp, src->k);
+    } else {
+        emit_reg(b, src, dst->size); // 's' and 'w', or 'd' and 'x'
+    }
+    buf_push(b, '\n');
+}
+
+// Extensions read a w register. 'uxtb' and 'uxth' only write one (which zeros
+// the rest of the x register anyway), and 'uxtw' is just a 'mov'
+static void encode_ext(Buf *b, AsmIns *ins) {
+    int dst_size = ins->l->size;
+    if (ins->op == A64_UXTW) {
+        start_ins(b, "mov");
+        dst_size = R32;
+    } else {
+        if (ins->op == A64_UXTB || ins->op == A64_UXTH) {
+            dst_size = R32;
+        }
+        buf_push(b, '\t');
+        emit(b, A64_OPCODES[ins->op - X64_LAST]);
+        buf_push(b, ' ');
+    }
+    emit_gpr(b, ins->l->reg, dst_size);
+    sep(b);
+    emit_gpr(b, ins->r->reg, R32);
+    buf_push(b, '\n');
+}
+
+// 'op dst, l, r' between GPRs, with a constant for 'r' if the instruction
+// takes it, and otherwise through x16
+static void encode_arith(Buf *b, AsmIns *ins) {
+    AsmOpr *dst = ins->l, *l = ins->r, *r = ins->r2;
+    int size = dst->size;
+    if (r->k == OPR_IMM && (ins->op == A64_ADD || ins->op == A64_SUB)) {
+        encode_add_imm(b, ins->op == A64_SUB, dst, l, r->imm);
+        return;
+    }
+    int is_logical = ins->op == A64_AND || ins->op == A64_ORR || ins->op == A64_EOR;
+    int is_shift = ins->op == A64_LSL || ins->op == A64_LSR || ins->op == A64_ASR;
+    int in_ins = r->k == OPR_IMM &&
+                 (is_shift || (is_logical && is_bitmask_imm(r->imm, size)));
+    int is_zr = r->k == OPR_IMM && !in_ins && r->imm == 0;
+    if (r->k == OPR_IMM && !in_ins && !is_zr) {
+        encode_mov_imm(b, X16, size, r->imm);
+    }
+    buf_push(b, '\t');
+    emit(b, A64_OPCODES[ins->op - X64_LAST]);
+    buf_push(b, ' ');
+    emit_gpr(b, dst->reg, size);
+    sep(b);
+    emit_gpr(b, l->reg, size);
+    sep(b);
+    if (r->k != OPR_IMM) {
+        emit_gpr(b, r->reg, size);
+        if (dst->reg == XSP || l->reg == XSP) {
+            EMIT(b, ", uxtx"); // Only the extended register form takes sp
+        }
+    } else if (in_ins) {
+        EMIT(b, "#");
+        emit_uint(b, truncate_imm(r->imm, size));
+    } else {
+        emit_gpr(b, is_zr ? XZR : X16, size);
+    }
+    buf_push(b, '\n');
+}
+
+// Unary operations on GPRs ('clz', 'rbit', 'rev', and 'rev16') are at the
+// source's size, which the result might be narrower than
+static void encode_unary(Buf *b, AsmIns *ins) {
+    int size = ins->r->size;
+    buf_push(b, '\t');
+    emit(b, A64_OPCODES[ins->op - X64_LAST]);
+    buf_push(b, ' ');
+    emit_gpr(b, ins->l->reg, size);
+    sep(b);
+    emit_gpr(b, ins->r->reg, size);
+    buf_push(b, '\n');
+}
+
+static void encode_fp_arith(Buf *b, AsmIns *ins) {
+    buf_push(b, '\t');
+    emit(b, A64_OPCODES[ins->op - X64_LAST]);
+    buf_push(b, ' ');
+    emit_fpr(b, ins->l->reg, ins->l->size);
+    sep(b);
+    emit_fpr(b, ins->r->reg, ins->l->size);
+    sep(b);
+    emit_fpr(b, ins->r2->reg, ins->l->size);
+    buf_push(b, '\n');
+}
+
+// 'fcvt', 'scvtf', and 'fcvtzs', each operand at its own size
+static void encode_fp_conv(Buf *b, AsmIns *ins) {
+    buf_push(b, '\t');
+    emit(b, A64_OPCODES[ins->op - X64_LAST]);
+    buf_push(b, ' ');
+    emit_reg(b, ins->l, ins->l->size);
+    sep(b);
+    emit_reg(b, ins->r, ins->r->size);
+    buf_push(b, '\n');
+}
+
+// 'cmp' with a constant it won't take goes through x16, unless it's negative
+// and 'cmn' takes it
+static void encode_cmp(Buf *b, AsmIns *ins) {
+    AsmOpr *l = ins->l, *r = ins->r;
+    int size = l->size;
+    if (r->k != OPR_IMM) {
+        start_ins(b, "cmp");
+        emit_gpr(b, l->reg, size);
+        sep(b);
+        emit_gpr(b, r->reg, size);
+        buf_push(b, '\n');
+        return;
+    }
+    uint64_t imm = truncate_imm(r->imm, size);
+    int64_t v = signed_imm(imm, size);
+    if (is_arith_imm(imm) || (v < 0 && v != INT64_MIN && is_arith_imm((uint64_t) -v))) {
+        int is_cmn = !is_arith_imm(imm);
+        start_ins(b, is_cmn ? "cmn" : "cmp");
+        emit_gpr(b, l->reg, size);
+        sep(b);
+        emit_arith_imm(b, is_cmn ? (uint64_t) -v : imm);
+        buf_push(b, '\n');
+        return;
+    }
+    encode_mov_imm(b, X16, size, imm);
+    start_ins(b, "cmp");
+    emit_gpr(b, l->reg, size);
+    sep(b);
+    emit_gpr(b, X16, size);
+    buf_push(b, '\n');
+}
+
+static void encode_fcmp(Buf *b, AsmIns *ins) {
+    start_ins(b, "fcmp");
+    emit_fpr(b, ins->l->reg, ins->l->size);
+    sep(b);
+    if (ins->r->k == OPR_IMM) {
+        EMIT(b, "#0.0");
+    } else {
+        emit_fpr(b, ins->r->reg, ins->l->size);
+    }
+    buf_push(b, '\n');
+}
+
+static void encode_cond(Buf *b, AsmIns *ins) {
+    if (ins->op >= A64_CSET && ins->op < A64_CSET + NUM_CONDS) {
+        start_ins(b, "cset");
+        emit_gpr(b, ins->l->reg, ins->l->size);
+        sep(b);
+        emit(b, COND_NAMES[ins->op - A64_CSET]);
+        buf_push(b, '\n');
+        return;
+    }
+    int is_fp = ins->op >= A64_FCSEL;
+    int cond = ins->op - (is_fp ? A64_FCSEL : A64_CSEL);
+    start_ins(b, is_fp ? "fcsel" : "csel");
+    emit_reg(b, ins->l, ins->l->size);
+    sep(b);
+    emit_reg(b, ins->r, ins->l->size);
+    sep(b);
+    emit_reg(b, ins->r2, ins->l->size);
+    sep(b);
+    emit(b, COND_NAMES[cond]);
+    buf_push(b, '\n');
+}
+
+// A call or tail call: straight to a label, through x16 from the GOT, or to
+// the address in a register
+static void encode_call(Buf *b, AsmIns *ins) {
+    int is_tail = ins->op == A64_TAIL_CALL;
+    AsmOpr *fn = ins->l;
+    switch (fn->k) {
+    case OPR_LABEL:
+        start_ins(b, is_tail ? "b" : "bl");
+        emit_sym(b, fn->label);
+        buf_push(b, '\n');
+        return;
+    case OPR_GOTPCREL:
+        encode_got_load(b, X16, fn->label, ":got:", ":got_lo12:");
+        start_ins(b, is_tail ? "br" : "blr");
+        emit_gpr(b, X16, R64);
+        buf_push(b, '\n');
+        return;
+    case OPR_GPR:
+        start_ins(b, is_tail ? "br" : "blr");
+        emit_gpr(b, fn->reg, R64);
+        buf_push(b, '\n');
+        return;
+    default: UNREACHABLE();
+    }
+}
+
+static char * exclusive_suffix(size_t bytes) {
+    return bytes == 1 ? "b" : bytes == 2 ? "h" : "";
+}
+
+// 'ldar' and 'stlr' (with a 'b' or 'h' for 1 and 2 bytes)
+static void encode_acq_rel(Buf *b, AsmIns *ins) {
+    int is_load = ins->op == A64_LDAR;
+    AsmOpr *reg = is_load ? ins->l : ins->r, *mem = is_load ? ins->r : ins->l;
+    buf_push(b, '\t');
+    buf_print(b, is_load ? "ldar" : "stlr");
+    buf_print(b, exclusive_suffix(mem->bytes));
+    buf_push(b, ' ');
+    emit_gpr(b, reg->reg, mem_reg_size(mem->bytes));
+    EMIT(b, ", [");
+    emit_gpr(b, mem->base, R64);
+    EMIT(b, "]\n");
+}
+
+static void emit_exclusive(Buf *b, char *op, size_t bytes) {
+    buf_push(b, '\t');
+    buf_print(b, op);
+    buf_print(b, exclusive_suffix(bytes));
+    buf_push(b, ' ');
+}
+
+// Read-modify-writes are a loop around 'ldaxr' and 'stlxr', with the old value
+// in x17 and the store's status in w16, which ends with the old value in 'l':
+//   1: ldaxr x17, [<addr>]
+//      <'add x17, x17, l', or 'cmp x17, l' and 'b.ne 2f'>
+//      stlxr w16, <new>, [<addr>]
+//      cbnz w16, 1b
+//   2: <'mov l, x17', or for an add, 'sub l, x17, l'>
+static void encode_rmw(Buf *b, AsmIns *ins) {
+    AsmOpr *l = ins->l, *mem = ins->r;
+    size_t bytes = mem->bytes;
+    int size = mem_reg_size(bytes);
+    EMIT(b, "1:");
+    emit_exclusive(b, "ldaxr", bytes);
+    emit_gpr(b, X17, size);
+    EMIT(b, ", [");
+    emit_gpr(b, mem->base, R64);
+    EMIT(b, "]\n");
+    int new = l->reg;
+    if (ins->op == A64_LDADD) {
+        start_ins(b, "add");
+        emit_gpr(b, X17, size);
+        sep(b);
+        emit_gpr(b, X17, size);
+        sep(b);
+        emit_gpr(b, l->reg, size);
+        buf_push(b, '\n');
+        new = X17;
+    } else if (ins->op == A64_CAS) {
+        start_ins(b, "cmp");
+        emit_gpr(b, X17, size);
+        sep(b);
+        emit_gpr(b, l->reg, size);
+        if (bytes < 4) { // The upper bits of 'l' are undefined
+            buf_print(b, bytes == 1 ? ", uxtb" : ", uxth");
+        }
+        EMIT(b, "\n\tb.ne 2f\n");
+        new = ins->r2->reg;
+    }
+    emit_exclusive(b, "stlxr", bytes);
+    emit_gpr(b, X16, R32);
+    sep(b);
+    emit_gpr(b, new, size);
+    EMIT(b, ", [");
+    emit_gpr(b, mem->base, R64);
+    EMIT(b, "]\n\tcbnz w16, 1b\n2:");
+    if (ins->op == A64_LDADD) {
+        start_ins(b, "sub");
+        emit_gpr(b, l->reg, size);
+        sep(b);
+        emit_gpr(b, X17, size);
+        sep(b);
+        emit_gpr(b, l->reg, size);
+    } else {
+        start_ins(b, "mov");
+        emit_gpr(b, l->reg, size);
+        sep(b);
+        emit_gpr(b, X17, size);
+    }
+    buf_push(b, '\n');
+}
+
+static void encode_ins(Buf *b, Global *g, AsmIns *ins) {
+    int op = ins->op;
+    if (op >= A64_CSET && op < A64_FCSEL + NUM_CONDS) {
+        encode_cond(b, ins);
+        return;
+    } else if (op >= A64_B_COND && op < A64_B_COND + NUM_CONDS) {
+        buf_push(b, '\t');
+        EMIT(b, "b.");
+        emit(b, COND_NAMES[op - A64_B_COND]);
+        buf_push(b, ' ');
+        emit_bb_label(b, g, ins->l->bb);
+        buf_push(b, '\n');
+        return;
+    }
+    switch (op) {
+    case A64_MOV:  encode_mov(b, ins); break;
+    case A64_FMOV: encode_fmov(b, ins); break;
+    case A64_SXTB: case A64_SXTH: case A64_SXTW:
+    case A64_UXTB: case A64_UXTH: case A64_UXTW:
+        encode_ext(b, ins);
+        break;
+    case A64_LDR:  encode_ldr(b, ins); break;
+    case A64_STR:  encode_str(b, ins); break;
+    case A64_LEA:  encode_lea(b, g, ins); break;
+    case A64_ADD: case A64_SUB: case A64_MUL: case A64_UMULH:
+    case A64_SDIV: case A64_UDIV: case A64_AND: case A64_ORR: case A64_EOR:
+    case A64_LSL: case A64_LSR: case A64_ASR:
+        encode_arith(b, ins);
+        break;
+    case A64_CLZ: case A64_RBIT: case A64_REV: case A64_REV16:
+        encode_unary(b, ins);
+        break;
+    case A64_CNT: // The number of bits set in each byte, added up
+        start_ins(b, "cnt");
+        emit_fpr_kind(b, ins->l->reg, 'v');
+        sep(b);
+        emit_fpr_kind(b, ins->l->reg, 'v');
+        buf_push(b, '\n');
+        start_ins(b, "addv");
+        emit_fpr_kind(b, ins->l->reg, 'b');
+        sep(b);
+        emit_fpr_kind(b, ins->l->reg, 'v');
+        buf_push(b, '\n');
+        break;
+    case A64_FADD: case A64_FSUB: case A64_FMUL: case A64_FDIV:
+        encode_fp_arith(b, ins);
+        break;
+    case A64_FCVT: case A64_SCVTF: case A64_FCVTZS:
+        encode_fp_conv(b, ins);
+        break;
+    case A64_CMP:  encode_cmp(b, ins); break;
+    case A64_FCMP: encode_fcmp(b, ins); break;
+    case A64_PUSH_FRAME: EMIT(b, "\tstp x29, x30, [sp, #-16]!\n"); break;
+    case A64_POP_FRAME:  EMIT(b, "\tldp x29, x30, [sp], #16\n"); break;
+    case A64_ALIGN_SP: // mov x16, sp; and sp, x16, #-<align>
+        EMIT(b, "\tmov x16, sp\n\tand sp, x16, #");
+        emit_hex(b, -ins->l->imm);
+        buf_push(b, '\n');
+        break;
+    case A64_B:
+        start_ins(b, "b");
+        emit_bb_label(b, g, ins->l->bb);
+        buf_push(b, '\n');
+        break;
+    case A64_BR:
+        start_ins(b, "br");
+        emit_gpr(b, ins->l->reg, R64);
+        buf_push(b, '\n');
+        break;
+    case A64_RET: EMIT(b, "\tret\n"); break;
+    case A64_BL: case A64_TAIL_CALL: encode_call(b, ins); break;
+    case A64_LDAR: case A64_STLR: encode_acq_rel(b, ins); break;
+    case A64_SWP: case A64_LDADD: case A64_CAS: encode_rmw(b, ins); break;
+    case A64_DMB:  EMIT(b, "\tdmb ish\n"); break;
+    case A64_PRFM: encode_prfm(b, ins); break;
+    case A64_BRK:  EMIT(b, "\tbrk #0x3e8\n"); break;
+    case A64_NOP:  EMIT(b, "\tnop\n"); break;
+    default: UNREACHABLE();
+    }
+}
+
+
+// ---- Functions -------------------------------------------------------------
+
+// The assembler pads code with 'nop's
+static void encode_align(Buf *b, int align) {
+    if (align > 1) {
+        EMIT(b, "\t.balign ");
+        emit_uint(b, (uint64_t) align);
+        buf_push(b, '\n');
+    }
+}
+
+static void encode_bb(Buf *b, Global *g, BB *bb) {
+    if (is_loop_start(bb)) {
+        encode_align(b, ALIGN_LOOPS);
+    }
+    emit_bb_label(b, g, bb);
+    EMIT(b, ":\n");
+    for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+        encode_ins(b, g, ins);
+    }
+}
+
+// Jump tables hold the offset of each BB from the start of the table (see
+// 'asm_switch'), and come before the function's label
+static void encode_jump_tables(Buf *b, Global *g) {
+    if (vec_len(g->fn->jump_tables) > 0) {
+        encode_align(b, 8);
+    }
+    for (size_t i = 0; i < vec_len(g->fn->jump_tables); i++) {
+        Vec *table = vec_get(g->fn->jump_tables, i);
+        emit_table_label(b, g, i);
+        EMIT(b, ":\n");
+        for (size_t j = 0; j < vec_len(table); j++) {
+            EMIT(b, "\t.quad ");
+            emit_bb_label(b, g, vec_get(table, j));
+            buf_push(b, '-');
+            emit_table_label(b, g, i);
+            buf_push(b, '\n');
+        }
+    }
+}
+
+static void number_bbs(Fn *fn) {
+    size_t i = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->n = i++;
+    }
+}
+
+static void encode_global_directive(Buf *b, Global *g) {
+    EMIT(b, "\t.globl ");
+    emit_sym(b, g->label);
+    buf_push(b, '\n');
+    if (is_hidden(g) && g->k != G_NONE) {
+        EMIT(b, "\t.hidden ");
+        emit_sym(b, g->label);
+        buf_push(b, '\n');
+    }
+}
+
+// '.type' and '.size' for the symbol table
+static void encode_type(Buf *b, Global *g) {
+    EMIT(b, "\t.type ");
+    emit_sym(b, g->label);
+    buf_print(b, g->k == G_FN_DEF ? ", %function\n" : ", %object\n");
+}
+
+static void encode_size(Buf *b, Global *g) {
+    EMIT(b, "\t.size ");
+    emit_sym(b, g->label);
+    sep(b);
+    if (g->k == G_FN_DEF) {
+        EMIT(b, ".-");
+        emit_sym(b, g->label);
+    } else {
+        emit_uint(b, g->t->size);
+    }
+    buf_push(b, '\n');
+}
+
+void a64_encode_fn(Buf *b, Global *g) {
+    if (g->linkage == LINK_EXTERN) {
+        encode_global_directive(b, g);
+    }
+    number_bbs(g->fn);
+    encode_jump_tables(b, g);
+    encode_align(b, ALIGN_FUNCTIONS);
+    encode_type(b, g);
+    emit_sym(b, g->label);
+    EMIT(b, ":\n");
+    for (BB *bb = g->fn->entry; bb; bb = bb->next) {
+        encode_bb(b, g, bb);
+    }
+    encode_size(b, g);
+    buf_push(b, '\n');
+}
+
+
+// ---- Sections and Globals --------------------------------------------------
+
+static void encode_section_header(Buf *b, int section, Global *g) {
+    char *label = g && has_own_section(section) ? g->label : NULL;
+    EMIT(b, "\t.section ");
+    buf_print(b, section_name(section, label, g ? g->fn_attrs : 0));
+    switch (section) {
+    case SEC_TEXT:    EMIT(b, ",\"ax\",@progbits\n"); return;
+    case SEC_RODATA:  EMIT(b, ",\"a\",@progbits\n"); return;
+    case SEC_CSTRING: EMIT(b, ",\"aMS\",@progbits,1\n"); return;
+    case SEC_DATA:    EMIT(b, ",\"aw\",@progbits\n"); return;
+    case SEC_BSS:     EMIT(b, ",\"aw\",@nobits\n"); return;
+    case SEC_TDATA:   EMIT(b, ",\"awT\",@progbits\n"); return;
+    case SEC_TBSS:    EMIT(b, ",\"awT\",@nobits\n"); return;
+    case SEC_CST4:    EMIT(b, ",\"aM\",@progbits,4\n"); return;
+    case SEC_CST8:    EMIT(b, ",\"aM\",@progbits,8\n"); return;
+    default: UNREACHABLE();
+    }
+}
+
+#define STREAM_AT (64 * 1024) // Bytes of text to gather before writing them
+
+// Writes each function out as it goes, as 'encode_nasm' does
+static void encode_fns(FILE *out, Buf *b, Vec *globals, Buf **fn_text) {
+    int written_header = 0;
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k != G_FN_DEF) {
+            continue; // Not a function definition
+        }
+        if (FUNCTION_SECTIONS) {
+            encode_section_header(b, SEC_TEXT, g);
+            written_header = 0;
+        } else if (!written_header) {
+            EMIT(b, "\t.text\n");
+            written_header = 1;
+        }
+        if (fn_text && fn_text[i]) { // Already encoded
+            buf_nprint(b, fn_text[i]->data, fn_text[i]->len);
+        } else {
+            a64_encode_fn(b, g);
+        }
+        if (b->len >= STREAM_AT) {
+            fwrite(b->data, 1, b->len, out);
+            b->len = 0;
+        }
+    }
+}
+
+#define MIN_ZERO_RUN 16 // Shorter runs of zeros stay in an '.ascii'
+#define BYTES_PER_LINE 64
+
+static int is_zero_run(char *s, size_t len) {
+    if (len < MIN_ZERO_RUN) {
+        return 0;
+    }
+    for (size_t i = 0; i < MIN_ZERO_RUN; i++) {
+        if (s[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void encode_zeros(Buf *b, size_t n) {
+    EMIT(b, "\t.zero ");
+    emit_uint(b, n);
+    buf_push(b, '\n');
+}
+
+// '.ascii' lines, with anything that isn't printable as an octal escape, and
+// long runs of zeros as '.zero'
+static void encode_bytes(Buf *b, char *s, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        if (is_zero_run(&s[i], len - i)) {
+            size_t n = 0;
+            while (i + n < len && s[i + n] == 0) {
+                n++;
+            }
+            encode_zeros(b, n);
+            i += n;
+            continue;
+        }
+        EMIT(b, "\t.ascii \"");
+        size_t end = len - i > BYTES_PER_LINE ? i + BYTES_PER_LINE : len;
+        while (i < end && !(s[i] == 0 && is_zero_run(&s[i], len - i))) {
+            unsigned char c = (unsigned char) s[i++];
+            if (c >= ' ' && c <= '~' && c != '"' && c != '\\') {
+                buf_push(b, (char) c);
+            } else {
+                buf_push(b, '\\');
+                buf_push(b, (char) ('0' + (c >> 6)));
+                buf_push(b, (char) ('0' + ((c >> 3) & 7)));
+                buf_push(b, (char) ('0' + (c & 7)));
+            }
+        }
+        EMIT(b, "\"\n");
+    }
+}
+
+static void encode_ptr(Buf *b, char *label, int64_t offset) {
+    EMIT(b, "\t.quad ");
+    emit_sym_offset(b, label, offset);
+    buf_push(b, '\n');
+}
+
+// Bytes 'from' up to 'to' of an initialiser (which are zero after 'num_bytes')
+static void encode_init_range(Buf *b, Global *g, size_t from, size_t to) {
+    if (from < g->num_bytes) {
+        size_t end = to < g->num_bytes ? to : g->num_bytes;
+        encode_bytes(b, &g->bytes[from], end - from);
+        from = end;
+    }
+    if (from < to) {
+        encode_zeros(b, to - from);
+    }
+}
+
+static char *DATA_DIRECTIVES[] = {
+    [1] = "\t.byte ", [2] = "\t.hword ", [4] = "\t.word ", [8] = "\t.quad ",
+};
+
+// Long doubles are doubles (as everywhere else in Cosec)
+static void encode_global_val(Buf *b, Global *g) {
+    switch (g->k) {
+    case G_IMM:
+        buf_print(b, DATA_DIRECTIVES[g->t->size]);
+        emit_uint(b, g->imm);
+        buf_push(b, '\n');
+        break;
+    case G_FP: {
+        uint64_t bits;
+        if (g->t->size == 4) {
+            float f = (float) g->fp;
+            uint32_t bits32;
+            memcpy(&bits32, &f, sizeof(f));
+            bits = bits32;
+        } else {
+            memcpy(&bits, &g->fp, sizeof(bits));
+        }
+        buf_print(b, DATA_DIRECTIVES[g->t->size]);
+        emit_hex(b, bits);
+        buf_push(b, '\n');
+        break;
+    }
+    case G_INIT: {
+        size_t offset = 0;
+        for (size_t i = 0; i < vec_len(g->relocs); i++) {
+            InitReloc *r = vec_get(g->relocs, i);
+            encode_init_range(b, g, offset, r->offset);
+            encode_ptr(b, r->g->label, r->addend);
+            offset = r->offset + 8;
+        }
+        encode_init_range(b, g, offset, g->t->size);
+        break;
+    }
+    case G_PTR: encode_ptr(b, g->g->label, g->offset); break;
+    default: UNREACHABLE();
+    }
+}
+
+static void encode_global(Buf *b, Global *g, int section) {
+    if (g->linkage != LINK_STATIC) {
+        encode_global_directive(b, g);
+    }
+    if (g->k == G_NONE) {
+        return;
+    }
+    encode_align(b, g->t->align);
+    encode_type(b, g);
+    encode_size(b, g);
+    emit_sym(b, g->label);
+    EMIT(b, ":\n");
+    if (section == SEC_BSS || section == SEC_TBSS) {
+        encode_zeros(b, g->t->size);
+    } else {
+        encode_global_val(b, g);
+    }
+}
+
+static void encode_section(Buf *b, Vec *globals, int section) {
+    int written_header = 0;
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        int g_section = global_section(g);
+        if (g_section == SEC_UNDEF) {
+            g_section = SEC_DATA; // Just the '.globl' directive
+        }
+        if (g_section != section) {
+            continue;
+        }
+        if (has_own_section(section) && g->k != G_NONE) {
+            encode_section_header(b, section, g);
+            written_header = 0;
+        } else if (!written_header) {
+            encode_section_header(b, section, NULL);
+            written_header = 1;
+        }
+        encode_global(b, g, section);
+    }
+}
+
+// Constants for 'fmov's that can't take them as an immediate, in sections the
+// linker merges duplicates across files in
+static void encode_fp_pool(Buf *b, Vec *globals) {
+    Vec *f64s = fp_pool(globals, OPR_F64), *f32s = fp_pool(globals, OPR_F32);
+    if (vec_len(f64s) > 0) {
+        encode_section_header(b, SEC_CST8, NULL);
+        encode_align(b, 8);
+    }
+    for (size_t i = 0; i < vec_len(f64s); i++) {
+        uint64_t *fp = vec_get(f64s, i);
+        emit_pool_label(b, OPR_F64, *fp);
+        EMIT(b, ":\n\t.quad ");
+        emit_hex(b, *fp);
+        buf_push(b, '\n');
+    }
+    if (vec_len(f32s) > 0) {
+        encode_section_header(b, SEC_CST4, NULL);
+        encode_align(b, 4);
+    }
+    for (size_t i = 0; i < vec_len(f32s); i++) {
+        uint64_t *fp = vec_get(f32s, i);
+        emit_pool_label(b, OPR_F32, *fp);
+        EMIT(b, ":\n\t.word ");
+        emit_hex(b, *fp);
+        buf_push(b, '\n');
+    }
+}
+
+static void encode_globals(Buf *b, Vec *globals) {
+    encode_section(b, globals, SEC_RODATA);
+    encode_section(b, globals, SEC_CSTRING);
+    encode_fp_pool(b, globals);
+    encode_section(b, globals, SEC_DATA);
+    encode_section(b, globals, SEC_BSS);
+    encode_section(b, globals, SEC_TDATA);
+    encode_section(b, globals, SEC_TBSS);
+}
+
+void a64_encode_with(FILE *out, Vec *globals, Buf **fn_text) {
+    Buf *b = buf_new();
+    encode_fns(out, b, globals, fn_text);
+    encode_globals(b, globals);
+    EMIT(b, "\t.section .note.GNU-stack,\"\",@progbits\n"); // No executable stack
+    flush(out, b);
+}
@@ -0,0 +1,272 @@
+
+#include "alias.h"
+
+int STRICT_ALIASING = 1;
+
+// A memory location accessed by an instruction
+typedef struct {
+    IrIns *ptr;
+    uint64_t size; // 0 if not known
+    IrType *t;     // Type loaded or stored; NULL for copies and zeroing
+} Loc;
+
+Ptr decompose_ptr(IrIns *ins) {
+    Ptr p = { .base = ins, .offset = 0, .obj = NULL };
+    while (1) {
+        if (ins->op == IR_BITCAST) {
+            ins = ins->l;
+        } else if (ins->op == IR_PTRADD && ins->offset->op == IR_IMM) {
+            p.offset += (int64_t) ins->offset->imm;
+            ins = ins->base;
+        } else {
+            break;
+        }
+        p.base = ins;
+    }
+    while (ins->op == IR_BITCAST || ins->op == IR_PTRADD) {
+        ins = ins->op == IR_BITCAST ? ins->l : ins->base;
+    }
+    if (ins->op == IR_ALLOC || ins->op == IR_GLOBAL || ins->op == IR_FARG) {
+        p.obj = ins;
+    }
+    return p;
+}
+
+
+// ---- Alignment -------------------------------------------------------------
+
+static size_t min_align(size_t a, size_t b) {
+    return a < b ? a : b;
+}
+
+// The largest power of 2 (up to 'MAX_ALIGN') that 'v' is a multiple of
+static size_t imm_align(uint64_t v) {
+    return v == 0 ? MAX_ALIGN : min_align((size_t) (v & -v), MAX_ALIGN);
+}
+
+// The largest power of 2 that an offset is known to be a multiple of, e.g.,
+// 'ext(i) * 16' for an array of vectors
+static size_t offset_align(IrIns *offset) {
+    switch (offset->op) {
+    case IR_IMM: return imm_align(offset->imm);
+    case IR_SEXT: case IR_ZEXT: return offset_align(offset->l);
+    case IR_ADD: case IR_SUB:
+        return min_align(offset_align(offset->l), offset_align(offset->r));
+    case IR_MUL:
+        if (offset->r->op == IR_IMM) {
+            return min_align(offset_align(offset->l) * imm_align(offset->r->imm), MAX_ALIGN);
+        }
+        return 1;
+    case IR_SHL:
+        if (offset->r->op == IR_IMM && offset->r->imm < 8) {
+            return min_align(offset_align(offset->l) << offset->r->imm, MAX_ALIGN);
+        }
+        return 1;
+    default: return 1;
+    }
+}
+
+size_t ptr_align(IrIns *ptr) {
+    switch (ptr->op) {
+    case IR_ALLOC:  return min_align(ptr->alloc_t->align, MAX_ALIGN);
+    case IR_GLOBAL: return min_align(ptr->g->t->align, MAX_ALIGN);
+    case IR_PTRADD:
+        return min_align(ptr_align(ptr->base), offset_align(ptr->offset));
+    case IR_BITCAST:
+        if (ptr->l->t->k == IRT_PTR) {
+            size_t align = ptr_align(ptr->l);
+            return ptr->assumed_align > align ? min_align(ptr->assumed_align, MAX_ALIGN) : align;
+        }
+        return 1;
+    default: return 1;
+    }
+}
+
+
+// ---- Escape Analysis -------------------------------------------------------
+
+// Whether 'ins' only accesses the memory its operand 'opr' points to (or
+// derives another pointer into it), rather than letting the address escape
+static int is_contained_use(IrIns *ins, IrIns **opr) {
+    switch (ins->op) {
+    case IR_LOAD:    return opr == &ins->src;
+    case IR_STORE:   return opr == &ins->dst;
+    case IR_COPY:    return opr == &ins->src || opr == &ins->dst;
+    case IR_ZERO:    return opr == &ins->ptr;
+    case IR_PREFETCH: return opr == &ins->ptr;
+    case IR_PTRADD:  return opr == &ins->base;
+    case IR_BITCAST: return 1;
+    default:         return 0;
+    }
+}
+
+static void mark_escape(IrIns *ptr) {
+    if (ptr->t->k != IRT_PTR) {
+        return;
+    }
+    IrIns *obj = decompose_ptr(ptr).obj;
+    if (obj && obj->op == IR_ALLOC) {
+        obj->escapes = 1;
+    }
+}
+
+void analyse_escapes(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_ALLOC) {
+                ins->escapes = ins->count != NULL; // Dynamic ones aren't worth it
+            }
+        }
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_PHI) { // A pointer that could be into anything
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    mark_escape(vec_get(ins->defs, i));
+                }
+                continue;
+            }
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                if (!is_contained_use(ins, oprs[i])) {
+                    mark_escape(*oprs[i]);
+                }
+            }
+        }
+    }
+}
+
+
+// ---- Queries ---------------------------------------------------------------
+
+static uint64_t const_size(IrIns *size) {
+    return size->op == IR_IMM ? size->imm : 0;
+}
+
+// Returns the number of locations accessed by 'ins'; only writes if 'writes'
+static int locs_of(IrIns *ins, Loc locs[2], int writes) {
+    switch (ins->op) {
+    case IR_LOAD:
+        if (writes) return 0;
+        locs[0] = (Loc) { ins->src, ins->t->size, ins->t };
+        return 1;
+    case IR_STORE:
+        locs[0] = (Loc) { ins->dst, ins->src->t->size, ins->src->t };
+        return 1;
+    case IR_COPY:
+        locs[0] = (Loc) { ins->dst, const_size(ins->len), NULL };
+        if (writes) return 1;
+        locs[1] = (Loc) { ins->src, const_size(ins->len), NULL };
+        return 2;
+    case IR_ZERO:
+        locs[0] = (Loc) { ins->ptr, const_size(ins->size), NULL };
+        return 1;
+    default: UNREACHABLE();
+    }
+    return 0;
+}
+
+static int is_identified(IrIns *obj) { // Known to be separate from the others
+    return obj && (obj->op == IR_ALLOC || obj->op == IR_GLOBAL);
+}
+
+static int is_local(IrIns *obj) { // Only reached through pointers derived from it
+    return obj && obj->op == IR_ALLOC && !obj->escapes;
+}
+
+static int same_obj(IrIns *a, IrIns *b) {
+    if (a->op == IR_GLOBAL && b->op == IR_GLOBAL) {
+        return a->g == b->g;
+    }
+    return a == b;
+}
+
+static int overlaps(int64_t a, uint64_t a_size, int64_t b, uint64_t b_size) {
+    if (a_size == 0 || b_size == 0) {
+        return 1; // Size not known
+    }
+    return a < b + (int64_t) b_size && b < a + (int64_t) a_size;
+}
+
+static int types_may_alias(IrType *a, IrType *b) {
+    if (!STRICT_ALIASING || !a || !b) {
+        return 1;
+    }
+    a = a->k == IRT_VEC ? a->elem : a;
+    b = b->k == IRT_VEC ? b->elem : b;
+    return a->k == IRT_I8 || b->k == IRT_I8 || a->k == b->k;
+}
+
+static int locs_may_alias(Loc *a, Loc *b) {
+    Ptr pa = decompose_ptr(a->ptr), pb = decompose_ptr(b->ptr);
+    if (pa.base == pb.base) {
+        return overlaps(pa.offset, a->size, pb.offset, b->size);
+    }
+    if (pa.obj && pb.obj) {
+        if (same_obj(pa.obj, pb.obj)) {
+            return 1; // At some unknown offsets into the same object
+        }
+        if ((is_identified(pa.obj) && is_identified(pb.obj)) ||
+                (pa.obj->op == IR_FARG && pa.obj->is_restrict) ||
+                (pb.obj->op == IR_FARG && pb.obj->is_restrict)) {
+            return 0;
+        }
+    }
+    if ((is_local(pa.obj) && pa.obj != pb.obj) ||
+            (is_local(pb.obj) && pb.obj != pa.obj)) {
+        return 0;
+    }
+    return types_may_alias(a->t, b->t);
+}
+
+// Calls (and inline assembly, and atomics) can touch anything a pointer could
+// lead to, which is everything except stack allocations that haven't escaped
+static int is_call(IrIns *ins) {
+    return ins->op == IR_CALL || ins->op == IR_ASM || is_atomic(ins);
+}
+
+static int call_may_access(IrIns *ins, int writes) {
+    if (is_call(ins)) {
+        return 1;
+    }
+    Loc locs[2];
+    int num_locs = locs_of(ins, locs, writes);
+    for (int i = 0; i < num_locs; i++) {
+        if (!is_local(decompose_ptr(locs[i].ptr).obj)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int accesses_may_alias(IrIns *a, IrIns *b, int a_writes) {
+    if (is_call(a)) {
+        return call_may_access(b, 0);
+    } else if (is_call(b)) {
+        return call_may_access(a, a_writes);
+    }
+    Loc la[2], lb[2];
+    int num_a = locs_of(a, la, a_writes);
+    int num_b = locs_of(b, lb, 0);
+    for (int i = 0; i < num_a; i++) {
+        for (int j = 0; j < num_b; j++) {
+            if (locs_may_alias(&la[i], &lb[j])) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int may_alias(IrIns *a, IrIns *b) {
+    return accesses_may_alias(a, b, 0);
+}
+
+int may_clobber(IrIns *ins, IrIns *access) {
+    if (ins->op != IR_STORE && ins->op != IR_COPY && ins->op != IR_ZERO &&
+            !is_call(ins)) {
+        return 0;
+    }
+    return accesses_may_alias(ins, access, 1);
+}
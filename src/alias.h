@@ -0,0 +1,53 @@
+
+#ifndef COSEC_ALIAS_H
+#define COSEC_ALIAS_H
+
+#include "compile.h"
+
+// Alias analysis, for passes that move or remove memory accesses. Two accesses
+// can't overlap if:
+// * they're into different objects: distinct stack allocations or globals, a
+//   stack allocation whose address never escapes and a pointer that didn't
+//   come from it, or a 'restrict' parameter and anything else that's known
+// * they're at disjoint constant offsets from the same pointer
+// * they load or store different scalar types (strict aliasing; 'char'
+//   accesses can alias anything, and a vector counts as its element type),
+//   unless both are into the same known object, so type punning through a
+//   local or global union still works
+
+// '-fno-strict-aliasing': don't use the types of accesses
+extern int STRICT_ALIASING;
+
+// A pointer broken down into a 'base' plus a constant 'offset', by looking
+// through IR_PTRADDs with constant offsets (and IR_BITCASTs). Looking through
+// IR_PTRADDs with any offset then leads to the object it points into: an
+// IR_ALLOC, IR_GLOBAL, or IR_FARG, or NULL if it's not known (e.g., a pointer
+// that was loaded from memory, returned by a call, or merged by a phi)
+typedef struct {
+    IrIns *base;
+    int64_t offset;
+    IrIns *obj;
+} Ptr;
+
+Ptr decompose_ptr(IrIns *ptr);
+
+// The alignment 'ptr' is known to have, from the object it points into, the
+// offsets added on the way, and any '__builtin_assume_aligned'. Capped at
+// 'MAX_ALIGN', which is all a stack slot's sure to get (see 'alloc_stack_slot')
+size_t ptr_align(IrIns *ptr);
+
+// Sets 'escapes' on each IR_ALLOC whose address is used for anything other
+// than loading, storing, copying, or deriving another pointer into it. Has to
+// be re-run when new instructions use an IR_ALLOC
+void analyse_escapes(Fn *fn);
+
+// Whether the memory read or written by 'a' and 'b' (IR_LOADs, IR_STOREs,
+// IR_COPYs, IR_ZEROs, or IR_CALLs, which could touch anything that's escaped)
+// might overlap. Requires 'analyse_escapes'
+int may_alias(IrIns *a, IrIns *b);
+
+// Whether 'ins' writes to memory that 'access' (e.g., an IR_LOAD) reads, or
+// that 'access' writes if it's a store
+int may_clobber(IrIns *ins, IrIns *access);
+
+#endif
@@ -0,0 +1,387 @@
+#include "analysis.h"
+
+// The dominator algorithm is from 'A Simple, Fast Dominance Algorithm', Keith
+// D. Cooper, Timothy J. Harvey, and Ken Kennedy, 2001:
+//   https://www.cs.rice.edu/~keith/EMBED/dom.pdf
+
+void analyse(Vec *globals) {
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k == G_FN_DEF) {
+            require_analyses(g->fn, A_ALL);
+        }
+    }
+}
+
+int require_analyses(Fn *fn, int analyses) {
+    if (analyses & A_LOOPS) { // Each analysis needs the ones before it
+        analyses |= A_DOMINATORS;
+    }
+    if (analyses & A_DOMINATORS) {
+        analyses |= A_CFG;
+    }
+    int ran = 0;
+    if ((analyses & A_CFG) && !(fn->analyses & A_CFG)) {
+        analyse_cfg(fn); // Marks the others as stale
+        ran |= A_CFG;
+    }
+    if ((analyses & A_DOMINATORS) && !(fn->analyses & A_DOMINATORS)) {
+        analyse_dominators(fn);
+        ran |= A_DOMINATORS;
+    }
+    if ((analyses & A_LOOPS) && !(fn->analyses & A_LOOPS)) {
+        analyse_loops(fn);
+        ran |= A_LOOPS;
+    }
+    return ran;
+}
+
+
+// ---- Control Flow Graph ----------------------------------------------------
+
+static void add_pair(BB *before, BB *after) {
+    vec_push(before->succ, after);
+    vec_push(after->pred, before);
+}
+
+static int has_succ(BB *bb, BB *succ) {
+    for (size_t i = 0; i < vec_len(bb->succ); i++) {
+        if (vec_get(bb->succ, i) == succ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void analyse_cfg(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        vec_empty(bb->pred);
+        vec_empty(bb->succ);
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        IrIns *last = bb->ir_last;
+        if (last && last->op == IR_BR) { // Unconditional jump
+            add_pair(bb, last->br); // One successor
+        } else if (last && last->op == IR_CONDBR) { // Conditional jump
+            add_pair(bb, last->true); // Two successors
+            add_pair(bb, last->false);
+        } else if (last && last->op == IR_SWITCH) { // Jump table
+            add_pair(bb, last->default_br);
+            for (size_t i = 0; i < vec_len(last->table); i++) {
+                BB *target = vec_get(last->table, i);
+                if (!has_succ(bb, target)) { // Once per successor
+                    add_pair(bb, target);
+                }
+            }
+        } else if (last && last->op == IR_INDIRECT_BR) { // 'goto *'
+            for (size_t i = 0; i < vec_len(last->targets); i++) {
+                add_pair(bb, vec_get(last->targets, i)); // Already distinct
+            }
+        } // Otherwise, no successors
+    }
+    fn->analyses = A_CFG;
+}
+
+
+// ---- Reverse Postorder -----------------------------------------------------
+
+Vec * rev_postorder(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->rpo = -1; // Not visited
+    }
+
+    // Iterative depth-first search (functions can have a lot of BBs); while a
+    // BB is on the stack, 'rpo' is the index of the next successor to visit
+    Vec *postorder = vec_new();
+    Vec *stack = vec_new();
+    fn->entry->rpo = 0;
+    vec_push(stack, fn->entry);
+    while (vec_len(stack) > 0) {
+        BB *bb = vec_tail(stack);
+        if (bb->rpo < (int) vec_len(bb->succ)) {
+            BB *succ = vec_get(bb->succ, bb->rpo++);
+            if (succ->rpo == -1) {
+                succ->rpo = 0;
+                vec_push(stack, succ);
+            }
+        } else {
+            vec_pop(stack);
+            vec_push(postorder, bb);
+        }
+    }
+
+    Vec *rpo = vec_new();
+    for (size_t i = vec_len(postorder); i > 0; i--) {
+        BB *bb = vec_get(postorder, i - 1);
+        bb->rpo = (int) vec_len(rpo);
+        vec_push(rpo, bb);
+    }
+    vec_free(postorder);
+    vec_free(stack);
+    return rpo;
+}
+
+
+// ---- Dominators ------------------------------------------------------------
+
+// Walks up the dominator tree from 'b1' and 'b2' until they meet
+static BB * intersect(BB *b1, BB *b2) {
+    while (b1 != b2) {
+        while (b1->rpo > b2->rpo) {
+            b1 = b1->idom;
+        }
+        while (b2->rpo > b1->rpo) {
+            b2 = b2->idom;
+        }
+    }
+    return b1;
+}
+
+static void dominator_tree(Vec *rpo) {
+    BB *entry = vec_get(rpo, 0);
+    entry->idom = entry; // Only while computing
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (size_t i = 1; i < vec_len(rpo); i++) {
+            BB *bb = vec_get(rpo, i);
+            BB *new_idom = NULL;
+            for (size_t j = 0; j < vec_len(bb->pred); j++) {
+                BB *pred = vec_get(bb->pred, j);
+                if (!pred->idom) {
+                    continue; // Not processed yet (or unreachable)
+                }
+                new_idom = new_idom ? intersect(pred, new_idom) : pred;
+            }
+            if (bb->idom != new_idom) {
+                bb->idom = new_idom;
+                changed = 1;
+            }
+        }
+    }
+    entry->idom = NULL;
+    for (size_t i = 1; i < vec_len(rpo); i++) {
+        BB *bb = vec_get(rpo, i);
+        vec_push(bb->idom->dom_children, bb);
+    }
+}
+
+// A BB is in the dominance frontier of every BB on the path up the dominator
+// tree from each of its predecessors to its immediate dominator
+static void dominance_frontiers(Vec *rpo) {
+    for (size_t i = 0; i < vec_len(rpo); i++) {
+        BB *bb = vec_get(rpo, i);
+        if (vec_len(bb->pred) < 2) {
+            continue;
+        }
+        for (size_t j = 0; j < vec_len(bb->pred); j++) {
+            BB *runner = vec_get(bb->pred, j);
+            if (runner->rpo == -1) {
+                continue; // Unreachable
+            }
+            while (runner != bb->idom) {
+                Vec *df = runner->dom_frontier;
+                if (vec_len(df) == 0 || vec_tail(df) != bb) {
+                    vec_push(df, bb);
+                }
+                runner = runner->idom;
+            }
+        }
+    }
+}
+
+void analyse_dominators(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->idom = NULL;
+        vec_empty(bb->dom_children);
+        vec_empty(bb->dom_frontier);
+    }
+    Vec *rpo = rev_postorder(fn);
+    dominator_tree(rpo);
+    dominance_frontiers(rpo);
+    vec_free(rpo);
+    fn->analyses = (fn->analyses & A_CFG) | A_DOMINATORS;
+}
+
+int dominates(BB *a, BB *b) {
+    while (b && b != a) {
+        b = b->idom;
+    }
+    return b == a;
+}
+
+
+// ---- Loops -----------------------------------------------------------------
+
+// A natural loop is formed by a back edge: one to a header that dominates the
+// BB it comes from. The loop's BBs are everything that can reach the back edge
+// without going through the header
+static void find_loop_bbs(Loop *loop, BB *latch) {
+    Vec *stack = vec_new();
+    vec_push(stack, latch);
+    while (vec_len(stack) > 0) {
+        BB *bb = vec_pop(stack);
+        if (bb->loop == loop || bb->rpo == -1) {
+            continue; // Already found, or unreachable
+        }
+        bb->loop = loop;
+        vec_push(loop->bbs, bb);
+        for (size_t i = 0; i < vec_len(bb->pred); i++) {
+            vec_push(stack, vec_get(bb->pred, i));
+        }
+    }
+    vec_free(stack);
+}
+
+static Loop * new_loop(BB *header) {
+    Loop *loop = arena_alloc(ARENA_IR_FN, sizeof(Loop));
+    loop->header = header;
+    loop->parent = header->loop; // Innermost loop found so far
+    loop->depth = loop->parent ? loop->parent->depth + 1 : 1;
+    loop->bbs = vec_new();
+    vec_push(loop->bbs, header);
+    header->loop = loop;
+    return loop;
+}
+
+// Headers are visited in reverse postorder, so an enclosing loop (whose header
+// dominates the nested loop's) is always found first, and each BB ends up
+// pointing at the innermost loop it's in. Loops that share a header are merged
+void analyse_loops(Fn *fn) {
+    vec_empty(fn->loops);
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->loop = NULL;
+    }
+    Vec *rpo = rev_postorder(fn);
+    for (size_t i = 0; i < vec_len(rpo); i++) {
+        BB *header = vec_get(rpo, i);
+        Loop *loop = NULL;
+        for (size_t j = 0; j < vec_len(header->pred); j++) {
+            BB *pred = vec_get(header->pred, j);
+            if (pred->rpo == -1 || !dominates(header, pred)) {
+                continue; // Not a back edge
+            }
+            if (!loop) {
+                loop = new_loop(header);
+                vec_push(fn->loops, loop);
+            }
+            find_loop_bbs(loop, pred);
+        }
+    }
+    vec_free(rpo);
+    fn->analyses |= A_LOOPS;
+}
+
+int in_loop(BB *bb, Loop *loop) {
+    for (Loop *l = bb->loop; l; l = l->parent) {
+        if (l == loop) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+BB * find_preheader(Loop *loop) {
+    BB *outside = NULL;
+    for (size_t i = 0; i < vec_len(loop->header->pred); i++) {
+        BB *pred = vec_get(loop->header->pred, i);
+        if (in_loop(pred, loop)) {
+            continue;
+        } else if (outside) {
+            return NULL; // More than one way in
+        }
+        outside = pred;
+    }
+    return (outside && outside->ir_last->op == IR_BR) ? outside : NULL;
+}
+
+int is_innermost(Loop *loop) {
+    for (size_t i = 0; i < vec_len(loop->bbs); i++) {
+        BB *bb = vec_get(loop->bbs, i);
+        if (bb->loop != loop) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+Vec * straight_body(Loop *loop) {
+    IrIns *br = loop->header->ir_last;
+    if (br->op != IR_CONDBR || !in_loop(br->true, loop) || in_loop(br->false, loop)) {
+        return NULL;
+    }
+    Vec *body = vec_new();
+    size_t max = vec_len(loop->bbs) - 1;
+    for (BB *bb = br->true; bb != loop->header; bb = bb->ir_last->br) {
+        if (vec_len(body) == max || vec_len(bb->pred) != 1 ||
+                bb->ir_last->op != IR_BR) {
+            vec_free(body);
+            return NULL;
+        }
+        vec_push(body, bb);
+    }
+    if (vec_len(body) != max || max == 0) {
+        vec_free(body);
+        return NULL;
+    }
+    return body;
+}
+
+int is_unit_step(IrIns *iv, IrIns *next) {
+    return next->op == IR_ADD && next->l == iv && next->r->op == IR_IMM &&
+           next->r->imm == 1;
+}
+
+IrIns * match_loop_header(Loop *loop, BB *latch) {
+    BB *h = loop->header;
+    IrIns *cond = h->ir_head;
+    for (; cond->op == IR_PHI; cond = cond->next) {
+        if (vec_len(cond->preds) != 2) {
+            return NULL;
+        }
+    }
+    if ((cond->op != IR_SLT && cond->op != IR_ULT) || cond->next != h->ir_last ||
+            h->ir_last->cond != cond) {
+        return NULL;
+    }
+    IrIns *iv = cond->l;
+    if (iv->op != IR_PHI || iv->bb != h || in_loop(cond->r->bb, loop) ||
+            !is_unit_step(iv, phi_def(iv, latch))) {
+        return NULL;
+    }
+    return cond;
+}
+
+void count_uses(Loop *loop, int *uses) {
+    for (size_t i = 0; i < vec_len(loop->bbs); i++) {
+        BB *bb = vec_get(loop->bbs, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_PHI) {
+                for (size_t j = 0; j < vec_len(ins->defs); j++) {
+                    uses[((IrIns *) vec_get(ins->defs, j))->n]++;
+                }
+                continue;
+            }
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int j = 0; j < num_oprs; j++) {
+                uses[(*oprs[j])->n]++;
+            }
+        }
+    }
+}
+
+int loop_depth(BB *bb) {
+    return bb->loop ? bb->loop->depth : 0;
+}
+
+Loop * common_loop(Loop *a, Loop *b) {
+    while (a != b) {
+        if (!b || (a && a->depth > b->depth)) {
+            a = a->parent;
+        } else {
+            b = b->parent;
+        }
+    }
+    return a;
+}
@@ -0,0 +1,72 @@
+
+#ifndef COSEC_ANALYSIS_H
+#define COSEC_ANALYSIS_H
+
+#include "compile.h"
+
+// Control flow analyses over a function's BBs, shared by the optimisation
+// passes and the assembler. Each one fills in fields on 'BB' (see 'compile.h')
+// and has to be re-run if the CFG changes. 'Fn.analyses' records which ones
+// are up to date: running one marks it as up to date, and the ones that
+// depend on it as stale.
+
+enum {
+    A_CFG = 1,
+    A_DOMINATORS = 2,
+    A_LOOPS = 4,
+    A_ALL = A_CFG | A_DOMINATORS | A_LOOPS,
+};
+
+// Brings all the analyses below up to date on every function. Passes that
+// change the CFG keep them up to date (or re-run them)
+void analyse(Vec *globals);
+
+// Runs whichever of 'analyses' (a set of 'A_*') are stale on 'fn', along with
+// the stale ones they depend on, and returns the set it ran
+int require_analyses(Fn *fn, int analyses);
+
+// Populates 'pred' and 'succ' for each BB
+void analyse_cfg(Fn *fn);
+
+// Numbers the BBs reachable from the entry in reverse postorder (in 'rpo'),
+// and returns them in that order. Requires 'analyse_cfg'
+Vec * rev_postorder(Fn *fn); // of 'BB *'
+
+// Computes the dominator tree ('idom' and 'dom_children') and dominance
+// frontiers. Requires 'analyse_cfg'
+void analyse_dominators(Fn *fn);
+int dominates(BB *a, BB *b); // Whether 'a' dominates 'b'
+
+// Finds the natural loops ('fn->loops'), their nesting, and the innermost loop
+// containing each BB ('loop'). Requires 'analyse_dominators'
+void analyse_loops(Fn *fn);
+int loop_depth(BB *bb); // 0 if 'bb' isn't in a loop
+int in_loop(BB *bb, Loop *loop); // Including in a loop nested inside it
+Loop * common_loop(Loop *a, Loop *b); // Innermost loop containing both
+
+// A loop's preheader is the only BB that enters it from outside, and always
+// branches to the header. Returns NULL if it doesn't have one (see 'licm')
+BB * find_preheader(Loop *loop);
+
+// Whether no other loop is nested inside 'loop'
+int is_innermost(Loop *loop);
+
+// The BBs of a loop whose body is a straight line of BBs from the header's
+// true branch back round to the header (which its false branch leaves), in
+// order; or NULL. The last one is the latch
+Vec * straight_body(Loop *loop); // of 'BB *'
+
+// Whether 'next' is the induction variable 'iv' plus 1
+int is_unit_step(IrIns *iv, IrIns *next);
+
+// The 'i < n' (or unsigned) that exits a loop with a straight body, if its
+// header holds only phis (from the preheader and 'latch'), then that, then the
+// branch on it; where 'i' is one of the phis and goes up by 1 every
+// iteration, and 'n' is invariant. Otherwise NULL
+IrIns * match_loop_header(Loop *loop, BB *latch);
+
+// Adds each instruction's uses by the ones in 'loop' (including its phis) to
+// 'uses', indexed by 'n' (see 'number_ir')
+void count_uses(Loop *loop, int *uses);
+
+#endif
@@ -1,17 +1,137 @@
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 
 #include "assemble.h"
+#include "analysis.h"
+#include "alias.h"
+#include "layout.h"
+#include "stack_slots.h"
+#include "target.h"
+#include "stats.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#define HAS_CPUID
+#endif
 
 // macOS requires stack to be 16-byte aligned before calls
 #define STACK_ALIGN 16
 
+// Below rsp, which a leaf function can use without moving rsp
+#define RED_ZONE_SIZE 128
+
+int OMIT_FRAME_POINTER = 0;
+int RED_ZONE = 1;
+int SHRINK_WRAP = 1;
+int CPU_FEATURES = 0;
+int FP_CONTRACT = 1;
+int TLS_LOCAL_EXEC = 1;
+int PIC = PIC_NONE;
+int VISIBILITY_HIDDEN = 0;
+int PLT = 1;
+
+
+// ---- Target Features -------------------------------------------------------
+
+typedef struct {
+    char *name; // As in '-m<name>'
+    int feature, implies;
+} CpuFeature;
+
+static CpuFeature CPU_FEATURE_NAMES[] = {
+    { "lzcnt", CPU_LZCNT, 0 },
+    { "bmi",   CPU_BMI1,  0 },
+    { "bmi2",  CPU_BMI2,  0 },
+    { "avx",   CPU_AVX,   0 },
+    { "avx2",  CPU_AVX2,  CPU_AVX },
+    { "fma",   CPU_FMA,   CPU_AVX },
+};
+
+#define NUM_CPU_FEATURES (sizeof(CPU_FEATURE_NAMES) / sizeof(CPU_FEATURE_NAMES[0]))
+#define X86_64_V3 (CPU_LZCNT | CPU_BMI1 | CPU_BMI2 | CPU_AVX | CPU_AVX2 | CPU_FMA)
+
+// Turning a feature on turns on any it implies; turning it off turns off
+// any that imply it (e.g., '-mno-avx' turns off FMA)
+int set_cpu_feature(char *name, int on) {
+    CpuFeature *f = NULL;
+    for (size_t i = 0; i < NUM_CPU_FEATURES; i++) {
+        if (strcmp(CPU_FEATURE_NAMES[i].name, name) == 0) {
+            f = &CPU_FEATURE_NAMES[i];
+        }
+    }
+    if (!f) {
+        return 0;
+    }
+    if (on) {
+        CPU_FEATURES |= f->feature | f->implies;
+        return 1;
+    }
+    CPU_FEATURES &= ~f->feature;
+    for (size_t i = 0; i < NUM_CPU_FEATURES; i++) {
+        if (CPU_FEATURE_NAMES[i].implies & f->feature) {
+            CPU_FEATURES &= ~CPU_FEATURE_NAMES[i].feature;
+        }
+    }
+    return 1;
+}
+
+// AVX also needs the OS to save the upper halves of the YMM registers on a
+// context switch, which 'xgetbv' says
+static int native_features() {
+    int features = 0;
+#ifdef HAS_CPUID
+    unsigned int a, b, c, d;
+    if (__get_cpuid(0x80000001, &a, &b, &c, &d) && (c & (1 << 5))) {
+        features |= CPU_LZCNT;
+    }
+    int avx2 = 0;
+    if (__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+        features |= (b & (1 << 3)) ? CPU_BMI1 : 0;
+        features |= (b & (1 << 8)) ? CPU_BMI2 : 0;
+        avx2 = (b & (1 << 5)) != 0;
+    }
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c & (1 << 27)) && (c & (1 << 28))) {
+        unsigned int xcr0, xcr0_hi;
+        __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+        if ((xcr0 & 6) == 6) {
+            features |= CPU_AVX;
+            features |= (c & (1 << 12)) ? CPU_FMA : 0;
+            features |= avx2 ? CPU_AVX2 : 0;
+        }
+    }
+#endif
+    return features; // Baseline x86-64 when cross compiling from elsewhere
+}
+
+int cpu_arch_features(char *arch) {
+    if (strcmp(arch, "x86-64") == 0 || strcmp(arch, "x86-64-v2") == 0) {
+        return 0;
+    } else if (strcmp(arch, "x86-64-v3") == 0 || strcmp(arch, "haswell") == 0) {
+        return X86_64_V3;
+    } else if (strcmp(arch, "native") == 0) {
+        return native_features();
+    }
+    return -1;
+}
+
+// Stack slots are addressed off rbp; or off rsp with '-fomit-frame-pointer',
+// at an offset below the top of the stack frame that 'patch_stack_sizes'
+// fixes up once the frame's size is known
+static int frame_base() {
+    return OMIT_FRAME_POINTER ? RSP : RBP;
+}
+
 typedef struct { // Per-function assembler
     Fn *fn;
     BB *bb;
     int next_gpr, next_sse;
-    size_t next_stack;
-    Vec *patch_with_stack_size; // of 'AsmIns *'
+    int has_allocs; // Anything left on the stack that a callee could use
+    int ret_ptr;    // vreg with where to return an aggregate (see 'place_ret')
+    int line;       // Of the IR instruction being assembled
+    int *phi_in;    // Per phi (by 'n') in a BB with its address taken; the
+                    // vreg its predecessors copy into (see 'phi_dst')
 } Assembler;
 
 static Assembler * new_asm(Fn *fn) {
@@ -20,34 +140,71 @@ static Assembler * new_asm(Fn *fn) {
     a->bb = fn->entry;
     a->next_gpr = LAST_GPR;
     a->next_sse = LAST_XMM;
-    a->next_stack = 0;
-    a->patch_with_stack_size = vec_new();
+    a->has_allocs = 0;
+    a->ret_ptr = R_NONE;
+    a->line = 0;
+    a->phi_in = NULL;
+    fn->dyn_stack = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            a->has_allocs |= ins->op == IR_ALLOC;
+            fn->dyn_stack |= ins->op == IR_ALLOC && ins->count;
+        }
+    }
+    fn->stack_size = fn->out_args_size = 0;
+    fn->aligned_size = fn->frame_align = 0;
+    fn->patch_with_stack_size = vec_new();
+    fn->jump_tables = vec_new();
     return a;
 }
 
 
 // ---- Instructions ----------------------------------------------------------
 
-static AsmIns * asm0(int op) {
-    AsmIns *ins = malloc(sizeof(AsmIns));
+// Leaves off the storage for any operands it won't have
+static AsmIns * alloc_asm(int op, size_t size) {
+    AsmIns *ins = arena_alloc(ARENA_ASM, size);
+    STATS[STAT_ASM_INS]++;
     ins->next = ins->prev = NULL;
     ins->bb = NULL;
     ins->op = op;
-    ins->l = ins->r = NULL;
+    ins->line = 0;
+    ins->l = ins->r = ins->r2 = NULL;
+    ins->block = NULL;
+    ins->callee = NULL;
     ins->n = 0;
     return ins;
 }
 
+static AsmIns * asm0(int op) {
+    return alloc_asm(op, offsetof(AsmIns, l_opr));
+}
+
+// Copies an operand into the instruction's own storage for it
+static AsmOpr * own_opr(AsmOpr *store, AsmOpr *opr) {
+    if (!opr) {
+        return NULL;
+    }
+    *store = *opr;
+    return store;
+}
+
 static AsmIns * asm1(int op, AsmOpr *l) {
-    AsmIns *ins = asm0(op);
-    ins->l = l;
+    AsmIns *ins = alloc_asm(op, offsetof(AsmIns, r_opr));
+    ins->l = own_opr(&ins->l_opr, l);
     return ins;
 }
 
 static AsmIns * asm2(int op, AsmOpr *l, AsmOpr *r) {
-    AsmIns *ins = asm0(op);
-    ins->l = l;
-    ins->r = r;
+    AsmIns *ins = alloc_asm(op, sizeof(AsmIns));
+    ins->l = own_opr(&ins->l_opr, l);
+    ins->r = own_opr(&ins->r_opr, r);
+    return ins;
+}
+
+static AsmIns * asm3(int op, AsmOpr *l, AsmOpr *r, AsmOpr *r2) {
+    AsmIns *ins = asm2(op, l, r);
+    ins->r2 = r2;
     return ins;
 }
 
@@ -64,9 +221,36 @@ static AsmIns * emit_to_bb(BB *bb, AsmIns *ins) {
 }
 
 static AsmIns * emit(Assembler *a, AsmIns *ins) {
+    ins->line = a->line;
     return emit_to_bb(a->bb, ins);
 }
 
+static AsmIns * emit_before(AsmIns *before, AsmIns *ins) {
+    ins->bb = before->bb;
+    ins->next = before;
+    ins->prev = before->prev;
+    if (before->prev) {
+        before->prev->next = ins;
+    } else {
+        before->bb->asm_head = ins;
+    }
+    before->prev = ins;
+    return ins;
+}
+
+static AsmIns * emit_after(AsmIns *after, AsmIns *ins) {
+    ins->bb = after->bb;
+    ins->prev = after;
+    ins->next = after->next;
+    if (after->next) {
+        after->next->prev = ins;
+    } else {
+        after->bb->asm_last = ins;
+    }
+    after->next = ins;
+    return ins;
+}
+
 void delete_asm(AsmIns *ins) {
     if (ins->prev) {
         ins->prev->next = ins->next;
@@ -81,13 +265,34 @@ void delete_asm(AsmIns *ins) {
     }
 }
 
+int ins_oprs(AsmIns *ins, AsmOpr **oprs[MAX_INS_OPRS]) {
+    int n = 0;
+    if (ins->op == X64_ASM) { // Every operand in the block, then 'fixed'
+        int num_oprs = ins->block->inline_asm->num_oprs;
+        for (int i = 0; i < num_oprs; i++) {
+            oprs[n++] = &ins->block->oprs[i];
+        }
+        for (int i = 0; i < num_oprs; i++) {
+            if (ins->block->fixed[i]) {
+                oprs[n++] = &ins->block->fixed[i];
+            }
+        }
+        return n;
+    }
+    if (ins->l) oprs[n++] = &ins->l;
+    if (ins->r) oprs[n++] = &ins->r;
+    if (ins->r2) oprs[n++] = &ins->r2;
+    return n;
+}
+
 
 // ---- Operands --------------------------------------------------------------
 
 static AsmOpr * discharge(Assembler *a, IrIns *ir);
+static AsmOpr * next_ptr_vreg(Assembler *a);
 
 static AsmOpr * opr_new(int k) {
-    AsmOpr *opr = calloc(1, sizeof(AsmOpr));
+    AsmOpr *opr = arena_alloc(ARENA_ASM, sizeof(AsmOpr));
     opr->k = k;
     return opr;
 }
@@ -98,9 +303,28 @@ static AsmOpr * opr_imm(uint64_t imm) {
     return opr;
 }
 
-static AsmOpr * opr_fp(IrType *t, size_t idx) {
-    AsmOpr *opr = opr_new(t->k == IRT_F32 ? OPR_F32 : OPR_F64);
-    opr->fp = idx;
+// The bits of an IR_FP at its type's width
+uint64_t fp_bits(IrIns *ir) {
+    if (ir->t->k == IRT_F32) {
+        float f = (float) ir->fp;
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        return bits;
+    }
+    uint64_t bits;
+    memcpy(&bits, &ir->fp, sizeof(bits));
+    return bits;
+}
+
+// Positive zero is materialised with 'pxor' rather than loaded (not -0.0,
+// which has its sign bit set)
+static int is_fp_zero(IrIns *ir) {
+    return ir->op == IR_FP && fp_bits(ir) == 0;
+}
+
+static AsmOpr * opr_fp(IrIns *ir) {
+    AsmOpr *opr = opr_new(ir->t->k == IRT_F32 ? OPR_F32 : OPR_F64);
+    opr->fp = fp_bits(ir);
     return opr;
 }
 
@@ -117,7 +341,7 @@ static AsmOpr * opr_gpr_t(int reg, IrType *t) {
         case IRT_I8:  size = R8L; break;
         case IRT_I16: size = R16; break;
         case IRT_I32: size = R32; break;
-        case IRT_I64: case IRT_PTR: case IRT_ARR: size = R64; break;
+        case IRT_I64: case IRT_PTR: case IRT_ARR: case IRT_STRUCT: size = R64; break;
         default: UNREACHABLE();
     }
     return opr_gpr(reg, size);
@@ -135,18 +359,38 @@ static AsmOpr * opr_bb(BB *bb) {
     return opr;
 }
 
+static AsmOpr * opr_bb_addr(BB *bb) {
+    AsmOpr *opr = opr_new(OPR_BB_ADDR);
+    opr->bb = bb;
+    return opr;
+}
+
 static AsmOpr * opr_label(char *label) {
     AsmOpr *opr = opr_new(OPR_LABEL);
     opr->label = label;
     return opr;
 }
 
+static AsmOpr * opr_table(size_t idx) {
+    AsmOpr *opr = opr_new(OPR_TABLE);
+    opr->table = idx;
+    return opr;
+}
+
 static AsmOpr * opr_deref(char *label) {
     AsmOpr *opr = opr_new(OPR_DEREF);
     opr->label = label;
     return opr;
 }
 
+static AsmOpr * opr_mem_reg(int reg) {
+    AsmOpr *mem = opr_new(OPR_MEM); // [<reg>]
+    mem->base = reg;
+    mem->base_size = R64;
+    mem->scale = 1;
+    return mem;
+}
+
 // 'mem->bytes' MUST be set by the calling function if memory is to be accessed
 static AsmOpr * opr_mem_from_ptr(Assembler *a, IrIns *ptr, IrType *to_load) {
     assert(ptr->t->k == IRT_PTR);
@@ -164,14 +408,38 @@ static AsmOpr * opr_mem_from_ptr(Assembler *a, IrIns *ptr, IrType *to_load) {
     return mem;
 }
 
+// Stack slots are below the top of the stack frame; arguments passed on the
+// stack are above it (past the saved rbp and return address)
+static AsmOpr * opr_frame(int64_t disp, size_t bytes) {
+    AsmOpr *mem = opr_new(OPR_MEM); // [rbp + <disp>]
+    mem->base = frame_base();
+    mem->base_size = R64;
+    mem->scale = 1;
+    mem->disp = disp;
+    mem->frame = FRAME_TOP;
+    mem->bytes = bytes;
+    return mem;
+}
+
+// 'disp' bytes into an IR_ALLOC's stack slot; an over-aligned one's is off rsp
+// (see 'realign_frame')
+static AsmOpr * opr_alloc(IrIns *alloc, int64_t disp) {
+    if (!is_overaligned(alloc->alloc_t)) {
+        return opr_frame(disp - (int64_t) alloc->stack_slot, 0); // [rbp - <stack slot>]
+    }
+    AsmOpr *mem = opr_new(OPR_MEM); // [rsp + <out args> + <slot>]
+    mem->base = RSP;
+    mem->base_size = R64;
+    mem->scale = 1;
+    mem->disp = (int64_t) alloc->stack_slot + disp;
+    mem->frame = FRAME_ALIGNED;
+    return mem;
+}
+
 static AsmOpr * opr_mem_from_alloc(IrIns *alloc, IrType *to_load) {
     assert(alloc->op == IR_ALLOC);
     assert(alloc->t->k == IRT_PTR);
-    AsmOpr *mem = opr_new(OPR_MEM); // [rbp - <stack slot>]
-    mem->base = RBP;
-    mem->base_size = R64;
-    mem->scale = 1;
-    mem->disp = -((int64_t) alloc->stack_slot);
+    AsmOpr *mem = opr_alloc(alloc, 0);
     if (to_load) {
         assert(to_load->size <= 8);
         mem->bytes = to_load->size;
@@ -179,10 +447,258 @@ static AsmOpr * opr_mem_from_alloc(IrIns *alloc, IrType *to_load) {
     return mem;
 }
 
-static AsmOpr * opr_mem_from_global(IrIns *global, IrType *to_load) {
+// A thread-local's offset from the thread pointer in 'fs' is fixed at link
+// time if it's defined in this file ('TLS_LOCAL_EXEC'), and otherwise loaded
+// from the GOT; either way it's accessed without a call to '__tls_get_addr'
+static AsmOpr * opr_tls_offset(Assembler *a, Global *g) {
+    if (TLS_LOCAL_EXEC && g->k != G_NONE) {
+        AsmOpr *mem = opr_new(OPR_TPOFF); // [fs:<label>@tpoff]
+        mem->label = g->label;
+        return mem;
+    }
+    AsmOpr *got = opr_new(OPR_GOTTPOFF);
+    got->label = g->label;
+    got->bytes = 8;
+    AsmOpr *off = next_ptr_vreg(a);
+    emit(a, asm2(X64_MOV, off, got)); // mov <off>, [rel <label>@gottpoff]
+    AsmOpr *mem = opr_new(OPR_MEM); // [fs:<off>]
+    mem->base = off->reg;
+    mem->base_size = R64;
+    mem->scale = 1;
+    mem->fs = 1;
+    return mem;
+}
+
+int is_hidden(Global *g) {
+    if (g->linkage == LINK_STATIC || g->visibility == VIS_DEFAULT) {
+        return 0;
+    }
+    return g->visibility == VIS_HIDDEN || (VISIBILITY_HIDDEN && g->k != G_NONE);
+}
+
+int is_preemptible(Global *g) {
+    if (g->linkage == LINK_STATIC || is_hidden(g)) {
+        return 0;
+    }
+    switch (PIC) {
+    case PIC_PIE:    return g->k == G_NONE;
+    case PIC_SHARED: return 1;
+    default:         return 0;
+    }
+}
+
+// '[rel <label> wrt ..gotpcrel]': the GOT entry with the symbol's address
+static AsmOpr * opr_got(char *label) {
+    AsmOpr *got = opr_new(OPR_GOTPCREL);
+    got->label = label;
+    got->bytes = 8;
+    return got;
+}
+
+// A preemptible global's address is loaded from the GOT (which the linker
+// turns back into a 'lea' if the symbol ends up in the same module after all)
+static void emit_global_addr(Assembler *a, AsmOpr *dst, Global *g) {
+    if (is_preemptible(g)) {
+        emit(a, asm2(X64_MOV, dst, opr_got(g->label)));  // mov <dst>, [rel <label>@gotpcrel]
+    } else {
+        emit(a, asm2(X64_LEA, dst, opr_deref(g->label))); // lea <dst>, [rel <label>]
+    }
+}
+
+static AsmOpr * opr_mem_from_global(Assembler *a, IrIns *global, IrType *to_load) {
     assert(global->op == IR_GLOBAL);
     assert(global->t->k == IRT_PTR);
-    AsmOpr *mem = opr_deref(global->g->label);
+    Global *g = global->g;
+    AsmOpr *mem;
+    if (g->is_tls) {
+        mem = opr_tls_offset(a, g);
+    } else if (is_preemptible(g)) {
+        AsmOpr *addr = next_ptr_vreg(a);
+        emit_global_addr(a, addr, g);
+        mem = opr_mem_reg(addr->reg);
+    } else {
+        mem = opr_deref(g->label);
+    }
+    if (to_load) {
+        assert(to_load->size <= 8);
+        mem->bytes = to_load->size;
+    }
+    return mem;
+}
+
+// An address in the form x86 can encode: 'base + idx * scale + disp'
+typedef struct {
+    IrIns *base, *idx;
+    int scale;
+    int64_t disp;
+} Addr;
+
+static int fits_disp32(int64_t v) {
+    return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+// Matches 'x << <0-3>' or 'x * <1, 2, 4, or 8>'
+static int match_scale(IrIns *off, IrIns **idx, int *scale) {
+    if (off->op == IR_SHL && off->r->op == IR_IMM && off->r->imm <= 3) {
+        *idx = off->l;
+        *scale = 1 << off->r->imm;
+        return 1;
+    } else if (off->op == IR_MUL) {
+        IrIns *x = off->l, *imm = off->r;
+        if (x->op == IR_IMM) {
+            x = off->r;
+            imm = off->l;
+        }
+        if (imm->op == IR_IMM && (imm->imm == 1 || imm->imm == 2 ||
+                                  imm->imm == 4 || imm->imm == 8)) {
+            *idx = x;
+            *scale = (int) imm->imm;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Index registers in an address are 64-bit
+static int match_scaled_idx(IrIns *off, IrIns **idx, int *scale) {
+    return off->t->k == IRT_I64 && match_scale(off, idx, scale);
+}
+
+static int add_offset(Addr *addr, IrIns *off) {
+    if (off->op == IR_IMM) {
+        int64_t disp = addr->disp + (int64_t) off->imm;
+        if (!fits_disp32((int64_t) off->imm) || !fits_disp32(disp)) {
+            return 0;
+        }
+        addr->disp = disp;
+    } else if (!addr->idx) {
+        if (!match_scaled_idx(off, &addr->idx, &addr->scale)) {
+            addr->idx = off;
+            addr->scale = 1;
+        }
+    } else {
+        return 0; // Only one index register
+    }
+    return 1;
+}
+
+// Folds a chain of PTRADDs (e.g., 'a[i].x') into one address. Returns 1 if
+// the base of 'ptr' was itself a PTRADD that got folded in; if nothing can be
+// folded then 'addr->base' is just 'ptr'
+static int match_addr(IrIns *ptr, Addr *addr) {
+    *addr = (Addr) { .base = ptr, .scale = 1 };
+    if (ptr->op != IR_PTRADD) {
+        return 0;
+    }
+    Addr inner;
+    match_addr(ptr->base, &inner);
+    if (inner.base != ptr->base && add_offset(&inner, ptr->offset)) {
+        *addr = inner;
+        return 1;
+    }
+    inner = (Addr) { .base = ptr->base, .scale = 1 };
+    if (add_offset(&inner, ptr->offset)) {
+        *addr = inner;
+    }
+    return 0;
+}
+
+// A 32 or 64-bit 'add' (or a 'sub' of a constant) can be a 'lea', which puts
+// the result in a new register without a 'mov' first, and adds in a scaled
+// index and a constant too (e.g., 'lea eax, [rdi + rsi*4 + 8]'). So can a
+// multiply by 3, 5, or 9 (e.g., 'lea eax, [rdi + rdi*2]'), or a shift left by
+// 1. Only the low 32 bits of the registers matter for a 32-bit result. Sets
+// 'scaled' to the operand whose shift or multiply is done by the 'lea' (see
+// 'mark_addr_folds'), if there is one
+static int match_lea(IrIns *ir, Addr *addr, IrIns **scaled);
+
+// Whether 'ir' is an add of two registers that could be folded into the 'lea'
+// for adding a constant to it (e.g., 'a + b*4 + 8')
+static int is_lea_add(IrIns *ir) {
+    return ir->op == IR_ADD && (ir->t->k == IRT_I32 || ir->t->k == IRT_I64) &&
+           ir->l->op != IR_IMM && ir->r->op != IR_IMM;
+}
+
+static int lea_disp(Addr *addr, IrIns *x, uint64_t disp, IrIns **scaled) {
+    if (x->op == IR_ADD && x->fold > 0) { // Folded into this 'lea'
+        match_lea(x, addr, scaled);
+    } else {
+        *addr = (Addr) { .base = x, .scale = 1 };
+    }
+    addr->disp = x->t->size == 4 ? (int32_t) disp : (int64_t) disp;
+    return fits_disp32(addr->disp);
+}
+
+static int match_lea(IrIns *ir, Addr *addr, IrIns **scaled) {
+    *scaled = NULL;
+    if (ir->t->k != IRT_I32 && ir->t->k != IRT_I64) {
+        return 0;
+    }
+    IrIns *l = ir->l, *r = ir->r;
+    *addr = (Addr) { .base = l, .scale = 1 };
+    switch (ir->op) {
+    case IR_ADD:
+        if (l->op == IR_IMM) {
+            l = ir->r;
+            r = ir->l;
+            addr->base = l;
+        }
+        if (r->op == IR_IMM) {
+            return lea_disp(addr, l, r->imm, scaled);
+        } else if (match_scale(r, &addr->idx, &addr->scale)) {
+            *scaled = r;
+        } else if (match_scale(l, &addr->idx, &addr->scale)) {
+            *scaled = l;
+            addr->base = r;
+        } else {
+            addr->idx = r;
+        }
+        return 1;
+    case IR_SUB:
+        return r->op == IR_IMM && lea_disp(addr, l, -r->imm, scaled);
+    case IR_MUL:
+        if (l->op == IR_IMM) {
+            l = ir->r;
+            r = ir->l;
+        }
+        if (r->op != IR_IMM || (r->imm != 3 && r->imm != 5 && r->imm != 9)) {
+            return 0;
+        }
+        *addr = (Addr) { .base = l, .idx = l, .scale = (int) r->imm - 1 };
+        return 1;
+    case IR_SHL:
+        if (r->op != IR_IMM || r->imm != 1) {
+            return 0;
+        }
+        addr->idx = l;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static AsmOpr * opr_mem_from_ptradd(Assembler *a, IrIns *ptradd, IrType *to_load) {
+    Addr addr;
+    match_addr(ptradd, &addr);
+    assert(addr.base != ptradd);
+    AsmOpr *mem; // [<base> + <idx>*<scale> + <disp>]
+    if (addr.base->op == IR_ALLOC && !is_dyn_alloc(a->fn, addr.base)) {
+        mem = opr_alloc(addr.base, addr.disp);
+    } else {
+        AsmOpr *base = discharge(a, addr.base);
+        assert(base->k == OPR_GPR && base->size == R64);
+        mem = opr_new(OPR_MEM);
+        mem->base = base->reg;
+        mem->base_size = R64;
+        mem->disp = addr.disp;
+    }
+    mem->scale = addr.scale;
+    if (addr.idx) {
+        AsmOpr *idx = discharge(a, addr.idx);
+        assert(idx->k == OPR_GPR && idx->size == R64);
+        mem->idx = idx->reg;
+        mem->idx_size = R64;
+    }
     if (to_load) {
         assert(to_load->size <= 8);
         mem->bytes = to_load->size;
@@ -194,30 +710,90 @@ static AsmOpr * opr_mem_from_global(IrIns *global, IrType *to_load) {
 // of bytes to read from memory (or NULL if we don't care about setting 'bytes')
 static AsmOpr * load_ptr(Assembler *a, IrIns *ptr, IrType *to_load) {
     assert(ptr->t->k == IRT_PTR);
+    if (ptr->op == IR_ALLOC && is_dyn_alloc(a->fn, ptr)) {
+        return opr_mem_from_ptr(a, ptr, to_load); // In a vreg
+    }
     switch (ptr->op) {
         case IR_ALLOC:  return opr_mem_from_alloc(ptr, to_load);
-        case IR_GLOBAL: return opr_mem_from_global(ptr, to_load);
-        // TODO: inline IR_PTRADD
+        case IR_GLOBAL: return opr_mem_from_global(a, ptr, to_load);
+        case IR_PTRADD:
+            if (ptr->fold > 0) { // Folded into this use (see 'mark_addr_folds')
+                return opr_mem_from_ptradd(a, ptr, to_load);
+            } // Fall through
         default:        return opr_mem_from_ptr(a, ptr, to_load);
     }
 }
 
+// Floats and vectors go in SSE regs
+static int is_sse(IrType *t) {
+    return t->k == IRT_F32 || t->k == IRT_F64 || t->k == IRT_VEC;
+}
+
 static AsmOpr * next_vreg(Assembler *a, IrType *t) {
-    if (t->k == IRT_F32 || t->k == IRT_F64) {
+    STATS[STAT_VREGS]++;
+    if (is_sse(t)) {
         return opr_xmm(a->next_sse++);
     } else {
         return opr_gpr_t(a->next_gpr++, t);
     }
 }
 
+static AsmOpr * next_ptr_vreg(Assembler *a) {
+    STATS[STAT_VREGS]++;
+    return opr_gpr(a->next_gpr++, R64);
+}
+
 static int mov_for(IrType *t) {
     switch (t->k) {
         case IRT_F32: return X64_MOVSS;
         case IRT_F64: return X64_MOVSD;
+        case IRT_VEC: return X64_MOVDQU;
         default:      return X64_MOV;
     }
 }
 
+// Writing the low 8 or 16 bits of a register merges them with the rest of it,
+// a false dependency on whatever last wrote the register. So i8s and i16s are
+// written to 32-bit registers instead; their upper bits are never read
+static AsmOpr * full_width(AsmOpr *opr) {
+    if (opr->k == OPR_GPR && (opr->size == R8L || opr->size == R16)) {
+        return opr_gpr(opr->reg, R32);
+    }
+    return opr;
+}
+
+// A move of a value of type 't' into 'dst', writing all of it if it's a GPR
+static AsmIns * mov_ins(IrType *t, AsmOpr *dst, AsmOpr *src) {
+    if (dst->k == OPR_GPR && t->size < 4) {
+        if (src->k == OPR_GPR || src->k == OPR_IMM) {
+            return asm2(X64_MOV, full_width(dst), full_width(src));
+        }
+        return asm2(X64_MOVZX, full_width(dst), src);
+    }
+    return asm2(mov_for(t), dst, src);
+}
+
+// Vector loads and stores only touch the bytes in the vector (see 'Vectors').
+// A whole one at an address known to be 16 byte aligned uses 'movdqa'
+static int vec_mov_for(IrType *t, size_t align) {
+    switch (t->size) {
+        case 4:  return X64_MOVD;
+        case 8:  return X64_MOVQ;
+        default: return align >= 16 ? X64_MOVDQA : X64_MOVDQU;
+    }
+}
+
+// What's known of the alignment of an IR_LOAD's or IR_STORE's address 'ptr'
+static size_t access_align(IrIns *ir, IrIns *ptr) {
+    size_t align = ptr_align(ptr);
+    return ir->align > align ? ir->align : align;
+}
+
+static AsmOpr * vec_mem(AsmOpr *mem, IrType *t) {
+    mem->bytes = t->size < 16 ? t->size : 0; // No size for 'movdqu'
+    return mem;
+}
+
 
 // ---- Operand Discharge and Inlining ----------------------------------------
 
@@ -228,38 +804,72 @@ static int SET_OP[IR_LAST] = {
     [IR_FLT] = X64_SETB, [IR_FLE] = X64_SETBE, [IR_FGT] = X64_SETA, [IR_FGE] = X64_SETAE,
 };
 
-static void asm_cmp(Assembler *a, IrIns *ir);
+static void asm_cmp(Assembler *a, IrIns *ir, AsmOpr *to_zero);
 
 // Emit assembly to put the result of an instruction into a vreg
 static AsmOpr * discharge(Assembler *a, IrIns *ir) {
-    // Always re-materialise a LEA on discharging an IR_ALLOC
-    if (ir->op != IR_ALLOC && ir->vreg != R_NONE) { // Already in a vreg
-        return (ir->t->k == IRT_F32 || ir->t->k == IRT_F64) ?
-            opr_xmm(ir->vreg) : opr_gpr_t(ir->vreg, ir->t);
+    // Always re-materialise constants and the LEA for an IR_ALLOC in a stack
+    // slot, rather than reusing a vreg that might not be defined on every path
+    // to this use
+    int remat = ir->op == IR_IMM || ir->op == IR_FP || ir->op == IR_GLOBAL ||
+                ir->op == IR_BB_ADDR || (ir->op == IR_ALLOC && !is_dyn_alloc(a->fn, ir));
+    if (!remat && ir->vreg != R_NONE) { // Already in a vreg
+        return is_sse(ir->t) ? opr_xmm(ir->vreg) : opr_gpr_t(ir->vreg, ir->t);
     }
     AsmOpr *dst = next_vreg(a, ir->t);
     ir->vreg = dst->reg;
     switch (ir->op) {
-    case IR_IMM:    emit(a, asm2(mov_for(ir->t), dst, opr_imm(ir->imm))); break;
-    case IR_FP:     emit(a, asm2(mov_for(ir->t), dst, opr_fp(ir->t, ir->fp_idx))); break;
-    case IR_GLOBAL: emit(a, asm2(X64_LEA, dst, opr_deref(ir->g->label))); break;
-    case IR_LOAD:   emit(a, asm2(mov_for(ir->t), dst, load_ptr(a, ir->l, ir->t))); break;
+    case IR_IMM:    emit(a, mov_ins(ir->t, dst, opr_imm(ir->imm))); break;
+    case IR_FP:
+        if (is_fp_zero(ir)) {
+            emit(a, asm2(X64_PXOR, dst, dst));
+        } else {
+            emit(a, asm2(mov_for(ir->t), dst, opr_fp(ir)));
+        }
+        break;
+    case IR_GLOBAL:
+        if (ir->g->is_tls) { // The thread pointer, plus the offset from the GOT
+            AsmOpr *got = opr_new(OPR_GOTTPOFF);
+            got->label = ir->g->label;
+            got->bytes = 8;
+            AsmOpr *tp = opr_new(OPR_TPOFF); // [fs:0]
+            tp->bytes = 8;
+            emit(a, asm2(X64_MOV, dst, got));
+            emit(a, asm2(X64_ADD, dst, tp));
+        } else {
+            emit_global_addr(a, dst, ir->g);
+        }
+        break;
+    case IR_BB_ADDR: emit(a, asm2(X64_LEA, dst, opr_bb_addr(ir->label_bb))); break;
+    case IR_LOAD:
+        if (ir->t->k == IRT_VEC) {
+            AsmOpr *src = vec_mem(load_ptr(a, ir->l, NULL), ir->t);
+            emit(a, asm2(vec_mov_for(ir->t, access_align(ir, ir->src)), dst, src));
+        } else {
+            emit(a, mov_ins(ir->t, dst, load_ptr(a, ir->l, ir->t)));
+        }
+        break;
     case IR_ALLOC:  emit(a, asm2(X64_LEA, dst, opr_mem_from_alloc(ir, NULL))); break;
     case IR_EQ:  case IR_NEQ:
     case IR_SLT: case IR_SLE: case IR_SGT: case IR_SGE:
     case IR_ULT: case IR_ULE: case IR_UGT: case IR_UGE:
     case IR_FLT: case IR_FLE: case IR_FGT: case IR_FGE:
-        asm_cmp(a, ir);
+        asm_cmp(a, ir, dst); // Zeros the vreg first
         emit(a, asm1(SET_OP[ir->op], opr_gpr(dst->reg, R8L))); // Set low 8 bits
-        emit(a, asm2(X64_AND, dst, opr_imm(1))); // Clear rest of vreg
         break;
     default: UNREACHABLE();
     }
     return dst;
 }
 
+// Only 'mov' can take a 64-bit immediate; everything else sign extends 32 bits
+static int fits_imm32(IrIns *ir) {
+    int64_t v = (int64_t) ir->imm;
+    return ir->t->size < 8 || (v >= INT32_MIN && v <= INT32_MAX);
+}
+
 static AsmOpr * inline_imm(Assembler *a, IrIns *ir) {
-    if (ir->op == IR_IMM) {
+    if (ir->op == IR_IMM && fits_imm32(ir)) {
         return opr_imm(ir->imm);
     }
     return discharge(a, ir);
@@ -271,8 +881,8 @@ static AsmOpr * inline_mem(Assembler *a, IrIns *ir) {
             return discharge(a, ir);
         }
         return load_ptr(a, ir->l, ir->t);
-    } else if (ir->op == IR_FP) {
-        return opr_fp(ir->t, ir->fp_idx);
+    } else if (ir->op == IR_FP && !is_fp_zero(ir)) {
+        return opr_fp(ir);
     } else {
         return discharge(a, ir);
     }
@@ -286,104 +896,626 @@ static AsmOpr * inline_imm_mem(Assembler *a, IrIns *ir) {
     }
 }
 
+Fn * static_callee(IrIns *fn) {
+    if (fn->op == IR_GLOBAL && fn->g->k == G_FN_DEF && fn->g->linkage == LINK_STATIC) {
+        return fn->g->fn;
+    }
+    return NULL;
+}
+
+// A call to a global goes straight to its label (through a PLT stub if the
+// linker decides it needs one), or with '-fno-plt', through its GOT entry if
+// it might be in another module
 static AsmOpr * inline_label_mem(Assembler *a, IrIns *ir) {
     if (ir->op == IR_GLOBAL) {
-        return opr_label(ir->g->label);
+        Global *g = ir->g;
+        int via_got = !PLT && g->linkage != LINK_STATIC && !is_hidden(g) &&
+                      (g->k == G_NONE || is_preemptible(g));
+        return via_got ? opr_got(g->label) : opr_label(g->label);
     } else {
         return inline_mem(a, ir);
     }
 }
 
 
-// ---- Immediates, Constants, and Memory Operations --------------------------
+// ---- Block Moves -----------------------------------------------------------
 
-#define NUM_REG_FARGS 6
-static int GPR_FARGS[] = { RDI, RSI, RDX, RCX, R8, R9, };
-static int SSE_FARGS[] = { XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7, };
+// Copies and zeroing of blocks of memory are unrolled into 16-byte moves
+// through an SSE reg (then 8, 4, 2, and 1-byte ones for what's left) up to
+// this many bytes; anything bigger, or of unknown size, uses 'rep movsb' or
+// 'rep stosb', which are as fast as a loop of vector moves on CPUs with ERMSB
+#define MAX_UNROLLED_MOVE 128
 
-static void asm_farg(Assembler *a, IrIns *ir) {
-    // TODO: stack arguments
-    AsmOpr *dst = next_vreg(a, ir->t); // vreg for the result
-    ir->vreg = dst->reg;
-    AsmOpr *src;
-    if (ir->t->k == IRT_F32 || ir->t->k == IRT_F64) {
-        src = opr_xmm(SSE_FARGS[ir->arg_idx]); // FP args indexed separately
-    } else {
-        src = opr_gpr_t(GPR_FARGS[ir->arg_idx], ir->t);
+// 16-byte moves go through an SSE preg rather than a vreg, since spilling a
+// vreg would only save its low 8 bytes; it's never live across anything else
+#define SCRATCH_XMM XMM15
+
+static int GPR_SIZES[] = { [1] = R8L, [2] = R16, [4] = R32, [8] = R64, };
+
+static AsmOpr * opr_offset(AsmOpr *mem, size_t offset, size_t bytes) {
+    AsmOpr *part = opr_new(OPR_MEM);
+    *part = *mem;
+    part->disp += (int64_t) offset;
+    part->bytes = bytes;
+    return part;
+}
+
+// Memory at a pointer, or at an aggregate value, that can be offset into
+static AsmOpr * agg_mem(Assembler *a, IrIns *agg) {
+    if (agg->t->k == IRT_PTR && agg->op != IR_GLOBAL) { // No offsets off labels
+        return load_ptr(a, agg, NULL);
     }
-    emit(a, asm2(mov_for(ir->t), dst, src));
+    AsmOpr *ptr = discharge(a, agg);
+    assert(ptr->k == OPR_GPR && ptr->size == R64);
+    return opr_mem_reg(ptr->reg);
 }
 
-static void asm_fp(Assembler *a, IrIns *ir) {
-    size_t idx;
-    if (ir->t->k == IRT_F32) {
-        idx = vec_len(a->fn->f32s);
-        float *fp = malloc(sizeof(float));
-        *fp = (float) ir->fp;
-        vec_push(a->fn->f32s, fp);
-    } else {
-        idx = vec_len(a->fn->f64s);
-        double *fp = malloc(sizeof(double));
-        *fp = ir->fp;
-        vec_push(a->fn->f64s, fp);
+// Copies 'size' bytes, 16 at a time through an SSE reg and then in smaller
+// pieces through a GPR. 'align' is what's known of both pointers' alignment
+static void emit_copy(Assembler *a, AsmOpr *dst, AsmOpr *src, size_t size, size_t align) {
+    size_t offset = 0;
+    int mov = align >= 16 ? X64_MOVDQA : X64_MOVDQU;
+    for (; size - offset >= 16; offset += 16) {
+        AsmOpr *r = opr_xmm(SCRATCH_XMM);
+        emit(a, asm2(mov, r, opr_offset(src, offset, 0)));
+        emit(a, asm2(mov, opr_offset(dst, offset, 0), r));
+    }
+    int tmp = R_NONE;
+    while (offset < size) {
+        size_t bytes = 8;
+        while (bytes > size - offset) {
+            bytes /= 2;
+        }
+        if (tmp == R_NONE) {
+            tmp = next_ptr_vreg(a)->reg;
+        }
+        AsmOpr *r = opr_gpr(tmp, GPR_SIZES[bytes]);
+        emit(a, asm2(X64_MOV, r, opr_offset(src, offset, bytes)));
+        emit(a, asm2(X64_MOV, opr_offset(dst, offset, bytes), r));
+        offset += bytes;
     }
-    ir->fp_idx = idx;
 }
 
-static void asm_alloc(Assembler *a, IrIns *ir) {
-    assert(ir->t->k == IRT_PTR);
-    a->next_stack += + pad(a->next_stack, ir->alloc_t->align) + ir->alloc_t->size;
-    ir->stack_slot = a->next_stack;
+static void emit_zero(Assembler *a, AsmOpr *dst, size_t size, size_t align) {
+    size_t offset = 0;
+    if (size >= 16) {
+        AsmOpr *zero = opr_xmm(SCRATCH_XMM);
+        int mov = align >= 16 ? X64_MOVDQA : X64_MOVDQU;
+        emit(a, asm2(X64_PXOR, zero, zero));
+        for (; size - offset >= 16; offset += 16) {
+            emit(a, asm2(mov, opr_offset(dst, offset, 0), zero));
+        }
+    }
+    while (offset < size) {
+        size_t bytes = 8;
+        while (bytes > size - offset) {
+            bytes /= 2;
+        }
+        emit(a, asm2(X64_MOV, opr_offset(dst, offset, bytes), opr_imm(0)));
+        offset += bytes;
+    }
 }
 
-static void asm_load(Assembler *a, IrIns *ir) {
-    // TODO: discharge IR_LOADs with more than one use here
+static int is_small_block(IrIns *size) {
+    return size->op == IR_IMM && size->imm <= MAX_UNROLLED_MOVE;
 }
 
-static void asm_store(Assembler *a, IrIns *ir) {
-    AsmOpr *l = load_ptr(a, ir->dst, ir->src->t);
-    AsmOpr *r = inline_imm(a, ir->src);
-    emit(a, asm2(mov_for(ir->src->t), l, r));
+// The operands all have to be worked out before any of the pregs are set,
+// since pregs aren't kept free across instructions (see 'reg_alloc')
+static void asm_copy(Assembler *a, IrIns *ir) {
+    AsmOpr *dst = agg_mem(a, ir->dst);
+    AsmOpr *src = agg_mem(a, ir->src);
+    if (is_small_block(ir->len)) {
+        size_t align = access_align(ir, ir->dst);
+        size_t src_align = access_align(ir, ir->src);
+        emit_copy(a, dst, src, ir->len->imm, align < src_align ? align : src_align);
+        return;
+    }
+    AsmOpr *len = inline_imm(a, ir->len);
+    emit(a, asm2(X64_LEA, opr_gpr(RDI, R64), dst));
+    emit(a, asm2(X64_LEA, opr_gpr(RSI, R64), src));
+    emit(a, asm2(X64_MOV, opr_gpr(RCX, R64), len));
+    emit(a, asm0(X64_REP_MOVSB));
 }
 
-static void asm_ptradd(Assembler *a, IrIns *ir) {
-    AsmOpr *l = discharge(a, ir->l);
-    AsmOpr *r = inline_imm(a, ir->r);
-    if (r->k == OPR_IMM && r->imm == 0) {
-        ir->vreg = l->reg;
-        return; // Doesn't modify the pointer
+static void asm_zero(Assembler *a, IrIns *ir) {
+    AsmOpr *dst = agg_mem(a, ir->ptr);
+    if (is_small_block(ir->size)) {
+        emit_zero(a, dst, ir->size->imm, ptr_align(ir->ptr));
+        return;
     }
+    AsmOpr *size = inline_imm(a, ir->size);
+    emit(a, asm2(X64_LEA, opr_gpr(RDI, R64), dst));
+    emit(a, asm2(X64_MOV, opr_gpr(RCX, R64), size));
+    emit(a, asm2(X64_MOV, opr_gpr(RAX, R32), opr_imm(0)));
+    emit(a, asm0(X64_REP_STOSB));
+}
 
-    AsmOpr *dst = next_vreg(a, ir->t); // vreg for the result
-    ir->vreg = dst->reg;
 
-    // TODO: incorporate PTRADD, ADD/SUB, MUL, SHL, ALLOC (rbp) into LEA
-    // TODO: implement basic dead code elimination
-    AsmOpr *addr = opr_new(OPR_MEM);
-    addr->base = l->reg;
-    assert(l->size == R64); // Pointers are always 64-bit
-    addr->base_size = R64;
-    addr->scale = 1;
-    switch (r->k) {
-    case OPR_IMM:
-        addr->disp = (int64_t) r->imm;
-        break;
-    case OPR_GPR:
-        addr->idx = r->reg;
-        assert(r->size == R64); // Pointers are always 64-bit
-        addr->idx_size = R64;
-        break;
-    default: UNREACHABLE();
+// ---- Calling Convention ----------------------------------------------------
+
+// Arguments and return values are passed as the System V ABI lays out.
+// Aggregates (which are pointers to their contents in the IR) of up to 16
+// bytes are split into 'eightbytes', each passed in a GPR if it holds any
+// integers or an SSE reg if it only holds floats. Bigger aggregates, and
+// anything that doesn't fit in the regs left, are copied onto the stack
+
+// The registers are the target's (see 'target.h')
+#define GPR_ARGS (TARGET->gpr_args)
+#define SSE_ARGS (TARGET->fpr_args)
+#define GPR_RETS (TARGET->gpr_rets)
+#define SSE_RETS (TARGET->fpr_rets)
+
+typedef struct {
+    int num_regs;     // One per eightbyte; 0 if passed on the stack
+    int regs[2];
+    int is_sse[2];
+    size_t stack_off; // From the first argument on the stack
+} ArgLoc;
+
+typedef struct {
+    int num_gprs, num_sse; // Used so far
+    size_t stack_size;     // Of the arguments on the stack so far
+} ArgState;
+
+// Whether the parts of 't' (at 'offset' in the aggregate) that overlap the
+// eightbyte starting at 'lo' are all floating point
+static int is_sse_eightbyte(IrType *t, size_t offset, size_t lo) {
+    if (offset >= lo + 8 || offset + t->size <= lo) {
+        return 1; // Doesn't overlap
+    }
+    switch (t->k) {
+    case IRT_F32: case IRT_F64:
+        return 1;
+    case IRT_ARR:
+        for (size_t i = 0; i < t->len; i++) {
+            if (!is_sse_eightbyte(t->elem, offset + i * t->elem->size, lo)) {
+                return 0;
+            }
+        }
+        return 1;
+    case IRT_STRUCT:
+        for (size_t i = 0; i < vec_len(t->fields); i++) {
+            IrField *f = vec_get(t->fields, i);
+            if (!is_sse_eightbyte(f->t, offset + f->offset, lo)) {
+                return 0;
+            }
+        }
+        return 1;
+    default:
+        return 0;
     }
-    emit(a, asm2(X64_LEA, dst, addr));
 }
 
+// Returns the number of eightbytes in 't', or 0 if it's passed in memory
+static int classify(IrType *t, int is_sse[2]) {
+    if (t->k != IRT_STRUCT) { // A vector goes in one SSE reg too
+        is_sse[0] = t->k == IRT_F32 || t->k == IRT_F64 || t->k == IRT_VEC;
+        return 1;
+    }
+    if (t->size == 0 || t->size > 16) {
+        return 0;
+    }
+    int n = (int) ((t->size + 7) / 8);
+    for (int i = 0; i < n; i++) {
+        is_sse[i] = is_sse_eightbyte(t, 0, (size_t) i * 8);
+    }
+    return n;
+}
 
-// ---- Arithmetic ------------------------------------------------------------
+static ArgLoc place_arg(ArgState *s, IrType *t) {
+    ArgLoc loc = {0};
+    int is_sse[2];
+    int n = classify(t, is_sse);
+    int num_sse = 0;
+    for (int i = 0; i < n; i++) {
+        num_sse += is_sse[i];
+    }
+    if (n > 0 && s->num_gprs + (n - num_sse) <= TARGET->num_gpr_args &&
+            s->num_sse + num_sse <= TARGET->num_fpr_args) {
+        loc.num_regs = n;
+        for (int i = 0; i < n; i++) {
+            loc.is_sse[i] = is_sse[i];
+            loc.regs[i] = is_sse[i] ? SSE_ARGS[s->num_sse++] : GPR_ARGS[s->num_gprs++];
+        }
+    } else {
+        s->stack_size += pad(s->stack_size, t->align > 8 ? t->align : 8);
+        loc.stack_off = s->stack_size;
+        s->stack_size += t->size + pad(t->size, 8);
+    }
+    return loc;
+}
 
-static int INT_OP[IR_LAST] = {
-    [IR_ADD] = X64_ADD,
-    [IR_SUB] = X64_SUB,
+// Aggregates that don't fit in 2 regs are returned in memory: the caller
+// passes a pointer to put them at as a hidden first argument (in rdi), which
+// the callee hands back in rax
+static ArgLoc place_ret(IrType *t) {
+    ArgLoc loc = {0};
+    loc.num_regs = classify(t, loc.is_sse);
+    int num_gprs = 0, num_sse = 0;
+    for (int i = 0; i < loc.num_regs; i++) {
+        loc.regs[i] = loc.is_sse[i] ? SSE_RETS[num_sse++] : GPR_RETS[num_gprs++];
+    }
+    return loc;
+}
+
+static int returns_in_mem(IrType *t) {
+    return t->k == IRT_STRUCT && place_ret(t).num_regs == 0;
+}
+
+static ArgLoc param_loc(Fn *fn, size_t idx) {
+    ArgState s = {0};
+    s.num_gprs = returns_in_mem(fn->ret); // Hidden pointer
+    ArgLoc loc;
+    for (size_t i = 0; i <= idx; i++) {
+        loc = place_arg(&s, vec_get(fn->params, i));
+    }
+    return loc;
+}
+
+// Arguments passed on the stack are stored at the bottom of our stack frame
+// just before the call, so they're at the top of the callee's
+static AsmOpr * opr_out_arg(size_t offset, size_t bytes) {
+    AsmOpr *mem = opr_mem_reg(RSP); // [rsp + <offset>]
+    mem->disp = (int64_t) offset;
+    mem->bytes = bytes;
+    return mem;
+}
+
+// Arguments passed to us on the stack are above the saved rbp and return
+// address
+static AsmOpr * opr_in_arg(size_t offset, size_t bytes) {
+    return opr_frame(16 + (int64_t) offset, bytes);
+}
+
+// A stack slot big enough to hold every eightbyte of an aggregate in full
+static AsmOpr * agg_slot(Assembler *a, IrType *t) {
+    size_t slot = alloc_stack_slot(a->fn, t->size + pad(t->size, 8),
+                                   t->align > 8 ? t->align : 8);
+    return opr_frame(-((int64_t) slot), 0);
+}
+
+// Loading the last eightbyte of an aggregate in one go would read past its
+// end if it isn't 1, 2, 4, or 8 bytes, so it's copied to a stack slot first
+static AsmOpr * loadable_agg(Assembler *a, AsmOpr *mem, IrType *t) {
+    size_t rest = t->size % 8;
+    if (rest == 3 || rest > 4) {
+        AsmOpr *slot = agg_slot(a, t);
+        emit_copy(a, slot, mem, t->size, 1);
+        return slot;
+    }
+    return mem;
+}
+
+static void load_eightbytes(Assembler *a, ArgLoc *loc, AsmOpr *mem, IrType *t) {
+    for (int i = 0; i < loc->num_regs; i++) {
+        size_t bytes = t->size - (size_t) i * 8;
+        if (bytes >= 8 || bytes == 3 || bytes > 4) {
+            bytes = 8; // See 'loadable_agg'
+        }
+        AsmOpr *src = opr_offset(mem, (size_t) i * 8, bytes);
+        if (loc->is_sse[i]) {
+            int op = bytes == 4 ? X64_MOVSS : X64_MOVSD;
+            emit(a, asm2(op, opr_xmm(loc->regs[i]), src));
+        } else if (bytes < 4) {
+            emit(a, asm2(X64_MOVZX, opr_gpr(loc->regs[i], R32), src));
+        } else {
+            emit(a, asm2(X64_MOV, opr_gpr(loc->regs[i], GPR_SIZES[bytes]), src));
+        }
+    }
+}
+
+static void store_eightbytes(Assembler *a, ArgLoc *loc, AsmOpr *mem) {
+    for (int i = 0; i < loc->num_regs; i++) {
+        AsmOpr *dst = opr_offset(mem, (size_t) i * 8, 8);
+        if (loc->is_sse[i]) {
+            emit(a, asm2(X64_MOVSD, dst, opr_xmm(loc->regs[i])));
+        } else {
+            emit(a, asm2(X64_MOV, dst, opr_gpr(loc->regs[i], R64)));
+        }
+    }
+}
+
+static void asm_farg(Assembler *a, IrIns *ir) {
+    ArgLoc loc = param_loc(a->fn, ir->arg_idx);
+    AsmOpr *dst = next_vreg(a, ir->t); // vreg for the result
+    ir->vreg = dst->reg;
+    if (ir->t->k == IRT_STRUCT) { // Point to the aggregate
+        AsmOpr *agg;
+        if (loc.num_regs == 0) {
+            agg = opr_in_arg(loc.stack_off, 0);
+        } else {
+            agg = agg_slot(a, ir->t);
+            store_eightbytes(a, &loc, agg);
+        }
+        emit(a, asm2(X64_LEA, dst, agg));
+        return;
+    }
+    AsmOpr *src;
+    if (loc.num_regs == 0) {
+        src = opr_in_arg(loc.stack_off, ir->t->size);
+    } else if (is_sse(ir->t)) {
+        src = opr_xmm(loc.regs[0]);
+    } else {
+        src = opr_gpr_t(loc.regs[0], ir->t);
+    }
+    emit(a, mov_ins(ir->t, dst, src));
+}
+
+
+// ---- Immediates, Constants, and Memory Operations --------------------------
+
+// Only records the constant for the file's constant pool (see 'fp_pool'); it's
+// loaded wherever it's used
+static void asm_fp(Assembler *a, IrIns *ir) {
+    if (is_fp_zero(ir)) {
+        return;
+    }
+    uint64_t *bits = malloc(sizeof(uint64_t));
+    *bits = fp_bits(ir);
+    vec_push(ir->t->k == IRT_F32 ? a->fn->f32s : a->fn->f64s, bits);
+}
+
+static void asm_load(Assembler *a, IrIns *ir) {
+    if (ir->fold < 0) {
+        discharge(a, ir); // Can't be folded into its use (see 'mark_folds')
+    }
+}
+
+static void asm_store(Assembler *a, IrIns *ir) {
+    if (ir->src->t->k == IRT_VEC) {
+        AsmOpr *dst = vec_mem(load_ptr(a, ir->dst, NULL), ir->src->t);
+        int mov = vec_mov_for(ir->src->t, access_align(ir, ir->dst));
+        emit(a, asm2(mov, dst, discharge(a, ir->src)));
+        return;
+    }
+    AsmOpr *l = load_ptr(a, ir->dst, ir->src->t);
+    AsmOpr *r = inline_imm(a, ir->src);
+    emit(a, asm2(mov_for(ir->src->t), l, r));
+}
+
+static void asm_ptradd(Assembler *a, IrIns *ir) {
+    if (ir->fold > 0) {
+        return; // Folded into every load and store that uses it
+    }
+    AsmOpr *l = discharge(a, ir->l);
+    AsmOpr *r = inline_imm(a, ir->r);
+    if (r->k == OPR_IMM && r->imm == 0) {
+        ir->vreg = l->reg;
+        return; // Doesn't modify the pointer
+    }
+
+    AsmOpr *dst = next_vreg(a, ir->t); // vreg for the result
+    ir->vreg = dst->reg;
+
+    AsmOpr *addr = opr_new(OPR_MEM);
+    addr->base = l->reg;
+    assert(l->size == R64); // Pointers are always 64-bit
+    addr->base_size = R64;
+    addr->scale = 1;
+    switch (r->k) {
+    case OPR_IMM:
+        addr->disp = (int64_t) r->imm;
+        break;
+    case OPR_GPR:
+        addr->idx = r->reg;
+        assert(r->size == R64); // Pointers are always 64-bit
+        addr->idx_size = R64;
+        break;
+    default: UNREACHABLE();
+    }
+    emit(a, asm2(X64_LEA, dst, addr));
+}
+
+// A VLA moves rsp down by its size, rounded up to keep rsp 16 byte aligned,
+// and starts above the arguments for calls (see 'dyn_frame'). An over-aligned
+// object in a function with VLAs is allocated the same way (once, from the
+// entry BB), since a slot addressed off rsp (see 'realign_frame') would move
+static void asm_dyn_alloc(Assembler *a, IrIns *ir) {
+    IrType *t = ir->alloc_t;
+    size_t align = t->align > STACK_ALIGN ? t->align : STACK_ALIGN;
+    size_t extra = align - STACK_ALIGN; // To round the start up to 'align'
+    if (ir->count) {
+        assert(ir->count->t->size == 8); // A 'size_t' (see 'compile_vla')
+        AsmOpr *size = next_vreg(a, ir->count->t);
+        emit(a, asm2(X64_MOV, size, discharge(a, ir->count)));
+        if (t->size != 1) {
+            emit(a, asm2(X64_IMUL, size, opr_imm(t->size)));
+        }
+        emit(a, asm2(X64_ADD, size, opr_imm(STACK_ALIGN - 1 + extra)));
+        emit(a, asm2(X64_AND, size, opr_imm(-(uint64_t) STACK_ALIGN)));
+        emit(a, asm2(X64_SUB, opr_gpr(RSP, R64), size));
+    } else {
+        size_t size = t->size + pad(t->size, STACK_ALIGN) + extra;
+        emit(a, asm2(X64_SUB, opr_gpr(RSP, R64), opr_imm(size)));
+    }
+    AsmOpr *bottom = opr_new(OPR_MEM); // [rsp + <out args>]
+    bottom->base = RSP;
+    bottom->base_size = R64;
+    bottom->scale = 1;
+    bottom->frame = FRAME_DYN;
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    emit(a, asm2(X64_LEA, dst, bottom));
+    if (extra > 0) {
+        emit(a, asm2(X64_ADD, dst, opr_imm(align - 1)));
+        emit(a, asm2(X64_AND, dst, opr_imm(-(uint64_t) align)));
+    }
+}
+
+
+// ---- Vectors ---------------------------------------------------------------
+
+// A vector (see 'vectorise.h') lives in an SSE reg, with its lanes packed into
+// the low 4, 8, or 16 bytes; whatever's in the rest of the reg is ignored.
+// Only SSE2 instructions are used, which every x86-64 CPU has. Most of them
+// modify their left operand, so the result goes in a copy of it
+
+static int PADD[] = { [1] = X64_PADDB, [2] = X64_PADDW, [4] = X64_PADDD, [8] = X64_PADDQ, };
+static int PSUB[] = { [1] = X64_PSUBB, [2] = X64_PSUBW, [4] = X64_PSUBD, [8] = X64_PSUBQ, };
+static int PSLL[] = { [2] = X64_PSLLW, [4] = X64_PSLLD, [8] = X64_PSLLQ, };
+static int PSRL[] = { [2] = X64_PSRLW, [4] = X64_PSRLD, [8] = X64_PSRLQ, };
+static int PSRA[] = { [2] = X64_PSRAW, [4] = X64_PSRAD, };
+static int PUNPCKL[] = {
+    [1] = X64_PUNPCKLBW, [2] = X64_PUNPCKLWD, [4] = X64_PUNPCKLDQ, [8] = X64_PUNPCKLQDQ,
+};
+static int PACKSS[] = { [2] = X64_PACKSSWB, [4] = X64_PACKSSDW, }; // By source lane
+
+// The instruction for an IR operation on lanes of type 'elem'
+static int vec_op(int op, IrType *elem) {
+    if (elem->k == IRT_F32 || elem->k == IRT_F64) {
+        int f32 = elem->k == IRT_F32;
+        switch (op) {
+            case IR_ADD:  return f32 ? X64_ADDPS : X64_ADDPD;
+            case IR_SUB:  return f32 ? X64_SUBPS : X64_SUBPD;
+            case IR_MUL:  return f32 ? X64_MULPS : X64_MULPD;
+            case IR_FDIV: return f32 ? X64_DIVPS : X64_DIVPD;
+            default: UNREACHABLE();
+        }
+    }
+    int x64 = 0;
+    switch (op) {
+        case IR_ADD:     x64 = PADD[elem->size]; break;
+        case IR_SUB:     x64 = PSUB[elem->size]; break;
+        case IR_MUL:     x64 = elem->size == 2 ? X64_PMULLW : 0; break;
+        case IR_BIT_AND: x64 = X64_PAND; break;
+        case IR_BIT_OR:  x64 = X64_POR; break;
+        case IR_BIT_XOR: x64 = X64_PXOR; break;
+        case IR_SHL:     x64 = PSLL[elem->size]; break;
+        case IR_SHR:     x64 = PSRL[elem->size]; break;
+        case IR_SAR:     x64 = PSRA[elem->size]; break;
+        default: UNREACHABLE();
+    }
+    assert(x64 != 0); // Not in SSE2 (see 'vectorise.c')
+    return x64;
+}
+
+static AsmOpr * vec_copy(Assembler *a, IrType *t, AsmOpr *src) {
+    AsmOpr *dst = next_vreg(a, t);
+    emit(a, asm2(X64_MOVDQU, dst, src));
+    return dst;
+}
+
+// SSE2 has no 32-bit lane multiply ('pmulld' is SSE4.1), so the even and odd
+// lanes are multiplied into 64-bit products separately with 'pmuludq' (whose
+// low 32 bits are right whatever the signedness), then recombined
+static void asm_vec_mul32(Assembler *a, IrIns *ir, AsmOpr *l, AsmOpr *r) {
+    AsmOpr *even = vec_copy(a, ir->t, l);
+    emit(a, asm2(X64_PMULUDQ, even, r));
+    emit(a, asm2(X64_PSLLQ, even, opr_imm(32)));
+    emit(a, asm2(X64_PSRLQ, even, opr_imm(32)));
+    AsmOpr *odd = vec_copy(a, ir->t, l);
+    emit(a, asm2(X64_PSRLQ, odd, opr_imm(32)));
+    AsmOpr *r_odd = vec_copy(a, ir->t, r);
+    emit(a, asm2(X64_PSRLQ, r_odd, opr_imm(32)));
+    emit(a, asm2(X64_PMULUDQ, odd, r_odd));
+    emit(a, asm2(X64_PSLLQ, odd, opr_imm(32)));
+    emit(a, asm2(X64_POR, even, odd));
+    ir->vreg = even->reg;
+}
+
+// A shift's right operand is always a scalar IR_IMM
+static void asm_vec_arith(Assembler *a, IrIns *ir) {
+    AsmOpr *l = discharge(a, ir->l);
+    AsmOpr *r = ir->r->op == IR_IMM ? opr_imm(ir->r->imm) : discharge(a, ir->r);
+    IrType *elem = ir->t->elem;
+    if (ir->op == IR_MUL && elem->size == 4 && elem->k != IRT_F32) {
+        asm_vec_mul32(a, ir, l, r);
+        return;
+    }
+    AsmOpr *dst = vec_copy(a, ir->t, l);
+    ir->vreg = dst->reg;
+    emit(a, asm2(vec_op(ir->op, ir->t->elem), dst, r));
+}
+
+// Interleaving the low lanes with themselves doubles the number of copies of
+// the scalar in lane 0 each time
+static void asm_splat(Assembler *a, IrIns *ir) {
+    AsmOpr *src = discharge(a, ir->l);
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    size_t size = ir->t->elem->size;
+    if (src->k == OPR_XMM) {
+        emit(a, asm2(X64_MOVDQU, dst, src));
+    } else if (size == 8) {
+        emit(a, asm2(X64_MOVQ, dst, opr_gpr(src->reg, R64)));
+    } else { // The junk above an 8 or 16-bit scalar gets overwritten
+        emit(a, asm2(X64_MOVD, dst, opr_gpr(src->reg, R32)));
+    }
+    for (; size < ir->t->size; size *= 2) {
+        emit(a, asm2(PUNPCKL[size], dst, dst));
+    }
+}
+
+// Combines the top half of the lanes into the bottom half, until there's only
+// one left
+static void asm_reduce(Assembler *a, IrIns *ir) {
+    IrType *t = ir->vec->t;
+    AsmOpr *acc = vec_copy(a, t, discharge(a, ir->vec));
+    int op = vec_op(ir->reduce_op, t->elem);
+    for (size_t size = t->size; size > t->elem->size; size /= 2) {
+        AsmOpr *top = vec_copy(a, t, acc);
+        emit(a, asm2(X64_PSRLDQ, top, opr_imm(size / 2)));
+        emit(a, asm2(op, acc, top));
+    }
+    if (ir->t->k == IRT_F32 || ir->t->k == IRT_F64) {
+        ir->vreg = acc->reg; // The bottom lane's the scalar
+        return;
+    }
+    assert(ir->t->k >= IRT_I8 && ir->t->k <= IRT_I64);
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    if (ir->t->size == 8) {
+        emit(a, asm2(X64_MOVQ, dst, acc));
+    } else {
+        emit(a, asm2(X64_MOVD, opr_gpr(dst->reg, R32), acc));
+    }
+}
+
+// Each step doubles the size of the lanes in the low half of the reg, by
+// interleaving them with zeros or with their sign bits
+static void asm_vec_ext(Assembler *a, IrIns *ir) {
+    AsmOpr *dst = vec_copy(a, ir->t, discharge(a, ir->l));
+    ir->vreg = dst->reg;
+    AsmOpr *zero = NULL;
+    for (size_t size = ir->l->t->elem->size; size < ir->t->elem->size; size *= 2) {
+        if (ir->op == IR_ZEXT) {
+            if (!zero) {
+                zero = next_vreg(a, ir->t);
+                emit(a, asm2(X64_PXOR, zero, zero));
+            }
+            emit(a, asm2(PUNPCKL[size], dst, zero));
+        } else if (size < 4) { // Shift each copy's sign bit back down
+            emit(a, asm2(PUNPCKL[size], dst, dst));
+            emit(a, asm2(PSRA[size * 2], dst, opr_imm(size * 8)));
+        } else { // There's no 'psraq'
+            AsmOpr *sign = vec_copy(a, ir->t, dst);
+            emit(a, asm2(X64_PSRAD, sign, opr_imm(31)));
+            emit(a, asm2(X64_PUNPCKLDQ, dst, sign));
+        }
+    }
+}
+
+// Each step halves the size of the lanes. The bottom half of each lane is
+// sign extended over the top half first, so that packing them with signed
+// saturation leaves them alone (there's no packing without saturation)
+static void asm_vec_trunc(Assembler *a, IrIns *ir) {
+    AsmOpr *dst = vec_copy(a, ir->t, discharge(a, ir->l));
+    ir->vreg = dst->reg;
+    for (size_t size = ir->l->t->elem->size; size > ir->t->elem->size; size /= 2) {
+        AsmOpr *bits = opr_imm(size * 4);
+        emit(a, asm2(PSLL[size], dst, bits));
+        emit(a, asm2(PSRA[size], dst, bits));
+        emit(a, asm2(PACKSS[size], dst, dst));
+    }
+}
+
+
+// ---- Arithmetic ------------------------------------------------------------
+
+static int INT_OP[IR_LAST] = {
+    [IR_ADD] = X64_ADD,
+    [IR_SUB] = X64_SUB,
     [IR_MUL] = X64_IMUL,
     [IR_BIT_AND] = X64_AND,
     [IR_BIT_OR] = X64_OR,
@@ -407,12 +1539,203 @@ static int F64_OP[IR_LAST] = {
     [IR_FDIV] = X64_DIVSD,
 };
 
-static void asm_arith(Assembler *a, IrIns *ir) {
-    AsmOpr *l = discharge(a, ir->l); // Left operand always a vreg
-    AsmOpr *r = inline_imm_mem(a, ir->r);
+static int AVX_F32_OP[IR_LAST] = { // 'vaddss dst, l, r' (see 'CPU_AVX')
+    [IR_ADD]  = X64_VADDSS,
+    [IR_SUB]  = X64_VSUBSS,
+    [IR_MUL]  = X64_VMULSS,
+    [IR_FDIV] = X64_VDIVSS,
+};
+
+static int AVX_F64_OP[IR_LAST] = {
+    [IR_ADD]  = X64_VADDSD,
+    [IR_SUB]  = X64_VSUBSD,
+    [IR_MUL]  = X64_VMULSD,
+    [IR_FDIV] = X64_VDIVSD,
+};
+
+static int is_commutative(int op) {
+    return op == IR_ADD || op == IR_MUL || op == IR_BIT_AND ||
+           op == IR_BIT_OR || op == IR_BIT_XOR;
+}
+
+// Whether an operand can go straight into the instruction as a memory operand
+// (see 'inline_mem'), or as an immediate or memory operand, instead of a vreg
+static int is_mem_opr(IrIns *ir) {
+    return (ir->op == IR_FP && !is_fp_zero(ir)) || (ir->op == IR_LOAD && ir->fold > 0 && ir->vreg == R_NONE);
+}
+
+static int is_inlinable(IrIns *ir) {
+    return ir->op == IR_IMM || is_mem_opr(ir);
+}
+
+static int asm_lea(Assembler *a, IrIns *ir) {
+    Addr addr;
+    IrIns *scaled;
+    if (!match_lea(ir, &addr, &scaled)) {
+        return 0;
+    }
+    // Better as an arithmetic instruction on a memory operand, unless the
+    // multiply was folded into the 'lea' (so nothing else computes it)
+    if ((!scaled || scaled->fold <= 0) &&
+            (is_mem_opr(ir->r) || (is_commutative(ir->op) && is_mem_opr(ir->l)))) {
+        return 0;
+    }
+    if (scaled && scaled->fold <= 0) { // Computed for another use anyway
+        addr.idx = scaled;
+        addr.scale = 1;
+    }
+    AsmOpr *mem = opr_new(OPR_MEM); // [<base> + <idx>*<scale> + <disp>]
+    mem->base = discharge(a, addr.base)->reg;
+    mem->base_size = R64;
+    mem->disp = addr.disp;
+    mem->scale = addr.scale;
+    if (addr.idx) {
+        mem->idx = discharge(a, addr.idx)->reg;
+        mem->idx_size = R64;
+    }
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    emit(a, asm2(X64_LEA, dst, mem));
+    return 1;
+}
+
+static int is_fp_arith(IrType *t) {
+    IrType *elem = t->k == IRT_VEC ? t->elem : t;
+    return elem->k == IRT_F32 || elem->k == IRT_F64;
+}
 
+// The multiply folded into a floating point add or subtract (see
+// 'mark_fma_folds'), if there is one. An integer multiply's 'fold' means it's
+// a scaled index in an address instead
+static IrIns * fma_mul(IrIns *ir) {
+    if ((ir->op != IR_ADD && ir->op != IR_SUB) || !is_fp_arith(ir->t)) {
+        return NULL;
+    } else if (ir->l->op == IR_MUL && ir->l->fold > 0) {
+        return ir->l;
+    } else if (ir->r->op == IR_MUL && ir->r->fold > 0) {
+        return ir->r;
+    }
+    return NULL;
+}
+
+static int FMA_OP[3][4] = { // By add or subtract, then by type (see 'asm_fma')
+    { X64_VFMADD231SS, X64_VFMADD231SD, X64_VFMADD231PS, X64_VFMADD231PD },
+    { X64_VFMSUB231SS, X64_VFMSUB231SD, X64_VFMSUB231PS, X64_VFMSUB231PD },
+    { X64_VFNMADD231SS, X64_VFNMADD231SD, X64_VFNMADD231PS, X64_VFNMADD231PD },
+};
+
+// 'c + a * b' -> 'mov dst, c' then 'vfmadd231sd dst, a, b'. 'a * b - c' is a
+// 'vfmsub231sd' and 'c - a * b' a 'vfnmadd231sd'; the same for vectors with
+// the packed forms
+static void asm_fma(Assembler *a, IrIns *ir, IrIns *mul) {
+    IrIns *addend = mul == ir->l ? ir->r : ir->l;
+    IrIns *left = mul->l, *right = mul->r;
+    if (is_inlinable(left) && !is_inlinable(right)) {
+        left = mul->r; // Put the memory operand on the right
+        right = mul->l;
+    }
+    int packed = ir->t->k == IRT_VEC;
+    IrType *t = packed ? ir->t->elem : ir->t;
+    AsmOpr *dst;
+    if (packed) { // Vector loads are never folded (see 'mark_use')
+        dst = vec_copy(a, ir->t, discharge(a, addend));
+    } else {
+        dst = next_vreg(a, ir->t);
+        emit(a, asm2(mov_for(ir->t), dst, inline_mem(a, addend)));
+    }
+    ir->vreg = dst->reg;
+    AsmOpr *l = discharge(a, left);
+    AsmOpr *r = inline_mem(a, right);
+    int kind = ir->op == IR_ADD ? 0 : mul == ir->l ? 1 : 2;
+    emit(a, asm3(FMA_OP[kind][packed * 2 + (t->k == IRT_F64)], dst, l, r));
+}
+
+// 'mul' leaves both halves of the 128-bit product in rdx:rax, so a 64-bit
+// multiply and an IR_UMULH of the same operands later in the block (e.g., the
+// halves of a '__int128' product) share a single 'mul'
+static IrIns * wide_mul_partner(IrIns *ir) {
+    int op = ir->op == IR_MUL ? IR_UMULH : IR_MUL;
+    for (IrIns *p = ir->next; p; p = p->next) {
+        if (p->op == op && p->fold == 0 && p->t->k == IRT_I64 &&
+                ((p->l == ir->l && p->r == ir->r) || (p->l == ir->r && p->r == ir->l))) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static int asm_wide_mul(Assembler *a, IrIns *ir) {
+    IrIns *partner = wide_mul_partner(ir);
+    if (ir->op == IR_MUL && !partner) {
+        return 0; // 'imul' on its own
+    }
+    IrIns *left = ir->l, *right = ir->r;
+    if (is_inlinable(left) && left->op != IR_IMM) {
+        left = ir->r; // Put the memory operand on the right
+        right = ir->l;
+    }
+    AsmOpr *l = discharge(a, left);
+    AsmOpr *r = inline_mem(a, right); // No immediate operand
+    emit(a, asm2(X64_MOV, opr_gpr(RAX, R64), l));
+    emit(a, asm1(X64_MUL, r));
+    IrIns *lo = ir->op == IR_MUL ? ir : partner;
+    IrIns *hi = ir->op == IR_MUL ? partner : ir;
+    if (lo) {
+        AsmOpr *dst = next_vreg(a, lo->t);
+        emit(a, asm2(X64_MOV, dst, opr_gpr(RAX, R64)));
+        lo->vreg = dst->reg;
+    }
+    AsmOpr *dst = next_vreg(a, hi->t);
+    emit(a, asm2(X64_MOV, dst, opr_gpr(RDX, R64)));
+    hi->vreg = dst->reg;
+    if (partner) {
+        partner->fold = 1; // Done
+    }
+    return 1;
+}
+
+static void asm_arith(Assembler *a, IrIns *ir) {
+    if (ir->fold > 0) {
+        return; // Scaled index folded into an address, or multiply into an FMA
+    }
+    IrIns *mul = fma_mul(ir);
+    if (mul) {
+        asm_fma(a, ir, mul);
+        return;
+    }
+    if (ir->t->k == IRT_VEC) {
+        asm_vec_arith(a, ir);
+        return;
+    }
+    if (asm_lea(a, ir)) {
+        return;
+    }
+    if (ir->op == IR_MUL && ir->t->k == IRT_I64 && asm_wide_mul(a, ir)) {
+        return;
+    }
+    IrIns *left = ir->l, *right = ir->r;
+    if (is_commutative(ir->op) && is_inlinable(left) &&
+            (!is_inlinable(right) || left->op == IR_IMM)) {
+        left = ir->r; // Put the immediate or memory operand on the right
+        right = ir->l;
+    }
+    AsmOpr *l = discharge(a, left); // Left operand always a vreg
+    AsmOpr *r;
     AsmOpr *dst = next_vreg(a, ir->t); // vreg for the result
     ir->vreg = dst->reg;
+    if (!is_sse(ir->t) && ir->t->size < 4) { // 32-bit op (see 'full_width')
+        r = full_width(inline_imm(a, right)); // No 32-bit memory operand
+        l = full_width(l);
+        dst = full_width(dst);
+    } else {
+        r = inline_imm_mem(a, right);
+    }
+    if (is_sse(ir->t) && (CPU_FEATURES & CPU_AVX)) { // No 'mov' needed
+        int op = ir->t->k == IRT_F32 ? AVX_F32_OP[ir->op] : AVX_F64_OP[ir->op];
+        assert(op != 0);
+        emit(a, asm3(op, dst, l, r));
+        return;
+    }
     emit(a, asm2(mov_for(ir->t), dst, l));
 
     int op;
@@ -425,24 +1748,237 @@ static void asm_arith(Assembler *a, IrIns *ir) {
     emit(a, asm2(op, dst, r));
 }
 
+// Division by a constant is a multiply by a 'magic number' close to
+// '2^(N + s) / d' that keeps the high N bits of the product, then a shift
+// right by 's' ("Hacker's Delight", chapter 10). Powers of 2 are already
+// shifts and masks by now (see 'strength_reduce')
+
+typedef struct {
+    uint64_t m; // N bits
+    int s;
+    int add; // (Unsigned) the magic number's really '2^N + m'
+} Magic;
+
+static uint64_t low_bits(int n) {
+    return n >= 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << n) - 1;
+}
+
+// Figure 10-1, for an N-bit signed 'd' that isn't -1, 0, or 1. The magic
+// number's negative for a negative 'd'
+static Magic signed_magic(int64_t d, int n) {
+    uint64_t mask = low_bits(n), two_n1 = (uint64_t) 1 << (n - 1);
+    uint64_t ad = (d < 0 ? -(uint64_t) d : (uint64_t) d) & mask;
+    uint64_t t = two_n1 + (d < 0);
+    uint64_t anc = t - 1 - t % ad; // Absolute value of 'nc'
+    uint64_t q1 = two_n1 / anc, r1 = two_n1 - q1 * anc; // 2^p / |nc|
+    uint64_t q2 = two_n1 / ad, r2 = two_n1 - q2 * ad;   // 2^p / |d|
+    uint64_t delta;
+    int p = n - 1;
+    do {
+        p++;
+        q1 = (q1 * 2) & mask;
+        r1 = (r1 * 2) & mask;
+        if (r1 >= anc) {
+            q1 = (q1 + 1) & mask;
+            r1 -= anc;
+        }
+        q2 = (q2 * 2) & mask;
+        r2 = (r2 * 2) & mask;
+        if (r2 >= ad) {
+            q2 = (q2 + 1) & mask;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    Magic mg = { (q2 + 1) & mask, p - n, 0 };
+    if (d < 0) {
+        mg.m = -mg.m & mask;
+    }
+    return mg;
+}
+
+// Figure 10-2 ('magicu2'), for an N-bit unsigned 'd' > 1
+static Magic unsigned_magic(uint64_t d, int n) {
+    uint64_t mask = low_bits(n), two_n1 = (uint64_t) 1 << (n - 1);
+    uint64_t q = (two_n1 - 1) / d, r = (two_n1 - 1) - q * d; // (2^p - 1) / d
+    uint64_t two_pn = 0, delta; // 2^(p - N)
+    Magic mg = { 0, 0, 0 };
+    int p = n - 1;
+    do {
+        p++;
+        two_pn = p == n ? 1 : two_pn * 2;
+        if (r + 1 >= d - r) {
+            mg.add |= q >= two_n1 - 1;
+            q = (q * 2 + 1) & mask;
+            r = (r * 2 + 1 - d) & mask;
+        } else {
+            mg.add |= q >= two_n1;
+            q = (q * 2) & mask;
+            r = (r * 2 + 1) & mask;
+        }
+        delta = d - 1 - r;
+    } while (p < n * 2 && two_pn < delta);
+    mg.m = (q + 1) & mask;
+    mg.s = p - n;
+    return mg;
+}
+
+// 'imul' only takes a sign extended 32-bit immediate
+static void asm_imul_imm(Assembler *a, AsmOpr *dst, int64_t v) {
+    if (v >= INT32_MIN && v <= INT32_MAX) {
+        emit(a, asm2(X64_IMUL, dst, opr_imm((uint64_t) v)));
+    } else {
+        AsmOpr *imm = next_ptr_vreg(a);
+        emit(a, asm2(X64_MOV, imm, opr_imm((uint64_t) v)));
+        emit(a, asm2(X64_IMUL, dst, opr_gpr(imm->reg, dst->size)));
+    }
+}
+
+// Adds the '2^N * x' left out of the high half 'h' of an unsigned product,
+// without overflowing: '(((x - h) >> 1) + h) >> (s - 1)'
+static AsmOpr * asm_magic_add(Assembler *a, AsmOpr *x, AsmOpr *h, int s) {
+    AsmOpr *q = opr_gpr(a->next_gpr++, x->size);
+    emit(a, asm2(X64_MOV, q, x));
+    emit(a, asm2(X64_SUB, q, h));
+    emit(a, asm2(X64_SHR, q, opr_imm(1)));
+    emit(a, asm2(X64_ADD, q, h));
+    if (s > 1) {
+        emit(a, asm2(X64_SHR, q, opr_imm(s - 1)));
+    }
+    return q;
+}
+
+// Adds 1 to a negative quotient, since the shift rounded it down
+static void asm_round_to_zero(Assembler *a, AsmOpr *q) {
+    AsmOpr *sign = opr_gpr(a->next_gpr++, q->size);
+    emit(a, asm2(X64_MOV, sign, q));
+    emit(a, asm2(X64_SHR, sign, opr_imm(q->size == R64 ? 63 : 31)));
+    emit(a, asm2(X64_ADD, q, sign));
+}
+
+// A 32-bit dividend's extended to 64 bits, so the whole product fits in one
+// register and the high half's just a shift. A signed magic number with the
+// 'wrong' sign (e.g., a negative one for a positive 'd') needs the dividend
+// added to the high half, which is the same as adding 2^32 to the magic number
+static AsmOpr * asm_div32_imm(Assembler *a, AsmOpr *x, int64_t d, int is_signed) {
+    AsmOpr *t = next_ptr_vreg(a);
+    AsmOpr *t32 = opr_gpr(t->reg, R32);
+    if (is_signed) {
+        Magic mg = signed_magic(d, 32);
+        int64_t m = (int32_t) mg.m;
+        if (d > 0 && m < 0) {
+            m += (int64_t) 1 << 32;
+        } else if (d < 0 && m > 0) {
+            m -= (int64_t) 1 << 32;
+        }
+        emit(a, asm2(X64_MOVSX, t, x));
+        asm_imul_imm(a, t, m);
+        emit(a, asm2(X64_SAR, t, opr_imm(32 + mg.s)));
+        asm_round_to_zero(a, t32);
+        return t32;
+    } else {
+        Magic mg = unsigned_magic((uint32_t) d, 32);
+        emit(a, asm2(X64_MOVZX, t, x)); // Not a 'mov', which the coalescer removes
+        asm_imul_imm(a, t, (int64_t) mg.m);
+        if (!mg.add) {
+            emit(a, asm2(X64_SHR, t, opr_imm(32 + mg.s)));
+            return t32;
+        }
+        emit(a, asm2(X64_SHR, t, opr_imm(32)));
+        return asm_magic_add(a, x, t32, mg.s);
+    }
+}
+
+// 'mul' leaves the high half of the 128-bit product in rdx. There's only an
+// unsigned 'mul' with a single operand, so the high half of the signed product
+// is 'mulhu(x, m) - (x < 0 ? m : 0) - (m < 0 ? x : 0)' (section 8-3); the
+// last term cancels with the dividend that a magic number with the 'wrong'
+// sign needs added, leaving '- x' for a negative 'd' only
+static AsmOpr * asm_div64_imm(Assembler *a, AsmOpr *x, int64_t d, int is_signed) {
+    Magic mg = is_signed ? signed_magic(d, 64) : unsigned_magic((uint64_t) d, 64);
+    AsmOpr *m = next_ptr_vreg(a);
+    emit(a, asm2(X64_MOV, m, opr_imm(mg.m)));
+    emit(a, asm2(X64_MOV, opr_gpr(RAX, R64), m));
+    emit(a, asm1(X64_MUL, x));
+    AsmOpr *h = next_ptr_vreg(a);
+    emit(a, asm2(X64_MOV, h, opr_gpr(RDX, R64)));
+    if (is_signed) {
+        AsmOpr *t = next_ptr_vreg(a);
+        emit(a, asm2(X64_MOV, t, x));
+        emit(a, asm2(X64_SAR, t, opr_imm(63)));
+        emit(a, asm2(X64_AND, t, m));
+        emit(a, asm2(X64_SUB, h, t));
+        if (d < 0) {
+            emit(a, asm2(X64_SUB, h, x));
+        }
+        if (mg.s > 0) {
+            emit(a, asm2(X64_SAR, h, opr_imm(mg.s)));
+        }
+        asm_round_to_zero(a, h);
+        return h;
+    } else if (mg.add) {
+        return asm_magic_add(a, x, h, mg.s);
+    } else {
+        if (mg.s > 0) {
+            emit(a, asm2(X64_SHR, h, opr_imm(mg.s)));
+        }
+        return h;
+    }
+}
+
+// Returns 0 for a divisor that's left to 'idiv' or 'div' (0, 1, and -1)
+static int asm_div_mod_imm(Assembler *a, IrIns *ir) {
+    int is_signed = (ir->op == IR_SDIV || ir->op == IR_SMOD);
+    size_t size = ir->t->size;
+    int64_t d = (int64_t) ir->r->imm;
+    if (size == 4) {
+        d = is_signed ? (int32_t) d : (int64_t) (uint32_t) d;
+    } else if (size != 8) {
+        return 0; // Only 'short's and 'char's that weren't promoted to 'int'
+    }
+    if (d == 0 || d == 1 || (is_signed && d == -1)) {
+        return 0;
+    }
+    AsmOpr *x = discharge(a, ir->l);
+    AsmOpr *q = size == 4 ? asm_div32_imm(a, x, d, is_signed) :
+                            asm_div64_imm(a, x, d, is_signed);
+    if (ir->op == IR_SDIV || ir->op == IR_UDIV) {
+        ir->vreg = q->reg;
+        return 1;
+    }
+    asm_imul_imm(a, q, size == 4 ? (int32_t) d : d); // 'x - q * d'
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    emit(a, asm2(X64_MOV, dst, x));
+    emit(a, asm2(X64_SUB, dst, q));
+    return 1;
+}
+
 static void asm_div_mod(Assembler *a, IrIns *ir) {
+    if (ir->r->op == IR_IMM && asm_div_mod_imm(a, ir)) {
+        return;
+    }
     AsmOpr *dividend = discharge(a, ir->l); // Left operand always a vreg
     AsmOpr *divisor = inline_mem(a, ir->r);
 
     // Mov dividend into eax
     emit(a, asm2(X64_MOV, opr_gpr(RAX, dividend->size), dividend));
 
-    // Sign extend eax into edx:eax
-    int ext_op;
-    switch (ir->t->size) {
-        case 4:  ext_op = X64_CDQ; break;
-        case 8:  ext_op = X64_CQO; break;
-        default: ext_op = X64_CWD; break;
+    // Sign extend eax into edx:eax, or zero edx for 'div'
+    int is_signed = (ir->op == IR_SDIV || ir->op == IR_SMOD);
+    if (is_signed) {
+        int ext_op;
+        switch (ir->t->size) {
+            case 4:  ext_op = X64_CDQ; break;
+            case 8:  ext_op = X64_CQO; break;
+            default: ext_op = X64_CWD; break;
+        }
+        emit(a, asm0(ext_op));
+    } else {
+        emit(a, asm2(X64_MOV, opr_gpr(RDX, R32), opr_imm(0))); // Zeros all of rdx
     }
-    emit(a, asm0(ext_op));
 
     // div or idiv performs rdx:rax / <operand>
-    int is_signed = (ir->op == IR_SDIV || ir->op == IR_SMOD);
     emit(a, asm1(is_signed ? X64_IDIV : X64_DIV, divisor));
 
     // Mov result from rax (division) or rdx (modulo) into vreg
@@ -457,26 +1993,105 @@ static void asm_div_mod(Assembler *a, IrIns *ir) {
     emit(a, asm2(X64_MOV, dst, result));
 }
 
+static int BMI2_OP[IR_LAST] = {
+    [IR_SHL] = X64_SHLX,
+    [IR_SAR] = X64_SARX,
+    [IR_SHR] = X64_SHRX,
+};
+
+// 'shlx dst, l, count' takes the count in any register rather than 'cl', so
+// nothing has to move into rcx, and leaves 'l' alone. The count's register is
+// the size of the shift, but only its low 5 (or 6) bits are read
+static void asm_shx(Assembler *a, IrIns *ir, AsmOpr *l, AsmOpr *r) {
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    if (ir->t->size < 4) { // 32-bit shift of the extended value (see 'full_width')
+        AsmOpr *ext = full_width(next_vreg(a, ir->t));
+        int op = ir->op == IR_SHL ? X64_MOV : ir->op == IR_SAR ? X64_MOVSX : X64_MOVZX;
+        emit(a, asm2(op, ext, op == X64_MOV ? full_width(l) : l));
+        l = ext;
+        dst = full_width(dst);
+    }
+    emit(a, asm3(BMI2_OP[ir->op], dst, l, opr_gpr(r->reg, dst->size)));
+}
+
 static void asm_sh(Assembler *a, IrIns *ir) {
+    if (ir->t->k == IRT_VEC) {
+        asm_vec_arith(a, ir);
+        return;
+    }
+    if (ir->fold > 0) {
+        return; // Scaled index folded into an address
+    }
+    if (asm_lea(a, ir)) {
+        return;
+    }
     AsmOpr *l = discharge(a, ir->l); // Left operand always a vreg
 
     AsmOpr *r = inline_imm(a, ir->r); // Right either imm or vreg
-    if (r->k == OPR_GPR) { // If a vreg, shift count has to be in cl
-        emit(a, asm2(X64_MOV, opr_gpr(RCX, r->size), r));
-        r = opr_gpr(RCX, R8L);
+    if (r->k == OPR_GPR && (CPU_FEATURES & CPU_BMI2)) {
+        asm_shx(a, ir, l, r);
+        return;
     }
-
     AsmOpr *dst = next_vreg(a, ir->t); // vreg for the result
     ir->vreg = dst->reg;
-    emit(a, asm2(X64_MOV, dst, l));
+    if (ir->t->size < 4) { // 32-bit shift of the extended value (see 'full_width')
+        int op = ir->op == IR_SHL ? X64_MOV : ir->op == IR_SAR ? X64_MOVSX : X64_MOVZX;
+        dst = full_width(dst);
+        emit(a, asm2(op, dst, op == X64_MOV ? full_width(l) : l));
+    } else {
+        emit(a, asm2(X64_MOV, dst, l));
+    }
+
+    // If a vreg, the shift count has to be in cl. It's moved there last, since
+    // rcx is only live at the instructions that mention it; a spill load for
+    // 'l' between the two could otherwise be given rcx
+    if (r->k == OPR_GPR) {
+        r = full_width(r);
+        emit(a, asm2(X64_MOV, opr_gpr(RCX, r->size), r));
+        r = opr_gpr(RCX, R8L);
+    }
 
     emit(a, asm2(INT_OP[ir->op], dst, r)); // shift operation
 }
 
+// 'bsr' gives the index of the highest set bit, which XORing with 31 (or 63)
+// turns into the number of leading zeros. 'lzcnt' (and 'tzcnt', in place of
+// 'bsf') counts them directly
+static void asm_bits(Assembler *a, IrIns *ir) {
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    switch (ir->op) {
+    case IR_POPCNT: emit(a, asm2(X64_POPCNT, dst, inline_mem(a, ir->l))); break;
+    case IR_CTZ: {
+        int op = (CPU_FEATURES & CPU_BMI1) ? X64_TZCNT : X64_BSF;
+        emit(a, asm2(op, dst, inline_mem(a, ir->l)));
+        break;
+    }
+    case IR_CLZ:
+        if (CPU_FEATURES & CPU_LZCNT) {
+            emit(a, asm2(X64_LZCNT, dst, inline_mem(a, ir->l)));
+            break;
+        }
+        emit(a, asm2(X64_BSR, dst, inline_mem(a, ir->l)));
+        emit(a, asm2(X64_XOR, dst, opr_imm(ir->t->size * 8 - 1)));
+        break;
+    case IR_BSWAP:
+        emit(a, asm2(X64_MOV, dst, discharge(a, ir->l)));
+        emit(a, asm1(X64_BSWAP, dst));
+        break;
+    default: UNREACHABLE();
+    }
+}
+
 
 // ---- Conversions -----------------------------------------------------------
 
 static void asm_trunc(Assembler *a, IrIns *ir) {
+    if (ir->t->k == IRT_VEC) {
+        asm_vec_trunc(a, ir);
+        return;
+    }
     // For conversions, we can't allocate the result to the same vreg as its
     // operand, because the source operand might still be used after the
     // conversion operation.
@@ -488,32 +2103,62 @@ static void asm_trunc(Assembler *a, IrIns *ir) {
     // We can't (e.g.) do mov ax, qword [rbp-4]; we have to mov into a register
     // the same size as the SOURCE, then use the truncated register (i.e., ax)
     // in future instructions
-    emit(a, asm2(X64_MOV, opr_gpr_t(dst->reg, ir->l->t), src));
+    emit(a, mov_ins(ir->l->t, opr_gpr_t(dst->reg, ir->l->t), src));
 }
 
 static void asm_ext(Assembler *a, IrIns *ir, int op) {
+    if (ir->t->k == IRT_VEC && ir->op == IR_BITCAST) { // Same bits
+        AsmOpr *dst = vec_copy(a, ir->t, discharge(a, ir->l));
+        ir->vreg = dst->reg;
+        return;
+    } else if (ir->t->k == IRT_VEC) {
+        asm_vec_ext(a, ir);
+        return;
+    }
     AsmOpr *src = inline_imm_mem(a, ir->l);
     if (src->k == OPR_IMM) {
         op = X64_MOV;
     }
     AsmOpr *dst = next_vreg(a, ir->t); // New vreg for the result
     ir->vreg = dst->reg;
-    emit(a, asm2(op, dst, src));
+    if (ir->t->size < 4) { // i8 -> i16 (see 'full_width')
+        emit(a, op == X64_MOV ? mov_ins(ir->t, dst, src) : asm2(op, full_width(dst), src));
+    } else {
+        emit(a, asm2(op, dst, src));
+    }
+}
+
+// The new bits don't matter, so it's the same register read at the wider size
+// (like 'asm_trunc' the other way around), which the coalescer removes
+static void asm_anyext(Assembler *a, IrIns *ir) {
+    AsmOpr *src = discharge(a, ir->l);
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    emit(a, mov_ins(ir->l->t, opr_gpr_t(dst->reg, ir->l->t), src));
+}
+
+// Conversions into an SSE register only write its low lanes, keeping the rest
+// of it, so they'd wait on whatever last wrote it. Zeroing it first with 'pxor'
+// breaks the dependency (see 'X64_DEFS_LEFT' in 'reg_alloc.c')
+static AsmOpr * fresh_xmm(Assembler *a, IrType *t) {
+    AsmOpr *dst = next_vreg(a, t);
+    emit(a, asm2(X64_PXOR, dst, dst));
+    return dst;
 }
 
 static void asm_fp_trunc_ext(Assembler *a, IrIns *ir, int op) {
     // See below for why we don't use cvtxx2xx with a memory operand:
     // https://stackoverflow.com/questions/16597587/why-dont-gcc-and-clang-use-cvtss2sd-memory
     AsmOpr *src = discharge(a, ir->l);
-    AsmOpr *dst = next_vreg(a, ir->t); // New vreg for the result
+    AsmOpr *dst = fresh_xmm(a, ir->t); // New vreg for the result
     ir->vreg = dst->reg;
     emit(a, asm2(op, dst, src));
 }
 
 static void asm_conv_fp_int(Assembler *a, IrIns *ir, int op) {
     AsmOpr *src = discharge(a, ir->l);
-    AsmOpr *dst = next_vreg(a, ir->t); // New vreg for the result
-    ir->vreg = dst->reg;
+    AsmOpr *dst = is_sse(ir->t) ? fresh_xmm(a, ir->t) : next_vreg(a, ir->t);
+    ir->vreg = dst->reg; // New vreg for the result
     emit(a, asm2(op, dst, src));
 }
 
@@ -543,19 +2188,217 @@ static int INVERT_JMP[X64_LAST] = {
     [X64_JB] = X64_JAE, [X64_JBE] = X64_JA, [X64_JA] = X64_JBE, [X64_JAE] = X64_JB,
 };
 
+static int CMOV_OP[IR_LAST] = {
+    [IR_EQ] = X64_CMOVE,  [IR_NEQ] = X64_CMOVNE,
+    [IR_SLT] = X64_CMOVL, [IR_SLE] = X64_CMOVLE, [IR_SGT] = X64_CMOVG, [IR_SGE] = X64_CMOVGE,
+    [IR_ULT] = X64_CMOVB, [IR_ULE] = X64_CMOVBE, [IR_UGT] = X64_CMOVA, [IR_UGE] = X64_CMOVAE,
+    [IR_FLT] = X64_CMOVB, [IR_FLE] = X64_CMOVBE, [IR_FGT] = X64_CMOVA, [IR_FGE] = X64_CMOVAE,
+};
+
+static int INVERT_CMOV[X64_LAST] = {
+    [X64_CMOVE] = X64_CMOVNE, [X64_CMOVNE] = X64_CMOVE,
+    [X64_CMOVL] = X64_CMOVGE, [X64_CMOVLE] = X64_CMOVG,
+    [X64_CMOVG] = X64_CMOVLE, [X64_CMOVGE] = X64_CMOVL,
+    [X64_CMOVB] = X64_CMOVAE, [X64_CMOVBE] = X64_CMOVA,
+    [X64_CMOVA] = X64_CMOVBE, [X64_CMOVAE] = X64_CMOVB,
+};
+
 #define GPR_RET_REG RAX
 #define SSE_RET_REG XMM0
 
+static int is_reg_opr(AsmOpr *opr) {
+    return opr->k == OPR_GPR || opr->k == OPR_XMM;
+}
+
+static int same_reg(AsmOpr *l, AsmOpr *r) {
+    return is_reg_opr(l) && l->k == r->k && l->reg == r->reg;
+}
+
+static int reads_reg(AsmOpr *opr, AsmOpr *reg) {
+    if (opr->k == OPR_MEM) {
+        return reg->k == OPR_GPR && (opr->base == reg->reg || opr->idx == reg->reg);
+    }
+    return same_reg(opr, reg);
+}
+
+// Phis are lowered to copies at the end of each predecessor (critical edges
+// have been split, so the copies only run on the way to the phi's BB). All the
+// phis in a BB take their operands at the same time, so the copies are a
+// parallel copy, which is sequentialised here: emit any copy whose 'dst' isn't
+// read by another pending copy, until only cycles are left; then break a cycle
+// by moving one 'dst' into a new vreg and reading it from there instead. This
+// needs one temporary per cycle, and leaves only 'mov's between vregs for the
+// register allocator to coalesce away.
+//
+// Copies from immediates and memory don't block anything (the copies don't
+// write memory), so they're emitted last -- unless the address of a memory
+// operand uses one of the 'dst's, in which case it's loaded up front
+//
+// The edges out of an IR_INDIRECT_BR can't be split, so the copies for every
+// target run whichever one it goes to. Phis in a BB with its address taken
+// are copied into a vreg of their own instead, which the BB then copies into
+// the phi's; that way copies for one target can't clobber another's phis
+static AsmOpr * phi_dst(Assembler *a, IrIns *phi) {
+    if (!phi->bb->addr_taken) {
+        return discharge(a, phi);
+    }
+    int reg = a->phi_in[phi->n];
+    return is_sse(phi->t) ? opr_xmm(reg) : opr_gpr_t(reg, phi->t);
+}
+
+static void asm_phi_copies(Assembler *a, BB *pred, BB *bb) {
+    size_t num_phis = 0;
+    for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+        num_phis += ins->op == IR_PHI;
+    }
+    if (num_phis == 0) {
+        return;
+    }
+    IrIns *phis[num_phis];
+    AsmOpr *dsts[num_phis], *srcs[num_phis];
+    size_t num_copies = 0;
+    for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+        if (ins->op != IR_PHI) {
+            continue;
+        }
+        size_t j = 0;
+        while (vec_get(ins->preds, j) != pred) {
+            j++;
+        }
+        AsmOpr *dst = phi_dst(a, ins);
+        AsmOpr *src = inline_imm_mem(a, vec_get(ins->defs, j));
+        if (!same_reg(dst, src)) { // Skip 'a = phi(a, ...)'
+            phis[num_copies] = ins;
+            dsts[num_copies] = dst;
+            srcs[num_copies] = src;
+            num_copies++;
+        }
+    }
+    for (size_t i = 0; i < num_copies; i++) {
+        if (srcs[i]->k != OPR_MEM) {
+            continue;
+        }
+        for (size_t j = 0; j < num_copies; j++) {
+            if (reads_reg(srcs[i], dsts[j])) {
+                AsmOpr *tmp = next_vreg(a, phis[i]->t);
+                emit(a, mov_ins(phis[i]->t, tmp, srcs[i]));
+                srcs[i] = tmp;
+                break;
+            }
+        }
+    }
+
+    size_t num_left = num_copies;
+    int done[num_copies];
+    memset(done, 0, sizeof(done));
+    while (num_left > 0) {
+        int progress = 0;
+        for (size_t i = 0; i < num_copies; i++) { // Copies that block nothing
+            if (done[i] || !is_reg_opr(srcs[i])) {
+                continue;
+            }
+            int blocks = 0;
+            for (size_t j = 0; j < num_copies && !blocks; j++) {
+                blocks = !done[j] && j != i && same_reg(srcs[j], dsts[i]);
+            }
+            if (!blocks) {
+                emit(a, mov_ins(phis[i]->t, dsts[i], srcs[i]));
+                done[i] = 1;
+                num_left--;
+                progress = 1;
+            }
+        }
+        if (progress) {
+            continue;
+        }
+        size_t i = 0; // Only cycles (and non-register sources) are left
+        while (i < num_copies && (done[i] || !is_reg_opr(srcs[i]))) {
+            i++;
+        }
+        if (i == num_copies) {
+            break;
+        }
+        AsmOpr *tmp = next_vreg(a, phis[i]->t);
+        emit(a, mov_ins(phis[i]->t, tmp, dsts[i]));
+        for (size_t j = 0; j < num_copies; j++) {
+            if (!done[j] && same_reg(srcs[j], dsts[i])) {
+                srcs[j] = tmp;
+            }
+        }
+    }
+    for (size_t i = 0; i < num_copies; i++) {
+        if (!done[i]) {
+            emit(a, mov_ins(phis[i]->t, dsts[i], srcs[i]));
+        }
+    }
+}
+
 static void asm_br(Assembler *a, IrIns *ir) {
+    asm_phi_copies(a, ir->bb, ir->br);
     if (ir->br == ir->bb->next) {
         return; // Don't emit anything for a branch to next BB
     }
     emit(a, asm1(X64_JMP, opr_bb(ir->br)));
 }
 
-static void asm_cmp(Assembler *a, IrIns *ir) { // 'ir' is comparison instruction
+// The jump table holds the offset of each BB from the start of the table, so
+// it can go with the function's floating point constants and doesn't need
+// relocating (see 'x64.c'):
+//   cmp <idx>, <len - 1>
+//   ja <default>
+//   lea <tmp>, [rel <table>]
+//   add <tmp>, [<tmp> + <idx>*8]
+//   jmp <tmp>
+// Edges into BBs with phis have been split, so there are no copies to emit
+static void asm_switch(Assembler *a, IrIns *ir) {
+    AsmOpr *idx = discharge(a, ir->idx);
+    assert(idx->k == OPR_GPR && idx->size == R64);
+    if (!ir->in_range) {
+        emit(a, asm2(X64_CMP, idx, opr_imm(vec_len(ir->table) - 1)));
+        emit(a, asm1(X64_JA, opr_bb(ir->default_br)));
+    }
+
+    AsmOpr *tmp = next_vreg(a, irt_scalar(IRT_I64));
+    emit(a, asm2(X64_LEA, tmp, opr_table(vec_len(a->fn->jump_tables))));
+    vec_push(a->fn->jump_tables, ir->table);
+    AsmOpr *entry = opr_new(OPR_MEM); // [<tmp> + <idx>*8]
+    entry->base = tmp->reg;
+    entry->base_size = R64;
+    entry->idx = idx->reg;
+    entry->idx_size = R64;
+    entry->scale = 8;
+    entry->bytes = 8;
+    emit(a, asm2(X64_ADD, tmp, entry));
+    emit(a, asm1(X64_JMP, tmp));
+}
+
+// 'goto *' jumps to the address in a vreg, after the copies for every target's
+// phis (see 'phi_dst')
+static void asm_indirect_br(Assembler *a, IrIns *ir) {
+    AsmOpr *dest = discharge(a, ir->dest);
+    for (size_t i = 0; i < vec_len(ir->targets); i++) {
+        asm_phi_copies(a, ir->bb, vec_get(ir->targets, i));
+    }
+    emit(a, asm1(X64_JMP, dest));
+}
+
+// A phi in a BB with its address taken starts out in its own vreg
+static void asm_phi(Assembler *a, IrIns *ir) {
+    if (ir->bb->addr_taken) {
+        emit(a, mov_ins(ir->t, discharge(a, ir), phi_dst(a, ir)));
+    }
+}
+
+// 'ir' is a comparison. A 'setcc' only writes the low 8 bits of its register,
+// so the rest is zeroed beforehand (if 'to_zero' isn't NULL), after the
+// operands are in vregs but before the 'cmp' sets the flags. The 'mov' becomes
+// an 'xor' (see 'peephole.c'), which has no dependency on the register at all
+static void asm_cmp(Assembler *a, IrIns *ir, AsmOpr *to_zero) {
     AsmOpr *l = discharge(a, ir->l);
     AsmOpr *r = inline_imm_mem(a, ir->r);
+    if (to_zero) {
+        emit(a, asm2(X64_MOV, opr_gpr(to_zero->reg, R32), opr_imm(0)));
+    }
     int op;
     switch (ir->l->t->k) {
         case IRT_F32: op = X64_UCOMISS; break;
@@ -565,77 +2408,290 @@ static void asm_cmp(Assembler *a, IrIns *ir) { // 'ir' is comparison instruction
     emit(a, asm2(op, l, r));
 }
 
+int is_cmp(IrIns *ins) {
+    return ins->op >= IR_EQ && ins->op <= IR_FGE;
+}
+
+static int is_zero(IrIns *ins) {
+    return ins->op == IR_IMM && ins->imm == 0;
+}
+
+// The comparison in 'cmp != 0' or 'cmp == 0' (e.g., from 'if (b)' or 'if (!b)'
+// where 'b' holds a comparison), or NULL
+static IrIns * bool_test_of(IrIns *ins) {
+    if (ins->op != IR_EQ && ins->op != IR_NEQ) {
+        return NULL;
+    } else if (is_zero(ins->r) && is_cmp(ins->l)) {
+        return ins->l;
+    } else if (is_zero(ins->l) && is_cmp(ins->r)) {
+        return ins->r;
+    }
+    return NULL;
+}
+
+// Looks through tests of a boolean to the comparison underneath, so the
+// branch doesn't have to test a value materialised with 'setcc'. Sets
+// 'negated' if the branch should be taken when the comparison is false
+IrIns * fuse_cond(IrIns *cond, int *negated) {
+    *negated = 0;
+    IrIns *inner;
+    while ((inner = bool_test_of(cond))) {
+        *negated ^= cond->op == IR_EQ;
+        cond = inner;
+    }
+    return cond;
+}
+
 static void asm_condbr(Assembler *a, IrIns *ir) {
-    // The true case or false case MUST be the next basic block
-    assert(ir->true == ir->bb->next || ir->false == ir->bb->next);
-    asm_cmp(a, ir->cond);
-    int op = JMP_OP[ir->cond->op];
+    int negated;
+    IrIns *cond = fuse_cond(ir->cond, &negated);
+    BB *on_true = negated ? ir->false : ir->true;
+    BB *on_false = negated ? ir->true : ir->false;
+    asm_cmp(a, cond, NULL);
+    int op = JMP_OP[cond->op];
     assert(op != 0);
-    if (ir->true == ir->bb->next) { // True case falls through
+    if (on_true == ir->bb->next) { // True case falls through
         op = INVERT_JMP[op]; // Invert condition
         assert(op != 0);
+        emit(a, asm1(op, opr_bb(on_false)));
+    } else {
+        emit(a, asm1(op, opr_bb(on_true)));
+        if (on_false != ir->bb->next) { // Neither case falls through
+            emit(a, asm1(X64_JMP, opr_bb(on_false)));
+        }
+    }
+}
+
+// 'mov' the false value into the result, then 'cmov' the true one over it on
+// the comparison's flags (there's no 8 or 16-bit 'cmov', so those use the
+// 32-bit registers). A floating point select's 'sel' compares its operands
+// (see 'if_convert'), so it's a 'minss' or 'maxss' instead
+static void asm_select(Assembler *a, IrIns *ir) {
+    IrIns *sel = ir->sel;
+    if (is_sse(ir->t)) {
+        assert((sel->op == IR_FLT || sel->op == IR_FGT) &&
+               (sel->l == ir->l || sel->l == ir->r));
+        int is_min = (sel->op == IR_FLT) == (sel->l == ir->l);
+        int op = ir->t->k == IRT_F32 ? (is_min ? X64_MINSS : X64_MAXSS) :
+                                       (is_min ? X64_MINSD : X64_MAXSD);
+        AsmOpr *l = discharge(a, ir->l);
+        AsmOpr *r = inline_mem(a, ir->r);
+        AsmOpr *dst = next_vreg(a, ir->t);
+        ir->vreg = dst->reg;
+        emit(a, asm2(mov_for(ir->t), dst, l));
+        emit(a, asm2(op, dst, r));
+        return;
+    }
+    AsmOpr *t = discharge(a, ir->l);
+    AsmOpr *f = inline_imm(a, ir->r);
+    int op;
+    if (is_cmp(sel) && sel->fold > 0) { // Re-emit the 'cmp' (see 'mark_branch_conds')
+        int negated;
+        IrIns *cmp = fuse_cond(sel, &negated);
+        asm_cmp(a, cmp, NULL);
+        op = CMOV_OP[cmp->op];
+        if (negated) {
+            op = INVERT_CMOV[op];
+        }
+    } else {
+        AsmOpr *c = discharge(a, sel);
+        emit(a, asm2(X64_TEST, c, c));
+        op = X64_CMOVNE;
     }
-    BB *target = (ir->true == ir->bb->next) ? ir->false : ir->true;
-    emit(a, asm1(op, opr_bb(target)));
+    assert(op != 0);
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    emit(a, mov_ins(ir->t, dst, f));
+    if (ir->t->size < 4) {
+        dst = opr_gpr(dst->reg, R32);
+        t = opr_gpr(t->reg, R32);
+    }
+    emit(a, asm2(op, dst, t));
 }
 
+static IrIns * after_cargs(IrIns *call) {
+    IrIns *ins = call->next;
+    while (ins && ins->op == IR_CARG) {
+        ins = ins->next;
+    }
+    return ins;
+}
+
+// A call is in tail position if it's followed straight away by a return of
+// its result (or a 'void' return). It's lowered to a 'jmp' that reuses our
+// stack frame, so (e.g.) tail recursion runs in constant stack space. That
+// only works if the callee can't be handed a pointer into our stack frame,
+// and all its arguments fit in registers
+static int is_tail_call(Assembler *a, IrIns *call) {
+    IrIns *ret = after_cargs(call);
+    if (a->has_allocs || a->fn->instrument || !ret || ret->op != IR_RET ||
+            (ret->ret && ret->ret != call) || call->t->k == IRT_STRUCT) {
+        return 0;
+    }
+    ArgState s = {0};
+    for (IrIns *ins = call->next; ins && ins->op == IR_CARG; ins = ins->next) {
+        place_arg(&s, ins->t);
+    }
+    return s.stack_size == 0;
+}
+
+static void asm_postamble(Assembler *a);
+
 static void asm_call(Assembler *a, IrIns *ir) {
     // Count number of arguments
     size_t nargs = 0;
     for (IrIns *ins = ir->next; ins && ins->op == IR_CARG; ins = ins->next) {
         nargs++;
     }
-
-    // Discharge/inline arguments
+    IrIns *cargs[nargs];
     size_t i = 0;
-    AsmOpr *args[nargs];
     for (IrIns *ins = ir->next; ins && ins->op == IR_CARG; ins = ins->next) {
-        args[i++] = inline_imm_mem(a, ins->l);
+        cargs[i++] = ins;
+    }
+
+    // Work out where each argument goes, and reserve space at the bottom of
+    // the stack frame for the ones passed on the stack
+    ArgState s = {0};
+    int ret_in_mem = returns_in_mem(ir->t);
+    s.num_gprs = ret_in_mem; // Hidden pointer
+    ArgLoc locs[nargs];
+    for (i = 0; i < nargs; i++) {
+        locs[i] = place_arg(&s, cargs[i]->t);
+    }
+    if (s.stack_size > a->fn->out_args_size) {
+        a->fn->out_args_size = s.stack_size;
+    }
+
+    // Discharge/inline arguments; ones passed on the stack can't come from
+    // memory, since there's no memory to memory 'mov'
+    AsmOpr *args[nargs];
+    for (i = 0; i < nargs; i++) {
+        IrIns *arg = cargs[i]->arg;
+        if (arg->t->k == IRT_STRUCT || cargs[i]->t->k == IRT_STRUCT) {
+            args[i] = agg_mem(a, arg);
+            if (locs[i].num_regs > 0) {
+                args[i] = loadable_agg(a, args[i], cargs[i]->t);
+            }
+        } else if (locs[i].num_regs > 0) {
+            args[i] = inline_imm_mem(a, arg);
+        } else if (is_sse(arg->t)) {
+            args[i] = discharge(a, arg);
+        } else {
+            args[i] = inline_imm(a, arg);
+        }
+    }
+
+    // Copy arguments onto the stack
+    for (i = 0; i < nargs; i++) {
+        IrType *t = cargs[i]->t;
+        if (locs[i].num_regs > 0) {
+            continue;
+        }
+        AsmOpr *dst = opr_out_arg(locs[i].stack_off, t->size);
+        if (t->k == IRT_STRUCT) {
+            emit_copy(a, dst, args[i], t->size, 1);
+        } else {
+            emit(a, asm2(mov_for(t), dst, args[i]));
+        }
     }
 
     // Move arguments into required registers
-    i = 0;
-    size_t gpr_idx = 0, sse_idx = 0;
-    for (IrIns *ins = ir->next; ins && ins->op == IR_CARG; ins = ins->next) {
-        // TODO: pass extra arguments on stack (beyond NUM_REG_FARGS)
-        AsmOpr *dst;
-        if (ins->t->k == IRT_F32 || ins->t->k == IRT_F64) {
-            dst = opr_xmm(SSE_FARGS[sse_idx++]);
+    for (i = 0; i < nargs; i++) {
+        IrType *t = cargs[i]->t;
+        if (locs[i].num_regs == 0) {
+            continue;
+        } else if (t->k == IRT_STRUCT) {
+            load_eightbytes(a, &locs[i], args[i], t);
         } else {
-            dst = opr_gpr_t(GPR_FARGS[gpr_idx++], ins->t);
+            AsmOpr *dst = is_sse(t) ?
+                opr_xmm(locs[i].regs[0]) : opr_gpr_t(locs[i].regs[0], t);
+            emit(a, mov_ins(t, dst, args[i]));
+        }
+    }
+    AsmOpr *ret_mem = NULL;
+    if (ret_in_mem) { // Point the hidden argument at a stack slot
+        ret_mem = agg_slot(a, ir->t);
+        emit(a, asm2(X64_LEA, opr_gpr(GPR_ARGS[0], R64), ret_mem));
+    }
+    if (ir->is_vararg) { // al holds the number of SSE regs used
+        emit(a, asm2(X64_MOV, opr_gpr(RAX, R32), opr_imm((uint64_t) s.num_sse)));
+    }
+
+    // Emit a tail call; the target goes in r11 (which isn't callee-saved or
+    // an argument) if it's not a label (or its GOT entry), since it might be
+    // in a stack slot or callee-saved register that the postamble gets rid of
+    if (is_tail_call(a, ir)) {
+        AsmOpr *fn = inline_label_mem(a, ir->l);
+        if (fn->k != OPR_LABEL && fn->k != OPR_GOTPCREL) {
+            AsmOpr *r11 = opr_gpr(R11, R64);
+            emit(a, asm2(X64_MOV, r11, fn));
+            fn = r11;
         }
-        emit(a, asm2(mov_for(ins->t), dst, args[i++]));
+        asm_postamble(a);
+        AsmIns *tail = emit(a, asm1(X64_TAIL_CALL, fn));
+        tail->callee = static_callee(ir->l);
+        return;
     }
 
     // Emit call
-    emit(a, asm1(X64_CALL, inline_label_mem(a, ir->l)));
+    AsmIns *call = emit(a, asm1(X64_CALL, inline_label_mem(a, ir->l)));
+    call->callee = static_callee(ir->l);
 
     // Get return value
-    if (ir->t->k != IRT_VOID) {
+    if (ir->t->k == IRT_STRUCT) { // Point to the aggregate
+        AsmOpr *dst = next_vreg(a, ir->t);
+        ir->vreg = dst->reg;
+        if (!ret_in_mem) {
+            ArgLoc loc = place_ret(ir->t);
+            ret_mem = agg_slot(a, ir->t);
+            store_eightbytes(a, &loc, ret_mem);
+        }
+        emit(a, asm2(X64_LEA, dst, ret_mem));
+    } else if (ir->t->k != IRT_VOID) {
         AsmOpr *dst = next_vreg(a, ir->t); // New vreg for the result
         ir->vreg = dst->reg;
         AsmOpr *ret;
-        if (ir->t->k == IRT_F32 || ir->t->k == IRT_F64) {
+        if (is_sse(ir->t)) {
             ret = opr_xmm(SSE_RET_REG);
         } else {
             ret = opr_gpr_t(GPR_RET_REG, ir->t);
         }
-        emit(a, asm2(mov_for(ir->t), dst, ret));
+        emit(a, mov_ins(ir->t, dst, ret));
     }
 }
 
-static void asm_postamble(Assembler *a);
+static void asm_hook(Assembler *a, char *hook);
 
 static void asm_ret(Assembler *a, IrIns *ir) {
-    if (ir->ret) {
+    IrIns *call = ir->prev;
+    while (call && call->op == IR_CARG) {
+        call = call->prev;
+    }
+    if (call && call->op == IR_CALL && is_tail_call(a, call)) {
+        return; // Already returned by the callee
+    }
+    if (a->fn->instrument) { // Before the return value's put in place
+        asm_hook(a, HOOK_EXIT);
+    }
+    IrType *t = a->fn->ret;
+    if (ir->ret && t->k == IRT_STRUCT) {
+        AsmOpr *src = agg_mem(a, ir->ret);
+        if (a->ret_ptr != R_NONE) { // Copy to where the caller asked
+            emit_copy(a, opr_mem_reg(a->ret_ptr), src, t->size, 1);
+            emit(a, asm2(X64_MOV, opr_gpr(GPR_RET_REG, R64), opr_gpr(a->ret_ptr, R64)));
+        } else {
+            ArgLoc loc = place_ret(t);
+            load_eightbytes(a, &loc, loadable_agg(a, src, t), t);
+        }
+    } else if (ir->ret) {
         AsmOpr *val = inline_imm_mem(a, ir->ret);
-        if (ir->ret->t->k == IRT_F32 || ir->ret->t->k == IRT_F64) {
+        if (is_sse(ir->ret->t)) {
             emit(a, asm2(mov_for(ir->ret->t), opr_xmm(SSE_RET_REG), val));
         } else {
             // Zero the rest of eax using movsx if the function returns
             // something smaller than an int
             AsmOpr *dst = opr_gpr(GPR_RET_REG, ir->ret->t->size == 8 ? R64 : R32);
-            int mov_op = ir->ret->t->size < 4 ? X64_MOVSX : X64_MOV;
+            int mov_op = ir->ret->t->size < 4 && val->k != OPR_IMM ? X64_MOVSX : X64_MOV;
             emit(a, asm2(mov_op, dst, val));
         }
     }
@@ -644,6 +2700,153 @@ static void asm_ret(Assembler *a, IrIns *ir) {
 }
 
 
+// ---- Inline Assembly -------------------------------------------------------
+
+static AsmOpr * asm_opr_vreg(Assembler *a, AsmOperand *o) {
+    STATS[STAT_VREGS]++;
+    if (o->k == ASM_SSE) {
+        return opr_xmm(a->next_sse++);
+    } else {
+        return opr_gpr(a->next_gpr++, GPR_SIZES[o->size]);
+    }
+}
+
+// Inputs are discharged into vregs before the block, and register outputs are
+// given vregs that the block defines. Fixed register operands are moved into
+// and out of their pregs either side of it. The X64_ASM_CLOBBER just before
+// the block is where early clobber outputs are defined, so that they can't
+// share a reg with an input (see 'ins_use_def')
+static void asm_inline(Assembler *a, IrIns *ir) {
+    InlineAsm *src = ir->inline_asm;
+    int n = src->num_oprs;
+    AsmBlock *b = arena_alloc(ARENA_ASM, sizeof(AsmBlock));
+    b->inline_asm = src;
+    b->oprs = arena_alloc(ARENA_ASM, sizeof(AsmOpr *) * (size_t) (n + 1));
+    b->fixed = arena_alloc(ARENA_ASM, sizeof(AsmOpr *) * (size_t) (n + 1));
+    b->access = arena_alloc(ARENA_ASM, sizeof(int) * (size_t) (n + 1));
+    IrIns *in[MAX_ASM_OPRS] = {0}, *out[MAX_ASM_OPRS] = {0};
+    IrIns *ins = ir->next;
+    for (; ins && ins->op == IR_ASMIN; ins = ins->next) {
+        in[ins->opr_idx] = ins;
+    }
+    for (; ins && ins->op == IR_ASMOUT; ins = ins->next) {
+        out[ins->opr_idx] = ins;
+    }
+
+    // Register outputs (outputs in memory are passed as an address, like inputs)
+    AsmOpr *out_vreg[MAX_ASM_OPRS] = {0}; // Where a fixed output ends up
+    for (int i = 0; i < n; i++) {
+        AsmOperand *o = &src->oprs[i];
+        b->fixed[i] = NULL;
+        b->access[i] = (o->is_in ? ASM_READ : 0) | (o->is_out ? ASM_WRITE : 0) |
+                       (o->early_clobber ? ASM_EARLY : 0);
+        b->oprs[i] = NULL;
+        if (!o->is_out || o->k == ASM_MEM) {
+            continue;
+        }
+        AsmOpr *vreg = asm_opr_vreg(a, o);
+        if (o->k == ASM_FIXED) {
+            b->oprs[i] = opr_gpr(RAX + o->reg, GPR_SIZES[o->size]);
+            out_vreg[i] = vreg;
+        } else {
+            b->oprs[i] = vreg;
+        }
+        if (out[i]) {
+            out[i]->vreg = vreg->reg;
+        }
+    }
+
+    // Inputs; a '+' output or an input tied to an output starts off in the
+    // output's reg
+    for (int i = 0; i < n; i++) {
+        AsmOperand *o = &src->oprs[i];
+        if (o->k == ASM_IMM) {
+            b->oprs[i] = opr_imm(o->imm);
+            continue;
+        } else if (!in[i]) {
+            continue;
+        }
+        IrIns *v = in[i]->arg;
+        if (o->k == ASM_MEM) {
+            AsmOpr *mem = load_ptr(a, v, NULL);
+            mem->bytes = (o->size & (o->size - 1)) == 0 && o->size <= 8 ? o->size : 0;
+            b->oprs[i] = mem;
+            continue;
+        }
+        int to = o->k == ASM_TIED ? o->tied : i; // Operand whose reg it goes in
+        if (o->k == ASM_TIED) {
+            b->oprs[i] = b->oprs[to];
+            b->access[to] |= ASM_READ;
+        }
+        AsmOpr *val = discharge(a, v);
+        if (src->oprs[to].k == ASM_FIXED) {
+            b->fixed[i] = val;
+            b->oprs[i] = opr_gpr(RAX + src->oprs[to].reg, GPR_SIZES[o->size]);
+        } else if (src->oprs[to].is_out) {
+            emit(a, asm2(mov_for(v->t), b->oprs[to], val));
+        } else {
+            b->oprs[i] = val;
+        }
+    }
+
+    AsmIns *clobber = emit(a, asm0(X64_ASM_CLOBBER));
+    clobber->block = b;
+    AsmIns *block = emit(a, asm0(X64_ASM));
+    block->block = b;
+    for (int i = 0; i < n; i++) {
+        if (out_vreg[i] && out[i]) {
+            emit(a, asm2(X64_MOV, out_vreg[i], b->oprs[i]));
+        }
+    }
+}
+
+
+// ---- Atomics ---------------------------------------------------------------
+
+// x86 only lets a store be reordered with a later load, so an atomic load, or
+// a store weaker than seq_cst, is an ordinary 'mov'. A seq_cst store is an
+// 'xchg' (which is always locked), and read-modify-writes are locked too,
+// which makes them full barriers
+
+static void asm_atomic_load(Assembler *a, IrIns *ir) {
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    emit(a, mov_ins(ir->t, dst, load_ptr(a, ir->addr, ir->t)));
+}
+
+// 'xchg' and 'xadd' leave the old value in their register operand, which goes
+// on the left so 'reg_alloc' sees it defined (see 'X64_DEFS_LEFT')
+static AsmOpr * asm_swap(Assembler *a, IrIns *ir, int op) {
+    IrType *t = ir->val->t;
+    AsmOpr *dst = next_vreg(a, t);
+    emit(a, mov_ins(t, dst, inline_imm(a, ir->val)));
+    emit(a, asm2(op, dst, load_ptr(a, ir->addr, t)));
+    return dst;
+}
+
+static void asm_atomic_store(Assembler *a, IrIns *ir) {
+    if (ir->order == MO_SEQ_CST) {
+        asm_swap(a, ir, X64_XCHG);
+    } else {
+        AsmOpr *l = load_ptr(a, ir->addr, ir->val->t);
+        emit(a, asm2(mov_for(ir->val->t), l, inline_imm(a, ir->val)));
+    }
+}
+
+// 'lock cmpxchg [addr], val' compares against rax and leaves the old value in
+// it either way
+static void asm_atomic_cas(Assembler *a, IrIns *ir) {
+    AsmOpr *expected = inline_imm(a, ir->expected);
+    AsmOpr *val = discharge(a, ir->val);
+    AsmOpr *mem = load_ptr(a, ir->addr, ir->t);
+    emit(a, mov_ins(ir->t, opr_gpr_t(RAX, ir->t), expected));
+    emit(a, asm2(X64_LOCK_CMPXCHG, mem, val));
+    AsmOpr *dst = next_vreg(a, ir->t);
+    ir->vreg = dst->reg;
+    emit(a, mov_ins(ir->t, dst, opr_gpr_t(RAX, ir->t)));
+}
+
+
 // ---- Functions, Basic Blocks, and Instructions -----------------------------
 
 static void asm_ins(Assembler *a, IrIns *ir) {
@@ -652,37 +2855,78 @@ static void asm_ins(Assembler *a, IrIns *ir) {
     case IR_IMM:    break; // Always inlined
     case IR_FP:     asm_fp(a, ir); break;
     case IR_GLOBAL: break; // Always inlined
+    case IR_BB_ADDR: break; // Always inlined
 
         // Memory access
     case IR_FARG:   asm_farg(a, ir); break;
-    case IR_ALLOC:  asm_alloc(a, ir); break;
+    case IR_ALLOC: // Otherwise given a slot by 'assign_stack_slots'
+        if (is_dyn_alloc(a->fn, ir)) {
+            asm_dyn_alloc(a, ir);
+        }
+        break;
     case IR_LOAD:   asm_load(a, ir); break;
     case IR_STORE:  asm_store(a, ir); break;
+    case IR_COPY:   asm_copy(a, ir); break;
+    case IR_ZERO:   asm_zero(a, ir); break;
     case IR_PTRADD: asm_ptradd(a, ir); break;
+    case IR_PREFETCH: // 'locality' 3 is 'prefetcht0', down to 0 for 'prefetchnta'
+        emit(a, asm1(X64_PREFETCHNTA - ir->locality, load_ptr(a, ir->ptr, NULL)));
+        break;
+    case IR_STACK_SAVE:
+        ir->vreg = next_vreg(a, ir->t)->reg;
+        emit(a, asm2(X64_MOV, opr_gpr(ir->vreg, R64), opr_gpr(RSP, R64)));
+        break;
+    case IR_STACK_RESTORE:
+        emit(a, asm2(X64_MOV, opr_gpr(RSP, R64), discharge(a, ir->ptr)));
+        break;
+
+        // Atomics
+    case IR_ATOMIC_LOAD:  asm_atomic_load(a, ir); break;
+    case IR_ATOMIC_STORE: asm_atomic_store(a, ir); break;
+    case IR_ATOMIC_XCHG:  ir->vreg = asm_swap(a, ir, X64_XCHG)->reg; break;
+    case IR_ATOMIC_ADD:   ir->vreg = asm_swap(a, ir, X64_LOCK_XADD)->reg; break;
+    case IR_ATOMIC_CAS:   asm_atomic_cas(a, ir); break;
+    case IR_FENCE:
+        if (ir->order == MO_SEQ_CST) {
+            emit(a, asm0(X64_MFENCE));
+        }
+        break;
 
         // Arithmetic
     case IR_ADD: case IR_SUB: case IR_MUL: case IR_FDIV:
     case IR_BIT_AND: case IR_BIT_OR: case IR_BIT_XOR:
         asm_arith(a, ir);
         break;
+    case IR_UMULH:
+        if (ir->fold == 0) {
+            asm_wide_mul(a, ir);
+        }
+        break;
     case IR_SDIV: case IR_UDIV: case IR_SMOD: case IR_UMOD:
         asm_div_mod(a, ir);
         break;
     case IR_SHL: case IR_SAR: case IR_SHR:
         asm_sh(a, ir);
         break;
+    case IR_POPCNT: case IR_CTZ: case IR_CLZ: case IR_BSWAP:
+        asm_bits(a, ir);
+        break;
 
         // Comparisons
     case IR_EQ:  case IR_NEQ:
     case IR_SLT: case IR_SLE: case IR_SGT: case IR_SGE:
     case IR_ULT: case IR_ULE: case IR_UGT: case IR_UGE:
     case IR_FLT: case IR_FLE: case IR_FGT: case IR_FGE:
-        break; // Handled by CONDBR or 'discharge'
+        if (ir->fold < 0) {
+            discharge(a, ir);
+        }
+        break; // Otherwise handled by CONDBR or 'discharge'
 
         // Conversions
     case IR_TRUNC:   asm_trunc(a, ir); break;
     case IR_SEXT:    asm_ext(a, ir, X64_MOVSX); break;
     case IR_ZEXT:    asm_ext(a, ir, X64_MOVZX); break;
+    case IR_ANYEXT:  asm_anyext(a, ir); break;
     case IR_PTR2I:   asm_trunc(a, ir); break; // Pointers are always bigger
     case IR_I2PTR:   asm_ext(a, ir, X64_MOVZX); break;
     case IR_BITCAST: asm_ext(a, ir, X64_MOV); break;
@@ -692,68 +2936,962 @@ static void asm_ins(Assembler *a, IrIns *ir) {
     case IR_FP2I:   asm_fp_to_int(a, ir); break;
     case IR_I2FP:   asm_int_to_fp(a, ir); break;
 
+        // Vectors
+    case IR_SPLAT:  asm_splat(a, ir); break;
+    case IR_REDUCE: asm_reduce(a, ir); break;
+
         // Control flow
+    case IR_SELECT: asm_select(a, ir); break;
+    case IR_PHI:    asm_phi(a, ir); break; // Copies at the end of each pred
     case IR_BR:     asm_br(a, ir); break;
     case IR_CONDBR: asm_condbr(a, ir); break;
+    case IR_SWITCH: asm_switch(a, ir); break;
+    case IR_INDIRECT_BR: asm_indirect_br(a, ir); break;
     case IR_CALL:   asm_call(a, ir); break;
     case IR_CARG:   break; // Handled by IR_CALL
+    case IR_ASM:    asm_inline(a, ir); break;
+    case IR_ASMIN: case IR_ASMOUT: break; // Handled by IR_ASM
     case IR_RET:    asm_ret(a, ir); break;
+    case IR_UNREACHABLE: emit(a, asm0(X64_UD2)); break;
     default: assert(0); // TODO
     }
 }
 
 static void asm_bb(Assembler *a, BB *bb) {
+    int enter_hook = bb == a->fn->entry && a->fn->instrument;
     for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+        if (enter_hook && ins->op != IR_FARG) { // Once the arguments are read
+            asm_hook(a, HOOK_ENTER);
+            enter_hook = 0;
+        }
+        a->line = ins->line;
         asm_ins(a, ins);
     }
 }
 
+// '-fpatchable-function-entry' puts the NOPs before anything else, so a tracer
+// can overwrite them with a call without having to move any instructions
 static void asm_preamble(Assembler *a) {
-    emit(a, asm1(X64_PUSH, opr_gpr(RBP, R64)));                            // push rbp
-    emit(a, asm2(X64_MOV, opr_gpr(RBP, R64), opr_gpr(RSP, R64)));          // mov rbp, rsp
+    for (int i = 0; i < a->fn->patchable_entry; i++) {
+        emit(a, asm0(X64_NOP));
+    }
+    if (!omits_frame_ptr(a->fn)) {
+        emit(a, asm1(X64_PUSH, opr_gpr(RBP, R64)));                        // push rbp
+        emit(a, asm2(X64_MOV, opr_gpr(RBP, R64), opr_gpr(RSP, R64)));      // mov rbp, rsp
+    }
     AsmIns *patch = emit(a, asm2(X64_SUB, opr_gpr(RSP, R64), opr_imm(0))); // sub rsp, <stack size>
-    vec_push(a->patch_with_stack_size, patch);
+    vec_push(a->fn->patch_with_stack_size, patch);
 }
 
 static void asm_postamble(Assembler *a) {
     AsmIns *patch = emit(a, asm2(X64_ADD, opr_gpr(RSP, R64), opr_imm(0))); // add rsp, <stack size>
-    emit(a, asm1(X64_POP, opr_gpr(RBP, R64)));                             // pop rbp
-    vec_push(a->patch_with_stack_size, patch);
+    if (!omits_frame_ptr(a->fn)) {
+        emit(a, asm1(X64_POP, opr_gpr(RBP, R64)));                         // pop rbp
+    }
+    vec_push(a->fn->patch_with_stack_size, patch);
 }
 
-static void patch_stack_sizes(Assembler *a) {
-    a->next_stack += pad(a->next_stack, STACK_ALIGN);
-    if (a->next_stack == 0) {
-        for (size_t i = 0; i < vec_len(a->patch_with_stack_size); i++) {
-            AsmIns *ins = vec_get(a->patch_with_stack_size, i);
-            delete_asm(ins);
+// Calls a '-finstrument-functions' hook with the function's own address and
+// its return address, which is just below the arguments passed on the stack
+// (see 'opr_in_arg'). Everything the function needs afterwards is in vregs,
+// which the register allocator keeps safe across the call
+static void asm_hook(Assembler *a, char *hook) {
+    emit_global_addr(a, opr_gpr(GPR_ARGS[0], R64), a->fn->instrument);
+    emit(a, asm2(X64_MOV, opr_gpr(GPR_ARGS[1], R64), opr_frame(8, 8)));
+    emit(a, asm1(X64_CALL, opr_label(prepend_underscore(hook))));
+}
+
+// ---- Preparing the IR ------------------------------------------------------
+
+static int has_phis(BB *bb) {
+    for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+        if (ins->op == IR_PHI) {
+            return 1;
         }
+    }
+    return 0;
+}
+
+// Puts a new BB on the edge from 'bb' to 'succ'. If 'succ' was the fall
+// through, the new BB is put straight after 'bb' so it still is; otherwise
+// it's put at the end of the function
+static BB * split_edge(Fn *fn, BB *bb, BB *succ) {
+    BB *split = new_bb();
+    IrIns *br = new_ins(IR_BR, NULL);
+    br->br = succ;
+    br->bb = split;
+    split->ir_head = split->ir_last = br;
+    BB *after = (succ == bb->next) ? bb : fn->last;
+    split->prev = after;
+    split->next = after->next;
+    if (after->next) {
+        after->next->prev = split;
     } else {
-        for (size_t i = 0; i < vec_len(a->patch_with_stack_size); i++) {
-            AsmIns *ins = vec_get(a->patch_with_stack_size, i);
-            assert(ins->r->k == OPR_IMM);
-            ins->r->imm = a->next_stack;
+        fn->last = split;
+    }
+    after->next = split;
+    replace_phi_pred(succ, bb, split);
+    if (bb->freq >= 0 && succ->freq >= 0) { // At most the less frequent end
+        split->freq = bb->freq < succ->freq ? bb->freq : succ->freq;
+    }
+
+    // Keep the dominator tree and loops up to date for register allocation
+    split->idom = bb;
+    vec_push(bb->dom_children, split);
+    split->loop = common_loop(bb->loop, succ->loop);
+    for (Loop *loop = split->loop; loop; loop = loop->parent) {
+        vec_push(loop->bbs, split);
+    }
+    return split;
+}
+
+// There's nowhere for the copies on any edge out of a jump table. Each target
+// is a successor once, however many entries it has, so gets one new BB
+static void split_switch_edges(Fn *fn, IrIns *br) {
+    if (has_phis(br->default_br)) {
+        BB *target = br->default_br;
+        retarget_br(br, target, split_edge(fn, br->bb, target));
+    }
+    for (size_t i = 0; i < vec_len(br->table); i++) {
+        BB *target = vec_get(br->table, i);
+        if (has_phis(target)) {
+            retarget_br(br, target, split_edge(fn, br->bb, target));
+        }
+    }
+}
+
+// An edge is critical if it leaves a BB with several successors for one with
+// several predecessors; there's nowhere to put the copies for a phi on it
+void split_critical_edges(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        IrIns *last = bb->ir_last;
+        if (last && last->op == IR_SWITCH) {
+            split_switch_edges(fn, last);
+        }
+        if (!last || last->op != IR_CONDBR) {
+            continue;
+        }
+        if (last->true == last->false && has_phis(last->true)) {
+            last->true = last->false = split_edge(fn, bb, last->true); // One edge
+            continue;
+        }
+        if (has_phis(last->true)) {
+            last->true = split_edge(fn, bb, last->true);
+        }
+        if (has_phis(last->false)) {
+            last->false = split_edge(fn, bb, last->false);
+        }
+    }
+}
+
+static int has_side_effects(IrIns *ins) {
+    return ins->op == IR_STORE || ins->op == IR_COPY || ins->op == IR_ZERO ||
+           ins->op == IR_CALL || ins->op == IR_ASM || is_atomic(ins);
+}
+
+// Whether 'def' can be folded into its use by 'user', which is only safe if
+// nothing in between could have changed what it reads
+static int can_fold(IrIns *def, IrIns *user) {
+    if (user->op == IR_PHI) {
+        return 0; // Needed at the end of a predecessor
+    }
+    while (user->op == IR_CARG || user->op == IR_ASMIN) { // Used by the call/asm
+        user = user->prev;
+    }
+    if (user->bb != def->bb) {
+        return 0;
+    }
+    for (IrIns *ins = def->next; ins != user; ins = ins->next) {
+        if (!ins || has_side_effects(ins)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void mark_use(IrIns *def, IrIns *user) {
+    if (def->op != IR_LOAD && !is_cmp(def)) {
+        return;
+    }
+    if (def->t->k == IRT_VEC) { // Packed instructions need aligned memory
+        def->fold = -1;
+        return;
+    }
+    int addr_folded = user->fold > 0 && (user->op == IR_PTRADD || user->op == IR_ADD ||
+                                         user->op == IR_SHL || user->op == IR_MUL);
+    // Nothing is emitted for a folded address, so it can't take a load either
+    if (def->fold == 0 && !addr_folded && can_fold(def, user)) {
+        def->fold = 1;
+    } else {
+        def->fold = -1; // More than one use, or can't fold
+    }
+}
+
+// Whether the use of 'def' in 'user' (at operand 'opr') is part of an address
+// that's folded into a memory operand
+static int is_addr_use(IrIns *def, IrIns *user, IrIns **opr) {
+    if (user->op == IR_LOAD || (user->op == IR_STORE && opr == &user->dst) ||
+            (is_atomic(user) && opr == &user->addr) ||
+            (user->op == IR_PREFETCH && opr == &user->ptr)) {
+        return def->op == IR_PTRADD;
+    }
+    if (user->op == IR_ADD || user->op == IR_SUB) { // Done by the add's 'lea'
+        Addr addr;
+        IrIns *scaled;
+        if (!match_lea(user, &addr, &scaled)) {
+            return 0;
+        } else if (def->op == IR_ADD) {
+            return addr.base != def && addr.idx != def;
+        }
+        return scaled == def && addr.base != def; // Not 'x*8 + x*8'
+    }
+    if (user->op != IR_PTRADD || user->fold <= 0) {
+        return 0;
+    }
+    Addr addr;
+    int base_folded = match_addr(user, &addr);
+    if (opr == &user->base) {
+        return base_folded; // 'def' is a PTRADD
+    } else { // 'def' is a scaled index
+        return addr.idx != def && (def->op == IR_SHL || def->op == IR_MUL);
+    }
+}
+
+// Nothing is emitted for a PTRADD that's only used as an address, which is
+// folded into the memory operand of each load and store instead (e.g., 'mov
+// eax, [rdi + rsi*4 + 8]'). Same for a shift or multiply that scales an index
+// in such an address, or in the 'lea' for an add (see 'match_lea'), and for
+// an add folded into the 'lea' for adding a constant to it.
+// Candidates are dropped until every use is one of these
+static void mark_addr_folds(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            Addr addr;
+            if (ins->op == IR_PTRADD) {
+                match_addr(ins, &addr);
+                ins->fold = addr.base != ins;
+            } else if (ins->op == IR_SHL || ins->op == IR_MUL) {
+                ins->fold = (ins->t->k == IRT_I32 || ins->t->k == IRT_I64) &&
+                            match_scale(ins, &addr.idx, &addr.scale);
+            } else if (ins->op == IR_ADD) {
+                ins->fold = is_lea_add(ins);
+            }
+        }
+    }
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (BB *bb = fn->entry; bb; bb = bb->next) {
+            for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+                IrIns **oprs[3];
+                int num_oprs = ir_operands(ins, oprs);
+                for (int i = 0; i < num_oprs; i++) {
+                    IrIns *def = *oprs[i];
+                    if (def->fold > 0 && !is_addr_use(def, ins, oprs[i])) {
+                        def->fold = 0;
+                        changed = 1;
+                    }
+                }
+                for (size_t i = 0; ins->op == IR_PHI && i < vec_len(ins->defs); i++) {
+                    IrIns *def = vec_get(ins->defs, i);
+                    if (def->fold > 0) {
+                        def->fold = 0;
+                        changed = 1;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// With FMA and '-ffp-contract=fast', a floating point multiply (scalar or
+// vector) that's only used by an add or subtract in the same BB is folded into
+// it, so the pair becomes one 'vfmadd231sd' with a single rounding (as C's
+// 'FP_CONTRACT' pragma allows). Only one multiply is folded into each add
+static void mark_fma_folds(Fn *fn) {
+    if (!(CPU_FEATURES & CPU_FMA) || !FP_CONTRACT) {
+        return;
+    }
+    size_t num_ins = number_ir(fn);
+    int *num_uses = calloc(num_ins, sizeof(int));
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                num_uses[(*oprs[i])->n]++;
+            }
+            for (size_t i = 0; ins->op == IR_PHI && i < vec_len(ins->defs); i++) {
+                num_uses[((IrIns *) vec_get(ins->defs, i))->n]++;
+            }
+        }
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if ((ins->op != IR_ADD && ins->op != IR_SUB) || !is_fp_arith(ins->t)) {
+                continue;
+            }
+            IrIns *mul = ins->l;
+            for (int i = 0; i < 2; i++, mul = ins->r) {
+                if (mul->op == IR_MUL && num_uses[mul->n] == 1 && mul->bb == bb) {
+                    mul->fold = 1;
+                    break;
+                }
+            }
+        }
+    }
+    free(num_uses);
+}
+
+// 'asm_condbr' (and 'asm_select') does its own 'cmp' (see 'fuse_cond'), so a
+// comparison that's only used by branches and selects (e.g., more than one
+// after 'gvn') needn't be discharged. Its operands have to be in vregs already though, since the
+// 'cmp' is repeated at each branch
+void mark_branch_conds(Fn *fn) {
+    size_t num_ins = number_ir(fn);
+    int *other_use = calloc(num_ins, sizeof(int));
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            IrIns *tested = bool_test_of(ins);
+            for (int i = 0; i < num_oprs && ins->op != IR_CONDBR; i++) {
+                int is_sel = ins->op == IR_SELECT && oprs[i] == &ins->sel &&
+                             !is_sse(ins->t); // Float selects don't 'cmp'
+                if (*oprs[i] != tested && !is_sel) {
+                    other_use[(*oprs[i])->n] = 1;
+                }
+            }
+            for (size_t i = 0; ins->op == IR_PHI && i < vec_len(ins->defs); i++) {
+                other_use[((IrIns *) vec_get(ins->defs, i))->n] = 1;
+            }
+        }
+    }
+    int changed = 1;
+    while (changed) { // A boolean test that's discharged needs its comparison
+        changed = 0;
+        for (BB *bb = fn->entry; bb; bb = bb->next) {
+            for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+                IrIns *tested = bool_test_of(ins);
+                if (tested && other_use[ins->n] && !other_use[tested->n]) {
+                    other_use[tested->n] = 1;
+                    changed = 1;
+                }
+            }
+        }
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            int negated;
+            IrIns *cmp = fuse_cond(ins, &negated);
+            if (is_cmp(ins) && ins->fold < 0 && !other_use[ins->n] &&
+                    cmp->l->fold <= 0 && cmp->r->fold <= 0) {
+                ins->fold = 1;
+            }
+        }
+    }
+    free(other_use);
+}
+
+// Loads and comparisons are folded into the instruction that uses them where
+// possible (e.g., 'add eax, [rbp - 4]' or 'cmp' followed by 'jl'); otherwise
+// they're discharged into a vreg where they're defined
+static void mark_folds(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            ins->fold = 0;
+        }
+    }
+    mark_addr_folds(fn);
+    mark_fma_folds(fn);
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                mark_use(*oprs[i], ins);
+            }
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    mark_use(vec_get(ins->defs, i), ins);
+                }
+            }
         }
     }
+    mark_branch_conds(fn);
 }
 
-static void asm_fn(Fn *fn) {
+static void prepare_fn(Fn *fn) {
+    analyse_cfg(fn);
+    split_critical_edges(fn);
+    analyse_cfg(fn);
+    layout_bbs(fn);
+    mark_folds(fn);
+}
+
+
+// ---- Functions -------------------------------------------------------------
+
+void assemble_fn(Fn *fn) {
+    if (CODEGEN_STATS) {
+        codegen_stats_begin(fn);
+    }
+    prepare_fn(fn);
     Assembler *a = new_asm(fn);
+    assign_stack_slots(fn);
+    a->phi_in = calloc(number_ir(fn), sizeof(int));
+    for (BB *bb = fn->entry; bb; bb = bb->next) { // Phis need vregs up front
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_PHI) {
+                ins->vreg = next_vreg(a, ins->t)->reg;
+            }
+            if (ins->op == IR_PHI && bb->addr_taken) {
+                a->phi_in[ins->n] = next_vreg(a, ins->t)->reg;
+            }
+        }
+    }
     asm_preamble(a);
+    if (returns_in_mem(fn->ret)) {
+        AsmOpr *ptr = next_ptr_vreg(a);
+        a->ret_ptr = ptr->reg;
+        emit(a, asm2(X64_MOV, ptr, opr_gpr(GPR_ARGS[0], R64)));
+    }
+
+    // Assemble in reverse postorder so values are always defined before their
+    // uses (BBs still come out in their original order)
+    Vec *rpo = rev_postorder(fn);
+    for (size_t i = 0; i < vec_len(rpo); i++) {
+        a->bb = vec_get(rpo, i);
+        asm_bb(a, a->bb);
+    }
+    vec_free(rpo);
     for (BB *bb = fn->entry; bb; bb = bb->next) {
-        a->bb = bb;
-        asm_bb(a, bb);
+        if (bb->rpo == -1) { // Unreachable
+            a->bb = bb;
+            asm_bb(a, bb);
+        }
     }
-    patch_stack_sizes(a);
     fn->num_gprs = a->next_gpr;
     fn->num_sse = a->next_sse;
+    free(a->phi_in);
 }
 
 void assemble(Vec *global) {
     for (size_t i = 0; i < vec_len(global); i++) {
         Global *g = vec_get(global, i);
         if (g->k == G_FN_DEF) {
-            asm_fn(g->fn);
+            fn_begin(g);
+            TARGET->assemble_fn(g->fn);
+            fn_end();
+        }
+    }
+}
+
+
+// ---- Stack Frame -----------------------------------------------------------
+
+// The stack frame isn't finalised until after register allocation, which
+// needs its own slots for callee-saved registers. Returns the slot's offset
+// below the top of the stack frame (i.e., rbp)
+size_t alloc_stack_slot(Fn *fn, size_t size, size_t align) {
+    // The top of the frame's only 16 byte aligned (see 'is_overaligned')
+    align = align > MAX_ALIGN ? MAX_ALIGN : align;
+    fn->stack_size += size;
+    fn->stack_size += pad(fn->stack_size, align); // Align the slot's start
+    return fn->stack_size;
+}
+
+int is_overaligned(IrType *t) {
+    return t->align > MAX_ALIGN;
+}
+
+int is_dyn_alloc(Fn *fn, IrIns *alloc) {
+    return alloc->count || (fn->dyn_stack && alloc->alloc_t->align > MAX_ALIGN);
+}
+
+int omits_frame_ptr(Fn *fn) {
+    return OMIT_FRAME_POINTER && !fn->dyn_stack && fn->frame_align == 0;
+}
+
+// Returns the slot's offset from the start of the over-aligned area, which
+// 'realign_frame' puts above the arguments for calls
+size_t alloc_aligned_slot(Fn *fn, size_t size, size_t align) {
+    fn->aligned_size += pad(fn->aligned_size, align);
+    size_t slot = fn->aligned_size;
+    fn->aligned_size += size;
+    fn->frame_align = align > fn->frame_align ? align : fn->frame_align;
+    return slot;
+}
+
+static AsmOpr * opr_stack_slot(size_t slot, size_t bytes) {
+    return opr_frame(-((int64_t) slot), bytes); // [rbp - <stack slot>]
+}
+
+// Saves 'reg' after the function's prologue and restores it before every
+// epilogue
+void save_callee_saved(Fn *fn, int reg) {
+    size_t slot = alloc_stack_slot(fn, 8, 8);
+    AsmIns *prologue = vec_get(fn->patch_with_stack_size, 0);
+    emit_after(prologue, asm2(X64_MOV, opr_stack_slot(slot, 8), opr_gpr(reg, R64)));
+    for (size_t i = 1; i < vec_len(fn->patch_with_stack_size); i++) {
+        AsmIns *epilogue = vec_get(fn->patch_with_stack_size, i);
+        emit_before(epilogue, asm2(X64_MOV, opr_gpr(reg, R64), opr_stack_slot(slot, 8)));
+    }
+}
+
+// Used to spill a vreg of kind 'k' (OPR_GPR or OPR_XMM) to the stack. The
+// whole slot is always loaded and stored: 8 bytes for a GPR, and 16 for an SSE
+// reg, since it might hold a vector
+static AsmIns * mov_slot(int k, AsmOpr *l, AsmOpr *r) {
+    return asm2(k == OPR_GPR ? X64_MOV : X64_MOVDQU, l, r);
+}
+
+static AsmOpr * opr_reg(int k, int reg) {
+    return k == OPR_GPR ? opr_gpr(reg, R64) : opr_xmm(reg);
+}
+
+static AsmOpr * opr_spill_slot(int k, size_t slot) {
+    return opr_stack_slot(slot, k == OPR_GPR ? 8 : 0); // No size for 'movdqu'
+}
+
+void spill_load(AsmIns *before, int k, int reg, size_t slot) {
+    emit_before(before, mov_slot(k, opr_reg(k, reg), opr_spill_slot(k, slot)));
+}
+
+void spill_store(AsmIns *after, int k, int reg, size_t slot) {
+    emit_after(after, mov_slot(k, opr_spill_slot(k, slot), opr_reg(k, reg)));
+}
+
+// Copies all of 'src' into 'dst' before 'before', or at the end of 'bb' if
+// 'before' is NULL
+void split_copy(BB *bb, AsmIns *before, int k, int dst, int src) {
+    AsmIns *ins = mov_slot(k, opr_reg(k, dst), opr_reg(k, src));
+    if (before) {
+        emit_before(before, ins);
+    } else {
+        emit_to_bb(bb, ins);
+    }
+}
+
+// Re-emits 'def' (a 'mov' of a constant or 'lea' of an address) before
+// 'before', into 'reg' instead
+void spill_remat(AsmIns *before, AsmIns *def, int reg) {
+    AsmOpr *dst = opr_new(def->l->k), *src = opr_new(def->r->k);
+    *dst = *def->l;
+    *src = *def->r; // 'patch_frame_oprs' modifies stack slots in place
+    dst->reg = reg;
+    if (src->k == OPR_XMM) {
+        src->reg = reg; // 'pxor x, x'
+    }
+    emit_before(before, asm2(def->op, dst, src));
+}
+
+static int is_leaf(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            if (ins->op == X64_CALL) {
+                return 0;
+            }
+        }
+    }
+    return 1; // Tail calls don't count; they leave rsp as they found it
+}
+
+static int is_frame_opr(AsmOpr *opr) {
+    return opr && opr->k == OPR_MEM && opr->frame;
+}
+
+static int uses_frame(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            AsmOpr **oprs[MAX_INS_OPRS];
+            int num_oprs = ins_oprs(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                if (is_frame_opr(*oprs[i])) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Without a frame pointer, operands addressed off the top of the stack frame
+// are relative to rsp once the frame's size is known. Operands can be shared
+// between instructions, so they're copied rather than patched in place
+static AsmOpr * patch_frame_opr(AsmOpr *opr, int64_t top) {
+    if (!is_frame_opr(opr)) {
+        return opr;
+    }
+    AsmOpr *patched = opr_new(OPR_MEM);
+    *patched = *opr;
+    patched->disp += top;
+    return patched;
+}
+
+static void patch_frame_oprs(Fn *fn, int64_t top) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            AsmOpr **oprs[MAX_INS_OPRS];
+            int num_oprs = ins_oprs(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                *oprs[i] = patch_frame_opr(*oprs[i], top);
+            }
+        }
+    }
+}
+
+// Deletes 'push rbp', 'mov rbp, rsp', and every 'pop rbp', which sit either
+// side of the 'sub rsp' and 'add rsp's
+static void delete_frame_ptr(Fn *fn) {
+    AsmIns *prologue = vec_get(fn->patch_with_stack_size, 0);
+    delete_asm(prologue->prev->prev);
+    delete_asm(prologue->prev);
+    for (size_t i = 1; i < vec_len(fn->patch_with_stack_size); i++) {
+        AsmIns *epilogue = vec_get(fn->patch_with_stack_size, i);
+        assert(epilogue->next->op == X64_POP);
+        delete_asm(epilogue->next);
+    }
+}
+
+// With over-aligned objects, the prologue rounds rsp down below the stack
+// slots, then makes room for the objects and the arguments for calls:
+//   push rbp; mov rbp, rsp; sub rsp, <slots>; and rsp, -<align>; sub rsp, <rest>
+// Everything else is still off rbp (including the callee-saved registers, for
+// the unwinder; even with '-fomit-frame-pointer'), and each epilogue puts rsp
+// back with 'mov rsp, rbp'
+static void realign_frame(Fn *fn) {
+    size_t align = fn->frame_align;
+    size_t out_args = fn->out_args_size + pad(fn->out_args_size, align);
+    size_t rest = out_args + fn->aligned_size;
+    rest += pad(rest, align);
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            AsmOpr **oprs[MAX_INS_OPRS];
+            int num_oprs = ins_oprs(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                if (!is_frame_opr(*oprs[i])) {
+                    continue;
+                }
+                AsmOpr *patched = opr_new(OPR_MEM); // Might be shared
+                *patched = **oprs[i];
+                if (patched->frame == FRAME_ALIGNED) {
+                    patched->disp += (int64_t) out_args;
+                } else {
+                    patched->base = RBP;
+                }
+                *oprs[i] = patched;
+            }
+        }
+    }
+    AsmIns *prologue = vec_get(fn->patch_with_stack_size, 0);
+    AsmIns *and = asm2(X64_AND, opr_gpr(RSP, R64), opr_imm(-(uint64_t) align));
+    AsmIns *sub = asm2(X64_SUB, opr_gpr(RSP, R64), opr_imm(rest));
+    emit_after(prologue, and);
+    emit_after(and, sub);
+    for (size_t i = 1; i < vec_len(fn->patch_with_stack_size); i++) {
+        AsmIns *epilogue = vec_get(fn->patch_with_stack_size, i);
+        epilogue->op = X64_MOV;
+        *epilogue->r = *opr_gpr(RBP, R64);
+    }
+    if (fn->stack_size == 0) {
+        delete_asm(prologue);
+    } else {
+        prologue->r->imm = fn->stack_size;
+    }
+    vec_push(fn->patch_with_stack_size, and); // Kept in place by 'schedule'
+    vec_push(fn->patch_with_stack_size, sub);
+    // The return address and rbp, then at worst 'align' - 16 bytes skipped
+    // to realign rsp
+    fn->frame_size = 16 + fn->stack_size + (align - STACK_ALIGN) + rest;
+}
+
+static int has_inline_asm(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            if (ins->op == X64_ASM) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// With VLAs, rsp moves at run time (see 'asm_dyn_alloc'), so everything else
+// in the frame is addressed off rbp (even with '-fomit-frame-pointer'), the
+// VLAs start above the arguments for calls, and each epilogue puts rsp back
+// with 'mov rsp, rbp'
+static void dyn_frame(Fn *fn) {
+    size_t out_args = fn->out_args_size + pad(fn->out_args_size, STACK_ALIGN);
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            AsmOpr **oprs[MAX_INS_OPRS];
+            int num_oprs = ins_oprs(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                if (!is_frame_opr(*oprs[i])) {
+                    continue;
+                }
+                AsmOpr *patched = opr_new(OPR_MEM); // Might be shared
+                *patched = **oprs[i];
+                if (patched->frame == FRAME_DYN) {
+                    patched->disp += (int64_t) out_args;
+                } else {
+                    patched->base = RBP;
+                }
+                *oprs[i] = patched;
+            }
+        }
+    }
+    fn->stack_size += out_args;
+    fn->frame_size = 16 + fn->stack_size; // The return address and rbp too
+    AsmIns *prologue = vec_get(fn->patch_with_stack_size, 0);
+    for (size_t i = 1; i < vec_len(fn->patch_with_stack_size); i++) {
+        AsmIns *epilogue = vec_get(fn->patch_with_stack_size, i);
+        epilogue->op = X64_MOV;
+        *epilogue->r = *opr_gpr(RBP, R64);
+    }
+    if (fn->stack_size == 0) {
+        delete_asm(prologue);
+    } else {
+        prologue->r->imm = fn->stack_size;
+    }
+}
+
+// The stack frame holds the stack slots at the top, and the arguments for
+// calls that pass some on the stack at the bottom. A leaf function whose frame
+// fits in the red zone (the bytes below rsp that signal handlers leave alone)
+// uses it there without moving rsp at all; inline assembly might push or call
+// something, so it's not trusted with one
+void patch_stack_sizes(Fn *fn) {
+    int leaf = is_leaf(fn);
+    fn->stack_size += pad(fn->stack_size, STACK_ALIGN);
+    if (fn->dyn_stack) {
+        dyn_frame(fn);
+        return;
+    }
+    if (fn->frame_align > 0) {
+        realign_frame(fn);
+        return;
+    }
+    fn->stack_size += fn->out_args_size + pad(fn->out_args_size, STACK_ALIGN);
+    size_t below_top = fn->stack_size + (OMIT_FRAME_POINTER ? 8 : 0);
+    int red_zone = RED_ZONE && leaf && below_top <= RED_ZONE_SIZE && !has_inline_asm(fn);
+    int frame_ptr = !OMIT_FRAME_POINTER;
+    if (OMIT_FRAME_POINTER) {
+        // rsp is 8 off a 16 byte boundary on entry, with no 'push rbp' to
+        // realign it. The top of the frame is kept where rbp would be, so
+        // stack slots are aligned the same either way
+        if ((fn->stack_size > 0 || !leaf) && !red_zone) {
+            fn->stack_size += 8;
+        }
+        patch_frame_oprs(fn, red_zone ? -8 : (int64_t) fn->stack_size - 8);
+    } else if (fn->stack_size == 0 && leaf && !uses_frame(fn)) {
+        delete_frame_ptr(fn);
+        frame_ptr = 0;
+    }
+    // The red zone's still stack, even if rsp doesn't move for it
+    fn->frame_size = 8 + (frame_ptr ? 8 : 0) + fn->stack_size;
+    if (fn->stack_size == 0 || red_zone) {
+        for (size_t i = 0; i < vec_len(fn->patch_with_stack_size); i++) {
+            AsmIns *ins = vec_get(fn->patch_with_stack_size, i);
+            delete_asm(ins);
+        }
+    } else {
+        for (size_t i = 0; i < vec_len(fn->patch_with_stack_size); i++) {
+            AsmIns *ins = vec_get(fn->patch_with_stack_size, i);
+            assert(ins->r->k == OPR_IMM);
+            ins->r->imm = fn->stack_size;
+        }
+    }
+}
+
+
+// ---- Shrink Wrapping -------------------------------------------------------
+
+// Outside the prologue and epilogues there's no stack frame, and the
+// callee-saved registers still hold the caller's values
+static int is_frame_reg(int reg) {
+    return reg == RSP || reg == RBP || reg == RBX || (reg >= R12 && reg <= R15);
+}
+
+static int needs_frame(AsmIns *ins) {
+    if (ins->op == X64_CALL || ins->op == X64_ASM || ins->op == X64_ASM_CLOBBER) {
+        return 1;
+    }
+    AsmOpr **oprs[MAX_INS_OPRS];
+    int num_oprs = ins_oprs(ins, oprs);
+    for (int i = 0; i < num_oprs; i++) {
+        AsmOpr *opr = *oprs[i];
+        if (opr->k == OPR_GPR && is_frame_reg(opr->reg)) {
+            return 1;
+        }
+        if (opr->k == OPR_MEM && (opr->frame || is_frame_reg(opr->base) ||
+                                  is_frame_reg(opr->idx))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The epilogue in 'bb' if it's only reached from the entry BB, and returns (or
+// tail calls) without needing the stack frame for anything
+static AsmIns * frameless_return(Fn *fn, BB *bb) {
+    if (bb == fn->entry || bb->addr_taken || vec_len(bb->pred) != 1 || !bb->asm_last ||
+            (bb->asm_last->op != X64_RET && bb->asm_last->op != X64_TAIL_CALL)) {
+        return NULL;
+    }
+    AsmIns *epilogue = NULL;
+    for (size_t i = 1; i < vec_len(fn->patch_with_stack_size); i++) {
+        AsmIns *ins = vec_get(fn->patch_with_stack_size, i);
+        if (ins->bb == bb) {
+            epilogue = ins;
+        }
+    }
+    if (!epilogue) {
+        return NULL;
+    }
+    AsmIns *pop = OMIT_FRAME_POINTER ? NULL : epilogue->next;
+    for (AsmIns *ins = bb->asm_head; ins != bb->asm_last; ins = ins->next) {
+        if (ins != epilogue && ins != pop && needs_frame(ins)) {
+            return NULL;
+        }
+    }
+    return epilogue;
+}
+
+static void unlink_bb(Fn *fn, BB *bb) {
+    bb->prev->next = bb->next;
+    if (bb->next) {
+        bb->next->prev = bb->prev;
+    } else {
+        fn->last = bb->prev;
+    }
+}
+
+static void link_bb_after(Fn *fn, BB *after, BB *bb) {
+    bb->prev = after;
+    bb->next = after->next;
+    if (after->next) {
+        after->next->prev = bb;
+    } else {
+        fn->last = bb;
+    }
+    after->next = bb;
+}
+
+// An early return at the top of a function that doesn't need the stack frame,
+// like 'if (!p) return -1;', branches around the prologue. The prologue moves
+// into the entry BB's other successor (so the callee-saved registers are saved
+// there too; see 'save_callee_saved'), and the returning BB loses its epilogue
+// and is laid out straight after the entry BB, where the encoder's walk
+// through the frame expects code with no frame (see 'track_frame')
+void shrink_wrap(Fn *fn) {
+    BB *entry = fn->entry;
+    AsmIns *prologue = vec_get(fn->patch_with_stack_size, 0);
+    if (!SHRINK_WRAP || fn->frame_align > 0 || fn->dyn_stack || prologue->bb != entry) {
+        return;
+    }
+    AsmIns *jcc = entry->asm_last, *jmp = NULL;
+    if (jcc && jcc->op == X64_JMP) {
+        jmp = jcc;
+        jcc = jcc->prev;
+    }
+    if (!jcc || !INVERT_JMP[jcc->op] || (jmp && jmp->l->k != OPR_BB) ||
+            (!jmp && !entry->next)) {
+        return;
+    }
+    BB *taken = jcc->l->bb, *not_taken = jmp ? jmp->l->bb : entry->next;
+    BB *ret = taken, *body = not_taken;
+    AsmIns *epilogue = frameless_return(fn, ret);
+    if (!epilogue) {
+        ret = not_taken;
+        body = taken;
+        epilogue = frameless_return(fn, ret);
+    }
+    if (!epilogue || body->addr_taken || vec_len(body->pred) != 1 || !body->asm_head) {
+        return;
+    }
+    AsmIns *first = OMIT_FRAME_POINTER ? prologue : prologue->prev->prev;
+    int in_prologue = 0;
+    for (AsmIns *ins = entry->asm_head; ins != jcc; ins = ins->next) {
+        in_prologue |= ins == first;
+        if (!in_prologue && needs_frame(ins)) {
+            return;
+        }
+        in_prologue &= ins != prologue;
+    }
+
+    // Move the prologue ('push rbp' and 'mov rbp, rsp' sit before the 'sub')
+    AsmIns *at = body->asm_head;
+    AsmIns *end = prologue->next;
+    for (AsmIns *ins = first, *next; ins != end; ins = next) {
+        next = ins->next;
+        delete_asm(ins);
+        emit_before(at, ins);
+    }
+
+    // Drop the epilogue ('add rsp', then 'pop rbp')
+    if (!OMIT_FRAME_POINTER) {
+        assert(epilogue->next->op == X64_POP);
+        delete_asm(epilogue->next);
+    }
+    delete_asm(epilogue);
+    for (size_t i = 1; i < vec_len(fn->patch_with_stack_size); i++) {
+        if (vec_get(fn->patch_with_stack_size, i) == epilogue) {
+            vec_remove(fn->patch_with_stack_size, i);
+            break;
+        }
+    }
+
+    // Branch to the body, falling through to the early return
+    if (ret == taken) {
+        jcc->op = INVERT_JMP[jcc->op];
+        jcc->l = opr_bb(body);
+    }
+    if (jmp) {
+        delete_asm(jmp);
+    }
+    if (entry->next != ret) {
+        unlink_bb(fn, ret);
+        link_bb_after(fn, entry, ret);
+    }
+}
+
+
+
+// ---- Floating Point Constant Pool ------------------------------------------
+
+static int cmp_bits(const void *a, const void *b) {
+    uint64_t l = **(uint64_t **) a, r = **(uint64_t **) b;
+    return l < r ? -1 : (l > r ? 1 : 0);
+}
+
+// Run once every function's been assembled, since the parallel backend
+// assembles them on separate threads
+Vec * fp_pool(Vec *globals, int k) {
+    Vec *all = vec_new();
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k == G_FN_DEF) {
+            vec_push_all(all, k == OPR_F32 ? g->fn->f32s : g->fn->f64s);
         }
     }
+    qsort(all->data, vec_len(all), sizeof(void *), cmp_bits);
+    Vec *pool = vec_new();
+    for (size_t i = 0; i < vec_len(all); i++) {
+        uint64_t *bits = vec_get(all, i);
+        if (vec_len(pool) == 0 || *bits != *((uint64_t *) vec_tail(pool))) {
+            vec_push(pool, bits);
+        }
+    }
+    return pool;
+}
+
+// Named after the constant's bits, so every function refers to the same one
+// without looking it up; C identifiers can't contain a '.'
+char * fp_label(int k, uint64_t bits) {
+    Buf *b = buf_new();
+    buf_printf(b, "%s.%llx", k == OPR_F32 ? "_F" : "_D", (unsigned long long) bits);
+    buf_push(b, '\0');
+    return b->data;
 }
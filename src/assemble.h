@@ -35,10 +35,18 @@ enum { // x86-64 opcodes
     X64_MOVSD,
     X64_LEA,
 
+    // Block moves
+    X64_MOVDQU,    // 16 bytes to or from an SSE register
+    X64_MOVDQA,    // The same, at a 16 byte aligned address
+    X64_PXOR,      // Zeros an SSE register (or XORs two vectors)
+    X64_REP_MOVSB, // Copies rcx bytes from [rsi] to [rdi]
+    X64_REP_STOSB, // Sets rcx bytes at [rdi] to al
+
     // Arithmetic
     X64_ADD,
     X64_SUB,
     X64_IMUL,
+    X64_MUL, // Unsigned; rdx:rax = rax * its operand
     X64_CWD,
     X64_CDQ,
     X64_CQO,
@@ -50,6 +58,15 @@ enum { // x86-64 opcodes
     X64_SHL,
     X64_SHR,
     X64_SAR,
+    X64_POPCNT,
+    X64_BSF, // Index of the lowest set bit
+    X64_BSR, // Index of the highest set bit
+    X64_BSWAP,
+    X64_LZCNT, // Number of leading zeros (LZCNT)
+    X64_TZCNT, // Number of trailing zeros (BMI1)
+    X64_SHLX,  // 'shlx dst, src, count'; any register for the count (BMI2)
+    X64_SHRX,
+    X64_SARX,
 
     // Floating point arithmetic
     X64_ADDSS,
@@ -60,9 +77,73 @@ enum { // x86-64 opcodes
     X64_MULSD,
     X64_DIVSS,
     X64_DIVSD,
+    X64_MINSS, // For floating point selects (see 'asm_select')
+    X64_MINSD,
+    X64_MAXSS,
+    X64_MAXSD,
+    X64_VADDSS, // 'vaddss dst, l, r' (AVX); doesn't need 'dst' to be 'l'
+    X64_VADDSD,
+    X64_VSUBSS,
+    X64_VSUBSD,
+    X64_VMULSS,
+    X64_VMULSD,
+    X64_VDIVSS,
+    X64_VDIVSD,
+    X64_VFMADD231SS,  // 'dst = l * r + dst' (FMA)
+    X64_VFMADD231SD,
+    X64_VFMSUB231SS,  // 'dst = l * r - dst'
+    X64_VFMSUB231SD,
+    X64_VFNMADD231SS, // 'dst = -(l * r) + dst'
+    X64_VFNMADD231SD,
+
+    // Vector (packed SSE2) moves and arithmetic
+    X64_MOVD, // 4 bytes between an SSE register and a GPR or memory
+    X64_MOVQ, // 8 bytes
+    X64_PADDB,
+    X64_PADDW,
+    X64_PADDD,
+    X64_PADDQ,
+    X64_PSUBB,
+    X64_PSUBW,
+    X64_PSUBD,
+    X64_PSUBQ,
+    X64_PMULLW,
+    X64_PMULUDQ, // Multiplies the even 32-bit lanes into 64-bit products
+    X64_PAND,
+    X64_POR,
+    X64_ADDPS,
+    X64_ADDPD,
+    X64_SUBPS,
+    X64_SUBPD,
+    X64_MULPS,
+    X64_MULPD,
+    X64_DIVPS,
+    X64_DIVPD,
+    X64_VFMADD231PS, // Packed FMAs (see 'X64_VFMADD231SS')
+    X64_VFMADD231PD,
+    X64_VFMSUB231PS,
+    X64_VFMSUB231PD,
+    X64_VFNMADD231PS,
+    X64_VFNMADD231PD,
+    X64_PSLLW, // Shifts only take an immediate
+    X64_PSLLD,
+    X64_PSLLQ,
+    X64_PSRLW,
+    X64_PSRLD,
+    X64_PSRLQ,
+    X64_PSRAW,
+    X64_PSRAD,
+    X64_PSRLDQ, // Shifts the whole register right by a number of bytes
+    X64_PUNPCKLBW, // Interleaves the lanes in the low halves of two registers
+    X64_PUNPCKLWD,
+    X64_PUNPCKLDQ,
+    X64_PUNPCKLQDQ,
+    X64_PACKSSWB, // Narrows the lanes of two registers, with signed saturation
+    X64_PACKSSDW,
 
     // Comparisons
     X64_CMP,
+    X64_TEST,
     X64_SETE,
     X64_SETNE,
     X64_SETL,
@@ -73,6 +154,16 @@ enum { // x86-64 opcodes
     X64_SETBE,
     X64_SETA,
     X64_SETAE,
+    X64_CMOVE, // Moves only if the condition holds (for IR_SELECT)
+    X64_CMOVNE,
+    X64_CMOVL,
+    X64_CMOVLE,
+    X64_CMOVG,
+    X64_CMOVGE,
+    X64_CMOVB,
+    X64_CMOVBE,
+    X64_CMOVA,
+    X64_CMOVAE,
 
     // Floating point comparisons
     X64_UCOMISS,
@@ -90,6 +181,12 @@ enum { // x86-64 opcodes
     X64_PUSH,
     X64_POP,
 
+    // Cache hints
+    X64_PREFETCHT0,
+    X64_PREFETCHT1,
+    X64_PREFETCHT2,
+    X64_PREFETCHNTA,
+
     // Control flow
     X64_JMP,
     X64_JE,
@@ -103,29 +200,57 @@ enum { // x86-64 opcodes
     X64_JA,
     X64_JAE,
     X64_CALL,
+    X64_TAIL_CALL, // 'jmp' to a function that returns to our caller
     X64_RET,
     X64_SYSCALL,
+    X64_UD2, // Traps; for code that can never run
+
+    // Atomics (a single instruction with its 'lock' prefix, so nothing can be
+    // put between them)
+    X64_LOCK_XADD,
+    X64_LOCK_CMPXCHG,
+
+    // Inline assembly
+    X64_ASM,         // A block of inline assembly (see 'AsmBlock')
+    X64_ASM_CLOBBER, // Just before an X64_ASM; moves inputs into fixed pregs
+    X64_LOCK,        // The rest are only written in inline assembly
+    X64_PAUSE,
+    X64_RDTSC,
+    X64_MFENCE,
+    X64_LFENCE,
+    X64_SFENCE,
+    X64_CMPXCHG,
+    X64_XADD,
+    X64_XCHG,
+    X64_NOP,
 
     X64_LAST, // For tables
 };
 
 enum { // Operand types
     OPR_IMM,   // Immediate
-    OPR_F32,   // Per-function floating point constant (float)
+    OPR_F32,   // Floating point constant in the pool (float; see 'fp_pool')
     OPR_F64,   // (double or ldouble)
+    OPR_TABLE, // Address of a per-function jump table
     OPR_GPR,   // General purpose register
     OPR_XMM,   // Floating point SSE register
     OPR_MEM,   // Memory access: [base + idx * scale + disp]
     OPR_BB,    // Label for a BB
+    OPR_BB_ADDR, // Address of a BB, for 'lea': [rel <bb>]
     OPR_LABEL, // Arbitrary label
     OPR_DEREF, // Value at a label: [label]
+    OPR_TPOFF, // Thread-local at a label, off the thread pointer: [fs:label@tpoff]
+               // (or the thread pointer itself, [fs:0], if 'label' is NULL)
+    OPR_GOTTPOFF, // GOT entry with a thread-local's offset: [rel label@gottpoff]
+    OPR_GOTPCREL, // GOT entry with a symbol's address: [rel label@gotpcrel]
 };
 
 typedef struct {
     int k;
     union {
         uint64_t imm; // OPR_IMM
-        size_t fp;    // OPR_FP
+        uint64_t fp;  // OPR_F32, OPR_F64; the constant's bits
+        size_t table; // OPR_TABLE
         struct { int reg, size; }; // OPR_GPR, OPR_XMM
         struct {
             size_t bytes; // 1, 2, 4, or 8 bytes for memory access
@@ -134,28 +259,197 @@ typedef struct {
                     int base, base_size;
                     int idx, idx_size;
                     int scale; // 1, 2, 4, or 8
+                    int frame; // One of 'FRAME_TOP', etc. (0 if none)
                     int64_t disp;
+                    int fs; // Off the thread pointer: [fs:base + ...]
                 };
-                char *label; // OPR_LABEL, OPR_DEREF
+                char *label; // OPR_LABEL, OPR_DEREF, OPR_TPOFF, OPR_GOTTPOFF,
+                             // OPR_GOTPCREL
             };
         };
-        struct BB *bb; // OPR_BB
+        struct BB *bb; // OPR_BB, OPR_BB_ADDR
     };
 } AsmOpr;
 
+enum { // Where a stack slot's 'disp' is from, until 'patch_stack_sizes'
+    FRAME_TOP = 1, // The top of the stack frame
+    FRAME_ALIGNED, // The start of its over-aligned area
+    FRAME_DYN,     // The bottom, above the arguments for calls (rsp-relative)
+};
+
+enum { // How an inline assembly block accesses each of its operands
+    ASM_READ  = 1,
+    ASM_WRITE = 2,
+    ASM_EARLY = 4, // Written before the inputs are all read
+};
+
+// The operands substituted into an inline assembly template. An input with a
+// fixed register constraint (e.g., "a") is in its preg in 'oprs', and 'fixed'
+// has the vreg that the X64_ASM_CLOBBER moves into it. Outputs with a fixed
+// register are moved out of it after the block. The X64_ASM_CLOBBER shares
+// the X64_ASM's block
+typedef struct AsmBlock {
+    InlineAsm *inline_asm;
+    AsmOpr **oprs;  // Per operand
+    AsmOpr **fixed; // Per operand; NULL unless it's an input in a fixed preg
+    int *access;    // Per operand; 'ASM_READ', etc.
+} AsmBlock;
+
 typedef struct AsmIns {
     struct AsmIns *next, *prev;
     struct BB *bb;
     int op;
+    int line; // Of the IR instruction it came from, with '-g' (0 if unknown)
     AsmOpr *l, *r;
+    AsmOpr *r2; // Third operand of a VEX encoded instruction (e.g., 'shlx')
+    AsmBlock *block; // X64_ASM, X64_ASM_CLOBBER; and the instructions the
+                     // encoder expands an X64_ASM into
+    Fn *callee;      // X64_CALL, X64_TAIL_CALL; see 'static_callee'
 
     // For register allocator
     size_t n;
+
+    // Where 'l' and 'r' are kept when they're given to 'asm1', 'asm2', or
+    // 'asm3', so they sit next to the instruction rather than being shared
+    // with others (an instruction can still point elsewhere, e.g., after the
+    // peephole optimiser replaces an operand). Left off the end of the
+    // allocation for instructions made without them
+    AsmOpr l_opr, r_opr;
 } AsmIns;
 
 void assemble(Vec *globals);
+void assemble_fn(Fn *fn);
+
+// The function a call through 'fn' goes to, if it's a 'static' one defined in
+// this file (so what it does can't change at link time), or NULL
+Fn * static_callee(IrIns *fn);
+
+// For another target's instruction selection (see 'target.h'): the bits of an
+// IR_FP at its type's width; the comparison a branch on 'cond' tests, looking
+// through tests of a boolean (setting 'negated' if it's taken when that's
+// false); and the preparation of the IR before it's assembled, which splits
+// the edges that phi copies can't go on, and marks the comparisons only used
+// by branches and selects (which 'cmp' for themselves) with 'fold' 1
+uint64_t fp_bits(IrIns *ir);
+int is_cmp(IrIns *ins);
+IrIns * fuse_cond(IrIns *cond, int *negated);
+void split_critical_edges(Fn *fn);
+void mark_branch_conds(Fn *fn);
 
+// '-fomit-frame-pointer': address stack slots off rsp instead of rbp, which
+// frees up rbp for the register allocator
+extern int OMIT_FRAME_POINTER;
+
+// '-mno-red-zone': always move rsp for the stack frame, even in a leaf function
+// (for code that runs where something else can write below rsp, like a kernel)
+extern int RED_ZONE;
+
+// '-fno-shrink-wrap': always set up the stack frame in the entry BB (see
+// 'shrink_wrap')
+extern int SHRINK_WRAP;
+
+// '-march=' and '-m<feature>': the extensions to baseline x86-64 (up to SSE2)
+// that instruction selection can use. 'popcnt' is used regardless
+enum {
+    CPU_LZCNT = 1 << 0, // 'lzcnt' for '__builtin_clz'
+    CPU_BMI1  = 1 << 1, // 'tzcnt' for '__builtin_ctz'
+    CPU_BMI2  = 1 << 2, // 'shlx', 'shrx', and 'sarx' for variable shifts
+    CPU_AVX   = 1 << 3, // Three-operand floating point arithmetic
+    CPU_AVX2  = 1 << 4, // Nothing yet; vectors are still 128 bits
+    CPU_FMA   = 1 << 5, // Fused multiply-adds for 'a * b + c'
+};
+extern int CPU_FEATURES;
+int cpu_arch_features(char *arch);      // -1 if 'arch' isn't known
+int set_cpu_feature(char *name, int on); // 0 if 'name' isn't known
+
+// '-ffp-contract=fast' (the default) lets a floating point multiply and add be
+// fused into one FMA with a single rounding, given 'CPU_FMA'; '=off' (and
+// '=on', as in GCC) keeps every operation rounded separately
+extern int FP_CONTRACT;
+
+// Thread-locals defined in this file are accessed with the local-exec model
+// (a single 'mov' off 'fs', with the offset fixed at link time), which only
+// works in an executable; others with initial-exec (the offset's loaded from
+// the GOT first). NASM can't write local-exec relocations, and a shared
+// library can't use them, so it's off for both
+extern int TLS_LOCAL_EXEC;
+
+// '-fPIC' and '-fPIE'. Globals are always addressed relative to rip, so the
+// code works wherever it's loaded; what changes is which symbols might be
+// defined in another module (i.e., 'is_preemptible'), and so have their
+// address loaded from the GOT. Without either, every symbol is assumed to be
+// in the executable (the linker makes copies of a shared library's data)
+enum {
+    PIC_NONE,
+    PIC_PIE,    // For an executable; only undefined symbols are preemptible
+    PIC_SHARED, // For a shared library; so is anything that's exported
+};
+extern int PIC;
+
+// '-fvisibility=hidden': symbols defined in this file (unless they're given
+// 'visibility("default")') aren't exported from the shared library they end
+// up in, so references to them bind directly, without going through the GOT
+// or a PLT stub
+extern int VISIBILITY_HIDDEN;
+
+// '-fno-plt': calls to preemptible functions (and any that aren't defined in
+// this file) jump through their GOT entry, rather than calling a PLT stub
+// that does the same. Needs the symbols bound when the program's loaded
+extern int PLT;
+
+// Whether 'g' is kept out of the dynamic symbol table, by its visibility or
+// '-fvisibility'
+int is_hidden(Global *g);
+
+// Whether 'g' might end up defined by another module at run time, so its
+// address has to come from the GOT (see 'PIC')
+int is_preemptible(Global *g);
 // For register allocator to remove redundant 'mov's
 void delete_asm(AsmIns *ins);
 
+// Finds the operands of an instruction, including every one in an inline
+// assembly block, in order, then its 'fixed' inputs (the X64_ASM_CLOBBER
+// before it has none of its own). Returns how many there are
+#define MAX_INS_OPRS (MAX_ASM_OPRS * 2)
+int ins_oprs(AsmIns *ins, AsmOpr **oprs[MAX_INS_OPRS]);
+
+// For register allocator to lay out the stack frame once it knows which
+// callee-saved registers it used, to spill vregs to the stack, and to split
+// their live ranges
+size_t alloc_stack_slot(Fn *fn, size_t size, size_t align);
+
+// An object aligned to more than 'MAX_ALIGN' gets its own area at the bottom
+// of the stack frame, which the prologue realigns rsp for
+int is_overaligned(IrType *t);
+size_t alloc_aligned_slot(Fn *fn, size_t size, size_t align);
+
+// A VLA (an IR_ALLOC with a 'count') moves rsp when it's allocated rather than
+// getting a stack slot, as does an over-aligned object in the same function.
+// A function with either keeps its frame pointer, even with
+// '-fomit-frame-pointer'
+int is_dyn_alloc(Fn *fn, IrIns *alloc);
+int omits_frame_ptr(Fn *fn);
+
+void save_callee_saved(Fn *fn, int reg);
+void spill_load(AsmIns *before, int k, int reg, size_t slot);
+void spill_store(AsmIns *after, int k, int reg, size_t slot);
+void spill_remat(AsmIns *before, AsmIns *def, int reg);
+void split_copy(BB *bb, AsmIns *before, int k, int dst, int src);
+
+// The floating point constants every function in the file uses, for the
+// encoder to put in '.rodata'. Each one is there once, as a 'uint64_t *' of its
+// bits, in ascending order. 'k' is OPR_F32 or OPR_F64
+Vec * fp_pool(Vec *globals, int k);
+char * fp_label(int k, uint64_t bits); // Of a constant in the pool
+
+// Moves the prologue off an early return that doesn't need the stack frame,
+// once the register allocator's chosen registers, but before it saves the
+// callee-saved ones
+void shrink_wrap(Fn *fn);
+
+// Sets the size of the stack frame in the prologue and epilogues, and drops
+// the prologue and epilogues altogether for leaf functions that don't need a
+// stack frame (or only need one small enough for the red zone)
+void patch_stack_sizes(Fn *fn);
+
 #endif
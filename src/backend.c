@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "backend.h"
+#include "reg_alloc.h"
+#include "peephole.h"
+#include "schedule.h"
+#include "encode.h"
+#include "fn_cache.h"
+#include "stats.h"
+#include "stack_usage.h"
+#include "target.h"
+
+typedef struct {
+    Vec *globals;
+    int allocator, num_threads;
+    Buf **fn_text;
+    Encoder *enc;
+    int level; // Of the functions being done (see 'order_by_calls')
+    // For 'enc'; functions are encoded in order, by whichever worker finishes
+    // the next one due
+    pthread_mutex_t lock;
+    size_t next;
+    char *done;                // Per global
+    ArenaBlock **asm_blocks;   // Per global; its assembly, until it's encoded
+} Backend;
+
+// The function's text or machine code is all that's needed of its assembly
+static void free_asm(Fn *fn, ArenaBlock *blocks) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->asm_head = bb->asm_last = NULL;
+    }
+    vec_free(fn->patch_with_stack_size);
+    fn->patch_with_stack_size = NULL;
+    arena_free_blocks(blocks);
+}
+
+static void commit(Backend *b, size_t i) {
+    ArenaBlock *blocks = arena_detach(ARENA_ASM);
+    pthread_mutex_lock(&b->lock);
+    b->asm_blocks[i] = blocks;
+    b->done[i] = 1;
+    while (b->next < vec_len(b->globals) && b->done[b->next]) {
+        Global *g = vec_get(b->globals, b->next);
+        if (g->k == G_FN_DEF) {
+            x64_encode_fn(b->enc, g);
+            free_asm(g->fn, b->asm_blocks[b->next]);
+        }
+        b->next++;
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void backend_fn(Backend *b, size_t i, Global *g) {
+    Buf *key = NULL;
+    if (b->fn_text && CACHE_DIR && !CODEGEN_STATS && !STACK_USAGE && (key = fn_cache_key(g, b->allocator))) {
+        b->fn_text[i] = fn_cache_load(g, key);
+        if (b->fn_text[i]) {
+            return; // Compiled before
+        }
+    }
+    TARGET->assemble_fn(g->fn);
+    if (SCHEDULE_INSNS && TARGET->schedule_fn) {
+        TARGET->schedule_fn(g->fn, 0);
+    }
+    reg_alloc_fn(g->fn, b->allocator, b->num_threads, 0);
+    TARGET->peephole_fn(g->fn);
+    if (SCHEDULE_INSNS2 && TARGET->schedule_fn) {
+        TARGET->schedule_fn(g->fn, 1);
+    }
+    if (b->fn_text) {
+        Buf *text = buf_new();
+        TARGET->encode_fn(text, g);
+        b->fn_text[i] = text;
+        if (key) {
+            fn_cache_save(g, key, text);
+        }
+        free_asm(g->fn, arena_detach(ARENA_ASM));
+    }
+}
+
+static void backend_global(void *arg, size_t i) {
+    Backend *b = arg;
+    Global *g = vec_get(b->globals, i);
+    if ((g->k == G_FN_DEF ? g->fn->ra_level : 0) != b->level) {
+        return; // Done on another level
+    }
+    if (g->k == G_FN_DEF) {
+        backend_fn(b, i, g);
+    }
+    if (b->enc) {
+        commit(b, i);
+    }
+}
+
+void backend(Vec *globals, int allocator, int num_threads, Buf **fn_text, Encoder *enc) {
+    Backend b = {
+        .globals = globals,
+        .allocator = allocator,
+        .num_threads = num_threads,
+        .fn_text = fn_text,
+        .enc = enc,
+        .next = 0,
+    };
+    if (enc) {
+        pthread_mutex_init(&b.lock, NULL);
+        b.done = calloc(vec_len(globals) + 1, sizeof(char));
+        b.asm_blocks = calloc(vec_len(globals) + 1, sizeof(ArenaBlock *));
+    }
+    // A function that's loaded from the cache isn't allocated, and a cached
+    // caller couldn't tell if what its callees clobber had changed
+    int num_levels = order_by_calls(globals, IPA_RA && !CACHE_DIR);
+    for (b.level = 0; b.level < num_levels; b.level++) {
+        parallel_for(vec_len(globals), num_threads, backend_global, &b);
+    }
+    if (enc) {
+        pthread_mutex_destroy(&b.lock);
+        free(b.done);
+        free(b.asm_blocks);
+    }
+}
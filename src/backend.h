@@ -0,0 +1,23 @@
+
+#ifndef COSEC_BACKEND_H
+#define COSEC_BACKEND_H
+
+#include "assemble.h"
+#include "x64.h"
+
+// Parallel backend. Once the optimiser's done, functions don't share any
+// mutable state, so each one is taken through 'assemble', 'reg_alloc',
+// 'peephole', and encoding on a pool of 'num_threads' worker threads, each
+// with its own arenas. Functions are done a level of the call graph at a
+// time, callees first (see 'order_by_calls'). Either 'fn_text' or 'enc' is set:
+//   * 'fn_text[i]' gets the NASM text for 'globals[i]', to be stitched
+//     together in order by 'encode_nasm_with'. With '-fcache-dir', functions
+//     whose text is already in the cache (see 'fn_cache.h') skip all of that;
+//   * each function's machine code goes into 'enc' (see 'x64_begin'), in
+//     order, as soon as it and every function before it are done.
+// A function's assembly is freed once it's encoded, so memory use is bounded
+// by the IR rather than the IR plus every function's assembly. The debug and
+// '--time-report' output isn't thread safe, so those need the serial pipeline
+void backend(Vec *globals, int allocator, int num_threads, Buf **fn_text, Encoder *enc);
+
+#endif
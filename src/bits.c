@@ -0,0 +1,689 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "bits.h"
+#include "analysis.h"
+
+// Done in two rounds. The first only makes changes that give exactly the same
+// value, using the known bits (computed in a single pass in reverse postorder,
+// so nothing's known about a value coming around a loop's back edge). The
+// second then works out the demanded bits on what's left, and only changes
+// bits that nothing demands. Keeping them apart matters: 'zext(c) & 0xff'
+// only demands the low bits of 'zext(c)', and only because the mask is
+// there; the mask can only go if 'zext(c)' stays a real zero extension.
+//
+// A branch to a dead end (an IR_UNREACHABLE, from '__builtin_unreachable' or
+// '__builtin_assume') says something about its condition on the other side:
+// after 'if (x >= 16) __builtin_unreachable()', the top bits of 'x' are 0.
+// Each such fact holds in the BB the branch goes to and everything it
+// dominates, so the known bits of an operand are looked up where it's used.
+
+typedef struct {
+    IrIns *cond;    // The branch's condition (NULL if there's no fact)
+    int holds;      // Whether 'cond' is true here
+    IrIns *x;       // NULL if nothing more is known about any bits
+    uint64_t zeros; // More bits of 'x' known to be 0
+} Fact;
+
+typedef struct {
+    Fn *fn;
+    Vec *rpo;          // of 'BB *'
+    uint64_t *zeros;   // Per ins; the bits known to be 0
+    Fact *facts;       // Per BB (by 'rpo'); NULL if there aren't any
+    uint64_t *demands; // Per ins; the bits something depends on
+    IrIns **repl;      // Per ins; what it was replaced by, or NULL
+} Bits;
+
+static int is_int(IrType *t) {
+    return t && t->k >= IRT_I8 && t->k <= IRT_I64; // NULL for void
+}
+
+static uint64_t mask(IrType *t) {
+    return t->size >= 8 ? ~0ull : (1ull << (t->size * 8)) - 1;
+}
+
+static uint64_t sign_bit(IrType *t) {
+    return 1ull << (t->size * 8 - 1);
+}
+
+static uint64_t sext(uint64_t v, IrType *t) {
+    return v & sign_bit(t) ? v | ~mask(t) : v & mask(t);
+}
+
+static uint64_t low_bits(int n) { // The low 'n' bits
+    return n >= 64 ? ~0ull : (1ull << n) - 1;
+}
+
+static uint64_t high_bits(int n, IrType *t) { // The top 'n' bits of 't'
+    return mask(t) & ~(n >= 64 ? 0 : mask(t) >> n);
+}
+
+static int num_leading(uint64_t zeros, IrType *t) {
+    int n = 0;
+    for (int b = (int) t->size * 8 - 1; b >= 0 && ((zeros >> b) & 1); b--) n++;
+    return n;
+}
+
+static int num_trailing(uint64_t zeros, IrType *t) {
+    int n = 0;
+    for (int b = 0; b < (int) t->size * 8 && ((zeros >> b) & 1); b++) n++;
+    return n;
+}
+
+// Every bit up to the highest one set in 'v'
+static uint64_t up_to_msb(uint64_t v) {
+    for (int s = 1; s < 64; s *= 2) v |= v >> s;
+    return v;
+}
+
+// For a shift by a constant that's in range
+static int shift_by(IrIns *ins, int *s) {
+    if (ins->r->op != IR_IMM || ins->r->imm >= ins->t->size * 8) {
+        return 0;
+    }
+    *s = (int) ins->r->imm;
+    return 1;
+}
+
+static IrIns * resolve(Bits *b, IrIns *ins) {
+    while (b->repl[ins->n]) {
+        ins = b->repl[ins->n];
+    }
+    return ins;
+}
+
+static void replace_uses(Bits *b) {
+    for (BB *bb = b->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                *oprs[i] = resolve(b, *oprs[i]);
+            }
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    vec_put(ins->defs, i, resolve(b, vec_get(ins->defs, i)));
+                }
+            }
+        }
+    }
+}
+
+
+// ---- Known Bits ------------------------------------------------------------
+
+// The bits of 'x' known to be 0 in 'bb', including the facts that hold there.
+// Constants are looked at directly, since 'simplify_exact' adds new ones
+static uint64_t zeros_at(Bits *b, IrIns *x, BB *bb) {
+    if (x->op == IR_IMM) {
+        return ~x->imm & mask(x->t);
+    }
+    uint64_t z = b->zeros[x->n];
+    if (!b->facts) {
+        return z;
+    }
+    for (; bb; bb = bb->idom) {
+        Fact *f = &b->facts[bb->rpo];
+        if (f->x == x) {
+            z |= f->zeros;
+        }
+    }
+    return z & mask(x->t);
+}
+
+static uint64_t phi_zeros(Bits *b, IrIns *phi) {
+    uint64_t z = ~0ull;
+    for (size_t i = 0; i < vec_len(phi->defs); i++) {
+        IrIns *def = vec_get(phi->defs, i);
+        z &= zeros_at(b, def, vec_get(phi->preds, i));
+    }
+    return z;
+}
+
+static uint64_t known_zeros(Bits *b, IrIns *ins) {
+    IrType *t = ins->t;
+    int w = (int) t->size * 8, s;
+    uint64_t zl = 0, zr = 0;
+    if (ins->op >= IR_ADD && ins->op <= IR_ZEXT) {
+        zl = zeros_at(b, ins->l, ins->bb);
+        if (ins->op < IR_POPCNT || (ins->op >= IR_EQ && ins->op <= IR_FGE)) {
+            zr = zeros_at(b, ins->r, ins->bb);
+        }
+    }
+    int ll = num_leading(zl, t), lr = num_leading(zr, t);
+    int tl = num_trailing(zl, t), tr = num_trailing(zr, t);
+    uint64_t z;
+    switch (ins->op) {
+    case IR_IMM:     z = ~ins->imm; break;
+    case IR_BIT_AND: z = zl | zr; break;
+    case IR_BIT_OR: case IR_BIT_XOR: z = zl & zr; break;
+    case IR_ADD: { // Can only carry one bit further up
+        int lead = ll < lr ? ll : lr;
+        z = (lead > 0 ? high_bits(lead - 1, t) : 0) | low_bits(tl < tr ? tl : tr);
+        break;
+    }
+    case IR_SUB: // 'x - 0' is what a jump table starting at 0 indexes with
+        z = zr == mask(t) ? zl : low_bits(tl < tr ? tl : tr);
+        break;
+    case IR_MUL:
+        z = (ll + lr > w ? high_bits(ll + lr - w, t) : 0) | low_bits(tl + tr);
+        break;
+    case IR_UMULH: // The top half of a product with 'll + lr' leading zeros
+        z = high_bits(ll + lr < w ? ll + lr : w, t);
+        break;
+    case IR_UDIV: z = high_bits(ll, t); break;
+    case IR_UMOD: z = high_bits(ll > lr ? ll : lr, t); break;
+    case IR_SHL:
+        z = shift_by(ins, &s) ? (zl << s) | low_bits(s) : 0;
+        break;
+    case IR_SHR:
+        z = shift_by(ins, &s) ? (zl >> s) | high_bits(s, t) : 0;
+        break;
+    case IR_SAR: // The top bits are all copies of the sign bit
+        z = !shift_by(ins, &s) ? 0 :
+            (zl & sign_bit(t)) ? (zl >> s) | high_bits(s, t) : (zl >> s) & (mask(t) >> s);
+        break;
+    case IR_POPCNT: case IR_CTZ: case IR_CLZ: z = ~low_bits(7); break; // <= 64
+    case IR_EQ:  case IR_NEQ:
+    case IR_SLT: case IR_SLE: case IR_SGT: case IR_SGE:
+    case IR_ULT: case IR_ULE: case IR_UGT: case IR_UGE:
+    case IR_FLT: case IR_FLE: case IR_FGT: case IR_FGE:
+        z = ~1ull;
+        break;
+    case IR_TRUNC: z = zl; break;
+    case IR_ZEXT:  z = zl | ~mask(ins->l->t); break;
+    case IR_SEXT:
+        z = (zl & sign_bit(ins->l->t)) ? zl | ~mask(ins->l->t) : zl & mask(ins->l->t);
+        break;
+    case IR_SELECT:
+        z = zeros_at(b, ins->l, ins->bb) & zeros_at(b, ins->r, ins->bb);
+        break;
+    case IR_PHI:    z = phi_zeros(b, ins); break;
+    default:        z = 0; break;
+    }
+    return z & mask(t);
+}
+
+// ---- Assumptions -----------------------------------------------------------
+
+static int swap_cmp(int op) { // 'c op x' as 'x op' c'
+    switch (op) {
+    case IR_SLT: return IR_SGT; case IR_SLE: return IR_SGE;
+    case IR_SGT: return IR_SLT; case IR_SGE: return IR_SLE;
+    case IR_ULT: return IR_UGT; case IR_ULE: return IR_UGE;
+    case IR_UGT: return IR_ULT; case IR_UGE: return IR_ULE;
+    default:     return op; // IR_EQ, IR_NEQ
+    }
+}
+
+static int invert_cmp(int op) { // '!(x op c)' as 'x op' c'
+    switch (op) {
+    case IR_EQ:  return IR_NEQ; case IR_NEQ: return IR_EQ;
+    case IR_SLT: return IR_SGE; case IR_SLE: return IR_SGT;
+    case IR_SGT: return IR_SLE; case IR_SGE: return IR_SLT;
+    case IR_ULT: return IR_UGE; case IR_ULE: return IR_UGT;
+    case IR_UGT: return IR_ULE; default:     return IR_ULT; // IR_UGE
+    }
+}
+
+static int is_int_cmp(IrIns *ins) {
+    return ins->op >= IR_EQ && ins->op <= IR_UGE && is_int(ins->l->t);
+}
+
+// Splits an int comparison against a constant into 'x op c', or returns 0
+static int split_cmp(IrIns *cmp, IrIns **x, int *op, uint64_t *c) {
+    if (!is_int_cmp(cmp)) {
+        return 0;
+    } else if (cmp->r->op == IR_IMM) {
+        *x = cmp->l, *op = cmp->op, *c = cmp->r->imm & mask(cmp->l->t);
+    } else if (cmp->l->op == IR_IMM) {
+        *x = cmp->r, *op = swap_cmp(cmp->op), *c = cmp->l->imm & mask(cmp->r->t);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// A signed comparison is unsigned if the sign bit of 'x' is known to be 0
+// and 'c' isn't negative
+static int as_unsigned(int op, uint64_t z, uint64_t c, IrType *t) {
+    if (op < IR_SLT || op > IR_SGE || !(z & sign_bit(t)) || (c & sign_bit(t))) {
+        return op;
+    }
+    return op - IR_SLT + IR_ULT;
+}
+
+// The bits of 'x' known to be 0 wherever 'x op c' holds, in 'bb'
+static uint64_t cmp_zeros(Bits *b, IrIns *x, int op, uint64_t c, BB *bb) {
+    IrType *t = x->t;
+    op = as_unsigned(op, zeros_at(b, x, bb), c, t);
+    switch (op) {
+    case IR_EQ:  return ~c & mask(t);
+    case IR_ULT: return c == 0 ? 0 : ~up_to_msb(c - 1) & mask(t);
+    case IR_ULE: return ~up_to_msb(c) & mask(t);
+    case IR_SGE: return c == 0 ? sign_bit(t) : 0;
+    case IR_SGT: return c == mask(t) ? sign_bit(t) : 0; // -1
+    default:     return 0;
+    }
+}
+
+// The fact in 'bb' when its only predecessor ends in a conditional branch
+// whose other side is a dead end
+static Fact find_fact(Bits *b, BB *bb) {
+    Fact f = {0};
+    if (vec_len(bb->pred) != 1) {
+        return f;
+    }
+    BB *pred = vec_get(bb->pred, 0);
+    IrIns *br = pred->ir_last;
+    if (br->op != IR_CONDBR || br->true == br->false) {
+        return f;
+    }
+    BB *other = br->true == bb ? br->false : br->true;
+    IrIns *x;
+    int op;
+    uint64_t c;
+    if (!is_dead_end(other)) {
+        return f;
+    }
+    f.cond = br->cond;
+    f.holds = bb == br->true;
+    if (!split_cmp(br->cond, &x, &op, &c)) {
+        return f;
+    }
+    if (bb == br->false) {
+        op = invert_cmp(op);
+    }
+    if (op == IR_EQ && c == 0 && x->op == IR_BIT_AND && x->r->op == IR_IMM) {
+        f.x = x->l; // '(y & m) == 0'
+        f.zeros = x->r->imm;
+    } else if (op == IR_EQ && c == 0 && (x->op == IR_SMOD || x->op == IR_UMOD) &&
+               x->r->op == IR_IMM && x->r->imm != 0 &&
+               (x->r->imm & (x->r->imm - 1)) == 0) {
+        f.x = x->l; // 'y % 2^k == 0'
+        f.zeros = x->r->imm - 1;
+    } else {
+        f.x = x;
+        f.zeros = cmp_zeros(b, x, op, c, pred);
+    }
+    f.zeros &= mask(f.x->t);
+    if (!f.zeros) {
+        f.x = NULL;
+    }
+    return f;
+}
+
+static int has_dead_ends(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        if (is_dead_end(bb)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void analyse_known_bits(Bits *b) {
+    if (has_dead_ends(b->fn)) {
+        b->facts = calloc(vec_len(b->rpo), sizeof(Fact));
+    }
+    for (size_t i = 0; i < vec_len(b->rpo); i++) {
+        BB *bb = vec_get(b->rpo, i);
+        if (b->facts) {
+            b->facts[i] = find_fact(b, bb);
+        }
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (is_int(ins->t)) {
+                b->zeros[ins->n] = known_zeros(b, ins);
+            }
+        }
+    }
+}
+
+
+// ---- Exact Simplifications -------------------------------------------------
+
+// 'x & c' where 'c' only clears bits that are already 0 in 'x'
+static IrIns * fold_and(Bits *b, IrIns *x, IrIns *c, BB *bb) {
+    if (c->op != IR_IMM) {
+        return NULL;
+    }
+    uint64_t cleared = ~c->imm & ~zeros_at(b, x, bb) & mask(x->t);
+    return cleared == 0 ? x : NULL;
+}
+
+static int is_zero(Bits *b, IrIns *x, BB *bb) {
+    return zeros_at(b, x, bb) == mask(x->t);
+}
+
+// 'zext(trunc(v))' or 'sext(trunc(v))', where the bits that the truncation
+// drops are already what the extension puts back
+static IrIns * fold_ext_trunc(Bits *b, IrIns *ext) {
+    IrIns *trunc = ext->l;
+    if (trunc->op != IR_TRUNC || trunc->l->t != ext->t) {
+        return NULL;
+    }
+    IrIns *v = trunc->l;
+    uint64_t dropped = mask(v->t) & ~mask(trunc->t);
+    if (ext->op == IR_SEXT) {
+        dropped |= sign_bit(trunc->t); // Has to be 0 too
+    }
+    return (zeros_at(b, v, ext->bb) & dropped) == dropped ? v : NULL;
+}
+
+// Whether a comparison operand 'x' is either extended with 'ext' from 'nt',
+// or a constant that fits in 'nt' (as 'ext' would extend it)
+static int can_narrow(IrIns *x, int ext, IrType *nt) {
+    if (x->op == ext) {
+        return x->l->t == nt;
+    } else if (x->op != IR_IMM) {
+        return 0;
+    }
+    uint64_t v = x->imm & mask(x->t);
+    if (ext == IR_ZEXT) {
+        return (v & ~mask(nt)) == 0;
+    }
+    return (sext(v, nt) & mask(x->t)) == v;
+}
+
+static IrIns * narrow(IrIns *x, IrType *nt, IrIns *before) {
+    if (x->op != IR_IMM) {
+        return x->l;
+    }
+    IrIns *imm = new_ins(IR_IMM, nt);
+    imm->imm = sext(x->imm, nt);
+    insert_ir(imm, before);
+    return imm;
+}
+
+static void narrow_cmp_with(IrIns *cmp, int ext) {
+    IrIns *l = cmp->l, *r = cmp->r;
+    IrIns *x = l->op == ext ? l : r->op == ext ? r : NULL;
+    if (!x) {
+        return;
+    }
+    IrType *nt = x->l->t;
+    if (can_narrow(l, ext, nt) && can_narrow(r, ext, nt)) {
+        cmp->l = narrow(l, nt, cmp);
+        cmp->r = narrow(r, nt, cmp);
+    }
+}
+
+// Compares chars and shorts as they are, when both sides are extended the
+// same way from the same type (or a constant that fits)
+static void narrow_cmp(IrIns *cmp) {
+    if (!is_int(cmp->l->t)) {
+        return;
+    }
+    if (cmp->op == IR_EQ || cmp->op == IR_NEQ) {
+        narrow_cmp_with(cmp, IR_SEXT);
+        narrow_cmp_with(cmp, IR_ZEXT);
+    } else if (cmp->op >= IR_SLT && cmp->op <= IR_SGE) {
+        narrow_cmp_with(cmp, IR_SEXT);
+    } else if (cmp->op >= IR_ULT && cmp->op <= IR_UGE) {
+        narrow_cmp_with(cmp, IR_ZEXT);
+    }
+}
+
+// Whether 'x op c' always gives the same result (in 'result'), if 'x' can
+// only have the bits that aren't in 'z'
+static int decide_cmp(int op, uint64_t z, uint64_t c, IrType *t, int *result) {
+    uint64_t max = mask(t) & ~z; // Unsigned
+    op = as_unsigned(op, z, c, t);
+    if ((op >= IR_SLT && op <= IR_SGE) && (z & sign_bit(t))) {
+        *result = op == IR_SGT || op == IR_SGE; // 'c' is negative
+        return 1;
+    }
+    switch (op) {
+    case IR_EQ:  case IR_NEQ: *result = op == IR_NEQ; return (c & z) != 0;
+    case IR_ULT: case IR_UGE: *result = op == IR_ULT; return max < c;
+    case IR_ULE: case IR_UGT: *result = op == IR_ULE; return max <= c;
+    default: return 0;
+    }
+}
+
+// The value of the condition 'cond' in 'bb' if it's known there (since a
+// branch on it went one way, rather than to a dead end), or -1
+static int cond_at(Bits *b, IrIns *cond, BB *bb) {
+    for (; bb; bb = bb->idom) {
+        Fact *f = &b->facts[bb->rpo];
+        if (f->cond == cond) {
+            return f->holds;
+        }
+    }
+    return -1;
+}
+
+// Replaces the uses of conditions that are known where they're used (e.g.,
+// the same comparison that an assumption made) with constants
+static void fold_known_conds(Bits *b, IrIns *ins) {
+    IrIns **oprs[3];
+    int num_oprs = ins->op == IR_PHI ? 0 : ir_operands(ins, oprs);
+    for (int i = 0; i < num_oprs; i++) {
+        IrIns *cond = *oprs[i];
+        int is_cmp = cond->op >= IR_EQ && cond->op <= IR_FGE; // 0 or 1
+        int v = is_cmp ? cond_at(b, cond, ins->bb) : -1;
+        if (v >= 0) {
+            IrIns *imm = new_ins(IR_IMM, cond->t);
+            imm->imm = (uint64_t) v;
+            insert_ir(imm, ins);
+            *oprs[i] = imm;
+        }
+    }
+}
+
+// An int comparison against a constant that the known bits decide, which is
+// turned into the constant in place
+static int fold_cmp(Bits *b, IrIns *cmp) {
+    IrIns *x;
+    int op, result;
+    uint64_t c;
+    if (!split_cmp(cmp, &x, &op, &c) ||
+            !decide_cmp(op, zeros_at(b, x, cmp->bb), c, x->t, &result)) {
+        return 0;
+    }
+    cmp->op = IR_IMM;
+    cmp->imm = result;
+    return 1;
+}
+
+// A jump table whose index is known to fit doesn't need to check it
+static void fold_switch(Bits *b, IrIns *br) {
+    uint64_t max = mask(br->idx->t) & ~zeros_at(b, br->idx, br->bb);
+    if (max < vec_len(br->table)) {
+        br->in_range = 1;
+    }
+}
+
+static void simplify_exact(Bits *b) {
+    for (size_t i = 0; i < vec_len(b->rpo); i++) {
+        BB *bb = vec_get(b->rpo, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (b->facts) {
+                fold_known_conds(b, ins);
+            }
+            if (ins->op == IR_SWITCH) {
+                fold_switch(b, ins);
+            }
+            if (!is_int(ins->t)) {
+                continue;
+            }
+            if (ins->op >= IR_ADD && ins->op <= IR_BSWAP && is_zero(b, ins, bb)) {
+                ins->op = IR_IMM; // e.g., 'x * 0', or the top half of a 'u64 * u64'
+                ins->imm = 0;
+                continue;
+            }
+            IrIns *repl = NULL;
+            switch (ins->op) {
+            case IR_ADD: case IR_BIT_OR: case IR_BIT_XOR: // 'x + 0', etc.
+                repl = is_zero(b, ins->r, bb) ? ins->l : is_zero(b, ins->l, bb) ? ins->r : NULL;
+                break;
+            case IR_SUB: case IR_SHL: case IR_SHR: case IR_SAR:
+                repl = is_zero(b, ins->r, bb) ? ins->l : NULL;
+                break;
+            case IR_BIT_AND:
+                repl = fold_and(b, ins->l, ins->r, bb);
+                if (!repl) repl = fold_and(b, ins->r, ins->l, bb);
+                break;
+            case IR_SEXT: case IR_ZEXT:
+                repl = fold_ext_trunc(b, ins);
+                break;
+            case IR_SELECT:
+                if (ins->sel->op == IR_IMM) {
+                    repl = ins->sel->imm ? ins->l : ins->r;
+                }
+                break;
+            case IR_EQ:  case IR_NEQ:
+            case IR_SLT: case IR_SLE: case IR_SGT: case IR_SGE:
+            case IR_ULT: case IR_ULE: case IR_UGT: case IR_UGE:
+                if (!fold_cmp(b, ins)) {
+                    narrow_cmp(ins);
+                }
+                break;
+            }
+            b->repl[ins->n] = repl;
+        }
+    }
+    replace_uses(b); // Leaves what's replaced for 'dce'
+}
+
+
+// ---- Demanded Bits ---------------------------------------------------------
+
+// The bits of 'ins's 'i'th operand 'opr' that it depends on, if 'd' are the
+// bits that depend on it
+static uint64_t opr_demands(IrIns *ins, size_t i, IrIns *opr, uint64_t d) {
+    uint64_t all = mask(opr->t);
+    if (!is_int(ins->t)) {
+        return all;
+    }
+    int s;
+    switch (ins->op) {
+    case IR_ADD: case IR_SUB: case IR_MUL: // Carries only go up
+        return up_to_msb(d);
+    case IR_BIT_AND: {
+        IrIns *other = i == 0 ? ins->r : ins->l;
+        return other->op == IR_IMM ? d & other->imm : d;
+    }
+    case IR_BIT_OR: case IR_BIT_XOR: case IR_PHI:
+        return d;
+    case IR_SHL:
+        return i == 0 && shift_by(ins, &s) ? d >> s : all;
+    case IR_SHR:
+        return i == 0 && shift_by(ins, &s) ? (d << s) & all : all;
+    case IR_SAR:
+        if (i != 0 || !shift_by(ins, &s)) {
+            return all;
+        }
+        return ((d << s) & all) | ((d & high_bits(s, ins->t)) ? sign_bit(ins->t) : 0);
+    case IR_TRUNC:
+        return d;
+    case IR_ZEXT: case IR_ANYEXT:
+        return d & all;
+    case IR_SEXT:
+        return (d & all) | ((d & ~all) ? sign_bit(opr->t) : 0);
+    case IR_SELECT:
+        return i == 0 ? all : d;
+    default:
+        return all;
+    }
+}
+
+static void demand(Bits *b, IrIns *ins, size_t i, IrIns *opr, Vec *work) {
+    if (!is_int(opr->t)) {
+        return;
+    }
+    uint64_t d = opr_demands(ins, i, opr, b->demands[ins->n]);
+    if (d & ~b->demands[opr->n]) {
+        b->demands[opr->n] |= d;
+        vec_push(work, opr);
+    }
+}
+
+// Starts with nothing demanded of any int, and works back from everything
+// else, which depends on all of its operands
+static void analyse_demanded_bits(Bits *b) {
+    Vec *work = vec_new(); // of 'IrIns *'
+    for (BB *bb = b->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            b->demands[ins->n] = is_int(ins->t) ? 0 : ~0ull;
+            vec_push(work, ins);
+        }
+    }
+    while (vec_len(work) > 0) {
+        IrIns *ins = vec_pop(work);
+        if (ins->op == IR_PHI) {
+            for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                demand(b, ins, i, vec_get(ins->defs, i), work);
+            }
+            continue;
+        }
+        IrIns **oprs[3];
+        int num_oprs = ir_operands(ins, oprs);
+        for (int i = 0; i < num_oprs; i++) {
+            demand(b, ins, i, *oprs[i], work);
+        }
+    }
+    vec_free(work);
+}
+
+
+// ---- Demanded Simplifications ----------------------------------------------
+
+static int is_ext(IrIns *ins) {
+    return ins->op == IR_SEXT || ins->op == IR_ZEXT || ins->op == IR_ANYEXT;
+}
+
+// An extension that nothing looks at the new bits of. The truncation in
+// 'ext(trunc(v))' can go too; otherwise it's just a copy. An extended load is
+// left alone, since 'movzx' and 'movsx' load it at no extra cost
+static IrIns * simplify_ext(Bits *b, IrIns *ext) {
+    if ((b->demands[ext->n] & ~mask(ext->l->t)) != 0) {
+        return NULL;
+    } else if (ext->l->op == IR_TRUNC && ext->l->l->t == ext->t) {
+        return ext->l->l;
+    } else if (ext->l->op != IR_LOAD) {
+        ext->op = IR_ANYEXT;
+    }
+    return NULL;
+}
+
+static void simplify_demanded(Bits *b) {
+    for (BB *bb = b->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns *repl = NULL;
+            if (!is_int(ins->t)) {
+                // Nothing to do
+            } else if (ins->op == IR_SEXT || ins->op == IR_ZEXT) {
+                repl = simplify_ext(b, ins);
+            } else if (ins->op == IR_TRUNC && is_ext(ins->l) && ins->l->l->t == ins->t) {
+                repl = ins->l->l; // 'trunc(ext(v))'
+            }
+            b->repl[ins->n] = repl;
+        }
+    }
+    replace_uses(b);
+}
+
+void simplify_bits(Fn *fn) {
+    size_t num_ins = number_ir(fn);
+    Bits b = { .fn = fn, .rpo = rev_postorder(fn) };
+    b.zeros = calloc(num_ins, sizeof(uint64_t));
+    b.demands = calloc(num_ins, sizeof(uint64_t));
+    b.repl = calloc(num_ins, sizeof(IrIns *));
+    analyse_known_bits(&b);
+    simplify_exact(&b);
+
+    // 'narrow_cmp' adds constants
+    num_ins = number_ir(fn);
+    free(b.demands);
+    free(b.repl);
+    b.demands = calloc(num_ins, sizeof(uint64_t));
+    b.repl = calloc(num_ins, sizeof(IrIns *));
+    analyse_demanded_bits(&b);
+    simplify_demanded(&b);
+    free(b.zeros);
+    free(b.facts);
+    free(b.demands);
+    free(b.repl);
+    vec_free(b.rpo);
+}
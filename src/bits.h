@@ -0,0 +1,23 @@
+
+#ifndef COSEC_BITS_H
+#define COSEC_BITS_H
+
+#include "compile.h"
+
+// Known bits and demanded bits. C's integer promotions wrap nearly every
+// 'char' and 'short' operation in extensions and truncations, most of which
+// don't change anything that's ever looked at. Works out which bits of each
+// int are known to be 0 (from its operands), and which bits anything actually
+// depends on (from its uses), and then:
+//   * removes masks that don't clear anything ('cmp & 1', 'zext(x) & 0xff');
+//   * removes a truncation and extension that gives back what was truncated;
+//   * compares chars and shorts as they are, rather than extended;
+//   * and turns an extension whose new bits are never looked at into an
+//     IR_ANYEXT, which is just a copy of the register.
+// What's assumed with '__builtin_assume' (or a branch to
+// '__builtin_unreachable') counts towards the known bits, so it can also fold
+// comparisons it decides, and drop a jump table's range check.
+// Runs last, since the other passes don't know about IR_ANYEXT
+void simplify_bits(Fn *fn);
+
+#endif
@@ -2,9 +2,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "compile.h"
 #include "error.h"
+#include "stats.h"
+#include "ssa.h"
+#include "profile.h"
 
 #define GLOBAL_PREFIX "_G."
 
@@ -17,7 +21,7 @@ enum {
 
 typedef struct {
     char *label;
-    BB **br;
+    BB **br; // Or the 'label_bb' of an IR_BB_ADDR
     Token *err;
 } Goto;
 
@@ -26,11 +30,16 @@ typedef struct Scope {
     int k;
     Vec *globals;
     Fn *fn;
-    Map *vars;      // Block: 'IrIns *' k = IR_ALLOC; file: 'Global *'
+    Map *vars;      // File: 'Global *'
+    ScopedMap *locals; // 'IrIns *' k = IR_ALLOC; shared by every scope
+    Map **strs;     // File: 'Global *' for each string literal; by interned
+                    // contents, per element size (1, 2, or 4 bytes)
     Vec *breaks;    // SCOPE_LOOP and SCOPE_SWITCH 'break' jump list
     Vec *continues; // SCOPE_LOOP; 'continue' jump list
     Map *labels; // of 'BB *'
     Vec *gotos;  // of 'Goto *'
+    IrIns *stack_save; // IR_STACK_SAVE before the scope's first VLA
+    int line;    // Of the statement being compiled, with '-g'
 } Scope;
 
 
@@ -41,8 +50,10 @@ static Scope enter_scope(Scope *outer, int k) {
     s.outer = outer;
     s.k = k;
     s.globals = outer->globals;
+    s.strs = outer->strs;
     s.fn = outer->fn;
-    s.vars = map_new();
+    s.locals = outer->locals;
+    smap_enter(s.locals);
     if (k == SCOPE_LOOP) {
         s.breaks = vec_new();
         s.continues = vec_new();
@@ -51,9 +62,34 @@ static Scope enter_scope(Scope *outer, int k) {
     }
     s.labels = outer->labels;
     s.gotos = outer->gotos;
+    s.line = outer->line;
     return s;
 }
 
+static IrIns * emit(Scope *s, int op, IrType *t);
+
+// Frees the VLAs allocated in every scope from 's' out to (but not including)
+// 'to', when leaving them
+static void restore_stack(Scope *s, Scope *to) {
+    IrIns *save = NULL;
+    for (Scope *inner = s; inner != to; inner = inner->outer) {
+        save = inner->stack_save ? inner->stack_save : save;
+    }
+    if (save) {
+        IrIns *restore = emit(s, IR_STACK_RESTORE, NULL);
+        restore->ptr = save;
+    }
+}
+
+// A function's 'labels' and 'gotos' are shared by all its scopes, so they're
+// freed with the function's
+static void exit_scope(Scope *s) {
+    restore_stack(s, s->outer);
+    smap_exit(s->locals);
+    vec_free(s->breaks);
+    vec_free(s->continues);
+}
+
 static Scope * find_scope(Scope *s, int k) {
     while (s && !(s->k & k)) {
         s = s->outer;
@@ -62,38 +98,61 @@ static Scope * find_scope(Scope *s, int k) {
 }
 
 static Global * new_global(char *label, IrType *t, int linkage) {
-    Global *g = calloc(1, sizeof(Global));
+    Global *g = arena_alloc(ARENA_IR, sizeof(Global));
     g->k = G_NONE;
     g->label = label;
     g->t = t;
     g->linkage = linkage;
+    g->visibility = VIS_NONE;
+    g->is_const = 0;
+    g->is_cstring = 0;
+    g->is_tls = 0;
+    g->fn_attrs = 0;
     return g;
 }
 
-static InitElem * new_init_elem(uint64_t offset, Global *val) {
-    InitElem *elem = malloc(sizeof(InitElem));
-    elem->offset = offset;
-    elem->val = val;
-    return elem;
+static InitReloc * new_init_reloc(uint64_t offset, Global *g, int64_t addend) {
+    InitReloc *r = arena_alloc(ARENA_IR, sizeof(InitReloc));
+    r->offset = offset;
+    r->g = g;
+    r->addend = addend;
+    return r;
 }
 
-static BB * new_bb() {
-    BB *bb = malloc(sizeof(BB));
+BB * new_bb() {
+    BB *bb = arena_alloc(ARENA_IR_FN, sizeof(BB));
     bb->next = bb->prev = NULL;
     bb->ir_head = bb->ir_last = NULL;
     bb->asm_head = bb->asm_last = NULL;
     bb->n = 0;
 
-    // For assembler
+    // For analysis
     bb->pred = vec_new();
     bb->succ = vec_new();
-    bb->live_in = NULL;
+    bb->rpo = -1;
+    bb->idom = NULL;
+    bb->dom_children = vec_new();
+    bb->dom_frontier = vec_new();
+    bb->loop = NULL;
+    bb->unroll = 0;
+    bb->addr_taken = 0;
+    bb->freq = -1;
     return bb;
 }
 
 static Fn * new_fn() {
-    Fn *fn = malloc(sizeof(Fn));
+    Fn *fn = arena_alloc(ARENA_IR, sizeof(Fn));
     fn->entry = fn->last = new_bb();
+    fn->params = vec_new();
+    fn->ret = NULL;
+    fn->instrument = NULL;
+    fn->patchable_entry = 0;
+    fn->file = NULL;
+
+    // For analysis
+    fn->analyses = 0;
+    fn->loops = vec_new();
+    fn->hot_freq = 0;
 
     // For assembler
     fn->f32s = vec_new();
@@ -102,10 +161,15 @@ static Fn * new_fn() {
     return fn;
 }
 
-static IrIns * new_ins(int op, IrType *t) {
-    IrIns *ins = calloc(1, sizeof(IrIns));
+IrIns * new_ins(int op, IrType *t) {
+    IrIns *ins = arena_alloc(ARENA_IR_INS, sizeof(IrIns));
+    STATS[STAT_IR_INS]++;
     ins->op = op;
     ins->t = t;
+    if (op == IR_PHI) {
+        ins->preds = vec_new();
+        ins->defs = vec_new();
+    }
     return ins;
 }
 
@@ -145,15 +209,12 @@ static IrIns * emit(Scope *s, int op, IrType *t) {
         ins->true_chain = vec_new();
         ins->false_chain = vec_new();
     }
-    if (op == IR_PHI) {
-        ins->preds = vec_new();
-        ins->defs = vec_new();
-    }
+    ins->line = s->line;
     emit_to_bb(s->fn->last, ins);
     return ins;
 }
 
-static void delete_ir(IrIns *ins) {
+void delete_ir(IrIns *ins) {
     if (ins->prev) {
         ins->prev->next = ins->next;
     } else { // Head of the linked list
@@ -167,60 +228,614 @@ static void delete_ir(IrIns *ins) {
     }
 }
 
+void insert_ir(IrIns *ins, IrIns *before) {
+    ins->bb = before->bb;
+    ins->next = before;
+    ins->prev = before->prev;
+    if (before->prev) {
+        before->prev->next = ins;
+    } else {
+        before->bb->ir_head = ins;
+    }
+    before->prev = ins;
+}
+
+IrIns * insert_op(int op, IrType *t, IrIns *l, IrIns *r, IrIns *before) {
+    IrIns *ins = new_ins(op, t);
+    ins->l = l;
+    ins->r = r;
+    insert_ir(ins, before);
+    return ins;
+}
+
+IrIns * insert_imm(IrType *t, uint64_t imm, IrIns *before) {
+    IrIns *ins = new_ins(IR_IMM, t);
+    ins->imm = imm;
+    insert_ir(ins, before);
+    return ins;
+}
+
+IrIns * prepend_phi(IrType *t, BB *bb) {
+    IrIns *phi = new_ins(IR_PHI, t);
+    if (bb->ir_head) {
+        insert_ir(phi, bb->ir_head);
+    }
+    return phi;
+}
+
+BB * new_bb_before(IrIns *term, BB *before) {
+    BB *bb = new_bb();
+    term->bb = bb;
+    term->next = term->prev = NULL;
+    bb->ir_head = bb->ir_last = term;
+    bb->prev = before->prev;
+    bb->next = before;
+    if (before->prev) {
+        before->prev->next = bb;
+    }
+    before->prev = bb;
+    return bb;
+}
+
+void retarget_br(IrIns *br, BB *from, BB *to) {
+    if (br->op == IR_BR) {
+        if (br->br == from) br->br = to;
+    } else if (br->op == IR_CONDBR) {
+        if (br->true == from) br->true = to;
+        if (br->false == from) br->false = to;
+    } else if (br->op == IR_SWITCH) {
+        if (br->default_br == from) br->default_br = to;
+        for (size_t i = 0; i < vec_len(br->table); i++) {
+            if (vec_get(br->table, i) == from) vec_put(br->table, i, to);
+        }
+    } // An IR_INDIRECT_BR goes wherever its IR_BB_ADDRs say, so can't change
+}
+
+void insert_bb_after(Fn *fn, BB *bb, BB *after) {
+    bb->prev = after;
+    bb->next = after->next;
+    if (after->next) {
+        after->next->prev = bb;
+    } else {
+        fn->last = bb;
+    }
+    after->next = bb;
+}
+
+void remove_phi_pred(BB *bb, BB *pred) {
+    for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+        for (size_t i = 0; ins->op == IR_PHI && i < vec_len(ins->preds); i++) {
+            if (vec_get(ins->preds, i) == pred) {
+                vec_remove(ins->preds, i);
+                vec_remove(ins->defs, i--);
+            }
+        }
+    }
+}
+
+void replace_phi_pred(BB *bb, BB *from, BB *to) {
+    for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+        for (size_t i = 0; ins->op == IR_PHI && i < vec_len(ins->preds); i++) {
+            if (vec_get(ins->preds, i) == from) {
+                vec_put(ins->preds, i, to);
+            }
+        }
+    }
+}
+
+void fold_condbr(IrIns *br, int taken) {
+    BB *target = taken ? br->true : br->false;
+    BB *dead = taken ? br->false : br->true;
+    if (dead != target) {
+        remove_phi_pred(dead, br->bb);
+    }
+    br->op = IR_BR;
+    br->br = target;
+}
+
+void remove_phi_def(IrIns *phi, BB *pred) {
+    for (size_t i = 0; i < vec_len(phi->preds); i++) {
+        if (vec_get(phi->preds, i) == pred) {
+            vec_remove(phi->preds, i);
+            vec_remove(phi->defs, i);
+            return;
+        }
+    }
+}
+
+IrIns * next_phi(IrIns *ins) {
+    while (ins && (ins->op == IR_IMM || ins->op == IR_FP || ins->op == IR_GLOBAL)) {
+        ins = ins->next;
+    }
+    return ins && ins->op == IR_PHI ? ins : NULL;
+}
+
+size_t phi_idx(IrIns *phi, BB *pred) {
+    for (size_t i = 0; i < vec_len(phi->preds); i++) {
+        if (vec_get(phi->preds, i) == pred) {
+            return i;
+        }
+    }
+    UNREACHABLE();
+    return 0;
+}
+
+IrIns * phi_def(IrIns *phi, BB *pred) {
+    for (size_t i = 0; i < vec_len(phi->preds); i++) {
+        if (vec_get(phi->preds, i) == pred) {
+            return vec_get(phi->defs, i);
+        }
+    }
+    return NULL;
+}
+
+IrIns * append_ir(BB *bb, IrIns *ins) {
+    ins->bb = bb;
+    ins->prev = bb->ir_last;
+    ins->next = NULL;
+    if (bb->ir_last) {
+        bb->ir_last->next = ins;
+    } else {
+        bb->ir_head = ins;
+    }
+    bb->ir_last = ins;
+    return ins;
+}
+
+int can_copy(IrIns *ins) {
+    return ins->op != IR_ALLOC && ins->op != IR_ASM && ins->op != IR_ASMIN &&
+           ins->op != IR_ASMOUT;
+}
+
+void remove_unreachable_bbs(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        if (bb->rpo == -1) {
+            if (bb->prev) bb->prev->next = bb->next;
+            if (bb->next) bb->next->prev = bb->prev;
+            if (fn->last == bb) fn->last = bb->prev;
+            continue;
+        }
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_BB_ADDR && ins->label_bb->rpo == -1) {
+                // No 'goto *' can reach the label (or it'd be reachable too),
+                // but its address still has to be somewhere that isn't null
+                ins->label_bb = fn->entry;
+                continue;
+            }
+            if (ins->op != IR_PHI) {
+                continue;
+            }
+            for (size_t i = 0; i < vec_len(ins->preds); i++) {
+                BB *pred = vec_get(ins->preds, i);
+                if (pred->rpo == -1) {
+                    vec_remove(ins->preds, i);
+                    vec_remove(ins->defs, i--);
+                }
+            }
+        }
+    }
+}
+
+int is_dead_end(BB *bb) {
+    if (!bb->ir_last || bb->ir_last->op != IR_UNREACHABLE) {
+        return 0;
+    }
+    for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+        if (ins->op == IR_CALL || ins->op == IR_ASM) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+size_t number_ir(Fn *fn) {
+    size_t n = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            ins->n = n++;
+        }
+    }
+    return n;
+}
+
+int ir_operands(IrIns *ins, IrIns **oprs[3]) {
+    int n = 0;
+    switch (ins->op) {
+    case IR_IMM: case IR_FP: case IR_GLOBAL: case IR_BB_ADDR: case IR_FARG:
+    case IR_PHI: case IR_BR: case IR_UNREACHABLE:
+        break;
+    case IR_ALLOC:
+        if (ins->count) oprs[n++] = &ins->count;
+        break;
+    case IR_LOAD:
+        oprs[n++] = &ins->src;
+        break;
+    case IR_STORE:
+        oprs[n++] = &ins->src;
+        oprs[n++] = &ins->dst;
+        break;
+    case IR_COPY:
+        oprs[n++] = &ins->src;
+        oprs[n++] = &ins->dst;
+        oprs[n++] = &ins->len;
+        break;
+    case IR_ZERO:
+        oprs[n++] = &ins->ptr;
+        oprs[n++] = &ins->size;
+        break;
+    case IR_PTRADD:
+        oprs[n++] = &ins->base;
+        oprs[n++] = &ins->offset;
+        break;
+    case IR_PREFETCH: case IR_STACK_RESTORE:
+        oprs[n++] = &ins->ptr;
+        break;
+    case IR_STACK_SAVE:
+        break;
+    case IR_ATOMIC_LOAD:
+        oprs[n++] = &ins->addr;
+        break;
+    case IR_ATOMIC_STORE: case IR_ATOMIC_XCHG: case IR_ATOMIC_ADD:
+        oprs[n++] = &ins->addr;
+        oprs[n++] = &ins->val;
+        break;
+    case IR_ATOMIC_CAS:
+        oprs[n++] = &ins->addr;
+        oprs[n++] = &ins->expected;
+        oprs[n++] = &ins->val;
+        break;
+    case IR_FENCE:
+        break;
+    case IR_CONDBR:
+        oprs[n++] = &ins->cond;
+        break;
+    case IR_SWITCH:
+        oprs[n++] = &ins->idx;
+        break;
+    case IR_INDIRECT_BR:
+        oprs[n++] = &ins->dest;
+        break;
+    case IR_CALL:
+        oprs[n++] = &ins->fn;
+        break;
+    case IR_CARG: case IR_ASMIN:
+        oprs[n++] = &ins->arg;
+        break;
+    case IR_ASM: case IR_ASMOUT:
+        break;
+    case IR_RET:
+        if (ins->ret) oprs[n++] = &ins->ret;
+        break;
+    case IR_TRUNC: case IR_SEXT: case IR_ZEXT: case IR_ANYEXT: case IR_PTR2I:
+    case IR_I2PTR: case IR_BITCAST: case IR_FTRUNC: case IR_FEXT: case IR_FP2I:
+    case IR_I2FP:
+    case IR_SPLAT: case IR_POPCNT: case IR_CTZ: case IR_CLZ: case IR_BSWAP:
+        oprs[n++] = &ins->l;
+        break;
+    case IR_REDUCE:
+        oprs[n++] = &ins->vec;
+        break;
+    case IR_SELECT:
+        oprs[n++] = &ins->sel;
+        oprs[n++] = &ins->l;
+        oprs[n++] = &ins->r;
+        break;
+    default: // Binary operations and comparisons
+        oprs[n++] = &ins->l;
+        oprs[n++] = &ins->r;
+        break;
+    }
+    return n;
+}
+
+int is_const(IrIns *ins) {
+    return ins->op == IR_IMM || ins->op == IR_FP || ins->op == IR_GLOBAL ||
+           ins->op == IR_BB_ADDR;
+}
+
+int is_pure(IrIns *ins) {
+    return ins->op == IR_IMM || ins->op == IR_FP || ins->op == IR_GLOBAL ||
+           ins->op == IR_PTRADD || (ins->op >= IR_ADD && ins->op <= IR_I2FP);
+}
+
+int is_atomic(IrIns *ins) {
+    return ins->op >= IR_ATOMIC_LOAD && ins->op <= IR_FENCE;
+}
+
+int call_attrs(IrIns *call) {
+    assert(call->op == IR_CALL);
+    return call->fn->op == IR_GLOBAL ? call->fn->g->fn_attrs : 0;
+}
+
+Global * const_ptr_at(Global *g, int64_t offset, size_t size) {
+    if (!g->is_const || g->k != G_INIT || size != 8 || offset < 0) {
+        return NULL;
+    }
+    for (size_t i = 0; i < vec_len(g->relocs); i++) {
+        InitReloc *r = vec_get(g->relocs, i);
+        if (r->offset == (uint64_t) offset) {
+            return r->addend == 0 ? r->g : NULL;
+        }
+    }
+    return NULL;
+}
+
+void find_def_use(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            ins->users = vec_new(); // Not emptied, in case it was copied
+        }
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                vec_push((*oprs[i])->users, ins);
+            }
+            for (size_t i = 0; ins->op == IR_PHI && i < vec_len(ins->defs); i++) {
+                IrIns *def = vec_get(ins->defs, i);
+                vec_push(def->users, ins);
+            }
+        }
+    }
+}
+
+void add_user(IrIns *def, IrIns *user) {
+    if (!def->users) {
+        def->users = vec_new();
+    }
+    vec_push(def->users, user);
+}
+
+void replace_all_uses(IrIns *old, IrIns *new) {
+    if (old == new) {
+        return; // Would add to the list being walked, forever
+    }
+    for (size_t i = 0; old->users && i < vec_len(old->users); i++) {
+        IrIns *user = vec_get(old->users, i);
+        IrIns **oprs[3];
+        int num_oprs = ir_operands(user, oprs);
+        for (int j = 0; j < num_oprs; j++) {
+            if (*oprs[j] == old) {
+                *oprs[j] = new;
+                add_user(new, user);
+            }
+        }
+        for (size_t j = 0; user->op == IR_PHI && j < vec_len(user->defs); j++) {
+            if (vec_get(user->defs, j) == old) {
+                vec_put(user->defs, j, new);
+                add_user(new, user);
+            }
+        }
+    }
+    if (old->users) {
+        vec_empty(old->users);
+    }
+}
+
+void free_def_use(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            vec_free(ins->users);
+            ins->users = NULL;
+        }
+    }
+}
+
 
 // ---- IR Types --------------------------------------------------------------
 
-static IrType * irt_new(int k) {
+// IR types are hash-consed, so there's only ever one instance of each and they
+// can be compared by pointer. The scalar types are static singletons. Arrays,
+// structs, and vectors are interned in a table shared by every thread (like the sets in
+// 'util.c'), which lives as long as the compiler does, since types are few
+
+static IrType SCALAR_TYPES[] = {
+    [IRT_VOID] = { .k = IRT_VOID },
+    [IRT_I8]  = { .k = IRT_I8,  .size = 1, .align = 1 },
+    [IRT_I16] = { .k = IRT_I16, .size = 2, .align = 2 },
+    [IRT_I32] = { .k = IRT_I32, .size = 4, .align = 4 },
+    [IRT_I64] = { .k = IRT_I64, .size = 8, .align = 8 },
+    [IRT_F32] = { .k = IRT_F32, .size = 4, .align = 4 },
+    [IRT_F64] = { .k = IRT_F64, .size = 8, .align = 8 },
+    [IRT_PTR] = { .k = IRT_PTR, .size = 8, .align = 8 },
+};
+
+static struct {
+    IrType **types;
+    size_t num, size;
+} AGG_TYPES;
+static pthread_mutex_t AGG_TYPES_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+IrType * irt_scalar(int k) {
+    assert(k >= IRT_VOID && k <= IRT_PTR);
+    return &SCALAR_TYPES[k];
+}
+
+static uint64_t hash_mix(uint64_t h, uint64_t v) { // FNV-1a, a word at a time
+    return (h ^ v) * 0x100000001b3;
+}
+
+static uint64_t irt_hash(IrType *t) {
+    uint64_t h = 0xcbf29ce484222325;
+    h = hash_mix(h, (uint64_t) t->k);
+    h = hash_mix(h, t->size);
+    h = hash_mix(h, t->align);
+    if (t->k == IRT_ARR || t->k == IRT_VEC) {
+        h = hash_mix(h, (uint64_t) (uintptr_t) t->elem);
+        h = hash_mix(h, t->len);
+    } else {
+        for (size_t i = 0; i < vec_len(t->fields); i++) {
+            IrField *f = vec_get(t->fields, i);
+            h = hash_mix(h, (uint64_t) (uintptr_t) f->t);
+            h = hash_mix(h, f->offset);
+        }
+    }
+    return h;
+}
+
+// Element and field types are already interned, so compare by pointer
+static int irt_equal(IrType *a, IrType *b) {
+    if (a->k != b->k || a->size != b->size || a->align != b->align) {
+        return 0;
+    }
+    if (a->k == IRT_ARR || a->k == IRT_VEC) {
+        return a->elem == b->elem && a->len == b->len;
+    }
+    if (vec_len(a->fields) != vec_len(b->fields)) {
+        return 0;
+    }
+    for (size_t i = 0; i < vec_len(a->fields); i++) {
+        IrField *fa = vec_get(a->fields, i);
+        IrField *fb = vec_get(b->fields, i);
+        if (fa->t != fb->t || fa->offset != fb->offset) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void agg_types_rehash() {
+    if (AGG_TYPES.num < AGG_TYPES.size * 0.7) {
+        return;
+    }
+    size_t new_size = AGG_TYPES.size ? AGG_TYPES.size * 2 : 256;
+    IrType **types = calloc(new_size, sizeof(IrType *));
+    size_t mask = new_size - 1;
+    for (size_t i = 0; i < AGG_TYPES.size; i++) {
+        IrType *t = AGG_TYPES.types[i];
+        if (!t) {
+            continue;
+        }
+        size_t h = irt_hash(t) & mask;
+        while (types[h]) {
+            h = (h + 1) & mask;
+        }
+        types[h] = t;
+    }
+    free(AGG_TYPES.types);
+    AGG_TYPES.types = types;
+    AGG_TYPES.size = new_size;
+}
+
+// Returns the unique type equal to 't' (which is malloc'd), freeing 't' if
+// there already is one
+static IrType * irt_intern(IrType *t) {
+    pthread_mutex_lock(&AGG_TYPES_LOCK);
+    agg_types_rehash();
+    size_t mask = AGG_TYPES.size - 1;
+    size_t h = irt_hash(t) & mask;
+    IrType *found;
+    while ((found = AGG_TYPES.types[h])) {
+        if (irt_equal(found, t)) {
+            pthread_mutex_unlock(&AGG_TYPES_LOCK);
+            if (t->k == IRT_STRUCT) {
+                for (size_t i = 0; i < vec_len(t->fields); i++) {
+                    free(vec_get(t->fields, i));
+                }
+                vec_free(t->fields);
+            }
+            free(t);
+            return found;
+        }
+        h = (h + 1) & mask;
+    }
+    AGG_TYPES.types[h] = t;
+    AGG_TYPES.num++;
+    pthread_mutex_unlock(&AGG_TYPES_LOCK);
+    return t;
+}
+
+static IrType * irt_agg(int k, size_t size, size_t align) {
     IrType *t = calloc(1, sizeof(IrType));
     t->k = k;
-    switch (k) {
-    case IRT_I8:  t->size = t->align = 1; break;
-    case IRT_I16: t->size = t->align = 2; break;
-    case IRT_I32: case IRT_F32: t->size = t->align = 4; break;
-    case IRT_I64: case IRT_F64: case IRT_PTR:
-        t->size = t->align = 8;
-        break;
-    case IRT_ARR: t->align = 8; break;
-    default: break;
-    }
+    t->size = size;
+    t->align = align;
     return t;
 }
 
-static IrField * irt_field(IrType *t, size_t offset) {
+IrType * irt_vec(IrType *elem, size_t len) {
+    assert(elem->k >= IRT_I8 && elem->k <= IRT_F64);
+    IrType *t = irt_agg(IRT_VEC, elem->size * len, elem->size * len);
+    t->elem = elem;
+    t->len = len;
+    return irt_intern(t);
+}
+
+IrType * irt_arr(IrType *elem, size_t len, size_t size, size_t align) {
+    IrType *t = irt_agg(IRT_ARR, size, align);
+    t->elem = elem;
+    t->len = len;
+    return irt_intern(t);
+}
+
+IrType * irt_struct(size_t size, size_t align, Vec *fields) {
+    IrType *t = irt_agg(IRT_STRUCT, size, align);
+    t->fields = fields;
+    return irt_intern(t);
+}
+
+IrField * irt_field(IrType *t, size_t offset) {
     IrField *f = malloc(sizeof(IrField));
     f->t = t;
     f->offset = offset;
     return f;
 }
 
+// A bit-field's unit can overlap the fields either side of it (e.g., a 'char'
+// after an 'int x : 8'), so overlapping fields are merged into one: whichever
+// covers the others, or otherwise an array of bytes
+static void add_irt_field(Vec *fields, IrType *t, size_t offset) {
+    size_t end = offset + t->size;
+    while (vec_len(fields) > 0) {
+        IrField *last = vec_tail(fields);
+        size_t last_end = last->offset + last->t->size;
+        if (last_end <= offset) {
+            break;
+        }
+        if (last->offset <= offset && last_end >= end) {
+            t = last->t;
+        } else if (offset > last->offset || end < last_end) {
+            t = NULL;
+        }
+        offset = last->offset < offset ? last->offset : offset;
+        end = last_end > end ? last_end : end;
+        free(vec_pop(fields));
+    }
+    if (!t) {
+        t = irt_arr(irt_scalar(IRT_I8), end - offset, end - offset, 1);
+    }
+    vec_push(fields, irt_field(t, offset));
+}
+
 static IrType * irt_conv(AstType *t) {
     switch (t->k) {
-    case T_VOID:  return irt_new(IRT_VOID);
-    case T_CHAR:  return irt_new(IRT_I8);
-    case T_SHORT: return irt_new(IRT_I16);
-    case T_INT: case T_LONG: return irt_new(IRT_I32);
-    case T_LLONG: return irt_new(IRT_I64);
-    case T_FLOAT: return irt_new(IRT_F32);
-    case T_DOUBLE: case T_LDOUBLE: return irt_new(IRT_F64);
-    case T_PTR: case T_FN: return irt_new(IRT_PTR);
+    case T_VOID:  return irt_scalar(IRT_VOID);
+    case T_CHAR:  return irt_scalar(IRT_I8);
+    case T_SHORT: return irt_scalar(IRT_I16);
+    case T_INT: case T_LONG: return irt_scalar(IRT_I32);
+    case T_LLONG: return irt_scalar(IRT_I64);
+    case T_I128: { // The low half first
+        Vec *halves = vec_new();
+        vec_push(halves, irt_field(irt_scalar(IRT_I64), 0));
+        vec_push(halves, irt_field(irt_scalar(IRT_I64), 8));
+        return irt_struct(16, 16, halves);
+    }
+    case T_FLOAT: return irt_scalar(IRT_F32);
+    case T_DOUBLE: case T_LDOUBLE: return irt_scalar(IRT_F64);
+    case T_PTR: case T_FN: return irt_scalar(IRT_PTR);
     case T_ARR:
         assert(t->len->k == N_IMM); // Not VLA
-        IrType *arr = irt_new(IRT_ARR);
-        arr->elem = irt_conv(t->elem);
-        arr->len = t->len->imm;
-        arr->size = t->size;
-        return arr;
+        return irt_arr(irt_conv(t->elem), t->len->imm, t->size, t->align > 8 ? t->align : 8);
     case T_STRUCT:
         assert(t->fields);
-        IrType *obj = irt_new(IRT_STRUCT);
-        obj->fields = vec_new();
+        Vec *fields = vec_new();
         for (size_t i = 0; i < vec_len(t->fields); i++) {
             Field *f = vec_get(t->fields, i);
-            vec_push(obj->fields, irt_field(irt_conv(f->t), f->offset));
+            add_irt_field(fields, irt_conv(f->t), f->offset);
         }
-        obj->size = t->size;
-        obj->align = t->align;
-        return obj;
+        return irt_struct(t->size, t->align, fields);
     case T_UNION:
         assert(t->fields);
         IrType *max = NULL;
@@ -229,13 +844,30 @@ static IrType * irt_conv(AstType *t) {
             IrType *v = irt_conv(ft);
             max = (!max || v->size > max->size) ? v : max;
         }
-        assert(t->size == max->size && t->align == max->align);
+        if (t->size != max->size || t->align != max->align) { // 'aligned'
+            Vec *padded = vec_new();
+            vec_push(padded, irt_field(max, 0));
+            return irt_struct(t->size, t->align, padded);
+        }
         return max;
     case T_ENUM: return irt_conv(t->num_t);
+    case T_VEC:  return irt_vec(irt_conv(t->elem), t->size / t->elem->size);
     default: UNREACHABLE();
     }
 }
 
+// Scalar types are shared, so a scalar declared with more than its natural
+// alignment (by '_Alignas' or 'aligned') is kept in a one field struct
+static IrType * irt_obj(AstType *t) {
+    IrType *irt = irt_conv(t);
+    if (t->align <= irt->align || irt->k == IRT_ARR || irt->k == IRT_STRUCT) {
+        return irt;
+    }
+    Vec *fields = vec_new();
+    vec_push(fields, irt_field(irt, 0));
+    return irt_struct(irt->size + pad(irt->size, t->align), t->align, fields);
+}
+
 static int is_int(IrType *t) {
     return t->k >= IRT_I8 && t->k <= IRT_I64;
 }
@@ -244,13 +876,41 @@ static int is_fp(IrType *t) {
     return t->k >= IRT_F32 && t->k <= IRT_F64;
 }
 
+static int is_fp_t(AstType *t) {
+    return t->k >= T_FLOAT && t->k <= T_LDOUBLE;
+}
+
+// Operations on a vector are on each of its lanes
+static AstType * lane_t(AstType *t) {
+    return t->k == T_VEC ? t->elem : t;
+}
+
 
 // ---- Local and Global Variables --------------------------------------------
 
+// Constant sized IR_ALLOCs all go at the start of the entry BB (after the
+// IR_FARGs), wherever the object's declared, so only dynamically sized ones
+// (that modify rsp) come later
+static IrIns * emit_alloc(Scope *s, IrType *t) {
+    IrIns *alloc = new_ins(IR_ALLOC, irt_scalar(IRT_PTR));
+    alloc->alloc_t = t;
+    IrIns *before = s->fn->entry->ir_head;
+    while (before && (before->op == IR_FARG ||
+            (before->op == IR_ALLOC && !before->count))) {
+        before = before->next;
+    }
+    if (before) {
+        insert_ir(alloc, before);
+    } else {
+        emit_to_bb(s->fn->entry, alloc);
+    }
+    return alloc;
+}
+
 static void def_local(Scope *s, char *name, IrIns *alloc) {
     assert(alloc->op == IR_ALLOC);
     assert(s->outer); // Not top level
-    map_put(s->vars, name, alloc);
+    smap_put(s->locals, name, alloc);
 }
 
 static void def_global(Scope *s, char *name, Global *g) {
@@ -281,19 +941,29 @@ static void compile_global(Scope *s, AstNode *n, Global *g);
 
 static Global * def_const_global(Scope *s, AstNode *n) {
     char *label = next_global_label(s);
-    Global *g = new_global(label, irt_conv(n->t), n->t->linkage);
+    Global *g = new_global(label, irt_conv(n->t), LINK_STATIC); // Anonymous
+    g->is_const = 1;
     def_global(s, NULL, g);
     compile_global(s, n, g);
     return g;
 }
 
-static IrIns * find_local(Scope *s, char *name) {
-    while (s->outer) { // Not global scope
-        IrIns *ins = map_get(s->vars, name);
-        if (ins) return ins;
-        s = s->outer;
+// Identical string literals share a global (they're interned by the parser),
+// unless their encodings differ in size, e.g., u"a" and "a\0\0" (which would
+// need different alignments)
+static Global * def_str_global(Scope *s, AstNode *n) {
+    Map *strs = s->strs[n->t->elem->size / 2];
+    Global *g = map_get(strs, n->str);
+    if (!g) {
+        g = def_const_global(s, n);
+        g->is_cstring = n->enc == ENC_NONE && !memchr(n->str, '\0', n->len - 1);
+        map_put(strs, n->str, g);
     }
-    return NULL;
+    return g;
+}
+
+static IrIns * find_local(Scope *s, char *name) {
+    return smap_get(s->locals, name);
 }
 
 static Global * find_global(Scope *s, char *name) {
@@ -314,7 +984,7 @@ static int INVERT_COND[IR_LAST] = {
 static IrIns * compile_expr(Scope *s, AstNode *n);
 
 static void add_to_branch_chain(Vec *bcs, BB **bb, IrIns *ins) {
-    BrChain *bc = malloc(sizeof(BrChain));
+    BrChain *bc = arena_alloc(ARENA_IR_FN, sizeof(BrChain));
     bc->bb = bb;
     bc->ins = ins;
     vec_push(bcs, bc);
@@ -341,24 +1011,36 @@ static void add_phi(IrIns *phi, BB *pred, IrIns *def) {
     vec_push(phi->defs, def);
 }
 
+// Whether the chains have been swapped (by a '!') since 'br' was emitted, so
+// its own condition is the opposite of the result
+static int is_negated(IrIns *br) {
+    for (size_t i = 0; i < vec_len(br->false_chain); i++) {
+        BrChain *bc = vec_get(br->false_chain, i);
+        if (bc->bb == &br->true) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 static IrIns * discharge(Scope *s, IrIns *br) {
     if (br->op != IR_CONDBR) {
         return br; // Doesn't need discharging
     }
+    if (is_negated(br)) {
+        br->cond->op = INVERT_COND[br->cond->op];
+    }
     if (vec_len(br->true_chain) == 1 && vec_len(br->false_chain) == 1) {
         IrIns *cond = br->cond;
-        if (*((BrChain *) vec_get(br->false_chain, 0))->bb == br->false) {
-            cond->op = INVERT_COND[cond->op]; // Negate
-        }
         delete_ir(br);
         return cond;
     }
     BB *bb = emit_bb(s);
-    IrIns *k_true = emit(s, IR_IMM, irt_new(IRT_I32));
+    IrIns *k_true = emit(s, IR_IMM, irt_scalar(IRT_I32));
     k_true->imm = 1;
-    IrIns *k_false = emit(s, IR_IMM, irt_new(IRT_I32));
+    IrIns *k_false = emit(s, IR_IMM, irt_scalar(IRT_I32));
     k_false->imm = 0;
-    IrIns *phi = emit(s, IR_PHI, br->t);
+    IrIns *phi = emit(s, IR_PHI, irt_scalar(IRT_I32));
     for (size_t i = 0; i < vec_len(br->true_chain); i++) {
         BrChain *bc = vec_get(br->true_chain, i);
         if (bc->ins != br) { // Handle last condition separately
@@ -387,7 +1069,7 @@ static IrIns * to_cond(Scope *s, IrIns *cond) {
     if (cond->op < IR_EQ || cond->op > IR_FGE) { // Not a comparison
         IrIns *zero = emit(s, IR_IMM, cond->t);
         zero->imm = 0;
-        IrIns *cmp = emit(s, IR_NEQ, irt_new(IRT_I32));
+        IrIns *cmp = emit(s, IR_NEQ, irt_scalar(IRT_I32));
         cmp->l = cond;
         cmp->r = zero;
         cond = cmp;
@@ -417,7 +1099,7 @@ static IrIns * emit_conv(Scope *s, IrIns *src, AstType *ast_st, IrType *dt) {
     } else if ((st->k == IRT_PTR || st->k == IRT_ARR) && is_int(dt)) {
         op = IR_PTR2I;
     } else if (st->k == IRT_ARR && dt->k == IRT_PTR) {
-        IrIns *zero = emit(s, IR_IMM, irt_new(IRT_I64));
+        IrIns *zero = emit(s, IR_IMM, irt_scalar(IRT_I64));
         zero->imm = 0;
         IrIns *idx = emit(s, IR_PTRADD, dt);
         idx->base = src;
@@ -428,6 +1110,11 @@ static IrIns * emit_conv(Scope *s, IrIns *src, AstType *ast_st, IrType *dt) {
     } else if ((st->k == IRT_PTR || st->k == IRT_ARR) &&
                (dt->k == IRT_PTR || dt->k == IRT_ARR)) {
         return src; // No conversion necessary
+    } else if (dt->k == IRT_VEC && st->k != IRT_VEC) {
+        op = IR_SPLAT; // Already converted to the element type by the parser
+    } else if (st->k == IRT_VEC && dt->k == IRT_VEC) {
+        if (st == dt) return src; // No conversion needed
+        op = IR_BITCAST; // Same size (checked by parser)
     } else {
         UNREACHABLE();
     }
@@ -436,14 +1123,28 @@ static IrIns * emit_conv(Scope *s, IrIns *src, AstType *ast_st, IrType *dt) {
     return conv;
 }
 
+static IrIns * emit_atomic(Scope *s, int op, IrType *t, IrIns *addr, IrIns *val,
+                           int order) {
+    IrIns *ins = emit(s, op, t);
+    ins->addr = addr;
+    ins->val = val;
+    ins->expected = NULL;
+    ins->order = order;
+    return ins;
+}
+
 static IrIns * emit_load(Scope *s, IrIns *src, AstType *t) {
     // 't' is the type of the object to load from the pointer 'src'
     // The only valid operations on aggregate types are:
     // * T_STRUCT/T_UNION: field access (., ->), assign (=), addr (&), comma (,), ternary (?)
     // * T_ARR: member access ([]), addr (&), comma (,), ternary (?), ptr arith
+    // * T_I128: loaded a half at a time (see 'compile_i128')
     assert(src->t->k == IRT_PTR);
-    if (t->k == T_ARR || t->k == T_STRUCT || t->k == T_UNION || t->k == T_FN) {
+    if (t->k == T_ARR || t->k == T_STRUCT || t->k == T_UNION || t->k == T_FN ||
+            t->k == T_I128) {
         return src; // Aggregates loaded on field access
+    } else if (t->is_atomic) {
+        return emit_atomic(s, IR_ATOMIC_LOAD, irt_conv(t), src, NULL, MO_SEQ_CST);
     } else { // Base types
         IrIns *load = emit(s, IR_LOAD, irt_conv(t));
         load->src = src;
@@ -451,17 +1152,30 @@ static IrIns * emit_load(Scope *s, IrIns *src, AstType *t) {
     }
 }
 
-static void compile_init_elem(Scope *s, AstNode *n, AstType *t, IrIns *elem);
+// An lvalue of a base type is compiled to a load from the object (an atomic
+// one if it's '_Atomic'), which assignments, '&', etc. delete and use the
+// address of instead
+static int is_lval_load(IrIns *ins) {
+    return ins->op == IR_LOAD || ins->op == IR_ATOMIC_LOAD;
+}
 
-static void compile_array_init_raw(Scope *s, AstNode *n, IrIns *elem) {
-    assert(n->t->k == T_ARR);
-    for (size_t i = 0; i < vec_len(n->elems); i++) {
+static IrIns * load_addr(IrIns *load) {
+    return load->op == IR_ATOMIC_LOAD ? load->addr : load->src;
+}
+
+static void compile_init_elem(Scope *s, AstNode *n, AstType *t, IrIns *elem,
+                              int zeroed);
+static void emit_store(Scope *s, IrIns *dst, IrIns *src, AstType *t);
+
+static void compile_array_init_raw(Scope *s, AstNode *n, IrIns *elem, int zeroed) {
+    assert(n->t->k == T_ARR || n->t->k == T_VEC);
+    for (size_t i = 0; i < vec_len(n->elems); i++) {
         AstNode *v = vec_get(n->elems, i);
-        compile_init_elem(s, v, n->t->elem, elem);
+        compile_init_elem(s, v, n->t->elem, elem, zeroed);
         if (i < vec_len(n->elems) - 1) {
-            IrIns *offset = emit(s, IR_IMM, irt_new(IRT_I64));
+            IrIns *offset = emit(s, IR_IMM, irt_scalar(IRT_I64));
             offset->imm = n->t->elem->size;
-            IrIns *next = emit(s, IR_PTRADD, irt_new(IRT_PTR));
+            IrIns *next = emit(s, IR_PTRADD, irt_scalar(IRT_PTR));
             next->base = elem;
             next->offset = offset;
             elem = next;
@@ -469,39 +1183,68 @@ static void compile_array_init_raw(Scope *s, AstNode *n, IrIns *elem) {
     }
 }
 
-static void compile_struct_init_raw(Scope *s, AstNode *n, IrIns *obj) {
+static IrIns * store_bit_field(Scope *s, IrIns *ptr, Field *f, IrIns *v,
+                               AstType *v_t, AstType *t);
+
+static void emit_zero(Scope *s, IrIns *ptr, size_t size) {
+    IrIns *imm = emit(s, IR_IMM, irt_scalar(IRT_I64));
+    imm->imm = size;
+    IrIns *zero = emit(s, IR_ZERO, NULL);
+    zero->ptr = ptr;
+    zero->size = imm;
+}
+
+static int has_bit_fields(AstType *t) {
+    for (size_t i = 0; i < vec_len(t->fields); i++) {
+        if (((Field *) vec_get(t->fields, i))->is_bit_field) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Bit-fields are written into units that start out zeroed (rather than
+// undefined), so the stores to each unit fold into one constant if they can
+static void compile_struct_init_raw(Scope *s, AstNode *n, IrIns *obj, int zeroed) {
     assert(n->t->k == T_STRUCT || n->t->k == T_UNION);
+    if (!zeroed && has_bit_fields(n->t)) {
+        emit_zero(s, obj, n->t->size);
+        zeroed = 1;
+    }
     for (size_t i = 0; i < vec_len(n->elems); i++) {
         Field *f = vec_get(n->t->fields, i);
-        IrIns *offset = emit(s, IR_IMM, irt_new(IRT_I64));
+        IrIns *offset = emit(s, IR_IMM, irt_scalar(IRT_I64));
         offset->imm = f->offset;
-        IrIns *idx = emit(s, IR_PTRADD, irt_new(IRT_PTR));
+        IrIns *idx = emit(s, IR_PTRADD, irt_scalar(IRT_PTR));
         idx->base = obj;
         idx->offset = offset;
         AstNode *v = vec_get(n->elems, i);
-        compile_init_elem(s, v, f->t, idx);
+        if (f->is_bit_field && v) {
+            IrIns *val = discharge(s, compile_expr(s, v));
+            store_bit_field(s, idx, f, val, v->t, f->t);
+        } else if (!f->is_bit_field) {
+            compile_init_elem(s, v, f->t, idx, zeroed);
+        }
     }
 }
 
-static void compile_init_elem(Scope *s, AstNode *n, AstType *t, IrIns *elem) {
+// 'zeroed' if the whole object's already been zeroed, so missing elements can
+// be skipped
+static void compile_init_elem(Scope *s, AstNode *n, AstType *t, IrIns *elem,
+                              int zeroed) {
     if (n) {
-        if (t->k == T_ARR) {
-            compile_array_init_raw(s, n, elem);
+        if (t->k == T_ARR || (t->k == T_VEC && n->k == N_INIT)) {
+            compile_array_init_raw(s, n, elem, zeroed);
         } else if (t->k == T_STRUCT || t->k == T_UNION) {
-            compile_struct_init_raw(s, n, elem);
+            compile_struct_init_raw(s, n, elem, zeroed);
         } else {
             IrIns *ins = discharge(s, compile_expr(s, n));
-            IrIns *store = emit(s, IR_STORE, NULL);
-            store->dst = elem;
-            store->src = ins;
+            emit_store(s, elem, ins, t);
         }
-    } else {
-        if (t->k == T_ARR || t->k == T_STRUCT || t->k == T_UNION) {
-            IrIns *size = emit(s, IR_IMM, irt_new(IRT_I64));
-            size->imm = t->size;
-            IrIns *zero = emit(s, IR_ZERO, NULL);
-            zero->ptr = elem;
-            zero->size = size;
+    } else if (!zeroed) {
+        if (t->k == T_ARR || t->k == T_STRUCT || t->k == T_UNION || t->k == T_VEC ||
+                t->k == T_I128) {
+            emit_zero(s, elem, t->size);
         } else {
             IrIns *zero = emit(s, IR_IMM, irt_conv(t));
             zero->imm = 0;
@@ -518,11 +1261,10 @@ static IrIns * compile_const_init(Scope *s, AstNode *n) {
         return NULL;
     }
     Global *g = def_const_global(s, const_init);
-    IrIns *src = emit(s, IR_GLOBAL, irt_new(IRT_PTR));
+    IrIns *src = emit(s, IR_GLOBAL, irt_scalar(IRT_PTR));
     src->g = g;
-    IrIns *dst = emit(s, IR_ALLOC, irt_new(IRT_PTR));
-    dst->alloc_t = irt_conv(n->t);
-    IrIns *size = emit(s, IR_IMM, irt_new(IRT_I64));
+    IrIns *dst = emit_alloc(s, irt_conv(n->t));
+    IrIns *size = emit(s, IR_IMM, irt_scalar(IRT_I64));
     size->imm = dst->alloc_t->size;
     IrIns *copy = emit(s, IR_COPY, NULL);
     copy->src = src;
@@ -531,15 +1273,32 @@ static IrIns * compile_const_init(Scope *s, AstNode *n) {
     return dst;
 }
 
+static int has_missing_elems(AstNode *n) {
+    if (!n) {
+        return 1;
+    } else if (n->k != N_INIT) {
+        return 0;
+    }
+    for (size_t i = 0; i < vec_len(n->elems); i++) {
+        if (has_missing_elems(vec_get(n->elems, i))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 static IrIns * compile_init(Scope *s, AstNode *n) {
     assert(n->k == N_INIT);
     IrIns *const_init = compile_const_init(s, n);
     if (const_init) {
         return const_init;
     }
-    IrIns *alloc = emit(s, IR_ALLOC, irt_new(IRT_PTR));
-    alloc->alloc_t = irt_conv(n->t);
-    compile_init_elem(s, n, n->t, alloc);
+    IrIns *alloc = emit_alloc(s, irt_conv(n->t));
+    int zeroed = has_missing_elems(n);
+    if (zeroed) { // One block zeroing beats a store per missing element
+        emit_zero(s, alloc, n->t->size);
+    }
+    compile_init_elem(s, n, n->t, alloc, zeroed);
     return alloc;
 }
 
@@ -547,12 +1306,12 @@ static IrIns * compile_kptr(Scope *s, AstNode *n) {
     assert(n->g->k == N_GLOBAL);
     Global *g = find_global(s, n->g->var_name);
     assert(g); // Checked by parser
-    IrIns *ins = emit(s, IR_GLOBAL, irt_new(IRT_PTR));
+    IrIns *ins = emit(s, IR_GLOBAL, irt_scalar(IRT_PTR));
     ins->g = g;
     if (n->offset != 0) {
-        IrIns *offset = emit(s, IR_IMM, irt_new(IRT_I64));
+        IrIns *offset = emit(s, IR_IMM, irt_scalar(IRT_I64));
         offset->imm = n->offset < 0 ? -n->offset : n->offset;
-        IrIns *arith = emit(s, n->offset < 0 ? IR_SUB : IR_ADD, irt_new(IRT_PTR));
+        IrIns *arith = emit(s, n->offset < 0 ? IR_SUB : IR_ADD, irt_scalar(IRT_PTR));
         arith->l = ins;
         arith->r = offset;
         return arith;
@@ -560,11 +1319,556 @@ static IrIns * compile_kptr(Scope *s, AstNode *n) {
     return ins;
 }
 
+
+// ---- Bit-fields ------------------------------------------------------------
+
+// A bit-field is read by loading the whole unit it's in (an object of its
+// type; see 'set_struct_fields'), then shifting and masking it out; it's
+// written with a single read-modify-write of the unit. Both are done in at
+// least 32 bits. Writes to neighbouring bit-fields in the same unit are merged
+// later: 'dse' forwards the first store to the second's load and deletes it,
+// and 'gvn' folds the masks together (see 'merge_masks')
+
+static IrIns * emit_imm(Scope *s, IrType *t, uint64_t imm) {
+    IrIns *ins = emit(s, IR_IMM, t);
+    ins->imm = imm;
+    return ins;
+}
+
+static Field * bit_field(AstNode *n) {
+    if (n->k != N_FIELD) {
+        return NULL;
+    }
+    Field *f = vec_get(n->obj->t->fields, n->field_idx);
+    return f->is_bit_field ? f : NULL;
+}
+
+static IrType * bit_field_irt(Field *f) { // What it's worked on in
+    return irt_scalar(f->t->size == 8 ? IRT_I64 : IRT_I32);
+}
+
+static AstType * bit_field_int_t(Field *f) {
+    return f->t->k == T_ENUM ? f->t->num_t : f->t;
+}
+
+static uint64_t bit_field_mask(Field *f) {
+    return f->bits == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << f->bits) - 1;
+}
+
+static IrIns * emit_bits_op(Scope *s, int op, IrIns *l, uint64_t imm) {
+    IrIns *r = emit_imm(s, l->t, imm);
+    IrIns *ins = emit(s, op, l->t);
+    ins->l = l;
+    ins->r = r;
+    return ins;
+}
+
+static IrIns * compile_bit_field_unit(Scope *s, AstNode *n, Field *f) {
+    IrIns *obj = discharge(s, compile_expr(s, n->obj));
+    IrIns *offset = emit_imm(s, irt_scalar(IRT_I64), f->offset);
+    IrIns *idx = emit(s, IR_PTRADD, irt_scalar(IRT_PTR));
+    idx->base = obj;
+    idx->offset = offset;
+    return idx;
+}
+
+// Sign or zero extends the bottom 'f->bits' bits of 'v' as 't'
+static IrIns * extend_bit_field(Scope *s, IrIns *v, Field *f, AstType *t) {
+    AstType *ft = bit_field_int_t(f);
+    size_t w = v->t->size * 8;
+    if (f->bits < w && !ft->is_unsigned) {
+        v = emit_bits_op(s, IR_SHL, v, w - f->bits);
+        v = emit_bits_op(s, IR_SAR, v, w - f->bits);
+    } else if (f->bits < w) {
+        v = emit_bits_op(s, IR_BIT_AND, v, bit_field_mask(f));
+    }
+    return emit_conv(s, v, ft, irt_conv(t));
+}
+
+// The unit's extended to 'bit_field_irt' like its type would be, so a field at
+// the top of it only needs shifting down
+static IrIns * load_bit_field(Scope *s, IrIns *ptr, Field *f, AstType *t) {
+    AstType *ft = bit_field_int_t(f);
+    IrIns *unit = emit(s, IR_LOAD, irt_conv(ft));
+    unit->src = ptr;
+    IrIns *v = emit_conv(s, unit, ft, bit_field_irt(f));
+    size_t w = v->t->size * 8, top = f->bit_offset + f->bits;
+    if (top < ft->size * 8 && !ft->is_unsigned) { // Its top bit to the top
+        v = emit_bits_op(s, IR_SHL, v, w - top);
+        v = emit_bits_op(s, IR_SAR, v, w - f->bits);
+    } else if (f->bit_offset > 0) {
+        v = emit_bits_op(s, ft->is_unsigned ? IR_SHR : IR_SAR, v, f->bit_offset);
+    }
+    if (top < ft->size * 8 && ft->is_unsigned) {
+        v = emit_bits_op(s, IR_BIT_AND, v, bit_field_mask(f));
+    }
+    return emit_conv(s, v, ft, irt_conv(t));
+}
+
+// Stores 'v' (of type 'v_t') into the bit-field, and returns the value it now
+// has as a 't' (i.e., 'v' truncated to its width)
+static IrIns * store_bit_field(Scope *s, IrIns *ptr, Field *f, IrIns *v,
+                               AstType *v_t, AstType *t) {
+    AstType *ft = bit_field_int_t(f);
+    IrType *wt = bit_field_irt(f);
+    size_t w = wt->size * 8;
+    v = emit_conv(s, v, v_t, wt);
+    IrIns *unit = emit(s, IR_LOAD, irt_conv(ft));
+    unit->src = ptr;
+    IrIns *u = emit_conv(s, unit, ft, wt);
+    uint64_t mask = bit_field_mask(f);
+    IrIns *bits = v;
+    if (f->bits < w) {
+        bits = emit_bits_op(s, IR_BIT_AND, bits, mask);
+    }
+    if (f->bit_offset > 0) {
+        bits = emit_bits_op(s, IR_SHL, bits, f->bit_offset);
+    }
+    uint64_t unit_mask = w == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << w) - 1;
+    IrIns *kept = emit_bits_op(s, IR_BIT_AND, u, ~(mask << f->bit_offset) & unit_mask);
+    IrIns *merged = emit(s, IR_BIT_OR, wt);
+    merged->l = kept;
+    merged->r = bits;
+    IrIns *src = emit_conv(s, merged, ft, irt_conv(ft));
+    IrIns *store = emit(s, IR_STORE, NULL);
+    store->dst = ptr;
+    store->src = src;
+    return extend_bit_field(s, v, f, t);
+}
+
+static IrIns * compile_bit_field_assign(Scope *s, AstNode *n) {
+    IrIns *r = discharge(s, compile_expr(s, n->r));
+    Field *f = bit_field(n->l);
+    IrIns *ptr = compile_bit_field_unit(s, n->l, f);
+    return store_bit_field(s, ptr, f, r, n->r->t, n->l->t);
+}
+
+static IrIns * compile_bit_field_arith_assign(Scope *s, AstNode *n, int op) {
+    AstNode *lval = n->l->k == N_CONV ? n->l->l : n->l;
+    Field *f = bit_field(lval);
+    IrIns *ptr = compile_bit_field_unit(s, lval, f);
+    IrIns *l = load_bit_field(s, ptr, f, lval->t);
+    l = emit_conv(s, l, lval->t, irt_conv(n->l->t));
+    IrIns *r = discharge(s, compile_expr(s, n->r));
+    IrIns *v = emit(s, op, irt_conv(n->t));
+    v->l = l;
+    v->r = r;
+    return store_bit_field(s, ptr, f, v, n->t, lval->t);
+}
+
+static IrIns * compile_bit_field_inc_dec(Scope *s, AstNode *n) {
+    int is_sub = (n->k == N_PRE_DEC || n->k == N_POST_DEC);
+    Field *f = bit_field(n->l);
+    IrIns *ptr = compile_bit_field_unit(s, n->l, f);
+    IrIns *old = load_bit_field(s, ptr, f, n->t);
+    IrIns *v = emit_bits_op(s, is_sub ? IR_SUB : IR_ADD, old, 1);
+    IrIns *new = store_bit_field(s, ptr, f, v, n->t, n->t);
+    int is_prefix = (n->k == N_PRE_INC || n->k == N_PRE_DEC);
+    return is_prefix ? new : old;
+}
+
+
+// ---- 128-bit Integers ------------------------------------------------------
+
+// A '__int128' is an object of two i64 halves, which its rvalues point to as
+// for any other aggregate, so it's passed and returned the way the ABI wants
+// (in two GPRs) for free. Arithmetic is on the halves, which SROA and mem2reg
+// then keep in registers. Division, and conversion to and from floats, are
+// calls to libgcc
+
+static IrIns * emit_half_op(Scope *s, int op, IrIns *l, IrIns *r) {
+    int is_cmp = op >= IR_EQ && op <= IR_UGE;
+    IrIns *ins = emit(s, op, irt_scalar(is_cmp ? IRT_I32 : IRT_I64));
+    ins->l = l;
+    ins->r = r;
+    return ins;
+}
+
+static IrIns * emit_half_imm_op(Scope *s, int op, IrIns *l, uint64_t imm) {
+    IrIns *r = emit_imm(s, irt_scalar(IRT_I64), imm);
+    return emit_half_op(s, op, l, r);
+}
+
+static IrIns * emit_select(Scope *s, IrIns *sel, IrIns *l, IrIns *r) {
+    IrIns *ins = emit(s, IR_SELECT, l->t);
+    ins->sel = sel;
+    ins->l = l;
+    ins->r = r;
+    return ins;
+}
+
+static int is_imm(IrIns *ins, uint64_t imm) {
+    return ins->op == IR_IMM && ins->imm == imm;
+}
+
+static IrIns * i128_half_ptr(Scope *s, IrIns *ptr, uint64_t offset) {
+    IrIns *imm = emit_imm(s, irt_scalar(IRT_I64), offset);
+    IrIns *half = emit(s, IR_PTRADD, irt_scalar(IRT_PTR));
+    half->base = ptr;
+    half->offset = imm;
+    return half;
+}
+
+static IrIns * i128_hi_ptr(Scope *s, IrIns *ptr) {
+    return i128_half_ptr(s, ptr, 8);
+}
+
+static void load_i128(Scope *s, IrIns *ptr, IrIns **lo, IrIns **hi) {
+    IrIns *lo_ptr = ptr;
+    if (ptr->t->k != IRT_PTR) { // e.g., a call's result (see 'asm_call')
+        lo_ptr = i128_half_ptr(s, ptr, 0);
+    }
+    *lo = emit(s, IR_LOAD, irt_scalar(IRT_I64));
+    (*lo)->src = lo_ptr;
+    IrIns *hi_ptr = i128_hi_ptr(s, ptr);
+    *hi = emit(s, IR_LOAD, irt_scalar(IRT_I64));
+    (*hi)->src = hi_ptr;
+}
+
+static void store_i128(Scope *s, IrIns *ptr, IrIns *lo, IrIns *hi) {
+    IrIns *store = emit(s, IR_STORE, NULL);
+    store->dst = ptr;
+    store->src = lo;
+    IrIns *hi_ptr = i128_hi_ptr(s, ptr);
+    store = emit(s, IR_STORE, NULL);
+    store->dst = hi_ptr;
+    store->src = hi;
+}
+
+// Puts the halves in an object, for a '__int128' rvalue
+static IrIns * emit_i128(Scope *s, IrIns *lo, IrIns *hi) {
+    AstType t = { .k = T_I128 };
+    IrIns *alloc = emit_alloc(s, irt_conv(&t));
+    store_i128(s, alloc, lo, hi);
+    return alloc;
+}
+
+static IrIns * emit_lib_fn(Scope *s, char *name);
+
+// A '__int128' argument is passed as the pointer to it, as is the result
+static IrIns * emit_i128_lib_call(Scope *s, char *name, IrType *ret, IrIns **args,
+                                  int num_args) {
+    AstType i128 = { .k = T_I128 };
+    IrIns *fn = emit_lib_fn(s, name);
+    IrIns *call = emit(s, IR_CALL, ret);
+    call->fn = fn;
+    call->is_vararg = 0;
+    for (int i = 0; i < num_args; i++) {
+        IrIns *carg = emit(s, IR_CARG, args[i]->t->k == IRT_PTR ? irt_conv(&i128) : args[i]->t);
+        carg->arg = args[i];
+    }
+    return call;
+}
+
+// Shifts by more than 63 move one half into the other. A variable amount does
+// both, and picks the right one; the bits shifted from one half into the other
+// are shifted by one and then '63 - n' so neither shift is by 64
+static void emit_i128_shift(Scope *s, int op, IrIns *al, IrIns *ah, IrIns *amt,
+                            IrIns **lo, IrIns **hi) {
+    if (amt->op == IR_IMM) {
+        uint64_t n = amt->imm & 127;
+        if (n == 0) {
+            *lo = al;
+            *hi = ah;
+        } else if (op == IR_SHL && n < 64) {
+            *lo = emit_half_imm_op(s, IR_SHL, al, n);
+            IrIns *h = emit_half_imm_op(s, IR_SHL, ah, n);
+            IrIns *carry = emit_half_imm_op(s, IR_SHR, al, 64 - n);
+            *hi = emit_half_op(s, IR_BIT_OR, h, carry);
+        } else if (op == IR_SHL) {
+            *lo = emit_imm(s, irt_scalar(IRT_I64), 0);
+            *hi = n == 64 ? al : emit_half_imm_op(s, IR_SHL, al, n - 64);
+        } else if (n < 64) {
+            IrIns *l = emit_half_imm_op(s, IR_SHR, al, n);
+            IrIns *carry = emit_half_imm_op(s, IR_SHL, ah, 64 - n);
+            *lo = emit_half_op(s, IR_BIT_OR, l, carry);
+            *hi = emit_half_imm_op(s, op, ah, n);
+        } else {
+            *lo = n == 64 ? ah : emit_half_imm_op(s, op, ah, n - 64);
+            *hi = op == IR_SAR ? emit_half_imm_op(s, IR_SAR, ah, 63) :
+                  emit_imm(s, irt_scalar(IRT_I64), 0);
+        }
+        return;
+    }
+    IrIns *n = emit_half_imm_op(s, IR_BIT_AND, amt, 63);
+    IrIns *rest = emit_half_imm_op(s, IR_BIT_XOR, n, 63); // 63 - n
+    IrIns *big = emit_half_imm_op(s, IR_BIT_AND, amt, 64);
+    int rev = op == IR_SHL ? IR_SHR : IR_SHL;
+    IrIns *near = op == IR_SHL ? al : ah, *far = op == IR_SHL ? ah : al;
+    IrIns *moved = emit_half_op(s, op, near, n);
+    IrIns *kept = emit_half_op(s, op == IR_SHL ? IR_SHL : IR_SHR, far, n);
+    IrIns *carry = emit_half_imm_op(s, rev, near, 1);
+    carry = emit_half_op(s, rev, carry, rest);
+    kept = emit_half_op(s, IR_BIT_OR, kept, carry);
+    IrIns *fill = op == IR_SAR ? emit_half_imm_op(s, IR_SAR, ah, 63) :
+                  emit_imm(s, irt_scalar(IRT_I64), 0);
+    IrIns *near_v = emit_select(s, big, fill, moved);
+    IrIns *far_v = emit_select(s, big, moved, kept);
+    *lo = op == IR_SHL ? near_v : far_v;
+    *hi = op == IR_SHL ? far_v : near_v;
+}
+
+static char * I128_DIV_FNS[] = {
+    [IR_SDIV] = "__divti3", [IR_UDIV] = "__udivti3",
+    [IR_SMOD] = "__modti3", [IR_UMOD] = "__umodti3",
+};
+
+// Additions carry out of the low half by comparing the sum with an operand,
+// since the IR has no flags; multiplications are a 64-bit multiply for the low
+// half and its top 64 bits (IR_UMULH) for the high one, which the assembler
+// does with a single 'mul', plus the cross products (which are often 0)
+static void emit_i128_arith(Scope *s, int op, IrIns *al, IrIns *ah, IrIns *bl,
+                            IrIns *bh, IrIns **lo, IrIns **hi) {
+    switch (op) {
+    case IR_ADD: case IR_SUB: {
+        *lo = emit_half_op(s, op, al, bl);
+        IrIns *c = emit_half_op(s, IR_ULT, op == IR_ADD ? *lo : al, op == IR_ADD ? al : bl);
+        IrIns *carry = emit(s, IR_ZEXT, irt_scalar(IRT_I64));
+        carry->l = c;
+        IrIns *h = emit_half_op(s, op, ah, bh);
+        *hi = emit_half_op(s, op, h, carry);
+        break;
+    }
+    case IR_MUL:
+        *lo = emit_half_op(s, IR_MUL, al, bl);
+        *hi = emit_half_op(s, IR_UMULH, al, bl);
+        if (!is_imm(bh, 0) && !is_imm(al, 0)) {
+            IrIns *cross = emit_half_op(s, IR_MUL, al, bh);
+            *hi = emit_half_op(s, IR_ADD, *hi, cross);
+        }
+        if (!is_imm(ah, 0) && !is_imm(bl, 0)) {
+            IrIns *cross = emit_half_op(s, IR_MUL, ah, bl);
+            *hi = emit_half_op(s, IR_ADD, *hi, cross);
+        }
+        break;
+    case IR_BIT_AND: case IR_BIT_OR: case IR_BIT_XOR:
+        *lo = emit_half_op(s, op, al, bl);
+        *hi = emit_half_op(s, op, ah, bh);
+        break;
+    case IR_SHL: case IR_SAR: case IR_SHR:
+        emit_i128_shift(s, op, al, ah, bl, lo, hi);
+        break;
+    case IR_SDIV: case IR_UDIV: case IR_SMOD: case IR_UMOD: {
+        IrIns *args[] = { emit_i128(s, al, ah), emit_i128(s, bl, bh) };
+        IrIns *call = emit_i128_lib_call(s, I128_DIV_FNS[op], args[0]->alloc_t, args, 2);
+        load_i128(s, call, lo, hi);
+        break;
+    }
+    default: UNREACHABLE();
+    }
+}
+
+// The high halves decide, unless they're equal
+static IrIns * emit_i128_cmp(Scope *s, int op, IrIns *al, IrIns *ah, IrIns *bl,
+                             IrIns *bh) {
+    if (op == IR_EQ || op == IR_NEQ) {
+        IrIns *l = emit_half_op(s, IR_BIT_XOR, al, bl);
+        IrIns *h = emit_half_op(s, IR_BIT_XOR, ah, bh);
+        IrIns *diff = emit_half_op(s, IR_BIT_OR, l, h);
+        return emit_half_imm_op(s, op, diff, 0);
+    }
+    int strict, is_signed = op >= IR_SLT && op <= IR_SGE;
+    int lo_op = is_signed ? op - IR_SLT + IR_ULT : op;
+    switch (lo_op) {
+    case IR_ULT: case IR_ULE: strict = IR_ULT; break;
+    default:                  strict = IR_UGT; break;
+    }
+    int hi_op = is_signed ? strict - IR_ULT + IR_SLT : strict;
+    IrIns *differ = emit_half_op(s, IR_NEQ, ah, bh);
+    IrIns *h = emit_half_op(s, hi_op, ah, bh);
+    IrIns *l = emit_half_op(s, lo_op, al, bl);
+    return emit_select(s, differ, h, l);
+}
+
+static void i128_from(Scope *s, IrIns *v, AstType *from, AstType *to, IrIns **lo,
+                      IrIns **hi) {
+    if (from->k == T_ENUM) {
+        from = from->num_t;
+    }
+    if (is_fp_t(from)) {
+        char *name = from->k == T_FLOAT ?
+            (to->is_unsigned ? "__fixunssfti" : "__fixsfti") :
+            (to->is_unsigned ? "__fixunsdfti" : "__fixdfti");
+        IrIns *call = emit_i128_lib_call(s, name, irt_conv(to), &v, 1);
+        load_i128(s, call, lo, hi);
+    } else if (v->t->k == IRT_PTR) {
+        *lo = emit(s, IR_PTR2I, irt_scalar(IRT_I64));
+        (*lo)->l = v;
+        *hi = emit_imm(s, irt_scalar(IRT_I64), 0);
+    } else {
+        *lo = emit_conv(s, v, from, irt_scalar(IRT_I64));
+        *hi = from->is_unsigned ? emit_imm(s, irt_scalar(IRT_I64), 0) :
+              emit_half_imm_op(s, IR_SAR, *lo, 63);
+    }
+}
+
+static IrIns * i128_to(Scope *s, IrIns *lo, IrIns *hi, AstType *from, AstType *to) {
+    if (is_fp_t(to)) {
+        char *name = to->k == T_FLOAT ?
+            (from->is_unsigned ? "__floatuntisf" : "__floattisf") :
+            (from->is_unsigned ? "__floatuntidf" : "__floattidf");
+        IrIns *arg = emit_i128(s, lo, hi);
+        return emit_i128_lib_call(s, name, irt_conv(to), &arg, 1);
+    }
+    return emit_conv(s, lo, from, irt_conv(to)); // Truncates
+}
+
+static int i128_op(AstNode *n) {
+    switch (n->k) {
+    case N_ADD: case N_A_ADD: return IR_ADD;
+    case N_SUB: case N_A_SUB: return IR_SUB;
+    case N_MUL: case N_A_MUL: return IR_MUL;
+    case N_DIV: case N_A_DIV: return n->t->is_unsigned ? IR_UDIV : IR_SDIV;
+    case N_MOD: case N_A_MOD: return n->t->is_unsigned ? IR_UMOD : IR_SMOD;
+    case N_BIT_AND: case N_A_BIT_AND: return IR_BIT_AND;
+    case N_BIT_OR:  case N_A_BIT_OR:  return IR_BIT_OR;
+    case N_BIT_XOR: case N_A_BIT_XOR: return IR_BIT_XOR;
+    case N_SHL: case N_A_SHL: return IR_SHL;
+    case N_SHR: case N_A_SHR: return n->t->is_unsigned ? IR_SHR : IR_SAR;
+    default: UNREACHABLE();
+    }
+    return 0;
+}
+
+// The halves of a '__int128' expression
+static void compile_i128(Scope *s, AstNode *n, IrIns **lo, IrIns **hi) {
+    assert(n->t->k == T_I128);
+    IrIns *al, *ah, *bl, *bh;
+    switch (n->k) {
+    case N_IMM:
+        *lo = emit_imm(s, irt_scalar(IRT_I64), n->imm);
+        *hi = emit_imm(s, irt_scalar(IRT_I64), n->imm_hi);
+        break;
+    case N_ADD: case N_SUB: case N_MUL: case N_DIV: case N_MOD:
+    case N_BIT_AND: case N_BIT_OR: case N_BIT_XOR: case N_SHL: case N_SHR:
+        compile_i128(s, n->l, &al, &ah);
+        compile_i128(s, n->r, &bl, &bh);
+        emit_i128_arith(s, i128_op(n), al, ah, bl, bh, lo, hi);
+        break;
+    case N_NEG:
+        compile_i128(s, n->l, &bl, &bh);
+        al = emit_imm(s, irt_scalar(IRT_I64), 0);
+        emit_i128_arith(s, IR_SUB, al, al, bl, bh, lo, hi);
+        break;
+    case N_BIT_NOT:
+        compile_i128(s, n->l, &al, &ah);
+        *lo = emit_half_imm_op(s, IR_BIT_XOR, al, -1);
+        *hi = emit_half_imm_op(s, IR_BIT_XOR, ah, -1);
+        break;
+    case N_CONV:
+        if (n->l->t->k == T_I128) { // Only the signedness changes
+            compile_i128(s, n->l, lo, hi);
+        } else {
+            IrIns *v = discharge(s, compile_expr(s, n->l));
+            i128_from(s, v, n->l->t, n->t, lo, hi);
+        }
+        break;
+    default:
+        load_i128(s, discharge(s, compile_expr(s, n)), lo, hi);
+        break;
+    }
+}
+
+static IrIns * compile_i128_value(Scope *s, AstNode *n) {
+    IrIns *lo, *hi;
+    compile_i128(s, n, &lo, &hi);
+    return emit_i128(s, lo, hi);
+}
+
+static IrIns * compile_i128_binop(Scope *s, AstNode *n, int op) {
+    if (n->t->k == T_I128) {
+        return compile_i128_value(s, n);
+    }
+    IrIns *al, *ah, *bl, *bh; // Comparison
+    compile_i128(s, n->l, &al, &ah);
+    compile_i128(s, n->r, &bl, &bh);
+    return emit_i128_cmp(s, op, al, ah, bl, bh);
+}
+
+static IrIns * compile_i128_conv(Scope *s, AstNode *n) {
+    if (n->t->k == T_I128) {
+        return compile_i128_value(s, n);
+    }
+    IrIns *lo, *hi;
+    compile_i128(s, n->l, &lo, &hi);
+    return i128_to(s, lo, hi, n->l->t, n->t);
+}
+
+// Either the object or the operation is a '__int128' (e.g., 'int x; x += y'
+// for a '__int128 y'); the object's address is only worked out once
+static IrIns * compile_i128_arith_assign(Scope *s, AstNode *n, int op) {
+    AstNode *lval = n->l->k == N_CONV ? n->l->l : n->l;
+    AstType *op_t = n->l->t;
+    IrIns *addr = compile_expr(s, lval);
+    IrIns *l = NULL, *al, *ah, *bl, *bh, *lo, *hi;
+    if (is_lval_load(addr)) {
+        l = addr;
+        addr = load_addr(l);
+    } else {
+        load_i128(s, addr, &al, &ah);
+    }
+    if (op_t->k == T_I128) {
+        if (l) {
+            i128_from(s, l, lval->t, op_t, &al, &ah);
+        }
+        compile_i128(s, n->r, &bl, &bh);
+        emit_i128_arith(s, op, al, ah, bl, bh, &lo, &hi);
+        if (l) {
+            IrIns *v = i128_to(s, lo, hi, op_t, lval->t);
+            emit_store(s, addr, v, lval->t);
+            return v;
+        }
+    } else { // e.g., 'x += 1.5' for a '__int128 x'
+        IrIns *v = i128_to(s, al, ah, lval->t, op_t);
+        IrIns *r = discharge(s, compile_expr(s, n->r));
+        IrIns *result = emit(s, op, v->t);
+        result->l = v;
+        result->r = r;
+        i128_from(s, result, op_t, lval->t, &lo, &hi);
+    }
+    store_i128(s, addr, lo, hi);
+    return emit_i128(s, lo, hi);
+}
+
+static IrIns * compile_i128_inc_dec(Scope *s, AstNode *n) {
+    IrIns *addr = discharge(s, compile_expr(s, n->l));
+    IrIns *lo, *hi, *new_lo, *new_hi;
+    load_i128(s, addr, &lo, &hi);
+    IrIns *one = emit_imm(s, irt_scalar(IRT_I64), 1);
+    IrIns *zero = emit_imm(s, irt_scalar(IRT_I64), 0);
+    int is_sub = (n->k == N_PRE_DEC || n->k == N_POST_DEC);
+    emit_i128_arith(s, is_sub ? IR_SUB : IR_ADD, lo, hi, one, zero, &new_lo, &new_hi);
+    store_i128(s, addr, new_lo, new_hi);
+    if (n->k == N_PRE_INC || n->k == N_PRE_DEC) {
+        return emit_i128(s, new_lo, new_hi);
+    } else {
+        return emit_i128(s, lo, hi);
+    }
+}
+
+// A '__int128' condition is whether either half's non-zero
+static IrIns * compile_str_builtin(Scope *s, AstNode *n, int as_cond);
+
+static IrIns * compile_cond(Scope *s, AstNode *n) {
+    if (n->k == N_BUILTIN && (n->builtin == B_MEMCMP || n->builtin == B_STRCMP)) {
+        return to_cond(s, compile_str_builtin(s, n, 1));
+    } else if (n->t->k != T_I128) {
+        return to_cond(s, compile_expr(s, n));
+    }
+    IrIns *lo, *hi;
+    compile_i128(s, n, &lo, &hi);
+    return to_cond(s, emit_half_op(s, IR_BIT_OR, lo, hi));
+}
+
 static IrIns * compile_operand(Scope *s, AstNode *n) {
     IrIns *ins;
     Global *g;
     switch (n->k) {
     case N_IMM:
+        if (n->t->k == T_I128) {
+            ins = compile_i128_value(s, n);
+            break;
+        }
         ins = emit(s, IR_IMM, irt_conv(n->t));
         ins->imm = n->imm;
         break;
@@ -573,12 +1877,15 @@ static IrIns * compile_operand(Scope *s, AstNode *n) {
         ins->fp = n->fp;
         break;
     case N_STR:
-        assert(n->t->k == T_PTR);
-        ins = emit(s, IR_GLOBAL, irt_new(IRT_PTR));
-        ins->g = def_const_global(s, n);
+        assert(n->t->k == T_ARR); // Its address, as for any array
+        ins = emit(s, IR_GLOBAL, irt_scalar(IRT_PTR));
+        ins->g = def_str_global(s, n);
         break;
     case N_INIT:
         ins = compile_init(s, n);
+        if (n->t->k == T_VEC) { // A value, not an object
+            ins = emit_load(s, ins, n->t);
+        }
         break;
     case N_LOCAL:
         ins = find_local(s, n->var_name); // 'IR_ALLOC' ins
@@ -588,7 +1895,7 @@ static IrIns * compile_operand(Scope *s, AstNode *n) {
     case N_GLOBAL:
         g = find_global(s, n->var_name);
         assert(g); // Checked by parser
-        ins = emit(s, IR_GLOBAL, irt_new(IRT_PTR));
+        ins = emit(s, IR_GLOBAL, irt_scalar(IRT_PTR));
         ins->g = g;
         ins = emit_load(s, ins, n->t);
         break;
@@ -601,6 +1908,9 @@ static IrIns * compile_operand(Scope *s, AstNode *n) {
 }
 
 static IrIns * compile_binop(Scope *s, AstNode *n, int op) {
+    if (n->l->t->k == T_I128) {
+        return compile_i128_binop(s, n, op);
+    }
     IrIns *l = discharge(s, compile_expr(s, n->l));
     IrIns *r = discharge(s, compile_expr(s, n->r));
     IrIns *ins = emit(s, op, irt_conv(n->t));
@@ -665,7 +1975,7 @@ static IrIns * compile_ptr_arith(Scope *s, AstNode *n) { // <ptr> +/- <int>
     IrIns *mul = emit(s, IR_MUL, offset->t);
     mul->l = offset;
     mul->r = scale;
-    IrIns *idx = emit(s, IR_PTRADD, irt_new(IRT_PTR));
+    IrIns *idx = emit(s, IR_PTRADD, irt_scalar(IRT_PTR));
     idx->base = ptr;
     idx->offset = mul;
     return idx;
@@ -675,9 +1985,9 @@ static void emit_store(Scope *s, IrIns *dst, IrIns *src, AstType *t) {
     // 'src_t' is the type of the object to store into the pointer 'dst'
     assert(dst->t->k == IRT_PTR);
     assert(t->k != T_ARR); // Checked by parser
-    if (t->k == T_STRUCT || t->k == T_UNION) { // Use IR_COPY for aggregates
-        IrIns *size = emit(s, IR_IMM, irt_new(IRT_I64));
-        size->imm = src->t->size;
+    if (t->k == T_STRUCT || t->k == T_UNION || t->k == T_I128) { // Use IR_COPY for aggregates
+        IrIns *size = emit(s, IR_IMM, irt_scalar(IRT_I64));
+        size->imm = t->size;
         IrIns *copy = emit(s, IR_COPY, NULL);
         copy->src = src;
         copy->dst = dst;
@@ -690,20 +2000,102 @@ static void emit_store(Scope *s, IrIns *dst, IrIns *src, AstType *t) {
 }
 
 static IrIns * compile_assign(Scope *s, AstNode *n) {
+    if (bit_field(n->l)) {
+        return compile_bit_field_assign(s, n);
+    }
     IrIns *r = discharge(s, compile_expr(s, n->r));
     IrIns *l = compile_expr(s, n->l);
     IrIns *dst;
-    if (l->op == IR_LOAD) { // Base types
-        dst = l->src;
+    if (is_lval_load(l)) { // Base types
+        dst = load_addr(l);
         delete_ir(l);
     } else { // Aggregates (T_STRUCT, T_UNION)
         dst = l;
     } // Can't assign to T_ARR
-    emit_store(s, dst, r, n->r->t);
+    if (l->op == IR_ATOMIC_LOAD) {
+        emit_atomic(s, IR_ATOMIC_STORE, NULL, dst, r, MO_SEQ_CST);
+    } else {
+        emit_store(s, dst, r, n->r->t);
+    }
     return r; // Assignment evaluates to its right operand
 }
 
+// Read-modify-writes of an '_Atomic' object that there's no single x86
+// instruction for are a loop around a compare-and-swap, which tries again
+// with whatever another thread stored in the meantime:
+//   before: first = atomic_load addr; br loop
+//   loop:   old = phi [before: first], [loop: seen]
+//           new = <op> old, r
+//           seen = atomic_cas addr, old, new
+//           condbr seen == old, after, loop
+// 'op' is done in 'op_t', which the object's type 't' is converted to and
+// from. Returns the new value, and puts the old one in 'old'
+static IrIns * emit_cas_loop(Scope *s, IrIns *addr, AstType *t, int op, IrIns *r,
+                             AstType *op_t, IrIns **old) {
+    IrType *irt = irt_conv(t);
+    IrIns *first = emit_atomic(s, IR_ATOMIC_LOAD, irt, addr, NULL, MO_RELAXED);
+    IrIns *before_br = emit(s, IR_BR, NULL);
+    BB *loop = emit_bb(s);
+    before_br->br = loop;
+    IrIns *phi = emit(s, IR_PHI, irt);
+    IrIns *l = emit_conv(s, phi, t, irt_conv(op_t));
+    IrIns *new = emit(s, op, l->t);
+    new->l = l;
+    new->r = r;
+    new = emit_conv(s, new, op_t, irt);
+    IrIns *seen = emit_atomic(s, IR_ATOMIC_CAS, irt, addr, new, MO_SEQ_CST);
+    seen->expected = phi;
+    IrIns *ok = emit(s, IR_EQ, irt_scalar(IRT_I32));
+    ok->l = seen;
+    ok->r = phi;
+    IrIns *br = emit(s, IR_CONDBR, NULL);
+    br->cond = ok;
+    br->false = loop;
+    br->true = emit_bb(s);
+    add_phi(phi, before_br->bb, first);
+    add_phi(phi, loop, seen);
+    *old = phi;
+    return new;
+}
+
+// '+=' and '-=' on an integer are a 'lock xadd' (returning the old value, which
+// the new one is worked out from); anything else is a compare-and-swap loop
+static IrIns * compile_atomic_arith_assign(Scope *s, AstNode *n, int op) {
+    AstNode *lval = n->l->k == N_CONV ? n->l->l : n->l;
+    AstType *t = lval->t;
+    IrType *irt = irt_conv(t);
+    IrIns *l = compile_expr(s, lval);
+    IrIns *addr = load_addr(l);
+    delete_ir(l);
+    IrIns *r = discharge(s, compile_expr(s, n->r));
+    IrIns *old;
+    if ((op == IR_ADD || op == IR_SUB) && t->k != T_PTR) {
+        r = emit_conv(s, r, n->r->t, irt); // Same low bits, whatever the type
+        IrIns *delta = r;
+        if (op == IR_SUB) {
+            IrIns *zero = emit(s, IR_IMM, irt);
+            zero->imm = 0;
+            delta = emit(s, IR_SUB, irt);
+            delta->l = zero;
+            delta->r = r;
+        }
+        old = emit_atomic(s, IR_ATOMIC_ADD, irt, addr, delta, MO_SEQ_CST);
+        IrIns *new = emit(s, op, irt);
+        new->l = old;
+        new->r = r;
+        return new;
+    }
+    return emit_cas_loop(s, addr, t, op, r, n->l->t, &old);
+}
+
 static IrIns * compile_arith_assign(Scope *s, AstNode *n, int op) {
+    if (n->l->t->is_atomic || (n->l->k == N_CONV && n->l->l->t->is_atomic)) {
+        return compile_atomic_arith_assign(s, n, op);
+    } else if (n->l->t->k == T_I128 || (n->l->k == N_CONV && n->l->l->t->k == T_I128)) {
+        return compile_i128_arith_assign(s, n, op);
+    } else if (bit_field(n->l->k == N_CONV ? n->l->l : n->l)) {
+        return compile_bit_field_arith_assign(s, n, op);
+    }
     IrIns *binop = compile_binop(s, n, op);
 
     IrIns *lvalue = binop->l;
@@ -719,28 +2111,28 @@ static IrIns * compile_arith_assign(Scope *s, AstNode *n, int op) {
     IrType *ir_target = irt_conv(target);
     // May need to emit a truncation, e.g. 'char a = 3; char *b = &a; *b += 1'
     if (binop->t->k != ir_target->k) {
-        emit_conv(s, binop, n->l->t, ir_target);
+        binop = emit_conv(s, binop, n->l->t, ir_target);
     }
     emit_store(s, lvalue->src, binop, n->t);
     return binop; // Assignment evaluates to its right operand
 }
 
 static IrIns * compile_and(Scope *s, AstNode *n) {
-    IrIns *l = to_cond(s, compile_expr(s, n->l));
+    IrIns *l = compile_cond(s, n->l);
     BB *r_bb = emit_bb(s);
     patch_branch_chain(l->true_chain, r_bb);
 
-    IrIns *r = to_cond(s, compile_expr(s, n->r));
+    IrIns *r = compile_cond(s, n->r);
     merge_branch_chains(r->false_chain, l->false_chain);
     return r;
 }
 
 static IrIns * compile_or(Scope *s, AstNode *n) {
-    IrIns *l = to_cond(s, compile_expr(s, n->l));
+    IrIns *l = compile_cond(s, n->l);
     BB *r_bb = emit_bb(s);
     patch_branch_chain(l->false_chain, r_bb);
 
-    IrIns *r = to_cond(s, compile_expr(s, n->r));
+    IrIns *r = compile_cond(s, n->r);
     merge_branch_chains(r->true_chain, l->true_chain);
     return r;
 }
@@ -751,7 +2143,7 @@ static IrIns * compile_comma(Scope *s, AstNode *n) {
 }
 
 static IrIns * compile_ternary(Scope *s, AstNode *n) {
-    IrIns *cond = to_cond(s, compile_expr(s, n->if_cond));
+    IrIns *cond = compile_cond(s, n->if_cond);
 
     BB *true_bb = emit_bb(s);
     patch_branch_chain(cond->true_chain, true_bb);
@@ -768,25 +2160,49 @@ static IrIns * compile_ternary(Scope *s, AstNode *n) {
     false_br->br = after;
 
     IrIns *phi = emit(s, IR_PHI, irt_conv(n->t));
-    add_phi(phi, true_bb, true);
-    add_phi(phi, false_bb, false);
+    add_phi(phi, true_br->bb, true); // Either body might have added more BBs
+    add_phi(phi, false_br->bb, false);
     return phi;
 }
 
+// Splatted over every lane if 't' is a vector
+static IrIns * emit_lanes_imm(Scope *s, IrType *t, uint64_t imm) {
+    IrIns *k = emit(s, IR_IMM, t->k == IRT_VEC ? t->elem : t);
+    k->imm = imm;
+    if (t->k != IRT_VEC) {
+        return k;
+    }
+    IrIns *splat = emit(s, IR_SPLAT, t);
+    splat->l = k;
+    return splat;
+}
+
+// A float is subtracted from -0.0, which (unlike 0.0) gives -0.0 for 0.0
 static IrIns * compile_neg(Scope *s, AstNode *n) {
+    if (n->t->k == T_I128) {
+        return compile_i128_value(s, n);
+    }
     IrIns *l = discharge(s, compile_expr(s, n->l));
-    IrIns *zero = emit(s, IR_IMM, irt_conv(n->t));
-    zero->imm = 0;
-    IrIns *sub = emit(s, IR_SUB, irt_conv(n->t));
+    IrType *t = irt_conv(n->t);
+    IrIns *zero;
+    if (t->k == IRT_F32 || t->k == IRT_F64) {
+        zero = emit(s, IR_FP, t);
+        zero->fp = -0.0;
+    } else {
+        zero = emit_lanes_imm(s, t, 0);
+    }
+    IrIns *sub = emit(s, IR_SUB, t);
     sub->l = zero;
     sub->r = l;
     return sub;
 }
 
 static IrIns * compile_bit_not(Scope *s, AstNode *n) {
+    if (n->t->k == T_I128) {
+        return compile_i128_value(s, n);
+    }
     IrIns *l = discharge(s, compile_expr(s, n->l));
-    IrIns *neg1 = emit(s, IR_IMM, irt_conv(n->t));
-    neg1->imm = -1;
+    IrIns *neg1 = emit_lanes_imm(s, irt_conv(n->t), -1);
     IrIns *xor = emit(s, IR_BIT_XOR, irt_conv(n->t));
     xor->l = l;
     xor->r = neg1;
@@ -794,7 +2210,7 @@ static IrIns * compile_bit_not(Scope *s, AstNode *n) {
 }
 
 static IrIns * compile_log_not(Scope *s, AstNode *n) {
-    IrIns *l = to_cond(s, compile_expr(s, n->l));
+    IrIns *l = compile_cond(s, n->l);
     assert(l->op == IR_CONDBR);
     Vec *swap = l->true_chain; // Swap true and false chains
     l->true_chain = l->false_chain;
@@ -802,21 +2218,62 @@ static IrIns * compile_log_not(Scope *s, AstNode *n) {
     return l;
 }
 
+// An '_Atomic' object is incremented or decremented with 'lock xadd'
+static IrIns * compile_atomic_inc_dec(Scope *s, AstNode *n) {
+    int is_sub = (n->k == N_PRE_DEC || n->k == N_POST_DEC);
+    AstType *t = n->l->t;
+    IrType *irt = irt_conv(t);
+    IrIns *l = compile_expr(s, n->l);
+    IrIns *addr = load_addr(l);
+    delete_ir(l);
+    uint64_t step = t->k == T_PTR ? t->ptr->size : 1;
+    IrIns *delta = emit(s, IR_IMM, t->k == T_PTR ? irt_scalar(IRT_I64) : irt);
+    delta->imm = is_sub ? (uint64_t) -(int64_t) step : step;
+    IrIns *old = emit_atomic(s, IR_ATOMIC_ADD, irt, addr, delta, MO_SEQ_CST);
+    if (n->k == N_POST_INC || n->k == N_POST_DEC) {
+        return old;
+    }
+    IrIns *new = emit(s, t->k == T_PTR ? IR_PTRADD : IR_ADD, irt);
+    new->l = old;
+    new->r = delta;
+    return new;
+}
+
 static IrIns * compile_inc_dec(Scope *s, AstNode *n) {
+    if (n->l->t->is_atomic) {
+        return compile_atomic_inc_dec(s, n);
+    } else if (n->t->k == T_I128) {
+        return compile_i128_inc_dec(s, n);
+    } else if (bit_field(n->l)) {
+        return compile_bit_field_inc_dec(s, n);
+    }
     int is_sub = (n->k == N_PRE_DEC || n->k == N_POST_DEC);
     AstType ptr_t = { .k = T_LLONG, .is_unsigned = 1 };
     AstType *t = n->t->k == T_PTR ? &ptr_t : n->t;
     AstNode one = { .k = N_IMM, .t = t, .imm = 1 };
     AstNode op = { .k = is_sub ? N_SUB : N_ADD, .t = n->t, .l = n->l, .r = &one };
     IrIns *result = compile_expr(s, &op);
-    IrIns *lvalue = result->l;
+    IrIns *old = result->l;
+    IrIns *lvalue = old;
+    AstType *target = n->l->t;
+    if (n->l->k == N_CONV) { // Small types are promoted, e.g. 'char c; c++'
+        lvalue = lvalue->l;
+        target = n->l->l->t;
+    }
     assert(lvalue->op == IR_LOAD);
-    emit_store(s, lvalue->src, result, n->t);
+    IrType *ir_target = irt_conv(target);
+    if (result->t->k != ir_target->k) { // Truncate, then promote again
+        IrIns *truncated = emit_conv(s, result, n->t, ir_target);
+        emit_store(s, lvalue->src, truncated, target);
+        result = emit_conv(s, truncated, target, result->t);
+    } else {
+        emit_store(s, lvalue->src, result, target);
+    }
     int is_prefix = (n->k == N_PRE_INC || n->k == N_PRE_DEC);
     if (is_prefix) {
         return result;
     } else {
-        return lvalue;
+        return old;
     }
 }
 
@@ -827,15 +2284,27 @@ static IrIns * compile_deref(Scope *s, AstNode *n) {
 
 static IrIns * compile_addr(Scope *s, AstNode *n) {
     IrIns *l = compile_expr(s, n->l);
-    if (l->op == IR_LOAD) { // Base types
+    if (is_lval_load(l)) { // Base types
         delete_ir(l);
-        return l->src;
+        return load_addr(l);
     } else { // Aggregates (T_ARR, T_STRUCT, T_UNION) and T_FN
         return l;
     }
 }
 
+static void add_goto(Scope *s, char *label, BB **br, Token *err);
+
+// The label's BB is filled in with the gotos' (see 'resolve_gotos')
+static IrIns * compile_label_addr(Scope *s, AstNode *n) {
+    IrIns *ins = emit(s, IR_BB_ADDR, irt_conv(n->t));
+    add_goto(s, n->goto_label, &ins->label_bb, n->tk);
+    return ins;
+}
+
 static IrIns * compile_conv(Scope *s, AstNode *n) {
+    if (n->t->k == T_I128 || n->l->t->k == T_I128) {
+        return compile_i128_conv(s, n);
+    }
     IrIns *l = discharge(s, compile_expr(s, n->l));
     return emit_conv(s, l, n->l->t, irt_conv(n->t));
 }
@@ -849,9 +2318,9 @@ static IrIns * compile_array_access(Scope *s, AstNode *n) {
 static IrIns * compile_struct_field_access(Scope *s, AstNode *n) {
     IrIns *ptr = discharge(s, compile_expr(s, n->obj));
     Field *f = vec_get(n->obj->t->fields, n->field_idx);
-    IrIns *offset = emit(s, IR_IMM, irt_new(IRT_I64));
+    IrIns *offset = emit(s, IR_IMM, irt_scalar(IRT_I64));
     offset->imm = f->offset;
-    IrIns *idx = emit(s, IR_PTRADD, irt_new(IRT_PTR));
+    IrIns *idx = emit(s, IR_PTRADD, irt_scalar(IRT_PTR));
     idx->base = ptr;
     idx->offset = offset;
     return emit_load(s, idx, f->t);
@@ -863,35 +2332,522 @@ static IrIns * compile_union_field_access(Scope *s, AstNode *n) {
     return emit_load(s, obj, ft);
 }
 
-static IrIns * compile_field_access(Scope *s, AstNode *n) {
-    assert(n->obj->t->k == T_STRUCT || n->obj->t->k == T_UNION);
-    if (n->obj->t->k == T_STRUCT) {
-        return compile_struct_field_access(s, n);
-    } else { // T_UNION
-        return compile_union_field_access(s, n);
+static IrIns * compile_field_access(Scope *s, AstNode *n) {
+    assert(n->obj->t->k == T_STRUCT || n->obj->t->k == T_UNION);
+    Field *f = bit_field(n);
+    if (f) {
+        return load_bit_field(s, compile_bit_field_unit(s, n, f), f, n->t);
+    } else if (n->obj->t->k == T_STRUCT) {
+        return compile_struct_field_access(s, n);
+    } else { // T_UNION
+        return compile_union_field_access(s, n);
+    }
+}
+
+static IrIns * compile_call(Scope *s, AstNode *n) {
+    AstType *fn_t = n->fn->t;
+    if (fn_t->k == T_PTR) {
+        fn_t = fn_t->ptr;
+    }
+    assert(fn_t->k == T_FN);
+    IrIns *fn = discharge(s, compile_expr(s, n->fn));
+    IrIns *args[vec_len(n->args)];
+    for (size_t i = 0; i < vec_len(n->args); i++) {
+        AstNode *arg = vec_get(n->args, i);
+        args[i] = discharge(s, compile_expr(s, arg));
+    }
+    IrIns *call = emit(s, IR_CALL, irt_conv(n->t));
+    call->fn = fn;
+    call->is_vararg = fn_t->is_vararg;
+    for (size_t i = 0; i < vec_len(n->args); i++) {
+        AstNode *arg = vec_get(n->args, i);
+        IrIns *carg = emit(s, IR_CARG, irt_conv(arg->t));
+        carg->arg = args[i];
+    }
+    return call;
+}
+
+// For a '__builtin_...' that can't be inlined, e.g., a 'memcpy' of a size
+// that's only known at run time. The program doesn't have to declare it
+static IrIns * emit_lib_fn(Scope *s, char *name) {
+    name = intern(name); // Scopes are keyed by interned names
+    Global *g = find_global(s, name);
+    if (!g) {
+        char *label = prepend_underscore(name);
+        g = new_global(label, irt_scalar(IRT_PTR), LINK_EXTERN);
+        def_global(s, name, g);
+    }
+    IrIns *fn = emit(s, IR_GLOBAL, irt_scalar(IRT_PTR));
+    fn->g = g;
+    return fn;
+}
+
+static IrIns * emit_lib_call(Scope *s, char *name, IrIns **args, int num_args,
+                             IrType *t) {
+    IrIns *fn = emit_lib_fn(s, name);
+    IrIns *call = emit(s, IR_CALL, t);
+    call->fn = fn;
+    call->is_vararg = 0;
+    for (int i = 0; i < num_args; i++) {
+        IrIns *carg = emit(s, IR_CARG, args[i]->t);
+        carg->arg = args[i];
+    }
+    return call;
+}
+
+static void mark_likely(Vec *chain, int likely) {
+    for (size_t i = 0; i < vec_len(chain); i++) {
+        BrChain *bc = vec_get(chain, i);
+        IrIns *br = bc->ins;
+        br->likely = bc->bb == &br->true ? likely : -likely;
+    }
+}
+
+// '__builtin_expect(e, c)' is just 'e', but if 'c' is a constant, the branches
+// on 'e' are marked as likely to go the way 'c' says (see 'layout_bbs')
+static IrIns * compile_expect(Scope *s, AstNode *n) {
+    AstNode *e = vec_get(n->args, 0), *c = vec_get(n->args, 1);
+    if (c->k != N_IMM) {
+        return compile_expr(s, e);
+    }
+    if (e->k == N_CONV && is_int(irt_conv(e->l->t))) {
+        e = e->l; // Whether it's 0 doesn't depend on its size
+    }
+    IrIns *br = compile_cond(s, e);
+    mark_likely(br->true_chain, c->imm ? 1 : -1);
+    mark_likely(br->false_chain, c->imm ? -1 : 1);
+    return br;
+}
+
+// '__builtin_assume_aligned(p, align, offset)' is just 'p', through an
+// IR_BITCAST that records what's known of its alignment (see 'ptr_align'): the
+// lowest set bit of 'offset' if it's not a multiple of 'align'
+static IrIns * compile_assume_aligned(Scope *s, AstNode *n) {
+    IrIns *ptr = discharge(s, compile_expr(s, vec_get(n->args, 0)));
+    uint64_t align = ((AstNode *) vec_get(n->args, 1))->imm;
+    if (vec_len(n->args) == 3) {
+        AstNode *offset = vec_get(n->args, 2);
+        if (offset->k != N_IMM) {
+            compile_expr(s, offset); // Only evaluated for its side effects
+            return ptr;
+        }
+        uint64_t rem = offset->imm & (align - 1);
+        align = rem ? rem & -rem : align;
+    }
+    IrIns *cast = emit(s, IR_BITCAST, ptr->t);
+    cast->l = ptr;
+    cast->assumed_align = (size_t) align;
+    return cast;
+}
+
+// '__builtin_prefetch(p, rw, locality)'; x86 has no hint for a write without
+// 'prefetchw' (which not every CPU has), so 'rw' is ignored, as GCC does by
+// default
+static IrIns * compile_prefetch(Scope *s, AstNode *n) {
+    IrIns *ptr = discharge(s, compile_expr(s, vec_get(n->args, 0)));
+    IrIns *prefetch = emit(s, IR_PREFETCH, NULL);
+    prefetch->ptr = ptr;
+    prefetch->locality = vec_len(n->args) == 3 ?
+        (int) ((AstNode *) vec_get(n->args, 2))->imm : 3;
+    return prefetch;
+}
+
+// Anything after '__builtin_unreachable()' goes in a new BB with no
+// predecessors, like the code after a 'goto'
+static IrIns * compile_unreachable(Scope *s) {
+    IrIns *unreachable = emit(s, IR_UNREACHABLE, NULL);
+    emit_bb(s);
+    return unreachable;
+}
+
+// '__builtin_assume(cond)' is 'if (!cond) __builtin_unreachable()'. The branch
+// lasts until 'dce' folds it away, so the passes before can use what it says
+// about 'cond' (see 'simplify_bits')
+static IrIns * compile_assume(Scope *s, AstNode *n) {
+    AstNode *cond = vec_get(n->args, 0);
+    if (cond->k == N_IMM && cond->imm != 0) {
+        return emit(s, IR_IMM, irt_scalar(IRT_I32)); // Says nothing
+    }
+    IrIns *br = compile_cond(s, cond);
+    BB *never = emit_bb(s);
+    patch_branch_chain(br->false_chain, never);
+    IrIns *unreachable = compile_unreachable(s);
+    patch_branch_chain(br->true_chain, s->fn->last);
+    return unreachable;
+}
+
+static IrIns * compile_bits(Scope *s, AstNode *n, int op) {
+    AstNode *arg = vec_get(n->args, 0);
+    IrIns *l = discharge(s, compile_expr(s, arg));
+    IrIns *bits = emit(s, op, l->t);
+    bits->l = l;
+    return emit_conv(s, bits, arg->t, irt_conv(n->t));
+}
+
+// There's no 16-bit 'bswap', so the bytes end up in the top half of a 32-bit
+// one instead
+static IrIns * compile_bswap(Scope *s, AstNode *n) {
+    if (n->t->size != 2) {
+        return compile_bits(s, n, IR_BSWAP);
+    }
+    AstNode *arg = vec_get(n->args, 0);
+    IrIns *l = discharge(s, compile_expr(s, arg));
+    l = emit_conv(s, l, arg->t, irt_scalar(IRT_I32));
+    IrIns *swap = emit(s, IR_BSWAP, l->t);
+    swap->l = l;
+    IrIns *sixteen = emit(s, IR_IMM, l->t);
+    sixteen->imm = 16;
+    IrIns *shr = emit(s, IR_SHR, l->t);
+    shr->l = swap;
+    shr->r = sixteen;
+    IrIns *trunc = emit(s, IR_TRUNC, irt_conv(n->t));
+    trunc->l = shr;
+    return trunc;
+}
+
+// A 'memcpy' of a known size, or a 'memset' to 0, is an IR_COPY or IR_ZERO,
+// which can be unrolled and optimised like any other; anything else is left
+// to the library
+static IrIns * compile_mem_builtin(Scope *s, AstNode *n) {
+    IrIns *args[3];
+    for (int i = 0; i < 3; i++) {
+        args[i] = discharge(s, compile_expr(s, vec_get(n->args, i)));
+    }
+    AstNode *val = vec_get(n->args, 1), *size = vec_get(n->args, 2);
+    char *lib_fn = n->builtin == B_MEMCPY ? "memcpy" : "memset";
+    if (size->k != N_IMM) {
+        return emit_lib_call(s, lib_fn, args, 3, irt_conv(n->t));
+    } else if (n->builtin == B_MEMCPY) {
+        IrIns *copy = emit(s, IR_COPY, NULL);
+        copy->dst = args[0];
+        copy->src = args[1];
+        copy->len = args[2];
+    } else if (val->k == N_IMM && (uint8_t) val->imm == 0) {
+        IrIns *zero = emit(s, IR_ZERO, NULL);
+        zero->ptr = args[0];
+        zero->size = args[2];
+    } else {
+        return emit_lib_call(s, lib_fn, args, 3, irt_conv(n->t));
+    }
+    return args[0];
+}
+
+#define MAX_INLINE_CMP 16 // Most bytes an inline 'memcmp' or 'strcmp' compares
+
+// The string literal that 'arg' is, under its conversion to a pointer, or NULL
+static AstNode * str_literal(AstNode *arg) {
+    while (arg->k == N_CONV) {
+        arg = arg->l;
+    }
+    return arg->k == N_STR && arg->enc == ENC_NONE ? arg : NULL;
+}
+
+// The sign of the library's result, for operands that are both literals
+static int cmp_bytes(char *l, char *r, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (l[i] != r[i]) {
+            return (uint8_t) l[i] < (uint8_t) r[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// 'size' bytes at 'offset' in an operand of an inline comparison, zero
+// extended to 't'. A literal's bytes are an immediate rather than a load
+static IrIns * emit_cmp_chunk(Scope *s, IrIns *ptr, AstNode *lit, size_t offset,
+                              size_t size, IrType *t) {
+    if (lit) {
+        uint64_t imm = 0;
+        for (size_t i = 0; i < size; i++) {
+            imm |= (uint64_t) (uint8_t) lit->str[offset + i] << (i * 8);
+        }
+        return emit_imm(s, t, imm);
+    }
+    if (offset > 0) {
+        IrIns *k = emit_imm(s, irt_scalar(IRT_I64), offset);
+        IrIns *ptradd = emit(s, IR_PTRADD, irt_scalar(IRT_PTR));
+        ptradd->base = ptr;
+        ptradd->offset = k;
+        ptr = ptradd;
+    }
+    IrIns *load = emit(s, IR_LOAD, irt_scalar(size == 1 ? IRT_I8 : size == 2 ? IRT_I16 :
+                                              size == 4 ? IRT_I32 : IRT_I64));
+    load->src = ptr;
+    if (load->t->size == t->size) {
+        return load;
+    }
+    IrIns *ext = emit(s, IR_ZEXT, t);
+    ext->l = load;
+    return ext;
+}
+
+// Compares the operands a chunk of 'sizes[i]' bytes at a time, branching out
+// as soon as a pair differs to work out their order (-1 or 1, since the
+// library only promises the sign) from that pair, byte swapped so their first
+// bytes are the most significant. Equal operands give 0:
+//   chunk0: condbr l0 != r0, diff, chunk1
+//   ...
+//   diff:   l = phi l0, l1, ...; r = phi r0, r1, ...
+//           order = select bswap(l) > bswap(r), 1, -1; br join
+//   join:   phi [chunkN: 0], [diff: order]
+// If only whether they're equal matters ('as_cond'), the branches out are the
+// true chain of the condition instead, and there's no 'diff' or 'join'
+static IrIns * emit_cmp_chunks(Scope *s, IrIns **ptrs, AstNode **lits,
+                               size_t *sizes, int num_chunks, int as_cond) {
+    int wide = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        wide |= sizes[i] > 1;
+    }
+    IrType *t = irt_scalar(wide ? IRT_I64 : IRT_I32), *i32 = irt_scalar(IRT_I32);
+    IrIns *brs[MAX_INLINE_CMP], *l[MAX_INLINE_CMP], *r[MAX_INLINE_CMP];
+    size_t offset = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        if (i > 0) {
+            brs[i - 1]->false = emit_bb(s);
+        }
+        l[i] = emit_cmp_chunk(s, ptrs[0], lits[0], offset, sizes[i], t);
+        r[i] = emit_cmp_chunk(s, ptrs[1], lits[1], offset, sizes[i], t);
+        IrIns *neq = emit(s, IR_NEQ, i32);
+        neq->l = l[i];
+        neq->r = r[i];
+        brs[i] = emit(s, IR_CONDBR, NULL);
+        brs[i]->cond = neq;
+        offset += sizes[i];
+    }
+    IrIns *last = brs[num_chunks - 1];
+    if (as_cond) {
+        for (int i = 0; i < num_chunks; i++) {
+            add_to_branch_chain(last->true_chain, &brs[i]->true, brs[i]);
+        }
+        add_to_branch_chain(last->false_chain, &last->false, last);
+        return last;
+    }
+    BB *diff = emit_bb(s);
+    IrIns *l_phi = emit(s, IR_PHI, t), *r_phi = emit(s, IR_PHI, t);
+    for (int i = 0; i < num_chunks; i++) {
+        brs[i]->true = diff;
+        add_phi(l_phi, brs[i]->bb, l[i]);
+        add_phi(r_phi, brs[i]->bb, r[i]);
+    }
+    if (wide) {
+        IrIns *swapped = emit(s, IR_BSWAP, t);
+        swapped->l = l_phi;
+        l_phi = swapped;
+        swapped = emit(s, IR_BSWAP, t);
+        swapped->l = r_phi;
+        r_phi = swapped;
+    }
+    IrIns *gt = emit(s, IR_UGT, i32);
+    gt->l = l_phi;
+    gt->r = r_phi;
+    IrIns *one = emit_imm(s, i32, 1), *minus_one = emit_imm(s, i32, (uint64_t) -1);
+    IrIns *order = emit(s, IR_SELECT, i32);
+    order->sel = gt;
+    order->l = one;
+    order->r = minus_one;
+    IrIns *diff_br = emit(s, IR_BR, NULL);
+    BB *join = emit_bb(s);
+    diff_br->br = join;
+    last->false = join;
+    IrIns *zero = emit_imm(s, i32, 0);
+    IrIns *phi = emit(s, IR_PHI, i32);
+    add_phi(phi, last->bb, zero);
+    add_phi(phi, diff_br->bb, order);
+    return phi;
+}
+
+// A 'memcmp' of a constant size, or a 'strcmp' against a string literal, is
+// expanded inline if it compares at most 'MAX_INLINE_CMP' bytes: a 'memcmp' 8,
+// 4, 2, then 1 byte at a time (so 4 bytes are one 32-bit compare), and a
+// 'strcmp' a byte at a time, so it never reads past the end of the other
+// string. Either is folded if both operands are literals, as is a 'strlen' of
+// one. Anything else is left to the library. 'as_cond' is for a condition
+// (see 'emit_cmp_chunks')
+static IrIns * compile_str_builtin(Scope *s, AstNode *n, int as_cond) {
+    int num_args = (int) vec_len(n->args);
+    AstNode *lits[2] = { str_literal(vec_get(n->args, 0)), NULL };
+    if (num_args > 1) {
+        lits[1] = str_literal(vec_get(n->args, 1));
+    }
+    size_t len = 0; // Bytes compared
+    int can_inline = 0;
+    if (n->builtin == B_MEMCMP) {
+        AstNode *size = vec_get(n->args, 2);
+        len = size->k == N_IMM ? size->imm : 0;
+        can_inline = size->k == N_IMM && (!lits[0] || lits[0]->len >= len) &&
+            (!lits[1] || lits[1]->len >= len) &&
+            (len <= MAX_INLINE_CMP || (lits[0] && lits[1]));
+    } else if (n->builtin == B_STRCMP && (lits[0] || lits[1])) {
+        AstNode *lit = lits[0] ? lits[0] : lits[1];
+        len = strnlen(lit->str, lit->len) + 1; // Including the terminator
+        can_inline = len <= MAX_INLINE_CMP || (lits[0] && lits[1]);
+    } else if (n->builtin == B_STRLEN && lits[0]) {
+        return emit_imm(s, irt_conv(n->t), strnlen(lits[0]->str, lits[0]->len));
+    }
+    IrIns *args[3] = { NULL, NULL, NULL };
+    for (int i = 0; i < num_args; i++) {
+        if (!can_inline || (i < 2 && !lits[i])) {
+            args[i] = discharge(s, compile_expr(s, vec_get(n->args, i)));
+        }
+    }
+    if (!can_inline) {
+        char *lib_fn = n->builtin == B_MEMCMP ? "memcmp" :
+                       n->builtin == B_STRCMP ? "strcmp" : "strlen";
+        return emit_lib_call(s, lib_fn, args, num_args, irt_conv(n->t));
+    } else if (lits[0] && lits[1]) {
+        return emit_imm(s, irt_conv(n->t), (uint64_t) cmp_bytes(lits[0]->str, lits[1]->str, len));
+    } else if (len == 0) {
+        return emit_imm(s, irt_conv(n->t), 0);
+    }
+    size_t sizes[MAX_INLINE_CMP];
+    int num_chunks = 0;
+    for (size_t left = len; left > 0; left -= sizes[num_chunks++]) {
+        size_t size = n->builtin == B_STRCMP ? 1 : 8;
+        while (size > left) {
+            size /= 2;
+        }
+        sizes[num_chunks] = size;
+    }
+    return emit_cmp_chunks(s, args, lits, sizes, num_chunks, as_cond);
+}
+
+static int is_zero(AstNode *n) {
+    return n->k == N_IMM && n->imm == 0 && n->t->k != T_I128;
+}
+
+// 'memcmp(...) == 0' (or 'strcmp', either way round, or '!=') only depends on
+// whether the operands are equal, so it's compiled as a condition
+static IrIns * compile_eq(Scope *s, AstNode *n, int op) {
+    AstNode *cmp = is_zero(n->r) ? n->l : is_zero(n->l) ? n->r : NULL;
+    if (!cmp || cmp->k != N_BUILTIN ||
+            (cmp->builtin != B_MEMCMP && cmp->builtin != B_STRCMP)) {
+        return compile_binop(s, n, op);
+    }
+    IrIns *br = compile_cond(s, cmp); // True if they differ
+    if (op == IR_EQ) {
+        Vec *swap = br->true_chain;
+        br->true_chain = br->false_chain;
+        br->false_chain = swap;
+    }
+    return br;
+}
+
+// A memory order that isn't a constant (or isn't valid) is taken to be the
+// strongest, as GCC does
+static int mem_order(AstNode *arg) {
+    return arg->k == N_IMM && arg->imm <= MO_SEQ_CST ? (int) arg->imm : MO_SEQ_CST;
+}
+
+static int ATOMIC_RMW_OP[N_LAST] = {
+    [N_ADD] = IR_ADD, [N_SUB] = IR_SUB, [N_BIT_AND] = IR_BIT_AND,
+    [N_BIT_OR] = IR_BIT_OR, [N_BIT_XOR] = IR_BIT_XOR,
+};
+
+// '__atomic_fetch_add', '__atomic_add_fetch', etc., like 'compile_atomic_
+// arith_assign'
+static IrIns * compile_atomic_rmw(Scope *s, AstNode *n, IrIns *addr, AstType *t,
+                                  int order) {
+    IrType *irt = irt_conv(t);
+    IrIns *r = discharge(s, compile_expr(s, vec_get(n->args, 1)));
+    int op = ATOMIC_RMW_OP[n->builtin_op];
+    IrIns *old, *new;
+    if (op == IR_ADD || op == IR_SUB) {
+        IrIns *delta = r;
+        if (op == IR_SUB) {
+            IrIns *zero = emit(s, IR_IMM, irt);
+            zero->imm = 0;
+            delta = emit(s, IR_SUB, irt);
+            delta->l = zero;
+            delta->r = r;
+        }
+        old = emit_atomic(s, IR_ATOMIC_ADD, irt, addr, delta, order);
+        if (n->builtin == B_ATOMIC_FETCH_OP) {
+            return old;
+        }
+        new = emit(s, op, irt);
+        new->l = old;
+        new->r = r;
+    } else {
+        new = emit_cas_loop(s, addr, t, op, r, t, &old);
+    }
+    return n->builtin == B_ATOMIC_FETCH_OP ? old : new;
+}
+
+// '__atomic_compare_exchange_n(p, expected, desired, ...)' stores 'desired' if
+// '*p' is '*expected'; otherwise, it copies '*p' into '*expected'
+static IrIns * compile_atomic_cas(Scope *s, AstNode *n, IrIns *addr, AstType *t,
+                                  int order) {
+    IrType *irt = irt_conv(t);
+    IrIns *expected_ptr = discharge(s, compile_expr(s, vec_get(n->args, 1)));
+    IrIns *desired = discharge(s, compile_expr(s, vec_get(n->args, 2)));
+    IrIns *expected = emit(s, IR_LOAD, irt);
+    expected->src = expected_ptr;
+    IrIns *seen = emit_atomic(s, IR_ATOMIC_CAS, irt, addr, desired, order);
+    seen->expected = expected;
+    IrIns *ok = emit(s, IR_EQ, irt_scalar(IRT_I32));
+    ok->l = seen;
+    ok->r = expected;
+    IrIns *br = emit(s, IR_CONDBR, NULL);
+    br->cond = ok;
+    br->false = emit_bb(s);
+    IrIns *store = emit(s, IR_STORE, NULL);
+    store->dst = expected_ptr;
+    store->src = seen;
+    IrIns *after_br = emit(s, IR_BR, NULL);
+    br->true = after_br->br = emit_bb(s);
+    return ok;
+}
+
+static IrIns * compile_atomic_builtin(Scope *s, AstNode *n) {
+    int order = mem_order(vec_get(n->args, vec_len(n->args) - 1));
+    if (n->builtin == B_ATOMIC_FENCE || n->builtin == B_SIGNAL_FENCE) {
+        // A signal handler runs on the same CPU, so only the compiler has to
+        // keep the order (which any fence does)
+        return emit_atomic(s, IR_FENCE, NULL, NULL, NULL,
+                           n->builtin == B_SIGNAL_FENCE ? MO_RELAXED : order);
+    }
+    AstNode *ptr = vec_get(n->args, 0);
+    AstType *t = ptr->t->ptr;
+    IrType *irt = irt_conv(t);
+    IrIns *addr = discharge(s, compile_expr(s, ptr));
+    IrIns *val;
+    switch (n->builtin) {
+    case B_ATOMIC_LOAD:
+        return emit_atomic(s, IR_ATOMIC_LOAD, irt, addr, NULL, order);
+    case B_ATOMIC_STORE:
+        val = discharge(s, compile_expr(s, vec_get(n->args, 1)));
+        return emit_atomic(s, IR_ATOMIC_STORE, NULL, addr, val, order);
+    case B_ATOMIC_XCHG:
+        val = discharge(s, compile_expr(s, vec_get(n->args, 1)));
+        return emit_atomic(s, IR_ATOMIC_XCHG, irt, addr, val, order);
+    case B_ATOMIC_CAS:
+        return compile_atomic_cas(s, n, addr, t, order);
+    case B_ATOMIC_FETCH_OP: case B_ATOMIC_OP_FETCH:
+        return compile_atomic_rmw(s, n, addr, t, order);
+    default: UNREACHABLE();
     }
+    return NULL;
 }
 
-static IrIns * compile_call(Scope *s, AstNode *n) {
-    AstType *fn_t = n->fn->t;
-    if (fn_t->k == T_PTR) {
-        fn_t = fn_t->ptr;
-    }
-    assert(fn_t->k == T_FN);
-    IrIns *fn = discharge(s, compile_expr(s, n->fn));
-    IrIns *args[vec_len(n->args)];
-    for (size_t i = 0; i < vec_len(n->args); i++) {
-        AstNode *arg = vec_get(n->args, i);
-        args[i] = discharge(s, compile_expr(s, arg));
+static IrIns * compile_builtin(Scope *s, AstNode *n) {
+    if (n->builtin >= B_ATOMIC_LOAD) {
+        return compile_atomic_builtin(s, n);
     }
-    IrIns *call = emit(s, IR_CALL, irt_conv(n->t));
-    call->fn = fn;
-    for (size_t i = 0; i < vec_len(n->args); i++) {
-        AstNode *arg = vec_get(n->args, i);
-        IrIns *carg = emit(s, IR_CARG, irt_conv(arg->t));
-        carg->arg = args[i];
+    switch (n->builtin) {
+    case B_EXPECT:   return compile_expect(s, n);
+    case B_POPCOUNT: return compile_bits(s, n, IR_POPCNT);
+    case B_CTZ:      return compile_bits(s, n, IR_CTZ);
+    case B_CLZ:      return compile_bits(s, n, IR_CLZ);
+    case B_BSWAP:    return compile_bswap(s, n);
+    case B_MEMCPY: case B_MEMSET: return compile_mem_builtin(s, n);
+    case B_MEMCMP: case B_STRCMP: case B_STRLEN: return compile_str_builtin(s, n, 0);
+    case B_ASSUME_ALIGNED: return compile_assume_aligned(s, n);
+    case B_PREFETCH: return compile_prefetch(s, n);
+    case B_UNREACHABLE: return compile_unreachable(s);
+    case B_ASSUME: return compile_assume(s, n);
+    default: UNREACHABLE();
     }
-    return call;
+    return NULL;
 }
 
 static IrIns * compile_expr(Scope *s, AstNode *n) {
@@ -911,7 +2867,7 @@ static IrIns * compile_expr(Scope *s, AstNode *n) {
         return compile_binop(s, n, IR_SUB);
     case N_MUL: return compile_binop(s, n, IR_MUL);
     case N_DIV:
-        if (n->t->k >= T_FLOAT && n->t->k <= T_LDOUBLE) { // FP division
+        if (is_fp_t(lane_t(n->t))) { // FP division
             return compile_binop(s, n, IR_FDIV);
         } else if (n->t->is_unsigned) { // Unsigned integer division
             return compile_binop(s, n, IR_UDIV);
@@ -929,13 +2885,13 @@ static IrIns * compile_expr(Scope *s, AstNode *n) {
     case N_BIT_XOR:   return compile_binop(s, n, IR_BIT_XOR);
     case N_SHL:       return compile_binop(s, n, IR_SHL);
     case N_SHR:
-        if (n->t->is_unsigned) { // Unsigned integer right shift
+        if (lane_t(n->t)->is_unsigned) { // Unsigned integer right shift
             return compile_binop(s, n, IR_SHR);
         } else { // Signed integer right shift
             return compile_binop(s, n, IR_SAR);
         }
-    case N_EQ:        return compile_binop(s, n, IR_EQ);
-    case N_NEQ:       return compile_binop(s, n, IR_NEQ);
+    case N_EQ:        return compile_eq(s, n, IR_EQ);
+    case N_NEQ:       return compile_eq(s, n, IR_NEQ);
     case N_LT:
         if (n->l->t->k >= T_FLOAT && n->l->t->k <= T_LDOUBLE) { // FP comparison
             return compile_binop(s, n, IR_FLT);
@@ -975,7 +2931,7 @@ static IrIns * compile_expr(Scope *s, AstNode *n) {
     case N_A_SUB:     return compile_arith_assign(s, n, IR_SUB);
     case N_A_MUL:     return compile_arith_assign(s, n, IR_MUL);
     case N_A_DIV:
-        if (n->t->k >= T_FLOAT && n->t->k <= T_LDOUBLE) {
+        if (is_fp_t(lane_t(n->t))) {
             return compile_arith_assign(s, n, IR_FDIV);
         } else if (n->t->is_unsigned) { // Unsigned integer division
             return compile_arith_assign(s, n, IR_UDIV);
@@ -993,7 +2949,7 @@ static IrIns * compile_expr(Scope *s, AstNode *n) {
     case N_A_BIT_XOR: return compile_arith_assign(s, n, IR_BIT_XOR);
     case N_A_SHL:     return compile_arith_assign(s, n, IR_SHL);
     case N_A_SHR:
-        if (n->t->is_unsigned) { // Unsigned integer right shift
+        if (lane_t(n->t)->is_unsigned) { // Unsigned integer right shift
             return compile_arith_assign(s, n, IR_SHR);
         } else { // Signed integer right shift
             return compile_arith_assign(s, n, IR_SAR);
@@ -1009,12 +2965,14 @@ static IrIns * compile_expr(Scope *s, AstNode *n) {
         return compile_inc_dec(s, n);
     case N_DEREF:   return compile_deref(s, n);
     case N_ADDR:    return compile_addr(s, n);
+    case N_LABEL_ADDR: return compile_label_addr(s, n);
     case N_CONV:    return compile_conv(s, n);
 
         // Postfix operations
-    case N_IDX:   return compile_array_access(s, n);
-    case N_CALL:  return compile_call(s, n);
-    case N_FIELD: return compile_field_access(s, n);
+    case N_IDX:     return compile_array_access(s, n);
+    case N_CALL:    return compile_call(s, n);
+    case N_BUILTIN: return compile_builtin(s, n);
+    case N_FIELD:   return compile_field_access(s, n);
 
         // Operands
     default: return compile_operand(s, n);
@@ -1027,14 +2985,20 @@ static IrIns * compile_expr(Scope *s, AstNode *n) {
 static void compile_block(Scope *s, AstNode *n);
 static void compile_stmt(Scope *s, AstNode *n);
 
+// The stack pointer's saved before a scope's first VLA, and restored when
+// leaving the scope (see 'restore_stack'); except by a 'goto', which leaves
+// them until the function returns. The number of elements is a 'size_t', so
+// it's a constant once SCCP can prove every dimension is (see 'sccp')
 static IrIns * compile_vla(Scope *s, AstType *t) {
     assert(is_vla(t));
+    if (!s->stack_save) {
+        s->stack_save = emit(s, IR_STACK_SAVE, irt_scalar(IRT_PTR));
+    }
     Vec *to_mul = vec_new();
     while (is_vla(t)) {
         IrIns *count = discharge(s, compile_expr(s, t->len));
-        vec_push(to_mul, count);
-        IrIns *len = emit(s, IR_ALLOC, irt_new(IRT_PTR));
-        len->alloc_t = irt_conv(t->len->t);
+        vec_push(to_mul, emit_conv(s, count, t->len->t, irt_scalar(IRT_I64)));
+        IrIns *len = emit_alloc(s, irt_conv(t->len->t));
         emit_store(s, len, count, t->len->t);
         t->vla_len = len;
         t = t->elem;
@@ -1047,7 +3011,7 @@ static IrIns * compile_vla(Scope *s, AstType *t) {
         mul->r = vec_get(to_mul, i);
         total = mul;
     }
-    IrIns *alloc = emit(s, IR_ALLOC, irt_new(IRT_PTR));
+    IrIns *alloc = emit(s, IR_ALLOC, irt_scalar(IRT_PTR));
     alloc->alloc_t = irt_conv(t);
     alloc->count = total;
     return alloc;
@@ -1064,8 +3028,7 @@ static void compile_decl(Scope *s, AstNode *n) {
     } else if (is_vla(n->var->t)) { // VLA
         alloc = compile_vla(s, n->var->t);
     } else { // Everything else
-        alloc = emit(s, IR_ALLOC, irt_new(IRT_PTR));
-        alloc->alloc_t = irt_conv(n->var->t);
+        alloc = emit_alloc(s, irt_obj(n->var->t));
     }
     def_local(s, n->var->var_name, alloc);
     if (n->val && n->val->k != N_INIT) {
@@ -1077,7 +3040,7 @@ static void compile_decl(Scope *s, AstNode *n) {
 static void compile_if(Scope *s, AstNode *n) {
     Vec *brs = vec_new();
     while (n && n->if_cond) { // 'if' and 'else if's
-        IrIns *cond = to_cond(s, compile_expr(s, n->if_cond));
+        IrIns *cond = compile_cond(s, n->if_cond);
         BB *body = emit_bb(s);
         patch_branch_chain(cond->true_chain, body);
         compile_block(s, n->if_body);
@@ -1099,11 +3062,26 @@ static void compile_if(Scope *s, AstNode *n) {
     patch_branch_chain(brs, s->fn->last);
 }
 
+// For the line table with '-g', and to find each BB's count in a sampled
+// profile (see 'attach_sample_profile')
+static int records_lines() {
+    return DEBUG_INFO || PROFILE_SAMPLE_PATH;
+}
+
+// Only lines from the function's own file mean anything in its line table
+static void set_line(Scope *s, Token *tk) {
+    if (records_lines() && s->fn->file && tk && tk->f &&
+            strcmp(tk->f->name, s->fn->file) == 0) {
+        s->line = tk->line;
+    }
+}
+
 static void compile_while(Scope *s, AstNode *n) {
     IrIns *before_br = emit(s, IR_BR, NULL);
     BB *cond_bb = emit_bb(s);
     before_br->br = cond_bb;
-    IrIns *cond = to_cond(s, compile_expr(s, n->loop_cond));
+    cond_bb->unroll = n->loop_unroll;
+    IrIns *cond = compile_cond(s, n->loop_cond);
 
     Scope loop = enter_scope(s, SCOPE_LOOP);
     BB *body_bb = emit_bb(s);
@@ -1116,6 +3094,7 @@ static void compile_while(Scope *s, AstNode *n) {
     patch_branch_chain(cond->false_chain, after_bb);
     patch_branch_chain(loop.breaks, after_bb);
     patch_branch_chain(loop.continues, cond_bb);
+    exit_scope(&loop);
 }
 
 static void compile_do_while(Scope *s, AstNode *n) {
@@ -1123,18 +3102,21 @@ static void compile_do_while(Scope *s, AstNode *n) {
     Scope loop = enter_scope(s, SCOPE_LOOP);
     BB *body_bb = emit_bb(s);
     before_br->br = body_bb;
+    body_bb->unroll = n->loop_unroll;
     compile_block(&loop, n->loop_body);
     IrIns *body_br = emit(s, IR_BR, NULL);
 
     BB *cond_bb = emit_bb(s);
     body_br->br = cond_bb;
-    IrIns *cond = to_cond(s, compile_expr(s, n->loop_cond));
+    set_line(s, n->loop_cond->tk);
+    IrIns *cond = compile_cond(s, n->loop_cond);
     patch_branch_chain(cond->true_chain, body_bb);
 
     BB *after_bb = emit_bb(s);
     patch_branch_chain(cond->false_chain, after_bb);
     patch_branch_chain(loop.breaks, after_bb);
     patch_branch_chain(loop.continues, cond_bb);
+    exit_scope(&loop);
 }
 
 static void compile_for(Scope *s, AstNode *n) {
@@ -1148,7 +3130,7 @@ static void compile_for(Scope *s, AstNode *n) {
     if (n->for_cond) {
         start_bb = emit_bb(s);
         before_br->br = start_bb;
-        cond = to_cond(s, compile_expr(s, n->for_cond));
+        cond = compile_cond(s, n->for_cond);
     }
 
     Scope loop = enter_scope(s, SCOPE_LOOP);
@@ -1159,6 +3141,7 @@ static void compile_for(Scope *s, AstNode *n) {
         start_bb = body;
         before_br->br = body;
     }
+    start_bb->unroll = n->for_unroll;
     compile_block(&loop, n->for_body);
     IrIns *end_br = emit(s, IR_BR, NULL);
 
@@ -1166,6 +3149,7 @@ static void compile_for(Scope *s, AstNode *n) {
     if (n->for_inc) {
         BB *inc_bb = emit_bb(s);
         end_br->br = inc_bb;
+        set_line(s, n->for_inc->tk);
         compile_expr(s, n->for_inc);
         IrIns *inc_br = emit(s, IR_BR, NULL);
         inc_br->br = start_bb;
@@ -1181,39 +3165,317 @@ static void compile_for(Scope *s, AstNode *n) {
     }
     patch_branch_chain(loop.breaks, after);
     patch_branch_chain(loop.continues, continue_bb);
+    exit_scope(&loop);
 }
 
-static void compile_switch(Scope *s, AstNode *n) {
-    IrIns *cond = discharge(s, compile_expr(s, n->switch_cond));
-    for (size_t i = 0; i < vec_len(n->cases); i++) {
+// A switch's cases are sorted and split into clusters: runs of cases dense
+// enough for a jump table (an IR_SWITCH), runs spanning fewer than 64 values
+// that jump to only a few places (tested with a bit mask per target), and
+// single cases (compared one at a time). A few clusters are tested one after
+// the other; more are searched with a balanced binary tree of comparisons.
+// The dispatch code is emitted after the switch's body, once the BB for each
+// case is known
+
+#define MIN_TABLE_CASES      4  // Fewer cases aren't worth a jump table
+#define MIN_TABLE_DENSITY    40 // Percent of a table's entries that are cases
+#define MIN_BIT_TEST_CASES   3
+#define MAX_BIT_TEST_TARGETS 3
+#define MAX_LINEAR_CLUSTERS  3  // Any more are searched with a binary tree
+
+enum {
+    CLUSTER_CASE,
+    CLUSTER_TABLE,
+    CLUSTER_BITS,
+};
+
+typedef struct {
+    uint64_t key; // Sorts (unsigned) in the same order as the case values
+    uint64_t val; // Sign or zero extended to 64 bits
+    AstNode *case_n;
+    BB *target;
+} SwitchCase;
+
+typedef struct {
+    int k;
+    size_t start, end; // Index of the first case, and one past the last
+} Cluster;
+
+typedef struct {
+    IrIns *cond, *wide; // The value switched on, and extended to 64 bits
+    int is_signed;
+    SwitchCase *cases;
+    size_t num_cases;
+    Vec *clusters; // of 'Cluster *'
+    Vec *tables;   // of 'IrIns *' with op = IR_SWITCH
+} Switch;
+
+static int cmp_switch_cases(const void *a, const void *b) {
+    uint64_t l = ((SwitchCase *) a)->key, r = ((SwitchCase *) b)->key;
+    return l < r ? -1 : l > r;
+}
+
+static void sort_cases(Switch *sw, AstNode *n) {
+    sw->num_cases = vec_len(n->cases);
+    sw->cases = malloc(sizeof(SwitchCase) * sw->num_cases);
+    int shift = 64 - (int) sw->cond->t->size * 8;
+    for (size_t i = 0; i < sw->num_cases; i++) {
         AstNode *case_n = vec_get(n->cases, i);
-        IrIns *val = compile_expr(s, case_n->case_cond);
-        IrIns *cmp = emit(s, IR_EQ, irt_new(IRT_I32));
-        cmp->l = cond;
-        cmp->r = val;
+        uint64_t val = case_n->case_cond->imm << shift;
+        val = sw->is_signed ? (uint64_t) ((int64_t) val >> shift) : val >> shift;
+        sw->cases[i].val = val;
+        sw->cases[i].key = sw->is_signed ? val ^ ((uint64_t) 1 << 63) : val;
+        sw->cases[i].case_n = case_n;
+        sw->cases[i].target = NULL;
+    }
+    qsort(sw->cases, sw->num_cases, sizeof(SwitchCase), cmp_switch_cases);
+    for (size_t i = 0; i < sw->num_cases; i++) {
+        // Set by 'compile_case_default'
+        sw->cases[i].case_n->case_br = &sw->cases[i].target;
+    }
+}
+
+static int is_dense(Switch *sw, size_t start, size_t end) {
+    size_t num = end - start;
+    uint64_t range = sw->cases[end - 1].key - sw->cases[start].key;
+    return num >= MIN_TABLE_CASES && range < num * 100 / MIN_TABLE_DENSITY;
+}
+
+static int is_bit_testable(Switch *sw, size_t start, size_t end) {
+    if (end - start < MIN_BIT_TEST_CASES ||
+            sw->cases[end - 1].key - sw->cases[start].key >= 64) {
+        return 0;
+    }
+    size_t num_targets = 0;
+    for (size_t i = start; i < end; i++) {
+        size_t j = start;
+        while (sw->cases[j].target != sw->cases[i].target) {
+            j++;
+        }
+        num_targets += j == i; // First case jumping to this target
+    }
+    return num_targets <= MAX_BIT_TEST_TARGETS;
+}
+
+// Greedily takes the longest cluster starting at each case
+static void find_clusters(Switch *sw) {
+    sw->clusters = vec_new();
+    size_t start = 0;
+    while (start < sw->num_cases) {
+        Cluster *c = malloc(sizeof(Cluster));
+        c->k = CLUSTER_CASE;
+        c->start = start;
+        c->end = start + 1;
+        for (size_t end = sw->num_cases; end > start + 1; end--) {
+            if (is_bit_testable(sw, start, end)) { // Cheaper than a table
+                c->k = CLUSTER_BITS;
+                c->end = end;
+                break;
+            } else if (is_dense(sw, start, end)) {
+                c->k = CLUSTER_TABLE;
+                c->end = end;
+                break;
+            }
+        }
+        vec_push(sw->clusters, c);
+        start = c->end;
+    }
+}
+
+// Emits the switched on value minus the first case in a cluster, which is an
+// unsigned index into the cluster
+static IrIns * emit_cluster_idx(Scope *s, Switch *sw, Cluster *c) {
+    IrIns *first = emit_imm(s, irt_scalar(IRT_I64), sw->cases[c->start].val);
+    IrIns *idx = emit(s, IR_SUB, irt_scalar(IRT_I64));
+    idx->l = sw->wide;
+    idx->r = first;
+    return idx;
+}
+
+static void emit_case_cluster(Scope *s, Switch *sw, Cluster *c, Vec *fallthrough) {
+    SwitchCase *sc = &sw->cases[c->start];
+    IrIns *val = emit_imm(s, sw->cond->t, sc->val);
+    IrIns *cmp = emit(s, IR_EQ, irt_scalar(IRT_I32));
+    cmp->l = sw->cond;
+    cmp->r = val;
+    IrIns *br = emit(s, IR_CONDBR, NULL);
+    br->cond = cmp;
+    br->true = sc->target;
+    add_to_branch_chain(fallthrough, &br->false, br);
+}
+
+static void emit_table_cluster(Scope *s, Switch *sw, Cluster *c, Vec *fallthrough) {
+    IrIns *idx = emit_cluster_idx(s, sw, c);
+    IrIns *br = emit(s, IR_SWITCH, NULL);
+    br->idx = idx;
+    br->table = vec_new();
+    uint64_t first = sw->cases[c->start].key;
+    uint64_t len = sw->cases[c->end - 1].key - first + 1;
+    size_t i = c->start;
+    for (uint64_t key = first; key - first < len; key++) {
+        if (sw->cases[i].key == key) {
+            vec_push(br->table, sw->cases[i++].target);
+        } else {
+            vec_push(br->table, NULL); // Default, once it's known
+        }
+    }
+    add_to_branch_chain(fallthrough, &br->default_br, br);
+    vec_push(sw->tables, br);
+}
+
+static void emit_bits_cluster(Scope *s, Switch *sw, Cluster *c, Vec *fallthrough) {
+    IrIns *idx = emit_cluster_idx(s, sw, c);
+    uint64_t first = sw->cases[c->start].key;
+    IrIns *range = emit_imm(s, idx->t, sw->cases[c->end - 1].key - first);
+    IrIns *outside = emit(s, IR_UGT, irt_scalar(IRT_I32));
+    outside->l = idx;
+    outside->r = range;
+    IrIns *range_br = emit(s, IR_CONDBR, NULL);
+    range_br->cond = outside;
+    add_to_branch_chain(fallthrough, &range_br->true, range_br);
+    range_br->false = emit_bb(s);
+
+    IrIns *one = emit_imm(s, idx->t, 1);
+    IrIns *bit = emit(s, IR_SHL, idx->t);
+    bit->l = one;
+    bit->r = idx;
+    for (size_t i = c->start; i < c->end; i++) {
+        BB *target = sw->cases[i].target;
+        size_t first_case = c->start;
+        while (sw->cases[first_case].target != target) {
+            first_case++;
+        }
+        if (first_case < i) {
+            continue; // Already tested for this target
+        }
+        uint64_t mask = 0;
+        for (size_t j = i; j < c->end; j++) {
+            if (sw->cases[j].target == target) {
+                mask |= (uint64_t) 1 << (sw->cases[j].key - first);
+            }
+        }
+        IrIns *bits = emit_imm(s, idx->t, mask);
+        IrIns *and = emit(s, IR_BIT_AND, idx->t);
+        and->l = bit;
+        and->r = bits;
+        IrIns *zero = emit_imm(s, idx->t, 0);
+        IrIns *cmp = emit(s, IR_NEQ, irt_scalar(IRT_I32));
+        cmp->l = and;
+        cmp->r = zero;
         IrIns *br = emit(s, IR_CONDBR, NULL);
         br->cond = cmp;
-        case_n->case_br = &br->true;
-        BB *next = emit_bb(s);
-        br->false = next;
+        br->true = target;
+        br->false = emit_bb(s);
     }
-    IrIns *default_br = emit(s, IR_BR, NULL);
-    emit_bb(s);
-    if (n->default_n) { // If there's a default
-        n->default_n->case_br = &default_br->br;
+    IrIns *br = emit(s, IR_BR, NULL);
+    add_to_branch_chain(fallthrough, &br->br, br);
+}
+
+static void emit_cluster(Scope *s, Switch *sw, Cluster *c, Vec *fallthrough) {
+    switch (c->k) {
+    case CLUSTER_CASE:  emit_case_cluster(s, sw, c, fallthrough); break;
+    case CLUSTER_TABLE: emit_table_cluster(s, sw, c, fallthrough); break;
+    case CLUSTER_BITS:  emit_bits_cluster(s, sw, c, fallthrough); break;
+    default: UNREACHABLE();
+    }
+}
+
+// Emits the clusters from 'start' to 'end', adding the branches taken when the
+// value isn't any of their cases to 'fallthrough'
+static void emit_clusters(Scope *s, Switch *sw, size_t start, size_t end, Vec *fallthrough) {
+    if (end - start <= MAX_LINEAR_CLUSTERS) {
+        for (size_t i = start; i < end; i++) {
+            Vec *next = i + 1 < end ? vec_new() : fallthrough;
+            emit_cluster(s, sw, vec_get(sw->clusters, i), next);
+            if (next != fallthrough) {
+                patch_branch_chain(next, emit_bb(s));
+            }
+        }
+        return;
+    }
+    size_t mid = start + (end - start) / 2;
+    Cluster *pivot = vec_get(sw->clusters, mid);
+    IrIns *val = emit_imm(s, sw->wide->t, sw->cases[pivot->start].val);
+    IrIns *cmp = emit(s, sw->is_signed ? IR_SLT : IR_ULT, irt_scalar(IRT_I32));
+    cmp->l = sw->wide;
+    cmp->r = val;
+    IrIns *br = emit(s, IR_CONDBR, NULL);
+    br->cond = cmp;
+    br->true = emit_bb(s);
+    emit_clusters(s, sw, start, mid, fallthrough);
+    br->false = emit_bb(s);
+    emit_clusters(s, sw, mid, end, fallthrough);
+}
+
+// Case labels next to each other (e.g., 'case 1: case 2:') each get a BB that
+// only branches to the next one; jump straight past them to the body, so that
+// they count as the same target
+static BB * skip_empty_bbs(BB *bb) {
+    for (int i = 0; i < 16 && bb->ir_head && bb->ir_head->op == IR_BR; i++) {
+        bb = bb->ir_head->br; // Limited in case of an infinite loop
+    }
+    return bb;
+}
+
+static void emit_switch_dispatch(Scope *s, Switch *sw, Vec *fallthrough) {
+    for (size_t i = 0; i < sw->num_cases; i++) {
+        sw->cases[i].target = skip_empty_bbs(sw->cases[i].target);
+    }
+    find_clusters(sw);
+    size_t num_clusters = vec_len(sw->clusters);
+    int only_cases = num_clusters <= MAX_LINEAR_CLUSTERS;
+    for (size_t i = 0; i < num_clusters && only_cases; i++) {
+        Cluster *c = vec_get(sw->clusters, i);
+        only_cases = c->k == CLUSTER_CASE;
+    }
+    if (!only_cases) {
+        sw->wide = sw->cond;
+        if (sw->cond->t->size < 8) {
+            sw->wide = emit(s, sw->is_signed ? IR_SEXT : IR_ZEXT, irt_scalar(IRT_I64));
+            sw->wide->l = sw->cond;
+        }
+    }
+    if (num_clusters == 0) {
+        IrIns *br = emit(s, IR_BR, NULL);
+        add_to_branch_chain(fallthrough, &br->br, br);
+    } else {
+        emit_clusters(s, sw, 0, num_clusters, fallthrough);
     }
+}
+
+static void compile_switch(Scope *s, AstNode *n) {
+    Switch sw = {0};
+    sw.cond = discharge(s, compile_expr(s, n->switch_cond));
+    sw.is_signed = !n->switch_cond->t->is_unsigned;
+    sw.tables = vec_new();
+    sort_cases(&sw, n);
+    BB *default_bb = NULL;
+    if (n->default_n) {
+        n->default_n->case_br = &default_bb;
+    }
+    IrIns *dispatch_br = emit(s, IR_BR, NULL);
+    emit_bb(s);
 
     Scope switch_s = enter_scope(s, SCOPE_SWITCH);
     compile_block(&switch_s, n->switch_body);
-
     IrIns *end_br = emit(s, IR_BR, NULL);
+
+    dispatch_br->br = emit_bb(s);
+    Vec *fallthrough = vec_new();
+    emit_switch_dispatch(s, &sw, fallthrough);
+
     BB *after = emit_bb(s);
     end_br->br = after;
     patch_branch_chain(switch_s.breaks, after);
-    if (!default_br->br) { // If there's no default
-        default_br->br = after;
+    exit_scope(&switch_s);
+    patch_branch_chain(fallthrough, default_bb ? default_bb : after);
+    for (size_t i = 0; i < vec_len(sw.tables); i++) {
+        IrIns *br = vec_get(sw.tables, i);
+        for (size_t j = 0; j < vec_len(br->table); j++) {
+            if (!vec_get(br->table, j)) {
+                vec_put(br->table, j, br->default_br);
+            }
+        }
     }
-    patch_branch_chain(switch_s.breaks, after);
 }
 
 static void compile_case_default(Scope *s, AstNode *n) {
@@ -1230,6 +3492,7 @@ static void compile_case_default(Scope *s, AstNode *n) {
 static void compile_break(Scope *s) {
     Scope *switch_loop = find_scope(s, SCOPE_SWITCH | SCOPE_LOOP);
     assert(switch_loop); // Checked by parser
+    restore_stack(s, switch_loop);
     IrIns *br = emit(s, IR_BR, NULL);
     add_to_branch_chain(switch_loop->breaks, &br->br, br);
 }
@@ -1237,18 +3500,33 @@ static void compile_break(Scope *s) {
 static void compile_continue(Scope *s) {
     Scope *loop = find_scope(s, SCOPE_LOOP);
     assert(loop); // Checked by the parser
+    restore_stack(s, loop);
     IrIns *br = emit(s, IR_BR, NULL);
     add_to_branch_chain(loop->continues, &br->br, br);
 }
 
+static void add_goto(Scope *s, char *label, BB **br, Token *err) {
+    Goto *pair = arena_alloc(ARENA_IR_FN, sizeof(Goto));
+    pair->label = label;
+    pair->br = br;
+    pair->err = err;
+    vec_push(s->gotos, pair);
+}
+
 static void compile_goto(Scope *s, AstNode *n) {
     IrIns *br = emit(s, IR_BR, NULL);
     emit_bb(s);
-    Goto *pair = malloc(sizeof(Goto));
-    pair->label = n->goto_label;
-    pair->br = &br->br;
-    pair->err = n->tk;
-    vec_push(s->gotos, pair);
+    add_goto(s, n->goto_label, &br->br, n->tk);
+}
+
+// Its targets are filled in once every label's known (see
+// 'resolve_indirect_brs')
+static void compile_indirect_goto(Scope *s, AstNode *n) {
+    IrIns *dest = discharge(s, compile_expr(s, n->goto_ptr));
+    IrIns *br = emit(s, IR_INDIRECT_BR, NULL);
+    br->dest = dest;
+    br->targets = vec_new();
+    emit_bb(s);
 }
 
 static void compile_label(Scope *s, AstNode *n) {
@@ -1271,7 +3549,63 @@ static void compile_ret(Scope *s, AstNode *n) {
     ret->ret = v;
 }
 
+// Register outputs are IR_ASMOUTs stored to their lvalues after the block, so
+// only memory operands need their address taken
+static void compile_asm(Scope *s, AstNode *n) {
+    InlineAsm *a = n->inline_asm;
+    IrIns *dsts[MAX_ASM_OPRS], *vals[MAX_ASM_OPRS];
+    for (int i = 0; i < a->num_oprs; i++) {
+        AsmOperand *o = &a->oprs[i];
+        AstNode *arg = vec_get(n->asm_args, i);
+        dsts[i] = vals[i] = NULL;
+        if (o->k == ASM_IMM) {
+            continue; // Substituted straight into the template
+        }
+        IrIns *v = compile_expr(s, arg);
+        if (o->k == ASM_MEM) { // Pass the lvalue's address
+            vals[i] = is_lval_load(v) ? load_addr(v) : v;
+            if (is_lval_load(v)) {
+                delete_ir(v);
+            }
+        } else if (o->is_out) {
+            assert(is_lval_load(v)); // Register outputs are scalars
+            dsts[i] = load_addr(v);
+            if (o->is_in) { // '+'; the current value is an input too
+                vals[i] = v;
+            } else {
+                delete_ir(v);
+            }
+        } else {
+            vals[i] = discharge(s, v);
+        }
+    }
+    IrIns *ins = emit(s, IR_ASM, NULL);
+    ins->inline_asm = a;
+    for (int i = 0; i < a->num_oprs; i++) {
+        if (vals[i]) {
+            IrIns *in = emit(s, IR_ASMIN, vals[i]->t);
+            in->arg = vals[i];
+            in->opr_idx = i;
+        }
+    }
+    IrIns *outs[MAX_ASM_OPRS];
+    for (int i = 0; i < a->num_oprs; i++) {
+        if (dsts[i]) {
+            AstNode *arg = vec_get(n->asm_args, i);
+            outs[i] = emit(s, IR_ASMOUT, irt_conv(arg->t));
+            outs[i]->opr_idx = i;
+        }
+    }
+    for (int i = 0; i < a->num_oprs; i++) {
+        if (dsts[i]) {
+            AstNode *arg = vec_get(n->asm_args, i);
+            emit_store(s, dsts[i], outs[i], arg->t);
+        }
+    }
+}
+
 static void compile_stmt(Scope *s, AstNode *n) {
+    set_line(s, n->tk);
     switch (n->k) {
         case N_TYPEDEF:  break;
         case N_DECL:     compile_decl(s, n); break;
@@ -1284,8 +3618,10 @@ static void compile_stmt(Scope *s, AstNode *n) {
         case N_BREAK:    compile_break(s); break;
         case N_CONTINUE: compile_continue(s); break;
         case N_GOTO:     compile_goto(s, n); break;
+        case N_INDIRECT_GOTO: compile_indirect_goto(s, n); break;
         case N_LABEL:    compile_label(s, n); break;
         case N_RET:      compile_ret(s, n); break;
+        case N_ASM:      compile_asm(s, n); break;
         default:         discharge(s, compile_expr(s, n)); break;
     }
 }
@@ -1296,6 +3632,7 @@ static void compile_block(Scope *s, AstNode *n) {
         compile_stmt(&block, n);
         n = n->next;
     }
+    exit_scope(&block);
 }
 
 
@@ -1307,6 +3644,21 @@ static void ensure_ends_with_ret(Scope *s) {
     }
 }
 
+// Statements after a 'break', 'continue', 'goto', or 'return' are compiled
+// into the same BB as the branch, but can never run; cut them off so every BB
+// ends with exactly one terminator
+static void remove_dead_tails(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        IrIns *ins = bb->ir_head;
+        while (ins && ins->op != IR_BR && ins->op != IR_CONDBR && ins->op != IR_RET) {
+            ins = ins->next;
+        }
+        while (ins && ins->next) {
+            delete_ir(ins->next);
+        }
+    }
+}
+
 static void resolve_gotos(Scope *s) {
     for (size_t i = 0; i < vec_len(s->gotos); i++) {
         Goto *pair = vec_get(s->gotos, i);
@@ -1319,6 +3671,41 @@ static void resolve_gotos(Scope *s) {
     }
 }
 
+// A 'goto *' can go to any label whose address is taken in the function, so
+// each IR_INDIRECT_BR gets all of them as its successors
+static void resolve_indirect_brs(Fn *fn) {
+    Vec *targets = vec_new();
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_BB_ADDR && !ins->label_bb->addr_taken) {
+                ins->label_bb->addr_taken = 1;
+                vec_push(targets, ins->label_bb);
+            }
+        }
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        IrIns *br = bb->ir_last;
+        if (br && br->op == IR_INDIRECT_BR) {
+            for (size_t i = 0; i < vec_len(targets); i++) {
+                vec_push(br->targets, vec_get(targets, i));
+            }
+        }
+    }
+    vec_free(targets);
+}
+
+// Branch chains are only needed while the function's being compiled
+static void free_branch_chains(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        IrIns *br = bb->ir_last;
+        if (br && br->op == IR_CONDBR) {
+            vec_free(br->true_chain);
+            vec_free(br->false_chain);
+            br->true_chain = br->false_chain = NULL;
+        }
+    }
+}
+
 static void compile_fn_args(Scope *s, AstNode *n) {
     if (n->t->is_vararg) {
         TODO(); // TODO: vararg fns
@@ -1328,102 +3715,191 @@ static void compile_fn_args(Scope *s, AstNode *n) {
         AstType *t = vec_get(n->t->params, i);
         IrIns *ins = emit(s, IR_FARG, irt_conv(t));
         ins->arg_idx = i;
+        ins->is_restrict = t->k == T_PTR && t->is_restrict;
         fargs[i] = ins;
+        vec_push(s->fn->params, ins->t);
     }
     for (size_t i = 0; i < vec_len(n->param_names); i++) { // Emit IR_ALLOCs
         Token *name = vec_get(n->param_names, i);
         AstType *t = vec_get(n->t->params, i);
-        IrIns *alloc = emit(s, IR_ALLOC, irt_new(IRT_PTR));
-        alloc->alloc_t = irt_conv(t);
+        IrIns *alloc = emit_alloc(s, irt_conv(t));
         emit_store(s, alloc, fargs[i], t);
         def_local(s, name->ident, alloc);
     }
 }
 
-static void compile_fn_def(Scope *s, AstNode *n) {
+static Global * compile_fn_def(Scope *s, AstNode *n) {
     char *label = prepend_underscore(n->fn_name);
     Global *g = new_global(label, irt_conv(n->t), n->t->linkage);
     g->k = G_FN_DEF;
+    g->visibility = n->t->visibility;
+    g->fn_attrs = n->t->fn_attrs;
     g->fn = new_fn();
+    g->fn->ret = irt_conv(n->t->ret);
+    g->fn->instrument = INSTRUMENT_FUNCTIONS && !n->t->no_instrument ? g : NULL;
+    g->fn->patchable_entry = n->t->patchable_entry >= 0 ? n->t->patchable_entry :
+                             PATCHABLE_ENTRY;
+    g->fn->file = records_lines() && n->tk && n->tk->f ? intern(n->tk->f->name) : NULL;
     def_global(s, n->fn_name, g);
+    fn_begin(g);
     Scope body = enter_scope(s, SCOPE_BLOCK);
     body.fn = g->fn;
+    set_line(&body, n->tk);
     body.labels = map_new();
     body.gotos = vec_new();
     compile_fn_args(&body, n);
     compile_block(&body, n->fn_body);
     resolve_gotos(&body);
     ensure_ends_with_ret(&body);
+    remove_dead_tails(body.fn);
+    resolve_indirect_brs(body.fn);
+    free_branch_chains(body.fn);
+    if (DIRECT_SSA) {
+        build_ssa(body.fn);
+    }
+    map_free(body.labels);
+    vec_free(body.gotos);
+    exit_scope(&body);
+    fn_end();
+    return g;
 }
 
-static void compile_const_init_elem(Scope *s, Vec *elems, AstNode *n, uint64_t offset);
 
-static void compile_const_arr_init(Scope *s, Vec *elems, AstNode *n, uint64_t offset) {
+static void compile_const_init_elem(Scope *s, Global *g, AstNode *n, uint64_t offset, uint64_t size);
+
+static void compile_const_arr_init(Scope *s, Global *g, AstNode *n, uint64_t offset) {
     assert(n->k == N_INIT);
-    assert(n->t->k == T_ARR);
+    assert(n->t->k == T_ARR || n->t->k == T_VEC);
     for (size_t i = 0; i < vec_len(n->elems); i++) {
         AstNode *elem = vec_get(n->elems, i);
         uint64_t elem_offset = offset + i * n->t->elem->size;
-        compile_const_init_elem(s, elems, elem, elem_offset);
+        compile_const_init_elem(s, g, elem, elem_offset, n->t->elem->size);
+    }
+}
+
+static void write_le(char *dst, uint64_t v, uint64_t size) {
+    for (uint64_t i = 0; i < size; i++) {
+        dst[i] = (char) (v >> (i * 8));
+    }
+}
+
+// ORs the bottom 'bits' bits of 'v' into 'dst', from bit 'bit' on
+static void write_bits(char *dst, uint64_t v, size_t bit, size_t bits) {
+    for (size_t i = 0; i < bits; i++, bit++) {
+        if ((v >> i) & 1) {
+            dst[bit / 8] = (char) (dst[bit / 8] | (1 << (bit % 8)));
+        }
     }
 }
 
-static void compile_const_struct_init(Scope *s, Vec *elems, AstNode *n, uint64_t offset) {
+static void compile_const_struct_init(Scope *s, Global *g, AstNode *n, uint64_t offset) {
     assert(n->k == N_INIT);
     assert(n->t->k == T_STRUCT);
     for (size_t i = 0; i < vec_len(n->elems); i++) {
         AstNode *elem = vec_get(n->elems, i);
         Field *f = vec_get(n->t->fields, i);
         uint64_t field_offset = offset + f->offset;
-        compile_const_init_elem(s, elems, elem, field_offset);
+        if (f->is_bit_field && elem) {
+            assert(elem->k == N_IMM);
+            write_bits(&g->bytes[field_offset], elem->imm, f->bit_offset, f->bits);
+        } else if (!f->is_bit_field) {
+            compile_const_init_elem(s, g, elem, field_offset, f->t->size);
+        }
     }
 }
 
-static void compile_const_init_elem(Scope *s, Vec *elems, AstNode *n, uint64_t offset) {
+
+// Writes 'n' into the 'size' bytes at 'offset' in 'g->bytes', or adds a
+// relocation for a pointer to another global
+static void compile_const_init_elem(Scope *s, Global *g, AstNode *n, uint64_t offset, uint64_t size) {
     if (!n) return;
-    if (n->k == N_INIT) {
+    char *dst = &g->bytes[offset];
+    switch (n->k) {
+    case N_INIT:
         if (n->t->k == T_STRUCT) {
-            compile_const_struct_init(s, elems, n, offset);
-        } else { // T_ARR
-            assert(n->t->k == T_ARR);
-            compile_const_arr_init(s, elems, n, offset);
+            compile_const_struct_init(s, g, n, offset);
+        } else { // T_ARR, T_VEC
+            compile_const_arr_init(s, g, n, offset);
         }
-    } else {
-        Global *v = new_global(NULL, irt_conv(n->t), n->t->linkage);
-        compile_global(s, n, v);
-        vec_push(elems, new_init_elem(offset, v));
+        break;
+    case N_IMM:
+        if (size > 8) { // '__int128'
+            write_le(dst, n->imm, 8);
+            write_le(dst + 8, n->imm_hi, size - 8);
+        } else {
+            write_le(dst, n->imm, size);
+        }
+        break;
+    case N_FP:
+        if (size == 4) {
+            float f = (float) n->fp;
+            uint32_t bits;
+            memcpy(&bits, &f, sizeof(bits));
+            write_le(dst, bits, 4);
+        } else {
+            uint64_t bits;
+            memcpy(&bits, &n->fp, sizeof(bits));
+            write_le(dst, bits, 8);
+        }
+        break;
+    case N_STR: {
+        uint64_t len = n->len * n->t->elem->size;
+        memcpy(dst, n->str, len < size ? len : size); // UTF-16/32 in host order
+        break;
+    }
+    case N_KPTR:
+        if (n->g) {
+            Global *target = find_global(s, n->g->var_name);
+            vec_push(g->relocs, new_init_reloc(offset, target, n->offset));
+        } else { // Integer cast to a pointer (e.g., a null pointer)
+            write_le(dst, (uint64_t) n->offset, size);
+        }
+        break;
+    default: UNREACHABLE();
+    }
+}
+
+// A flat image of the whole object
+static void compile_image_global(Scope *s, AstNode *n, Global *g) {
+    g->k = G_INIT;
+    g->bytes = calloc(g->t->size, 1);
+    g->relocs = vec_new();
+    compile_const_init_elem(s, g, n, 0, g->t->size);
+    g->num_bytes = g->t->size;
+    while (g->num_bytes > 0 && g->bytes[g->num_bytes - 1] == 0) {
+        g->num_bytes--; // Trailing zeros are implied
     }
 }
 
 static void compile_global(Scope *s, AstNode *n, Global *g) {
     if (!n) return;
     switch (n->k) {
-    case N_IMM: g->k = G_IMM; g->imm = n->imm; break;
-    case N_FP:  g->k = G_FP;  g->fp = n->fp;   break;
-    case N_STR:
-        g->k = G_INIT;
-        g->elems = vec_new();
-        assert(n->t->k == T_ARR);
-        for (size_t i = 0; i < n->len; i++) {
-            Global *v = new_global(NULL, irt_conv(n->t->elem), LINK_NONE);
-            v->k = G_IMM;
-            uint64_t size;
-            switch (n->enc) {
-                case ENC_NONE:   v->imm = (uint64_t) n->str[i]; size = 1; break;
-                case ENC_CHAR16: v->imm = n->str16[i]; size = 2; break;
-                case ENC_WCHAR:
-                case ENC_CHAR32: v->imm = n->str32[i]; size = 4; break;
-                default: UNREACHABLE();
-            }
-            vec_push(g->elems, new_init_elem(i * size, v));
+    case N_IMM:
+        if (n->t->k == T_I128) {
+            compile_image_global(s, n, g);
+            break;
         }
+        g->k = G_IMM;
+        g->imm = n->imm;
         break;
-    case N_INIT:
+    case N_FP:  g->k = G_FP;  g->fp = n->fp;   break;
+    case N_STR: // The interned contents are used as they are
+        assert(n->t->k == T_ARR);
         g->k = G_INIT;
-        g->elems = vec_new();
-        compile_const_init_elem(s, g->elems, n, 0);
+        g->bytes = n->str; // UTF-16 and UTF-32 in host order (little endian)
+        g->num_bytes = n->len * n->t->elem->size;
+        if (g->num_bytes > g->t->size) {
+            g->num_bytes = g->t->size; // e.g., 'char a[2] = "ab"' drops the '\0'
+        }
+        g->relocs = vec_new();
         break;
+    case N_INIT: compile_image_global(s, n, g); break;
     case N_KPTR:
+        if (!n->g) { // Integer cast to a pointer (e.g., a null pointer)
+            g->k = G_IMM;
+            g->imm = (uint64_t) n->offset;
+            break;
+        }
         g->k = G_PTR;
         g->g = find_global(s, n->g->var_name);
         g->offset = n->offset;
@@ -1442,18 +3918,93 @@ static void compile_null_global(Global *g) {
         g->k = G_FP;
         g->imm = 0;
         break;
-    case IRT_ARR: case IRT_STRUCT:
+    case IRT_ARR: case IRT_STRUCT: case IRT_VEC:
         g->k = G_INIT;
-        g->elems = vec_new();
+        g->bytes = NULL;
+        g->num_bytes = 0;
+        g->relocs = vec_new();
+        break;
+    default: UNREACHABLE();
+    }
+}
+
+static int is_zero_global(Global *g) {
+    switch (g->k) {
+    case G_IMM:  return g->imm == 0;
+    case G_FP:   return g->fp == 0.0 && !signbit(g->fp);
+    case G_INIT: return g->num_bytes == 0 && vec_len(g->relocs) == 0;
+    default:     return 0;
+    }
+}
+
+int global_section(Global *g) {
+    if (g->k == G_FN_DEF) {
+        return SEC_TEXT;
+    } else if (g->k == G_NONE) {
+        return SEC_UNDEF;
+    } else if (g->is_tls) {
+        return is_zero_global(g) ? SEC_TBSS : SEC_TDATA;
+    } else if (g->is_cstring) {
+        return SEC_CSTRING;
+    } else if (g->is_const && g->k != G_PTR && !(g->k == G_INIT && vec_len(g->relocs) > 0)) {
+        return SEC_RODATA;
+    } else if (is_zero_global(g)) {
+        return SEC_BSS;
+    } else {
+        return SEC_DATA;
+    }
+}
+
+int FUNCTION_SECTIONS = 0, DATA_SECTIONS = 0;
+int INSTRUMENT_FUNCTIONS = 0, PATCHABLE_ENTRY = 0, DEBUG_INFO = 0;
+int DIRECT_SSA = 0;
+int ASSOCIATIVE_MATH = 0, RECIPROCAL_MATH = 0;
+
+int has_own_section(int section) {
+    switch (section) {
+    case SEC_TEXT:   return FUNCTION_SECTIONS;
+    case SEC_RODATA: case SEC_DATA: case SEC_BSS: case SEC_TDATA: case SEC_TBSS:
+        return DATA_SECTIONS;
+    default:         return 0;
+    }
+}
+
+char * section_name(int section, char *label, int fn_attrs) {
+    char *name = ".text"; // Never used; 'section' is always one of these
+    switch (section) {
+    case SEC_TEXT:
+        name = (fn_attrs & FA_HOT) ? ".text.hot" :
+               (fn_attrs & FA_COLD) ? ".text.unlikely" : ".text";
         break;
+    case SEC_RODATA: name = ".rodata"; break;
+    case SEC_CST4:   name = ".rodata.cst4"; break;
+    case SEC_CST8:   name = ".rodata.cst8"; break;
+    case SEC_CSTRING: name = ".rodata.str1.1"; break;
+    case SEC_DATA:   name = ".data"; break;
+    case SEC_BSS:    name = ".bss"; break;
+    case SEC_TDATA:  name = ".tdata"; break;
+    case SEC_TBSS:   name = ".tbss"; break;
     default: UNREACHABLE();
     }
+    if (!label) {
+        return name;
+    }
+    Buf *b = buf_new();
+    buf_print(b, name);
+    buf_push(b, '.');
+    buf_print(b, label[0] == '_' ? &label[1] : label); // As the ELF symbol
+    buf_push(b, '\0');
+    return b->data;
 }
 
 static void compile_global_decl(Scope *s, AstNode *n) {
     assert(n->var->k == N_GLOBAL);
     char *label = prepend_underscore(n->var->var_name);
     Global *g = new_global(label, irt_conv(n->var->t), n->var->t->linkage);
+    g->visibility = n->var->t->visibility;
+    g->is_const = n->is_const;
+    g->is_tls = n->is_tls;
+    g->fn_attrs = n->var->t->k == T_FN ? n->var->t->fn_attrs : 0;
     def_global(s, n->var->var_name, g);
     if (n->var->t->k == T_VOID || n->var->t->k == T_FN ||
             n->var->t->linkage == LINK_EXTERN) {
@@ -1466,23 +4017,156 @@ static void compile_global_decl(Scope *s, AstNode *n) {
     }
 }
 
+// A header's static function whose body hasn't been parsed yet (see 'parse');
+// it's compiled later, if it's used
+static void compile_fn_decl(Scope *s, AstNode *n) {
+    Global *g = new_global(prepend_underscore(n->fn_name), irt_conv(n->t), n->t->linkage);
+    g->visibility = n->t->visibility;
+    g->fn_attrs = n->t->fn_attrs;
+    def_global(s, n->fn_name, g);
+}
+
 static void compile_top_level(Scope *s, AstNode *n) {
     switch (n->k) {
         case N_DECL:    compile_global_decl(s, n); break;
-        case N_FN_DEF:  compile_fn_def(s, n); break;
+        case N_FN_DEF:
+            if (n->body_tks) {
+                compile_fn_decl(s, n);
+            } else {
+                compile_fn_def(s, n);
+            }
+            break;
         case N_TYPEDEF: break; // Ignore
         default:        UNREACHABLE();
     }
 }
 
+// The hooks that instrumented functions call (see 'INSTRUMENT_FUNCTIONS'), if
+// the file doesn't declare them itself
+static void declare_hooks(Scope *s) {
+    int instrumented = 0;
+    for (size_t i = 0; i < vec_len(s->globals); i++) {
+        Global *g = vec_get(s->globals, i);
+        instrumented |= g->k == G_FN_DEF && g->fn->instrument;
+    }
+    char *hooks[] = { HOOK_ENTER, HOOK_EXIT };
+    for (size_t i = 0; instrumented && i < sizeof(hooks) / sizeof(hooks[0]); i++) {
+        char *name = intern(hooks[i]);
+        if (!find_global(s, name)) {
+            Global *g = new_global(prepend_underscore(name), irt_scalar(IRT_PTR),
+                                   LINK_EXTERN);
+            def_global(s, name, g);
+        }
+    }
+}
+
+// A global used before it's defined is referred to through its forward
+// declaration's 'Global'; those references are pointed at the definition, so
+// what's known about it (e.g., that it's in this file, for 'is_preemptible')
+// holds at every use
+static void resolve_decls(Scope *s) {
+    Map *defs = map_new(); // of 'Global *', by interned label
+    for (size_t i = 0; i < vec_len(s->globals); i++) {
+        Global *g = vec_get(s->globals, i);
+        if (g->k != G_NONE) {
+            map_put(defs, intern(g->label), g);
+        }
+    }
+    for (size_t i = 0; i < vec_len(s->globals); i++) {
+        Global *g = vec_get(s->globals, i);
+        if (g->k != G_FN_DEF) {
+            continue;
+        }
+        for (BB *bb = g->fn->entry; bb; bb = bb->next) {
+            for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+                if (ins->op == IR_GLOBAL && ins->g->k == G_NONE) {
+                    Global *def = map_get(defs, intern(ins->g->label));
+                    ins->g = def ? def : ins->g;
+                }
+            }
+        }
+    }
+    map_free(defs);
+}
+
+struct Unit {
+    Scope file;
+};
+
+Unit * compile_begin() {
+    Unit *u = calloc(1, sizeof(Unit));
+    Scope *file = &u->file;
+    file->k = SCOPE_FILE;
+    file->globals = vec_new();
+    file->vars = map_new();
+    file->locals = smap_new();
+    file->strs = malloc(sizeof(Map *) * 3);
+    for (int i = 0; i < 3; i++) {
+        file->strs[i] = map_new();
+    }
+    return u;
+}
+
+Global * compile_top(Unit *u, AstNode *n) {
+    if (n->k == N_FN_DEF && !n->body_tks) {
+        return compile_fn_def(&u->file, n);
+    }
+    compile_top_level(&u->file, n);
+    return NULL;
+}
+
+Vec * compile_end(Unit *u) {
+    Vec *globals = u->file.globals;
+    declare_hooks(&u->file);
+    resolve_decls(&u->file);
+    smap_free(u->file.locals);
+    free(u);
+    return globals;
+}
+
 Vec * compile(AstNode *n) {
-    Scope file = {0};
-    file.k = SCOPE_FILE;
-    file.globals = vec_new();
-    file.vars = map_new();
+    Unit *u = compile_begin();
     while (n) {
-        compile_top_level(&file, n);
+        compile_top_level(&u->file, n);
         n = n->next;
     }
-    return file.globals;
+    return compile_end(u);
+}
+
+static int cmp_ptrs(const void *a, const void *b) {
+    uintptr_t l = (uintptr_t) *(void **) a, r = (uintptr_t) *(void **) b;
+    return l < r ? -1 : l > r;
+}
+
+void free_fn_ir(Fn *fn) {
+    Vec *vecs = vec_new(); // The instructions'; a copy of one can share them
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            switch (ins->op) {
+            case IR_PHI:         vec_push(vecs, ins->preds); vec_push(vecs, ins->defs); break;
+            case IR_SWITCH:      vec_push(vecs, ins->table); break;
+            case IR_INDIRECT_BR: vec_push(vecs, ins->targets); break;
+            default: break;
+            }
+        }
+        vec_free(bb->pred);
+        vec_free(bb->succ);
+        vec_free(bb->dom_children);
+        vec_free(bb->dom_frontier);
+    }
+    qsort(vecs->data, vec_len(vecs), sizeof(void *), cmp_ptrs);
+    for (size_t i = 0; i < vec_len(vecs); i++) {
+        if (i == 0 || vec_get(vecs, i) != vec_get(vecs, i - 1)) {
+            vec_free(vec_get(vecs, i));
+        }
+    }
+    vec_free(vecs);
+    for (size_t i = 0; i < vec_len(fn->loops); i++) {
+        Loop *loop = vec_get(fn->loops, i);
+        vec_free(loop->bbs);
+    }
+    vec_empty(fn->loops);
+    vec_free(fn->jump_tables); // Of the IR_SWITCHs' tables
+    fn->jump_tables = NULL;
+    fn->entry = fn->last = NULL;
 }
@@ -2,11 +2,6 @@
 #ifndef COSEC_COMPILE_H
 #define COSEC_COMPILE_H
 
-// TODO: move all constant IR_ALLOCs to the start of the function so only
-// dynamically sized allocations (that modify rsp) come after. So allocating
-// a static-sized variable after a dynamically-sized one doesn't require
-// modification of the stack pointer
-
 #include "parse.h"
 
 typedef struct {
@@ -25,22 +20,35 @@ enum {
     IRT_PTR,
     IRT_ARR,
     IRT_STRUCT,
+    IRT_VEC, // Packed into an SSE register (see 'vectorise.h')
 };
 
 typedef struct IrType {
     int k;
     size_t size, align;
     union {
-        struct { struct IrType *elem; size_t len; }; // IRT_ARR
+        struct { struct IrType *elem; size_t len; }; // IRT_ARR, IRT_VEC
         Vec *fields; // IRT_STRUCT; of 'IrField *'
     };
 } IrType;
 
+// IR types are hash-consed, so they can be compared by pointer (and mustn't be
+// changed). Returns the type for one of 'IRT_VOID' to 'IRT_PTR'
+IrType * irt_scalar(int k);
+IrType * irt_vec(IrType *elem, size_t len); // 'len' lanes of a scalar 'elem'
+
+// Aggregates, for reading IR back in (see 'ir_file.h'); 'fields' is of
+// 'IrField *', and is freed if there's already an equal type
+IrType * irt_arr(IrType *elem, size_t len, size_t size, size_t align);
+IrType * irt_struct(size_t size, size_t align, Vec *fields);
+IrField * irt_field(IrType *t, size_t offset);
+
 enum {
     // Constants, globals, and functions
     IR_IMM,
     IR_FP,
     IR_GLOBAL,
+    IR_BB_ADDR, // Address of a BB in the same function ('&&label')
 
     // Memory access
     IR_FARG,  // Only at START of entry BB; references 'n'th argument
@@ -50,11 +58,24 @@ enum {
     IR_COPY,
     IR_ZERO,
     IR_PTRADD,   // Pointer addition (offset in bytes)
+    IR_PREFETCH, // Hint to fetch the cache line at 'ptr' ('__builtin_prefetch')
+    IR_STACK_SAVE,    // The stack pointer, before a scope's VLAs are allocated
+    IR_STACK_RESTORE, // Frees the VLAs allocated since the IR_STACK_SAVE 'ptr'
+
+    // Atomics (see '__atomic_load_n', etc.). Each is a barrier that no other
+    // memory access is moved across, whatever its order
+    IR_ATOMIC_LOAD,
+    IR_ATOMIC_STORE,
+    IR_ATOMIC_XCHG, // Stores 'val'; returns the old value
+    IR_ATOMIC_ADD,  // Adds 'val'; returns the old value
+    IR_ATOMIC_CAS,  // Stores 'val' if the old value is 'expected'; returns it
+    IR_FENCE,
 
     // Arithmetic
     IR_ADD,
     IR_SUB,
     IR_MUL,
+    IR_UMULH, // Top 64 bits of the unsigned 128-bit product of two i64s
     IR_SDIV, // Signed division
     IR_UDIV, // Unsigned division
     IR_FDIV, // Floating point division
@@ -67,6 +88,12 @@ enum {
     IR_SAR, // Arithmetic right shift (for signed ints, fill with sign bit)
     IR_SHR, // Logical right shift (for unsigned ints, fill with zero)
 
+    // Bit manipulation (on a 32 or 64-bit int)
+    IR_POPCNT, // Number of set bits
+    IR_CTZ,    // Number of trailing zeros (undefined for 0)
+    IR_CLZ,    // Number of leading zeros (undefined for 0)
+    IR_BSWAP,  // Reverses the order of the bytes
+
     // Comparisons
     IR_EQ, IR_NEQ,
     IR_SLT, IR_SLE, IR_SGT, IR_SGE, // Signed comparison (for signed ints)
@@ -77,22 +104,35 @@ enum {
     IR_TRUNC,
     IR_SEXT,    // Sign extend (for signed ints)
     IR_ZEXT,    // Zero extend (for unsigned ints)
+    IR_ANYEXT,  // Extend, leaving the new bits undefined (see 'bits.h')
     IR_PTR2I,   // Pointer -> integer
     IR_I2PTR,   // Integer -> pointer
-    IR_BITCAST, // Pointer -> another pointer
+    IR_BITCAST, // Pointer -> another pointer, or vector -> same sized vector
 
     IR_FTRUNC, // Floating point truncation
     IR_FEXT,   // Floating point extension
     IR_FP2I,   // Floating point -> integer
     IR_I2FP,   // Integer -> floating point
 
+    // Vectors (the arithmetic and conversions above also work lane by lane)
+    IR_SPLAT,  // Scalar -> vector with it in every lane
+    IR_REDUCE, // Vector -> scalar, combining its lanes with 'reduce_op'
+
     // Control flow
+    IR_SELECT, // 'sel ? l : r', without a branch (see 'if_convert.h')
     IR_PHI,
     IR_BR,     // Unconditional branch
     IR_CONDBR, // Conditional branch
+    IR_SWITCH, // Indexed branch (through a jump table)
+    IR_INDIRECT_BR, // Branch to an address from IR_BB_ADDR ('goto *ptr')
     IR_CALL,
     IR_CARG,   // Immediately after IR_CALL
+    IR_ASM,    // Inline assembly block
+    IR_ASMIN,  // Immediately after IR_ASM; an input (or the address of a
+               // memory operand)
+    IR_ASMOUT, // Immediately after the IR_ASMINs; a register output's value
     IR_RET,
+    IR_UNREACHABLE, // Can never run ('__builtin_unreachable'); no successors
 
     IR_LAST, // For tables indexed by opcode
 };
@@ -102,30 +142,66 @@ typedef struct {
     struct IrIns *ins; // Needed to generate PHIs
 } BrChain;
 
+enum { // Memory orders, numbered as GCC's '__ATOMIC_RELAXED', etc.
+    MO_RELAXED,
+    MO_CONSUME,
+    MO_ACQUIRE,
+    MO_RELEASE,
+    MO_ACQ_REL,
+    MO_SEQ_CST,
+};
+
+// Instructions are allocated from their own arena (see 'ARENA_IR_INS'), so a
+// function's instructions are packed together in the order they're created;
+// the fields are ordered to keep the struct free of padding
 typedef struct IrIns {
     struct IrIns *next, *prev;
     struct BB *bb;
-    int op;
     IrType *t;
     union {
         // Constants and globals
         uint64_t imm; // IR_IMM
-        struct { double fp; size_t fp_idx; /* for assembler */ }; // IR_FP
+        double fp; // IR_FP
         struct Global *g; // IR_GLOBAL
+        struct BB *label_bb; // IR_BB_ADDR
 
         // Memory access
-        size_t arg_idx; // IR_FARG
+        struct { // IR_FARG
+            size_t arg_idx;
+            int is_restrict; // A pointer declared with 'restrict'
+        };
         struct { // IR_ALLOC
             IrType *alloc_t;
             struct IrIns *count;
             size_t stack_slot; // For assembler
+            int escapes;       // For alias analysis (see 'analyse_escapes')
+        };
+        struct { // IR_LOAD, IR_STORE, IR_COPY
+            struct IrIns *src, *dst, *len;
+            size_t align; // Known alignment of the address beyond what
+                          // 'ptr_align' can see (0 if none; see 'vectorise')
+        };
+        struct { // IR_ZERO, IR_PREFETCH (which has 'locality' instead of
+                 // 'size'), and IR_STACK_RESTORE (which only has 'ptr')
+            struct IrIns *ptr, *size;
+            int locality; // 0 (none, 'prefetchnta') to 3 ('prefetcht0')
         };
-        struct { struct IrIns *src, *dst, *len; }; // IR_LOAD, IR_STORE, IR_COPY
-        struct { struct IrIns *ptr, *size; };      // IR_ZERO
         struct { struct IrIns *base, *offset; };   // IR_IDX
+        struct { // IR_ATOMIC_*, IR_FENCE
+            struct IrIns *addr, *val, *expected;
+            int order; // One of 'MO_RELAXED', etc.
+        };
 
-        // Unary and binary operations
-        struct { struct IrIns *l, *r; };
+        // Unary and binary operations; a vector shift's 'r' is a scalar IR_IMM.
+        // An IR_SELECT picks 'l' if 'sel' is non-zero, otherwise 'r' (for
+        // floats, 'sel' is always an IR_FLT or IR_FGT comparing 'l' and 'r').
+        // An IR_BITCAST between pointers from '__builtin_assume_aligned' has
+        // the alignment it promises in 'assumed_align' (otherwise 0)
+        struct {
+            struct IrIns *l, *r, *sel;
+            size_t assumed_align;
+        };
+        struct { struct IrIns *vec; int reduce_op; }; // IR_REDUCE (IR_ADD, etc.)
 
         // Control flow
         struct { // IR_PHI
@@ -138,37 +214,118 @@ typedef struct IrIns {
             struct BB *true, *false;
             Vec *true_chain, *false_chain; // of 'BrChain *'
         };
-        struct IrIns *fn;  // IR_CALL
-        struct IrIns *arg; // IR_CARG
+        struct { // IR_SWITCH; 'idx' is an unsigned 64-bit int, and jumps to
+                 // 'default_br' if it's past the end of the table
+            struct IrIns *idx;
+            struct BB *default_br;
+            Vec *table; // of 'BB *'
+            int in_range; // 'idx' is never past the end, so isn't checked
+        };
+        struct { // IR_INDIRECT_BR; 'targets' holds every BB whose address is
+                 // taken in the function, which is everywhere 'dest' can go
+            struct IrIns *dest;
+            Vec *targets; // of 'BB *'
+        };
+        struct { struct IrIns *fn; int is_vararg; }; // IR_CALL
+        struct { // IR_CARG, IR_ASMIN, IR_ASMOUT (which has no 'arg')
+            struct IrIns *arg;
+            int opr_idx; // IR_ASMIN, IR_ASMOUT; index in 'InlineAsm->oprs'
+        };
+        struct InlineAsm *inline_asm; // IR_ASM
         struct IrIns *ret; // IR_RET
     };
+    Vec *users; // of 'struct IrIns *'; see 'find_def_use'
+    int op;
+    int line; // With '-g', the source line it came from (0 if unknown)
+
+    // IR_CONDBR; 1 if 'true' is the likely successor, -1 if 'false' is, or 0 if
+    // unknown (see '__builtin_expect'). Outside the union, which it would
+    // otherwise make 8 bytes bigger
+    int likely;
     int vreg; // For assembler
-    size_t n; // For printing
+    int fold; // For assembler; 1 if folded into its only use, -1 if discharged
+              // where it's defined (IR_LOAD and comparisons)
+    uint32_t n; // For printing
 } IrIns;
 
+typedef struct Loop {
+    struct BB *header;
+    struct Loop *parent; // Enclosing loop (NULL if it's outermost)
+    Vec *bbs;            // of 'BB *'; includes the BBs of nested loops
+    int depth;           // 1 for an outermost loop
+} Loop;
+
 typedef struct BB {
     struct BB *next, *prev;
     IrIns *ir_head, *ir_last;
     struct AsmIns *asm_head, *asm_last;
     size_t n; // For printing
 
-    // For assembler
-    Vec *pred, *succ; // Control flow graph analysis
-    int *live_in;     // Liveness analysis (all regs live-in at the BB's start)
+    // For analysis (see 'analysis.h')
+    Vec *pred, *succ; // Control flow graph, of 'BB *'
+    int rpo;          // Index in reverse postorder (-1 if unreachable)
+    struct BB *idom;  // Immediate dominator (NULL for the entry BB)
+    Vec *dom_children, *dom_frontier; // of 'BB *'
+    Loop *loop;       // Innermost loop containing the BB (or NULL)
+
+    // '#pragma unroll' on the loop this BB is the header of: 0 if there isn't
+    // one, 1 for 'nounroll', UNROLL_FULL for no factor, otherwise the factor
+    int unroll;
+
+    // Its address is taken by an IR_BB_ADDR, so it's a target of every
+    // IR_INDIRECT_BR; it can't be merged away or have its edges retargeted
+    int addr_taken;
+
+    // Times the BB ran, from '-fprofile-use' (see 'profile.h'); -1 if unknown
+    int64_t freq;
 } BB;
 
 typedef struct {
     BB *entry, *last;
 
+    // Signature, for the assembler to work out where the arguments and return
+    // value are passed (aggregates are passed and returned by pointer in the IR)
+    Vec *params;  // of 'IrType *'
+    IrType *ret;
+
+    // '-finstrument-functions' and '-fpatchable-function-entry', after the
+    // function's attributes (see 'INSTRUMENT_FUNCTIONS')
+    struct Global *instrument; // The function itself, if it calls the hooks
+    int patchable_entry;       // Bytes of NOPs at its entry
+
+    char *file; // With '-g', the source file it's defined in (see 'DEBUG_INFO')
+
+    // For analysis
+    int analyses; // Set of the 'A_*' that are up to date (see 'analysis.h')
+    Vec *loops; // of 'Loop *'; enclosing loops come before nested ones
+    int64_t hot_freq; // A BB that ran this often is hot (0 without a profile)
+
     // For assembler
-    Vec *f32s, *f64s; // Per-function floating point constants
+    Vec *f32s, *f64s; // of 'uint64_t *'; the constants it uses (see 'fp_pool')
+    Vec *jump_tables; // of 'Vec *' of 'BB *'; for IR_SWITCHs
     int num_gprs, num_sse;
+    size_t stack_size;
+    size_t out_args_size; // For arguments passed on the stack, at the bottom
+    size_t aligned_size, frame_align; // For over-aligned objects (see
+                                      // 'alloc_aligned_slot')
+    int dyn_stack; // Moves rsp at run time, for VLAs (see 'asm_dyn_alloc')
+    size_t frame_size; // Most it takes from the stack itself (not counting
+                       // 'dyn_stack'), from the return address down; set by
+                       // 'patch_stack_sizes', for '-fstack-usage'
+    Vec *patch_with_stack_size; // of 'AsmIns *'
+
+    // For register allocator (see 'order_by_calls')
+    int ra_level; // It's allocated after every function at a lower level
+    uint64_t gpr_clobbers, sse_clobbers; // Caller-saved pregs it might write
+
+    struct CodegenStats *codegen; // With '--codegen-stats' (see 'stats.h')
 } Fn;
 
 typedef struct {
-    uint64_t offset;
-    struct Global *val; // with k = G_IMM, G_FP
-} InitElem;
+    uint64_t offset;   // Of the 8 byte pointer in the initialiser
+    struct Global *g;  // Points to 'g' + 'addend'
+    int64_t addend;
+} InitReloc;
 
 enum {
     G_NONE,
@@ -184,10 +341,19 @@ typedef struct Global {
     char *label;
     IrType *t;
     int linkage;
+    int visibility; // 'VIS_*'
+    int is_const; // Never written to (e.g., a 'const' object, string literal)
+    int is_cstring; // A string literal whose only null is its terminator
+    int is_tls;   // '_Thread_local': each thread has its own copy
+    int fn_attrs; // For a function; set of 'FA_*' (e.g., 'FA_PURE')
     union {
         uint64_t imm; // G_IMM
         double fp;    // G_FP
-        Vec *elems;   // G_INIT; of 'InitElem *'
+        struct { // G_INIT; 'num_bytes' of contents, then zeros up to 't->size'
+            char *bytes;
+            size_t num_bytes;
+            Vec *relocs; // of 'InitReloc *'; pointers to patch in, by offset
+        };
         struct { struct Global *g; int64_t offset; }; // G_PTR
         Fn *fn;       // G_FN
     };
@@ -195,4 +361,194 @@ typedef struct Global {
 
 Vec * compile(AstNode *n); // of 'Global *'
 
+// The same a node at a time, for '-fstream' (see 'parse'). 'compile_top'
+// returns the function 'n' defines (or NULL if it isn't a function
+// definition); the AST can be freed as soon as it returns. 'compile_end'
+// returns every global. A use of a global before its definition still refers
+// to the forward declaration (a G_NONE) in functions compiled before it
+typedef struct Unit Unit;
+Unit * compile_begin();
+Global * compile_top(Unit *u, AstNode *n);
+Vec * compile_end(Unit *u);
+
+// Frees what's left of a function's IR once it's been encoded, apart from its
+// instructions (which are freed with their arena) and what the rest of the
+// program still needs to know about it (e.g., its constants, for 'fp_pool',
+// and the caller-saved pregs it clobbers, for 'order_by_calls'); 'entry' is
+// left NULL
+void free_fn_ir(Fn *fn);
+
+enum { // Sections
+    SEC_UNDEF, // For symbols defined in another object file
+    SEC_TEXT,
+    SEC_RODATA,
+    SEC_CST4,  // The floating point constant pool (see 'fp_pool'), in
+    SEC_CST8,  // sections the linker can merge with other objects' pools
+    SEC_CSTRING, // String literals, which the linker can merge likewise
+    SEC_DATA,
+    SEC_BSS,
+    SEC_TDATA, // The initial contents of each thread's copy of a thread-local
+    SEC_TBSS,  // (or just its size, if it starts out zero)
+};
+
+// Where a global's contents go: functions in '.text'; 'char' string literals
+// in '.rodata.str1.1'; read only data with no pointers to patch in '.rodata';
+// objects that are all zero in '.bss', which takes no space in the object
+// file; thread-locals in '.tdata' or '.tbss' likewise; and everything else in
+// '.data'
+int global_section(Global *g);
+
+// '-ffunction-sections' and '-fdata-sections': give each function (or each
+// other global) a section of its own, named after it (e.g., '.text.main'), so
+// the linker can drop the ones nothing refers to with '--gc-sections'. Only
+// means anything for ELF
+extern int FUNCTION_SECTIONS, DATA_SECTIONS;
+
+// '-finstrument-functions': every function (without the attribute
+// 'no_instrument_function') calls 'HOOK_ENTER' once it's read its arguments,
+// and 'HOOK_EXIT' before it returns, each with its own address and its return
+// address. The calls are made by the assembler, so a function that's inlined
+// doesn't make them
+extern int INSTRUMENT_FUNCTIONS;
+#define HOOK_ENTER "__cyg_profile_func_enter"
+#define HOOK_EXIT  "__cyg_profile_func_exit"
+
+// '-fpatchable-function-entry=N': every function (unless its attribute
+// 'patchable_function_entry' says otherwise) starts with N one byte NOPs,
+// ahead of its prologue, for a tracer to patch a call to a probe over
+extern int PATCHABLE_ENTRY;
+
+// '-g': each instruction records the line of the statement it came from, for
+// the line table in the object file (see 'object.h'). Lines from a file other
+// than the function's own (e.g., from a macro defined in a header) are left
+// out, and an inlined function's instructions take the line of the call
+extern int DEBUG_INFO;
+
+// '-fdirect-ssa': each function's local variables are promoted to SSA values
+// (see 'build_ssa') as soon as it's compiled, rather than left as IR_ALLOCs
+// for 'mem2reg', which then doesn't run ('sroa' promotes the fields it splits
+// out itself)
+extern int DIRECT_SSA;
+
+// '-fassociative-math': floating point adds and multiplies may be regrouped,
+// so a loop's floating point reductions can be vectorised (see 'vectorise.h')
+// and split over several accumulators (see 'unroll.h'). '-freciprocal-math':
+// a floating point divide by a constant may become a multiply by its
+// reciprocal (see 'strength.h'). '-ffast-math' turns both on
+extern int ASSOCIATIVE_MATH, RECIPROCAL_MATH;
+
+// A function declared 'hot' or 'cold' that has a section of its own goes in
+// '.text.hot.<name>' or '.text.unlikely.<name>', which the linker gathers
+// together, away from the rest of '.text'
+int has_own_section(int section);
+char * section_name(int section, char *label, int fn_attrs); // 'label' is NULL
+                                                             // for shared
+
+// For optimisation passes and the assembler to modify the IR
+BB * new_bb();
+IrIns * new_ins(int op, IrType *t);
+void delete_ir(IrIns *ins);
+void insert_ir(IrIns *ins, IrIns *before); // 'ins' mustn't be in a BB
+IrIns * append_ir(BB *bb, IrIns *ins);     // Likewise; returns 'ins'
+
+// New instructions inserted before 'before'; and a phi at the start of 'bb',
+// which is left out of any BB if 'bb' is still empty
+IrIns * insert_op(int op, IrType *t, IrIns *l, IrIns *r, IrIns *before);
+IrIns * insert_imm(IrType *t, uint64_t imm, IrIns *before);
+IrIns * prepend_phi(IrType *t, BB *bb);
+
+// A new BB holding just 'term', linked in before 'before'
+BB * new_bb_before(IrIns *term, BB *before);
+
+// Whether 'ins' can be duplicated within its function: an IR_ALLOC is the one
+// stack slot for its variable, and inline assembly might define labels
+int can_copy(IrIns *ins);
+
+// Points the branches in a terminator that go to 'from' at 'to' instead
+void retarget_br(IrIns *br, BB *from, BB *to);
+
+// Links 'bb' into the function's list of BBs straight after 'after'
+void insert_bb_after(Fn *fn, BB *bb, BB *after);
+
+// Removes the entries for 'pred' from the phis in 'bb', once 'pred' no longer
+// branches there
+void remove_phi_pred(BB *bb, BB *pred);
+
+// Points the entries for 'from' in the phis in 'bb' at 'to' instead, once
+// 'to' branches there in place of 'from'
+void replace_phi_pred(BB *bb, BB *from, BB *to);
+
+// Removes the entry for 'pred' from one phi (e.g., when one of two edges from
+// 'pred' is merged away)
+void remove_phi_def(IrIns *phi, BB *pred);
+
+// The first phi from 'ins' on, skipping over any constants that have been
+// put before it; or NULL
+IrIns * next_phi(IrIns *ins);
+
+// Turns a conditional branch into a branch to its true target if 'taken', or
+// its false one otherwise, and removes the phi entries for the other
+void fold_condbr(IrIns *br, int taken);
+
+// Where 'pred' is in a phi's 'preds' (which it has to be); and the value the
+// phi takes coming from 'pred', or NULL if it has no entry for it
+size_t phi_idx(IrIns *phi, BB *pred);
+IrIns * phi_def(IrIns *phi, BB *pred);
+
+// Unlinks the BBs not reachable from the entry (with 'rpo' = -1, see
+// 'rev_postorder'), and any phi entries coming from them. The CFG analyses
+// need re-running afterwards
+void remove_unreachable_bbs(Fn *fn);
+
+// Whether reaching 'bb' is undefined: it ends in an IR_UNREACHABLE, and nothing
+// before that (a call or inline assembly) could stop it from getting there
+int is_dead_end(BB *bb);
+
+// Numbers the instructions in 'n' (so passes can keep per-instruction
+// information in arrays on the side) and returns how many there are
+size_t number_ir(Fn *fn);
+
+// Fills 'oprs' with pointers to each of an instruction's operands (so they can
+// be read or replaced) and returns how many there are. A phi's operands are
+// in 'defs' instead
+int ir_operands(IrIns *ins, IrIns **oprs[3]);
+
+// Whether 'ins' is a constant (including the address of a global or BB), with
+// the same value wherever it is in its function
+int is_const(IrIns *ins);
+
+// Whether 'ins' is a constant, or computes its value from its operands alone
+// without side effects (a division by 0 aside), so passes can merge, move or
+// evaluate it
+int is_pure(IrIns *ins);
+
+// Whether 'ins' is an atomic access or fence, which passes treat like a call:
+// it may read or write any memory that's escaped, and nothing is moved across it
+int is_atomic(IrIns *ins);
+
+// The attributes ('FA_*') of the function a call goes to, if it's called
+// directly, so passes can, e.g., delete a call to a 'pure' function whose
+// result isn't used; or 0
+int call_attrs(IrIns *call);
+
+// The global that 'size' bytes at 'offset' in a 'const' global's initialiser
+// point to, if they're exactly a pointer to it (with no addend; e.g., an entry
+// in a table of functions); or NULL
+Global * const_ptr_at(Global *g, int64_t offset, size_t size);
+
+// Def-use chains, for a pass that replaces values one at a time (or asks what
+// uses something) without rescanning the whole function each time.
+// 'find_def_use' fills in every instruction's 'users': each instruction that
+// uses it, once for each operand (or phi entry) that does. A pass has to call
+// 'add_user' for each operand it sets (which 'replace_all_uses' does itself),
+// and 'free_def_use' once it's done. 'users' can still list an instruction
+// that's since been deleted or stopped using it, but never misses one.
+// 'new_ins', 'insert_ir' and 'delete_ir' don't touch 'users': an instruction a
+// pass adds in between has to 'add_user' each of its operands, and one it
+// deletes stays listed as a user of its operands
+void find_def_use(Fn *fn);
+void add_user(IrIns *def, IrIns *user);
+void replace_all_uses(IrIns *old, IrIns *new); // Leaves 'old' with no users
+void free_def_use(Fn *fn);
+
 #endif
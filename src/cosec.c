@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cosec.h"
+#include "driver.h"
+#include "error.h"
+#include "pp.h"
+#include "jit.h"
+
+static pthread_mutex_t COMPILE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t DEFAULTS_ONCE = PTHREAD_ONCE_INIT;
+static GlobalOptions DEFAULTS;
+
+static void save_defaults() {
+    DEFAULTS = save_options();
+}
+
+static void parse_args(Options *opts, CosecOptions *o) {
+    default_options(opts);
+    opts->num_threads = 1; // Not worth starting threads for a small file
+    if (!o) {
+        return;
+    }
+    for (int i = 0; i < o->num_args; i++) {
+        if (!parse_option(opts, o->num_args, o->args, &i)) {
+            error("unknown option '%s'", o->args[i]);
+        }
+    }
+}
+
+static Map * virtual_headers(CosecOptions *o) {
+    if (!o || o->num_headers == 0) {
+        return NULL;
+    }
+    Map *headers = map_new();
+    for (size_t i = 0; i < o->num_headers; i++) {
+        VirtualHeader *vh = malloc(sizeof(VirtualHeader));
+        vh->contents = o->headers[i].contents;
+        vh->len = o->headers[i].len;
+        map_put(headers, intern(o->headers[i].name), vh);
+    }
+    return headers;
+}
+
+// Frees everything the compile allocated in arenas, on this thread and on the
+// backend's workers
+static void free_arenas() {
+    for (int arena = 0; arena < ARENA_LAST; arena++) {
+        arena_free(arena);
+    }
+    arena_free_orphans();
+}
+
+// Runs the pipeline with 'ERROR_JMP' set, so an error comes back here; then
+// 'load' (if it's not NULL) on the output while it's still in the arenas.
+// Returns 0 on success, with the messages in '*errors'
+static int run_pipeline(char *name, char *src, size_t len, CosecOptions *opts, Output *out,
+                        int format, void (*load)(Output *, void *), void *load_arg,
+                        char **errors) {
+    pthread_once(&DEFAULTS_ONCE, save_defaults);
+    pthread_mutex_lock(&COMPILE_LOCK);
+    Buf *b = buf_new();
+    int ok = 0;
+    jmp_buf jmp;
+    ERROR_OUT = b;
+    if (setjmp(jmp) == 0) {
+        ERROR_JMP = &jmp;
+        Options o;
+        parse_args(&o, opts);
+        if (format >= 0) {
+            o.format = format;
+        }
+        VIRTUAL_HEADERS = virtual_headers(opts);
+        pipeline(new_file_from(src, len, name), out, &o);
+        if (load) {
+            load(out, load_arg);
+        }
+        ok = 1;
+    }
+    ERROR_JMP = NULL;
+    ERROR_OUT = NULL;
+    VIRTUAL_HEADERS = NULL;
+    restore_options(&DEFAULTS);
+    free_arenas();
+    pthread_mutex_unlock(&COMPILE_LOCK);
+
+    buf_push(b, '\0');
+    *errors = b->data;
+    free(b);
+    return !ok;
+}
+
+int cosec_compile(char *name, char *src, size_t len, CosecOptions *opts, CosecResult *result) {
+    char *out = NULL;
+    size_t out_len = 0;
+    FILE *f_out = open_memstream(&out, &out_len);
+    if (!f_out) {
+        *result = (CosecResult) { .errors = strdup("error: can't create the output buffer\n") };
+        return 1;
+    }
+    Output output = { .f = f_out };
+    int failed = run_pipeline(name, src, len, opts, &output, -1, NULL, NULL, &result->errors);
+    fclose(f_out); // Sets 'out' and 'out_len'
+    if (failed) {
+        free(out);
+        out = NULL;
+        out_len = 0;
+    }
+    result->out = out;
+    result->out_len = out_len;
+    return failed;
+}
+
+void cosec_free_result(CosecResult *result) {
+    free(result->out);
+    free(result->errors);
+    result->out = result->errors = NULL;
+    result->out_len = 0;
+}
+
+struct CosecJit {
+    Jit *jit;
+};
+
+typedef struct {
+    CosecResolver resolve;
+    void *ctx;
+    Jit *jit;
+} JitLoad;
+
+static void load_jit(Output *out, void *arg) {
+    JitLoad *l = arg;
+    l->jit = jit_load(out->obj, l->resolve, l->ctx);
+}
+
+CosecJit * cosec_jit(char *name, char *src, size_t len, CosecOptions *opts,
+                     CosecResolver resolve, void *ctx, char **errors) {
+    Output output = { 0 };
+    JitLoad l = { .resolve = resolve, .ctx = ctx };
+    char *msgs;
+    int failed = run_pipeline(name, src, len, opts, &output, OUT_JIT, load_jit, &l, &msgs);
+    if (errors) {
+        *errors = msgs;
+    } else {
+        free(msgs);
+    }
+    if (failed) {
+        return NULL;
+    }
+    CosecJit *jit = malloc(sizeof(CosecJit));
+    jit->jit = l.jit;
+    return jit;
+}
+
+void * cosec_jit_symbol(CosecJit *jit, char *name) {
+    return jit_symbol(jit->jit, name);
+}
+
+void cosec_jit_free(CosecJit *jit) {
+    jit_free(jit->jit);
+    free(jit);
+}
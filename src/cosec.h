@@ -0,0 +1,76 @@
+
+#ifndef COSEC_H
+#define COSEC_H
+
+#include <stddef.h>
+
+// Library interface ('libcosec'). Compiles C source held in memory to NASM
+// assembly, an object file, or code that can be run straight away, without
+// touching the file system (other than for '#include's that aren't given as
+// virtual headers). Errors are returned rather than exiting the process.
+//
+// The options that are globals (e.g., '-fomit-frame-pointer') are shared by
+// the whole process, so calls from several threads take turns; each one's
+// options are put back to the defaults afterwards. Everything runs on the
+// calling thread unless '-j <n>' is given (for the preprocessor's thread and
+// the backend's workers).
+//
+// Each call frees its arenas, but not everything the compiler mallocs outside
+// them (most of its vectors and maps), so a process that compiles a great many
+// files grows by a few tens of KB per file
+
+typedef struct {
+    char *name;     // As it's '#include'd (with '""' or '<>'), e.g., "gen.h"
+    char *contents; // Needn't be NUL terminated
+    size_t len;
+} CosecHeader;
+
+typedef struct {
+    // Command line options, as for the 'cosec' command (e.g.,
+    // "-fformat=elf64", "-march=native"); no input files or '-o'
+    char **args;
+    int num_args;
+
+    // Virtual include files, found before any on disk
+    CosecHeader *headers;
+    size_t num_headers;
+} CosecOptions;
+
+typedef struct {
+    char *out;      // The assembly or object file, or NULL if it failed
+    size_t out_len;
+    char *errors;   // Error and warning messages ("" if there weren't any)
+} CosecResult;
+
+// Compiles the 'len' bytes of 'src' ('name' is its file name, for errors and
+// for '#include ""'s next to it). 'opts' can be NULL for the defaults.
+// Returns 0 on success
+int cosec_compile(char *name, char *src, size_t len, CosecOptions *opts, CosecResult *result);
+
+void cosec_free_result(CosecResult *result);
+
+// JIT. Compiles straight to machine code in executable memory in this process,
+// rather than to an object file, so the functions it defines can be called
+// through the pointers 'cosec_jit_symbol' returns. The format options are
+// ignored.
+//
+// 'resolve' gives the address of each symbol the code uses but doesn't define
+// (e.g., "printf"), or NULL if it doesn't know it; if 'resolve' is NULL,
+// they're looked up among the symbols the process has loaded, as 'dlsym'
+// does. Calls to symbols more than 2 GB away go through a stub, but taking
+// the address of such a symbol (or using an 'extern' variable) is an error
+typedef struct CosecJit CosecJit;
+typedef void * (*CosecResolver)(void *ctx, char *name);
+
+// Returns NULL if it failed. '*errors' is set to the error and warning
+// messages (to be free'd) if 'errors' isn't NULL
+CosecJit * cosec_jit(char *name, char *src, size_t len, CosecOptions *opts,
+                     CosecResolver resolve, void *ctx, char **errors);
+
+// The address of the global function or variable 'name', or NULL
+void * cosec_jit_symbol(CosecJit *jit, char *name);
+
+// Unmaps the code and data; pointers into them mustn't be used after
+void cosec_jit_free(CosecJit *jit);
+
+#endif
@@ -0,0 +1,381 @@
+#include <stdlib.h>
+
+#include "dce.h"
+#include "analysis.h"
+
+// The CFG is simplified first, to a fixed point, since each change can expose
+// more: threading a branch through an empty BB can leave it unreachable, and
+// deleting a BB can leave its successor with a single predecessor to merge
+// into. Phis that end up with one incoming value are replaced by it, then dead
+// instructions are swept.
+//
+// Instructions are numbered (in 'n') once at the start; the pass never creates
+// any, so the numbering stays valid throughout.
+
+static int has_phis(BB *bb) {
+    for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+        if (ins->op == IR_PHI) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void replace_bb(Vec *bbs, BB *from, BB *to) {
+    for (size_t i = 0; i < vec_len(bbs); i++) {
+        if (vec_get(bbs, i) == from) {
+            vec_put(bbs, i, to);
+        }
+    }
+}
+
+static IrIns * resolve(IrIns **repl, IrIns *ins) {
+    while (repl[ins->n]) {
+        ins = repl[ins->n];
+    }
+    return ins;
+}
+
+
+// ---- CFG Simplification ----------------------------------------------------
+
+// Points branches to a BB containing only an IR_BR straight at its target.
+// The target can't have phis, since each predecessor would need an entry, and
+// the BB can't have its address taken. Leaves the empty BB unreachable
+static int thread_jumps(Fn *fn) {
+    int changed = 0;
+    for (BB *bb = fn->entry->next; bb; bb = bb->next) {
+        IrIns *br = bb->ir_head;
+        if (!br || br != bb->ir_last || br->op != IR_BR) {
+            continue; // Not empty
+        }
+        BB *target = br->br;
+        if (target == bb || has_phis(target) || vec_len(bb->pred) == 0 ||
+                bb->addr_taken) {
+            continue;
+        }
+        // Keep 'pred' and 'succ' right for the BBs still to come
+        for (size_t i = 0; i < vec_len(target->pred); i++) {
+            if (vec_get(target->pred, i) == bb) {
+                vec_remove(target->pred, i);
+                break;
+            }
+        }
+        for (size_t i = 0; i < vec_len(bb->pred); i++) {
+            BB *pred = vec_get(bb->pred, i);
+            retarget_br(pred->ir_last, bb, target);
+            replace_bb(pred->succ, bb, target);
+            vec_push(target->pred, pred);
+        }
+        vec_empty(bb->pred);
+        changed = 1;
+    }
+    return changed;
+}
+
+static int has_one_target(IrIns *br) {
+    if (br->op == IR_CONDBR) {
+        return br->true == br->false;
+    }
+    for (size_t i = 0; i < vec_len(br->table); i++) { // IR_SWITCH
+        if (vec_get(br->table, i) != br->default_br) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// The target a conditional branch always takes, since its condition is a
+// constant or the other side is a dead end (see 'is_dead_end'); or NULL
+static BB * only_target(IrIns *br) {
+    if (br->cond->op == IR_IMM) {
+        return br->cond->imm ? br->true : br->false;
+    } else if (is_dead_end(br->false)) {
+        return br->true;
+    } else if (is_dead_end(br->true)) {
+        return br->false;
+    }
+    return NULL;
+}
+
+// A jump table that never goes to its default (or to a hole in the table
+// that's a dead end) doesn't need to check its index
+static int fold_switch(IrIns *br) {
+    BB *dead = br->default_br;
+    if (br->in_range || !is_dead_end(dead)) {
+        return 0;
+    }
+    BB *live = NULL;
+    for (size_t i = 0; i < vec_len(br->table) && !live; i++) {
+        BB *target = vec_get(br->table, i);
+        live = is_dead_end(target) ? NULL : target;
+    }
+    if (!live) {
+        return 0; // Every target is a dead end
+    }
+    retarget_br(br, dead, live);
+    remove_phi_pred(dead, br->bb);
+    br->in_range = 1;
+    return 1;
+}
+
+// A conditional branch (or jump table) with the same target either way doesn't
+// need its condition (which is swept later if nothing else uses it); nor does
+// one that can only ever go one way
+static int fold_branches(Fn *fn) {
+    int changed = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        IrIns *br = bb->ir_last;
+        if (br && br->op == IR_SWITCH && !has_one_target(br)) {
+            changed |= fold_switch(br);
+            continue;
+        }
+        if (!br || (br->op != IR_CONDBR && br->op != IR_SWITCH)) {
+            continue;
+        }
+        BB *target;
+        if (has_one_target(br)) {
+            target = br->op == IR_CONDBR ? br->true : br->default_br;
+            if (has_phis(target)) {
+                continue;
+            }
+        } else if ((target = only_target(br))) {
+            remove_phi_pred(target == br->true ? br->false : br->true, bb);
+        } else {
+            continue;
+        }
+        br->op = IR_BR;
+        br->br = target;
+        changed = 1;
+    }
+    return changed;
+}
+
+static int remove_dead_bbs(Fn *fn) {
+    size_t num_bbs = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        num_bbs++;
+    }
+    Vec *rpo = rev_postorder(fn);
+    int all_reachable = vec_len(rpo) == num_bbs;
+    vec_free(rpo);
+    if (all_reachable) {
+        return 0;
+    }
+    remove_unreachable_bbs(fn);
+    return 1;
+}
+
+// Appends 'succ' to 'bb' when 'bb' always branches to it and is its only
+// predecessor. Phis in 'succ' have a single entry, so are replaced by it
+static void merge_bbs(Fn *fn, BB *bb, BB *succ, IrIns **repl) {
+    delete_ir(bb->ir_last); // The IR_BR
+    IrIns *ins = succ->ir_head;
+    while (ins) {
+        IrIns *next = ins->next;
+        if (ins->op == IR_PHI) {
+            assert(vec_len(ins->defs) == 1);
+            repl[ins->n] = vec_get(ins->defs, 0);
+        } else {
+            ins->bb = bb;
+            ins->prev = bb->ir_last;
+            ins->next = NULL;
+            if (bb->ir_last) {
+                bb->ir_last->next = ins;
+            } else {
+                bb->ir_head = ins;
+            }
+            bb->ir_last = ins;
+        }
+        ins = next;
+    }
+    for (size_t i = 0; i < vec_len(succ->succ); i++) {
+        BB *after = vec_get(succ->succ, i);
+        replace_phi_pred(after, succ, bb);
+        replace_bb(after->pred, succ, bb);
+    }
+    vec_empty(bb->succ);
+    vec_push_all(bb->succ, succ->succ);
+
+    if (succ->prev) succ->prev->next = succ->next;
+    if (succ->next) succ->next->prev = succ->prev;
+    if (fn->last == succ) fn->last = succ->prev;
+}
+
+static int merge_lines(Fn *fn, IrIns **repl) {
+    int changed = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        while (bb->ir_last && bb->ir_last->op == IR_BR) {
+            BB *succ = bb->ir_last->br;
+            if (succ == bb || succ == fn->entry || vec_len(succ->pred) != 1 ||
+                    succ->addr_taken) {
+                break;
+            }
+            merge_bbs(fn, bb, succ, repl);
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+static void simplify_cfg(Fn *fn, IrIns **repl) {
+    int changed = 1;
+    while (changed) {
+        analyse_cfg(fn);
+        changed = thread_jumps(fn);
+        changed |= fold_branches(fn);
+        analyse_cfg(fn);
+        changed |= remove_dead_bbs(fn);
+        analyse_cfg(fn);
+        changed |= merge_lines(fn, repl);
+    }
+}
+
+
+// ---- Dead Code Elimination -------------------------------------------------
+
+// A phi is redundant if all its entries are the same value (other than the
+// phi itself, around a loop)
+static int remove_trivial_phis(Fn *fn, IrIns **repl) {
+    int changed = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        IrIns *ins = bb->ir_head;
+        while (ins) {
+            IrIns *next = ins->next;
+            if (ins->op == IR_PHI) {
+                IrIns *unique = NULL;
+                int trivial = 1;
+                for (size_t i = 0; i < vec_len(ins->defs) && trivial; i++) {
+                    IrIns *def = resolve(repl, vec_get(ins->defs, i));
+                    if (def == ins || def == unique) {
+                        continue;
+                    } else if (unique) {
+                        trivial = 0; // Two different values
+                    }
+                    unique = def;
+                }
+                if (trivial && unique) {
+                    repl[ins->n] = unique;
+                    delete_ir(ins);
+                    changed = 1;
+                }
+            }
+            ins = next;
+        }
+    }
+    return changed;
+}
+
+static void replace_uses(Fn *fn, IrIns **repl) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                *oprs[i] = resolve(repl, *oprs[i]);
+            }
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    vec_put(ins->defs, i, resolve(repl, vec_get(ins->defs, i)));
+                }
+            }
+        }
+    }
+}
+
+// A call to a 'pure' or 'const' function has no side effects, so it's only
+// live if its result is used (and then so are its IR_CARGs)
+static int is_root(IrIns *ins) {
+    switch (ins->op) {
+    case IR_CALL:
+        return !(call_attrs(ins) & (FA_PURE | FA_CONST));
+    case IR_STORE: case IR_COPY: case IR_ZERO: case IR_PREFETCH:
+    case IR_STACK_RESTORE: case IR_ASM: case IR_ASMIN:
+    case IR_ATOMIC_LOAD: case IR_ATOMIC_STORE: case IR_ATOMIC_XCHG:
+    case IR_ATOMIC_ADD: case IR_ATOMIC_CAS: case IR_FENCE:
+    case IR_BR: case IR_CONDBR: case IR_SWITCH: case IR_INDIRECT_BR: case IR_RET:
+    case IR_UNREACHABLE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void mark_live(IrIns *ins, int *live, Vec *work) {
+    if (!live[ins->n]) {
+        live[ins->n] = 1;
+        vec_push(work, ins);
+    }
+}
+
+// Everything that an instruction with side effects (transitively) uses is
+// live; the rest is deleted
+static void remove_dead_ins(Fn *fn, size_t num_ins) {
+    int *live = calloc(num_ins, sizeof(int));
+    Vec *work = vec_new();
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (is_root(ins)) {
+                mark_live(ins, live, work);
+            }
+        }
+    }
+    while (vec_len(work) > 0) {
+        IrIns *ins = vec_pop(work);
+        IrIns **oprs[3];
+        int num_oprs = ir_operands(ins, oprs);
+        for (int i = 0; i < num_oprs; i++) {
+            mark_live(*oprs[i], live, work);
+        }
+        if (ins->op == IR_PHI) {
+            for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                mark_live(vec_get(ins->defs, i), live, work);
+            }
+        } else if (ins->op == IR_CALL) {
+            for (IrIns *carg = ins->next; carg && carg->op == IR_CARG; carg = carg->next) {
+                mark_live(carg, live, work);
+            }
+        }
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        IrIns *ins = bb->ir_head;
+        while (ins) {
+            IrIns *next = ins->next;
+            if (!live[ins->n]) {
+                delete_ir(ins);
+            }
+            ins = next;
+        }
+    }
+    free(live);
+}
+
+void merge_straight_lines(Fn *fn) {
+    size_t num_ins = number_ir(fn);
+    IrIns **repl = calloc(num_ins, sizeof(IrIns *));
+    analyse_cfg(fn);
+    if (merge_lines(fn, repl)) {
+        replace_uses(fn, repl);
+        analyse_cfg(fn);
+        vec_free(rev_postorder(fn));
+        analyse_dominators(fn);
+        analyse_loops(fn);
+    }
+    free(repl);
+}
+
+void dce(Fn *fn) {
+    size_t num_ins = number_ir(fn);
+    IrIns **repl = calloc(num_ins, sizeof(IrIns *));
+    simplify_cfg(fn, repl);
+    while (remove_trivial_phis(fn, repl)) {
+        // Removing one phi can make others trivial
+    }
+    replace_uses(fn, repl);
+    remove_dead_ins(fn, num_ins);
+    free(repl);
+
+    analyse_cfg(fn);
+    analyse_dominators(fn);
+    analyse_loops(fn);
+}
@@ -0,0 +1,20 @@
+
+#ifndef COSEC_DCE_H
+#define COSEC_DCE_H
+
+#include "compile.h"
+
+// Dead code elimination and CFG simplification. Removes instructions whose
+// results are never used (and have no side effects), threads branches
+// through empty BBs, merges straight-line BBs, and drops unreachable ones.
+// A branch that can only go one way (since its condition is a constant, or
+// its other side is a dead end; see 'is_dead_end') becomes unconditional.
+// Requires 'analyse', and keeps it up to date
+void dce(Fn *fn);
+
+// Just the merging of straight-line BBs, for a pass that leaves them behind
+// (with phis that have a single entry) in loops that later passes want to
+// match. Unlike the rest of 'dce', leaves every loop's preheader alone
+void merge_straight_lines(Fn *fn);
+
+#endif
@@ -1,5 +1,6 @@
 
 #include <ctype.h>
+#include <string.h>
 #include <limits.h>
 #include <inttypes.h>
 
@@ -15,10 +16,10 @@ static char * AST_NAMES[N_LAST] = {
     "==", "!=", "<", "<=", ">", ">=", "&&", "||",
     "=", "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", "<<=", ">>=",
     ",", "?",
-    "-", "~", "!", "++", "--", "++", "--", "*", "&", "conv",
-    "idx", "call", ".",
+    "-", "~", "!", "++", "--", "++", "--", "*", "&", "&&", "conv",
+    "idx", "call", "builtin", ".",
     "fn def", "typedef", "decl", "if", "while", "do while", "for", "switch",
-    "case", "default", "break", "continue", "goto", "label", "return",
+    "case", "default", "break", "continue", "goto", "goto *", "label", "return", "asm",
 };
 
 static void print_nodes(AstNode *n, int indent);
@@ -33,6 +34,7 @@ static void print_struct_fields(AstType *t) {
         Field *f = vec_get(t->fields, i);
         print_type(f->t);
         if (f->name) printf(" %s", f->name);
+        if (f->is_bit_field) printf(" : %zu", f->bits);
         printf(", ");
     }
     printf("}");
@@ -59,6 +61,7 @@ static void print_type(AstType *t) {
     case T_INT:     printf(t->is_unsigned ? "uint" : "int"); break;
     case T_LONG:    printf(t->is_unsigned ? "ulong" : "long"); break;
     case T_LLONG:   printf(t->is_unsigned ? "ullong" : "llong"); break;
+    case T_I128:    printf(t->is_unsigned ? "u128" : "i128"); break;
     case T_FLOAT:   printf("float"); break;
     case T_DOUBLE:  printf("double"); break;
     case T_LDOUBLE: printf("ldouble"); break;
@@ -161,6 +164,11 @@ static void print_expr(AstNode *n) {
         }
         break;
 
+    case N_LABEL_ADDR:
+        print_type(n->t);
+        printf(" &&%s", n->goto_label);
+        break;
+
         // Operations
     case N_POST_INC: case N_POST_DEC:
         print_type(n->t);
@@ -168,11 +176,13 @@ static void print_expr(AstNode *n) {
         print_expr(n->l);
         printf(" %s )", AST_NAMES[n->k]);
         break;
-    case N_CALL:
+    case N_CALL: case N_BUILTIN:
         print_type(n->t);
-        printf(" ( call ");
-        print_expr(n->fn);
-        printf(" ");
+        printf(" ( %s ", AST_NAMES[n->k]);
+        if (n->k == N_CALL) {
+            print_expr(n->fn);
+            printf(" ");
+        }
         for (size_t i = 0; i < vec_len(n->args); i++) {
             AstNode *arg = vec_get(n->args, i);
             print_expr(arg);
@@ -346,6 +356,12 @@ static void print_node(AstNode *n, int indent) {
         print_indent(indent);
         printf("goto %s\n", n->goto_label);
         break;
+    case N_INDIRECT_GOTO:
+        print_indent(indent);
+        printf("goto *");
+        print_expr(n->goto_ptr);
+        printf("\n");
+        break;
     case N_LABEL:
         print_indent(0);
         printf("%s:\n", n->label);
@@ -359,6 +375,21 @@ static void print_node(AstNode *n, int indent) {
         }
         printf("\n");
         break;
+    case N_ASM:
+        print_indent(indent);
+        printf("asm \"%s\"", quote_str(n->inline_asm->template,
+                                        strlen(n->inline_asm->template)));
+        for (size_t i = 0; i < vec_len(n->asm_args); i++) {
+            AstNode *arg = vec_get(n->asm_args, i);
+            printf(" ");
+            if (arg) {
+                print_expr(arg);
+            } else {
+                printf("%" PRIu64, n->inline_asm->oprs[i].imm);
+            }
+        }
+        printf("\n");
+        break;
     default:
         print_indent(indent);
         print_expr(n);
@@ -379,22 +410,118 @@ void print_ast(AstNode *n) {
 }
 
 
+// ---- Struct Layouts --------------------------------------------------------
+
+// Like 'pahole': each field's offset and size, the holes that padding leaves
+// between them, and where each cache line starts. A field that could fit in
+// one line but crosses into the next is flagged, since reading it touches both
+
+static char * aggr_kind(AstType *t) {
+    return t->k == T_STRUCT ? "struct" : "union";
+}
+
+// Nested structs and unions by their tag, rather than all their fields
+static void print_field_type(AstType *t, Vec *aggrs) {
+    switch (t->k) {
+    case T_PTR: print_field_type(t->ptr, aggrs); printf("*"); return;
+    case T_ARR:
+        print_field_type(t->elem, aggrs);
+        printf("[%" PRIu64 "]", t->len && t->len->k == N_IMM ? t->len->imm : 0);
+        return;
+    case T_STRUCT: case T_UNION:
+        for (size_t i = 0; i < vec_len(aggrs); i++) {
+            AggrDef *d = vec_get(aggrs, i);
+            if (d->t == t) {
+                printf("%s %s", aggr_kind(t), d->tag ? d->tag : "<anonymous>");
+                return;
+            }
+        }
+        printf("%s", aggr_kind(t));
+        return;
+    default: print_type(t); return;
+    }
+}
+
+static void print_layout(AggrDef *d, Vec *aggrs) {
+    AstType *t = d->t;
+    printf("%s %s { // %s:%d\n", aggr_kind(t), d->tag ? d->tag : "<anonymous>",
+           d->tk->f->name ? d->tk->f->name : "<input>", d->tk->line);
+    size_t end = 0, num_holes = 0, holes = 0, crossings = 0;
+    for (size_t i = 0; i < vec_len(t->fields); i++) {
+        Field *f = vec_get(t->fields, i);
+        size_t first = f->offset * 8 + f->bit_offset; // A bit-field's bits, not its unit
+        size_t start = first / 8;
+        if (start > end) {
+            printf("    // XXX %zu byte hole\n", start - end);
+            num_holes++;
+            holes += start - end;
+        }
+        if (t->k == T_STRUCT && i > 0 && first % (CACHE_LINE * 8) == 0) {
+            printf("    // --- cache line %zu (%zu bytes) ---\n",
+                   start / CACHE_LINE, start);
+        }
+        printf("    ");
+        print_field_type(f->t, aggrs);
+        if (f->is_bit_field) {
+            printf(" %s : %zu; // offset %zu, bit %zu\n", f->name, f->bits,
+                   start, first % 8);
+            size_t f_end = (first + f->bits + 7) / 8;
+            end = f_end > end ? f_end : end;
+            continue;
+        }
+        printf(" %s; // offset %zu, size %zu", f->name ? f->name : "<anonymous>",
+               f->offset, f->t->size);
+        size_t last = f->offset + f->t->size - 1;
+        if (f->t->size > 0 && f->t->size <= CACHE_LINE &&
+                f->offset / CACHE_LINE != last / CACHE_LINE) {
+            printf(" (crosses a cache line)");
+            crossings++;
+        }
+        printf("\n");
+        size_t f_end = f->offset + f->t->size;
+        end = f_end > end ? f_end : end;
+    }
+    size_t lines = (t->size + CACHE_LINE - 1) / CACHE_LINE;
+    printf("}; // size %zu, align %zu, %zu cache line%s, %zu hole%s (%zu bytes), "
+           "%zu bytes of tail padding, %zu bytes wasted, %zu field%s crossing "
+           "cache lines\n\n", t->size, t->align, lines, lines == 1 ? "" : "s",
+           num_holes, num_holes == 1 ? "" : "s", holes, t->size - end,
+           holes + t->size - end, crossings, crossings == 1 ? "" : "s");
+}
+
+void print_struct_layouts(Vec *aggrs) {
+    for (size_t i = 0; i < vec_len(aggrs); i++) {
+        print_layout(vec_get(aggrs, i), aggrs);
+    }
+}
+
+
 // ---- SSA IR ----------------------------------------------------------------
 
 #define BB_PREFIX "._BB"
 
+static char *MEM_ORDER_NAMES[] = {
+    "relaxed", "consume", "acquire", "release", "acq_rel", "seq_cst",
+};
+
 static char *IR_OP_NAMES[IR_LAST] = {
-    "IMM", "FP", "GLOBAL",
-    "FARG", "ALLOC", "LOAD", "STORE", "COPY", "ZERO", "PTRADD",
-    "ADD", "SUB", "MUL", "SDIV", "UDIV", "FDIV", "SMOD", "UMOD",
+    "IMM", "FP", "GLOBAL", "BB_ADDR",
+    "FARG", "ALLOC", "LOAD", "STORE", "COPY", "ZERO", "PTRADD", "PREFETCH",
+    "STACK_SAVE", "STACK_RESTORE",
+    "ATOMIC_LOAD", "ATOMIC_STORE", "ATOMIC_XCHG", "ATOMIC_ADD", "ATOMIC_CAS",
+    "FENCE",
+    "ADD", "SUB", "MUL", "UMULH", "SDIV", "UDIV", "FDIV", "SMOD", "UMOD",
     "AND", "OR", "XOR", "SHL", "SAR", "SHR",
+    "POPCNT", "CTZ", "CLZ", "BSWAP",
     "EQ", "NEQ", 
     "SLT", "SLE", "SGT", "SGE",
     "ULT", "ULE", "UGT", "UGE",
     "FLT", "FLE", "FGT", "FGE",
-    "TRUNC", "SEXT", "ZEXT", "PTR2I", "I2PTR", "BITCAST",
+    "TRUNC", "SEXT", "ZEXT", "ANYEXT", "PTR2I", "I2PTR", "BITCAST",
     "FTRUNC", "FEXT", "FP2I", "I2FP",
-    "PHI", "BR", "CONDBR", "CALL", "CARG", "RET",
+    "SPLAT", "REDUCE",
+    "SELECT", "PHI", "BR", "CONDBR", "SWITCH", "INDIRECT_BR", "CALL", "CARG", "ASM", "ASMIN", "ASMOUT",
+    "RET", "UNREACHABLE",
 };
 
 static void print_irt(IrType *t) {
@@ -412,6 +539,11 @@ static void print_irt(IrType *t) {
         print_irt(t->elem);
         printf("]");
         break;
+    case IRT_VEC:
+        printf("<%zu x ", t->len);
+        print_irt(t->elem);
+        printf(">");
+        break;
     case IRT_STRUCT:
         printf("struct { ");
         for (size_t i = 0; i < vec_len(t->fields); i++) {
@@ -425,39 +557,82 @@ static void print_irt(IrType *t) {
 }
 
 static void print_ins(IrIns *ins) {
-    printf("\t%.4zu\t", ins->n);
+    printf("\t%.4u\t", ins->n);
     print_irt(ins->t);
     printf("\t%s\t", IR_OP_NAMES[ins->op]);
     switch (ins->op) {
     case IR_IMM:    printf("+%" PRIi64, ins->imm); break;
     case IR_FP:     printf("+%g", ins->fp); break;
     case IR_GLOBAL: printf("%s", ins->g->label); break;
+    case IR_BB_ADDR: printf(BB_PREFIX "%zu", ins->label_bb->n); break;
     case IR_FARG:   printf("%zu", ins->arg_idx); break;
     case IR_ALLOC:
         print_irt(ins->alloc_t);
         if (ins->count) {
-            printf("\t%.4zu", ins->count->n);
+            printf("\t%.4u", ins->count->n);
         }
         break;
-    case IR_STORE: printf("%.4zu -> %.4zu", ins->src->n, ins->dst->n); break;
-    case IR_COPY:  printf("%.4zu -> %.4zu (size %.4zu)", ins->src->n,
+    case IR_STORE: printf("%.4u -> %.4u", ins->src->n, ins->dst->n); break;
+    case IR_COPY:  printf("%.4u -> %.4u (size %.4u)", ins->src->n,
                           ins->dst->n, ins->len->n); break;
     case IR_PHI:
         for (size_t i = 0; i < vec_len(ins->preds); i++) {
             BB *pred = vec_get(ins->preds, i);
             IrIns *def = vec_get(ins->defs, i);
-            printf("[ " BB_PREFIX "%zu -> %.4zu ] ", pred->n, def->n);
+            printf("[ " BB_PREFIX "%zu -> %.4u ] ", pred->n, def->n);
         }
         break;
+    case IR_PREFETCH: printf("%.4u\t%d", ins->ptr->n, ins->locality); break;
+    case IR_STACK_SAVE: break;
+    case IR_STACK_RESTORE: printf("%.4u", ins->ptr->n); break;
+    case IR_REDUCE:
+        printf("%.4u\t%s", ins->vec->n, IR_OP_NAMES[ins->reduce_op]);
+        break;
+    case IR_SELECT:
+        printf("%.4u ? %.4u : %.4u", ins->sel->n, ins->l->n, ins->r->n);
+        break;
     case IR_BR: printf(BB_PREFIX "%zu", ins->br ? ins->br->n : 0); break;
+    case IR_ATOMIC_LOAD: case IR_ATOMIC_STORE: case IR_ATOMIC_XCHG:
+    case IR_ATOMIC_ADD: case IR_ATOMIC_CAS: case IR_FENCE:
+        if (ins->val) printf("%.4u -> ", ins->val->n);
+        if (ins->addr) printf("%.4u", ins->addr->n);
+        if (ins->expected) printf(" (if %.4u)", ins->expected->n);
+        printf("\t%s", MEM_ORDER_NAMES[ins->order]);
+        break;
+    case IR_ASM:
+        printf("\"%s\"", quote_str(ins->inline_asm->template,
+                                   strlen(ins->inline_asm->template)));
+        break;
+    case IR_CALL:
+        printf("%.4u", ins->fn->n);
+        if (ins->is_vararg) printf("\t...");
+        break;
+    case IR_ASMIN:  printf("%%%d\t%.4u", ins->opr_idx, ins->arg->n); break;
+    case IR_ASMOUT: printf("%%%d", ins->opr_idx); break;
     case IR_CONDBR:
-        printf("%.4zu\t", ins->cond->n);
+        printf("%.4u\t", ins->cond->n);
         printf(BB_PREFIX "%zu\t", ins->true ? ins->true->n : 0);
         printf(BB_PREFIX "%zu", ins->false ? ins->false->n : 0);
         break;
+    case IR_SWITCH:
+        printf("%.4u\t", ins->idx->n);
+        for (size_t i = 0; i < vec_len(ins->table); i++) {
+            BB *target = vec_get(ins->table, i);
+            printf(BB_PREFIX "%zu ", target->n);
+        }
+        printf("\t" BB_PREFIX "%zu", ins->default_br->n);
+        if (ins->in_range) printf("\t(in range)");
+        break;
+    case IR_INDIRECT_BR:
+        printf("%.4u\t", ins->dest->n);
+        for (size_t i = 0; i < vec_len(ins->targets); i++) {
+            BB *target = vec_get(ins->targets, i);
+            printf(BB_PREFIX "%zu ", target->n);
+        }
+        break;
     default:
-        if (ins->l) printf("%.4zu", ins->l->n);
-        if (ins->r) printf("\t%.4zu", ins->r->n);
+        if (ins->l) printf("%.4u", ins->l->n);
+        if (ins->r) printf("\t%.4u", ins->r->n);
         break;
     }
     printf("\n");
@@ -501,14 +676,16 @@ static void print_global_val(Global *g) {
     case G_IMM: printf("%" PRIu64, g->imm); break;
     case G_FP:  printf("%g", g->fp); break;
     case G_INIT:
-        printf("{ ");
-        for (size_t i = 0; i < vec_len(g->elems); i++) {
-            InitElem *elem = vec_get(g->elems, i);
-            printf("[%" PRIu64 "] = ", elem->offset);
-            print_global_val(elem->val);
-            printf(", ");
+        printf("\"%s\"", quote_str(g->bytes, g->num_bytes));
+        for (size_t i = 0; i < vec_len(g->relocs); i++) {
+            InitReloc *r = vec_get(g->relocs, i);
+            printf(", [%" PRIu64 "] = &%s", r->offset, r->g->label);
+            if (r->addend > 0) {
+                printf(" + %" PRIu64, r->addend);
+            } else if (r->addend < 0) {
+                printf(" - %" PRIu64, -r->addend);
+            }
         }
-        printf("}");
         break;
     case G_PTR:
         printf("&%s", g->g->label);
@@ -5,6 +5,11 @@
 #include "parse.h"
 
 void print_ast(AstNode *ast);
+
+#define CACHE_LINE 64 // Bytes
+
+// For '--struct-layout-report'; 'aggrs' is of 'AggrDef *' (see 'parse')
+void print_struct_layouts(Vec *aggrs);
 void print_ir(Vec *globals);
 
 #endif
@@ -0,0 +1,107 @@
+#include <stdlib.h>
+
+#include "dge.h"
+
+// Globals are marked by interned label rather than by 'Global', since a
+// declaration before the definition is a different 'Global' with the same
+// label; a label is live if anything live refers to any of its 'Global's.
+
+typedef struct {
+    Map *by_label; // of 'Vec *' of 'Global *'
+    Map *live;     // of 'Vec *' (the same as in 'by_label'), by label
+    Vec *work;     // of 'Vec *' of 'Global *'; live, but not yet scanned
+} Reach;
+
+static void mark(Reach *r, Global *g) {
+    char *label = intern(g->label);
+    if (map_get(r->live, label)) {
+        return;
+    }
+    Vec *gs = map_get(r->by_label, label);
+    map_put(r->live, label, gs);
+    vec_push(r->work, gs);
+}
+
+// The calls to the '-finstrument-functions' hooks are added by the
+// assembler, so the IR doesn't refer to them
+static void mark_hook(Reach *r, char *hook) {
+    Vec *gs = map_get(r->by_label, intern(prepend_underscore(hook)));
+    if (gs) {
+        mark(r, vec_get(gs, 0));
+    }
+}
+
+static void mark_refs_in_fn(Reach *r, Fn *fn) {
+    if (fn->instrument) {
+        mark_hook(r, HOOK_ENTER);
+        mark_hook(r, HOOK_EXIT);
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_GLOBAL) {
+                mark(r, ins->g);
+            }
+        }
+    }
+}
+
+static void mark_refs(Reach *r, Global *g) {
+    switch (g->k) {
+    case G_FN_DEF: mark_refs_in_fn(r, g->fn); break;
+    case G_PTR:    mark(r, g->g); break;
+    case G_INIT:
+        for (size_t i = 0; i < vec_len(g->relocs); i++) {
+            InitReloc *reloc = vec_get(g->relocs, i);
+            mark(r, reloc->g);
+        }
+        break;
+    default: break;
+    }
+}
+
+void dge(Vec *globals) {
+    Reach r = { map_new(), map_new(), vec_new() };
+    Vec *groups = vec_new(); // Every 'Vec *' in 'by_label', to free
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        char *label = intern(g->label);
+        Vec *gs = map_get(r.by_label, label);
+        if (!gs) {
+            gs = vec_new();
+            map_put(r.by_label, label, gs);
+            vec_push(groups, gs);
+        }
+        vec_push(gs, g);
+    }
+    for (size_t i = 0; i < vec_len(globals); i++) { // Roots
+        Global *g = vec_get(globals, i);
+        if (g->linkage != LINK_STATIC) {
+            mark(&r, g);
+        }
+    }
+    while (vec_len(r.work) > 0) {
+        Vec *gs = vec_pop(r.work);
+        for (size_t i = 0; i < vec_len(gs); i++) {
+            mark_refs(&r, vec_get(gs, i));
+        }
+    }
+
+    size_t num_live = 0; // Keeps the order the rest are emitted in
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (map_get(r.live, intern(g->label))) {
+            vec_put(globals, num_live++, g);
+        }
+    }
+    while (vec_len(globals) > num_live) {
+        vec_pop(globals);
+    }
+
+    for (size_t i = 0; i < vec_len(groups); i++) {
+        vec_free(vec_get(groups, i));
+    }
+    vec_free(groups);
+    map_free(r.by_label);
+    map_free(r.live);
+    vec_free(r.work);
+}
@@ -0,0 +1,14 @@
+
+#ifndef COSEC_DGE_H
+#define COSEC_DGE_H
+
+#include "compile.h"
+
+// Dead global elimination. Marks every global reachable from the externally
+// visible ones (i.e., not 'static'), through the IR_GLOBALs in functions and
+// the pointers in initialisers, then removes the 'static' functions and
+// variables that weren't reached (including ones only referenced by each
+// other). Runs last, once the optimiser's removed the references it can
+void dge(Vec *globals);
+
+#endif
@@ -0,0 +1,886 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "driver.h"
+#include "parse.h"
+#include "pp.h"
+#include "compile.h"
+#include "analysis.h"
+#include "passes.h"
+#include "alias.h"
+#include "assemble.h"
+#include "encode.h"
+#include "object.h"
+#include "error.h"
+#include "debug.h"
+#include "reg_alloc.h"
+#include "peephole.h"
+#include "schedule.h"
+#include "backend.h"
+#include "stats.h"
+#include "stack_usage.h"
+#include "pch.h"
+#include "fn_cache.h"
+#include "ir_file.h"
+#include "lto.h"
+#include "profile.h"
+#include "layout.h"
+#include "writer.h"
+#include "target.h"
+
+void default_options(Options *opts) {
+    *opts = (Options) { .allocator = REG_ALLOC_GRAPH, .format = OUT_NASM,
+                        .num_threads = num_cores(), .opt_level = MAX_OPT_LEVEL };
+}
+
+static FILE * open_output(Output *out, Options *opts) {
+    if (out->f) {
+        return out->f;
+    }
+    int is_text = (opts->format == OUT_NASM && !opts->lto) || opts->preprocess;
+    FILE *f_out = open_writer(out->path, is_text);
+    if (!f_out) {
+        error("can't open output file '%s'", out->path);
+    }
+    return f_out;
+}
+
+static void close_output(Output *out, FILE *f_out) {
+    if (f_out != out->f && fclose(f_out) != 0) {
+        error("can't write output file '%s'", out->path);
+    }
+}
+
+// 'obj' is the machine code for every format but NASM; 'fn_text' is from the
+// backend for NASM, if it was used
+static void write_output(Vec *globals, Output *out, Options *opts, Buf **fn_text, Object *obj) {
+    if (opts->format == OUT_JIT) {
+        out->obj = obj;
+        return;
+    }
+    FILE *f_out = open_output(out, opts);
+    switch (opts->format) {
+    case OUT_NASM:    TARGET->encode_with(f_out, globals, fn_text); break;
+    case OUT_ELF64:   encode_elf64(f_out, obj); break;
+    case OUT_MACHO64: encode_macho64(f_out, obj); break;
+    default: UNREACHABLE();
+    }
+    close_output(out, f_out);
+}
+
+static void stream_backend(Vec *globals, Output *out, Options *opts) {
+    Buf **fn_text = NULL;
+    Encoder *enc = NULL;
+    if (opts->format == OUT_NASM) {
+        fn_text = calloc(vec_len(globals) + 1, sizeof(Buf *));
+    } else {
+        enc = x64_begin();
+    }
+    backend(globals, opts->allocator, opts->num_threads, fn_text, enc);
+    write_output(globals, out, opts, fn_text, enc ? x64_end(enc, globals) : NULL);
+    for (size_t i = 0; fn_text && i < vec_len(globals); i++) {
+        buf_free(fn_text[i]);
+    }
+    free(fn_text);
+}
+
+// Each phase of the backend over the whole program, for the dumps and
+// '--time-report'
+static void lower_serial(Vec *globals, Output *out, Options *opts) {
+    // Assembler
+    phase_begin("assemble");
+    assemble(globals);
+    phase_end();
+    if (SCHEDULE_INSNS && TARGET->schedule_fn) {
+        phase_begin("schedule");
+        schedule(globals, 0);
+        phase_end();
+    }
+    if (opts->dump_asm) {
+        TARGET->encode_with(stdout, globals, NULL);
+    }
+
+    // Register allocator
+    phase_begin("reg_alloc");
+    reg_alloc(globals, opts->allocator, opts->debug_regalloc);
+    phase_end();
+    phase_begin("peephole");
+    peephole(globals, opts->dump_asm);
+    phase_end();
+    if (SCHEDULE_INSNS2 && TARGET->schedule_fn) {
+        phase_begin("schedule2");
+        schedule(globals, 1);
+        phase_end();
+    }
+    if (opts->dump_asm) {
+        TARGET->encode_with(stdout, globals, NULL);
+    }
+    phase_begin("encode");
+    write_output(globals, out, opts, NULL, opts->format == OUT_NASM ? NULL : encode_x64(globals));
+    phase_end();
+}
+
+// 'path' with its extension (if it has one) swapped for 'ext'
+static char * swap_ext(char *path, char *ext) {
+    char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    char *dot = strrchr(base, '.');
+    Buf *b = buf_new();
+    buf_nprint(b, path, dot ? (size_t) (dot - path) : strlen(path));
+    buf_print(b, ext);
+    buf_push(b, '\0');
+    return b->data;
+}
+
+// '-fstack-usage'. Next to the output, or the source file if it's written to
+// stdout
+static void write_stack_usage(Vec *globals, Output *out, char *name) {
+    char *path = swap_ext(out->path ? out->path : (*name ? name : "out"), ".su");
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        error("can't open stack usage file '%s'", path);
+    }
+    print_stack_usage(fp, globals, name);
+    fclose(fp);
+}
+
+// How globals are reached, which has to be settled before anything's assembled
+static void set_code_model(Options *opts) {
+    if (opts->format == OUT_JIT) { // Symbols are resolved at load time; there's no GOT
+        PIC = PIC_NONE;
+        PLT = 1;
+    }
+    if (TARGET != &X64_SYSV) { // Only assembly; x29 is always the frame pointer
+        if (opts->format != OUT_NASM) {
+            error("only assembly output is supported for %s", TARGET->name);
+        }
+        OMIT_FRAME_POINTER = 0;
+    }
+    TLS_LOCAL_EXEC = (opts->format != OUT_NASM || TARGET != &X64_SYSV) && PIC != PIC_SHARED;
+}
+
+// Takes the optimised IR the rest of the way; 'name' is the source file (for
+// '--codegen-stats' and '-fstack-usage')
+static void lower(Vec *globals, Output *out, Options *opts, char *name) {
+    set_code_model(opts);
+    layout_fns(globals);
+    phase_begin("analyse"); // Whatever the last passes left stale
+    analyse(globals);
+    phase_end();
+    if (opts->dump_ir) {
+        print_ir(globals);
+        printf("\n");
+    }
+
+    // The backend takes each function the rest of the way on its own, and
+    // frees its assembly once it's encoded, so only a few functions' worth is
+    // ever held at once; unless something wants to print (or time) each
+    // phase across the whole program
+    if (!opts->dump_asm && !opts->debug_regalloc && !TIME_REPORT) {
+        stream_backend(globals, out, opts);
+    } else {
+        lower_serial(globals, out, opts);
+    }
+    if (CODEGEN_STATS) {
+        print_codegen_stats(globals, name);
+    }
+    if (STACK_USAGE && opts->format != OUT_JIT) {
+        write_stack_usage(globals, out, name);
+    }
+}
+
+enum { // What 'optimise' is given
+    OPT_FILE,    // A whole file
+    OPT_PROGRAM, // A whole program, linked with '-flto'
+    OPT_FNS,     // Just some of a file's functions, with '-fstream'
+};
+
+// Everything from inlining to dead global elimination. For a whole program,
+// the globals it never writes are also made 'const'. The interprocedural
+// passes need the whole file, so don't run on some of its functions
+static void optimise(Vec *globals, Options *opts, int scope) {
+    int level = opts->opt_level;
+    if (!opts->no_inline && scope != OPT_FNS) {
+        run_pass(globals, &PASS_INLINE, level);
+    }
+    if (scope == OPT_PROGRAM) {
+        run_pass(globals, &PASS_CONSTIFY, level);
+    }
+    run_pass(globals, &PASS_SROA, level);
+    if (!DIRECT_SSA) { // Otherwise promoted as each function was compiled
+        run_pass(globals, &PASS_MEM2REG, level);
+    }
+    if (!opts->no_ipcp && scope != OPT_FNS) {
+        run_pass(globals, &PASS_IPCP, level);
+    }
+    run_pass(globals, &PASS_SCCP, level);
+    run_pass(globals, &PASS_GVN, level);
+    if (!opts->no_vrp) {
+        run_pass(globals, &PASS_VRP, level);
+    }
+    run_pass(globals, &PASS_DSE, level);
+    if (!opts->no_thread) {
+        run_pass(globals, &PASS_THREAD, level);
+    }
+    run_pass(globals, &PASS_LICM, level);
+    if (!opts->no_interchange) {
+        run_pass(globals, &PASS_INTERCHANGE, level);
+    }
+    if (!opts->no_unswitch) {
+        run_pass(globals, &PASS_UNSWITCH, level);
+    }
+    if (!opts->no_switch_conv) {
+        run_pass(globals, &PASS_SWITCH_CONV, level);
+    }
+    run_pass(globals, &PASS_IF_CONVERT, level);
+    if (!opts->no_idioms) {
+        run_pass(globals, &PASS_IDIOM, level);
+    }
+    if (!opts->no_vectorise && TARGET->vectors) {
+        run_pass(globals, &PASS_VECTORISE, level);
+    }
+    run_pass(globals, &PASS_STRENGTH_REDUCE, level);
+    int changed_loops = 0;
+    if (!opts->no_unroll) {
+        changed_loops |= run_pass(globals, &PASS_UNROLL, level);
+    }
+    if (!opts->no_rotate) {
+        changed_loops |= run_pass(globals, &PASS_ROTATE, level);
+    }
+    if (changed_loops) {
+        // Folds the constant induction variables in fully unrolled loops, and
+        // the guards in front of rotated loops that always run
+        run_pass(globals, &PASS_SCCP, level);
+    }
+    run_pass(globals, &PASS_SIMPLIFY_BITS, level);
+    run_pass(globals, &PASS_DCE, level);
+    if (!opts->no_sink) {
+        run_pass(globals, &PASS_SINK, level); // Once nothing dead is left to move
+    }
+    if (!opts->no_crossjump) {
+        run_pass(globals, &PASS_TAIL_MERGE, level);
+    }
+    if (scope != OPT_FNS) {
+        run_pass(globals, &PASS_DGE, level);
+    }
+}
+
+// With '-flto', a file's IR is written out instead of being lowered, once the
+// passes that only simplify it have run; the loop optimisations (which
+// shouldn't run twice) and inlining wait until the files are linked
+static void write_ir_output(Vec *globals, Output *out, Options *opts) {
+    int level = opts->opt_level;
+    run_pass(globals, &PASS_SROA, level);
+    if (!DIRECT_SSA) { // Otherwise promoted as each function was compiled
+        run_pass(globals, &PASS_MEM2REG, level);
+    }
+    run_pass(globals, &PASS_SCCP, level);
+    run_pass(globals, &PASS_GVN, level);
+    run_pass(globals, &PASS_DCE, level);
+    run_pass(globals, &PASS_DGE, level);
+    phase_begin("write_ir");
+    Buf *b = write_ir(globals);
+    FILE *f_out = open_output(out, opts);
+    fwrite(b->data, 1, b->len, f_out);
+    close_output(out, f_out);
+    buf_free(b);
+    phase_end();
+}
+
+static void write_dep_path(FILE *fp, char *path) {
+    for (char *c = path; *c; c++) {
+        if (*c == ' ' || *c == '#') {
+            fputc('\\', fp);
+        } else if (*c == '$') {
+            fputc('$', fp);
+        }
+        fputc(*c, fp);
+    }
+}
+
+// '-MD'. The output depends on the source file and every header it included,
+// each listed once in the order they were first included
+static void write_deps(File *f, Output *out, Options *opts, Vec *deps) {
+    char *src = f->name ? f->name : "out";
+    char *target = out->path ? out->path : swap_ext(src, ".o");
+    char *path = opts->dep_file ? opts->dep_file : swap_ext(out->path ? out->path : src, ".d");
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        error("can't open dependency file '%s'", path);
+    }
+    write_dep_path(fp, target);
+    fputs(": ", fp);
+    write_dep_path(fp, src);
+    Map *seen = map_new();
+    for (size_t i = 0; i < vec_len(deps); i++) {
+        char *dep = vec_get(deps, i);
+        if (!map_get(seen, dep)) {
+            map_put(seen, dep, dep);
+            fputs(" \\\n  ", fp);
+            write_dep_path(fp, dep);
+        }
+    }
+    fputc('\n', fp);
+    fclose(fp);
+    map_free(seen);
+}
+
+// Never builds an AST; the tokens go straight from the preprocessor to the
+// output
+static void preprocess_output(File *f, Output *out, Options *opts, Vec *deps) {
+    phase_begin("preprocess");
+    FILE *f_out = open_output(out, opts);
+    preprocess(f, f_out, deps);
+    close_output(out, f_out);
+    arena_free(ARENA_TOKENS);
+    phase_end();
+}
+
+// Structs that span more cache lines than '--struct-layout-report=N' allows
+static void warn_large_structs(Vec *aggrs, int max_lines) {
+    for (size_t i = 0; i < vec_len(aggrs); i++) {
+        AggrDef *d = vec_get(aggrs, i);
+        size_t lines = (d->t->size + CACHE_LINE - 1) / CACHE_LINE;
+        if (lines > (size_t) max_lines) {
+            warning_at(d->tk, "%s '%s' is %zu bytes, which spans %zu cache lines "
+                       "(more than %d)", d->t->k == T_STRUCT ? "struct" : "union",
+                       d->tag ? d->tag : "<anonymous>", d->t->size, lines, max_lines);
+        }
+    }
+}
+
+
+
+// ---- Streaming -------------------------------------------------------------
+
+// With '-fstream', each function is compiled as soon as it's parsed, and its
+// AST freed; a batch of them (one per thread) is then optimised and taken
+// through the backend together, after which what's left of their IR is freed.
+// Only the globals (and the NASM text, or the object's contents) are kept for
+// the whole file
+typedef struct {
+    Options *opts;
+    Unit *unit;
+    Vec *batch;  // of 'Global *'; functions compiled since the last flush
+    Vec *tables; // of 'Global *'; globals the passes added (e.g., switch tables)
+    Encoder *enc; // For every format but NASM
+    Vec *text;    // of 'Buf *'; for NASM, each function's, in order
+} Stream;
+
+// Everything that needs the whole file's AST or IR at once; the passes that do
+// (e.g., inlining) are left out rather than falling back
+static int can_stream(Options *opts) {
+    return !opts->lto && !opts->emit_ir && !opts->dump_ast && !opts->dump_ir &&
+           !opts->dump_asm && !opts->debug_regalloc && !opts->struct_layout &&
+           !TIME_REPORT && !PASS_STATS && !STACK_USAGE && !PROFILE_GENERATE &&
+           !PROFILE_USE && !PROFILE_SAMPLE_PATH;
+}
+
+static void flush_batch(Stream *st) {
+    Vec *batch = st->batch;
+    size_t num_fns = vec_len(batch);
+    if (num_fns == 0) {
+        return;
+    }
+    optimise(batch, st->opts, OPT_FNS);
+    analyse(batch);
+    Buf **fn_text = st->enc ? NULL : calloc(vec_len(batch) + 1, sizeof(Buf *));
+    backend(batch, st->opts->allocator, st->opts->num_threads, fn_text, st->enc);
+    for (size_t i = 0; i < vec_len(batch); i++) {
+        Global *g = vec_get(batch, i);
+        if (i >= num_fns) {
+            vec_push(st->tables, g);
+            continue;
+        }
+        if (fn_text) {
+            vec_push(st->text, fn_text[i]);
+        }
+        free_fn_ir(g->fn);
+    }
+    free(fn_text);
+    vec_empty(batch);
+    arena_free(ARENA_IR_INS); // Nothing else points into the batch's IR
+    arena_free(ARENA_IR_FN);
+}
+
+static void stream_node(AstNode *n, void *arg) {
+    Stream *st = arg;
+    Global *g = compile_top(st->unit, n);
+    if (g) {
+        vec_push(st->batch, g);
+    }
+    if ((int) vec_len(st->batch) >= st->opts->num_threads) {
+        flush_batch(st);
+    }
+}
+
+static void stream_output(Stream *st, Vec *globals, Output *out, char *name) {
+    Buf **fn_text = NULL;
+    if (!st->enc) { // Matched up with the functions, which are in the same order
+        fn_text = calloc(vec_len(globals) + 1, sizeof(Buf *));
+        size_t next = 0;
+        for (size_t i = 0; i < vec_len(globals); i++) {
+            Global *g = vec_get(globals, i);
+            if (g->k == G_FN_DEF) {
+                fn_text[i] = vec_get(st->text, next++);
+            }
+        }
+        assert(next == vec_len(st->text));
+    }
+    write_output(globals, out, st->opts, fn_text, st->enc ? x64_end(st->enc, globals) : NULL);
+    for (size_t i = 0; fn_text && i < vec_len(globals); i++) {
+        buf_free(fn_text[i]);
+    }
+    free(fn_text);
+    if (CODEGEN_STATS) {
+        print_codegen_stats(globals, name);
+    }
+}
+
+static void pipeline_stream(File *f, Output *out, Options *opts, Vec *deps) {
+    set_code_model(opts);
+    Stream st = {
+        .opts = opts,
+        .unit = compile_begin(),
+        .batch = vec_new(),
+        .tables = vec_new(),
+        .enc = opts->format == OUT_NASM ? NULL : x64_begin(),
+        .text = vec_new(),
+    };
+    parse(f, opts->num_threads > 1, deps, NULL, stream_node, &st);
+    if (deps) {
+        write_deps(f, out, opts, deps);
+        vec_free(deps);
+    }
+    flush_batch(&st);
+    Vec *globals = compile_end(st.unit);
+    arena_free(ARENA_AST);
+    arena_free(ARENA_TOKENS);
+    vec_push_all(globals, st.tables);
+    stream_output(&st, globals, out, f->name ? f->name : "");
+    vec_free(st.batch);
+    vec_free(st.tables);
+    vec_free(st.text);
+}
+
+void pipeline(File *f, Output *out, Options *opts) {
+    Vec *deps = opts->gen_deps ? vec_new() : NULL;
+    if (opts->preprocess) {
+        preprocess_output(f, out, opts, deps);
+        if (deps) {
+            write_deps(f, out, opts, deps);
+            vec_free(deps);
+        }
+        return;
+    }
+    if (opts->stream && can_stream(opts)) {
+        pipeline_stream(f, out, opts, deps);
+        return;
+    }
+
+    // Parser
+    phase_begin("parse");
+    Vec *aggrs = opts->struct_layout ? vec_new() : NULL;
+    AstNode *ast = parse(f, opts->num_threads > 1, deps, aggrs, NULL, NULL);
+    phase_end();
+    if (deps) { // Headers are all known once it's parsed
+        write_deps(f, out, opts, deps);
+        vec_free(deps);
+    }
+    if (opts->dump_ast) {
+        print_ast(ast);
+        printf("\n");
+    }
+    if (aggrs) { // Before the AST's arena is freed
+        print_struct_layouts(aggrs);
+        if (opts->max_struct_lines > 0) {
+            warn_large_structs(aggrs, opts->max_struct_lines);
+        }
+        vec_free(aggrs);
+    }
+
+    // Compiler
+    phase_begin("compile");
+    Vec *globals = compile(ast);
+    arena_free(ARENA_AST); // Nothing in the IR points back into the AST
+    arena_free(ARENA_TOKENS);
+    phase_end();
+    char *file_name = f->name ? f->name : "";
+    if (PROFILE_USE) { // Before 'instrument' adds BBs the profile didn't have
+        attach_profile(globals, file_name);
+    } else if (PROFILE_SAMPLE_PATH) {
+        attach_sample_profile(globals, file_name);
+    }
+    if (PROFILE_GENERATE) {
+        instrument(globals, file_name);
+    }
+    if (opts->lto && opts->format != OUT_JIT) {
+        write_ir_output(globals, out, opts);
+        return;
+    }
+
+    // Optimiser
+    optimise(globals, opts, OPT_FILE);
+    if (opts->emit_ir && !save_ir(opts->emit_ir, globals)) {
+        error("can't write IR file '%s'", opts->emit_ir);
+    }
+    lower(globals, out, opts, file_name);
+}
+
+void pipeline_ir(Vec *paths, Output *out, Options *opts) {
+    phase_begin("read_ir");
+    Vec *modules = vec_new();
+    for (size_t i = 0; i < vec_len(paths); i++) {
+        char *path = vec_get(paths, i);
+        Vec *globals = load_ir(path);
+        if (!globals) {
+            phase_end();
+            error("'%s' isn't an IR file from this version of the compiler", path);
+        }
+        vec_push(modules, globals);
+    }
+    phase_end();
+    Vec *globals;
+    if (opts->lto) {
+        phase_begin("link");
+        globals = lto_link(modules);
+        phase_end();
+        optimise(globals, opts, OPT_PROGRAM);
+    } else {
+        assert(vec_len(modules) == 1);
+        globals = vec_head(modules);
+    }
+    vec_free(modules);
+    char *name = vec_len(paths) == 1 ? vec_head(paths) : out->path; // Linked
+    lower(globals, out, opts, name ? name : "");
+}
+
+// For '-falign-functions=' and '-falign-loops='; a power of 2, up to a page
+static int parse_align(char *arg) {
+    char *end;
+    long align = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || align < 1 || align > 4096 ||
+            (align & (align - 1)) != 0) {
+        error("alignment '%s' isn't a power of 2 up to 4096", arg);
+    }
+    return (int) align;
+}
+
+// For '-fpatchable-function-entry=N[,M]'; the M NOPs GCC can put before the
+// function's label aren't supported, so M has to be 0
+static int parse_patchable_entry(char *arg) {
+    char *end;
+    long nops = strtol(arg, &end, 10);
+    if (*arg == '\0' || nops < 0 || nops > MAX_PATCHABLE_ENTRY ||
+            (*end != '\0' && strcmp(end, ",0") != 0)) {
+        error("invalid '-fpatchable-function-entry=%s' (expected up to %d NOPs, "
+              "and none before the entry)", arg, MAX_PATCHABLE_ENTRY);
+    }
+    return (int) nops;
+}
+
+int parse_option(Options *opts, int argc, char **argv, int *i) {
+    char *arg = argv[*i];
+    if (strcmp(arg, "--dump-ast") == 0) {
+        opts->dump_ast = 1;
+    } else if (strcmp(arg, "--dump-ir") == 0) {
+        opts->dump_ir = 1;
+    } else if (strcmp(arg, "--struct-layout-report") == 0) {
+        opts->struct_layout = 1;
+    } else if (strncmp(arg, "--struct-layout-report=", 23) == 0) {
+        char *end;
+        long lines = strtol(&arg[23], &end, 10);
+        if (arg[23] == '\0' || *end != '\0' || lines < 1 || lines > INT_MAX) {
+            error("invalid cache line count '%s'", &arg[23]);
+        }
+        opts->struct_layout = 1;
+        opts->max_struct_lines = (int) lines;
+    } else if (strcmp(arg, "-E") == 0) {
+        opts->preprocess = 1;
+    } else if (strcmp(arg, "-MD") == 0) {
+        opts->gen_deps = 1;
+    } else if (strcmp(arg, "-MF") == 0) {
+        if (*i == argc - 1) {
+            error("no file name after '-MF'");
+        }
+        opts->dep_file = argv[++*i];
+    } else if (strcmp(arg, "-flto") == 0) {
+        opts->lto = 1;
+    } else if (strncmp(arg, "--emit-ir=", 10) == 0) {
+        opts->emit_ir = &arg[10];
+    } else if (strcmp(arg, "--dump-asm") == 0) {
+        opts->dump_asm = 1;
+    } else if (strcmp(arg, "--debug-regalloc") == 0) {
+        opts->debug_regalloc = 1;
+    } else if (strcmp(arg, "--pass-stats") == 0) {
+        PASS_STATS = 1;
+    } else if (strcmp(arg, "--codegen-stats") == 0) {
+        CODEGEN_STATS = 1;
+        CODEGEN_STATS_PATH = NULL;
+    } else if (strncmp(arg, "--codegen-stats=", 16) == 0) {
+        CODEGEN_STATS = 1;
+        CODEGEN_STATS_PATH = &arg[16];
+    } else if (strcmp(arg, "-fstack-usage") == 0) {
+        STACK_USAGE = SU_FRAMES;
+    } else if (strcmp(arg, "-fstack-usage=callgraph") == 0) {
+        STACK_USAGE = SU_CALL_GRAPH;
+    } else if (strcmp(arg, "--time-report") == 0 || strcmp(arg, "-ftime-report") == 0) {
+        TIME_REPORT = 1;
+    } else if (strcmp(arg, "--perf-counters") == 0) {
+        TIME_REPORT = 1;
+        PERF_COUNTERS = 1;
+    } else if (strcmp(arg, "-j") == 0) {
+        if (*i == argc - 1) {
+            error("no thread count after '-j'");
+        }
+        opts->num_threads = atoi(argv[++*i]);
+        if (opts->num_threads < 1) {
+            error("invalid thread count '%s'", argv[*i]);
+        }
+    } else if (strcmp(arg, "-fregalloc=graph") == 0) {
+        opts->allocator = REG_ALLOC_GRAPH;
+    } else if (strcmp(arg, "-fregalloc=linear") == 0) {
+        opts->allocator = REG_ALLOC_LINEAR;
+    } else if (strncmp(arg, "-fregalloc=", 11) == 0) {
+        error("unknown register allocator '%s'", &arg[11]);
+    } else if (strncmp(arg, "-fpch-dir=", 10) == 0) {
+        PCH_DIR = &arg[10];
+    } else if (strncmp(arg, "-fcache-dir=", 12) == 0) {
+        CACHE_DIR = &arg[12];
+    } else if (strcmp(arg, "-fformat=nasm") == 0) {
+        opts->format = OUT_NASM;
+    } else if (strcmp(arg, "-fformat=elf64") == 0) {
+        opts->format = OUT_ELF64;
+    } else if (strcmp(arg, "-fformat=macho64") == 0) {
+        opts->format = OUT_MACHO64;
+    } else if (strncmp(arg, "-fformat=", 9) == 0) {
+        error("unknown output format '%s'", &arg[9]);
+    } else if (strcmp(arg, "-fomit-frame-pointer") == 0) {
+        OMIT_FRAME_POINTER = 1;
+    } else if (strcmp(arg, "-fno-omit-frame-pointer") == 0) {
+        OMIT_FRAME_POINTER = 0;
+    } else if (strcmp(arg, "-fshrink-wrap") == 0) {
+        SHRINK_WRAP = 1;
+    } else if (strcmp(arg, "-fno-shrink-wrap") == 0) {
+        SHRINK_WRAP = 0;
+    } else if (strcmp(arg, "-fPIC") == 0 || strcmp(arg, "-fpic") == 0) {
+        PIC = PIC_SHARED;
+    } else if (strcmp(arg, "-fPIE") == 0 || strcmp(arg, "-fpie") == 0) {
+        PIC = PIC_PIE;
+    } else if (strcmp(arg, "-fno-PIC") == 0 || strcmp(arg, "-fno-pic") == 0 ||
+               strcmp(arg, "-fno-PIE") == 0 || strcmp(arg, "-fno-pie") == 0) {
+        PIC = PIC_NONE;
+    } else if (strcmp(arg, "-fvisibility=default") == 0) {
+        VISIBILITY_HIDDEN = 0;
+    } else if (strcmp(arg, "-fvisibility=hidden") == 0 ||
+               strcmp(arg, "-fvisibility=internal") == 0) {
+        VISIBILITY_HIDDEN = 1;
+    } else if (strncmp(arg, "-fvisibility=", 13) == 0) {
+        error("unknown visibility '%s'", &arg[13]);
+    } else if (strcmp(arg, "-fplt") == 0) {
+        PLT = 1;
+    } else if (strcmp(arg, "-fno-plt") == 0) {
+        PLT = 0;
+    } else if (strcmp(arg, "-mred-zone") == 0) {
+        RED_ZONE = 1;
+    } else if (strcmp(arg, "-mno-red-zone") == 0) {
+        RED_ZONE = 0;
+    } else if (strcmp(arg, "-fipa-ra") == 0) {
+        IPA_RA = 1;
+    } else if (strcmp(arg, "-fno-ipa-ra") == 0) {
+        IPA_RA = 0;
+    } else if (strcmp(arg, "-fschedule-insns") == 0) {
+        SCHEDULE_INSNS = 1;
+    } else if (strcmp(arg, "-fno-schedule-insns") == 0) {
+        SCHEDULE_INSNS = 0;
+    } else if (strcmp(arg, "-fschedule-insns2") == 0) {
+        SCHEDULE_INSNS2 = 1;
+    } else if (strcmp(arg, "-fno-schedule-insns2") == 0) {
+        SCHEDULE_INSNS2 = 0;
+    } else if (strcmp(arg, "-O") == 0) {
+        opts->opt_level = 1;
+    } else if (strncmp(arg, "-O", 2) == 0) {
+        if (arg[2] < '0' || arg[2] > '0' + MAX_OPT_LEVEL || arg[3] != '\0') {
+            error("unknown optimisation level '%s'", &arg[2]);
+        }
+        opts->opt_level = arg[2] - '0';
+    } else if (strcmp(arg, "-fstream") == 0) {
+        opts->stream = 1;
+    } else if (strcmp(arg, "-fno-inline") == 0) {
+        opts->no_inline = 1;
+    } else if (strcmp(arg, "-fno-ipa-cp") == 0) {
+        opts->no_ipcp = 1;
+    } else if (strcmp(arg, "-fno-thread-jumps") == 0) {
+        opts->no_thread = 1;
+    } else if (strcmp(arg, "-fno-tree-loop-distribute-patterns") == 0) {
+        opts->no_idioms = 1;
+    } else if (strcmp(arg, "-fno-vectorize") == 0) {
+        opts->no_vectorise = 1;
+    } else if (strcmp(arg, "-fno-unroll-loops") == 0) {
+        opts->no_unroll = 1;
+    } else if (strcmp(arg, "-funroll-loops") == 0) {
+        opts->no_unroll = 0;
+    } else if (strcmp(arg, "-fno-loop-interchange") == 0) {
+        opts->no_interchange = 1;
+    } else if (strcmp(arg, "-fno-unswitch-loops") == 0) {
+        opts->no_unswitch = 1;
+    } else if (strcmp(arg, "-fno-rotate-loops") == 0) {
+        opts->no_rotate = 1;
+    } else if (strcmp(arg, "-fno-tree-vrp") == 0) {
+        opts->no_vrp = 1;
+    } else if (strcmp(arg, "-fno-tree-switch-conversion") == 0) {
+        opts->no_switch_conv = 1;
+    } else if (strcmp(arg, "-fno-tree-sink") == 0) {
+        opts->no_sink = 1;
+    } else if (strcmp(arg, "-fno-crossjumping") == 0) {
+        opts->no_crossjump = 1;
+    } else if (strcmp(arg, "-fstrict-aliasing") == 0) {
+        STRICT_ALIASING = 1;
+    } else if (strcmp(arg, "-fno-strict-aliasing") == 0) {
+        STRICT_ALIASING = 0;
+    } else if (strcmp(arg, "-ffp-contract=fast") == 0) {
+        FP_CONTRACT = 1;
+    } else if (strcmp(arg, "-ffp-contract=on") == 0 ||
+               strcmp(arg, "-ffp-contract=off") == 0) {
+        FP_CONTRACT = 0;
+    } else if (strcmp(arg, "-ffast-math") == 0) {
+        ASSOCIATIVE_MATH = RECIPROCAL_MATH = 1;
+    } else if (strcmp(arg, "-fno-fast-math") == 0) {
+        ASSOCIATIVE_MATH = RECIPROCAL_MATH = 0;
+    } else if (strcmp(arg, "-fassociative-math") == 0) {
+        ASSOCIATIVE_MATH = 1;
+    } else if (strcmp(arg, "-fno-associative-math") == 0) {
+        ASSOCIATIVE_MATH = 0;
+    } else if (strcmp(arg, "-freciprocal-math") == 0) {
+        RECIPROCAL_MATH = 1;
+    } else if (strcmp(arg, "-fno-reciprocal-math") == 0) {
+        RECIPROCAL_MATH = 0;
+    } else if (strncmp(arg, "--target=", 9) == 0) {
+        TARGET = find_target(&arg[9]);
+        if (!TARGET) {
+            error("unknown target '%s'", &arg[9]);
+        }
+    } else if (strncmp(arg, "-march=", 7) == 0) {
+        CPU_FEATURES = cpu_arch_features(&arg[7]);
+        if (CPU_FEATURES < 0) {
+            error("unknown architecture '%s'", &arg[7]);
+        }
+    } else if (strncmp(arg, "-m", 2) == 0) {
+        int on = strncmp(arg, "-mno-", 5) != 0;
+        if (!set_cpu_feature(on ? &arg[2] : &arg[5], on)) {
+            error("unknown instruction set extension '%s'", on ? &arg[2] : &arg[5]);
+        }
+    } else if (strncmp(arg, "-falign-functions=", 18) == 0) {
+        ALIGN_FUNCTIONS = parse_align(&arg[18]);
+    } else if (strncmp(arg, "-falign-loops=", 14) == 0) {
+        ALIGN_LOOPS = parse_align(&arg[14]);
+    } else if (strcmp(arg, "-fno-align-functions") == 0) {
+        ALIGN_FUNCTIONS = 1;
+    } else if (strcmp(arg, "-fno-align-loops") == 0) {
+        ALIGN_LOOPS = 1;
+    } else if (strcmp(arg, "-ffunction-sections") == 0) {
+        FUNCTION_SECTIONS = 1;
+    } else if (strcmp(arg, "-fdata-sections") == 0) {
+        DATA_SECTIONS = 1;
+    } else if (strcmp(arg, "-g") == 0) {
+        DEBUG_INFO = 1;
+    } else if (strcmp(arg, "-finstrument-functions") == 0) {
+        INSTRUMENT_FUNCTIONS = 1;
+    } else if (strncmp(arg, "-fpatchable-function-entry=", 27) == 0) {
+        PATCHABLE_ENTRY = parse_patchable_entry(&arg[27]);
+    } else if (strcmp(arg, "-fdirect-ssa") == 0) {
+        DIRECT_SSA = 1;
+    } else if (strncmp(arg, "-fprofile-generate", 18) == 0 && (!arg[18] || arg[18] == '=')) {
+        PROFILE_GENERATE = 1;
+        PROFILE_PATH = arg[18] ? &arg[19] : PROFILE_PATH;
+    } else if (strncmp(arg, "-fprofile-use", 13) == 0 && (!arg[13] || arg[13] == '=')) {
+        PROFILE_USE = 1;
+        PROFILE_PATH = arg[13] ? &arg[14] : PROFILE_PATH;
+    } else if (strncmp(arg, "-fprofile-sample-use=", 21) == 0) {
+        PROFILE_SAMPLE_PATH = &arg[21];
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+GlobalOptions save_options() {
+    return (GlobalOptions) {
+        .time_report = TIME_REPORT,
+        .perf_counters = PERF_COUNTERS,
+        .pass_stats = PASS_STATS,
+        .codegen_stats = CODEGEN_STATS,
+        .codegen_stats_path = CODEGEN_STATS_PATH,
+        .stack_usage = STACK_USAGE,
+        .pch_dir = PCH_DIR,
+        .cache_dir = CACHE_DIR,
+        .omit_frame_pointer = OMIT_FRAME_POINTER,
+        .red_zone = RED_ZONE,
+        .shrink_wrap = SHRINK_WRAP,
+        .pic = PIC,
+        .visibility_hidden = VISIBILITY_HIDDEN,
+        .plt = PLT,
+        .schedule_insns = SCHEDULE_INSNS,
+        .schedule_insns2 = SCHEDULE_INSNS2,
+        .ipa_ra = IPA_RA,
+        .strict_aliasing = STRICT_ALIASING,
+        .fp_contract = FP_CONTRACT,
+        .associative_math = ASSOCIATIVE_MATH,
+        .reciprocal_math = RECIPROCAL_MATH,
+        .cpu_features = CPU_FEATURES,
+        .target = TARGET,
+        .align_functions = ALIGN_FUNCTIONS,
+        .align_loops = ALIGN_LOOPS,
+        .function_sections = FUNCTION_SECTIONS,
+        .data_sections = DATA_SECTIONS,
+        .debug_info = DEBUG_INFO,
+        .instrument_functions = INSTRUMENT_FUNCTIONS,
+        .patchable_entry = PATCHABLE_ENTRY,
+        .direct_ssa = DIRECT_SSA,
+        .profile_generate = PROFILE_GENERATE,
+        .profile_use = PROFILE_USE,
+        .profile_path = PROFILE_PATH,
+        .profile_sample_path = PROFILE_SAMPLE_PATH,
+    };
+}
+
+void restore_options(GlobalOptions *o) {
+    TIME_REPORT = o->time_report;
+    PERF_COUNTERS = o->perf_counters;
+    PASS_STATS = o->pass_stats;
+    CODEGEN_STATS = o->codegen_stats;
+    CODEGEN_STATS_PATH = o->codegen_stats_path;
+    STACK_USAGE = o->stack_usage;
+    PCH_DIR = o->pch_dir;
+    CACHE_DIR = o->cache_dir;
+    OMIT_FRAME_POINTER = o->omit_frame_pointer;
+    RED_ZONE = o->red_zone;
+    SHRINK_WRAP = o->shrink_wrap;
+    PIC = o->pic;
+    VISIBILITY_HIDDEN = o->visibility_hidden;
+    PLT = o->plt;
+    SCHEDULE_INSNS = o->schedule_insns;
+    SCHEDULE_INSNS2 = o->schedule_insns2;
+    IPA_RA = o->ipa_ra;
+    STRICT_ALIASING = o->strict_aliasing;
+    FP_CONTRACT = o->fp_contract;
+    ASSOCIATIVE_MATH = o->associative_math;
+    RECIPROCAL_MATH = o->reciprocal_math;
+    CPU_FEATURES = o->cpu_features;
+    TARGET = o->target;
+    ALIGN_FUNCTIONS = o->align_functions;
+    ALIGN_LOOPS = o->align_loops;
+    FUNCTION_SECTIONS = o->function_sections;
+    DATA_SECTIONS = o->data_sections;
+    DEBUG_INFO = o->debug_info;
+    INSTRUMENT_FUNCTIONS = o->instrument_functions;
+    PATCHABLE_ENTRY = o->patchable_entry;
+    DIRECT_SSA = o->direct_ssa;
+    PROFILE_GENERATE = o->profile_generate;
+    PROFILE_USE = o->profile_use;
+    PROFILE_PATH = o->profile_path;
+    PROFILE_SAMPLE_PATH = o->profile_sample_path;
+}
@@ -0,0 +1,95 @@
+
+#ifndef COSEC_DRIVER_H
+#define COSEC_DRIVER_H
+
+#include <stdio.h>
+
+#include "file.h"
+#include "x64.h"
+#include "target.h"
+
+// Compiler driver. Takes a source file through the whole pipeline, from
+// parsing to writing out the assembly or object file; shared by the command
+// line compiler ('main.c') and the library ('cosec.h')
+
+enum { // Output formats
+    OUT_NASM,
+    OUT_ELF64,
+    OUT_MACHO64,
+    OUT_JIT, // Machine code left in 'Output.obj', for the library's JIT
+};
+
+typedef struct {
+    int allocator, format, num_threads;
+    int dump_ast, dump_ir, dump_asm, debug_regalloc;
+    int struct_layout; // '--struct-layout-report[=N]'; prints each struct's
+    int max_struct_lines; // layout, and warns about those over N cache lines
+    char *emit_ir; // Writes the optimised IR here too (see 'ir_file.h')
+    int lto; // Source files are compiled to IR files, and IR files linked
+             // into one program (see 'lto.h')
+    int opt_level; // '-O'; which passes run (see 'passes.h')
+    int preprocess; // '-E'; the preprocessed source is the output
+    int gen_deps;   // '-MD'; a Makefile rule for the output is written too,
+    char *dep_file; // to '-MF' if given (otherwise beside the output)
+    int stream; // '-fstream'; each function goes from parsing to encoding
+                // before the next is parsed (see 'pipeline')
+    int no_inline, no_ipcp, no_thread, no_idioms, no_vectorise, no_unroll,
+        no_rotate, no_unswitch, no_sink, no_crossjump, no_vrp,
+        no_interchange, no_switch_conv;
+} Options;
+
+// Where the output goes: 'f' if it's set, otherwise the file 'path', which is
+// only opened once compiling has succeeded. Nothing is written for 'OUT_JIT';
+// 'obj' is set instead
+typedef struct {
+    char *path;
+    FILE *f;
+    Object *obj;
+} Output;
+
+void default_options(Options *opts);
+
+// Parses the option at 'argv[*i]', moving 'i' past its argument if it has
+// one. Some options set globals (e.g., 'OMIT_FRAME_POINTER') rather than
+// 'opts'. Returns 0 if 'argv[*i]' isn't one of the options the pipeline
+// knows about
+int parse_option(Options *opts, int argc, char **argv, int *i);
+
+// With '-fstream', each function's AST is freed once it's compiled, and its IR
+// once it's encoded, so memory is bounded by the globals and the biggest few
+// functions rather than the whole file. That leaves out inlining, IPA
+// constant propagation, dead global elimination, and laying out hot and cold
+// functions, and a global used before its definition is reached as if it were
+// defined in another file (e.g., through the GOT for PIE). It falls back to
+// the whole file for the options that need it (the dumps, '-flto',
+// '--emit-ir', '--time-report', '--pass-stats', '-fstack-usage', and profiles)
+void pipeline(File *f, Output *out, Options *opts);
+
+// Reads the IR from a file written with '--emit-ir' (which has already been
+// optimised), and takes it through the backend. With '-flto', reads every
+// file in 'paths' (of 'char *') and links them into one program, which is
+// then optimised as a whole
+void pipeline_ir(Vec *paths, Output *out, Options *opts);
+
+// The options that are globals, for putting back as they were before a
+// command line was parsed (by the compile server and the library)
+typedef struct {
+    int time_report, perf_counters, pass_stats, codegen_stats;
+    char *codegen_stats_path, *pch_dir, *cache_dir;
+    int stack_usage;
+    int omit_frame_pointer, red_zone, shrink_wrap;
+    int pic, visibility_hidden, plt;
+    int schedule_insns, schedule_insns2, ipa_ra;
+    int strict_aliasing;
+    int fp_contract, associative_math, reciprocal_math, cpu_features, align_functions, align_loops;
+    int function_sections, data_sections, debug_info;
+    int instrument_functions, patchable_entry, direct_ssa;
+    int profile_generate, profile_use;
+    char *profile_path, *profile_sample_path;
+    Target *target;
+} GlobalOptions;
+
+GlobalOptions save_options();
+void restore_options(GlobalOptions *o);
+
+#endif
@@ -0,0 +1,304 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dse.h"
+#include "alias.h"
+#include "analysis.h"
+
+// Forwarding goes through the BBs in reverse postorder, keeping a list of the
+// memory contents known at each point: the value stored or loaded through each
+// pointer, and the ranges that have been zeroed. A BB starts with its
+// immediate dominator's list only if that's its single predecessor (i.e.,
+// nothing else could have run in between, like 'gvn'). Each write drops the
+// entries it might clobber (see 'may_clobber').
+//
+// Dead stores are found by scanning each BB backwards, keeping the ranges
+// written later in the BB that nothing has read since. A write into a range
+// that's entirely overwritten later is dead. An allocation whose address never
+// escapes (see 'analyse_escapes') can't be read after a return, so it counts
+// as overwritten at an IR_RET; and writes into one that's never read at all
+// are always dead.
+
+#define MAX_RANGES 64 // Keeps the scans from going quadratic in long BBs
+
+typedef struct {
+    IrIns *ins;    // IR_LOAD, IR_STORE, IR_COPY, IR_ZERO, or a whole IR_ALLOC
+    Ptr p;
+    uint64_t size; // 0 if not known
+} Range;
+
+static Range * new_range(IrIns *ins, IrIns *ptr, uint64_t size) {
+    Range *r = malloc(sizeof(Range));
+    r->ins = ins;
+    r->p = decompose_ptr(ptr);
+    r->size = size;
+    return r;
+}
+
+static void add_range(Vec *ranges, Range *r) {
+    if (vec_len(ranges) == MAX_RANGES) {
+        vec_remove(ranges, 0); // Forget the oldest
+    }
+    vec_push(ranges, r);
+}
+
+static int is_write(IrIns *ins) {
+    return ins->op == IR_STORE || ins->op == IR_COPY || ins->op == IR_ZERO;
+}
+
+static uint64_t const_size(IrIns *size) {
+    return size->op == IR_IMM ? size->imm : 0;
+}
+
+// The range written by an IR_STORE, IR_COPY, or IR_ZERO
+static Range * write_range(IrIns *ins) {
+    switch (ins->op) {
+    case IR_STORE: return new_range(ins, ins->dst, ins->src->t->size);
+    case IR_COPY:  return new_range(ins, ins->dst, const_size(ins->len));
+    case IR_ZERO:  return new_range(ins, ins->ptr, const_size(ins->size));
+    default: UNREACHABLE();
+    }
+    return NULL;
+}
+
+// Whether 'r' is known to include all of 'size' bytes at 'p'
+static int contains(Range *r, Ptr p, uint64_t size) {
+    if (r->ins->op == IR_ALLOC) {
+        return p.obj == r->ins;
+    }
+    if (r->p.base != p.base || r->size == 0 || size == 0) {
+        return 0;
+    }
+    return r->p.offset <= p.offset &&
+           p.offset + (int64_t) size <= r->p.offset + (int64_t) r->size;
+}
+
+
+// ---- Store-to-Load Forwarding ----------------------------------------------
+
+typedef struct {
+    IrIns **repl;  // Per ins; the value a load was replaced by, or NULL
+    Vec **out;     // Per BB (indexed by 'rpo'); of 'Range *'; known at the end
+} Forward;
+
+static IrIns * resolve(Forward *f, IrIns *ins) {
+    return f->repl[ins->n] ? f->repl[ins->n] : ins;
+}
+
+static void kill_ranges(Vec *ranges, IrIns *write) {
+    size_t i = 0;
+    while (i < vec_len(ranges)) {
+        Range *r = vec_get(ranges, i);
+        if (may_clobber(write, r->ins)) {
+            vec_remove(ranges, i);
+        } else {
+            i++;
+        }
+    }
+}
+
+// Replaces the load in place (so its users don't need updating, like 'sccp')
+static void zero_load(IrIns *load) {
+    if (load->t->k == IRT_F32 || load->t->k == IRT_F64) {
+        load->op = IR_FP;
+        load->fp = 0;
+    } else {
+        load->op = IR_IMM;
+        load->imm = 0;
+    }
+}
+
+// Returns 1 if the load was replaced
+static int forward_load(Forward *f, Vec *ranges, IrIns *load) {
+    Ptr p = decompose_ptr(load->src);
+    for (size_t i = vec_len(ranges); i > 0; i--) {
+        Range *r = vec_get(ranges, i - 1);
+        if (!contains(r, p, load->t->size)) {
+            continue;
+        }
+        if (r->ins->op == IR_ZERO) {
+            zero_load(load);
+            return 1;
+        }
+        if (r->ins->op == IR_COPY || r->p.offset != p.offset) {
+            continue;
+        }
+        IrIns *v = r->ins->op == IR_STORE ? r->ins->src : r->ins;
+        if (v->t->k == load->t->k && v->t->size == load->t->size) {
+            f->repl[load->n] = v;
+            delete_ir(load);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void forward_bb(Forward *f, BB *bb) {
+    Vec *ranges = vec_new();
+    if (bb->idom && vec_len(bb->pred) == 1 && vec_get(bb->pred, 0) == bb->idom) {
+        vec_push_all(ranges, f->out[bb->idom->rpo]);
+    }
+    IrIns *ins = bb->ir_head;
+    while (ins) {
+        IrIns *next = ins->next;
+        IrIns **oprs[3];
+        int num_oprs = ir_operands(ins, oprs);
+        for (int i = 0; i < num_oprs; i++) {
+            *oprs[i] = resolve(f, *oprs[i]);
+        }
+        if (ins->op == IR_LOAD) {
+            if (!forward_load(f, ranges, ins)) {
+                add_range(ranges, new_range(ins, ins->src, ins->t->size));
+            }
+        } else if (is_write(ins) || ins->op == IR_CALL || ins->op == IR_ASM ||
+                   is_atomic(ins)) {
+            kill_ranges(ranges, ins);
+            if (ins->op == IR_STORE || ins->op == IR_ZERO) {
+                add_range(ranges, write_range(ins));
+            }
+        }
+        ins = next;
+    }
+    f->out[bb->rpo] = ranges;
+}
+
+// Phi operands (and anything in a BB that isn't reachable) might not have been
+// seen before the loads they use were replaced
+static void replace_remaining(Forward *f, Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    vec_put(ins->defs, i, resolve(f, vec_get(ins->defs, i)));
+                }
+                continue;
+            }
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                *oprs[i] = resolve(f, *oprs[i]);
+            }
+        }
+    }
+}
+
+static void forward_fn(Fn *fn) {
+    size_t num_ins = number_ir(fn);
+    Vec *rpo = rev_postorder(fn);
+    Forward f;
+    f.repl = calloc(num_ins, sizeof(IrIns *));
+    f.out = calloc(vec_len(rpo), sizeof(Vec *));
+    for (size_t i = 0; i < vec_len(rpo); i++) {
+        forward_bb(&f, vec_get(rpo, i));
+    }
+    replace_remaining(&f, fn);
+    for (size_t i = 0; i < vec_len(rpo); i++) {
+        vec_free(f.out[i]);
+    }
+    free(f.repl);
+    free(f.out);
+    vec_free(rpo);
+}
+
+
+// ---- Dead Store Elimination ------------------------------------------------
+
+// Marks the allocations that something reads from
+static int * find_read_allocs(Fn *fn) {
+    size_t num_ins = number_ir(fn);
+    int *is_read = calloc(num_ins, sizeof(int));
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_LOAD || ins->op == IR_COPY) {
+                IrIns *obj = decompose_ptr(ins->src).obj;
+                if (obj && obj->op == IR_ALLOC) {
+                    is_read[obj->n] = 1;
+                }
+            }
+        }
+    }
+    return is_read;
+}
+
+static int is_unread(IrIns *obj, int *is_read) {
+    return obj && obj->op == IR_ALLOC && !obj->escapes && !is_read[obj->n];
+}
+
+static int may_read(IrIns *ins, Range *r) {
+    if (r->ins->op == IR_ALLOC) { // Only read through pointers derived from it
+        return (ins->op == IR_LOAD || ins->op == IR_COPY) &&
+               decompose_ptr(ins->src).obj == r->ins;
+    }
+    return may_alias(ins, r->ins);
+}
+
+static void drop_read_ranges(Vec *later, IrIns *ins) {
+    size_t i = 0;
+    while (i < vec_len(later)) {
+        if (may_read(ins, vec_get(later, i))) {
+            vec_remove(later, i);
+        } else {
+            i++;
+        }
+    }
+}
+
+static int is_overwritten(Vec *later, Range *w) {
+    for (size_t i = 0; i < vec_len(later); i++) {
+        if (contains(vec_get(later, i), w->p, w->size)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void dse_bb(BB *bb, Vec *allocs, int *is_read) {
+    Vec *later = vec_new(); // of 'Range *'
+    if (bb->ir_last && bb->ir_last->op == IR_RET) {
+        for (size_t i = 0; i < vec_len(allocs); i++) {
+            IrIns *alloc = vec_get(allocs, i);
+            add_range(later, new_range(alloc, alloc, alloc->alloc_t->size));
+        }
+    }
+    IrIns *ins = bb->ir_last;
+    while (ins) {
+        IrIns *prev = ins->prev;
+        if (is_write(ins)) {
+            Range *w = write_range(ins);
+            if (is_unread(w->p.obj, is_read) || is_overwritten(later, w)) {
+                delete_ir(ins);
+            } else {
+                if (ins->op == IR_COPY) {
+                    drop_read_ranges(later, ins);
+                }
+                if (w->size > 0) {
+                    add_range(later, w);
+                }
+            }
+        } else if (ins->op == IR_LOAD || ins->op == IR_CALL ||
+                   ins->op == IR_ASM || is_atomic(ins)) {
+            drop_read_ranges(later, ins);
+        }
+        ins = prev;
+    }
+    vec_free(later);
+}
+
+void dse(Fn *fn) {
+    analyse_escapes(fn);
+    forward_fn(fn);
+    int *is_read = find_read_allocs(fn);
+    Vec *allocs = vec_new(); // of 'IrIns *'; the ones that don't escape
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_ALLOC && !ins->escapes) {
+                vec_push(allocs, ins);
+            }
+        }
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        dse_bb(bb, allocs, is_read);
+    }
+    free(is_read);
+}
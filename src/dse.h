@@ -0,0 +1,15 @@
+
+#ifndef COSEC_DSE_H
+#define COSEC_DSE_H
+
+#include "compile.h"
+
+// Dead store elimination and store-to-load forwarding. A load from memory
+// that's known to hold a value stored (or loaded) earlier in the same BB or a
+// dominating one is replaced by that value, or by 0 if it's been zeroed. Then
+// stores (and zeroings and copies) are removed if everything they write is
+// overwritten later in the BB before anything could read it, or if nothing
+// ever reads it before the function returns. Requires 'analyse'
+void dse(Fn *fn);
+
+#endif
@@ -1,157 +1,443 @@
 
-#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "encode.h"
+#include "analysis.h"
 
 #define BB_PREFIX  "._BB"
-#define F32_PREFIX "_F"
-#define F64_PREFIX "_D"
-
-static char *X64_OPCODES[X64_LAST] = {
-    "mov", "movsx", "movzx", "movss", "movsd", "lea",
-    "add", "sub", "imul", "cwd", "cdq", "cqo", "idiv", "div",
-    "and", "or", "xor", "shl", "shr", "sar",
-    "addss", "addsd", "subss", "subsd", "mulss", "mulsd", "divss", "divsd",
-    "cmp", "sete", "setne", "setl", "setle", "setg", "setge",
-    "setb", "setbe", "seta", "setae",
-    "ucomiss", "ucomisd",
-    "cvtss2sd", "cvtsd2ss", "cvtsi2ss", "cvtsi2sd", "cvttss2si", "cvttsd2si",
-    "push", "pop",
-    "jmp", "je", "jne", "jl", "jle", "jg", "jge", "jb", "jbe", "ja", "jae",
-    "call", "ret", "syscall",
+#define TABLE_PREFIX "_T"
+
+// Output is appended to a single buffer and written out with one 'fwrite' at
+// the end, rather than going through 'fprintf' for every operand. Names have
+// their lengths worked out at compile time, and integers are formatted by hand
+
+typedef struct {
+    char *s;
+    size_t len;
+} Name;
+
+#define N(s) { s, sizeof(s) - 1 }
+
+static Name X64_OPCODES[X64_LAST] = {
+    N("mov"), N("movsx"), N("movzx"), N("movss"), N("movsd"), N("lea"),
+    N("movdqu"), N("movdqa"), N("pxor"), N("rep movsb"), N("rep stosb"),
+    N("add"), N("sub"), N("imul"), N("mul"), N("cwd"), N("cdq"), N("cqo"),
+    N("idiv"), N("div"),
+    N("and"), N("or"), N("xor"), N("shl"), N("shr"), N("sar"), N("popcnt"),
+    N("bsf"), N("bsr"), N("bswap"), N("lzcnt"), N("tzcnt"), N("shlx"),
+    N("shrx"), N("sarx"),
+    N("addss"), N("addsd"), N("subss"), N("subsd"), N("mulss"), N("mulsd"),
+    N("divss"), N("divsd"), N("minss"), N("minsd"), N("maxss"), N("maxsd"),
+    N("vaddss"), N("vaddsd"), N("vsubss"), N("vsubsd"), N("vmulss"),
+    N("vmulsd"), N("vdivss"), N("vdivsd"), N("vfmadd231ss"), N("vfmadd231sd"),
+    N("vfmsub231ss"), N("vfmsub231sd"), N("vfnmadd231ss"), N("vfnmadd231sd"),
+    N("movd"), N("movq"), N("paddb"), N("paddw"), N("paddd"), N("paddq"),
+    N("psubb"), N("psubw"), N("psubd"), N("psubq"), N("pmullw"), N("pmuludq"),
+    N("pand"), N("por"), N("addps"), N("addpd"), N("subps"), N("subpd"),
+    N("mulps"), N("mulpd"), N("divps"), N("divpd"),
+    N("vfmadd231ps"), N("vfmadd231pd"), N("vfmsub231ps"), N("vfmsub231pd"),
+    N("vfnmadd231ps"), N("vfnmadd231pd"), N("psllw"), N("pslld"),
+    N("psllq"), N("psrlw"), N("psrld"), N("psrlq"), N("psraw"), N("psrad"),
+    N("psrldq"), N("punpcklbw"), N("punpcklwd"), N("punpckldq"),
+    N("punpcklqdq"), N("packsswb"), N("packssdw"),
+    N("cmp"), N("test"), N("sete"), N("setne"), N("setl"), N("setle"), N("setg"),
+    N("setge"), N("setb"), N("setbe"), N("seta"), N("setae"), N("cmove"),
+    N("cmovne"), N("cmovl"), N("cmovle"), N("cmovg"), N("cmovge"), N("cmovb"),
+    N("cmovbe"), N("cmova"), N("cmovae"),
+    N("ucomiss"), N("ucomisd"),
+    N("cvtss2sd"), N("cvtsd2ss"), N("cvtsi2ss"), N("cvtsi2sd"), N("cvttss2si"),
+    N("cvttsd2si"),
+    N("push"), N("pop"),
+    N("prefetcht0"), N("prefetcht1"), N("prefetcht2"), N("prefetchnta"),
+    N("jmp"), N("je"), N("jne"), N("jl"), N("jle"), N("jg"), N("jge"), N("jb"),
+    N("jbe"), N("ja"), N("jae"),
+    N("call"), N("jmp"), N("ret"), N("syscall"), N("ud2"),
+    N("lock xadd"), N("lock cmpxchg"),
+    N("asm"), N("asm clobber"), N("lock"), N("pause"), N("rdtsc"), N("mfence"),
+    N("lfence"), N("sfence"), N("cmpxchg"), N("xadd"), N("xchg"), N("nop"),
 };
 
-static char *GPR_NAMES[][R64 + 1] = {
-    { NULL, NULL,   NULL,  NULL,   NULL,   NULL,  }, // R_NONE
-    { NULL, "al",   "ah",  "ax",   "eax",  "rax", },
-    { NULL, "cl",   "ch",  "cx",   "ecx",  "rcx", },
-    { NULL, "dl",   "dh",  "dx",   "edx",  "rdx", },
-    { NULL, "bl",   "bh",  "bx",   "ebx",  "rbx", },
-    { NULL, "spl",  NULL,  "sp",   "esp",  "rsp", },
-    { NULL, "bpl",  NULL,  "bp",   "ebp",  "rbp", },
-    { NULL, "sil",  NULL,  "si",   "esi",  "rsi", },
-    { NULL, "dil",  NULL,  "di",   "edi",  "rdi", },
-    { NULL, "r8b",  NULL,  "r8w",  "r8d",  "r8",  },
-    { NULL, "r9b",  NULL,  "r9w",  "r9d",  "r9",  },
-    { NULL, "r10b", NULL,  "r10w", "r10d", "r10", },
-    { NULL, "r11b", NULL,  "r11w", "r11d", "r11", },
-    { NULL, "r12b", NULL,  "r12w", "r12d", "r12", },
-    { NULL, "r13b", NULL,  "r13w", "r13d", "r13", },
-    { NULL, "r14b", NULL,  "r14w", "r14d", "r14", },
-    { NULL, "r15b", NULL,  "r15w", "r15d", "r15", },
+static Name GPR_NAMES[][R64 + 1] = {
+    { {0}, {0},       {0},     {0},       {0},       {0},      }, // R_NONE
+    { {0}, N("al"),   N("ah"), N("ax"),   N("eax"),  N("rax"), },
+    { {0}, N("cl"),   N("ch"), N("cx"),   N("ecx"),  N("rcx"), },
+    { {0}, N("dl"),   N("dh"), N("dx"),   N("edx"),  N("rdx"), },
+    { {0}, N("bl"),   N("bh"), N("bx"),   N("ebx"),  N("rbx"), },
+    { {0}, N("spl"),  {0},     N("sp"),   N("esp"),  N("rsp"), },
+    { {0}, N("bpl"),  {0},     N("bp"),   N("ebp"),  N("rbp"), },
+    { {0}, N("sil"),  {0},     N("si"),   N("esi"),  N("rsi"), },
+    { {0}, N("dil"),  {0},     N("di"),   N("edi"),  N("rdi"), },
+    { {0}, N("r8b"),  {0},     N("r8w"),  N("r8d"),  N("r8"),  },
+    { {0}, N("r9b"),  {0},     N("r9w"),  N("r9d"),  N("r9"),  },
+    { {0}, N("r10b"), {0},     N("r10w"), N("r10d"), N("r10"), },
+    { {0}, N("r11b"), {0},     N("r11w"), N("r11d"), N("r11"), },
+    { {0}, N("r12b"), {0},     N("r12w"), N("r12d"), N("r12"), },
+    { {0}, N("r13b"), {0},     N("r13w"), N("r13d"), N("r13"), },
+    { {0}, N("r14b"), {0},     N("r14w"), N("r14d"), N("r14"), },
+    { {0}, N("r15b"), {0},     N("r15w"), N("r15d"), N("r15"), },
 };
 
-static char *XMM_NAMES[] = {
-    NULL, "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
-    "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15",
+static Name XMM_NAMES[] = {
+    {0}, N("xmm0"), N("xmm1"), N("xmm2"), N("xmm3"), N("xmm4"), N("xmm5"),
+    N("xmm6"), N("xmm7"), N("xmm8"), N("xmm9"), N("xmm10"), N("xmm11"),
+    N("xmm12"), N("xmm13"), N("xmm14"), N("xmm15"),
 };
 
-static char *REG_SIZE_SUFFIX[] = {
-    [R8L] = "l", [R8H] = "h", [R16] = "w", [R32] = "d", [R64] = "q",
+static char REG_SIZE_SUFFIX[] = {
+    [R8L] = 'l', [R8H] = 'h', [R16] = 'w', [R32] = 'd', [R64] = 'q',
 };
 
-static char *NASM_MEM_PREFIX[] = {
-    [1] = "byte", [2] = "word", [4] = "dword", [8] = "qword",
+static Name NASM_MEM_PREFIX[] = {
+    [1] = N("byte "), [2] = N("word "), [4] = N("dword "), [8] = N("qword "),
 };
 
 static char *NASM_CONST[] = {
     [1] = "db", [2] = "dw", [4] = "dd", [8] = "dq",
 };
 
-static void encode_mem_access(FILE *out, size_t bytes) {
+static void emit(Buf *b, Name name) {
+    assert(name.s);
+    buf_nprint(b, name.s, name.len);
+}
+
+#define EMIT(b, str) buf_nprint((b), (str), sizeof(str) - 1)
+
+static void emit_uint(Buf *b, uint64_t v) {
+    char digits[20];
+    int n = 20;
+    do {
+        digits[--n] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    buf_nprint(b, &digits[n], (size_t) (20 - n));
+}
+
+static void emit_int(Buf *b, int64_t v) {
+    if (v < 0) {
+        buf_push(b, '-');
+        emit_uint(b, -(uint64_t) v);
+    } else {
+        emit_uint(b, (uint64_t) v);
+    }
+}
+
+static void emit_hex(Buf *b, uint64_t v) {
+    char digits[16];
+    int n = 16;
+    do {
+        digits[--n] = "0123456789abcdef"[v & 0xf];
+        v >>= 4;
+    } while (v > 0);
+    buf_nprint(b, &digits[n], (size_t) (16 - n));
+}
+
+static void emit_mem_access(Buf *b, size_t bytes) {
     if (bytes > 0) {
-        fprintf(out, "%s ", NASM_MEM_PREFIX[bytes]);
+        emit(b, NASM_MEM_PREFIX[bytes]);
     }
 }
 
-void encode_gpr(FILE *out, int reg, int size) {
+static void emit_gpr(Buf *b, int reg, int size) {
     assert(size != R0 && reg != R_NONE);
     if (reg < LAST_GPR) { // Physical
-        fprintf(out, "%s", GPR_NAMES[reg][size]);
+        emit(b, GPR_NAMES[reg][size]);
     } else { // Virtual
-        fprintf(out, "%%%d%s", reg - LAST_GPR, REG_SIZE_SUFFIX[size]);
+        buf_push(b, '%');
+        emit_uint(b, (uint64_t) (reg - LAST_GPR));
+        buf_push(b, REG_SIZE_SUFFIX[size]);
     }
 }
 
-void encode_xmm(FILE *out, int reg) {
+static void emit_xmm(Buf *b, int reg) {
     if (reg < LAST_XMM) { // Physical
-        fprintf(out, "%s", XMM_NAMES[reg]);
+        emit(b, XMM_NAMES[reg]);
     } else { // Virtual
-        fprintf(out, "%%%df", reg - LAST_XMM);
+        buf_push(b, '%');
+        emit_uint(b, (uint64_t) (reg - LAST_XMM));
+        buf_push(b, 'f');
     }
 }
 
-static void encode_op(FILE *out, Global *g, AsmOpr *opr) {
+static void flush(FILE *out, Buf *b) {
+    fwrite(b->data, 1, b->len, out);
+    free(b->data);
+    free(b);
+}
+
+void encode_gpr(FILE *out, int reg, int size) {
+    Buf *b = buf_new();
+    emit_gpr(b, reg, size);
+    flush(out, b);
+}
+
+void encode_xmm(FILE *out, int reg) {
+    Buf *b = buf_new();
+    emit_xmm(b, reg);
+    flush(out, b);
+}
+
+int nasm_opcode(char *name, size_t len) {
+    for (int op = 0; op < X64_LAST; op++) {
+        Name n = X64_OPCODES[op];
+        if (n.len == len && strncmp(n.s, name, len) == 0) {
+            return op;
+        }
+    }
+    return -1;
+}
+
+int nasm_gpr(char *name, size_t len, int *size) {
+    for (int reg = RAX; reg < LAST_GPR; reg++) {
+        for (int s = R8L; s <= R64; s++) {
+            Name n = GPR_NAMES[reg][s];
+            if (n.s && n.len == len && strncmp(n.s, name, len) == 0) {
+                *size = s;
+                return reg;
+            }
+        }
+    }
+    return R_NONE;
+}
+
+int nasm_xmm(char *name, size_t len) {
+    for (int reg = XMM0; reg < LAST_XMM; reg++) {
+        if (XMM_NAMES[reg].len == len && strncmp(XMM_NAMES[reg].s, name, len) == 0) {
+            return reg;
+        }
+    }
+    return R_NONE;
+}
+
+// 'b', 'h', 'w', 'k', and 'q' pick the size of a GPR ('%k0' for 'eax', etc.);
+// 'c' is for a bare constant, which immediates are anyway
+static int ASM_MODIFIER_SIZE[128] = {
+    ['b'] = R8L, ['h'] = R8H, ['w'] = R16, ['k'] = R32, ['q'] = R64,
+};
+
+AsmOpr * asm_template_opr(AsmIns *ins, int idx, int modifier) {
+    AsmOpr *opr = ins->block->oprs[idx];
+    if (opr->k != OPR_GPR || !ASM_MODIFIER_SIZE[modifier]) {
+        return opr;
+    }
+    AsmOpr *resized = arena_alloc(ARENA_ASM, sizeof(AsmOpr));
+    *resized = *opr;
+    resized->size = ASM_MODIFIER_SIZE[modifier];
+    return resized;
+}
+
+static void encode_op(Buf *b, Global *g, AsmOpr *opr) {
     switch (opr->k) {
-    case OPR_IMM: fprintf(out, "%" PRIi64, opr->imm); break;
-    case OPR_F32:
-        encode_mem_access(out, 4);
-        fprintf(out, "[rel %s." F32_PREFIX "%zu]", g->label, opr->fp);
+    case OPR_IMM: emit_int(b, (int64_t) opr->imm); break;
+    case OPR_F32: case OPR_F64:
+        emit_mem_access(b, opr->k == OPR_F32 ? 4 : 8);
+        EMIT(b, "[rel ");
+        buf_print(b, fp_label(opr->k, opr->fp));
+        buf_push(b, ']');
         break;
-    case OPR_F64:
-        encode_mem_access(out, 8);
-        fprintf(out, "[rel %s." F64_PREFIX "%zu]", g->label, opr->fp);
+    case OPR_TABLE:
+        EMIT(b, "[rel ");
+        buf_print(b, g->label);
+        EMIT(b, "." TABLE_PREFIX);
+        emit_uint(b, opr->table);
+        buf_push(b, ']');
         break;
-    case OPR_GPR: encode_gpr(out, opr->reg, opr->size); break;
-    case OPR_XMM: encode_xmm(out, opr->reg); break;
+    case OPR_GPR: emit_gpr(b, opr->reg, opr->size); break;
+    case OPR_XMM: emit_xmm(b, opr->reg); break;
     case OPR_MEM:
-        encode_mem_access(out, opr->bytes);
-        fprintf(out, "[");
-        encode_gpr(out, opr->base, opr->base_size);
+        emit_mem_access(b, opr->bytes);
+        buf_push(b, '[');
+        if (opr->fs) {
+            EMIT(b, "fs:");
+        }
+        emit_gpr(b, opr->base, opr->base_size);
         if (opr->idx != R_NONE) {
-            fprintf(out, " + ");
-            encode_gpr(out, opr->idx, opr->idx_size);
+            EMIT(b, " + ");
+            emit_gpr(b, opr->idx, opr->idx_size);
             if (opr->scale > 1) {
-                fprintf(out, "*%d", opr->scale);
+                buf_push(b, '*');
+                emit_uint(b, (uint64_t) opr->scale);
             }
         }
         if (opr->disp > 0) {
-            fprintf(out, " + %" PRIi64, opr->disp);
+            EMIT(b, " + ");
+            emit_int(b, opr->disp);
         } else if (opr->disp < 0) {
-            fprintf(out, " - %" PRIi64, -opr->disp);
+            EMIT(b, " - ");
+            emit_uint(b, -(uint64_t) opr->disp);
         }
-        fprintf(out, "]");
+        buf_push(b, ']');
+        break;
+    case OPR_BB:
+        EMIT(b, BB_PREFIX);
+        emit_uint(b, opr->bb->n);
         break;
-    case OPR_BB:    fprintf(out, BB_PREFIX "%zu", opr->bb->n); break;
-    case OPR_LABEL: fprintf(out, "%s", opr->label); break;
+    case OPR_BB_ADDR:
+        EMIT(b, "[rel " BB_PREFIX);
+        emit_uint(b, opr->bb->n);
+        buf_push(b, ']');
+        break;
+    case OPR_LABEL: buf_print(b, opr->label); break;
     case OPR_DEREF:
-        encode_mem_access(out, opr->bytes);
-        fprintf(out, "[rel %s]", opr->label);
+        emit_mem_access(b, opr->bytes);
+        EMIT(b, "[rel ");
+        buf_print(b, opr->label);
+        buf_push(b, ']');
+        break;
+    case OPR_TPOFF: // NASM has no local-exec relocation, so only in '--dump-asm'
+        emit_mem_access(b, opr->bytes);
+        EMIT(b, "[fs:");
+        if (opr->label) {
+            buf_print(b, opr->label);
+            EMIT(b, " wrt ..tpoff]");
+        } else {
+            EMIT(b, "0]");
+        }
+        break;
+    case OPR_GOTTPOFF:
+        emit_mem_access(b, opr->bytes);
+        EMIT(b, "[rel ");
+        buf_print(b, opr->label);
+        EMIT(b, " wrt ..gottpoff]");
+        break;
+    case OPR_GOTPCREL:
+        emit_mem_access(b, opr->bytes);
+        EMIT(b, "[rel ");
+        buf_print(b, opr->label);
+        EMIT(b, " wrt ..gotpcrel]");
         break;
     }
 }
 
-static void encode_ins(FILE *out, Global *g, AsmIns *ins) {
-    fprintf(out, "%s", X64_OPCODES[ins->op]);
-    if (ins->l) {
-        fprintf(out, " ");
-        encode_op(out, g, ins->l);
+static void encode_ins(Buf *b, Global *g, AsmIns *ins);
+
+// The 'mov's that the X64_ASM_CLOBBER before a block does
+static void encode_asm_moves(Buf *b, Global *g, AsmIns *ins) {
+    AsmBlock *block = ins->block;
+    for (int i = 0; i < block->inline_asm->num_oprs; i++) {
+        if (block->fixed[i]) {
+            AsmIns mov = { .op = X64_MOV, .l = block->oprs[i], .r = block->fixed[i] };
+            buf_push(b, '\t');
+            encode_ins(b, g, &mov);
+        }
     }
-    if (ins->r) {
-        fprintf(out, ", ");
-        encode_op(out, g, ins->r);
+}
+
+// The template goes out a line at a time, with the operands substituted in
+static void encode_asm_block(Buf *b, Global *g, AsmIns *ins) {
+    InlineAsm *src = ins->block->inline_asm;
+    char *c = src->template;
+    while (*c) {
+        while (*c == ' ' || *c == '\t' || *c == '\n') {
+            c++;
+        }
+        if (!*c) {
+            break;
+        }
+        buf_push(b, '\t');
+        while (*c && *c != '\n') {
+            if (*c != '%' || src->is_basic) {
+                buf_push(b, *c++);
+                continue;
+            }
+            c++;
+            if (*c == '%') {
+                buf_push(b, *c++);
+                continue;
+            }
+            int modifier;
+            int idx = read_asm_opr(src, &c, &modifier);
+            assert(idx >= 0); // Checked by the parser
+            encode_op(b, g, asm_template_opr(ins, idx, modifier));
+        }
+        buf_push(b, '\n');
     }
-    fprintf(out, "\n");
 }
 
-static void encode_bb(FILE *out, Global *g, BB *bb) {
-    fprintf(out, BB_PREFIX "%zu:\n", bb->n);
-    for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
-        fprintf(out, "\t");
-        encode_ins(out, g, ins);
+static void encode_ins(Buf *b, Global *g, AsmIns *ins) {
+    AsmOpr *l = ins->l, *r = ins->r;
+    if ((ins->op == X64_XCHG || ins->op == X64_LOCK_XADD) &&
+            l->k == OPR_GPR && r->k != OPR_GPR) {
+        // Written register first (see 'asm_swap'), but NASM wants 'xadd m, r'
+        l = ins->r, r = ins->l;
+    }
+    emit(b, X64_OPCODES[ins->op]);
+    if (l) {
+        buf_push(b, ' ');
+        encode_op(b, g, l);
     }
+    if (l && l->k == OPR_LABEL && PIC != PIC_NONE) { // A 'call' or tail call
+        EMIT(b, " wrt ..plt"); // NASM otherwise uses a plain rip-relative one
+    }
+    if (r) {
+        EMIT(b, ", ");
+        encode_op(b, g, r);
+    }
+    if (ins->r2) {
+        EMIT(b, ", ");
+        encode_op(b, g, ins->r2);
+    }
+    buf_push(b, '\n');
+}
+
+int ALIGN_FUNCTIONS = 16, ALIGN_LOOPS = 16;
+
+// Loops are still as 'analyse_loops' found them; the assembler keeps 'loop'
+// up to date for the BBs it splits off edges
+int is_loop_start(BB *bb) {
+    return bb->loop && bb->prev && !in_loop(bb->prev, bb->loop);
 }
 
-static void encode_fps(FILE *out, Global *g) {
-    for (size_t i = 0; i < vec_len(g->fn->f32s); i++) {
-        uint32_t *fp = vec_get(g->fn->f32s, i);
-        fprintf(out, "%s." F32_PREFIX "%zu: ", g->label, i);
-        fprintf(out, "dd 0x%" PRIx32 " ; float %g\n", *fp, *((float *) fp));
+// NASM pads code with 'nop's
+static void encode_align(Buf *b, int align) {
+    if (align > 1) {
+        EMIT(b, "align ");
+        emit_uint(b, (uint64_t) align);
+        buf_push(b, '\n');
     }
-    for (size_t i = 0; i < vec_len(g->fn->f64s); i++) {
-        uint64_t *fp = vec_get(g->fn->f64s, i);
-        fprintf(out, "%s." F64_PREFIX "%zu: ", g->label, i);
-        fprintf(out, "dq 0x%" PRIx64 " ; double %g\n", *fp, *((double *) fp));
+}
+
+static void encode_bb(Buf *b, Global *g, BB *bb) {
+    if (is_loop_start(bb)) {
+        encode_align(b, ALIGN_LOOPS);
+    }
+    EMIT(b, BB_PREFIX);
+    emit_uint(b, bb->n);
+    EMIT(b, ":\n");
+    for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+        if (ins->op == X64_ASM_CLOBBER) {
+            encode_asm_moves(b, g, ins);
+        } else if (ins->op == X64_ASM) {
+            encode_asm_block(b, g, ins);
+        } else {
+            buf_push(b, '\t');
+            encode_ins(b, g, ins);
+        }
+    }
+}
+
+// Jump tables hold the offset of each BB from the start of the table (see
+// 'asm_switch'); they come before the function's label, so the BBs' local
+// labels are spelt out in full
+static void encode_jump_tables(Buf *b, Global *g) {
+    for (size_t i = 0; i < vec_len(g->fn->jump_tables); i++) {
+        Vec *table = vec_get(g->fn->jump_tables, i);
+        buf_print(b, g->label);
+        EMIT(b, "." TABLE_PREFIX);
+        emit_uint(b, i);
+        EMIT(b, ":\n");
+        for (size_t j = 0; j < vec_len(table); j++) {
+            BB *target = vec_get(table, j);
+            EMIT(b, "\tdq ");
+            buf_print(b, g->label);
+            EMIT(b, BB_PREFIX);
+            emit_uint(b, target->n);
+            EMIT(b, " - ");
+            buf_print(b, g->label);
+            EMIT(b, "." TABLE_PREFIX);
+            emit_uint(b, i);
+            buf_push(b, '\n');
+        }
     }
 }
 
@@ -162,92 +448,309 @@ static void number_bbs(Fn *fn) {
     }
 }
 
-static void encode_fn(FILE *out, Global *g) {
+static void encode_global_directive(Buf *b, Global *g) {
+    EMIT(b, "global ");
+    buf_print(b, g->label);
+    if (is_hidden(g) && g->k != G_NONE) {
+        buf_print(b, g->k == G_FN_DEF ? ":function hidden" : ":data hidden");
+    }
+    buf_push(b, '\n');
+}
+
+void encode_nasm_fn(Buf *b, Global *g) {
     if (g->linkage == LINK_EXTERN) {
-        fprintf(out, "global %s\n", g->label);
+        encode_global_directive(b, g);
     }
     number_bbs(g->fn);
-    encode_fps(out, g);
-    fprintf(out, "%s:\n", g->label);
+    encode_jump_tables(b, g);
+    encode_align(b, ALIGN_FUNCTIONS);
+    buf_print(b, g->label);
+    EMIT(b, ":\n");
     for (BB *bb = g->fn->entry; bb; bb = bb->next) {
-        encode_bb(out, g, bb);
+        encode_bb(b, g, bb);
+    }
+    buf_push(b, '\n');
+}
+
+// Sections of their own spell out their attributes, since NASM only knows the
+// defaults for the usual names
+static void encode_own_section(Buf *b, int section, Global *g) {
+    EMIT(b, "section ");
+    buf_print(b, section_name(section, g->label, g->fn_attrs));
+    switch (section) {
+    case SEC_TEXT:   EMIT(b, " progbits alloc exec nowrite align=16\n"); return;
+    case SEC_RODATA: EMIT(b, " progbits alloc noexec nowrite"); break;
+    case SEC_DATA:   EMIT(b, " progbits alloc noexec write"); break;
+    case SEC_BSS:    EMIT(b, " nobits alloc noexec write"); break;
+    case SEC_TDATA:  EMIT(b, " progbits alloc noexec write tls"); break;
+    case SEC_TBSS:   EMIT(b, " nobits alloc noexec write tls"); break;
+    default: UNREACHABLE();
     }
-    fprintf(out, "\n");
+    EMIT(b, " align=");
+    emit_uint(b, g->t->align > 1 ? g->t->align : 1);
+    buf_push(b, '\n');
 }
 
-static void encode_fns(FILE *out, Vec *globals) {
+#define STREAM_AT (64 * 1024) // Bytes of text to gather before writing them
+
+// Writes each function out as it goes, so the output file's written while
+// the rest are encoded rather than all at once at the end
+static void encode_fns(FILE *out, Buf *b, Vec *globals, Buf **fn_text) {
     int written_header = 0;
     for (size_t i = 0; i < vec_len(globals); i++) {
         Global *g = vec_get(globals, i);
         if (g->k != G_FN_DEF) {
             continue; // Not a function definition
         }
-        if (!written_header) {
-            fprintf(out, "section .text\n");
+        if (FUNCTION_SECTIONS) {
+            encode_own_section(b, SEC_TEXT, g);
+        } else if (!written_header) {
+            EMIT(b, "section .text\n");
             written_header = 1;
         }
-        encode_fn(out, g);
+        if (fn_text && fn_text[i]) { // Already encoded
+            buf_nprint(b, fn_text[i]->data, fn_text[i]->len);
+        } else {
+            encode_nasm_fn(b, g);
+        }
+        if (b->len >= STREAM_AT) {
+            fwrite(b->data, 1, b->len, out);
+            b->len = 0;
+        }
     }
 }
 
-static void encode_global_val(FILE *out, Global *g) {
-    uint64_t offset = 0;
-    switch (g->k) {
-    case G_IMM:  fprintf(out, "%s %" PRIu64, NASM_CONST[g->t->size], g->imm); break;
-    case G_FP:   fprintf(out, "%s %lf", NASM_CONST[g->t->size], g->fp); break;
-    case G_INIT:
-        for (size_t i = 0; i < vec_len(g->elems); i++) {
-            InitElem *elem = vec_get(g->elems, i);
-            if (offset < elem->offset) {
-                fprintf(out, "times %" PRIu64 " db 0", elem->offset - offset);
+#define DB_PER_LINE  64
+#define MIN_ZERO_RUN 16 // Shorter runs of zeros stay in a 'db' line
+
+static void start_line(Buf *b, int *first) {
+    if (!*first) {
+        buf_push(b, '\n');
+    }
+    *first = 0;
+}
+
+static void encode_zeros(Buf *b, size_t n, int *first) {
+    start_line(b, first);
+    EMIT(b, "times ");
+    emit_uint(b, n);
+    EMIT(b, " db 0");
+}
+
+static int is_zero_run(char *s, size_t len) {
+    if (len < MIN_ZERO_RUN) {
+        return 0;
+    }
+    for (size_t i = 0; i < MIN_ZERO_RUN; i++) {
+        if (s[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int is_quotable(char c) {
+    return c >= ' ' && c <= '~' && c != '\'';
+}
+
+// One 'db' line per 'DB_PER_LINE' bytes, with runs of printable characters
+// quoted (e.g., a string literal becomes "db 'hello', 10, 0") and long runs of
+// zeros as 'times'
+static void encode_bytes(Buf *b, char *s, size_t len, int *first) {
+    size_t i = 0;
+    while (i < len) {
+        if (is_zero_run(&s[i], len - i)) {
+            size_t n = 0;
+            while (i + n < len && s[i + n] == 0) {
+                n++;
             }
-            encode_global_val(out, elem->val);
-            offset = elem->offset + elem->val->t->size;
+            encode_zeros(b, n, first);
+            i += n;
+            continue;
         }
-        if (offset < g->t->size) {
-            fprintf(out, "times %" PRIu64 " db 0", g->t->size - offset);
+        start_line(b, first);
+        EMIT(b, "db ");
+        size_t end = len - i > DB_PER_LINE ? i + DB_PER_LINE : len;
+        for (int first_item = 1; i < end; first_item = 0) {
+            if (s[i] == 0 && is_zero_run(&s[i], len - i)) {
+                break;
+            }
+            if (!first_item) {
+                EMIT(b, ", ");
+            }
+            if (is_quotable(s[i])) {
+                buf_push(b, '\'');
+                while (i < end && is_quotable(s[i])) {
+                    buf_push(b, s[i++]);
+                }
+                buf_push(b, '\'');
+            } else {
+                emit_uint(b, (unsigned char) s[i++]);
+            }
         }
+    }
+}
+
+static void encode_ptr(Buf *b, char *label, int64_t offset) {
+    EMIT(b, "dq ");
+    buf_print(b, label);
+    if (offset > 0) {
+        EMIT(b, " + ");
+        emit_int(b, offset);
+    } else {
+        EMIT(b, " - ");
+        emit_int(b, -offset);
+    }
+}
+
+// Bytes 'from' up to 'to' of an initialiser (which are zero after 'num_bytes')
+static void encode_init_range(Buf *b, Global *g, size_t from, size_t to, int *first) {
+    if (from < g->num_bytes) {
+        size_t end = to < g->num_bytes ? to : g->num_bytes;
+        encode_bytes(b, &g->bytes[from], end - from, first);
+        from = end;
+    }
+    if (from < to) {
+        encode_zeros(b, to - from, first);
+    }
+}
+
+static void encode_global_val(Buf *b, Global *g) {
+    switch (g->k) {
+    case G_IMM:
+        buf_print(b, NASM_CONST[g->t->size]);
+        buf_push(b, ' ');
+        emit_uint(b, g->imm);
         break;
-    case G_PTR:
-        fprintf(out, "dq %s", g->g->label);
-        if (g->offset > 0) {
-            fprintf(out, " + %" PRIi64, g->offset);
-        } else {
-            fprintf(out, " - %" PRIi64, -g->offset);
+    case G_FP: buf_printf(b, "%s %lf", NASM_CONST[g->t->size], g->fp); break;
+    case G_INIT: {
+        int first = 1;
+        size_t offset = 0;
+        for (size_t i = 0; i < vec_len(g->relocs); i++) {
+            InitReloc *r = vec_get(g->relocs, i);
+            encode_init_range(b, g, offset, r->offset, &first);
+            start_line(b, &first);
+            encode_ptr(b, r->g->label, r->addend);
+            offset = r->offset + 8;
         }
+        encode_init_range(b, g, offset, g->t->size, &first);
         break;
+    }
+    case G_PTR: encode_ptr(b, g->g->label, g->offset); break;
     default: UNREACHABLE();
     }
 }
 
-static void encode_global(FILE *out, Global *g) {
+static void encode_global(Buf *b, Global *g, int section) {
     if (g->linkage != LINK_STATIC) {
-        fprintf(out, "global %s\n", g->label);
+        encode_global_directive(b, g);
     }
     if (g->k == G_NONE) {
         return;
     }
-    fprintf(out, "%s: ", g->label);
-    encode_global_val(out, g);
-    fprintf(out, "\n");
+    int nobits = section == SEC_BSS || section == SEC_TBSS;
+    if (g->t->align > 1) {
+        if (nobits) {
+            EMIT(b, "alignb ");
+            emit_uint(b, g->t->align);
+        } else {
+            EMIT(b, "align ");
+            emit_uint(b, g->t->align);
+            EMIT(b, ", db 0");
+        }
+        buf_push(b, '\n');
+    }
+    buf_print(b, g->label);
+    EMIT(b, ": ");
+    if (nobits) {
+        EMIT(b, "resb ");
+        emit_uint(b, g->t->size);
+    } else {
+        encode_global_val(b, g);
+    }
+    buf_push(b, '\n');
 }
 
-static void encode_globals(FILE *out, Vec *globals) {
+static void encode_section(Buf *b, Vec *globals, int section) {
     int written_header = 0;
     for (size_t i = 0; i < vec_len(globals); i++) {
         Global *g = vec_get(globals, i);
-        if (g->k == G_FN_DEF) {
-            continue; // Function definition
+        int g_section = global_section(g);
+        if (g_section == SEC_UNDEF) {
+            g_section = SEC_DATA; // Just the 'global' directive
+        } else if (g_section == SEC_CSTRING) {
+            g_section = SEC_RODATA; // NASM can't mark a section as mergeable
         }
-        if (!written_header) {
-            fprintf(out, "section .data\n");
+        if (g_section != section) {
+            continue;
+        }
+        if (has_own_section(section) && g->k != G_NONE) {
+            if (written_header) {
+                buf_push(b, '\n');
+            }
+            encode_own_section(b, section, g);
+            written_header = 1;
+        } else if (!written_header) {
+            EMIT(b, "section ");
+            buf_print(b, section_name(section, NULL, 0));
+            buf_push(b, '\n');
             written_header = 1;
         }
-        encode_global(out, g);
+        encode_global(b, g, section);
+    }
+    if (written_header) {
+        buf_push(b, '\n');
     }
 }
 
+// The comments with each constant's value are the only place 'printf'
+// formatting is still needed. NASM can't mark a section as mergeable, so the
+// pool goes in '.rodata' (the object file writers use '.rodata.cst4' and
+// '.rodata.cst8'). Doubles come first, so the floats after them are aligned
+static void encode_fp_pool(Buf *b, Vec *globals) {
+    Vec *f64s = fp_pool(globals, OPR_F64), *f32s = fp_pool(globals, OPR_F32);
+    if (vec_len(f64s) == 0 && vec_len(f32s) == 0) {
+        return;
+    }
+    EMIT(b, "section .rodata\nalign 8, db 0\n");
+    for (size_t i = 0; i < vec_len(f64s); i++) {
+        uint64_t *fp = vec_get(f64s, i);
+        buf_print(b, fp_label(OPR_F64, *fp));
+        EMIT(b, ": dq 0x");
+        emit_hex(b, *fp);
+        double d;
+        memcpy(&d, fp, sizeof(d));
+        buf_printf(b, " ; double %g\n", d);
+    }
+    for (size_t i = 0; i < vec_len(f32s); i++) {
+        uint64_t *fp = vec_get(f32s, i);
+        buf_print(b, fp_label(OPR_F32, *fp));
+        EMIT(b, ": dd 0x");
+        emit_hex(b, *fp);
+        uint32_t bits = (uint32_t) *fp;
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        buf_printf(b, " ; float %g\n", f);
+    }
+    buf_push(b, '\n');
+}
+
+static void encode_globals(Buf *b, Vec *globals) {
+    encode_section(b, globals, SEC_RODATA);
+    encode_fp_pool(b, globals);
+    encode_section(b, globals, SEC_DATA);
+    encode_section(b, globals, SEC_BSS);
+    encode_section(b, globals, SEC_TDATA);
+    encode_section(b, globals, SEC_TBSS);
+}
+
 void encode_nasm(FILE *out, Vec *globals) {
-    encode_fns(out, globals);     // .text section
-    encode_globals(out, globals); // .data section
+    encode_nasm_with(out, globals, NULL);
+}
+
+void encode_nasm_with(FILE *out, Vec *globals, Buf **fn_text) {
+    Buf *b = buf_new();
+    encode_fns(out, b, globals, fn_text); // .text section
+    encode_globals(b, globals);      // .rodata, .data, .bss, .tdata, and .tbss
+    flush(out, b);
 }
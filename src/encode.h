@@ -6,8 +6,32 @@
 
 void encode_nasm(FILE *out, Vec *globals);
 
+// '-falign-functions=N' and '-falign-loops=N': pad with NOPs so that each
+// function, and each loop, starts on an N byte boundary (so a short loop
+// doesn't straddle more fetch blocks than it needs to). 1 for no padding
+extern int ALIGN_FUNCTIONS, ALIGN_LOOPS;
+
+// Whether 'bb' is the first of its loop's BBs in the code, where the loop's
+// padding goes. That's not always the header; a loop's condition often comes
+// last, and the padding would be run on every iteration in front of it
+int is_loop_start(BB *bb);
+
+// For the parallel backend, which encodes each function on its own thread.
+// 'fn_text[i]' is the already encoded text for 'globals[i]', if not NULL
+void encode_nasm_fn(Buf *b, Global *g);
+void encode_nasm_with(FILE *out, Vec *globals, Buf **fn_text);
+
 // For register allocation debugging
 void encode_gpr(FILE *out, int reg, int size);
 void encode_xmm(FILE *out, int reg);
 
+// For inline assembly in 'x64.c'; an instruction or register by its NASM name,
+// or -1 (R_NONE for registers) if there isn't one
+int nasm_opcode(char *name, size_t len);
+int nasm_gpr(char *name, size_t len, int *size);
+int nasm_xmm(char *name, size_t len);
+
+// The operand that '%<modifier><idx>' in an inline assembly template stands for
+AsmOpr * asm_template_opr(AsmIns *ins, int idx, int modifier);
+
 #endif
@@ -15,25 +15,57 @@
 #define COLOUR_BLUE   34
 #define COLOUR_WHITE  37
 
+THREAD_LOCAL jmp_buf *ERROR_JMP = NULL;
+THREAD_LOCAL Buf *ERROR_OUT = NULL;
+THREAD_LOCAL int ERROR_OUT_COLOURS = 0;
+
+// Messages go to 'ERROR_OUT' if it's set, otherwise stdout
+static void vout(char *fmt, va_list args) {
+    if (ERROR_OUT) {
+        buf_vprintf(ERROR_OUT, fmt, args);
+    } else {
+        vprintf(fmt, args);
+    }
+}
+
+static void out(char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vout(fmt, args);
+    va_end(args);
+}
+
 static int supports_color() {
 #if defined(_WIN32) || defined(_WIN64)
     return 0; // Don't bother on Windows
 #else
-    static int supported = -1;
-    if (supported < 0) {
-        // Output in color if stdout is a terminal; proper way would be to
-        // check TERM or use terminfo database
-        supported = isatty(fileno(stdout));
-    }
-    return supported;
+    // Output in color if stdout is a terminal; proper way would be to check
+    // TERM or use terminfo database. Not cached, since the compile server's
+    // stdout is a different client's for each job
+    return isatty(fileno(stdout));
 #endif
 }
 
+int error_colours() {
+    return ERROR_OUT ? ERROR_OUT_COLOURS : supports_color();
+}
+
 static void print_colour(int colour) {
-    if (!supports_color()) {
-        return;
+    if (error_colours()) {
+        out("\033[%dm", colour);
+    }
+}
+
+void print_messages(Buf *msgs) {
+    out("%.*s", (int) msgs->len, msgs->data);
+}
+
+void error_fail() {
+    if (ERROR_JMP) {
+        fflush(stdout);
+        longjmp(*ERROR_JMP, 1);
     }
-    printf("\033[%dm", colour);
+    exit(1);
 }
 
 void error(char *fmt, ...) {
@@ -41,31 +73,31 @@ void error(char *fmt, ...) {
     va_start(args, fmt);
     print_colour(COLOUR_RED);
     print_colour(COLOUR_BOLD);
-    printf("error: ");
+    out("error: ");
     print_colour(COLOUR_WHITE);
-    vprintf(fmt, args);
+    vout(fmt, args);
     print_colour(COLOUR_CLEAR);
-    printf("\n");
+    out("\n");
     va_end(args);
-    exit(1);
+    error_fail();
 }
 
 static void print_tk(Token *tk) {
     print_colour(COLOUR_BLUE);
-    printf(" --> ");
+    out(" --> ");
     print_colour(COLOUR_CLEAR);
     if (tk->f && tk->f->name) {
-        printf("%s", tk->f->name);
+        out("%s", tk->f->name);
     } else {
-        printf("<unknown>");
+        out("<unknown>");
     }
     if (tk->line > 0) {
-        printf(":%d", tk->line);
+        out(":%d", tk->line);
     }
     if (tk->col > 0) {
-        printf(":%d", tk->col);
+        out(":%d", tk->col);
     }
-    printf("\n");
+    out("\n");
 }
 
 void error_at(Token *tk, char *fmt, ...) {
@@ -73,14 +105,14 @@ void error_at(Token *tk, char *fmt, ...) {
     va_start(args, fmt);
     print_colour(COLOUR_RED);
     print_colour(COLOUR_BOLD);
-    printf("error: ");
+    out("error: ");
     print_colour(COLOUR_WHITE);
-    vprintf(fmt, args);
+    vout(fmt, args);
     print_colour(COLOUR_CLEAR);
-    printf("\n");
+    out("\n");
     print_tk(tk);
     va_end(args);
-    exit(1);
+    error_fail();
 }
 
 void warning_at(Token *tk, char *fmt, ...) {
@@ -88,11 +120,11 @@ void warning_at(Token *tk, char *fmt, ...) {
     va_start(args, fmt);
     print_colour(COLOUR_YELLOW);
     print_colour(COLOUR_BOLD);
-    printf("warning: ");
+    out("warning: ");
     print_colour(COLOUR_WHITE);
-    vprintf(fmt, args);
+    vout(fmt, args);
     print_colour(COLOUR_CLEAR);
-    printf("\n");
+    out("\n");
     print_tk(tk);
     va_end(args);
 }
@@ -2,10 +2,30 @@
 #ifndef COSEC_ERROR_H
 #define COSEC_ERROR_H
 
+#include <setjmp.h>
+
 #include "lex.h"
 
+// Errors exit, unless the thread has set 'ERROR_JMP', in which case they jump
+// there instead (after flushing the message), so it can carry on with
+// something else (another file, or the compile server's next job)
+extern THREAD_LOCAL jmp_buf *ERROR_JMP;
+
+// Errors and warnings are printed to stdout, or appended here (without
+// colours, unless 'ERROR_OUT_COLOURS' is set) if it's set
+extern THREAD_LOCAL Buf *ERROR_OUT;
+extern THREAD_LOCAL int ERROR_OUT_COLOURS;
+
 void error(char *fmt, ...) __attribute__((noreturn));
 void error_at(Token *tk, char *fmt, ...) __attribute__((noreturn));
 void warning_at(Token *tk, char *fmt, ...);
 
+// For messages captured in another thread's 'ERROR_OUT': whether they should
+// have colours to be printed here, and printing them here
+int error_colours();
+void print_messages(Buf *msgs);
+
+// Fails as an error does, for one whose message has already been printed
+void error_fail() __attribute__((noreturn));
+
 #endif
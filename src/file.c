@@ -1,65 +1,176 @@
-
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#define USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// SSE2 is part of x86-64, so it doesn't need a run-time check; everywhere else
+// runs of characters are scanned one at a time
+#if defined(__SSE2__)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
 
 #include "file.h"
 
-File * new_file(FILE *fp, char *path) {
-    assert(fp);
+#ifdef USE_MMAP
+// Only use the mapping if it already ends with '\n'; otherwise we need an
+// extra byte to terminate the file, which a mapping can't give us
+static char * map_file(FILE *fp, size_t *len) {
+    struct stat st;
+    int fd = fileno(fp);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        return NULL;
+    }
+    size_t size = (size_t) st.st_size;
+    char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    if (data[size - 1] != '\n') {
+        munmap(data, size);
+        return NULL;
+    }
+    *len = size;
+    return data;
+}
+#endif
+
+// For pipes, empty files, and files that don't end with a newline. Always
+// leaves room for one more character at the end
+static char * slurp_file(FILE *fp, size_t *len) {
+    size_t max = 4096, n = 0;
+    char *data = malloc(max);
+    while (1) {
+        n += fread(&data[n], 1, max - n - 1, fp);
+        if (n < max - 1) {
+            break;
+        }
+        max *= 2;
+        data = realloc(data, max);
+    }
+    *len = n;
+    return data;
+}
+
+// Turns '\r\n' and '\r' into '\n' and removes backslash-newlines in place,
+// remembering where each splice was so 'next_ch' can keep the line count right.
+// Only writes when something has actually moved, so an untouched mmap'd page
+// is never copied
+static void normalise(File *f) {
+    char *r = f->data, *w = f->data;
+    while (r < f->end) {
+        char *src = r;
+        char c = *r++;
+        if (c == '\\' && r < f->end && (*r == '\n' || *r == '\r')) {
+            if (*r++ == '\r' && r < f->end && *r == '\n') {
+                r++;
+            }
+            vec_push(f->splices, w);
+            continue;
+        }
+        if (c == '\r') {
+            if (r < f->end && *r == '\n') {
+                r++;
+            }
+            c = '\n';
+        }
+        if (w != src || c != *src) {
+            *w = c;
+        }
+        w++;
+    }
+    f->end = w;
+}
+
+static File * alloc_file(char *path) {
     File *f = malloc(sizeof(File));
-    f->fp = fp;
     f->name = str_copy(path);
     f->line = 1;
     f->col = 1;
-    f->buf = buf_new();
-    f->prev_ch = 0;
+    f->splices = vec_new();
+    f->next_splice = 0;
+    f->data = NULL;
+    f->map_size = 0;
     return f;
 }
 
-static int read_ch_raw(File *f) {
-    int c;
-    if (f->buf->len > 0) {
-        c = (int) buf_pop(f->buf);
-    } else {
-        c = getc(f->fp);
-        if (c == EOF) {
-            // End the file with '\n' (for the preprocessor)
-            c = (f->prev_ch == '\n' || f->prev_ch == EOF) ? EOF : '\n';
-        } else if (c == '\r') { // Turn '\r' into '\n'
-            int c2 = getc(f->fp);
-            if (c2 != '\n') { // Turn '\r\n' into '\n'
-                ungetc(c2, f->fp);
-            }
-            c = '\n';
-        }
-    }
-    if (c == '\n') {
-        f->line++;
-        f->col = 1;
-    } else if (c != EOF) {
-        f->col++;
+static File * init_file(File *f, size_t len) {
+    f->p = f->data;
+    f->end = f->data + len;
+    normalise(f);
+
+    // End the file with '\n' (for the preprocessor). There's always room:
+    // either the buffer was slurped (or copied) with a spare byte, or
+    // normalising removed the final newline as part of a splice (so the file
+    // got shorter)
+    if (f->end == f->data || f->end[-1] != '\n') {
+        *f->end++ = '\n';
     }
-    f->prev_ch = c;
-    return c;
+    f->splice = vec_len(f->splices) > 0 ? vec_get(f->splices, 0) : NULL;
+    return f;
 }
 
-void undo_ch(File *f, int c) {
-    if (c == EOF) {
-        return;
+File * new_file(FILE *fp, char *path) {
+    assert(fp);
+    File *f = alloc_file(path);
+    size_t len = 0;
+#ifdef USE_MMAP
+    f->data = map_file(fp, &len);
+    f->map_size = f->data ? len : 0;
+#endif
+    if (!f->data) {
+        f->data = slurp_file(fp, &len);
     }
-    assert(c >= 0 && c <= 255);
-    buf_push(f->buf, (char) c);
+    fclose(fp);
+    return init_file(f, len);
+}
+
+File * new_file_from(char *data, size_t len, char *path) {
+    File *f = alloc_file(path);
+    f->data = malloc(len + 1); // Room for a final newline
+    memcpy(f->data, data, len);
+    return init_file(f, len);
+}
+
+File * new_empty_file(char *path) {
+    File *f = calloc(1, sizeof(File));
+    f->name = str_copy(path);
+    f->line = 1;
+    f->col = 1;
+    f->splices = vec_new();
+    return f;
+}
+
+void view_chs(File *f, char *s, size_t len) {
+    f->p = s;
+    f->end = s + len;
+    f->splice = NULL;
+    f->line = 1;
+    f->col = 1;
 }
 
 int next_ch(File *f) {
-    int c = read_ch_raw(f);
-    if (c == '\\') {
-        int c2 = read_ch_raw(f);
-        if (c2 == '\n') {
-            return next_ch(f); // Escape newlines preceded by '\'
-        } else {
-            undo_ch(f, c2);
-            f->col--;
-        }
+    if (f->p >= f->end) {
+        return EOF;
+    }
+    while (f->p == f->splice) { // Several splices can end at the same place
+        f->line++;
+        f->col = 1;
+        f->next_splice++;
+        f->splice = f->next_splice < vec_len(f->splices) ?
+                vec_get(f->splices, f->next_splice) : NULL;
+    }
+    int c = (unsigned char) *f->p++;
+    if (c == '\n') {
+        f->line++;
+        f->col = 1;
+    } else {
+        f->col++;
     }
     return c;
 }
@@ -73,28 +184,179 @@ int next_ch_is(File *f, int c) {
 }
 
 int peek_ch(File *f) {
-    int line = f->line, col = f->col;
-    int c = next_ch(f);
-    undo_ch(f, c);
-    f->line = line, f->col = col;
-    return c;
+    return f->p < f->end ? (unsigned char) f->p[0] : EOF;
 }
 
 int peek2_ch(File *f) {
-    int line = f->line, col = f->col;
-    int c1 = next_ch(f);
-    int c2 = next_ch(f);
-    undo_ch(f, c2);
-    undo_ch(f, c1);
-    f->line = line, f->col = col;
-    return c2;
-}
-
-void undo_chs(File *f, char *s, size_t len) {
-    for (size_t i = 0; i < len; i++) {
-        char ch = s[len - i - 1];
-        assert(ch != '\n'); // Cannot contain newlines
-        undo_ch(f, ch);
-        f->col--;
+    return f->p + 1 < f->end ? (unsigned char) f->p[1] : EOF;
+}
+
+
+// ---- Runs of Characters ----------------------------------------------------
+
+enum {
+    RUN_SPACE,   // ' ', '\t', '\v', '\f' ('\r' is normalised away)
+    RUN_IDENT,   // [a-zA-Z0-9_]
+    RUN_COMMENT, // Anything but '*' and '\n'
+    RUN_STR,     // Anything but '"', '\\' and '\n'
+};
+
+static int in_run(int run, char c) {
+    switch (run) {
+    case RUN_SPACE:   return c == ' ' || c == '\t' || c == '\v' || c == '\f';
+    case RUN_IDENT:   return isalnum((unsigned char) c) || c == '_';
+    case RUN_COMMENT: return c != '*' && c != '\n';
+    case RUN_STR:     return c != '"' && c != '\\' && c != '\n';
+    default: UNREACHABLE();
+    }
+    return 0;
+}
+
+#ifdef USE_SSE2
+static __m128i in_range_16(__m128i v, char lo, char hi) {
+    // Signed compares; bytes >= 0x80 are negative so never in the range
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((char) (lo - 1))),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8((char) (hi + 1))));
+}
+
+static __m128i is_16(__m128i v, char c) {
+    return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+}
+
+static __m128i in_run_16(int run, __m128i v) { // 0xff in each in-run byte
+    switch (run) {
+    case RUN_SPACE:
+        return _mm_or_si128(_mm_or_si128(is_16(v, ' '), is_16(v, '\t')),
+                            _mm_or_si128(is_16(v, '\v'), is_16(v, '\f')));
+    case RUN_IDENT: {
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20)); // 'A-Z' to 'a-z'
+        return _mm_or_si128(_mm_or_si128(in_range_16(lower, 'a', 'z'),
+                                         in_range_16(v, '0', '9')),
+                            is_16(v, '_'));
+    }
+    case RUN_COMMENT:
+        return _mm_andnot_si128(_mm_or_si128(is_16(v, '*'), is_16(v, '\n')),
+                                _mm_set1_epi8((char) 0xff));
+    case RUN_STR:
+        return _mm_andnot_si128(_mm_or_si128(_mm_or_si128(is_16(v, '"'), is_16(v, '\\')),
+                                             is_16(v, '\n')),
+                                _mm_set1_epi8((char) 0xff));
+    default: UNREACHABLE();
+    }
+    return _mm_setzero_si128();
+}
+#endif
+
+// Runs stop at the next splice, so 'next_ch' still counts its line
+static inline size_t span_chs(File *f, int run) {
+    char *p = f->p;
+    char *limit = f->splice ? f->splice : f->end;
+#ifdef USE_SSE2
+    while (limit - p >= 16) { // Never read past the end, which might be mmap'd
+        __m128i v = _mm_loadu_si128((__m128i *) p);
+        unsigned int out = ~(unsigned int) _mm_movemask_epi8(in_run_16(run, v)) & 0xffff;
+        if (out) {
+            return (size_t) (p - f->p) + (size_t) __builtin_ctz(out);
+        }
+        p += 16;
+    }
+#endif
+    while (p < limit && in_run(run, *p)) {
+        p++;
+    }
+    return (size_t) (p - f->p);
+}
+
+size_t span_space_chs(File *f)   { return span_chs(f, RUN_SPACE); }
+size_t span_ident_chs(File *f)   { return span_chs(f, RUN_IDENT); }
+size_t span_comment_chs(File *f) { return span_chs(f, RUN_COMMENT); }
+size_t span_str_chs(File *f)     { return span_chs(f, RUN_STR); }
+
+size_t span_line_chs(File *f) {
+    if (f->p >= f->end) {
+        return 0;
+    }
+    char *limit = f->splice ? f->splice : f->end;
+    char *nl = memchr(f->p, '\n', (size_t) (limit - f->p));
+    return (size_t) ((nl ? nl : limit) - f->p);
+}
+
+void skip_chs(File *f, size_t n) {
+    f->p += n; // Never newlines, which 'next_ch' counts
+    f->col += (int) n;
+}
+
+
+// ---- Skipped Blocks --------------------------------------------------------
+
+static void next_splice(File *f) {
+    f->next_splice++;
+    f->splice = f->next_splice < vec_len(f->splices) ?
+            vec_get(f->splices, f->next_splice) : NULL;
+}
+
+// Counts the splices before 'p' into the line number; 'bol' is where the
+// current line begins (a splice starts a new line, like a newline)
+static void pass_splices(File *f, char *p, char **bol) {
+    while (f->splice && f->splice < p) {
+        f->line++;
+        if (f->splice > *bol) {
+            *bol = f->splice;
+        }
+        next_splice(f);
+    }
+}
+
+static char * skip_block_comment_chs(File *f, char *p, char **bol) {
+    for (char *c = p; c + 1 < f->end; c++) { // 'p' is after the opening '/*'
+        if (c[0] == '\n') {
+            f->line++;
+            *bol = c + 1;
+        } else if (c[0] == '*' && c[1] == '/') {
+            return c + 2;
+        }
+    }
+    return NULL; // Unterminated
+}
+
+static char * skip_literal_chs(File *f, char *p, char quote) {
+    // A literal in a skipped block might not be terminated (e.g., an
+    // apostrophe in English text), so it ends at the end of the line too
+    while (p < f->end && *p != quote && *p != '\n') {
+        if (*p == '\\' && p + 1 < f->end && p[1] != '\n') {
+            p++;
+        }
+        p++;
+    }
+    return p < f->end && *p == quote ? p + 1 : p;
+}
+
+void skip_chs_to_directive(File *f) {
+    char *p = f->p;
+    char *bol = p - (f->col - 1); // Beginning of the line, where 'col' is 1
+    while (p < f->end) {
+        pass_splices(f, p + 1, &bol);
+        if (p == bol && *p == '#') {
+            break; // Directive
+        }
+        char c = *p++;
+        if (c == '\n') {
+            f->line++;
+            bol = p;
+        } else if (c == '/' && p < f->end && *p == '/') {
+            p = memchr(p, '\n', f->end - p); // Always ends in a newline
+        } else if (c == '/' && p < f->end && *p == '*') {
+            char *end = skip_block_comment_chs(f, p + 1, &bol);
+            if (!end) {
+                p--; // Let the lexer report the unterminated comment
+                break;
+            }
+            p = end;
+        } else if (c == '"' || c == '\'') {
+            p = skip_literal_chs(f, p, c);
+        }
+        pass_splices(f, p, &bol);
     }
+    f->p = p;
+    f->col = (int) (p - bol) + 1;
 }
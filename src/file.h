@@ -6,22 +6,54 @@
 
 #include "util.h"
 
+// The whole source file is read into memory up front (mmap'd where possible)
+// and walked with a cursor. '\r\n' and '\r' are normalised to '\n', and
+// backslash-newlines are spliced out, in a single pass when the file is
+// opened, so reading and peeking characters are just pointer reads.
 typedef struct {
-    FILE *fp;
     char *name; // Not the full path to the file (e.g., 'stdlib.h')
     int line, col;
-    Buf *buf;
-    int prev_ch;
+    char *data, *p, *end; // Normalised file contents; 'p' is the cursor
+    size_t map_size;      // Non-zero if 'data' is mmap'd
+    Vec *splices;         // of 'char *'; where '\'-newlines were removed
+    size_t next_splice;
+    char *splice;         // Next splice position (or NULL if there are none)
 } File;
 
+// Takes ownership of 'fp', which is closed once its contents have been read
 File * new_file(FILE *fp, char *path);
+
+// Copies 'len' bytes of source that's already in memory
+File * new_file_from(char *data, size_t len, char *path);
+
+// For a header whose tokens are replayed from the cache, or as somewhere to
+// point 'view_chs'. Has no contents
+File * new_empty_file(char *path);
+
+// Points the cursor at 'len' bytes of 's' instead of the file's contents,
+// without copying them; 's' has to outlive lexing it. Used by the
+// preprocessor to lex a token glued together with '##', so 's' can't contain
+// splices (and shouldn't contain newlines, to keep 'f->col' right for errors)
+void view_chs(File *f, char *s, size_t len);
+
 int next_ch(File *f);
 int peek_ch(File *f);
 int peek2_ch(File *f);
 int next_ch_is(File *f, int c);
 
-// Used by the preprocessor when gluing tokens together with '##'. CANNOT
-// contain newlines (can't reliably update 'f->col' for errors)
-void undo_chs(File *f, char *s, size_t len);
+// Fast paths for the lexer. The length of the run of characters at the cursor
+// that are in a class, up to the next splice, which 'skip_chs' then moves
+// past. Runs never contain newlines
+size_t span_space_chs(File *f);   // ' ', '\t', '\v', '\f'
+size_t span_ident_chs(File *f);   // [a-zA-Z0-9_]
+size_t span_comment_chs(File *f); // Up to the next '*' or newline
+size_t span_str_chs(File *f);     // Up to the next '"', '\\' or newline
+size_t span_line_chs(File *f);    // Up to the next newline
+void skip_chs(File *f, size_t n);
+
+// For skipping a false '#if' block without lexing it. Moves the cursor to the
+// next '#' at the start of a line (or the end of the file), keeping track of
+// comments and literals only so that a '#' or newline inside one is skipped
+void skip_chs_to_directive(File *f);
 
 #endif
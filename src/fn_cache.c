@@ -0,0 +1,317 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#define USE_FILES
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "fn_cache.h"
+#include "assemble.h"
+#include "schedule.h"
+#include "encode.h"
+#include "target.h"
+
+char *CACHE_DIR = NULL;
+
+static void put(Buf *b, void *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        buf_push(b, ((char *) data)[i]);
+    }
+}
+
+static void put_u32(Buf *b, uint32_t v) { put(b, &v, sizeof(v)); }
+static void put_u64(Buf *b, uint64_t v) { put(b, &v, sizeof(v)); }
+
+static void put_str(Buf *b, char *s) {
+    put_u32(b, (uint32_t) strlen(s));
+    put(b, s, strlen(s));
+}
+
+
+// ---- Keys ------------------------------------------------------------------
+
+// A key is the options, then the function's label, linkage, attributes and
+// signature, then each BB's instructions in order. Instructions and BBs are
+// written as their index in the function, so the key doesn't depend on where
+// anything is in memory
+
+#define FN_CACHE_MAGIC   0x4e464343 // 'CCFN'
+#define FN_CACHE_VERSION 11
+
+static void put_type(Buf *b, IrType *t) {
+    if (!t) {
+        put_u32(b, (uint32_t) -1);
+        return;
+    }
+    put_u32(b, (uint32_t) t->k);
+    put_u64(b, t->size);
+    put_u64(b, t->align);
+    if (t->k == IRT_ARR || t->k == IRT_VEC) {
+        put_u64(b, t->len);
+        put_type(b, t->elem);
+    } else if (t->k == IRT_STRUCT) {
+        put_u64(b, vec_len(t->fields));
+        for (size_t i = 0; i < vec_len(t->fields); i++) {
+            IrField *f = vec_get(t->fields, i);
+            put_u64(b, f->offset);
+            put_type(b, f->t);
+        }
+    }
+}
+
+static void put_bbs(Buf *b, Vec *bbs) {
+    put_u64(b, vec_len(bbs));
+    for (size_t i = 0; i < vec_len(bbs); i++) {
+        put_u64(b, ((BB *) vec_get(bbs, i))->n);
+    }
+}
+
+// Everything the backend reads from 'ins', besides its operands
+static void put_ins_fields(Buf *b, IrIns *ins) {
+    switch (ins->op) {
+    case IR_IMM: put_u64(b, ins->imm); break;
+    case IR_FP:  { uint64_t bits; memcpy(&bits, &ins->fp, sizeof(bits)); put_u64(b, bits); break; }
+    case IR_GLOBAL:
+        put_str(b, ins->g->label);
+        put_u32(b, (uint32_t) ins->g->k);
+        put_u32(b, (uint32_t) ins->g->linkage);
+        put_u32(b, (uint32_t) ins->g->visibility);
+        put_u32(b, (uint32_t) ins->g->is_tls);
+        put_u32(b, (uint32_t) ins->g->fn_attrs); // e.g., a 'pure' callee
+        break;
+    case IR_BB_ADDR: put_u64(b, ins->label_bb->n); break;
+    case IR_FARG:
+        put_u64(b, ins->arg_idx);
+        put_u32(b, (uint32_t) ins->is_restrict);
+        break;
+    case IR_ALLOC:
+        put_type(b, ins->alloc_t);
+        put_u32(b, (uint32_t) ins->escapes);
+        break;
+    case IR_LOAD: case IR_STORE: case IR_COPY: put_u64(b, ins->align); break;
+    case IR_BITCAST: put_u64(b, ins->assumed_align); break;
+    case IR_PREFETCH: put_u32(b, (uint32_t) ins->locality); break;
+    case IR_REDUCE: put_u32(b, (uint32_t) ins->reduce_op); break;
+    case IR_ATOMIC_LOAD: case IR_ATOMIC_STORE: case IR_ATOMIC_XCHG:
+    case IR_ATOMIC_ADD: case IR_ATOMIC_CAS: case IR_FENCE:
+        put_u32(b, (uint32_t) ins->order);
+        break;
+    case IR_PHI:
+        put_bbs(b, ins->preds);
+        put_u64(b, vec_len(ins->defs));
+        for (size_t i = 0; i < vec_len(ins->defs); i++) {
+            put_u64(b, ((IrIns *) vec_get(ins->defs, i))->n);
+        }
+        break;
+    case IR_BR: put_u64(b, ins->br->n); break;
+    case IR_CONDBR:
+        put_u64(b, ins->true->n);
+        put_u64(b, ins->false->n);
+        put_u32(b, (uint32_t) ins->likely);
+        break;
+    case IR_SWITCH:
+        put_u64(b, ins->default_br->n);
+        put_bbs(b, ins->table);
+        put_u32(b, (uint32_t) ins->in_range);
+        break;
+    case IR_INDIRECT_BR: put_bbs(b, ins->targets); break;
+    case IR_CALL: put_u32(b, (uint32_t) ins->is_vararg); break;
+    default: break;
+    }
+}
+
+Buf * fn_cache_key(Global *g, int allocator) {
+    Fn *fn = g->fn;
+    size_t n = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->n = n++;
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_ASM) {
+                return NULL; // Refers to an 'InlineAsm' that's not worth keying
+            }
+        }
+    }
+    number_ir(fn);
+
+    Buf *b = buf_new();
+    put_u32(b, (uint32_t) allocator);
+    put_u32(b, (uint32_t) CPU_FEATURES);
+    put_u32(b, (uint32_t) FP_CONTRACT);
+    put_u32(b, (uint32_t) OMIT_FRAME_POINTER);
+    put_u32(b, (uint32_t) RED_ZONE);
+    put_u32(b, (uint32_t) SHRINK_WRAP);
+    put_u32(b, (uint32_t) SCHEDULE_INSNS);
+    put_u32(b, (uint32_t) SCHEDULE_INSNS2);
+    put_u32(b, (uint32_t) ALIGN_FUNCTIONS);
+    put_u32(b, (uint32_t) ALIGN_LOOPS);
+    put_u32(b, (uint32_t) TLS_LOCAL_EXEC);
+    put_u32(b, (uint32_t) PIC);
+    put_u32(b, (uint32_t) VISIBILITY_HIDDEN);
+    put_u32(b, (uint32_t) PLT);
+    put_str(b, TARGET->name);
+
+    put_str(b, g->label);
+    put_u32(b, (uint32_t) g->linkage);
+    put_u32(b, (uint32_t) g->fn_attrs);
+    put_u64(b, vec_len(fn->params));
+    for (size_t i = 0; i < vec_len(fn->params); i++) {
+        put_type(b, vec_get(fn->params, i));
+    }
+    put_type(b, fn->ret);
+    put_str(b, fn->instrument ? fn->instrument->label : "");
+    put_u32(b, (uint32_t) fn->patchable_entry);
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        put_u32(b, (uint32_t) -1); // BB boundary
+        put_u64(b, (uint64_t) bb->freq); // For layout and spill costs
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            put_u32(b, (uint32_t) ins->op);
+            put_type(b, ins->t);
+            put_ins_fields(b, ins);
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                put_u64(b, (*oprs[i])->n);
+            }
+        }
+    }
+    return b;
+}
+
+
+// ---- Entries ---------------------------------------------------------------
+
+// An entry is the magic number, 'FN_CACHE_VERSION', the key's length and the
+// key, then the function's doubles and floats (a count, then their bits), and
+// then the length of the text and the text
+
+typedef struct {
+    char *p, *end;
+} Reader;
+
+static int get(Reader *r, void *data, size_t len) {
+    if ((size_t) (r->end - r->p) < len) {
+        return 0; // Truncated
+    }
+    memcpy(data, r->p, len);
+    r->p += len;
+    return 1;
+}
+
+static void put_fps(Buf *b, Vec *fps) {
+    put_u64(b, vec_len(fps));
+    for (size_t i = 0; i < vec_len(fps); i++) {
+        put_u64(b, *((uint64_t *) vec_get(fps, i)));
+    }
+}
+
+static int get_fps(Reader *r, Vec *fps) {
+    uint64_t num;
+    if (!get(r, &num, 8) || num > (uint64_t) (r->end - r->p) / 8) {
+        return 0;
+    }
+    for (uint64_t i = 0; i < num; i++) {
+        uint64_t *bits = malloc(sizeof(uint64_t));
+        get(r, bits, 8);
+        vec_push(fps, bits);
+    }
+    return 1;
+}
+
+static Buf * encode_entry(Global *g, Buf *key, Buf *text) {
+    Buf *b = buf_new();
+    put_u32(b, FN_CACHE_MAGIC);
+    put_u32(b, FN_CACHE_VERSION);
+    put_u64(b, key->len);
+    put(b, key->data, key->len);
+    put_fps(b, g->fn->f64s);
+    put_fps(b, g->fn->f32s);
+    put_u64(b, text->len);
+    put(b, text->data, text->len);
+    return b;
+}
+
+// Returns NULL if the entry is corrupt or for a different key
+static Buf * decode_entry(Global *g, Buf *key, char *data, size_t size) {
+    Reader r = { data, data + size };
+    uint32_t magic, version;
+    uint64_t key_len, text_len;
+    if (!get(&r, &magic, 4) || magic != FN_CACHE_MAGIC ||
+            !get(&r, &version, 4) || version != FN_CACHE_VERSION ||
+            !get(&r, &key_len, 8) || key_len != key->len ||
+            (size_t) (r.end - r.p) < key_len || memcmp(r.p, key->data, key_len) != 0) {
+        return NULL;
+    }
+    r.p += key_len;
+    Vec *f64s = vec_new(), *f32s = vec_new();
+    if (!get_fps(&r, f64s) || !get_fps(&r, f32s) || !get(&r, &text_len, 8) ||
+            text_len != (uint64_t) (r.end - r.p)) {
+        return NULL;
+    }
+    Buf *text = buf_new();
+    buf_nprint(text, r.p, text_len);
+    g->fn->f64s = f64s;
+    g->fn->f32s = f32s;
+    return text;
+}
+
+static uint64_t hash_key(Buf *key) { // 64-bit FNV hash
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < key->len; i++) {
+        h ^= (unsigned char) key->data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static char * entry_path(Buf *key) {
+    Buf *b = buf_new();
+    buf_printf(b, "%s/%016llx.fn", CACHE_DIR, (unsigned long long) hash_key(key));
+    return b->data;
+}
+
+#ifdef USE_FILES
+Buf * fn_cache_load(Global *g, Buf *key) {
+    int fd = open(entry_path(key), O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    Buf *text = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size_t size = (size_t) st.st_size;
+        char *data = malloc(size);
+        if (read(fd, data, size) == (ssize_t) size) {
+            text = decode_entry(g, key, data, size);
+        }
+        free(data);
+    }
+    close(fd);
+    return text;
+}
+
+// Written to a temporary file first, so other compilers never see half an
+// entry
+void fn_cache_save(Global *g, Buf *key, Buf *text) {
+    mkdir(CACHE_DIR, 0777);
+    char *dst = entry_path(key);
+    Buf *tmp = buf_new();
+    buf_printf(tmp, "%s.XXXXXX", dst);
+    int fd = mkstemp(tmp->data);
+    if (fd < 0) {
+        return;
+    }
+    Buf *b = encode_entry(g, key, text);
+    int ok = write(fd, b->data, b->len) == (ssize_t) b->len;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp->data, dst) != 0) {
+        unlink(tmp->data);
+    }
+}
+#else
+Buf * fn_cache_load(Global *g, Buf *key) { return NULL; }
+void fn_cache_save(Global *g, Buf *key, Buf *text) {}
+#endif
@@ -0,0 +1,25 @@
+
+#ifndef COSEC_FN_CACHE_H
+#define COSEC_FN_CACHE_H
+
+#include "compile.h"
+
+// Function cache. If 'CACHE_DIR' is set ('-fcache-dir=<dir>'), the NASM text
+// for each function is kept there, keyed by the function's optimised IR and
+// every option the backend looks at, so a later compile of a function whose
+// IR hasn't changed (even if the rest of the file has) skips assembling,
+// register allocation, and encoding for it. The whole key is stored with the
+// text and compared on a hit, so a hash collision can't give the wrong code
+extern char *CACHE_DIR;
+
+// The key for 'g's code, or NULL if it can't be cached (it has inline assembly)
+Buf * fn_cache_key(Global *g, int allocator);
+
+// The cached text for 'key', or NULL. Also restores the floating point
+// constants 'g' refers to (see 'fp_pool'), which aren't in the text
+Buf * fn_cache_load(Global *g, Buf *key);
+
+// Best effort; needs the constants 'assemble' recorded for 'g'
+void fn_cache_save(Global *g, Buf *key, Buf *text);
+
+#endif
@@ -0,0 +1,414 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gvn.h"
+
+// A dominator-based scheme, from 'Value Numbering', Preston Briggs, Keith D.
+// Cooper, and L. Taylor Simpson, 1997: walking the dominator tree with a
+// scoped hash table means any equivalent expression found in the table is
+// always defined on every path to the instruction being looked up.
+//
+// Memory isn't modelled beyond a version number that changes with every
+// store, copy, or call. A load's expression includes the version, so it only
+// matches while memory is known to be unchanged. A BB carries the version on
+// from its immediate dominator only if that's its single predecessor (i.e.,
+// nothing else could have run in between).
+//
+// A call to a 'pure' or 'const' function doesn't change memory, and one with
+// at most 2 arguments is an expression too: its operands are the arguments,
+// and the function called. A 'pure' call's expression includes the memory
+// version, like a load's, since the function can read memory.
+
+typedef struct Expr {
+    int op, tk;
+    size_t size;     // Of the result type
+    IrIns *l, *r;    // Operands (after value numbering)
+    IrIns *fn;       // IR_CALL; the function called
+    uint64_t v;      // Constant, global, or memory version
+    IrIns *val;      // Instruction computing the expression
+    struct Expr *next;
+} Expr;
+
+typedef struct {
+    Fn *fn;
+    IrIns **repl;    // Per ins; the equivalent it was replaced by, or NULL
+    Expr **buckets;  // Scoped hash table; most recent entry first in a bucket
+    size_t num_buckets;
+    Vec *scope;      // of 'Expr *'; in the order they were added
+    uint64_t mem;    // Current memory version
+    uint64_t next_mem;
+    uint64_t *mem_out; // Per BB (indexed by 'rpo'); memory version at the end
+    size_t num_ins;  // New instructions are numbered this, so they're never in 'repl'
+} GVN;
+
+
+// ---- Expressions -----------------------------------------------------------
+
+static int is_commutative(int op) {
+    return op == IR_ADD || op == IR_MUL || op == IR_UMULH || op == IR_BIT_AND ||
+           op == IR_BIT_OR || op == IR_BIT_XOR || op == IR_EQ || op == IR_NEQ;
+}
+
+static int is_pure_call(IrIns *ins) {
+    return ins->op == IR_CALL && (call_attrs(ins) & (FA_PURE | FA_CONST));
+}
+
+static int clobbers_mem(IrIns *ins) {
+    return ins->op == IR_STORE || ins->op == IR_COPY || ins->op == IR_ZERO ||
+           (ins->op == IR_CALL && !is_pure_call(ins)) || ins->op == IR_ASM ||
+           is_atomic(ins);
+}
+
+static Expr to_expr(GVN *g, IrIns *ins) {
+    Expr e = { .op = ins->op, .tk = ins->t->k, .size = ins->t->size,
+               .l = NULL, .r = NULL, .fn = NULL, .v = 0, .val = ins, .next = NULL };
+    switch (ins->op) {
+    case IR_IMM:    e.v = ins->imm; break;
+    case IR_FP:     memcpy(&e.v, &ins->fp, sizeof(double)); break;
+    case IR_GLOBAL: e.v = (uint64_t) (uintptr_t) ins->g; break;
+    case IR_LOAD:   e.l = ins->src; e.v = g->mem; break;
+    default: {
+        IrIns **oprs[3];
+        int num_oprs = ir_operands(ins, oprs);
+        e.l = *oprs[0];
+        e.r = num_oprs > 1 ? *oprs[1] : NULL;
+        if (is_commutative(ins->op) && e.l->n > e.r->n) { // Canonical order
+            IrIns *tmp = e.l;
+            e.l = e.r;
+            e.r = tmp;
+        }
+        break;
+    }
+    }
+    return e;
+}
+
+static size_t hash_expr(Expr *e) {
+    uint64_t h = 14695981039346656037ull; // FNV-1a over the fields
+    uint64_t fields[] = { (uint64_t) e->op, (uint64_t) e->tk, e->size,
+                          e->l ? e->l->n : 0, e->r ? e->r->n : 0,
+                          e->fn ? e->fn->n : 0, e->v };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        h = (h ^ fields[i]) * 1099511628211ull;
+    }
+    return (size_t) h;
+}
+
+static int expr_eq(Expr *a, Expr *b) {
+    return a->op == b->op && a->tk == b->tk && a->size == b->size &&
+           a->l == b->l && a->r == b->r && a->fn == b->fn && a->v == b->v;
+}
+
+static IrIns * find_expr(GVN *g, Expr *e) {
+    size_t b = hash_expr(e) & (g->num_buckets - 1);
+    for (Expr *x = g->buckets[b]; x; x = x->next) {
+        if (expr_eq(x, e)) {
+            return x->val;
+        }
+    }
+    return NULL;
+}
+
+static void add_expr(GVN *g, Expr *e) {
+    Expr *x = malloc(sizeof(Expr));
+    *x = *e;
+    size_t b = hash_expr(x) & (g->num_buckets - 1);
+    x->next = g->buckets[b];
+    g->buckets[b] = x;
+    vec_push(g->scope, x);
+}
+
+// Entries are always removed in the reverse order they were added, so each
+// one is at the head of its bucket
+static void pop_scope(GVN *g, size_t to) {
+    while (vec_len(g->scope) > to) {
+        Expr *x = vec_pop(g->scope);
+        size_t b = hash_expr(x) & (g->num_buckets - 1);
+        assert(g->buckets[b] == x);
+        g->buckets[b] = x->next;
+        free(x);
+    }
+}
+
+
+// ---- Reassociation ---------------------------------------------------------
+
+// The address of each element in an initialiser (see 'compile_array_init_raw')
+// is built on the one before it ('p2 = p1 + 8', with 'p1 = p0 + 8'), so a big
+// initialiser is one long dependency chain. A constant offset from a PTRADD of
+// a constant offset is folded into one from its base instead ('p2 = p0 + 16'),
+// which also gives equal addresses the same value number. A variable offset
+// goes before a constant one ('(p + 8) + i*4' becomes '(p + i*4) + 8'), so
+// the constant folds into any constant offsets from the result too. Either
+// way 'match_addr' (in 'assemble.c') sees a base, an index, and a constant.
+
+// Returns an equivalent that's already been numbered, or inserts 'ins' before
+// 'before' and numbers it
+static IrIns * number_new(GVN *g, IrIns *ins, IrIns *before) {
+    ins->n = g->num_ins;
+    Expr e = to_expr(g, ins);
+    IrIns *prev = find_expr(g, &e);
+    if (prev) {
+        return prev;
+    }
+    insert_ir(ins, before);
+    add_expr(g, &e);
+    return ins;
+}
+
+static void reassociate(GVN *g, IrIns *ptradd) {
+    IrIns *inner = ptradd->base;
+    if (inner->op != IR_PTRADD || inner->offset->op != IR_IMM) {
+        return;
+    }
+    if (ptradd->offset->op == IR_IMM) {
+        IrIns *imm = new_ins(IR_IMM, ptradd->offset->t);
+        imm->imm = inner->offset->imm + ptradd->offset->imm;
+        ptradd->base = inner->base;
+        ptradd->offset = number_new(g, imm, ptradd);
+    } else {
+        IrIns *var = new_ins(IR_PTRADD, ptradd->t);
+        var->base = inner->base;
+        var->offset = ptradd->offset;
+        ptradd->base = number_new(g, var, ptradd);
+        ptradd->offset = inner->offset;
+    }
+}
+
+// Writes to neighbouring bit-fields in one unit leave a chain of masks once
+// the stores are forwarded to the loads after them: '((u & c1) | v1) & c2'.
+// Where 'v1' can only have bits that 'c2' keeps, that's '(u & (c1 & c2)) |
+// v1'; and '(x | k1) | k2' is 'x | (k1 | k2)'. A run of them then clears the
+// unit with a single 'and', and sets any constant fields with a single 'or'
+
+#define MAX_ONES_DEPTH 4
+
+static IrIns * imm_opr(IrIns *ins, IrIns **other) {
+    if (ins->r->op == IR_IMM) {
+        *other = ins->l;
+        return ins->r;
+    } else if (ins->l->op == IR_IMM) {
+        *other = ins->r;
+        return ins->l;
+    }
+    return NULL;
+}
+
+// The bits that could be 1 in 'ins'
+static uint64_t maybe_ones(IrIns *ins, int depth) {
+    if (ins->op == IR_IMM) {
+        return ins->imm;
+    } else if (depth == MAX_ONES_DEPTH) {
+        return ~0ull;
+    }
+    switch (ins->op) {
+    case IR_BIT_AND:
+        return maybe_ones(ins->l, depth + 1) & maybe_ones(ins->r, depth + 1);
+    case IR_BIT_OR:
+        return maybe_ones(ins->l, depth + 1) | maybe_ones(ins->r, depth + 1);
+    case IR_SHL:
+        if (ins->r->op != IR_IMM || ins->r->imm >= 64) {
+            return ~0ull;
+        }
+        return maybe_ones(ins->l, depth + 1) << ins->r->imm;
+    case IR_ZEXT:
+        return maybe_ones(ins->l, depth + 1) & (~0ull >> (64 - ins->l->t->size * 8));
+    default: return ~0ull;
+    }
+}
+
+static void merge_masks(GVN *g, IrIns *ins, IrIns *before) {
+    IrIns *x, *c = imm_opr(ins, &x);
+    if (!c || (ins->t->k < IRT_I8 || ins->t->k > IRT_I64)) {
+        return;
+    }
+    uint64_t all = ~0ull >> (64 - ins->t->size * 8);
+    IrIns *y, *k;
+    if (x->op == ins->op && (k = imm_opr(x, &y))) { // '(y & k) & c', '(y | k) | c'
+        IrIns *imm = new_ins(IR_IMM, ins->t);
+        imm->imm = ins->op == IR_BIT_AND ? k->imm & c->imm : k->imm | c->imm;
+        ins->l = y;
+        ins->r = number_new(g, imm, before);
+    } else if (ins->op == IR_BIT_AND && x->op == IR_BIT_OR) {
+        for (int i = 0; i < 2; i++) {
+            IrIns *u = i ? x->r : x->l, *v = i ? x->l : x->r;
+            if ((maybe_ones(v, 0) & ~c->imm & all) != 0) {
+                continue;
+            }
+            IrIns *and = new_ins(IR_BIT_AND, ins->t);
+            and->l = u;
+            and->r = c;
+            merge_masks(g, and, before);
+            ins->op = IR_BIT_OR;
+            ins->l = number_new(g, and, before);
+            ins->r = v;
+            merge_masks(g, ins, before); // Its 'v' might be a constant too
+            return;
+        }
+    }
+}
+
+
+// ---- Value Numbering -------------------------------------------------------
+
+static IrIns * resolve(GVN *g, IrIns *ins) {
+    return g->repl[ins->n] ? g->repl[ins->n] : ins;
+}
+
+// Returns 0 if the call can't be an expression (it has more than 2 arguments,
+// or no result)
+static int call_expr(GVN *g, IrIns *call, Expr *e) {
+    *e = (Expr) { .op = IR_CALL, .tk = call->t->k, .size = call->t->size,
+                  .l = NULL, .r = NULL, .fn = call->fn, .val = call, .next = NULL };
+    e->v = (call_attrs(call) & FA_CONST) ? 0 : g->mem;
+    IrIns **args[] = { &e->l, &e->r };
+    size_t num_args = 0;
+    for (IrIns *carg = call->next; carg && carg->op == IR_CARG; carg = carg->next) {
+        if (num_args == 2) {
+            return 0;
+        }
+        *args[num_args++] = resolve(g, carg->arg); // Not resolved yet
+    }
+    return call->t->k != IRT_VOID;
+}
+
+static void delete_call(IrIns *call) {
+    while (call->next && call->next->op == IR_CARG) {
+        delete_ir(call->next);
+    }
+    delete_ir(call);
+}
+
+// A store makes the stored value available to loads from the same pointer
+static void forward_store(GVN *g, IrIns *store) {
+    Expr e = { .op = IR_LOAD, .tk = store->src->t->k,
+               .size = store->src->t->size, .l = store->dst, .r = NULL,
+               .fn = NULL, .v = g->mem, .val = store->src, .next = NULL };
+    add_expr(g, &e);
+}
+
+static void number_bb(GVN *g, BB *bb) {
+    if (bb->idom && vec_len(bb->pred) == 1 && vec_get(bb->pred, 0) == bb->idom) {
+        g->mem = g->mem_out[bb->idom->rpo];
+    } else {
+        g->mem = g->next_mem++; // Anything could have happened to memory
+    }
+    IrIns *ins = bb->ir_head;
+    while (ins) {
+        IrIns *next = ins->next;
+        IrIns **oprs[3];
+        int num_oprs = ir_operands(ins, oprs);
+        for (int i = 0; i < num_oprs; i++) {
+            *oprs[i] = resolve(g, *oprs[i]);
+        }
+        if (clobbers_mem(ins)) {
+            g->mem = g->next_mem++;
+            if (ins->op == IR_STORE) {
+                forward_store(g, ins);
+            }
+        } else if (is_pure(ins) || ins->op == IR_LOAD) {
+            if (ins->op == IR_PTRADD) {
+                reassociate(g, ins);
+            } else if (ins->op == IR_BIT_AND || ins->op == IR_BIT_OR) {
+                merge_masks(g, ins, ins);
+            }
+            Expr e = to_expr(g, ins);
+            IrIns *prev = find_expr(g, &e);
+            if (prev) {
+                g->repl[ins->n] = prev;
+                delete_ir(ins);
+            } else {
+                add_expr(g, &e);
+            }
+        } else if (is_pure_call(ins)) {
+            Expr e;
+            if (call_expr(g, ins, &e)) {
+                IrIns *prev = find_expr(g, &e);
+                if (prev) {
+                    g->repl[ins->n] = prev;
+                    while (next && next->op == IR_CARG) {
+                        next = next->next;
+                    }
+                    delete_call(ins);
+                } else {
+                    add_expr(g, &e);
+                }
+            }
+        }
+        ins = next;
+    }
+    g->mem_out[bb->rpo] = g->mem;
+}
+
+typedef struct {
+    BB *bb;
+    size_t scope_len;
+    size_t next_child;
+} GVNFrame;
+
+// Walks the dominator tree iteratively (like 'rename_vars' in mem2reg),
+// dropping each BB's expressions once all the BBs it dominates are done
+static void number_dom_tree(GVN *g) {
+    size_t max_frames = 16, num_frames = 0;
+    GVNFrame *frames = malloc(sizeof(GVNFrame) * max_frames);
+    frames[num_frames++] = (GVNFrame) { g->fn->entry, 0, 0 };
+    number_bb(g, g->fn->entry);
+    while (num_frames > 0) {
+        GVNFrame *f = &frames[num_frames - 1];
+        if (f->next_child < vec_len(f->bb->dom_children)) {
+            BB *child = vec_get(f->bb->dom_children, f->next_child++);
+            if (num_frames == max_frames) {
+                max_frames *= 2;
+                frames = realloc(frames, sizeof(GVNFrame) * max_frames);
+            }
+            frames[num_frames++] = (GVNFrame) { child, vec_len(g->scope), 0 };
+            number_bb(g, child);
+        } else {
+            pop_scope(g, f->scope_len);
+            num_frames--;
+        }
+    }
+    free(frames);
+}
+
+// Phi operands come from predecessors, which might not have been numbered when
+// the phi was reached, so they're done once everything else is
+static void replace_phi_defs(GVN *g) {
+    for (BB *bb = g->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op != IR_PHI) {
+                continue;
+            }
+            for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                vec_put(ins->defs, i, resolve(g, vec_get(ins->defs, i)));
+            }
+        }
+    }
+}
+
+void gvn(Fn *fn) {
+    size_t num_ins = number_ir(fn);
+    size_t num_bbs = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        num_bbs++;
+    }
+    GVN g;
+    g.fn = fn;
+    g.repl = calloc(num_ins + 1, sizeof(IrIns *));
+    g.num_buckets = 16;
+    while (g.num_buckets < num_ins * 2) {
+        g.num_buckets *= 2;
+    }
+    g.buckets = calloc(g.num_buckets, sizeof(Expr *));
+    g.scope = vec_new();
+    g.mem = 0;
+    g.next_mem = 1;
+    g.mem_out = calloc(num_bbs, sizeof(uint64_t));
+    g.num_ins = num_ins;
+
+    number_dom_tree(&g);
+    replace_phi_defs(&g);
+    free(g.repl);
+    free(g.buckets);
+    free(g.mem_out);
+}
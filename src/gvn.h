@@ -0,0 +1,14 @@
+
+#ifndef COSEC_GVN_H
+#define COSEC_GVN_H
+
+#include "compile.h"
+
+// Global value numbering. A pure instruction computing the same operation on
+// the same operands as one that dominates it is replaced by the earlier one.
+// Loads are also reused (or replaced by the value just stored) as long as no
+// store, copy, or call could have changed memory in between. Requires
+// 'analyse'
+void gvn(Fn *fn);
+
+#endif
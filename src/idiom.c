@@ -0,0 +1,293 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "idiom.h"
+#include "analysis.h"
+#include "alias.h"
+
+// A loop is recognised if:
+//   * it's innermost and has a preheader;
+//   * its header only holds the phi for 'i', and the 'i < n' (or unsigned)
+//     that exits the loop, where 'i' goes up by 1 every iteration and 'n' is
+//     invariant;
+//   * the rest of it is a straight line of BBs back to the header;
+//   * it only stores a zero to 'dst + ext(i) * size', or a value it loads from
+//     'src + ext(i) * size', with 'size' that of the scalar stored, through
+//     invariant 'dst' and 'src' that can't overlap;
+//   * and nothing it computes is used after it.
+// Its first BB after the header is then replaced by the block operation, which
+// goes straight to the exit, so the header's test is left as a guard for the
+// range being empty:
+//   header: i = phi [pre -> start]; condbr start < n, body, exit
+//   body: off = ext(start) * size; len = (ext(n) - ext(start)) * size
+//         zero dst + off, len; br exit
+// The 'ext' is whichever the addresses use, and has to match the comparison
+// (sign extension for a signed one), so that the elements touched are the
+// contiguous range the block operation covers.
+
+typedef struct {
+    Loop *loop;
+    BB *pre, *header, *latch, *exit;
+    Vec *body;          // of 'BB *'; the BBs after the header, in order
+    IrIns *iv, *cond;
+    IrIns *store, *load; // 'load' is NULL for a zero
+    int ext;            // IR_SEXT or IR_ZEXT for a 32-bit 'i', otherwise 0
+} IdiomLoop;
+
+typedef struct {
+    int64_t *scale; // Per ins; the multiple of 'i' an address adds (0 if none)
+    int *uses;      // Per ins; number of uses in the loop
+} Idioms;
+
+
+// ---- Loop Shape ------------------------------------------------------------
+
+// The only phi in the header is the one for 'i'
+static int match_loop(IdiomLoop *l) {
+    if (!is_innermost(l->loop) || !(l->pre = find_preheader(l->loop)) ||
+            !(l->body = straight_body(l->loop))) {
+        return 0;
+    }
+    l->exit = l->header->ir_last->false;
+    l->latch = vec_tail(l->body);
+    IrIns *cond = match_loop_header(l->loop, l->latch);
+    if (!cond || l->header->ir_head->next != cond ||
+            (cond->l->t->k != IRT_I32 && cond->l->t->k != IRT_I64)) {
+        return 0;
+    }
+    l->iv = cond->l;
+    l->cond = cond;
+    if (l->iv->t->k == IRT_I32) {
+        l->ext = cond->op == IR_SLT ? IR_SEXT : IR_ZEXT;
+    }
+    return 1;
+}
+
+
+// ---- Body ------------------------------------------------------------------
+
+// The multiple of 'i' that 'v' is, or 0 if it isn't one
+static int64_t scale_of(Idioms *d, IdiomLoop *l, IrIns *v) {
+    if (v == l->iv) {
+        return l->ext ? 0 : 1; // A 32-bit 'i' has to be extended first
+    }
+    return d->scale[v->n];
+}
+
+// Addresses 'base + ext(i) * size' (or 'base + i * size' for a 64-bit 'i').
+// Returns 1 if 'ins' is part of one
+static int match_addr(Idioms *d, IdiomLoop *l, IrIns *ins) {
+    int64_t scale;
+    if (l->ext && ins->op == l->ext && ins->l == l->iv && ins->t->k == IRT_I64) {
+        scale = 1;
+    } else if (ins->op == IR_MUL && ins->r->op == IR_IMM &&
+               ins->l->op != IR_PTRADD && scale_of(d, l, ins->l)) {
+        scale = (int64_t) ins->r->imm * scale_of(d, l, ins->l);
+    } else if (ins->op == IR_PTRADD && !in_loop(ins->base->bb, l->loop) &&
+               ins->offset->op != IR_PTRADD && scale_of(d, l, ins->offset)) {
+        scale = scale_of(d, l, ins->offset);
+    } else {
+        return 0;
+    }
+    d->scale[ins->n] = scale;
+    return 1;
+}
+
+static int is_elem_addr(Idioms *d, IrIns *addr, IrType *t) {
+    return addr->op == IR_PTRADD && d->scale[addr->n] == (int64_t) t->size;
+}
+
+static int is_zero(IdiomLoop *l, IrIns *v) {
+    if (in_loop(v->bb, l->loop)) {
+        return 0;
+    }
+    return (v->op == IR_IMM && v->imm == 0) ||
+           (v->op == IR_FP && v->fp == 0.0 && !signbit(v->fp));
+}
+
+static int check_body(Idioms *d, IdiomLoop *l) {
+    IrIns *iv_next = phi_def(l->iv, l->latch);
+    for (size_t i = 0; i < vec_len(l->body); i++) {
+        BB *bb = vec_get(l->body, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_BR || ins == iv_next || match_addr(d, l, ins)) {
+                continue;
+            } else if (ins->op == IR_LOAD && !l->load && ins->t->k != IRT_VEC) {
+                l->load = ins;
+            } else if (ins->op == IR_STORE && !l->store) {
+                l->store = ins;
+            } else {
+                return 0;
+            }
+        }
+    }
+    IrIns *store = l->store, *load = l->load;
+    if (!store || d->uses[iv_next->n] != 1 || store->src->t->k == IRT_VEC ||
+            !is_elem_addr(d, store->dst, store->src->t)) {
+        return 0;
+    }
+    if (!load) {
+        return is_zero(l, store->src);
+    }
+    return store->src == load && d->uses[load->n] == 1 &&
+           is_elem_addr(d, load->src, load->t) &&
+           store->dst->base != load->src->base && !may_alias(store, load);
+}
+
+// Nothing in the loop can be used after it, since it won't be computed
+static int is_used_after(IdiomLoop *l, Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        if (in_loop(bb, l->loop)) {
+            continue;
+        }
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    IrIns *def = vec_get(ins->defs, i);
+                    if (in_loop(def->bb, l->loop)) {
+                        return 1;
+                    }
+                }
+                continue;
+            }
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                if (in_loop((*oprs[i])->bb, l->loop)) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int is_idiom(Idioms *d, IdiomLoop *l, Fn *fn) {
+    if (!match_loop(l)) {
+        return 0;
+    }
+    count_uses(l->loop, d->uses);
+    return check_body(d, l) && !is_used_after(l, fn);
+}
+
+
+// ---- Transformation --------------------------------------------------------
+
+// Folds two constants, since the block operations are only unrolled for a
+// constant size (see 'asm_zero')
+static IrIns * emit_i64(int op, IrIns *l, IrIns *r, IrIns *before) {
+    IrIns *ins;
+    if (l->op == IR_IMM && r->op == IR_IMM) {
+        ins = new_ins(IR_IMM, irt_scalar(IRT_I64));
+        ins->imm = op == IR_SUB ? l->imm - r->imm : l->imm * r->imm;
+    } else {
+        ins = new_ins(op, irt_scalar(IRT_I64));
+        ins->l = l;
+        ins->r = r;
+    }
+    insert_ir(ins, before);
+    return ins;
+}
+
+static IrIns * emit_ext(IdiomLoop *l, IrIns *v, IrIns *before) {
+    if (!l->ext) {
+        return v;
+    }
+    IrIns *ins;
+    if (v->op == IR_IMM) {
+        ins = new_ins(IR_IMM, irt_scalar(IRT_I64));
+        ins->imm = l->ext == IR_SEXT ? (uint64_t) (int64_t) (int32_t) v->imm
+                                     : (uint32_t) v->imm;
+    } else {
+        ins = new_ins(l->ext, irt_scalar(IRT_I64));
+        ins->l = v;
+    }
+    insert_ir(ins, before);
+    return ins;
+}
+
+static IrIns * emit_addr(IrIns *base, IrIns *offset, IrIns *before) {
+    IrIns *ins = new_ins(IR_PTRADD, irt_scalar(IRT_PTR));
+    ins->base = base;
+    ins->offset = offset;
+    insert_ir(ins, before);
+    return ins;
+}
+
+static IrIns * emit_imm(uint64_t imm, IrIns *before) {
+    IrIns *ins = new_ins(IR_IMM, irt_scalar(IRT_I64));
+    ins->imm = imm;
+    insert_ir(ins, before);
+    return ins;
+}
+
+static void replace_loop(IdiomLoop *l) {
+    BB *body = vec_get(l->body, 0);
+    IrIns *br = body->ir_last;
+    br->prev = NULL;
+    body->ir_head = br; // Everything else in the loop is dead
+    br->br = l->exit;
+
+    IrIns *store = l->store;
+    size_t elem = store->src->t->size;
+    IrIns *size = emit_imm(elem, br);
+    IrIns *start = emit_ext(l, phi_def(l->iv, l->pre), br);
+    IrIns *end = emit_ext(l, l->cond->r, br);
+    IrIns *offset = emit_i64(IR_MUL, start, size, br);
+    IrIns *len = emit_i64(IR_MUL, emit_i64(IR_SUB, end, start, br), size, br);
+    IrIns *dst = emit_addr(store->dst->base, offset, br);
+    if (l->load) {
+        IrIns *copy = new_ins(IR_COPY, NULL);
+        copy->dst = dst;
+        copy->src = emit_addr(l->load->src->base, offset, br);
+        copy->len = len;
+        copy->align = 0;
+        insert_ir(copy, br);
+    } else {
+        IrIns *zero = new_ins(IR_ZERO, NULL);
+        zero->ptr = dst;
+        zero->size = len;
+        insert_ir(zero, br);
+    }
+
+    size_t idx = phi_idx(l->iv, l->latch);
+    vec_remove(l->iv->preds, idx);
+    vec_remove(l->iv->defs, idx);
+    for (IrIns *phi = l->exit->ir_head; phi && phi->op == IR_PHI; phi = phi->next) {
+        vec_push(phi->preds, body);
+        vec_push(phi->defs, phi_def(phi, l->header));
+    }
+}
+
+void recognise_idioms(Fn *fn) {
+    analyse_escapes(fn);
+    size_t num_ins = number_ir(fn);
+    Idioms d;
+    d.scale = calloc(num_ins, sizeof(int64_t));
+    d.uses = calloc(num_ins, sizeof(int));
+    int changed = 0;
+    for (size_t i = 0; i < vec_len(fn->loops); i++) {
+        IdiomLoop l = { .loop = vec_get(fn->loops, i), };
+        l.header = l.loop->header;
+        memset(d.uses, 0, num_ins * sizeof(int));
+        if (is_idiom(&d, &l, fn)) {
+            replace_loop(&l);
+            changed = 1;
+        }
+        if (l.body) {
+            vec_free(l.body);
+        }
+    }
+    if (changed) {
+        analyse_cfg(fn);
+        vec_free(rev_postorder(fn));
+        remove_unreachable_bbs(fn);
+        analyse_cfg(fn);
+        analyse_dominators(fn);
+        analyse_loops(fn);
+    }
+    free(d.scale);
+    free(d.uses);
+}
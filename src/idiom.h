@@ -0,0 +1,17 @@
+
+#ifndef COSEC_IDIOM_H
+#define COSEC_IDIOM_H
+
+#include "compile.h"
+
+// Loop idiom recognition. A counted loop that only zeroes or copies an array
+// an element at a time, like
+//   for (i = start; i < n; i++) a[i] = 0;
+//   for (i = start; i < n; i++) a[i] = b[i];
+// is replaced by a single IR_ZERO or IR_COPY of the whole range, which the
+// assembler turns into SSE moves (for a small constant size) or a 'rep stos'
+// or 'rep movs'. Requires 'analyse' and 'licm' (for the preheaders), and
+// keeps 'analyse' up to date
+void recognise_idioms(Fn *fn);
+
+#endif
@@ -0,0 +1,333 @@
+#include <stdlib.h>
+
+#include "if_convert.h"
+#include "analysis.h"
+
+// A BB 'head' ending in a conditional branch is converted when the branch's
+// two paths meet again at a BB 'join' straight away, either with a BB on each
+// path (a diamond) or with one path going straight to 'join' (a triangle):
+//
+//        head            head
+//        /  \            /  |
+//     then  else      then  |
+//        \  /            \  |
+//        join            join
+//
+// The instructions on each path are moved into 'head', the phis in 'join'
+// take their values from IR_SELECTs on the branch's condition instead, and
+// 'head' branches straight to 'join'. If 'join' has no other predecessors it's
+// merged into 'head', so an enclosing branch can be converted next (e.g., for
+// the nested ternaries in a clamp).
+//
+// Both paths now run every time, so their instructions mustn't have side
+// effects or be able to fault (no loads or integer divisions), and there can
+// only be a few of them. A branch marked as likely (see '__builtin_expect') is
+// predictable anyway, so it's left alone. There's no 'cmov' for SSE
+// registers, so a floating point phi is only converted if it's the minimum or
+// maximum of the operands of the branch's comparison ('minss' or 'maxss').
+//
+// A '&&' or '||' used as a value (see 'discharge' in 'compile.c') is a chain
+// of these triangles, where each phi picks between a comparison and 0 or 1.
+// On 0 or 1 values a select is just bitwise logic ('c ? x : 0' is 'c & x',
+// and 'c ? 1 : x' is 'c | x'), so the flag ends up as a 'setcc' for each
+// comparison, combined with 'and's and 'or's.
+
+#define MAX_SPECULATED 4 // Instructions on each path, not counting constants
+#define MAX_SELECTS    4 // Per branch
+
+typedef struct {
+    Fn *fn;
+    IrIns **repl;   // Per instruction; the value replacing a redundant phi
+    size_t num_ins; // New IR_SELECTs are numbered this, so they're never in 'repl'
+} IfConv;
+
+// 'discharge' (in 'compile.c') puts its constants before the phi, so the
+// phis in a BB aren't always at its head
+static int is_speculatable(IrIns *ins) {
+    if (ins->op == IR_SDIV || ins->op == IR_UDIV || ins->op == IR_SMOD ||
+            ins->op == IR_UMOD) {
+        return 0; // Could fault
+    }
+    return is_const(ins) || ins->op == IR_PTRADD || ins->op == IR_SELECT ||
+           (ins->op >= IR_ADD && ins->op <= IR_I2FP);
+}
+
+// Whether 'bb' is a path from the branch (its only predecessor) to 'join'
+// that's cheap and safe to run unconditionally
+static int is_path(BB *bb, BB *join) {
+    IrIns *br = bb->ir_last;
+    if (vec_len(bb->pred) != 1 || !br || br->op != IR_BR || br->br != join ||
+            bb->addr_taken) {
+        return 0;
+    }
+    int cost = 0;
+    for (IrIns *ins = bb->ir_head; ins != br; ins = ins->next) {
+        if (!is_speculatable(ins)) {
+            return 0;
+        }
+        cost += !is_const(ins);
+    }
+    return cost <= MAX_SPECULATED;
+}
+
+static void remove_bb(Vec *bbs, BB *bb) {
+    for (size_t i = 0; i < vec_len(bbs); i++) {
+        if (vec_get(bbs, i) == bb) {
+            vec_remove(bbs, i);
+            return;
+        }
+    }
+}
+
+static void replace_bb(Vec *bbs, BB *from, BB *to) {
+    for (size_t i = 0; i < vec_len(bbs); i++) {
+        if (vec_get(bbs, i) == from) {
+            vec_put(bbs, i, to);
+        }
+    }
+}
+
+static void unlink_bb(Fn *fn, BB *bb) {
+    if (bb->prev) bb->prev->next = bb->next;
+    if (bb->next) bb->next->prev = bb->prev;
+    if (fn->last == bb) fn->last = bb->prev;
+}
+
+// A 'cmov' needs the value in a GPR. 'minss' (or 'maxss') computes 'l < r ? l
+// : r' (or '>'), so a floating point select has to compare its own operands
+static int can_select(IrType *t, IrIns *cond, IrIns *l, IrIns *r) {
+    switch (t->k) {
+    case IRT_I8: case IRT_I16: case IRT_I32: case IRT_I64: case IRT_PTR:
+        return 1;
+    case IRT_F32: case IRT_F64:
+        return (cond->op == IR_FLT || cond->op == IR_FGT) &&
+               ((cond->l == l && cond->r == r) || (cond->l == r && cond->r == l));
+    default:
+        return 0;
+    }
+}
+
+// Moves the instructions on a path into 'head', before its branch
+static void move_path(Fn *fn, BB *bb, IrIns *br) {
+    IrIns *ins = bb->ir_head;
+    while (ins != bb->ir_last) {
+        IrIns *next = ins->next;
+        delete_ir(ins);
+        insert_ir(ins, br);
+        ins = next;
+    }
+    unlink_bb(fn, bb);
+}
+
+// Appends the instructions in 'join' to 'head', in place of its IR_BR
+static void merge_join(Fn *fn, BB *head, BB *join) {
+    delete_ir(head->ir_last);
+    for (IrIns *ins = join->ir_head; ins; ins = ins->next) {
+        ins->bb = head;
+    }
+    join->ir_head->prev = head->ir_last;
+    if (head->ir_last) {
+        head->ir_last->next = join->ir_head;
+    } else {
+        head->ir_head = join->ir_head;
+    }
+    head->ir_last = join->ir_last;
+    for (size_t i = 0; i < vec_len(join->succ); i++) {
+        BB *succ = vec_get(join->succ, i);
+        replace_bb(succ->pred, join, head);
+        for (IrIns *phi = next_phi(succ->ir_head); phi; phi = next_phi(phi->next)) {
+            replace_bb(phi->preds, join, head);
+        }
+    }
+    vec_empty(head->succ);
+    vec_push_all(head->succ, join->succ);
+    unlink_bb(fn, join);
+}
+
+static int is_bool(IrIns *ins) {
+    switch (ins->op) {
+    case IR_IMM:
+        return ins->imm == 0 || ins->imm == 1;
+    case IR_EQ: case IR_NEQ: case IR_SLT: case IR_SLE: case IR_SGT: case IR_SGE:
+    case IR_ULT: case IR_ULE: case IR_UGT: case IR_UGE:
+    case IR_FLT: case IR_FLE: case IR_FGT: case IR_FGE:
+        return 1;
+    case IR_BIT_AND: case IR_BIT_OR: case IR_BIT_XOR:
+        return is_bool(ins->l) && is_bool(ins->r);
+    default:
+        return 0;
+    }
+}
+
+static int is_imm(IrIns *ins, uint64_t imm) {
+    return ins->op == IR_IMM && ins->imm == imm;
+}
+
+static IrIns * emit_logic(IfConv *c, IrIns *br, int op, IrIns *l, IrIns *r) {
+    IrIns *ins = new_ins(op, l->t);
+    ins->n = c->num_ins;
+    ins->l = l;
+    ins->r = r;
+    insert_ir(ins, br);
+    return ins;
+}
+
+// 'cond ? l : r' as bitwise logic, if all three are 0 or 1; NULL otherwise
+static IrIns * select_bool(IfConv *c, IrIns *br, IrIns *l, IrIns *r) {
+    IrIns *cond = br->cond;
+    if (cond->t->k != IRT_I32 || l->t->k != IRT_I32 || r->t->k != IRT_I32 ||
+            !is_bool(cond) || !is_bool(l) || !is_bool(r)) {
+        return NULL;
+    }
+    if (is_imm(l, 0) || is_imm(r, 1)) { // Needs '!cond'
+        IrIns *one = new_ins(IR_IMM, cond->t);
+        one->n = c->num_ins;
+        one->imm = 1;
+        insert_ir(one, br);
+        IrIns *not = emit_logic(c, br, IR_BIT_XOR, cond, one);
+        if (is_imm(l, 0) && is_imm(r, 1)) {
+            return not;
+        }
+        return is_imm(l, 0) ? emit_logic(c, br, IR_BIT_AND, not, r) :
+                              emit_logic(c, br, IR_BIT_OR, not, l);
+    } else if (is_imm(r, 0)) {
+        return is_imm(l, 1) ? cond : emit_logic(c, br, IR_BIT_AND, cond, l);
+    } else if (is_imm(l, 1)) {
+        return emit_logic(c, br, IR_BIT_OR, cond, r);
+    }
+    return NULL; // Two comparisons need a real select
+}
+
+static BB * find_join(BB *head, BB *then, BB *els) {
+    if (then == head || els == head || then == els) {
+        return NULL;
+    } else if (is_path(then, els)) {
+        return els; // Triangle with 'then' on the path
+    } else if (is_path(els, then)) {
+        return then;
+    } else if (then->ir_last && then->ir_last->op == IR_BR) {
+        BB *join = then->ir_last->br;
+        if (join != head && is_path(then, join) && is_path(els, join)) {
+            return join; // Diamond
+        }
+    }
+    return NULL;
+}
+
+static int convert(IfConv *c, BB *head) {
+    IrIns *br = head->ir_last;
+    if (!br || br->op != IR_CONDBR || br->likely != 0) {
+        return 0;
+    }
+    BB *then = br->true, *els = br->false;
+    BB *join = find_join(head, then, els);
+    if (!join) {
+        return 0;
+    }
+    BB *from_true = then == join ? head : then;
+    BB *from_false = els == join ? head : els;
+    IrIns *cond = br->cond;
+    int num_selects = 0;
+    for (IrIns *phi = next_phi(join->ir_head); phi; phi = next_phi(phi->next)) {
+        IrIns *l = phi_def(phi, from_true), *r = phi_def(phi, from_false);
+        if (l != r && (!can_select(phi->t, cond, l, r) ||
+                       ++num_selects > MAX_SELECTS)) {
+            return 0;
+        }
+    }
+
+    if (then != join) {
+        move_path(c->fn, then, br);
+    }
+    if (els != join) {
+        move_path(c->fn, els, br);
+    }
+    // No other way into 'join'
+    int merge = vec_len(join->pred) == 2 && !join->addr_taken;
+    IrIns *phi = next_phi(join->ir_head);
+    while (phi) {
+        IrIns *next = phi->next;
+        IrIns *l = phi_def(phi, from_true), *r = phi_def(phi, from_false);
+        IrIns *v = l == r ? l : select_bool(c, br, l, r);
+        if (merge) {
+            delete_ir(phi);
+            if (v) {
+                c->repl[phi->n] = v;
+            } else { // The phi becomes the select
+                phi->op = IR_SELECT;
+                phi->sel = cond;
+                phi->l = l;
+                phi->r = r;
+                insert_ir(phi, br);
+            }
+        } else {
+            if (!v) {
+                v = new_ins(IR_SELECT, phi->t);
+                v->n = c->num_ins;
+                v->sel = cond;
+                v->l = l;
+                v->r = r;
+                insert_ir(v, br);
+            }
+            remove_phi_def(phi, from_true);
+            remove_phi_def(phi, from_false);
+            vec_push(phi->preds, head);
+            vec_push(phi->defs, v);
+        }
+        phi = next_phi(next);
+    }
+
+    br->op = IR_BR;
+    br->br = join;
+    if (merge) {
+        merge_join(c->fn, head, join);
+    } else {
+        remove_bb(join->pred, from_true);
+        remove_bb(join->pred, from_false);
+        vec_push(join->pred, head);
+        vec_empty(head->succ);
+        vec_push(head->succ, join);
+    }
+    return 1;
+}
+
+static void replace_phis(IfConv *c) {
+    for (BB *bb = c->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                while (c->repl[(*oprs[i])->n]) {
+                    *oprs[i] = c->repl[(*oprs[i])->n];
+                }
+            }
+            for (size_t i = 0; ins->op == IR_PHI && i < vec_len(ins->defs); i++) {
+                IrIns *def = vec_get(ins->defs, i);
+                while (c->repl[def->n]) {
+                    def = c->repl[def->n];
+                }
+                vec_put(ins->defs, i, def);
+            }
+        }
+    }
+}
+
+void if_convert(Fn *fn) {
+    IfConv c;
+    c.fn = fn;
+    c.num_ins = number_ir(fn);
+    c.repl = calloc(c.num_ins + 1, sizeof(IrIns *));
+    int changed = 0;
+    for (BB *bb = fn->last; bb; bb = bb->prev) { // Inner branches usually last
+        while (convert(&c, bb)) {
+            changed = 1;
+        }
+    }
+    if (changed) {
+        replace_phis(&c);
+        analyse_cfg(fn);
+        analyse_dominators(fn);
+        analyse_loops(fn);
+    }
+    free(c.repl);
+}
@@ -0,0 +1,14 @@
+
+#ifndef COSEC_IF_CONVERT_H
+#define COSEC_IF_CONVERT_H
+
+#include "compile.h"
+
+// If-conversion. A conditional branch around a little code that only
+// computes the values of the phis where its two paths meet again (e.g., 'x <
+// y ? x : y') is replaced by an IR_SELECT for each phi, which become 'cmov's
+// (or 'minss' and 'maxss') rather than a branch that could be mispredicted.
+// Requires 'analyse', and keeps it up to date
+void if_convert(Fn *fn);
+
+#endif
@@ -0,0 +1,589 @@
+#include <stdlib.h>
+
+#include "inline.h"
+#include "profile.h"
+
+// Functions are inlined into bottom up, so a callee's body already has its
+// own calls inlined when it's copied. A callee that's still being inlined into
+// (i.e., it's part of a cycle of calls) is left as a call.
+//
+// A call is inlined by cutting its BB after the call, then branching to a
+// copy of the callee's BBs in between. The callee's IR_FARGs are replaced by
+// the call's arguments, and each IR_RET by a branch to the rest of the
+// caller's BB, where a phi merges the return values (if there are several).
+// The callee's IR_ALLOCs are moved to the caller's entry BB, so one inside a
+// loop still has a single stack slot.
+//
+// The cost of inlining is the number of instructions in the callee, not
+// counting the IR_FARGs and IR_ALLOCs, which disappear. Small callees are
+// inlined everywhere; larger ones only if there's one call to them (and the
+// function itself is then dropped). Callers stop growing past a limit. A
+// callee declared 'always_inline' is inlined wherever it can be, whatever its
+// size or linkage, and one declared 'noinline' never is.
+//
+// With a profile ('-fprofile-use'), larger callees are inlined at calls that
+// are hot, and only callees with a single call (which doesn't grow the
+// program) at calls that never ran. The copy's BBs get the callee's counts,
+// scaled to the number of times the call was made.
+
+#define MAX_INLINE_SIZE 32    // For a callee to be inlined anywhere
+#define MAX_HOT_INLINE_SIZE 128 // For a callee at a hot call
+#define MAX_CALLED_ONCE 400   // For a callee with a single call
+#define MAX_CALLER_SIZE 4000  // Beyond which nothing more is inlined into it
+
+enum { NOT_VISITED, VISITING, DONE };
+
+typedef struct {
+    Global *g;
+    int state;
+    size_t size;
+    size_t num_calls; // Direct calls to it from anywhere
+    int addr_taken;   // Referenced other than as the target of a call
+} FnInfo;
+
+// 'fns' is of 'FnInfo *', by interned label (a declaration before the
+// definition is a different 'Global')
+static FnInfo * fn_info(Map *fns, Global *g) {
+    return map_get(fns, intern(g->label));
+}
+
+// The definition a call goes to, if it's direct and to this file
+static FnInfo * callee_of(Map *fns, IrIns *call) {
+    if (call->fn->op != IR_GLOBAL) {
+        return NULL;
+    }
+    return fn_info(fns, call->fn->g);
+}
+
+static size_t fn_size(Fn *fn) {
+    size_t size = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op != IR_FARG && ins->op != IR_ALLOC) {
+                size++;
+            }
+        }
+    }
+    return size;
+}
+
+
+// ---- References ------------------------------------------------------------
+
+static void count_ref(Map *fns, Global *g, int is_call) {
+    FnInfo *info = fn_info(fns, g);
+    if (!info) {
+        return; // Not a function defined in this file
+    } else if (is_call) {
+        info->num_calls++;
+    } else {
+        info->addr_taken = 1;
+    }
+}
+
+static void count_refs_in_fn(Map *fns, Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                IrIns *opr = *oprs[i];
+                if (opr->op == IR_GLOBAL) {
+                    count_ref(fns, opr->g, ins->op == IR_CALL && oprs[i] == &ins->fn);
+                }
+            }
+            if (ins->op != IR_PHI) {
+                continue;
+            }
+            for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                IrIns *def = vec_get(ins->defs, i);
+                if (def->op == IR_GLOBAL) {
+                    count_ref(fns, def->g, 0);
+                }
+            }
+        }
+    }
+}
+
+static void count_refs(Map *fns, Vec *globals) {
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        FnInfo *info = fn_info(fns, g);
+        if (info && info->g == g) {
+            info->num_calls = 0;
+            info->addr_taken = 0;
+        }
+    }
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        switch (g->k) {
+        case G_FN_DEF: count_refs_in_fn(fns, g->fn); break;
+        case G_PTR:    count_ref(fns, g->g, 0); break;
+        case G_INIT:
+            for (size_t j = 0; j < vec_len(g->relocs); j++) {
+                InitReloc *r = vec_get(g->relocs, j);
+                count_ref(fns, r->g, 0);
+            }
+            break;
+        default: break;
+        }
+    }
+}
+
+
+// ---- Devirtualisation ------------------------------------------------------
+
+// A call through a function pointer whose value is already known is made
+// direct first, so it can be inlined: one loaded from a 'const' table (see
+// 'const_ptr_at') at a constant offset, or from a local variable that's only
+// ever assigned one value (a load before the assignment would read an
+// uninitialised value, which is undefined). 'sccp' finds the rest, once
+// they're in SSA form, but only after inlining's done
+
+#define MAX_RESOLVE_DEPTH 4 // Locals assigned from locals, etc.
+
+typedef struct {
+    IrIns **stored; // Per ins; for an IR_ALLOC, the only value it's assigned
+    int *escapes;   // Per ins; for an IR_ALLOC, used other than by loads and
+                    // stores to it, or assigned more than once
+} Devirt;
+
+static uint64_t sext_imm(uint64_t v, size_t size) {
+    int shift = 64 - (int) size * 8;
+    return size >= 8 ? v : (uint64_t) ((int64_t) (v << shift) >> shift);
+}
+
+// Whether 'ins' is a constant integer (the offsets into a table aren't folded
+// until 'sccp')
+static int const_int(IrIns *ins, int64_t *out) {
+    int64_t l, r;
+    switch (ins->op) {
+    case IR_IMM: *out = (int64_t) sext_imm(ins->imm, ins->t->size); return 1;
+    case IR_SEXT: return const_int(ins->l, out);
+    case IR_ADD: case IR_MUL: case IR_SHL:
+        if (!const_int(ins->l, &l) || !const_int(ins->r, &r) ||
+                (ins->op == IR_SHL && (r < 0 || r >= 64))) {
+            return 0;
+        }
+        *out = (int64_t) (ins->op == IR_ADD ? (uint64_t) l + (uint64_t) r :
+                          ins->op == IR_MUL ? (uint64_t) l * (uint64_t) r :
+                                              (uint64_t) l << r);
+        *out = (int64_t) sext_imm((uint64_t) *out, ins->t->size);
+        return 1;
+    default: return 0;
+    }
+}
+
+static Global * resolve_ptr(Devirt *d, IrIns *ptr, int depth) {
+    if (depth > MAX_RESOLVE_DEPTH) {
+        return NULL;
+    } else if (ptr->op == IR_GLOBAL) {
+        return ptr->g;
+    } else if (ptr->op != IR_LOAD) {
+        return NULL;
+    }
+    IrIns *src = ptr->src;
+    if (src->op == IR_ALLOC) {
+        IrIns *stored = d->stored[src->n];
+        return stored && !d->escapes[src->n] ? resolve_ptr(d, stored, depth + 1) : NULL;
+    }
+    int64_t offset = 0;
+    while (src->op == IR_PTRADD || (src->op == IR_BITCAST && src->l->t->k == IRT_PTR)) {
+        int64_t n;
+        if (src->op == IR_BITCAST) {
+            src = src->l;
+            continue;
+        } else if (!const_int(src->offset, &n)) {
+            return NULL;
+        }
+        offset += n;
+        src = src->base;
+    }
+    return src->op == IR_GLOBAL ? const_ptr_at(src->g, offset, ptr->t->size) : NULL;
+}
+
+static void find_stored(Devirt *d, Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                IrIns *alloc = *oprs[i];
+                if (alloc->op != IR_ALLOC || (ins->op == IR_LOAD && oprs[i] == &ins->src)) {
+                    continue;
+                } else if (ins->op == IR_STORE && oprs[i] == &ins->dst && !alloc->count &&
+                           !d->stored[alloc->n]) {
+                    d->stored[alloc->n] = ins->src;
+                } else {
+                    d->escapes[alloc->n] = 1;
+                }
+            }
+            for (size_t i = 0; ins->op == IR_PHI && i < vec_len(ins->defs); i++) {
+                IrIns *def = vec_get(ins->defs, i);
+                if (def->op == IR_ALLOC) {
+                    d->escapes[def->n] = 1;
+                }
+            }
+        }
+    }
+}
+
+static void devirtualise(Fn *fn) {
+    size_t num_ins = number_ir(fn);
+    Devirt d;
+    d.stored = calloc(num_ins, sizeof(IrIns *));
+    d.escapes = calloc(num_ins, sizeof(int));
+    find_stored(&d, fn);
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op != IR_CALL || ins->fn->op == IR_GLOBAL) {
+                continue;
+            }
+            Global *target = resolve_ptr(&d, ins->fn, 0);
+            if (target) {
+                IrIns *g = new_ins(IR_GLOBAL, irt_scalar(IRT_PTR));
+                g->g = target;
+                insert_ir(g, ins);
+                ins->fn = g;
+            }
+        }
+    }
+    free(d.stored);
+    free(d.escapes);
+}
+
+
+// ---- Inlining a Call -------------------------------------------------------
+
+static void replace_phi_preds(BB *bb, BB *from, BB *to) {
+    for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+        if (ins->op != IR_PHI) {
+            continue;
+        }
+        for (size_t i = 0; i < vec_len(ins->preds); i++) {
+            if (vec_get(ins->preds, i) == from) {
+                vec_put(ins->preds, i, to);
+            }
+        }
+    }
+}
+
+// Moves everything after 'last' into a new BB that follows it
+static BB * split_bb(Fn *fn, IrIns *last) {
+    BB *bb = last->bb, *rest = new_bb();
+    rest->freq = bb->freq;
+    insert_bb_after(fn, rest, bb);
+    rest->ir_head = last->next;
+    rest->ir_last = bb->ir_last;
+    for (IrIns *ins = rest->ir_head; ins; ins = ins->next) {
+        ins->bb = rest;
+    }
+    rest->ir_head->prev = NULL;
+    last->next = NULL;
+    bb->ir_last = last;
+
+    IrIns *br = rest->ir_last; // Phis in its successors now come from 'rest'
+    if (br->op == IR_BR) {
+        replace_phi_preds(br->br, bb, rest);
+    } else if (br->op == IR_CONDBR) {
+        replace_phi_preds(br->true, bb, rest);
+        replace_phi_preds(br->false, bb, rest);
+    } else if (br->op == IR_SWITCH) {
+        replace_phi_preds(br->default_br, bb, rest);
+        for (size_t i = 0; i < vec_len(br->table); i++) {
+            replace_phi_preds(vec_get(br->table, i), bb, rest);
+        }
+    } else if (br->op == IR_INDIRECT_BR) {
+        for (size_t i = 0; i < vec_len(br->targets); i++) {
+            replace_phi_preds(vec_get(br->targets, i), bb, rest);
+        }
+    }
+    return rest;
+}
+
+static IrIns * zero_of(IrType *t) { // For an IR_RET without a value
+    IrIns *zero = new_ins(t->k == IRT_F32 || t->k == IRT_F64 ? IR_FP : IR_IMM, t);
+    zero->imm = 0;
+    zero->fp = 0.0;
+    return zero;
+}
+
+// The count for the copy of 'b' made at a call in 'site'
+static int64_t scale_freq(BB *b, Fn *callee, BB *site) {
+    if (site->freq == 0) {
+        return 0;
+    }
+    int64_t entry = callee->entry->freq;
+    if (site->freq < 0 || b->freq < 0 || entry <= 0) {
+        return -1;
+    }
+    return (int64_t) ((double) b->freq * (double) site->freq / (double) entry);
+}
+
+static int is_scalar(IrType *t) {
+    return t->k != IRT_ARR && t->k != IRT_STRUCT;
+}
+
+// Whether the call's arguments and result line up with the callee's
+static int can_inline_call(IrIns *call, Fn *callee) {
+    size_t num_args = 0;
+    for (IrIns *carg = call->next; carg && carg->op == IR_CARG; carg = carg->next) {
+        num_args++;
+    }
+    if (!is_scalar(call->t)) {
+        return 0;
+    }
+    for (BB *bb = callee->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_FARG) {
+                if (ins->arg_idx >= num_args) {
+                    return 0;
+                }
+                IrIns *carg = call->next;
+                for (size_t i = 0; i < ins->arg_idx; i++) {
+                    carg = carg->next;
+                }
+                if (carg->arg->t->k != ins->t->k) {
+                    return 0;
+                }
+            } else if (ins->op == IR_ALLOC && ins->count) {
+                return 0; // Variable length array
+            } else if (ins->op == IR_BB_ADDR) {
+                return 0; // A label's address has to stay in its function
+            } else if (ins->op == IR_RET && ins->ret && call->t->k != IRT_VOID &&
+                       ins->ret->t->k != call->t->k) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Returns the rest of the call's BB, after the copy
+static BB * inline_call(Fn *caller, IrIns *call, Fn *callee) {
+    IrIns *last_carg = call;
+    Vec *args = vec_new();
+    while (last_carg->next && last_carg->next->op == IR_CARG) {
+        last_carg = last_carg->next;
+        vec_push(args, last_carg->arg);
+    }
+    BB *bb = call->bb;
+    BB *rest = split_bb(caller, last_carg);
+
+    // Copy the BBs, and instructions without their operands (which might be
+    // defined later on)
+    size_t num_ins = number_ir(callee), num_bbs = 0;
+    for (BB *b = callee->entry; b; b = b->next) {
+        b->n = num_bbs++;
+    }
+    IrIns **map = calloc(num_ins, sizeof(IrIns *));
+    BB **bb_map = malloc(sizeof(BB *) * num_bbs);
+    BB *prev = bb;
+    for (BB *b = callee->entry; b; b = b->next) {
+        bb_map[b->n] = new_bb();
+        bb_map[b->n]->unroll = b->unroll;
+        bb_map[b->n]->freq = scale_freq(b, callee, bb);
+        insert_bb_after(caller, bb_map[b->n], prev);
+        prev = bb_map[b->n];
+    }
+    IrIns *allocs_before = caller->entry->ir_head;
+    while (allocs_before && allocs_before->op == IR_FARG) {
+        allocs_before = allocs_before->next;
+    }
+    for (BB *b = callee->entry; b; b = b->next) {
+        for (IrIns *ins = b->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_FARG) {
+                map[ins->n] = vec_get(args, ins->arg_idx);
+                continue;
+            }
+            IrIns *copy = new_ins(ins->op, ins->t);
+            *copy = *ins;
+            copy->line = call->line; // The callee's lines are from its own file
+            copy->users = NULL;
+            map[ins->n] = copy;
+            if (ins->op == IR_ALLOC && allocs_before) {
+                insert_ir(copy, allocs_before);
+            } else {
+                append_ir(bb_map[b->n], copy);
+            }
+        }
+    }
+
+    // Point the copies' operands at the other copies, and return to 'rest'
+    IrIns *result = NULL;
+    if (call->t->k != IRT_VOID) {
+        result = new_ins(IR_PHI, call->t);
+        insert_ir(result, rest->ir_head);
+    }
+    for (BB *b = callee->entry; b; b = b->next) {
+        for (IrIns *ins = b->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_FARG) {
+                continue;
+            }
+            IrIns *copy = map[ins->n];
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(copy, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                *oprs[i] = map[(*oprs[i])->n];
+                add_user(*oprs[i], copy);
+            }
+            switch (copy->op) {
+            case IR_PHI:
+                copy->preds = vec_new();
+                copy->defs = vec_new();
+                for (size_t i = 0; i < vec_len(ins->preds); i++) {
+                    BB *pred = vec_get(ins->preds, i);
+                    IrIns *def = vec_get(ins->defs, i);
+                    vec_push(copy->preds, bb_map[pred->n]);
+                    vec_push(copy->defs, map[def->n]);
+                    add_user(map[def->n], copy);
+                }
+                break;
+            case IR_BR: copy->br = bb_map[ins->br->n]; break;
+            case IR_CONDBR:
+                copy->true = bb_map[ins->true->n];
+                copy->false = bb_map[ins->false->n];
+                copy->true_chain = vec_new();
+                copy->false_chain = vec_new();
+                break;
+            case IR_SWITCH:
+                copy->default_br = bb_map[ins->default_br->n];
+                copy->table = vec_new();
+                for (size_t i = 0; i < vec_len(ins->table); i++) {
+                    BB *target = vec_get(ins->table, i);
+                    vec_push(copy->table, bb_map[target->n]);
+                }
+                break;
+            case IR_RET:
+                if (result) {
+                    IrIns *v = copy->ret;
+                    if (!v) { // Fell off the end of a non-void function
+                        v = zero_of(call->t);
+                        insert_ir(v, copy);
+                    }
+                    vec_push(result->preds, copy->bb);
+                    vec_push(result->defs, v);
+                    add_user(v, result);
+                }
+                copy->op = IR_BR;
+                copy->br = rest;
+                break;
+            default: break;
+            }
+        }
+    }
+
+    // Branch to the copy instead of calling the callee
+    if (result) {
+        replace_all_uses(call, result);
+    }
+    while (call->next) {
+        vec_free(call->next->users);
+        delete_ir(call->next); // IR_CARGs
+    }
+    vec_free(call->users);
+    delete_ir(call);
+    IrIns *br = new_ins(IR_BR, NULL);
+    br->br = bb_map[callee->entry->n];
+    append_ir(bb, br);
+    free(map);
+    free(bb_map);
+    return rest;
+}
+
+
+// ---- Inliner ---------------------------------------------------------------
+
+// 'always_inline' and 'noinline' override the heuristics
+static int should_inline(FnInfo *caller, FnInfo *callee, BB *site) {
+    int attrs = callee->g->fn_attrs;
+    if (callee->state != DONE || (attrs & FA_NOINLINE)) {
+        return 0;
+    } else if (attrs & FA_ALWAYS_INLINE) {
+        return 1;
+    } else if (callee->g->linkage != LINK_STATIC ||
+               caller->size + callee->size > MAX_CALLER_SIZE) {
+        return 0;
+    }
+    if (callee->num_calls == 1 && !callee->addr_taken &&
+            callee->size <= MAX_CALLED_ONCE) {
+        return 1;
+    } else if (is_cold(site)) {
+        return 0;
+    } else if (is_hot(caller->g->fn, site)) {
+        return callee->size <= MAX_HOT_INLINE_SIZE;
+    }
+    return callee->size <= MAX_INLINE_SIZE;
+}
+
+static void inline_into(Map *fns, FnInfo *caller) {
+    caller->state = VISITING;
+    Fn *fn = caller->g->fn;
+    find_def_use(fn); // For each call's result
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            FnInfo *callee;
+            if (ins->op != IR_CALL || !(callee = callee_of(fns, ins))) {
+                continue;
+            }
+            if (callee->state == NOT_VISITED) {
+                inline_into(fns, callee);
+            }
+            if (!should_inline(caller, callee, bb) || !can_inline_call(ins, callee->g->fn)) {
+                continue;
+            }
+            BB *rest = inline_call(fn, ins, callee->g->fn);
+            caller->size += callee->size;
+            callee->num_calls--;
+            bb = rest->prev; // Carry on from after the copy
+            break;
+        }
+    }
+    free_def_use(fn);
+    caller->size = fn_size(fn);
+    caller->state = DONE;
+}
+
+// A 'static' function that nothing refers to any more (other than itself, or
+// other such functions) doesn't need to be emitted
+static void remove_unused(Map *fns, Vec *globals) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        count_refs(fns, globals);
+        for (size_t i = 0; i < vec_len(globals); i++) {
+            Global *g = vec_get(globals, i);
+            FnInfo *info = fn_info(fns, g);
+            if (!info || info->g != g || g->linkage != LINK_STATIC ||
+                    info->num_calls > 0 || info->addr_taken) {
+                continue;
+            }
+            vec_remove(globals, i--);
+            map_remove(fns, intern(g->label));
+            changed = 1;
+        }
+    }
+}
+
+void inline_fns(Vec *globals) {
+    Map *fns = map_new();
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k == G_FN_DEF) {
+            devirtualise(g->fn);
+            FnInfo *info = calloc(1, sizeof(FnInfo));
+            info->g = g;
+            info->size = fn_size(g->fn);
+            map_put(fns, intern(g->label), info);
+        }
+    }
+    count_refs(fns, globals);
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        FnInfo *info = fn_info(fns, g);
+        if (info && info->g == g && info->state == NOT_VISITED) {
+            inline_into(fns, info);
+        }
+    }
+    remove_unused(fns, globals);
+}
@@ -0,0 +1,16 @@
+
+#ifndef COSEC_INLINE_H
+#define COSEC_INLINE_H
+
+#include "compile.h"
+
+// Inlining. Replaces direct calls to small 'static' functions (and to ones
+// called from only one place) with a copy of the callee's body, then drops
+// the 'static' functions nothing refers to any more. Runs straight after
+// 'compile', before 'mem2reg', so the callee's arguments and locals are still
+// stack allocations, which 'mem2reg' then promotes in the caller. A call
+// through a function pointer that can only be one function is made direct
+// first, so it can be inlined too
+void inline_fns(Vec *globals);
+
+#endif
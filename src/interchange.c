@@ -0,0 +1,509 @@
+#include <stdlib.h>
+
+#include "interchange.h"
+#include "analysis.h"
+#include "alias.h"
+#include "licm.h"
+
+// A pair of loops is interchanged if:
+//   * the inner loop is innermost, and the only loop in the outer one;
+//   * both headers hold phis, then 'i < n' (or unsigned) that exits the
+//     loop, where 'i' is a 32-bit int that goes up by 1 every iteration, and
+//     both 'n' and where 'i' starts are invariant in the outer loop (so the
+//     nest is rectangular);
+//   * the inner loop's preheader (between the two headers) only computes
+//     values for the inner loop, and the way back from the inner loop's exit
+//     to the outer header only steps the outer induction variable;
+//   * each of the headers' other phis is half of a reduction (e.g., 'sum +=
+//     x' as 'so = phi [pre -> 0] [outer latch -> si]' and 'si = phi [inner
+//     pre -> so] [inner latch -> si + x]'), whose order doesn't matter;
+//   * and there are no calls, and every store only overlaps with accesses
+//     at the same address, 'base + i * si + j * sj + k' (see 'affine'),
+//     which two different iterations can only share if one of 'si' or 'sj'
+//     is 0 (so one loop keeps the order of its iterations) or if neither
+//     loop runs far enough to cover the other's stride.
+//
+// The CFG stays as it is. The loops swap the starts, limits and comparisons
+// of their induction variables, and the uses of one variable inside the
+// nest become uses of the other. What was computed in the inner loop's
+// preheader now depends on the inner loop's variable, so it moves into the
+// inner loop's body; 'licm' then hoists whatever's invariant in the new
+// inner loop back out.
+
+typedef struct {
+    Loop *outer, *inner;
+    BB *pre;                // Outer loop's preheader
+    BB *oh, *ol;            // Outer header and latch
+    BB *ih, *ib, *il;       // Inner header, first BB of its body, and latch
+    BB *ip;                 // Inner loop's preheader
+    IrIns *o_iv, *o_cond, *o_next;
+    IrIns *i_iv, *i_cond, *i_next;
+    Vec *accesses;          // of 'IrIns *'; loads and stores in the nest
+} Nest;
+
+// An address (or offset) as 'base + inv + o * outer_iv + i * inner_iv + k',
+// where 'base' and 'inv' are invariant in the nest (NULL if there isn't one)
+typedef struct {
+    IrIns *base, *inv;
+    int64_t o, i, k;
+} Affine;
+
+#define MAX_COEFF ((int64_t) 1 << 31) // Keeps products of them in 64 bits
+
+static int is_fp(IrType *t) {
+    return t->k == IRT_F32 || t->k == IRT_F64;
+}
+
+
+// ---- Nest Shape ------------------------------------------------------------
+
+// The single predecessor of 'loop's header inside the loop
+static BB * find_latch(Loop *loop) {
+    BB *latch = NULL;
+    for (size_t i = 0; i < vec_len(loop->header->pred); i++) {
+        BB *pred = vec_get(loop->header->pred, i);
+        if (in_loop(pred, loop)) {
+            if (latch) return NULL;
+            latch = pred;
+        }
+    }
+    return latch;
+}
+
+// The header's 'i < n' branches into the loop, and 'i' starts (and 'n' is)
+// invariant in the outer loop too
+static int match_header(Nest *n, Loop *loop, BB *pre, BB *latch,
+                        IrIns **iv, IrIns **cond, IrIns **next) {
+    *cond = match_loop_header(loop, latch);
+    if (!*cond) {
+        return 0;
+    }
+    IrIns *br = loop->header->ir_last;
+    *iv = (*cond)->l;
+    *next = phi_def(*iv, latch);
+    return in_loop(br->true, loop) && !in_loop(br->false, loop) &&
+           (*iv)->t->k == IRT_I32 && !in_loop((*cond)->r->bb, n->outer) &&
+           !in_loop(phi_def(*iv, pre)->bb, n->outer);
+}
+
+// The inner loop's preheader only computes values, and loads them (it runs
+// on every iteration of the outer loop, so moving it into the inner loop's
+// body only ever runs it less)
+static int check_inner_pre(Nest *n) {
+    BB *ip = n->ip;
+    if (vec_len(ip->pred) != 1 || vec_get(ip->pred, 0) != n->oh ||
+            n->oh->ir_last->true != ip) {
+        return 0;
+    }
+    for (IrIns *ins = ip->ir_head; ins != ip->ir_last; ins = ins->next) {
+        if (!is_pure(ins) && ins->op != IR_LOAD) {
+            return 0;
+        }
+        if (ins->op == IR_LOAD) {
+            vec_push(n->accesses, ins);
+        }
+    }
+    for (IrIns *phi = n->ih->ir_head; phi->op == IR_PHI; phi = phi->next) {
+        if (phi_def(phi, ip)->bb == ip) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// The inner loop's only way out is through its header, and there's nothing
+// in it that has to run in order other than loads and stores
+static int check_inner_body(Nest *n) {
+    for (size_t i = 0; i < vec_len(n->inner->bbs); i++) {
+        BB *bb = vec_get(n->inner->bbs, i);
+        if (bb == n->ih) {
+            continue;
+        }
+        for (size_t j = 0; j < vec_len(bb->succ); j++) {
+            if (!in_loop(vec_get(bb->succ, j), n->inner)) {
+                return 0;
+            }
+        }
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_LOAD || ins->op == IR_STORE) {
+                vec_push(n->accesses, ins);
+            } else if (!is_pure(ins) && ins->op != IR_PHI && ins->op != IR_BR &&
+                       ins->op != IR_CONDBR) {
+                return 0;
+            }
+        }
+    }
+    n->ib = n->ih->ir_last->true;
+    return 1;
+}
+
+// From the inner loop's exit back round to the outer header, there's only a
+// straight line of BBs that step the outer induction variable
+static int check_outer_tail(Nest *n) {
+    size_t num_bbs = 2 + vec_len(n->inner->bbs); // Headers, inner preheader
+    BB *bb = n->ih->ir_last->false;
+    while (1) {
+        if (!in_loop(bb, n->outer) || vec_len(bb->pred) != 1 ||
+                bb->ir_last->op != IR_BR) {
+            return 0;
+        }
+        for (IrIns *ins = bb->ir_head; ins != bb->ir_last; ins = ins->next) {
+            if (ins->op != IR_IMM && ins != n->o_next) {
+                return 0;
+            }
+        }
+        num_bbs++;
+        if (bb == n->ol) {
+            break;
+        }
+        bb = bb->ir_last->br;
+    }
+    return n->o_next->bb->loop == n->outer && num_bbs == vec_len(n->outer->bbs);
+}
+
+static int match_nest(Nest *n) {
+    Loop *inner = n->inner, *outer = n->outer;
+    for (size_t i = 0; i < vec_len(outer->bbs); i++) {
+        BB *bb = vec_get(outer->bbs, i);
+        if (bb->loop != outer && bb->loop != inner) {
+            return 0; // Another loop in the outer one, or one in the inner one
+        }
+    }
+    n->oh = outer->header;
+    n->ih = inner->header;
+    if (!(n->pre = find_preheader(outer)) || !(n->ip = find_preheader(inner)) ||
+            !(n->ol = find_latch(outer)) || !(n->il = find_latch(inner)) ||
+            n->ol->ir_last->op != IR_BR || n->il->ir_last->op != IR_BR) {
+        return 0;
+    }
+    return match_header(n, outer, n->pre, n->ol, &n->o_iv, &n->o_cond, &n->o_next) &&
+           match_header(n, inner, n->ip, n->il, &n->i_iv, &n->i_cond, &n->i_next) &&
+           check_inner_pre(n) && check_inner_body(n) && check_outer_tail(n);
+}
+
+
+// ---- Uses ------------------------------------------------------------------
+
+static int only_used_by(IrIns *def, IrIns *a, IrIns *b) {
+    for (size_t i = 0; i < vec_len(def->users); i++) {
+        IrIns *user = vec_get(def->users, i);
+        if (user != a && user != b) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// An induction variable is only used by its step, its comparison, and
+// instructions in the inner loop's preheader or body (which are renamed)
+static int check_iv_uses(Nest *n, IrIns *iv, IrIns *cond, IrIns *next) {
+    for (size_t i = 0; i < vec_len(iv->users); i++) {
+        IrIns *user = vec_get(iv->users, i);
+        if (user != cond && user != next && user->bb != n->ip &&
+                (!in_loop(user->bb, n->inner) || user->bb == n->ih)) {
+            return 0;
+        }
+    }
+    return only_used_by(next, iv, NULL) && only_used_by(cond, cond->bb->ir_last, NULL);
+}
+
+static int is_reduction_op(int op, IrType *t) {
+    if (is_fp(t)) {
+        return ASSOCIATIVE_MATH && (op == IR_ADD || op == IR_MUL);
+    }
+    return op == IR_ADD || op == IR_MUL || op == IR_BIT_AND || op == IR_BIT_OR ||
+           op == IR_BIT_XOR;
+}
+
+// 'outer' is the outer header's half of a reduction, whose value comes back
+// round from the inner header's half
+static int match_reduction(Nest *n, IrIns *outer) {
+    IrIns *inner = phi_def(outer, n->ol);
+    if (inner->op != IR_PHI || inner->bb != n->ih || inner == n->i_iv ||
+            phi_def(inner, n->ip) != outer) {
+        return 0;
+    }
+    IrIns *upd = phi_def(inner, n->il);
+    if (!is_reduction_op(upd->op, upd->t) || !in_loop(upd->bb, n->inner) ||
+            upd->bb == n->ih || (upd->l == inner) == (upd->r == inner) ||
+            !only_used_by(inner, upd, outer) || !only_used_by(upd, inner, NULL)) {
+        return 0;
+    }
+    for (size_t i = 0; i < vec_len(outer->users); i++) {
+        IrIns *user = vec_get(outer->users, i);
+        if (user != inner && in_loop(user->bb, n->outer)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int check_phis(Nest *n) {
+    size_t num_outer = 0, num_inner = 0;
+    for (IrIns *phi = n->oh->ir_head; phi->op == IR_PHI; phi = phi->next) {
+        if (phi != n->o_iv) {
+            if (!match_reduction(n, phi)) return 0;
+            num_outer++;
+        }
+    }
+    for (IrIns *phi = n->ih->ir_head; phi->op == IR_PHI; phi = phi->next) {
+        num_inner += phi != n->i_iv;
+    }
+    return num_outer == num_inner && // Every inner phi is some reduction's
+           check_iv_uses(n, n->o_iv, n->o_cond, n->o_next) &&
+           check_iv_uses(n, n->i_iv, n->i_cond, n->i_next);
+}
+
+
+// ---- Dependences -----------------------------------------------------------
+
+static int add_affine(Affine *a, Affine b, int64_t sign) {
+    if ((a->base && b.base) || (a->inv && b.inv) || (b.inv && sign < 0)) {
+        return 0;
+    }
+    if (b.base) a->base = b.base;
+    if (b.inv) a->inv = b.inv;
+    a->o += sign * b.o;
+    a->i += sign * b.i;
+    a->k += sign * b.k;
+    return 1;
+}
+
+static int fits(int64_t v) {
+    return v > -MAX_COEFF && v < MAX_COEFF;
+}
+
+static int scale_affine(Affine *a, int64_t c) {
+    if (a->inv || !fits(c) || !fits(a->o) || !fits(a->i) || !fits(a->k)) {
+        return 0;
+    }
+    a->o *= c;
+    a->i *= c;
+    a->k *= c;
+    return 1;
+}
+
+static int64_t imm_val(IrIns *imm) {
+    return imm->t->size >= 8 ? (int64_t) imm->imm :
+        (int64_t) (imm->imm << (64 - imm->t->size * 8)) >> (64 - imm->t->size * 8);
+}
+
+// Breaks down an address or offset computed in the nest. Returns 0 if it's
+// not made of the pieces in 'Affine'
+static int affine(Nest *n, IrIns *ins, Affine *a) {
+    *a = (Affine) { 0 };
+    if (ins->op == IR_IMM) {
+        a->k = imm_val(ins);
+        return fits(a->k);
+    }
+    if (!in_loop(ins->bb, n->outer)) {
+        if (ins->t->k == IRT_PTR) a->base = ins; else a->inv = ins;
+        return 1;
+    }
+    Affine b;
+    switch (ins->op) {
+    case IR_PTRADD:
+        return affine(n, ins->base, a) && affine(n, ins->offset, &b) &&
+               !b.base && add_affine(a, b, 1);
+    case IR_ADD: case IR_SUB:
+        return affine(n, ins->l, a) && affine(n, ins->r, &b) &&
+               add_affine(a, b, ins->op == IR_ADD ? 1 : -1);
+    case IR_MUL:
+        if (ins->r->op == IR_IMM) {
+            return affine(n, ins->l, a) && scale_affine(a, imm_val(ins->r));
+        } else if (ins->l->op == IR_IMM) {
+            return affine(n, ins->r, a) && scale_affine(a, imm_val(ins->l));
+        }
+        return 0;
+    case IR_SHL:
+        return ins->r->op == IR_IMM && ins->r->imm < 31 && affine(n, ins->l, a) &&
+               scale_affine(a, (int64_t) 1 << ins->r->imm);
+    case IR_SEXT: case IR_ZEXT: {
+        // The induction variables only run between their start and limit,
+        // so extending them the same way they're compared doesn't wrap
+        IrIns *iv = ins->l;
+        if (iv != n->o_iv && iv != n->i_iv) return 0;
+        IrIns *cond = iv == n->o_iv ? n->o_cond : n->i_cond;
+        if ((ins->op == IR_SEXT) != (cond->op == IR_SLT)) return 0;
+        if (iv == n->o_iv) a->o = 1; else a->i = 1;
+        return 1;
+    }
+    default:
+        return 0;
+    }
+}
+
+static IrIns * access_ptr(IrIns *access) {
+    return access->op == IR_LOAD ? access->src : access->dst;
+}
+
+static size_t access_size(IrIns *access) {
+    return access->op == IR_LOAD ? access->t->size : access->src->t->size;
+}
+
+static int same_affine(Affine *a, Affine *b) {
+    return a->base == b->base && a->inv == b->inv && a->o == b->o &&
+           a->i == b->i && a->k == b->k;
+}
+
+// Iterations of a loop, if its start and limit are constant; otherwise -1
+static int64_t trip_count(IrIns *iv, IrIns *cond, BB *pre) {
+    IrIns *start = phi_def(iv, pre), *lim = cond->r;
+    if (start->op != IR_IMM || lim->op != IR_IMM) {
+        return -1;
+    }
+    int64_t trip = cond->op == IR_SLT ?
+        (int64_t) (int32_t) lim->imm - (int64_t) (int32_t) start->imm :
+        (int64_t) (uint32_t) lim->imm - (int64_t) (uint32_t) start->imm;
+    return trip > 0 ? trip : 0;
+}
+
+static int64_t abs64(int64_t v) {
+    return v < 0 ? -v : v;
+}
+
+// Whether a stride of 'a' over 'trip' iterations stays short of 'b'
+static int stays_within(int64_t a, int64_t trip, int64_t b) {
+    return trip >= 0 && trip < MAX_COEFF && abs64(a) * (trip > 0 ? trip - 1 : 0) < abs64(b);
+}
+
+// Two different iterations can only access the same address if one of the
+// strides is 0 (then only iterations of the other loop share it, and they
+// stay in order), or if a whole run of one loop doesn't reach the other's
+// stride
+static int is_separable(Nest *n, Affine *a) {
+    if (a->o == 0 && a->i == 0) {
+        return 0; // Every iteration accesses it
+    }
+    if (a->o == 0 || a->i == 0) {
+        return 1;
+    }
+    int64_t o_trip = trip_count(n->o_iv, n->o_cond, n->pre);
+    int64_t i_trip = trip_count(n->i_iv, n->i_cond, n->ip);
+    return stays_within(a->i, i_trip, a->o) || stays_within(a->o, o_trip, a->i);
+}
+
+static int is_legal(Nest *n) {
+    for (size_t i = 0; i < vec_len(n->accesses); i++) {
+        IrIns *store = vec_get(n->accesses, i);
+        if (store->op != IR_STORE) {
+            continue;
+        }
+        Affine sa;
+        if (!affine(n, access_ptr(store), &sa) || !is_separable(n, &sa)) {
+            return 0;
+        }
+        for (size_t j = 0; j < vec_len(n->accesses); j++) {
+            IrIns *other = vec_get(n->accesses, j);
+            if (other == store || !may_alias(store, other)) {
+                continue;
+            }
+            Affine oa;
+            if (!affine(n, access_ptr(other), &oa) || !same_affine(&sa, &oa) ||
+                    access_size(store) != access_size(other)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Worth it if more accesses take a shorter stride with the outer loop's
+// induction variable than with the inner one's
+static int is_profitable(Nest *n) {
+    int better = 0, worse = 0;
+    for (size_t i = 0; i < vec_len(n->accesses); i++) {
+        Affine a;
+        if (!affine(n, access_ptr(vec_get(n->accesses, i)), &a) || a.o == 0 ||
+                a.i == 0) {
+            continue;
+        }
+        better += abs64(a.o) < abs64(a.i);
+        worse += abs64(a.o) > abs64(a.i);
+    }
+    return better > worse;
+}
+
+
+// ---- Transformation --------------------------------------------------------
+
+static void swap_defs(IrIns **a, IrIns **b) {
+    IrIns *t = *a;
+    *a = *b;
+    *b = t;
+}
+
+static void rename_iv(Nest *n, IrIns **opr) {
+    if (*opr == n->o_iv) {
+        *opr = n->i_iv;
+    } else if (*opr == n->i_iv) {
+        *opr = n->o_iv;
+    }
+}
+
+static void interchange(Nest *n) {
+    // Move the inner loop's preheader into its body
+    IrIns *to = n->ib->ir_head;
+    while (to->op == IR_PHI) to = to->next;
+    while (n->ip->ir_head != n->ip->ir_last) {
+        IrIns *ins = n->ip->ir_head;
+        delete_ir(ins);
+        insert_ir(ins, to);
+    }
+
+    // Swap the starts, limits and comparisons
+    size_t o_start = phi_idx(n->o_iv, n->pre), i_start = phi_idx(n->i_iv, n->ip);
+    IrIns *o_def = vec_get(n->o_iv->defs, o_start);
+    vec_put(n->o_iv->defs, o_start, vec_get(n->i_iv->defs, i_start));
+    vec_put(n->i_iv->defs, i_start, o_def);
+    swap_defs(&n->o_cond->r, &n->i_cond->r);
+    int op = n->o_cond->op;
+    n->o_cond->op = n->i_cond->op;
+    n->i_cond->op = op;
+
+    // Swap the uses in the inner loop's body
+    for (size_t i = 0; i < vec_len(n->inner->bbs); i++) {
+        BB *bb = vec_get(n->inner->bbs, i);
+        if (bb == n->ih) {
+            continue;
+        }
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins == n->i_next) {
+                continue;
+            }
+            for (size_t j = 0; ins->op == IR_PHI && j < vec_len(ins->defs); j++) {
+                IrIns *def = vec_get(ins->defs, j);
+                rename_iv(n, &def);
+                vec_put(ins->defs, j, def);
+            }
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int j = 0; j < num_oprs; j++) {
+                rename_iv(n, oprs[j]);
+            }
+        }
+    }
+}
+
+void interchange_loops(Fn *fn) {
+    analyse_escapes(fn);
+    find_def_use(fn);
+    int changed = 0;
+    for (size_t i = 0; i < vec_len(fn->loops); i++) {
+        Loop *inner = vec_get(fn->loops, i);
+        if (!inner->parent) {
+            continue;
+        }
+        Nest n = { .outer = inner->parent, .inner = inner };
+        n.accesses = vec_new();
+        if (match_nest(&n) && check_phis(&n) && is_legal(&n) && is_profitable(&n)) {
+            interchange(&n);
+            changed = 1;
+        }
+        vec_free(n.accesses);
+    }
+    free_def_use(fn);
+    if (changed) {
+        licm(fn); // Hoists what's now invariant in the inner loops
+    }
+}
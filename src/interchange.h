@@ -0,0 +1,17 @@
+#ifndef COSEC_INTERCHANGE_H
+#define COSEC_INTERCHANGE_H
+
+#include "compile.h"
+
+// Loop interchange. A perfect nest of two counted loops that walks an array
+// down its columns, like
+//   for (j = 0; j < m; j++) for (i = 0; i < n; i++) sum += a[i][j];
+// strides a whole row with every iteration of the inner loop. If the inner
+// loop's induction variable moves the addresses it accesses further than the
+// outer one's does, and no iteration writes memory that a later one (in the
+// other order) accesses (see 'alias.h'), the two loops are swapped so the
+// inner one walks the contiguous dimension. Requires 'analyse' and 'licm'
+// (for the preheaders), and keeps 'analyse' up to date
+void interchange_loops(Fn *fn);
+
+#endif
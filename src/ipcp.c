@@ -0,0 +1,456 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ipcp.h"
+#include "profile.h"
+
+// Only direct calls to a 'static' function whose address is never taken are
+// looked at, since then they're every call there is. An argument is constant
+// at a call if it's an IR_IMM, IR_FP, or IR_GLOBAL; one that's the same
+// constant at every call is put in the function's entry BB in place of its
+// IR_FARG.
+//
+// A call is hot if the profile says so (see 'is_hot'), or without one, if it's
+// in a loop. The constants a hot call passes for the rest of the arguments
+// pick the copy of the function it's pointed at; hot calls that pass the same
+// ones share a copy. A copy is named '<label>.constprop.<n>' (like GCC's), and
+// only small functions are copied, a few times at most. If every call ends up
+// going to a copy, 'dge' drops the original.
+
+#define MAX_SPECIALISE_SIZE 200 // Instructions in a function, to be copied
+#define MAX_SPECIALISATIONS 4   // Copies of one function
+
+typedef struct {
+    IrIns *call;
+    Fn *caller;
+} CallSite;
+
+typedef struct {
+    Global *g;
+    int addr_taken;  // Referenced other than as the target of a call
+    Vec *sites;      // of 'CallSite *'
+    IrIns **fargs;   // Per argument; its IR_FARG, or NULL if it's unused
+    size_t num_args; // Highest IR_FARG index + 1
+} FnInfo;
+
+typedef struct {
+    IrIns **consts; // Per argument; the constant the copy is specialised to,
+    Global *g;      // or NULL
+} Spec;
+
+// 'fns' is of 'FnInfo *', by interned label (a declaration before the
+// definition is a different 'Global')
+static FnInfo * fn_info(Map *fns, Global *g) {
+    return map_get(fns, intern(g->label));
+}
+
+static int same_const(IrIns *a, IrIns *b) {
+    if (a->op != b->op || a->t->k != b->t->k || a->t->size != b->t->size) {
+        return 0;
+    }
+    switch (a->op) {
+    case IR_IMM: return a->imm == b->imm;
+    case IR_FP:  return memcmp(&a->fp, &b->fp, sizeof(double)) == 0;
+    default:     return intern(a->g->label) == intern(b->g->label);
+    }
+}
+
+
+// ---- Call Sites ------------------------------------------------------------
+
+static void add_ref(Map *fns, Global *g, IrIns *call, Fn *caller) {
+    FnInfo *info = fn_info(fns, g);
+    if (!info) {
+        return; // Not a 'static' function defined in this file
+    } else if (call) {
+        CallSite *site = malloc(sizeof(CallSite));
+        site->call = call;
+        site->caller = caller;
+        vec_push(info->sites, site);
+    } else {
+        info->addr_taken = 1;
+    }
+}
+
+static void find_refs_in_fn(Map *fns, Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                IrIns *opr = *oprs[i];
+                if (opr->op == IR_GLOBAL) {
+                    int is_call = ins->op == IR_CALL && oprs[i] == &ins->fn;
+                    add_ref(fns, opr->g, is_call ? ins : NULL, fn);
+                }
+            }
+            for (size_t i = 0; ins->op == IR_PHI && i < vec_len(ins->defs); i++) {
+                IrIns *def = vec_get(ins->defs, i);
+                if (def->op == IR_GLOBAL) {
+                    add_ref(fns, def->g, NULL, fn);
+                }
+            }
+        }
+    }
+}
+
+static void find_refs(Map *fns, Vec *globals) {
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        switch (g->k) {
+        case G_FN_DEF: find_refs_in_fn(fns, g->fn); break;
+        case G_PTR:    add_ref(fns, g->g, NULL, NULL); break;
+        case G_INIT:
+            for (size_t j = 0; j < vec_len(g->relocs); j++) {
+                InitReloc *r = vec_get(g->relocs, j);
+                add_ref(fns, r->g, NULL, NULL);
+            }
+            break;
+        default: break;
+        }
+    }
+}
+
+static void find_fargs(FnInfo *info) {
+    Fn *fn = info->g->fn;
+    info->num_args = 0;
+    for (IrIns *ins = fn->entry->ir_head; ins; ins = ins->next) {
+        if (ins->op == IR_FARG && ins->arg_idx >= info->num_args) {
+            info->num_args = ins->arg_idx + 1;
+        }
+    }
+    info->fargs = calloc(info->num_args + 1, sizeof(IrIns *));
+    for (IrIns *ins = fn->entry->ir_head; ins; ins = ins->next) {
+        if (ins->op == IR_FARG) {
+            info->fargs[ins->arg_idx] = ins;
+        }
+    }
+}
+
+static IrIns * call_arg(IrIns *call, size_t idx) {
+    IrIns *carg = call->next;
+    for (size_t i = 0; carg && carg->op == IR_CARG; i++, carg = carg->next) {
+        if (i == idx) {
+            return carg->arg;
+        }
+    }
+    return NULL;
+}
+
+// Whether the call passes every argument the function uses, with the type it
+// expects
+static int args_line_up(FnInfo *info, IrIns *call) {
+    for (size_t i = 0; i < info->num_args; i++) {
+        IrIns *farg = info->fargs[i], *arg = call_arg(call, i);
+        if (farg && (!arg || arg->t->k != farg->t->k)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// The constant a call passes as argument 'idx', or NULL. Not the address of
+// a BB, which belongs to the caller
+static IrIns * const_arg(FnInfo *info, CallSite *site, size_t idx) {
+    IrIns *arg = call_arg(site->call, idx);
+    return info->fargs[idx] && is_const(arg) && arg->op != IR_BB_ADDR ? arg : NULL;
+}
+
+static int is_hot_site(CallSite *site) {
+    BB *bb = site->call->bb;
+    if (site->caller->hot_freq > 0) {
+        return is_hot(site->caller, bb);
+    }
+    return bb->loop != NULL;
+}
+
+
+// ---- Propagation -----------------------------------------------------------
+
+// Replaces the uses of an IR_FARG with a copy of the constant 'k' (from a
+// caller), put after the function's IR_FARGs. Needs 'find_def_use'
+static void set_arg(Fn *fn, IrIns *farg, IrIns *k) {
+    IrIns *copy = new_ins(k->op, k->t);
+    switch (k->op) {
+    case IR_IMM: copy->imm = k->imm; break;
+    case IR_FP:  copy->fp = k->fp; break;
+    default:     copy->g = k->g; break;
+    }
+    copy->line = farg->line;
+    IrIns *before = fn->entry->ir_head;
+    while (before->op == IR_FARG) {
+        before = before->next;
+    }
+    insert_ir(copy, before);
+    replace_all_uses(farg, copy);
+}
+
+// The arguments that are the same constant at every call. Sets 'done' for
+// the ones it propagates
+static void propagate_uniform(FnInfo *info, int *done) {
+    find_def_use(info->g->fn);
+    for (size_t i = 0; i < info->num_args; i++) {
+        CallSite *first = vec_get(info->sites, 0);
+        IrIns *k = const_arg(info, first, i);
+        for (size_t j = 1; k && j < vec_len(info->sites); j++) {
+            IrIns *other = const_arg(info, vec_get(info->sites, j), i);
+            if (!other || !same_const(k, other)) {
+                k = NULL;
+            }
+        }
+        if (k) {
+            set_arg(info->g->fn, info->fargs[i], k);
+            done[i] = 1;
+        }
+    }
+    free_def_use(info->g->fn);
+}
+
+
+// ---- Specialisation --------------------------------------------------------
+
+static size_t fn_size(Fn *fn) {
+    size_t size = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            size++;
+        }
+    }
+    return size;
+}
+
+// A copy of the whole function gets its own stack slots
+static int can_copy_fn(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op != IR_ALLOC && !can_copy(ins)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static Vec * copy_bbs(Vec *bbs, BB **bb_map) { // of 'BB *'
+    Vec *copy = vec_new();
+    for (size_t i = 0; i < vec_len(bbs); i++) {
+        BB *bb = vec_get(bbs, i);
+        vec_push(copy, bb_map[bb->n]);
+    }
+    return copy;
+}
+
+static Fn * copy_fn(Fn *fn) {
+    size_t num_ins = number_ir(fn), num_bbs = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->n = num_bbs++;
+    }
+    IrIns **map = calloc(num_ins, sizeof(IrIns *));
+    BB **bb_map = malloc(sizeof(BB *) * num_bbs);
+    Fn *copy = arena_alloc(ARENA_IR, sizeof(Fn));
+    *copy = *fn;
+    copy->entry = copy->last = NULL;
+    copy->analyses = 0;
+    copy->loops = vec_new();
+    copy->f32s = vec_new();
+    copy->f64s = vec_new();
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        BB *b = new_bb();
+        b->unroll = bb->unroll;
+        b->addr_taken = bb->addr_taken;
+        b->freq = bb->freq;
+        b->prev = copy->last;
+        if (copy->last) {
+            copy->last->next = b;
+        } else {
+            copy->entry = b;
+        }
+        copy->last = b;
+        bb_map[bb->n] = b;
+    }
+
+    // Copy the instructions without their operands (which might be defined
+    // later on), then point the operands at the copies
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        BB *b = bb_map[bb->n];
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns *c = new_ins(ins->op, ins->t);
+            *c = *ins;
+            c->users = NULL;
+            append_ir(b, c);
+            map[ins->n] = c;
+        }
+    }
+    for (BB *bb = copy->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                *oprs[i] = map[(*oprs[i])->n];
+            }
+            switch (ins->op) {
+            case IR_BB_ADDR: ins->label_bb = bb_map[ins->label_bb->n]; break;
+            case IR_PHI: {
+                Vec *defs = ins->defs;
+                ins->preds = copy_bbs(ins->preds, bb_map);
+                ins->defs = vec_new();
+                for (size_t i = 0; i < vec_len(defs); i++) {
+                    IrIns *def = vec_get(defs, i);
+                    vec_push(ins->defs, map[def->n]);
+                }
+                break;
+            }
+            case IR_BR: ins->br = bb_map[ins->br->n]; break;
+            case IR_CONDBR:
+                ins->true = bb_map[ins->true->n];
+                ins->false = bb_map[ins->false->n];
+                ins->true_chain = vec_new();
+                ins->false_chain = vec_new();
+                break;
+            case IR_SWITCH:
+                ins->default_br = bb_map[ins->default_br->n];
+                ins->table = copy_bbs(ins->table, bb_map);
+                break;
+            case IR_INDIRECT_BR: ins->targets = copy_bbs(ins->targets, bb_map); break;
+            default: break;
+            }
+        }
+    }
+    free(map);
+    free(bb_map);
+    return copy;
+}
+
+static Spec * find_spec(Vec *specs, IrIns **consts, size_t num_args) {
+    for (size_t i = 0; i < vec_len(specs); i++) {
+        Spec *spec = vec_get(specs, i);
+        size_t j = 0;
+        while (j < num_args && (consts[j] == spec->consts[j] ||
+               (consts[j] && spec->consts[j] && same_const(consts[j], spec->consts[j])))) {
+            j++;
+        }
+        if (j == num_args) {
+            return spec;
+        }
+    }
+    return NULL;
+}
+
+static Spec * new_spec(Vec *globals, FnInfo *info, IrIns **consts, size_t n) {
+    Global *g = arena_alloc(ARENA_IR, sizeof(Global));
+    *g = *info->g;
+    size_t len = strlen(info->g->label) + 32;
+    g->label = malloc(len);
+    snprintf(g->label, len, "%s.constprop.%zu", info->g->label, n);
+    g->linkage = LINK_STATIC;
+    g->fn = copy_fn(info->g->fn);
+    if (g->fn->instrument) {
+        g->fn->instrument = g;
+    }
+    find_def_use(g->fn);
+    for (IrIns *ins = g->fn->entry->ir_head; ins; ins = ins->next) {
+        if (ins->op == IR_FARG && consts[ins->arg_idx]) {
+            set_arg(g->fn, ins, consts[ins->arg_idx]);
+        }
+    }
+    free_def_use(g->fn);
+    vec_push(globals, g);
+    Spec *spec = malloc(sizeof(Spec));
+    spec->consts = consts;
+    spec->g = g;
+    return spec;
+}
+
+static void retarget_call(IrIns *call, Global *g) {
+    IrIns *target = new_ins(IR_GLOBAL, call->fn->t);
+    target->g = g;
+    target->line = call->line;
+    insert_ir(target, call);
+    call->fn = target;
+}
+
+// Points each hot call that passes constants (other than the ones in 'done')
+// at a copy of the function specialised to them
+static void specialise(Vec *globals, FnInfo *info, int *done) {
+    Fn *fn = info->g->fn;
+    if (fn_size(fn) > MAX_SPECIALISE_SIZE || !can_copy_fn(fn)) {
+        return;
+    }
+    Vec *specs = vec_new(); // of 'Spec *'
+    for (size_t i = 0; i < vec_len(info->sites); i++) {
+        CallSite *site = vec_get(info->sites, i);
+        if (!is_hot_site(site)) {
+            continue;
+        }
+        IrIns **consts = calloc(info->num_args + 1, sizeof(IrIns *));
+        int any = 0;
+        for (size_t j = 0; j < info->num_args; j++) {
+            consts[j] = done[j] ? NULL : const_arg(info, site, j);
+            any |= consts[j] != NULL;
+        }
+        Spec *spec = any ? find_spec(specs, consts, info->num_args) : NULL;
+        if (spec || !any || vec_len(specs) == MAX_SPECIALISATIONS) {
+            free(consts);
+        } else {
+            spec = new_spec(globals, info, consts, vec_len(specs));
+            vec_push(specs, spec);
+        }
+        if (spec) {
+            retarget_call(site->call, spec->g);
+        }
+    }
+    for (size_t i = 0; i < vec_len(specs); i++) {
+        Spec *spec = vec_get(specs, i);
+        free(spec->consts);
+        free(spec);
+    }
+    vec_free(specs);
+}
+
+void propagate_args(Vec *globals) {
+    Map *fns = map_new();
+    size_t num_globals = vec_len(globals); // Not the copies added
+    for (size_t i = 0; i < num_globals; i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k == G_FN_DEF && g->linkage == LINK_STATIC) {
+            FnInfo *info = calloc(1, sizeof(FnInfo));
+            info->g = g;
+            info->sites = vec_new();
+            map_put(fns, intern(g->label), info);
+        }
+    }
+    find_refs(fns, globals);
+    for (size_t i = 0; i < num_globals; i++) {
+        Global *g = vec_get(globals, i);
+        FnInfo *info = g->k == G_FN_DEF ? fn_info(fns, g) : NULL;
+        if (!info || info->g != g || info->addr_taken || vec_len(info->sites) == 0) {
+            continue;
+        }
+        find_fargs(info);
+        int lines_up = 1;
+        for (size_t j = 0; j < vec_len(info->sites); j++) {
+            CallSite *site = vec_get(info->sites, j);
+            lines_up &= args_line_up(info, site->call);
+        }
+        if (lines_up) {
+            int *done = calloc(info->num_args + 1, sizeof(int));
+            propagate_uniform(info, done);
+            specialise(globals, info, done);
+            free(done);
+        }
+    }
+    for (size_t i = 0; i < num_globals; i++) {
+        Global *g = vec_get(globals, i);
+        FnInfo *info = g->k == G_FN_DEF ? fn_info(fns, g) : NULL;
+        if (info && info->g == g) {
+            for (size_t j = 0; j < vec_len(info->sites); j++) {
+                free(vec_get(info->sites, j));
+            }
+            vec_free(info->sites);
+            free(info->fargs);
+            free(info);
+        }
+    }
+    map_free(fns);
+}
@@ -0,0 +1,15 @@
+
+#ifndef COSEC_IPCP_H
+#define COSEC_IPCP_H
+
+#include "compile.h"
+
+// Interprocedural constant propagation. An argument that every call to a
+// 'static' function passes the same constant is replaced by that constant in
+// the function's body; and a function that hot calls pass other constants is
+// copied, with the copy specialised to them. 'sccp', 'dce', and the loop
+// passes then run with the constants known. Runs after 'mem2reg', so the
+// arguments are used directly rather than through a stack allocation
+void propagate_args(Vec *globals);
+
+#endif
@@ -0,0 +1,752 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#define USE_MMAP
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "ir_file.h"
+
+#define IR_FILE_MAGIC   0x52494343 // 'CCIR'
+#define IR_FILE_VERSION 12
+
+#define NO_IDX ((uint32_t) -1) // For a NULL type
+
+
+// ---- Writer ----------------------------------------------------------------
+
+// Globals are written as their index in the table, which starts with the ones
+// given to 'write_ir', in order. A declaration and the definition after it
+// are different 'Global's with the same label, so references go by label (to
+// the definition, if there is one), and any global that's only referenced is
+// added to the end of the table
+
+typedef struct {
+    Buf *b;        // The globals
+    Buf *types_b;  // The type table
+    Vec *types;    // of 'IrType *'; in the type table
+    Vec *globals;  // of 'Global *'; in the global table
+    Map *by_label; // of index + 1, by interned label
+} Writer;
+
+static void put(Buf *b, void *data, size_t len) {
+    buf_nprint(b, data, len);
+}
+
+static void put_u8(Buf *b, uint8_t v)   { put(b, &v, sizeof(v)); }
+static void put_u32(Buf *b, uint32_t v) { put(b, &v, sizeof(v)); }
+static void put_u64(Buf *b, uint64_t v) { put(b, &v, sizeof(v)); }
+
+static void put_str(Buf *b, char *s) {
+    put_u32(b, (uint32_t) strlen(s));
+    put(b, s, strlen(s) + 1);
+}
+
+// Types are hash-consed, so each is written once, after the types it's made
+// of; there are few enough of them to find by searching
+static uint32_t type_idx(Writer *w, IrType *t) {
+    if (!t) {
+        return NO_IDX;
+    }
+    for (size_t i = 0; i < vec_len(w->types); i++) {
+        if (vec_get(w->types, i) == t) {
+            return (uint32_t) i;
+        }
+    }
+    uint32_t elem = 0;
+    if (t->k == IRT_ARR || t->k == IRT_VEC) {
+        elem = type_idx(w, t->elem);
+    } else if (t->k == IRT_STRUCT) {
+        for (size_t i = 0; i < vec_len(t->fields); i++) {
+            type_idx(w, ((IrField *) vec_get(t->fields, i))->t);
+        }
+    }
+    Buf *b = w->types_b;
+    put_u8(b, (uint8_t) t->k);
+    if (t->k == IRT_ARR || t->k == IRT_VEC) {
+        put_u32(b, elem);
+        put_u64(b, t->len);
+        put_u64(b, t->size);
+        put_u64(b, t->align);
+    } else if (t->k == IRT_STRUCT) {
+        put_u64(b, t->size);
+        put_u64(b, t->align);
+        put_u32(b, (uint32_t) vec_len(t->fields));
+        for (size_t i = 0; i < vec_len(t->fields); i++) {
+            IrField *f = vec_get(t->fields, i);
+            put_u32(b, type_idx(w, f->t));
+            put_u64(b, f->offset);
+        }
+    }
+    vec_push(w->types, t);
+    return (uint32_t) (vec_len(w->types) - 1);
+}
+
+static void put_type(Writer *w, IrType *t) {
+    put_u32(w->b, type_idx(w, t));
+}
+
+static void put_global_ref(Writer *w, Global *g) {
+    char *label = intern(g->label);
+    size_t idx = (size_t) map_get(w->by_label, label);
+    if (!idx) {
+        vec_push(w->globals, g);
+        idx = vec_len(w->globals);
+        map_put(w->by_label, label, (void *) idx);
+    }
+    put_u32(w->b, (uint32_t) (idx - 1));
+}
+
+static void put_bbs(Buf *b, Vec *bbs) {
+    put_u32(b, (uint32_t) vec_len(bbs));
+    for (size_t i = 0; i < vec_len(bbs); i++) {
+        put_u32(b, (uint32_t) ((BB *) vec_get(bbs, i))->n);
+    }
+}
+
+static void put_inline_asm(Buf *b, InlineAsm *a) {
+    put_str(b, a->template);
+    put_u8(b, (uint8_t) a->is_basic);
+    put_u32(b, a->clobbers);
+    put_u32(b, a->sse_clobbers);
+    put_u8(b, (uint8_t) a->num_outs);
+    put_u8(b, (uint8_t) a->num_oprs);
+    for (int i = 0; i < a->num_oprs; i++) {
+        AsmOperand *o = &a->oprs[i];
+        put_u8(b, (uint8_t) o->k);
+        put_u8(b, (uint8_t) o->reg);
+        put_u8(b, (uint8_t) o->tied);
+        put_u8(b, (uint8_t) (o->is_out | (o->is_in << 1) | (o->early_clobber << 2) |
+                             ((o->name != NULL) << 3)));
+        if (o->name) {
+            put_str(b, o->name);
+        }
+        put_u64(b, o->size);
+        put_u64(b, o->imm);
+    }
+}
+
+static void put_ins(Writer *w, IrIns *ins) {
+    Buf *b = w->b;
+    put_u8(b, (uint8_t) ins->op);
+    put_type(w, ins->t);
+    put_u32(b, (uint32_t) ins->line);
+    switch (ins->op) {
+    case IR_IMM: put_u64(b, ins->imm); break;
+    case IR_FP:  { uint64_t bits; memcpy(&bits, &ins->fp, sizeof(bits)); put_u64(b, bits); break; }
+    case IR_GLOBAL: put_global_ref(w, ins->g); break;
+    case IR_BB_ADDR: put_u32(b, (uint32_t) ins->label_bb->n); break;
+    case IR_FARG:
+        put_u64(b, ins->arg_idx);
+        put_u8(b, (uint8_t) ins->is_restrict);
+        break;
+    case IR_ALLOC:
+        put_type(w, ins->alloc_t);
+        put_u8(b, (uint8_t) ins->escapes);
+        break;
+    case IR_LOAD: case IR_STORE: case IR_COPY: put_u64(b, ins->align); break;
+    case IR_BITCAST: put_u64(b, ins->assumed_align); break;
+    case IR_PREFETCH: put_u8(b, (uint8_t) ins->locality); break;
+    case IR_REDUCE: put_u8(b, (uint8_t) ins->reduce_op); break;
+    case IR_ATOMIC_LOAD: case IR_ATOMIC_STORE: case IR_ATOMIC_XCHG:
+    case IR_ATOMIC_ADD: case IR_ATOMIC_CAS: case IR_FENCE:
+        put_u8(b, (uint8_t) ins->order);
+        break;
+    case IR_PHI:
+        put_bbs(b, ins->preds);
+        for (size_t i = 0; i < vec_len(ins->defs); i++) {
+            put_u32(b, (uint32_t) ((IrIns *) vec_get(ins->defs, i))->n);
+        }
+        break;
+    case IR_BR: put_u32(b, (uint32_t) ins->br->n); break;
+    case IR_CONDBR:
+        put_u32(b, (uint32_t) ins->true->n);
+        put_u32(b, (uint32_t) ins->false->n);
+        put_u8(b, (uint8_t) ins->likely);
+        break;
+    case IR_SWITCH:
+        put_u32(b, (uint32_t) ins->default_br->n);
+        put_bbs(b, ins->table);
+        put_u8(b, (uint8_t) ins->in_range);
+        break;
+    case IR_INDIRECT_BR: put_bbs(b, ins->targets); break;
+    case IR_CALL: put_u8(b, (uint8_t) ins->is_vararg); break;
+    case IR_CARG: case IR_ASMIN: case IR_ASMOUT: put_u8(b, (uint8_t) ins->opr_idx); break;
+    case IR_ASM: put_inline_asm(b, ins->inline_asm); break;
+    default: break;
+    }
+    IrIns **oprs[3];
+    int num_oprs = ir_operands(ins, oprs);
+    put_u8(b, (uint8_t) num_oprs);
+    for (int i = 0; i < num_oprs; i++) {
+        put_u32(b, (uint32_t) (*oprs[i])->n);
+    }
+}
+
+static void put_fn(Writer *w, Fn *fn) {
+    Buf *b = w->b;
+    size_t num_bbs = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->n = num_bbs++;
+    }
+    size_t num_ins = number_ir(fn);
+    put_u32(b, (uint32_t) vec_len(fn->params));
+    for (size_t i = 0; i < vec_len(fn->params); i++) {
+        put_type(w, vec_get(fn->params, i));
+    }
+    put_type(w, fn->ret);
+    put_u8(b, fn->instrument != NULL);
+    if (fn->instrument) {
+        put_global_ref(w, fn->instrument);
+    }
+    put_u32(b, (uint32_t) fn->patchable_entry);
+    put_str(b, fn->file ? fn->file : "");
+    put_u64(b, (uint64_t) fn->hot_freq);
+    put_u32(b, (uint32_t) num_bbs);
+    put_u32(b, (uint32_t) num_ins);
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        uint32_t n = 0;
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            n++;
+        }
+        put_u32(b, (uint32_t) bb->unroll);
+        put_u64(b, (uint64_t) bb->freq);
+        put_u32(b, n);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            put_ins(w, ins);
+        }
+    }
+}
+
+static void put_global(Writer *w, Global *g) {
+    Buf *b = w->b;
+    put_str(b, g->label);
+    put_u8(b, (uint8_t) g->k);
+    put_u8(b, (uint8_t) g->linkage);
+    put_u8(b, (uint8_t) (g->is_const | (g->is_cstring << 1) | (g->is_tls << 2) |
+                         (g->visibility << 3)));
+    put_u8(b, (uint8_t) g->fn_attrs);
+    put_type(w, g->t);
+    switch (g->k) {
+    case G_IMM: put_u64(b, g->imm); break;
+    case G_FP:  { uint64_t bits; memcpy(&bits, &g->fp, sizeof(bits)); put_u64(b, bits); break; }
+    case G_INIT:
+        put_u64(b, g->num_bytes);
+        put(b, g->bytes, g->num_bytes);
+        put_u32(b, (uint32_t) vec_len(g->relocs));
+        for (size_t i = 0; i < vec_len(g->relocs); i++) {
+            InitReloc *r = vec_get(g->relocs, i);
+            put_u64(b, r->offset);
+            put_global_ref(w, r->g);
+            put_u64(b, (uint64_t) r->addend);
+        }
+        break;
+    case G_PTR:
+        put_global_ref(w, g->g);
+        put_u64(b, (uint64_t) g->offset);
+        break;
+    case G_FN_DEF: put_fn(w, g->fn); break;
+    default: break;
+    }
+}
+
+Buf * write_ir(Vec *globals) {
+    Writer w = { buf_new(), buf_new(), vec_new(), vec_new(), map_new() };
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        vec_push(w.globals, g);
+        char *label = intern(g->label);
+        if (!map_get(w.by_label, label) || g->k != G_NONE) {
+            map_put(w.by_label, label, (void *) (i + 1));
+        }
+    }
+    for (size_t i = 0; i < vec_len(w.globals); i++) { // Grows as it's written
+        put_global(&w, vec_get(w.globals, i));
+    }
+
+    Buf *b = buf_new();
+    put_u32(b, IR_FILE_MAGIC);
+    put_u32(b, IR_FILE_VERSION);
+    put_u32(b, (uint32_t) vec_len(w.types));
+    put(b, w.types_b->data, w.types_b->len);
+    put_u32(b, (uint32_t) vec_len(w.globals));
+    put_u32(b, (uint32_t) vec_len(globals));
+    put(b, w.b->data, w.b->len);
+    buf_free(w.b);
+    buf_free(w.types_b);
+    vec_free(w.types);
+    vec_free(w.globals);
+    map_free(w.by_label);
+    return b;
+}
+
+
+// ---- Reader ----------------------------------------------------------------
+
+// Every global, and every BB and instruction in a function, is allocated
+// before any are read, so references to ones later in the file can be filled
+// in straight away. Reading past the end or an index out of range sets
+// 'corrupt', after which everything read is zero (or NULL)
+
+typedef struct {
+    char *p, *end;
+    int corrupt;
+    IrType **types;
+    uint32_t num_types;
+    Global **globals;
+    uint32_t num_globals;
+    BB **bbs;     // Of the function being read
+    uint32_t num_bbs;
+    IrIns **ins;  // Likewise
+    uint32_t num_ins;
+} Reader;
+
+static void get(Reader *r, void *data, size_t len) {
+    if (r->corrupt || (size_t) (r->end - r->p) < len) {
+        r->corrupt = 1;
+        memset(data, 0, len);
+        return;
+    }
+    memcpy(data, r->p, len);
+    r->p += len;
+}
+
+static uint8_t get_u8(Reader *r)   { uint8_t v;  get(r, &v, sizeof(v)); return v; }
+static uint32_t get_u32(Reader *r) { uint32_t v; get(r, &v, sizeof(v)); return v; }
+static uint64_t get_u64(Reader *r) { uint64_t v; get(r, &v, sizeof(v)); return v; }
+
+// For a count of things that each take at least 'min_size' bytes, so a
+// corrupt count can't make the reader allocate more than the file's size
+static uint32_t get_count(Reader *r, size_t min_size) {
+    uint32_t n = get_u32(r);
+    if ((uint64_t) n * min_size > (uint64_t) (r->end - r->p)) {
+        r->corrupt = 1;
+        return 0;
+    }
+    return n;
+}
+
+// Returns a pointer to the string in the file, which is followed by a NUL
+static char * get_str(Reader *r) {
+    uint32_t len = get_u32(r);
+    if (r->corrupt || (size_t) (r->end - r->p) < (size_t) len + 1 || r->p[len] != '\0') {
+        r->corrupt = 1;
+        return "";
+    }
+    char *s = r->p;
+    r->p += len + 1;
+    return s;
+}
+
+static uint32_t get_idx(Reader *r, uint32_t num) {
+    uint32_t idx = get_u32(r);
+    if (idx >= num) {
+        r->corrupt = 1;
+        return 0;
+    }
+    return idx;
+}
+
+static IrType * get_type(Reader *r) {
+    uint32_t idx = get_u32(r);
+    if (idx == NO_IDX) {
+        return NULL;
+    } else if (idx >= r->num_types) {
+        r->corrupt = 1;
+        return NULL;
+    }
+    return r->types[idx];
+}
+
+static Global * get_global(Reader *r) {
+    uint32_t idx = get_idx(r, r->num_globals);
+    return r->corrupt ? NULL : r->globals[idx];
+}
+
+static BB * get_bb(Reader *r) {
+    uint32_t idx = get_idx(r, r->num_bbs);
+    return r->corrupt ? NULL : r->bbs[idx];
+}
+
+static IrIns * get_ins(Reader *r) {
+    uint32_t idx = get_idx(r, r->num_ins);
+    return r->corrupt ? NULL : r->ins[idx];
+}
+
+// Only refers to types earlier in the table (see 'read_ir')
+static IrType * read_type(Reader *r) {
+    uint8_t k = get_u8(r);
+    if (k <= IRT_PTR) {
+        return irt_scalar(k);
+    } else if (k == IRT_ARR || k == IRT_VEC) {
+        IrType *elem = get_type(r);
+        uint64_t len = get_u64(r), size = get_u64(r), align = get_u64(r);
+        if (r->corrupt || !elem || (k == IRT_VEC && (elem->k < IRT_I8 || elem->k > IRT_F64))) {
+            r->corrupt = 1;
+            return NULL;
+        }
+        return k == IRT_VEC ? irt_vec(elem, len) : irt_arr(elem, len, size, align);
+    } else if (k == IRT_STRUCT) {
+        uint64_t size = get_u64(r), align = get_u64(r);
+        uint32_t num_fields = get_count(r, 12);
+        Vec *fields = vec_new();
+        for (uint32_t i = 0; i < num_fields; i++) {
+            IrType *ft = get_type(r);
+            uint64_t offset = get_u64(r);
+            if (!ft) {
+                r->corrupt = 1;
+            }
+            vec_push(fields, irt_field(ft, offset));
+        }
+        if (r->corrupt) {
+            for (size_t i = 0; i < vec_len(fields); i++) {
+                free(vec_get(fields, i));
+            }
+            vec_free(fields);
+            return NULL;
+        }
+        return irt_struct(size, align, fields);
+    }
+    r->corrupt = 1;
+    return NULL;
+}
+
+static void get_bbs(Reader *r, Vec *bbs) {
+    uint32_t n = get_count(r, 4);
+    for (uint32_t i = 0; i < n && !r->corrupt; i++) {
+        vec_push(bbs, get_bb(r));
+    }
+}
+
+static InlineAsm * read_inline_asm(Reader *r) {
+    InlineAsm *a = calloc(1, sizeof(InlineAsm));
+    a->oprs = calloc(MAX_ASM_OPRS, sizeof(AsmOperand));
+    a->template = get_str(r);
+    a->is_basic = get_u8(r);
+    a->clobbers = get_u32(r);
+    a->sse_clobbers = get_u32(r);
+    a->num_outs = get_u8(r);
+    a->num_oprs = get_u8(r);
+    if (a->num_oprs > MAX_ASM_OPRS || a->num_outs > a->num_oprs) {
+        r->corrupt = 1;
+        return a;
+    }
+    for (int i = 0; i < a->num_oprs; i++) {
+        AsmOperand *o = &a->oprs[i];
+        o->k = get_u8(r);
+        o->reg = get_u8(r);
+        o->tied = get_u8(r);
+        uint8_t flags = get_u8(r);
+        o->is_out = flags & 1;
+        o->is_in = (flags >> 1) & 1;
+        o->early_clobber = (flags >> 2) & 1;
+        o->name = (flags & 8) ? get_str(r) : NULL;
+        o->size = get_u64(r);
+        o->imm = get_u64(r);
+    }
+    return a;
+}
+
+static void read_ins(Reader *r, IrIns *ins) {
+    ins->op = get_u8(r);
+    ins->t = get_type(r);
+    ins->line = (int) get_u32(r);
+    if (ins->op >= IR_LAST) {
+        r->corrupt = 1;
+        return;
+    }
+    switch (ins->op) {
+    case IR_IMM: ins->imm = get_u64(r); break;
+    case IR_FP:  { uint64_t bits = get_u64(r); memcpy(&ins->fp, &bits, sizeof(bits)); break; }
+    case IR_GLOBAL: ins->g = get_global(r); break;
+    case IR_BB_ADDR:
+        ins->label_bb = get_bb(r);
+        if (ins->label_bb) {
+            ins->label_bb->addr_taken = 1;
+        }
+        break;
+    case IR_FARG:
+        ins->arg_idx = get_u64(r);
+        ins->is_restrict = get_u8(r);
+        break;
+    case IR_ALLOC:
+        ins->alloc_t = get_type(r);
+        ins->escapes = get_u8(r);
+        break;
+    case IR_LOAD: case IR_STORE: case IR_COPY: ins->align = get_u64(r); break;
+    case IR_BITCAST: ins->assumed_align = get_u64(r); break;
+    case IR_PREFETCH: ins->locality = get_u8(r); break;
+    case IR_REDUCE: ins->reduce_op = get_u8(r); break;
+    case IR_ATOMIC_LOAD: case IR_ATOMIC_STORE: case IR_ATOMIC_XCHG:
+    case IR_ATOMIC_ADD: case IR_ATOMIC_CAS: case IR_FENCE:
+        ins->order = get_u8(r);
+        break;
+    case IR_PHI:
+        ins->preds = vec_new();
+        ins->defs = vec_new();
+        get_bbs(r, ins->preds);
+        for (size_t i = 0; i < vec_len(ins->preds) && !r->corrupt; i++) {
+            vec_push(ins->defs, get_ins(r));
+        }
+        break;
+    case IR_BR: ins->br = get_bb(r); break;
+    case IR_CONDBR:
+        ins->true = get_bb(r);
+        ins->false = get_bb(r);
+        ins->likely = (int8_t) get_u8(r);
+        break;
+    case IR_SWITCH:
+        ins->default_br = get_bb(r);
+        ins->table = vec_new();
+        get_bbs(r, ins->table);
+        ins->in_range = get_u8(r);
+        break;
+    case IR_INDIRECT_BR:
+        ins->targets = vec_new();
+        get_bbs(r, ins->targets);
+        break;
+    case IR_CALL: ins->is_vararg = get_u8(r); break;
+    case IR_CARG: case IR_ASMIN: case IR_ASMOUT: ins->opr_idx = get_u8(r); break;
+    case IR_ASM: ins->inline_asm = read_inline_asm(r); break;
+    default: break;
+    }
+
+    // 'count' and 'ret' only have a slot in 'ir_operands' if they're set
+    uint8_t num_oprs = get_u8(r);
+    if (num_oprs > 0 && ins->op == IR_ALLOC) {
+        ins->count = ins;
+    } else if (num_oprs > 0 && ins->op == IR_RET) {
+        ins->ret = ins;
+    }
+    IrIns **oprs[3];
+    if (r->corrupt || ir_operands(ins, oprs) != num_oprs) {
+        r->corrupt = 1;
+        return;
+    }
+    for (int i = 0; i < num_oprs; i++) {
+        *oprs[i] = get_ins(r);
+    }
+}
+
+static void emit(BB *bb, IrIns *ins) {
+    ins->bb = bb;
+    ins->prev = bb->ir_last;
+    if (bb->ir_last) {
+        bb->ir_last->next = ins;
+    } else {
+        bb->ir_head = ins;
+    }
+    bb->ir_last = ins;
+}
+
+static Fn * read_fn(Reader *r) {
+    Fn *fn = arena_alloc(ARENA_IR, sizeof(Fn));
+    fn->params = vec_new();
+    fn->loops = vec_new();
+    fn->f32s = vec_new();
+    fn->f64s = vec_new();
+    uint32_t num_params = get_count(r, 4);
+    for (uint32_t i = 0; i < num_params && !r->corrupt; i++) {
+        vec_push(fn->params, get_type(r));
+    }
+    fn->ret = get_type(r);
+    fn->instrument = get_u8(r) ? get_global(r) : NULL;
+    fn->patchable_entry = (int) get_u32(r);
+    if (fn->patchable_entry > MAX_PATCHABLE_ENTRY) {
+        r->corrupt = 1;
+    }
+    char *file = get_str(r);
+    fn->file = file[0] ? file : NULL;
+    fn->hot_freq = (int64_t) get_u64(r);
+    r->num_bbs = get_count(r, 16);
+    r->num_ins = get_count(r, 10);
+    if (r->corrupt || r->num_bbs == 0) {
+        r->corrupt = 1;
+        return fn;
+    }
+    r->bbs = malloc(sizeof(BB *) * r->num_bbs);
+    r->ins = malloc(sizeof(IrIns *) * (r->num_ins + 1));
+    for (uint32_t i = 0; i < r->num_bbs; i++) {
+        BB *bb = r->bbs[i] = new_bb();
+        bb->prev = fn->last;
+        if (fn->last) {
+            fn->last->next = bb;
+        } else {
+            fn->entry = bb;
+        }
+        fn->last = bb;
+    }
+    for (uint32_t i = 0; i < r->num_ins; i++) {
+        r->ins[i] = new_ins(IR_IMM, NULL); // Filled in by 'read_ins'
+    }
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < r->num_bbs && !r->corrupt; i++) {
+        BB *bb = r->bbs[i];
+        bb->unroll = (int) get_u32(r);
+        bb->freq = (int64_t) get_u64(r);
+        uint32_t n = get_u32(r);
+        if (n > r->num_ins - next) {
+            r->corrupt = 1;
+            break;
+        }
+        for (uint32_t j = 0; j < n && !r->corrupt; j++) {
+            IrIns *ins = r->ins[next++];
+            read_ins(r, ins);
+            emit(bb, ins);
+        }
+    }
+    if (next != r->num_ins) {
+        r->corrupt = 1;
+    }
+    free(r->bbs);
+    free(r->ins);
+    return fn;
+}
+
+static void read_global(Reader *r, Global *g) {
+    g->label = get_str(r);
+    g->k = get_u8(r);
+    g->linkage = get_u8(r);
+    uint8_t flags = get_u8(r);
+    g->is_const = flags & 1;
+    g->is_cstring = (flags >> 1) & 1;
+    g->is_tls = (flags >> 2) & 1;
+    g->visibility = (flags >> 3) & 3;
+    g->fn_attrs = get_u8(r);
+    g->t = get_type(r);
+    switch (g->k) {
+    case G_IMM: g->imm = get_u64(r); break;
+    case G_FP:  { uint64_t bits = get_u64(r); memcpy(&g->fp, &bits, sizeof(bits)); break; }
+    case G_INIT: {
+        uint64_t num_bytes = get_u64(r);
+        if (num_bytes > (uint64_t) (r->end - r->p)) {
+            r->corrupt = 1;
+            break;
+        }
+        g->bytes = r->p;
+        g->num_bytes = num_bytes;
+        r->p += num_bytes;
+        g->relocs = vec_new();
+        uint32_t num_relocs = get_count(r, 20);
+        for (uint32_t i = 0; i < num_relocs && !r->corrupt; i++) {
+            InitReloc *reloc = arena_alloc(ARENA_IR, sizeof(InitReloc));
+            reloc->offset = get_u64(r);
+            reloc->g = get_global(r);
+            reloc->addend = (int64_t) get_u64(r);
+            vec_push(g->relocs, reloc);
+        }
+        break;
+    }
+    case G_PTR:
+        g->g = get_global(r);
+        g->offset = (int64_t) get_u64(r);
+        break;
+    case G_FN_DEF: g->fn = read_fn(r); break;
+    case G_NONE: break;
+    default: r->corrupt = 1; break;
+    }
+}
+
+Vec * read_ir(char *data, size_t size) {
+    Reader r = { .p = data, .end = data + size };
+    if (get_u32(&r) != IR_FILE_MAGIC || get_u32(&r) != IR_FILE_VERSION) {
+        return NULL;
+    }
+    uint32_t num_types = get_count(&r, 1);
+    r.types = malloc(sizeof(IrType *) * (num_types + 1));
+    for (r.num_types = 0; r.num_types < num_types && !r.corrupt; r.num_types++) {
+        r.types[r.num_types] = read_type(&r);
+    }
+    r.num_globals = get_count(&r, 8);
+    uint32_t num_roots = get_u32(&r);
+    if (num_roots > r.num_globals) {
+        r.corrupt = 1;
+    }
+    Vec *globals = vec_new();
+    if (!r.corrupt) {
+        r.globals = malloc(sizeof(Global *) * (r.num_globals + 1));
+        for (uint32_t i = 0; i < r.num_globals; i++) {
+            r.globals[i] = arena_alloc(ARENA_IR, sizeof(Global));
+        }
+        for (uint32_t i = 0; i < r.num_globals && !r.corrupt; i++) {
+            read_global(&r, r.globals[i]);
+        }
+        for (uint32_t i = 0; i < num_roots; i++) {
+            vec_push(globals, r.globals[i]);
+        }
+        free(r.globals);
+    }
+    free(r.types);
+    if (r.corrupt || r.p != r.end) {
+        vec_free(globals);
+        return NULL;
+    }
+    return globals;
+}
+
+
+// ---- Files -----------------------------------------------------------------
+
+int save_ir(char *path, Vec *globals) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        return 0;
+    }
+    Buf *b = write_ir(globals);
+    int ok = fwrite(b->data, 1, b->len, f) == b->len;
+    ok = fclose(f) == 0 && ok;
+    buf_free(b);
+    return ok;
+}
+
+#ifdef USE_MMAP
+// The mapping is never unmapped, since the IR points into it. It's private and
+// writable, so the IR's strings and initialisers are like any others to the
+// passes that run on it
+Vec * load_ir(char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    Vec *globals = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size_t size = (size_t) st.st_size;
+        char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            globals = read_ir(data, size);
+            if (!globals) {
+                munmap(data, size);
+            }
+        }
+    }
+    close(fd);
+    return globals;
+}
+#else
+// The contents are never freed, since the IR points into them
+Vec * load_ir(char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+    Buf *b = buf_new();
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        buf_nprint(b, chunk, n);
+    }
+    fclose(f);
+    Vec *globals = read_ir(b->data, b->len);
+    if (!globals) {
+        buf_free(b);
+    }
+    return globals;
+}
+#endif
@@ -0,0 +1,39 @@
+
+#ifndef COSEC_IR_FILE_H
+#define COSEC_IR_FILE_H
+
+#include "compile.h"
+
+// Binary IR files. A compact, versioned serialisation of the IR: every global
+// and its initialiser, and each function's BBs and instructions, with the
+// types they use in a table of their own. Globals, BBs, instructions, and
+// types are written as indices, so a file doesn't depend on where anything
+// was in memory, and reading one back needs just a single pass to rebuild
+// the structures in 'compile.h'. It's the basis for caching the optimised IR
+// between runs, for link-time optimisation, and for handing pre-lowered code
+// to the JIT.
+//
+// A file is the magic number, 'IR_FILE_VERSION', the type table, then the
+// globals. Strings (labels, source file names, and inline assembly) are stored
+// with a NUL after them, so the reader can use them straight from the
+// memory-mapped file.
+// Nothing's checked beyond what keeps the reader in bounds; a file's assumed
+// to have been written by this version of the compiler
+
+// The globals the pipeline's left after optimisation (everything but the
+// analyses, which the reader doesn't need)
+Buf * write_ir(Vec *globals);
+
+// Rebuilds the 'globals' 'write_ir' was given, with their functions, in
+// 'ARENA_IR'. 'data' has to outlive the IR. Returns NULL if it's corrupt or
+// from another version. Run 'analyse' on the result before anything else
+Vec * read_ir(char *data, size_t size); // of 'Global *'
+
+// Returns 0 if 'path' can't be written
+int save_ir(char *path, Vec *globals);
+
+// Memory-maps 'path' (where possible) and reads it. Returns NULL if it can't
+// be opened, or 'read_ir' fails
+Vec * load_ir(char *path);
+
+#endif
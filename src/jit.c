@@ -0,0 +1,234 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#define USE_MMAP
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "jit.h"
+#include "error.h"
+
+// The sections are laid out as in an executable: the text, followed by the
+// stubs for undefined symbols; then, on a new page, the read-only data, the
+// floating point constant pool (doubles first), and the string literals; then,
+// on another page, the data and '.bss'. The mapping starts off writable and
+// each part gets its final protection once everything is relocated
+
+#define STUB_SIZE 16 // 'jmp [rel addr]' (6 bytes), then the 8 byte 'addr'
+
+typedef struct {
+    uint64_t off[SEC_BSS + 1]; // Of each section, from the start of the mapping
+    uint64_t stubs, code_end, ro_end, size;
+    size_t align; // Of the whole mapping
+} Layout;
+
+static uint64_t align_to(uint64_t offset, size_t align) {
+    return offset + pad(offset, align);
+}
+
+static char * sym_name(Symbol *sym) {
+    return sym->name[0] == '_' ? &sym->name[1] : sym->name;
+}
+
+static void layout(Object *obj, size_t num_undef, size_t page, Layout *l) {
+    size_t aligns[] = { obj->text_align, obj->rodata_align, obj->data_align, obj->bss_align };
+    l->align = page;
+    for (size_t i = 0; i < sizeof(aligns) / sizeof(aligns[0]); i++) {
+        l->align = aligns[i] > l->align ? aligns[i] : l->align;
+    }
+    l->off[SEC_TEXT] = 0;
+    l->stubs = align_to(obj->text->len, STUB_SIZE);
+    l->code_end = l->stubs + num_undef * STUB_SIZE;
+    l->off[SEC_RODATA] = align_to(align_to(l->code_end, page), obj->rodata_align);
+    l->off[SEC_CST8] = align_to(l->off[SEC_RODATA] + obj->rodata->len, 8);
+    l->off[SEC_CST4] = l->off[SEC_CST8] + obj->cst8->len;
+    l->off[SEC_CSTRING] = l->off[SEC_CST4] + obj->cst4->len;
+    l->ro_end = l->off[SEC_CSTRING] + obj->cstrings->len;
+    l->off[SEC_DATA] = align_to(align_to(l->ro_end, page), obj->data_align);
+    l->off[SEC_BSS] = align_to(l->off[SEC_DATA] + obj->data->len, obj->bss_align);
+    l->size = align_to(l->off[SEC_BSS] + obj->bss_size, page);
+    if (l->size == 0) {
+        l->size = page; // Nothing in it, but 'mmap' can't map nothing
+    }
+}
+
+static int cmp_jit_syms(const void *a, const void *b) {
+    return strcmp(((JitSym *) a)->name, ((JitSym *) b)->name);
+}
+
+#ifdef USE_MMAP
+static void * find_in_process(void *ctx, char *name) {
+    (void) ctx; // Unused
+    static void *self = NULL; // Everything the process has loaded
+    if (!self) {
+        self = dlopen(NULL, RTLD_LAZY);
+    }
+    return self ? dlsym(self, name) : NULL;
+}
+
+// Rip-relative references to undefined symbols too far away for 32 bits go
+// through the symbol's stub if they're calls. Returns 0 if the reference is
+// still out of range
+static int relocate(Reloc *r, char *section, char **addrs, char **stubs) {
+    char *at = section + r->offset;
+    uintptr_t target = (uintptr_t) addrs[r->sym->idx] + (uintptr_t) r->addend;
+    if (r->k == RELOC_ABS64) {
+        uint64_t v = target;
+        memcpy(at, &v, 8);
+        return 1;
+    }
+    uintptr_t end = (uintptr_t) at + (uintptr_t) r->pc_bias;
+    int64_t disp = (int64_t) (target - end);
+    if (disp != (int32_t) disp && r->k == RELOC_CALL && stubs[r->sym->idx]) {
+        disp = (int64_t) ((uintptr_t) stubs[r->sym->idx] + (uintptr_t) r->addend - end);
+    }
+    if (disp != (int32_t) disp) {
+        return 0;
+    }
+    int32_t d = (int32_t) disp;
+    memcpy(at, &d, 4);
+    return 1;
+}
+
+static int relocate_all(Vec *relocs, char *section, char **addrs, char **stubs, Reloc **failed) {
+    for (size_t i = 0; i < vec_len(relocs); i++) {
+        Reloc *r = vec_get(relocs, i);
+        if (!relocate(r, section, addrs, stubs)) {
+            *failed = r;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void write_stub(char *stub, char *target) {
+    static const char jmp[] = { (char) 0xff, 0x25, 0, 0, 0, 0 }; // 'jmp [rel $+6]'
+    uint64_t addr = (uint64_t) (uintptr_t) target;
+    memset(stub, (char) 0xcc, STUB_SIZE); // 'int3' in the padding
+    memcpy(stub, jmp, sizeof(jmp));
+    memcpy(stub + sizeof(jmp), &addr, 8);
+}
+
+static void copy_section(char *dst, Buf *src) {
+    if (src->len > 0) {
+        memcpy(dst, src->data, src->len);
+    }
+}
+
+Jit * jit_load(Object *obj, JitResolver resolve, void *ctx) {
+    if (!resolve) {
+        resolve = find_in_process;
+    }
+
+    // Resolve everything first, so there's nothing to undo on an error
+    size_t num_syms = vec_len(obj->syms), num_undef = 0;
+    for (size_t i = 0; i < num_syms; i++) {
+        Symbol *sym = vec_get(obj->syms, i);
+        if (sym->is_tls) { // There's no thread-local block to put it in
+            error("thread-local '%s' isn't supported by the JIT", sym_name(sym));
+        }
+    }
+    char **addrs = calloc(num_syms + 1, sizeof(char *));
+    char **stubs = calloc(num_syms + 1, sizeof(char *));
+    for (size_t i = 0; i < num_syms; i++) {
+        Symbol *sym = vec_get(obj->syms, i);
+        sym->idx = i;
+        if (sym->section == SEC_UNDEF) {
+            addrs[i] = resolve(ctx, sym_name(sym));
+            if (!addrs[i]) {
+                free(addrs);
+                free(stubs);
+                error("undefined symbol '%s'", sym_name(sym));
+            }
+            num_undef++;
+        }
+    }
+
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    Layout l;
+    layout(obj, num_undef, page, &l);
+    size_t map_size = l.size + l.align - page; // Room to align the start
+    char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        free(addrs);
+        free(stubs);
+        error("can't allocate memory for the JIT: %s", strerror(errno));
+    }
+    char *base = map + pad((uintptr_t) map, l.align);
+    copy_section(base + l.off[SEC_TEXT], obj->text);
+    copy_section(base + l.off[SEC_RODATA], obj->rodata);
+    copy_section(base + l.off[SEC_CST8], obj->cst8);
+    copy_section(base + l.off[SEC_CST4], obj->cst4);
+    copy_section(base + l.off[SEC_CSTRING], obj->cstrings);
+    copy_section(base + l.off[SEC_DATA], obj->data);
+    char *stub = base + l.stubs;
+    for (size_t i = 0; i < num_syms; i++) {
+        Symbol *sym = vec_get(obj->syms, i);
+        if (sym->section == SEC_UNDEF) {
+            write_stub(stub, addrs[i]);
+            stubs[i] = stub;
+            stub += STUB_SIZE;
+        } else {
+            addrs[i] = base + l.off[sym->section] + sym->offset;
+        }
+    }
+    Reloc *failed;
+    if (!relocate_all(obj->text_relocs, base + l.off[SEC_TEXT], addrs, stubs, &failed) ||
+            !relocate_all(obj->data_relocs, base + l.off[SEC_DATA], addrs, stubs, &failed)) {
+        munmap(map, map_size);
+        free(addrs);
+        free(stubs);
+        error("'%s' is too far from the JIT's code to be referenced rip-relative",
+              sym_name(failed->sym));
+    }
+
+    uint64_t ro_start = l.off[SEC_RODATA] - l.off[SEC_RODATA] % page;
+    uint64_t data_start = l.off[SEC_DATA] - l.off[SEC_DATA] % page;
+    if (mprotect(base, align_to(l.code_end, page), PROT_READ | PROT_EXEC) != 0 ||
+            (data_start > ro_start && mprotect(base + ro_start, data_start - ro_start, PROT_READ) != 0)) {
+        int err = errno;
+        munmap(map, map_size);
+        free(addrs);
+        free(stubs);
+        error("can't make the JIT's code executable: %s", strerror(err));
+    }
+
+    Jit *jit = calloc(1, sizeof(Jit));
+    jit->mem = map;
+    jit->size = map_size;
+    jit->syms = malloc(sizeof(JitSym) * (num_syms + 1));
+    for (size_t i = 0; i < num_syms; i++) {
+        Symbol *sym = vec_get(obj->syms, i);
+        if (sym->is_global && sym->section != SEC_UNDEF) {
+            jit->syms[jit->num_syms++] = (JitSym) { intern(sym_name(sym)), addrs[i] };
+        }
+    }
+    qsort(jit->syms, jit->num_syms, sizeof(JitSym), cmp_jit_syms);
+    free(addrs);
+    free(stubs);
+    return jit;
+}
+
+void jit_free(Jit *jit) {
+    munmap(jit->mem, jit->size);
+    free(jit->syms);
+    free(jit);
+}
+#else
+Jit * jit_load(Object *obj, JitResolver resolve, void *ctx) {
+    error("the JIT isn't supported on Windows");
+}
+
+void jit_free(Jit *jit) {}
+#endif
+
+void * jit_symbol(Jit *jit, char *name) {
+    JitSym key = { name, NULL };
+    JitSym *sym = bsearch(&key, jit->syms, jit->num_syms, sizeof(JitSym), cmp_jit_syms);
+    return sym ? sym->addr : NULL;
+}
@@ -0,0 +1,41 @@
+
+#ifndef COSEC_JIT_H
+#define COSEC_JIT_H
+
+#include "x64.h"
+
+// In-process JIT. Does the linker's and loader's job on the machine code from
+// 'encode_x64': lays its sections out in freshly mmap'd memory, resolves the
+// symbols it refers to but doesn't define, applies its relocations, and makes
+// the text executable, so its functions can be called straight away.
+//
+// Calls to undefined symbols go through a stub ('jmp [rel addr]') when the
+// symbol is more than 2 GB from the code; other rip-relative references to
+// it (e.g., to an 'extern' variable) can't, and are an error
+
+// Returns the address of 'name' (without the label's leading underscore), or
+// NULL if there's no such symbol
+typedef void * (*JitResolver)(void *ctx, char *name);
+
+typedef struct {
+    char *name;
+    void *addr;
+} JitSym;
+
+typedef struct {
+    char *mem; // The mapping, holding every section
+    size_t size;
+    JitSym *syms; // The globals it defines, sorted by name
+    size_t num_syms;
+} Jit;
+
+// 'resolve' is NULL to look undefined symbols up in the process (as 'dlsym'
+// does)
+Jit * jit_load(Object *obj, JitResolver resolve, void *ctx);
+
+// The address of the global 'name' (as in the C source), or NULL
+void * jit_symbol(Jit *jit, char *name);
+
+void jit_free(Jit *jit);
+
+#endif
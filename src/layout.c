@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "layout.h"
+#include "analysis.h"
+#include "profile.h"
+
+// BBs are laid out in chains, greedily: after placing a BB, its most likely
+// successor that hasn't been placed yet goes next. When there isn't one, the
+// chain ends and the next one starts at the first unplaced BB in the original
+// order. The heuristics (after Ball and Larus, "Branch Prediction for Free",
+// 1993) are that edges which leave a loop are unlikely, and so are edges to a
+// BB that returns. Otherwise the original fallthrough is kept. A branch with a
+// hint from '__builtin_expect' overrides all of them.
+//
+// A loop whose header tests the condition (e.g., 'while' and 'for') is
+// rotated: it's entered at the body, and the header is placed after the
+// latch, so each iteration takes one conditional jump back to the body
+// instead of a jump to the header and a not-taken jump out of the loop.
+//
+// BBs that are cold go after all the others, so the hot path of a function is
+// contiguous and takes fewer i-cache lines. A BB is cold if it calls a
+// function that never returns (as in error handling, e.g., 'exit(1)' or a
+// failed 'assert') or that's declared 'cold', if it's only reached by the unlikely side of a branch
+// hinted with '__builtin_expect', if it ends in '__builtin_unreachable', or if
+// every path to or from it goes through a cold BB. A chain never runs from a hot BB into a cold one.
+//
+// With a profile ('-fprofile-use'), the counts replace the heuristics: the
+// most frequently taken successor comes next, and a BB that never ran is cold.
+
+typedef struct {
+    BB **order;
+    size_t num_placed;
+    int *placed;   // Indexed by 'bb->n'
+    int *deferred; // Headers of rotated loops, placed after their latch
+    int *cold;
+} Layout;
+
+static char *NORETURN_FNS[] = {
+    "exit", "_Exit", "quick_exit", "abort", "longjmp", "siglongjmp",
+    "__assert_fail", "__assert_rtn", // glibc's and macOS's failed 'assert'
+    NULL,
+};
+
+static int is_noreturn_call(IrIns *ins) {
+    if (ins->op != IR_CALL || ins->fn->op != IR_GLOBAL) {
+        return 0;
+    }
+    char *label = ins->fn->g->label;
+    label = label[0] == '_' ? &label[1] : label;
+    for (char **name = NORETURN_FNS; *name; name++) {
+        if (strcmp(label, *name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int calls_cold(BB *bb) {
+    if (bb->ir_last && bb->ir_last->op == IR_UNREACHABLE) {
+        return 1;
+    }
+    for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+        if (is_noreturn_call(ins) || (ins->op == IR_CALL && (call_attrs(ins) & FA_COLD))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The successor that '__builtin_expect' says 'bb' is unlikely to branch to,
+// or NULL
+static BB * unlikely_succ(BB *bb) {
+    IrIns *br = bb->ir_last;
+    if (!br || br->op != IR_CONDBR || br->likely == 0) {
+        return NULL;
+    }
+    return br->likely > 0 ? br->false : br->true;
+}
+
+static int all_cold(Vec *bbs, int *cold) {
+    if (vec_len(bbs) == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < vec_len(bbs); i++) {
+        BB *bb = vec_get(bbs, i);
+        if (!cold[bb->n]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Iterated to a fixed point, starting with everything hot, so a loop that
+// can go round forever stays hot. Whatever's only reached from the unlikely
+// side of a hinted branch is cold too
+static void find_cold(Fn *fn, int *cold) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        cold[bb->n] = calls_cold(bb) || is_cold(bb);
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        BB *unlikely = unlikely_succ(bb);
+        if (unlikely && vec_len(unlikely->pred) == 1) {
+            cold[unlikely->n] = 1;
+        }
+    }
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (BB *bb = fn->last; bb; bb = bb->prev) {
+            if (!cold[bb->n] && (all_cold(bb->succ, cold) ||
+                                 all_cold(bb->pred, cold))) {
+                cold[bb->n] = 1;
+                changed = 1;
+            }
+        }
+    }
+}
+
+static int is_exit(BB *from, BB *to) { // Whether the edge leaves a loop
+    return loop_depth(from) > 0 && !in_loop(to, from->loop);
+}
+
+static int returns(BB *bb) {
+    return bb->ir_last && bb->ir_last->op == IR_RET;
+}
+
+static int has_counts(Vec *bbs) {
+    for (size_t i = 0; i < vec_len(bbs); i++) {
+        if (((BB *) vec_get(bbs, i))->freq < 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Higher is more likely
+static int64_t edge_score(BB *from, BB *to) {
+    if (has_counts(from->succ) && to->freq >= 0) {
+        return to->freq * 2 + (to == from->next); // Ties keep the fallthrough
+    }
+    BB *unlikely = unlikely_succ(from);
+    if (unlikely) {
+        return to == unlikely ? 0 : 8;
+    }
+    int score = 0;
+    if (!is_exit(from, to)) {
+        score += 4;
+    }
+    if (!returns(to)) {
+        score += 2;
+    }
+    if (to == from->next) {
+        score += 1;
+    }
+    return score;
+}
+
+// The body of a loop with header 'header' if it can be rotated, i.e., the
+// header ends with a test that either stays in the loop or leaves it
+static BB * rotated_body(BB *header) {
+    Loop *loop = header->loop;
+    if (!loop || loop->header != header || header->ir_last->op != IR_CONDBR) {
+        return NULL;
+    }
+    BB *t = header->ir_last->true, *f = header->ir_last->false;
+    if (in_loop(t, loop) && !in_loop(f, loop)) {
+        return t;
+    } else if (in_loop(f, loop) && !in_loop(t, loop)) {
+        return f;
+    }
+    return NULL;
+}
+
+static BB * next_in_chain(Layout *l, BB *bb) {
+    BB *best = NULL;
+    int64_t best_score = -1;
+    for (size_t i = 0; i < vec_len(bb->succ); i++) {
+        BB *succ = vec_get(bb->succ, i);
+        BB *body;
+        if (l->placed[succ->n] || (l->cold[succ->n] && !l->cold[bb->n])) {
+            continue;
+        }
+        if (!l->deferred[succ->n] && !in_loop(bb, succ->loop) &&
+                (body = rotated_body(succ)) && !l->placed[body->n] &&
+                !l->cold[body->n]) {
+            l->deferred[succ->n] = 1; // Entering the loop; start at the body
+            succ = body;
+        }
+        int64_t score = edge_score(bb, succ);
+        if (score > best_score) {
+            best = succ;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+// The first unplaced BB in the original order; cold ones only once there are
+// no others left
+static BB * chain_start(Layout *l, BB **hot, BB **cold) {
+    while (*hot && (l->placed[(*hot)->n] || l->cold[(*hot)->n])) {
+        *hot = (*hot)->next;
+    }
+    if (*hot) {
+        return *hot;
+    }
+    while (*cold && l->placed[(*cold)->n]) {
+        *cold = (*cold)->next;
+    }
+    return *cold;
+}
+
+static void place(Layout *l, BB *bb) {
+    l->placed[bb->n] = 1;
+    l->order[l->num_placed++] = bb;
+}
+
+void layout_bbs(Fn *fn) {
+    size_t num_bbs = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->n = num_bbs++;
+    }
+    Layout l = {
+        .order = malloc(sizeof(BB *) * num_bbs),
+        .placed = calloc(num_bbs, sizeof(int)),
+        .deferred = calloc(num_bbs, sizeof(int)),
+        .cold = malloc(sizeof(int) * num_bbs),
+    };
+    find_cold(fn, l.cold);
+    BB *first_hot = fn->entry, *first_cold = fn->entry;
+    BB *bb = fn->entry;
+    while (bb) {
+        place(&l, bb);
+        bb = next_in_chain(&l, bb);
+        if (!bb) { // Start a new chain
+            bb = chain_start(&l, &first_hot, &first_cold);
+        }
+    }
+    assert(l.num_placed == num_bbs);
+
+    for (size_t i = 0; i < num_bbs; i++) {
+        BB *placed = l.order[i];
+        placed->prev = i > 0 ? l.order[i - 1] : NULL;
+        placed->next = i < num_bbs - 1 ? l.order[i + 1] : NULL;
+    }
+    fn->last = l.order[num_bbs - 1];
+    free(l.order);
+    free(l.placed);
+    free(l.deferred);
+    free(l.cold);
+}
+
+// Functions declared 'hot' go first, and 'cold' ones last; otherwise the order
+// is kept. A stable partition, so it's also the order in the assembly
+void layout_fns(Vec *globals) {
+    Vec *hot = vec_new(), *rest = vec_new(), *cold = vec_new();
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        int attrs = g->k == G_FN_DEF ? g->fn_attrs : 0;
+        vec_push((attrs & FA_HOT) ? hot : (attrs & FA_COLD) ? cold : rest, g);
+    }
+    size_t n = 0;
+    Vec *parts[] = { hot, rest, cold };
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < vec_len(parts[i]); j++) {
+            vec_put(globals, n++, vec_get(parts[i], j));
+        }
+        vec_free(parts[i]);
+    }
+}
@@ -0,0 +1,24 @@
+
+#ifndef COSEC_LAYOUT_H
+#define COSEC_LAYOUT_H
+
+#include "compile.h"
+
+// Block placement. Reorders a function's BBs so that the likely successor of
+// each branch falls through, using the counts from '-fprofile-use' if there
+// are any, and otherwise loop info and static branch heuristics (or the hints
+// from '__builtin_expect'). Loops are rotated so the test is at the bottom
+// and the back edge is a conditional jump. Cold BBs (that lead to a call to
+// 'exit', 'abort', and the like, or to a function declared 'cold', that a
+// hint says are unlikely, that can never run ('__builtin_unreachable'), or
+// that never ran in the profile) go at the end.
+// Called by 'assemble' once critical edges are split; requires 'analyse_cfg'
+// and 'analyse_loops'
+void layout_bbs(Fn *fn);
+
+// Function placement. Puts the functions declared 'hot' together at the start
+// of '.text', and the ones declared 'cold' at the end, so the hot ones share
+// i-cache lines and pages. Called once the optimiser's done
+void layout_fns(Vec *globals);
+
+#endif
@@ -5,6 +5,7 @@
 
 #include "lex.h"
 #include "error.h"
+#include "stats.h"
 
 #define TK_FIRST TK_SHL
 
@@ -16,10 +17,21 @@ Lexer * new_lexer(File *f) {
     Lexer *l = malloc(sizeof(Lexer));
     l->parent = NULL;
     l->f = f;
-    l->buf = vec_new();
+    l->stack = NULL;
+    l->num_stack = l->max_stack = 0;
+    l->spans = NULL;
+    l->num_spans = l->max_spans = 0;
+    l->replay = NULL;
     return l;
 }
 
+void free_lexer(Lexer *l) {
+    assert(!l->parent);
+    free(l->stack);
+    free(l->spans);
+    free(l);
+}
+
 static Lexer * copy_lexer(Lexer *l) {
     Lexer *copy = malloc(sizeof(Lexer));
     *copy = *l;
@@ -27,7 +39,8 @@ static Lexer * copy_lexer(Lexer *l) {
 }
 
 static Token * new_tk(Lexer *l, int k) {
-    Token *t = calloc(1, sizeof(Token));
+    Token *t = arena_alloc(ARENA_TOKENS, sizeof(Token));
+    STATS[STAT_TOKENS]++;
     t->k = k;
     t->f = l->f;
     t->line = l->f->line;
@@ -36,7 +49,7 @@ static Token * new_tk(Lexer *l, int k) {
 }
 
 Token * copy_tk(Token *t) {
-    Token *copy = malloc(sizeof(Token));
+    Token *copy = arena_alloc(ARENA_TOKENS, sizeof(Token));
     *copy = *t;
     return copy;
 }
@@ -46,7 +59,10 @@ Token * copy_tk(Token *t) {
 
 static void skip_line_comment(Lexer *l) {
     while (peek_ch(l->f) != EOF && peek_ch(l->f) != '\n') {
-        next_ch(l->f);
+        skip_chs(l->f, span_line_chs(l->f));
+        if (peek_ch(l->f) != '\n') {
+            next_ch(l->f); // A splice or pushed back character
+        }
     }
 }
 
@@ -54,6 +70,7 @@ static void skip_block_comment(Lexer *l) {
     Token *err = new_tk(l, -1);
     int c = next_ch(l->f);
     while (c != EOF && !(c == '*' && peek_ch(l->f) == '/')) {
+        skip_chs(l->f, span_comment_chs(l->f)); // Up to the next '*' or newline
         c = next_ch(l->f);
     }
     if (c == EOF) {
@@ -66,6 +83,7 @@ static int skip_space(Lexer *l) {
     int c = peek_ch(l->f);
     if (isspace(c) && c != '\n') { // Handle newlines separately
         next_ch(l->f);
+        skip_chs(l->f, span_space_chs(l->f)); // The rest of the run of spaces
         return 1;
     } else if (c == '/' && peek2_ch(l->f) == '/') {
         skip_line_comment(l);
@@ -87,20 +105,37 @@ static int skip_spaces(Lexer *l) {
 // ---- Values and Symbols ----------------------------------------------------
 
 static Token * lex_ident(Lexer *l) {
+    static THREAD_LOCAL Buf *b = NULL; // Scratch space, reused since the ident is interned
+    if (!b) {
+        b = buf_new();
+    }
     Token *t = new_tk(l, TK_IDENT);
-    Buf *b = buf_new();
+    char *start = l->f->p;
+    size_t len = span_ident_chs(l->f);
+    skip_chs(l->f, len);
+    if (!isalnum(peek_ch(l->f)) && peek_ch(l->f) != '_') {
+        t->ident = intern_n(start, len); // Interned straight from the file
+        return t;
+    }
+    b->len = 0; // Split by a splice or pushed back characters
+    if (len > 0) {
+        buf_nprint(b, start, len);
+    }
     while (isalnum(peek_ch(l->f)) || peek_ch(l->f) == '_') {
         int c = next_ch(l->f);
         buf_push(b, (char) c);
     }
-    buf_push(b, '\0');
-    t->ident = b->data;
+    t->ident = intern_n(b->data, b->len);
     return t;
 }
 
 static Token * lex_num(Lexer *l) {
+    static THREAD_LOCAL Buf *b = NULL; // Scratch space, reused since the number is interned
+    if (!b) {
+        b = buf_new();
+    }
+    b->len = 0;
     Token *t = new_tk(l, TK_NUM);
-    Buf *b = buf_new();
     int last = EOF;
     while (isalnum(peek_ch(l->f)) || peek_ch(l->f) == '.' ||
             (strchr("eEpP", last) && strchr("+-", peek_ch(l->f)))) {
@@ -108,8 +143,7 @@ static Token * lex_num(Lexer *l) {
         buf_push(b, (char) c);
         last = c;
     }
-    buf_push(b, '\0');
-    t->num = b->data;
+    t->num = intern_n(b->data, b->len); // Tables repeat the same few numbers a lot
     return t;
 }
 
@@ -233,6 +267,11 @@ static Token * lex_str(Lexer *l) {
         } else {
             buf_push(b, (char) c);
         }
+        size_t len = span_str_chs(l->f); // Copy a run of plain characters at once
+        if (len > 0) {
+            buf_nprint(b, l->f->p, len);
+            skip_chs(l->f, len);
+        }
         c = next_ch(l->f);
     }
     if (c == EOF) {
@@ -301,10 +340,34 @@ static Token * lex_sym(Lexer *l) {
 
 // ---- Tokens ----------------------------------------------------------------
 
+static Token * replay_tk(Lexer *l) {
+    if (l->f->line != l->replay_line) { // Changed by '#line'
+        l->line_offset += l->f->line - l->replay_line;
+    }
+    Token *proto = &l->replay[l->next_replay];
+    if (l->next_replay < l->num_replay - 1) {
+        l->next_replay++; // Stay on the final 'TK_EOF'
+    }
+    int line = proto->line + l->line_offset;
+    l->f->line = l->replay_line = line;
+    l->f->col = proto->col;
+    if (proto->k == TK_NEWLINE) {
+        return NEWLINE_TK;
+    }
+    Token *t = copy_tk(proto);
+    STATS[STAT_TOKENS]++;
+    t->f = l->f;
+    t->line = line;
+    return t;
+}
+
 static Token * lex_tk_raw(Lexer *l) {
     if (!l->f) {
         return EOF_TK;
     }
+    if (l->replay) {
+        return replay_tk(l);
+    }
     if (skip_spaces(l)) {
         return SPACE_TK;
     }
@@ -329,20 +392,53 @@ static Token * lex_tk_raw(Lexer *l) {
     }
 }
 
+static Token * next_span_tk(Span *s) {
+    Token *t = s->tks[s->next++];
+    if (s->copy) {
+        t = copy_tk(t);
+    }
+    t->hide_set = set_union(t->hide_set, s->hide_set);
+    if (s->pos) { // For error messages
+        t->f = s->pos->f;
+        t->line = s->pos->line;
+        t->col = s->pos->col;
+    }
+    if (s->next == 1 && s->first_space >= 0) {
+        t->has_preceding_space = s->first_space;
+    }
+    return t;
+}
+
 static Token * lex_tk(Lexer *l) {
+    while (l->num_spans > 0) {
+        Span *s = &l->spans[l->num_spans - 1];
+        if (l->num_stack > s->base) {
+            break; // Tokens pushed back on top of the span
+        }
+        if (s->next < s->num) {
+            return next_span_tk(s);
+        }
+        l->num_spans--;
+    }
     Token *t;
-    if (vec_len(l->buf) > 0) {
-        t = vec_pop(l->buf);
+    if (l->num_stack > 0) {
+        t = l->stack[--l->num_stack];
     } else {
         t = lex_tk_raw(l);
         while (t->k == TK_SPACE) {
             t = lex_tk_raw(l);
-            t->has_preceding_space = 1;
+            if (!is_shared_tk(t)) {
+                t->has_preceding_space = 1;
+            }
         }
     }
     return t;
 }
 
+int is_shared_tk(Token *t) {
+    return t == SPACE_TK || t == NEWLINE_TK || t == EOF_TK;
+}
+
 Token * next_raw_tk(Lexer *l) {
     Token *t = lex_tk(l);
     if (l->parent && t->k == TK_EOF) {
@@ -352,20 +448,57 @@ Token * next_raw_tk(Lexer *l) {
     return t;
 }
 
+static void reserve_stack(Lexer *l, size_t n) {
+    if (l->num_stack + n > l->max_stack) {
+        l->max_stack = l->max_stack ? l->max_stack : 16;
+        while (l->max_stack < l->num_stack + n) {
+            l->max_stack *= 2;
+        }
+        l->stack = realloc(l->stack, sizeof(Token *) * l->max_stack);
+    }
+}
+
 void undo_raw_tk(Lexer *l, Token *t) {
     if (t->k == TK_EOF) {
         return;
     }
-    vec_push(l->buf, t);
+    reserve_stack(l, 1);
+    l->stack[l->num_stack++] = t;
 }
 
 void undo_raw_tks(Lexer *l, Vec *tks) {
-    for (size_t i = 0; i < vec_len(tks); i++) {
-        undo_raw_tk(l, vec_get(tks, vec_len(tks) - i - 1));
+    size_t n = tks->len;
+    reserve_stack(l, n);
+    Token **top = &l->stack[l->num_stack];
+    size_t pushed = 0;
+    for (size_t i = n; i > 0; i--) {
+        Token *t = tks->data[i - 1];
+        if (t->k != TK_EOF) {
+            top[pushed++] = t;
+        }
     }
+    l->num_stack += pushed;
+}
+
+void undo_raw_span(Lexer *l, Span *s) {
+    if (s->num == 0) {
+        return;
+    }
+    if (l->num_spans == l->max_spans) {
+        l->max_spans = l->max_spans ? l->max_spans * 2 : 16;
+        l->spans = realloc(l->spans, sizeof(Span) * l->max_spans);
+    }
+    Span *top = &l->spans[l->num_spans++];
+    *top = *s;
+    top->next = 0;
+    top->base = l->num_stack;
 }
 
 Token * peek_raw_tk(Lexer *l) {
+    size_t base = l->num_spans > 0 ? l->spans[l->num_spans - 1].base : 0;
+    if (l->num_stack > base) {
+        return l->stack[l->num_stack - 1];
+    }
     Token *t = next_raw_tk(l);
     undo_raw_tk(l, t);
     return t;
@@ -383,18 +516,97 @@ void push_lexer(Lexer *l, File *f) {
     Lexer *parent = copy_lexer(l);
     l->parent = parent;
     l->f = f;
-    l->buf = vec_new();
+    l->stack = NULL;
+    l->num_stack = l->max_stack = 0;
+    l->spans = NULL;
+    l->num_spans = l->max_spans = 0;
+    l->replay = NULL;
 }
 
 void pop_lexer(Lexer *l) {
     assert(l->parent);
-    *l = *l->parent;
+    Lexer *parent = l->parent;
+    free(l->stack);
+    free(l->spans);
+    *l = *parent;
+    free(parent);
+}
+
+void push_replay_lexer(Lexer *l, File *f, Token *tks, size_t num) {
+    assert(num > 0 && tks[num - 1].k == TK_EOF);
+    push_lexer(l, f);
+    l->replay = tks;
+    l->num_replay = num;
+    l->next_replay = 0;
+    l->replay_line = l->line_offset = 0;
+    f->line = 0;
+}
+
+static Token * copy_out(Vec *tks, Token *t) {
+    Token *copy = copy_tk(t);
+    copy->f = NULL;
+    vec_push(tks, copy);
+    return copy;
+}
+
+Token * lex_all(File *f, size_t *num) {
+    Lexer *l = new_lexer(f);
+    Vec *tks = vec_new();
+    int directive = 0; // After a '#' at the start of a line
+    while (1) {
+        Token *t = lex_tk(l);
+        if (t->k == TK_NEWLINE) { // Remember the line the newline goes to
+            Token nl = { .k = TK_NEWLINE, .line = f->line, .col = f->col };
+            copy_out(tks, &nl);
+            directive = 0;
+            continue;
+        }
+        copy_out(tks, t);
+        if (t->k == TK_EOF) {
+            break;
+        }
+        if (directive && t->k == TK_IDENT && (strcmp(t->ident, "include") == 0 ||
+                                              strcmp(t->ident, "import") == 0)) {
+            Token *path = new_tk(l, TK_INCLUDE_PATH);
+            int search_cwd;
+            char *file = lex_include_path(l, &search_cwd);
+            if (file) { // Otherwise a macro, lexed as usual
+                Buf *b = buf_new();
+                buf_push(b, search_cwd ? '"' : '<');
+                buf_print(b, file);
+                buf_push(b, search_cwd ? '"' : '>');
+                path->str = b->data;
+                path->len = b->len;
+                copy_out(tks, path);
+            }
+        } else if (directive && t->k == TK_IDENT && (strcmp(t->ident, "error") == 0 ||
+                                                     strcmp(t->ident, "warning") == 0)) {
+            Token *rest = new_tk(l, TK_REST_OF_LINE);
+            rest->str = lex_rest_of_line(l); // Including the newline
+            rest->len = strlen(rest->str);
+            copy_out(tks, rest);
+        }
+        directive = t->k == '#' && t->col == 1;
+    }
+
+    // Copy into one array, out of the tokens arena
+    *num = vec_len(tks);
+    Token *protos = malloc(sizeof(Token) * *num);
+    for (size_t i = 0; i < *num; i++) {
+        protos[i] = *(Token *) vec_get(tks, i);
+    }
+    return protos;
 }
 
 
 // ---- Special Preprocessor Functions ----------------------------------------
 
 char * lex_rest_of_line(Lexer *l) {
+    if (l->replay) {
+        Token *t = lex_tk(l);
+        assert(t->k == TK_REST_OF_LINE);
+        return t->str;
+    }
     skip_spaces(l);
     Buf *b = buf_new();
     int c = next_ch(l->f);
@@ -407,6 +619,15 @@ char * lex_rest_of_line(Lexer *l) {
 }
 
 char * lex_include_path(Lexer *l, int *search_cwd) {
+    if (l->replay) {
+        Token *t = lex_tk(l);
+        if (t->k != TK_INCLUDE_PATH) {
+            undo_raw_tk(l, t);
+            return NULL; // No include path
+        }
+        *search_cwd = t->str[0] == '"';
+        return str_ncopy(&t->str[1], t->len - 2);
+    }
     skip_spaces(l);
     Token *err = new_tk(l, -1);
     char close;
@@ -435,17 +656,65 @@ char * lex_include_path(Lexer *l, int *search_cwd) {
     return b->data;
 }
 
-Token * glue_tks(Lexer *l, Token *t1, Token *t2) {
-    Buf *b = buf_new();
-    buf_print(b, token2str(t1));
-    buf_print(b, token2str(t2));
-    buf_push(b, '\0');
-    undo_chs(l->f, b->data, b->len);
-    Token *glued = lex_tk(l);
-    glued->has_preceding_space = t1->has_preceding_space;
-    if (next_ch(l->f) != '\0') {
+static int has_pushed_back_tks(Lexer *l) {
+    while (l->num_spans > 0) { // Drop finished spans
+        Span *s = &l->spans[l->num_spans - 1];
+        if (s->next < s->num || l->num_stack > s->base) {
+            break;
+        }
+        l->num_spans--;
+    }
+    return l->num_stack > 0 || l->num_spans > 0;
+}
+
+void skip_to_directive(Lexer *l) {
+    if (!l->f || has_pushed_back_tks(l)) {
+        return; // The caller skips these token by token
+    }
+    if (l->replay) {
+        while (l->next_replay < l->num_replay - 1) { // Stay on the final 'TK_EOF'
+            Token *proto = &l->replay[l->next_replay];
+            if (proto->k == '#' && proto->col == 1) {
+                break;
+            }
+            l->next_replay++;
+        }
+        return;
+    }
+    skip_chs_to_directive(l->f);
+}
+
+static char * tk_spelling(Token *t) {
+    switch (t->k) {
+    case TK_IDENT: return t->ident;
+    case TK_NUM:   return t->num;
+    default:       return token2str(t);
+    }
+}
+
+Token * glue_tks(Token *t1, Token *t2) {
+    // Lex the glued token from its own file, since the lexer it came from may
+    // have no file (for macro argument pre-expansion) or tokens pushed back.
+    // The file just views the scratch buffer, which is reused since whatever
+    // the token holds onto is interned or copied
+    static THREAD_LOCAL File *f = NULL;
+    static THREAD_LOCAL Buf *b = NULL;
+    if (!f) {
+        f = new_empty_file("<glued token>");
+        b = buf_new();
+    }
+    b->len = 0;
+    buf_print(b, tk_spelling(t1));
+    buf_print(b, tk_spelling(t2));
+    size_t len = b->len;
+    buf_push(b, '\0'); // For the error message
+    view_chs(f, b->data, len);
+    Lexer l = { .f = f };
+    Token *glued = lex_tk_raw(&l);
+    if (is_shared_tk(glued) || f->p != f->end) { // e.g., '/' '/' is a comment
         error_at(t1, "macro concatenation formed invalid token '%s'", b->data);
     }
+    glued->has_preceding_space = t1->has_preceding_space;
     return glued;
 }
 
@@ -455,12 +724,14 @@ Token * glue_tks(Lexer *l, Token *t1, Token *t2) {
 static char *TK_NAMES[TK_LAST - TK_FIRST] = {
     "<<", ">>", "==", "!=", "<=", ">=", "&&", "||", "+=", "-=", "*=", "/=",
     "%=", "&=", "|=", "^=", "<<=", ">>=", "++", "--", "->", "...", "##",
-    "void", "char", "short", "int", "long", "float", "double", "signed",
-    "unsigned", "struct", "union", "enum", "typedef", "auto", "static",
-    "extern", "register", "inline", "const", "restrict", "volatile", "sizeof",
-    "if", "else", "while", "do", "for", "switch", "case", "default", "break",
-    "continue", "goto", "return", "number", "character", "string",
-    "identifier", "end of file", "space", "newline", "macro parameter",
+    "void", "char", "short", "int", "long", "__int128", "float", "double",
+    "signed", "unsigned", "struct", "union", "enum", "typedef", "auto", "static",
+    "extern", "register", "_Thread_local", "inline", "const", "restrict",
+    "volatile", "_Atomic", "_Alignas", "__attribute__", "sizeof", "if",
+    "else", "while", "do", "for", "switch", "case", "default", "break",
+    "continue", "goto", "return", "__asm__", "number", "character", "string",
+    "identifier",
+    "end of file", "'#pragma unroll'", "space", "newline", "macro parameter",
 };
 
 char * tk2str(int t) {
@@ -490,7 +761,7 @@ char * token2str(Token *t) {
     case TK_IDENT: buf_printf(b, "%s", t->ident); break;
     case TK_CH:
         write_encoding(b, t->enc);
-        buf_printf(b, "'%c'", quote_ch((char) t->ch));
+        buf_printf(b, "'%s'", quote_ch((char) t->ch));
         break;
     case TK_STR:
         write_encoding(b, t->enc);
@@ -522,7 +793,7 @@ char * token2pretty(Token *t) {
     case TK_CH:
         buf_print(b, "character ");
         write_encoding(b, t->enc);
-        buf_printf(b, "'%c'", quote_ch((char) t->ch));
+        buf_printf(b, "'%s'", quote_ch((char) t->ch));
         break;
     case TK_STR:
         buf_print(b, "string ");
@@ -42,6 +42,7 @@ enum {
     TK_SHORT,
     TK_INT,
     TK_LONG,
+    TK_INT128, // '__int128'
     TK_FLOAT,
     TK_DOUBLE,
     TK_SIGNED,
@@ -55,12 +56,17 @@ enum {
     TK_STATIC,
     TK_EXTERN,
     TK_REGISTER,
+    TK_THREAD_LOCAL, // '_Thread_local'
 
     TK_INLINE,
 
     TK_CONST,
     TK_RESTRICT,
     TK_VOLATILE,
+    TK_ATOMIC, // '_Atomic'
+    TK_ALIGNAS, // '_Alignas'
+
+    TK_ATTRIBUTE,
 
     // Statements
     TK_SIZEOF,
@@ -76,6 +82,7 @@ enum {
     TK_CONTINUE,
     TK_GOTO,
     TK_RETURN,
+    TK_ASM, // Also 'asm' and '__asm'
 
     // Values
     TK_NUM,
@@ -83,15 +90,21 @@ enum {
     TK_STR,
     TK_IDENT,
     TK_EOF,
+    TK_PRAGMA_UNROLL, // '#pragma unroll' (and friends), before a loop
 
     // Preprocessor only
     TK_SPACE,
     TK_NEWLINE,
     TK_MACRO_PARAM,
+    TK_INCLUDE_PATH, // Replayed by 'lex_include_path'; with its '""' or '<>'
+    TK_REST_OF_LINE, // Replayed by 'lex_rest_of_line'
 
     TK_LAST, // For tables indexed by token
 };
 
+#define FIRST_KEYWORD TK_VOID
+#define LAST_KEYWORD  TK_ASM
+
 enum { // In order of element size
     ENC_NONE,   // UTF-8 (default)
     ENC_CHAR16, // u"..." (UTF-16)
@@ -99,47 +112,95 @@ enum { // In order of element size
     ENC_CHAR32, // U"..." (UTF-32)
 };
 
+#define UNROLL_FULL (-1) // '#pragma unroll' without a factor
+
+// Packed into 40 bytes (5 words), since tokens are copied on every macro
+// substitution
 typedef struct {
-    int k;
-    File *f;
+    int16_t k;
+    uint8_t has_preceding_space;
+    uint8_t enc; // TK_CH and TK_STR
     int line, col;
-    int has_preceding_space;
+    uint32_t len; // TK_STR (NOT null terminated)
+    File *f;
     union {
-        char *ident; // TK_IDENT
-        char *num;   // TK_NUM
-        struct {
-            int enc;
-            union {
-                int ch; // TK_CH
-                struct { char *str; size_t len; }; // TK_STR
-            };
-        };
+        char *ident;      // TK_IDENT
+        char *num;        // TK_NUM
+        int ch;           // TK_CH
+        char *str;        // TK_STR
         size_t param_idx; // TK_MACRO_PARAM
+        int unroll;       // TK_PRAGMA_UNROLL; the factor, 1 for 'nounroll',
+                          // or UNROLL_FULL
     };
     Set *hide_set; // For macro expansion in the preprocessor
 } Token;
 
+// A run of tokens pushed back onto the lexer without copying them one by one
+// (part of a macro body, or a macro argument). Each token is only copied (for
+// a macro body, which is shared between expansions) and given 'hide_set' and
+// 'pos' lazily, when it's read
+typedef struct {
+    Token **tks;
+    size_t num, next;
+    size_t base;     // 'num_stack' when pushed; tokens above it are read first
+    int copy;        // Copy each token before modifying it
+    Set *hide_set;   // Added to each token
+    Token *pos;      // If not NULL, file, line and column for each token
+    int first_space; // If not -1, 'has_preceding_space' for the first token
+} Span;
+
 typedef struct Lexer {
     struct Lexer *parent; // For '#include's in the preprocessor
     File *f;
-    Vec *buf;
+
+    // Tokens pushed back onto the lexer (lookahead, and the results of macro
+    // expansion), in reverse order so the next token is on top. Macro
+    // expansions are pushed as spans, which are read lazily
+    Token **stack;
+    size_t num_stack, max_stack;
+    Span *spans; // Read before the stack below their 'base'
+    size_t num_spans, max_spans;
+
+    // Tokens replayed from the header cache, instead of lexing 'f' (which
+    // then has no contents)
+    Token *replay;
+    size_t num_replay, next_replay;
+    int replay_line, line_offset; // For '#line'
 } Lexer;
 
 Lexer * new_lexer(File *f);
+void free_lexer(Lexer *l);
 Token * next_raw_tk(Lexer *l);
 Token * peek_raw_tk(Lexer *l);
 Token * expect_raw_tk(Lexer *l, int tk);
 void undo_raw_tk(Lexer *l, Token *t);
 void undo_raw_tks(Lexer *l, Vec *tks);
+void undo_raw_span(Lexer *l, Span *s);
 void push_lexer(Lexer *l, File *f);
 void pop_lexer(Lexer *l);
 
+// For the header cache. 'lex_all' lexes all of 'f' up front, into tokens that
+// don't point into any arena or file, ending with 'TK_EOF'. The text after
+// '#include' and '#error' is kept as 'TK_INCLUDE_PATH' and 'TK_REST_OF_LINE'
+// tokens. 'push_replay_lexer' includes a file by replaying them
+Token * lex_all(File *f, size_t *num);
+void push_replay_lexer(Lexer *l, File *f, Token *tks, size_t num);
+
 Token * copy_tk(Token *t);
 
+// Spaces, newlines and EOFs are the same token everywhere (shared between
+// threads), so nothing should be written to them
+int is_shared_tk(Token *t);
+
 // Special preprocessor functions
 char * lex_rest_of_line(Lexer *l);                  // '#error' and '#warning'
 char * lex_include_path(Lexer *l, int *search_cwd); // '#include' and '#import'
-Token * glue_tks(Lexer *l, Token *t1, Token *t2);   // '##' operator
+Token * glue_tks(Token *t1, Token *t2);             // '##' operator
+
+// For skipping a false '#if' block: moves past everything up to the next '#'
+// at the start of a line without lexing it. Does nothing while there are
+// tokens pushed back, which the caller has to skip one at a time
+void skip_to_directive(Lexer *l);
 
 // Token printing
 char * tk2str(int t);
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+
+#include "licm.h"
+#include "analysis.h"
+#include "alias.h"
+
+// An instruction is invariant if all its operands are defined outside the
+// loop (or are invariant themselves). Loops are visited innermost first, so
+// something hoisted out of an inner loop can carry on out of the loops that
+// enclose it.
+//
+// Instructions that can fault (loads and divisions) might not have run at
+// all in the original program, so they're only hoisted if their BB runs on
+// every iteration (i.e., it dominates every exit and back edge). Loads also
+// need nothing in the loop to write to memory they might read (see 'alias.h');
+// a call to a 'pure' or 'const' function doesn't write to any.
+
+// ---- Preheaders ------------------------------------------------------------
+
+// Moves the phi entries for the edges coming into the loop from outside over
+// to the preheader, merging them with a new phi if there's more than one
+static void split_phi(IrIns *phi, Loop *loop, BB *pre) {
+    IrIns *merged = new_ins(IR_PHI, phi->t);
+    for (size_t i = 0; i < vec_len(phi->preds); i++) {
+        BB *pred = vec_get(phi->preds, i);
+        if (!in_loop(pred, loop)) {
+            vec_push(merged->preds, pred);
+            vec_push(merged->defs, vec_get(phi->defs, i));
+            vec_remove(phi->preds, i);
+            vec_remove(phi->defs, i--);
+        }
+    }
+    IrIns *def;
+    if (vec_len(merged->defs) == 1) {
+        def = vec_get(merged->defs, 0); // Doesn't need a phi
+    } else {
+        insert_ir(merged, pre->ir_head);
+        def = merged;
+    }
+    vec_push(phi->preds, pre);
+    vec_push(phi->defs, def);
+}
+
+static BB * new_preheader(Loop *loop) {
+    BB *header = loop->header;
+    BB *pre = new_bb();
+    IrIns *br = new_ins(IR_BR, NULL);
+    br->br = header;
+    br->bb = pre;
+    pre->ir_head = pre->ir_last = br;
+
+    // Put it just before the header so it falls through
+    pre->prev = header->prev;
+    pre->next = header;
+    if (header->prev) {
+        header->prev->next = pre;
+    }
+    header->prev = pre;
+
+    for (size_t i = 0; i < vec_len(header->pred); i++) {
+        BB *pred = vec_get(header->pred, i);
+        if (!in_loop(pred, loop)) {
+            retarget_br(pred->ir_last, header, pre);
+        }
+    }
+    for (IrIns *ins = header->ir_head; ins && ins->op == IR_PHI; ins = ins->next) {
+        split_phi(ins, loop, pre);
+    }
+    return pre;
+}
+
+// A header whose address is taken can't have its edges from an IR_INDIRECT_BR
+// moved to a preheader, so its loop is left without one
+static int add_preheaders(Fn *fn) {
+    int changed = 0;
+    for (size_t i = 0; i < vec_len(fn->loops); i++) {
+        Loop *loop = vec_get(fn->loops, i);
+        if (loop->header != fn->entry && !loop->header->addr_taken &&
+                !find_preheader(loop)) {
+            new_preheader(loop);
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+
+// ---- Hoisting --------------------------------------------------------------
+
+// A load straight from a global's address can't fault (e.g., of a flag that
+// the loop tests)
+static int can_fault(IrIns *ins) {
+    return (ins->op == IR_LOAD && ins->src->op != IR_GLOBAL) ||
+           ins->op == IR_SDIV || ins->op == IR_UDIV ||
+           ins->op == IR_SMOD || ins->op == IR_UMOD;
+}
+
+// Comparisons are left where they are so they can still be folded into the
+// branch that uses them
+static int is_hoistable(IrIns *ins) {
+    return ins->op == IR_IMM || ins->op == IR_FP || ins->op == IR_GLOBAL ||
+           ins->op == IR_LOAD || ins->op == IR_PTRADD ||
+           (ins->op >= IR_ADD && ins->op <= IR_BSWAP) ||
+           (ins->op >= IR_TRUNC && ins->op <= IR_I2FP);
+}
+
+static Vec * mem_writes(Loop *loop) {
+    Vec *writes = vec_new(); // of 'IrIns *'
+    for (size_t i = 0; i < vec_len(loop->bbs); i++) {
+        BB *bb = vec_get(loop->bbs, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_STORE || ins->op == IR_COPY ||
+                    ins->op == IR_ZERO || ins->op == IR_ASM || is_atomic(ins) ||
+                    (ins->op == IR_CALL && !(call_attrs(ins) & (FA_PURE | FA_CONST)))) {
+                vec_push(writes, ins);
+            }
+        }
+    }
+    return writes;
+}
+
+static int is_clobbered(IrIns *load, Vec *writes) {
+    for (size_t i = 0; i < vec_len(writes); i++) {
+        if (may_clobber(vec_get(writes, i), load)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether 'bb' runs on every iteration, i.e., before the loop is left or goes
+// back around to the header
+static int runs_every_iteration(BB *bb, Loop *loop) {
+    for (size_t i = 0; i < vec_len(loop->bbs); i++) {
+        BB *from = vec_get(loop->bbs, i);
+        for (size_t j = 0; j < vec_len(from->succ); j++) {
+            BB *succ = vec_get(from->succ, j);
+            int leaves = !in_loop(succ, loop) || succ == loop->header;
+            if (leaves && !dominates(bb, from)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static int is_invariant(IrIns *ins, Loop *loop, Vec *writes) {
+    if (!is_hoistable(ins)) {
+        return 0;
+    }
+    if (can_fault(ins) && !runs_every_iteration(ins->bb, loop)) {
+        return 0;
+    }
+    IrIns **oprs[3];
+    int num_oprs = ir_operands(ins, oprs);
+    for (int i = 0; i < num_oprs; i++) {
+        if (in_loop((*oprs[i])->bb, loop)) {
+            return 0;
+        }
+    }
+    return ins->op != IR_LOAD || !is_clobbered(ins, writes);
+}
+
+static int cmp_rpo(const void *a, const void *b) {
+    BB *l = *(BB **) a, *r = *(BB **) b;
+    return l->rpo - r->rpo;
+}
+
+// Visits the loop's BBs in reverse postorder, so an instruction's operands are
+// always looked at (and maybe hoisted) before it is
+static void hoist(Loop *loop, BB *pre) {
+    Vec *writes = mem_writes(loop);
+    size_t num_bbs = vec_len(loop->bbs);
+    BB **bbs = malloc(sizeof(BB *) * num_bbs);
+    for (size_t i = 0; i < num_bbs; i++) {
+        bbs[i] = vec_get(loop->bbs, i);
+    }
+    qsort(bbs, num_bbs, sizeof(BB *), cmp_rpo);
+    for (size_t i = 0; i < num_bbs; i++) {
+        IrIns *ins = bbs[i]->ir_head;
+        while (ins) {
+            IrIns *next = ins->next;
+            if (is_invariant(ins, loop, writes)) {
+                delete_ir(ins);
+                insert_ir(ins, pre->ir_last);
+            }
+            ins = next;
+        }
+    }
+    free(bbs);
+}
+
+void licm(Fn *fn) {
+    analyse_escapes(fn);
+    if (add_preheaders(fn)) {
+        analyse_cfg(fn);
+        analyse_dominators(fn);
+        analyse_loops(fn);
+    }
+    for (size_t i = vec_len(fn->loops); i > 0; i--) { // Innermost first
+        Loop *loop = vec_get(fn->loops, i - 1);
+        BB *pre = find_preheader(loop);
+        if (pre) {
+            hoist(loop, pre);
+        }
+    }
+}
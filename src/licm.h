@@ -0,0 +1,13 @@
+
+#ifndef COSEC_LICM_H
+#define COSEC_LICM_H
+
+#include "compile.h"
+
+// Loop-invariant code motion. Gives every loop a preheader (a BB that's the
+// only way into the loop from outside it) and hoists pure instructions that
+// compute the same value on every iteration into it. Requires 'analyse', and
+// keeps it up to date
+void licm(Fn *fn);
+
+#endif
@@ -0,0 +1,217 @@
+
+#include "lto.h"
+#include "error.h"
+
+
+// ---- Linking ---------------------------------------------------------------
+
+// Labels are compared interned. A declaration and a definition are different
+// 'Global's with the same label (even in one file), so after merging, every
+// reference to a label is pointed at one 'Global' for it: the definition, or
+// if there isn't one (it's in a library), the first declaration
+
+static char * c_name(char *label) { // For errors
+    return label[0] == '_' ? label + 1 : label;
+}
+
+// Renames the 'static' globals in 'module' whose labels are already 'taken',
+// by adding a suffix, then takes their labels
+static void rename_statics(Vec *module, size_t idx, Map *taken) {
+    Map *renamed = map_new(); // of the new label, by interned old label
+    for (size_t i = 0; i < vec_len(module); i++) {
+        Global *g = vec_get(module, i);
+        if (g->linkage != LINK_STATIC) {
+            continue;
+        }
+        char *label = intern(g->label);
+        char *new_label = map_get(renamed, label);
+        if (!new_label) {
+            new_label = label;
+            for (size_t n = idx; map_get(taken, new_label); n++) {
+                Buf *b = buf_new();
+                buf_printf(b, "%s.%zu", label, n);
+                new_label = intern(b->data);
+                buf_free(b);
+            }
+            map_put(taken, new_label, new_label);
+            map_put(renamed, label, new_label);
+        }
+        g->label = new_label;
+    }
+    map_free(renamed);
+}
+
+static Global * resolve(Map *canon, Global *g) {
+    return map_get(canon, intern(g->label));
+}
+
+static void resolve_refs(Map *canon, Global *g) {
+    switch (g->k) {
+    case G_FN_DEF:
+        for (BB *bb = g->fn->entry; bb; bb = bb->next) {
+            for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+                if (ins->op == IR_GLOBAL) {
+                    ins->g = resolve(canon, ins->g);
+                }
+            }
+        }
+        break;
+    case G_PTR: g->g = resolve(canon, g->g); break;
+    case G_INIT:
+        for (size_t i = 0; i < vec_len(g->relocs); i++) {
+            InitReloc *r = vec_get(g->relocs, i);
+            r->g = resolve(canon, r->g);
+        }
+        break;
+    default: break;
+    }
+}
+
+Vec * lto_link(Vec *modules) {
+    Map *taken = map_new(); // Every label that isn't 'static'
+    for (size_t i = 0; i < vec_len(modules); i++) {
+        Vec *module = vec_get(modules, i);
+        for (size_t j = 0; j < vec_len(module); j++) {
+            Global *g = vec_get(module, j);
+            if (g->linkage != LINK_STATIC) {
+                char *label = intern(g->label);
+                map_put(taken, label, label);
+            }
+        }
+    }
+    for (size_t i = 0; i < vec_len(modules); i++) {
+        rename_statics(vec_get(modules, i), i, taken);
+    }
+
+    Map *canon = map_new(); // of 'Global *', by interned label
+    for (size_t i = 0; i < vec_len(modules); i++) {
+        Vec *module = vec_get(modules, i);
+        for (size_t j = 0; j < vec_len(module); j++) {
+            Global *g = vec_get(module, j);
+            char *label = intern(g->label);
+            Global *prev = map_get(canon, label);
+            if (prev) { // Any declaration's attributes hold for the definition
+                g->fn_attrs |= prev->fn_attrs;
+                prev->fn_attrs |= g->fn_attrs;
+                if (!g->visibility) {
+                    g->visibility = prev->visibility;
+                }
+                prev->visibility = g->visibility;
+            }
+            if (!prev || (prev->k == G_NONE && g->k != G_NONE)) {
+                map_put(canon, label, g);
+            } else if (prev->k != G_NONE && g->k != G_NONE) {
+                error("multiple definitions of '%s'", c_name(label));
+            }
+        }
+    }
+
+    Vec *globals = vec_new();
+    char *main_label = intern("_main");
+    for (size_t i = 0; i < vec_len(modules); i++) {
+        Vec *module = vec_get(modules, i);
+        for (size_t j = 0; j < vec_len(module); j++) {
+            Global *g = vec_get(module, j);
+            char *label = intern(g->label);
+            if (map_get(canon, label) != g) {
+                continue; // A declaration of something defined elsewhere
+            }
+            resolve_refs(canon, g);
+            if (g->k != G_NONE && label != main_label) {
+                g->linkage = LINK_STATIC;
+            }
+            vec_push(globals, g);
+        }
+    }
+    map_free(taken);
+    map_free(canon);
+    return globals;
+}
+
+
+// ---- Read Only Globals -----------------------------------------------------
+
+// An address derived from a global, through IR_PTRADDs and IR_BITCASTs, is
+// only read from if every use is as an IR_LOAD's or IR_COPY's source, or to
+// derive another address. Anything else (stores, calls, phis, ...) might
+// write to it, or let it escape to something that does. Inline assembly can
+// refer to globals by name, so a program with any is left alone
+
+static Global * derived_from(IrIns *addr) {
+    while (addr->op == IR_PTRADD || addr->op == IR_BITCAST) {
+        addr = addr->op == IR_PTRADD ? addr->base : addr->l;
+    }
+    return addr->op == IR_GLOBAL ? addr->g : NULL;
+}
+
+static int only_reads(IrIns *user, IrIns **opr) {
+    switch (user->op) {
+    case IR_LOAD: case IR_COPY: return opr == &user->src;
+    case IR_PTRADD: return opr == &user->base;
+    case IR_BITCAST: return 1;
+    default: return 0;
+    }
+}
+
+static void mark_written(Map *written, Global *g) {
+    if (g) {
+        char *label = intern(g->label);
+        map_put(written, label, label);
+    }
+}
+
+// Returns 0 if 'fn' has inline assembly
+static int find_writes_in_fn(Map *written, Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_ASM) {
+                return 0;
+            }
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                if (!only_reads(ins, oprs[i])) {
+                    mark_written(written, derived_from(*oprs[i]));
+                }
+            }
+            if (ins->op != IR_PHI) {
+                continue;
+            }
+            for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                mark_written(written, derived_from(vec_get(ins->defs, i)));
+            }
+        }
+    }
+    return 1;
+}
+
+void constify_globals(Vec *globals) {
+    Map *written = map_new(); // by interned label
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        switch (g->k) {
+        case G_FN_DEF:
+            if (!find_writes_in_fn(written, g->fn)) {
+                map_free(written);
+                return;
+            }
+            break;
+        case G_PTR: mark_written(written, g->g); break;
+        case G_INIT:
+            for (size_t j = 0; j < vec_len(g->relocs); j++) {
+                InitReloc *r = vec_get(g->relocs, j);
+                mark_written(written, r->g);
+            }
+            break;
+        default: break;
+        }
+    }
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->linkage == LINK_STATIC && (g->k == G_IMM || g->k == G_FP || g->k == G_INIT) &&
+                !map_get(written, intern(g->label))) {
+            g->is_const = 1;
+        }
+    }
+    map_free(written);
+}
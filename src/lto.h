@@ -0,0 +1,30 @@
+
+#ifndef COSEC_LTO_H
+#define COSEC_LTO_H
+
+#include "compile.h"
+
+// Link-time optimisation. With '-flto', each file is compiled to binary IR
+// (see 'ir_file.h') instead of assembly, and passing those IR files back to
+// the compiler links them into one program, which is optimised as a whole
+// before going through the backend.
+//
+// Linking takes the IR files to be the whole program, other than the
+// libraries it calls: everything but 'main' is made 'static', so the inliner
+// can inline across files, 'dge' can drop what isn't used, and
+// 'constify_globals' can find the globals that are never written.
+
+// Merges the globals from each file (each a 'Vec *' of 'Global *') into one
+// program. 'static' globals whose labels clash with another file's are
+// renamed, references to a declaration are pointed at the definition from
+// whichever file has it, and the definitions are all made 'static' (except
+// 'main'). Run 'analyse' on the result
+Vec * lto_link(Vec *modules); // of 'Global *'
+
+// Marks the 'static' variables that are never written (i.e., whose address
+// is only ever loaded from, directly or at an offset) as 'const', so 'sccp'
+// can fold loads from them. Runs after inlining, which exposes the uses in
+// callees that took the address as an argument
+void constify_globals(Vec *globals);
+
+#endif
@@ -1,19 +1,25 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
-#include "parse.h"
-#include "compile.h"
-#include "assemble.h"
-#include "encode.h"
+#include "driver.h"
 #include "error.h"
-#include "debug.h"
-#include "reg_alloc.h"
+#include "stats.h"
+#include "passes.h"
+#include "server.h"
 
 // Compile the generated assembly with (on my macOS machine):
 //   nasm -f macho64 out.s
 //   ld -L/Library/Developer/CommandLineTools/SDKs/MacOSX.sdk/usr/lib -lSystem out.o
-// The linker arguments are annoying but necessary
+// The linker arguments are annoying but necessary. Or skip NASM with
+//   cosec -fformat=macho64 test.c (or -fformat=elf64 on Linux)
+// or skip both, and have 'cc' link the object files for you, with
+//   cosec --link test.c -o test
 //
 // See the equivalent LLVM IR with:
 //   clang -emit-llvm -Xclang -disable-O0-optnone -S test.c
@@ -34,47 +40,391 @@ static void print_version() {
 }
 
 static void print_help() {
-    printf("Usage: cosec [options] <file>\n");
+    printf("Usage: cosec [options] <file>...\n");
+    printf("       cosec --server <socket>\n");
+    printf("       cosec --connect <socket> [options] <file>...\n");
     printf("\n");
     printf("Options:\n");
     printf("  --help, -h     Print this help message\n");
     printf("  --version, -v  Print the compiler version\n");
-    printf("  -o <file>      Output assembly to <file>\n");
+    printf("  -o <file>      Output to <file> (- for stdout), or into the\n");
+    printf("                 directory <file> when compiling several files\n");
+    printf("  -c             Write an object file for each input (named after\n");
+    printf("                 it, with .o), in the platform's format\n");
+    printf("  --link         Compile the inputs to objects and link them, with\n");
+    printf("                 any .o, .a, -l, and -L inputs, into the executable\n");
+    printf("                 <file> (default a.out), using $COSEC_LD (default\n");
+    printf("                 cc)\n");
+    printf("  -fregalloc=<graph|linear>\n");
+    printf("                 Register allocator (linear is faster, graph\n");
+    printf("                 generates better code; default graph)\n");
+    printf("  -O0, -O1, -O2  Optimisation level: -O0 runs no passes, -O1 only the\n");
+    printf("                 cheap scalar ones, -O2 everything (the default;\n");
+    printf("                 -O is -O1)\n");
+    printf("  -E             Only preprocess, writing the result to stdout (or\n");
+    printf("                 the -o file)\n");
+    printf("  -MD            Also write a Makefile rule listing the headers the\n");
+    printf("                 output depends on, beside the output (with .d\n");
+    printf("                 for its extension)\n");
+    printf("  -MF <file>     Write the -MD rule to <file> instead\n");
+    printf("  --dump-ast     Print the AST after parsing\n");
+    printf("  --dump-ir      Print the IR after optimisation\n");
+    printf("  --struct-layout-report[=<n>]\n");
+    printf("                 Print each struct and union's layout: field\n");
+    printf("                 offsets, padding holes, and fields that cross\n");
+    printf("                 cache lines; warn about any over <n> cache lines\n");
+    printf("  -flto          Compile each file to IR (in a .ir file) instead;\n");
+    printf("                 with .ir files as input, link them into one\n");
+    printf("                 program and optimise it as a whole\n");
+    printf("  --emit-ir=<file>\n");
+    printf("                 Write the IR after optimisation to <file>, as\n");
+    printf("                 binary IR that can be compiled later by passing\n");
+    printf("                 <file> (ending in .ir) as an input file\n");
+    printf("  --dump-asm     Print the assembly before and after register\n");
+    printf("                 allocation, and what the peephole pass did\n");
+    printf("  --debug-regalloc\n");
+    printf("                 Print the register allocator's live ranges,\n");
+    printf("                 interference, and decisions\n");
+    printf("  --time-report  Print the time and memory each phase takes, and\n");
+    printf("                 how many objects it creates\n");
+    printf("  --perf-counters\n");
+    printf("                 --time-report, with cycles, instructions, branch\n");
+    printf("                 and cache misses, and page faults per phase (on\n");
+    printf("                 Linux, where permitted)\n");
+    printf("  --pass-stats   Print the time each optimisation pass takes, how\n");
+    printf("                 many IR instructions it adds or removes, and how\n");
+    printf("                 often each analysis is run or reused\n");
+    printf("  --codegen-stats[=<file>]\n");
+    printf("                 Print a line of JSON for each function with its\n");
+    printf("                 instruction counts (IR, and assembly by class),\n");
+    printf("                 vregs, coalesced moves, copies left, spills and\n");
+    printf("                 reloads, frame size, and calls (appended to\n");
+    printf("                 <file> if given)\n");
+    printf("  -fstack-usage[=callgraph]\n");
+    printf("                 Write a .su file next to the output with each\n");
+    printf("                 function's frame size (and whether it also\n");
+    printf("                 allocates on the stack at run time) and outgoing\n");
+    printf("                 argument area; with =callgraph, also the worst\n");
+    printf("                 case stack depth over the calls it makes to\n");
+    printf("                 functions in the same file\n");
+    printf("  -j <n>         Compile several files, and the functions in each\n");
+    printf("                 file, on <n> threads (default one per core;\n");
+    printf("                 -j 1 runs everything serially)\n");
+    printf("  -fstream       Parse, optimise, and encode each function before\n");
+    printf("                 the next one, freeing it once it's written, to\n");
+    printf("                 bound memory use on huge files (no inlining,\n");
+    printf("                 IPA constant propagation, or dead global removal)\n");
+    printf("  --server <socket>\n");
+    printf("                 Stay running, compiling each command line sent to\n");
+    printf("                 the Unix socket <socket>, with headers kept lexed\n");
+    printf("                 between them (must be the only option)\n");
+    printf("  --connect <socket> <args>...\n");
+    printf("                 Have the server on <socket> compile <args> here\n");
+    printf("  -fpch-dir=<dir>\n");
+    printf("                 Keep lexed headers in <dir>, for later runs to\n");
+    printf("                 reuse\n");
+    printf("  -fcache-dir=<dir>\n");
+    printf("                 Keep each function's assembly in <dir>, for later\n");
+    printf("                 runs to reuse when its code hasn't changed (NASM\n");
+    printf("                 output only)\n");
+    printf("  -fformat=<nasm|elf64|macho64>\n");
+    printf("                 Output NASM assembly, or an object file to pass\n");
+    printf("                 straight to the linker (default nasm)\n");
+    printf("  -fno-inline    Don't inline calls to small static functions\n");
+    printf("  -fno-ipa-cp    Don't propagate constant arguments into static\n");
+    printf("                 functions, or copy them for hot calls' constants\n");
+    printf("  -fno-thread-jumps\n");
+    printf("                 Don't copy blocks to skip tests whose outcome is\n");
+    printf("                 already known on the way in\n");
+    printf("  -fno-tree-loop-distribute-patterns\n");
+    printf("                 Don't turn loops that zero or copy arrays into\n");
+    printf("                 block operations\n");
+    printf("  -fno-vectorize Don't vectorise loops\n");
+    printf("  -fno-unroll-loops\n");
+    printf("                 Don't unroll loops, even with '#pragma unroll'\n");
+    printf("  -fno-loop-interchange\n");
+    printf("                 Don't swap nested loops to walk arrays along\n");
+    printf("                 their rows\n");
+    printf("  -fno-unswitch-loops\n");
+    printf("                 Don't copy loops to take tests that don't change\n");
+    printf("                 out of them\n");
+    printf("  -fno-rotate-loops\n");
+    printf("                 Don't move loop tests to the bottom of the loop\n");
+    printf("  -fno-tree-vrp  Don't fold the comparisons that the ranges of their\n");
+    printf("                 operands decide\n");
+    printf("  -fno-tree-switch-conversion\n");
+    printf("                 Don't turn switches that only pick constants into\n");
+    printf("                 loads from tables\n");
+    printf("  -fno-tree-sink Don't move computations down into the branches\n");
+    printf("                 that use them\n");
+    printf("  -fno-crossjumping\n");
+    printf("                 Don't merge the identical code at the ends of\n");
+    printf("                 blocks that return or jump to the same place\n");
+    printf("  -fno-strict-aliasing\n");
+    printf("                 Assume loads and stores of different types can\n");
+    printf("                 access the same memory\n");
+    printf("  -fomit-frame-pointer\n");
+    printf("                 Address the stack frame off rsp, and use rbp as\n");
+    printf("                 a general purpose register\n");
+    printf("  -f[no-]shrink-wrap\n");
+    printf("                 Skip the prologue on early returns that don't\n");
+    printf("                 need a stack frame (default on)\n");
+    printf("  -fPIC, -fPIE   Load the addresses of symbols that might be in\n");
+    printf("                 another module (anything exported, or for a PIE,\n");
+    printf("                 anything undefined) from the GOT\n");
+    printf("  -fvisibility=<default|hidden>\n");
+    printf("                 Whether symbols defined here are exported from a\n");
+    printf("                 shared library (default default)\n");
+    printf("  -fno-plt       Call functions that might be in another module\n");
+    printf("                 through the GOT, rather than a PLT stub\n");
+    printf("  -m[no-]red-zone\n");
+    printf("                 Keep a leaf function's small stack frame below\n");
+    printf("                 rsp without moving rsp (default on)\n");
+    printf("  -f[no-]schedule-insns\n");
+    printf("                 Reorder instructions to hide latencies before\n");
+    printf("                 register allocation (default on)\n");
+    printf("  -f[no-]schedule-insns2\n");
+    printf("                 Reorder them again afterwards (default off)\n");
+    printf("  -f[no-]ipa-ra  Let calls to static functions clobber only the\n");
+    printf("                 registers the function uses (default on)\n");
+    printf("  --target=<x86_64|aarch64>[-...]\n");
+    printf("                 Architecture to compile for (default x86_64);\n");
+    printf("                 aarch64 (or arm64) writes GNU assembler syntax,\n");
+    printf("                 with the AAPCS64 calling convention\n");
+    printf("  -march=<x86-64|x86-64-v2|x86-64-v3|haswell|native>\n");
+    printf("                 Instruction set extensions to use (default\n");
+    printf("                 x86-64; native asks the CPU with cpuid)\n");
+    printf("  -m[no-]<lzcnt|bmi|bmi2|avx|avx2|fma>\n");
+    printf("                 Turn a single extension on or off\n");
+    printf("  -ffp-contract=<fast|on|off>\n");
+    printf("                 Whether 'a * b + c' can be fused into one FMA\n");
+    printf("                 instruction, given -mfma (default fast; on is\n");
+    printf("                 treated as off)\n");
+    printf("  -f[no-]associative-math\n");
+    printf("                 Let floating point adds and multiplies be\n");
+    printf("                 regrouped, so loops summing floats can be\n");
+    printf("                 vectorised (default off)\n");
+    printf("  -f[no-]reciprocal-math\n");
+    printf("                 Let 'x / c' become 'x * (1 / c)' (default off)\n");
+    printf("  -f[no-]fast-math\n");
+    printf("                 Both of the above\n");
+    printf("  -falign-functions=<n>, -falign-loops=<n>\n");
+    printf("                 Pad with NOPs so functions (or loop headers) start\n");
+    printf("                 on an n byte boundary (default 16; 1 for none)\n");
+    printf("  -ffunction-sections, -fdata-sections\n");
+    printf("                 Put each function (or each other global) in its\n");
+    printf("                 own section, for the linker's --gc-sections\n");
+    printf("                 (ELF only)\n");
+    printf("  -g             Add a DWARF line table, mapping the code back to\n");
+    printf("                 source lines (ELF only)\n");
+    printf("  -finstrument-functions\n");
+    printf("                 Call __cyg_profile_func_enter and\n");
+    printf("                 __cyg_profile_func_exit on entry to and exit from\n");
+    printf("                 each function (except no_instrument_function ones)\n");
+    printf("  -fpatchable-function-entry=<n>\n");
+    printf("                 Start each function with n bytes of NOPs, for a\n");
+    printf("                 tracer to patch (default 0)\n");
+    printf("  -fdirect-ssa   Build SSA form for local variables as each function\n");
+    printf("                 is compiled, instead of in a separate pass\n");
+    printf("  -fprofile-generate[=<file>]\n");
+    printf("                 Count how often each basic block runs and where\n");
+    printf("                 each indirect call goes, and append the counts\n");
+    printf("                 to <file> when the program exits (default\n");
+    printf("                 cosec.profdata)\n");
+    printf("  -fprofile-use[=<file>]\n");
+    printf("                 Use the counts in <file> for block placement,\n");
+    printf("                 inlining, unrolling, spill costs, and turning\n");
+    printf("                 indirect calls into direct ones\n");
+    printf("  -fprofile-sample-use=<file>\n");
+    printf("                 Use the sample counts for each source line in\n");
+    printf("                 <file> (e.g., converted from 'perf record') the\n");
+    printf("                 same way, without instrumenting the program\n");
 }
 
-static void pipeline(char *in, char *out) {
+static int is_ir_file(char *path) {
+    char *ext = strrchr(path, '.');
+    return ext && strcmp(ext, ".ir") == 0;
+}
+
+// 'out' is only NULL for '-E', which writes to stdout by default
+static void compile_path(char *in, char *out, Options *opts) {
+    Output o = { .path = out, .f = out ? NULL : stdout };
+    if (is_ir_file(in)) {
+        Vec *paths = vec_new();
+        vec_push(paths, in);
+        pipeline_ir(paths, &o, opts);
+        return;
+    }
     FILE *f_in = fopen(in, "r");
     if (!f_in) {
         error("can't read input file '%s'", in);
     }
-    File *f = new_file(f_in, in);
+    pipeline(new_file(f_in, in), &o, opts);
+}
 
-    // Parser
-    AstNode *ast = parse(f);
-    print_ast(ast);
-    printf("\n");
+// Several files are compiled in parallel, each start to finish on one thread,
+// sharing only interned strings and sets. Each file's output has the same
+// base name, in the '-o' directory if there is one (otherwise the current
+// one)
+typedef struct {
+    Vec *in, *out; // of 'char *'
+    Options *opts;
+    int failed;
+} Build;
 
-    // Compiler
-    Vec *globals = compile(ast);
-    print_ir(globals);
-    printf("\n");
+static char * output_for(char *in, char *dir, Options *opts) {
+    char *base = strrchr(in, '/');
+    base = base ? base + 1 : in;
+    char *ext = strrchr(base, '.');
+    Buf *b = buf_new();
+    buf_nprint(b, base, ext ? (size_t) (ext - base) : strlen(base));
+    buf_print(b, opts->preprocess ? ".i" : opts->lto ? ".ir" :
+                 opts->format == OUT_NASM ? ".s" : ".o");
+    buf_push(b, '\0');
+    return dir ? concat_paths(dir, b->data) : b->data;
+}
+
+// An error in one file doesn't stop the others
+static void compile_file(void *arg, size_t i) {
+    Build *b = arg;
+    jmp_buf *outer = ERROR_JMP; // Set for the compile server's job
+    jmp_buf jmp;
+    if (setjmp(jmp) == 0) {
+        ERROR_JMP = &jmp;
+        compile_path(vec_get(b->in, i), vec_get(b->out, i), b->opts);
+    } else {
+        b->failed = 1;
+    }
+    ERROR_JMP = outer;
+    for (int arena = 0; arena < ARENA_LAST; arena++) {
+        arena_free(arena); // Ready for this thread's next file
+    }
+}
+
+static int compile_files(Vec *in, char *dir, Options *opts) {
+    if (dir) {
+        struct stat st;
+        if (stat(dir, &st) != 0) {
+            if (mkdir(dir, 0777) != 0) {
+                error("can't create output directory '%s'", dir);
+            }
+        } else if (!S_ISDIR(st.st_mode)) {
+            error("'-o' must be a directory when compiling multiple files");
+        }
+    }
+    Vec *out = vec_new();
+    Map *seen = map_new();
+    for (size_t i = 0; i < vec_len(in); i++) {
+        char *path = intern(output_for(vec_get(in, i), dir, opts));
+        if (map_get(seen, path)) {
+            error("multiple input files would be written to '%s'", path);
+        }
+        map_put(seen, path, path);
+        vec_push(out, path);
+    }
+
+    // Dumps, '--time-report', '--pass-stats', and '--codegen-stats' need the
+    // files one at a time. Threads left over once there's one per file go to
+    // each file's backend
+    int num_files = (int) vec_len(in);
+    int serial = opts->dump_ast || opts->dump_ir || opts->dump_asm ||
+                 opts->debug_regalloc || TIME_REPORT || PASS_STATS ||
+                 CODEGEN_STATS;
+    int num_threads = serial ? 1 : opts->num_threads;
+    Options file_opts = *opts;
+    file_opts.num_threads = num_threads > num_files ? num_threads / num_files : 1;
+    Build b = { .in = in, .out = out, .opts = &file_opts };
+    parallel_for(vec_len(in), num_threads, compile_file, &b);
+    return b.failed;
+}
+
+// Linking
+// With '--link', every input is compiled into an object file in a temporary
+// directory (in parallel, as for several files), then the system's compiler
+// driver links them, since it knows where the C library and start files are
 
-    // Assembler
-    assemble(globals);
-    encode_nasm(stdout, globals);
+extern char **environ;
 
-    // Register allocator
-    reg_alloc(globals, 1);
-    encode_nasm(stdout, globals);
-    FILE *f_out = fopen(out, "w");
-    if (!f_out) {
-        error("can't open output file '%s'", out);
+#ifdef __APPLE__
+#define NATIVE_FORMAT OUT_MACHO64
+#else
+#define NATIVE_FORMAT OUT_ELF64
+#endif
+
+static int is_link_input(char *arg) {
+    char *ext = strrchr(arg, '.');
+    return strncmp(arg, "-l", 2) == 0 || strncmp(arg, "-L", 2) == 0 ||
+           (ext && (strcmp(ext, ".o") == 0 || strcmp(ext, ".a") == 0 ||
+                    strcmp(ext, ".so") == 0 || strcmp(ext, ".dylib") == 0));
+}
+
+// Returns the linker's exit status, or -1 if it couldn't be run
+static int run_linker(char *ld, Vec *objs, Vec *link_args, char *out) {
+    Vec *args = vec_new();
+    vec_push(args, ld);
+    vec_push(args, "-o");
+    vec_push(args, out);
+    vec_push_all(args, objs);
+    vec_push_all(args, link_args);
+    vec_push(args, NULL);
+    pid_t pid;
+    int status;
+    int err = posix_spawnp(&pid, ld, NULL, NULL, (char **) args->data, environ);
+    vec_free(args);
+    if (err != 0) {
+        return -1;
     }
-    encode_nasm(f_out, globals);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+        return 1;
+    }
+    return WEXITSTATUS(status);
 }
 
-int main(int argc, char *argv[]) {
-    char *in = NULL, *out = "out.s";
+static int compile_files(Vec *in, char *dir, Options *opts);
+
+static int compile_and_link(Vec *in, Vec *link_args, char *out, Options *opts) {
+    char tmp[] = "/tmp/cosec-XXXXXX";
+    if (!mkdtemp(tmp)) {
+        error("can't create a temporary directory for linking");
+    }
+    Vec *objs = vec_new();
+    int failed;
+    if (opts->lto) { // The IR files are linked into one object
+        char *obj = concat_paths(tmp, "lto.o");
+        Output o = { .path = obj };
+        pipeline_ir(in, &o, opts);
+        vec_push(objs, obj);
+        failed = 0;
+    } else {
+        for (size_t i = 0; i < vec_len(in); i++) {
+            vec_push(objs, output_for(vec_get(in, i), tmp, opts));
+        }
+        failed = compile_files(in, tmp, opts);
+    }
+    char *ld = getenv("COSEC_LD");
+    ld = ld && *ld ? ld : "cc";
+    if (!failed) {
+        failed = run_linker(ld, objs, link_args, out ? out : "a.out");
+    }
+    for (size_t i = 0; i < vec_len(objs); i++) {
+        remove(vec_get(objs, i));
+    }
+    rmdir(tmp);
+    vec_free(objs);
+    if (failed < 0) {
+        error("can't run the linker '%s'", ld);
+    }
+    return failed;
+}
+
+// Compiles the files on the command line
+static int run(int argc, char *argv[]) {
+    Vec *in = vec_new();
+    Vec *link_args = vec_new(); // For '--link'
+    char *out = NULL;
+    int compile_only = 0, link = 0;
+    Options opts;
+    default_options(&opts);
     for (int i = 1; i < argc; i++) {
         char *arg = argv[i];
         if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
@@ -88,15 +438,98 @@ int main(int argc, char *argv[]) {
                 error("no file name after '-o'");
             }
             out = argv[++i];
-        } else if (in) {
-            error("multiple input files provided");
-        } else {
-            in = arg;
+        } else if (strcmp(arg, "-c") == 0) {
+            compile_only = 1;
+        } else if (strcmp(arg, "--link") == 0) {
+            link = 1;
+        } else if (is_link_input(arg)) {
+            vec_push(link_args, arg); // Only used with '--link'
+        } else if (!parse_option(&opts, argc, argv, &i)) {
+            vec_push(in, arg);
         }
     }
-    if (!in) {
+    if (compile_only && link) {
+        error("'-c' and '--link' can't be used together");
+    } else if ((compile_only || link) && opts.preprocess) {
+        error("'%s' can't be used with '-E'", compile_only ? "-c" : "--link");
+    } else if (vec_len(link_args) > 0 && !link) {
+        error("'%s' is only used with '--link'", (char *) vec_head(link_args));
+    }
+    if ((compile_only || link) && opts.format == OUT_NASM) {
+        opts.format = NATIVE_FORMAT; // Straight to an object; no NASM needed
+    }
+    size_t num_ir = 0;
+    for (size_t i = 0; i < vec_len(in); i++) {
+        num_ir += is_ir_file(vec_get(in, i));
+    }
+    char *default_out = opts.format == OUT_NASM ? "out.s" : "out.o";
+    int to_stdout = out && strcmp(out, "-") == 0; // '-o -'
+    if (vec_len(in) == 0) {
         error("no input files");
+    } else if (opts.emit_ir && vec_len(in) > 1) {
+        error("'--emit-ir' needs a single input file");
+    } else if (opts.dep_file && vec_len(in) > 1) {
+        error("'-MF' needs a single input file");
+    } else if (to_stdout && link) {
+        error("'-o -' can't be used with '--link'");
+    } else if (to_stdout && vec_len(in) > 1 && !(opts.lto && num_ir > 0)) {
+        error("'-o -' needs a single input file");
+    } else if (opts.lto && num_ir > 0) {
+        if (num_ir < vec_len(in)) {
+            error("'-flto' can't link source files; compile them with '-flto' first");
+        }
+        if (link) {
+            return compile_and_link(in, link_args, out, &opts);
+        }
+        Output o = { .path = to_stdout ? NULL : out ? out : default_out,
+                     .f = to_stdout ? stdout : NULL };
+        pipeline_ir(in, &o, &opts);
+    } else if (opts.preprocess && num_ir > 0) {
+        error("'-E' needs source files");
+    } else if (link) {
+        if (opts.lto || opts.emit_ir) {
+            error("'--link' needs object files; link '-flto' IR files instead");
+        }
+        if (compile_and_link(in, link_args, out, &opts)) {
+            return 1;
+        }
+    } else if (vec_len(in) == 1) {
+        if (to_stdout) {
+            out = NULL;
+        } else if (!out && compile_only) {
+            out = output_for(vec_get(in, 0), NULL, &opts);
+        } else if (!out && !opts.preprocess) {
+            out = opts.lto ? "out.ir" : default_out;
+        }
+        compile_path(vec_get(in, 0), out, &opts);
+    } else if (compile_files(in, out, &opts)) {
+        return 1;
     }
-    pipeline(in, out);
+    print_time_report(stderr);
+    print_pass_stats(stderr);
     return 0;
 }
+
+// Put back before each of the compile server's jobs
+static GlobalOptions DEFAULT_OPTIONS;
+
+static int server_job(int argc, char *argv[]) {
+    restore_options(&DEFAULT_OPTIONS);
+    return run(argc, argv);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--server") == 0) {
+        if (argc != 3) {
+            error("expected a socket path after '--server'");
+        }
+        DEFAULT_OPTIONS = save_options();
+        serve(argv[2], server_job);
+    } else if (argc > 1 && strcmp(argv[1], "--connect") == 0) {
+        if (argc < 3) {
+            error("expected a socket path after '--connect'");
+        }
+        return connect_server(argv[2], argc - 3, &argv[3]);
+    }
+    return run(argc, argv);
+}
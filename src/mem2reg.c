@@ -0,0 +1,431 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "mem2reg.h"
+#include "analysis.h"
+
+// Uses the SSA construction algorithm presented in 'Efficiently Computing
+// Static Single Assignment Form and the Control Dependence Graph', Ron Cytron
+// et al., 1991: phis are placed on the iterated dominance frontier of the
+// stores to each variable, then a walk over the dominator tree renames each
+// load to the value stored most recently along the path to it.
+//
+// Instructions are numbered (in 'n') while the pass runs so that per-
+// instruction information can be kept in arrays on the side.
+
+typedef struct {
+    Fn *fn;
+    size_t num_ins;
+    int *var_of;   // Per ins; variable for a promoted IR_ALLOC or phi, or -1
+    IrIns **repl;  // Per ins; value replacing a promoted IR_LOAD, or NULL
+    Vec *vars;     // of 'IrIns *' k = IR_ALLOC
+    Vec **stacks;  // Per variable; of 'IrIns *'; definitions being renamed
+    IrIns **undef; // Per variable; value used before the first store
+} Mem2Reg;
+
+
+// ---- Promotable Allocations ------------------------------------------------
+
+static int is_scalar(IrType *t) {
+    return t->k != IRT_VOID && t->k != IRT_ARR && t->k != IRT_STRUCT;
+}
+
+// An IR_ALLOC can be promoted if it's only ever the pointer loaded from or
+// stored to, with the same type as the allocation
+static int is_promotable_use(IrIns *ins, IrIns **opr) {
+    IrIns *alloc = *opr;
+    if (ins->op == IR_LOAD) {
+        return ins->t->k == alloc->alloc_t->k;
+    } else if (ins->op == IR_STORE && opr == &ins->dst) {
+        return ins->src != alloc && ins->src->t->k == alloc->alloc_t->k;
+    }
+    return 0; // Address taken
+}
+
+static void find_promotable(Mem2Reg *m) {
+    for (BB *bb = m->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_ALLOC && !ins->count && is_scalar(ins->alloc_t)) {
+                m->var_of[ins->n] = 0; // Candidate; numbered below
+            }
+        }
+    }
+    for (BB *bb = m->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                IrIns *opr = *oprs[i];
+                if (opr->op == IR_ALLOC && !is_promotable_use(ins, oprs[i])) {
+                    m->var_of[opr->n] = -1;
+                }
+            }
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    IrIns *def = vec_get(ins->defs, i);
+                    if (def->op == IR_ALLOC) {
+                        m->var_of[def->n] = -1;
+                    }
+                }
+            }
+        }
+    }
+    for (BB *bb = m->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_ALLOC && m->var_of[ins->n] == 0) {
+                m->var_of[ins->n] = (int) vec_len(m->vars);
+                vec_push(m->vars, ins);
+            }
+        }
+    }
+}
+
+static int promoted_var(Mem2Reg *m, IrIns *ptr) {
+    if (ptr->op != IR_ALLOC || ptr->n >= m->num_ins) {
+        return -1;
+    }
+    return m->var_of[ptr->n];
+}
+
+
+// ---- Phi Placement ---------------------------------------------------------
+
+static IrIns * insert_phi(BB *bb, IrType *t) {
+    IrIns *phi = new_ins(IR_PHI, t);
+    for (size_t i = 0; i < vec_len(bb->pred); i++) {
+        vec_push(phi->preds, vec_get(bb->pred, i));
+        vec_push(phi->defs, NULL); // Filled in when renaming
+    }
+    phi->bb = bb;
+    phi->prev = NULL;
+    phi->next = bb->ir_head;
+    if (bb->ir_head) {
+        bb->ir_head->prev = phi;
+    } else {
+        bb->ir_last = phi;
+    }
+    bb->ir_head = phi;
+    return phi;
+}
+
+// Places a phi for each variable on the iterated dominance frontier of the
+// BBs that store to it. Returns the phis, with their variable in 'phi_vars'
+static Vec * place_phis(Mem2Reg *m, Vec *rpo, Vec *phi_vars) {
+    size_t num_bbs = vec_len(rpo);
+    Vec **def_bbs = malloc(sizeof(Vec *) * vec_len(m->vars));
+    for (size_t v = 0; v < vec_len(m->vars); v++) {
+        def_bbs[v] = vec_new();
+    }
+    for (size_t i = 0; i < num_bbs; i++) {
+        BB *bb = vec_get(rpo, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            int var;
+            if (ins->op == IR_STORE && (var = promoted_var(m, ins->dst)) >= 0) {
+                Vec *bbs = def_bbs[var];
+                if (vec_len(bbs) == 0 || vec_tail(bbs) != bb) {
+                    vec_push(bbs, bb);
+                }
+            }
+        }
+    }
+
+    // 'has_phi' and 'on_work' hold the last variable (+1) each BB was visited
+    // for, so they don't need clearing between variables
+    int *has_phi = calloc(num_bbs, sizeof(int));
+    int *on_work = calloc(num_bbs, sizeof(int));
+    Vec *phis = vec_new();
+    Vec *work = vec_new();
+    for (size_t v = 0; v < vec_len(m->vars); v++) {
+        IrIns *alloc = vec_get(m->vars, v);
+        int stamp = (int) v + 1;
+        for (size_t i = 0; i < vec_len(def_bbs[v]); i++) {
+            BB *bb = vec_get(def_bbs[v], i);
+            on_work[bb->rpo] = stamp;
+            vec_push(work, bb);
+        }
+        while (vec_len(work) > 0) {
+            BB *bb = vec_pop(work);
+            for (size_t i = 0; i < vec_len(bb->dom_frontier); i++) {
+                BB *df = vec_get(bb->dom_frontier, i);
+                if (has_phi[df->rpo] == stamp) {
+                    continue;
+                }
+                has_phi[df->rpo] = stamp;
+                vec_push(phis, insert_phi(df, alloc->alloc_t));
+                vec_push(phi_vars, (void *) (intptr_t) v);
+                if (on_work[df->rpo] != stamp) {
+                    on_work[df->rpo] = stamp;
+                    vec_push(work, df);
+                }
+            }
+        }
+    }
+    for (size_t v = 0; v < vec_len(m->vars); v++) {
+        vec_free(def_bbs[v]);
+    }
+    free(has_phi);
+    free(on_work);
+    free(def_bbs);
+    vec_free(work);
+    return phis;
+}
+
+
+// ---- Renaming --------------------------------------------------------------
+
+static IrIns * undef_value(Mem2Reg *m, int var) {
+    if (m->undef[var]) {
+        return m->undef[var];
+    }
+    IrIns *alloc = vec_get(m->vars, var);
+    IrType *t = alloc->alloc_t;
+    IrIns *k = new_ins((t->k == IRT_F32 || t->k == IRT_F64) ? IR_FP : IR_IMM, t);
+    if (k->op == IR_FP) {
+        k->fp = 0;
+    } else {
+        k->imm = 0;
+    }
+    k->n = m->num_ins; // Not in any of the side arrays
+
+    // After the IR_FARGs, which have to be at the start of the entry BB
+    BB *entry = m->fn->entry;
+    IrIns *after = NULL;
+    for (IrIns *ins = entry->ir_head; ins && ins->op == IR_FARG; ins = ins->next) {
+        after = ins;
+    }
+    k->bb = entry;
+    k->prev = after;
+    k->next = after ? after->next : entry->ir_head;
+    if (k->next) {
+        k->next->prev = k;
+    } else {
+        entry->ir_last = k;
+    }
+    if (after) {
+        after->next = k;
+    } else {
+        entry->ir_head = k;
+    }
+    m->undef[var] = k;
+    return k;
+}
+
+static IrIns * current_def(Mem2Reg *m, int var) {
+    Vec *stack = m->stacks[var];
+    return vec_len(stack) > 0 ? vec_tail(stack) : undef_value(m, var);
+}
+
+static IrIns * resolve(Mem2Reg *m, IrIns *value) {
+    if (value->n < m->num_ins && m->repl[value->n]) {
+        return m->repl[value->n]; // A promoted load
+    }
+    return value;
+}
+
+// Pushes every definition in 'bb' onto its variable's stack (logging which
+// variable in 'pushed'), and removes the promoted loads and stores
+static void rename_bb(Mem2Reg *m, BB *bb, Vec *pushed) {
+    IrIns *ins = bb->ir_head;
+    while (ins) {
+        IrIns *next = ins->next;
+        int var;
+        if (ins->op == IR_PHI && ins->n < m->num_ins && m->var_of[ins->n] >= 0) {
+            vec_push(m->stacks[m->var_of[ins->n]], ins);
+            vec_push(pushed, (void *) (intptr_t) m->var_of[ins->n]);
+        } else if (ins->op == IR_LOAD && (var = promoted_var(m, ins->src)) >= 0) {
+            m->repl[ins->n] = current_def(m, var);
+            delete_ir(ins);
+        } else if (ins->op == IR_STORE && (var = promoted_var(m, ins->dst)) >= 0) {
+            vec_push(m->stacks[var], resolve(m, ins->src));
+            vec_push(pushed, (void *) (intptr_t) var);
+            delete_ir(ins);
+        }
+        ins = next;
+    }
+
+    // Fill in the phi operands coming from this BB in each successor
+    for (size_t i = 0; i < vec_len(bb->succ); i++) {
+        BB *succ = vec_get(bb->succ, i);
+        for (IrIns *phi = succ->ir_head; phi && phi->op == IR_PHI; phi = phi->next) {
+            if (phi->n >= m->num_ins || m->var_of[phi->n] < 0) {
+                continue; // Not one of ours
+            }
+            for (size_t j = 0; j < vec_len(phi->preds); j++) {
+                if (vec_get(phi->preds, j) == bb) {
+                    vec_put(phi->defs, j, current_def(m, m->var_of[phi->n]));
+                }
+            }
+        }
+    }
+}
+
+typedef struct {
+    BB *bb;
+    size_t num_pushed; // Length of the 'pushed' log before visiting 'bb'
+    size_t next_child;
+} RenameFrame;
+
+// Walks the dominator tree (iteratively; it can be deep), popping each BB's
+// definitions off their stacks once all the BBs it dominates are done
+static void rename_vars(Mem2Reg *m) {
+    Vec *pushed = vec_new(); // of 'int'; variable for each push, in order
+    size_t max_frames = 16, num_frames = 0;
+    RenameFrame *frames = malloc(sizeof(RenameFrame) * max_frames);
+    frames[num_frames++] = (RenameFrame) { m->fn->entry, 0, 0 };
+    rename_bb(m, m->fn->entry, pushed);
+    while (num_frames > 0) {
+        RenameFrame *f = &frames[num_frames - 1];
+        if (f->next_child < vec_len(f->bb->dom_children)) {
+            BB *child = vec_get(f->bb->dom_children, f->next_child++);
+            if (num_frames == max_frames) {
+                max_frames *= 2;
+                frames = realloc(frames, sizeof(RenameFrame) * max_frames);
+            }
+            frames[num_frames++] = (RenameFrame) { child, vec_len(pushed), 0 };
+            rename_bb(m, child, pushed);
+        } else {
+            while (vec_len(pushed) > f->num_pushed) {
+                int var = (int) (intptr_t) vec_pop(pushed);
+                vec_pop(m->stacks[var]);
+            }
+            num_frames--;
+        }
+    }
+    free(frames);
+}
+
+// Points every use of a promoted load at the value that replaced it
+static void replace_loads(Mem2Reg *m) {
+    for (BB *bb = m->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                *oprs[i] = resolve(m, *oprs[i]);
+            }
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    vec_put(ins->defs, i, resolve(m, vec_get(ins->defs, i)));
+                }
+            }
+        }
+    }
+    for (size_t v = 0; v < vec_len(m->vars); v++) {
+        delete_ir(vec_get(m->vars, v));
+    }
+}
+
+
+// ---- Dead Phi Elimination --------------------------------------------------
+
+// Minimal SSA places phis for variables that aren't live any more; remove the
+// ones nothing (other than other dead phis) uses. Reuses 'n' as a mark
+static void remove_dead_phis(Fn *fn) {
+    Vec *work = vec_new();
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            ins->n = 0;
+        }
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_PHI) {
+                continue;
+            }
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                IrIns *opr = *oprs[i];
+                if (opr->op == IR_PHI && !opr->n) {
+                    opr->n = 1;
+                    vec_push(work, opr);
+                }
+            }
+        }
+    }
+    while (vec_len(work) > 0) {
+        IrIns *phi = vec_pop(work);
+        for (size_t i = 0; i < vec_len(phi->defs); i++) {
+            IrIns *def = vec_get(phi->defs, i);
+            if (def->op == IR_PHI && !def->n) {
+                def->n = 1;
+                vec_push(work, def);
+            }
+        }
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        IrIns *ins = bb->ir_head;
+        while (ins) {
+            IrIns *next = ins->next;
+            if (ins->op == IR_PHI && !ins->n) {
+                delete_ir(ins);
+            }
+            ins = next;
+        }
+    }
+}
+
+
+// ---- Promotion -------------------------------------------------------------
+
+void mem2reg(Fn *fn) {
+    remove_unreachable_bbs(fn); // Aren't in the dominator tree
+    analyse_cfg(fn);
+    Vec *rpo = rev_postorder(fn);
+
+    Mem2Reg m;
+    m.fn = fn;
+    m.num_ins = number_ir(fn);
+    m.var_of = malloc(sizeof(int) * m.num_ins);
+    for (size_t i = 0; i < m.num_ins; i++) {
+        m.var_of[i] = -1;
+    }
+    m.vars = vec_new();
+    find_promotable(&m);
+    if (vec_len(m.vars) == 0) {
+        free(m.var_of);
+        vec_free(m.vars);
+        vec_free(rpo);
+        return; // Nothing to promote
+    }
+    size_t num_vars = vec_len(m.vars);
+
+    // Renumber with the new phis, and keep track of their variables
+    Vec *phi_vars = vec_new();
+    Vec *phis = place_phis(&m, rpo, phi_vars);
+    m.num_ins = number_ir(fn);
+    free(m.var_of);
+    m.var_of = malloc(sizeof(int) * m.num_ins);
+    for (size_t i = 0; i < m.num_ins; i++) {
+        m.var_of[i] = -1;
+    }
+    for (size_t v = 0; v < num_vars; v++) {
+        IrIns *alloc = vec_get(m.vars, v);
+        m.var_of[alloc->n] = (int) v;
+    }
+    for (size_t i = 0; i < vec_len(phis); i++) {
+        IrIns *phi = vec_get(phis, i);
+        m.var_of[phi->n] = (int) (intptr_t) vec_get(phi_vars, i);
+    }
+    m.repl = calloc(m.num_ins, sizeof(IrIns *));
+    m.stacks = malloc(sizeof(Vec *) * num_vars);
+    m.undef = calloc(num_vars, sizeof(IrIns *));
+    for (size_t v = 0; v < num_vars; v++) {
+        m.stacks[v] = vec_new();
+    }
+
+    rename_vars(&m);
+    replace_loads(&m);
+    remove_dead_phis(fn);
+    for (size_t v = 0; v < num_vars; v++) {
+        vec_free(m.stacks[v]);
+    }
+    free(m.var_of);
+    free(m.repl);
+    free(m.stacks);
+    free(m.undef);
+    vec_free(m.vars);
+    vec_free(phis);
+    vec_free(phi_vars);
+    vec_free(rpo);
+}
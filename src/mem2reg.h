@@ -0,0 +1,12 @@
+
+#ifndef COSEC_MEM2REG_H
+#define COSEC_MEM2REG_H
+
+#include "compile.h"
+
+// Promotes local variables that never have their address taken from stack
+// allocations (IR_ALLOC, with IR_LOADs and IR_STOREs through them) to SSA
+// values, inserting IR_PHIs where control flow merges. Requires 'analyse'
+void mem2reg(Fn *fn);
+
+#endif
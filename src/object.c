@@ -0,0 +1,1083 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "object.h"
+#include "error.h"
+
+// Both formats are written into a buffer, then out all at once. Offsets into
+// the file are worked out as each part is appended, so the headers that refer
+// to them are filled in afterwards.
+//
+// ELF uses explicit addends for relocations ('.rela'); Mach-O stores the
+// addend in the bytes being relocated. Labels in the assembly all start with
+// an underscore, which is what Mach-O expects; it's stripped for ELF.
+
+static void w(Buf *b, uint64_t v, size_t bytes) { // Little endian
+    for (size_t i = 0; i < bytes; i++) {
+        buf_push(b, (char) (v >> (i * 8)));
+    }
+}
+
+static void w_buf(Buf *b, Buf *src) {
+    for (size_t i = 0; i < src->len; i++) {
+        buf_push(b, src->data[i]);
+    }
+}
+
+static void w_pad(Buf *b, size_t align) {
+    while (align > 1 && b->len % align != 0) {
+        buf_push(b, 0);
+    }
+}
+
+static void w_name(Buf *b, char *name, size_t len) { // Fixed length, 0 padded
+    size_t i = 0;
+    for (; name[i] && i < len; i++) {
+        buf_push(b, name[i]);
+    }
+    for (; i < len; i++) {
+        buf_push(b, 0);
+    }
+}
+
+static size_t w_str(Buf *strtab, char *s) { // Returns its offset
+    size_t offset = strtab->len;
+    for (; *s; s++) {
+        buf_push(strtab, *s);
+    }
+    buf_push(strtab, 0);
+    return offset;
+}
+
+static void patch(Buf *b, size_t offset, uint64_t v, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) {
+        b->data[offset + i] = (char) (v >> (i * 8));
+    }
+}
+
+static size_t align_to(size_t offset, size_t align) {
+    return offset + pad(offset, align);
+}
+
+static size_t log2_align(size_t align) {
+    size_t n = 0;
+    while (((size_t) 1 << n) < align) {
+        n++;
+    }
+    return n;
+}
+
+
+// ---- ELF64 -----------------------------------------------------------------
+
+// The object's text, read only data, data, and bss (and thread-local data and
+// bss, if there are any) each go in one section, or are cut into one section
+// per symbol (for '-ffunction-sections' and
+// '-fdata-sections'). The floating point constant pool and the string
+// literals are always whole, and marked so the linker can merge them with
+// other objects'. Symbols and
+// relocations refer to the piece they're in.
+// Section headers are in the order: null, the pieces, their relocations,
+// '.symtab', '.strtab', '.note.GNU-stack', then '.shstrtab'
+
+typedef struct {
+    char *name;
+    uint32_t name_off; // In '.shstrtab'
+    uint32_t type;
+    uint64_t flags;
+    uint64_t offset, size;
+    uint32_t link, info;
+    uint64_t align, entsize;
+    Buf *contents;     // NULL if it takes no space in the file
+    Vec *relocs;       // of 'ElfReloc *'; for '.eh_frame' and the debug info
+} ElfSection;
+
+typedef struct { // Against the section symbol for 'shndx'
+    uint64_t offset;
+    uint32_t type;
+    size_t shndx;
+    int64_t addend;
+} ElfReloc;
+
+typedef struct {
+    int section;         // Which of the object's sections it's a piece of
+    uint64_t start, end; // Within that section
+    size_t align;
+    char *label;         // The symbol it was cut out for; NULL if it's whole
+    int fn_attrs;        // Of that symbol, if it's a function (see 'section_name')
+    size_t shndx;
+} ElfPiece;
+
+enum {
+    SHT_PROGBITS = 1, SHT_SYMTAB = 2, SHT_STRTAB = 3, SHT_RELA = 4, SHT_NOBITS = 8,
+    SHT_X86_64_UNWIND = 0x70000001,
+};
+enum {
+    SHF_WRITE = 1, SHF_ALLOC = 2, SHF_EXEC = 4, SHF_MERGE = 0x10, SHF_STRINGS = 0x20,
+    SHF_INFO_LINK = 0x40, SHF_TLS = 0x400,
+};
+enum { STB_LOCAL = 0, STB_GLOBAL = 1 };
+enum { STT_NOTYPE = 0, STT_OBJECT = 1, STT_FUNC = 2, STT_SECTION = 3, STT_TLS = 6 };
+enum {
+    R_X86_64_NONE = 0,
+    R_X86_64_64 = 1, R_X86_64_PC32 = 2, R_X86_64_PLT32 = 4, R_X86_64_32 = 10,
+    R_X86_64_GOTTPOFF = 22, R_X86_64_TPOFF32 = 23,
+    R_X86_64_GOTPCRELX = 41, R_X86_64_REX_GOTPCRELX = 42,
+};
+enum { STV_DEFAULT = 0, STV_HIDDEN = 2 };
+
+static ElfSection * elf_new_section(Vec *secs, char *name, uint32_t type, uint64_t flags,
+                                    uint64_t align, Buf *contents) {
+    ElfSection *s = calloc(1, sizeof(ElfSection));
+    s->name = name;
+    s->type = type;
+    s->flags = flags;
+    s->align = align;
+    s->contents = contents;
+    vec_push(secs, s);
+    return s;
+}
+
+static char * elf_sym_name(Symbol *sym) {
+    return sym->name[0] == '_' ? &sym->name[1] : sym->name;
+}
+
+static uint64_t section_len(Object *obj, int section) {
+    switch (section) {
+    case SEC_TEXT:   return obj->text->len;
+    case SEC_RODATA: return obj->rodata->len;
+    case SEC_CST4:   return obj->cst4->len;
+    case SEC_CST8:   return obj->cst8->len;
+    case SEC_CSTRING: return obj->cstrings->len;
+    case SEC_DATA:   return obj->data->len;
+    case SEC_BSS:    return obj->bss_size;
+    case SEC_TDATA:  return obj->tdata->len;
+    case SEC_TBSS:   return obj->tbss_size;
+    default: UNREACHABLE();
+    }
+    return 0;
+}
+
+static size_t section_align(Object *obj, int section) {
+    switch (section) {
+    case SEC_TEXT:   return obj->text_align;
+    case SEC_RODATA: return obj->rodata_align;
+    case SEC_CST4:   return 4;
+    case SEC_CST8:   return 8;
+    case SEC_CSTRING: return 1;
+    case SEC_DATA:   return obj->data_align;
+    case SEC_BSS:    return obj->bss_align;
+    case SEC_TDATA:  return obj->tdata_align;
+    case SEC_TBSS:   return obj->tbss_align;
+    default: UNREACHABLE();
+    }
+    return 0;
+}
+
+static ElfPiece * new_piece(Vec *pieces, int section, uint64_t start, size_t align,
+                            char *label) {
+    ElfPiece *p = calloc(1, sizeof(ElfPiece));
+    p->section = section;
+    p->start = p->end = start;
+    p->align = align;
+    p->label = label;
+    vec_push(pieces, p);
+    return p;
+}
+
+static int cmp_sym_start(const void *a, const void *b) {
+    Symbol *l = *(Symbol **) a, *r = *(Symbol **) b;
+    return l->start < r->start ? -1 : (l->start > r->start ? 1 : 0);
+}
+
+// Each symbol's piece runs up to the start of the next symbol in its section.
+// Symbols are in the order they were first referenced, not where they are
+static Vec * elf_pieces(Object *obj) {
+    size_t num_syms = vec_len(obj->syms);
+    Symbol **in_section = malloc(sizeof(Symbol *) * (num_syms + 1));
+    Vec *pieces = vec_new();
+    for (int section = SEC_TEXT; section <= SEC_TBSS; section++) {
+        uint64_t len = section_len(obj, section);
+        if ((section == SEC_TDATA || section == SEC_TBSS) && len == 0) {
+            continue; // Only when there are thread-locals
+        }
+        if (!has_own_section(section)) {
+            ElfPiece *whole = new_piece(pieces, section, 0, section_align(obj, section), NULL);
+            whole->end = len;
+            for (size_t i = 0; i < num_syms; i++) {
+                Symbol *sym = vec_get(obj->syms, i);
+                if (sym->section == section) {
+                    sym->piece = whole;
+                }
+            }
+            continue;
+        }
+        size_t n = 0;
+        for (size_t i = 0; i < num_syms; i++) {
+            Symbol *sym = vec_get(obj->syms, i);
+            if (sym->section == section) {
+                in_section[n++] = sym;
+            }
+        }
+        qsort(in_section, n, sizeof(Symbol *), cmp_sym_start);
+        for (size_t i = 0; i < n; i++) {
+            Symbol *sym = in_section[i];
+            ElfPiece *p = new_piece(pieces, section, sym->start, sym->align, elf_sym_name(sym));
+            p->fn_attrs = sym->fn_attrs;
+            p->end = i + 1 < n ? in_section[i + 1]->start : len;
+            sym->piece = p;
+        }
+    }
+    free(in_section);
+    return pieces;
+}
+
+static Buf * elf_contents(Object *obj, ElfPiece *p) {
+    Buf *src;
+    switch (p->section) {
+    case SEC_TEXT:   src = obj->text; break;
+    case SEC_RODATA: src = obj->rodata; break;
+    case SEC_CST4:   src = obj->cst4; break;
+    case SEC_CST8:   src = obj->cst8; break;
+    case SEC_CSTRING: src = obj->cstrings; break;
+    case SEC_DATA:   src = obj->data; break;
+    case SEC_TDATA:  src = obj->tdata; break;
+    default:         return NULL; // '.bss' and '.tbss'
+    }
+    Buf *b = buf_new();
+    buf_nprint(b, &src->data[p->start], p->end - p->start);
+    return b;
+}
+
+static void elf_sym(Buf *symtab, Buf *strtab, Symbol *sym) {
+    ElfPiece *p = sym->piece;
+    int type = sym->section == SEC_UNDEF ? STT_NOTYPE : (sym->is_fn ? STT_FUNC : STT_OBJECT);
+    if (sym->is_tls) {
+        type = STT_TLS; // Even if undefined
+    }
+    int bind = sym->is_global ? STB_GLOBAL : STB_LOCAL;
+    int vis = sym->is_hidden ? STV_HIDDEN : STV_DEFAULT;
+    w(symtab, w_str(strtab, elf_sym_name(sym)), 4);   // st_name
+    w(symtab, (uint64_t) ((bind << 4) | type), 1);    // st_info
+    w(symtab, (uint64_t) vis, 1);                     // st_other
+    w(symtab, p ? p->shndx : 0, 2);                   // st_shndx
+    w(symtab, p ? sym->offset - p->start : 0, 8);     // st_value
+    w(symtab, sym->size, 8);                          // st_size
+}
+
+// Locals have to come first, starting with a symbol for each of the first
+// 'num_secs' sections (other than the null section), at the same index as the
+// section; returns the index of the first global
+static size_t elf_symtab(Object *obj, size_t num_secs, Buf *symtab, Buf *strtab) {
+    buf_push(strtab, 0);
+    w(symtab, 0, 24); // Null symbol
+    for (size_t i = 1; i < num_secs; i++) {
+        w(symtab, 0, 4);               // st_name
+        w(symtab, STT_SECTION, 1);     // st_info: local
+        w(symtab, 0, 1);               // st_other
+        w(symtab, i, 2);               // st_shndx
+        w(symtab, 0, 16);              // st_value, st_size
+    }
+    size_t n = num_secs, first_global = num_secs;
+    for (int global = 0; global <= 1; global++) {
+        for (size_t i = 0; i < vec_len(obj->syms); i++) {
+            Symbol *sym = vec_get(obj->syms, i);
+            if (sym->is_global == global) {
+                elf_sym(symtab, strtab, sym);
+                sym->idx = n++;
+            }
+        }
+        if (!global) {
+            first_global = n;
+        }
+    }
+    return first_global;
+}
+
+// Relocations are in order of offset, so each piece takes the ones from
+// '*next' up to its end
+static Buf * elf_relocs(Vec *relocs, size_t *next, ElfPiece *p) {
+    Buf *rela = buf_new();
+    for (; *next < vec_len(relocs); (*next)++) {
+        Reloc *r = vec_get(relocs, *next);
+        if (r->offset >= p->end) {
+            break;
+        }
+        assert(r->offset >= p->start);
+        uint64_t type = R_X86_64_NONE;
+        int64_t addend = r->addend;
+        switch (r->k) {
+        case RELOC_ABS64: type = R_X86_64_64; break;
+        case RELOC_PC32:  type = R_X86_64_PC32; addend -= r->pc_bias; break;
+        case RELOC_CALL:  type = R_X86_64_PLT32; addend -= r->pc_bias; break;
+        case RELOC_TPOFF32:  type = R_X86_64_TPOFF32; break;
+        case RELOC_GOTTPOFF: type = R_X86_64_GOTTPOFF; addend -= r->pc_bias; break;
+        case RELOC_GOT_LOAD: type = R_X86_64_REX_GOTPCRELX; addend -= r->pc_bias; break;
+        case RELOC_GOT_CALL: type = R_X86_64_GOTPCRELX; addend -= r->pc_bias; break;
+        default: UNREACHABLE();
+        }
+        w(rela, r->offset - p->start, 8);                  // r_offset
+        w(rela, ((uint64_t) r->sym->idx << 32) | type, 8); // r_info
+        w(rela, (uint64_t) addend, 8);                     // r_addend
+    }
+    return rela;
+}
+
+static Buf * elf_sec_relocs(Vec *relocs) {
+    Buf *rela = buf_new();
+    for (size_t i = 0; i < vec_len(relocs); i++) {
+        ElfReloc *r = vec_get(relocs, i);
+        w(rela, r->offset, 8);                            // r_offset
+        w(rela, ((uint64_t) r->shndx << 32) | r->type, 8); // r_info
+        w(rela, (uint64_t) r->addend, 8);                 // r_addend
+    }
+    return rela;
+}
+
+// Writes the bytes to be relocated as zeros, and records the relocation
+static void sec_reloc(ElfSection *s, uint32_t type, size_t shndx, int64_t addend) {
+    ElfReloc *r = malloc(sizeof(ElfReloc));
+    r->offset = s->contents->len;
+    r->type = type;
+    r->shndx = shndx;
+    r->addend = addend;
+    vec_push(s->relocs, r);
+    w(s->contents, 0, type == R_X86_64_64 ? 8 : 4);
+}
+
+// Relocations against a function go against the section it's in, since a
+// global function's symbol could be preempted in a shared library
+static void fn_reloc(ElfSection *s, uint32_t type, Symbol *sym, uint64_t offset) {
+    ElfPiece *p = sym->piece;
+    sec_reloc(s, type, p->shndx, (int64_t) (sym->offset - p->start + offset));
+}
+
+static void uleb(Buf *b, uint64_t v) {
+    do {
+        uint8_t byte = v & 0x7f;
+        v >>= 7;
+        buf_push(b, (char) (byte | (v ? 0x80 : 0)));
+    } while (v);
+}
+
+static void sleb(Buf *b, int64_t v) {
+    while (1) {
+        uint8_t byte = v & 0x7f;
+        v >>= 7; // Arithmetic
+        if ((v == 0 && !(byte & 0x40)) || (v == -1 && (byte & 0x40))) {
+            buf_push(b, (char) byte);
+            return;
+        }
+        buf_push(b, (char) (byte | 0x80));
+    }
+}
+
+static void w_cstr(Buf *b, char *s) {
+    buf_print(b, s);
+    buf_push(b, 0);
+}
+
+// Functions, in the order they are in '.text'
+static Vec * elf_fns(Object *obj) {
+    Vec *fns = vec_new();
+    for (size_t i = 0; i < vec_len(obj->syms); i++) {
+        Symbol *sym = vec_get(obj->syms, i);
+        if (sym->is_fn && sym->section == SEC_TEXT) {
+            vec_push(fns, sym);
+        }
+    }
+    qsort(fns->data, vec_len(fns), sizeof(void *), cmp_sym_start);
+    return fns;
+}
+
+// '.eh_frame' has a CIE with the frame on entry to a function (the CFA is
+// rsp + 8, with the return address below it), then an FDE for each function
+// with the changes to its frame (see 'FrameRow'). Unwinders and profilers
+// use it to walk the stack, which they can't do by following rbp when the
+// frame pointer's omitted
+
+enum { // DWARF call frame instructions
+    DW_CFA_advance_loc = 0x40, DW_CFA_offset = 0x80, DW_CFA_restore = 0xc0,
+    DW_CFA_advance_loc1 = 0x02, DW_CFA_advance_loc2 = 0x03, DW_CFA_advance_loc4 = 0x04,
+    DW_CFA_def_cfa = 0x0c, DW_CFA_def_cfa_register = 0x0d, DW_CFA_def_cfa_offset = 0x0e,
+};
+
+#define DW_EH_PE_PCREL_SDATA4 0x1b
+#define DWARF_RA 16 // The return address' column
+
+static int DWARF_GPR[LAST_GPR] = {
+    [RAX] = 0, [RDX] = 1, [RCX] = 2, [RBX] = 3, [RSI] = 4, [RDI] = 5, [RBP] = 6,
+    [RSP] = 7, [R8] = 8, [R9] = 9, [R10] = 10, [R11] = 11, [R12] = 12,
+    [R13] = 13, [R14] = 14, [R15] = 15,
+};
+
+static void cfa_advance(Buf *b, uint64_t delta) {
+    if (delta < 0x40) {
+        buf_push(b, (char) (DW_CFA_advance_loc | delta));
+    } else if (delta <= 0xff) {
+        buf_push(b, DW_CFA_advance_loc1);
+        w(b, delta, 1);
+    } else if (delta <= 0xffff) {
+        buf_push(b, DW_CFA_advance_loc2);
+        w(b, delta, 2);
+    } else {
+        buf_push(b, DW_CFA_advance_loc4);
+        w(b, delta, 4);
+    }
+}
+
+static void cfa_row(Buf *b, FrameRow *prev, FrameRow *row) {
+    if (row->cfa_reg != prev->cfa_reg && row->cfa_off != prev->cfa_off) {
+        buf_push(b, DW_CFA_def_cfa);
+        uleb(b, (uint64_t) DWARF_GPR[row->cfa_reg]);
+        uleb(b, (uint64_t) row->cfa_off);
+    } else if (row->cfa_reg != prev->cfa_reg) {
+        buf_push(b, DW_CFA_def_cfa_register);
+        uleb(b, (uint64_t) DWARF_GPR[row->cfa_reg]);
+    } else if (row->cfa_off != prev->cfa_off) {
+        buf_push(b, DW_CFA_def_cfa_offset);
+        uleb(b, (uint64_t) row->cfa_off);
+    }
+    for (int reg = RAX; reg < LAST_GPR; reg++) {
+        if (row->saved[reg] == prev->saved[reg]) {
+            continue;
+        } else if (row->saved[reg] == 0) {
+            buf_push(b, (char) (DW_CFA_restore | DWARF_GPR[reg]));
+        } else {
+            buf_push(b, (char) (DW_CFA_offset | DWARF_GPR[reg]));
+            uleb(b, (uint64_t) row->saved[reg] / 8); // Factored by -8
+        }
+    }
+}
+
+// Entries are padded with DW_CFA_nop (0) to 8 bytes; 'start' is where the
+// entry's length goes
+static void eh_entry_end(Buf *b, size_t start) {
+    w_pad(b, 8);
+    patch(b, start, b->len - start - 4, 4);
+}
+
+static void eh_cie(Buf *b) {
+    w(b, 0, 4); // Length
+    w(b, 0, 4); // CIE ID
+    w(b, 1, 1); // Version
+    w_cstr(b, "zR");
+    uleb(b, 1);  // Code alignment factor
+    sleb(b, -8); // Data alignment factor
+    uleb(b, DWARF_RA);
+    uleb(b, 1);  // Augmentation data length
+    w(b, DW_EH_PE_PCREL_SDATA4, 1); // FDE address encoding
+    buf_push(b, DW_CFA_def_cfa);
+    uleb(b, (uint64_t) DWARF_GPR[RSP]);
+    uleb(b, 8);
+    buf_push(b, (char) (DW_CFA_offset | DWARF_RA));
+    uleb(b, 1);
+    eh_entry_end(b, 0);
+}
+
+static void eh_fde(ElfSection *s, Symbol *sym) {
+    Buf *b = s->contents;
+    size_t start = b->len;
+    w(b, 0, 4);         // Length
+    w(b, start + 4, 4); // Back to the CIE
+    fn_reloc(s, R_X86_64_PC32, sym, 0); // Start
+    w(b, sym->size, 4);
+    uleb(b, 0);         // Augmentation data length
+    FrameRow prev = { .cfa_reg = RSP, .cfa_off = 8 };
+    for (size_t i = 0; i < vec_len(sym->frame); i++) {
+        FrameRow *row = vec_get(sym->frame, i);
+        cfa_advance(b, row->offset - prev.offset);
+        cfa_row(b, &prev, row);
+        prev = *row;
+    }
+    eh_entry_end(b, start);
+}
+
+static void elf_eh_frame(ElfSection *s, Vec *fns) {
+    eh_cie(s->contents);
+    for (size_t i = 0; i < vec_len(fns); i++) {
+        eh_fde(s, vec_get(fns, i));
+    }
+}
+
+// With '-g', there's a DWARF 4 line table, mapping each function's code back
+// to the lines of its source file (see 'LineRow'), and the compile unit
+// '.debug_info' needs for tools to find it, whose address ranges are each of
+// the functions. There's no information about types or variables
+
+enum { // DWARF line number program opcodes
+    DW_LNS_copy = 1, DW_LNS_advance_pc = 2, DW_LNS_advance_line = 3, DW_LNS_set_file = 4,
+    DW_LNE_end_sequence = 1, DW_LNE_set_address = 2,
+};
+
+#define DW_LINE_BASE   (-5)
+#define DW_LINE_RANGE  14
+#define DW_OPCODE_BASE 13
+
+static char STD_OPCODE_LENGTHS[DW_OPCODE_BASE - 1] = { 0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1 };
+
+enum { // The compile unit's attributes
+    DW_TAG_compile_unit = 0x11,
+    DW_AT_name = 0x03, DW_AT_stmt_list = 0x10, DW_AT_low_pc = 0x11,
+    DW_AT_language = 0x13, DW_AT_comp_dir = 0x1b, DW_AT_producer = 0x25,
+    DW_AT_ranges = 0x55,
+    DW_FORM_addr = 0x01, DW_FORM_data1 = 0x0b, DW_FORM_string = 0x08,
+    DW_FORM_sec_offset = 0x17,
+    DW_LANG_C99 = 0x0c,
+};
+
+static int CU_ATTRS[][2] = {
+    { DW_AT_producer, DW_FORM_string }, { DW_AT_language, DW_FORM_data1 },
+    { DW_AT_name, DW_FORM_string }, { DW_AT_comp_dir, DW_FORM_string },
+    { DW_AT_stmt_list, DW_FORM_sec_offset }, { DW_AT_low_pc, DW_FORM_addr },
+    { DW_AT_ranges, DW_FORM_sec_offset },
+};
+
+static size_t file_idx(Vec *files, char *file) { // 1 based
+    for (size_t i = 0; i < vec_len(files); i++) {
+        if (strcmp(vec_get(files, i), file) == 0) {
+            return i + 1;
+        }
+    }
+    vec_push(files, file);
+    return vec_len(files);
+}
+
+// One sequence for each function, since with '-ffunction-sections' they
+// could end up anywhere relative to each other
+static void line_sequence(ElfSection *s, Symbol *sym, size_t file) {
+    Buf *b = s->contents;
+    buf_push(b, 0); // Extended opcode
+    uleb(b, 9);
+    buf_push(b, DW_LNE_set_address);
+    fn_reloc(s, R_X86_64_64, sym, 0);
+    if (file != 1) {
+        buf_push(b, DW_LNS_set_file);
+        uleb(b, file);
+    }
+    uint64_t offset = 0;
+    int line = 1;
+    for (size_t i = 0; i < vec_len(sym->lines); i++) {
+        LineRow *row = vec_get(sym->lines, i);
+        if (row->offset > offset) {
+            buf_push(b, DW_LNS_advance_pc);
+            uleb(b, row->offset - offset);
+        }
+        if (row->line != line) {
+            buf_push(b, DW_LNS_advance_line);
+            sleb(b, row->line - line);
+        }
+        buf_push(b, DW_LNS_copy);
+        offset = row->offset;
+        line = row->line;
+    }
+    buf_push(b, DW_LNS_advance_pc);
+    uleb(b, sym->size - offset);
+    buf_push(b, 0);
+    uleb(b, 1);
+    buf_push(b, DW_LNE_end_sequence);
+}
+
+static void elf_debug_line(ElfSection *s, Vec *fns) {
+    Vec *files = vec_new();
+    for (size_t i = 0; i < vec_len(fns); i++) {
+        Symbol *sym = vec_get(fns, i);
+        file_idx(files, sym->file);
+    }
+    Buf *b = s->contents;
+    w(b, 0, 4); // Unit length
+    w(b, 4, 2); // Version
+    w(b, 0, 4); // Header length
+    w(b, 1, 1); // Minimum instruction length
+    w(b, 1, 1); // Maximum operations per instruction
+    w(b, 1, 1); // Default 'is_stmt'
+    w(b, (uint64_t) DW_LINE_BASE, 1);
+    w(b, DW_LINE_RANGE, 1);
+    w(b, DW_OPCODE_BASE, 1);
+    buf_nprint(b, STD_OPCODE_LENGTHS, sizeof(STD_OPCODE_LENGTHS));
+    buf_push(b, 0); // No include directories; files are relative to 'comp_dir'
+    for (size_t i = 0; i < vec_len(files); i++) {
+        w_cstr(b, vec_get(files, i));
+        uleb(b, 0); // Directory
+        uleb(b, 0); // Modification time
+        uleb(b, 0); // Length
+    }
+    buf_push(b, 0);
+    patch(b, 6, b->len - 10, 4);
+    for (size_t i = 0; i < vec_len(fns); i++) {
+        Symbol *sym = vec_get(fns, i);
+        line_sequence(s, sym, file_idx(files, sym->file));
+    }
+    patch(b, 0, b->len - 4, 4);
+    vec_free(files);
+}
+
+static void elf_debug_abbrev(Buf *b) {
+    uleb(b, 1); // Abbreviation code
+    uleb(b, DW_TAG_compile_unit);
+    buf_push(b, 0); // No children
+    for (size_t i = 0; i < sizeof(CU_ATTRS) / sizeof(CU_ATTRS[0]); i++) {
+        uleb(b, (uint64_t) CU_ATTRS[i][0]);
+        uleb(b, (uint64_t) CU_ATTRS[i][1]);
+    }
+    uleb(b, 0);
+    uleb(b, 0);
+    uleb(b, 0); // End of the abbreviations
+}
+
+static void elf_debug_ranges(ElfSection *s, Vec *fns) {
+    for (size_t i = 0; i < vec_len(fns); i++) {
+        Symbol *sym = vec_get(fns, i);
+        fn_reloc(s, R_X86_64_64, sym, 0);
+        fn_reloc(s, R_X86_64_64, sym, sym->size);
+    }
+    w(s->contents, 0, 16);
+}
+
+static void elf_debug_info(ElfSection *s, Vec *fns, size_t abbrev, size_t line,
+                           size_t ranges) {
+    Buf *b = s->contents;
+    w(b, 0, 4); // Unit length
+    w(b, 4, 2); // Version
+    sec_reloc(s, R_X86_64_32, abbrev, 0);
+    w(b, 8, 1); // Address size
+    uleb(b, 1); // The compile unit's abbreviation
+    w_cstr(b, "Cosec");
+    w(b, DW_LANG_C99, 1);
+    Symbol *first = vec_get(fns, 0);
+    w_cstr(b, first->file);
+    char *dir = getcwd(NULL, 0);
+    w_cstr(b, dir ? dir : ".");
+    free(dir);
+    sec_reloc(s, R_X86_64_32, line, 0);
+    w(b, 0, 8); // Low PC; the ranges are absolute
+    sec_reloc(s, R_X86_64_32, ranges, 0);
+    patch(b, 0, b->len - 4, 4);
+}
+
+static ElfSection * elf_reloc_section(Vec *secs, char *name, uint32_t type, uint64_t flags,
+                                      uint64_t align) {
+    ElfSection *s = elf_new_section(secs, name, type, flags, align, buf_new());
+    s->relocs = vec_new();
+    return s;
+}
+
+// Adds '.eh_frame', and with '-g' the debug info, after the pieces
+static void elf_unwind_and_debug(Vec *secs, Object *obj) {
+    Vec *fns = elf_fns(obj);
+    if (vec_len(fns) == 0) {
+        vec_free(fns);
+        return;
+    }
+    ElfSection *eh = elf_reloc_section(secs, ".eh_frame", SHT_X86_64_UNWIND, SHF_ALLOC, 8);
+    elf_eh_frame(eh, fns);
+    if (DEBUG_INFO) {
+        size_t info_idx = vec_len(secs);
+        ElfSection *info = elf_reloc_section(secs, ".debug_info", SHT_PROGBITS, 0, 1);
+        ElfSection *abbrev = elf_reloc_section(secs, ".debug_abbrev", SHT_PROGBITS, 0, 1);
+        ElfSection *line = elf_reloc_section(secs, ".debug_line", SHT_PROGBITS, 0, 1);
+        ElfSection *ranges = elf_reloc_section(secs, ".debug_ranges", SHT_PROGBITS, 0, 1);
+        elf_debug_info(info, fns, info_idx + 1, info_idx + 2, info_idx + 3);
+        elf_debug_abbrev(abbrev->contents);
+        elf_debug_line(line, fns);
+        elf_debug_ranges(ranges, fns);
+    }
+    vec_free(fns);
+}
+
+static void elf_section_header(Buf *f, ElfSection *s) {
+    w(f, s->name_off, 4);
+    w(f, s->type, 4);
+    w(f, s->flags, 8);
+    w(f, 0, 8); // sh_addr
+    w(f, s->offset, 8);
+    w(f, s->size, 8);
+    w(f, s->link, 4);
+    w(f, s->info, 4);
+    w(f, s->align, 8);
+    w(f, s->entsize, 8);
+}
+
+// Appends a section's contents to the file and records where they went
+static void elf_section(Buf *f, ElfSection *s) {
+    w_pad(f, s->align);
+    s->offset = f->len;
+    if (s->contents) {
+        s->size = s->contents->len;
+        w_buf(f, s->contents);
+    }
+}
+
+void encode_elf64(FILE *out, Object *obj) {
+    Vec *pieces = elf_pieces(obj);
+
+    Vec *secs = vec_new();
+    elf_new_section(secs, "", 0, 0, 0, NULL);
+    for (size_t i = 0; i < vec_len(pieces); i++) {
+        ElfPiece *p = vec_get(pieces, i);
+        p->shndx = vec_len(secs);
+        uint64_t flags = SHF_ALLOC;
+        switch (p->section) {
+        case SEC_TEXT: flags |= SHF_EXEC; break;
+        case SEC_CST4: case SEC_CST8: flags |= SHF_MERGE; break;
+        case SEC_CSTRING: flags |= SHF_MERGE | SHF_STRINGS; break;
+        case SEC_DATA: case SEC_BSS: flags |= SHF_WRITE; break;
+        case SEC_TDATA: case SEC_TBSS: flags |= SHF_WRITE | SHF_TLS; break;
+        }
+        int nobits = p->section == SEC_BSS || p->section == SEC_TBSS;
+        ElfSection *s = elf_new_section(secs, section_name(p->section, p->label, p->fn_attrs),
+                                        nobits ? SHT_NOBITS : SHT_PROGBITS,
+                                        flags, p->align, elf_contents(obj, p));
+        s->size = p->end - p->start; // For '.bss', which has no contents
+        if (flags & SHF_MERGE) {
+            s->entsize = section_align(obj, p->section); // One constant, or 'char'
+        }
+    }
+
+    elf_unwind_and_debug(secs, obj);
+
+    Buf *symtab = buf_new(), *strtab = buf_new(), *shstrtab = buf_new();
+    size_t num_sec_syms = vec_len(secs);
+    size_t first_global = elf_symtab(obj, num_sec_syms, symtab, strtab);
+    size_t next_text = 0, next_data = 0, next_tdata = 0;
+    for (size_t i = 0; i < vec_len(pieces); i++) {
+        ElfPiece *p = vec_get(pieces, i);
+        Buf *rela;
+        if (p->section == SEC_TEXT) {
+            rela = elf_relocs(obj->text_relocs, &next_text, p);
+        } else if (p->section == SEC_DATA) {
+            rela = elf_relocs(obj->data_relocs, &next_data, p);
+        } else if (p->section == SEC_TDATA) {
+            rela = elf_relocs(obj->tdata_relocs, &next_tdata, p);
+        } else {
+            continue; // Never has relocations
+        }
+        if (rela->len == 0) {
+            continue;
+        }
+        Buf *name = buf_new();
+        buf_print(name, ".rela");
+        buf_print(name, section_name(p->section, p->label, p->fn_attrs));
+        buf_push(name, '\0');
+        ElfSection *s = elf_new_section(secs, name->data, SHT_RELA, SHF_INFO_LINK, 8, rela);
+        s->info = (uint32_t) p->shndx;
+        s->entsize = 24;
+    }
+    for (size_t i = 1; i < num_sec_syms; i++) {
+        ElfSection *target = vec_get(secs, i);
+        if (!target->relocs || vec_len(target->relocs) == 0) {
+            continue;
+        }
+        Buf *name = buf_new();
+        buf_print(name, ".rela");
+        buf_print(name, target->name);
+        buf_push(name, '\0');
+        ElfSection *s = elf_new_section(secs, name->data, SHT_RELA, SHF_INFO_LINK, 8,
+                                        elf_sec_relocs(target->relocs));
+        s->info = (uint32_t) i;
+        s->entsize = 24;
+    }
+    size_t symtab_idx = vec_len(secs);
+    ElfSection *sym_s = elf_new_section(secs, ".symtab", SHT_SYMTAB, 0, 8, symtab);
+    sym_s->link = (uint32_t) symtab_idx + 1; // '.strtab'
+    sym_s->info = (uint32_t) first_global;
+    sym_s->entsize = 24;
+    elf_new_section(secs, ".strtab", SHT_STRTAB, 0, 1, strtab);
+    elf_new_section(secs, ".note.GNU-stack", SHT_PROGBITS, 0, 1, NULL); // Non-executable stack
+    elf_new_section(secs, ".shstrtab", SHT_STRTAB, 0, 1, shstrtab);
+    size_t num_secs = vec_len(secs);
+    buf_push(shstrtab, 0);
+    for (size_t i = 1; i < num_secs; i++) {
+        ElfSection *s = vec_get(secs, i);
+        if (s->type == SHT_RELA) {
+            s->link = (uint32_t) symtab_idx;
+        }
+        s->name_off = (uint32_t) w_str(shstrtab, s->name);
+    }
+
+    Buf *f = buf_new();
+    w(f, 0, 64); // ELF header, filled in below
+    for (size_t i = 1; i < num_secs; i++) {
+        elf_section(f, vec_get(secs, i));
+    }
+    w_pad(f, 8);
+    size_t shoff = f->len;
+    for (size_t i = 0; i < num_secs; i++) {
+        elf_section_header(f, vec_get(secs, i));
+    }
+
+    Buf *e = buf_new();
+    w(e, 0x464c457f, 4); // "\x7fELF"
+    w(e, 2, 1); // 64-bit
+    w(e, 1, 1); // Little endian
+    w(e, 1, 1); // ELF version
+    w(e, 0, 9); // System V ABI, and padding
+    w(e, 1, 2);  // e_type: relocatable
+    w(e, 62, 2); // e_machine: x86-64
+    w(e, 1, 4);  // e_version
+    w(e, 0, 8);  // e_entry
+    w(e, 0, 8);  // e_phoff
+    w(e, shoff, 8);
+    w(e, 0, 4);  // e_flags
+    w(e, 64, 2); // e_ehsize
+    w(e, 0, 2);  // e_phentsize
+    w(e, 0, 2);  // e_phnum
+    w(e, 64, 2); // e_shentsize
+    w(e, num_secs, 2);
+    w(e, num_secs - 1, 2); // e_shstrndx: '.shstrtab' is last
+    memcpy(f->data, e->data, 64);
+    fwrite(f->data, 1, f->len, out);
+}
+
+
+// ---- Mach-O ----------------------------------------------------------------
+
+enum {
+    MH_MAGIC_64 = 0xfeedfacf,
+    CPU_TYPE_X86_64 = 0x01000007,
+    CPU_SUBTYPE_X86_64_ALL = 3,
+    MH_OBJECT = 1,
+    LC_SYMTAB = 0x2,
+    LC_DYSYMTAB = 0xb,
+    LC_SEGMENT_64 = 0x19,
+    LC_BUILD_VERSION = 0x32,
+    PLATFORM_MACOS = 1,
+};
+
+enum { N_EXT = 0x1, N_PEXT = 0x10, N_UNDF = 0x0, N_SECT = 0xe };
+enum { // Relocation types
+    X86_64_RELOC_UNSIGNED = 0,
+    X86_64_RELOC_SIGNED = 1,
+    X86_64_RELOC_BRANCH = 2,
+    X86_64_RELOC_GOT_LOAD = 3, // A 'mov' from the GOT entry
+    X86_64_RELOC_GOT = 4,      // Anything else that uses it
+    X86_64_RELOC_SIGNED_1 = 6, // With 1, 2, or 4 bytes of immediate after
+    X86_64_RELOC_SIGNED_2 = 7,
+    X86_64_RELOC_SIGNED_4 = 8,
+};
+
+#define MACHO_HEADER_SIZE 32
+#define MACHO_SEGMENT_SIZE (72 + 5 * 80) // '__text', '__const', '__cstring', '__data', '__bss'
+#define MACHO_CMDS_SIZE (MACHO_SEGMENT_SIZE + 24 + 24 + 80)
+
+static int macho_sym_order(Symbol *sym) {
+    if (!sym->is_global) {
+        return 0; // Local
+    }
+    return sym->section == SEC_UNDEF ? 2 : 1; // External defined, undefined
+}
+
+static int cmp_macho_syms(const void *a, const void *b) {
+    Symbol *l = *(Symbol **) a, *r = *(Symbol **) b;
+    int lo = macho_sym_order(l), ro = macho_sym_order(r);
+    if (lo != ro) {
+        return lo - ro;
+    } else if (lo == 0) {
+        return l->idx < r->idx ? -1 : 1; // Locals stay in order
+    }
+    return strcmp(l->name, r->name);
+}
+
+static size_t macho_relocs(Buf *relocs, Buf *contents, Vec *to_write) {
+    for (size_t i = 0; i < vec_len(to_write); i++) {
+        Reloc *r = vec_get(to_write, i);
+        uint32_t type = X86_64_RELOC_UNSIGNED, pcrel = 1, len = 2; // 4 bytes
+        switch (r->k) {
+        case RELOC_ABS64: type = X86_64_RELOC_UNSIGNED; pcrel = 0; len = 3; break;
+        case RELOC_CALL:  type = X86_64_RELOC_BRANCH; break;
+        case RELOC_GOT_LOAD: type = X86_64_RELOC_GOT_LOAD; break;
+        case RELOC_GOT_CALL: type = X86_64_RELOC_GOT; break;
+        case RELOC_PC32:
+            switch (r->pc_bias - 4) {
+            case 0: type = X86_64_RELOC_SIGNED; break;
+            case 1: type = X86_64_RELOC_SIGNED_1; break;
+            case 2: type = X86_64_RELOC_SIGNED_2; break;
+            case 4: type = X86_64_RELOC_SIGNED_4; break;
+            default: UNREACHABLE();
+            }
+            break;
+        default: UNREACHABLE();
+        }
+        patch(contents, r->offset, (uint64_t) r->addend, len == 3 ? 8 : 4);
+        w(relocs, r->offset, 4); // r_address
+        w(relocs, (uint32_t) r->sym->idx | (pcrel << 24) | (len << 25) |
+                  (1u << 27) | (type << 28), 4); // Always 'r_extern'
+    }
+    return vec_len(to_write);
+}
+
+static void macho_section(Buf *f, char *sect, char *seg, uint64_t addr, uint64_t size,
+                          uint64_t offset, size_t align, uint64_t reloff,
+                          uint64_t nreloc, uint32_t flags) {
+    w_name(f, sect, 16);
+    w_name(f, seg, 16);
+    w(f, addr, 8);
+    w(f, size, 8);
+    w(f, offset, 4);
+    w(f, log2_align(align), 4);
+    w(f, reloff, 4);
+    w(f, nreloc, 4);
+    w(f, flags, 4);
+    w(f, 0, 12); // reserved1-3
+}
+
+void encode_macho64(FILE *out, Object *obj) {
+    for (size_t i = 0; i < vec_len(obj->syms); i++) {
+        Symbol *sym = vec_get(obj->syms, i);
+        if (sym->is_tls) { // Needs thread-local variable descriptors
+            error("thread-local '%s' isn't supported in Mach-O output", &sym->name[1]);
+        }
+    }
+
+    // Symbol table: locals, then external definitions, then undefined
+    size_t num_syms = vec_len(obj->syms);
+    Symbol **syms = malloc(sizeof(Symbol *) * (num_syms + 1));
+    for (size_t i = 0; i < num_syms; i++) {
+        syms[i] = vec_get(obj->syms, i);
+        syms[i]->idx = i;
+    }
+    qsort(syms, num_syms, sizeof(Symbol *), cmp_macho_syms);
+    size_t num_of[3] = {0};
+    for (size_t i = 0; i < num_syms; i++) {
+        syms[i]->idx = i;
+        num_of[macho_sym_order(syms[i])]++;
+    }
+
+    // Sections are laid out one after the other, in order; '__bss' takes no
+    // space in the file. The floating point constant pool goes at the end of
+    // '__const', doubles first, and string literals in '__cstring' after it
+    size_t text_off = align_to(MACHO_HEADER_SIZE + MACHO_CMDS_SIZE, 16);
+    size_t const_align = obj->cst8->len > 0 && obj->rodata_align < 8 ? 8 : obj->rodata_align;
+    size_t const_addr = align_to(obj->text->len, const_align);
+    size_t cst8_addr = align_to(const_addr + obj->rodata->len, 8);
+    size_t cst4_addr = cst8_addr + obj->cst8->len;
+    size_t const_size = cst4_addr + obj->cst4->len - const_addr;
+    size_t cstring_addr = const_addr + const_size;
+    size_t data_addr = align_to(cstring_addr + obj->cstrings->len, obj->data_align);
+    size_t bss_addr = align_to(data_addr + obj->data->len, obj->bss_align);
+    size_t const_off = text_off + const_addr;
+    size_t cstring_off = text_off + cstring_addr;
+    size_t data_off = text_off + data_addr;
+    size_t file_size = data_addr + obj->data->len;
+    size_t vm_size = bss_addr + obj->bss_size;
+    size_t sect_addr[] = { [SEC_TEXT] = 0, [SEC_RODATA] = const_addr,
+                           [SEC_CST4] = cst4_addr, [SEC_CST8] = cst8_addr,
+                           [SEC_CSTRING] = cstring_addr, [SEC_DATA] = data_addr,
+                           [SEC_BSS] = bss_addr };
+    int sect_num[] = { [SEC_TEXT] = 1, [SEC_RODATA] = 2, [SEC_CST4] = 2, [SEC_CST8] = 2,
+                       [SEC_CSTRING] = 3, [SEC_DATA] = 4, [SEC_BSS] = 5 };
+
+    Buf *text_relocs = buf_new(), *data_relocs = buf_new();
+    size_t num_text_relocs = macho_relocs(text_relocs, obj->text, obj->text_relocs);
+    size_t num_data_relocs = macho_relocs(data_relocs, obj->data, obj->data_relocs);
+
+    Buf *symtab = buf_new(), *strtab = buf_new();
+    buf_push(strtab, ' '); // Offset 0 is the empty name
+    buf_push(strtab, 0);
+    for (size_t i = 0; i < num_syms; i++) {
+        Symbol *sym = syms[i];
+        w(symtab, w_str(strtab, sym->name), 4); // n_strx
+        if (sym->section == SEC_UNDEF) {
+            w(symtab, N_UNDF | N_EXT, 1);
+            w(symtab, 0, 1);
+            w(symtab, 0, 2);
+            w(symtab, 0, 8);
+        } else {
+            w(symtab, N_SECT | (sym->is_global ? N_EXT : 0) | (sym->is_hidden ? N_PEXT : 0), 1);
+            w(symtab, sect_num[sym->section], 1); // n_sect
+            w(symtab, 0, 2); // n_desc
+            w(symtab, sect_addr[sym->section] + sym->offset, 8);
+        }
+    }
+    w_pad(strtab, 8);
+
+    size_t text_reloff = align_to(data_off + obj->data->len, 8);
+    size_t data_reloff = text_reloff + text_relocs->len;
+    size_t symoff = align_to(data_reloff + data_relocs->len, 8);
+    size_t stroff = symoff + symtab->len;
+
+    Buf *f = buf_new();
+    w(f, MH_MAGIC_64, 4);
+    w(f, CPU_TYPE_X86_64, 4);
+    w(f, CPU_SUBTYPE_X86_64_ALL, 4);
+    w(f, MH_OBJECT, 4);
+    w(f, 4, 4); // ncmds
+    w(f, MACHO_CMDS_SIZE, 4);
+    w(f, 0, 4); // flags
+    w(f, 0, 4); // reserved
+
+    w(f, LC_SEGMENT_64, 4);
+    w(f, MACHO_SEGMENT_SIZE, 4);
+    w_name(f, "", 16); // Objects have a single unnamed segment
+    w(f, 0, 8);        // vmaddr
+    w(f, vm_size, 8);
+    w(f, text_off, 8); // fileoff
+    w(f, file_size, 8);
+    w(f, 7, 4);        // maxprot: rwx
+    w(f, 7, 4);        // initprot
+    w(f, 5, 4);        // nsects
+    w(f, 0, 4);        // flags
+    macho_section(f, "__text", "__TEXT", 0, obj->text->len, text_off, obj->text_align,
+                  num_text_relocs ? text_reloff : 0, num_text_relocs,
+                  0x80000400); // S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS
+    macho_section(f, "__const", "__TEXT", const_addr, const_size, const_off,
+                  const_align, 0, 0, 0);
+    macho_section(f, "__cstring", "__TEXT", cstring_addr, obj->cstrings->len, cstring_off,
+                  1, 0, 0, 0x2); // S_CSTRING_LITERALS
+    macho_section(f, "__data", "__DATA", data_addr, obj->data->len, data_off,
+                  obj->data_align, num_data_relocs ? data_reloff : 0,
+                  num_data_relocs, 0);
+    macho_section(f, "__bss", "__DATA", bss_addr, obj->bss_size, 0,
+                  obj->bss_align, 0, 0, 0x1); // S_ZEROFILL
+
+    w(f, LC_BUILD_VERSION, 4);
+    w(f, 24, 4);
+    w(f, PLATFORM_MACOS, 4);
+    w(f, 0x000b0000, 4); // minos: 11.0
+    w(f, 0, 4);          // sdk
+    w(f, 0, 4);          // ntools
+
+    w(f, LC_SYMTAB, 4);
+    w(f, 24, 4);
+    w(f, symoff, 4);
+    w(f, num_syms, 4);
+    w(f, stroff, 4);
+    w(f, strtab->len, 4);
+
+    w(f, LC_DYSYMTAB, 4);
+    w(f, 80, 4);
+    w(f, 0, 4);                       // ilocalsym
+    w(f, num_of[0], 4);               // nlocalsym
+    w(f, num_of[0], 4);               // iextdefsym
+    w(f, num_of[1], 4);               // nextdefsym
+    w(f, num_of[0] + num_of[1], 4);   // iundefsym
+    w(f, num_of[2], 4);               // nundefsym
+    w(f, 0, 4 * 12); // No TOC, modules, indirect symbols, or local relocs
+
+    assert(f->len == MACHO_HEADER_SIZE + MACHO_CMDS_SIZE);
+    w_pad(f, 16);
+    w_buf(f, obj->text);
+    while (f->len < const_off) {
+        buf_push(f, 0);
+    }
+    w_buf(f, obj->rodata);
+    while (f->len < text_off + cst8_addr) {
+        buf_push(f, 0);
+    }
+    w_buf(f, obj->cst8);
+    w_buf(f, obj->cst4);
+    w_buf(f, obj->cstrings);
+    while (f->len < data_off) {
+        buf_push(f, 0);
+    }
+    w_buf(f, obj->data);
+    w_pad(f, 8);
+    w_buf(f, text_relocs);
+    w_buf(f, data_relocs);
+    w_pad(f, 8);
+    w_buf(f, symtab);
+    w_buf(f, strtab);
+    fwrite(f->data, 1, f->len, out);
+    free(syms);
+}
@@ -0,0 +1,15 @@
+
+#ifndef COSEC_OBJECT_H
+#define COSEC_OBJECT_H
+
+#include <stdio.h>
+
+#include "x64.h"
+
+// Object files. Writes the machine code from 'encode_x64' out as a relocatable
+// ELF64 (Linux) or Mach-O (macOS) object file, which can be passed straight to
+// the linker without going through NASM
+void encode_elf64(FILE *out, Object *obj);
+void encode_macho64(FILE *out, Object *obj);
+
+#endif
@@ -1,12 +1,15 @@
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <ctype.h>
 #include <limits.h>
 #include <inttypes.h>
 
 #include "parse.h"
 #include "pp.h"
 #include "error.h"
+#include "stats.h"
 
 enum {
     SCOPE_FILE,
@@ -15,13 +18,29 @@ enum {
     SCOPE_SWITCH,
 };
 
+// Static functions defined in headers (e.g., the many 'static inline' ones
+// in system headers) mostly go unused, so their bodies are kept as tokens
+// until the function's referenced, and dropped if it never is
+typedef struct {
+    File *main;
+    Map *used; // of 'AstNode *'; by name, every function referenced
+    Vec *fns;  // of 'AstNode *' with k = N_FN_DEF, whose bodies are deferred
+    Vec *aggrs; // of 'AggrDef *'; every struct and union defined (or NULL if
+                // they aren't wanted), which is file-wide state like the above
+    DeclHook hook; // Where top-level nodes go, if they aren't kept (see 'parse')
+    void *hook_arg;
+} Deferred;
+
 typedef struct Scope {
     struct Scope *outer;
     int k;
     PP *pp;
-    Map *vars;   // of 'AstNode *' with k = N_LOCAL, N_GLOBAL, or N_TYPEDEF
-    Map *tags;   // of 'AstType *'
+    ScopedMap *vars; // of 'AstNode *' with k = N_LOCAL, N_GLOBAL, N_TYPEDEF,
+                     // or N_IMM; shared with every scope inside this one
+    ScopedMap *tags; // of 'AstType *'
     AstNode *fn; // NULL in file scope
+    Deferred *deferred; // NULL when only parsing constant expressions
+    int in_static_init; // Parsing a static local's initializer
 
     // For SCOPE_SWITCH
     Vec *cases;         // of 'AstNode *' with k = N_CASE
@@ -29,13 +48,24 @@ typedef struct Scope {
     AstType *cond_t;    // Type of the condition
 } Scope;
 
+// Most nodes are expressions, which only use the first few fields of the
+// union; only N_FN_DEF, N_FOR, and N_SWITCH are given the whole thing
+#define SMALL_NODE_SIZE (offsetof(AstNode, imm) + 3 * sizeof(void *))
+
 static AstNode * node(int k, Token *tk) {
-    AstNode *n = calloc(1, sizeof(AstNode));
+    int is_big = k == N_FN_DEF || k == N_FOR || k == N_SWITCH;
+    AstNode *n = arena_alloc(ARENA_AST, is_big ? sizeof(AstNode) : SMALL_NODE_SIZE);
+    STATS[STAT_AST_NODES]++;
     n->k = k;
     n->tk = tk;
     return n;
 }
 
+// For constant expressions; '*dst = *src' would run off the end of a small node
+static void copy_node(AstNode *dst, AstNode *src) {
+    memcpy(dst, src, SMALL_NODE_SIZE);
+}
+
 
 // ---- Scope -----------------------------------------------------------------
 
@@ -43,8 +73,8 @@ static Scope new_scope(int k, PP *pp) {
     Scope s = {0};
     s.k = k;
     s.pp = pp;
-    s.vars = map_new();
-    s.tags = map_new();
+    s.vars = smap_new();
+    s.tags = smap_new();
     return s;
 }
 
@@ -52,9 +82,12 @@ static void enter_scope(Scope *inner, Scope *outer, int k) {
     *inner = (Scope) {0};
     inner->k = k;
     inner->pp = outer->pp;
-    inner->vars = map_new();
-    inner->tags = map_new();
+    inner->vars = outer->vars;
+    inner->tags = outer->tags;
+    smap_enter(inner->vars);
+    smap_enter(inner->tags);
     inner->fn = outer->fn;
+    inner->deferred = outer->deferred;
     inner->outer = outer;
     if (k == SCOPE_SWITCH) {
         inner->cases = vec_new();
@@ -63,6 +96,12 @@ static void enter_scope(Scope *inner, Scope *outer, int k) {
     }
 }
 
+// The switch's 'cases' outlive it, in its 'N_SWITCH'
+static void exit_scope(Scope *s) {
+    smap_exit(s->vars);
+    smap_exit(s->tags);
+}
+
 static Scope * find_scope(Scope *s, int k) {
     while (s && s->k != k) {
         s = s->outer;
@@ -76,7 +115,7 @@ static Scope * find_scope(Scope *s, int k) {
 #define NOT_FOUND ((size_t) -1)
 
 static AstType * t_new(int k) {
-    AstType *t = calloc(1, sizeof(AstType));
+    AstType *t = arena_alloc(ARENA_AST, sizeof(AstType));
     t->k = k;
     switch (t->k) {
     case T_CHAR:  t->size = t->align = 1; break;
@@ -85,6 +124,7 @@ static AstType * t_new(int k) {
     case T_LLONG: case T_DOUBLE: case T_LDOUBLE: case T_PTR: case T_FN:
         t->size = t->align = 8;
         break;
+    case T_I128: t->size = t->align = 16; break;
     case T_ARR: t->align = 8; break;
     default: break;
     }
@@ -103,6 +143,24 @@ static AstType * t_ptr(AstType *base) {
     return t;
 }
 
+// Set while a function body that's freed once it's parsed (see
+// 'stream_fn_body') is being parsed
+static THREAD_LOCAL int IN_STREAMED_BODY;
+
+// Expressions that take an address all share the same pointer type; only a
+// declarator builds its own (which 'restrict' and the linkage get set on). In
+// a body that's freed, the type might be from outside it (and outlive it), so
+// isn't given one that would be freed
+static AstType * t_ptr_to(AstType *base) {
+    if (!base->ptr_to && IN_STREAMED_BODY) {
+        return t_ptr(base);
+    }
+    if (!base->ptr_to) {
+        base->ptr_to = t_ptr(base);
+    }
+    return base->ptr_to;
+}
+
 static void set_arr_len(AstType *t, AstNode *len) {
     t->len = len;
     if (len && len->k == N_IMM) {
@@ -113,39 +171,114 @@ static void set_arr_len(AstType *t, AstNode *len) {
 static AstType * t_arr(AstType *elem, AstNode *len) {
     AstType *t = t_new(T_ARR);
     t->elem = elem;
+    t->align = elem->align > t->align ? elem->align : t->align;
     set_arr_len(t, len);
     return t;
 }
 
+static AstType * t_vec(AstType *elem, size_t size) {
+    AstType *t = t_new(T_VEC);
+    t->elem = elem;
+    t->len = NULL;
+    t->size = t->align = size;
+    return t;
+}
+
 static AstType * t_fn(AstType *ret, Vec *params, int is_vararg) {
     AstType *t = t_new(T_FN);
     t->ret = ret;
     t->params = params;
     t->is_vararg = is_vararg;
+    t->no_instrument = 0;
+    t->patchable_entry = -1;
+    t->fn_attrs = 0;
     return t;
 }
 
+// '_Atomic' qualifies a copy of the type, since the type itself might be shared
+// (e.g., by a typedef). Only integers and pointers, which fit in a GPR, can be
+// accessed atomically
+static AstType * t_atomic(Token *err, AstType *t) {
+    if (t->is_atomic) {
+        return t;
+    }
+    if (t->k != T_PTR && !(t->k >= T_CHAR && t->k <= T_LLONG)) {
+        error_at(err, "'_Atomic' is only supported for integer and pointer types");
+    }
+    AstType *atomic = t_new(t->k);
+    *atomic = *t;
+    atomic->ptr_to = NULL;
+    atomic->is_atomic = 1;
+    return atomic;
+}
+
+// '__attribute__((aligned(N)))' likewise qualifies a copy. It only ever raises
+// the alignment, and a struct or union is padded out to it, so each element of
+// an array of them is aligned too. A struct or union that isn't defined yet
+// can't be copied (its definition wouldn't reach the copy), so it's left be
+static AstType * t_aligned(AstType *t, size_t align) {
+    if (align <= t->align || ((t->k == T_STRUCT || t->k == T_UNION) && !t->fields)) {
+        return t;
+    }
+    AstType *aligned = t_new(t->k);
+    *aligned = *t;
+    aligned->ptr_to = NULL;
+    aligned->align = align;
+    if (t->k == T_STRUCT || t->k == T_UNION) {
+        aligned->size += pad(aligned->size, align);
+    }
+    return aligned;
+}
+
+// Bit-fields are packed into units the size of their type, aligned like it.
+// One that would straddle two units starts the next one instead, as does one
+// with a width of 0. Unnamed bit-fields are only there for the layout, so
+// they're left out of 't->fields' (and don't raise the alignment)
 static void set_struct_fields(AstType *t, Vec *fields) {
-    t->fields = fields;
+    t->fields = vec_new();
+    size_t bit = t->size * 8; // Next free bit
     for (size_t i = 0; i < vec_len(fields); i++) { // Pick largest align
         Field *f = vec_get(fields, i);
-        t->size += pad(t->size, f->t->align);
-        f->offset = t->size;
-        t->size += f->t->size;
+        if (f->is_bit_field) {
+            size_t unit = f->t->size * 8;
+            if (f->bits == 0 || bit / unit != (bit + f->bits - 1) / unit) {
+                bit += pad(bit, unit);
+            }
+            f->offset = bit / unit * f->t->size;
+            f->bit_offset = bit - f->offset * 8;
+            bit += f->bits;
+            t->size = (bit + 7) / 8 > t->size ? (bit + 7) / 8 : t->size;
+            if (!f->name) {
+                continue;
+            }
+            // The whole unit's read and written, so the struct has to cover it
+            size_t end = f->offset + f->t->size;
+            t->size = end > t->size ? end : t->size;
+        } else {
+            bit += pad(bit, f->t->align * 8);
+            f->offset = bit / 8;
+            bit += f->t->size * 8;
+            t->size = bit / 8 > t->size ? bit / 8 : t->size;
+        }
         t->align = f->t->align > t->align ? f->t->align : t->align;
+        vec_push(t->fields, f);
     }
+    t->size += pad(t->size, t->align); // Trailing padding, so arrays stay aligned
 }
 
 static void set_union_fields(AstType *t, Vec *fields) {
-    t->fields = fields;
+    t->fields = vec_new();
     for (size_t i = 0; i < vec_len(fields); i++) { // Pick largest align
         Field *f = vec_get(fields, i);
-        f->offset = 0;
-        if (f->t->size > t->size) {
-            t->size = f->t->size;
-            t->align = f->t->align;
+        if (f->is_bit_field && !f->name) {
+            continue;
         }
+        f->offset = 0;
+        t->size = f->t->size > t->size ? f->t->size : t->size;
+        t->align = f->t->align > t->align ? f->t->align : t->align;
+        vec_push(t->fields, f);
     }
+    t->size += pad(t->size, t->align);
 }
 
 static void set_enum_consts(AstType *t, Vec *consts, AstType *num_t) {
@@ -156,15 +289,18 @@ static void set_enum_consts(AstType *t, Vec *consts, AstType *num_t) {
 }
 
 static Field * new_field(AstType *t, char *name) {
-    Field *f = malloc(sizeof(Field));
+    Field *f = arena_alloc(ARENA_AST, sizeof(Field));
     f->t = t;
     f->name = name;
     f->offset = 0;
+    f->is_bit_field = 0;
+    f->bits = 0;
+    f->bit_offset = 0;
     return f;
 }
 
 static EnumConst * new_enum_const(char *name, uint64_t val) {
-    EnumConst *k = malloc(sizeof(EnumConst));
+    EnumConst *k = arena_alloc(ARENA_AST, sizeof(EnumConst));
     k->name = name;
     k->val = val;
     return k;
@@ -185,7 +321,7 @@ static size_t find_field(AstType *t, char *name) {
 }
 
 static int is_int(AstType *t) {
-    return t->k >= T_CHAR && t->k <= T_LLONG;
+    return t->k >= T_CHAR && t->k <= T_I128;
 }
 
 static int is_fp(AstType *t) {
@@ -196,6 +332,10 @@ static int is_num(AstType *t) {
     return is_int(t) || is_fp(t);
 }
 
+static int is_vec(AstType *t) {
+    return t->k == T_VEC;
+}
+
 static int is_void_ptr(AstType *t) {
     return t->k == T_PTR && t->ptr->k == T_VOID;
 }
@@ -243,7 +383,7 @@ static int is_incomplete(AstType *t) {
 }
 
 static int are_equal(AstType *a, AstType *b) {
-    if (!a && !b) return 1;
+    if (a == b) return 1; // Also the same struct, union, or enum tag
     if (!a || !b) return 0;
     if (a->k != b->k) return 0;
     switch (a->k) {
@@ -254,6 +394,7 @@ static int are_equal(AstType *a, AstType *b) {
             return 0;
         }
         return are_equal(a->elem, b->elem);
+    case T_VEC: return a->size == b->size && are_equal(a->elem, b->elem);
     case T_FN:
         if (vec_len(a->params) != vec_len(b->params)) return 0;
         if (a->is_vararg != b->is_vararg) return 0;
@@ -294,7 +435,7 @@ static int are_equal(AstType *a, AstType *b) {
 }
 
 static void expect_val(AstNode *n) {
-    if (n->t->k == T_STRUCT || n->t->k == T_UNION) {
+    if (n->t->k == T_STRUCT || n->t->k == T_UNION || n->t->k == T_VEC) {
         error_at(n->tk, "expected pointer or arithmetic type");
     }
 }
@@ -325,6 +466,17 @@ static void expect_lval(AstNode *n) {
     if (n->t->k == T_VOID) error_at(n->tk, "'void' type is not an lvalue");
 }
 
+static int is_bit_field(AstNode *n) {
+    return n->k == N_FIELD &&
+           ((Field *) vec_get(n->obj->t->fields, n->field_idx))->is_bit_field;
+}
+
+// Bit-fields aren't addressable, so they can't be the operand of '&', etc.
+static void expect_addressable(AstNode *n) {
+    expect_lval(n);
+    if (is_bit_field(n)) error_at(n->tk, "cannot take the address of a bit-field");
+}
+
 static void expect_assignable(AstNode *n) {
     expect_lval(n);
     if (n->t->k == T_ARR) error_at(n->tk, "array type is not assignable");
@@ -335,12 +487,7 @@ static void expect_assignable(AstNode *n) {
 // ---- Variables, Typedefs, and Tags -----------------------------------------
 
 static AstNode * find_var(Scope *s, char *name) {
-    while (s) {
-        AstNode *var = map_get(s->vars, name);
-        if (var) return var;
-        s = s->outer;
-    }
-    return NULL;
+    return smap_get(s->vars, name);
 }
 
 static AstType * find_typedef(Scope *s, char *name) {
@@ -352,12 +499,7 @@ static AstType * find_typedef(Scope *s, char *name) {
 }
 
 static AstType * find_tag(Scope *s, char *tag) {
-    while (s) {
-        AstType *t = map_get(s->tags, tag);
-        if (t) return t;
-        s = s->outer;
-    }
-    return NULL;
+    return smap_get(s->tags, tag);
 }
 
 static void def_symbol(Scope *s, AstNode *n) {
@@ -366,7 +508,7 @@ static void def_symbol(Scope *s, AstNode *n) {
         v = find_var(s, n->var_name);
         if (v && !are_equal(n->t, v->t)) goto err_type;
     }
-    v = map_get(s->vars, n->var_name);
+    v = smap_get_local(s->vars, n->var_name);
     if (!v) goto okay; // No previous definition
     if (n->k != v->k) goto err_symbol;
     if (!are_equal(n->t, v->t)) goto err_type;
@@ -395,7 +537,17 @@ err_static1:
 err_static2:
     error_at(n->tk, "static declaration of '%s' follows non-static declaration", n->var_name);
 okay:
-    map_put(s->vars, n->var_name, n);
+    if (v && !n->t->visibility) {
+        n->t->visibility = v->t->visibility;
+    }
+    if (v && n->t->k == T_FN && v->t->k == T_FN) { // Keep earlier attributes
+        n->t->no_instrument |= v->t->no_instrument;
+        n->t->fn_attrs |= v->t->fn_attrs;
+        if (n->t->patchable_entry < 0) {
+            n->t->patchable_entry = v->t->patchable_entry;
+        }
+    }
+    smap_put(s->vars, n->var_name, n);
 }
 
 static AstNode * def_var(Scope *s, Token *name, AstType *t) {
@@ -423,7 +575,7 @@ static AstNode * def_typedef(Scope *s, Token *name, AstType *t) {
 }
 
 static void def_enum_const(Scope *s, Token *name, AstType *t, int64_t val) {
-    AstNode *v = map_get(s->vars, name->ident);
+    AstNode *v = smap_get_local(s->vars, name->ident);
     if (v && v->k != N_IMM) {
         error_at(name, "redefinition of '%s' as a different kind of symbol", name->ident);
     } else if (v) {
@@ -432,26 +584,32 @@ static void def_enum_const(Scope *s, Token *name, AstType *t, int64_t val) {
     AstNode *n = node(N_IMM, name);
     n->t = t;
     n->imm = val;
-    map_put(s->vars, name->ident, n);
+    smap_put(s->vars, name->ident, n);
 }
 
 
 // ---- Literals --------------------------------------------------------------
 
+// Any order and case of 'u', 'l', or 'll'
 static AstType * parse_int_suffix(char *s) {
-    if (strcasecmp(s, "u") == 0) {
-        return t_num(T_INT, 1);
-    } else if (strcasecmp(s, "l") == 0) {
-        return t_num(T_LONG, 0);
-    } else if (strcasecmp(s, "ul") == 0 || strcasecmp(s, "lu") == 0) {
-        return t_num(T_LONG, 1);
-    } else if (strcasecmp(s, "ll") == 0) {
-        return t_num(T_LLONG, 0);
-    } else if (strcasecmp(s, "ull") == 0 || strcasecmp(s, "llu") == 0) {
-        return t_num(T_LLONG, 1);
-    } else {
+    int is_unsigned = 0, longs = 0;
+    if ((*s | 0x20) == 'u') {
+        is_unsigned = 1;
+        s++;
+    }
+    if ((*s | 0x20) == 'l') {
+        longs = ((s[1] | 0x20) == 'l') ? 2 : 1;
+        s += longs;
+    }
+    if (!is_unsigned && (*s | 0x20) == 'u') {
+        is_unsigned = 1;
+        s++;
+    }
+    if (*s != '\0') {
         return NULL;
     }
+    int k = longs == 0 ? T_INT : longs == 1 ? T_LONG : T_LLONG;
+    return t_num(k, is_unsigned);
 }
 
 static AstType * smallest_type_for_int(uint64_t num, int signed_only) {
@@ -469,25 +627,47 @@ static AstType * smallest_type_for_int(uint64_t num, int signed_only) {
     }
 }
 
+static int digit_val(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20; // Lower case
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return 16; // Not a digit in any base
+}
+
 static AstNode * parse_int(Token *tk) {
-    char *suffix;
-    uint64_t num;
-    if (strncasecmp(tk->num, "0b", 2) == 0) { // strotoul can't read '0b' prefix
-        num = strtoul(tk->num + 2, &suffix, 2);
-    } else { // strtoul can read '0x' and '0' prefix
-        num = strtoul(tk->num, &suffix, 0);
+    char *p = tk->num;
+    int base = 10;
+    if (p[0] == '0' && (p[1] | 0x20) == 'x') {
+        base = 16;
+        p += 2;
+    } else if (p[0] == '0' && (p[1] | 0x20) == 'b') {
+        base = 2;
+        p += 2;
+    } else if (p[0] == '0') {
+        base = 8;
+    }
+    if (digit_val(*p) >= base) {
+        p = tk->num + 1; // No digits after the prefix; it's a bad suffix on '0'
+    }
+    uint64_t num = 0;
+    for (int d; (d = digit_val(*p)) < base; p++) {
+        if (num > (UINT64_MAX - (uint64_t) d) / (uint64_t) base) {
+            num = UINT64_MAX; // Saturate, like 'strtoull'
+        } else {
+            num = num * (uint64_t) base + (uint64_t) d;
+        }
     }
+    char *suffix = p;
     AstType *t;
     if (*suffix == '\0') { // No suffix; select type based on how large 'num' is
-        int is_base_10 = (*tk->num != '0');
-        t = smallest_type_for_int(num, is_base_10);
+        t = smallest_type_for_int(num, base == 10);
     } else { // Type specified by suffix
         t = parse_int_suffix(suffix);
         if (!t) {
             error_at(tk, "invalid integer suffix '%s'", suffix);
         }
         size_t bits = t->size * 8;
-        uint64_t invalid_bits = bits >= 64 ? 0 : ~((1 << bits) - 1);
+        uint64_t invalid_bits = bits >= 64 ? 0 : ~(((uint64_t) 1 << bits) - 1);
         if ((num & invalid_bits) != 0) {
             warning_at(tk, "integer '%s' too large for specified type", tk->num);
         }
@@ -508,9 +688,59 @@ static AstType * parse_float_suffix(char *s) {
     }
 }
 
+// Every power of 10 up to 1e22 is exactly representable as a double
+static double POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+    1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Clinger's fast path: a decimal whose significant digits fit in 53 bits and
+// whose exponent is at most 22 is a single correctly rounded multiply or
+// divide of two exact doubles. Returns 0 for anything else (e.g., hex floats)
+static int parse_float_fast(char *s, double *num, char **suffix) {
+    uint64_t m = 0;
+    int digits = 0, exp = 0;
+    char *p = s;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        if (m == 0 && *p == '0') continue; // Leading zeros aren't significant
+        if (++digits > 19) return 0;
+        m = m * 10 + (uint64_t) (*p - '0');
+    }
+    if (*p == '.') {
+        for (p++; *p >= '0' && *p <= '9'; p++) {
+            exp--;
+            if (m == 0 && *p == '0') continue;
+            if (++digits > 19) return 0;
+            m = m * 10 + (uint64_t) (*p - '0');
+        }
+    }
+    if ((*p | 0x20) == 'e') {
+        p++;
+        int neg = (*p == '-');
+        if (*p == '+' || *p == '-') p++;
+        if (!(*p >= '0' && *p <= '9')) return 0;
+        int e = 0;
+        for (; *p >= '0' && *p <= '9'; p++) {
+            if (e < 10000) e = e * 10 + (*p - '0');
+        }
+        exp += neg ? -e : e;
+    } else if ((*p | 0x20) == 'x' || (*p | 0x20) == 'p') {
+        return 0; // Hex float
+    }
+    if (m > ((uint64_t) 1 << 53) || exp < -22 || exp > 22) {
+        return 0;
+    }
+    *num = exp < 0 ? (double) m / POW10[-exp] : (double) m * POW10[exp];
+    *suffix = p;
+    return 1;
+}
+
 static AstNode * parse_float(Token *tk) {
     char *suffix;
-    double num = strtod(tk->num, &suffix);
+    double num;
+    if (!parse_float_fast(tk->num, &num, &suffix)) {
+        num = strtod(tk->num, &suffix);
+    }
     AstType *t;
     if (*suffix == '\0') { // No suffix; always a double
         t = t_num(T_DOUBLE, 0);
@@ -526,62 +756,82 @@ static AstNode * parse_float(Token *tk) {
     return n;
 }
 
+static int is_float_lit(char *s) {
+    int is_hex = (s[0] == '0' && (s[1] | 0x20) == 'x');
+    for (; *s; s++) {
+        char c = (char) (*s | 0x20);
+        if (*s == '.' || c == 'p' || (!is_hex && c == 'e')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 static AstNode * parse_num(Scope *s) {
     Token *tk = expect_tk(s->pp, TK_NUM);
-    if (strpbrk(tk->num, ".pP") ||
-            (strncasecmp(tk->num, "0x", 2) != 0 && strpbrk(tk->num, "eE"))) {
+    if (is_float_lit(tk->num)) {
         return parse_float(tk);
     } else {
         return parse_int(tk);
     }
 }
 
-static Token * concat_strs(Scope *s) {
-    Buf *buf = buf_new();
-    Token *t = peek_tk(s->pp);
-    assert(t->k == TK_STR);
-    Token *str = copy_tk(t);
-    while (t->k == TK_STR) {
-        t = next_tk(s->pp);
-        if (t->enc > str->enc) {
-            str->enc = t->enc;
-        }
-        buf_nprint(buf, t->str, t->len);
-        t = peek_tk(s->pp);
-    }
-    buf_push(buf, '\0');
-    str->str = buf->data;
-    str->len = buf->len;
-    return str;
-}
-
+// Adjacent string literals are concatenated, taking the widest encoding of any
+// of them. Each piece is decoded straight into a buffer of the final size, and
+// the result is interned, so identical literals share one copy of their
+// contents (and one global; see 'compile_expr')
 static AstNode * parse_str(Scope *s) {
-    Token *tk = concat_strs(s);
-    AstType *elem = NULL;
-    AstNode *n = node(N_STR, tk);
-    n->enc = tk->enc;
-    switch (tk->enc) {
-    case ENC_NONE:
-        n->len = tk->len;
-        n->str = tk->str;
-        elem = t_num(T_CHAR, 0);
-        break;
-    case ENC_CHAR16:
-        n->str16 = utf8_to_utf16(tk->str, tk->len, &n->len);
-        elem = t_num(T_SHORT, 1);
-        break;
-    case ENC_CHAR32: case ENC_WCHAR:
-        n->str32 = utf8_to_utf32(tk->str, tk->len, &n->len);
-        elem = t_num(T_INT, 1);
-        break;
+    Token *tk = copy_tk(peek_tk(s->pp));
+    assert(tk->k == TK_STR);
+    Vec *pieces = vec_new();
+    size_t max_len = 1; // For the null terminator
+    int enc = ENC_NONE;
+    while (peek_tk(s->pp)->k == TK_STR) {
+        Token *t = copy_tk(next_tk(s->pp));
+        vec_push(pieces, t);
+        max_len += t->len;
+        if (t->enc > enc) {
+            enc = t->enc;
+        }
     }
-    if (!n->str) {
-        error_at(tk, "invalid UTF-8 string");
+    size_t elem_size = enc == ENC_NONE ? 1 : enc == ENC_CHAR16 ? 2 : 4;
+    char *str = malloc(max_len * elem_size);
+    size_t len = 0;
+    for (size_t i = 0; i < vec_len(pieces); i++) {
+        Token *t = vec_get(pieces, i);
+        int ok = 1;
+        switch (enc) {
+        case ENC_NONE:
+            memcpy(&str[len], t->str, t->len);
+            len += t->len;
+            break;
+        case ENC_CHAR16: ok = utf8_to_utf16(t->str, t->len, (uint16_t *) str, &len); break;
+        case ENC_CHAR32: case ENC_WCHAR:
+            ok = utf8_to_utf32(t->str, t->len, (uint32_t *) str, &len);
+            break;
+        }
+        if (!ok) {
+            error_at(t, "invalid UTF-8 string");
+        }
     }
-    AstNode *len = node(N_IMM, tk);
-    len->t = t_num(T_LLONG, 1);
-    len->imm = n->len;
-    n->t = t_arr(elem, len);
+    memset(&str[len * elem_size], 0, elem_size); // Null terminator
+    len++;
+
+    AstNode *n = node(N_STR, tk);
+    n->enc = enc;
+    n->len = len;
+    n->str = intern_n(str, len * elem_size);
+    free(str);
+    AstType *elem = NULL;
+    switch (enc) {
+        case ENC_NONE:   elem = t_num(T_CHAR, 0); break;
+        case ENC_CHAR16: elem = t_num(T_SHORT, 1); break;
+        case ENC_CHAR32: case ENC_WCHAR: elem = t_num(T_INT, 1); break;
+    }
+    AstNode *len_n = node(N_IMM, tk);
+    len_n->t = t_num(T_LLONG, 1);
+    len_n->imm = n->len;
+    n->t = t_arr(elem, len_n);
     return n;
 }
 
@@ -600,8 +850,26 @@ static AstNode * parse_ch(Scope *s) {
 
 // ---- Declaration Specifiers ------------------------------------------------
 
-static AstType * parse_decl_specs(Scope *s, int *sclass);
+// The attributes in a run of '__attribute__((...))'s. 'vector_size' and
+// 'aligned' apply to a type; the others to a function, and are kept on its
+// 'T_FN' type
+typedef struct {
+    size_t vec_size;     // In bytes; 0 if there isn't one
+    Token *vec_err;
+    size_t align;        // 'aligned' or '_Alignas'; 0 if there isn't one
+    Token *fn_attr;      // The first function attribute, for errors
+    int no_instrument;   // 'no_instrument_function'
+    int patchable_entry; // 'patchable_function_entry'; -1 if there isn't one
+    int fn_attrs;        // Set of 'FA_*'
+    int visibility;      // 'VIS_*'; for any declaration with linkage
+} Attrs;
+
+#define NO_ATTRS ((Attrs) { .patchable_entry = -1 })
+
+static void parse_attr(Scope *s, Attrs *a);
+static AstType * parse_decl_specs(Scope *s, int *sclass, int *tquals, Attrs *attrs);
 static AstType * parse_declarator(Scope *s, AstType *base, Token **name, Vec *param_names);
+static AstType * parse_abstract_declarator(Scope *s, AstType *base);
 
 static AstNode * parse_expr_no_commas(Scope *s);
 static int64_t calc_int_expr(AstNode *e);
@@ -610,17 +878,36 @@ static int is_type(Scope *s, Token *t) {
     if (t->k == TK_IDENT) {
         return find_typedef(s, t->ident) != NULL;
     } else {
-        return t->k >= TK_VOID && t->k <= TK_VOLATILE;
+        return t->k >= TK_VOID && t->k <= TK_ATTRIBUTE;
     }
 }
 
+// 'int x : 3'. The width can be up to the size of the type, and only an
+// unnamed bit-field can have a width of 0
+static void parse_bit_field_width(Scope *s, Field *f) {
+    Token *colon = expect_tk(s->pp, ':');
+    AstNode *e = parse_expr_no_commas(s);
+    if (!(is_int(f->t) || f->t->k == T_ENUM) || f->t->k == T_I128 || f->t->is_atomic) {
+        error_at(colon, "bit-field must have integer type");
+    }
+    int64_t bits = calc_int_expr(e);
+    if (bits < 0 || (uint64_t) bits > f->t->size * 8) {
+        error_at(e->tk, "bit-field width must be between 0 and %zu", f->t->size * 8);
+    }
+    if (bits == 0 && f->name) {
+        error_at(e->tk, "named bit-field '%s' cannot have zero width", f->name);
+    }
+    f->is_bit_field = 1;
+    f->bits = (size_t) bits;
+}
+
 static void parse_aggr_fields(Scope *s, AstType *t) {
     expect_tk(s->pp, '{');
     Vec *fields = vec_new();
     while (!peek_tk_is(s->pp, '}') && !peek_tk_is(s->pp, TK_EOF)) {
         Token *tk = peek_tk(s->pp);
         int sclass;
-        AstType *base = parse_decl_specs(s, &sclass);
+        AstType *base = parse_decl_specs(s, &sclass, NULL, NULL);
         if (sclass != SC_NONE) {
             error_at(tk, "illegal storage class specifier in %s field",
                      t->k == T_STRUCT ? "struct" : "union");
@@ -629,21 +916,28 @@ static void parse_aggr_fields(Scope *s, AstType *t) {
             vec_push(fields, new_field(base, NULL));
         }
         while (!peek_tk_is(s->pp, ';') && !peek_tk_is(s->pp, TK_EOF)) {
-            Token *name;
-            AstType *ft = parse_declarator(s, base, &name, NULL);
-            if (is_incomplete(ft)) {
-                error_at(name, "%s field cannot have incomplete type",
-                         t->k == T_STRUCT ? "struct" : "union");
-            }
-            if (is_vla(ft)) {
-                error_at(name, "%s field must have constant size",
-                         t->k == T_STRUCT ? "struct" : "union");
+            Token *name = NULL;
+            AstType *ft = base;
+            if (!peek_tk_is(s->pp, ':')) { // Unnamed bit-fields have no declarator
+                ft = parse_declarator(s, base, &name, NULL);
+                if (is_incomplete(ft)) {
+                    error_at(name, "%s field cannot have incomplete type",
+                             t->k == T_STRUCT ? "struct" : "union");
+                }
+                if (is_vla(ft)) {
+                    error_at(name, "%s field must have constant size",
+                             t->k == T_STRUCT ? "struct" : "union");
+                }
+                if (find_field(t, name->ident) != NOT_FOUND) {
+                    error_at(name, "duplicate field '%s' in %s", name->ident,
+                             t->k == T_STRUCT ? "struct" : "union");
+                }
             }
-            if (find_field(t, name->ident) != NOT_FOUND) {
-                error_at(name, "duplicate field '%s' in %s", name->ident,
-                         t->k == T_STRUCT ? "struct" : "union");
+            Field *f = new_field(ft, name ? name->ident : NULL);
+            if (peek_tk_is(s->pp, ':')) {
+                parse_bit_field_width(s, f);
             }
-            vec_push(fields, new_field(ft, name->ident));
+            vec_push(fields, f);
             if (!next_tk_is(s->pp, ',')) {
                 break;
             }
@@ -685,23 +979,54 @@ static void parse_enum_consts(Scope *s, AstType *t) {
     set_enum_consts(t, consts, num_t);
 }
 
-static void parse_aggr_def(Scope *s, AstType *t) {
+// Attributes between 'struct' and its tag, or after its fields, are in 'a';
+// 'aligned' applies to the struct (or union) itself, wherever it's used
+static void parse_aggr_def(Scope *s, AstType *t, Attrs *a) {
     if (t->k == T_STRUCT || t->k == T_UNION) {
         parse_aggr_fields(s, t);
     } else { // T_ENUM
         parse_enum_consts(s, t);
     }
+    while (next_tk_is(s->pp, TK_ATTRIBUTE)) {
+        parse_attr(s, a);
+    }
+    if (a->fn_attr) {
+        warning_at(a->fn_attr, "ignoring function attribute on a declaration that "
+                   "isn't a function");
+    }
+    if (t->k != T_ENUM && a->align > t->align) {
+        t->align = a->align;
+        t->size += pad(t->size, t->align);
+    }
+}
+
+// For '--struct-layout-report'
+static void record_aggr(Scope *s, AstType *t, char *tag, Token *tk) {
+    if (t->k == T_ENUM || !s->deferred || !s->deferred->aggrs) {
+        return;
+    }
+    AggrDef *d = arena_alloc(ARENA_AST, sizeof(AggrDef));
+    d->t = t;
+    d->tag = tag;
+    d->tk = tk;
+    vec_push(s->deferred->aggrs, d);
 }
 
 static AstType * parse_aggr(Scope *s, int k) {
+    Attrs a = NO_ATTRS;
+    while (next_tk_is(s->pp, TK_ATTRIBUTE)) {
+        parse_attr(s, &a);
+    }
     if (!peek_tk_is(s->pp, TK_IDENT)) { // Anonymous
         AstType *t = t_new(k);
-        parse_aggr_def(s, t);
+        Token *brace = peek_tk(s->pp);
+        parse_aggr_def(s, t, &a);
+        record_aggr(s, t, NULL, brace);
         return t;
     }
     Token *tag = next_tk(s->pp);
     if (peek_tk_is(s->pp, '{')) { // Definition
-        AstType *prev = map_get(s->tags, tag->ident);
+        AstType *prev = smap_get_local(s->tags, tag->ident);
         if (prev && prev->k != k) {
             error_at(tag, "use of tag '%s' does not match previous declaration",
                      tag->ident);
@@ -711,8 +1036,9 @@ static AstType * parse_aggr(Scope *s, int k) {
                      tag->ident);
         }
         AstType *t = prev ? prev : t_new(k);
-        map_put(s->tags, tag->ident, t);
-        parse_aggr_def(s, t);
+        smap_put(s->tags, tag->ident, t);
+        parse_aggr_def(s, t, &a);
+        record_aggr(s, t, tag->ident, tag);
         return t;
     } else { // Declaration/use
         AstType *prev = find_tag(s, tag->ident);
@@ -723,22 +1049,233 @@ static AstType * parse_aggr(Scope *s, int k) {
             return prev;
         } else { // New declaration
             AstType *t = t_new(k);
-            map_put(s->tags, tag->ident, t);
+            smap_put(s->tags, tag->ident, t);
             return t;
         }
     }
 }
 
-static AstType * parse_decl_specs(Scope *s, int *sclass) {
+static void skip_parens(Scope *s) {
+    expect_tk(s->pp, '(');
+    int depth = 1;
+    while (depth > 0) {
+        Token *tk = next_tk(s->pp);
+        if (tk->k == '(') {
+            depth++;
+        } else if (tk->k == ')') {
+            depth--;
+        } else if (tk->k == TK_EOF) {
+            error_at(tk, "expected ')'");
+        }
+    }
+}
+
+static struct { char *name; int attr; } FN_ATTRS[] = {
+    { "always_inline", FA_ALWAYS_INLINE },
+    { "noinline", FA_NOINLINE },
+    { "hot", FA_HOT },
+    { "cold", FA_COLD },
+    { "pure", FA_PURE },
+    { "const", FA_CONST },
+    { NULL, 0 },
+};
+
+// The 'FA_*' for an attribute's name (which can also be spelled with '__'
+// either side, e.g., '__noinline__'), or 0
+static int find_fn_attr(char *attr) {
+    size_t len = strlen(attr);
+    if (len > 4 && strncmp(attr, "__", 2) == 0 && strcmp(&attr[len - 2], "__") == 0) {
+        attr += 2;
+        len -= 4;
+    }
+    for (size_t i = 0; FN_ATTRS[i].name; i++) {
+        if (strlen(FN_ATTRS[i].name) == len && strncmp(attr, FN_ATTRS[i].name, len) == 0) {
+            return FN_ATTRS[i].attr;
+        }
+    }
+    return 0;
+}
+
+// Parses the '((...))' after '__attribute__' into 'a'. Attributes that
+// aren't understood are ignored, with a warning
+static void parse_attr(Scope *s, Attrs *a) {
+    expect_tk(s->pp, '(');
+    expect_tk(s->pp, '(');
+    while (!peek_tk_is(s->pp, ')') && !peek_tk_is(s->pp, TK_EOF)) {
+        Token *name = next_tk(s->pp);
+        char *attr;
+        int fa;
+        if (name->k == TK_IDENT) {
+            attr = name->ident;
+        } else if (name->k >= FIRST_KEYWORD && name->k <= LAST_KEYWORD) {
+            attr = tk2str(name->k); // e.g., 'const'
+        } else {
+            error_at(name, "expected attribute name");
+        }
+        if (strcmp(attr, "vector_size") == 0 || strcmp(attr, "__vector_size__") == 0) {
+            expect_tk(s->pp, '(');
+            AstNode *size = parse_expr_no_commas(s);
+            int64_t bytes = calc_int_expr(size);
+            if (bytes <= 0) {
+                error_at(size->tk, "vector size must be positive");
+            }
+            expect_tk(s->pp, ')');
+            a->vec_size = (size_t) bytes;
+            a->vec_err = size->tk;
+        } else if (strcmp(attr, "aligned") == 0 || strcmp(attr, "__aligned__") == 0) {
+            int64_t align = MAX_ALIGN; // The largest any type needs
+            if (next_tk_is(s->pp, '(')) {
+                AstNode *n = parse_expr_no_commas(s);
+                align = calc_int_expr(n);
+                if (align <= 0 || (align & (align - 1)) != 0) {
+                    error_at(n->tk, "requested alignment is not a positive power of 2");
+                }
+                expect_tk(s->pp, ')');
+            }
+            a->align = (size_t) align > a->align ? (size_t) align : a->align;
+        } else if ((fa = find_fn_attr(attr))) {
+            a->fn_attrs |= fa;
+            a->fn_attr = a->fn_attr ? a->fn_attr : name;
+        } else if (strcmp(attr, "no_instrument_function") == 0 ||
+                   strcmp(attr, "__no_instrument_function__") == 0) {
+            a->no_instrument = 1;
+            a->fn_attr = a->fn_attr ? a->fn_attr : name;
+        } else if (strcmp(attr, "patchable_function_entry") == 0 ||
+                   strcmp(attr, "__patchable_function_entry__") == 0) {
+            expect_tk(s->pp, '(');
+            AstNode *count = parse_expr_no_commas(s);
+            int64_t nops = calc_int_expr(count);
+            if (nops < 0 || nops > MAX_PATCHABLE_ENTRY) {
+                error_at(count->tk, "invalid number of NOPs for 'patchable_function_entry'");
+            }
+            if (next_tk_is(s->pp, ',')) {
+                AstNode *before = parse_expr_no_commas(s);
+                if (calc_int_expr(before) != 0) {
+                    error_at(before->tk, "NOPs before the function's entry aren't supported");
+                }
+            }
+            expect_tk(s->pp, ')');
+            a->patchable_entry = (int) nops;
+            a->fn_attr = a->fn_attr ? a->fn_attr : name;
+        } else if (strcmp(attr, "visibility") == 0 || strcmp(attr, "__visibility__") == 0) {
+            expect_tk(s->pp, '(');
+            if (!peek_tk_is(s->pp, TK_STR)) {
+                error_at(peek_tk(s->pp), "expected string after 'visibility'");
+            }
+            AstNode *vis = parse_str(s);
+            if (strcmp(vis->str, "default") == 0) {
+                a->visibility = VIS_DEFAULT;
+            } else if (strcmp(vis->str, "hidden") == 0 || strcmp(vis->str, "internal") == 0) {
+                a->visibility = VIS_HIDDEN;
+            } else if (strcmp(vis->str, "protected") == 0) {
+                warning_at(vis->tk, "'protected' visibility isn't supported; using 'default'");
+                a->visibility = VIS_DEFAULT;
+            } else {
+                error_at(vis->tk, "visibility must be 'default', 'hidden', 'protected', "
+                         "or 'internal'");
+            }
+            expect_tk(s->pp, ')');
+        } else {
+            warning_at(name, "ignoring unsupported attribute '%s'", attr);
+            if (peek_tk_is(s->pp, '(')) {
+                skip_parens(s);
+            }
+        }
+        if (!next_tk_is(s->pp, ',')) {
+            break;
+        }
+    }
+    expect_tk(s->pp, ')');
+    expect_tk(s->pp, ')');
+}
+
+// Function attributes on anything but a function are ignored
+// '_Alignas(<constant expression>)' or '_Alignas(<type name>)' raises the
+// alignment of what's declared like 'aligned' does; 0 leaves it be
+static void parse_alignas(Scope *s, Attrs *a) {
+    expect_tk(s->pp, '(');
+    size_t align;
+    if (is_type(s, peek_tk(s->pp))) {
+        AstType *t = parse_decl_specs(s, NULL, NULL, NULL);
+        align = parse_abstract_declarator(s, t)->align;
+    } else {
+        AstNode *n = parse_expr_no_commas(s);
+        int64_t v = calc_int_expr(n);
+        if (v < 0 || (v & (v - 1)) != 0) {
+            error_at(n->tk, "requested alignment is not a power of 2");
+        }
+        align = (size_t) v;
+    }
+    expect_tk(s->pp, ')');
+    a->align = align > a->align ? align : a->align;
+}
+
+static void apply_fn_attrs(AstType *t, Attrs *a) {
+    if (!a->fn_attr) {
+        return;
+    } else if (t->k != T_FN) {
+        warning_at(a->fn_attr, "ignoring function attribute on a declaration that "
+                   "isn't a function");
+        return;
+    }
+    t->no_instrument |= a->no_instrument;
+    if (a->patchable_entry >= 0) {
+        t->patchable_entry = a->patchable_entry;
+    }
+    t->fn_attrs |= a->fn_attrs;
+    if ((t->fn_attrs & FA_ALWAYS_INLINE) && (t->fn_attrs & FA_NOINLINE)) {
+        error_at(a->fn_attr, "function can't be both 'always_inline' and 'noinline'");
+    } else if ((t->fn_attrs & FA_HOT) && (t->fn_attrs & FA_COLD)) {
+        error_at(a->fn_attr, "function can't be both 'hot' and 'cold'");
+    }
+}
+
+// Vectors live in SSE registers, so they're at most 16 bytes (there's no AVX)
+static AstType * vec_of(Token *err, AstType *elem, size_t size) {
+    if (!is_num(elem) || elem->k == T_I128) {
+        error_at(err, "invalid vector element type");
+    }
+    if (size % elem->size != 0 || (size & (size - 1)) != 0) {
+        error_at(err, "vector size must be a power of 2 multiple of the element size");
+    }
+    if (size < 4 || size > 16) {
+        error_at(err, "unsupported vector size '%zu' (expected 4, 8, or 16 bytes)", size);
+    }
+    return t_vec(elem, size);
+}
+
+static AstType * parse_attrs(Scope *s, AstType *t) {
+    Attrs a = NO_ATTRS;
+    while (next_tk_is(s->pp, TK_ATTRIBUTE)) {
+        a.vec_size = 0;
+        parse_attr(s, &a);
+        if (a.vec_size) {
+            t = vec_of(a.vec_err, t, a.vec_size);
+        }
+    }
+    if (a.align && t->k != T_FN) {
+        t = t_aligned(t, a.align);
+    }
+    apply_fn_attrs(t, &a);
+    if (a.visibility) {
+        t->visibility = a.visibility;
+    }
+    return t;
+}
+
+// Function attributes in the specifiers are put in 'attrs' (if it's not NULL)
+// for the declarators to pick up
+static AstType * parse_decl_specs(Scope *s, int *sclass, int *tquals, Attrs *attrs) {
     if (!is_type(s, peek_tk(s->pp))) {
         error_at(peek_tk(s->pp), "expected type name");
     }
     int sc = 0, tq = 0, fs = 0;
-    enum { tnone, tvoid, tchar, tint, tfloat, tdouble } kind = 0;
+    enum { tnone, tvoid, tchar, tint, tint128, tfloat, tdouble } kind = 0;
     enum { tlong = 1, tllong, tshort } size = 0;
     enum { tsigned = 1, tunsigned } sign = 0;
     AstType *t = NULL;
-    Token *tk;
+    Attrs a = NO_ATTRS;
+    Token *tk, *atomic = NULL, *tls = NULL;
     while (1) {
         tk = next_tk(s->pp);
         switch (tk->k) {
@@ -747,13 +1284,30 @@ static AstType * parse_decl_specs(Scope *s, int *sclass) {
         case TK_STATIC:   if (sc) { goto sc_err; } sc = SC_STATIC; break;
         case TK_EXTERN:   if (sc) { goto sc_err; } sc = SC_EXTERN; break;
         case TK_REGISTER: if (sc) { goto sc_err; } sc = SC_REGISTER; break;
+        case TK_THREAD_LOCAL: if (tls) { goto sc_err; } tls = tk; break;
         case TK_INLINE:   if (fs) { goto fs_err; } fs = FS_INLINE; break;
         case TK_CONST:    tq |= TQ_CONST; break;
         case TK_RESTRICT: tq |= TQ_RESTRICT; break;
         case TK_VOLATILE: tq |= TQ_VOLATILE; break;
+        case TK_ATOMIC:
+            if (!peek_tk_is(s->pp, '(')) {
+                tq |= TQ_ATOMIC;
+                atomic = tk;
+                break;
+            } else if (t || kind || size || sign) {
+                goto t_err;
+            }
+            next_tk(s->pp); // '_Atomic(<type name>)'
+            t = parse_decl_specs(s, NULL, NULL, NULL);
+            t = t_atomic(tk, parse_abstract_declarator(s, t));
+            expect_tk(s->pp, ')');
+            break;
+        case TK_ATTRIBUTE: parse_attr(s, &a); break;
+        case TK_ALIGNAS:   parse_alignas(s, &a); break;
         case TK_VOID:     if (kind) { goto t_err; } kind = tvoid; break;
         case TK_CHAR:     if (kind) { goto t_err; } kind = tchar; break;
         case TK_INT:      if (kind) { goto t_err; } kind = tint; break;
+        case TK_INT128:   if (kind) { goto t_err; } kind = tint128; break;
         case TK_FLOAT:    if (kind) { goto t_err; } kind = tfloat; break;
         case TK_DOUBLE:   if (kind) { goto t_err; } kind = tdouble; break;
         case TK_SHORT:    if (size) { goto t_err; } size = tshort; break;
@@ -772,31 +1326,55 @@ static AstType * parse_decl_specs(Scope *s, int *sclass) {
         }
         if (size == tshort && !(kind == tnone || kind == tint)) goto t_err;
         if (size == tlong && !(kind == tnone || kind == tint || kind == tdouble)) goto t_err;
-        if (sign && !(kind == tnone || kind == tchar || kind == tint)) goto t_err;
+        if (size && kind == tint128) goto t_err;
+        if (sign && !(kind == tnone || kind == tchar || kind == tint || kind == tint128)) goto t_err;
         if (t && (kind || size || sign)) goto t_err;
     }
 done:
-    (void) tq; // Unused
-    undo_raw_tk(s->pp->l, tk);
+    undo_tk(s->pp, tk);
+    if (tls && sc != SC_NONE && sc != SC_STATIC && sc != SC_EXTERN) {
+        error_at(tls, "'_Thread_local' can only be combined with 'static' or 'extern'");
+    }
     if (sclass) {
-        *sclass = sc;
+        *sclass = sc | (tls ? SC_THREAD_LOCAL : 0);
+    }
+    if (tquals) {
+        *tquals = tq;
+    }
+    if (!t) {
+        int is_unsigned = sign == tunsigned;
+        switch (kind) {
+        case tvoid:   t = t_num(T_VOID, 0); break;
+        case tchar:   t = t_num(T_CHAR, is_unsigned); break;
+        case tint128: t = t_num(T_I128, is_unsigned); break;
+        case tfloat:  t = t_num(T_FLOAT, 0); break;
+        case tdouble: t = t_num(size == tlong ? T_LDOUBLE : T_DOUBLE, 0); break;
+        default:
+            switch (size) {
+                case tshort: t = t_num(T_SHORT, is_unsigned); break;
+                case tlong:  t = t_num(T_LONG, is_unsigned); break;
+                case tllong: t = t_num(T_LLONG, is_unsigned); break;
+                default:     t = t_num(T_INT, is_unsigned); break;
+            }
+            break;
+        }
     }
-    if (t) {
-        return t;
+    if (a.vec_size) {
+        t = vec_of(a.vec_err, t, a.vec_size);
+    }
+    if (a.align) {
+        t = t_aligned(t, a.align);
     }
-    switch (kind) {
-        case tvoid:   return t_num(T_VOID, 0);
-        case tchar:   return t_num(T_CHAR, sign == tunsigned);
-        case tfloat:  return t_num(T_FLOAT, 0);
-        case tdouble: return t_num(size == tlong ? T_LDOUBLE : T_DOUBLE, 0);
-        default: break;
+    if (atomic) {
+        t = t_atomic(atomic, t);
     }
-    switch (size) {
-        case tshort: return t_num(T_SHORT, sign == tunsigned);
-        case tlong:  return t_num(T_LONG, sign == tunsigned);
-        case tllong: return t_num(T_LLONG, sign == tunsigned);
-        default:     return t_num(T_INT, sign == tunsigned);
+    if (attrs) {
+        *attrs = a;
+    } else if (a.fn_attr) {
+        warning_at(a.fn_attr, "ignoring function attribute on a declaration that "
+                   "isn't a function");
     }
+    return t;
 sc_err:
     error_at(tk, "can't have more than one storage class specifier");
 fs_err:
@@ -845,7 +1423,7 @@ static AstType * parse_fn_declarator_param(Scope *s, Token **name) {
     Token *err = peek_tk(s->pp);
     AstType *base = t_num(T_INT, 0); // Parameter types default to 'int'
     if (is_type(s, peek_tk(s->pp))) {
-        base = parse_decl_specs(s, NULL);
+        base = parse_decl_specs(s, NULL, NULL, NULL);
     }
     AstType *t = parse_declarator(s, base, name, NULL);
     if (t->k == T_ARR) { // Array of T is adjusted to pointer to T
@@ -895,26 +1473,47 @@ static AstType * parse_fn_declarator(Scope *s, AstType *ret, Vec *param_names) {
     return t_fn(ret, param_types, is_vararg);
 }
 
+// Attributes after a declarator apply to its base type, e.g., 'int' in
+// 'typedef int v4si __attribute__((vector_size(16)))'
 static AstType * parse_declarator_tail(Scope *s, AstType *base, Vec *param_names) {
     if (peek_tk_is(s->pp, '[')) {
         return parse_array_declarator(s, base);
     } else if (peek_tk_is(s->pp, '(')) {
-        return parse_fn_declarator(s, base, param_names);
+        return parse_attrs(s, parse_fn_declarator(s, base, param_names));
     } else {
-        return base;
+        return parse_attrs(s, base);
     }
 }
 
-static void skip_type_quals(Scope *s) {
-    while (next_tk_is(s->pp, TK_CONST) ||
-           next_tk_is(s->pp, TK_RESTRICT) ||
-           next_tk_is(s->pp, TK_VOLATILE));
+// Only 'restrict' (for alias analysis) and '_Atomic' are kept; the others are
+// ignored
+static int parse_ptr_quals(Scope *s) {
+    int tq = 0;
+    while (1) {
+        if (next_tk_is(s->pp, TK_CONST)) {
+            tq |= TQ_CONST;
+        } else if (next_tk_is(s->pp, TK_RESTRICT)) {
+            tq |= TQ_RESTRICT;
+        } else if (next_tk_is(s->pp, TK_VOLATILE)) {
+            tq |= TQ_VOLATILE;
+        } else if (next_tk_is(s->pp, TK_ATOMIC)) {
+            tq |= TQ_ATOMIC;
+        } else {
+            return tq;
+        }
+    }
 }
 
 static AstType * parse_declarator(Scope *s, AstType *base, Token **name, Vec *param_names) {
-    if (next_tk_is(s->pp, '*')) {
-        skip_type_quals(s);
-        return parse_declarator(s, t_ptr(base), name, param_names);
+    Token *star = next_tk_is(s->pp, '*');
+    if (star) {
+        AstType *ptr = t_ptr(base);
+        int tq = parse_ptr_quals(s);
+        ptr->is_restrict = (tq & TQ_RESTRICT) != 0;
+        if (tq & TQ_ATOMIC) {
+            ptr = t_atomic(star, ptr);
+        }
+        return parse_declarator(s, ptr, name, param_names);
     }
     if (next_tk_is(s->pp, '(')) { // Either sub-declarator or fn parameters
         if (is_type(s, peek_tk(s->pp)) || peek_tk_is(s->pp, ')')) { // Function
@@ -1024,6 +1623,9 @@ static void check_conv(AstNode *l, AstType *dst) {
         error_at(l->tk, "cannot convert between incompatible union types");
     } else if (src->k == T_VOID) {
         error_at(l->tk, "cannot convert from 'void' type");
+    } else if ((src->k == T_VEC || dst->k == T_VEC) &&
+               (src->k != dst->k || src->size != dst->size)) {
+        error_at(l->tk, "can only convert vector to vector of the same size");
     }
 }
 
@@ -1037,6 +1639,8 @@ static void warn_implicit_conv(AstNode *l, AstType *dst) {
                !is_void_ptr(src) && !is_void_ptr(dst) &&
                !are_equal(src->ptr, dst->ptr)) {
         warning_at(l->tk, "conversion between incompatible pointer types");
+    } else if (src->k == T_VEC && !are_equal(src, dst)) {
+        warning_at(l->tk, "conversion between incompatible vector types");
     }
 }
 
@@ -1099,11 +1703,11 @@ static AstNode * discharge(AstNode *l) {
         n = conv_to(l, t_num(T_INT, 0));
         break;
     case T_ARR: // Arrays are converted to pointers
-        n = conv_to(l, t_ptr(l->t->elem));
+        n = conv_to(l, t_ptr_to(l->t->elem));
         break;
     case T_FN: // Functions are converted to pointer to functions
         n = node(N_ADDR, l->tk);
-        n->t = t_ptr(l->t);
+        n->t = t_ptr_to(l->t);
         n->l = l;
         break;
     default: n = l; break;
@@ -1111,6 +1715,8 @@ static AstNode * discharge(AstNode *l) {
     return n;
 }
 
+static AstNode * parse_builtin(Scope *s, Token *name);
+
 static AstNode * parse_operand(Scope *s) {
     AstNode *n;
     Token *tk = peek_tk(s->pp);
@@ -1121,6 +1727,12 @@ static AstNode * parse_operand(Scope *s) {
     case TK_IDENT:
         next_tk(s->pp);
         n = find_var(s, tk->ident);
+        if (n && n->k == N_GLOBAL && n->t->k == T_FN && s->deferred) {
+            map_put(s->deferred->used, n->var_name, n);
+        }
+        if (!n) { // Builtins can be redeclared as something else
+            n = parse_builtin(s, tk);
+        }
         if (!n) error_at(tk, "undeclared identifier '%s'", tk->ident);
         break;
     case '(':
@@ -1133,9 +1745,20 @@ static AstNode * parse_operand(Scope *s) {
     return n;
 }
 
+// A vector's lanes are accessed through a pointer to its first one
+static AstNode * vec_lanes(AstNode *l) {
+    expect_lval(l);
+    AstNode *n = node(N_ADDR, l->tk);
+    n->t = t_ptr_to(l->t->elem);
+    n->l = l;
+    return n;
+}
+
 static AstNode * parse_array_access(Scope *s, AstNode *l) {
     Token *op = expect_tk(s->pp, '[');
-    if (l->t->k != T_ARR) {
+    if (l->t->k == T_VEC) {
+        l = vec_lanes(l);
+    } else if (l->t->k != T_ARR) {
         l = discharge(l);
     }
     if (l->t->k != T_ARR && l->t->k != T_PTR) {
@@ -1152,14 +1775,10 @@ static AstNode * parse_array_access(Scope *s, AstNode *l) {
     return n;
 }
 
-static AstNode * parse_call(Scope *s, AstNode *l) {
-    Token *op = expect_tk(s->pp, '(');
-    l = discharge(l);
-    if (l->t->k != T_PTR || l->t->ptr->k != T_FN) {
-        error_at(l->tk, "expected function type");
-    }
-    AstType *fn_t = l->t->ptr;
-    Vec *args = vec_new();
+// Parses the arguments after the '(', converting them to the parameter types.
+// 'args' has any that have already been parsed, up to and including the comma
+// after them
+static Vec * parse_args(Scope *s, AstType *fn_t, Vec *args) {
     while (!peek_tk_is(s->pp, ')') && !peek_tk_is(s->pp, TK_EOF)) {
         AstNode *arg = parse_subexpr(s, PREC_COMMA);
         arg = discharge(arg);
@@ -1180,13 +1799,352 @@ static AstNode * parse_call(Scope *s, AstNode *l) {
         error_at(peek_tk(s->pp), "too few arguments to function call");
     }
     expect_tk(s->pp, ')');
+    return args;
+}
+
+static void lib_builtin(AstNode *call);
+
+static AstNode * parse_call(Scope *s, AstNode *l) {
+    Token *op = expect_tk(s->pp, '(');
+    l = discharge(l);
+    if (l->t->k != T_PTR || l->t->ptr->k != T_FN) {
+        error_at(l->tk, "expected function type");
+    }
+    AstType *fn_t = l->t->ptr;
     AstNode *n = node(N_CALL, op);
     n->t = fn_t->ret;
     n->fn = l;
-    n->args = args;
+    n->args = parse_args(s, fn_t, vec_new());
+    lib_builtin(n);
+    return n;
+}
+
+typedef struct {
+    char *name;
+    int k;      // 'B_EXPECT', etc.
+    int operand; // Type of the (unsigned) operand, for the bit operations; the
+                 // operation ('N_ADD', etc.) for the atomic read-modify-writes
+} Builtin;
+
+static Builtin BUILTINS[] = {
+    { "__builtin_expect", B_EXPECT, 0 },
+    { "__builtin_popcount", B_POPCOUNT, T_INT },
+    { "__builtin_popcountl", B_POPCOUNT, T_LONG },
+    { "__builtin_popcountll", B_POPCOUNT, T_LLONG },
+    { "__builtin_ctz", B_CTZ, T_INT },
+    { "__builtin_ctzl", B_CTZ, T_LONG },
+    { "__builtin_ctzll", B_CTZ, T_LLONG },
+    { "__builtin_clz", B_CLZ, T_INT },
+    { "__builtin_clzl", B_CLZ, T_LONG },
+    { "__builtin_clzll", B_CLZ, T_LLONG },
+    { "__builtin_bswap16", B_BSWAP, T_SHORT },
+    { "__builtin_bswap32", B_BSWAP, T_INT },
+    { "__builtin_bswap64", B_BSWAP, T_LLONG },
+    { "__builtin_memcpy", B_MEMCPY, 0 },
+    { "__builtin_memset", B_MEMSET, 0 },
+    { "__builtin_memcmp", B_MEMCMP, 0 },
+    { "__builtin_strcmp", B_STRCMP, 0 },
+    { "__builtin_strlen", B_STRLEN, 0 },
+    { "__builtin_assume_aligned", B_ASSUME_ALIGNED, 0 },
+    { "__builtin_prefetch", B_PREFETCH, 0 },
+    { "__builtin_unreachable", B_UNREACHABLE, 0 },
+    { "__builtin_assume", B_ASSUME, 0 },
+    { "__atomic_load_n", B_ATOMIC_LOAD, 0 },
+    { "__atomic_store_n", B_ATOMIC_STORE, 0 },
+    { "__atomic_exchange_n", B_ATOMIC_XCHG, 0 },
+    { "__atomic_compare_exchange_n", B_ATOMIC_CAS, 0 },
+    { "__atomic_fetch_add", B_ATOMIC_FETCH_OP, N_ADD },
+    { "__atomic_fetch_sub", B_ATOMIC_FETCH_OP, N_SUB },
+    { "__atomic_fetch_and", B_ATOMIC_FETCH_OP, N_BIT_AND },
+    { "__atomic_fetch_or", B_ATOMIC_FETCH_OP, N_BIT_OR },
+    { "__atomic_fetch_xor", B_ATOMIC_FETCH_OP, N_BIT_XOR },
+    { "__atomic_add_fetch", B_ATOMIC_OP_FETCH, N_ADD },
+    { "__atomic_sub_fetch", B_ATOMIC_OP_FETCH, N_SUB },
+    { "__atomic_and_fetch", B_ATOMIC_OP_FETCH, N_BIT_AND },
+    { "__atomic_or_fetch", B_ATOMIC_OP_FETCH, N_BIT_OR },
+    { "__atomic_xor_fetch", B_ATOMIC_OP_FETCH, N_BIT_XOR },
+    { "__atomic_thread_fence", B_ATOMIC_FENCE, 0 },
+    { "__atomic_signal_fence", B_SIGNAL_FENCE, 0 },
+    { NULL },
+};
+
+static Builtin * find_builtin(char *name) {
+    for (Builtin *b = BUILTINS; b->name; b++) {
+        if (strcmp(b->name, name) == 0) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// The signature a builtin's arguments are checked against
+static AstType * builtin_t(Builtin *b) {
+    Vec *params = vec_new();
+    AstType *ret;
+    switch (b->k) {
+    case B_EXPECT:
+        ret = t_num(T_LONG, 0);
+        vec_push(params, ret);
+        vec_push(params, ret);
+        break;
+    case B_POPCOUNT: case B_CTZ: case B_CLZ:
+        ret = t_num(T_INT, 0);
+        vec_push(params, t_num(b->operand, 1));
+        break;
+    case B_BSWAP:
+        ret = t_num(b->operand, 1);
+        vec_push(params, ret);
+        break;
+    case B_MEMCPY: case B_MEMSET:
+        ret = t_ptr(t_new(T_VOID));
+        vec_push(params, ret);
+        vec_push(params, b->k == B_MEMCPY ? ret : t_num(T_INT, 0));
+        vec_push(params, t_num(T_LLONG, 1)); // size_t
+        break;
+    case B_MEMCMP:
+        ret = t_num(T_INT, 0);
+        vec_push(params, t_ptr(t_new(T_VOID)));
+        vec_push(params, t_ptr(t_new(T_VOID)));
+        vec_push(params, t_num(T_LLONG, 1)); // size_t
+        break;
+    case B_STRCMP:
+        ret = t_num(T_INT, 0);
+        vec_push(params, t_ptr(t_num(T_CHAR, 0)));
+        vec_push(params, t_ptr(t_num(T_CHAR, 0)));
+        break;
+    case B_STRLEN:
+        ret = t_num(T_LLONG, 1); // size_t
+        vec_push(params, t_ptr(t_num(T_CHAR, 0)));
+        break;
+    case B_ASSUME_ALIGNED: // An optional offset after the alignment
+        ret = t_ptr(t_new(T_VOID));
+        vec_push(params, ret);
+        vec_push(params, t_num(T_LLONG, 1)); // size_t
+        break;
+    case B_PREFETCH: // Optional read/write and locality constants
+        ret = t_new(T_VOID);
+        vec_push(params, t_ptr(t_new(T_VOID)));
+        break;
+    case B_UNREACHABLE: case B_ASSUME: // The condition's checked separately
+        ret = t_new(T_VOID);
+        break;
+    case B_ATOMIC_FENCE: case B_SIGNAL_FENCE:
+        ret = t_new(T_VOID);
+        vec_push(params, t_num(T_INT, 0)); // Memory order
+        break;
+    default: UNREACHABLE();
+    }
+    return t_fn(ret, params, b->k == B_ASSUME_ALIGNED || b->k == B_PREFETCH ||
+                             b->k == B_ASSUME);
+}
+
+static int is_generic_atomic(Builtin *b) {
+    return b->k >= B_ATOMIC_LOAD && b->k <= B_ATOMIC_OP_FETCH;
+}
+
+// The other atomic builtins take any integer or pointer type, given by the
+// object their first argument points to
+static AstType * atomic_builtin_t(Builtin *b, AstNode *ptr) {
+    AstType *t = ptr->t->k == T_PTR ? ptr->t->ptr : NULL;
+    int is_rmw = b->k == B_ATOMIC_FETCH_OP || b->k == B_ATOMIC_OP_FETCH;
+    if (!t || !((t->k >= T_CHAR && t->k <= T_LLONG) || (t->k == T_PTR && !is_rmw))) {
+        error_at(ptr->tk, "expected pointer to %s for '%s'",
+                 is_rmw ? "integer" : "integer or pointer", b->name);
+    }
+    Vec *params = vec_new();
+    AstType *ret = t, *order = t_num(T_INT, 0);
+    vec_push(params, ptr->t);
+    switch (b->k) {
+    case B_ATOMIC_LOAD: break;
+    case B_ATOMIC_STORE:
+        ret = t_new(T_VOID);
+        vec_push(params, t);
+        break;
+    case B_ATOMIC_XCHG: case B_ATOMIC_FETCH_OP: case B_ATOMIC_OP_FETCH:
+        vec_push(params, t);
+        break;
+    case B_ATOMIC_CAS: // Returns whether it stored the new value
+        ret = t_num(T_INT, 0);
+        vec_push(params, ptr->t); // The expected value; the old one if it fails
+        vec_push(params, t);
+        vec_push(params, order);  // Weak, which is the same as strong on x86
+        vec_push(params, order);  // Memory order if it fails
+        break;
+    default: UNREACHABLE();
+    }
+    vec_push(params, order);
+    return t_fn(ret, params, 0);
+}
+
+// Constant integer arguments are folded, so the compiler can tell which are
+// (e.g., to inline a 'memcpy' of a known size)
+static AstNode * fold_arg(AstNode *arg) {
+    int64_t v;
+    if (!is_int(arg->t) || !try_calc_int_expr(arg, &v)) {
+        return arg;
+    }
+    AstNode *n = node(N_IMM, arg->tk);
+    n->t = arg->t;
+    n->imm = (uint64_t) v;
+    return n;
+}
+
+// '__builtin_assume_aligned(p, align[, offset])' promises that 'p - offset' is
+// a multiple of 'align', which has to be a constant power of 2
+static void check_assume_aligned(Token *name, Vec *args) {
+    AstNode *align = vec_get(args, 1);
+    if (vec_len(args) > 3) {
+        error_at(name, "too many arguments to '%s'", name->ident);
+    }
+    if (align->k != N_IMM || align->imm == 0 || (align->imm & (align->imm - 1)) != 0) {
+        error_at(align->tk, "expected power of 2 alignment");
+    }
+    if (vec_len(args) == 3 && !is_int(((AstNode *) vec_get(args, 2))->t)) {
+        error_at(((AstNode *) vec_get(args, 2))->tk, "expected integer offset");
+    }
+}
+
+// '__builtin_prefetch(p, rw, locality)'; 'rw' and 'locality' have to be
+// constants, if they're given
+static void check_prefetch(Token *name, Vec *args) {
+    if (vec_len(args) > 3) {
+        error_at(name, "too many arguments to '%s'", name->ident);
+    }
+    for (size_t i = 1; i < vec_len(args); i++) {
+        AstNode *arg = vec_get(args, i);
+        if (arg->k != N_IMM || arg->imm > (i == 1 ? 1 : 3)) {
+            error_at(arg->tk, i == 1 ? "expected 0 or 1 for read or write" :
+                                       "expected locality from 0 to 3");
+        }
+    }
+}
+
+// Whether evaluating 'n' could do anything other than give its value
+static int has_side_effects(AstNode *n) {
+    if (!n) {
+        return 0;
+    }
+    switch (n->k) {
+    case N_IMM: case N_FP: case N_STR: case N_LOCAL: case N_GLOBAL:
+    case N_KVAL: case N_KPTR: case N_LABEL_ADDR:
+        return 0;
+    case N_NEG: case N_BIT_NOT: case N_LOG_NOT: case N_DEREF: case N_ADDR:
+    case N_CONV:
+        return has_side_effects(n->l);
+    case N_FIELD:
+        return has_side_effects(n->obj);
+    case N_TERNARY:
+        return has_side_effects(n->if_cond) || has_side_effects(n->if_body) ||
+               has_side_effects(n->if_else);
+    default:
+        if ((n->k >= N_ADD && n->k <= N_LOG_OR) || n->k == N_COMMA || n->k == N_IDX) {
+            return has_side_effects(n->l) || has_side_effects(n->r);
+        }
+        return 1; // Assignments, increments, calls, and initialisers
+    }
+}
+
+// '__builtin_assume(cond)' never evaluates 'cond', so one with side effects
+// can't be kept without running them; it's dropped, as Clang does
+static void check_assume(Token *name, Vec *args) {
+    if (vec_len(args) != 1) {
+        error_at(name, "expected 1 argument to '%s'", name->ident);
+    }
+    AstNode *cond = vec_get(args, 0);
+    expect_val(cond);
+    if (has_side_effects(cond)) {
+        warning_at(cond->tk, "assumption is ignored because it has side effects");
+        AstNode *yes = node(N_IMM, cond->tk);
+        yes->t = t_num(T_INT, 0);
+        yes->imm = 1;
+        vec_put(args, 0, yes);
+    }
+}
+
+static Builtin LIB_BUILTINS[] = {
+    { "memcmp", B_MEMCMP, 0 },
+    { "strcmp", B_STRCMP, 0 },
+    { "strlen", B_STRLEN, 0 },
+    { NULL },
+};
+
+// A direct call to one of the library functions in 'LIB_BUILTINS', declared
+// with the standard signature, becomes the builtin, so it can be expanded
+// inline when its operands are constants (as GCC does without '-fno-builtin')
+static void lib_builtin(AstNode *call) {
+    AstNode *fn = call->fn;
+    if (fn->k != N_ADDR || fn->l->k != N_GLOBAL || fn->l->t->linkage != LINK_EXTERN) {
+        return;
+    }
+    Builtin *b = LIB_BUILTINS;
+    while (b->name && strcmp(b->name, fn->l->var_name) != 0) {
+        b++;
+    }
+    if (!b->name) {
+        return;
+    }
+    AstType *fn_t = fn->l->t, *std = builtin_t(b);
+    if (fn_t->is_vararg || vec_len(fn_t->params) != vec_len(std->params) ||
+            !is_int(fn_t->ret) || fn_t->ret->size != std->ret->size) {
+        return;
+    }
+    call->k = N_BUILTIN;
+    call->fn = NULL;
+    call->builtin = b->k;
+    call->builtin_op = b->operand;
+    for (size_t i = 0; i < vec_len(call->args); i++) {
+        vec_put(call->args, i, fold_arg(vec_get(call->args, i)));
+    }
+}
+
+// Returns NULL if 'name' isn't a builtin
+static AstNode * parse_builtin(Scope *s, Token *name) {
+    Builtin *b = find_builtin(name->ident);
+    if (!b) {
+        return NULL;
+    }
+    if (!peek_tk_is(s->pp, '(')) {
+        error_at(name, "builtin function '%s' must be called", name->ident);
+    }
+    next_tk(s->pp);
+    AstType *fn_t;
+    Vec *args = vec_new();
+    if (is_generic_atomic(b)) {
+        AstNode *ptr = discharge(parse_subexpr(s, PREC_COMMA));
+        fn_t = atomic_builtin_t(b, ptr);
+        vec_push(args, ptr);
+        expect_tk(s->pp, ',');
+    } else {
+        fn_t = builtin_t(b);
+    }
+    AstNode *n = node(N_BUILTIN, name);
+    n->t = fn_t->ret;
+    n->fn = NULL;
+    n->args = parse_args(s, fn_t, args);
+    n->builtin = b->k;
+    n->builtin_op = b->operand;
+    for (size_t i = 0; i < vec_len(n->args); i++) {
+        vec_put(n->args, i, fold_arg(vec_get(n->args, i)));
+    }
+    switch (b->k) {
+    case B_ASSUME_ALIGNED: check_assume_aligned(name, n->args); break;
+    case B_PREFETCH:       check_prefetch(name, n->args); break;
+    case B_ASSUME:         check_assume(name, n->args); break;
+    default: break;
+    }
     return n;
 }
 
+// A bit-field whose values all fit in an 'int' is one, as a 'char' would be
+// once it's promoted
+static AstType * bit_field_type(Field *f) {
+    AstType *t = f->t->k == T_ENUM ? f->t->num_t : f->t;
+    if (f->bits < 32 || (f->bits == 32 && !t->is_unsigned)) {
+        return t_num(T_INT, 0);
+    }
+    return t;
+}
+
 static AstNode * parse_field_access(Scope *s, AstNode *l) {
     Token *op = next_tk(s->pp);
     if (l->t->k != T_STRUCT && l->t->k != T_UNION) {
@@ -1204,7 +2162,7 @@ static AstNode * parse_field_access(Scope *s, AstNode *l) {
     }
     Field *f = vec_get(l->t->fields, f_idx);
     AstNode *n = node(N_FIELD, op);
-    n->t = f->t;
+    n->t = f->is_bit_field ? bit_field_type(f) : f->t;
     n->obj = l;
     n->field_idx = f_idx;
     return n;
@@ -1245,7 +2203,9 @@ static AstNode * parse_postfix(Scope *s, AstNode *l) {
 static AstNode * parse_neg(Scope *s) {
     Token *op = expect_tk(s->pp, '-');
     AstNode *l = parse_subexpr(s, PREC_UNARY);
-    expect_num(l);
+    if (!is_vec(l->t)) {
+        expect_num(l);
+    }
     l = discharge(l);
     AstNode *unop = node(N_NEG, op);
     unop->t = l->t;
@@ -1256,14 +2216,18 @@ static AstNode * parse_neg(Scope *s) {
 static AstNode * parse_plus(Scope *s) {
     expect_tk(s->pp, '+');
     AstNode *l = parse_subexpr(s, PREC_UNARY);
-    expect_num(l);
+    if (!is_vec(l->t)) {
+        expect_num(l);
+    }
     return discharge(l); // Type promotion
 }
 
 static AstNode * parse_bit_not(Scope *s) {
     Token *op = expect_tk(s->pp, '~');
     AstNode *l = parse_subexpr(s, PREC_UNARY);
-    expect_int(l);
+    if (!is_vec(l->t) || !is_int(l->t->elem)) {
+        expect_int(l);
+    }
     l = discharge(l);
     AstNode *unop = node(N_BIT_NOT, op);
     unop->t = l->t;
@@ -1309,23 +2273,41 @@ static AstNode * parse_deref(Scope *s) {
 static AstNode * parse_addr(Scope *s) {
     Token *op = expect_tk(s->pp, '&');
     AstNode *l = parse_subexpr(s, PREC_UNARY);
-    expect_lval(l);
+    expect_addressable(l);
     AstNode *unop = node(N_ADDR, op);
-    unop->t = t_ptr(l->t);
+    unop->t = t_ptr_to(l->t);
     unop->l = l;
     return unop;
 }
 
+// GNU's '&&label' is the address of a label in the current function, as a
+// 'void *' for 'goto *' (which label is only checked by the compiler, once
+// it's seen them all). It's only an IR_BB_ADDR in the function's code, so it
+// can't go in a static initializer; a dispatch table has to be a local array
+static AstNode * parse_label_addr(Scope *s) {
+    Token *op = expect_tk(s->pp, TK_LOG_AND);
+    if (s->in_static_init) {
+        error_at(op, "label address in a static initializer isn't supported; "
+                     "use a non-static array");
+    }
+    Token *label = expect_tk(s->pp, TK_IDENT);
+    AstNode *n = node(N_LABEL_ADDR, op);
+    n->t = t_ptr(t_new(T_VOID));
+    n->goto_label = label->ident;
+    return n;
+}
+
 static AstNode * parse_sizeof(Scope *s) {
     Token *op = expect_tk(s->pp, TK_SIZEOF);
     AstType *t;
     if (peek_tk_is(s->pp, '(') && is_type(s, peek2_tk(s->pp))) {
         next_tk(s->pp);
-        t = parse_decl_specs(s, NULL);
+        t = parse_decl_specs(s, NULL, NULL, NULL);
         t = parse_abstract_declarator(s, t);
         expect_tk(s->pp, ')');
     } else {
         AstNode *l = parse_subexpr(s, PREC_UNARY);
+        if (is_bit_field(l)) error_at(l->tk, "cannot take the size of a bit-field");
         t = l->t;
     }
     AstNode *n = node(N_IMM, op);
@@ -1336,7 +2318,7 @@ static AstNode * parse_sizeof(Scope *s) {
 
 static AstNode * parse_cast(Scope *s) {
     expect_tk(s->pp, '(');
-    AstType *t = parse_decl_specs(s, NULL);
+    AstType *t = parse_decl_specs(s, NULL, NULL, NULL);
     t = parse_abstract_declarator(s, t);
     expect_tk(s->pp, ')');
     if (peek_tk_is(s->pp, '{')) { // Compound literal
@@ -1356,6 +2338,7 @@ static AstNode * parse_unop(Scope *s) {
     case TK_INC: case TK_DEC: return parse_pre_inc_dec(s);
     case '*': return parse_deref(s);
     case '&': return parse_addr(s);
+    case TK_LOG_AND: return parse_label_addr(s);
     case TK_SIZEOF: return parse_sizeof(s);
     case '(':
         if (is_type(s, peek2_tk(s->pp))) {
@@ -1406,6 +2389,11 @@ static AstNode * emit_binop(int op, AstNode *l, AstNode *r, Token *tk) {
         t = l->t->k == T_PTR ? l->t : r->t;
         l = conv_to(l, t);
         r = conv_to(r, t);
+    } else if (l->t->k == T_VEC || r->t->k == T_VEC) { // Ternary or comma
+        if (!are_equal(l->t, r->t)) {
+            error_at(tk, "invalid operands to binary operation");
+        }
+        t = l->t;
     } else { // No pointers
         assert(is_num(l->t) && is_num(r->t));
         t = promote(l->t, r->t);
@@ -1429,9 +2417,98 @@ static AstNode * emit_binop(int op, AstNode *l, AstNode *r, Token *tk) {
     return n;
 }
 
+static int VEC_BINOP[TK_LAST] = {
+    ['+'] = N_ADD, ['-'] = N_SUB, ['*'] = N_MUL, ['/'] = N_DIV,
+    ['&'] = N_BIT_AND, ['|'] = N_BIT_OR, ['^'] = N_BIT_XOR,
+    [TK_SHL] = N_SHL, [TK_SHR] = N_SHR,
+    [TK_A_ADD] = N_A_ADD, [TK_A_SUB] = N_A_SUB,
+    [TK_A_MUL] = N_A_MUL, [TK_A_DIV] = N_A_DIV,
+    [TK_A_BIT_AND] = N_A_BIT_AND, [TK_A_BIT_OR] = N_A_BIT_OR,
+    [TK_A_BIT_XOR] = N_A_BIT_XOR, [TK_A_SHL] = N_A_SHL, [TK_A_SHR] = N_A_SHR,
+};
+
+// Shifts are by a constant, so they're by the same amount in every lane
+static AstNode * vec_shift_amount(AstNode *r, AstType *elem) {
+    int64_t amount;
+    if (!is_int(r->t) || !try_calc_int_expr(r, &amount)) {
+        error_at(r->tk, "vector shift amount must be an integer constant");
+    }
+    if (amount < 0 || amount >= (int64_t) elem->size * 8) {
+        error_at(r->tk, "vector shift amount out of range");
+    }
+    AstNode *n = node(N_IMM, r->tk);
+    n->t = t_num(T_INT, 0);
+    n->imm = (uint64_t) amount;
+    return n;
+}
+
+// Checks the operation has an SSE2 equivalent (see 'assemble.c')
+static void check_vec_op(int op, AstType *elem, Token *tk) {
+    int ok = 0;
+    switch (op) {
+    case N_ADD: case N_SUB: ok = 1; break;
+    case N_MUL: ok = is_fp(elem) || elem->size == 2 || elem->size == 4; break;
+    case N_DIV: ok = is_fp(elem); break;
+    case N_BIT_AND: case N_BIT_OR: case N_BIT_XOR: ok = is_int(elem); break;
+    case N_SHL: ok = is_int(elem) && elem->size >= 2; break;
+    case N_SHR:
+        ok = is_int(elem) && elem->size >= 2 &&
+             (elem->is_unsigned || elem->size <= 4); // No 'psraq'
+        break;
+    default: UNREACHABLE();
+    }
+    if (!ok) {
+        error_at(tk, "operation not supported on vectors of this type");
+    }
+}
+
+// Operations on vectors apply lane by lane. A scalar operand is converted to
+// the element type and copied into every lane
+static AstNode * emit_vec_binop(int op, AstNode *l, AstNode *r, Token *tk) {
+    int is_assign = op >= N_A_ADD && op <= N_A_SHR;
+    if (is_assign) {
+        expect_assignable(l);
+        if (!is_vec(l->t)) {
+            error_at(tk, "invalid operands to vector operation");
+        }
+    }
+    int lane_op = is_assign ? op - N_A_ADD + N_ADD : op;
+    AstType *t = is_vec(l->t) ? l->t : r->t;
+    check_vec_op(lane_op, t->elem, tk);
+    if (lane_op == N_SHL || lane_op == N_SHR) {
+        if (!is_vec(l->t)) {
+            error_at(tk, "invalid operands to vector operation");
+        }
+        r = vec_shift_amount(r, t->elem);
+    } else if (is_vec(l->t) && is_vec(r->t)) {
+        if (!are_equal(l->t, r->t)) {
+            error_at(tk, "invalid operands to vector operation");
+        }
+    } else {
+        AstNode **scalar = is_vec(l->t) ? &r : &l;
+        expect_num(*scalar);
+        AstNode *splat = node(N_CONV, (*scalar)->tk);
+        splat->t = t;
+        splat->l = conv_to(discharge(*scalar), t->elem);
+        *scalar = splat;
+    }
+    AstNode *n = node(op, tk);
+    n->t = t;
+    n->l = l;
+    n->r = r;
+    return n;
+}
+
 static AstNode * parse_binop(Scope *s, Token *op, AstNode *l) {
     AstNode *r = parse_subexpr(s, BINOP_PREC[op->k] - IS_RASSOC[op->k]);
     AstNode *n;
+    if ((is_vec(l->t) || is_vec(r->t)) && op->k != '=' && op->k != ',' &&
+            op->k != '?') {
+        if (!VEC_BINOP[op->k]) {
+            error_at(op, "invalid operands to vector operation");
+        }
+        return emit_vec_binop(VEC_BINOP[op->k], l, r, op);
+    }
     switch (op->k) {
     case '+':    expect_val(l); expect_val(r); return emit_binop(N_ADD, l, r, op);
     case '-':    expect_val(l); expect_val(r); return emit_binop(N_SUB, l, r, op);
@@ -1476,14 +2553,15 @@ static AstNode * parse_binop(Scope *s, Token *op, AstNode *l) {
         n->t = n->r->t;
         return n;
     case '?':
+        expect_val(l);
         expect_tk(s->pp, ':');
         AstNode *els = parse_subexpr(s, PREC_TERNARY - IS_RASSOC['?']);
         AstNode *binop = emit_binop(N_TERNARY, r, els, op);
         n = node(N_TERNARY, op);
         n->t = binop->t;
         n->if_cond = l;
-        n->if_body = n->l;
-        n->if_else = n->r;
+        n->if_body = binop->l;
+        n->if_else = binop->r;
         return n;
     default: UNREACHABLE();
     }
@@ -1634,14 +2712,132 @@ static int globals_are_equal(AstNode *g1, AstNode *g2) {
            (g1 && g2 && strcmp(g1->var_name, g2->var_name) == 0);
 }
 
+static int is_i128_arith(AstNode *e) {
+    if (e->k >= N_ADD && e->k <= N_LOG_OR) {
+        return e->l->t->k == T_I128 || e->r->t->k == T_I128;
+    } else if (e->k == N_NEG || e->k == N_BIT_NOT || e->k == N_LOG_NOT) {
+        return e->l->t->k == T_I128;
+    }
+    return 0;
+}
+
+static int i128_lt(uint64_t al, uint64_t ah, uint64_t bl, uint64_t bh, int is_signed) {
+    if (ah != bh) {
+        return is_signed ? (int64_t) ah < (int64_t) bh : ah < bh;
+    }
+    return al < bl;
+}
+
+// Long division, a bit at a time; 'd' isn't 0
+static void u128_div(uint64_t nl, uint64_t nh, uint64_t dl, uint64_t dh,
+                     uint64_t *ql, uint64_t *qh, uint64_t *rl, uint64_t *rh) {
+    *ql = *qh = *rl = *rh = 0;
+    for (int i = 127; i >= 0; i--) {
+        *rh = (*rh << 1) | (*rl >> 63); // r = (r << 1) | bit i of n
+        *rl = (*rl << 1) | ((i >= 64 ? nh >> (i - 64) : nl >> i) & 1);
+        if (*rh > dh || (*rh == dh && *rl >= dl)) { // r -= d; set bit i of q
+            *rh = *rh - dh - (*rl < dl);
+            *rl -= dl;
+            if (i >= 64) *qh |= (uint64_t) 1 << (i - 64); else *ql |= (uint64_t) 1 << i;
+        }
+    }
+}
+
+static void i128_neg(uint64_t *lo, uint64_t *hi) {
+    *hi = -*hi - (*lo != 0);
+    *lo = -*lo;
+}
+
+static int i128_div(AstNode *e, uint64_t al, uint64_t ah, uint64_t bl, uint64_t bh,
+                    uint64_t *lo, uint64_t *hi) {
+    if (bl == 0 && bh == 0) {
+        return 0; // Division by zero is left for run time
+    }
+    uint64_t ql, qh, rl, rh;
+    int neg_a = !e->t->is_unsigned && (int64_t) ah < 0;
+    int neg_b = !e->t->is_unsigned && (int64_t) bh < 0;
+    if (neg_a) i128_neg(&al, &ah);
+    if (neg_b) i128_neg(&bl, &bh);
+    u128_div(al, ah, bl, bh, &ql, &qh, &rl, &rh);
+    if (neg_a != neg_b) i128_neg(&ql, &qh);
+    if (neg_a) i128_neg(&rl, &rh); // The remainder has the dividend's sign
+    *lo = e->k == N_DIV ? ql : rl;
+    *hi = e->k == N_DIV ? qh : rh;
+    return 1;
+}
+
+static AstNode * eval_const_expr(AstNode *e, Token **err);
+
+// A '__int128' constant has its top half in 'imm_hi', and arithmetic on it is
+// done a half at a time
+static AstNode * eval_i128_arith(AstNode *e, AstNode *n, Token **err) {
+    int is_unop = e->k == N_NEG || e->k == N_BIT_NOT || e->k == N_LOG_NOT;
+    AstNode *l = eval_const_expr(e->l, err);
+    AstNode *r = is_unop || !l ? NULL : eval_const_expr(e->r, err);
+    if (!l || l->k != N_IMM || (!is_unop && (!r || r->k != N_IMM))) goto err;
+    uint64_t al = l->imm, ah = l->imm_hi, bl = r ? r->imm : 0, bh = r ? r->imm_hi : 0;
+    uint64_t lo = 0, hi = 0;
+    int is_signed = !e->l->t->is_unsigned, sh = (int) (bl & 127);
+    switch (e->k) {
+    case N_ADD:     lo = al + bl; hi = ah + bh + (lo < al); break;
+    case N_SUB:     lo = al - bl; hi = ah - bh - (al < bl); break;
+    case N_MUL:     lo = al * bl; hi = umulh(al, bl) + al * bh + ah * bl; break;
+    case N_DIV: case N_MOD:
+        if (!i128_div(e, al, ah, bl, bh, &lo, &hi)) goto err;
+        break;
+    case N_BIT_AND: lo = al & bl; hi = ah & bh; break;
+    case N_BIT_OR:  lo = al | bl; hi = ah | bh; break;
+    case N_BIT_XOR: lo = al ^ bl; hi = ah ^ bh; break;
+    case N_SHL:
+        lo = sh >= 64 ? 0 : al << sh;
+        hi = sh >= 64 ? al << (sh - 64) : sh == 0 ? ah : (ah << sh) | (al >> (64 - sh));
+        break;
+    case N_SHR: {
+        uint64_t fill = is_signed && (int64_t) ah < 0 ? ~(uint64_t) 0 : 0;
+        if (sh >= 64) {
+            lo = is_signed ? (uint64_t) ((int64_t) ah >> (sh - 64)) : ah >> (sh - 64);
+            hi = fill;
+        } else {
+            lo = sh == 0 ? al : (al >> sh) | (ah << (64 - sh));
+            hi = is_signed ? (uint64_t) ((int64_t) ah >> sh) : ah >> sh;
+        }
+        break;
+    }
+    case N_EQ:      lo = al == bl && ah == bh; break;
+    case N_NEQ:     lo = al != bl || ah != bh; break;
+    case N_LT:      lo = i128_lt(al, ah, bl, bh, is_signed); break;
+    case N_LE:      lo = !i128_lt(bl, bh, al, ah, is_signed); break;
+    case N_GT:      lo = i128_lt(bl, bh, al, ah, is_signed); break;
+    case N_GE:      lo = !i128_lt(al, ah, bl, bh, is_signed); break;
+    case N_LOG_AND: lo = (al | ah) && (bl | bh); break;
+    case N_LOG_OR:  lo = (al | ah) || (bl | bh); break;
+    case N_NEG:     lo = -al; hi = -ah - (al != 0); break;
+    case N_BIT_NOT: lo = ~al; hi = ~ah; break;
+    case N_LOG_NOT: lo = !(al | ah); break;
+    default: UNREACHABLE();
+    }
+    n->k = N_IMM;
+    n->imm = lo;
+    n->imm_hi = hi;
+    n->t = e->t;
+    n->tk = e->tk;
+    return n;
+err:
+    if (err && !*err) *err = e->tk;
+    return NULL;
+}
+
 // Only allowable 'Node' types are N_IMM, N_FP, N_STR, N_INIT, N_SIZEOF,
 // N_KVAL, N_KPTR
 static AstNode * eval_const_expr(AstNode *e, Token **err) {
     AstNode *cond, *l, *r;
     AstNode *n = node(e->k, e->tk);
+    if (is_i128_arith(e)) {
+        return eval_i128_arith(e, n, err);
+    }
     switch (e->k) {
         // Constants
-    case N_IMM: case N_FP: case N_STR: *n = *e; break;
+    case N_IMM: case N_FP: case N_STR: copy_node(n, e); break;
     case N_INIT:
         n->elems = vec_new();
         for (size_t i = 0; i < vec_len(e->elems); i++) {
@@ -1682,7 +2878,7 @@ static AstNode * eval_const_expr(AstNode *e, Token **err) {
     case N_COMMA:
         r = eval_const_expr(e->r, err);
         if (!r) goto err;
-        *n = *r; // Ignore LHS
+        copy_node(n, r); // Ignore LHS
         break;
 
         // Ternary operation
@@ -1694,7 +2890,7 @@ static AstNode * eval_const_expr(AstNode *e, Token **err) {
         if (!l) goto err;
         r = eval_const_expr(e->if_else, err);
         if (!r) goto err;
-        *n = cond->imm ? *l : *r;
+        copy_node(n, cond->imm ? l : r);
         break;
 
         // Unary operations
@@ -1704,30 +2900,45 @@ static AstNode * eval_const_expr(AstNode *e, Token **err) {
     case N_ADDR:
         l = eval_const_expr(e->l, err);
         if (!l || l->k != N_KVAL) goto err;
-        *n = *l;
+        copy_node(n, l);
         n->k = N_KPTR;
         break;
     case N_DEREF:
         l = eval_const_expr(e->l, err);
         if (!l || l->k != N_KPTR) goto err;
-        *n = *l;
+        copy_node(n, l);
         n->k = N_KVAL;
         break;
     case N_CONV:
         l = eval_const_expr(e->l, err);
         if (!l) goto err;
-        if (is_fp(e->t) && l->k == N_IMM) { // int -> float
+        if (is_vec(e->t) || is_vec(l->t)) { // Splat or reinterpretation
+            goto err;
+        } else if (is_fp(e->t) && l->k == N_IMM) { // int -> float
+            if (l->t->k == T_I128 && l->imm_hi != 0) goto err;
             n->k = N_FP;
             n->fp = (double) l->imm;
         } else if (is_int(e->t) && l->k == N_FP) { // float -> int
             n->k = N_IMM;
             n->imm = (int64_t) l->fp;
+            n->imm_hi = (int64_t) n->imm < 0 ? (uint64_t) -1 : 0;
+        } else if (e->t->k == T_I128 && l->k == N_IMM) { // int -> __int128
+            AstType *lt = l->t->k == T_ENUM ? l->t->num_t : l->t;
+            n->k = N_IMM;
+            n->imm = l->imm;
+            n->imm_hi = l->imm_hi;
+            if (lt->k != T_I128) { // Extend from the value's own size
+                int shift = 64 - (int) lt->size * 8;
+                n->imm = lt->is_unsigned ? (l->imm << shift) >> shift :
+                         (uint64_t) ((int64_t) (l->imm << shift) >> shift);
+                n->imm_hi = !lt->is_unsigned && (int64_t) n->imm < 0 ? (uint64_t) -1 : 0;
+            }
         } else if (is_int(e->t) && l->k == N_IMM) { // int -> int
             n->k = N_IMM;
             uint64_t bits = e->t->size * 8; // Bits
             uint64_t mask = bits >= 64 ? (uint64_t) -1 : ((uint64_t) 1 << bits) - 1;
             n->imm = l->imm & mask; // Truncate
-            if (!l->t->is_unsigned && (n->imm & ((int64_t) 1 << (bits - 1)))) {
+            if (bits < 64 && !l->t->is_unsigned && (n->imm & ((int64_t) 1 << (bits - 1)))) {
                 n->imm |= ~(((int64_t) 1 << bits) - 1); // Sign extend
             }
         } else if (e->t->k == T_PTR && l->k == N_IMM) { // int -> ptr
@@ -1738,8 +2949,9 @@ static AstNode * eval_const_expr(AstNode *e, Token **err) {
             if (l->g) goto err;
             n->k = N_IMM;
             n->imm = l->offset;
+            n->imm_hi = 0;
         } else { // Direct conversion
-            *n = *l;
+            copy_node(n, l);
         }
         break;
 
@@ -1749,14 +2961,15 @@ static AstNode * eval_const_expr(AstNode *e, Token **err) {
         if (!l || (l->k != N_KPTR && l->k != N_KVAL)) goto err;
         r = eval_const_expr(e->r, err);
         if (!r || r->k != N_IMM) goto err;
-        *n = *l;
+        copy_node(n, l);
         n->offset += (int64_t) (r->imm * l->t->elem->size);
         break;
     case N_FIELD:
         l = eval_const_expr(e->obj, err);
         if (!l || l->k != N_KVAL) goto err;
-        *n = *l;
         Field *f = vec_get(l->t->fields, e->field_idx);
+        if (f->is_bit_field) goto err; // Not addressable
+        copy_node(n, l);
         n->offset += (int64_t) f->offset;
         break;
     default: goto err;
@@ -1809,10 +3022,263 @@ static int try_calc_int_expr(AstNode *e, int64_t *val) {
     return n != NULL;
 }
 
-int64_t parse_const_int_expr(PP *pp) {
-    Scope s = new_scope(SCOPE_FILE, pp);
-    AstNode *e = parse_expr(&s);
-    return calc_int_expr(e);
+
+// ---- Inline Assembly -------------------------------------------------------
+
+// The GPRs that can be named in a clobber list, in encoding order
+static char *ASM_GPR_NAMES[][4] = {
+    { "rax", "eax", "ax", "al" },      { "rcx", "ecx", "cx", "cl" },
+    { "rdx", "edx", "dx", "dl" },      { "rbx", "ebx", "bx", "bl" },
+    { "rsp", "esp", "sp", "spl" },     { "rbp", "ebp", "bp", "bpl" },
+    { "rsi", "esi", "si", "sil" },     { "rdi", "edi", "di", "dil" },
+    { "r8", "r8d", "r8w", "r8b" },     { "r9", "r9d", "r9w", "r9b" },
+    { "r10", "r10d", "r10w", "r10b" }, { "r11", "r11d", "r11w", "r11b" },
+    { "r12", "r12d", "r12w", "r12b" }, { "r13", "r13d", "r13w", "r13b" },
+    { "r14", "r14d", "r14w", "r14b" }, { "r15", "r15d", "r15w", "r15b" },
+};
+
+static char ASM_FIXED_REGS[] = "acdbXXSD"; // In encoding order ('X' is unused)
+
+int read_asm_opr(InlineAsm *a, char **s, int *modifier) {
+    char *c = *s;
+    *modifier = 0;
+    if (*c && strchr("bhwkqc", *c) && (c[1] == '[' || isdigit(c[1]))) {
+        *modifier = *c++;
+    }
+    int idx = -1;
+    if (*c == '[') {
+        char *end = strchr(c, ']');
+        if (!end) {
+            return -1;
+        }
+        for (int i = 0; i < a->num_oprs; i++) {
+            char *name = a->oprs[i].name;
+            if (name && strlen(name) == (size_t) (end - c - 1) &&
+                    strncmp(name, c + 1, (size_t) (end - c - 1)) == 0) {
+                idx = i;
+            }
+        }
+        c = end + 1;
+    } else if (isdigit(*c)) {
+        idx = 0;
+        while (isdigit(*c)) {
+            idx = idx * 10 + (*c++ - '0');
+        }
+        if (idx >= a->num_oprs) {
+            return -1;
+        }
+    }
+    *s = c;
+    return idx;
+}
+
+static void check_asm_template(Token *tk, InlineAsm *a) {
+    if (a->is_basic) {
+        return;
+    }
+    for (char *c = a->template; *c; c++) {
+        if (*c != '%') {
+            continue;
+        }
+        c++;
+        int modifier;
+        if (*c == '%') {
+            continue;
+        } else if (read_asm_opr(a, &c, &modifier) < 0) {
+            error_at(tk, "invalid operand reference in 'asm' template");
+        }
+        c--;
+    }
+}
+
+static int is_gpr_type(AstType *t) {
+    return (is_int(t) || t->k == T_PTR || t->k == T_ENUM) && t->size <= 8;
+}
+
+static int is_sse_type(AstType *t) {
+    return is_fp(t) || (is_vec(t) && t->size <= 16);
+}
+
+// Picks one of the alternatives in a constraint (e.g., "rm"): a register if
+// there's one, an immediate if the operand's a constant, otherwise memory
+static void pick_asm_constraint(InlineAsm *a, AsmOperand *o, char *c,
+                                AstNode *arg, Token *tk) {
+    int has_gpr = 0, has_sse = 0, has_mem = 0, has_imm = 0, fixed = -1, tied = -1;
+    for (; *c; c++) {
+        char *reg;
+        switch (*c) {
+        case '=': case '+': case '&': case '%': break; // Modifiers
+        case 'r': case 'q': case 'g': has_gpr = 1; break;
+        case 'x': has_sse = 1; break;
+        case 'm': has_mem = 1; break;
+        case 'i': case 'n': has_imm = 1; break;
+        default:
+            if (isdigit(*c)) {
+                tied = *c - '0';
+            } else if (*c != 'X' && (reg = strchr(ASM_FIXED_REGS, *c))) {
+                fixed = (int) (reg - ASM_FIXED_REGS);
+            } else {
+                error_at(tk, "unsupported 'asm' constraint '%c'", *c);
+            }
+        }
+    }
+    int64_t imm;
+    if (tied >= 0) {
+        if (o->is_out || tied >= a->num_outs || a->oprs[tied].k == ASM_MEM) {
+            error_at(tk, "invalid 'asm' operand to match");
+        }
+        o->k = ASM_TIED;
+        o->tied = tied;
+    } else if (has_imm && !o->is_out && is_int(arg->t) &&
+               try_calc_int_expr(arg, &imm)) {
+        o->k = ASM_IMM;
+        o->imm = (uint64_t) imm;
+    } else if (fixed >= 0) {
+        o->k = ASM_FIXED;
+        o->reg = fixed;
+    } else if (has_gpr && (is_gpr_type(arg->t) || !has_mem)) {
+        o->k = ASM_GPR;
+    } else if (has_sse && (is_sse_type(arg->t) || !has_mem)) {
+        o->k = ASM_SSE;
+    } else if (has_mem) {
+        o->k = ASM_MEM;
+    } else if (has_imm) {
+        error_at(tk, "'asm' operand is not a constant");
+    } else {
+        error_at(tk, "'asm' constraint has no alternatives");
+    }
+}
+
+static void check_asm_operand(AsmOperand *o, AstNode *arg) {
+    if (o->k == ASM_MEM) {
+        expect_addressable(arg);
+    } else if (o->is_out) {
+        expect_lval(arg);
+    }
+    if (o->is_out && o->k != ASM_MEM) {
+        expect_assignable(arg);
+    }
+    if ((o->k == ASM_GPR || o->k == ASM_FIXED) && !is_gpr_type(arg->t)) {
+        error_at(arg->tk, "expected integer or pointer type for 'asm' operand");
+    }
+    if (o->k == ASM_SSE && !is_sse_type(arg->t)) {
+        error_at(arg->tk, "expected floating point or vector type for 'asm' operand");
+    }
+}
+
+// '[name] "constraint" (expression)'
+static void parse_asm_operand(Scope *s, InlineAsm *a, Vec *args, int is_out) {
+    if (a->num_oprs == MAX_ASM_OPRS) {
+        error_at(peek_tk(s->pp), "more than %d operands in 'asm'", MAX_ASM_OPRS);
+    }
+    AsmOperand *o = &a->oprs[a->num_oprs];
+    memset(o, 0, sizeof(AsmOperand));
+    if (next_tk_is(s->pp, '[')) {
+        o->name = expect_tk(s->pp, TK_IDENT)->ident;
+        expect_tk(s->pp, ']');
+    }
+    if (!peek_tk_is(s->pp, TK_STR)) {
+        error_at(peek_tk(s->pp), "expected 'asm' constraint");
+    }
+    AstNode *constraint = parse_str(s);
+    char *c = constraint->str;
+    o->is_out = *c == '=' || *c == '+';
+    o->is_in = !is_out || *c == '+';
+    o->early_clobber = strchr(c, '&') != NULL;
+    if (o->is_out != is_out) {
+        error_at(constraint->tk, is_out ? "output constraint must start with '=' or '+'"
+                                        : "input constraint can't start with '=' or '+'");
+    }
+    expect_tk(s->pp, '(');
+    AstNode *arg = parse_expr(s);
+    expect_tk(s->pp, ')');
+    pick_asm_constraint(a, o, c, arg, constraint->tk);
+    if (o->k != ASM_MEM && (arg->t->k == T_ARR || arg->t->k == T_FN)) {
+        arg = discharge(arg);
+    }
+    if (o->k == ASM_TIED) { // Converted to the output's type
+        arg = conv_to(arg, ((AstNode *) vec_get(args, o->tied))->t);
+    }
+    check_asm_operand(o, arg);
+    o->size = arg->t->size;
+    a->num_oprs++;
+    vec_push(args, o->k == ASM_IMM ? NULL : arg);
+}
+
+static void parse_asm_clobber(Scope *s, InlineAsm *a) {
+    Token *tk = peek_tk(s->pp);
+    if (tk->k != TK_STR) {
+        error_at(tk, "expected 'asm' clobber");
+    }
+    char *name = parse_str(s)->str;
+    if (name[0] == '%') {
+        name++;
+    }
+    if (strcmp(name, "memory") == 0 || strcmp(name, "cc") == 0) {
+        return; // Always assumed
+    }
+    if (strncmp(name, "xmm", 3) == 0 && isdigit(name[3])) {
+        int reg = atoi(&name[3]);
+        if (reg < 16) {
+            a->sse_clobbers |= 1u << reg;
+            return;
+        }
+    }
+    for (int reg = 0; reg < 16; reg++) {
+        for (int i = 0; i < 4; i++) {
+            if (strcmp(name, ASM_GPR_NAMES[reg][i]) == 0) {
+                if (reg == 4 || reg == 5) { // rsp or rbp
+                    error_at(tk, "can't clobber the stack or frame pointer in 'asm'");
+                }
+                a->clobbers |= 1u << reg;
+                return;
+            }
+        }
+    }
+    error_at(tk, "unknown register '%s' in 'asm' clobbers", name);
+}
+
+static AstNode * parse_asm(Scope *s) {
+    Token *asm_tk = expect_tk(s->pp, TK_ASM);
+    while (next_tk_is(s->pp, TK_VOLATILE) || next_tk_is(s->pp, TK_INLINE));
+    if (peek_tk_is(s->pp, TK_GOTO)) {
+        error_at(peek_tk(s->pp), "'asm goto' is not supported");
+    }
+    expect_tk(s->pp, '(');
+    if (!peek_tk_is(s->pp, TK_STR)) {
+        error_at(peek_tk(s->pp), "expected 'asm' template");
+    }
+    AstNode *template = parse_str(s);
+    if (template->enc != ENC_NONE) {
+        error_at(template->tk, "'asm' template must be a narrow string");
+    }
+    InlineAsm *a = calloc(1, sizeof(InlineAsm));
+    a->template = template->str;
+    a->oprs = malloc(sizeof(AsmOperand) * MAX_ASM_OPRS);
+    a->is_basic = !peek_tk_is(s->pp, ':');
+    Vec *args = vec_new();
+    for (int section = 0; section < 3 && next_tk_is(s->pp, ':'); section++) {
+        if (peek_tk_is(s->pp, ':') || peek_tk_is(s->pp, ')')) {
+            continue; // Empty
+        }
+        do {
+            if (section == 2) {
+                parse_asm_clobber(s, a);
+            } else {
+                parse_asm_operand(s, a, args, section == 0);
+            }
+        } while (next_tk_is(s->pp, ','));
+        if (section == 0) {
+            a->num_outs = a->num_oprs;
+        }
+    }
+    expect_tk(s->pp, ')');
+    expect_tk(s->pp, ';');
+    check_asm_template(template->tk, a);
+    AstNode *n = node(N_ASM, asm_tk);
+    n->inline_asm = a;
+    n->asm_args = args;
+    return n;
 }
 
 
@@ -1856,6 +3322,7 @@ static AstNode * parse_while(Scope *s) {
     Scope loop;
     enter_scope(&loop, s, SCOPE_LOOP);
     AstNode *body = parse_stmt(&loop);
+    exit_scope(&loop);
     AstNode *n = node(N_WHILE, while_tk);
     n->loop_cond = cond;
     n->loop_body = body;
@@ -1867,6 +3334,7 @@ static AstNode * parse_do_while(Scope *s) {
     Scope loop;
     enter_scope(&loop, s, SCOPE_LOOP);
     AstNode *body = parse_stmt(&loop);
+    exit_scope(&loop);
     expect_tk(s->pp, TK_WHILE);
     expect_tk(s->pp, '(');
     AstNode *cond = parse_expr(s);
@@ -1905,6 +3373,7 @@ static AstNode * parse_for(Scope *s) {
     expect_tk(s->pp, ')');
 
     AstNode *body = parse_stmt(&loop);
+    exit_scope(&loop);
     AstNode *n = node(N_FOR, for_tk);
     n->for_init = init;
     n->for_cond = cond;
@@ -1918,12 +3387,16 @@ static AstNode * parse_switch(Scope *s) {
     expect_tk(s->pp, '(');
     AstNode *cond = parse_expr(s);
     expect_int(cond);
+    if (cond->t->k == T_I128) {
+        error_at(cond->tk, "switch on '__int128' isn't supported");
+    }
     expect_tk(s->pp, ')');
 
     Scope switch_s;
     enter_scope(&switch_s, s, SCOPE_SWITCH);
     switch_s.cond_t = cond->t;
     AstNode *body = parse_stmt(&switch_s);
+    exit_scope(&switch_s);
     AstNode *n = node(N_SWITCH, switch_tk);
     n->switch_cond = cond;
     n->switch_body = body;
@@ -2007,6 +3480,14 @@ static AstNode * parse_continue(Scope *s) {
 
 static AstNode * parse_goto(Scope *s) {
     Token *goto_tk = expect_tk(s->pp, TK_GOTO);
+    if (next_tk_is(s->pp, '*')) { // 'goto *ptr'
+        AstNode *ptr = discharge(parse_expr(s));
+        expect_ptr(ptr);
+        expect_tk(s->pp, ';');
+        AstNode *n = node(N_INDIRECT_GOTO, goto_tk);
+        n->goto_ptr = ptr;
+        return n;
+    }
     Token *label = expect_tk(s->pp, TK_IDENT);
     expect_tk(s->pp, ';');
     AstNode *n = node(N_GOTO, goto_tk);
@@ -2046,6 +3527,21 @@ static AstNode * parse_expr_stmt(Scope *s) {
     return n;
 }
 
+static AstNode * parse_unroll(Scope *s) {
+    Token *pragma = expect_tk(s->pp, TK_PRAGMA_UNROLL);
+    Token *t = peek_tk(s->pp);
+    if (t->k != TK_FOR && t->k != TK_WHILE && t->k != TK_DO) {
+        error_at(t, "expected loop after '#pragma unroll', found %s", token2pretty(t));
+    }
+    AstNode *n = parse_stmt(s);
+    if (n->k == N_FOR) {
+        n->for_unroll = pragma->unroll;
+    } else {
+        n->loop_unroll = pragma->unroll;
+    }
+    return n;
+}
+
 static AstNode * parse_stmt(Scope *s) {
     Token *t = peek_tk(s->pp);
     switch (t->k) {
@@ -2062,6 +3558,8 @@ static AstNode * parse_stmt(Scope *s) {
     case TK_CONTINUE: return parse_continue(s);
     case TK_GOTO:     return parse_goto(s);
     case TK_RETURN:   return parse_ret(s);
+    case TK_ASM:      return parse_asm(s);
+    case TK_PRAGMA_UNROLL: return parse_unroll(s);
     case TK_IDENT:
         if (peek2_tk_is(s->pp, ':')) {
             return parse_label(s);
@@ -2089,12 +3587,66 @@ static AstNode * parse_block(Scope *s) {
         while (*cur) cur = &(*cur)->next;
     }
     expect_tk(s->pp, '}');
+    exit_scope(&block);
     return head;
 }
 
 
 // ---- Declarations ----------------------------------------------------------
 
+static void parse_fn_body(Scope *s, AstNode *fn) {
+    Scope fn_scope;
+    enter_scope(&fn_scope, s, SCOPE_BLOCK);
+    fn_scope.fn = fn;
+    for (size_t i = 0; i < vec_len(fn->param_names); i++) { // Def params as vars
+        Token *param_name = vec_get(fn->param_names, i);
+        AstType *param_t = vec_get(fn->t->params, i);
+        def_var(&fn_scope, param_name, param_t);
+    }
+    fn->fn_body = parse_block(&fn_scope);
+    exit_scope(&fn_scope);
+}
+
+// Up to and including the matching '}'
+static Vec * skip_fn_body(Scope *s) {
+    Vec *tks = vec_new();
+    int depth = 0;
+    do {
+        Token *t = next_tk(s->pp);
+        if (t->k == TK_EOF) {
+            expect_tk(s->pp, '}');
+        }
+        depth += t->k == '{' ? 1 : t->k == '}' ? -1 : 0;
+        vec_push(tks, t);
+    } while (depth > 0);
+    return tks;
+}
+
+// Hands 'fn' to the hook as soon as its body's parsed, then frees the body;
+// the AST's arena is swapped for a fresh one meanwhile, so everything the body
+// allocated goes with it, and the file scope's nodes are left alone
+static void stream_fn_body(Scope *s, AstNode *fn) {
+    Deferred *d = s->deferred;
+    ArenaBlock *file_ast = arena_detach(ARENA_AST);
+    jmp_buf jmp, *outer = ERROR_JMP;
+    if (setjmp(jmp) != 0) { // Give the file scope's blocks back to be freed
+        ERROR_JMP = outer;
+        IN_STREAMED_BODY = 0;
+        arena_adopt(ARENA_AST, file_ast);
+        error_fail();
+    }
+    ERROR_JMP = &jmp;
+    IN_STREAMED_BODY = 1;
+    parse_fn_body(s, fn);
+    IN_STREAMED_BODY = 0;
+    d->hook(fn, d->hook_arg);
+    ERROR_JMP = outer;
+    fn->fn_body = NULL;
+    arena_free(ARENA_AST);
+    arena_adopt(ARENA_AST, file_ast);
+}
+
+// NULL if the function's been handed to the hook already
 static AstNode * parse_fn_def(Scope *s, AstType *t, Token *name, Vec *param_names) {
     if (t->k != T_FN) {
         error_at(name, "expected function type");
@@ -2104,15 +3656,15 @@ static AstNode * parse_fn_def(Scope *s, AstType *t, Token *name, Vec *param_name
     fn->t = t;
     fn->fn_name = name->ident;
     fn->param_names = param_names;
-    Scope fn_scope;
-    enter_scope(&fn_scope, s, SCOPE_BLOCK);
-    fn_scope.fn = fn;
-    for (size_t i = 0; i < vec_len(param_names); i++) { // Def params as vars
-        Token *param_name = vec_get(param_names, i);
-        AstType *param_t = vec_get(t->params, i);
-        def_var(&fn_scope, param_name, param_t);
+    if (s->deferred && t->linkage == LINK_STATIC && name->f != s->deferred->main) {
+        fn->body_tks = skip_fn_body(s);
+        vec_push(s->deferred->fns, fn);
+    } else if (s->deferred && s->deferred->hook) {
+        stream_fn_body(s, fn);
+        return NULL;
+    } else {
+        parse_fn_body(s, fn);
     }
-    fn->fn_body = parse_block(&fn_scope);
     return fn;
 }
 
@@ -2269,6 +3821,13 @@ static AstNode * parse_init_list_raw(Scope *s, AstType *t, int designated) {
         return parse_array_init(s, t, designated);
     } else if (t->k == T_STRUCT || t->k == T_UNION) {
         return parse_struct_init(s, t, designated);
+    } else if (t->k == T_VEC) { // Initialized like an array of its lanes
+        AstNode *len = node(N_IMM, peek_tk(s->pp));
+        len->t = t_num(T_LLONG, 1);
+        len->imm = t->size / t->elem->size;
+        AstNode *n = parse_array_init(s, t_arr(t->elem, len), designated);
+        n->t = t;
+        return n;
     } else { // Everything else, e.g., int a = {3}
         AstNode *len = node(N_IMM, peek_tk(s->pp));
         len->t = t_num(T_LLONG, 1);
@@ -2291,11 +3850,13 @@ static AstNode * parse_decl_init(Scope *s, AstType *t) {
         error_at(err, "cannot initialize variable-length array");
     }
     AstNode *val;
+    s->in_static_init = t->linkage == LINK_STATIC && s->fn;
     if (peek_tk_is(s->pp, '{') || is_string_type(t)) {
         val = parse_init_list(s, t);
     } else {
         val = parse_expr_no_commas(s);
     }
+    s->in_static_init = 0;
     if (t->k == T_ARR && val->t->k != T_ARR) {
         error_at(err, "array initializer must be an initializer list or string literal");
     }
@@ -2327,11 +3888,33 @@ static AstNode * parse_decl_var(Scope *s, AstType *t, Token *name) {
     return decl;
 }
 
-static AstNode * parse_init_decl(Scope *s, AstType *base, int sclass) {
+// Whether the object declared with type 't' is 'const' when the declaration
+// specifiers are: only if the declarator doesn't add a pointer or function
+// (e.g., 'const int a[4]' is read only, but 'const int *p' isn't)
+static int is_const_obj(AstType *t, AstType *base, int tquals) {
+    while (t->k == T_ARR) {
+        t = t->elem;
+    }
+    return (tquals & TQ_CONST) && t == base;
+}
+
+static AstNode * parse_init_decl(Scope *s, AstType *base, int sclass, int tquals,
+                                 Attrs *attrs) {
     Token *name = NULL;
     Vec *param_names = vec_new();
     AstType *t = parse_named_declarator(s, base, &name, param_names);
-    switch (sclass) {
+    apply_fn_attrs(t, attrs);
+    if (attrs->visibility) {
+        t->visibility = attrs->visibility;
+    }
+    int is_tls = (sclass & SC_THREAD_LOCAL) != 0;
+    if (is_tls && t->k == T_FN) {
+        error_at(name, "function cannot be declared '_Thread_local'");
+    } else if (is_tls && s->k != SCOPE_FILE && sclass == SC_THREAD_LOCAL) {
+        error_at(name, "'_Thread_local' variable in block scope must also be "
+                 "'static' or 'extern'");
+    }
+    switch (sclass & ~SC_THREAD_LOCAL) {
     case SC_TYPEDEF: return def_typedef(s, name, t);
     case SC_EXTERN: t->linkage = LINK_EXTERN; break;
     case SC_STATIC: t->linkage = LINK_STATIC; break;
@@ -2345,24 +3928,45 @@ static AstNode * parse_init_decl(Scope *s, AstType *base, int sclass) {
     if (s->k == SCOPE_FILE && peek_tk_is(s->pp, '{')) {
         return parse_fn_def(s, t, name, param_names);
     }
-    return parse_decl_var(s, t, name);
+    AstNode *decl = parse_decl_var(s, t, name);
+    decl->is_const = is_const_obj(t, base, tquals);
+    decl->is_tls = is_tls;
+    return decl;
+}
+
+// Each node goes to the hook on its own, in order
+static void hand_over(Deferred *d, AstNode *n) {
+    while (n) {
+        AstNode *next = n->next;
+        n->next = NULL;
+        d->hook(n, d->hook_arg);
+        n = next;
+    }
 }
 
 static AstNode * parse_decl(Scope *s) {
-    int sclass;
-    AstType *base = parse_decl_specs(s, &sclass);
+    int sclass, tquals;
+    Attrs attrs;
+    AstType *base = parse_decl_specs(s, &sclass, &tquals, &attrs);
     if (next_tk_is(s->pp, ';')) {
         return NULL;
     }
     AstNode *head = NULL;
     AstNode **cur = &head;
+    int to_hook = s->k == SCOPE_FILE && s->deferred && s->deferred->hook;
     while (1) {
-        *cur = parse_init_decl(s, base, sclass);
-        if ((*cur)->k == N_FN_DEF) {
-            return head;
+        AstNode *n = parse_init_decl(s, base, sclass, tquals, &attrs);
+        int is_fn_def = !n || n->k == N_FN_DEF; // NULL once it's been streamed
+        if (to_hook) {
+            hand_over(s->deferred, n);
+        } else {
+            *cur = n;
+            while (*cur) {
+                cur = &(*cur)->next;
+            }
         }
-        while (*cur) {
-            cur = &(*cur)->next;
+        if (is_fn_def) {
+            return head;
         }
         if (!next_tk_is(s->pp, ',')) {
             break;
@@ -2372,17 +3976,96 @@ static AstNode * parse_decl(Scope *s) {
     return head;
 }
 
-AstNode * parse(File *f) {
-    Lexer *l = new_lexer(f);
-    PP *pp = new_pp(l);
+// Against the file scope as it is at the end of the file, rather than where
+// the function was defined; the same for any valid program
+static void parse_deferred(Scope *file_scope, Token *eof) {
+    Deferred *d = file_scope->deferred;
+    int changed = 1;
+    while (changed) { // Bodies parsed may reference more functions
+        changed = 0;
+        for (size_t i = 0; i < vec_len(d->fns); i++) {
+            AstNode *fn = vec_get(d->fns, i);
+            if (fn->body_tks && map_get(d->used, fn->fn_name)) {
+                Vec *tks = fn->body_tks;
+                fn->body_tks = NULL; // No longer just a declaration
+                Scope s = *file_scope;
+                s.pp = new_replay_pp(tks, eof);
+                if (d->hook) {
+                    stream_fn_body(&s, fn);
+                } else {
+                    parse_fn_body(&s, fn);
+                }
+                free_replay_pp(s.pp);
+                vec_free(tks);
+                changed = 1;
+            }
+        }
+    }
+}
+
+static AstNode * drop_unused(AstNode *head) {
+    AstNode **cur = &head;
+    while (*cur) {
+        if ((*cur)->k == N_FN_DEF && (*cur)->body_tks) {
+            vec_free((*cur)->body_tks);
+            *cur = (*cur)->next;
+        } else {
+            cur = &(*cur)->next;
+        }
+    }
+    return head;
+}
+
+// GCC's names for the 128-bit integer types
+static void def_built_in_typedefs(Scope *s) {
+    Token *name = copy_tk(peek_tk(s->pp));
+    name->k = TK_IDENT;
+    name->ident = intern("__int128_t");
+    def_typedef(s, name, t_num(T_I128, 0));
+    name = copy_tk(name);
+    name->ident = intern("__uint128_t");
+    def_typedef(s, name, t_num(T_I128, 1));
+}
+
+static AstNode * parse_file(PP *pp, File *main, Vec *aggrs, DeclHook hook, void *arg) {
+    Deferred deferred = { main, map_new(), vec_new(), aggrs, hook, arg };
     Scope file_scope = new_scope(SCOPE_FILE, pp);
+    file_scope.deferred = &deferred;
+    def_built_in_typedefs(&file_scope);
     AstNode *head = NULL;
     AstNode **cur = &head;
-    while (!next_tk_is(pp, TK_EOF)) {
+    Token *eof;
+    while (!(eof = next_tk_is(pp, TK_EOF))) {
         *cur = parse_decl(&file_scope);
         while (*cur) {
             cur = &(*cur)->next;
         }
     }
+    parse_deferred(&file_scope, eof);
+    head = drop_unused(head);
+    smap_free(file_scope.vars);
+    smap_free(file_scope.tags);
+    map_free(deferred.used);
+    vec_free(deferred.fns);
     return head;
 }
+
+AstNode * parse(File *f, int pp_thread, Vec *deps, Vec *aggrs, DeclHook hook, void *arg) {
+    PP *pp = new_pp(new_lexer(f));
+    pp->deps = deps;
+    if (!pp_thread) {
+        return parse_file(pp, f, aggrs, hook, arg);
+    }
+    pp = start_pp_thread(pp);
+    jmp_buf jmp, *outer = ERROR_JMP;
+    if (setjmp(jmp) != 0) { // The thread has to be stopped on an error too
+        ERROR_JMP = outer;
+        end_pp_thread(pp);
+        error_fail();
+    }
+    ERROR_JMP = &jmp;
+    AstNode *ast = parse_file(pp, f, aggrs, hook, arg);
+    ERROR_JMP = outer;
+    end_pp_thread(pp);
+    return ast;
+}
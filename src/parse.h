@@ -11,28 +11,47 @@ enum { // Storage classes
     SC_STATIC,
     SC_AUTO,
     SC_REGISTER,
+    SC_THREAD_LOCAL = 0x10, // '_Thread_local'; OR'd with 'SC_STATIC', etc.
 };
 
 enum { // Type qualifiers
     TQ_CONST    = 0b001,
     TQ_RESTRICT = 0b010,
     TQ_VOLATILE = 0b100,
+    TQ_ATOMIC   = 0b1000,
 };
 
 enum { // Function specifiers
     FS_INLINE = 1,
 };
 
+enum { // Function attributes, e.g., '__attribute__((noinline))'
+    FA_ALWAYS_INLINE = 0b1,
+    FA_NOINLINE      = 0b10,
+    FA_HOT           = 0b100,
+    FA_COLD          = 0b1000,
+    FA_PURE          = 0b10000,  // No side effects; only reads memory
+    FA_CONST         = 0b100000, // Doesn't even read memory
+};
+
 enum { // Linkage
     LINK_NONE,
     LINK_STATIC,
     LINK_EXTERN,
 };
 
+enum { // Visibility, from '__attribute__((visibility("...")))'
+    VIS_NONE,    // Not given; '-fvisibility' decides (see 'is_hidden')
+    VIS_DEFAULT, // Exported from a shared library, and can be preempted
+    VIS_HIDDEN,  // Not exported, so references bind within the library
+};
+
 typedef struct {
     struct AstType *t;
     char *name;
     size_t offset;
+    int is_bit_field; // Its 'bits' bits start at bit 'bit_offset' of a 't' at 'offset'
+    size_t bits, bit_offset;
 } Field;
 
 typedef struct {
@@ -47,6 +66,7 @@ enum {
     T_INT,
     T_LONG,
     T_LLONG,
+    T_I128, // '__int128'; passed around in two halves
     T_FLOAT,
     T_DOUBLE,
     T_LDOUBLE,
@@ -57,16 +77,23 @@ enum {
     T_STRUCT,
     T_UNION,
     T_ENUM,
+    T_VEC, // GCC's '__attribute__((vector_size(N)))'
 };
 
 typedef struct AstType {
     int k;
     int linkage;
+    int visibility; // 'VIS_*'; for a declaration with linkage
+    int is_atomic; // '_Atomic'; loads and stores of the object are atomic
     size_t size, align;
+    struct AstType *ptr_to; // Shared pointer to this type, for expressions
     union {
-        int is_unsigned;  // T_CHAR to T_LLONG
-        struct AstType *ptr; // T_PTR
-        struct { // T_ARR
+        int is_unsigned;  // T_CHAR to T_I128
+        struct { // T_PTR
+            struct AstType *ptr;
+            int is_restrict; // Declared with 'restrict'
+        };
+        struct { // T_ARR, T_VEC (with 'size / elem->size' lanes)
             struct AstType *elem;
             struct AstNode *len;   // VLA if len->k != N_IMM
             struct IrIns *vla_len; // Length of VLA at init (for compiler)
@@ -75,6 +102,10 @@ typedef struct AstType {
             struct AstType *ret;
             Vec *params; // of 'AstType *'
             int is_vararg;
+            int no_instrument;   // '__attribute__((no_instrument_function))'
+            int patchable_entry; // '__attribute__((patchable_function_entry(N)))';
+                                 // -1 if not given
+            int fn_attrs;        // Set of 'FA_*'
         };
         Vec *fields; // of 'Field *'; T_STRUCT, T_UNION
         struct {  // T_ENUM
@@ -144,11 +175,13 @@ enum {
     N_POST_DEC,
     N_DEREF,
     N_ADDR,
+    N_LABEL_ADDR, // '&&label' (a GNU extension)
     N_CONV,
 
     // Postfix operations
     N_IDX,
     N_CALL,
+    N_BUILTIN, // Call to a '__builtin_...' function, compiled inline
     N_FIELD,
 
     // Statements
@@ -165,12 +198,81 @@ enum {
     N_BREAK,
     N_CONTINUE,
     N_GOTO,
+    N_INDIRECT_GOTO, // 'goto *ptr' (a GNU extension)
     N_LABEL,
     N_RET,
+    N_ASM, // GNU inline assembly
 
     N_LAST,
 };
 
+enum { // Builtin functions (for N_BUILTIN)
+    B_EXPECT,   // '__builtin_expect'; a hint for which way a branch goes
+    B_POPCOUNT, // '__builtin_popcount', '__builtin_popcountl', etc.
+    B_CTZ,
+    B_CLZ,
+    B_BSWAP,    // '__builtin_bswap16', '__builtin_bswap32', etc.
+    B_MEMCPY,
+    B_MEMSET,
+    B_MEMCMP,   // Also calls to 'memcmp', 'strcmp', and 'strlen' (see
+    B_STRCMP,   // 'lib_builtin')
+    B_STRLEN,
+    B_ASSUME_ALIGNED,  // '__builtin_assume_aligned'
+    B_PREFETCH,        // '__builtin_prefetch'
+    B_UNREACHABLE,     // '__builtin_unreachable'
+    B_ASSUME,          // '__builtin_assume'; ignored if its condition has side effects
+    B_ATOMIC_LOAD,     // '__atomic_load_n', etc.; the memory order is the last
+    B_ATOMIC_STORE,    // argument
+    B_ATOMIC_XCHG,
+    B_ATOMIC_CAS,      // '__atomic_compare_exchange_n'
+    B_ATOMIC_FETCH_OP, // '__atomic_fetch_add', etc.; returns the old value
+    B_ATOMIC_OP_FETCH, // '__atomic_add_fetch', etc.; returns the new value
+    B_ATOMIC_FENCE,    // '__atomic_thread_fence'
+    B_SIGNAL_FENCE,    // '__atomic_signal_fence'; only stops the compiler
+};
+
+enum { // Inline assembly operand constraints
+    ASM_GPR,   // 'r' (or 'q', 'g'); any GPR
+    ASM_FIXED, // 'a', 'b', 'c', 'd', 'S', or 'D'; a particular GPR
+    ASM_SSE,   // 'x'
+    ASM_MEM,   // 'm'
+    ASM_IMM,   // 'i' or 'n'; an integer constant expression
+    ASM_TIED,  // '0' to '9'; an input in the same place as that output
+};
+
+typedef struct {
+    int k;
+    int reg;   // ASM_FIXED; the GPR's number in the encoding (0 is rax)
+    int tied;  // ASM_TIED; index of the output
+    int is_out, is_in; // Written ('=' or '+'), and read (an input or '+')
+    int early_clobber; // '&'; written before the inputs are all read
+    char *name;        // For '%[name]' in the template, or NULL
+    size_t size;       // Of the operand's type, in bytes
+    uint64_t imm;      // ASM_IMM
+} AsmOperand;
+
+// Outlives the AST (the IR and assembly refer to it), so isn't in its arena.
+// The template is in NASM syntax; operands are substituted for '%0' to '%9'
+// and '%[name]', with an optional size modifier (e.g., '%k0' for the 32-bit
+// register). Every block is treated as volatile, reading and writing memory,
+// and clobbering the flags
+typedef struct InlineAsm {
+    char *template;
+    int is_basic; // No operands; '%' is left alone in the template
+    AsmOperand *oprs; // Outputs, then inputs
+    int num_oprs, num_outs;
+    uint32_t clobbers, sse_clobbers; // Bit per reg, numbered as for 'reg'
+} InlineAsm;
+
+#define MAX_ASM_OPRS 30 // Same limit as GCC
+
+#define MAX_PATCHABLE_ENTRY 255 // NOPs for 'patchable_function_entry'
+
+#define MAX_ALIGN 16 // That any type needs (a vector); what a bare 'aligned' asks for
+
+// Nodes other than N_FN_DEF, N_FOR, and N_SWITCH are allocated with only the
+// first 3 pointers' worth of the union (see 'node' in 'parse.c'), so their
+// fields have to fit in that, and they can't be copied with '*n = *m'
 typedef struct AstNode {
     struct AstNode *next;
     int k;
@@ -178,7 +280,10 @@ typedef struct AstNode {
     Token *tk;
     union {
         // Constants and variables
-        uint64_t imm; // N_IMM
+        struct { // N_IMM
+            uint64_t imm;
+            uint64_t imm_hi; // The top half of a T_I128
+        };
         double fp;    // N_FP
         struct {      // N_STR
             union { char *str; uint16_t *str16; uint32_t *str32; };
@@ -194,9 +299,11 @@ typedef struct AstNode {
 
         // Operations
         struct { struct AstNode *l, *r; }; // Unary and binary operations
-        struct { // N_CALL
-            struct AstNode *fn;
-            Vec *args; // of 'AstNode *'
+        struct { // N_CALL, N_BUILTIN
+            struct AstNode *fn; // N_CALL
+            Vec *args;          // of 'AstNode *'
+            int builtin;        // N_BUILTIN; one of 'B_EXPECT', etc.
+            int builtin_op;     // B_ATOMIC_FETCH_OP, B_ATOMIC_OP_FETCH; 'N_ADD', etc.
         };
         struct { // N_FIELD
             struct AstNode *obj;
@@ -208,10 +315,13 @@ typedef struct AstNode {
             char *fn_name;
             Vec *param_names; // of 'Token *'
             struct AstNode *fn_body;
+            Vec *body_tks; // of 'Token *'; the body's, until it's parsed
         };
         struct { // N_DECL
             struct AstNode *var; // with k = N_LOCAL, N_GLOBAL
             struct AstNode *val;
+            int is_const; // The object itself is 'const' (so read only)
+            int is_tls;   // '_Thread_local' (or '__thread')
         };
         struct { // N_IF, N_TERNARY
             struct AstNode *if_cond, *if_body;
@@ -219,9 +329,11 @@ typedef struct AstNode {
         };
         struct { // N_WHILE, N_DO_WHILE
             struct AstNode *loop_cond, *loop_body;
+            int loop_unroll; // From '#pragma unroll' (see 'BB.unroll')
         };
         struct { // N_FOR
             struct AstNode *for_init, *for_cond, *for_inc, *for_body;
+            int for_unroll;
         };
         struct { // N_SWITCH
             struct AstNode *switch_cond, *switch_body;
@@ -233,19 +345,43 @@ typedef struct AstNode {
             struct AstNode *case_body;
             struct BB **case_br; // For the compiler
         };
-        struct { char *goto_label; }; // N_GOTO
+        struct { char *goto_label; }; // N_GOTO, N_LABEL_ADDR
+        struct AstNode *goto_ptr; // N_INDIRECT_GOTO
         struct { // N_LABEL
             char *label;
             struct AstNode *label_body;
         };
         struct AstNode *ret; // N_RET
+        struct { // N_ASM
+            InlineAsm *inline_asm;
+            Vec *asm_args; // of 'AstNode *'; per operand (NULL for ASM_IMM)
+        };
     };
 } AstNode;
 
-AstNode * parse(File *f);
+// A struct or union definition, for '--struct-layout-report'
+typedef struct {
+    AstType *t;
+    char *tag; // NULL if it's anonymous
+    Token *tk; // The tag, or the '{' if it's anonymous
+} AggrDef;
 
-// Used by the preprocessor for '#if' directives
-int64_t parse_const_int_expr(PP *pp);
+// Called with each top-level node as soon as it's parsed, with '-fstream'
+typedef void (*DeclHook)(AstNode *n, void *arg);
+
+// 'pp_thread' runs the preprocessor on its own thread (see 'start_pp_thread').
+// If 'deps' is set, the full path of every header '#include'd is pushed onto
+// it (repeats and all), for '-MD'. If 'aggrs' is set, every struct and union
+// definition is pushed onto it (of 'AggrDef *'; in the AST's arena).
+//
+// If 'hook' is set, no list is built (and NULL is returned): each declaration
+// and function definition goes to 'hook' in order instead. A function's body
+// is freed (with everything else allocated in the AST's arena while parsing
+// it) once 'hook' returns, so only the file scope is kept for the whole file.
+// A header's static function whose body is deferred (see 'Deferred' in
+// 'parse.c') goes to 'hook' first without a body, as a declaration, then
+// again with its body at the end of the file if it's used
+AstNode * parse(File *f, int pp_thread, Vec *deps, Vec *aggrs, DeclHook hook, void *arg);
 
 // Used by the compiler to handle VLAs separate to constant-sized arrays
 int is_vla(AstType *t);
@@ -253,4 +389,10 @@ int is_vla(AstType *t);
 // Used by the compiler to check for constant array/struct initializers
 AstNode * try_calc_const_expr(AstNode *e);
 
+// Reads an operand reference in an inline assembly template from just past
+// its '%' (e.g., 'k0' or '[name]'), advancing '*s' over it. Returns the
+// operand's index and sets '*modifier' (to 0 if there isn't one), or returns
+// -1 if it's invalid
+int read_asm_opr(InlineAsm *a, char **s, int *modifier);
+
 #endif
@@ -0,0 +1,226 @@
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "passes.h"
+#include "analysis.h"
+#include "inline.h"
+#include "lto.h"
+#include "ipcp.h"
+#include "sroa.h"
+#include "mem2reg.h"
+#include "sccp.h"
+#include "gvn.h"
+#include "dse.h"
+#include "thread.h"
+#include "licm.h"
+#include "interchange.h"
+#include "unswitch.h"
+#include "switch_conv.h"
+#include "if_convert.h"
+#include "idiom.h"
+#include "vectorise.h"
+#include "strength.h"
+#include "unroll.h"
+#include "rotate.h"
+#include "bits.h"
+#include "vrp.h"
+#include "sink.h"
+#include "tail_merge.h"
+#include "dce.h"
+#include "dge.h"
+#include "stats.h"
+
+// Inlining changes its callers' CFGs, and runs before anything's analysed
+Pass PASS_INLINE = { "inline", .module = inline_fns, .level = 2 };
+Pass PASS_CONSTIFY = { "constify", .module = constify_globals, .level = 1, .keeps = A_ALL };
+Pass PASS_IPCP = { "ipcp", .module = propagate_args, .level = 2, .needs = A_LOOPS, .keeps = A_ALL };
+Pass PASS_SROA = { "sroa", .fn = sroa, .level = 1, .keeps = A_ALL };
+Pass PASS_MEM2REG = { "mem2reg", .fn = mem2reg, .level = 1, .needs = A_DOMINATORS, .keeps = A_ALL };
+Pass PASS_SCCP = { "sccp", .fn = sccp, .level = 1, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_GVN = { "gvn", .fn = gvn, .level = 1, .needs = A_DOMINATORS, .keeps = A_ALL };
+Pass PASS_VRP = { "vrp", .fn = propagate_ranges, .level = 2, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_DSE = { "dse", .fn = dse, .level = 1, .needs = A_DOMINATORS, .keeps = A_ALL };
+Pass PASS_THREAD = { "thread", .fn = thread_branches, .level = 2, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_LICM = { "licm", .fn = licm, .level = 2, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_INTERCHANGE = { "interchange", .fn = interchange_loops,
+    .level = 2, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_UNSWITCH = { "unswitch", .fn = unswitch_loops,
+    .level = 2, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_SWITCH_CONV = { "switch_conv", .module = convert_switches,
+    .level = 2, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_IF_CONVERT = { "if_convert", .fn = if_convert,
+    .level = 2, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_IDIOM = { "idiom", .fn = recognise_idioms, .level = 2, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_VECTORISE = { "vectorise", .fn = vectorise, .level = 2, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_STRENGTH_REDUCE = { "strength_reduce", .fn = strength_reduce,
+    .level = 2, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_UNROLL = { "unroll", .fn = unroll, .level = 2, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_ROTATE = { "rotate", .fn = rotate_loops, .level = 2, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_SIMPLIFY_BITS = { "simplify_bits", .fn = simplify_bits,
+    .level = 1, .needs = A_DOMINATORS, .keeps = A_ALL };
+Pass PASS_SINK = { "sink", .fn = sink, .level = 2, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_TAIL_MERGE = { "tail_merge", .fn = merge_tails,
+    .level = 2, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_DCE = { "dce", .fn = dce, .level = 1, .needs = A_ALL, .keeps = A_ALL };
+Pass PASS_DGE = { "dge", .module = dge, .level = 0, .keeps = A_ALL }; // Even at -O0, like GCC
+
+int PASS_STATS = 0;
+
+
+// ---- Statistics ------------------------------------------------------------
+
+typedef struct {
+    Pass *pass;
+    size_t runs;
+    double secs;
+    size_t ins_before, ins_after; // Summed over every run
+} PassStat;
+
+static char *ANALYSIS_NAMES[] = { "cfg", "dominators", "loops" };
+#define NUM_ANALYSES 3
+
+static Vec *PASS_STAT_ROWS; // of 'PassStat *', in the order they first ran
+static size_t ANALYSES_RUN[NUM_ANALYSES], ANALYSES_REUSED[NUM_ANALYSES];
+static double ANALYSIS_SECS[NUM_ANALYSES];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static PassStat * pass_stat(Pass *pass) {
+    if (!PASS_STAT_ROWS) {
+        PASS_STAT_ROWS = vec_new();
+    }
+    for (size_t i = 0; i < vec_len(PASS_STAT_ROWS); i++) {
+        PassStat *s = vec_get(PASS_STAT_ROWS, i);
+        if (s->pass == pass) {
+            return s;
+        }
+    }
+    PassStat *s = calloc(1, sizeof(PassStat));
+    s->pass = pass;
+    vec_push(PASS_STAT_ROWS, s);
+    return s;
+}
+
+static size_t count_ir(Vec *globals) {
+    size_t n = 0;
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k != G_FN_DEF) {
+            continue;
+        }
+        for (BB *bb = g->fn->entry; bb; bb = bb->next) {
+            for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+void print_pass_stats(FILE *out) {
+    if (!PASS_STAT_ROWS) {
+        return;
+    }
+    fprintf(out, "%-20s %6s %10s %10s %10s %10s\n", "pass", "runs", "time (ms)",
+            "IR before", "IR after", "change");
+    double total = 0;
+    for (size_t i = 0; i < vec_len(PASS_STAT_ROWS); i++) {
+        PassStat *s = vec_get(PASS_STAT_ROWS, i);
+        fprintf(out, "%-20s %6zu %10.3f %10zu %10zu %+10lld\n", s->pass->name,
+                s->runs, s->secs * 1e3, s->ins_before, s->ins_after,
+                (long long) s->ins_after - (long long) s->ins_before);
+        total += s->secs;
+    }
+    fprintf(out, "%-20s %6s %10.3f\n", "total", "", total * 1e3);
+
+    fprintf(out, "\n%-20s %6s %10s %10s\n", "analysis", "runs", "time (ms)", "reused");
+    for (int i = 0; i < NUM_ANALYSES; i++) {
+        fprintf(out, "%-20s %6zu %10.3f %10zu\n", ANALYSIS_NAMES[i], ANALYSES_RUN[i],
+                ANALYSIS_SECS[i] * 1e3, ANALYSES_REUSED[i]);
+    }
+}
+
+void reset_pass_stats() {
+    PASS_STAT_ROWS = NULL;
+    for (int i = 0; i < NUM_ANALYSES; i++) {
+        ANALYSES_RUN[i] = ANALYSES_REUSED[i] = 0;
+        ANALYSIS_SECS[i] = 0;
+    }
+}
+
+
+// ---- Pass Manager ----------------------------------------------------------
+
+// With '--pass-stats', the analyses are brought up to date one at a time (the
+// ones that others depend on first), to time each one
+static void require(Fn *fn, int needs) {
+    if (!PASS_STATS) {
+        require_analyses(fn, needs);
+        return;
+    }
+    for (int i = NUM_ANALYSES - 1; i > 0; i--) {
+        if (needs & (1 << i)) {
+            needs |= (1 << i) - 1;
+        }
+    }
+    for (int i = 0; i < NUM_ANALYSES; i++) {
+        if (!(needs & (1 << i))) {
+            continue;
+        }
+        double start = now();
+        if (require_analyses(fn, 1 << i)) {
+            ANALYSES_RUN[i]++;
+            ANALYSIS_SECS[i] += now() - start;
+        } else {
+            ANALYSES_REUSED[i]++;
+        }
+    }
+}
+
+int run_pass(Vec *globals, Pass *pass, int level) {
+    if (level < pass->level) {
+        return 0;
+    }
+    phase_begin(pass->name);
+    PassStat *stat = PASS_STATS ? pass_stat(pass) : NULL;
+    double secs = 0;
+    if (stat) {
+        stat->ins_before += count_ir(globals);
+    }
+    if (pass->module) {
+        for (size_t i = 0; i < vec_len(globals); i++) {
+            Global *g = vec_get(globals, i);
+            if (g->k == G_FN_DEF) {
+                require(g->fn, pass->needs);
+            }
+        }
+        double start = stat ? now() : 0;
+        pass->module(globals);
+        secs = stat ? now() - start : 0;
+    }
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k != G_FN_DEF) {
+            continue;
+        }
+        if (pass->fn) {
+            require(g->fn, pass->needs);
+            double start = stat ? now() : 0;
+            pass->fn(g->fn);
+            secs += stat ? now() - start : 0;
+        }
+        g->fn->analyses &= pass->keeps;
+    }
+    if (stat) {
+        stat->runs++;
+        stat->secs += secs;
+        stat->ins_after += count_ir(globals);
+    }
+    phase_end();
+    return 1;
+}
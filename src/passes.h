@@ -0,0 +1,46 @@
+
+#ifndef COSEC_PASSES_H
+#define COSEC_PASSES_H
+
+#include <stdio.h>
+
+#include "compile.h"
+
+// Optimisation pass manager. Each of the optimiser's passes is named here,
+// either as a function pass (run on each function on its own) or a module
+// pass (run once over all the globals, for passes like inlining that look
+// across functions). The driver strings them together into pipelines (see
+// 'driver.c'), and 'run_pass' runs one:
+//   * only if the '-O' level is at least the pass's 'level';
+//   * bringing the analyses it 'needs' up to date first, on each function
+//     where something since has left them stale (see 'require_analyses');
+//   * and marking the ones it doesn't 'keep' up to date as stale afterwards.
+// With '--pass-stats', the time each pass takes and how many IR instructions
+// it adds or removes are summed over every time it runs, along with how many
+// times each analysis was actually run rather than reused
+
+typedef struct {
+    char *name;
+    void (*fn)(Fn *fn);             // A function pass; or
+    void (*module)(Vec *globals);   // A module pass
+    int level;        // The lowest '-O' level it runs at
+    int needs, keeps; // Sets of 'A_*' (see 'analysis.h')
+} Pass;
+
+extern Pass PASS_INLINE, PASS_CONSTIFY, PASS_IPCP, PASS_SROA, PASS_MEM2REG, PASS_SCCP,
+    PASS_GVN, PASS_VRP, PASS_DSE, PASS_THREAD, PASS_LICM, PASS_INTERCHANGE, PASS_UNSWITCH,
+    PASS_SWITCH_CONV, PASS_IF_CONVERT, PASS_IDIOM,
+    PASS_VECTORISE, PASS_STRENGTH_REDUCE, PASS_UNROLL, PASS_ROTATE,
+    PASS_SIMPLIFY_BITS, PASS_SINK, PASS_TAIL_MERGE, PASS_DCE, PASS_DGE;
+
+#define MAX_OPT_LEVEL 2
+
+// Returns 1 if the pass ran, or 0 if 'level' is below the pass's
+int run_pass(Vec *globals, Pass *pass, int level);
+
+extern int PASS_STATS;
+
+void print_pass_stats(FILE *out);
+void reset_pass_stats(); // Between the compile server's jobs
+
+#endif
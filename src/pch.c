@@ -0,0 +1,426 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#define USE_MMAP
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "pch.h"
+#include "error.h"
+
+char *PCH_DIR = NULL;
+
+typedef struct {
+    int64_t mtime, size; // Of the header when it was lexed
+    Token *tks;
+    size_t num;
+    char *guard; // Include guard macro, if any
+    int is_ready; // Not set while one thread's still lexing it
+} Header;
+
+// Files compiled in parallel tend to include the same headers at the same
+// time, so the first thread to miss leaves a placeholder that the others
+// wait on, rather than every one of them reading and lexing the header
+static Map *HEADERS; // of 'Header *'; by interned full path
+static pthread_mutex_t HEADERS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t HEADERS_READY = PTHREAD_COND_INITIALIZER;
+
+// Returns the cached header if it's up to date, or otherwise a new
+// placeholder that the caller has to 'publish' (or 'abandon'). Other threads
+// only ever look at a placeholder under the lock, through the map
+static Header * lookup(char *path, struct stat *st) {
+    pthread_mutex_lock(&HEADERS_LOCK);
+    if (!HEADERS) {
+        HEADERS = map_new();
+    }
+    Header *h;
+    while ((h = map_get(HEADERS, path)) && !h->is_ready) {
+        pthread_cond_wait(&HEADERS_READY, &HEADERS_LOCK);
+    }
+    if (!h || h->mtime != (int64_t) st->st_mtime || h->size != (int64_t) st->st_size) {
+        h = calloc(1, sizeof(Header)); // Missing, or changed since it was cached
+        map_put(HEADERS, path, h);
+    }
+    pthread_mutex_unlock(&HEADERS_LOCK);
+    return h;
+}
+
+static void publish(char *path, Header *h) {
+    pthread_mutex_lock(&HEADERS_LOCK);
+    h->is_ready = 1;
+    map_put(HEADERS, path, h);
+    pthread_cond_broadcast(&HEADERS_READY);
+    pthread_mutex_unlock(&HEADERS_LOCK);
+}
+
+// The header can't be read; the next thread to look for it tries again
+static void abandon(char *path, Header *placeholder) {
+    pthread_mutex_lock(&HEADERS_LOCK);
+    if (map_get(HEADERS, path) == placeholder) {
+        map_remove(HEADERS, path);
+    }
+    pthread_cond_broadcast(&HEADERS_READY);
+    pthread_mutex_unlock(&HEADERS_LOCK);
+}
+
+// An error lexing the header goes on to the thread's 'ERROR_JMP' as usual,
+// but only once the placeholder's been abandoned, so nothing waits on it
+// forever
+static void lex_header(char *path, Header *h, FILE *fp, char *name) {
+    jmp_buf *prev = ERROR_JMP;
+    jmp_buf env;
+    if (prev) {
+        ERROR_JMP = &env;
+        if (setjmp(env)) {
+            ERROR_JMP = prev;
+            abandon(path, h);
+            longjmp(*prev, 1);
+        }
+    }
+    h->tks = lex_all(new_file(fp, name), &h->num);
+    ERROR_JMP = prev;
+}
+
+
+// ---- Include Guards --------------------------------------------------------
+
+// Returns the directive's name if 'tks[i]' starts one
+static char * directive_at(Token *tks, size_t num, size_t i) {
+    if (i + 1 < num && tks[i].k == '#' && tks[i].col == 1 && tks[i + 1].k == TK_IDENT) {
+        return tks[i + 1].ident;
+    }
+    return NULL;
+}
+
+static int is_tk(Token *tks, size_t num, size_t i, int k) {
+    return i < num && tks[i].k == k;
+}
+
+static int is_ident(Token *tks, size_t num, size_t i, char *ident) {
+    return is_tk(tks, num, i, TK_IDENT) && strcmp(tks[i].ident, ident) == 0;
+}
+
+// Matches '#ifndef X' or '#if !defined X' or '#if !defined(X)' at 'tks[*i]',
+// moving 'i' past the newline
+static char * match_guard_start(Token *tks, size_t num, size_t *i) {
+    char *d = directive_at(tks, num, *i);
+    if (!d) {
+        return NULL;
+    }
+    size_t j = *i + 2;
+    if (strcmp(d, "if") == 0 && is_tk(tks, num, j, '!') && is_ident(tks, num, j + 1, "defined")) {
+        j += 2;
+        int parens = is_tk(tks, num, j, '(');
+        j += parens;
+        if (!is_tk(tks, num, j, TK_IDENT) || (parens && !is_tk(tks, num, j + 1, ')'))) {
+            return NULL;
+        }
+        char *guard = tks[j].ident;
+        j += 1 + parens;
+        if (!is_tk(tks, num, j, TK_NEWLINE)) {
+            return NULL;
+        }
+        *i = j + 1;
+        return guard;
+    } else if (strcmp(d, "ifndef") == 0 && is_tk(tks, num, j, TK_IDENT) &&
+               is_tk(tks, num, j + 1, TK_NEWLINE)) {
+        *i = j + 2;
+        return tks[j].ident;
+    }
+    return NULL;
+}
+
+// The header is guarded if nothing but newlines comes before the guard's
+// '#if' and after its '#endif' (and there's no '#else' or '#elif' for it)
+static char * find_guard(Token *tks, size_t num) {
+    size_t i = 0;
+    while (is_tk(tks, num, i, TK_NEWLINE)) i++;
+    char *guard = match_guard_start(tks, num, &i);
+    if (!guard) {
+        return NULL;
+    }
+    int depth = 1;
+    for (; i < num && depth > 0; i++) {
+        char *d = directive_at(tks, num, i);
+        if (!d) {
+            continue;
+        }
+        if (strcmp(d, "if") == 0 || strcmp(d, "ifdef") == 0 || strcmp(d, "ifndef") == 0) {
+            depth++;
+        } else if (strcmp(d, "endif") == 0) {
+            depth--;
+        } else if (depth == 1 && (strcmp(d, "else") == 0 || strcmp(d, "elif") == 0)) {
+            return NULL;
+        }
+    }
+    if (depth > 0) {
+        return NULL;
+    }
+    while (i < num && tks[i].k != TK_NEWLINE && tks[i].k != TK_EOF) i++; // Rest of '#endif'
+    while (is_tk(tks, num, i, TK_NEWLINE)) i++;
+    return is_tk(tks, num, i, TK_EOF) ? guard : NULL;
+}
+
+
+// ---- Blobs -----------------------------------------------------------------
+
+// A blob is a header (the magic number, 'PCH_VERSION', the header file's
+// modification time, size and full path), followed by the number of tokens and
+// the tokens themselves. Each token is its kind, whether it has a preceding
+// space, its encoding, line and column, then (depending on its kind) either a
+// character, or a length and that many bytes of text plus a NUL terminator (so
+// the text can be used straight out of the mapping)
+
+#define PCH_MAGIC   0x48435043 // 'CPCH'
+#define PCH_VERSION 6
+
+static int has_text(int k) {
+    return k == TK_IDENT || k == TK_NUM || k == TK_STR ||
+           k == TK_INCLUDE_PATH || k == TK_REST_OF_LINE;
+}
+
+static char * token_text(Token *t, uint32_t *len) {
+    switch (t->k) {
+    case TK_IDENT: *len = (uint32_t) strlen(t->ident); return t->ident;
+    case TK_NUM:   *len = (uint32_t) strlen(t->num); return t->num;
+    default:       *len = (uint32_t) t->len; return t->str;
+    }
+}
+
+static void put(Buf *b, void *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        buf_push(b, ((char *) data)[i]);
+    }
+}
+
+static void put_u32(Buf *b, uint32_t v) { put(b, &v, sizeof(v)); }
+static void put_i32(Buf *b, int32_t v)  { put(b, &v, sizeof(v)); }
+static void put_i64(Buf *b, int64_t v)  { put(b, &v, sizeof(v)); }
+
+static Buf * encode_blob(char *path, Header *h) {
+    Buf *b = buf_new();
+    put_u32(b, PCH_MAGIC);
+    put_u32(b, PCH_VERSION);
+    put_i64(b, h->mtime);
+    put_i64(b, h->size);
+    put_u32(b, (uint32_t) strlen(path));
+    put(b, path, strlen(path));
+    put_u32(b, (uint32_t) h->num);
+    for (size_t i = 0; i < h->num; i++) {
+        Token *t = &h->tks[i];
+        put_u32(b, (uint32_t) t->k);
+        buf_push(b, (char) t->has_preceding_space);
+        buf_push(b, (char) t->enc);
+        put_i32(b, t->line);
+        put_i32(b, t->col);
+        if (has_text(t->k)) {
+            uint32_t len;
+            char *text = token_text(t, &len);
+            put_u32(b, len);
+            put(b, text, len);
+            buf_push(b, '\0');
+        } else if (t->k == TK_CH) {
+            put_i32(b, t->ch);
+        }
+    }
+    return b;
+}
+
+typedef struct {
+    char *p, *end;
+} Reader;
+
+static int get(Reader *r, void *data, size_t len) {
+    if ((size_t) (r->end - r->p) < len) {
+        return 0; // Truncated
+    }
+    memcpy(data, r->p, len);
+    r->p += len;
+    return 1;
+}
+
+// Returns a pointer to the next 'len' bytes (and the NUL after them)
+static char * get_text(Reader *r, uint32_t len) {
+    if ((size_t) (r->end - r->p) < (size_t) len + 1 || r->p[len] != '\0') {
+        return NULL;
+    }
+    char *text = r->p;
+    r->p += len + 1;
+    return text;
+}
+
+// Returns NULL if the blob is corrupt or for a different version of the header
+static Header * decode_blob(char *data, size_t size, char *path, struct stat *st) {
+    Reader r = { data, data + size };
+    uint32_t magic, version, path_len, num;
+    int64_t mtime, file_size;
+    if (!get(&r, &magic, 4) || magic != PCH_MAGIC ||
+            !get(&r, &version, 4) || version != PCH_VERSION ||
+            !get(&r, &mtime, 8) || mtime != (int64_t) st->st_mtime ||
+            !get(&r, &file_size, 8) || file_size != (int64_t) st->st_size ||
+            !get(&r, &path_len, 4) || path_len != strlen(path) ||
+            (size_t) (r.end - r.p) < path_len || memcmp(r.p, path, path_len) != 0) {
+        return NULL;
+    }
+    r.p += path_len;
+    if (!get(&r, &num, 4) || num == 0) {
+        return NULL;
+    }
+    Token *tks = calloc(num, sizeof(Token));
+    for (uint32_t i = 0; i < num; i++) {
+        Token *t = &tks[i];
+        uint32_t k;
+        uint8_t has_space, enc;
+        int32_t line, col;
+        if (!get(&r, &k, 4) || k >= TK_LAST || !get(&r, &has_space, 1) ||
+                !get(&r, &enc, 1) || !get(&r, &line, 4) || !get(&r, &col, 4)) {
+            goto corrupt;
+        }
+        t->k = (int) k;
+        t->has_preceding_space = has_space;
+        t->line = line;
+        t->col = col;
+        if (has_text(t->k)) {
+            uint32_t len;
+            char *text;
+            if (!get(&r, &len, 4) || !(text = get_text(&r, len))) {
+                goto corrupt;
+            }
+            switch (t->k) {
+            case TK_IDENT: t->ident = intern_n(text, len); break;
+            case TK_NUM:   t->num = text; break;
+            default:       t->str = text; t->len = len; t->enc = enc; break;
+            }
+        } else if (t->k == TK_CH) {
+            if (!get(&r, &t->ch, 4)) {
+                goto corrupt;
+            }
+            t->enc = enc;
+        }
+    }
+    if (tks[num - 1].k != TK_EOF) {
+        goto corrupt;
+    }
+    Header *h = malloc(sizeof(Header));
+    h->mtime = mtime;
+    h->size = file_size;
+    h->tks = tks;
+    h->num = num;
+    h->guard = find_guard(tks, num);
+    return h;
+corrupt:
+    free(tks);
+    return NULL;
+}
+
+static uint64_t hash_path(char *path) { // 64-bit FNV hash
+    uint64_t h = 14695981039346656037ULL;
+    for (char *p = path; *p; p++) {
+        h ^= (unsigned char) *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static char * blob_path(char *path) {
+    Buf *b = buf_new();
+    buf_printf(b, "%s/%016llx.pch", PCH_DIR, (unsigned long long) hash_path(path));
+    return b->data;
+}
+
+#ifdef USE_MMAP
+// The mapping is never unmapped, since the tokens point into it
+static Header * load_blob(char *path, struct stat *st) {
+    int fd = open(blob_path(path), O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat blob_st;
+    Header *h = NULL;
+    if (fstat(fd, &blob_st) == 0 && blob_st.st_size > 0) {
+        size_t size = (size_t) blob_st.st_size;
+        char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            h = decode_blob(data, size, path, st);
+            if (!h) {
+                munmap(data, size);
+            }
+        }
+    }
+    close(fd);
+    return h;
+}
+
+// Best effort; written to a temporary file first, so other compilers never
+// see half a blob
+static void save_blob(char *path, Header *h) {
+    mkdir(PCH_DIR, 0777);
+    char *dst = blob_path(path);
+    Buf *tmp = buf_new();
+    buf_printf(tmp, "%s.XXXXXX", dst);
+    int fd = mkstemp(tmp->data);
+    if (fd < 0) {
+        return;
+    }
+    Buf *b = encode_blob(path, h);
+    int ok = write(fd, b->data, b->len) == (ssize_t) b->len;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp->data, dst) != 0) {
+        unlink(tmp->data);
+    }
+}
+#else
+static Header * load_blob(char *path, struct stat *st) { return NULL; }
+static void save_blob(char *path, Header *h) {}
+#endif
+
+
+// ---- Includes --------------------------------------------------------------
+
+int pch_include(Lexer *l, char *path, char *name, char **guard) {
+    *guard = NULL;
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+    if (!S_ISREG(st.st_mode)) { // Something odd; don't cache it
+        FILE *fp = fopen(path, "r");
+        if (!fp) {
+            return 0;
+        }
+        push_lexer(l, new_file(fp, name));
+        return 1;
+    }
+    char *key = intern(path);
+    Header *h = lookup(key, &st);
+    if (!h->is_ready) { // This thread's to fill it in
+        Header *blob = PCH_DIR ? load_blob(path, &st) : NULL;
+        if (blob) {
+            publish(key, blob); // Replaces the placeholder
+            free(h);
+            h = blob;
+        } else {
+            FILE *fp = fopen(path, "r");
+            if (!fp) {
+                abandon(key, h);
+                return 0;
+            }
+            h->mtime = (int64_t) st.st_mtime;
+            h->size = (int64_t) st.st_size;
+            lex_header(key, h, fp, name);
+            h->guard = find_guard(h->tks, h->num);
+            if (PCH_DIR) {
+                save_blob(path, h);
+            }
+            publish(key, h);
+        }
+    }
+    push_replay_lexer(l, new_empty_file(name), h->tks, h->num);
+    *guard = h->guard;
+    return 1;
+}
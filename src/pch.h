@@ -0,0 +1,28 @@
+
+#ifndef COSEC_PCH_H
+#define COSEC_PCH_H
+
+#include "lex.h"
+
+// Precompiled headers. The first time a header is '#include'd, it's lexed in
+// one go and its tokens are kept (by full path, checked against the file's
+// modification time and size), so every later include of it, in any file on
+// any thread, replays them instead of lexing characters. Tokens are cached
+// before preprocessing, so the same tokens are right whatever macros are
+// defined when the header's included. A thread that includes a header while
+// another is still lexing it waits for those tokens, so each header is only
+// read once however many files include it at the same time.
+//
+// If 'PCH_DIR' is set ('-fpch-dir=<dir>'), the tokens are also written there
+// as a compact binary blob, which is memory-mapped by later runs of the
+// compiler
+extern char *PCH_DIR;
+
+// Pushes 'path' (a full path) onto 'l', with the name 'name' for errors and
+// '__FILE__'. Returns 0 if it can't be opened. If the whole header is inside
+// an include guard ('#ifndef X' ... '#endif', or '#if !defined(X)'), 'guard' is
+// set to the (interned) guard macro, otherwise NULL; the preprocessor can then
+// skip later includes of it without opening it while 'X' is defined
+int pch_include(Lexer *l, char *path, char *name, char **guard);
+
+#endif
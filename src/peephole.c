@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "peephole.h"
+#include "stats.h"
+#include "target.h"
+
+// Each pattern looks at the window of instructions starting at 'ins' and
+// rewrites it if it matches. Patterns are tried on every instruction until
+// none of them match anything, since one rewrite can expose another (e.g.,
+// deleting a redundant 'mov' can leave a 'jmp' to the next BB).
+//
+// Flags are never live across BBs ('cmp' is always followed by its 'jcc' or
+// 'setcc' in the same BB), so an instruction's effect on them only matters up
+// to the end of its BB.
+
+typedef struct {
+    char *name;
+    int (*apply)(AsmIns *ins); // Returns 1 if 'ins' was rewritten
+} Peephole;
+
+static AsmOpr * new_gpr(int reg, int size) {
+    AsmOpr *opr = arena_alloc(ARENA_ASM, sizeof(AsmOpr));
+    opr->k = OPR_GPR;
+    opr->reg = reg;
+    opr->size = size;
+    return opr;
+}
+
+static int is_gpr(AsmOpr *opr) {
+    return opr && opr->k == OPR_GPR;
+}
+
+static int is_imm(AsmOpr *opr, uint64_t imm) {
+    return opr && opr->k == OPR_IMM && opr->imm == imm;
+}
+
+static int same_reg(AsmOpr *l, AsmOpr *r) {
+    return l->k == r->k && l->reg == r->reg && l->size == r->size;
+}
+
+static int reads_flags(int op) {
+    return (op >= X64_SETE && op <= X64_SETAE) ||
+           (op >= X64_CMOVE && op <= X64_CMOVAE) || (op >= X64_JE && op <= X64_JAE);
+}
+
+// Shifts by 'cl' leave the flags alone if 'cl' is 0, so they don't count
+static int writes_flags(int op) {
+    return op == X64_ADD || op == X64_SUB || op == X64_IMUL || op == X64_MUL ||
+           op == X64_AND || op == X64_OR || op == X64_XOR || op == X64_CMP ||
+           op == X64_TEST || op == X64_IDIV || op == X64_DIV || op == X64_POPCNT ||
+           op == X64_BSF || op == X64_BSR || op == X64_LZCNT || op == X64_TZCNT ||
+           op == X64_UCOMISS || op == X64_UCOMISD || op == X64_CALL ||
+           op == X64_TAIL_CALL || op == X64_ASM || op == X64_LOCK_XADD ||
+           op == X64_LOCK_CMPXCHG;
+}
+
+// Whether nothing reads the flags set by 'ins' before they're overwritten
+static int flags_dead_after(AsmIns *ins) {
+    for (AsmIns *next = ins->next; next; next = next->next) {
+        if (reads_flags(next->op)) {
+            return 0;
+        } else if (writes_flags(next->op)) {
+            return 1;
+        }
+    }
+    return 1; // End of the BB
+}
+
+// The BB that's emitted after 'bb', skipping over any that are empty
+static BB * next_non_empty(BB *bb) {
+    for (bb = bb->next; bb && !bb->asm_head; bb = bb->next);
+    return bb;
+}
+
+
+// ---- Patterns --------------------------------------------------------------
+
+// 'mov <reg>, 0' -> 'xor <reg>, <reg>'; a 32-bit 'xor' zeros the upper half
+// of the register too, and has a shorter encoding
+static int zero_idiom(AsmIns *ins) {
+    if (ins->op != X64_MOV || !is_gpr(ins->l) || !is_imm(ins->r, 0) ||
+            !flags_dead_after(ins)) {
+        return 0;
+    }
+    int size = ins->l->size == R64 ? R32 : ins->l->size;
+    ins->op = X64_XOR;
+    ins->l = new_gpr(ins->l->reg, size);
+    ins->r = new_gpr(ins->l->reg, size);
+    return 1;
+}
+
+// 'cmp <reg>, 0' -> 'test <reg>, <reg>'; sets the flags in the same way
+static int test_idiom(AsmIns *ins) {
+    if (ins->op != X64_CMP || !is_gpr(ins->l) || !is_imm(ins->r, 0)) {
+        return 0;
+    }
+    ins->op = X64_TEST;
+    ins->r = new_gpr(ins->l->reg, ins->l->size);
+    return 1;
+}
+
+// 'add <opr>, 0' and 'sub <opr>, 0' (e.g., 'add rsp, 0') do nothing
+static int add_zero(AsmIns *ins) {
+    if ((ins->op != X64_ADD && ins->op != X64_SUB) || !is_imm(ins->r, 0) ||
+            !flags_dead_after(ins)) {
+        return 0;
+    }
+    delete_asm(ins);
+    return 1;
+}
+
+// 'lea a, [a + b]' -> 'add a, b' (and the same for a constant 'b'), which has
+// a shorter encoding, once the register allocator has put an add's result in
+// the same register as one of its operands
+static int lea_add(AsmIns *ins) {
+    if (ins->op != X64_LEA || !is_gpr(ins->l) || ins->r->k != OPR_MEM ||
+            ins->r->frame || ins->r->scale > 1 || !flags_dead_after(ins)) {
+        return 0;
+    }
+    AsmOpr *mem = ins->r, *r;
+    if (mem->idx == R_NONE && mem->base == ins->l->reg) {
+        r = arena_alloc(ARENA_ASM, sizeof(AsmOpr));
+        r->k = OPR_IMM;
+        r->imm = (uint64_t) mem->disp;
+    } else if (mem->idx != R_NONE && mem->disp == 0 && mem->base == ins->l->reg) {
+        r = new_gpr(mem->idx, ins->l->size);
+    } else if (mem->idx != R_NONE && mem->disp == 0 && mem->idx == ins->l->reg) {
+        r = new_gpr(mem->base, ins->l->size);
+    } else {
+        return 0;
+    }
+    ins->op = X64_ADD;
+    ins->r = r;
+    return 1;
+}
+
+// 'mov <reg>, <reg>' does nothing, except a 32-bit one, which clears the upper
+// half of the register
+static int self_mov(AsmIns *ins) {
+    if (ins->op == X64_MOV && is_gpr(ins->l) && is_gpr(ins->r) &&
+            same_reg(ins->l, ins->r) && ins->l->size == R64) {
+        delete_asm(ins);
+        return 1;
+    } else if ((ins->op == X64_MOVSS || ins->op == X64_MOVSD ||
+                ins->op == X64_MOVDQU) &&
+               ins->l->k == OPR_XMM && ins->r->k == OPR_XMM &&
+               ins->l->reg == ins->r->reg) {
+        delete_asm(ins);
+        return 1;
+    }
+    return 0;
+}
+
+// 'mov a, b' then 'mov b, a' -> 'mov a, b'
+static int mov_back(AsmIns *ins) {
+    AsmIns *next = ins->next;
+    if (!next || ins->op != X64_MOV || next->op != X64_MOV ||
+            !is_gpr(ins->l) || !is_gpr(ins->r) ||
+            !is_gpr(next->l) || !is_gpr(next->r) || ins->l->size != R64 ||
+            !same_reg(ins->l, next->r) || !same_reg(ins->r, next->l)) {
+        return 0;
+    }
+    delete_asm(next);
+    return 1;
+}
+
+// 'jmp' to the BB that comes next anyway
+static int jmp_next(AsmIns *ins) {
+    if (ins->op != X64_JMP || ins->l->k != OPR_BB || ins->next ||
+            ins->l->bb != next_non_empty(ins->bb)) {
+        return 0;
+    }
+    delete_asm(ins);
+    return 1;
+}
+
+// 'jmp' or 'jcc' to a BB that only jumps somewhere else goes straight there
+static int jmp_chain(AsmIns *ins) {
+    if (ins->op < X64_JMP || ins->op > X64_JAE || ins->l->k != OPR_BB) {
+        return 0;
+    }
+    BB *target = ins->l->bb;
+    AsmIns *jmp = target->asm_head;
+    if (!jmp || jmp->next || jmp->op != X64_JMP || jmp->l->k != OPR_BB ||
+            jmp->l->bb == target) {
+        return 0;
+    }
+    ins->l = jmp->l;
+    return 1;
+}
+
+static Peephole PEEPHOLES[] = {
+    { "mov <reg>, 0 -> xor", zero_idiom },
+    { "cmp <reg>, 0 -> test", test_idiom },
+    { "add/sub 0", add_zero },
+    { "lea a, [a + b] -> add", lea_add },
+    { "mov <reg>, <reg>", self_mov },
+    { "mov a, b; mov b, a", mov_back },
+    { "jmp to next BB", jmp_next },
+    { "jmp to a jmp", jmp_chain },
+};
+
+#define NUM_PEEPHOLES (sizeof(PEEPHOLES) / sizeof(PEEPHOLES[0]))
+
+// Per thread, since the parallel backend runs functions through separately
+static THREAD_LOCAL int HITS[NUM_PEEPHOLES];
+static THREAD_LOCAL int DEAD_BB_HITS;
+
+
+// ---- Functions -------------------------------------------------------------
+
+static int peephole_bb(BB *bb) {
+    int changed = 0;
+    AsmIns *ins = bb->asm_head;
+    while (ins) {
+        AsmIns *next = ins->next; // In case 'ins' is deleted
+        for (size_t i = 0; i < NUM_PEEPHOLES; i++) {
+            if (PEEPHOLES[i].apply(ins)) {
+                HITS[i]++;
+                changed = 1;
+                next = ins->prev ? ins->prev->next : bb->asm_head;
+                break;
+            }
+        }
+        ins = next;
+    }
+    return changed;
+}
+
+static int falls_through(BB *bb) {
+    AsmIns *last = bb->asm_last;
+    return !last || (last->op != X64_JMP && last->op != X64_RET &&
+                     last->op != X64_TAIL_CALL && last->op != X64_UD2);
+}
+
+// Deletes the code in BBs that nothing jumps to (directly, through a jump
+// table, or by its address) or falls through into (e.g., once every jump to a BB that only holds
+// a 'jmp' has been retargeted)
+static int remove_dead_bbs(Fn *fn) {
+    size_t num_bbs = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->n = num_bbs++;
+    }
+    int *jumped_to = calloc(num_bbs, sizeof(int));
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            if (ins->l && ins->l->k == OPR_BB) {
+                jumped_to[ins->l->bb->n] = 1;
+            }
+        }
+    }
+    for (size_t i = 0; i < vec_len(fn->jump_tables); i++) {
+        Vec *table = vec_get(fn->jump_tables, i);
+        for (size_t j = 0; j < vec_len(table); j++) {
+            jumped_to[((BB *) vec_get(table, j))->n] = 1;
+        }
+    }
+    int changed = 0;
+    int reachable = 1; // Whether control can reach the current BB
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        reachable = reachable || jumped_to[bb->n] || bb == fn->entry ||
+                    bb->addr_taken;
+        if (!reachable && bb->asm_head) {
+            bb->asm_head = bb->asm_last = NULL;
+            DEAD_BB_HITS++;
+            changed = 1;
+        }
+        reachable = reachable && falls_through(bb);
+    }
+    free(jumped_to);
+    return changed;
+}
+
+void peephole_fn(Fn *fn) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (BB *bb = fn->entry; bb; bb = bb->next) {
+            changed |= peephole_bb(bb);
+        }
+        changed |= remove_dead_bbs(fn);
+    }
+    if (fn->codegen) {
+        codegen_stats_end(fn);
+    }
+}
+
+void peephole(Vec *globals, int debug) {
+    for (size_t i = 0; i < NUM_PEEPHOLES; i++) {
+        HITS[i] = 0;
+    }
+    DEAD_BB_HITS = 0;
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k == G_FN_DEF) {
+            TARGET->peephole_fn(g->fn);
+        }
+    }
+    if (debug) {
+        printf("Peephole optimisations:\n");
+        for (size_t i = 0; i < NUM_PEEPHOLES; i++) {
+            printf("  %-22s %d\n", PEEPHOLES[i].name, HITS[i]);
+        }
+        printf("  %-22s %d\n", "unreachable BB", DEAD_BB_HITS);
+        printf("\n");
+    }
+}
@@ -0,0 +1,14 @@
+
+#ifndef COSEC_PEEPHOLE_H
+#define COSEC_PEEPHOLE_H
+
+#include "assemble.h"
+
+// Peephole optimisation. Rewrites short windows of instructions left over
+// after register allocation into cheaper equivalents (e.g., 'mov eax, 0' to
+// 'xor eax, eax'), and prints how often each pattern matched if 'debug' is
+// set. Runs after 'reg_alloc', on physical registers
+void peephole(Vec *globals, int debug);
+void peephole_fn(Fn *fn);
+
+#endif
@@ -1,10 +1,16 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
 
 #include "pp.h"
-#include "parse.h"
 #include "error.h"
+#include "pch.h"
+#include "stats.h"
 
 // Preprocessor macro expansion uses Dave Prosser's algorithm:
 //   https://www.spinellis.gr/blog/20060626/cpp.algo.pdf
@@ -13,31 +19,95 @@
 // An explanation around variadic function-like macros:
 //   https://gcc.gnu.org/onlinedocs/cpp/Variadic-Macros.html
 
-#define FIRST_KEYWORD TK_VOID
+#define MACRO_FILTER_SIZE (1 << 16) // Bits in 'pp->maybe_macro'; a power of 2
+
+enum { // Kinds of directive, by name in 'DIRECTIVES'
+    DIR_NONE,
+    DIR_DEFINE,
+    DIR_UNDEF,
+    DIR_INCLUDE,
+    DIR_IMPORT,
+    DIR_IF,
+    DIR_IFDEF,
+    DIR_IFNDEF,
+    DIR_ELIF,
+    DIR_ELSE,
+    DIR_ENDIF,
+    DIR_LINE,
+    DIR_WARNING,
+    DIR_ERROR,
+    DIR_PRAGMA,
+};
 
-static char *KEYWORDS[] = {
-    "void", "char", "short", "int", "long", "float", "double", "signed",
-    "unsigned", "struct", "union", "enum", "typedef", "auto", "static",
-    "extern", "register", "inline", "const", "restrict", "volatile", "sizeof",
-    "if", "else", "while", "do", "for", "switch", "case", "default", "break",
-    "continue", "goto", "return", NULL,
+static char *DIRECTIVE_NAMES[] = {
+    "define", "undef", "include", "import", "if", "ifdef", "ifndef", "elif",
+    "else", "endif", "line", "warning", "error", "pragma", NULL,
 };
 
+static Map *DIRECTIVES; // of directive kind; by interned name
+
 static Token *ZERO_TK = &(Token) { .k = TK_NUM, .num = "0" };
 static Token *ONE_TK  = &(Token) { .k = TK_NUM, .num = "1" };
 
 static void def_built_ins(PP *pp);
 static void def_default_include_paths(PP *pp);
 
+static pthread_once_t KEYWORDS_ONCE = PTHREAD_ONCE_INIT;
+
+static void def_keywords() {
+    // Tag each keyword's interned ident with its token, so classifying an
+    // ident is just the hash it already paid for when it was interned. The
+    // spellings come from the lexer's token names, so there's only one list
+    for (int k = FIRST_KEYWORD; k <= LAST_KEYWORD; k++) {
+        ATOM(intern(tk2str(k)))->tag = k;
+    }
+    // GNU spellings that mean the same thing
+    ATOM(intern("asm"))->tag = TK_ASM;
+    ATOM(intern("__asm"))->tag = TK_ASM;
+    ATOM(intern("__volatile__"))->tag = TK_VOLATILE;
+    ATOM(intern("__volatile"))->tag = TK_VOLATILE;
+    ATOM(intern("__thread"))->tag = TK_THREAD_LOCAL;
+}
+
+static pthread_once_t DIRECTIVES_ONCE = PTHREAD_ONCE_INIT;
+
+static void def_directives() {
+    DIRECTIVES = map_new();
+    for (size_t i = 0; DIRECTIVE_NAMES[i]; i++) {
+        map_put(DIRECTIVES, intern(DIRECTIVE_NAMES[i]), (void *) (DIR_DEFINE + i));
+    }
+}
+
+static int directive_kind(Token *t) {
+    if (t->k != TK_IDENT) {
+        return DIR_NONE;
+    }
+    return (int) (size_t) map_get(DIRECTIVES, t->ident);
+}
+
 PP * new_pp(Lexer *l) {
     PP *pp = malloc(sizeof(PP));
     pp->l = l;
     pp->macros = map_new();
+    pp->maybe_macro = bits_new(BITS_WORDS(MACRO_FILTER_SIZE));
     pp->conds = vec_new();
     pp->include_once = map_new();
+    pp->include_guards = map_new();
     pp->include_paths = vec_new();
+    pp->deps = NULL;
+    pp->subst = NULL;
+    pp->num_subst = pp->max_subst = 0;
+    pp->macro_stamps = map_new();
+    pp->macro_gen = 0;
+    pp->memo_refs = NULL;
+    pp->memo_failed = 0;
+    pp->ring = NULL;
+    pp->replay = NULL;
+    pp->eof = NULL;
     time_t now = time(NULL);
     localtime_r(&now, &pp->now);
+    pthread_once(&KEYWORDS_ONCE, def_keywords); // Shared by every file
+    pthread_once(&DIRECTIVES_ONCE, def_directives);
     def_built_ins(pp);
     def_default_include_paths(pp);
     return pp;
@@ -47,9 +117,39 @@ Macro * new_macro(int k) {
     Macro *m = malloc(sizeof(Macro));
     m->k = k;
     m->body = NULL;
+    m->expansion = m->refs = NULL;
+    m->memo_gen = 0;
+    m->no_memo = 0;
     return m;
 }
 
+// Most identifiers aren't macros, so a name is checked against a filter on
+// the defined macros' (cached) hashes before it's looked up; a clear bit
+// means it definitely isn't one. '#undef' leaves the bit set, since another
+// macro might share it, which only costs a wasted lookup
+static size_t macro_filter_bit(char *name) {
+    return ATOM(name)->hash & (MACRO_FILTER_SIZE - 1);
+}
+
+// Stamps 'name' with a new generation whenever it's defined or undefined,
+// which invalidates any memoised expansion that looked it up
+static void touch_macro(PP *pp, char *name) {
+    map_put(pp->macro_stamps, name, (void *) (uintptr_t) ++pp->macro_gen);
+}
+
+static void put_macro(PP *pp, char *name, Macro *m) {
+    bits_put(pp->maybe_macro, macro_filter_bit(name));
+    map_put(pp->macros, name, m);
+    touch_macro(pp, name);
+}
+
+static Macro * find_macro(PP *pp, char *name) {
+    if (!bits_has(pp->maybe_macro, macro_filter_bit(name))) {
+        return NULL;
+    }
+    return map_get(pp->macros, name);
+}
+
 
 // ---- Macro Definitions -----------------------------------------------------
 
@@ -98,7 +198,7 @@ static Map * parse_params(PP *pp, int *is_vararg) {
                 *is_vararg = 1;
             }
         } else if (t->k == TK_ELLIPSIS) { // Vararg
-            name = "__VA_ARGS__";
+            name = intern("__VA_ARGS__");
             t->k = TK_MACRO_PARAM;
             t->param_idx = num_params++;
             *is_vararg = 1;
@@ -154,13 +254,14 @@ static void parse_define(PP *pp) {
     } else {
         m = parse_obj_macro(pp);
     }
-    map_put(pp->macros, name->ident, m);
+    put_macro(pp, name->ident, m);
 }
 
 static void parse_undef(PP *pp) {
     Token *name = expect_raw_tk(pp->l, TK_IDENT);
     expect_raw_tk(pp->l, TK_NEWLINE);
     map_remove(pp->macros, name->ident);
+    touch_macro(pp, name->ident);
 }
 
 
@@ -200,57 +301,121 @@ static char * parse_include_path(PP *pp, int *search_cwd) {
     }
 }
 
-static int include(PP *pp, char *dir, char *file, int include_once) {
+// Include lookups are cached for the whole process (every file has the same
+// include paths), from the including directory (for '""'), or '<' (for '<>'),
+// plus the name as written, to the full path of the header found, or "" if
+// there isn't one
+static Map *INCLUDE_LOOKUPS;
+static pthread_mutex_t INCLUDE_LOOKUPS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static char * find_in(char *dir, char *file) {
     char *path = full_path(concat_paths(dir, file));
+    struct stat st;
+    return stat(path, &st) == 0 ? intern(path) : NULL;
+}
+
+THREAD_LOCAL Map *VIRTUAL_HEADERS = NULL;
+
+static char * find_include(PP *pp, char *file, int search_cwd) {
+    if (VIRTUAL_HEADERS && map_get(VIRTUAL_HEADERS, intern(file))) {
+        return intern(file); // Its name stands in for its path
+    }
+    if (file[0] == '/') { // Absolute path
+        return find_in("/", file);
+    }
+    char *local_dir = pp->l->f->name ? get_dir(pp->l->f->name) : ".";
+    Buf *b = buf_new();
+    buf_printf(b, "%s\n%s", search_cwd ? local_dir : "<", file);
+    char *key = intern_n(b->data, b->len);
+    pthread_mutex_lock(&INCLUDE_LOOKUPS_LOCK);
+    char *path = INCLUDE_LOOKUPS ? map_get(INCLUDE_LOOKUPS, key) : NULL;
+    pthread_mutex_unlock(&INCLUDE_LOOKUPS_LOCK);
+    if (path) {
+        return *path ? path : NULL;
+    }
+    if (search_cwd) {
+        path = find_in(local_dir, file);
+    }
+    for (size_t i = 0; !path && i < vec_len(pp->include_paths); i++) {
+        path = find_in(vec_get(pp->include_paths, i), file);
+    }
+    pthread_mutex_lock(&INCLUDE_LOOKUPS_LOCK);
+    if (!INCLUDE_LOOKUPS) {
+        INCLUDE_LOOKUPS = map_new();
+    }
+    map_put(INCLUDE_LOOKUPS, key, path ? path : "");
+    pthread_mutex_unlock(&INCLUDE_LOOKUPS_LOCK);
+    return path;
+}
+
+static void include(PP *pp, Token *t, char *path, char *file, int include_once) {
+    VirtualHeader *vh = VIRTUAL_HEADERS ? map_get(VIRTUAL_HEADERS, path) : NULL;
+    if (pp->deps && !vh) { // Even if it's skipped this time
+        vec_push(pp->deps, path);
+    }
     if (map_get(pp->include_once, path)) {
-        return 1; // Already included
+        return; // Already included
     }
-    FILE *fp = fopen(path, "r");
-    if (!fp) {
-        return 0;
+    char *guard = map_get(pp->include_guards, path);
+    if (guard && find_macro(pp, guard)) {
+        return; // Would be skipped entirely; don't even open it
+    }
+    if (vh) {
+        push_lexer(pp->l, new_file_from(vh->contents, vh->len, file));
+    } else if (!pch_include(pp->l, path, file, &guard)) {
+        error_at(t, "can't open file '%s'", file);
+    }
+    if (guard) {
+        map_put(pp->include_guards, path, guard);
     }
-    File *f = new_file(fp, file);
-    push_lexer(pp->l, f);
     if (include_once) {
         map_put(pp->include_once, path, (void *) 1);
     }
-    return 1;
 }
 
 static void parse_include(PP *pp, Token *t) {
-    int is_import = strcmp(t->ident, "import") == 0;
+    int is_import = directive_kind(t) == DIR_IMPORT;
     int search_cwd;
     char *file = parse_include_path(pp, &search_cwd);
     expect_raw_tk(pp->l, TK_NEWLINE);
-    if (file[0] == '/') { // Absolute path
-        if (include(pp, "/", file, is_import)) {
-            goto found;
-        }
-    } else { // Relative path
-        if (search_cwd) {
-            char *local_dir = pp->l->f->name ? get_dir(pp->l->f->name) : ".";
-            if (include(pp, local_dir, file, is_import)) {
-                goto found;
-            }
-        }
-        for (size_t i = 0; i < vec_len(pp->include_paths); i++) {
-            char *dir = vec_get(pp->include_paths, i);
-            if (include(pp, dir, file, is_import)) {
-                goto found;
-            }
+    char *path = find_include(pp, file, search_cwd);
+    if (!path) {
+        error_at(t, "can't find file '%s'", file);
+    }
+    include(pp, t, path, file, is_import);
+}
+
+void forget_include_lookups() {
+    pthread_mutex_lock(&INCLUDE_LOOKUPS_LOCK);
+    INCLUDE_LOOKUPS = NULL;
+    pthread_mutex_unlock(&INCLUDE_LOOKUPS_LOCK);
+}
+
+// The default include paths that exist, worked out once for every file
+static Vec *DEFAULT_INCLUDE_PATHS;
+static pthread_once_t DEFAULT_INCLUDE_PATHS_ONCE = PTHREAD_ONCE_INIT;
+
+static void find_default_include_paths() {
+    // [ $ cpp -v ] gives the list of GCC's default include paths
+    static char *paths[] = {
+        "/usr/local/include",
+        "/Library/Developer/CommandLineTools/usr/include",
+        "/Library/Developer/CommandLineTools/SDKs/MacOSX.sdk/usr/include",
+        "/Library/Developer/CommandLineTools/SDKs/MacOSX.sdk/System/Library/Frameworks",
+        NULL,
+    };
+    DEFAULT_INCLUDE_PATHS = vec_new();
+    for (size_t i = 0; paths[i]; i++) {
+        struct stat st;
+        if (stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            vec_push(DEFAULT_INCLUDE_PATHS, paths[i]);
         }
     }
-    error_at(t, "can't find file '%s'", file);
-found:
-    return;
 }
 
 static void def_default_include_paths(PP *pp) {
-    // [ $ cpp -v ] gives the list of GCC's default include paths
-    vec_push(pp->include_paths, "/usr/local/include");
-    vec_push(pp->include_paths, "/Library/Developer/CommandLineTools/usr/include");
-    vec_push(pp->include_paths, "/Library/Developer/CommandLineTools/SDKs/MacOSX.sdk/usr/include");
-    vec_push(pp->include_paths, "/Library/Developer/CommandLineTools/SDKs/MacOSX.sdk/System/Library/Frameworks");
+    pthread_once(&DEFAULT_INCLUDE_PATHS_ONCE, find_default_include_paths);
+    vec_push_all(pp->include_paths, DEFAULT_INCLUDE_PATHS);
 }
 
 
@@ -258,30 +423,32 @@ static void def_default_include_paths(PP *pp) {
 
 static void skip_cond_incl(PP *pp) {
     int level = 0;
-    Token *t = peek_raw_tk(pp->l);
-    while (t->k != TK_EOF) {
-        Token *hash = t = next_raw_tk(pp->l);
-        if (!(t->k == '#' && t->col == 1)) continue; // Not a directive
-        t = next_raw_tk(pp->l);
-        if (t->k != TK_IDENT) continue;
-        if (level == 0 && (strcmp(t->ident, "elif") == 0 ||
-                strcmp(t->ident, "else") == 0 ||
-                strcmp(t->ident, "endif") == 0)) {
+    while (1) {
+        skip_to_directive(pp->l); // Without lexing the lines in between
+        Token *hash = next_raw_tk(pp->l);
+        if (hash->k == TK_EOF) break;
+        if (!(hash->k == '#' && hash->col == 1)) continue; // Not a directive
+        Token *t = next_raw_tk(pp->l);
+        int d = directive_kind(t);
+        if (level == 0 && (d == DIR_ELIF || d == DIR_ELSE || d == DIR_ENDIF)) {
             undo_raw_tk(pp->l, t);
             undo_raw_tk(pp->l, hash);
             break;
         }
-        if (strcmp(t->ident, "if") == 0 ||
-                strcmp(t->ident, "ifdef") == 0 ||
-                strcmp(t->ident, "ifndef") == 0) {
+        if (d == DIR_IF || d == DIR_IFDEF || d == DIR_IFNDEF) {
             level++;
         }
-        if (strcmp(t->ident, "endif") == 0 && level > 0) {
+        if (d == DIR_ENDIF && level > 0) {
             level--;
         }
     }
 }
 
+// '__has_include' is treated as a macro, so code can check for it first
+static int is_defined(PP *pp, char *name) {
+    return find_macro(pp, name) || strcmp(name, "__has_include") == 0;
+}
+
 static Token * parse_defined(PP *pp) {
     Token *t = next_raw_tk(pp->l);
     if (t->k == '(') {
@@ -291,34 +458,247 @@ static Token * parse_defined(PP *pp) {
     if (t->k != TK_IDENT) {
         error_at(t, "expected identifier, found %s", token2pretty(t));
     }
-    return map_get(pp->macros, t->ident) ? ONE_TK : ZERO_TK;
+    return is_defined(pp, t->ident) ? ONE_TK : ZERO_TK;
 }
 
+static Token * parse_has_include(PP *pp) {
+    expect_raw_tk(pp->l, '(');
+    int search_cwd;
+    char *file = parse_include_path(pp, &search_cwd);
+    expect_raw_tk(pp->l, ')');
+    return find_include(pp, file, search_cwd) ? ONE_TK : ZERO_TK;
+}
+
+// Ends with the newline
 static Vec * parse_cond_line(PP *pp) {
     Vec *tks = vec_new();
     Token *t = expand_next(pp);
     while (t->k != TK_NEWLINE) {
         if (t->k == TK_IDENT && strcmp(t->ident, "defined") == 0) {
             t = parse_defined(pp);
+        } else if (t->k == TK_IDENT && strcmp(t->ident, "__has_include") == 0) {
+            t = parse_has_include(pp);
         } else if (t->k == TK_IDENT) {
             t = ZERO_TK; // All other idents get replaced with '0'
         }
         vec_push(tks, t);
         t = expand_next(pp);
     }
+    vec_push(tks, t);
     return tks;
 }
 
+// The condition is evaluated straight off its tokens, rather than through the
+// parser's expression AST. Everything is an 'intmax_t', or a 'uintmax_t' if
+// any operand is unsigned, as the standard says
+typedef struct {
+    Vec *tks;
+    size_t next;
+    int skip; // In an operand that isn't evaluated (e.g., after '0 &&')
+} CondExpr;
+
+typedef struct {
+    uint64_t v;
+    int is_unsigned;
+} CondVal;
+
+enum {
+    CPREC_MIN,
+    CPREC_COMMA,
+    CPREC_TERNARY,
+    CPREC_LOG_OR,
+    CPREC_LOG_AND,
+    CPREC_BIT_OR,
+    CPREC_BIT_XOR,
+    CPREC_BIT_AND,
+    CPREC_EQ,
+    CPREC_REL,
+    CPREC_SHIFT,
+    CPREC_ADD,
+    CPREC_MUL,
+};
+
+static int COND_PREC[TK_LAST] = {
+    [','] = CPREC_COMMA, ['?'] = CPREC_TERNARY,
+    [TK_LOG_OR] = CPREC_LOG_OR, [TK_LOG_AND] = CPREC_LOG_AND,
+    ['|'] = CPREC_BIT_OR, ['^'] = CPREC_BIT_XOR, ['&'] = CPREC_BIT_AND,
+    [TK_EQ] = CPREC_EQ, [TK_NEQ] = CPREC_EQ,
+    ['<'] = CPREC_REL, [TK_LE] = CPREC_REL, ['>'] = CPREC_REL, [TK_GE] = CPREC_REL,
+    [TK_SHL] = CPREC_SHIFT, [TK_SHR] = CPREC_SHIFT,
+    ['+'] = CPREC_ADD, ['-'] = CPREC_ADD,
+    ['*'] = CPREC_MUL, ['/'] = CPREC_MUL, ['%'] = CPREC_MUL,
+};
+
+static Token * cond_peek(CondExpr *c) {
+    return vec_get(c->tks, c->next);
+}
+
+static Token * cond_next(CondExpr *c) {
+    Token *t = cond_peek(c);
+    if (t->k != TK_NEWLINE) {
+        c->next++;
+    }
+    return t;
+}
+
+static void cond_expect(CondExpr *c, int k) {
+    Token *t = cond_next(c);
+    if (t->k != k) {
+        error_at(t, "expected %s, found %s", tk2pretty(k), token2pretty(t));
+    }
+}
+
+static int digit_val(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20; // Lower case
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return 16; // Not a digit in any base
+}
+
+// Any size suffix is irrelevant, since every integer is 64 bits here
+static CondVal cond_num(Token *t) {
+    char *p = t->num;
+    int base = 10;
+    if (p[0] == '0' && (p[1] | 0x20) == 'x') {
+        base = 16;
+        p += 2;
+    } else if (p[0] == '0' && (p[1] | 0x20) == 'b') {
+        base = 2;
+        p += 2;
+    } else if (p[0] == '0') {
+        base = 8;
+    }
+    if (digit_val(*p) >= base) {
+        p = t->num + 1; // No digits after the prefix; it's a bad suffix on '0'
+    }
+    CondVal r = { 0, 0 };
+    for (int d; (d = digit_val(*p)) < base; p++) {
+        if (r.v > (UINT64_MAX - (uint64_t) d) / (uint64_t) base) {
+            r.v = UINT64_MAX; // Saturate, like 'strtoull'
+        } else {
+            r.v = r.v * (uint64_t) base + (uint64_t) d;
+        }
+    }
+    for (; (*p | 0x20) == 'u' || (*p | 0x20) == 'l'; p++) {
+        r.is_unsigned |= (*p | 0x20) == 'u';
+    }
+    if (*p == '.' || (*p | 0x20) == 'e' || (*p | 0x20) == 'p' || (*p | 0x20) == 'f') {
+        error_at(t, "floating point constant in preprocessor expression");
+    } else if (*p != '\0') {
+        error_at(t, "invalid integer suffix '%s'", p);
+    }
+    r.is_unsigned |= r.v > INT64_MAX; // Too big for 'intmax_t'
+    return r;
+}
+
+static CondVal cond_subexpr(CondExpr *c, int min_prec);
+
+static CondVal cond_unop(CondExpr *c) {
+    Token *t = cond_next(c);
+    CondVal r;
+    switch (t->k) {
+    case TK_NUM: return cond_num(t);
+    case TK_CH: return (CondVal) { (uint64_t) (int64_t) t->ch, 0 };
+    case '(':
+        r = cond_subexpr(c, CPREC_MIN);
+        cond_expect(c, ')');
+        return r;
+    case '+': return cond_unop(c);
+    case '-': r = cond_unop(c); r.v = -r.v; return r;
+    case '~': r = cond_unop(c); r.v = ~r.v; return r;
+    case '!': r = cond_unop(c); return (CondVal) { r.v == 0, 0 };
+    default: error_at(t, "expected expression, found %s", token2pretty(t));
+    }
+}
+
+static CondVal cond_ternary(CondExpr *c, CondVal cond) {
+    int skip = c->skip;
+    c->skip = skip || !cond.v;
+    CondVal l = cond_subexpr(c, CPREC_MIN);
+    cond_expect(c, ':');
+    c->skip = skip || cond.v;
+    CondVal r = cond_subexpr(c, CPREC_TERNARY - 1); // Right associative
+    c->skip = skip;
+    CondVal result = cond.v ? l : r;
+    result.is_unsigned = l.is_unsigned || r.is_unsigned;
+    return result;
+}
+
+static CondVal cond_binop(CondExpr *c, Token *op, CondVal l) {
+    if (op->k == '?') {
+        return cond_ternary(c, l);
+    }
+    int skip = c->skip;
+    if (op->k == TK_LOG_AND || op->k == TK_LOG_OR) { // Short circuits
+        c->skip = skip || (op->k == TK_LOG_AND ? !l.v : l.v);
+    }
+    CondVal r = cond_subexpr(c, COND_PREC[op->k]);
+    c->skip = skip;
+    int is_unsigned = l.is_unsigned || r.is_unsigned;
+    int64_t sl = (int64_t) l.v, sr = (int64_t) r.v;
+    switch (op->k) {
+    case ',':  return r;
+    case TK_LOG_OR:  return (CondVal) { l.v || r.v, 0 };
+    case TK_LOG_AND: return (CondVal) { l.v && r.v, 0 };
+    case '|': return (CondVal) { l.v | r.v, is_unsigned };
+    case '^': return (CondVal) { l.v ^ r.v, is_unsigned };
+    case '&': return (CondVal) { l.v & r.v, is_unsigned };
+    case TK_EQ:  return (CondVal) { l.v == r.v, 0 };
+    case TK_NEQ: return (CondVal) { l.v != r.v, 0 };
+    case '<':   return (CondVal) { is_unsigned ? l.v < r.v : sl < sr, 0 };
+    case TK_LE: return (CondVal) { is_unsigned ? l.v <= r.v : sl <= sr, 0 };
+    case '>':   return (CondVal) { is_unsigned ? l.v > r.v : sl > sr, 0 };
+    case TK_GE: return (CondVal) { is_unsigned ? l.v >= r.v : sl >= sr, 0 };
+    case TK_SHL: case TK_SHR: // The type of the left operand
+        if (r.v >= 64) {
+            return (CondVal) { op->k == TK_SHR && !l.is_unsigned && sl < 0 ? -1 : 0,
+                               l.is_unsigned };
+        } else if (op->k == TK_SHL) {
+            return (CondVal) { l.v << r.v, l.is_unsigned };
+        } else {
+            return (CondVal) { l.is_unsigned ? l.v >> r.v : (uint64_t) (sl >> r.v),
+                               l.is_unsigned };
+        }
+    case '+': return (CondVal) { l.v + r.v, is_unsigned };
+    case '-': return (CondVal) { l.v - r.v, is_unsigned };
+    case '*': return (CondVal) { l.v * r.v, is_unsigned };
+    case '/': case '%':
+        if (r.v == 0) {
+            if (!c->skip) {
+                error_at(op, "division by zero in preprocessor expression");
+            }
+            return (CondVal) { 0, is_unsigned };
+        }
+        if (is_unsigned) {
+            return (CondVal) { op->k == '/' ? l.v / r.v : l.v % r.v, 1 };
+        } else if (sl == INT64_MIN && sr == -1) { // Overflows
+            return (CondVal) { op->k == '/' ? l.v : 0, 0 };
+        } else {
+            return (CondVal) { (uint64_t) (op->k == '/' ? sl / sr : sl % sr), 0 };
+        }
+    default: UNREACHABLE();
+    }
+    return l;
+}
+
+static CondVal cond_subexpr(CondExpr *c, int min_prec) {
+    CondVal l = cond_unop(c);
+    while (COND_PREC[cond_peek(c)->k] > min_prec) {
+        Token *op = cond_next(c);
+        l = cond_binop(c, op, l);
+    }
+    return l;
+}
+
 static int parse_cond(PP *pp) {
-    // Create a temporary lexer for the constant condition; don't use
-    // 'push_lexer' because we want the 'TK_EOF' when we're done
-    Vec *tks = parse_cond_line(pp);
-    Lexer *prev = pp->l;
-    pp->l = new_lexer(NULL);
-    undo_raw_tks(pp->l, tks);
-    int64_t v = parse_const_int_expr(pp);
-    pp->l = prev;
-    return v != 0;
+    CondExpr c = { .tks = parse_cond_line(pp), .next = 0, .skip = 0 };
+    CondVal v = cond_subexpr(&c, CPREC_MIN);
+    Token *end = cond_next(&c);
+    if (end->k != TK_NEWLINE) {
+        error_at(end, "expected newline, found %s", token2pretty(end));
+    }
+    vec_free(c.tks);
+    return v.v != 0;
 }
 
 static void start_if(PP *pp, int is_true) {
@@ -339,14 +719,14 @@ static void parse_if(PP *pp) {
 static void parse_ifdef(PP *pp) {
     Token *t = expect_raw_tk(pp->l, TK_IDENT);
     expect_raw_tk(pp->l, TK_NEWLINE);
-    int is_true = map_get(pp->macros, t->ident) != NULL;
+    int is_true = is_defined(pp, t->ident);
     start_if(pp, is_true);
 }
 
 static void parse_ifndef(PP *pp) {
     Token *t = expect_raw_tk(pp->l, TK_IDENT);
     expect_raw_tk(pp->l, TK_NEWLINE);
-    int is_true = map_get(pp->macros, t->ident) == NULL;
+    int is_true = !is_defined(pp, t->ident);
     start_if(pp, is_true);
 }
 
@@ -425,15 +805,61 @@ static void parse_error(PP *pp, Token *t) {
 }
 
 static void parse_pragma_once(PP *pp) {
-    char *path = full_path(pp->l->f->name);
+    char *path = intern(full_path(pp->l->f->name));
     map_put(pp->include_once, path, (void *) 1);
     expect_raw_tk(pp->l, TK_NEWLINE);
 }
 
+// '#pragma unroll', '#pragma unroll N' (or '(N)'), '#pragma nounroll', and
+// GCC's '#pragma GCC unroll N' (where 0 means not to) all become a single
+// TK_PRAGMA_UNROLL for the parser, in front of the loop
+static void parse_pragma_unroll(PP *pp, Token *t, int needs_factor) {
+    Token *unroll = copy_tk(t);
+    unroll->k = TK_PRAGMA_UNROLL;
+    unroll->unroll = UNROLL_FULL;
+    Token *factor = next_raw_tk(pp->l);
+    int parens = !needs_factor && factor->k == '(';
+    if (parens) {
+        factor = next_raw_tk(pp->l);
+    }
+    if (factor->k == TK_NUM) {
+        char *end;
+        unsigned long n = strtoul(factor->num, &end, 0);
+        if (*end != '\0' || n > INT_MAX) {
+            error_at(factor, "invalid unroll factor '%s'", factor->num);
+        }
+        unroll->unroll = n > 0 ? (int) n : 1;
+        factor = next_raw_tk(pp->l);
+    } else if (needs_factor || parens) {
+        error_at(factor, "expected unroll factor, found %s", token2pretty(factor));
+    }
+    if (parens) {
+        if (factor->k != ')') {
+            error_at(factor, "expected ')', found %s", token2pretty(factor));
+        }
+        factor = next_raw_tk(pp->l);
+    }
+    if (factor->k != TK_NEWLINE) {
+        error_at(factor, "unexpected %s after '#pragma unroll'", token2pretty(factor));
+    }
+    undo_raw_tk(pp->l, unroll);
+}
+
 static void parse_pragma(PP *pp) {
     Token *t = expect_raw_tk(pp->l, TK_IDENT);
     if (strcmp(t->ident, "once") == 0) {
         parse_pragma_once(pp);
+    } else if (strcmp(t->ident, "unroll") == 0) {
+        parse_pragma_unroll(pp, t, 0);
+    } else if (strcmp(t->ident, "nounroll") == 0) {
+        expect_raw_tk(pp->l, TK_NEWLINE);
+        Token *unroll = copy_tk(t);
+        unroll->k = TK_PRAGMA_UNROLL;
+        unroll->unroll = 1;
+        undo_raw_tk(pp->l, unroll);
+    } else if (strcmp(t->ident, "GCC") == 0 && peek_raw_tk(pp->l)->k == TK_IDENT &&
+               strcmp(peek_raw_tk(pp->l)->ident, "unroll") == 0) {
+        parse_pragma_unroll(pp, next_raw_tk(pp->l), 1);
     } else {
         error_at(t, "unsupported pragma directive '%s'", token2str(t));
     }
@@ -459,9 +885,10 @@ static void macro_time(PP *pp, Token *t) {
 }
 
 static void macro_file(PP *pp, Token *t) {
+    (void) pp; // Unused
     t->k = TK_STR;
-    t->len = strlen(pp->l->f->name);
-    t->str = str_ncopy(pp->l->f->name, t->len);
+    t->len = strlen(t->f->name); // 'pp->l' has no file during pre-expansion
+    t->str = str_ncopy(t->f->name, t->len);
 }
 
 static void macro_line(PP *pp, Token *t) {
@@ -478,16 +905,39 @@ static void macro_one(PP *pp, Token *t) {
     t->num = "1";
 }
 
+static void macro_sizeof_int128(PP *pp, Token *t) {
+    (void) pp; // Unused
+    t->k = TK_NUM;
+    t->num = "16";
+}
+
 static void macro_stdc_version(PP *pp, Token *t) {
     (void) pp; // Unused
     t->k = TK_NUM;
     t->num = "199901L"; // C99 standard
 }
 
+// GCC's memory orders for the '__atomic' builtins
+static char *ATOMIC_ORDERS[] = {
+    "__ATOMIC_RELAXED", "__ATOMIC_CONSUME", "__ATOMIC_ACQUIRE",
+    "__ATOMIC_RELEASE", "__ATOMIC_ACQ_REL", "__ATOMIC_SEQ_CST", NULL,
+};
+
+static void macro_atomic_order(PP *pp, Token *t) {
+    (void) pp; // Unused
+    static char *nums[] = { "0", "1", "2", "3", "4", "5", };
+    int order = 0;
+    while (strcmp(ATOMIC_ORDERS[order], t->ident) != 0) {
+        order++;
+    }
+    t->k = TK_NUM;
+    t->num = nums[order];
+}
+
 static void def_built_in(PP *pp, char *name, BuiltIn fn) {
     Macro *m = new_macro(MACRO_BUILT_IN);
     m->built_in = fn;
-    map_put(pp->macros, name, m);
+    put_macro(pp, intern(name), m);
 }
 
 static void def_built_ins(PP *pp) {
@@ -498,6 +948,10 @@ static void def_built_ins(PP *pp) {
     def_built_in(pp, "__STDC__", macro_one);
     def_built_in(pp, "__STDC_VERSION__", macro_stdc_version);
     def_built_in(pp, "__STDC_HOSTED__", macro_one);
+    def_built_in(pp, "__SIZEOF_INT128__", macro_sizeof_int128);
+    for (size_t i = 0; ATOMIC_ORDERS[i]; i++) {
+        def_built_in(pp, ATOMIC_ORDERS[i], macro_atomic_order);
+    }
 }
 
 
@@ -506,21 +960,6 @@ static void def_built_ins(PP *pp) {
 static void parse_directive(PP *pp);
 static Token * expand_next_ignore_newlines(PP *pp);
 
-static void copy_pos_info_to_tks(Vec *tks, Token *from) {
-    // Copy file, line, column info from [from] to every token in [tks] for
-    // error messages from expanded macros; set [has_preceding_space] for the
-    // first token in [tks]
-    for (size_t i = 0; i < vec_len(tks); i++) {
-        Token *to = vec_get(tks, i);
-        to->f = from->f;
-        to->line = from->line;
-        to->col = from->col;
-        if (i == 0) {
-            to->has_preceding_space = from->has_preceding_space;
-        }
-    }
-}
-
 static Token * stringize(Vec *tks, Token *hash) {
     Buf *b = buf_new();
     for (size_t i = 0; i < vec_len(tks); i++) {
@@ -537,18 +976,14 @@ static Token * stringize(Vec *tks, Token *hash) {
     return str;
 }
 
-static void glue(PP *pp, Vec *tks, Token *t) {
-    Token *last = vec_pop(tks);
-    Token *glued = glue_tks(pp->l, last, t);
-    vec_push(tks, glued);
-}
-
 static Vec * pre_expand_arg(PP *pp, Vec *arg) {
     // Create a temporary lexer for the arg; don't use 'push_lexer' because we
     // want the 'TK_EOF' when we're finished pre-expansion
     Lexer *prev = pp->l;
     pp->l = new_lexer(NULL);
-    undo_raw_tks(pp->l, arg);
+    undo_raw_span(pp->l, &(Span) {
+        .tks = (Token **) arg->data, .num = vec_len(arg), .first_space = -1,
+    });
     Vec *expanded = vec_new();
     while (1) {
         Token *t = expand_next_ignore_newlines(pp);
@@ -557,66 +992,155 @@ static Vec * pre_expand_arg(PP *pp, Vec *arg) {
         }
         vec_push(expanded, t);
     }
+    free_lexer(pp->l);
     pp->l = prev;
     return expanded;
 }
 
-static Vec * substitute(PP *pp, Macro *m, Vec *args, Set *hide_set) {
-    Vec *tks = vec_new();
-    for (size_t i = 0; i < vec_len(m->body); i++) {
-        Token *t = copy_tk(vec_get(m->body, i));
-        Token *u = i < vec_len(m->body) - 1 ? vec_get(m->body, i + 1) : NULL;
-        if (t->k == '#' && u && u->k == TK_MACRO_PARAM) {
+// A macro's expansion is built up in 'pp->subst' (above 'base') as spans over
+// its body and arguments, which are pushed onto the lexer without copying any
+// tokens. Only '#' and '##' create new tokens
+
+static void push_subst(PP *pp, Token **tks, size_t num, int copy) {
+    if (num == 0) {
+        return;
+    }
+    if (pp->num_subst == pp->max_subst) {
+        pp->max_subst = pp->max_subst ? pp->max_subst * 2 : 16;
+        pp->subst = realloc(pp->subst, sizeof(Span) * pp->max_subst);
+    }
+    pp->subst[pp->num_subst++] = (Span) {
+        .tks = tks, .num = num, .copy = copy, .first_space = -1,
+    };
+}
+
+static void push_subst_body_tk(PP *pp, size_t base, Token **t) {
+    Span *last = pp->num_subst > base ? &pp->subst[pp->num_subst - 1] : NULL;
+    if (last && last->copy && last->tks + last->num == t) {
+        last->num++; // Extend the run of body tokens
+    } else {
+        push_subst(pp, t, 1, 1);
+    }
+}
+
+static void push_subst_new_tk(PP *pp, Token *t) {
+    Token **slot = arena_alloc(ARENA_TOKENS, sizeof(Token *));
+    *slot = t;
+    push_subst(pp, slot, 1, 0);
+}
+
+static Token * last_subst_tk(PP *pp, size_t base) {
+    if (pp->num_subst == base) {
+        return NULL;
+    }
+    Span *last = &pp->subst[pp->num_subst - 1];
+    return last->tks[last->num - 1];
+}
+
+static Token * pop_subst_tk(PP *pp, size_t base) {
+    Token *t = last_subst_tk(pp, base);
+    if (t && --pp->subst[pp->num_subst - 1].num == 0) {
+        pp->num_subst--; // Never leave an empty span
+    }
+    return t;
+}
+
+static void glue(PP *pp, size_t base, Token *t) {
+    Token *last = pop_subst_tk(pp, base);
+    push_subst_new_tk(pp, glue_tks(last, t));
+}
+
+static int needs_pre_expansion(PP *pp, Vec *arg) {
+    for (size_t i = 0; i < vec_len(arg); i++) {
+        Token *t = vec_get(arg, i);
+        if (t->k == TK_IDENT && find_macro(pp, t->ident)) {
+            return 1;
+        }
+    }
+    return 0; // Pre-expansion would give back the same tokens
+}
+
+static Vec * expanded_arg(PP *pp, Vec *args, Vec **expanded, size_t idx) {
+    if (!expanded[idx]) { // Pre-expand each arg at most once
+        Vec *arg = vec_get(args, idx);
+        expanded[idx] = needs_pre_expansion(pp, arg) ? pre_expand_arg(pp, arg) : arg;
+    }
+    return expanded[idx];
+}
+
+static void substitute(PP *pp, Macro *m, Vec *args, Token *t) {
+    size_t base = pp->num_subst;
+    Set *hide_set = t->hide_set;
+    Vec **expanded = args ? calloc(vec_len(args), sizeof(Vec *)) : NULL;
+    Token **body = (Token **) m->body->data;
+    size_t len = vec_len(m->body);
+    for (size_t i = 0; i < len; i++) {
+        Token *b = body[i];
+        Token *u = i < len - 1 ? body[i + 1] : NULL;
+        if (b->k == '#' && u && u->k == TK_MACRO_PARAM) {
             Vec *arg = vec_get(args, u->param_idx);
-            Token *str = stringize(arg, t);
-            vec_push(tks, str);
+            push_subst_new_tk(pp, stringize(arg, b));
             i++; // Skip 'u'
-        } else if (t->k == TK_CONCAT && u && u->k == TK_MACRO_PARAM) {
+        } else if (b->k == TK_CONCAT && u && u->k == TK_MACRO_PARAM) {
             // <anything> ## <macro param>
             Vec *arg = vec_get(args, u->param_idx);
+            Token **arg_tks = (Token **) arg->data;
             // ',' ## __VA_ARGS__ is expanded to empty token sequence if
             // __VA_ARGS__ is empty, or to ',' [tokens in __VA_ARGS__] otherwise
+            Token *last = last_subst_tk(pp, base);
             if (m->is_vararg && u->param_idx == m->num_params - 1 && // Is vararg?
-                    vec_len(tks) > 0 && ((Token *) vec_tail(tks))->k == ',') {
+                    last && last->k == ',') {
                 if (vec_len(arg) > 0) {
-                    vec_push_all(tks, arg); // ',' [tokens in __VA_ARGS__]
+                    push_subst(pp, arg_tks, vec_len(arg), 0); // ',' [tokens in __VA_ARGS__]
                 } else {
-                    vec_pop(tks); // Remove ','
+                    pop_subst_tk(pp, base); // Remove ','
                 }
             } else if (vec_len(arg) > 0) {
-                Token *first = vec_remove(arg, 0);
-                glue(pp, tks, first);
-                vec_push_all(tks, arg); // Don't pre-expand
+                glue(pp, base, arg_tks[0]);
+                push_subst(pp, arg_tks + 1, vec_len(arg) - 1, 0); // Don't pre-expand
             }
             i++; // Skip 'u'
-        } else if (t->k == TK_CONCAT && u) {
+        } else if (b->k == TK_CONCAT && u) {
             // <anything> ## <token>
             hide_set = u->hide_set;
-            glue(pp, tks, u);
+            glue(pp, base, u);
             i++; // Skip 'u'
-        } else if (t->k == TK_MACRO_PARAM && u && u->k == TK_CONCAT) {
+        } else if (b->k == TK_MACRO_PARAM && u && u->k == TK_CONCAT) {
             // <macro param> ## <anything>
             hide_set = u->hide_set;
-            Vec *arg = vec_get(args, t->param_idx);
+            Vec *arg = vec_get(args, b->param_idx);
             if (vec_len(arg) == 0) {
                 i++; // Skip '##' if nothing to glue to
             } else {
-                vec_push_all(tks, arg); // Don't pre-expand
+                push_subst(pp, (Token **) arg->data, vec_len(arg), 0); // Don't pre-expand
+            }
+        } else if (b->k == TK_MACRO_PARAM) {
+            Vec *arg = expanded_arg(pp, args, expanded, b->param_idx);
+            size_t num_subst = pp->num_subst;
+            push_subst(pp, (Token **) arg->data, vec_len(arg), 0);
+            if (pp->num_subst > num_subst) { // Leading token's preceding space
+                pp->subst[num_subst].first_space = b->has_preceding_space;
             }
-        } else if (t->k == TK_MACRO_PARAM) {
-            Vec *arg = vec_get(args, t->param_idx);
-            arg = pre_expand_arg(pp, arg);
-            copy_pos_info_to_tks(arg, t); // For leading token's preceding space
-            vec_push_all(tks, arg);
         } else {
-            vec_push(tks, t);
+            push_subst_body_tk(pp, base, &body[i]);
         }
     }
-    for (size_t i = 0; i < vec_len(tks); i++) { // Add 'hide_set' to all the tks
-        Token *t = vec_get(tks, i);
-        set_union(&t->hide_set, hide_set);
+    free(expanded);
+
+    // Every token gets the hide set, and the position of the macro invocation
+    // for error messages. Push the spans in reverse, since the lexer's a stack
+    for (size_t i = base; i < pp->num_subst; i++) {
+        Span *s = &pp->subst[i];
+        s->hide_set = hide_set;
+        s->pos = t;
+        if (i == base) {
+            s->first_space = t->has_preceding_space;
+        }
     }
-    return tks;
+    for (size_t i = pp->num_subst; i > base; i--) {
+        undo_raw_span(pp->l, &pp->subst[i - 1]);
+    }
+    pp->num_subst = base;
 }
 
 static Vec * parse_args(PP *pp, Macro *m) {
@@ -635,6 +1159,10 @@ static Vec * parse_args(PP *pp, Macro *m) {
             if (t->k == TK_NEWLINE) continue;
             if (t->k == TK_EOF) break;
             if (t->k == '#' && t->col == 1) {
+                if (pp->memo_refs) { // Not from the file
+                    pp->memo_failed = 1;
+                    continue;
+                }
                 parse_directive(pp);
                 continue;
             }
@@ -660,39 +1188,114 @@ static Vec * parse_args(PP *pp, Macro *m) {
     return args;
 }
 
-static Token * expand_next(PP *pp) {
-    Token *t = next_raw_tk(pp->l);
+// An object-like macro named outside of any other expansion (so with an
+// empty hide set) expands to the same tokens every time, as long as none of
+// the names looked up along the way has been defined or undefined since (see
+// 'touch_macro'). So its full expansion is worked out once, into a Vec of
+// tokens, which later uses push back onto the lexer as a span, copied lazily
+// like a macro body. The tokens are still rescanned, since a function-like
+// macro's name at the end may be followed by its arguments.
+//
+// Expansions that depend on anything else aren't memoised: built-in macros
+// (like '__LINE__'), and function-like macros whose arguments run past the
+// end of the expansion
+
+static int is_memo_valid(PP *pp, Macro *m) {
+    if (!m->expansion) {
+        return 0;
+    }
+    for (size_t i = 0; i < vec_len(m->refs); i++) {
+        uintptr_t stamp = (uintptr_t) map_get(pp->macro_stamps, vec_get(m->refs, i));
+        if (stamp > m->memo_gen) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void memoise(PP *pp, Macro *m, Token *t) {
+    Lexer *prev = pp->l;
+    pp->l = new_lexer(NULL); // For the 'TK_EOF' at the end, as for arguments
+    pp->memo_refs = vec_new();
+    pp->memo_failed = 0;
+    t->hide_set = set_put(t->hide_set, t->ident);
+    substitute(pp, m, NULL, t);
+    Vec *expansion = vec_new();
+    while (1) {
+        Token *u = expand_next_ignore_newlines(pp);
+        if (u->k == TK_EOF) {
+            break;
+        }
+        vec_push(expansion, u);
+    }
+    free_lexer(pp->l);
+    pp->l = prev;
+    if (pp->memo_failed) {
+        m->no_memo = 1;
+        m->expansion = NULL;
+    } else {
+        m->expansion = expansion;
+        m->refs = pp->memo_refs;
+        m->memo_gen = pp->macro_gen;
+    }
+    pp->memo_refs = NULL;
+}
+
+static int expand_memo(PP *pp, Macro *m, Token *t) {
+    if (m->no_memo || t->hide_set || pp->memo_refs) {
+        return 0; // Not memoisable, or already memoising another macro
+    }
+    if (!is_memo_valid(pp, m)) {
+        memoise(pp, m, t);
+        if (!m->expansion) {
+            return 0;
+        }
+    }
+    undo_raw_span(pp->l, &(Span) {
+        .tks = (Token **) m->expansion->data, .num = vec_len(m->expansion),
+        .copy = 1, .pos = t, .first_space = t->has_preceding_space,
+    });
+    return 1;
+}
+
+static Token * expand_tk(PP *pp, Token *t) {
     if (t->k != TK_IDENT) {
         return t;
     }
-    Macro *m = map_get(pp->macros, t->ident);
+    if (pp->memo_refs) {
+        vec_push(pp->memo_refs, t->ident);
+    }
+    Macro *m = find_macro(pp, t->ident);
     if (!m || set_has(t->hide_set, t->ident)) {
         return t; // No macro, or macro self-reference
     }
-    Vec *tks;
     switch (m->k) {
     case MACRO_OBJ:
-        set_put(&t->hide_set, t->ident);
-        tks = substitute(pp, m, NULL, t->hide_set);
-        copy_pos_info_to_tks(tks, t); // For error messages
-        undo_raw_tks(pp->l, tks);
+        if (expand_memo(pp, m, t)) {
+            break;
+        }
+        t->hide_set = set_put(t->hide_set, t->ident);
+        substitute(pp, m, NULL, t);
         break;
     case MACRO_FN:
         if (peek_raw_tk(pp->l)->k != '(') return t;
         Vec *args = parse_args(pp, m);
+        if (pp->memo_refs && peek_raw_tk(pp->l)->k != ')') {
+            pp->memo_failed = 1; // The arguments run off the end
+            return t;
+        }
         if (vec_len(args) != m->num_params) {
             error_at(t, "incorrect number of arguments provided to function-"
                         "like macro invocation (have %zu, expected %zu)",
                         vec_len(args), m->num_params);
         }
         Token *rparen = expect_raw_tk(pp->l, ')');
-        set_intersection(&t->hide_set, rparen->hide_set);
-        set_put(&t->hide_set, t->ident);
-        tks = substitute(pp, m, args, t->hide_set);
-        copy_pos_info_to_tks(tks, t); // For error messages
-        undo_raw_tks(pp->l, tks);
+        t->hide_set = set_intersection(t->hide_set, rparen->hide_set);
+        t->hide_set = set_put(t->hide_set, t->ident);
+        substitute(pp, m, args, t);
         break;
     case MACRO_BUILT_IN:
+        pp->memo_failed = 1; // Only matters while memoising
         t = copy_tk(t);
         m->built_in(pp, t);
         undo_raw_tk(pp->l, t);
@@ -701,56 +1304,78 @@ static Token * expand_next(PP *pp) {
     return expand_next_ignore_newlines(pp);
 }
 
-static Token * expand_next_ignore_newlines(PP *pp) {
-    Token *t = expand_next(pp);
+static Token * expand_next(PP *pp) {
+    return expand_tk(pp, next_raw_tk(pp->l));
+}
+
+static Token * expand_tk_ignore_newlines(PP *pp, Token *t) {
+    t = expand_tk(pp, t);
     while (t->k == TK_NEWLINE) { // Ignore newlines
         t = next_raw_tk(pp->l);
-        t->has_preceding_space = 1;
+        if (!is_shared_tk(t)) {
+            t->has_preceding_space = 1;
+        }
     }
     return t;
 }
 
+static Token * expand_next_ignore_newlines(PP *pp) {
+    return expand_tk_ignore_newlines(pp, next_raw_tk(pp->l));
+}
+
+// Tokens that go straight through to the parser, which is most of them
+static int is_plain_tk(PP *pp, Token *t) {
+    return t->k != TK_NEWLINE && t->k != '#' &&
+           (t->k != TK_IDENT || !bits_has(pp->maybe_macro, macro_filter_bit(t->ident)));
+}
+
 
 // ---- Tokens and Directives -------------------------------------------------
 
 static void parse_directive(PP *pp) {
     Token *t = next_raw_tk(pp->l);
     if (t->k == TK_NEWLINE) return; // Empty directive
-    if (t->k != TK_IDENT) goto err;
-    if (strcmp(t->ident, "define") == 0)         parse_define(pp);
-    else if (strcmp(t->ident, "undef") == 0)     parse_undef(pp);
-    else if (strcmp(t->ident, "include") == 0 ||
-             strcmp(t->ident, "import") == 0)    parse_include(pp, t);
-    else if (strcmp(t->ident, "if") == 0)        parse_if(pp);
-    else if (strcmp(t->ident, "ifdef") == 0)     parse_ifdef(pp);
-    else if (strcmp(t->ident, "ifndef") == 0)    parse_ifndef(pp);
-    else if (strcmp(t->ident, "elif") == 0)      parse_elif(pp, t);
-    else if (strcmp(t->ident, "else") == 0)      parse_else(pp, t);
-    else if (strcmp(t->ident, "endif") == 0)     parse_endif(pp, t);
-    else if (strcmp(t->ident, "line") == 0)      parse_line(pp);
-    else if (strcmp(t->ident, "warning") == 0)   parse_warning(pp, t);
-    else if (strcmp(t->ident, "error") == 0)     parse_error(pp, t);
-    else if (strcmp(t->ident, "pragma") == 0)    parse_pragma(pp);
-    else goto err;
-    return;
-err:
-    error_at(t, "unsupported preprocessor directive '%s'", token2str(t));
+    switch (directive_kind(t)) {
+    case DIR_DEFINE:  parse_define(pp); break;
+    case DIR_UNDEF:   parse_undef(pp); break;
+    case DIR_INCLUDE:
+    case DIR_IMPORT:  parse_include(pp, t); break;
+    case DIR_IF:      parse_if(pp); break;
+    case DIR_IFDEF:   parse_ifdef(pp); break;
+    case DIR_IFNDEF:  parse_ifndef(pp); break;
+    case DIR_ELIF:    parse_elif(pp, t); break;
+    case DIR_ELSE:    parse_else(pp, t); break;
+    case DIR_ENDIF:   parse_endif(pp, t); break;
+    case DIR_LINE:    parse_line(pp); break;
+    case DIR_WARNING: parse_warning(pp, t); break;
+    case DIR_ERROR:   parse_error(pp, t); break;
+    case DIR_PRAGMA:  parse_pragma(pp); break;
+    default:
+        error_at(t, "unsupported preprocessor directive '%s'", token2str(t));
+    }
 }
 
+static Token * ring_next(struct TokenRing *r);
+static void ring_undo(struct TokenRing *r, Token *t);
+
 Token * next_tk(PP *pp) {
-    Token *t = expand_next_ignore_newlines(pp);
-    if (t->k == '#' && t->col == 1 && !t->hide_set) { // '#' at line start
-        parse_directive(pp);
-        return next_tk(pp);
-    }
-    if (t->k == TK_IDENT) { // Check for keywords
-        for (size_t i = 0; KEYWORDS[i]; i++) {
-            if (strcmp(t->ident, KEYWORDS[i]) == 0) {
-                t->k = FIRST_KEYWORD + i;
-                break;
-            }
+    if (pp->ring) {
+        return ring_next(pp->ring);
+    }
+    if (pp->replay) {
+        return vec_len(pp->replay) > 0 ? vec_pop(pp->replay) : pp->eof;
+    }
+    Token *t = next_raw_tk(pp->l);
+    if (!is_plain_tk(pp, t)) {
+        t = expand_tk_ignore_newlines(pp, t);
+        while (t->k == '#' && t->col == 1 && !t->hide_set) { // '#' at line start
+            parse_directive(pp); // Loop rather than recurse, for long runs of directives
+            t = expand_next_ignore_newlines(pp);
         }
     }
+    if (t->k == TK_IDENT && ATOM(t->ident)->tag) { // Check for keywords
+        t->k = ATOM(t->ident)->tag;
+    }
     return t;
 }
 
@@ -759,13 +1384,13 @@ Token * next_tk_is(PP *pp, int k) {
     if (t->k == k) {
         return t;
     }
-    undo_raw_tk(pp->l, t);
+    undo_tk(pp, t);
     return NULL;
 }
 
 Token * peek_tk(PP *pp) {
     Token *t = next_tk(pp);
-    undo_raw_tk(pp->l, t);
+    undo_tk(pp, t);
     return t;
 }
 
@@ -777,7 +1402,7 @@ Token * peek_tk_is(PP *pp, int k) {
 Token * peek2_tk(PP *pp) {
     Token *t = next_tk(pp);
     Token *t2 = peek_tk(pp);
-    undo_raw_tk(pp->l, t);
+    undo_tk(pp, t);
     return t2;
 }
 
@@ -793,3 +1418,335 @@ Token * expect_tk(PP *pp, int k) {
     }
     return t;
 }
+
+void undo_tk(PP *pp, Token *t) {
+    if (pp->ring) {
+        ring_undo(pp->ring, t);
+    } else if (pp->replay) {
+        if (t->k != TK_EOF) {
+            vec_push(pp->replay, t);
+        }
+    } else {
+        undo_raw_tk(pp->l, t);
+    }
+}
+
+PP * new_replay_pp(Vec *tks, Token *eof) {
+    PP *pp = calloc(1, sizeof(PP));
+    pp->replay = vec_new();
+    for (size_t i = vec_len(tks); i > 0; i--) {
+        vec_push(pp->replay, vec_get(tks, i - 1));
+    }
+    pp->eof = eof;
+    return pp;
+}
+
+void free_replay_pp(PP *pp) {
+    vec_free(pp->replay);
+    free(pp);
+}
+
+
+// ---- Preprocess Only -------------------------------------------------------
+
+// For '-E'. The output is written through a buffer that's flushed whenever
+// it fills up, so the whole file is never held in memory
+#define PP_OUT_FLUSH (64 * 1024)
+
+typedef struct {
+    FILE *out;
+    Buf *b;
+    File *f;    // Where the last token came from
+    char *name; // 'f->name' then; '#line' can change it
+    int line;   // Line the output's on, in 'f'
+    int last; // Last character written (or '\n' at the start of a line)
+} PPOut;
+
+static int is_ident_ch(int c) {
+    return isalnum(c) || c == '_';
+}
+
+// Whether two tokens written with nothing between them would be lexed as
+// something else (e.g., '+' '+', 'L' "str", or '1' '.'); only has to err on
+// the side of a space
+static int runs_together(int last, int first) {
+    if (is_ident_ch(last) || last == '.') {
+        return is_ident_ch(first) || first == '.' || first == '"' || first == '\'';
+    }
+    return ispunct(last) && ispunct(first) && !strchr("()[]{};,", last) &&
+           !strchr("()[]{};,\"'", first);
+}
+
+static void write_escaped(Buf *b, int c, int quote) {
+    if (c == quote || c == '\\') {
+        buf_push(b, '\\');
+        buf_push(b, (char) c);
+    } else if (c >= 0x80 && quote == '"') {
+        buf_push(b, (char) c); // Part of a UTF-8 sequence
+    } else if (c > 0xff) {
+        buf_printf(b, "\\U%08x", c);
+    } else if (!isprint(c)) {
+        buf_printf(b, "\\%03o", c); // Always 3 digits, so a digit after is safe
+    } else {
+        buf_push(b, (char) c);
+    }
+}
+
+static void write_spelling(Buf *b, Token *t) {
+    if ((t->k == TK_CH || t->k == TK_STR) && t->enc != ENC_NONE) {
+        buf_push(b, "\0uLU"[t->enc]); // By 'ENC_*'
+    }
+    switch (t->k) {
+    case TK_IDENT: buf_print(b, t->ident); break;
+    case TK_NUM:   buf_print(b, t->num); break;
+    case TK_CH:
+        buf_push(b, '\'');
+        write_escaped(b, t->ch, '\'');
+        buf_push(b, '\'');
+        break;
+    case TK_STR:
+        buf_push(b, '"');
+        for (size_t i = 0; i < t->len; i++) {
+            write_escaped(b, (unsigned char) t->str[i], '"');
+        }
+        buf_push(b, '"');
+        break;
+    case TK_PRAGMA_UNROLL:
+        if (t->unroll == 1) {
+            buf_print(b, "#pragma nounroll");
+        } else if (t->unroll == UNROLL_FULL) {
+            buf_print(b, "#pragma unroll");
+        } else {
+            buf_printf(b, "#pragma unroll %d", t->unroll);
+        }
+        break;
+    default:
+        if (t->k >= FIRST_KEYWORD && t->k <= LAST_KEYWORD) {
+            buf_print(b, t->ident); // As it was spelt (e.g., '__asm')
+        } else if (t->k < 256) {
+            buf_push(b, (char) t->k);
+        } else {
+            buf_print(b, tk2str(t->k));
+        }
+        break;
+    }
+}
+
+// Moves the output on to the token's line; newlines within a file, and a
+// '#line' marker when the tokens move to another one
+static void move_to_line(PPOut *o, Token *t) {
+    int same_file = t->f == o->f && t->f->name == o->name;
+    if (same_file && t->line <= o->line) {
+        return; // Same line, or a macro expansion's tokens
+    }
+    if (o->last != '\n') {
+        buf_push(o->b, '\n');
+        o->last = '\n';
+        o->line++;
+    }
+    if (!same_file) {
+        buf_printf(o->b, "#line %d \"%s\"\n", t->line, t->f->name);
+        o->f = t->f;
+        o->name = t->f->name;
+        o->line = t->line;
+    }
+    for (; o->line < t->line; o->line++) {
+        buf_push(o->b, '\n');
+    }
+}
+
+static void write_tk(PPOut *o, Token *t) {
+    if (t->f) {
+        move_to_line(o, t);
+    }
+    if (t->k == TK_PRAGMA_UNROLL && o->last != '\n') {
+        buf_push(o->b, '\n'); // Has a line to itself
+        o->line++;
+    }
+    size_t start = o->b->len;
+    write_spelling(o->b, t);
+    int first = (unsigned char) o->b->data[start];
+    if (o->last != '\n' && (t->has_preceding_space || runs_together(o->last, first))) {
+        buf_push(o->b, ' '); // Goes in front, now that the first character's known
+        memmove(&o->b->data[start + 1], &o->b->data[start], o->b->len - start - 1);
+        o->b->data[start] = ' ';
+    }
+    o->last = (unsigned char) o->b->data[o->b->len - 1];
+    if (t->k == TK_PRAGMA_UNROLL) {
+        buf_push(o->b, '\n');
+        o->last = '\n';
+        o->line++;
+    }
+    if (o->b->len >= PP_OUT_FLUSH) {
+        fwrite(o->b->data, 1, o->b->len, o->out);
+        o->b->len = 0;
+    }
+}
+
+void preprocess(File *f, FILE *out, Vec *deps) {
+    PP *pp = new_pp(new_lexer(f));
+    pp->deps = deps;
+    PPOut o = { .out = out, .b = buf_new(), .last = '\n' };
+    Token *t;
+    while ((t = next_tk(pp))->k != TK_EOF) {
+        write_tk(&o, t);
+    }
+    if (o.last != '\n') {
+        buf_push(o.b, '\n');
+    }
+    fwrite(o.b->data, 1, o.b->len, out);
+    buf_free(o.b);
+}
+
+
+// ---- Preprocessor Thread ---------------------------------------------------
+
+#define RING_SIZE 1024 // A power of 2
+
+// 'head' and 'tail' only ever increase; each is written by one side and read
+// by the other, so they're all that's synchronised
+typedef struct TokenRing {
+    Token *tks[RING_SIZE]; // NULL where the preprocessor failed
+    Buf *msgs[RING_SIZE];  // Printed by the preprocessor before each token
+    size_t head, tail;     // Taken off at 'head'; pushed on at 'tail'
+    int cancel;            // Set if the parser stops before the end
+
+    // The parser's side
+    Vec *undone; // of 'Token *'
+    Token *eof;  // Once it's been reached
+
+    // The preprocessor's side
+    PP *pp;
+    pthread_t thread;
+    Map *virtual_headers; // Its copy of the parser's thread-local
+    int colours;
+    ArenaBlock *arenas[ARENA_LAST]; // Handed back once it's done
+    size_t stats[STAT_LAST];
+} TokenRing;
+
+// Waits on the other side by giving up the CPU; it's seldom far behind
+static int ring_push(TokenRing *r, Token *t, Buf *msgs) {
+    size_t tail = r->tail;
+    while (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+        if (__atomic_load_n(&r->cancel, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        sched_yield();
+    }
+    r->tks[tail % RING_SIZE] = t;
+    r->msgs[tail % RING_SIZE] = msgs;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static Token * ring_pop(TokenRing *r) {
+    size_t head = r->head;
+    while (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head) {
+        sched_yield();
+    }
+    Token *t = r->tks[head % RING_SIZE];
+    Buf *msgs = r->msgs[head % RING_SIZE];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    if (msgs) {
+        print_messages(msgs);
+        buf_free(msgs);
+    }
+    if (!t) {
+        error_fail(); // Its message was the last one
+    }
+    return t;
+}
+
+static Token * ring_next(TokenRing *r) {
+    if (vec_len(r->undone) > 0) {
+        return vec_pop(r->undone);
+    }
+    if (r->eof) {
+        return r->eof; // As the lexer keeps returning 'TK_EOF'
+    }
+    Token *t = ring_pop(r);
+    if (t->k == TK_EOF) {
+        r->eof = t;
+    }
+    return t;
+}
+
+static void ring_undo(TokenRing *r, Token *t) {
+    if (t->k != TK_EOF) {
+        vec_push(r->undone, t);
+    }
+}
+
+// What the preprocessor's printed since the last token, or NULL
+static Buf * take_msgs() {
+    if (ERROR_OUT->len == 0) {
+        return NULL;
+    }
+    Buf *msgs = ERROR_OUT;
+    ERROR_OUT = buf_new();
+    return msgs;
+}
+
+static void * pp_thread(void *arg) {
+    TokenRing *r = arg;
+    VIRTUAL_HEADERS = r->virtual_headers;
+    ERROR_OUT = buf_new();
+    ERROR_OUT_COLOURS = r->colours;
+    jmp_buf jmp;
+    if (setjmp(jmp) == 0) {
+        ERROR_JMP = &jmp;
+        while (1) {
+            Token *t = next_tk(r->pp);
+            if (!ring_push(r, t, take_msgs()) || t->k == TK_EOF) {
+                break;
+            }
+        }
+    } else {
+        ring_push(r, NULL, take_msgs());
+    }
+    ERROR_JMP = NULL;
+    buf_free(ERROR_OUT);
+    ERROR_OUT = NULL;
+    for (int arena = 0; arena < ARENA_LAST; arena++) {
+        r->arenas[arena] = arena_detach(arena);
+    }
+    memcpy(r->stats, STATS, sizeof(STATS));
+    return NULL;
+}
+
+PP * start_pp_thread(PP *pp) {
+    TokenRing *r = calloc(1, sizeof(TokenRing));
+    r->undone = vec_new();
+    r->pp = pp;
+    r->virtual_headers = VIRTUAL_HEADERS;
+    r->colours = error_colours();
+    if (pthread_create(&r->thread, NULL, pp_thread, r) != 0) {
+        vec_free(r->undone);
+        free(r);
+        return pp; // Preprocess as the tokens are needed instead
+    }
+    PP *front = calloc(1, sizeof(PP));
+    front->ring = r;
+    return front;
+}
+
+void end_pp_thread(PP *front) {
+    TokenRing *r = front->ring;
+    if (!r) {
+        return; // The thread never started
+    }
+    __atomic_store_n(&r->cancel, 1, __ATOMIC_RELEASE);
+    pthread_join(r->thread, NULL);
+    for (size_t i = r->head; i < r->tail; i++) {
+        buf_free(r->msgs[i % RING_SIZE]); // Never reached
+    }
+    for (int arena = 0; arena < ARENA_LAST; arena++) {
+        arena_adopt(arena, r->arenas[arena]);
+    }
+    for (int i = 0; i < STAT_LAST; i++) {
+        STATS[i] += r->stats[i];
+    }
+    vec_free(r->undone);
+    free(r);
+    free(front);
+}
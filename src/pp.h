@@ -2,6 +2,7 @@
 #ifndef COSEC_PP_H
 #define COSEC_PP_H
 
+#include <stdio.h>
 #include <time.h>
 
 #include "lex.h"
@@ -10,10 +11,22 @@
 typedef struct { // C pre-processor
     Lexer *l;
     Map *macros;
+    uint64_t *maybe_macro; // Filter on the names in 'macros'; see 'find_macro'
     Vec *conds; // For nested '#if's
     Map *include_once;
+    Map *include_guards; // of 'char *' (the guard macro); by full path
     Vec *include_paths;
+    Vec *deps; // of 'char *'; if set, every header included (see '-MD')
+    Span *subst; // Scratch space for macro substitution
+    size_t num_subst, max_subst;
+    Map *macro_stamps; // of 'macro_gen' when each name was last (un)defined
+    uint64_t macro_gen;
+    Vec *memo_refs;  // of 'char *'; set while memoising an expansion
+    int memo_failed; // Set if that expansion can't be memoised
     struct tm now;
+    struct TokenRing *ring; // Set if the tokens come from a preprocessor thread
+    Vec *replay; // of 'Token *', in reverse; set for a replay PP
+    Token *eof;  // Returned once 'replay' is empty
 } PP;
 
 typedef void (*BuiltIn)(PP *pp, Token *t);
@@ -28,6 +41,12 @@ typedef struct {
     int k;
     Vec *body; // of 'Token *'
     union {
+        struct { // MACRO_OBJ; see 'expand_memo'
+            Vec *expansion; // of 'Token *'; fully expanded, if memoised
+            Vec *refs;      // of 'char *'; names looked up while expanding
+            uint64_t memo_gen;
+            int no_memo;
+        };
         struct { size_t num_params; int is_vararg; }; // MACRO_FN
         BuiltIn built_in; // MACRO_BUILT_IN
     };
@@ -44,6 +63,15 @@ typedef struct {
     int is_true;
 } Cond;
 
+// Headers held in memory rather than on disk (see 'cosec.h'), by the interned
+// name they're '#include'd as (with '""' or '<>'); found before any file
+typedef struct {
+    char *contents;
+    size_t len;
+} VirtualHeader;
+
+extern THREAD_LOCAL Map *VIRTUAL_HEADERS; // of 'VirtualHeader *'
+
 PP * new_pp(Lexer *l);
 Token * next_tk(PP *pp);
 Token * next_tk_is(PP *pp, int k);
@@ -52,5 +80,33 @@ Token * peek_tk_is(PP *pp, int k);
 Token * peek2_tk(PP *pp);
 Token * peek2_tk_is(PP *pp, int k);
 Token * expect_tk(PP *pp, int k);
+void undo_tk(PP *pp, Token *t); // Returned by 'next_tk' again
+
+// '-E'. Writes out the tokens from 'f', fully expanded, keeping the spaces
+// and line breaks between them; a '#line' marker goes before the first token
+// from each file (and on coming back to one after an '#include'). 'deps' is
+// as for 'parse'
+void preprocess(File *f, FILE *out, Vec *deps);
+
+// Replays 'tks' (already preprocessed, e.g., saved by the parser to come back
+// to later), then 'eof' forever
+PP * new_replay_pp(Vec *tks, Token *eof);
+void free_replay_pp(PP *pp);
+
+// Preprocessor thread. Runs 'pp' on a thread of its own, which pushes fully
+// expanded tokens (with keywords classified) onto a single-producer,
+// single-consumer ring as fast as the parser takes them off, so lexing and
+// preprocessing overlap with parsing. The tokens are read through the PP
+// returned, with 'next_tk' and friends as usual. Warnings and errors from
+// the preprocessor are passed on as the parser reaches the token they came
+// before, so they come out in the same order as without the thread.
+// 'end_pp_thread' has to be called once the parser's done with the PP (or
+// has failed); it hands the thread's arenas (i.e., the tokens) to the caller
+PP * start_pp_thread(PP *pp);
+void end_pp_thread(PP *front);
+
+// Include lookups are cached for the whole process; the compile server drops
+// them between jobs, since headers may have come or gone
+void forget_include_lookups();
 
 #endif
@@ -0,0 +1,1080 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "profile.h"
+#include "analysis.h"
+#include "error.h"
+
+int PROFILE_GENERATE = 0, PROFILE_USE = 0;
+char *PROFILE_PATH = "cosec.profdata";
+char *PROFILE_SAMPLE_PATH = NULL;
+
+// The profile is a series of records, one per file of the program that ran
+// each time it ran. A record is the magic number, 'PROFILE_VERSION', the
+// number of functions, of counters and of indirect call sites, then each
+// function's key, CFG checksum, number of BBs and number of indirect calls.
+// Then comes the ID of the process that wrote it, all the counters (each a
+// 64-bit count, in order), each call site's target (see 'record_target'), and
+// the address of each function. The instrumented program writes a record by
+// copying a header (made when it was compiled) and the rest straight to the
+// file.
+//
+// A call site's target is an address, which only means something in the run
+// it was taken from (the program might be loaded somewhere else each time),
+// so it's looked up in the addresses written by records from the same process
+
+#define PROFILE_MAGIC   0x46504343 // 'CCPF'
+#define PROFILE_VERSION 2
+
+// A BB is hot if it ran at least 1/HOT_FRACTION times as often as the most
+// run BB in the profile
+#define HOT_FRACTION 100
+
+// A 'static' function's key has its file's name in front
+static char * fn_key(Global *g, char *file_name) {
+    if (g->linkage != LINK_STATIC) {
+        return intern(g->label);
+    }
+    Buf *b = buf_new();
+    buf_printf(b, "%s:%s", file_name, g->label);
+    char *key = intern(b->data);
+    buf_free(b);
+    return key;
+}
+
+static uint64_t hash_u64(uint64_t h, uint64_t v) { // 64-bit FNV
+    for (int i = 0; i < 8; i++) {
+        h ^= (v >> (i * 8)) & 0xff;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Of each BB's successors, in order; numbers the BBs in 'n'
+static uint64_t cfg_checksum(Fn *fn, size_t *num_bbs) {
+    size_t n = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->n = n++;
+    }
+    *num_bbs = n;
+    uint64_t h = hash_u64(14695981039346656037ULL, n);
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        IrIns *br = bb->ir_last;
+        h = hash_u64(h, br ? br->op : IR_LAST);
+        if (!br) {
+            continue;
+        }
+        switch (br->op) {
+        case IR_BR: h = hash_u64(h, br->br->n); break;
+        case IR_CONDBR:
+            h = hash_u64(h, br->true->n);
+            h = hash_u64(h, br->false->n);
+            break;
+        case IR_SWITCH:
+            h = hash_u64(h, br->default_br->n);
+            for (size_t i = 0; i < vec_len(br->table); i++) {
+                h = hash_u64(h, ((BB *) vec_get(br->table, i))->n);
+            }
+            break;
+        case IR_INDIRECT_BR:
+            for (size_t i = 0; i < vec_len(br->targets); i++) {
+                h = hash_u64(h, ((BB *) vec_get(br->targets, i))->n);
+            }
+            break;
+        default: break;
+        }
+    }
+    return h;
+}
+
+// A call through a function pointer, which '-fprofile-use' might promote to a
+// direct call to where it usually goes
+static int is_indirect_call(IrIns *ins) {
+    return ins->op == IR_CALL && ins->fn->op != IR_GLOBAL;
+}
+
+static uint32_t count_sites(Fn *fn) {
+    uint32_t n = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            n += is_indirect_call(ins);
+        }
+    }
+    return n;
+}
+
+
+// ---- Instrumentation -------------------------------------------------------
+
+// Each BB adds 1 to its counter, in an array of them for the whole file. The
+// first time any function in the file is called, it registers a function with
+// 'atexit' that writes the record:
+//   entry: flag = load registered; condbr flag != 0, body, register
+//   register: store 1 -> registered; call atexit(dump); br body
+//   body: (the old entry BB)
+//   dump: f = fopen(PROFILE_PATH, "ab"); condbr f == 0, done, write
+//   write: fwrite(header, 1, len, f); fwrite(pid, 4, 1, f);
+//          fwrite(counts, 8, n, f); ...; fclose(f)
+
+typedef struct {
+    Vec *globals;
+    char *file_name;
+    Global *counts, *registered, *dump;
+    Global *sites, *pid, *addrs;
+    size_t num_counts, num_sites, num_fns;
+} Instr;
+
+static Global * new_global(Vec *globals, char *label, IrType *t, int k, int linkage) {
+    Global *g = arena_alloc(ARENA_IR, sizeof(Global));
+    g->k = k;
+    g->label = label;
+    g->t = t;
+    g->linkage = linkage;
+    vec_push(globals, g);
+    return g;
+}
+
+static Global * new_bytes(Instr *in, char *label, char *bytes, size_t len) {
+    IrType *t = irt_arr(irt_scalar(IRT_I8), len, len, 8);
+    Global *g = new_global(in->globals, label, t, G_INIT, LINK_STATIC);
+    g->bytes = bytes;
+    g->num_bytes = len;
+    g->relocs = vec_new();
+    g->is_const = 1;
+    return g;
+}
+
+static Global * lib_fn(Instr *in, char *name) {
+    char *label = prepend_underscore(name);
+    for (size_t i = 0; i < vec_len(in->globals); i++) {
+        Global *g = vec_get(in->globals, i);
+        if (strcmp(g->label, label) == 0) {
+            return g; // The file declares it already
+        }
+    }
+    return new_global(in->globals, label, irt_scalar(IRT_PTR), G_NONE, LINK_EXTERN);
+}
+
+static IrIns * emit_imm(BB *bb, IrType *t, uint64_t imm) {
+    IrIns *ins = append_ir(bb, new_ins(IR_IMM, t));
+    ins->imm = imm;
+    return ins;
+}
+
+static IrIns * emit_global(BB *bb, Global *g) {
+    IrIns *ins = append_ir(bb, new_ins(IR_GLOBAL, irt_scalar(IRT_PTR)));
+    ins->g = g;
+    return ins;
+}
+
+static IrIns * emit_call(BB *bb, Global *fn, IrType *t, IrIns **args, int num_args) {
+    IrIns *call = new_ins(IR_CALL, t);
+    call->fn = emit_global(bb, fn);
+    call->is_vararg = 0;
+    append_ir(bb, call);
+    for (int i = 0; i < num_args; i++) {
+        IrIns *carg = append_ir(bb, new_ins(IR_CARG, args[i]->t));
+        carg->arg = args[i];
+    }
+    return call;
+}
+
+static IrIns * emit_br(BB *bb, BB *to) {
+    IrIns *br = append_ir(bb, new_ins(IR_BR, NULL));
+    br->br = to;
+    return br;
+}
+
+static IrIns * emit_binary(BB *bb, int op, IrType *t, IrIns *l, IrIns *r) {
+    IrIns *ins = append_ir(bb, new_ins(op, t));
+    ins->l = l;
+    ins->r = r;
+    return ins;
+}
+
+static IrIns * emit_condbr(BB *bb, int op, IrIns *l, IrIns *r, BB *t, BB *f) {
+    IrIns *cmp = append_ir(bb, new_ins(op, irt_scalar(IRT_I32)));
+    cmp->l = l;
+    cmp->r = r;
+    IrIns *br = append_ir(bb, new_ins(IR_CONDBR, NULL));
+    br->cond = cmp;
+    br->true = t;
+    br->false = f;
+    br->true_chain = vec_new();
+    br->false_chain = vec_new();
+    return br;
+}
+
+// Before the first instruction in 'bb' that isn't a phi (or, in the entry BB,
+// an IR_FARG or IR_ALLOC)
+static void count_bb(Instr *in, BB *bb, size_t idx) {
+    IrIns *before = bb->ir_head;
+    while (before && (before->op == IR_PHI || before->op == IR_FARG ||
+                      (before->op == IR_ALLOC && !before->count))) {
+        before = before->next;
+    }
+    IrType *i64 = irt_scalar(IRT_I64);
+    IrIns *g = new_ins(IR_GLOBAL, irt_scalar(IRT_PTR));
+    g->g = in->counts;
+    IrIns *offset = new_ins(IR_IMM, i64);
+    offset->imm = idx * 8;
+    IrIns *ptr = new_ins(IR_PTRADD, irt_scalar(IRT_PTR));
+    ptr->base = g;
+    ptr->offset = offset;
+    IrIns *count = new_ins(IR_LOAD, i64);
+    count->src = ptr;
+    IrIns *one = new_ins(IR_IMM, i64);
+    one->imm = 1;
+    IrIns *add = new_ins(IR_ADD, i64);
+    add->l = count;
+    add->r = one;
+    IrIns *store = new_ins(IR_STORE, NULL);
+    store->src = add;
+    store->dst = ptr;
+    IrIns *seq[] = { g, offset, ptr, count, one, add, store };
+    for (size_t i = 0; i < sizeof(seq) / sizeof(seq[0]); i++) {
+        if (before) {
+            insert_ir(seq[i], before);
+        } else {
+            append_ir(bb, seq[i]);
+        }
+    }
+}
+
+// Each indirect call site has a candidate target and a number of votes for
+// it, which finds the target most of the calls went to (if there is one)
+// without branching (a majority vote, as in Boyer and Moore's algorithm):
+//   votes == 0 ? (cand = target, votes = 1) :
+//   cand == target ? votes++ : votes--
+// The votes left at the end are at most the calls to the candidate minus the
+// calls anywhere else
+static void record_target(Instr *in, IrIns *call, size_t idx) {
+    IrType *ptr = irt_scalar(IRT_PTR), *i64 = irt_scalar(IRT_I64);
+    IrType *i32 = irt_scalar(IRT_I32);
+    BB *bb = new_bb(); // Instructions are emitted here, then moved before 'call'
+    IrIns *sites = emit_global(bb, in->sites);
+    IrIns *cand_offset = emit_imm(bb, i64, idx * 16);
+    IrIns *cand_ptr = append_ir(bb, new_ins(IR_PTRADD, ptr));
+    cand_ptr->base = sites;
+    cand_ptr->offset = cand_offset;
+    IrIns *votes_offset = emit_imm(bb, i64, idx * 16 + 8);
+    IrIns *votes_ptr = append_ir(bb, new_ins(IR_PTRADD, ptr));
+    votes_ptr->base = sites;
+    votes_ptr->offset = votes_offset;
+    IrIns *cand = append_ir(bb, new_ins(IR_LOAD, ptr));
+    cand->src = cand_ptr;
+    IrIns *votes = append_ir(bb, new_ins(IR_LOAD, i64));
+    votes->src = votes_ptr;
+
+    IrIns *zero = emit_imm(bb, i64, 0);
+    IrIns *no_votes = emit_binary(bb, IR_EQ, i32, votes, zero);
+    IrIns *new_cand = append_ir(bb, new_ins(IR_SELECT, ptr));
+    new_cand->sel = no_votes;
+    new_cand->l = call->fn;
+    new_cand->r = cand;
+    IrIns *is_cand = emit_binary(bb, IR_EQ, i32, new_cand, call->fn);
+    IrIns *one = emit_imm(bb, i64, 1);
+    IrIns *inc = emit_binary(bb, IR_ADD, i64, votes, one);
+    IrIns *dec = emit_binary(bb, IR_SUB, i64, votes, one);
+    IrIns *new_votes = append_ir(bb, new_ins(IR_SELECT, i64));
+    new_votes->sel = is_cand;
+    new_votes->l = inc;
+    new_votes->r = dec;
+    IrIns *store_cand = append_ir(bb, new_ins(IR_STORE, NULL));
+    store_cand->src = new_cand;
+    store_cand->dst = cand_ptr;
+    IrIns *store_votes = append_ir(bb, new_ins(IR_STORE, NULL));
+    store_votes->src = new_votes;
+    store_votes->dst = votes_ptr;
+
+    while (bb->ir_head) {
+        IrIns *ins = bb->ir_head;
+        delete_ir(ins);
+        insert_ir(ins, call);
+    }
+}
+
+// Moves the IR_FARGs and IR_ALLOCs at the start of the old entry BB (which
+// have to stay in the entry) to a new one in front of it, which registers
+// the record on the first call
+static void add_registration(Instr *in, Fn *fn) {
+    BB *body = fn->entry, *entry = new_bb(), *reg = new_bb();
+    while (body->ir_head && (body->ir_head->op == IR_FARG ||
+            (body->ir_head->op == IR_ALLOC && !body->ir_head->count))) {
+        IrIns *ins = body->ir_head;
+        delete_ir(ins);
+        append_ir(entry, ins);
+    }
+    IrIns *registered = emit_global(entry, in->registered);
+    IrIns *flag = append_ir(entry, new_ins(IR_LOAD, irt_scalar(IRT_I32)));
+    flag->src = registered;
+    IrIns *zero = emit_imm(entry, irt_scalar(IRT_I32), 0);
+    emit_condbr(entry, IR_NEQ, flag, zero, body, reg)->likely = 1;
+
+    IrIns *store = new_ins(IR_STORE, NULL);
+    store->src = emit_imm(reg, irt_scalar(IRT_I32), 1);
+    store->dst = emit_global(reg, in->registered);
+    append_ir(reg, store);
+    IrIns *dump = emit_global(reg, in->dump);
+    emit_call(reg, lib_fn(in, "atexit"), irt_scalar(IRT_I32), &dump, 1);
+    emit_br(reg, body);
+
+    entry->next = reg;
+    reg->prev = entry;
+    reg->next = body;
+    body->prev = reg;
+    fn->entry = entry;
+}
+
+static void emit_dump_fn(Instr *in, Global *header, size_t header_len) {
+    Fn *fn = arena_alloc(ARENA_IR, sizeof(Fn));
+    fn->params = vec_new();
+    fn->ret = irt_scalar(IRT_VOID);
+    fn->loops = vec_new();
+    fn->f32s = vec_new();
+    fn->f64s = vec_new();
+    BB *open = new_bb(), *write = new_bb(), *done = new_bb();
+    open->next = write;
+    write->prev = open;
+    write->next = done;
+    done->prev = write;
+    fn->entry = open;
+    fn->last = done;
+    in->dump->fn = fn;
+
+    IrType *ptr = irt_scalar(IRT_PTR), *i64 = irt_scalar(IRT_I64);
+    char *path = PROFILE_PATH;
+    IrIns *open_args[] = {
+        emit_global(open, new_bytes(in, "_G.prof.path", path, strlen(path) + 1)),
+        emit_global(open, new_bytes(in, "_G.prof.mode", "ab", 3)),
+    };
+    IrIns *f = emit_call(open, lib_fn(in, "fopen"), ptr, open_args, 2);
+    emit_condbr(open, IR_EQ, f, emit_imm(open, ptr, 0), done, write);
+
+    Global *fwrite = lib_fn(in, "fwrite");
+    IrIns *pid = emit_call(write, lib_fn(in, "getpid"), irt_scalar(IRT_I32), NULL, 0);
+    IrIns *pid_g = emit_global(write, in->pid);
+    IrIns *store_pid = append_ir(write, new_ins(IR_STORE, NULL));
+    store_pid->src = pid;
+    store_pid->dst = pid_g;
+    struct { Global *g; size_t size, count; } parts[] = {
+        { header, 1, header_len },
+        { in->pid, 4, 1 },
+        { in->counts, 8, in->num_counts },
+        { in->sites, 16, in->num_sites },
+        { in->addrs, 8, in->num_fns },
+    };
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        if (parts[i].count == 0) {
+            continue; // No indirect calls
+        }
+        IrIns *args[] = {
+            emit_global(write, parts[i].g), emit_imm(write, i64, parts[i].size),
+            emit_imm(write, i64, parts[i].count), f,
+        };
+        emit_call(write, fwrite, i64, args, 4);
+    }
+    emit_call(write, lib_fn(in, "fclose"), irt_scalar(IRT_I32), &f, 1);
+    emit_br(write, done);
+    append_ir(done, new_ins(IR_RET, NULL));
+}
+
+static void put_u32(Buf *b, uint32_t v) { buf_nprint(b, (char *) &v, sizeof(v)); }
+static void put_u64(Buf *b, uint64_t v) { buf_nprint(b, (char *) &v, sizeof(v)); }
+
+void instrument(Vec *globals, char *file_name) {
+    Instr in = { .globals = globals, .file_name = file_name };
+    Buf *fns = buf_new();
+    uint32_t num_fns = 0;
+    size_t num_globals = vec_len(globals);
+    for (size_t i = 0; i < num_globals; i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k != G_FN_DEF) {
+            continue;
+        }
+        size_t num_bbs;
+        uint64_t checksum = cfg_checksum(g->fn, &num_bbs);
+        uint32_t num_sites = count_sites(g->fn);
+        char *key = fn_key(g, file_name);
+        put_u32(fns, (uint32_t) strlen(key));
+        buf_print(fns, key);
+        put_u64(fns, checksum);
+        put_u32(fns, (uint32_t) num_bbs);
+        put_u32(fns, num_sites);
+        in.num_counts += num_bbs;
+        in.num_sites += num_sites;
+        num_fns++;
+    }
+    if (num_fns == 0) {
+        buf_free(fns);
+        return;
+    }
+    in.num_fns = num_fns;
+    Buf *header = buf_new();
+    put_u32(header, PROFILE_MAGIC);
+    put_u32(header, PROFILE_VERSION);
+    put_u32(header, num_fns);
+    put_u64(header, in.num_counts);
+    put_u64(header, in.num_sites);
+    buf_nprint(header, fns->data, fns->len);
+    buf_free(fns);
+
+    IrType *i64 = irt_scalar(IRT_I64);
+    IrType *counts_t = irt_arr(i64, in.num_counts, in.num_counts * 8, 8);
+    in.counts = new_global(globals, "_G.prof.counts", counts_t, G_INIT, LINK_STATIC);
+    in.counts->relocs = vec_new();
+    IrType *sites_t = irt_arr(i64, in.num_sites * 2, in.num_sites * 16, 8);
+    in.sites = new_global(globals, "_G.prof.sites", sites_t, G_INIT, LINK_STATIC);
+    in.sites->relocs = vec_new();
+    IrType *addrs_t = irt_arr(i64, num_fns, num_fns * 8, 8);
+    in.addrs = new_global(globals, "_G.prof.addrs", addrs_t, G_INIT, LINK_STATIC);
+    in.addrs->relocs = vec_new();
+    in.pid = new_global(globals, "_G.prof.pid", irt_scalar(IRT_I32), G_IMM, LINK_STATIC);
+    in.registered = new_global(globals, "_G.prof.registered", irt_scalar(IRT_I32),
+                               G_IMM, LINK_STATIC);
+    in.dump = new_global(globals, "_G.prof.dump", irt_scalar(IRT_PTR), G_FN_DEF, LINK_STATIC);
+
+    size_t idx = 0, site_idx = 0, fn_idx = 0;
+    for (size_t i = 0; i < num_globals; i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k != G_FN_DEF) {
+            continue;
+        }
+        InitReloc *addr = arena_alloc(ARENA_IR, sizeof(InitReloc));
+        addr->offset = fn_idx++ * 8;
+        addr->g = g;
+        addr->addend = 0;
+        vec_push(in.addrs->relocs, addr);
+        for (BB *bb = g->fn->entry; bb; bb = bb->next) {
+            for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+                if (is_indirect_call(ins)) {
+                    record_target(&in, ins, site_idx++);
+                }
+            }
+            count_bb(&in, bb, idx++);
+        }
+        add_registration(&in, g->fn);
+    }
+    Global *header_g = new_bytes(&in, "_G.prof.header", header->data, header->len);
+    emit_dump_fn(&in, header_g, header->len);
+}
+
+
+// ---- Profile Use -----------------------------------------------------------
+
+// Where most of an indirect call site's calls went: 'votes' is at most the
+// calls to 'target' (a function's key, or NULL if it isn't known) minus the
+// calls anywhere else
+typedef struct {
+    char *target;
+    uint64_t votes;
+} SiteProfile;
+
+typedef struct {
+    uint64_t checksum;
+    size_t num_bbs, num_sites;
+    uint64_t *counts;
+    SiteProfile *sites;
+} FnProfile;
+
+// A call site's target, as read; it's only looked up once the functions'
+// addresses have been read from every record
+typedef struct {
+    SiteProfile *site;
+    uint32_t pid;
+    uint64_t addr, votes;
+} RawSite;
+
+typedef struct {
+    int64_t mtime, size; // Of the file when it was read
+    Map *fns;            // of 'FnProfile *', by key
+    uint64_t max;        // Largest count
+} Profile;
+
+static Profile *PROFILE;
+static char *PROFILE_READ_PATH; // Of 'PROFILE'
+static pthread_mutex_t PROFILE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    char *p, *end;
+} Reader;
+
+static int get(Reader *r, void *data, size_t len) {
+    if ((size_t) (r->end - r->p) < len) {
+        return 0; // Truncated
+    }
+    memcpy(data, r->p, len);
+    r->p += len;
+    return 1;
+}
+
+// The key in 'addrs' (see 'read_record') for a function's address in a run
+static char * addr_key(uint32_t pid, uint64_t addr) {
+    char key[32];
+    snprintf(key, sizeof(key), "%x:%llx", pid, (unsigned long long) addr);
+    return intern(key);
+}
+
+// Returns 0 if the record's corrupt; a later record for a function with a
+// different checksum (i.e., from a run after it changed) replaces the earlier
+// counts, and one with the same checksum adds to them. Each call site's
+// target is added to 'raw', and each function's key to 'addrs' (by
+// 'addr_key')
+static int read_record(Reader *r, Profile *p, Vec *raw, Map *addrs) {
+    uint32_t magic, version, num_fns, pid;
+    uint64_t num_counts, num_sites;
+    if (!get(r, &magic, 4) || magic != PROFILE_MAGIC || !get(r, &version, 4) ||
+            version != PROFILE_VERSION || !get(r, &num_fns, 4) ||
+            !get(r, &num_counts, 8) || num_counts > (uint64_t) (r->end - r->p) / 8 ||
+            !get(r, &num_sites, 8) || num_sites > (uint64_t) (r->end - r->p) / 16) {
+        return 0;
+    }
+    FnProfile **fns = calloc(num_fns + 1, sizeof(FnProfile *));
+    char **keys = calloc(num_fns + 1, sizeof(char *));
+    uint64_t total = 0, total_sites = 0;
+    for (uint32_t i = 0; i < num_fns; i++) {
+        uint32_t len, num_bbs, fn_sites;
+        FnProfile *fp = calloc(1, sizeof(FnProfile));
+        fns[i] = fp;
+        if (!get(r, &len, 4) || (size_t) (r->end - r->p) < len) {
+            goto corrupt;
+        }
+        char *key = keys[i] = intern_n(r->p, len);
+        r->p += len;
+        if (!get(r, &fp->checksum, 8) || !get(r, &num_bbs, 4) || !get(r, &fn_sites, 4)) {
+            goto corrupt;
+        }
+        fp->num_bbs = num_bbs;
+        fp->num_sites = fn_sites;
+        total += num_bbs;
+        total_sites += fn_sites;
+        FnProfile *prev = map_get(p->fns, key);
+        if (prev && prev->checksum == fp->checksum && prev->num_bbs == fp->num_bbs &&
+                prev->num_sites == fp->num_sites) {
+            free(fp);
+            fns[i] = prev; // Add to the earlier counts
+        } else {
+            fp->counts = calloc(num_bbs + 1, sizeof(uint64_t));
+            fp->sites = calloc(fn_sites + 1, sizeof(SiteProfile));
+            map_put(p->fns, key, fp);
+        }
+    }
+    if (total != num_counts || total_sites != num_sites || !get(r, &pid, 4) ||
+            (size_t) (r->end - r->p) < num_counts * 8 + num_sites * 16 + num_fns * 8) {
+        goto corrupt;
+    }
+    for (uint32_t i = 0; i < num_fns; i++) {
+        for (size_t j = 0; j < fns[i]->num_bbs; j++) {
+            uint64_t count = 0;
+            if (!get(r, &count, 8)) {
+                goto corrupt;
+            }
+            fns[i]->counts[j] += count;
+            if (fns[i]->counts[j] > p->max) {
+                p->max = fns[i]->counts[j];
+            }
+        }
+    }
+    for (uint32_t i = 0; i < num_fns; i++) {
+        for (size_t j = 0; j < fns[i]->num_sites; j++) {
+            RawSite *site = calloc(1, sizeof(RawSite));
+            site->site = &fns[i]->sites[j];
+            site->pid = pid;
+            vec_push(raw, site); // Freed by 'read_profile', even if corrupt
+            if (!get(r, &site->addr, 8) || !get(r, &site->votes, 8)) {
+                goto corrupt;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < num_fns; i++) {
+        uint64_t addr = 0;
+        if (!get(r, &addr, 8)) {
+            goto corrupt;
+        }
+        map_put(addrs, addr_key(pid, addr), keys[i]);
+    }
+    free(fns);
+    free(keys);
+    return 1;
+corrupt:
+    free(fns);
+    free(keys);
+    return 0;
+}
+
+// Adds the votes for a target from one run to those from earlier ones, which
+// keeps the majority (if there is one) over all of them
+static void add_votes(SiteProfile *site, char *target, uint64_t votes) {
+    if (site->target == target || site->votes == 0) {
+        site->target = target;
+        site->votes += votes;
+    } else if (site->votes >= votes) {
+        site->votes -= votes;
+    } else {
+        site->target = target;
+        site->votes = votes - site->votes;
+    }
+}
+
+// Returns NULL if the file can't be read in full
+static Profile * read_profile(char *path, struct stat *st) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+    Buf *b = buf_new();
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        buf_nprint(b, chunk, n);
+    }
+    int failed = ferror(f) || b->len != (size_t) st->st_size;
+    fclose(f);
+    if (failed) { // e.g., it's being written by a run at the same time
+        buf_free(b);
+        return NULL;
+    }
+    Profile *p = calloc(1, sizeof(Profile));
+    p->mtime = (int64_t) st->st_mtime;
+    p->size = (int64_t) st->st_size;
+    p->fns = map_new();
+    Reader r = { b->data, b->data + b->len };
+    Vec *raw = vec_new();
+    Map *addrs = map_new();
+    while (r.p < r.end && read_record(&r, p, raw, addrs)) {}
+    for (size_t i = 0; i < vec_len(raw); i++) {
+        RawSite *site = vec_get(raw, i);
+        // A target that isn't known votes against the others, and if it wins
+        // there's no target for the call to be promoted to
+        if (site->votes > 0) {
+            add_votes(site->site, map_get(addrs, addr_key(site->pid, site->addr)), site->votes);
+        }
+        free(site);
+    }
+    vec_free(raw);
+    map_free(addrs);
+    buf_free(b);
+    return p;
+}
+
+// The profile is read once and shared by every file (and kept for the
+// compile server's later jobs, unless the file's changed)
+static Profile * get_profile() {
+    struct stat st;
+    if (stat(PROFILE_PATH, &st) != 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&PROFILE_LOCK);
+    Profile *p = PROFILE;
+    if (!p || strcmp(PROFILE_READ_PATH, PROFILE_PATH) != 0 ||
+            p->mtime != (int64_t) st.st_mtime || p->size != (int64_t) st.st_size) {
+        p = PROFILE = read_profile(PROFILE_PATH, &st); // The old one's leaked
+        PROFILE_READ_PATH = PROFILE_PATH;
+    }
+    pthread_mutex_unlock(&PROFILE_LOCK);
+    if (!p) {
+        error("can't read profile '%s'", PROFILE_PATH);
+    }
+    return p;
+}
+
+// The function a target's key is for, if a call in this file can go to it
+// directly. One in another file is declared, unless it's 'static'
+static Global * find_target(Vec *globals, char *key, char *file_name) {
+    Global *decl = NULL;
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if ((g->k == G_FN_DEF || g->k == G_NONE) && fn_key(g, file_name) == key) {
+            if (g->k == G_FN_DEF) {
+                return g;
+            }
+            decl = g;
+        }
+    }
+    if (decl || strchr(key, ':')) {
+        return decl;
+    }
+    return new_global(globals, key, irt_scalar(IRT_PTR), G_NONE, LINK_EXTERN);
+}
+
+// Turns 'call', in its own BB, into
+//   condbr fn == target, direct, indirect
+//   direct: call target(...); br join
+//   indirect: call fn(...); br join
+//   join: phi(direct, indirect)
+// so the inliner can then inline the call in 'direct'
+static void promote_call(Fn *fn, IrIns *call, Global *target, int64_t hits) {
+    BB *bb = call->bb, *direct = new_bb(), *indirect = new_bb(), *join = new_bb();
+    IrIns *last_carg = call;
+    while (last_carg->next && last_carg->next->op == IR_CARG) {
+        last_carg = last_carg->next;
+    }
+    while (last_carg->next) { // The rest of the BB goes after the call
+        IrIns *ins = last_carg->next;
+        delete_ir(ins);
+        append_ir(join, ins);
+    }
+    for (IrIns *ins = call, *next; ins; ins = next) { // The call and its IR_CARGs
+        next = ins->next;
+        delete_ir(ins);
+        append_ir(indirect, ins);
+    }
+    IrIns *direct_fn = emit_global(direct, target);
+    IrIns *direct_call = append_ir(direct, new_ins(IR_CALL, call->t));
+    direct_call->fn = direct_fn;
+    direct_call->is_vararg = call->is_vararg;
+    direct_call->line = call->line;
+    for (IrIns *carg = call->next; carg && carg->op == IR_CARG; carg = carg->next) {
+        IrIns *copy = append_ir(direct, new_ins(IR_CARG, carg->t));
+        copy->arg = carg->arg;
+        copy->line = carg->line;
+    }
+    emit_br(direct, join);
+    emit_br(indirect, join);
+    IrIns *hot = emit_global(bb, target);
+    emit_condbr(bb, IR_EQ, call->fn, hot, direct, indirect)->likely = 1;
+
+    direct->prev = bb;
+    direct->next = indirect;
+    indirect->prev = direct;
+    indirect->next = join;
+    join->prev = indirect;
+    join->next = bb->next;
+    if (bb->next) {
+        bb->next->prev = join;
+    } else {
+        fn->last = join;
+    }
+    bb->next = direct;
+    int64_t total = bb->freq;
+    direct->freq = hits;
+    indirect->freq = total - hits;
+    join->freq = total;
+
+    IrIns *phi = NULL;
+    if (call->t->k != IRT_VOID) {
+        phi = new_ins(IR_PHI, call->t);
+        phi->preds = vec_new();
+        phi->defs = vec_new();
+        vec_push(phi->preds, direct);
+        vec_push(phi->defs, direct_call);
+        vec_push(phi->preds, indirect);
+        vec_push(phi->defs, call);
+        if (join->ir_head) {
+            insert_ir(phi, join->ir_head);
+        } else {
+            append_ir(join, phi);
+        }
+    }
+    for (BB *b = fn->entry; b; b = b->next) { // bb's successors now come from join
+        for (IrIns *ins = b->ir_head; ins; ins = ins->next) {
+            if (ins == phi) {
+                continue;
+            } else if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->preds); i++) {
+                    if (vec_get(ins->preds, i) == bb) {
+                        vec_put(ins->preds, i, join);
+                    }
+                    if (phi && vec_get(ins->defs, i) == call) {
+                        vec_put(ins->defs, i, phi);
+                    }
+                }
+            } else if (phi) {
+                IrIns **oprs[3];
+                int n = ir_operands(ins, oprs);
+                for (int i = 0; i < n; i++) {
+                    if (*oprs[i] == call) {
+                        *oprs[i] = phi;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// A call whose target had at least 3/4 of the calls (i.e., more than half
+// the calls outvoted the rest) becomes a direct call to it, behind a check
+static void promote_calls(Vec *globals, Global *g, FnProfile *fp, char *file_name) {
+    Vec *calls = vec_new();
+    for (BB *bb = g->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (is_indirect_call(ins)) {
+                vec_push(calls, ins);
+            }
+        }
+    }
+    for (size_t i = 0; i < vec_len(calls); i++) {
+        IrIns *call = vec_get(calls, i);
+        SiteProfile *site = &fp->sites[i];
+        int64_t total = call->bb->freq;
+        if (!site->target || total <= 0 || site->votes * 2 < (uint64_t) total) {
+            continue;
+        }
+        Global *target = find_target(globals, site->target, file_name);
+        if (target) {
+            int64_t hits = (total + (int64_t) site->votes) / 2;
+            promote_call(g->fn, call, target, hits < total ? hits : total);
+        }
+    }
+    vec_free(calls);
+}
+
+void attach_profile(Vec *globals, char *file_name) {
+    Profile *p = get_profile();
+    if (!p) {
+        return;
+    }
+    int64_t hot_freq = (int64_t) (p->max / HOT_FRACTION);
+    hot_freq = hot_freq > 0 ? hot_freq : 1;
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k != G_FN_DEF) {
+            continue;
+        }
+        FnProfile *fp = map_get(p->fns, fn_key(g, file_name));
+        size_t num_bbs;
+        if (!fp || cfg_checksum(g->fn, &num_bbs) != fp->checksum ||
+                num_bbs != fp->num_bbs) {
+            continue;
+        }
+        for (BB *bb = g->fn->entry; bb; bb = bb->next) {
+            bb->freq = (int64_t) fp->counts[bb->n];
+        }
+        g->fn->hot_freq = hot_freq;
+        if (!PROFILE_GENERATE && count_sites(g->fn) == fp->num_sites) {
+            promote_calls(globals, g, fp, file_name); // Changes the CFG, which
+                                                      // 'instrument' mustn't see
+        }
+    }
+}
+
+
+// ---- Sampled Profile -------------------------------------------------------
+
+typedef struct {
+    int line;
+    uint64_t count;
+} LineCount;
+
+typedef struct {
+    Vec *raw;          // of 'LineCount *', as read
+    LineCount *lines;  // Sorted by line, one each
+    size_t num_lines;
+} SampleFn;
+
+typedef struct {
+    int64_t mtime, size; // Of the file when it was read
+    Map *fns;            // of 'SampleFn *', by function name
+    uint64_t max;        // Largest count
+} SampleProfile;
+
+static SampleProfile *SAMPLE_PROFILE;
+static char *SAMPLE_PROFILE_READ_PATH; // Of 'SAMPLE_PROFILE'
+static pthread_mutex_t SAMPLE_PROFILE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static int cmp_lines(const void *a, const void *b) {
+    LineCount *l = *(LineCount **) a, *r = *(LineCount **) b;
+    return (l->line > r->line) - (l->line < r->line);
+}
+
+// Sorts a function's lines, adding up the counts for the same one
+static void sort_lines(SampleProfile *p, SampleFn *sf) {
+    size_t n = vec_len(sf->raw);
+    qsort(sf->raw->data, n, sizeof(LineCount *), cmp_lines);
+    sf->lines = calloc(n, sizeof(LineCount));
+    for (size_t i = 0; i < n; i++) {
+        LineCount *lc = vec_get(sf->raw, i);
+        if (sf->num_lines == 0 || sf->lines[sf->num_lines - 1].line != lc->line) {
+            sf->lines[sf->num_lines++] = (LineCount) { .line = lc->line };
+        }
+        LineCount *merged = &sf->lines[sf->num_lines - 1];
+        merged->count += lc->count;
+        if (merged->count > p->max) {
+            p->max = merged->count;
+        }
+        free(lc);
+    }
+    vec_free(sf->raw);
+    sf->raw = NULL;
+}
+
+// A malformed line is skipped, rather than throwing out the whole profile
+static SampleProfile * read_sample_profile(char *path, struct stat *st) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return NULL;
+    }
+    SampleProfile *p = calloc(1, sizeof(SampleProfile));
+    p->mtime = (int64_t) st->st_mtime;
+    p->size = (int64_t) st->st_size;
+    p->fns = map_new();
+    Vec *fns = vec_new();
+    char line[1024], name[512];
+    while (fgets(line, sizeof(line), f)) {
+        int src_line;
+        unsigned long long count;
+        if (line[0] == '#' ||
+                sscanf(line, "%511s %d %llu", name, &src_line, &count) != 3 || src_line <= 0) {
+            continue;
+        }
+        char *key = intern(name);
+        SampleFn *sf = map_get(p->fns, key);
+        if (!sf) {
+            sf = calloc(1, sizeof(SampleFn));
+            sf->raw = vec_new();
+            map_put(p->fns, key, sf);
+            vec_push(fns, sf);
+        }
+        LineCount *lc = malloc(sizeof(LineCount));
+        lc->line = src_line;
+        lc->count = count;
+        vec_push(sf->raw, lc);
+    }
+    fclose(f);
+    for (size_t i = 0; i < vec_len(fns); i++) {
+        sort_lines(p, vec_get(fns, i));
+    }
+    vec_free(fns);
+    return p;
+}
+
+static SampleProfile * get_sample_profile() {
+    struct stat st;
+    if (stat(PROFILE_SAMPLE_PATH, &st) != 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&SAMPLE_PROFILE_LOCK);
+    SampleProfile *p = SAMPLE_PROFILE;
+    if (!p || strcmp(SAMPLE_PROFILE_READ_PATH, PROFILE_SAMPLE_PATH) != 0 ||
+            p->mtime != (int64_t) st.st_mtime || p->size != (int64_t) st.st_size) {
+        // The old one's leaked
+        p = SAMPLE_PROFILE = read_sample_profile(PROFILE_SAMPLE_PATH, &st);
+        SAMPLE_PROFILE_READ_PATH = PROFILE_SAMPLE_PATH;
+    }
+    pthread_mutex_unlock(&SAMPLE_PROFILE_LOCK);
+    return p;
+}
+
+static uint64_t line_count(SampleFn *sf, int line) {
+    size_t lo = 0, hi = sf->num_lines;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (sf->lines[mid].line < line) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < sf->num_lines && sf->lines[lo].line == line ? sf->lines[lo].count : 0;
+}
+
+// The symbol's name, without the label's leading underscore; a 'static'
+// function is looked for under 'file:name' first
+static SampleFn * find_sample_fn(SampleProfile *p, Global *g, char *file_name) {
+    char *name = &g->label[1];
+    SampleFn *sf = NULL;
+    if (g->linkage == LINK_STATIC) {
+        Buf *b = buf_new();
+        buf_printf(b, "%s:%s", file_name, name);
+        sf = map_get(p->fns, intern(b->data));
+        buf_free(b);
+    }
+    return sf ? sf : map_get(p->fns, intern(name));
+}
+
+static int64_t sum_freqs(Vec *bbs) {
+    int64_t sum = 0;
+    for (size_t i = 0; i < vec_len(bbs); i++) {
+        BB *bb = vec_get(bbs, i);
+        if (bb->freq < 0) {
+            return -1;
+        }
+        sum += bb->freq;
+    }
+    return sum;
+}
+
+static int has_only_succ(Vec *preds) {
+    for (size_t i = 0; i < vec_len(preds); i++) {
+        if (vec_len(((BB *) vec_get(preds, i))->succ) != 1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int has_only_pred(Vec *succs) {
+    for (size_t i = 0; i < vec_len(succs); i++) {
+        if (vec_len(((BB *) vec_get(succs, i))->pred) != 1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// A BB without any lines ran as often as all its predecessors put together if
+// it's the only successor of each of them, and likewise for its successors
+static void infer_freqs(Fn *fn) {
+    analyse_cfg(fn);
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (BB *bb = fn->entry; bb; bb = bb->next) {
+            if (bb->freq >= 0) {
+                continue;
+            }
+            int64_t freq = -1;
+            if (vec_len(bb->pred) > 0 && has_only_succ(bb->pred)) {
+                freq = sum_freqs(bb->pred);
+            }
+            if (freq < 0 && vec_len(bb->succ) > 0 && has_only_pred(bb->succ)) {
+                freq = sum_freqs(bb->succ);
+            }
+            if (freq >= 0) {
+                bb->freq = freq;
+                changed = 1;
+            }
+        }
+    }
+}
+
+void attach_sample_profile(Vec *globals, char *file_name) {
+    SampleProfile *p = get_sample_profile();
+    if (!p) {
+        return;
+    }
+    int64_t hot_freq = (int64_t) (p->max / HOT_FRACTION);
+    hot_freq = hot_freq > 0 ? hot_freq : 1;
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        SampleFn *sf = g->k == G_FN_DEF ? find_sample_fn(p, g, file_name) : NULL;
+        if (!sf) {
+            continue;
+        }
+        for (BB *bb = g->fn->entry; bb; bb = bb->next) {
+            bb->freq = -1;
+            for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+                if (ins->line <= 0 || ins->op == IR_BR || ins->op == IR_PHI) {
+                    continue; // Jumps and phis take the line of the statement
+                              // they end or join, not of the code before them
+                }
+                int64_t count = (int64_t) line_count(sf, ins->line);
+                bb->freq = count > bb->freq ? count : bb->freq;
+            }
+        }
+        infer_freqs(g->fn);
+        g->fn->hot_freq = hot_freq;
+    }
+}
+
+int is_cold(BB *bb) {
+    return bb->freq == 0;
+}
+
+int is_hot(Fn *fn, BB *bb) {
+    return fn->hot_freq > 0 && bb->freq >= fn->hot_freq;
+}
@@ -0,0 +1,54 @@
+
+#ifndef COSEC_PROFILE_H
+#define COSEC_PROFILE_H
+
+#include "compile.h"
+
+// Profile-guided optimisation. '-fprofile-generate' adds a counter to every
+// BB of every function, and records where each call through a function
+// pointer goes; the program writes the counts to 'PROFILE_PATH' when it exits
+// (appending, so several runs add up). '-fprofile-use' reads them back into
+// 'BB.freq' when the program's compiled again, for block placement (see
+// 'layout.h'), inlining, unrolling, and spill costs. An indirect call that
+// mostly goes to one function is promoted to a direct call to it, behind a
+// check that the pointer is that function, so it can be inlined.
+//
+// Both run straight after 'compile', before anything's changed the CFG, so
+// the counts line up with the BBs they were taken from. Each function's
+// counts are stored with a checksum of its CFG, and ignored if the function
+// has changed since. A 'static' function is told apart from one with the same
+// name in another file by the name of its file, which has to be the same when
+// compiling with the profile as it was when taking it
+//
+// '-fprofile-sample-use' reads a sampled profile instead (e.g., from 'perf
+// record' on a build with '-g'), which costs the program nothing to take. It's
+// text, one sample count per line:
+//   <function> <line> <count>
+// where the function is its symbol's name ('file:name' for a 'static' one in
+// a file with other functions of the same name; see above), and the line is
+// in the file the function's defined in. Lines starting with '#' are ignored,
+// and counts for the same line add up. Each instruction records its line (as
+// with '-g'), and a BB's count is the largest of its lines'; one without any
+// (e.g., an empty BB where the arms of an 'if' join) gets its count from its
+// neighbours where it can
+extern int PROFILE_GENERATE, PROFILE_USE;
+extern char *PROFILE_PATH; // Default 'cosec.profdata'
+extern char *PROFILE_SAMPLE_PATH; // NULL without '-fprofile-sample-use'
+
+// Adds the counters, and the code to write them out
+void instrument(Vec *globals, char *file_name);
+
+// Sets 'freq' on each BB (and 'hot_freq' on each function) that there are
+// counts for, and promotes indirect calls (unless also '-fprofile-generate',
+// which needs the CFG as it was compiled)
+void attach_profile(Vec *globals, char *file_name);
+
+// The same for a sampled profile (which has no indirect call targets)
+void attach_sample_profile(Vec *globals, char *file_name);
+
+// Whether the profile says a BB never ran, or ran often. A BB without counts
+// (e.g., one added by an optimisation) is neither
+int is_cold(BB *bb);
+int is_hot(Fn *fn, BB *bb);
+
+#endif
@@ -1,9 +1,14 @@
 
 #include <stdlib.h>
+#include <math.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "reg_alloc.h"
 #include "encode.h"
+#include "analysis.h"
+#include "stats.h"
+#include "target.h"
 
 // The register allocator is based on the classic graph colouring algorithm
 // presented in Modern Parser Implementation in C, Andrew W. Appel, Chapter 11.
@@ -31,44 +36,71 @@ typedef struct RegAlloc { // Allocator for a register group (GPR or SSE)
     int group;
     int num_regs; // pregs + vregs
     int num_pregs;
+    size_t num_words; // Size of a bit set of regs, in 'uint64_t's
+    double *spill_costs; // Per reg; lowest (relative to degree) is spilled first
+    AsmIns **remat;      // Per reg; its only def, if it can be re-emitted at
+                         // each use instead of being spilled to the stack
+    uint64_t **live_in, **live_out; // Per BB (by 'bb->n'); bit sets of regs
+    size_t num_live_bbs;            // That 'live_in' and 'live_out' hold
+    Vec **live_ranges; // Per reg; kept between rounds that only spill, along
+    Graph *ig;         // with the interference graph (see 'update_live_ranges')
+    int num_ranges;    // Regs that 'live_ranges' holds
+    Vec *spill_temps;  // of 'SpillTemp *'; the last round's spill code
+    uint64_t *temps;   // Bit set of every vreg that spilling has made (see
+    size_t temp_words; // 'is_spill_temp'), of 'temp_words' words
+    size_t ig_edges, coalesced, spills, reloads, remats; // For '--codegen-stats'
     int debug;
 } RegAlloc;
 
+// Spilling adds new vregs to the function, so this is called again after
+static void update_num_regs(RegAlloc *a) {
+    a->num_regs = (a->group == REG_GROUP_GPR) ? a->fn->num_gprs : a->fn->num_sse;
+    a->num_words = BITS_WORDS(a->num_regs);
+}
+
 static RegAlloc * new_reg_alloc(Fn *fn, int reg_group, int debug) {
     RegAlloc *a = malloc(sizeof(RegAlloc));
     a->fn = fn;
     a->group = reg_group;
-    if (reg_group == REG_GROUP_GPR) {
-        a->num_regs = fn->num_gprs;
-        a->num_pregs = LAST_GPR;
-    } else { // SSE
-        a->num_regs = fn->num_sse;
-        a->num_pregs = LAST_XMM;
-    }
+    a->num_pregs = (reg_group == REG_GROUP_GPR) ? TARGET->num_gprs : TARGET->num_fprs;
+    assert(a->num_pregs <= 64); // All pregs fit in the first word of a bit set
+    update_num_regs(a);
+    a->spill_costs = NULL;
+    a->remat = NULL;
+    a->live_in = a->live_out = NULL;
+    a->num_live_bbs = 0;
+    a->live_ranges = NULL;
+    a->ig = NULL;
+    a->num_ranges = 0;
+    a->spill_temps = vec_new();
+    a->temps = NULL;
+    a->temp_words = 0;
+    a->ig_edges = a->coalesced = a->spills = a->reloads = a->remats = 0;
     a->debug = debug;
     return a;
 }
 
-
-// ---- Control Flow Graph Analysis -------------------------------------------
-
-static void add_pair(BB *before, BB *after) {
-    vec_push(before->succ, after);
-    vec_push(after->pred, before);
+static void free_live_in_out(RegAlloc *a) {
+    for (size_t i = 0; i < a->num_live_bbs; i++) {
+        free(a->live_in[i]);
+        free(a->live_out[i]);
+    }
+    free(a->live_in);
+    free(a->live_out);
+    a->live_in = a->live_out = NULL;
+    a->num_live_bbs = 0;
 }
 
-// Populates predecessor and successor basic blocks for each basic block in the
-// function
-static void cfg_analysis(Fn *fn) {
-    for (BB *bb = fn->entry; bb; bb = bb->next) {
-        IrIns *last = bb->ir_last;
-        if (last && last->op == IR_BR) { // Unconditional jump
-            add_pair(bb, last->br); // One successor
-        } else if (last && last->op == IR_CONDBR) { // Conditional jump
-            add_pair(bb, last->true); // Two successors
-            add_pair(bb, last->false);
-        } // Otherwise, no successors
-    }
+static void free_live_ranges(RegAlloc *a);
+
+static void free_reg_alloc(RegAlloc *a) {
+    free_live_in_out(a);
+    free_live_ranges(a);
+    vec_free(a->spill_temps);
+    free(a->temps);
+    free(a->spill_costs);
+    free(a->remat);
+    free(a);
 }
 
 
@@ -76,202 +108,447 @@ static void cfg_analysis(Fn *fn) {
 
 typedef struct {
     size_t start, end;
+    int single; // Live at only 'start' (see 'live_ranges_for_fn')
 } Interval;
 
 static Interval * new_interval(size_t start, size_t end) {
     Interval *in = malloc(sizeof(Interval));
     in->start = start;
     in->end = end;
+    in->single = 0;
     return in;
 }
 
+// Intervals are half-open: a reg is free for reuse at the program point where
+// its last use is, so that (e.g.) 'mov v2, v1' doesn't make v1 and v2 interfere
 static int intervals_intersect(Interval *a, Interval *b) {
-    return !((a->end - 1) < b->start || a->start > (b->end - 1));
+    return a->start < b->end && b->start < a->end;
 }
 
+// Live ranges are sorted, non-overlapping lists of intervals, so we just walk
+// along both at the same time
 static int ranges_intersect(Vec *a, Vec *b) {
-    for (size_t i = 0; i < vec_len(a); i++) {
+    size_t i = 0, j = 0;
+    while (i < vec_len(a) && j < vec_len(b)) {
         Interval *aa = vec_get(a, i);
-        for (size_t j = 0; j < vec_len(b); j++) {
-            Interval *bb = vec_get(b, j);
-            if (intervals_intersect(aa, bb)) {
-                return 1;
-            }
+        Interval *bb = vec_get(b, j);
+        if (intervals_intersect(aa, bb)) {
+            return 1;
+        }
+        if (aa->end <= bb->end) { // Whichever finishes first can't intersect
+            i++;                  // anything else
+        } else {
+            j++;
         }
     }
     return 0;
 }
 
-static void mark_idx_live(Vec *live_range, size_t idx) {
-    for (size_t i = 0; i < vec_len(live_range); i++) {
-        Interval *in = vec_get(live_range, i);
-        if (idx >= in->start && idx <= in->end) {
-            return; // Already inside an interval
-        } else if (idx == in->start - 1) {
-            in->start--; // Right before an existing interval
-            return;
-        } else if (idx == in->end + 1) {
-            in->end++; // Right after an existing interval
-            return;
+
+// ---- Liveness Analysis -----------------------------------------------------
+
+// The pregs in 'a''s group that are clobbered by a call to an unknown function
+static uint64_t caller_saved(RegAlloc *a) {
+    uint64_t regs = 0;
+    for (int preg = 1; preg < a->num_pregs; preg++) { // 0 is R_NONE
+        if (a->group == REG_GROUP_SSE || (TARGET->clobbers(TARGET->call) >> preg & 1)) {
+            regs |= (uint64_t) 1 << preg;
         }
     }
-    Interval *in = new_interval(idx, idx);
-    vec_push(live_range, in);
+    return regs;
+}
+
+// The pregs in 'a''s group that 'ins' clobbers besides its operands. A call
+// to a function that's already been allocated only clobbers what that
+// function's code writes (see 'order_by_calls'). There are no callee-saved
+// SSE regs, so other calls clobber all of them
+static uint64_t implicit_clobbers(RegAlloc *a, AsmIns *ins) {
+    Fn *callee = ins->callee;
+    if (callee && callee->ra_level < a->fn->ra_level) {
+        return a->group == REG_GROUP_GPR ? callee->gpr_clobbers : callee->sse_clobbers;
+    }
+    if (a->group == REG_GROUP_SSE) {
+        return ins->op == TARGET->call || ins->op == TARGET->tail_call ? caller_saved(a) : 0;
+    }
+    return TARGET->clobbers(ins->op);
 }
 
+// A call that clobbers every caller-saved preg, which anything live across it
+// has to be kept out of (see 'split_around_calls')
+static int clobbers_all(RegAlloc *a, AsmIns *ins) {
+    uint64_t all = caller_saved(a);
+    return ins->op == TARGET->call && (implicit_clobbers(a, ins) & all) == all;
+}
 
-// ---- Liveness Analysis -----------------------------------------------------
+// Returns the 'i'th preg to try (starting from 0), or R_NONE after the last,
+// in the target's order (see 'target.c')
+static int nth_preg(RegAlloc *a, int i) {
+    return a->group == REG_GROUP_GPR ? TARGET->gpr_order[i] : TARGET->fpr_order[i];
+}
 
-// Instructions that define their left operand
-static int X64_DEFS_LEFT[X64_LAST] = {
-    [X64_MOV] = 1, [X64_MOVSX] = 1, [X64_MOVZX] = 1, [X64_MOVSS] = 1,
-    [X64_MOVSD] = 1, [X64_LEA] = 1,
-    [X64_ADD] = 1, [X64_SUB] = 1, [X64_IMUL] = 1, [X64_AND] = 1, [X64_OR] = 1,
-    [X64_XOR] = 1, [X64_SHL] = 1, [X64_SHR] = 1, [X64_SAR] = 1,
-    [X64_ADDSS] = 1, [X64_ADDSD] = 1, [X64_SUBSS] = 1, [X64_SUBSD] = 1,
-    [X64_MULSS] = 1, [X64_MULSD] = 1, [X64_DIVSS] = 1, [X64_DIVSD] = 1,
-    [X64_SETE] = 1, [X64_SETNE] = 1, [X64_SETL] = 1, [X64_SETLE] = 1,
-    [X64_SETG] = 1, [X64_SETGE] = 1, [X64_SETB] = 1, [X64_SETBE] = 1,
-    [X64_SETA] = 1, [X64_SETAE] = 1,
-    [X64_CVTSS2SD] = 1, [X64_CVTSD2SS] = 1, [X64_CVTSI2SS] = 1,
-    [X64_CVTSI2SD] = 1, [X64_CVTTSS2SI] = 1, [X64_CVTTSD2SI] = 1,
-    [X64_POP] = 1,
-};
+// Sets of regs are stored as bit sets, 'a->num_words' long
+static uint64_t * regs_new(RegAlloc *a) {
+    return bits_new(a->num_words);
+}
 
-// Some instructions clobber GPRs that aren't explicitly used as arguments
-// (e.g., 'call' clobbers the caller-saved registers)
-static int CLOBBERS[X64_LAST][LAST_GPR] = {
-    [X64_CWD]  = { [RDX] = 1, },
-    [X64_CDQ]  = { [RDX] = 1, },
-    [X64_CQO]  = { [RDX] = 1, },
-    [X64_IDIV] = { [RAX] = 1, [RDX] = 1, },
-    [X64_DIV]  = { [RAX] = 1, [RDX] = 1, },
-    [X64_CALL] = { [RAX] = 1, [RDI] = 1, [RSI] = 1, [RDX] = 1, [RCX] = 1,
-                   [R8] = 1, [R9] = 1, [R10] = 1, [R11] = 1, },
-};
+static int has_reg(uint64_t *regs, int reg) {
+    return bits_has(regs, (size_t) reg);
+}
 
-static void mark_opr_live(RegAlloc *a, AsmOpr *opr, int *live) {
+static void put_reg(uint64_t *regs, int reg) {
+    bits_put(regs, (size_t) reg);
+}
+
+static int is_spill_temp(RegAlloc *a, int reg) {
+    return (size_t) reg < a->temp_words * 64 && has_reg(a->temps, reg);
+}
+
+static void remove_reg(uint64_t *regs, int reg) {
+    bits_remove(regs, (size_t) reg);
+}
+
+static void clear_pregs(RegAlloc *a, uint64_t *regs) {
+    regs[0] &= ~(((uint64_t) 1 << a->num_pregs) - 1);
+}
+
+static int is_group_reg(RegAlloc *a, AsmOpr *opr) {
+    return opr->k == (a->group == REG_GROUP_GPR ? OPR_GPR : OPR_XMM);
+}
+
+static void mark_opr_used(RegAlloc *a, AsmOpr *opr, uint64_t *use) {
     if (!opr) return;
-    if (a->group == REG_GROUP_GPR) {
-        if (opr->k == OPR_GPR) {
-            live[opr->reg] = 1;
-        } else if (opr->k == OPR_MEM) {
-            if (opr->base) live[opr->base] = 1;
-            if (opr->idx)  live[opr->idx] = 1;
-        }
-    } else {
-        if (opr->k == OPR_XMM) {
-            live[opr->reg] = 1;
-        }
+    if (is_group_reg(a, opr)) {
+        put_reg(use, opr->reg);
+    } else if (a->group == REG_GROUP_GPR && opr->k == OPR_MEM) {
+        if (opr->base) put_reg(use, opr->base);
+        if (opr->idx)  put_reg(use, opr->idx);
     }
 }
 
-static void mark_live(RegAlloc *a, AsmIns *ins, int *live) {
-    mark_opr_live(a, ins->l, live); // Mark regs used in ins args as live
-    mark_opr_live(a, ins->r, live);
-    if (a->group == REG_GROUP_GPR) {
-        // Mark rsp, rbp live for every instruction
-        live[RSP] = 1;
-        live[RBP] = 1;
-
-        // Some instructions clobber pregs not explicitly used as arguments
-        for (int preg = 0; preg < a->num_pregs; preg++) {
-            if (CLOBBERS[ins->op][preg]) {
-                live[preg] = 1;
-            }
+static void mark_clobbers_used(RegAlloc *a, AsmBlock *b, uint64_t *use) {
+    uint32_t clobbers = a->group == REG_GROUP_GPR ?
+        b->inline_asm->clobbers : b->inline_asm->sse_clobbers;
+    for (int i = 0; i < 16; i++) {
+        if (clobbers & (1u << i)) {
+            put_reg(use, (a->group == REG_GROUP_GPR ? RAX : XMM0) + i);
         }
     }
 }
 
-static int live_ranges_for_bb(RegAlloc *a, BB *bb, Vec **live_ranges) {
-    // Tracks which regs are live at the current program point
-    int *live = calloc(a->num_regs, sizeof(int));
-
-    // Live-out is union of live-in over all successors
-    for (size_t i = 0; i < vec_len(bb->succ); i++) {
-        BB *succ = vec_get(bb->succ, i);
-        for (int reg = 0; reg < a->num_regs; reg++) {
-            live[reg] |= succ->live_in[reg];
+// Everything in an inline assembly block is used at both its X64_ASM_CLOBBER
+// and the X64_ASM itself, so that no input shares a reg with a clobber or an
+// early clobber output (defined at the X64_ASM_CLOBBER). Other outputs are
+// defined at the X64_ASM, so can share a reg with an input that dies there
+static int asm_use_def(RegAlloc *a, AsmIns *ins, uint64_t *use, int *defs) {
+    AsmBlock *b = ins->block;
+    int at_block = ins->op == X64_ASM, num_defs = 0;
+    for (int i = 0; i < b->inline_asm->num_oprs; i++) {
+        AsmOpr *opr = b->oprs[i];
+        int access = b->access[i];
+        mark_opr_used(a, b->fixed[i], use);
+        if (!is_group_reg(a, opr) || (access & ASM_READ)) {
+            mark_opr_used(a, opr, use);
+            continue;
+        }
+        int early = (access & ASM_EARLY) != 0;
+        if (at_block || early) {
+            put_reg(use, opr->reg);
+        }
+        if (at_block != early) { // Defined here
+            defs[num_defs++] = opr->reg;
         }
     }
+    mark_clobbers_used(a, b, use);
+    return num_defs;
+}
 
-    // Mark everything live-out as live for the program point BEYOND the last
-    // instruction in the BB
-    for (int reg = 0; reg < a->num_regs; reg++) {
-        if (live[reg]) {
-            mark_idx_live(live_ranges[reg], bb->asm_last->n + 1);
+// Every reg that appears in an instruction is live at that instruction (even
+// one it defines, so that a def always occupies its reg for at least a program
+// point). Fills in the regs that are defined (and so are dead before the
+// instruction) and returns how many there are
+static int ins_use_def(RegAlloc *a, AsmIns *ins, uint64_t *use, int *defs) {
+    mark_opr_used(a, ins->l, use); // Mark regs used in ins args as live
+    mark_opr_used(a, ins->r, use);
+    mark_opr_used(a, ins->r2, use);
+    if (a->group == REG_GROUP_GPR) {
+        // Mark the stack and frame pointers live for every instruction (the
+        // frame pointer's free for allocation if it's omitted)
+        put_reg(use, TARGET->sp);
+        if (!omits_frame_ptr(a->fn)) {
+            put_reg(use, TARGET->fp);
         }
+
+    }
+    // Some instructions clobber pregs not explicitly used as arguments
+    use[0] |= implicit_clobbers(a, ins);
+    if (ins->op == X64_ASM || ins->op == X64_ASM_CLOBBER) {
+        return asm_use_def(a, ins, use, defs);
+    }
+    // Instructions like 'add' read their left operand too, so it's still live
+    // before them
+    if (ins->l && is_group_reg(a, ins->l) && TARGET->only_defs_left(ins)) {
+        defs[0] = ins->l->reg;
+        return 1;
     }
+    return 0;
+}
 
-    // Instructions in reverse
+// Computes the regs used before being defined in a BB ('gen'), and the regs
+// defined in a BB ('kill'); pregs are never live across instructions, so are
+// left out of both
+static void use_def_for_bb(RegAlloc *a, BB *bb, uint64_t *gen, uint64_t *kill) {
+    uint64_t use[a->num_words];
     for (AsmIns *ins = bb->asm_last; ins; ins = ins->prev) {
-        mark_live(a, ins, live);
+        memset(use, 0, sizeof(uint64_t) * a->num_words);
+        int defs[MAX_ASM_OPRS];
+        int num_defs = ins_use_def(a, ins, use, defs);
+        bits_or(gen, use, a->num_words);
+        for (int i = 0; i < num_defs; i++) {
+            remove_reg(gen, defs[i]);
+            put_reg(kill, defs[i]);
+        }
+    }
+    clear_pregs(a, gen);
+    clear_pregs(a, kill);
+}
+
+// Standard backwards dataflow over the bit sets, until a fixed point:
+//   live_out(bb) = union of live_in(succ) over all successors
+//   live_in(bb)  = gen(bb) | (live_out(bb) & ~kill(bb))
+static void live_in_out_for_fn(RegAlloc *a, Vec *bbs) {
+    size_t num_bbs = vec_len(bbs);
+    uint64_t *gen = bits_new(num_bbs * a->num_words);
+    uint64_t *kill = bits_new(num_bbs * a->num_words);
+    free_live_in_out(a); // From the last round
+    a->num_live_bbs = num_bbs;
+    a->live_in = malloc(sizeof(uint64_t *) * num_bbs);
+    a->live_out = malloc(sizeof(uint64_t *) * num_bbs);
+    for (size_t i = 0; i < num_bbs; i++) {
+        BB *bb = vec_get(bbs, i);
+        assert(bb->n == i);
+        a->live_in[i] = regs_new(a);
+        a->live_out[i] = regs_new(a);
+        use_def_for_bb(a, bb, &gen[i * a->num_words], &kill[i * a->num_words]);
+    }
 
-        // Copy everything that's live here into 'live_ranges'
-        for (int reg = 0; reg < a->num_regs; reg++) {
-            if (live[reg]) {
-                mark_idx_live(live_ranges[reg], ins->n);
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (size_t i = num_bbs; i > 0; i--) { // Reverse order converges faster
+            BB *bb = vec_get(bbs, i - 1);
+            uint64_t *live_in = a->live_in[i - 1], *live_out = a->live_out[i - 1];
+            uint64_t *g = &gen[(i - 1) * a->num_words];
+            uint64_t *k = &kill[(i - 1) * a->num_words];
+            for (size_t w = 0; w < a->num_words; w++) {
+                uint64_t out = 0;
+                for (size_t j = 0; j < vec_len(bb->succ); j++) {
+                    BB *succ = vec_get(bb->succ, j);
+                    out |= a->live_in[succ->n][w];
+                }
+                uint64_t in = g[w] | (out & ~k[w]);
+                changed |= in != live_in[w];
+                live_out[w] = out;
+                live_in[w] = in;
             }
         }
+    }
+    free(gen);
+    free(kill);
+}
 
-        // Regs defined are no longer live before the program point
-        if (ins->l && ins->l->k == OPR_GPR && X64_DEFS_LEFT[ins->op]) {
-            live[ins->l->reg] = 0;
-        }
+// Adds the interval [start, end] to a reg's live range. Intervals are added
+// in decreasing order (and reversed once they're all built), so we only need
+// to check the last one for merging
+static void add_interval(Vec *live_range, size_t start, size_t end) {
+    Interval *last = vec_len(live_range) > 0 ? vec_tail(live_range) : NULL;
+    if (last && last->start <= end + 1) {
+        last->start = start;
+    } else {
+        vec_push(live_range, new_interval(start, end));
+    }
+}
 
-        // All pregs are live for only ONE instruction
-        for (int preg = 0; preg < a->num_pregs; preg++) {
-            live[preg] = 0;
+// Every reg that was live at program point 'idx + 1' (in 'prev') and isn't at
+// 'idx' (in 'live') has a run of liveness starting at 'idx + 1', and every reg
+// live at 'idx' that wasn't at 'idx + 1' has a run ending at 'idx'
+static void live_transitions(RegAlloc *a, uint64_t *prev, uint64_t *live,
+                             size_t idx, size_t *ends, Vec **live_ranges) {
+    for (size_t w = 0; w < a->num_words; w++) {
+        uint64_t diff = prev[w] ^ live[w];
+        while (diff) {
+            int bit = __builtin_ctzll(diff);
+            diff &= diff - 1;
+            int reg = (int) (w * 64) + bit;
+            if (has_reg(live, reg)) {
+                ends[reg] = idx; // Became live (going backwards)
+            } else {
+                add_interval(live_ranges[reg], idx + 1, ends[reg]);
+            }
         }
+        prev[w] = live[w];
     }
+}
 
-    // Everything left over is live-in for the BB
-    int changed = 0;
-    for (int reg = 0; reg < a->num_regs; reg++) {
-        if (live[reg]) {
-            changed |= !bb->live_in[reg];
-            bb->live_in[reg] = 1;
+// The pregs the function's arguments are passed in are set before its entry,
+// so (like a call's arguments; see 'implicit_uses') they're live from there
+// until they're read, by the moves for the IR_FARGs at the start of the entry
+// BB. Otherwise the reg for one argument (or its spill) could be given the
+// preg that a later one's still waiting in. Finds the last instruction that
+// reads each preg before anything writes it; 'reads' says which pregs have one
+static uint64_t find_arg_reads(RegAlloc *a, size_t *last_read) {
+    uint64_t reads = 0, written = 0;
+    for (AsmIns *ins = a->fn->entry->asm_head; ins; ins = ins->next) {
+        if (ins->op == TARGET->call || ins->op == TARGET->tail_call ||
+                ins->op == X64_ASM || ins->op == X64_ASM_CLOBBER) {
+            break; // The arguments have all been read by now
+        }
+        AsmOpr **oprs[MAX_INS_OPRS];
+        int num_oprs = ins_oprs(ins, oprs);
+        for (int i = 0; i < num_oprs; i++) {
+            AsmOpr *opr = *oprs[i];
+            if (!is_group_reg(a, opr) || opr->reg >= a->num_pregs) {
+                continue;
+            }
+            int is_def, is_use;
+            opr_use_def(ins, i, &is_def, &is_use);
+            if (is_use && !has_reg(&written, opr->reg)) {
+                put_reg(&reads, opr->reg);
+                last_read[opr->reg] = ins->n;
+            }
+            if (is_def) {
+                put_reg(&written, opr->reg);
+            }
         }
+        written |= implicit_clobbers(a, ins);
     }
-    return changed; // Return 1 if live-in for the BB was changed
+    return reads;
 }
 
+// With live-out known for every BB, a single backwards sweep over the function
+// builds the intervals for every reg in order
 static Vec ** live_ranges_for_fn(RegAlloc *a) {
+    Vec *bbs = vec_new(); // of 'BB *'
+    for (BB *bb = a->fn->entry; bb; bb = bb->next) {
+        vec_push(bbs, bb);
+    }
+    live_in_out_for_fn(a, bbs);
     Vec **live_ranges = malloc(sizeof(Vec *) * a->num_regs);
     for (int reg = 0; reg < a->num_regs; reg++) { // Alloc live ranges
         live_ranges[reg] = vec_new();
     }
-    for (BB *bb = a->fn->entry; bb; bb = bb->next) { // Alloc live-in for BBs
-        bb->live_in = calloc(a->num_regs, sizeof(int));
-    }
 
-    Vec *worklist = vec_new(); // of 'AsmBB *'
-    for (BB *bb = a->fn->entry; bb; bb = bb->next) { // Add all BBs
-        vec_push(worklist, bb);
+    // The program point at the end of each BB (see 'number_ins'); BBs can be
+    // empty, so this can't always be found from their last instruction
+    size_t num_bbs = vec_len(bbs);
+    size_t bb_end[num_bbs];
+    for (size_t i = 0, idx = 1; i < num_bbs; i++, idx += 2) {
+        BB *bb = vec_get(bbs, i);
+        if (bb->asm_last) {
+            idx = bb->asm_last->n + 1;
+        }
+        bb_end[i] = idx;
     }
 
-    while (vec_len(worklist) > 0) {
-        BB *bb = vec_pop(worklist); // Pop BBs in reverse order
-        if (live_ranges_for_bb(a, bb, live_ranges)) { // live-in changed?
-            for (size_t i = 0; i < vec_len(bb->pred); i++) { // Add predecessors
-                BB *pred = vec_get(bb->pred, i);
-                vec_push(worklist, pred);
+    size_t last_arg_read[a->num_pregs];
+    uint64_t arg_reads = find_arg_reads(a, last_arg_read);
+
+    size_t *ends = calloc(a->num_regs, sizeof(size_t)); // Last point of each run
+    uint64_t prev[a->num_words], live[a->num_words];
+    for (size_t i = num_bbs; i > 0; i--) {
+        BB *bb = vec_get(bbs, i - 1);
+
+        // Everything live-out is live for the program point BEYOND the last
+        // instruction in the BB
+        memset(prev, 0, sizeof(uint64_t) * a->num_words);
+        memcpy(live, a->live_out[bb->n], sizeof(uint64_t) * a->num_words);
+        live_transitions(a, prev, live, bb_end[i - 1], ends, live_ranges);
+
+        // Instructions in reverse
+        for (AsmIns *ins = bb->asm_last; ins; ins = ins->prev) {
+            int defs[MAX_ASM_OPRS];
+            int num_defs = ins_use_def(a, ins, live, defs);
+            live_transitions(a, prev, live, ins->n, ends, live_ranges);
+            for (int j = 0; j < num_defs; j++) { // Regs defined aren't live before the ins
+                remove_reg(live, defs[j]);
+            }
+            clear_pregs(a, live); // Pregs are live for only ONE instruction...
+            if (a->group == REG_GROUP_GPR) { // ...unless they're read implicitly
+                live[0] |= TARGET->implicit_uses(ins->op);
+            }
+            for (int preg = 0; bb == a->fn->entry && preg < a->num_pregs; preg++) {
+                if (has_reg(&arg_reads, preg) && ins->n <= last_arg_read[preg]) {
+                    put_reg(live, preg); // ...or hold an argument
+                }
+            }
+        }
+
+        // What's left is live-in, at the BB's entry point; then close
+        // everything that's still live at the start of the BB
+        size_t before = i > 1 ? bb_end[i - 2] : (size_t) -1;
+        live_transitions(a, prev, live, before + 1, ends, live_ranges);
+        memset(live, 0, sizeof(uint64_t) * a->num_words);
+        live_transitions(a, prev, live, before, ends, live_ranges);
+    }
+    free(ends);
+    vec_free(bbs);
+    for (int reg = 0; reg < a->num_regs; reg++) { // Sort in increasing order
+        Vec *range = live_ranges[reg];
+        for (size_t i = 0, j = vec_len(range); i + 1 < j; i++, j--) {
+            void *tmp = range->data[i];
+            range->data[i] = range->data[j - 1];
+            range->data[j - 1] = tmp;
+        }
+        for (size_t i = 0; i < vec_len(range); i++) {
+            // A reg live at only one point (e.g., a preg clobbered by a 'call',
+            // or a def that's never used) still occupies its reg there
+            Interval *in = vec_get(range, i);
+            if (in->start == in->end) {
+                in->end++;
+                in->single = 1;
             }
         }
     }
     return live_ranges;
 }
 
+static void free_range(Vec *range) {
+    for (size_t i = 0; i < vec_len(range); i++) {
+        free(vec_get(range, i));
+    }
+    vec_empty(range);
+}
+
+static void free_spill_temps(RegAlloc *a) {
+    for (size_t i = 0; i < vec_len(a->spill_temps); i++) {
+        free(vec_get(a->spill_temps, i));
+    }
+    vec_empty(a->spill_temps);
+}
+
+// Once the code changes other than by spilling, the next round starts over
+static void free_live_ranges(RegAlloc *a) {
+    for (int reg = 0; reg < a->num_ranges; reg++) {
+        free_range(a->live_ranges[reg]);
+        vec_free(a->live_ranges[reg]);
+    }
+    free(a->live_ranges);
+    graph_free(a->ig);
+    free_spill_temps(a);
+    a->live_ranges = NULL;
+    a->ig = NULL;
+    a->num_ranges = 0;
+}
+
 static void print_reg(RegAlloc *a, int reg) {
     if (a->group == REG_GROUP_GPR) {
-        encode_gpr(stdout, reg, R64);
+        TARGET->print_gpr(stdout, reg, R64);
     } else {
-        encode_xmm(stdout, reg);
+        TARGET->print_fpr(stdout, reg);
     }
 }
 
 static void print_live_range(Vec *live_range) {
-    for (int i = (int) vec_len(live_range) - 1; i >= 0; i--) { // Reverse order
+    for (size_t i = 0; i < vec_len(live_range); i++) {
         Interval *in = vec_get(live_range, i);
         printf("[%zu, %zu) ", in->start, in->end);
     }
@@ -291,316 +568,1682 @@ static void print_live_ranges(RegAlloc *a, Vec **live_ranges) {
 }
 
 
-// ---- Interference and Coalescing Graphs ------------------------------------
+// ---- Interference Graph ----------------------------------------------------
+
+typedef struct {
+    Interval *in;
+    int reg;
+} RegInterval;
+
+static int cmp_reg_interval_start(const void *a, const void *b) {
+    Interval *l = ((RegInterval *) a)->in, *r = ((RegInterval *) b)->in;
+    return (l->start > r->start) - (l->start < r->start);
+}
+
+static void add_interference(RegAlloc *a, Graph *g, int reg1, int reg2) {
+    if (reg1 == reg2 || has_edge(g, reg1, reg2)) {
+        return;
+    }
+    if (reg1 < a->num_pregs && reg2 < a->num_pregs) {
+        return; // Don't care about preg interference
+    }
+    add_edge(g, reg1, reg2);
+    STATS[STAT_IG_EDGES]++;
+    a->ig_edges++;
+    if (a->debug) {
+        print_reg(a, reg1);
+        printf(" interferes with ");
+        print_reg(a, reg2);
+        printf("\n");
+    }
+}
 
 // The interference graph tells us if two regs are live at the same time.
 // (reg1, reg2) is an edge in the graph if their live ranges intersect.
 static Graph * interference_graph(RegAlloc *a, Vec **live_ranges) {
-    // Intersect every pair of regs; iterate the upper half triangle of the
-    // matrix since it's symmetric about the leading diagonal
     Graph *g = graph_new(a->num_regs);
-    for (int reg1 = 0; reg1 < a->num_regs; reg1++) {
-        Vec *range1 = live_ranges[reg1];
-        if (!vec_len(range1)) { // Reg not used
-            continue;
+    size_t num_intervals = 0;
+    for (int reg = 0; reg < a->num_regs; reg++) {
+        if (vec_len(live_ranges[reg])) {
+            add_node(g, reg);
+            num_intervals += vec_len(live_ranges[reg]);
         }
-        add_node(g, reg1);
-        for (int reg2 = 0; reg2 < reg1; reg2++) {
-            Vec *range2 = live_ranges[reg2];
-            if (!vec_len(range2)) {
-                continue;
-            }
-            if (reg1 < a->num_pregs && reg2 < a->num_pregs) {
-                continue; // Don't care about preg interference
-            }
-            add_node(g, reg2);
-            if (ranges_intersect(range1, range2)) {
-                add_edge(g, reg1, reg2);
-                if (a->debug) {
-                    print_reg(a, reg1);
-                    printf(" interferes with ");
-                    print_reg(a, reg2);
-                    printf("\n");
-                }
+    }
+
+    // Sweep over all intervals in order of their start, keeping track of the
+    // ones that are active (contain the current program point); each interval
+    // interferes with exactly the ones active when it starts
+    RegInterval *all = malloc(sizeof(RegInterval) * (num_intervals + 1));
+    RegInterval *active = malloc(sizeof(RegInterval) * (num_intervals + 1));
+    size_t n = 0, num_active = 0;
+    for (int reg = 0; reg < a->num_regs; reg++) {
+        for (size_t i = 0; i < vec_len(live_ranges[reg]); i++) {
+            Interval *in = vec_get(live_ranges[reg], i);
+            all[n++] = (RegInterval) { in, reg };
+        }
+    }
+    qsort(all, n, sizeof(RegInterval), cmp_reg_interval_start);
+    for (size_t i = 0; i < n; i++) {
+        RegInterval *cur = &all[i];
+        size_t live = 0;
+        for (size_t j = 0; j < num_active; j++) { // Expire finished intervals
+            if (active[j].in->end > cur->in->start) {
+                active[live++] = active[j];
             }
         }
+        num_active = live;
+        for (size_t j = 0; j < num_active; j++) {
+            add_interference(a, g, cur->reg, active[j].reg);
+        }
+        active[num_active++] = *cur;
     }
+    free(all);
+    free(active);
     return g;
 }
 
 static int is_coalescing_candidate(RegAlloc *a, AsmIns *ins) {
-    if (a->group == REG_GROUP_GPR) {
-        return ins->op >= X64_MOV && ins->op <= X64_MOVZX && // is mov?
-               (ins->l->k == OPR_GPR && ins->r->k == OPR_GPR) && // both regs?
-               (ins->l->reg >= LAST_GPR || ins->r->reg >= LAST_GPR); // at least one vreg?
-    } else {
-        return ins->op >= X64_MOVSS && ins->op <= X64_MOVSD && // is mov?
-               (ins->l->k == OPR_XMM && ins->r->k == OPR_XMM) && // both regs?
-               (ins->l->reg >= LAST_XMM || ins->r->reg >= LAST_XMM); // at least one vreg?
-    }
+    return TARGET->is_move(ins) != MOV_NONE && is_group_reg(a, ins->l) && // is mov?
+           (ins->l->reg >= a->num_pregs || ins->r->reg >= a->num_pregs); // at least one vreg?
 }
 
-// The coalescing graph tells us if two regs are candidates for coalescing.
-// (reg1, reg2) is an edge in the graph if both regs are related by a move
-// and their live ranges don't otherwise intersect.
-static Graph * coalescing_graph(RegAlloc *a, Vec **live_ranges) {
-    Graph *g = graph_new(a->num_regs);
-    for (BB *bb = a->fn->entry; bb; bb = bb->next) {
-        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
-            if (is_coalescing_candidate(a, ins) &&
-                    !ranges_intersect(live_ranges[ins->l->reg],
-                                      live_ranges[ins->r->reg])) {
-                add_node(g, ins->l->reg);
-                add_node(g, ins->r->reg);
-                add_edge(g, ins->l->reg, ins->r->reg);
-            }
+
+// ---- Graph Colouring -------------------------------------------------------
+
+// The iterated register coalescing algorithm from Appel, Chapter 11.4. Every
+// vreg is in exactly one worklist or set at a time (its 'state'), and keeps
+// its degree and the moves it's in up to date as nodes are removed from the
+// graph and coalesced, so each step only looks at the neighbours of the
+// nodes involved, rather than rescanning the whole graph.
+//
+// Pregs are precoloured: they're never simplified or spilled, and their
+// degree is taken to be infinite. Edges are never removed from the
+// interference graph; 'adjacent' skips nodes that have been removed instead,
+// and 'assign_colours' uses the full graph
+
+enum { // Which worklist or set a reg is in
+    NODE_NONE,      // Not in the interference graph, or a preg
+    NODE_SIMPLIFY,  // Insignificant degree and not move-related
+    NODE_FREEZE,    // Insignificant degree and move-related
+    NODE_SPILL,     // Significant degree
+    NODE_STACK,     // Removed from the graph, waiting for a colour
+    NODE_COALESCED, // Merged into another reg (see 'coalesce_map')
+};
+
+enum { // Which set a move is in
+    MOVE_WORKLIST,    // Might be coalesced
+    MOVE_ACTIVE,      // Not ready to be coalesced yet
+    MOVE_COALESCED,
+    MOVE_CONSTRAINED, // Its regs interfere
+    MOVE_FROZEN,      // Given up on coalescing
+};
+
+typedef struct {
+    int dst, src;
+    int state; // 'MOVE_*'
+} Move;
+
+typedef struct {
+    RegAlloc *a;
+    Graph *ig;
+    int k;             // Number of pregs to hand out
+    int *degree;       // Per reg; number of neighbours still in the graph
+    int *state;        // Per reg; 'NODE_*'
+    Vec **moves;       // Per reg; the 'Move *'s it's in
+    Vec *all_moves;    // Each 'Move *' once
+    int *coalesce_map; // Per reg; the reg it was coalesced into
+    // Worklists are stacks; a reg can be pushed onto one more than once, so
+    // it's only taken off if its 'state' still says it belongs there
+    Vec *simplify_wl, *freeze_wl, *spill_wl; // of 'int' regs
+    Vec *move_wl;                            // of 'Move *'
+    int *stack, num_stack; // Order regs are coloured in (in reverse)
+    int *mark, stamp;      // For finding the union of two adjacency lists
+} Colouring;
+
+static void push_reg(Vec *wl, int reg) {
+    vec_push(wl, (void *) (intptr_t) reg);
+}
+
+static int pop_reg(Colouring *c, Vec *wl, int state) {
+    while (vec_len(wl) > 0) {
+        int reg = (int) (intptr_t) vec_pop(wl);
+        if (c->state[reg] == state) {
+            return reg;
         }
     }
-    return g;
+    return R_NONE;
 }
 
+static void set_state(Colouring *c, int reg, int state) {
+    c->state[reg] = state;
+    switch (state) {
+        case NODE_SIMPLIFY: push_reg(c->simplify_wl, reg); break;
+        case NODE_FREEZE:   push_reg(c->freeze_wl, reg); break;
+        case NODE_SPILL:    push_reg(c->spill_wl, reg); break;
+        default: break;
+    }
+}
 
-// ---- Graph Colouring -------------------------------------------------------
+static int is_preg(Colouring *c, int reg) {
+    return reg < c->a->num_pregs;
+}
 
-// Remove one non-move related node of insignificant degree (<num_pregs) from
-// the interference graph and push it onto the stack
-static int simplify(RegAlloc *a, Graph *ig, Graph *cg, int *stack, int *num_stack) {
-    // Find a non-move related node of insignificant degree
-    for (int vreg = a->num_pregs; vreg < a->num_regs; vreg++) {
-        if (!has_node(ig, vreg)) {
-            continue; // The reg doesn't exist
-        }
-        if (num_edges(cg, vreg) > 0) {
-            continue; // The reg is move related
-        }
-        if (num_edges(ig, vreg) >= a->num_pregs) {
-            continue; // The reg is of significant degree (>=num_pregs edges)
-        }
-        stack[(*num_stack)++] = vreg; // Add to stack
-        remove_node(ig, vreg); // Remove from graphs
-        remove_node(cg, vreg);
-        if (a->debug) {
-            printf("simplifying ");
-            print_reg(a, vreg);
-            printf("\n");
-        }
-        return 1;
+static int get_alias(Colouring *c, int reg) {
+    while (c->state[reg] == NODE_COALESCED) {
+        reg = c->coalesce_map[reg];
     }
-    return 0; // No nodes to simplify
+    return reg;
 }
 
-// Brigg's criteria: nodes a and b can be coalesced if the resulting node ab has
-// fewer than 'num_pregs' nodes of significant degree
-// Basically, calculate the degree of every (unique) neighbour of a and b and
-// count the number of these neighbours that have significant degree
-static int briggs_criteria(RegAlloc *a, Graph *ig, int reg1, int reg2) {
-    int count = 0;
-    int seen[a->num_regs];
-    memset(seen, 0, sizeof(int) * a->num_regs);
-    for (int neighbour = 0; neighbour < a->num_regs; neighbour++) {
-        if ((has_edge(ig, reg1, neighbour) ||      // Neighbour of reg1?
-                 has_edge(ig, reg2, neighbour)) && // or of reg2?
-                 !seen[neighbour]) {               // Unique?
-            seen[neighbour] = 1;
-            if (num_edges(ig, neighbour) >= a->num_pregs) { // Significant?
-                count++;
-            }
+// A neighbour that's still in the graph
+static int is_adjacent(Colouring *c, int reg) {
+    return c->state[reg] != NODE_STACK && c->state[reg] != NODE_COALESCED;
+}
+
+static int is_move_related(Colouring *c, int reg) {
+    Vec *moves = c->moves[reg];
+    for (size_t i = 0; i < vec_len(moves); i++) {
+        Move *m = vec_get(moves, i);
+        if (m->state == MOVE_WORKLIST || m->state == MOVE_ACTIVE) {
+            return 1;
         }
     }
-    return count;
+    return 0;
 }
 
-// Coalesce one move-related pair of nodes using the Brigg's criteria
-static int coalesce(RegAlloc *a, Graph *ig, Graph *cg, int *coalesce_map) {
-    // Find two move-related nodes
-    for (int reg1 = 0; reg1 < a->num_regs; reg1++) {
-        if (!has_node(cg, reg1)) {
-            continue; // Node isn't move-related to anything
-        }
-        for (int reg2 = 0; reg2 < reg1; reg2++) { // Only iterate upper half
-            if (!has_node(cg, reg1)) {
-                continue; // Node isn't move-related to anything
-            }
-            if (!has_edge(cg, reg1, reg2)) {
-                continue; // Nodes aren't move-related
-            }
-            if (briggs_criteria(a, ig, reg1, reg2) >= a->num_pregs) {
-                continue; // Not profitable to coalesce
-            }
-            // Coalesce one node into the other; if one of the regs is a preg,
-            // then make sure we coalesce the vreg into it
-            int to_coalesce = (reg1 < a->num_pregs) ? reg2 : reg1;
-            int target = (to_coalesce == reg1) ? reg2 : reg1;
-            copy_edges(ig, to_coalesce, target);
-            copy_edges(cg, to_coalesce, target);
-            remove_node(ig, to_coalesce);
-            remove_node(cg, to_coalesce);
-            coalesce_map[to_coalesce] = target;
-            if (a->debug) {
-                printf("coalescing ");
-                print_reg(a, to_coalesce);
-                printf(" into ");
-                print_reg(a, target);
-                printf("\n");
+static int is_significant(Colouring *c, int reg) {
+    return is_preg(c, reg) || c->degree[reg] >= c->k;
+}
+
+static Colouring * new_colouring(RegAlloc *a, Graph *ig, int *coalesce_map) {
+    Colouring *c = malloc(sizeof(Colouring));
+    c->a = a;
+    c->ig = ig;
+    c->k = 0;
+    while (nth_preg(a, c->k)) {
+        c->k++;
+    }
+    c->degree = calloc(a->num_regs, sizeof(int));
+    c->state = calloc(a->num_regs, sizeof(int));
+    c->moves = malloc(sizeof(Vec *) * a->num_regs);
+    c->coalesce_map = coalesce_map;
+    c->simplify_wl = vec_new();
+    c->freeze_wl = vec_new();
+    c->spill_wl = vec_new();
+    c->move_wl = vec_new();
+    c->all_moves = vec_new();
+    c->stack = malloc(sizeof(int) * a->num_regs);
+    c->num_stack = 0;
+    c->mark = calloc(a->num_regs, sizeof(int));
+    c->stamp = 0;
+    for (int reg = 0; reg < a->num_regs; reg++) {
+        c->moves[reg] = vec_new();
+        c->degree[reg] = ig->adj[reg].num;
+    }
+    return c;
+}
+
+static void free_colouring(Colouring *c) {
+    for (size_t i = 0; i < vec_len(c->all_moves); i++) {
+        free(vec_get(c->all_moves, i));
+    }
+    vec_free(c->all_moves);
+    for (int reg = 0; reg < c->a->num_regs; reg++) {
+        vec_free(c->moves[reg]);
+    }
+    vec_free(c->simplify_wl);
+    vec_free(c->freeze_wl);
+    vec_free(c->spill_wl);
+    vec_free(c->move_wl);
+    free(c->degree);
+    free(c->state);
+    free(c->moves);
+    free(c->stack);
+    free(c->mark);
+    free(c);
+}
+
+// Moves between two regs are what coalescing gets rid of; moves between regs
+// whose live ranges intersect are constrained from the start
+static void find_moves(Colouring *c) {
+    RegAlloc *a = c->a;
+    for (BB *bb = a->fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            if (!is_coalescing_candidate(a, ins)) {
+                continue;
             }
-            return 1;
+            Move *m = malloc(sizeof(Move));
+            m->dst = ins->l->reg;
+            m->src = ins->r->reg;
+            m->state = MOVE_WORKLIST;
+            vec_push(c->moves[m->dst], m);
+            vec_push(c->moves[m->src], m);
+            vec_push(c->move_wl, m);
+            vec_push(c->all_moves, m);
         }
     }
-    return 0; // No nodes to coalesce
 }
 
-// Look for a move-related node of insignificant degree that we can freeze the
-// moves for (give up hope of coalescing them)
-static int freeze(RegAlloc *a, Graph *ig, Graph *cg) {
-    // Find a move related node of insignificant degree
-    for (int vreg = a->num_pregs; vreg < a->num_regs; vreg++) {
-        if (!has_node(ig, vreg)) {
+static void make_worklists(Colouring *c) {
+    for (int vreg = c->a->num_pregs; vreg < c->a->num_regs; vreg++) {
+        if (!has_node(c->ig, vreg)) {
             continue; // The reg doesn't exist
         }
-        if (num_edges(cg, vreg) == 0) {
-            continue; // The reg is NOT move related
-        }
-        if (num_edges(ig, vreg) >= a->num_pregs) {
-            continue; // The reg is of significant degree (>=num_pregs edges)
-        }
-        remove_node(cg, vreg); // Remove from coalesce
-        if (a->debug) {
-            printf("freezing ");
-            print_reg(a, vreg);
-            printf("\n");
+        if (is_significant(c, vreg)) {
+            set_state(c, vreg, NODE_SPILL);
+        } else if (is_move_related(c, vreg)) {
+            set_state(c, vreg, NODE_FREEZE);
+        } else {
+            set_state(c, vreg, NODE_SIMPLIFY);
         }
-        return 1;
     }
-    return 0; // No nodes to freeze
 }
 
-// Look for a significant degree node to remove from the interference graph and
-// push on to the stack as a potential spill (we won't know for sure until we
-// select registers though)
-static int spill(RegAlloc *a, Graph *ig, Graph *cg, int *stack, int *num_stack) {
-    // Find a node of significant degree
-    for (int vreg = a->num_pregs; vreg < a->num_regs; vreg++) {
-        if (!has_node(ig, vreg)) {
-            continue; // The reg doesn't exist
-        }
-        if (num_edges(ig, vreg) < a->num_pregs) {
-            continue; // This reg isn't of significant degree
+// Moves that were waiting on a neighbour of 'reg' to drop to insignificant
+// degree might be coalescable now
+static void enable_moves(Colouring *c, int reg) {
+    Vec *moves = c->moves[reg];
+    for (size_t i = 0; i < vec_len(moves); i++) {
+        Move *m = vec_get(moves, i);
+        if (m->state == MOVE_ACTIVE) {
+            m->state = MOVE_WORKLIST;
+            vec_push(c->move_wl, m);
         }
-        stack[(*num_stack)++] = vreg; // Add to the stack
-        remove_node(ig, vreg); // Remove from graphs
-        remove_node(cg, vreg);
-        if (a->debug) {
-            printf("spilling ");
-            print_reg(a, vreg);
-            printf("\n");
+    }
+}
+
+static void decrement_degree(Colouring *c, int reg) {
+    if (is_preg(c, reg)) {
+        return;
+    }
+    if (c->degree[reg]-- != c->k) {
+        return;
+    }
+    // Just became insignificant
+    enable_moves(c, reg);
+    AdjList *adj = &c->ig->adj[reg];
+    for (int i = 0; i < adj->num; i++) {
+        if (is_adjacent(c, adj->nodes[i])) {
+            enable_moves(c, adj->nodes[i]);
         }
-        return 1;
     }
-    return 0; // No nodes to spill
+    if (c->state[reg] == NODE_SPILL) {
+        set_state(c, reg, is_move_related(c, reg) ? NODE_FREEZE : NODE_SIMPLIFY);
+    }
 }
 
-static void select(RegAlloc *a, Graph *ig, int *stack, int num_stack,
-                   int *reg_map, int *coalesce_map) {
-    // For each of the coalesced regs, we need to copy across their
-    // interferences in the original interference graph to the target reg they
-    // were coalesced into
-    for (int vreg = a->num_pregs; vreg < a->num_regs; vreg++) {
-        int target = coalesce_map[vreg];
-        if (target) { // 'vreg' was coalesced into 'target'
-            copy_edges(ig, vreg, target);
+// Remove a non-move related node of insignificant degree from the graph and
+// push it onto the stack
+static void simplify(Colouring *c, int vreg) {
+    c->state[vreg] = NODE_STACK;
+    c->stack[c->num_stack++] = vreg;
+    AdjList *adj = &c->ig->adj[vreg];
+    for (int i = 0; i < adj->num; i++) {
+        if (is_adjacent(c, adj->nodes[i])) {
+            decrement_degree(c, adj->nodes[i]);
         }
     }
+    if (c->a->debug) {
+        printf("simplifying ");
+        print_reg(c->a, vreg);
+        printf("\n");
+    }
+}
+
+static void add_ig_edge(Colouring *c, int reg1, int reg2) {
+    if (reg1 == reg2 || has_edge(c->ig, reg1, reg2) ||
+            (is_preg(c, reg1) && is_preg(c, reg2))) {
+        return;
+    }
+    add_edge(c->ig, reg1, reg2);
+    c->degree[reg1]++;
+    c->degree[reg2]++;
+}
 
-    // Work our way down the stack allocating regs
-    while (num_stack) {
-        int vreg = stack[--num_stack]; // Pop from the stack
+// A node that's no longer move related can be simplified once it's of
+// insignificant degree
+static void add_worklist(Colouring *c, int reg) {
+    if (!is_preg(c, reg) && c->state[reg] == NODE_FREEZE &&
+            !is_move_related(c, reg) && !is_significant(c, reg)) {
+        set_state(c, reg, NODE_SIMPLIFY);
+    }
+}
 
-        // Find the first preg not interfering with 'vreg'
-        int preg = 1; // 0 is R_NONE
-        while (has_edge(ig, vreg, preg) && preg < a->num_pregs) {
-            preg++;
-        }
-        if (preg >= a->num_pregs) { // All pregs interfere -> spill
-            assert(0); // TODO: spilling
+// George's criteria, for coalescing 'vreg' into the preg 'preg': every
+// neighbour of 'vreg' already interferes with 'preg', or is of insignificant
+// degree (so can always be coloured regardless)
+static int george_criteria(Colouring *c, int preg, int vreg) {
+    AdjList *adj = &c->ig->adj[vreg];
+    for (int i = 0; i < adj->num; i++) {
+        int t = adj->nodes[i];
+        if (is_adjacent(c, t) && !is_preg(c, t) && is_significant(c, t) &&
+                !has_edge(c->ig, t, preg)) {
+            return 0;
         }
-        reg_map[vreg] = preg;
+    }
+    return 1;
+}
 
-        // Copy the regs that interfere with this vreg to the allocated preg
-        copy_edges(ig, vreg, preg);
-        if (a->debug) {
-            printf("allocating ");
-            print_reg(a, vreg);
-            printf(" to ");
-            print_reg(a, preg);
-            printf("\n");
+static int count_significant(Colouring *c, int reg, int count) {
+    AdjList *adj = &c->ig->adj[reg];
+    for (int i = 0; i < adj->num; i++) {
+        int t = adj->nodes[i];
+        if (is_adjacent(c, t) && c->mark[t] != c->stamp) {
+            c->mark[t] = c->stamp;
+            count += is_significant(c, t);
         }
     }
+    return count;
 }
 
-static void color_graph(RegAlloc *a, Graph *ig, Graph *cg,
-                        int *reg_map, int *coalesce_map) {
-    int stack[a->num_regs]; // Defines the order vregs are allocated
-    int num_stack = 0;
-    Graph *ig2 = graph_copy(ig); // Copy that we can modify
+// Briggs' criteria, for coalescing two vregs: the merged node has fewer than
+// 'k' neighbours of significant degree (so it can always be simplified)
+static int briggs_criteria(Colouring *c, int reg1, int reg2) {
+    c->stamp++;
+    int count = count_significant(c, reg1, 0);
+    count = count_significant(c, reg2, count);
+    return count < c->k;
+}
 
-simplify_and_coalesce:
-    // Repeat simplification and coalescing until only significant-degree or
-    // move-related nodes remain (do each at least once and keep going until
-    // we can't anymore)
-    if (simplify(a, ig2, cg, stack, &num_stack)) {
-        while (simplify(a, ig2, cg, stack, &num_stack));
-    } else {
-        goto freeze_and_spill;
+static int same_remat(AsmIns *l, AsmIns *r) {
+    if (!l || !r || l->op != r->op || l->l->size != r->l->size ||
+            l->r->k != r->r->k) {
+        return 0;
     }
-    if (coalesce(a, ig2, cg, coalesce_map)) {
-        while (coalesce(a, ig2, cg, coalesce_map));
-        goto simplify_and_coalesce;
-    } else {
-        goto freeze_and_spill;
+    switch (l->r->k) {
+    case OPR_IMM:   return l->r->imm == r->r->imm;
+    case OPR_F32: case OPR_F64: return l->r->fp == r->r->fp;
+    case OPR_DEREF: case OPR_GOTPCREL: return strcmp(l->r->label, r->r->label) == 0;
+    case OPR_BB_ADDR: return l->r->bb == r->r->bb;
+    case OPR_MEM:   return l->r->base == r->r->base && l->r->disp == r->r->disp;
+    case OPR_XMM:   return 1; // Both 'pxor x, x'
+    default:        return 0;
     }
+}
 
-freeze_and_spill:
-    // Freeze a move-related node we can't simplify and try again. Keep freezing
-    // until only significant degree nodes remain
-    if (freeze(a, ig2, cg)) {
-        goto simplify_and_coalesce;
+// The merged live range is longer than either, so it can be spilled even if
+// one of them couldn't (see 'compute_spill_costs'). It can only be
+// rematerialised if both halves are defined by the same thing
+static void merge_spill_costs(RegAlloc *a, int target, int to_coalesce) {
+    double *costs = a->spill_costs;
+    if (costs[target] == INFINITY) {
+        costs[target] = costs[to_coalesce];
+    } else if (costs[to_coalesce] != INFINITY) {
+        costs[target] += costs[to_coalesce];
     }
-    // Only significant degree nodes remain -> spill one. Keep spilling until
-    // we've removed all nodes from the interference graph
-    if (spill(a, ig2, cg, stack, &num_stack)) {
-        goto simplify_and_coalesce;
+    if (!same_remat(a->remat[target], a->remat[to_coalesce])) {
+        a->remat[target] = NULL;
     }
-
-    // All vregs dealt ith -> colour regs in the order they pop off the stack
-    select(a, ig, stack, num_stack, reg_map, coalesce_map);
 }
 
+// Spilling a rematerialisable reg costs nothing: its def is just re-emitted
+// wherever it's used
+static double spill_cost(RegAlloc *a, int reg) {
+    if (a->remat[reg] && a->spill_costs[reg] != INFINITY) {
+        return 0;
+    }
+    return a->spill_costs[reg];
+}
 
-// ---- Register Replacement After Allocation ---------------------------------
-
-static int map_vreg(RegAlloc *a, int reg, int *reg_map, int *coalesce_map) {
-    if (reg < a->num_pregs) {
-        return reg; // Not a vreg
+static void combine(Colouring *c, int target, int to_coalesce) {
+    c->state[to_coalesce] = NODE_COALESCED; // Off the freeze or spill worklist
+    c->coalesce_map[to_coalesce] = target;
+    c->a->coalesced++;
+    vec_push_all(c->moves[target], c->moves[to_coalesce]);
+    enable_moves(c, to_coalesce);
+    AdjList *adj = &c->ig->adj[to_coalesce];
+    for (int i = 0; i < adj->num; i++) { // 'add_ig_edge' doesn't grow 'adj'
+        int t = adj->nodes[i];
+        if (is_adjacent(c, t)) {
+            add_ig_edge(c, t, target);
+            decrement_degree(c, t);
+        }
     }
-    while (reg >= a->num_pregs && coalesce_map[reg]) {
-        reg = coalesce_map[reg]; // Find end of coalescing chain
+    if (!is_preg(c, target)) {
+        merge_spill_costs(c->a, target, to_coalesce);
+        if (c->state[target] == NODE_FREEZE && is_significant(c, target)) {
+            set_state(c, target, NODE_SPILL);
+        }
     }
-    if (reg >= a->num_pregs) { // If not coalesced into a preg
-        reg = reg_map[reg]; // Find allocated preg
+    if (c->a->debug) {
+        printf("coalescing ");
+        print_reg(c->a, to_coalesce);
+        printf(" into ");
+        print_reg(c->a, target);
+        printf("\n");
     }
-    assert(reg > R_NONE);
-    return reg;
 }
 
-static void replace_vregs_in_op(RegAlloc *a, AsmOpr *op, int *reg_map, int *coalesce_map) {
-    if (!op) return;
-    if (a->group == REG_GROUP_GPR) {
-        switch (op->k) {
-        case OPR_GPR:
-            op->reg = map_vreg(a, op->reg, reg_map, coalesce_map);
-            break;
-        case OPR_MEM:
-            op->base = map_vreg(a, op->base, reg_map, coalesce_map);
+static void coalesce(Colouring *c, Move *m) {
+    int x = get_alias(c, m->dst), y = get_alias(c, m->src);
+    // If one of the regs is a preg, then coalesce the vreg into it
+    int target = is_preg(c, y) ? y : x;
+    int to_coalesce = (target == y) ? x : y;
+    if (target == to_coalesce) {
+        m->state = MOVE_COALESCED;
+        add_worklist(c, target);
+    } else if (is_preg(c, to_coalesce) ||
+               has_edge(c->ig, target, to_coalesce)) {
+        m->state = MOVE_CONSTRAINED;
+        add_worklist(c, target);
+        add_worklist(c, to_coalesce);
+    } else if (is_preg(c, target) ? george_criteria(c, target, to_coalesce) :
+                                    briggs_criteria(c, target, to_coalesce)) {
+        m->state = MOVE_COALESCED;
+        combine(c, target, to_coalesce);
+        add_worklist(c, target);
+    } else {
+        m->state = MOVE_ACTIVE; // Until one of their neighbours is simplified
+    }
+}
+
+// Give up on coalescing the moves 'reg' is in
+static void freeze_moves(Colouring *c, int reg) {
+    Vec *moves = c->moves[reg];
+    for (size_t i = 0; i < vec_len(moves); i++) {
+        Move *m = vec_get(moves, i);
+        if (m->state != MOVE_WORKLIST && m->state != MOVE_ACTIVE) {
+            continue;
+        }
+        m->state = MOVE_FROZEN;
+        int other = get_alias(c, m->src) == get_alias(c, reg) ?
+            get_alias(c, m->dst) : get_alias(c, m->src);
+        if (c->state[other] == NODE_FREEZE && !is_move_related(c, other) &&
+                !is_significant(c, other)) {
+            set_state(c, other, NODE_SIMPLIFY);
+        }
+    }
+}
+
+// Freeze a move-related node of insignificant degree, so it can be simplified
+static void freeze(Colouring *c, int vreg) {
+    set_state(c, vreg, NODE_SIMPLIFY);
+    freeze_moves(c, vreg);
+    if (c->a->debug) {
+        printf("freezing ");
+        print_reg(c->a, vreg);
+        printf("\n");
+    }
+}
+
+// Pick the node of significant degree that's cheapest to spill relative to
+// how many other nodes it gets out of the way, and simplify it as a potential
+// spill (we won't know for sure until we select registers though)
+static int select_spill(Colouring *c) {
+    RegAlloc *a = c->a;
+    int to_spill = R_NONE;
+    double best = 0;
+    for (size_t i = 0; i < vec_len(c->spill_wl); i++) {
+        int vreg = (int) (intptr_t) vec_get(c->spill_wl, i);
+        if (c->state[vreg] != NODE_SPILL) {
+            continue;
+        }
+        double cost = spill_cost(a, vreg) / c->degree[vreg];
+        if (to_spill == R_NONE || cost < best) {
+            to_spill = vreg;
+            best = cost;
+        }
+    }
+    if (to_spill == R_NONE) {
+        return 0; // No nodes to spill
+    }
+    set_state(c, to_spill, NODE_SIMPLIFY);
+    freeze_moves(c, to_spill);
+    if (a->debug) {
+        printf("potential spill ");
+        print_reg(a, to_spill);
+        printf("\n");
+    }
+    return 1;
+}
+
+// Moves that weren't coalesced (e.g., into the pregs for arguments and return
+// values, or because coalescing them might have caused a spill) still go away
+// if both sides end up in the same preg. So a vreg's hint is the preg that the
+// most of its move partners are in (or have been allocated), if it's free
+static int preferred_preg(Colouring *c, int vreg, int *reg_map, int *used) {
+    int votes[c->a->num_pregs];
+    memset(votes, 0, sizeof(votes));
+    Vec *moves = c->moves[vreg];
+    int best = R_NONE;
+    for (size_t i = 0; i < vec_len(moves); i++) {
+        Move *m = vec_get(moves, i);
+        int dst = get_alias(c, m->dst), src = get_alias(c, m->src);
+        int other = (dst == vreg) ? src : dst;
+        int preg = is_preg(c, other) ? other : reg_map[other];
+        if (other == vreg || !preg || used[preg]) {
+            continue;
+        }
+        votes[preg]++;
+        if (!best || votes[preg] > votes[best]) {
+            best = preg;
+        }
+    }
+    return best;
+}
+
+// Work our way down the stack allocating regs. Returns the number of vregs
+// that were actually spilled (marked in 'spilled')
+static int assign_colours(Colouring *c, int *reg_map, int *spilled) {
+    RegAlloc *a = c->a;
+    int num_spilled = 0;
+    int used[a->num_pregs];
+    while (c->num_stack) {
+        int vreg = c->stack[--c->num_stack]; // Pop from the stack
+        memset(used, 0, sizeof(int) * a->num_pregs);
+        AdjList *adj = &c->ig->adj[vreg];
+        for (int i = 0; i < adj->num; i++) {
+            int t = get_alias(c, adj->nodes[i]);
+            int preg = is_preg(c, t) ? t : reg_map[t];
+            used[preg] = 1;
+        }
+
+        // Try the hint first, then the first preg not interfering with 'vreg'
+        int preg = preferred_preg(c, vreg, reg_map, used);
+        for (int i = 0; !preg && (preg = nth_preg(a, i)) && used[preg]; i++) {
+            preg = R_NONE;
+        }
+        if (!preg) { // All pregs interfere -> spill
+            // Spill temporaries live for only a couple of instructions, and
+            // spilling them again wouldn't help
+            assert(a->spill_costs[vreg] != INFINITY);
+            spilled[vreg] = 1;
+            num_spilled++;
+            if (a->debug) {
+                printf("spilling ");
+                print_reg(a, vreg);
+                printf("\n");
+            }
+            continue;
+        }
+        reg_map[vreg] = preg;
+        if (a->debug) {
+            printf("allocating ");
+            print_reg(a, vreg);
+            printf(" to ");
+            print_reg(a, preg);
+            printf("\n");
+        }
+    }
+    return num_spilled;
+}
+
+// Returns the number of vregs spilled
+static int color_graph(RegAlloc *a, Graph *ig, int *reg_map, int *coalesce_map,
+                       int *spilled) {
+    Colouring *c = new_colouring(a, ig, coalesce_map);
+    find_moves(c);
+    make_worklists(c);
+    while (1) {
+        int vreg;
+        if ((vreg = pop_reg(c, c->simplify_wl, NODE_SIMPLIFY))) {
+            simplify(c, vreg);
+        } else if (vec_len(c->move_wl) > 0) {
+            Move *m = vec_pop(c->move_wl);
+            if (m->state == MOVE_WORKLIST) {
+                coalesce(c, m);
+            }
+        } else if ((vreg = pop_reg(c, c->freeze_wl, NODE_FREEZE))) {
+            freeze(c, vreg);
+        } else if (!select_spill(c)) {
+            break; // All vregs dealt with
+        }
+    }
+    // Colour regs in the order they pop off the stack
+    int num_spilled = assign_colours(c, reg_map, spilled);
+    free_colouring(c);
+    return num_spilled;
+}
+
+
+// ---- Linear Scan -----------------------------------------------------------
+
+// A much cheaper alternative to graph colouring (no interference graph, no
+// iterated coalescing) for when compile time matters more than code quality.
+// Based on the linear scan algorithm presented in 'Linear Scan Register
+// Allocation', Massimiliano Poletto and Vivek Sarkar, 1999; but since our live
+// ranges already have holes in them, a preg is only busy where the ranges of
+// the vregs assigned to it actually are, rather than from their first to
+// their last use.
+
+typedef struct {
+    int reg;
+    size_t start, end; // First and last program point of the whole live range
+} ScanReg;
+
+static int cmp_scan_reg_start(const void *a, const void *b) {
+    ScanReg *l = (ScanReg *) a, *r = (ScanReg *) b;
+    if (l->start != r->start) {
+        return (l->start > r->start) - (l->start < r->start);
+    }
+    return (l->reg > r->reg) - (l->reg < r->reg); // Keep the order stable
+}
+
+// Move-related regs make good hints: if 'mov v1, v2' and both end up in the
+// same preg, the mov disappears
+static void mov_hints(RegAlloc *a, int *hints) {
+    for (BB *bb = a->fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            if (!is_coalescing_candidate(a, ins)) {
+                continue;
+            }
+            int l = ins->l->reg, r = ins->r->reg;
+            if (l >= a->num_pregs && !hints[l]) hints[l] = r;
+            if (r >= a->num_pregs && !hints[r]) hints[r] = l;
+        }
+    }
+}
+
+// 'active' holds the vregs currently assigned to each preg that haven't
+// expired yet
+static int is_preg_free(RegAlloc *a, Vec **live_ranges, Vec **active, int preg,
+                        int vreg) {
+    if (preg <= R_NONE || preg >= a->num_pregs) {
+        return 0;
+    }
+    if (ranges_intersect(live_ranges[vreg], live_ranges[preg])) {
+        return 0; // Interferes with a use of the preg itself
+    }
+    for (size_t i = 0; i < vec_len(active[preg]); i++) {
+        int other = (int) (intptr_t) vec_get(active[preg], i);
+        if (ranges_intersect(live_ranges[vreg], live_ranges[other])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void expire_old(Vec **live_ranges, Vec **active, int num_pregs,
+                       size_t start) {
+    for (int preg = 0; preg < num_pregs; preg++) {
+        Vec *regs = active[preg];
+        size_t live = 0;
+        for (size_t i = 0; i < vec_len(regs); i++) {
+            int other = (int) (intptr_t) vec_get(regs, i);
+            Interval *last = vec_get(live_ranges[other], vec_len(live_ranges[other]) - 1);
+            if (last->end > start) {
+                regs->data[live++] = regs->data[i];
+            }
+        }
+        regs->len = live;
+    }
+}
+
+// Finds the cheapest vreg to spill out of 'vreg' and the active vregs that
+// stop it from getting a preg
+static int cheapest_conflict(RegAlloc *a, Vec **live_ranges, Vec **active,
+                             int vreg, int *preg_out) {
+    int to_spill = vreg;
+    *preg_out = R_NONE;
+    for (int preg = 1; preg < a->num_pregs; preg++) {
+        for (size_t i = 0; i < vec_len(active[preg]); i++) {
+            int other = (int) (intptr_t) vec_get(active[preg], i);
+            if (spill_cost(a, other) < spill_cost(a, to_spill) &&
+                    ranges_intersect(live_ranges[vreg], live_ranges[other])) {
+                to_spill = other;
+                *preg_out = preg;
+            }
+        }
+    }
+    return to_spill;
+}
+
+static void evict(Vec **active, int preg, int vreg) {
+    Vec *regs = active[preg];
+    for (size_t i = 0; i < vec_len(regs); i++) {
+        if ((int) (intptr_t) vec_get(regs, i) == vreg) {
+            vec_remove(regs, i);
+            return;
+        }
+    }
+}
+
+static int find_free_preg(RegAlloc *a, Vec **live_ranges, Vec **active,
+                          int *reg_map, int *hints, int vreg) {
+    // Try the hint first, then the first preg that's free
+    int hint = hints[vreg];
+    int preg = hint < a->num_pregs ? hint : reg_map[hint];
+    if (is_preg_free(a, live_ranges, active, preg, vreg)) {
+        return preg;
+    }
+    for (int i = 0; (preg = nth_preg(a, i)); i++) {
+        if (is_preg_free(a, live_ranges, active, preg, vreg)) {
+            return preg;
+        }
+    }
+    return R_NONE;
+}
+
+// Returns the number of vregs spilled
+static int linear_scan(RegAlloc *a, Vec **live_ranges, int *reg_map,
+                       int *spilled) {
+    ScanReg order[a->num_regs];
+    int num_order = 0;
+    for (int vreg = a->num_pregs; vreg < a->num_regs; vreg++) {
+        Vec *range = live_ranges[vreg];
+        if (!vec_len(range)) {
+            continue; // Never used
+        }
+        Interval *first = vec_get(range, 0);
+        Interval *last = vec_get(range, vec_len(range) - 1);
+        order[num_order++] = (ScanReg) { vreg, first->start, last->end };
+    }
+    qsort(order, num_order, sizeof(ScanReg), cmp_scan_reg_start);
+
+    int hints[a->num_regs];
+    memset(hints, 0, a->num_regs * sizeof(int));
+    mov_hints(a, hints);
+
+    Vec *active[a->num_pregs];
+    for (int preg = 0; preg < a->num_pregs; preg++) {
+        active[preg] = vec_new();
+    }
+    int num_spilled = 0;
+    for (int i = 0; i < num_order; i++) {
+        int vreg = order[i].reg;
+        expire_old(live_ranges, active, a->num_pregs, order[i].start);
+
+        // If no preg is free, spill whichever of 'vreg' and the vregs in its
+        // way is cheapest, until either 'vreg' is spilled or it fits
+        int preg;
+        while (!(preg = find_free_preg(a, live_ranges, active, reg_map, hints, vreg))) {
+            int evict_from;
+            int to_spill = cheapest_conflict(a, live_ranges, active, vreg, &evict_from);
+            assert(a->spill_costs[to_spill] != INFINITY); // See 'assign_colours'
+            spilled[to_spill] = 1;
+            num_spilled++;
+            if (a->debug) {
+                printf("spilling ");
+                print_reg(a, to_spill);
+                printf("\n");
+            }
+            if (to_spill == vreg) {
+                break;
+            }
+            evict(active, evict_from, to_spill);
+            reg_map[to_spill] = R_NONE;
+        }
+        if (!preg) {
+            continue; // Spilled
+        }
+        reg_map[vreg] = preg;
+        vec_push(active[preg], (void *) (intptr_t) vreg);
+        if (a->debug) {
+            printf("allocating ");
+            print_reg(a, vreg);
+            printf(" to ");
+            print_reg(a, preg);
+            printf("\n");
+        }
+    }
+    for (int preg = 0; preg < a->num_pregs; preg++) {
+        vec_free(active[preg]);
+    }
+    return num_spilled;
+}
+
+
+// ---- Spilling --------------------------------------------------------------
+
+static void add_opr_cost(RegAlloc *a, AsmOpr *opr, double weight) {
+    if (!opr) return;
+    if (is_group_reg(a, opr)) {
+        a->spill_costs[opr->reg] += weight;
+    } else if (a->group == REG_GROUP_GPR && opr->k == OPR_MEM) {
+        a->spill_costs[opr->base] += weight;
+        a->spill_costs[opr->idx] += weight;
+    }
+}
+
+void opr_use_def(AsmIns *ins, int i, int *is_def, int *is_use) {
+    if (ins->op == X64_ASM) {
+        AsmBlock *b = ins->block;
+        if (i >= b->inline_asm->num_oprs) { // In 'fixed'
+            *is_def = 0, *is_use = 1;
+        } else {
+            *is_def = (b->access[i] & ASM_WRITE) != 0;
+            *is_use = !*is_def || (b->access[i] & ASM_READ);
+        }
+    } else {
+        *is_def = (i == 0) && TARGET->defs_left(ins);
+        *is_use = !((i == 0) && TARGET->only_defs_left(ins));
+    }
+}
+
+#define MIN_PROFILE_WEIGHT 0.01
+
+// Each use costs 10x more for every loop it's in, or with a profile, in
+// proportion to how often its BB ran compared to the function's entry (but
+// never nothing, so a reg in a cold BB isn't spilled for free)
+static double bb_weight(Fn *fn, BB *bb) {
+    if (bb->freq >= 0 && fn->entry->freq > 0) {
+        double weight = (double) bb->freq / (double) fn->entry->freq;
+        return weight > MIN_PROFILE_WEIGHT ? weight : MIN_PROFILE_WEIGHT;
+    }
+    double weight = 1;
+    for (int i = 0; i < loop_depth(bb) && i < 8; i++) {
+        weight *= 10;
+    }
+    return weight;
+}
+
+// Whether there's a call strictly inside an interval; 'calls' is per program
+// point (see 'number_ins')
+static int has_call_between(char *calls, Interval *in) {
+    for (size_t n = in->start + 1; n < in->end; n++) {
+        if (calls[n]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The cost of spilling a reg is the number of loads and stores we'd need,
+// where each costs 10x more for every loop it's in
+static void compute_spill_costs(RegAlloc *a, Vec **live_ranges) {
+    free(a->spill_costs);
+    a->spill_costs = calloc(a->num_regs, sizeof(double));
+    free(a->remat);
+    a->remat = calloc(a->num_regs, sizeof(AsmIns *));
+    int *num_defs = calloc(a->num_regs, sizeof(int));
+    size_t num_points = 0;
+    for (BB *bb = a->fn->entry; bb; bb = bb->next) {
+        num_points = bb->asm_last ? bb->asm_last->n + 2 : num_points + 2;
+    }
+    char *calls = calloc(num_points + 1, sizeof(char));
+    for (BB *bb = a->fn->entry; bb; bb = bb->next) {
+        double weight = bb_weight(a->fn, bb);
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            calls[ins->n] = clobbers_all(a, ins);
+            AsmOpr **oprs[MAX_INS_OPRS];
+            int num_oprs = ins_oprs(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                add_opr_cost(a, *oprs[i], weight);
+                int is_def, is_use;
+                opr_use_def(ins, i, &is_def, &is_use);
+                if (is_def && is_group_reg(a, *oprs[i])) {
+                    num_defs[(*oprs[i])->reg]++;
+                    a->remat[(*oprs[i])->reg] = ins;
+                }
+            }
+        }
+    }
+    for (int reg = a->num_pregs; reg < a->num_regs; reg++) {
+        if (num_defs[reg] != 1 || !TARGET->is_remat_def(a->remat[reg])) {
+            a->remat[reg] = NULL;
+        }
+    }
+    free(num_defs);
+
+    // A reg that's live for only an instruction or two can't be made any
+    // shorter by spilling it -- unless it's live across a call (see
+    // 'split_around_calls'). Nor can the temporaries that spilling introduces,
+    // which can be longer when several of an instruction's operands are
+    // spilled (each live across the others' loads); spilling one of those just
+    // makes another just as long, every round
+    for (int reg = a->num_pregs; reg < a->num_regs; reg++) {
+        Vec *range = live_ranges[reg];
+        if (vec_len(range) == 1) {
+            Interval *in = vec_get(range, 0);
+            if ((in->end - in->start <= 2 || is_spill_temp(a, reg)) &&
+                    !has_call_between(calls, in)) {
+                a->spill_costs[reg] = INFINITY;
+            }
+        }
+    }
+    free(calls);
+}
+
+static int new_vreg(RegAlloc *a) {
+    STATS[STAT_VREGS]++;
+    return (a->group == REG_GROUP_GPR) ? a->fn->num_gprs++ : a->fn->num_sse++;
+}
+
+static int group_opr_k(RegAlloc *a) {
+    return (a->group == REG_GROUP_GPR) ? OPR_GPR : OPR_XMM;
+}
+
+static int spill_target(RegAlloc *a, int reg, int *coalesce_map, int *spilled) {
+    if (reg < a->num_pregs || reg >= a->num_regs) {
+        return R_NONE; // Not a vreg, or a new one added by spilling
+    }
+    while (reg >= a->num_pregs && coalesce_map[reg]) {
+        reg = coalesce_map[reg]; // Find end of coalescing chain
+    }
+    return (reg >= a->num_pregs && spilled[reg]) ? reg : R_NONE;
+}
+
+typedef struct {
+    int vreg, tmp; // Spilled vreg and the new vreg replacing it in an ins
+    int use, def;
+} SpillUse;
+
+static void spill_reg_in_opr(RegAlloc *a, int *reg, int is_def, int is_use,
+                             SpillUse *uses, int *num_uses, int *coalesce_map,
+                             int *spilled) {
+    int vreg = spill_target(a, *reg, coalesce_map, spilled);
+    if (!vreg) {
+        return;
+    }
+    int i = 0;
+    while (i < *num_uses && uses[i].vreg != vreg) {
+        i++;
+    }
+    if (i == *num_uses) { // One new vreg per spilled vreg in an instruction
+        uses[(*num_uses)++] = (SpillUse) { vreg, new_vreg(a), 0, 0 };
+    }
+    uses[i].use |= is_use;
+    uses[i].def |= is_def;
+    *reg = uses[i].tmp;
+}
+
+// A new vreg from spilling is live from its load (or the instruction, if it's
+// only defined there) to its store (or the instruction, if it's only used)
+typedef struct {
+    int reg;
+    AsmIns *first, *last;
+} SpillTemp;
+
+static void add_spill_temp(RegAlloc *a, int reg, AsmIns *first, AsmIns *last) {
+    SpillTemp *t = malloc(sizeof(SpillTemp));
+    t->reg = reg;
+    t->first = first;
+    t->last = last;
+    vec_push(a->spill_temps, t);
+}
+
+// Operands can be shared between instructions, so copy before modifying
+static AsmOpr * copy_opr(AsmOpr *opr) {
+    AsmOpr *copy = arena_alloc(ARENA_ASM, sizeof(AsmOpr));
+    *copy = *opr;
+    return copy;
+}
+
+static void spill_regs_in_ins(RegAlloc *a, AsmIns *ins, size_t *slots,
+                              int *coalesce_map, int *spilled) {
+    SpillUse uses[MAX_INS_OPRS * 2]; // A memory operand can have two regs
+    int num_uses = 0;
+    AsmOpr **oprs[MAX_INS_OPRS];
+    int num_oprs = ins_oprs(ins, oprs);
+    for (int i = 0; i < num_oprs; i++) {
+        AsmOpr *opr = *oprs[i];
+        if (is_group_reg(a, opr) && spill_target(a, opr->reg, coalesce_map, spilled)) {
+            int is_def, is_use;
+            opr_use_def(ins, i, &is_def, &is_use);
+            opr = copy_opr(opr);
+            spill_reg_in_opr(a, &opr->reg, is_def, is_use, uses, &num_uses,
+                             coalesce_map, spilled);
+        } else if (a->group == REG_GROUP_GPR && opr->k == OPR_MEM &&
+                   (spill_target(a, opr->base, coalesce_map, spilled) ||
+                    spill_target(a, opr->idx, coalesce_map, spilled))) {
+            opr = copy_opr(opr);
+            spill_reg_in_opr(a, &opr->base, 0, 1, uses, &num_uses,
+                             coalesce_map, spilled);
+            spill_reg_in_opr(a, &opr->idx, 0, 1, uses, &num_uses,
+                             coalesce_map, spilled);
+        }
+        *oprs[i] = opr;
+    }
+    // Loads for an inline assembly block go before its X64_ASM_CLOBBER, which
+    // uses everything the block does
+    AsmIns *load_at = ins->op == X64_ASM ? ins->prev : ins;
+    int k = group_opr_k(a);
+    for (int i = 0; i < num_uses; i++) {
+        AsmIns *remat = a->remat[uses[i].vreg];
+        if (remat && uses[i].def) { // The def itself; it's re-emitted at uses
+            assert(num_uses == 1);
+            delete_asm(ins);
+            return;
+        } else if (remat) {
+            TARGET->spill_remat(load_at, remat, uses[i].tmp);
+            add_spill_temp(a, uses[i].tmp, load_at->prev, ins);
+            a->remats++;
+            continue;
+        }
+        size_t slot = slots[uses[i].vreg];
+        AsmIns *first = load_at, *last = ins;
+        if (uses[i].use) {
+            TARGET->spill_load(load_at, k, uses[i].tmp, slot);
+            first = load_at->prev;
+            a->reloads++;
+        }
+        if (uses[i].def) {
+            TARGET->spill_store(ins, k, uses[i].tmp, slot);
+            last = ins->next;
+            a->spills++;
+        }
+        add_spill_temp(a, uses[i].tmp, first, last);
+    }
+}
+
+// The spilled vregs (and the vregs coalesced into them) are gone from the
+// code, so they're taken out of the liveness and the interference graph too.
+// The new vregs that replace them are live only inside a BB, so nothing else
+// changes in the live-in and live-out sets
+static void forget_spilled(RegAlloc *a, int *coalesce_map, int *spilled) {
+    for (int vreg = a->num_pregs; vreg < a->num_regs; vreg++) {
+        if (!spill_target(a, vreg, coalesce_map, spilled)) {
+            continue;
+        }
+        free_range(a->live_ranges[vreg]);
+        if (a->ig) {
+            remove_node(a->ig, vreg);
+        }
+        for (size_t i = 0; i < a->num_live_bbs; i++) {
+            remove_reg(a->live_in[i], vreg);
+            remove_reg(a->live_out[i], vreg);
+        }
+    }
+}
+
+// Rewrites every use of a spilled vreg into a load from its stack slot before
+// the instruction, and every def into a store after it, each through a new
+// short-lived vreg. Rematerialisable vregs don't need a stack slot: their def
+// is deleted and re-emitted before each use instead
+static void rewrite_spilled(RegAlloc *a, int *coalesce_map, int *spilled) {
+    size_t *slots = calloc(a->num_regs, sizeof(size_t));
+    for (int vreg = a->num_pregs; vreg < a->num_regs; vreg++) {
+        if (spilled[vreg] && !a->remat[vreg]) {
+            slots[vreg] = a->group == REG_GROUP_GPR ?
+                alloc_stack_slot(a->fn, 8, 8) : alloc_stack_slot(a->fn, 16, 16);
+        }
+    }
+    for (BB *bb = a->fn->entry; bb; bb = bb->next) {
+        AsmIns *next;
+        for (AsmIns *ins = bb->asm_head; ins; ins = next) {
+            next = ins->next; // 'ins' might be deleted
+            spill_regs_in_ins(a, ins, slots, coalesce_map, spilled);
+        }
+    }
+    free(slots);
+    forget_spilled(a, coalesce_map, spilled);
+    update_num_regs(a);
+    a->temps = realloc(a->temps, sizeof(uint64_t) * a->num_words);
+    memset(&a->temps[a->temp_words], 0, sizeof(uint64_t) * (a->num_words - a->temp_words));
+    a->temp_words = a->num_words;
+    for (size_t i = 0; i < vec_len(a->spill_temps); i++) {
+        SpillTemp *t = vec_get(a->spill_temps, i);
+        put_reg(a->temps, t->reg);
+    }
+}
+
+
+// ---- Updating Liveness After Spilling --------------------------------------
+
+// Recomputing the liveness and interference graph from scratch after every
+// round of spilling would make each round cost as much as the first. Spill
+// code only adds program points, though, so the intervals left after the
+// spilled vregs are removed (see 'forget_spilled') move along with the points
+// they start and end at. A reg that's live at the points either side of some
+// spill code is live in the middle of it too. The new vregs get their own
+// short intervals, and edges to whatever those intersect.
+
+static void grow_regs(uint64_t **regs, size_t from, size_t to) {
+    *regs = realloc(*regs, sizeof(uint64_t) * to);
+    memset(&(*regs)[from], 0, sizeof(uint64_t) * (to - from));
+}
+
+// Sorts the new vregs' intervals by their start, then finds the ones that can
+// intersect each other interval by binary search; none is longer than the
+// longest spill code around one instruction
+static void add_spill_temp_edges(RegAlloc *a) {
+    size_t n = vec_len(a->spill_temps), longest = 0;
+    RegInterval *temps = malloc(sizeof(RegInterval) * (n + 1));
+    for (size_t i = 0; i < n; i++) {
+        SpillTemp *t = vec_get(a->spill_temps, i);
+        Interval *in = vec_head(a->live_ranges[t->reg]);
+        temps[i] = (RegInterval) { in, t->reg };
+        if (in->end - in->start > longest) {
+            longest = in->end - in->start;
+        }
+        add_node(a->ig, t->reg);
+    }
+    qsort(temps, n, sizeof(RegInterval), cmp_reg_interval_start);
+    for (int reg = 0; reg < a->num_regs; reg++) {
+        Vec *range = a->live_ranges[reg];
+        for (size_t i = 0; i < vec_len(range); i++) {
+            Interval *in = vec_get(range, i);
+            size_t lo = 0, hi = n;
+            while (lo < hi) { // First temp that can still be live at 'in->start'
+                size_t mid = (lo + hi) / 2;
+                if (temps[mid].in->start + longest <= in->start) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            for (size_t j = lo; j < n && temps[j].in->start < in->end; j++) {
+                if (intervals_intersect(in, temps[j].in)) {
+                    add_interference(a, a->ig, reg, temps[j].reg);
+                }
+            }
+        }
+    }
+    free(temps);
+}
+
+// The last program point an interval is live at
+static size_t last_point(Interval *in) {
+    return in->single ? in->start : in->end;
+}
+
+// The interval in a live range that's live at 'point', or NULL; 'i' is set to
+// where an interval starting at 'point' would go
+static Interval * interval_at(Vec *range, size_t point, size_t *i) {
+    size_t lo = 0, hi = vec_len(range);
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (((Interval *) vec_get(range, mid))->start <= point) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *i = lo;
+    Interval *in = lo > 0 ? vec_get(range, lo - 1) : NULL;
+    return in && point <= last_point(in) ? in : NULL;
+}
+
+// Sets the last point an interval is live at (see 'live_ranges_for_fn')
+static void set_last_point(Interval *in, size_t last) {
+    in->single = last == in->start;
+    in->end = in->single ? last + 1 : last;
+}
+
+static void insert_interval(Vec *range, size_t i, Interval *in) {
+    vec_push(range, NULL);
+    for (size_t j = vec_len(range) - 1; j > i; j--) {
+        range->data[j] = range->data[j - 1];
+    }
+    range->data[i] = in;
+}
+
+// Makes a reg live or dead at one program point, merging or splitting its
+// intervals the same way as building them would
+static void set_live_at(Vec *range, size_t point, int live) {
+    size_t i;
+    Interval *in = interval_at(range, point, &i);
+    if (in && !live) {
+        size_t start = in->start, last = last_point(in);
+        if (start == point && last == point) {
+            free(vec_remove(range, i - 1));
+        } else if (start == point) {
+            in->start = point + 1;
+            set_last_point(in, last);
+        } else if (last == point) {
+            set_last_point(in, point - 1);
+        } else {
+            Interval *after = new_interval(point + 1, 0);
+            set_last_point(after, last);
+            set_last_point(in, point - 1);
+            insert_interval(range, i, after);
+        }
+    } else if (!in && live) {
+        Interval *prev = i > 0 ? vec_get(range, i - 1) : NULL;
+        Interval *next = i < vec_len(range) ? vec_get(range, i) : NULL;
+        if (prev && last_point(prev) + 1 == point) {
+            if (next && next->start == point + 1) { // Joins them up
+                set_last_point(prev, last_point(next));
+                free(vec_remove(range, i));
+            } else {
+                set_last_point(prev, point);
+            }
+        } else if (next && next->start == point + 1) {
+            size_t last = last_point(next);
+            next->start = point;
+            set_last_point(next, last);
+        } else {
+            in = new_interval(point, 0);
+            set_last_point(in, point);
+            insert_interval(range, i, in);
+        }
+    }
+}
+
+// A vreg live either side of some new code is live in the middle of it too,
+// unless the next old instruction defines it
+static void fix_vreg_liveness(RegAlloc *a, AsmIns *ins, char *is_new, uint64_t *use) {
+    AsmIns *next_old = ins->next;
+    while (next_old && is_new[next_old->n]) {
+        next_old = next_old->next;
+    }
+    if (!next_old) {
+        return;
+    }
+    memset(use, 0, sizeof(uint64_t) * a->num_words);
+    int defs[MAX_ASM_OPRS];
+    int num_defs = ins_use_def(a, next_old, use, defs);
+    for (int i = 0; i < num_defs; i++) {
+        if (defs[i] >= a->num_pregs) {
+            set_live_at(a->live_ranges[defs[i]], ins->n, 0);
+        }
+    }
+}
+
+// A preg is live only where it's mentioned (the stack and frame pointers
+// everywhere), at the point before an instruction that reads it implicitly,
+// and while it holds an argument. So the pregs are worked out again at the
+// new code and the instructions whose next instruction changed ('ins' is NULL
+// for the start of 'bb')
+static void fix_preg_liveness(RegAlloc *a, BB *bb, AsmIns *ins, uint64_t *use,
+                              uint64_t arg_reads, size_t *last_arg_read) {
+    memset(use, 0, sizeof(uint64_t) * a->num_words);
+    AsmIns *next = ins ? ins->next : bb->asm_head;
+    if (!next && !ins) {
+        return; // Empty BB
+    }
+    size_t point = ins ? ins->n : next->n - 1;
+    if (ins) {
+        int defs[MAX_ASM_OPRS];
+        ins_use_def(a, ins, use, defs);
+    }
+    for (int preg = 0; preg < a->num_pregs; preg++) {
+        int live = has_reg(use, preg) ||
+            (a->group == REG_GROUP_GPR && next && (TARGET->implicit_uses(next->op) >> preg & 1)) ||
+            (bb == a->fn->entry && next && has_reg(&arg_reads, preg) &&
+             next->n <= last_arg_read[preg]);
+        set_live_at(a->live_ranges[preg], point, live);
+    }
+}
+
+// 'moved' maps each program point from before the round to where it is now,
+// 'added' is the new code from both groups, and 'after_deleted' the
+// instructions that deleted ones were before (see 'moved_points')
+static void update_live_ranges(RegAlloc *a, size_t *moved, Vec *added,
+                               Vec *after_deleted) {
+    int num_ranges = a->num_ranges;
+    size_t num_words = BITS_WORDS(num_ranges);
+    a->live_ranges = realloc(a->live_ranges, sizeof(Vec *) * a->num_regs);
+    for (int reg = num_ranges; reg < a->num_regs; reg++) {
+        a->live_ranges[reg] = vec_new();
+    }
+    a->num_ranges = a->num_regs;
+    for (size_t i = 0; a->num_words > num_words && i < a->num_live_bbs; i++) {
+        grow_regs(&a->live_in[i], num_words, a->num_words);
+        grow_regs(&a->live_out[i], num_words, a->num_words);
+    }
+
+    for (int reg = 0; reg < num_ranges; reg++) {
+        Vec *range = a->live_ranges[reg];
+        size_t n = 0;
+        for (size_t i = 0; i < vec_len(range); i++) {
+            Interval *in = vec_get(range, i);
+            size_t last = moved[last_point(in)];
+            in->start = moved[in->start];
+            Interval *prev = n > 0 ? vec_get(range, n - 1) : NULL;
+            if (prev && last_point(prev) + 1 >= in->start) {
+                set_last_point(prev, last); // Deleted code was all between
+                free(in);
+            } else {
+                set_last_point(in, last);
+                range->data[n++] = in;
+            }
+        }
+        range->len = n;
+    }
+    size_t num_points = 0;
+    for (BB *bb = a->fn->entry; bb; bb = bb->next) {
+        num_points = bb->asm_last ? bb->asm_last->n + 2 : num_points + 2;
+    }
+    char *is_new = calloc(num_points, sizeof(char));
+    for (size_t i = 0; i < vec_len(added); i++) {
+        is_new[((AsmIns *) vec_get(added, i))->n] = 1;
+    }
+    size_t last_arg_read[a->num_pregs];
+    uint64_t arg_reads = find_arg_reads(a, last_arg_read);
+    uint64_t *use = regs_new(a);
+    for (size_t i = 0; i < vec_len(added); i++) {
+        AsmIns *ins = vec_get(added, i);
+        fix_vreg_liveness(a, ins, is_new, use);
+        fix_preg_liveness(a, ins->bb, ins, use, arg_reads, last_arg_read);
+        if (!ins->prev || !is_new[ins->prev->n]) {
+            fix_preg_liveness(a, ins->bb, ins->prev, use, arg_reads, last_arg_read);
+        }
+    }
+    for (size_t i = 0; i < vec_len(after_deleted); i++) {
+        AsmIns *ins = vec_get(after_deleted, i);
+        fix_preg_liveness(a, ins->bb, ins->prev, use, arg_reads, last_arg_read);
+    }
+    free(use);
+    free(is_new);
+    for (size_t i = 0; i < vec_len(a->spill_temps); i++) {
+        SpillTemp *t = vec_get(a->spill_temps, i);
+        vec_push(a->live_ranges[t->reg], new_interval(t->first->n, t->last->n));
+    }
+    if (a->ig) {
+        graph_grow(a->ig, a->num_regs);
+        add_spill_temp_edges(a);
+    }
+    free_spill_temps(a);
+}
+
+
+// ---- Live Range Splitting --------------------------------------------------
+
+// Spilling a vreg costs a load or store at every use, even where there'd be a
+// reg for it. So when colouring has to spill, the spilled vregs are first
+// split into pieces that can be allocated separately, and colouring is tried
+// again; only the pieces that still don't get a reg are spilled. Splits are
+// copies between vregs, so the coalescer undoes any that don't help.
+
+static int mentions_reg(RegAlloc *a, AsmOpr *opr, int reg) {
+    if (is_group_reg(a, opr)) {
+        return opr->reg == reg;
+    }
+    return a->group == REG_GROUP_GPR && opr->k == OPR_MEM &&
+           (opr->base == reg || opr->idx == reg);
+}
+
+static void rename_reg(RegAlloc *a, AsmIns *ins, int from, int to) {
+    AsmOpr **oprs[MAX_INS_OPRS];
+    int num_oprs = ins_oprs(ins, oprs);
+    for (int i = 0; i < num_oprs; i++) {
+        AsmOpr *opr = *oprs[i];
+        if (!mentions_reg(a, opr, from)) {
+            continue;
+        }
+        opr = copy_opr(opr);
+        if (is_group_reg(a, opr)) {
+            opr->reg = to;
+        } else {
+            opr->base = opr->base == from ? to : opr->base;
+            opr->idx = opr->idx == from ? to : opr->idx;
+        }
+        *oprs[i] = opr;
+    }
+}
+
+// How often each vreg is live across a call, weighted like spill costs
+static void count_call_crossings(RegAlloc *a, double *crossings) {
+    uint64_t live[a->num_words];
+    for (BB *bb = a->fn->entry; bb; bb = bb->next) {
+        memcpy(live, a->live_out[bb->n], sizeof(uint64_t) * a->num_words);
+        for (AsmIns *ins = bb->asm_last; ins; ins = ins->prev) {
+            if (clobbers_all(a, ins)) {
+                for (size_t vreg = bits_next(live, a->num_words, a->num_pregs);
+                        vreg < a->num_words * 64;
+                        vreg = bits_next(live, a->num_words, vreg + 1)) {
+                    crossings[vreg] += bb_weight(a->fn, bb);
+                }
+            }
+            int defs[MAX_ASM_OPRS];
+            int num_defs = ins_use_def(a, ins, live, defs);
+            for (int i = 0; i < num_defs; i++) {
+                remove_reg(live, defs[i]);
+            }
+            clear_pregs(a, live);
+        }
+    }
+}
+
+// The most regs live at any one instruction in a loop. Only the vregs used in
+// the loop count (one that's just live through it can be spilled outside the
+// loop for free), along with the pregs each instruction uses or clobbers
+static int loop_pressure(RegAlloc *a, Loop *loop) {
+    uint64_t used[a->num_words], live[a->num_words];
+    memset(used, 0, sizeof(uint64_t) * a->num_words);
+    for (size_t i = 0; i < vec_len(loop->bbs); i++) {
+        BB *bb = vec_get(loop->bbs, i);
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            AsmOpr **oprs[MAX_INS_OPRS];
+            int num_oprs = ins_oprs(ins, oprs);
+            for (int j = 0; j < num_oprs; j++) {
+                mark_opr_used(a, *oprs[j], used);
+            }
+        }
+    }
+    used[0] |= ((uint64_t) 1 << a->num_pregs) - 1;
+    int pressure = 0;
+    for (size_t i = 0; i < vec_len(loop->bbs); i++) {
+        BB *bb = vec_get(loop->bbs, i);
+        memcpy(live, a->live_out[bb->n], sizeof(uint64_t) * a->num_words);
+        for (AsmIns *ins = bb->asm_last; ins; ins = ins->prev) {
+            int defs[MAX_ASM_OPRS];
+            int num_defs = ins_use_def(a, ins, live, defs);
+            int num_live = 0;
+            for (size_t w = 0; w < a->num_words; w++) {
+                num_live += __builtin_popcountll(live[w] & used[w]);
+            }
+            pressure = num_live > pressure ? num_live : pressure;
+            for (int j = 0; j < num_defs; j++) {
+                remove_reg(live, defs[j]);
+            }
+            clear_pregs(a, live);
+        }
+    }
+    return pressure;
+}
+
+// A vreg that's live across a call interferes with every caller-saved reg, so
+// can't use one anywhere. Copy it into a new vreg just for the call and back
+// again after; then only the copy needs a callee-saved reg (or the
+// stack)
+// The call's results are read out of their pregs straight after it, and a
+// preg's only live at the instructions that mention it, so the copies back
+// have to go after those reads (so long as they don't use 'vreg') or they
+// could be given the same preg. Likewise, the arguments are only kept live in
+// their pregs for the one program point before the call, so the copy in goes
+// before they're set up, or its spill code could clobber one
+static AsmIns * before_call_args(AsmIns *call) {
+    AsmIns *ins = call;
+    while (ins->prev && ins->prev->l &&
+           ((ins->prev->l->k == OPR_GPR && ins->prev->l->reg < TARGET->num_gprs) ||
+            (ins->prev->l->k == OPR_XMM && ins->prev->l->reg < TARGET->num_fprs))) {
+        ins = ins->prev;
+    }
+    return ins;
+}
+
+static AsmIns * after_call_results(RegAlloc *a, AsmIns *call, int vreg) {
+    AsmIns *ins = call->next;
+    while (ins && ins->r && is_group_reg(a, ins->r) && ins->r->reg < a->num_pregs &&
+            ins->l && is_group_reg(a, ins->l) && ins->l->reg >= a->num_pregs &&
+            ins->l->reg != vreg) {
+        ins = ins->next;
+    }
+    return ins;
+}
+
+static void split_around_calls(RegAlloc *a, uint64_t *to_split) {
+    int k = group_opr_k(a);
+    uint64_t live[a->num_words];
+    for (BB *bb = a->fn->entry; bb; bb = bb->next) {
+        memcpy(live, a->live_out[bb->n], sizeof(uint64_t) * a->num_words);
+        AsmIns *prev;
+        for (AsmIns *ins = bb->asm_last; ins; ins = prev) {
+            prev = ins->prev; // Skip over the copies inserted below
+            if (clobbers_all(a, ins)) {
+                for (size_t i = bits_next(live, a->num_words, a->num_pregs);
+                        i < a->num_words * 64; i = bits_next(live, a->num_words, i + 1)) {
+                    int vreg = (int) i;
+                    if (!has_reg(to_split, vreg) ||
+                            (ins->l && mentions_reg(a, ins->l, vreg))) {
+                        continue; // Not live across the call
+                    }
+                    int tmp = new_vreg(a);
+                    TARGET->split_copy(bb, before_call_args(ins), k, tmp, vreg);
+                    TARGET->split_copy(bb, after_call_results(a, ins, vreg), k, vreg, tmp);
+                    if (a->debug) {
+                        printf("splitting ");
+                        print_reg(a, vreg);
+                        printf(" around call\n");
+                    }
+                }
+            }
+            int defs[MAX_ASM_OPRS];
+            int num_defs = ins_use_def(a, ins, live, defs);
+            for (int i = 0; i < num_defs; i++) {
+                remove_reg(live, defs[i]);
+            }
+            clear_pregs(a, live);
+        }
+    }
+}
+
+static int ins_mentions_reg(RegAlloc *a, AsmIns *ins, int reg) {
+    AsmOpr **oprs[MAX_INS_OPRS];
+    int num_oprs = ins_oprs(ins, oprs);
+    for (int i = 0; i < num_oprs; i++) {
+        if (mentions_reg(a, *oprs[i], reg)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int loop_mentions_reg(RegAlloc *a, Loop *loop, int reg) {
+    for (size_t i = 0; i < vec_len(loop->bbs); i++) {
+        BB *bb = vec_get(loop->bbs, i);
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            if (ins_mentions_reg(a, ins, reg)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int has_bb(Vec *bbs, BB *bb) {
+    for (size_t i = 0; i < vec_len(bbs); i++) {
+        if (vec_get(bbs, i) == bb) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Copies go at the end of the preheader and the start of each exit, so every
+// exit has to be reached only from inside the loop. Returns NULL if one isn't
+static Vec * loop_exits(Loop *loop) {
+    Vec *exits = vec_new();
+    for (size_t i = 0; i < vec_len(loop->bbs); i++) {
+        BB *bb = vec_get(loop->bbs, i);
+        for (size_t j = 0; j < vec_len(bb->succ); j++) {
+            BB *exit = vec_get(bb->succ, j);
+            if (in_loop(exit, loop) || has_bb(exits, exit)) {
+                continue;
+            }
+            for (size_t k = 0; k < vec_len(exit->pred); k++) {
+                if (!in_loop(vec_get(exit->pred, k), loop)) {
+                    return NULL;
+                }
+            }
+            vec_push(exits, exit);
+        }
+    }
+    return exits;
+}
+
+// A vreg that's live into a loop and used inside it gets a new vreg for the
+// whole loop, copied in at the end of the preheader and back out at each exit
+// it's still live at. If there isn't a reg for it everywhere, the part outside
+// the loop (where uses are cheaper; see 'compute_spill_costs') can be spilled
+// while the loop keeps it in a reg
+static void split_around_loop(RegAlloc *a, Loop *loop, uint64_t *to_split) {
+    BB *preheader = find_preheader(loop);
+    Vec *exits = preheader ? loop_exits(loop) : NULL;
+    if (!exits) {
+        return;
+    }
+    int k = group_opr_k(a);
+    AsmIns *jmp = preheader->asm_last; // Copy in after any phi copies
+    if (jmp && jmp->op != TARGET->jmp) {
+        jmp = NULL;
+    }
+    for (int vreg = a->num_pregs; vreg < a->num_regs; vreg++) {
+        if (!has_reg(to_split, vreg) || !has_reg(a->live_in[loop->header->n], vreg) ||
+                !loop_mentions_reg(a, loop, vreg)) {
+            continue;
+        }
+        int inside = new_vreg(a);
+        for (size_t i = 0; i < vec_len(loop->bbs); i++) {
+            BB *bb = vec_get(loop->bbs, i);
+            for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+                rename_reg(a, ins, vreg, inside);
+            }
+        }
+        TARGET->split_copy(preheader, jmp, k, inside, vreg);
+        if (a->debug) {
+            printf("splitting ");
+            print_reg(a, vreg);
+            printf(" around loop at .BB%zu\n", loop->header->n);
+        }
+        for (size_t i = 0; i < vec_len(exits); i++) {
+            BB *exit = vec_get(exits, i);
+            if (has_reg(a->live_in[exit->n], vreg)) {
+                TARGET->split_copy(exit, exit->asm_head, k, vreg, inside);
+            }
+        }
+    }
+}
+
+// Splits the live ranges of spilled vregs (all the vregs coalesced into them
+// too). Uses the live-in and live-out sets from the allocation that failed,
+// so everything's measured before the new vregs are added. Returns whether
+// anything was split
+static int split_spilled(RegAlloc *a, int *coalesce_map, int *spilled) {
+    double *crossings = calloc(a->num_regs, sizeof(double));
+    count_call_crossings(a, crossings);
+    uint64_t *around_loops = regs_new(a), *around_calls = regs_new(a);
+    for (int vreg = a->num_pregs; vreg < a->num_regs; vreg++) {
+        int target = spill_target(a, vreg, coalesce_map, spilled);
+        if (!target || a->remat[target]) { // Remat is cheaper
+            continue;
+        }
+        put_reg(around_loops, vreg);
+        // A store and load around each call has to be cheaper than spilling
+        if (crossings[vreg] > 0 && 2 * crossings[vreg] < a->spill_costs[vreg]) {
+            put_reg(around_calls, vreg);
+        }
+    }
+    // Only worth splitting around a loop if everything used in it fits in
+    // regs; otherwise the part inside would just be spilled too
+    Vec *loops = a->fn->loops;
+    int fits[vec_len(loops) + 1];
+    for (size_t i = 0; i < vec_len(loops); i++) {
+        fits[i] = loop_pressure(a, vec_get(loops, i)) < a->num_pregs;
+    }
+
+    int num_regs = a->num_regs;
+    split_around_calls(a, around_calls);
+    for (size_t i = vec_len(loops); i > 0; i--) { // Innermost loops first
+        if (fits[i - 1]) {
+            split_around_loop(a, vec_get(loops, i - 1), around_loops);
+        }
+    }
+    free(crossings);
+    free(around_loops);
+    free(around_calls);
+    update_num_regs(a);
+    return a->num_regs != num_regs;
+}
+
+
+// ---- Register Replacement After Allocation ---------------------------------
+
+static int map_vreg(RegAlloc *a, int reg, int *reg_map, int *coalesce_map) {
+    if (reg < a->num_pregs) {
+        return reg; // Not a vreg
+    }
+    while (reg >= a->num_pregs && coalesce_map[reg]) {
+        reg = coalesce_map[reg]; // Find end of coalescing chain
+    }
+    if (reg >= a->num_pregs) { // If not coalesced into a preg
+        reg = reg_map[reg]; // Find allocated preg
+    }
+    assert(reg > R_NONE);
+    return reg;
+}
+
+static void replace_vregs_in_op(RegAlloc *a, AsmOpr *op, int *reg_map, int *coalesce_map) {
+    if (!op) return;
+    if (a->group == REG_GROUP_GPR) {
+        switch (op->k) {
+        case OPR_GPR:
+            op->reg = map_vreg(a, op->reg, reg_map, coalesce_map);
+            break;
+        case OPR_MEM:
+            op->base = map_vreg(a, op->base, reg_map, coalesce_map);
             op->idx = map_vreg(a, op->idx, reg_map, coalesce_map);
             break;
         }
@@ -612,25 +2255,21 @@ static void replace_vregs_in_op(RegAlloc *a, AsmOpr *op, int *reg_map, int *coal
 }
 
 static int is_redundant_mov(RegAlloc *a, AsmIns *ins) {
-    if (a->group == REG_GROUP_GPR) {
-        return ins->op >= X64_MOV && ins->op <= X64_MOVZX && // is mov?
-               ins->l->k == OPR_GPR && ins->r->k == OPR_GPR && // both regs?
-               ins->l->reg == ins->r->reg && // same reg?
-               !((ins->op == X64_MOVSX || ins->op == X64_MOVZX) &&
-                 ins->l->size > ins->r->size); // Don't remove (e.g.) movsx rax, ax
-    } else { // SSE
-        return ins->op >= X64_MOVSS && ins->op <= X64_MOVSD && // is mov?
-               ins->l->k == OPR_XMM && ins->r->k == OPR_XMM && // both regs?
-               ins->l->reg == ins->r->reg; // same reg?
-    }
+    int mov = TARGET->is_move(ins);
+    return mov != MOV_NONE && is_group_reg(a, ins->l) && // is mov?
+           ins->l->reg == ins->r->reg && // same reg?
+           !(mov == MOV_EXTEND && ins->l->size > ins->r->size); // Don't remove (e.g.) movsx rax, ax
 }
 
 static void replace_vregs(RegAlloc *a, int *reg_map, int *coalesce_map) {
     // Run through the code and replace each vreg with its allocated preg
     for (BB *bb = a->fn->entry; bb; bb = bb->next) {
         for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
-            replace_vregs_in_op(a, ins->l, reg_map, coalesce_map);
-            replace_vregs_in_op(a, ins->r, reg_map, coalesce_map);
+            AsmOpr **oprs[MAX_INS_OPRS];
+            int num_oprs = ins_oprs(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                replace_vregs_in_op(a, *oprs[i], reg_map, coalesce_map);
+            }
             if (is_redundant_mov(a, ins)) {
                 delete_asm(ins); // Remove redundant mov
             }
@@ -639,29 +2278,199 @@ static void replace_vregs(RegAlloc *a, int *reg_map, int *coalesce_map) {
 }
 
 
+// ---- Interprocedural -------------------------------------------------------
+
+int IPA_RA = 1;
+
+#define LEVEL_NONE (-1)
+#define LEVEL_VISITING (-2)
+
+static int call_level(Fn *fn) {
+    if (fn->ra_level != LEVEL_NONE) {
+        return fn->ra_level; // LEVEL_VISITING for a recursive call
+    }
+    fn->ra_level = LEVEL_VISITING;
+    int level = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            Fn *callee = ins->op == IR_CALL ? static_callee(ins->fn) : NULL;
+            int callee_level = callee ? call_level(callee) : LEVEL_VISITING;
+            if (callee_level >= level) {
+                level = callee_level + 1;
+            }
+        }
+    }
+    fn->ra_level = level;
+    return level;
+}
+
+// A recursive call is left out of its caller's level, so it clobbers every
+// caller-saved preg (see 'implicit_clobbers')
+int order_by_calls(Vec *globals, int enabled) {
+    int num_levels = 1;
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k == G_FN_DEF) {
+            g->fn->ra_level = enabled ? LEVEL_NONE : 0;
+        }
+    }
+    for (size_t i = 0; enabled && i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k == G_FN_DEF && call_level(g->fn) >= num_levels) {
+            num_levels = g->fn->ra_level + 1;
+        }
+    }
+    return num_levels;
+}
+
+// The caller-saved pregs in 'a''s group that anything in the function writes
+// (or reads, which is simpler and only costs the argument pregs)
+static uint64_t find_clobbers(RegAlloc *a) {
+    uint64_t regs = 0;
+    for (BB *bb = a->fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            if (ins->op == X64_ASM || ins->op == X64_ASM_CLOBBER) {
+                return caller_saved(a);
+            }
+            regs |= implicit_clobbers(a, ins);
+            AsmOpr **oprs[MAX_INS_OPRS];
+            int num_oprs = ins_oprs(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                if (is_group_reg(a, *oprs[i])) {
+                    regs |= (uint64_t) 1 << (*oprs[i])->reg;
+                }
+            }
+        }
+    }
+    return regs & caller_saved(a);
+}
+
+
 // ---- Register Allocation ---------------------------------------------------
 
-static void alloc_reg_group(RegAlloc *a) {
-    if (a->num_regs == a->num_pregs) {
-        return; // No vregs to allocate
+static void number_ins(Fn *fn);
+
+// One round of allocation for a register group, found without changing the
+// code, so the GPR and SSE groups can be coloured at the same time
+typedef struct {
+    int *reg_map;      // Maps vreg -> allocated preg
+    int *coalesce_map; // Maps vreg -> coalesced vreg or preg
+    int *spilled;
+    int num_spilled;
+} Allocation;
+
+// The live ranges and interference graph are only built from scratch for the
+// first round, and after splitting; spilling updates them
+static void colour_reg_group(RegAlloc *a, int allocator, Allocation *r) {
+    if (!a->live_ranges) {
+        a->live_ranges = live_ranges_for_fn(a);
+        a->num_ranges = a->num_regs;
     }
-    Vec **live_ranges = live_ranges_for_fn(a);
     if (a->debug) {
-        print_live_ranges(a, live_ranges);
+        print_live_ranges(a, a->live_ranges);
+    }
+    compute_spill_costs(a, a->live_ranges);
+    r->reg_map = calloc(a->num_regs, sizeof(int));
+    r->coalesce_map = calloc(a->num_regs, sizeof(int));
+    r->spilled = calloc(a->num_regs, sizeof(int));
+    if (allocator == REG_ALLOC_LINEAR) {
+        r->num_spilled = linear_scan(a, a->live_ranges, r->reg_map, r->spilled);
+    } else {
+        if (!a->ig) {
+            a->ig = interference_graph(a, a->live_ranges);
+        }
+        Graph *ig = graph_copy(a->ig); // Coalescing adds edges
+        r->num_spilled = color_graph(a, ig, r->reg_map, r->coalesce_map, r->spilled);
+        graph_free(ig);
+    }
+}
+
+static void free_allocation(Allocation *r) {
+    free(r->reg_map);
+    free(r->coalesce_map);
+    free(r->spilled);
+}
+
+// Spilling always leaves fewer regs live where there were too many, so it
+// should converge well before this; but if it doesn't, every vreg is spilled
+// rather than the compiler hanging. That leaves only the spill temporaries,
+// which are never spilled again, so the next round colours everything
+#define MAX_ROUNDS 64
+
+static void spill_everything(RegAlloc *a, Allocation *r) {
+    memset(r->coalesce_map, 0, sizeof(int) * a->num_regs);
+    for (int vreg = a->num_pregs; vreg < a->num_regs; vreg++) {
+        r->spilled[vreg] = !is_spill_temp(a, vreg);
+    }
+}
+
+// Replaces the vregs if nothing was spilled, and returns 1. Otherwise splits
+// or spills the vregs in 'r' for another round (after 'number_ins'). 'rounds'
+// counts the rounds so far
+static int apply_allocation(RegAlloc *a, Allocation *r, int *split, int *rounds) {
+    if (!r->num_spilled) {
+        replace_vregs(a, r->reg_map, r->coalesce_map);
+        return 1;
+    }
+    if (++*rounds >= MAX_ROUNDS) {
+        spill_everything(a, r);
+        rewrite_spilled(a, r->coalesce_map, r->spilled);
+        return 0;
+    }
+
+    // Try splitting the spilled vregs first, once
+    if (!*split && split_spilled(a, r->coalesce_map, r->spilled)) {
+        *split = 1;
+        free_live_ranges(a);
+    } else { // Spill to the stack and try again with the new code
+        rewrite_spilled(a, r->coalesce_map, r->spilled);
+    }
+    return 0;
+}
+
+// Saves any of the target's callee-saved GPRs that the allocator handed out.
+// There are no callee-saved SSE regs
+static void save_callee_saved_regs(Fn *fn) {
+    int used[TARGET->num_gprs];
+    memset(used, 0, sizeof(used));
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            if (ins->op == X64_ASM) { // Clobbers count too
+                for (int reg = 0; reg < 16; reg++) {
+                    used[RAX + reg] |= (ins->block->inline_asm->clobbers >> reg) & 1;
+                }
+            }
+            AsmOpr **oprs[MAX_INS_OPRS];
+            int num_oprs = ins_oprs(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                AsmOpr *opr = *oprs[i];
+                if (opr->k == OPR_GPR) {
+                    used[opr->reg] = 1;
+                } else if (opr->k == OPR_MEM) {
+                    used[opr->base] = 1;
+                    used[opr->idx] = 1;
+                }
+            }
+        }
+    }
+    for (int i = 0; i < TARGET->num_callee_saved; i++) {
+        if (used[TARGET->callee_saved[i]]) {
+            TARGET->save_callee_saved(fn, TARGET->callee_saved[i]);
+        }
+    }
+    if (omits_frame_ptr(fn) && used[TARGET->fp]) { // Otherwise saved by the prologue
+        TARGET->save_callee_saved(fn, TARGET->fp);
     }
-    Graph *ig = interference_graph(a, live_ranges);
-    Graph *cg = coalescing_graph(a, live_ranges);
-    int reg_map[a->num_regs]; // Maps vreg -> allocated preg
-    memset(reg_map, 0, a->num_regs * sizeof(int));
-    int coalesce_map[a->num_regs]; // Maps vreg -> coalesced vreg or preg
-    memset(coalesce_map, 0, a->num_regs * sizeof(int));
-    color_graph(a, ig, cg, reg_map, coalesce_map);
-    replace_vregs(a, reg_map, coalesce_map);
 }
 
 static void number_ins(Fn *fn) {
-    size_t i = 0;
+    size_t i = 0, n = 0;
     for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->n = n++;
+        i++; // Extra program point at the START of a BB for vregs that are
+             // live-in, so that one that dies at the first instruction
+             // still interferes with the others that are live-in, but not
+             // with what that instruction defines
         for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
             ins->n = i++;
         }
@@ -669,21 +2478,162 @@ static void number_ins(Fn *fn) {
     }
 }
 
-static void alloc_fn(Fn *fn, int debug) {
+// The program point at the start of each BB (by 'bb->n'), before a round
+// changes the code; sets 'num_points'
+static size_t * bb_start_points(Fn *fn, size_t *num_points) {
+    size_t num_bbs = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        num_bbs++;
+    }
+    size_t *starts = malloc(sizeof(size_t) * num_bbs);
+    size_t n = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        starts[bb->n] = n;
+        n = bb->asm_last ? bb->asm_last->n + 2 : n + 2;
+    }
+    *num_points = n;
+    return starts;
+}
+
+// Maps each program point from before a round (see 'bb_start_points') to
+// where it is once the new code is numbered too, and collects the new code in
+// 'added' (new instructions still have 'n' 0). The point of a deleted
+// instruction goes to whatever's after it, which goes in 'after_deleted'
+static size_t * moved_points(Fn *fn, size_t *starts, size_t num_points,
+                             Vec *added, Vec *after_deleted) {
+    size_t *moved = malloc(sizeof(size_t) * num_points);
+    size_t i = 0, old = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        size_t end = bb->next ? starts[bb->next->n] - 1 : num_points - 1;
+        assert(old == starts[bb->n]);
+        moved[old++] = i++;
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next, i++) {
+            if (!ins->n) {
+                vec_push(added, ins);
+            } else if (old < ins->n) {
+                vec_push(after_deleted, ins);
+            }
+            while (ins->n && old <= ins->n) {
+                moved[old++] = i;
+            }
+        }
+        while (old <= end) {
+            moved[old++] = i;
+        }
+        i++;
+    }
+    return moved;
+}
+
+
+// Colouring the smaller group has to take a lot longer than starting a thread
+#define MIN_PARALLEL_VREGS 512
+
+typedef struct {
+    RegAlloc *groups[2]; // That still have vregs left to allocate
+    int num_groups;
+    int allocator;
+    Allocation rounds[2];
+} Rounds;
+
+static void colour_group(void *arg, size_t i) {
+    Rounds *r = arg;
+    colour_reg_group(r->groups[i], r->allocator, &r->rounds[i]);
+}
+
+// The GPR and SSE groups share no regs, and colouring only reads the code, so
+// each round colours both groups at once (on two threads if 'num_threads' is
+// 2). Splitting and spilling change the code, so they're done one group at a
+// time after that. They only use a group's liveness at the start and end of
+// each BB, which the other group's spill code doesn't change. The output's the
+// same either way
+static void alloc_reg_groups(Fn *fn, RegAlloc **groups, int allocator, int num_threads) {
+    Rounds r = { .num_groups = 0, .allocator = allocator };
+    for (int i = 0; i < 2; i++) {
+        if (groups[i]->num_regs > groups[i]->num_pregs) { // Any vregs?
+            r.groups[r.num_groups++] = groups[i];
+        }
+    }
+    int split[2] = { 0, 0 }, rounds[2] = { 0, 0 }; // Per group
+    while (r.num_groups > 0) {
+        parallel_for((size_t) r.num_groups, num_threads, colour_group, &r);
+        size_t num_points;
+        size_t *starts = bb_start_points(fn, &num_points);
+        int n = 0;
+        for (int i = 0; i < r.num_groups; i++) {
+            RegAlloc *a = r.groups[i];
+            if (!apply_allocation(a, &r.rounds[i], &split[a->group], &rounds[a->group])) {
+                r.groups[n++] = a; // Another round
+            }
+            free_allocation(&r.rounds[i]);
+        }
+        r.num_groups = n;
+        if (n > 0) {
+            Vec *added = vec_new(), *after_deleted = vec_new();
+            size_t *moved = moved_points(fn, starts, num_points, added, after_deleted);
+            number_ins(fn);
+            for (int i = 0; i < n; i++) {
+                if (r.groups[i]->live_ranges) { // Only spilled
+                    update_live_ranges(r.groups[i], moved, added, after_deleted);
+                }
+            }
+            free(moved);
+            vec_free(added);
+            vec_free(after_deleted);
+        }
+        free(starts);
+    }
+}
+
+// Colouring the smaller group has to take a lot longer than starting a thread
+#define MIN_PARALLEL_VREGS 512
+
+void reg_alloc_fn(Fn *fn, int allocator, int num_threads, int debug) {
     number_ins(fn);
-    cfg_analysis(fn);
-    RegAlloc *gpr = new_reg_alloc(fn, REG_GROUP_GPR, debug);
-    alloc_reg_group(gpr);
-    RegAlloc *sse = new_reg_alloc(fn, REG_GROUP_SSE, debug);
-    alloc_reg_group(sse);
+    analyse_cfg(fn);
+    RegAlloc *groups[] = {
+        new_reg_alloc(fn, REG_GROUP_GPR, debug),
+        new_reg_alloc(fn, REG_GROUP_SSE, debug),
+    };
+    int gpr_vregs = groups[0]->num_regs - groups[0]->num_pregs;
+    int sse_vregs = groups[1]->num_regs - groups[1]->num_pregs;
+    int parallel = num_threads > 1 && !debug && // Debug output has to be in order
+                   gpr_vregs >= MIN_PARALLEL_VREGS && sse_vregs >= MIN_PARALLEL_VREGS;
+    alloc_reg_groups(fn, groups, allocator, parallel ? 2 : 1);
+    if (TARGET->shrink_wrap) {
+        TARGET->shrink_wrap(fn);
+    }
+    save_callee_saved_regs(fn);
+    TARGET->patch_stack_sizes(fn);
+    fn->gpr_clobbers = find_clobbers(groups[0]);
+    fn->sse_clobbers = find_clobbers(groups[1]);
+    if (fn->codegen) {
+        CodegenStats *s = fn->codegen;
+        s->vregs = gpr_vregs + sse_vregs;
+        for (int i = 0; i < 2; i++) {
+            s->ig_edges += groups[i]->ig_edges;
+            s->coalesced += groups[i]->coalesced;
+            s->spills += groups[i]->spills;
+            s->reloads += groups[i]->reloads;
+            s->remats += groups[i]->remats;
+        }
+    }
+    free_reg_alloc(groups[0]);
+    free_reg_alloc(groups[1]);
 }
 
-void reg_alloc(Vec *globals, int debug) {
-    for (size_t i = 0; i < vec_len(globals); i++) {
-        Global *g = vec_get(globals, i);
-        if (g->k == G_FN_DEF) {
+void reg_alloc(Vec *globals, int allocator, int debug) {
+    int num_levels = order_by_calls(globals, IPA_RA);
+    for (int level = 0; level < num_levels; level++) {
+        for (size_t i = 0; i < vec_len(globals); i++) {
+            Global *g = vec_get(globals, i);
+            if (g->k != G_FN_DEF || g->fn->ra_level != level) {
+                continue;
+            }
             if (debug) printf("Register allocation for '%s':\n", g->label);
-            alloc_fn(g->fn, debug);
+            fn_begin(g);
+            reg_alloc_fn(g->fn, allocator, 1, debug);
+            fn_end();
             if (debug) printf("\n");
         }
     }
@@ -4,6 +4,31 @@
 
 #include "assemble.h"
 
-void reg_alloc(Vec *globals, int debug);
+enum {
+    REG_ALLOC_GRAPH,  // Graph colouring (better code)
+    REG_ALLOC_LINEAR, // Linear scan (faster)
+};
+
+// '-fno-ipa-ra': assume every call clobbers all the caller-saved regs
+extern int IPA_RA;
+
+// Interprocedural register allocation. A function is allocated after the
+// 'static' functions it calls, which records the caller-saved pregs each one
+// writes (counting its own calls), so its calls to them only clobber those.
+// Sets each function's 'ra_level' (one more than its callees', leaving out
+// recursive calls), and returns the number of levels; everything on a level
+// has to be allocated before anything on the next. With 'enabled' 0, they're
+// all on one level, and every call clobbers everything
+int order_by_calls(Vec *globals, int enabled);
+
+void reg_alloc(Vec *globals, int allocator, int debug);
+
+// With 'num_threads' > 1, a large function's GPRs and SSE regs are coloured
+// at the same time, on two threads
+void reg_alloc_fn(Fn *fn, int allocator, int num_threads, int debug);
+
+// Whether the 'i'th operand of an instruction (see 'ins_oprs') is defined, and
+// whether it's used (also for the scheduler)
+void opr_use_def(AsmIns *ins, int i, int *is_def, int *is_use);
 
 #endif
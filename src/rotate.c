@@ -0,0 +1,297 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rotate.h"
+#include "analysis.h"
+
+// A loop that comes out of 'compile_while' or 'compile_for' looks like:
+//   preheader: ...; br header
+//   header: phis; test; condbr test, body, exit
+//   body: ...
+//   latch: ...; br header
+// Rotating it copies the test into the preheader and the latch, and the
+// header goes:
+//   preheader: ...; test'; condbr test', body, exit
+//   body: phis; ...
+//   latch: ...; test''; condbr test'', body, exit
+// Each of the header's values that's used in the body gets a phi there that
+// picks between its copy in the preheader and its copy in the latch (for a
+// phi, the value it had coming from each); likewise in the exit, for uses
+// after the loop. A loop is only rotated if:
+//   * it has a preheader and a single latch;
+//   * the header only holds phis and a short test with no side effects;
+//   * neither the body nor the exit has any other way in (or phis);
+//   * and everything that uses one of the header's values is only reached
+//     through one of them.
+// 'layout_bbs' still rotates the loops left alone here, but has to jump into
+// them at the test.
+
+#define MAX_TEST 8 // Instructions in the test (not counting constants)
+
+typedef struct {
+    Loop *loop;
+    BB *pre, *header, *latch, *body, *exit;
+    IrIns **guard;  // Per ins in the header; its copy in the preheader
+    IrIns **bottom; // Likewise in the latch
+    IrIns **in_body, **in_exit; // Phis for the header's values
+    Vec *to_fill;   // of 'IrIns *'; header values whose body phi needs defs
+} Rotation;
+
+
+// ---- Loop Shape ------------------------------------------------------------
+
+// The header's test is copied in front of the loop, so it can only hold cheap
+// instructions with no side effects
+static int is_cheap(IrIns *ins) {
+    return ins->op == IR_IMM || ins->op == IR_FP || ins->op == IR_GLOBAL ||
+           ins->op == IR_LOAD || ins->op == IR_PTRADD || ins->op == IR_SELECT ||
+           (ins->op >= IR_ADD && ins->op <= IR_I2FP);
+}
+
+static int find_edges(Rotation *r) {
+    BB *h = r->header;
+    IrIns *br = h->ir_last;
+    if (br->op != IR_CONDBR || vec_len(h->pred) != 2) {
+        return 0;
+    }
+    int t = in_loop(br->true, r->loop), f = in_loop(br->false, r->loop);
+    if (t == f) {
+        return 0;
+    }
+    r->body = t ? br->true : br->false;
+    r->exit = t ? br->false : br->true;
+    r->latch = vec_get(h->pred, vec_get(h->pred, 0) == r->pre ? 1 : 0);
+    return r->body != h && r->latch->ir_last->op == IR_BR &&
+           vec_len(r->body->pred) == 1 && vec_len(r->exit->pred) == 1 &&
+           r->body->ir_head->op != IR_PHI && r->exit->ir_head->op != IR_PHI;
+}
+
+static int is_short_test(BB *h) {
+    int size = 0;
+    IrIns *ins = h->ir_head;
+    for (; ins->op == IR_PHI; ins = ins->next);
+    for (; ins != h->ir_last; ins = ins->next) {
+        if (!is_cheap(ins)) {
+            return 0;
+        }
+        size += ins->op != IR_IMM && ins->op != IR_FP;
+    }
+    return size <= MAX_TEST;
+}
+
+// Where a use of 'def' by 'ins' is; for a phi, at the end of the predecessor
+// it comes from
+static BB * use_site(IrIns *ins, size_t i) {
+    return ins->op == IR_PHI ? vec_get(ins->preds, i) : ins->bb;
+}
+
+static int is_header_val(Rotation *r, IrIns *ins) {
+    return ins->bb == r->header;
+}
+
+static int has_split_use(Rotation *r, IrIns *user, IrIns *def, size_t i) {
+    BB *site = use_site(user, i);
+    return is_header_val(r, def) && user->bb != r->header &&
+           !dominates(r->body, site) && !dominates(r->exit, site);
+}
+
+// Every use of the header's values after it is only reached through the body
+// or only through the exit
+static int has_split_uses(Rotation *r, Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    if (has_split_use(r, ins, vec_get(ins->defs, i), i)) {
+                        return 1;
+                    }
+                }
+                continue;
+            }
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                if (has_split_use(r, ins, *oprs[i], 0)) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int can_rotate(Rotation *r, Fn *fn) {
+    return (r->pre = find_preheader(r->loop)) && find_edges(r) &&
+           is_short_test(r->header) && !has_split_uses(r, fn);
+}
+
+
+// ---- Transformation --------------------------------------------------------
+
+static IrIns * at_guard(Rotation *r, IrIns *ins) {
+    return is_header_val(r, ins) ? r->guard[ins->n] : ins;
+}
+
+static IrIns * in_body(Rotation *r, IrIns *ins) {
+    if (!r->in_body[ins->n]) {
+        r->in_body[ins->n] = prepend_phi(ins->t, r->body);
+        vec_push(r->to_fill, ins); // Its defs might need more of these
+    }
+    return r->in_body[ins->n];
+}
+
+// A header value, as it would be at the header after the latch. A phi takes
+// what it's given by the latch, which might be what another header value was
+// in the body
+static IrIns * at_bottom(Rotation *r, IrIns *ins) {
+    if (!is_header_val(r, ins)) {
+        return ins;
+    } else if (ins->op != IR_PHI) {
+        return r->bottom[ins->n];
+    }
+    IrIns *next = phi_def(ins, r->latch);
+    return is_header_val(r, next) ? in_body(r, next) : next;
+}
+
+static IrIns * in_exit(Rotation *r, IrIns *ins) {
+    if (!r->in_exit[ins->n]) {
+        IrIns *phi = prepend_phi(ins->t, r->exit);
+        vec_push(phi->preds, r->pre);
+        vec_push(phi->defs, at_guard(r, ins));
+        vec_push(phi->preds, r->latch);
+        vec_push(phi->defs, at_bottom(r, ins));
+        r->in_exit[ins->n] = phi;
+    }
+    return r->in_exit[ins->n];
+}
+
+// Copies the test before 'before', with the header's values replaced by what
+// 'at' gives for them
+static void copy_test(Rotation *r, IrIns **copies, IrIns *before,
+                      IrIns * (*at)(Rotation *, IrIns *)) {
+    for (IrIns *ins = r->header->ir_head; ins != r->header->ir_last; ins = ins->next) {
+        if (ins->op == IR_PHI) {
+            continue;
+        }
+        IrIns *copy = new_ins(ins->op, ins->t);
+        *copy = *ins;
+        IrIns **oprs[3];
+        int num_oprs = ir_operands(copy, oprs);
+        for (int i = 0; i < num_oprs; i++) {
+            *oprs[i] = at(r, *oprs[i]);
+        }
+        insert_ir(copy, before);
+        copies[ins->n] = copy;
+    }
+}
+
+static IrIns * replacement(Rotation *r, IrIns *def, BB *site) {
+    return dominates(r->body, site) ? in_body(r, def) : in_exit(r, def);
+}
+
+static void replace_uses(Rotation *r, Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        if (bb == r->header) {
+            continue;
+        }
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    IrIns *def = vec_get(ins->defs, i);
+                    if (is_header_val(r, def)) {
+                        vec_put(ins->defs, i, replacement(r, def, vec_get(ins->preds, i)));
+                    }
+                }
+                continue;
+            }
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                if (is_header_val(r, *oprs[i])) {
+                    *oprs[i] = replacement(r, *oprs[i], bb);
+                }
+            }
+        }
+    }
+}
+
+// Replaces the branch at the end of 'bb' with a copy of the header's, on 'cond'
+static void emit_test_br(Rotation *r, BB *bb, IrIns *cond) {
+    IrIns *old = bb->ir_last, *hbr = r->header->ir_last;
+    IrIns *br = new_ins(IR_CONDBR, NULL);
+    br->cond = cond;
+    br->true = hbr->true;
+    br->false = hbr->false;
+    br->true_chain = br->false_chain = NULL;
+    br->likely = hbr->likely;
+    insert_ir(br, old);
+    delete_ir(old);
+}
+
+static void rotate(Rotation *r, Fn *fn) {
+    BB *h = r->header;
+    for (IrIns *phi = h->ir_head; phi->op == IR_PHI; phi = phi->next) {
+        r->guard[phi->n] = phi_def(phi, r->pre);
+    }
+    copy_test(r, r->guard, r->pre->ir_last, at_guard);
+    copy_test(r, r->bottom, r->latch->ir_last, at_bottom);
+    replace_uses(r, fn);
+    while (vec_len(r->to_fill) > 0) {
+        IrIns *ins = vec_pop(r->to_fill);
+        IrIns *phi = r->in_body[ins->n];
+        vec_push(phi->preds, r->pre);
+        vec_push(phi->defs, at_guard(r, ins));
+        vec_push(phi->preds, r->latch);
+        vec_push(phi->defs, at_bottom(r, ins));
+    }
+    IrIns *cond = h->ir_last->cond;
+    emit_test_br(r, r->pre, at_guard(r, cond));
+    emit_test_br(r, r->latch, at_bottom(r, cond));
+}
+
+static Loop * next_loop(Fn *fn, Vec *rotated) {
+    for (size_t i = vec_len(fn->loops); i > 0; i--) { // Innermost first
+        Loop *loop = vec_get(fn->loops, i - 1);
+        int done = 0;
+        for (size_t j = 0; j < vec_len(rotated) && !done; j++) {
+            done = vec_get(rotated, j) == loop->header;
+        }
+        if (!done) {
+            return loop;
+        }
+    }
+    return NULL;
+}
+
+void rotate_loops(Fn *fn) {
+    Vec *tried = vec_new(); // of 'BB *'; headers
+    Loop *loop;
+    while ((loop = next_loop(fn, tried))) {
+        vec_push(tried, loop->header);
+        Rotation r = { .loop = loop, .header = loop->header };
+        if (!can_rotate(&r, fn)) {
+            continue;
+        }
+        size_t num_ins = number_ir(fn);
+        r.guard = calloc(num_ins, sizeof(IrIns *));
+        r.bottom = calloc(num_ins, sizeof(IrIns *));
+        r.in_body = calloc(num_ins, sizeof(IrIns *));
+        r.in_exit = calloc(num_ins, sizeof(IrIns *));
+        r.to_fill = vec_new();
+        rotate(&r, fn);
+        free(r.guard);
+        free(r.bottom);
+        free(r.in_body);
+        free(r.in_exit);
+
+        // The header's unreachable now; the body heads the loop instead
+        vec_push(tried, r.body);
+        analyse_cfg(fn);
+        vec_free(rev_postorder(fn));
+        remove_unreachable_bbs(fn);
+        analyse_cfg(fn);
+        analyse_dominators(fn);
+        analyse_loops(fn);
+    }
+}
@@ -0,0 +1,16 @@
+
+#ifndef COSEC_ROTATE_H
+#define COSEC_ROTATE_H
+
+#include "compile.h"
+
+// Loop rotation. A 'while' or 'for' loop tests its condition at the top, so
+// every iteration jumps back to the test and then branches into the body. A
+// rotated loop tests it once in front of the loop (a guard that skips the
+// loop when it wouldn't run at all) and then again at the bottom of the body,
+// so each iteration takes just the one conditional branch back to the top.
+// Runs after the passes that look for loops tested at the top ('vectorise',
+// 'unroll', and so on). Requires 'analyse', and keeps it up to date
+void rotate_loops(Fn *fn);
+
+#endif
@@ -0,0 +1,649 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sccp.h"
+#include "analysis.h"
+
+// Uses the algorithm from 'Constant Propagation with Conditional Branches',
+// Mark N. Wegman and F. Kenneth Zadeck, 1991. Each instruction starts out
+// undefined and only ever moves down to a constant, then to 'overdefined'.
+// Only the CFG edges that can actually be taken (given what's known so far)
+// are followed, so a constant condition stops its dead branch from ever
+// contributing to a phi.
+//
+// A load from a 'const' global is a constant too, if it's at a constant
+// offset and the bytes it reads are in the initialiser (and aren't part of a
+// pointer, whose value isn't known until link time). The load depends on the
+// offsets of the IR_PTRADDs its address is made from, so it's one of their
+// users.
+//
+// A global's address is a constant too, though not one that can be folded
+// into anything. It's followed through phis and loads from 'const' globals
+// whose initialiser has a pointer to it (e.g., a table of functions), so a
+// call through a function pointer that can only be one function becomes a
+// direct call to it (which the register allocator can then see into).
+
+enum {
+    LAT_UNDEF, // Not yet known (optimistically, could be anything)
+    LAT_CONST,
+    LAT_OVER,  // Not a constant
+};
+
+typedef struct {
+    int k;
+    uint64_t imm; // For ints; sign extended from the type's size
+    double fp;    // For floats; rounded to a float for IRT_F32
+    Global *g;    // For pointers; the address of 'g' ('imm' is 0)
+} Lattice;
+
+typedef struct {
+    Fn *fn;
+    Lattice *vals;   // Per ins
+    Vec **users;     // Per ins; of 'IrIns *'
+    int *executable; // Per BB (indexed by 'rpo')
+    Vec **exec_pred; // Per BB; of 'BB *'; predecessors along executable edges
+    Vec *flow;       // of 'BB *'; pairs of (from, to) edges to follow
+    Vec *ssa;        // of 'IrIns *'; instructions to re-evaluate
+} SCCP;
+
+static int is_fp_t(IrType *t) {
+    return t->k == IRT_F32 || t->k == IRT_F64;
+}
+
+
+// ---- Folding ---------------------------------------------------------------
+
+static uint64_t sext(uint64_t v, size_t size) {
+    if (size >= 8) {
+        return v;
+    }
+    int shift = 64 - (int) size * 8;
+    return (uint64_t) ((int64_t) (v << shift) >> shift);
+}
+
+static uint64_t zext(uint64_t v, size_t size) {
+    if (size >= 8) {
+        return v;
+    }
+    return v & ((1ull << (size * 8)) - 1);
+}
+
+// Returns 0 if the operation can't be folded (e.g., division by zero, which
+// has to be left for run time)
+static int fold_int(int op, size_t size, uint64_t l, uint64_t r, uint64_t *out) {
+    int64_t sl = (int64_t) sext(l, size), sr = (int64_t) sext(r, size);
+    uint64_t ul = zext(l, size), ur = zext(r, size);
+    int64_t min = (int64_t) sext(1ull << (size * 8 - 1), size);
+    switch (op) {
+    case IR_ADD: *out = l + r; break;
+    case IR_SUB: *out = l - r; break;
+    case IR_MUL: *out = l * r; break;
+    case IR_UMULH: *out = umulh(l, r); break;
+    case IR_SDIV: case IR_SMOD:
+        if (sr == 0 || (sl == min && sr == -1)) return 0;
+        *out = (uint64_t) (op == IR_SDIV ? sl / sr : sl % sr);
+        break;
+    case IR_UDIV: case IR_UMOD:
+        if (ur == 0) return 0;
+        *out = op == IR_UDIV ? ul / ur : ul % ur;
+        break;
+    case IR_BIT_AND: *out = l & r; break;
+    case IR_BIT_OR:  *out = l | r; break;
+    case IR_BIT_XOR: *out = l ^ r; break;
+    case IR_SHL: case IR_SAR: case IR_SHR:
+        if (ur >= size * 8) return 0; // Undefined; leave it to the hardware
+        *out = op == IR_SHL ? ul << ur :
+               op == IR_SAR ? (uint64_t) (sl >> ur) : ul >> ur;
+        break;
+    case IR_EQ:  *out = ul == ur; break;
+    case IR_NEQ: *out = ul != ur; break;
+    case IR_SLT: *out = sl < sr; break;
+    case IR_SLE: *out = sl <= sr; break;
+    case IR_SGT: *out = sl > sr; break;
+    case IR_SGE: *out = sl >= sr; break;
+    case IR_ULT: *out = ul < ur; break;
+    case IR_ULE: *out = ul <= ur; break;
+    case IR_UGT: *out = ul > ur; break;
+    case IR_UGE: *out = ul >= ur; break;
+    default: return 0;
+    }
+    return 1;
+}
+
+// Undefined for 0 for 'IR_CTZ' and 'IR_CLZ', so that's left to the hardware
+static int fold_bits(int op, size_t size, uint64_t v, uint64_t *out) {
+    v = zext(v, size);
+    uint64_t n = 0;
+    switch (op) {
+    case IR_POPCNT:
+        for (; v; v &= v - 1) n++;
+        break;
+    case IR_CTZ:
+        if (v == 0) return 0;
+        while (!((v >> n) & 1)) n++;
+        break;
+    case IR_CLZ:
+        if (v == 0) return 0;
+        while (!((v >> (size * 8 - 1 - n)) & 1)) n++;
+        break;
+    case IR_BSWAP:
+        for (size_t i = 0; i < size; i++) {
+            n = (n << 8) | ((v >> (i * 8)) & 0xff);
+        }
+        break;
+    default: UNREACHABLE();
+    }
+    *out = n;
+    return 1;
+}
+
+static int fold_fp(int op, double l, double r, Lattice *out) {
+    switch (op) {
+    case IR_ADD:  out->fp = l + r; break;
+    case IR_SUB:  out->fp = l - r; break;
+    case IR_MUL:  out->fp = l * r; break;
+    case IR_FDIV: out->fp = l / r; break;
+    case IR_EQ:  out->imm = l == r; break;
+    case IR_NEQ: out->imm = l != r; break;
+    case IR_FLT: out->imm = l < r; break;
+    case IR_FLE: out->imm = l <= r; break;
+    case IR_FGT: out->imm = l > r; break;
+    case IR_FGE: out->imm = l >= r; break;
+    default: return 0;
+    }
+    return 1;
+}
+
+static int fold_conv(IrIns *ins, Lattice *l, Lattice *out) {
+    IrType *st = ins->l->t;
+    switch (ins->op) {
+    case IR_TRUNC: out->imm = l->imm; break;
+    case IR_SEXT:  out->imm = sext(l->imm, st->size); break;
+    case IR_ZEXT:  out->imm = zext(l->imm, st->size); break;
+    case IR_FTRUNC: case IR_FEXT: out->fp = l->fp; break;
+    case IR_I2FP:
+        if (ins->t->k == IRT_F32) { // Round straight to a float
+            out->fp = (float) (int64_t) sext(l->imm, st->size);
+        } else {
+            out->fp = (double) (int64_t) sext(l->imm, st->size);
+        }
+        break;
+    case IR_FP2I: {
+        // Out of range is undefined behaviour; only fold what's well defined
+        double max = (double) (1ull << (ins->t->size * 8 - 1));
+        if (!(l->fp > -max - 1 && l->fp < max)) return 0;
+        out->imm = (uint64_t) (int64_t) l->fp;
+        break;
+    }
+    default: return 0; // Pointer conversions are left alone
+    }
+    return 1;
+}
+
+// Evaluates an arithmetic or bit operation, comparison, or conversion on
+// known operands
+static Lattice fold(IrIns *ins, Lattice *l, Lattice *r) {
+    Lattice v = { .k = LAT_OVER, .imm = 0, .fp = 0, .g = NULL };
+    int ok;
+    if (ins->op >= IR_POPCNT && ins->op <= IR_BSWAP) {
+        ok = fold_bits(ins->op, ins->t->size, l->imm, &v.imm);
+    } else if (!r) {
+        ok = fold_conv(ins, l, &v);
+    } else if (is_fp_t(ins->l->t)) {
+        ok = fold_fp(ins->op, l->fp, r->fp, &v);
+    } else {
+        ok = fold_int(ins->op, ins->l->t->size, l->imm, r->imm, &v.imm);
+    }
+    if (!ok) {
+        v.k = LAT_OVER;
+        return v;
+    }
+    v.k = LAT_CONST;
+    if (ins->t->k == IRT_F32) {
+        v.fp = (float) v.fp;
+    } else if (!is_fp_t(ins->t)) {
+        v.imm = sext(v.imm, ins->t->size);
+    }
+    return v;
+}
+
+// Reads 'size' bytes (little endian) at 'offset' in a constant global.
+// Returns 0 if they aren't known
+static int read_const(Global *g, int64_t offset, size_t size, uint64_t *out) {
+    if (!g->is_const || offset < 0 || (uint64_t) offset + size > g->t->size) {
+        return 0;
+    }
+    uint64_t bits = 0;
+    switch (g->k) {
+    case G_IMM: bits = g->imm; break;
+    case G_FP:
+        if (g->t->k == IRT_F32) {
+            float f = (float) g->fp;
+            uint32_t b;
+            memcpy(&b, &f, sizeof(b));
+            bits = b;
+        } else {
+            memcpy(&bits, &g->fp, sizeof(bits));
+        }
+        break;
+    case G_INIT:
+        for (size_t i = 0; i < vec_len(g->relocs); i++) {
+            InitReloc *r = vec_get(g->relocs, i);
+            if ((uint64_t) offset < r->offset + 8 && r->offset < (uint64_t) offset + size) {
+                return 0; // Part of a pointer
+            }
+        }
+        for (size_t i = size; i > 0; i--) {
+            uint64_t at = (uint64_t) offset + i - 1;
+            uint8_t byte = at < g->num_bytes ? (uint8_t) g->bytes[at] : 0;
+            bits = (bits << 8) | byte;
+        }
+        *out = bits;
+        return 1;
+    default: return 0; // Not defined here
+    }
+    *out = bits >> (offset * 8); // Within the scalar, so 'offset' < 8
+    return 1;
+}
+
+static Lattice fold_load(IrIns *load, Global *g, int64_t offset) {
+    Lattice v = { .k = LAT_OVER, .imm = 0, .fp = 0, .g = NULL };
+    IrType *t = load->t;
+    uint64_t bits = 0;
+    if (t->k == IRT_PTR) {
+        v.g = const_ptr_at(g, offset, t->size);
+        v.k = v.g ? LAT_CONST : LAT_OVER;
+        return v;
+    } else if (t->k < IRT_I8 || t->k > IRT_F64 || !read_const(g, offset, t->size, &bits)) {
+        return v;
+    }
+    v.k = LAT_CONST;
+    if (t->k == IRT_F32) {
+        uint32_t b = (uint32_t) bits;
+        float f;
+        memcpy(&f, &b, sizeof(f));
+        v.fp = f;
+    } else if (t->k == IRT_F64) {
+        memcpy(&v.fp, &bits, sizeof(v.fp));
+    } else {
+        v.imm = sext(bits, t->size);
+    }
+    return v;
+}
+
+
+// ---- Lattice ---------------------------------------------------------------
+
+static int is_foldable(IrIns *ins) {
+    return (ins->op >= IR_ADD && ins->op <= IR_FGE) || ins->op == IR_TRUNC ||
+           ins->op == IR_SEXT || ins->op == IR_ZEXT ||
+           (ins->op >= IR_FTRUNC && ins->op <= IR_I2FP);
+}
+
+// A constant that isn't an address, so it can be folded
+static int is_known(Lattice *v) {
+    return v->k == LAT_CONST && !v->g;
+}
+
+static int lat_eq(Lattice *a, Lattice *b) {
+    return a->k == b->k && a->imm == b->imm && a->g == b->g &&
+           memcmp(&a->fp, &b->fp, sizeof(double)) == 0; // -0.0 isn't 0.0
+}
+
+static Lattice meet(Lattice a, Lattice b) {
+    if (a.k == LAT_UNDEF) return b;
+    if (b.k == LAT_UNDEF) return a;
+    if (a.k == LAT_OVER || !lat_eq(&a, &b)) {
+        a.k = LAT_OVER;
+    }
+    return a;
+}
+
+static int is_exec_edge(SCCP *s, BB *from, BB *to) {
+    Vec *preds = s->exec_pred[to->rpo];
+    for (size_t i = 0; i < vec_len(preds); i++) {
+        if (vec_get(preds, i) == from) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static Lattice eval_phi(SCCP *s, IrIns *phi) {
+    Lattice v = { .k = LAT_UNDEF, .imm = 0, .fp = 0, .g = NULL };
+    for (size_t i = 0; i < vec_len(phi->preds); i++) {
+        BB *pred = vec_get(phi->preds, i);
+        if (pred->rpo != -1 && is_exec_edge(s, pred, phi->bb)) {
+            IrIns *def = vec_get(phi->defs, i);
+            v = meet(v, s->vals[def->n]);
+        }
+    }
+    return v;
+}
+
+// Undefined until every offset in the load's address is known
+static Lattice eval_load(SCCP *s, IrIns *load) {
+    Lattice v = { .k = LAT_OVER, .imm = 0, .fp = 0, .g = NULL };
+    IrIns *ptr = load->src;
+    int64_t offset = 0;
+    int undef = 0;
+    while (ptr->op == IR_PTRADD || (ptr->op == IR_BITCAST && ptr->l->t->k == IRT_PTR)) {
+        if (ptr->op == IR_BITCAST) {
+            ptr = ptr->l;
+            continue;
+        }
+        Lattice *o = &s->vals[ptr->offset->n];
+        if (o->k == LAT_OVER || o->g) {
+            return v;
+        }
+        undef |= o->k == LAT_UNDEF;
+        offset += (int64_t) o->imm;
+        ptr = ptr->base;
+    }
+    if (ptr->op != IR_GLOBAL || !ptr->g->is_const) {
+        return v;
+    } else if (undef) {
+        v.k = LAT_UNDEF;
+        return v;
+    }
+    return fold_load(load, ptr->g, offset);
+}
+
+static Lattice eval(SCCP *s, IrIns *ins) {
+    Lattice v = { .k = LAT_OVER, .imm = 0, .fp = 0, .g = NULL };
+    if (ins->op == IR_GLOBAL) {
+        v.k = LAT_CONST;
+        v.g = ins->g;
+    } else if (ins->op == IR_IMM) {
+        v.k = LAT_CONST;
+        v.imm = sext(ins->imm, ins->t->size);
+    } else if (ins->op == IR_FP) {
+        v.k = LAT_CONST;
+        v.fp = ins->t->k == IRT_F32 ? (float) ins->fp : ins->fp;
+    } else if (ins->op == IR_PHI) {
+        v = eval_phi(s, ins);
+    } else if (ins->op == IR_LOAD) {
+        v = eval_load(s, ins);
+    } else if (is_foldable(ins)) {
+        IrIns **oprs[3];
+        int num_oprs = ir_operands(ins, oprs);
+        Lattice *l = &s->vals[(*oprs[0])->n];
+        Lattice *r = num_oprs > 1 ? &s->vals[(*oprs[1])->n] : NULL;
+        if (l->k == LAT_OVER || (r && r->k == LAT_OVER) || l->g || (r && r->g)) {
+            return v;
+        } else if (l->k == LAT_UNDEF || (r && r->k == LAT_UNDEF)) {
+            v.k = LAT_UNDEF;
+            return v;
+        }
+        v = fold(ins, l, r);
+    }
+    return v;
+}
+
+
+// ---- Propagation -----------------------------------------------------------
+
+static void add_flow_edge(SCCP *s, BB *from, BB *to) {
+    vec_push(s->flow, from);
+    vec_push(s->flow, to);
+}
+
+static BB * switch_target(IrIns *br, uint64_t idx) {
+    return idx < vec_len(br->table) ? vec_get(br->table, idx) : br->default_br;
+}
+
+static void visit_br(SCCP *s, IrIns *ins) {
+    if (ins->op == IR_BR) {
+        add_flow_edge(s, ins->bb, ins->br);
+        return;
+    } else if (ins->op == IR_SWITCH) {
+        Lattice *idx = &s->vals[ins->idx->n];
+        if (idx->k == LAT_OVER || idx->g) {
+            for (size_t i = 0; i < vec_len(ins->bb->succ); i++) {
+                add_flow_edge(s, ins->bb, vec_get(ins->bb->succ, i));
+            }
+        } else if (idx->k == LAT_CONST) {
+            add_flow_edge(s, ins->bb, switch_target(ins, idx->imm));
+        } // Otherwise, wait until the index is known
+        return;
+    } else if (ins->op == IR_INDIRECT_BR) { // Could go to any label
+        for (size_t i = 0; i < vec_len(ins->bb->succ); i++) {
+            add_flow_edge(s, ins->bb, vec_get(ins->bb->succ, i));
+        }
+        return;
+    }
+    Lattice *cond = &s->vals[ins->cond->n];
+    if (cond->k == LAT_OVER || cond->g) { // An address could be null, if weak
+        add_flow_edge(s, ins->bb, ins->true);
+        add_flow_edge(s, ins->bb, ins->false);
+    } else if (cond->k == LAT_CONST) {
+        int taken = is_fp_t(ins->cond->t) ? cond->fp != 0 : cond->imm != 0;
+        add_flow_edge(s, ins->bb, taken ? ins->true : ins->false);
+    } // Otherwise, wait until the condition is known
+}
+
+static void visit(SCCP *s, IrIns *ins) {
+    if (ins->op == IR_BR || ins->op == IR_CONDBR || ins->op == IR_SWITCH ||
+            ins->op == IR_INDIRECT_BR) {
+        visit_br(s, ins);
+        return;
+    }
+    Lattice v = eval(s, ins);
+    if (lat_eq(&v, &s->vals[ins->n])) {
+        return;
+    }
+    s->vals[ins->n] = v;
+    Vec *users = s->users[ins->n];
+    for (size_t i = 0; i < vec_len(users); i++) {
+        vec_push(s->ssa, vec_get(users, i));
+    }
+}
+
+static void visit_edge(SCCP *s, BB *from, BB *to) {
+    if (from) {
+        if (is_exec_edge(s, from, to)) {
+            return; // Already followed
+        }
+        vec_push(s->exec_pred[to->rpo], from);
+    }
+    int first_visit = !s->executable[to->rpo];
+    s->executable[to->rpo] = 1;
+    for (IrIns *ins = to->ir_head; ins; ins = ins->next) {
+        if (first_visit || ins->op == IR_PHI) { // Only phis can change
+            visit(s, ins);
+        }
+    }
+}
+
+static void find_users(SCCP *s) {
+    for (BB *bb = s->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                vec_push(s->users[(*oprs[i])->n], ins);
+            }
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    IrIns *def = vec_get(ins->defs, i);
+                    vec_push(s->users[def->n], ins);
+                }
+            } else if (ins->op == IR_LOAD) {
+                for (IrIns *ptr = ins->src; ptr->op == IR_PTRADD || ptr->op == IR_BITCAST;
+                        ptr = ptr->op == IR_PTRADD ? ptr->base : ptr->l) {
+                    if (ptr->op == IR_PTRADD) {
+                        vec_push(s->users[ptr->offset->n], ins);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void propagate(SCCP *s) {
+    visit_edge(s, NULL, s->fn->entry);
+    while (vec_len(s->flow) > 0 || vec_len(s->ssa) > 0) {
+        if (vec_len(s->flow) > 0) {
+            BB *to = vec_pop(s->flow);
+            BB *from = vec_pop(s->flow);
+            visit_edge(s, from, to);
+        } else {
+            IrIns *ins = vec_pop(s->ssa);
+            if (ins->bb->rpo != -1 && s->executable[ins->bb->rpo]) {
+                visit(s, ins);
+            }
+        }
+    }
+}
+
+
+// ---- Rewriting -------------------------------------------------------------
+
+static void fold_switch(IrIns *br, uint64_t idx) {
+    BB *target = switch_target(br, idx);
+    for (size_t i = 0; i < vec_len(br->bb->succ); i++) {
+        BB *dead = vec_get(br->bb->succ, i);
+        if (dead != target) {
+            remove_phi_pred(dead, br->bb);
+        }
+    }
+    br->op = IR_BR;
+    br->br = target;
+}
+
+// Replaces constant instructions with an IR_IMM, IR_FP or IR_GLOBAL in place
+// (so their users don't need updating) and folds constant branches. Returns 1
+// if the CFG changed
+static int rewrite(SCCP *s) {
+    int changed = 0;
+    for (BB *bb = s->fn->entry; bb; bb = bb->next) {
+        if (bb->rpo == -1 || !s->executable[bb->rpo]) {
+            bb->rpo = -1; // Deleted below
+            changed = 1;
+            continue;
+        }
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            Lattice *v = &s->vals[ins->n];
+            if (ins->op == IR_CONDBR) {
+                Lattice *cond = &s->vals[ins->cond->n];
+                if (is_known(cond)) {
+                    fold_condbr(ins, is_fp_t(ins->cond->t) ? cond->fp != 0 : cond->imm != 0);
+                    changed = 1;
+                }
+            } else if (ins->op == IR_SWITCH) {
+                Lattice *idx = &s->vals[ins->idx->n];
+                if (is_known(idx)) {
+                    fold_switch(ins, idx->imm);
+                    changed = 1;
+                }
+            } else if (v->k == LAT_CONST && (is_foldable(ins) || ins->op == IR_PHI ||
+                                             ins->op == IR_LOAD)) {
+                if (v->g) {
+                    ins->op = IR_GLOBAL;
+                    ins->g = v->g;
+                } else if (is_fp_t(ins->t)) {
+                    ins->op = IR_FP;
+                    ins->fp = v->fp;
+                } else {
+                    ins->op = IR_IMM;
+                    ins->imm = v->imm;
+                }
+            }
+        }
+    }
+    return changed;
+}
+
+
+// ---- VLAs ------------------------------------------------------------------
+
+// A VLA whose number of elements turned out to be constant becomes a fixed
+// size object in the entry BB, with its own stack slot (see
+// 'assign_stack_slots'), rather than moving rsp at run time. Once there are
+// no dynamic allocations left, the IR_STACK_SAVEs and IR_STACK_RESTOREs
+// around them have nothing to free
+static void fix_allocs(Fn *fn) {
+    Vec *fixed = vec_new();
+    int dynamic = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op != IR_ALLOC || !ins->count) {
+                continue;
+            }
+            IrIns *count = ins->count;
+            size_t size = ins->alloc_t->size;
+            if (count->op == IR_IMM && (int64_t) count->imm > 0 && size > 0 &&
+                    count->imm <= SIZE_MAX / size) {
+                vec_push(fixed, ins);
+            } else {
+                dynamic = 1;
+            }
+        }
+    }
+    for (size_t i = 0; i < vec_len(fixed); i++) {
+        IrIns *alloc = vec_get(fixed, i);
+        IrType *elem = alloc->alloc_t;
+        size_t len = alloc->count->imm;
+        alloc->alloc_t = irt_arr(elem, len, len * elem->size, elem->align);
+        alloc->count = NULL;
+        delete_ir(alloc);
+        IrIns *before = fn->entry->ir_head; // After the other fixed ones
+        while (before->op == IR_FARG || (before->op == IR_ALLOC && !before->count)) {
+            before = before->next;
+        }
+        insert_ir(alloc, before);
+    }
+    for (BB *bb = fn->entry; bb && !dynamic; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head, *next; ins; ins = next) {
+            next = ins->next;
+            if (ins->op == IR_STACK_SAVE || ins->op == IR_STACK_RESTORE) {
+                delete_ir(ins);
+            }
+        }
+    }
+    vec_free(fixed);
+}
+
+void sccp(Fn *fn) {
+    size_t num_ins = number_ir(fn);
+    Vec *rpo = rev_postorder(fn);
+    size_t num_bbs = vec_len(rpo);
+    vec_free(rpo);
+    SCCP s;
+    s.fn = fn;
+    s.vals = calloc(num_ins, sizeof(Lattice)); // All LAT_UNDEF
+    s.users = malloc(sizeof(Vec *) * num_ins);
+    for (size_t i = 0; i < num_ins; i++) {
+        s.users[i] = vec_new();
+    }
+    s.executable = calloc(num_bbs, sizeof(int));
+    s.exec_pred = malloc(sizeof(Vec *) * num_bbs);
+    for (size_t i = 0; i < num_bbs; i++) {
+        s.exec_pred[i] = vec_new();
+    }
+    s.flow = vec_new();
+    s.ssa = vec_new();
+
+    find_users(&s);
+    propagate(&s);
+    if (rewrite(&s)) {
+        remove_unreachable_bbs(fn);
+        analyse_cfg(fn);
+        analyse_dominators(fn);
+        analyse_loops(fn);
+    }
+    fix_allocs(fn);
+    for (size_t i = 0; i < num_ins; i++) {
+        vec_free(s.users[i]);
+    }
+    for (size_t i = 0; i < num_bbs; i++) {
+        vec_free(s.exec_pred[i]);
+    }
+    free(s.vals);
+    free(s.users);
+    free(s.executable);
+    free(s.exec_pred);
+    vec_free(s.flow);
+    vec_free(s.ssa);
+}
@@ -0,0 +1,16 @@
+
+#ifndef COSEC_SCCP_H
+#define COSEC_SCCP_H
+
+#include "compile.h"
+
+// Sparse conditional constant propagation. Folds arithmetic, comparisons,
+// and conversions on constants (through phis), and loads at constant offsets
+// from 'const' globals with known initialisers, turns IR_CONDBRs and
+// IR_SWITCHs on a known condition or index into IR_BRs, deletes the BBs
+// that can no longer be reached, and turns VLAs of a known length into fixed
+// size objects.
+// Requires 'analyse', and keeps it up to date
+void sccp(Fn *fn);
+
+#endif
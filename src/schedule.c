@@ -0,0 +1,647 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "schedule.h"
+#include "reg_alloc.h"
+
+// A list scheduler, one BB at a time. Each BB is cut into regions at the
+// instructions that have to stay where they are (calls, jumps, inline
+// assembly, and the like), and the instructions in a region become the nodes
+// of a DAG, with an edge wherever one has to come before another (through a
+// register, or memory). Nodes are then picked top-down, cycle by cycle: of
+// those whose inputs are ready, the one on the longest (latency weighted)
+// path to the end of the region goes first. Nothing is known about the
+// addresses loads and stores use, so only loads can pass each other.
+//
+// Some runs of instructions have to stay together, as a single node:
+// - A flags def and the instructions that read it (e.g., 'cmp' and 'setl'),
+//   so nothing in between can overwrite them. The 'cmp' before a 'jcc' at the
+//   end of a BB stays next to it, so the pair can be macro-fused
+// - Before register allocation, a preg's def and its uses (e.g., an argument
+//   moved into rdi and the 'call'), since the register allocator only treats
+//   a preg as live at the instructions it appears in (see 'live_ranges')
+//
+// Before register allocation, reordering can also lengthen live ranges, so
+// once more vregs are live than there are registers for, nodes that end live
+// ranges are picked over ones that start them.
+
+#define ISSUE_WIDTH  4   // Instructions started each cycle
+#define LOAD_LATENCY 4   // Extra cycles for a memory operand (from the L1)
+#define MAX_REGION   256 // Longer runs are cut into several regions
+
+#define MAX_LIVE_GPRS 12 // Before nodes that end live ranges go first
+#define MAX_LIVE_SSE  14
+
+int SCHEDULE_INSNS = 1;
+int SCHEDULE_INSNS2 = 0;
+
+// Roughly the latencies on recent Intel and AMD cores (from Agner Fog's
+// instruction tables); 1 cycle if it's not here
+static int LATENCY[X64_LAST] = {
+    [X64_IMUL] = 3, [X64_MUL] = 3, [X64_IDIV] = 26, [X64_DIV] = 26,
+    [X64_POPCNT] = 3, [X64_BSF] = 3, [X64_BSR] = 3, [X64_LZCNT] = 3,
+    [X64_TZCNT] = 3,
+    [X64_ADDSS] = 4, [X64_ADDSD] = 4, [X64_SUBSS] = 4, [X64_SUBSD] = 4,
+    [X64_MULSS] = 4, [X64_MULSD] = 4, [X64_DIVSS] = 11, [X64_DIVSD] = 14,
+    [X64_MINSS] = 4, [X64_MINSD] = 4, [X64_MAXSS] = 4, [X64_MAXSD] = 4,
+    [X64_VADDSS] = 4, [X64_VADDSD] = 4, [X64_VSUBSS] = 4, [X64_VSUBSD] = 4,
+    [X64_VMULSS] = 4, [X64_VMULSD] = 4, [X64_VDIVSS] = 11, [X64_VDIVSD] = 14,
+    [X64_VFMADD231SS] = 4, [X64_VFMADD231SD] = 4, [X64_VFMSUB231SS] = 4,
+    [X64_VFMSUB231SD] = 4, [X64_VFNMADD231SS] = 4, [X64_VFNMADD231SD] = 4,
+    [X64_MOVD] = 2, [X64_MOVQ] = 2, [X64_PMULLW] = 5, [X64_PMULUDQ] = 5,
+    [X64_ADDPS] = 4, [X64_ADDPD] = 4, [X64_SUBPS] = 4, [X64_SUBPD] = 4,
+    [X64_MULPS] = 4, [X64_MULPD] = 4, [X64_DIVPS] = 11, [X64_DIVPD] = 14,
+    [X64_VFMADD231PS] = 4, [X64_VFMADD231PD] = 4, [X64_VFMSUB231PS] = 4,
+    [X64_VFMSUB231PD] = 4, [X64_VFNMADD231PS] = 4, [X64_VFNMADD231PD] = 4,
+    [X64_UCOMISS] = 3, [X64_UCOMISD] = 3, [X64_CVTSS2SD] = 5,
+    [X64_CVTSD2SS] = 5, [X64_CVTSI2SS] = 5, [X64_CVTSI2SD] = 5,
+    [X64_CVTTSS2SI] = 6, [X64_CVTTSD2SI] = 6,
+};
+
+// Instructions that leave the flags alone; everything else might write them
+static int KEEPS_FLAGS[X64_LAST] = {
+    [X64_MOV] = 1, [X64_MOVSX] = 1, [X64_MOVZX] = 1, [X64_MOVSS] = 1,
+    [X64_MOVSD] = 1, [X64_LEA] = 1, [X64_MOVDQU] = 1, [X64_MOVDQA] = 1,
+    [X64_PXOR] = 1, [X64_BSWAP] = 1, [X64_SHLX] = 1, [X64_SHRX] = 1, [X64_SARX] = 1,
+    [X64_CWD] = 1, [X64_CDQ] = 1, [X64_CQO] = 1,
+    [X64_ADDSS] = 1, [X64_ADDSD] = 1, [X64_SUBSS] = 1, [X64_SUBSD] = 1,
+    [X64_MULSS] = 1, [X64_MULSD] = 1, [X64_DIVSS] = 1, [X64_DIVSD] = 1,
+    [X64_MINSS] = 1, [X64_MINSD] = 1, [X64_MAXSS] = 1, [X64_MAXSD] = 1,
+    [X64_VADDSS] = 1, [X64_VADDSD] = 1, [X64_VSUBSS] = 1, [X64_VSUBSD] = 1,
+    [X64_VMULSS] = 1, [X64_VMULSD] = 1, [X64_VDIVSS] = 1, [X64_VDIVSD] = 1,
+    [X64_VFMADD231SS] = 1, [X64_VFMADD231SD] = 1, [X64_VFMSUB231SS] = 1,
+    [X64_VFMSUB231SD] = 1, [X64_VFNMADD231SS] = 1, [X64_VFNMADD231SD] = 1,
+    [X64_MOVD] = 1, [X64_MOVQ] = 1, [X64_PADDB] = 1, [X64_PADDW] = 1,
+    [X64_PADDD] = 1, [X64_PADDQ] = 1, [X64_PSUBB] = 1, [X64_PSUBW] = 1,
+    [X64_PSUBD] = 1, [X64_PSUBQ] = 1, [X64_PMULLW] = 1, [X64_PMULUDQ] = 1,
+    [X64_PAND] = 1, [X64_POR] = 1, [X64_ADDPS] = 1, [X64_ADDPD] = 1,
+    [X64_SUBPS] = 1, [X64_SUBPD] = 1, [X64_MULPS] = 1, [X64_MULPD] = 1,
+    [X64_DIVPS] = 1, [X64_DIVPD] = 1, [X64_VFMADD231PS] = 1,
+    [X64_VFMADD231PD] = 1, [X64_VFMSUB231PS] = 1, [X64_VFMSUB231PD] = 1,
+    [X64_VFNMADD231PS] = 1, [X64_VFNMADD231PD] = 1, [X64_PSLLW] = 1,
+    [X64_PSLLD] = 1, [X64_PSLLQ] = 1, [X64_PSRLW] = 1, [X64_PSRLD] = 1,
+    [X64_PSRLQ] = 1, [X64_PSRAW] = 1, [X64_PSRAD] = 1, [X64_PSRLDQ] = 1,
+    [X64_PUNPCKLBW] = 1, [X64_PUNPCKLWD] = 1, [X64_PUNPCKLDQ] = 1,
+    [X64_PUNPCKLQDQ] = 1, [X64_PACKSSWB] = 1, [X64_PACKSSDW] = 1,
+    [X64_SETE] = 1, [X64_SETNE] = 1, [X64_SETL] = 1, [X64_SETLE] = 1,
+    [X64_SETG] = 1, [X64_SETGE] = 1, [X64_SETB] = 1, [X64_SETBE] = 1,
+    [X64_SETA] = 1, [X64_SETAE] = 1,
+    [X64_CMOVE] = 1, [X64_CMOVNE] = 1, [X64_CMOVL] = 1, [X64_CMOVLE] = 1,
+    [X64_CMOVG] = 1, [X64_CMOVGE] = 1, [X64_CMOVB] = 1, [X64_CMOVBE] = 1,
+    [X64_CMOVA] = 1, [X64_CMOVAE] = 1,
+    [X64_CVTSS2SD] = 1, [X64_CVTSD2SS] = 1, [X64_CVTSI2SS] = 1,
+    [X64_CVTSI2SD] = 1, [X64_CVTTSS2SI] = 1, [X64_CVTTSD2SI] = 1,
+};
+
+static int reads_flags(int op) {
+    return (op >= X64_SETE && op <= X64_SETAE) ||
+           (op >= X64_CMOVE && op <= X64_CMOVAE) || (op >= X64_JE && op <= X64_JAE);
+}
+
+// Instructions that never move, and split a BB into regions
+static int is_barrier(int op) {
+    switch (op) {
+    case X64_REP_MOVSB: case X64_REP_STOSB: case X64_PUSH: case X64_POP:
+    case X64_CALL: case X64_TAIL_CALL: case X64_RET: case X64_SYSCALL: case X64_UD2:
+    case X64_ASM: case X64_ASM_CLOBBER: case X64_LOCK: case X64_PAUSE:
+    case X64_RDTSC: case X64_MFENCE: case X64_LFENCE: case X64_SFENCE:
+    case X64_NOP: case X64_CMPXCHG: case X64_XADD: case X64_XCHG:
+    case X64_LOCK_XADD: case X64_LOCK_CMPXCHG:
+        return 1;
+    default:
+        return op >= X64_JMP && op <= X64_JAE;
+    }
+}
+
+// The pregs a barrier might read, which have to stay live up to it
+static int barrier_reads(AsmIns *barrier, int is_xmm, int preg) {
+    if (!barrier) { // End of a region cut short (see 'MAX_REGION')
+        return 1;
+    }
+    switch (barrier->op) {
+    case X64_CALL: case X64_TAIL_CALL: // Arguments, and 'al' for varargs
+        if (is_xmm) {
+            return preg <= XMM7;
+        }
+        return preg == RAX || preg == RDI || preg == RSI || preg == RDX ||
+               preg == RCX || preg == R8 || preg == R9;
+    case X64_RET:
+        return is_xmm ? preg <= XMM1 : preg == RAX || preg == RDX;
+    default:
+        return !(barrier->op >= X64_JMP && barrier->op <= X64_JAE);
+    }
+}
+
+
+// ---- Dependences -----------------------------------------------------------
+
+// Registers are keyed by their number and kind, so GPRs and SSE registers
+// (which are numbered separately) don't collide
+static int reg_key(int is_xmm, int reg) {
+    return reg * 2 + is_xmm;
+}
+
+static int is_preg_key(int key) {
+    return (key & 1) ? key / 2 < LAST_XMM : key / 2 < LAST_GPR;
+}
+
+// rsp and rbp are live everywhere anyway
+static int is_glued_preg(int key) {
+    return is_preg_key(key) && key != reg_key(0, RSP) && key != reg_key(0, RBP);
+}
+
+typedef struct {
+    int *keys;
+    int n, max;
+} RegSet;
+
+static void regs_add(RegSet *s, int key) {
+    for (int i = 0; i < s->n; i++) {
+        if (s->keys[i] == key) {
+            return;
+        }
+    }
+    if (s->n == s->max) {
+        s->max = s->max ? s->max * 2 : 4;
+        s->keys = realloc(s->keys, sizeof(int) * s->max);
+    }
+    s->keys[s->n++] = key;
+}
+
+static int regs_has(RegSet *s, int key) {
+    for (int i = 0; i < s->n; i++) {
+        if (s->keys[i] == key) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int regs_meet(RegSet *a, RegSet *b) {
+    for (int i = 0; i < a->n; i++) {
+        if (regs_has(b, a->keys[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    RegSet defs, uses;
+    RegSet implicit_defs; // Clobbered (e.g., rdx by 'idiv'), not a value
+    int load, store;
+} Effects;
+
+// 'cqo' and friends read and write rax and rdx without naming them
+static void implicit_effects(AsmIns *ins, Effects *e) {
+    int rax = reg_key(0, RAX), rdx = reg_key(0, RDX);
+    switch (ins->op) {
+    case X64_CWD: case X64_CDQ: case X64_CQO:
+        regs_add(&e->uses, rax);
+        regs_add(&e->defs, rdx);
+        break;
+    case X64_MUL:
+        regs_add(&e->uses, rax);
+        regs_add(&e->implicit_defs, rax);
+        regs_add(&e->implicit_defs, rdx);
+        break;
+    case X64_IDIV: case X64_DIV:
+        regs_add(&e->uses, rax);
+        regs_add(&e->uses, rdx);
+        regs_add(&e->implicit_defs, rax);
+        regs_add(&e->implicit_defs, rdx);
+        break;
+    default: break;
+    }
+    for (int i = 0; i < e->implicit_defs.n; i++) {
+        regs_add(&e->defs, e->implicit_defs.keys[i]);
+    }
+}
+
+static void ins_effects(AsmIns *ins, Effects *e) {
+    AsmOpr **oprs[MAX_INS_OPRS];
+    int num_oprs = ins_oprs(ins, oprs);
+    for (int i = 0; i < num_oprs; i++) {
+        AsmOpr *opr = *oprs[i];
+        int is_def, is_use;
+        opr_use_def(ins, i, &is_def, &is_use);
+        switch (opr->k) {
+        case OPR_GPR: case OPR_XMM: {
+            int key = reg_key(opr->k == OPR_XMM, opr->reg);
+            if (is_def) regs_add(&e->defs, key);
+            if (is_use) regs_add(&e->uses, key);
+            break;
+        }
+        case OPR_MEM:
+            if (opr->base != R_NONE) regs_add(&e->uses, reg_key(0, opr->base));
+            if (opr->idx != R_NONE) regs_add(&e->uses, reg_key(0, opr->idx));
+            // Fall through
+        case OPR_DEREF: case OPR_TPOFF: case OPR_GOTTPOFF:
+            if (ins->op == X64_LEA) {
+                break; // Just the address
+            }
+            e->store |= is_def;
+            e->load |= is_use;
+            break;
+        default: break; // Immediates, and constants that are never written
+        }
+    }
+    implicit_effects(ins, e);
+}
+
+static void free_effects(Effects *e) {
+    free(e->defs.keys);
+    free(e->uses.keys);
+    free(e->implicit_defs.keys);
+}
+
+
+// ---- Regions ---------------------------------------------------------------
+
+typedef struct {
+    int first, num_ins; // Instructions in the region
+    Effects e;
+    int latency, height;
+    int *succs, *succ_lats;
+    int num_succs, max_succs;
+    int num_preds; // That aren't scheduled yet
+    int earliest;  // Cycle its inputs are ready in
+    int done;
+} Node;
+
+typedef struct {
+    Fn *fn;
+    int after_reg_alloc;
+    int *remaining; // Per vreg key; uses in unscheduled nodes
+    int *live;      // Per vreg key
+    int num_live[2]; // GPRs and SSE regs
+} Sched;
+
+typedef struct {
+    int *attached; // Per instruction; in the same node as the one before it
+    int to_start, to_end; // Whether the first and last nodes have to stay put
+} Glue;
+
+// Instructions 'a' to 'b' become part of the same node; 'a' is -1 for the
+// start of the region, and 'b' is 'n' for the end of it
+static void glue(Glue *g, int a, int b, int n) {
+    if (a < 0) {
+        g->to_start = 1;
+        a = 0;
+    }
+    if (b == n) {
+        g->to_end = 1;
+        b = n - 1;
+    }
+    for (int i = a + 1; i <= b; i++) {
+        g->attached[i] = 1;
+    }
+}
+
+static void glue_flags(Glue *g, AsmIns **ins, int n, AsmIns *after) {
+    int writer = -1;
+    for (int i = 0; i < n; i++) {
+        if (reads_flags(ins[i]->op)) {
+            glue(g, writer, i, n);
+        }
+        if (!KEEPS_FLAGS[ins[i]->op]) {
+            writer = i;
+        }
+    }
+    if (writer >= 0 && (!after || reads_flags(after->op))) {
+        glue(g, writer, n, n);
+    }
+}
+
+static void glue_pregs(Glue *g, Effects *e, int n, AsmIns *after) {
+    int num_keys = reg_key(1, LAST_XMM);
+    int last[num_keys]; // The last instruction that mentions each preg
+    int is_value[num_keys]; // And whether it set the preg to something used later
+    for (int k = 0; k < num_keys; k++) {
+        last[k] = -1;
+        is_value[k] = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < e[i].uses.n; j++) {
+            int k = e[i].uses.keys[j];
+            if (is_glued_preg(k)) { // Live-in if there's no def before it
+                glue(g, last[k], i, n);
+                last[k] = i;
+                is_value[k] = 0;
+            }
+        }
+        for (int j = 0; j < e[i].defs.n; j++) {
+            int k = e[i].defs.keys[j];
+            if (is_glued_preg(k)) {
+                last[k] = i;
+                is_value[k] = !regs_has(&e[i].implicit_defs, k);
+            }
+        }
+    }
+    for (int k = 0; k < num_keys; k++) {
+        if (last[k] >= 0 && (is_value[k] || barrier_reads(after, k & 1, k / 2))) {
+            glue(g, last[k], n, n);
+        }
+    }
+}
+
+static void add_succ(Node *from, int to, int latency) {
+    if (from->num_succs == from->max_succs) {
+        from->max_succs = from->max_succs ? from->max_succs * 2 : 4;
+        from->succs = realloc(from->succs, sizeof(int) * from->max_succs);
+        from->succ_lats = realloc(from->succ_lats, sizeof(int) * from->max_succs);
+    }
+    from->succs[from->num_succs] = to;
+    from->succ_lats[from->num_succs++] = latency;
+}
+
+static void build_dag(Node *nodes, int num_nodes, int to_start, int to_end) {
+    for (int j = 0; j < num_nodes; j++) {
+        Node *b = &nodes[j];
+        for (int i = 0; i < j; i++) {
+            Node *a = &nodes[i];
+            if ((to_start && i == 0) || (to_end && j == num_nodes - 1)) {
+                add_succ(a, j, 0);
+                b->num_preds++;
+                continue;
+            }
+            int raw = regs_meet(&b->e.uses, &a->e.defs);
+            int other = regs_meet(&b->e.defs, &a->e.uses) ||
+                        regs_meet(&b->e.defs, &a->e.defs) ||
+                        (a->e.store && (b->e.load || b->e.store)) ||
+                        (a->e.load && b->e.store);
+            if (raw || other) {
+                add_succ(a, j, raw ? a->latency : 0);
+                b->num_preds++;
+            }
+        }
+    }
+    for (int i = num_nodes - 1; i >= 0; i--) { // Longest path to the end
+        Node *a = &nodes[i];
+        a->height = a->latency;
+        for (int s = 0; s < a->num_succs; s++) {
+            int h = a->succ_lats[s] + nodes[a->succs[s]].height;
+            a->height = h > a->height ? h : a->height;
+        }
+    }
+}
+
+static int is_vreg_key(Sched *s, int key) {
+    return !s->after_reg_alloc && !is_preg_key(key);
+}
+
+// How many more vregs of a kind would be live after 'n'
+static int pressure_delta(Sched *s, Node *n, int is_xmm) {
+    int delta = 0;
+    for (int i = 0; i < n->e.defs.n; i++) {
+        int k = n->e.defs.keys[i];
+        if ((k & 1) == is_xmm && is_vreg_key(s, k) && !s->live[k] &&
+                s->remaining[k] > regs_has(&n->e.uses, k)) {
+            delta++;
+        }
+    }
+    for (int i = 0; i < n->e.uses.n; i++) {
+        int k = n->e.uses.keys[i];
+        if ((k & 1) == is_xmm && is_vreg_key(s, k) && s->live[k] &&
+                s->remaining[k] == 1) {
+            delta--;
+        }
+    }
+    return delta;
+}
+
+static void track_pressure(Sched *s, Node *n) {
+    for (int i = 0; i < n->e.uses.n; i++) {
+        int k = n->e.uses.keys[i];
+        if (is_vreg_key(s, k) && --s->remaining[k] == 0 && s->live[k]) {
+            s->live[k] = 0;
+            s->num_live[k & 1]--;
+        }
+    }
+    for (int i = 0; i < n->e.defs.n; i++) {
+        int k = n->e.defs.keys[i];
+        if (is_vreg_key(s, k) && s->remaining[k] > 0 && !s->live[k]) {
+            s->live[k] = 1;
+            s->num_live[k & 1]++;
+        }
+    }
+}
+
+// Whether 'a' should go before 'b', both being ready
+static int better(Sched *s, Node *a, Node *b, int ia, int ib) {
+    int limits[2] = { MAX_LIVE_GPRS, MAX_LIVE_SSE };
+    for (int is_xmm = 0; is_xmm < 2 && !s->after_reg_alloc; is_xmm++) {
+        if (s->num_live[is_xmm] >= limits[is_xmm]) {
+            int da = pressure_delta(s, a, is_xmm), db = pressure_delta(s, b, is_xmm);
+            if (da != db) {
+                return da < db;
+            }
+        }
+    }
+    if (a->height != b->height) {
+        return a->height > b->height;
+    }
+    return ia < ib; // Keep the original order otherwise
+}
+
+static int pick(Sched *s, Node *nodes, int num_nodes, int *cycle) {
+    int best = -1, next_cycle = -1;
+    for (int i = 0; i < num_nodes; i++) {
+        Node *n = &nodes[i];
+        if (n->done || n->num_preds > 0) {
+            continue;
+        } else if (n->earliest > *cycle) { // Not ready yet
+            if (next_cycle < 0 || n->earliest < next_cycle) {
+                next_cycle = n->earliest;
+            }
+        } else if (best < 0 || better(s, n, &nodes[best], i, best)) {
+            best = i;
+        }
+    }
+    if (best < 0) { // Stall until something's ready
+        *cycle = next_cycle;
+        return pick(s, nodes, num_nodes, cycle);
+    }
+    return best;
+}
+
+// Schedules the 'n' instructions in 'ins', followed by 'after' (a barrier, or
+// NULL), and writes them to 'out' in their new order
+static void schedule_region(Sched *s, AsmIns **ins, int n, AsmIns *after, AsmIns **out) {
+    Effects *e = calloc(n, sizeof(Effects));
+    for (int i = 0; i < n; i++) {
+        ins_effects(ins[i], &e[i]);
+    }
+    Glue g = { .attached = calloc(n, sizeof(int)) };
+    glue_flags(&g, ins, n, after);
+    if (!s->after_reg_alloc) {
+        glue_pregs(&g, e, n, after);
+    }
+
+    Node *nodes = calloc(n, sizeof(Node));
+    int num_nodes = 0;
+    for (int i = 0; i < n; i++) {
+        if (!g.attached[i] || num_nodes == 0) {
+            nodes[num_nodes++].first = i;
+        }
+        Node *node = &nodes[num_nodes - 1];
+        node->num_ins++;
+        for (int j = 0; j < e[i].defs.n; j++) regs_add(&node->e.defs, e[i].defs.keys[j]);
+        for (int j = 0; j < e[i].uses.n; j++) regs_add(&node->e.uses, e[i].uses.keys[j]);
+        node->e.load |= e[i].load;
+        node->e.store |= e[i].store;
+        int latency = (LATENCY[ins[i]->op] ? LATENCY[ins[i]->op] : 1) +
+                      (e[i].load ? LOAD_LATENCY : 0);
+        node->latency = latency > node->latency ? latency : node->latency;
+    }
+    build_dag(nodes, num_nodes, g.to_start, g.to_end);
+
+    for (int i = 0; i < num_nodes; i++) { // Uses of each vreg
+        for (int j = 0; j < nodes[i].e.uses.n; j++) {
+            int k = nodes[i].e.uses.keys[j];
+            if (is_vreg_key(s, k)) {
+                s->remaining[k]++;
+            }
+        }
+    }
+    s->num_live[0] = s->num_live[1] = 0;
+    int cycle = 0, issued = 0, num_out = 0;
+    for (int scheduled = 0; scheduled < num_nodes; scheduled++) {
+        int i = pick(s, nodes, num_nodes, &cycle);
+        Node *node = &nodes[i];
+        node->done = 1;
+        for (int j = 0; j < node->num_ins; j++) {
+            out[num_out++] = ins[node->first + j];
+        }
+        for (int j = 0; j < node->num_succs; j++) {
+            Node *succ = &nodes[node->succs[j]];
+            succ->num_preds--;
+            int ready = cycle + node->succ_lats[j];
+            succ->earliest = ready > succ->earliest ? ready : succ->earliest;
+        }
+        track_pressure(s, node);
+        if (++issued == ISSUE_WIDTH) {
+            cycle++;
+            issued = 0;
+        }
+    }
+    assert(num_out == n);
+
+    for (int i = 0; i < num_nodes; i++) {
+        for (int j = 0; j < nodes[i].e.defs.n; j++) {
+            int k = nodes[i].e.defs.keys[j];
+            if (is_vreg_key(s, k)) {
+                s->live[k] = 0;
+            }
+        }
+        free_effects(&nodes[i].e);
+        free(nodes[i].succs);
+        free(nodes[i].succ_lats);
+    }
+    for (int i = 0; i < n; i++) {
+        free_effects(&e[i]);
+    }
+    free(nodes);
+    free(g.attached);
+    free(e);
+}
+
+
+// ---- Functions -------------------------------------------------------------
+
+// The 'sub rsp' and 'add rsp' that allocate the stack frame stay next to the
+// 'push rbp' and 'pop rbp' around them (see 'patch_stack_sizes'). Nothing
+// else that moves rsp (for a VLA, see 'asm_dyn_alloc') is reordered either,
+// since rsp isn't followed as a dependence
+static int is_fixed(Sched *s, AsmIns *ins) {
+    if (is_barrier(ins->op) || (ins->l && ins->l->k == OPR_GPR && ins->l->reg == RSP)) {
+        return 1;
+    }
+    for (size_t i = 0; i < vec_len(s->fn->patch_with_stack_size); i++) {
+        if (vec_get(s->fn->patch_with_stack_size, i) == ins) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void schedule_bb(Sched *s, BB *bb) {
+    size_t n = 0;
+    for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+        n++;
+    }
+    if (n < 2) {
+        return;
+    }
+    AsmIns **ins = malloc(sizeof(AsmIns *) * n);
+    AsmIns **out = malloc(sizeof(AsmIns *) * n);
+    n = 0;
+    for (AsmIns *i = bb->asm_head; i; i = i->next) {
+        ins[n++] = i;
+    }
+    size_t i = 0;
+    while (i < n) {
+        if (is_fixed(s, ins[i])) {
+            out[i] = ins[i];
+            i++;
+            continue;
+        }
+        size_t end = i;
+        while (end < n && !is_fixed(s, ins[end]) && end - i < MAX_REGION) {
+            end++;
+        }
+        AsmIns *after = end < n && is_fixed(s, ins[end]) ? ins[end] : NULL;
+        schedule_region(s, &ins[i], end - i, after, &out[i]);
+        i = end;
+    }
+    for (i = 0; i < n; i++) { // Relink the BB in the new order
+        out[i]->prev = i > 0 ? out[i - 1] : NULL;
+        out[i]->next = i + 1 < n ? out[i + 1] : NULL;
+    }
+    bb->asm_head = out[0];
+    bb->asm_last = out[n - 1];
+    free(ins);
+    free(out);
+}
+
+// The number of register keys (see 'reg_key') used in 'fn'
+static int num_reg_keys(Fn *fn) {
+    int max = reg_key(1, LAST_XMM);
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            AsmOpr **oprs[MAX_INS_OPRS];
+            int num_oprs = ins_oprs(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                AsmOpr *opr = *oprs[i];
+                int reg = opr->k == OPR_MEM ? (opr->base > opr->idx ? opr->base : opr->idx) :
+                          (opr->k == OPR_GPR || opr->k == OPR_XMM) ? opr->reg : 0;
+                if (reg_key(1, reg) >= max) {
+                    max = reg_key(1, reg) + 1;
+                }
+            }
+        }
+    }
+    return max;
+}
+
+void schedule_fn(Fn *fn, int after_reg_alloc) {
+    int num_keys = num_reg_keys(fn);
+    Sched s = { .fn = fn, .after_reg_alloc = after_reg_alloc };
+    s.remaining = calloc(num_keys, sizeof(int));
+    s.live = calloc(num_keys, sizeof(int));
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        schedule_bb(&s, bb);
+    }
+    free(s.remaining);
+    free(s.live);
+}
+
+void schedule(Vec *globals, int after_reg_alloc) {
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k == G_FN_DEF) {
+            schedule_fn(g->fn, after_reg_alloc);
+        }
+    }
+}
@@ -0,0 +1,20 @@
+
+#ifndef COSEC_SCHEDULE_H
+#define COSEC_SCHEDULE_H
+
+#include "assemble.h"
+
+// Instruction scheduling. Reorders the instructions in each BB so that long
+// latency ones (loads, divisions, conversions) start as early as possible and
+// whatever uses their results comes later, with independent work in between.
+// Runs after 'assemble' (on vregs, keeping an eye on register pressure) and,
+// optionally, after 'peephole' (on pregs)
+void schedule(Vec *globals, int after_reg_alloc);
+void schedule_fn(Fn *fn, int after_reg_alloc);
+
+// '-fschedule-insns' (the default) and '-fschedule-insns2': whether to
+// schedule before and after register allocation
+extern int SCHEDULE_INSNS;
+extern int SCHEDULE_INSNS2;
+
+#endif
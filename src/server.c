@@ -0,0 +1,237 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#define USE_SOCKETS
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "server.h"
+#include "error.h"
+#include "pp.h"
+#include "stats.h"
+#include "passes.h"
+
+// A job is sent as a 4 byte length, along with the client's stdout and stderr
+// (as 'SCM_RIGHTS' ancillary data), followed by that many bytes: the client's
+// working directory, then each argument (not including the program name),
+// each NUL terminated. The reply is the job's exit status, as 4 bytes
+
+#define MAX_JOB (1 << 24) // Bytes
+
+#ifdef USE_SOCKETS
+static int read_all(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= (size_t) n;
+    }
+    return 1;
+}
+
+static int write_all(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= (size_t) n;
+    }
+    return 1;
+}
+
+static int open_socket(char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        error("socket path '%s' is too long", path);
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        error("can't create socket: %s", strerror(errno));
+    }
+    return fd;
+}
+
+
+// ---- Server ----------------------------------------------------------------
+
+// Receives the job's length and the client's stdout and stderr
+static int recv_header(int conn, uint32_t *len, int fds[2]) {
+    char ctrl[CMSG_SPACE(sizeof(int) * 2)];
+    struct iovec iov = { .iov_base = len, .iov_len = sizeof(*len) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctrl, .msg_controllen = sizeof(ctrl),
+    };
+    if (recvmsg(conn, &msg, 0) != (ssize_t) sizeof(*len)) {
+        return 0;
+    }
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS ||
+            c->cmsg_len != CMSG_LEN(sizeof(int) * 2)) {
+        return 0;
+    }
+    memcpy(fds, CMSG_DATA(c), sizeof(int) * 2);
+    return 1;
+}
+
+// Runs the job with its output going to the client; an error in it jumps
+// back here rather than exiting
+static int run_job(int (*run)(int, char **), Vec *args, int fds[2]) {
+    fflush(stdout);
+    fflush(stderr);
+    int saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+    dup2(fds[0], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    int status = 1;
+    jmp_buf jmp;
+    if (setjmp(jmp) == 0) {
+        ERROR_JMP = &jmp;
+        status = run((int) vec_len(args), (char **) args->data);
+    }
+    ERROR_JMP = NULL;
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+    return status;
+}
+
+// Frees the job's arenas, and drops what a later job mightn't see the same
+static void end_job() {
+    for (int arena = 0; arena < ARENA_LAST; arena++) {
+        arena_free(arena);
+    }
+    arena_free_orphans();
+    forget_include_lookups();
+    reset_time_report();
+    reset_pass_stats();
+}
+
+static void serve_job(int conn, int (*run)(int, char **)) {
+    uint32_t len;
+    int fds[2];
+    if (!recv_header(conn, &len, fds)) {
+        return;
+    }
+    char *data = NULL;
+    int32_t status = 1;
+    if (len > 0 && len <= MAX_JOB) {
+        data = malloc(len + 1);
+    }
+    if (data && read_all(conn, data, len)) {
+        data[len] = '\0'; // In case the last argument isn't terminated
+        Vec *args = vec_new();
+        vec_push(args, "cosec");
+        for (char *arg = data + strlen(data) + 1; arg < data + len; arg += strlen(arg) + 1) {
+            vec_push(args, arg);
+        }
+        if (chdir(data) == 0) {
+            forget_cwd();
+            status = run_job(run, args, fds);
+        }
+        end_job();
+    }
+    free(data);
+    close(fds[0]);
+    close(fds[1]);
+    write_all(conn, &status, sizeof(status));
+}
+
+void serve(char *socket_path, int (*run)(int argc, char **argv)) {
+    struct sockaddr_un addr;
+    int sock = open_socket(socket_path, &addr);
+    unlink(socket_path); // Left behind by a server that was killed
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+            listen(sock, SOMAXCONN) != 0) {
+        error("can't listen on '%s': %s", socket_path, strerror(errno));
+    }
+    signal(SIGPIPE, SIG_IGN); // A client that's gone away mustn't kill the server
+    while (1) {
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            error("can't accept a connection on '%s': %s", socket_path, strerror(errno));
+        }
+        serve_job(conn, run);
+        close(conn);
+    }
+}
+
+
+// ---- Client ----------------------------------------------------------------
+
+static int send_header(int sock, uint32_t len, int fds[2]) {
+    char ctrl[CMSG_SPACE(sizeof(int) * 2)];
+    memset(ctrl, 0, sizeof(ctrl));
+    struct iovec iov = { .iov_base = &len, .iov_len = sizeof(len) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctrl, .msg_controllen = sizeof(ctrl),
+    };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+    memcpy(CMSG_DATA(c), fds, sizeof(int) * 2);
+    return sendmsg(sock, &msg, 0) == (ssize_t) sizeof(len);
+}
+
+int connect_server(char *socket_path, int argc, char **argv) {
+    struct sockaddr_un addr;
+    int sock = open_socket(socket_path, &addr);
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        error("can't connect to '%s': %s", socket_path, strerror(errno));
+    }
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, PATH_MAX)) {
+        error("can't get current working directory: %s", strerror(errno));
+    }
+    Buf *b = buf_new();
+    buf_nprint(b, cwd, strlen(cwd) + 1);
+    for (int i = 0; i < argc; i++) {
+        buf_nprint(b, argv[i], strlen(argv[i]) + 1);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    int32_t status;
+    if (!send_header(sock, (uint32_t) b->len, fds) || !write_all(sock, b->data, b->len) ||
+            !read_all(sock, &status, sizeof(status))) {
+        error("lost the connection to '%s'", socket_path);
+    }
+    close(sock);
+    return status;
+}
+#else
+void serve(char *socket_path, int (*run)(int argc, char **argv)) {
+    error("the compile server isn't supported on Windows");
+}
+
+int connect_server(char *socket_path, int argc, char **argv) {
+    error("the compile server isn't supported on Windows");
+}
+#endif
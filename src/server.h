@@ -0,0 +1,26 @@
+
+#ifndef COSEC_SERVER_H
+#define COSEC_SERVER_H
+
+// Compile server. Every run of the compiler starts cold, so a build that runs
+// it once per file re-lexes the same headers and re-interns the same strings
+// every time. 'cosec --server <socket>' stays running instead, listening on a
+// Unix socket, and runs the jobs it's sent one after another in the same
+// process; interned strings, headers' tokens (see 'pch.h'), and the default
+// include paths stay warm from one job to the next. After each job, its
+// arenas are freed and the caches that depend on the file system or working
+// directory are dropped.
+//
+// A job is a command line, run as if it was passed to the compiler in the
+// client's working directory, with its output going to the client's stdout
+// and stderr. 'cosec --connect <socket> <args>...' is a client that sends its
+// arguments and exits with the job's status; a build system can speak the
+// protocol directly too (see 'server.c')
+
+// Never returns; 'run' compiles a job's command line, returning its exit status
+void serve(char *socket_path, int (*run)(int argc, char **argv));
+
+// Returns the job's exit status
+int connect_server(char *socket_path, int argc, char **argv);
+
+#endif
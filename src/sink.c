@@ -0,0 +1,206 @@
+#include <stdlib.h>
+
+#include "sink.h"
+#include "analysis.h"
+#include "alias.h"
+
+// An instruction can move to any BB on the dominator tree between its own and
+// the closest common dominator of its uses (a phi uses its operand at the end
+// of the predecessor it comes from). The further down, the fewer paths it's
+// on, but entering a loop would run it on every iteration; so it goes to the
+// one with the lowest profile count (with '-fprofile-use') or loop depth, and
+// the furthest down of those it ties with. It never enters a loop it wasn't
+// already in, and only moves at all if there's a path that then skips it.
+//
+// Nothing moves onto a path it wasn't already on, so instructions that can
+// fault (loads and divisions) are moved like any other. A load also needs
+// nothing between where it was and where it goes to write to memory it reads
+// (see 'alias.h').
+//
+// BBs are visited in postorder, and each one's instructions from the bottom
+// up, so an instruction's users have already moved by the time it's looked at
+// and its operands can follow it down afterwards.
+
+typedef struct {
+    int *seen; // By BB 'rpo'; the last search that visited it
+    int search;
+} Sink;
+
+// Comparisons are compiled into whichever branch or 'cmov' uses them (see
+// 'asm_cmp'), so go wherever that is too
+static int is_sinkable(IrIns *ins) {
+    return ins->op == IR_LOAD || ins->op == IR_PTRADD || ins->op == IR_SELECT ||
+           (ins->op >= IR_ADD && ins->op <= IR_BSWAP) ||
+           (ins->op >= IR_EQ && ins->op <= IR_FGE) ||
+           (ins->op >= IR_TRUNC && ins->op <= IR_REDUCE);
+}
+
+static BB * common_dom(BB *a, BB *b) {
+    while (a != b) {
+        while (a->rpo > b->rpo) a = a->idom;
+        while (b->rpo > a->rpo) b = b->idom;
+    }
+    return a;
+}
+
+// The closest common dominator of the BBs 'ins' is used in, or NULL if it's
+// not used (or used somewhere unreachable)
+static BB * uses_dom(IrIns *ins) {
+    BB *dom = NULL;
+    for (size_t i = 0; i < vec_len(ins->users); i++) {
+        IrIns *user = vec_get(ins->users, i);
+        for (size_t j = 0; user->op == IR_PHI && j < vec_len(user->defs); j++) {
+            BB *pred = vec_get(user->preds, j);
+            if (vec_get(user->defs, j) == ins) {
+                if (pred->rpo < 0) return NULL;
+                dom = dom ? common_dom(dom, pred) : pred;
+            }
+        }
+        if (user->op != IR_PHI) {
+            if (user->bb->rpo < 0) return NULL;
+            dom = dom ? common_dom(dom, user->bb) : user->bb;
+        }
+    }
+    return dom;
+}
+
+static int runs_less_often(BB *a, BB *b) {
+    if (a->freq >= 0 && b->freq >= 0) {
+        return a->freq < b->freq;
+    }
+    return loop_depth(a) < loop_depth(b);
+}
+
+// Whether there's a way out of the function, or back around to 'from', that
+// doesn't go through 'to' (i.e., 'to' doesn't post-dominate 'from'), so 'to'
+// runs less often
+static int can_skip(Sink *s, BB *from, BB *to) {
+    if (from->freq >= 0 && to->freq >= 0) {
+        return to->freq < from->freq;
+    }
+    s->search++;
+    Vec *stack = vec_new();
+    vec_push_all(stack, from->succ);
+    int skips = 0;
+    while (!skips && vec_len(stack) > 0) {
+        BB *bb = vec_pop(stack);
+        if (bb == to || s->seen[bb->rpo] == s->search) {
+            continue;
+        }
+        s->seen[bb->rpo] = s->search;
+        skips = bb == from || vec_len(bb->succ) == 0;
+        vec_push_all(stack, bb->succ);
+    }
+    vec_free(stack);
+    return skips;
+}
+
+// Where 'ins' should go, between its own BB and 'late' on the dominator tree,
+// or NULL if it should stay where it is. Moving it somewhere that runs just
+// as often would only make its operands live for longer
+static BB * pick_bb(Sink *s, IrIns *ins, BB *late) {
+    BB *best = NULL;
+    for (BB *bb = late; bb && bb != ins->bb; bb = bb->idom) {
+        int enters_loop = bb->loop && !in_loop(ins->bb, bb->loop);
+        if (!enters_loop && (!best || runs_less_often(bb, best))) {
+            best = bb;
+        }
+    }
+    return best && can_skip(s, ins->bb, best) ? best : NULL;
+}
+
+// Before its first user in 'bb' (or the call or inline assembly that takes it
+// as an argument), or after the phis if there isn't one
+static IrIns * insertion_point(IrIns *ins, BB *bb) {
+    IrIns *at = bb->ir_head;
+    while (at->op == IR_PHI) {
+        at = at->next;
+    }
+    for (IrIns *i = at; i; i = i->next) {
+        for (size_t j = 0; j < vec_len(ins->users); j++) {
+            if (vec_get(ins->users, j) == i) {
+                while (i->op == IR_CARG || i->op == IR_ASMIN) {
+                    i = i->prev;
+                }
+                return i;
+            }
+        }
+    }
+    return at;
+}
+
+// Atomics and inline assembly are barriers to every memory access, and a load
+// from a VLA can't move past the IR_STACK_RESTORE that frees it
+static int clobbers(IrIns *ins, IrIns *load) {
+    return ins->op == IR_ASM || is_atomic(ins) || ins->op == IR_STACK_RESTORE ||
+           may_clobber(ins, load);
+}
+
+static int clobbered_in(IrIns *from, IrIns *to, IrIns *load) {
+    for (IrIns *ins = from; ins && ins != to; ins = ins->next) {
+        if (clobbers(ins, load)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether anything after 'load' in its BB, in the BBs on the way from there
+// to 'at', or before 'at' in its BB might write to memory the load reads
+static int is_clobbered(Sink *s, IrIns *load, IrIns *at) {
+    if (clobbered_in(load->next, NULL, load) ||
+            clobbered_in(at->bb->ir_head, at, load)) {
+        return 1;
+    }
+    s->search++;
+    Vec *stack = vec_new();
+    vec_push_all(stack, at->bb->pred);
+    int clobbered = 0;
+    while (!clobbered && vec_len(stack) > 0) {
+        BB *bb = vec_pop(stack);
+        if (bb == load->bb || bb->rpo < 0 || s->seen[bb->rpo] == s->search) {
+            continue;
+        }
+        s->seen[bb->rpo] = s->search;
+        clobbered = clobbered_in(bb->ir_head, NULL, load);
+        vec_push_all(stack, bb->pred);
+    }
+    vec_free(stack);
+    return clobbered;
+}
+
+static void sink_ins(Sink *s, IrIns *ins) {
+    if (!is_sinkable(ins)) {
+        return;
+    }
+    BB *late = uses_dom(ins);
+    BB *to = late ? pick_bb(s, ins, late) : NULL;
+    if (!to) {
+        return;
+    }
+    IrIns *at = insertion_point(ins, to);
+    if (ins->op == IR_LOAD && is_clobbered(s, ins, at)) {
+        return;
+    }
+    delete_ir(ins);
+    insert_ir(ins, at);
+}
+
+void sink(Fn *fn) {
+    analyse_escapes(fn);
+    find_def_use(fn);
+    Vec *rpo = rev_postorder(fn);
+    Sink s = { .seen = calloc(vec_len(rpo), sizeof(int)) };
+    for (size_t i = vec_len(rpo); i > 0; i--) {
+        BB *bb = vec_get(rpo, i - 1);
+        IrIns *ins = bb->ir_last;
+        while (ins) {
+            IrIns *prev = ins->prev;
+            sink_ins(&s, ins);
+            ins = prev;
+        }
+    }
+    free(s.seen);
+    vec_free(rpo);
+    free_def_use(fn);
+}
@@ -0,0 +1,14 @@
+#ifndef COSEC_SINK_H
+#define COSEC_SINK_H
+
+#include "compile.h"
+
+// Code sinking, the opposite of 'licm'. Moves pure instructions (and loads
+// that nothing on the way might write to) down out of the BB they were
+// compiled in, to the least often run BB that still dominates all their uses.
+// A value computed before an 'if' but only used in one arm then only runs on
+// that path, and isn't live across the rest of the function. Requires
+// 'analyse', and keeps it up to date
+void sink(Fn *fn);
+
+#endif
@@ -0,0 +1,448 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sroa.h"
+#include "alias.h"
+#include "ssa.h"
+
+// An aggregate is flattened into its scalar fields ('leaves'), including the
+// elements of arrays and nested structs. It can be split if every pointer
+// derived from it (by IR_PTRADDs with constant offsets, and IR_BITCASTs) is
+// only used to load or store exactly one leaf, with the leaf's type, or to
+// zero or copy a range that doesn't cut through any leaf. Anything else (an
+// unknown offset, the address escaping, or a mismatched type, e.g., from a
+// union) leaves the aggregate alone. Padding isn't copied.
+//
+// Splitting an aggregate rewrites the copies to and from it, which changes
+// the uses of the object on their other side. If that's another aggregate
+// being split, it's left for the next round.
+
+#define MAX_LEAVES 16
+
+typedef struct {
+    int64_t offset;
+    IrType *t;
+    IrIns *alloc; // Replacing the leaf once split
+} Leaf;
+
+typedef struct {
+    IrIns *alloc;
+    Vec *leaves;   // of 'Leaf *'; in offset order
+    Vec *uses;     // of 'IrIns *'; loads, stores, zeroings, and copies
+    Vec *ptrs;     // of 'IrIns *'; pointers derived from the allocation
+    Vec *partners; // of 'Agg *'; on the other side of a copy
+    int ok, split;
+} Agg;
+
+typedef struct {
+    Vec *aggs;       // of 'Agg *'
+    int *root;       // Per ins; index of the aggregate a pointer is into, or -1
+    int64_t *offset; // Per ins; offset of a pointer into its aggregate
+} SROA;
+
+
+// ---- Constant Copies -------------------------------------------------------
+
+// A local that's initialised by copying the whole of a 'const' global into it
+// (e.g., 'const int t[] = {1, 2, 3}' in a function), and is never written
+// again or has its address escape, is just the global under another name
+
+static Global * const_copy_src(IrIns *copy, IrIns *alloc) {
+    if (copy->dst != alloc || copy->src->op != IR_GLOBAL || copy->len->op != IR_IMM) {
+        return NULL;
+    }
+    Global *g = copy->src->g;
+    int known = g->k == G_IMM || g->k == G_FP || g->k == G_INIT;
+    if (!known || !g->is_const || g->t->size != alloc->alloc_t->size ||
+            copy->len->imm != g->t->size) {
+        return NULL;
+    }
+    return g;
+}
+
+static void forward_const_copies(Fn *fn) {
+    size_t num_ins = number_ir(fn);
+    analyse_escapes(fn);
+    IrIns **init = calloc(num_ins, sizeof(IrIns *)); // Per IR_ALLOC
+    char *written = calloc(num_ins, sizeof(char));   // Per IR_ALLOC, otherwise
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns *dst;
+            switch (ins->op) {
+            case IR_STORE: case IR_COPY: dst = ins->dst; break;
+            case IR_ZERO: dst = ins->ptr; break;
+            default: continue;
+            }
+            IrIns *obj = decompose_ptr(dst).obj;
+            if (!obj || obj->op != IR_ALLOC) {
+                continue;
+            } else if (ins->op == IR_COPY && !init[obj->n] && const_copy_src(ins, obj)) {
+                init[obj->n] = ins;
+            } else {
+                written[obj->n] = 1;
+            }
+        }
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op != IR_ALLOC || ins->escapes || written[ins->n] || !init[ins->n]) {
+                continue;
+            }
+            IrIns *copy = init[ins->n];
+            ins->op = IR_GLOBAL; // In place, so its users don't need updating
+            ins->g = copy->src->g;
+            delete_ir(copy);
+        }
+    }
+    free(init);
+    free(written);
+}
+
+
+// ---- Candidates ------------------------------------------------------------
+
+// Returns 0 if there are too many leaves
+static int flatten(IrType *t, int64_t offset, Vec *leaves) {
+    if (t->k == IRT_STRUCT) {
+        for (size_t i = 0; i < vec_len(t->fields); i++) {
+            IrField *f = vec_get(t->fields, i);
+            if (!flatten(f->t, offset + (int64_t) f->offset, leaves)) {
+                return 0;
+            }
+        }
+    } else if (t->k == IRT_ARR) {
+        for (size_t i = 0; i < t->len; i++) {
+            if (!flatten(t->elem, offset + (int64_t) (i * t->elem->size), leaves)) {
+                return 0;
+            }
+        }
+    } else {
+        if (vec_len(leaves) == MAX_LEAVES) {
+            return 0;
+        }
+        Leaf *l = malloc(sizeof(Leaf));
+        l->offset = offset;
+        l->t = t;
+        l->alloc = NULL;
+        vec_push(leaves, l);
+    }
+    return 1;
+}
+
+static void find_candidates(SROA *s, Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op != IR_ALLOC || ins->count ||
+                    (ins->alloc_t->k != IRT_STRUCT && ins->alloc_t->k != IRT_ARR)) {
+                continue;
+            }
+            Vec *leaves = vec_new();
+            if (!flatten(ins->alloc_t, 0, leaves) || vec_len(leaves) == 0) {
+                continue;
+            }
+            Agg *a = malloc(sizeof(Agg));
+            a->alloc = ins;
+            a->leaves = leaves;
+            a->uses = vec_new();
+            a->ptrs = vec_new();
+            a->partners = vec_new();
+            a->ok = 1;
+            a->split = 0;
+            s->root[ins->n] = (int) vec_len(s->aggs);
+            s->offset[ins->n] = 0;
+            vec_push(s->aggs, a);
+        }
+    }
+}
+
+// Array indices aren't folded into constants until 'sccp', which runs later
+static int const_offset(IrIns *ins, int64_t *v) {
+    int64_t l, r;
+    switch (ins->op) {
+    case IR_IMM: {
+        int shift = 64 - (int) ins->t->size * 8; // Sign extend
+        *v = (int64_t) (ins->imm << shift) >> shift;
+        return 1;
+    }
+    case IR_SEXT:
+        return const_offset(ins->l, v);
+    case IR_ADD: case IR_SUB: case IR_MUL:
+        if (!const_offset(ins->l, &l) || !const_offset(ins->r, &r)) {
+            return 0;
+        }
+        *v = ins->op == IR_ADD ? l + r : (ins->op == IR_SUB ? l - r : l * r);
+        return 1;
+    default: return 0;
+    }
+}
+
+// BBs aren't in dominator order, so keep going until nothing changes
+static void find_roots(SROA *s, Fn *fn) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (BB *bb = fn->entry; bb; bb = bb->next) {
+            for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+                int64_t offset;
+                if (s->root[ins->n] >= 0) {
+                    continue;
+                }
+                if (ins->op == IR_PTRADD && s->root[ins->base->n] >= 0 &&
+                        const_offset(ins->offset, &offset)) {
+                    s->root[ins->n] = s->root[ins->base->n];
+                    s->offset[ins->n] = s->offset[ins->base->n] + offset;
+                    changed = 1;
+                } else if (ins->op == IR_BITCAST && s->root[ins->l->n] >= 0) {
+                    s->root[ins->n] = s->root[ins->l->n];
+                    s->offset[ins->n] = s->offset[ins->l->n];
+                    changed = 1;
+                }
+            }
+        }
+    }
+}
+
+
+// ---- Uses ------------------------------------------------------------------
+
+static Leaf * find_leaf(Agg *a, int64_t offset, IrType *t) {
+    for (size_t i = 0; i < vec_len(a->leaves); i++) {
+        Leaf *l = vec_get(a->leaves, i);
+        if (l->offset == offset && l->t->k == t->k && l->t->size == t->size) {
+            return l;
+        }
+    }
+    return NULL;
+}
+
+static int is_in_range(Leaf *l, int64_t offset, uint64_t size) {
+    return l->offset >= offset &&
+           l->offset + (int64_t) l->t->size <= offset + (int64_t) size;
+}
+
+// Whether a zeroing or copy of 'size' bytes at 'offset' covers each leaf
+// either entirely or not at all
+static int splits_cleanly(Agg *a, int64_t offset, IrIns *size) {
+    if (size->op != IR_IMM || offset < 0 ||
+            offset + (int64_t) size->imm > (int64_t) a->alloc->alloc_t->size) {
+        return 0;
+    }
+    for (size_t i = 0; i < vec_len(a->leaves); i++) {
+        Leaf *l = vec_get(a->leaves, i);
+        int64_t end = l->offset + (int64_t) l->t->size;
+        if (end > offset && l->offset < offset + (int64_t) size->imm &&
+                !is_in_range(l, offset, size->imm)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int is_valid_use(SROA *s, Agg *a, IrIns *ins, IrIns **opr) {
+    int64_t offset = s->offset[(*opr)->n];
+    switch (ins->op) {
+    case IR_PTRADD:
+        vec_push(a->ptrs, ins);
+        return opr == &ins->base && s->root[ins->n] >= 0;
+    case IR_BITCAST:
+        vec_push(a->ptrs, ins);
+        return 1;
+    case IR_LOAD:
+        vec_push(a->uses, ins);
+        return find_leaf(a, offset, ins->t) != NULL;
+    case IR_STORE:
+        vec_push(a->uses, ins);
+        return opr == &ins->dst && find_leaf(a, offset, ins->src->t) != NULL;
+    case IR_ZERO:
+        vec_push(a->uses, ins);
+        return splits_cleanly(a, offset, ins->size);
+    case IR_COPY: {
+        vec_push(a->uses, ins);
+        IrIns *other = opr == &ins->dst ? ins->src : ins->dst;
+        int other_root = s->root[other->n];
+        if (other_root == s->root[(*opr)->n]) {
+            return 0; // Copy within the same aggregate
+        } else if (other_root >= 0) {
+            vec_push(a->partners, vec_get(s->aggs, other_root));
+        }
+        return splits_cleanly(a, offset, ins->len);
+    }
+    default: return 0; // Address taken
+    }
+}
+
+static void find_uses(SROA *s, Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    IrIns *def = vec_get(ins->defs, i);
+                    if (s->root[def->n] >= 0) {
+                        ((Agg *) vec_get(s->aggs, s->root[def->n]))->ok = 0;
+                    }
+                }
+                continue;
+            }
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                int root = s->root[(*oprs[i])->n];
+                if (root < 0) {
+                    continue;
+                }
+                Agg *a = vec_get(s->aggs, root);
+                if (!is_valid_use(s, a, ins, oprs[i])) {
+                    a->ok = 0;
+                }
+            }
+        }
+    }
+}
+
+
+// ---- Splitting -------------------------------------------------------------
+
+static IrIns * zero_of(IrType *t) {
+    IrIns *zero = new_ins(t->k == IRT_F32 || t->k == IRT_F64 ? IR_FP : IR_IMM, t);
+    zero->imm = 0;
+    zero->fp = 0.0;
+    return zero;
+}
+
+static void split_zero(SROA *s, Agg *a, IrIns *zero) {
+    int64_t start = s->offset[zero->ptr->n];
+    for (size_t i = 0; i < vec_len(a->leaves); i++) {
+        Leaf *l = vec_get(a->leaves, i);
+        if (!is_in_range(l, start, zero->size->imm)) {
+            continue;
+        }
+        IrIns *v = zero_of(l->t);
+        insert_ir(v, zero);
+        IrIns *store = new_ins(IR_STORE, NULL);
+        store->dst = l->alloc;
+        store->src = v;
+        insert_ir(store, zero);
+    }
+    delete_ir(zero);
+}
+
+static IrIns * field_ptr(IrIns *ptr, int64_t offset, IrIns *before) {
+    if (offset == 0) {
+        return ptr;
+    }
+    IrIns *imm = new_ins(IR_IMM, irt_scalar(IRT_I64));
+    imm->imm = (uint64_t) offset;
+    insert_ir(imm, before);
+    IrIns *field = new_ins(IR_PTRADD, irt_scalar(IRT_PTR));
+    field->base = ptr;
+    field->offset = imm;
+    insert_ir(field, before);
+    return field;
+}
+
+// Each leaf in the range is loaded from one side and stored to the other
+static void split_copy(SROA *s, Agg *a, IrIns *copy) {
+    int root = s->root[copy->dst->n];
+    int is_dst = root >= 0 && vec_get(s->aggs, root) == a;
+    IrIns *ptr = is_dst ? copy->dst : copy->src;
+    IrIns *other = is_dst ? copy->src : copy->dst;
+    int64_t start = s->offset[ptr->n];
+    if (other->t->k != IRT_PTR) { // e.g., a call returning a struct
+        IrIns *cast = new_ins(IR_BITCAST, irt_scalar(IRT_PTR));
+        cast->l = other;
+        insert_ir(cast, copy);
+        other = cast;
+    }
+    for (size_t i = 0; i < vec_len(a->leaves); i++) {
+        Leaf *l = vec_get(a->leaves, i);
+        if (!is_in_range(l, start, copy->len->imm)) {
+            continue;
+        }
+        IrIns *field = field_ptr(other, l->offset - start, copy);
+        IrIns *load = new_ins(IR_LOAD, l->t);
+        load->src = is_dst ? field : l->alloc;
+        insert_ir(load, copy);
+        IrIns *store = new_ins(IR_STORE, NULL);
+        store->dst = is_dst ? l->alloc : field;
+        store->src = load;
+        insert_ir(store, copy);
+    }
+    delete_ir(copy);
+}
+
+static void split_agg(SROA *s, Agg *a) {
+    for (size_t i = 0; i < vec_len(a->leaves); i++) {
+        Leaf *l = vec_get(a->leaves, i);
+        l->alloc = new_ins(IR_ALLOC, irt_scalar(IRT_PTR));
+        l->alloc->alloc_t = l->t;
+        l->alloc->count = NULL;
+        insert_ir(l->alloc, a->alloc);
+    }
+    for (size_t i = 0; i < vec_len(a->uses); i++) {
+        IrIns *ins = vec_get(a->uses, i);
+        switch (ins->op) {
+        case IR_LOAD:
+            ins->src = find_leaf(a, s->offset[ins->src->n], ins->t)->alloc;
+            break;
+        case IR_STORE:
+            ins->dst = find_leaf(a, s->offset[ins->dst->n], ins->src->t)->alloc;
+            break;
+        case IR_ZERO: split_zero(s, a, ins); break;
+        case IR_COPY: split_copy(s, a, ins); break;
+        default: UNREACHABLE();
+        }
+    }
+    for (size_t i = 0; i < vec_len(a->ptrs); i++) {
+        delete_ir(vec_get(a->ptrs, i));
+    }
+    delete_ir(a->alloc);
+}
+
+static int has_split_partner(Agg *a) {
+    for (size_t i = 0; i < vec_len(a->partners); i++) {
+        Agg *partner = vec_get(a->partners, i);
+        if (partner->split) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Returns 1 if there's another round to do; sets 'split' if anything was
+static int sroa_round(Fn *fn, int *split) {
+    size_t num_ins = number_ir(fn);
+    SROA s;
+    s.aggs = vec_new();
+    s.root = malloc(sizeof(int) * num_ins);
+    memset(s.root, -1, sizeof(int) * num_ins);
+    s.offset = calloc(num_ins, sizeof(int64_t));
+    find_candidates(&s, fn);
+    find_roots(&s, fn);
+    find_uses(&s, fn);
+
+    int round_split = 0, deferred = 0;
+    for (size_t i = 0; i < vec_len(s.aggs); i++) {
+        Agg *a = vec_get(s.aggs, i);
+        if (!a->ok) {
+            continue;
+        } else if (has_split_partner(a)) {
+            deferred = 1; // Its uses have changed
+            continue;
+        }
+        split_agg(&s, a);
+        a->split = round_split = *split = 1;
+    }
+    free(s.root);
+    free(s.offset);
+    return round_split && deferred;
+}
+
+void sroa(Fn *fn) {
+    forward_const_copies(fn);
+    int split = 0;
+    while (sroa_round(fn, &split));
+    if (split && DIRECT_SSA) {
+        build_ssa(fn); // 'mem2reg' doesn't run to promote the leaves
+    }
+}
@@ -0,0 +1,16 @@
+
+#ifndef COSEC_SROA_H
+#define COSEC_SROA_H
+
+#include "compile.h"
+
+// Scalar replacement of aggregates. Splits a small local struct or array
+// (IR_ALLOC of an IRT_STRUCT or IRT_ARR) that's only accessed field by field,
+// at constant offsets, into a separate IR_ALLOC for each scalar field, which
+// 'mem2reg' can then promote. Zeroing and block copies of the whole object are
+// split into a load or store per field. A local that only ever holds a copy
+// of a 'const' global (and doesn't escape) is replaced by the global itself.
+// Run before 'mem2reg'
+void sroa(Fn *fn);
+
+#endif
@@ -0,0 +1,346 @@
+#include <stdlib.h>
+
+#include "ssa.h"
+#include "analysis.h"
+
+// Uses the SSA construction algorithm presented in 'Simple and Efficient
+// Construction of Static Single Assignment Form', Matthias Braun et al., 2013.
+// The BBs are filled in the order they were emitted, keeping each variable's
+// current definition per BB. A load takes the definition in its own BB, or if
+// there isn't one yet, looks for it in the BB's predecessors, placing a phi
+// where more than one of them merge. A BB is sealed once all its predecessors
+// have been filled; until then (e.g., a loop header before the loop's body is
+// filled), a lookup leaves an incomplete phi in it to finish when it's sealed.
+// A phi whose operands all turn out to be the same value (other than itself)
+// is removed for that value, so phis are only left where they're needed.
+//
+// 'compile' only knows where a branch goes once the statement it's in (or, for
+// a 'goto', the function) is finished, so rather than running as each
+// expression is compiled, this runs over the loads and stores of the finished
+// function, in the order they were emitted.
+//
+// Instructions are numbered (in 'n') while the pass runs so that per-
+// instruction information can be kept in arrays on the side; the phis and
+// constants it creates are numbered after the rest.
+
+typedef struct {
+    Fn *fn;
+    size_t num_ins, max_ins;
+    int *var_of;      // Per ins; variable for a promoted IR_ALLOC or phi, or -1
+    IrIns **repl;     // Per ins; value replacing a promoted IR_LOAD or phi
+    Vec *vars;        // of 'IrIns *' k = IR_ALLOC
+    IrIns **defs;     // Per BB, per variable; current definition, or NULL
+    int *waiting;     // Per BB; predecessors still to fill (sealed once 0)
+    Vec **incomplete; // Per BB; of 'IrIns *'; phis to finish when it's sealed
+    IrIns **undef;    // Per variable; value used before the first store
+} Ssa;
+
+
+// ---- Promotable Allocations ------------------------------------------------
+
+static int is_scalar(IrType *t) {
+    return t->k != IRT_VOID && t->k != IRT_ARR && t->k != IRT_STRUCT;
+}
+
+// Same as 'mem2reg': an IR_ALLOC can be promoted if it's only ever the pointer
+// loaded from or stored to, with the same type as the allocation
+static int is_promotable_use(IrIns *ins, IrIns **opr) {
+    IrIns *alloc = *opr;
+    if (ins->op == IR_LOAD) {
+        return ins->t->k == alloc->alloc_t->k;
+    } else if (ins->op == IR_STORE && opr == &ins->dst) {
+        return ins->src != alloc && ins->src->t->k == alloc->alloc_t->k;
+    }
+    return 0; // Address taken
+}
+
+static void find_vars(Ssa *s) {
+    for (BB *bb = s->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_ALLOC && !ins->count && is_scalar(ins->alloc_t)) {
+                s->var_of[ins->n] = 0; // Candidate; numbered below
+            }
+        }
+    }
+    for (BB *bb = s->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                IrIns *opr = *oprs[i];
+                if (opr->op == IR_ALLOC && !is_promotable_use(ins, oprs[i])) {
+                    s->var_of[opr->n] = -1;
+                }
+            }
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    IrIns *def = vec_get(ins->defs, i);
+                    if (def->op == IR_ALLOC) {
+                        s->var_of[def->n] = -1;
+                    }
+                }
+            }
+        }
+    }
+    for (BB *bb = s->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_ALLOC && s->var_of[ins->n] == 0) {
+                s->var_of[ins->n] = (int) vec_len(s->vars);
+                vec_push(s->vars, ins);
+            }
+        }
+    }
+}
+
+static int promoted_var(Ssa *s, IrIns *ptr) {
+    return ptr->op == IR_ALLOC ? s->var_of[ptr->n] : -1;
+}
+
+
+// ---- Definitions -----------------------------------------------------------
+
+static void number_new(Ssa *s, IrIns *ins, int var) {
+    if (s->num_ins == s->max_ins) {
+        s->max_ins *= 2;
+        s->var_of = realloc(s->var_of, sizeof(int) * s->max_ins);
+        s->repl = realloc(s->repl, sizeof(IrIns *) * s->max_ins);
+    }
+    ins->n = s->num_ins++;
+    s->var_of[ins->n] = var;
+    s->repl[ins->n] = NULL;
+}
+
+static IrIns * resolve(Ssa *s, IrIns *value) {
+    while (s->repl[value->n]) {
+        value = s->repl[value->n]; // A promoted load or trivial phi
+    }
+    return value;
+}
+
+static IrIns ** def_of(Ssa *s, int var, BB *bb) {
+    return &s->defs[bb->n * vec_len(s->vars) + var];
+}
+
+static IrIns * undef_value(Ssa *s, int var) {
+    if (s->undef[var]) {
+        return s->undef[var];
+    }
+    IrIns *alloc = vec_get(s->vars, var);
+    IrType *t = alloc->alloc_t;
+    IrIns *k = new_ins((t->k == IRT_F32 || t->k == IRT_F64) ? IR_FP : IR_IMM, t);
+    if (k->op == IR_FP) {
+        k->fp = 0;
+    } else {
+        k->imm = 0;
+    }
+    number_new(s, k, -1);
+
+    // After the IR_FARGs, which have to be at the start of the entry BB (which
+    // always ends with a branch, so there's something to insert before)
+    IrIns *before = s->fn->entry->ir_head;
+    while (before->op == IR_FARG) {
+        before = before->next;
+    }
+    insert_ir(k, before);
+    s->undef[var] = k;
+    return k;
+}
+
+static IrIns * new_phi(Ssa *s, int var, BB *bb) {
+    IrIns *alloc = vec_get(s->vars, var);
+    IrIns *phi = new_ins(IR_PHI, alloc->alloc_t);
+    number_new(s, phi, var);
+    phi->bb = bb;
+    phi->prev = NULL;
+    phi->next = bb->ir_head;
+    if (bb->ir_head) {
+        bb->ir_head->prev = phi;
+    } else {
+        bb->ir_last = phi;
+    }
+    bb->ir_head = phi;
+    return phi;
+}
+
+// Returns the value a phi stands for, deleting it if its operands (other than
+// itself) are all the same value
+static IrIns * remove_trivial_phi(Ssa *s, IrIns *phi) {
+    IrIns *same = NULL;
+    for (size_t i = 0; i < vec_len(phi->defs); i++) {
+        IrIns *def = resolve(s, vec_get(phi->defs, i));
+        if (def == phi || def == same) {
+            continue;
+        } else if (same) {
+            return phi; // Merges two different values
+        }
+        same = def;
+    }
+    if (!same) { // Only reachable from itself, or from nowhere
+        same = undef_value(s, s->var_of[phi->n]);
+    }
+    s->repl[phi->n] = same;
+    delete_ir(phi);
+    return same;
+}
+
+static IrIns * read_var(Ssa *s, int var, BB *bb);
+
+static IrIns * add_phi_operands(Ssa *s, IrIns *phi) {
+    BB *bb = phi->bb;
+    for (size_t i = 0; i < vec_len(bb->pred); i++) {
+        BB *pred = vec_get(bb->pred, i);
+        vec_push(phi->preds, pred);
+        vec_push(phi->defs, read_var(s, s->var_of[phi->n], pred));
+    }
+    return remove_trivial_phi(s, phi);
+}
+
+// 'bb' is either being filled, or is a filled predecessor of a sealed BB
+static IrIns * read_var(Ssa *s, int var, BB *bb) {
+    IrIns *def = *def_of(s, var, bb);
+    if (def) {
+        return def;
+    }
+    if (s->waiting[bb->n] > 0) { // Not sealed; more predecessors to come
+        def = new_phi(s, var, bb);
+        vec_push(s->incomplete[bb->n], def);
+    } else if (vec_len(bb->pred) == 0) {
+        def = undef_value(s, var);
+    } else if (vec_len(bb->pred) == 1) {
+        def = read_var(s, var, vec_get(bb->pred, 0));
+    } else {
+        def = new_phi(s, var, bb);
+        *def_of(s, var, bb) = def; // Ends the search around a loop
+        def = add_phi_operands(s, def);
+    }
+    *def_of(s, var, bb) = def;
+    return def;
+}
+
+static void seal_bb(Ssa *s, BB *bb) {
+    Vec *phis = s->incomplete[bb->n];
+    for (size_t i = 0; i < vec_len(phis); i++) {
+        add_phi_operands(s, vec_get(phis, i));
+    }
+    vec_empty(phis);
+}
+
+// Replaces the promoted loads and stores in 'bb' with definitions, then seals
+// any successor this was the last predecessor to fill
+static void fill_bb(Ssa *s, BB *bb) {
+    IrIns *ins = bb->ir_head;
+    while (ins) {
+        IrIns *next = ins->next;
+        int var;
+        if (ins->op == IR_LOAD && (var = promoted_var(s, ins->src)) >= 0) {
+            IrIns *value = read_var(s, var, bb); // Might grow 'repl'
+            s->repl[ins->n] = value;
+            delete_ir(ins);
+        } else if (ins->op == IR_STORE && (var = promoted_var(s, ins->dst)) >= 0) {
+            *def_of(s, var, bb) = ins->src;
+            delete_ir(ins);
+        }
+        ins = next;
+    }
+    for (size_t i = 0; i < vec_len(bb->succ); i++) {
+        BB *succ = vec_get(bb->succ, i);
+        if (--s->waiting[succ->n] == 0) {
+            seal_bb(s, succ);
+        }
+    }
+}
+
+
+// ---- Construction ----------------------------------------------------------
+
+// A phi's operand can be a load or phi that was only replaced after the phi
+// was checked, so removing one trivial phi can expose others
+static void remove_trivial_phis(Ssa *s) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (BB *bb = s->fn->entry; bb; bb = bb->next) {
+            IrIns *ins = bb->ir_head;
+            while (ins && ins->op == IR_PHI) {
+                IrIns *next = ins->next;
+                if (s->var_of[ins->n] >= 0 && remove_trivial_phi(s, ins) != ins) {
+                    changed = 1;
+                }
+                ins = next;
+            }
+        }
+    }
+}
+
+static void replace_uses(Ssa *s) {
+    for (BB *bb = s->fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                *oprs[i] = resolve(s, *oprs[i]);
+            }
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    vec_put(ins->defs, i, resolve(s, vec_get(ins->defs, i)));
+                }
+            }
+        }
+    }
+    for (size_t v = 0; v < vec_len(s->vars); v++) {
+        delete_ir(vec_get(s->vars, v));
+    }
+}
+
+void build_ssa(Fn *fn) {
+    analyse_cfg(fn);
+    Ssa s;
+    s.fn = fn;
+    s.num_ins = number_ir(fn);
+    s.max_ins = s.num_ins + 16;
+    s.var_of = malloc(sizeof(int) * s.max_ins);
+    for (size_t i = 0; i < s.num_ins; i++) {
+        s.var_of[i] = -1;
+    }
+    s.repl = calloc(s.max_ins, sizeof(IrIns *));
+    s.vars = vec_new();
+    find_vars(&s);
+    size_t num_vars = vec_len(s.vars);
+    if (num_vars == 0) {
+        free(s.var_of);
+        free(s.repl);
+        vec_free(s.vars);
+        return; // Nothing to promote
+    }
+
+    size_t num_bbs = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->n = num_bbs++;
+    }
+    s.defs = calloc(num_bbs * num_vars, sizeof(IrIns *));
+    s.waiting = malloc(sizeof(int) * num_bbs);
+    s.incomplete = malloc(sizeof(Vec *) * num_bbs);
+    s.undef = calloc(num_vars, sizeof(IrIns *));
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        s.waiting[bb->n] = (int) vec_len(bb->pred); // Sealed if there are none
+        s.incomplete[bb->n] = vec_new();
+    }
+
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        fill_bb(&s, bb);
+    }
+    remove_trivial_phis(&s);
+    replace_uses(&s);
+
+    for (size_t i = 0; i < num_bbs; i++) {
+        assert(s.waiting[i] == 0); // Every BB's predecessors have been filled
+        vec_free(s.incomplete[i]);
+    }
+    free(s.var_of);
+    free(s.repl);
+    free(s.defs);
+    free(s.waiting);
+    free(s.incomplete);
+    free(s.undef);
+    vec_free(s.vars);
+}
@@ -0,0 +1,12 @@
+
+#ifndef COSEC_SSA_H
+#define COSEC_SSA_H
+
+#include "compile.h"
+
+// Builds SSA form for a function as 'compile' finishes it (with '-fdirect-
+// ssa'), promoting the same local variables as 'mem2reg' without needing the
+// dominator tree. Leaves the CFG analysed
+void build_ssa(Fn *fn);
+
+#endif
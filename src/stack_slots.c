@@ -0,0 +1,332 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stack_slots.h"
+#include "analysis.h"
+#include "assemble.h"
+
+// An allocation is live at the program points that can both be reached from
+// one of its uses and reach another; i.e., from (roughly) its first use to its
+// last, including around any loop it's used in. That only holds if every
+// access to it is visible, so an allocation whose address escapes (e.g., is
+// passed to a call or stored to memory) is live everywhere. Allocations whose
+// live ranges don't intersect share a slot; slots are handed out first fit, in
+// the order the allocations appear in the function.
+
+typedef struct {
+    size_t start, end; // Half-open; instruction numbers (see 'number_ir')
+} Interval;
+
+typedef struct {
+    IrIns *alloc;
+    int escapes;
+    int *has_use;        // Per BB
+    size_t *first, *last; // Per BB; instruction numbers of the uses in it
+    Vec *range;          // of 'Interval *'; sorted and non-overlapping
+} Alloc;
+
+typedef struct {
+    size_t size, align;
+    Vec *allocs; // of 'Alloc *'
+} Slot;
+
+typedef struct {
+    Fn *fn;
+    size_t num_ins, num_bbs;
+    BB **bbs;          // Indexed by 'bb->n'
+    size_t *bb_start;  // Instruction number of each BB's first instruction
+    size_t *bb_end;    // And one past its last
+    Vec *allocs;       // of 'Alloc *'
+    int *root;         // Per instruction; the allocation a pointer is into, or -1
+} Slots;
+
+static Alloc * new_alloc(Slots *s, IrIns *ins) {
+    Alloc *a = malloc(sizeof(Alloc));
+    a->alloc = ins;
+    a->escapes = 0;
+    a->has_use = calloc(s->num_bbs, sizeof(int));
+    a->first = calloc(s->num_bbs, sizeof(size_t));
+    a->last = calloc(s->num_bbs, sizeof(size_t));
+    a->range = vec_new();
+    return a;
+}
+
+static void number_bbs(Slots *s) {
+    s->num_bbs = 0;
+    for (BB *bb = s->fn->entry; bb; bb = bb->next) {
+        bb->n = s->num_bbs++;
+    }
+    s->bbs = malloc(sizeof(BB *) * s->num_bbs);
+    s->bb_start = malloc(sizeof(size_t) * s->num_bbs);
+    s->bb_end = malloc(sizeof(size_t) * s->num_bbs);
+    size_t n = 0;
+    for (BB *bb = s->fn->entry; bb; bb = bb->next) {
+        s->bbs[bb->n] = bb;
+        s->bb_start[bb->n] = n;
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            n++;
+        }
+        s->bb_end[bb->n] = n;
+    }
+}
+
+
+// ---- Uses ------------------------------------------------------------------
+
+// Whether 'ins' only accesses the memory its operand 'opr' points to (or
+// derives another pointer into it), rather than letting the address escape
+static int is_contained_use(IrIns *ins, IrIns **opr) {
+    switch (ins->op) {
+    case IR_LOAD:    return opr == &ins->src;
+    case IR_STORE:   return opr == &ins->dst;
+    case IR_COPY:    return opr == &ins->src || opr == &ins->dst;
+    case IR_ZERO:    return opr == &ins->ptr;
+    case IR_PTRADD:  return opr == &ins->base;
+    case IR_BITCAST: return 1;
+    default:         return 0;
+    }
+}
+
+static void add_use(Alloc *a, IrIns *ins) {
+    size_t bb = ins->bb->n;
+    if (!a->has_use[bb]) {
+        a->has_use[bb] = 1;
+        a->first[bb] = ins->n;
+    }
+    a->last[bb] = ins->n;
+}
+
+#define UNKNOWN (-2) // A pointer whose definitions haven't all been seen yet
+
+// Finds the allocation each pointer is into: the IR_ALLOC itself, and the
+// pointers derived from it by IR_PTRADDs, IR_BITCASTs, and phis (e.g., an
+// induction variable walking over an array, see 'strength_reduce'), where all
+// of a phi's definitions have to be into the same one
+static void find_roots(Slots *s, Vec *rpo) {
+    for (size_t i = 0; i < vec_len(rpo); i++) {
+        BB *bb = vec_get(rpo, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_ALLOC && !is_dyn_alloc(s->fn, ins)) {
+                s->root[ins->n] = (int) vec_len(s->allocs);
+                vec_push(s->allocs, new_alloc(s, ins));
+            } else if (ins->op == IR_PHI || ins->op == IR_PTRADD ||
+                       ins->op == IR_BITCAST) {
+                s->root[ins->n] = UNKNOWN;
+            }
+        }
+    }
+    int changed = 1;
+    while (changed) { // Reverse postorder sees definitions before uses
+        changed = 0;
+        for (size_t i = 0; i < vec_len(rpo); i++) {
+            BB *bb = vec_get(rpo, i);
+            for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+                int root = s->root[ins->n];
+                if (ins->op == IR_PTRADD) {
+                    root = s->root[ins->base->n];
+                } else if (ins->op == IR_BITCAST) {
+                    root = s->root[ins->l->n];
+                } else if (ins->op == IR_PHI) {
+                    root = UNKNOWN;
+                    for (size_t j = 0; j < vec_len(ins->defs); j++) {
+                        IrIns *def = vec_get(ins->defs, j);
+                        int def_root = s->root[def->n];
+                        if (def_root == UNKNOWN || def_root == root) {
+                            continue;
+                        }
+                        root = root == UNKNOWN ? def_root : -1;
+                    }
+                }
+                changed |= root != s->root[ins->n];
+                s->root[ins->n] = root;
+            }
+        }
+    }
+    for (size_t i = 0; i < s->num_ins; i++) {
+        if (s->root[i] == UNKNOWN) { // Only defined in terms of other phis
+            s->root[i] = -1;
+        }
+    }
+}
+
+static void find_uses(Slots *s) {
+    Vec *rpo = rev_postorder(s->fn);
+    find_roots(s, rpo);
+    for (size_t i = 0; i < vec_len(rpo); i++) {
+        BB *bb = vec_get(rpo, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_PHI) {
+                for (size_t j = 0; j < vec_len(ins->defs); j++) {
+                    IrIns *def = vec_get(ins->defs, j);
+                    int root = s->root[def->n];
+                    if (root < 0) {
+                        continue;
+                    }
+                    Alloc *a = vec_get(s->allocs, root);
+                    add_use(a, ins);
+                    a->escapes |= s->root[ins->n] != root; // Mixed with others
+                }
+                continue;
+            }
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int j = 0; j < num_oprs; j++) {
+                int root = s->root[(*oprs[j])->n];
+                if (root < 0) {
+                    continue;
+                }
+                Alloc *a = vec_get(s->allocs, root);
+                add_use(a, ins);
+                a->escapes |= !is_contained_use(ins, oprs[j]);
+            }
+        }
+    }
+    vec_free(rpo);
+}
+
+
+// ---- Live Ranges -----------------------------------------------------------
+
+static void add_interval(Vec *range, size_t start, size_t end) {
+    Interval *last = vec_len(range) > 0 ? vec_tail(range) : NULL;
+    if (last && last->end >= start) {
+        last->end = end;
+    } else {
+        Interval *in = malloc(sizeof(Interval));
+        in->start = start;
+        in->end = end;
+        vec_push(range, in);
+    }
+}
+
+static void live_range(Slots *s, Alloc *a) {
+    if (a->escapes) {
+        add_interval(a->range, 0, s->num_ins);
+        return;
+    }
+
+    // Which BBs can be reached from a use, and which can reach one
+    int *reach_in = calloc(s->num_bbs, sizeof(int));
+    int *live_out = calloc(s->num_bbs, sizeof(int));
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (size_t i = 0; i < s->num_bbs; i++) {
+            BB *bb = s->bbs[i];
+            for (size_t j = 0; j < vec_len(bb->pred) && !reach_in[i]; j++) {
+                BB *pred = vec_get(bb->pred, j);
+                if (a->has_use[pred->n] || reach_in[pred->n]) {
+                    reach_in[i] = changed = 1;
+                }
+            }
+            for (size_t j = 0; j < vec_len(bb->succ) && !live_out[i]; j++) {
+                BB *succ = vec_get(bb->succ, j);
+                if (a->has_use[succ->n] || live_out[succ->n]) {
+                    live_out[i] = changed = 1;
+                }
+            }
+        }
+    }
+
+    // BBs are numbered in order, so the intervals come out sorted
+    for (size_t i = 0; i < s->num_bbs; i++) {
+        if (a->has_use[i]) {
+            size_t start = reach_in[i] ? s->bb_start[i] : a->first[i];
+            size_t end = live_out[i] ? s->bb_end[i] : a->last[i] + 1;
+            add_interval(a->range, start, end);
+        } else if (reach_in[i] && live_out[i]) {
+            add_interval(a->range, s->bb_start[i], s->bb_end[i]);
+        }
+    }
+    free(reach_in);
+    free(live_out);
+}
+
+// Walks along both sorted lists at the same time
+static int ranges_intersect(Vec *a, Vec *b) {
+    size_t i = 0, j = 0;
+    while (i < vec_len(a) && j < vec_len(b)) {
+        Interval *aa = vec_get(a, i);
+        Interval *bb = vec_get(b, j);
+        if (aa->start < bb->end && bb->start < aa->end) {
+            return 1;
+        }
+        if (aa->end <= bb->end) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    return 0;
+}
+
+
+// ---- Colouring -------------------------------------------------------------
+
+// Over-aligned objects are kept apart from the rest (see 'is_overaligned')
+static int fits_in_slot(Slot *slot, Alloc *a) {
+    Alloc *first = vec_get(slot->allocs, 0);
+    if (is_overaligned(first->alloc->alloc_t) != is_overaligned(a->alloc->alloc_t)) {
+        return 0;
+    }
+    for (size_t i = 0; i < vec_len(slot->allocs); i++) {
+        Alloc *other = vec_get(slot->allocs, i);
+        if (ranges_intersect(a->range, other->range)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static Vec * colour_slots(Slots *s) {
+    Vec *slots = vec_new(); // of 'Slot *'
+    for (size_t i = 0; i < vec_len(s->allocs); i++) {
+        Alloc *a = vec_get(s->allocs, i);
+        IrType *t = a->alloc->alloc_t;
+        Slot *slot = NULL;
+        for (size_t j = 0; j < vec_len(slots) && !slot; j++) {
+            Slot *candidate = vec_get(slots, j);
+            if (fits_in_slot(candidate, a)) {
+                slot = candidate;
+            }
+        }
+        if (!slot) {
+            slot = malloc(sizeof(Slot));
+            slot->size = slot->align = 0;
+            slot->allocs = vec_new();
+            vec_push(slots, slot);
+        }
+        slot->size = t->size > slot->size ? t->size : slot->size;
+        slot->align = t->align > slot->align ? t->align : slot->align;
+        vec_push(slot->allocs, a);
+    }
+    return slots;
+}
+
+void assign_stack_slots(Fn *fn) {
+    Slots s = { .fn = fn };
+    s.num_ins = number_ir(fn);
+    number_bbs(&s);
+    s.allocs = vec_new();
+    s.root = malloc(sizeof(int) * (s.num_ins + 1));
+    memset(s.root, -1, sizeof(int) * (s.num_ins + 1));
+    find_uses(&s);
+    for (size_t i = 0; i < vec_len(s.allocs); i++) {
+        live_range(&s, vec_get(s.allocs, i));
+    }
+
+    Vec *slots = colour_slots(&s);
+    for (size_t i = 0; i < vec_len(slots); i++) {
+        Slot *slot = vec_get(slots, i);
+        size_t align = slot->align ? slot->align : 1;
+        Alloc *first = vec_get(slot->allocs, 0);
+        size_t offset = is_overaligned(first->alloc->alloc_t) ?
+            alloc_aligned_slot(fn, slot->size, align) :
+            alloc_stack_slot(fn, slot->size, align);
+        for (size_t j = 0; j < vec_len(slot->allocs); j++) {
+            Alloc *a = vec_get(slot->allocs, j);
+            a->alloc->stack_slot = offset;
+        }
+    }
+}
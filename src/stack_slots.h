@@ -0,0 +1,14 @@
+
+#ifndef COSEC_STACK_SLOTS_H
+#define COSEC_STACK_SLOTS_H
+
+#include "compile.h"
+
+// Stack slot colouring. Gives each IR_ALLOC left after optimisation (other
+// than VLAs, see 'is_dyn_alloc') a stack slot ('stack_slot'), sharing one slot between allocations that are never
+// live at the same time (e.g., temporaries in different block scopes), so
+// stack frames stay small. Called by 'assemble' before the function's
+// instructions are assembled; requires 'analyse_cfg'
+void assign_stack_slots(Fn *fn);
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdlib.h>
+
+#include "stack_usage.h"
+
+int STACK_USAGE = SU_NONE;
+
+enum {
+    DEPTH_DYNAMIC = 1,
+    DEPTH_EXTERNAL = 2,
+    DEPTH_RECURSIVE = 4,
+};
+
+// Calls are matched to definitions by label, since a call might be to a
+// declaration of a function defined later
+typedef struct {
+    Global *g;
+    int visiting, done;
+    size_t depth; // Including its own frame
+    int flags;    // Set of 'DEPTH_*'; why 'depth' isn't exact
+} FnDepth;
+
+static char * fn_name(Global *g) {
+    return g->label[0] == '_' ? &g->label[1] : g->label;
+}
+
+static void find_depth(Map *fns, FnDepth *d) {
+    d->visiting = 1;
+    Fn *fn = d->g->fn;
+    size_t deepest = 0;
+    int flags = (fn->dyn_stack ? DEPTH_DYNAMIC : 0) |
+                (fn->instrument ? DEPTH_EXTERNAL : 0);
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op != IR_CALL) {
+                continue;
+            }
+            FnDepth *callee = ins->fn->op == IR_GLOBAL ?
+                               map_get(fns, intern(ins->fn->g->label)) : NULL;
+            if (!callee) { // Indirect, or defined in another file
+                flags |= DEPTH_EXTERNAL;
+                continue;
+            }
+            if (callee->visiting) { // A cycle; stop here
+                flags |= DEPTH_RECURSIVE;
+                continue;
+            }
+            if (!callee->done) {
+                find_depth(fns, callee);
+            }
+            deepest = callee->depth > deepest ? callee->depth : deepest;
+            flags |= callee->flags;
+        }
+    }
+    d->depth = fn->frame_size + deepest;
+    d->flags = flags;
+    d->visiting = 0;
+    d->done = 1;
+}
+
+static void print_depth_flags(FILE *out, int flags) {
+    if (!flags) {
+        fputs("static", out);
+        return;
+    }
+    char *names[] = { "dynamic", "external", "recursive" };
+    char *sep = "";
+    for (int i = 0; i < 3; i++) {
+        if (flags & (1 << i)) {
+            fprintf(out, "%s%s", sep, names[i]);
+            sep = ",";
+        }
+    }
+}
+
+void print_stack_usage(FILE *out, Vec *globals, char *file) {
+    Map *fns = map_new();
+    Vec *depths = vec_new();
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k == G_FN_DEF) {
+            FnDepth *d = calloc(1, sizeof(FnDepth));
+            d->g = g;
+            map_put(fns, intern(g->label), d);
+            vec_push(depths, d);
+        }
+    }
+    for (size_t i = 0; i < vec_len(depths); i++) {
+        FnDepth *d = vec_get(depths, i);
+        Fn *fn = d->g->fn;
+        fprintf(out, "%s:%s\t%zu\t%s\t%zu", file, fn_name(d->g), fn->frame_size,
+                fn->dyn_stack ? "dynamic" : "static", fn->out_args_size);
+        if (STACK_USAGE == SU_CALL_GRAPH) {
+            if (!d->done) {
+                find_depth(fns, d);
+            }
+            fprintf(out, "\t%zu\t", d->depth);
+            print_depth_flags(out, d->flags);
+        }
+        fputc('\n', out);
+    }
+    for (size_t i = 0; i < vec_len(depths); i++) {
+        free(vec_get(depths, i));
+    }
+    vec_free(depths);
+    map_free(fns);
+}
@@ -0,0 +1,39 @@
+
+#ifndef COSEC_STACK_USAGE_H
+#define COSEC_STACK_USAGE_H
+
+#include <stdio.h>
+
+#include "compile.h"
+
+// '-fstack-usage'. Once the backend's done, writes a line for each function
+// to a '.su' file next to the output:
+//
+//   <file>:<fn>  <frame>  <static|dynamic>  <out args>
+//
+// 'frame' is the most the function takes from the stack itself, in bytes,
+// counting its return address, saved frame pointer, spill and callee-saved
+// slots, locals, and the area for outgoing arguments passed on the stack
+// (which 'out args' gives on its own). It's 'dynamic' if it also moves rsp
+// at run time (for a VLA or 'alloca'), by an amount that isn't counted.
+//
+// With '-fstack-usage=callgraph', two more columns give the worst case depth
+// of the stack below the function's caller (its frame, plus the deepest chain
+// of calls it makes to functions defined in the same file), and whether that
+// chain's exact ('static'), or only a lower bound because some function on
+// it is 'dynamic', makes an 'external' call (to a function defined elsewhere,
+// through a pointer, or to the '-finstrument-functions' hooks), or is
+// 'recursive'
+enum {
+    SU_NONE,
+    SU_FRAMES,
+    SU_CALL_GRAPH,
+};
+
+extern int STACK_USAGE;
+
+// Requires 'frame_size' from 'patch_stack_sizes' (i.e., that the functions
+// weren't loaded from the function cache)
+void print_stack_usage(FILE *out, Vec *globals, char *file);
+
+#endif
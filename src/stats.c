@@ -0,0 +1,448 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "stats.h"
+#include "assemble.h"
+#include "target.h"
+#include "aarch64.h"
+
+int TIME_REPORT = 0;
+int PERF_COUNTERS = 0;
+int CODEGEN_STATS = 0;
+char *CODEGEN_STATS_PATH = NULL;
+THREAD_LOCAL size_t STATS[STAT_LAST];
+
+static char *STAT_NAMES[STAT_LAST] = {
+    "tokens", "AST nodes", "IR ins", "asm ins", "vregs", "IG edges",
+};
+
+static char *PERF_NAMES[PERF_LAST] = {
+    "cycles", "instructions", "br misses", "L1d misses", "LLC misses", "faults",
+};
+
+typedef struct {
+    double wall, cpu; // In seconds
+    size_t counts[STAT_LAST];
+    double perf[PERF_LAST]; // Scaled up if the counter was multiplexed
+} Sample;
+
+typedef struct {
+    char *name;        // Phase name, or function label
+    Sample start, total;
+    size_t peak_bytes; // Phases only
+} Timer;
+
+static Vec *PHASES, *FNS;      // of 'Timer *'
+static Timer *PHASE, *FN;      // Running
+static Map *FN_TIMERS;         // of 'Timer *'; by interned label
+
+// ---- Hardware Counters -----------------------------------------------------
+
+static int PERF_FDS[PERF_LAST];
+static int PERF_OPENED = 0; // Once per process; kept open between jobs
+
+#ifdef __linux__
+static int open_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1; // Allowed with 'perf_event_paranoid' up to 2
+    attr.exclude_hv = 1;
+    attr.inherit = 1;        // Count the backend's threads too
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void open_counters() {
+    uint64_t l1d = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    PERF_FDS[PERF_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    PERF_FDS[PERF_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    PERF_FDS[PERF_BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    PERF_FDS[PERF_L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE, l1d);
+    PERF_FDS[PERF_LLC_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    PERF_FDS[PERF_PAGE_FAULTS] = open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+}
+
+static double read_counter(int fd) {
+    uint64_t v[3]; // Value, time enabled, time running
+    if (fd < 0 || read(fd, v, sizeof(v)) != sizeof(v) || v[2] == 0) {
+        return 0.0;
+    }
+    return (double) v[0] * ((double) v[1] / (double) v[2]);
+}
+#else
+static void open_counters() {
+    for (int i = 0; i < PERF_LAST; i++) {
+        PERF_FDS[i] = -1; // Only Linux has 'perf_event_open'
+    }
+}
+
+static double read_counter(int fd) {
+    (void) fd;
+    return 0.0;
+}
+#endif
+
+static int any_counters() {
+    for (int i = 0; i < PERF_LAST; i++) {
+        if (PERF_FDS[i] >= 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// ---- Time Report -----------------------------------------------------------
+
+static double seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static Sample sample() {
+    Sample s;
+    s.wall = seconds(CLOCK_MONOTONIC);
+    s.cpu = seconds(CLOCK_PROCESS_CPUTIME_ID);
+    for (int i = 0; i < STAT_LAST; i++) {
+        s.counts[i] = STATS[i];
+    }
+    for (int i = 0; i < PERF_LAST; i++) {
+        s.perf[i] = PERF_COUNTERS ? read_counter(PERF_FDS[i]) : 0.0;
+    }
+    return s;
+}
+
+// Adds everything since 'timer' was started to its total
+static void stop(Timer *timer) {
+    Sample now = sample();
+    timer->total.wall += now.wall - timer->start.wall;
+    timer->total.cpu += now.cpu - timer->start.cpu;
+    for (int i = 0; i < STAT_LAST; i++) {
+        timer->total.counts[i] += now.counts[i] - timer->start.counts[i];
+    }
+    for (int i = 0; i < PERF_LAST; i++) {
+        timer->total.perf[i] += now.perf[i] - timer->start.perf[i];
+    }
+}
+
+void phase_begin(char *name) {
+    if (!TIME_REPORT) {
+        return;
+    }
+    assert(!PHASE);
+    if (!PHASES) {
+        PHASES = vec_new();
+    }
+    if (PERF_COUNTERS && !PERF_OPENED) {
+        open_counters();
+        PERF_OPENED = 1;
+    }
+    PHASE = calloc(1, sizeof(Timer));
+    PHASE->name = name;
+    vec_push(PHASES, PHASE);
+    arena_reset_peak();
+    PHASE->start = sample();
+}
+
+void phase_end() {
+    if (!TIME_REPORT) {
+        return;
+    }
+    assert(PHASE);
+    stop(PHASE);
+    PHASE->peak_bytes = arena_peak();
+    PHASE = NULL;
+}
+
+// A function's totals are summed over every phase it's timed in
+void fn_begin(Global *g) {
+    if (!TIME_REPORT) {
+        return;
+    }
+    assert(!FN);
+    if (!FN_TIMERS) {
+        FNS = vec_new();
+        FN_TIMERS = map_new();
+    }
+    char *key = intern(g->label);
+    FN = map_get(FN_TIMERS, key);
+    if (!FN) {
+        FN = calloc(1, sizeof(Timer));
+        FN->name = g->label;
+        vec_push(FNS, FN);
+        map_put(FN_TIMERS, key, FN);
+    }
+    FN->start = sample();
+}
+
+void fn_end() {
+    if (!TIME_REPORT) {
+        return;
+    }
+    assert(FN);
+    stop(FN);
+    FN = NULL;
+}
+
+static void print_header(FILE *out, char *first, int with_bytes) {
+    fprintf(out, "%-20s %10s %10s", first, "wall (ms)", "cpu (ms)");
+    if (with_bytes) {
+        fprintf(out, " %10s", "peak (KB)");
+    }
+    for (int i = 0; i < STAT_LAST; i++) {
+        fprintf(out, " %10s", STAT_NAMES[i]);
+    }
+    fprintf(out, "\n");
+}
+
+static void print_row(FILE *out, char *name, Sample *s, size_t *peak_bytes) {
+    fprintf(out, "%-20s %10.3f %10.3f", name, s->wall * 1e3, s->cpu * 1e3);
+    if (peak_bytes) {
+        fprintf(out, " %10zu", *peak_bytes / 1024);
+    }
+    for (int i = 0; i < STAT_LAST; i++) {
+        fprintf(out, " %10zu", s->counts[i]);
+    }
+    fprintf(out, "\n");
+}
+
+static void print_perf_header(FILE *out) {
+    fprintf(out, "%-20s", "counters");
+    for (int i = 0; i < PERF_LAST; i++) {
+        fprintf(out, " %14s", PERF_NAMES[i]);
+        if (i == PERF_INSTRUCTIONS) {
+            fprintf(out, " %6s", "IPC");
+        }
+    }
+    fprintf(out, "\n");
+}
+
+// Counters that couldn't be opened (in some VMs, or when not permitted) are '-'
+static void print_perf_row(FILE *out, char *name, Sample *s) {
+    fprintf(out, "%-20s", name);
+    for (int i = 0; i < PERF_LAST; i++) {
+        if (PERF_FDS[i] < 0) {
+            fprintf(out, " %14s", "-");
+        } else {
+            fprintf(out, " %14.0f", s->perf[i]);
+        }
+        if (i == PERF_INSTRUCTIONS) {
+            int has_ipc = PERF_FDS[PERF_CYCLES] >= 0 && PERF_FDS[PERF_INSTRUCTIONS] >= 0 &&
+                          s->perf[PERF_CYCLES] > 0.0;
+            if (has_ipc) {
+                fprintf(out, " %6.2f", s->perf[PERF_INSTRUCTIONS] / s->perf[PERF_CYCLES]);
+            } else {
+                fprintf(out, " %6s", "-");
+            }
+        }
+    }
+    fprintf(out, "\n");
+}
+
+static void print_perf_counters(FILE *out, Sample *total) {
+    fprintf(out, "\n");
+    if (!any_counters()) {
+        fprintf(out, "hardware counters unavailable (see 'perf_event_paranoid')\n");
+        return;
+    }
+    print_perf_header(out);
+    for (size_t i = 0; i < vec_len(PHASES); i++) {
+        Timer *t = vec_get(PHASES, i);
+        print_perf_row(out, t->name, &t->total);
+    }
+    print_perf_row(out, "total", total);
+}
+
+void print_time_report(FILE *out) {
+    if (!PHASES) {
+        return;
+    }
+    Sample total = {0};
+    size_t peak = 0;
+    print_header(out, "phase", 1);
+    for (size_t i = 0; i < vec_len(PHASES); i++) {
+        Timer *t = vec_get(PHASES, i);
+        print_row(out, t->name, &t->total, &t->peak_bytes);
+        total.wall += t->total.wall;
+        total.cpu += t->total.cpu;
+        for (int j = 0; j < STAT_LAST; j++) {
+            total.counts[j] += t->total.counts[j];
+        }
+        for (int j = 0; j < PERF_LAST; j++) {
+            total.perf[j] += t->total.perf[j];
+        }
+        peak = t->peak_bytes > peak ? t->peak_bytes : peak;
+    }
+    print_row(out, "total", &total, &peak);
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        long max_rss_kb = usage.ru_maxrss / 1024; // In bytes on macOS
+#else
+        long max_rss_kb = usage.ru_maxrss;
+#endif
+        fprintf(out, "max resident set size: %ld KB\n", max_rss_kb);
+    }
+    if (PERF_COUNTERS) {
+        print_perf_counters(out, &total);
+    }
+
+    if (FNS && vec_len(FNS) > 0) {
+        fprintf(out, "\n");
+        print_header(out, "function", 0);
+        for (size_t i = 0; i < vec_len(FNS); i++) {
+            Timer *t = vec_get(FNS, i);
+            print_row(out, t->name, &t->total, NULL);
+        }
+    }
+}
+
+void reset_time_report() {
+    PHASES = FNS = NULL;
+    PHASE = FN = NULL;
+    FN_TIMERS = NULL;
+}
+
+
+// ---- Codegen Stats ---------------------------------------------------------
+
+static char *CLASS_NAMES[CLASS_LAST] = {
+    "move", "int", "fp", "vector", "cmp", "branch", "call", "stack", "other",
+};
+
+static int a64_asm_class(int op) {
+    if (op <= A64_LEA) {
+        return CLASS_MOVE;
+    } else if (op <= A64_CNT) {
+        return CLASS_INT;
+    } else if (op <= A64_FCVTZS || op == A64_FCMP ||
+               (op >= A64_FCSEL && op < A64_FCSEL + NUM_CONDS)) {
+        return CLASS_FP;
+    } else if (op <= A64_FCSEL) {
+        return CLASS_CMP;
+    } else if (op <= A64_ALIGN_SP) {
+        return CLASS_STACK;
+    } else if (op <= A64_RET) {
+        return CLASS_BRANCH;
+    } else if (op <= A64_TAIL_CALL) {
+        return CLASS_CALL;
+    }
+    return CLASS_OTHER;
+}
+
+static int asm_class(int op) {
+    if (op >= X64_LAST) {
+        return a64_asm_class(op);
+    } else if (op <= X64_REP_STOSB) {
+        return CLASS_MOVE;
+    } else if (op <= X64_SARX) {
+        return CLASS_INT;
+    } else if (op <= X64_VFNMADD231SD || (op >= X64_UCOMISS && op <= X64_CVTTSD2SI)) {
+        return CLASS_FP;
+    } else if (op <= X64_PACKSSDW) {
+        return CLASS_VECTOR;
+    } else if (op <= X64_CMOVAE) {
+        return CLASS_CMP;
+    } else if (op == X64_PUSH || op == X64_POP) {
+        return CLASS_STACK;
+    } else if ((op >= X64_JMP && op <= X64_JAE) || op == X64_RET) {
+        return CLASS_BRANCH;
+    } else if (op == X64_CALL || op == X64_TAIL_CALL || op == X64_SYSCALL) {
+        return CLASS_CALL;
+    }
+    return CLASS_OTHER;
+}
+
+static int is_copy(AsmIns *ins) {
+    switch (ins->op) {
+    case X64_MOV: return ins->l->k == OPR_GPR && ins->r->k == OPR_GPR;
+    case X64_MOVSS: case X64_MOVSD: case X64_MOVDQU: case X64_MOVDQA:
+        return ins->l->k == OPR_XMM && ins->r->k == OPR_XMM;
+    default: return ins->op >= X64_LAST && TARGET->is_move(ins) == MOV_COPY;
+    }
+}
+
+void codegen_stats_begin(Fn *fn) {
+    fn->codegen = calloc(1, sizeof(CodegenStats));
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            fn->codegen->ir_ins++;
+        }
+    }
+}
+
+void codegen_stats_end(Fn *fn) {
+    CodegenStats *s = fn->codegen;
+    memset(s->classes, 0, sizeof(s->classes)); // Once, after the last pass
+    s->asm_ins = s->copies = s->calls = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            s->asm_ins++;
+            s->classes[asm_class(ins->op)]++;
+            s->copies += is_copy(ins);
+            s->calls += ins->op == TARGET->call || ins->op == TARGET->tail_call;
+        }
+    }
+}
+
+static void print_json_str(FILE *out, char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', out);
+        }
+        if ((unsigned char) *s < 0x20) {
+            fprintf(out, "\\u%04x", *s);
+        } else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+void print_codegen_stats(Vec *globals, char *file) {
+    FILE *out = CODEGEN_STATS_PATH ? fopen(CODEGEN_STATS_PATH, "a") : stdout;
+    if (!out) {
+        return; // Checked when the option's given
+    }
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k != G_FN_DEF || !g->fn->codegen) {
+            continue;
+        }
+        CodegenStats *s = g->fn->codegen;
+        fprintf(out, "{\"file\": ");
+        print_json_str(out, file);
+        fprintf(out, ", \"fn\": ");
+        print_json_str(out, g->label);
+        fprintf(out, ", \"ir_ins\": %zu, \"asm_ins\": %zu, \"classes\": {",
+                s->ir_ins, s->asm_ins);
+        for (int c = 0; c < CLASS_LAST; c++) {
+            fprintf(out, "%s\"%s\": %zu", c > 0 ? ", " : "", CLASS_NAMES[c],
+                    s->classes[c]);
+        }
+        fprintf(out, "}, \"vregs\": %zu, \"ig_edges\": %zu, \"coalesced\": %zu, "
+                "\"copies\": %zu, \"spills\": %zu, \"reloads\": %zu, "
+                "\"remats\": %zu, \"frame_size\": %zu, \"calls\": %zu}\n",
+                s->vregs, s->ig_edges, s->coalesced, s->copies, s->spills,
+                s->reloads, s->remats, g->fn->stack_size, s->calls);
+        free(s);
+        g->fn->codegen = NULL;
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+}
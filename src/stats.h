@@ -0,0 +1,81 @@
+
+#ifndef COSEC_STATS_H
+#define COSEC_STATS_H
+
+#include <stdio.h>
+
+#include "compile.h"
+
+// Compiler statistics for '--time-report'. Each phase of the pipeline is
+// timed (wall clock and CPU), along with the most memory held in arenas while
+// it ran and the number of objects it created. Assembly and register
+// allocation are broken down by function too. Counting an object is a single
+// add; nothing else is recorded unless 'TIME_REPORT' is set
+enum {
+    STAT_TOKENS,
+    STAT_AST_NODES,
+    STAT_IR_INS,
+    STAT_ASM_INS,
+    STAT_VREGS,
+    STAT_IG_EDGES, // Interference graph edges
+    STAT_LAST,
+};
+
+// With '--perf-counters' too, hardware performance counters (from Linux's
+// 'perf_event_open', for this process only) are read at the same boundaries
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES, // Loads only
+    PERF_LLC_MISSES,
+    PERF_PAGE_FAULTS,
+    PERF_LAST,
+};
+
+extern int TIME_REPORT;
+extern int PERF_COUNTERS;
+extern THREAD_LOCAL size_t STATS[STAT_LAST]; // Objects created so far, on this thread
+
+void phase_begin(char *name);
+void phase_end();
+void fn_begin(Global *g); // Within a phase
+void fn_end();
+void print_time_report(FILE *out);
+void reset_time_report(); // Between the compile server's jobs
+
+// Code generation statistics for '--codegen-stats': a line of JSON for each
+// function, with what the backend made of it, for diffing between builds to
+// catch codegen regressions. Collected per function (in 'Fn.codegen'), so the
+// parallel backend can fill them in; functions are never loaded from
+// '-fcache-dir' while they're on
+enum { // Classes of assembly instruction
+    CLASS_MOVE,   // Loads, stores, copies, 'lea', and block moves
+    CLASS_INT,    // Integer arithmetic
+    CLASS_FP,     // Scalar floating point arithmetic and conversions
+    CLASS_VECTOR, // Packed SSE
+    CLASS_CMP,    // Comparisons, 'setcc', and 'cmovcc'
+    CLASS_BRANCH, // Jumps and 'ret'
+    CLASS_CALL,
+    CLASS_STACK,  // 'push' and 'pop'
+    CLASS_OTHER,
+    CLASS_LAST,
+};
+
+typedef struct CodegenStats {
+    size_t ir_ins, asm_ins, classes[CLASS_LAST];
+    size_t vregs, ig_edges, coalesced; // 'ig_edges' only for the graph allocator
+    size_t copies; // Register to register 'mov's left after the peephole pass
+    size_t spills, reloads, remats; // Stores to and loads from stack slots, and
+                                    // rematerialised defs, added by 'reg_alloc'
+    size_t calls;
+} CodegenStats;
+
+extern int CODEGEN_STATS;
+extern char *CODEGEN_STATS_PATH; // Appended to; stdout if NULL
+
+void codegen_stats_begin(Fn *fn); // Before 'assemble_fn'
+void codegen_stats_end(Fn *fn);   // Once the assembly's final
+void print_codegen_stats(Vec *globals, char *file);
+
+#endif
@@ -0,0 +1,399 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include "strength.h"
+#include "analysis.h"
+
+// A basic induction variable is a phi in a loop's header that starts at some
+// value on entry and goes up by a constant on the back edge, like 'i' in
+// 'for (i = 0; i < n; i++)'. An address 'base + sext(i) * size' with a
+// loop-invariant 'base' then goes up by 'step * size' every iteration too, so
+// it's replaced by a new pointer phi that does exactly that. The old multiply
+// is left for 'dce' to remove if nothing else needs it.
+//
+// Sign extending 'i' commutes with adding the step because signed overflow is
+// undefined; zero extended (unsigned) indices can wrap, so are left alone.
+
+typedef struct {
+    IrIns *phi;
+    IrIns *init; // Value on entry to the loop
+    int64_t step;
+} IndVar;
+
+static int is_imm(IrIns *ins) {
+    return ins->op == IR_IMM;
+}
+
+static int64_t imm_val(IrIns *ins) { // Sign extended from the type's size
+    assert(ins->op == IR_IMM);
+    if (ins->t->size >= 8) {
+        return (int64_t) ins->imm;
+    }
+    int shift = 64 - (int) ins->t->size * 8;
+    return (int64_t) (ins->imm << shift) >> shift;
+}
+
+static IrIns * new_imm(IrType *t, int64_t v, IrIns *before) {
+    IrIns *imm = new_ins(IR_IMM, t);
+    imm->imm = (uint64_t) v;
+    insert_ir(imm, before);
+    return imm;
+}
+
+
+// ---- Induction Variables ---------------------------------------------------
+
+// Matches 'phi + <imm>', '<imm> + phi', or 'phi - <imm>'
+static int match_step(IrIns *phi, IrIns *next, int64_t *step) {
+    if (next->op == IR_ADD && next->l == phi && is_imm(next->r)) {
+        *step = imm_val(next->r);
+    } else if (next->op == IR_ADD && next->r == phi && is_imm(next->l)) {
+        *step = imm_val(next->l);
+    } else if (next->op == IR_SUB && next->l == phi && is_imm(next->r)) {
+        *step = -imm_val(next->r);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Only loops with a single back edge (from 'latch') are handled
+static Vec * find_ivs(Loop *loop, BB *pre, BB *latch) {
+    Vec *ivs = vec_new();
+    for (IrIns *phi = loop->header->ir_head; phi && phi->op == IR_PHI; phi = phi->next) {
+        if (vec_len(phi->preds) != 2 || phi->t->k == IRT_PTR ||
+                phi->t->k == IRT_F32 || phi->t->k == IRT_F64) {
+            continue;
+        }
+        int from_pre = vec_get(phi->preds, 0) == pre ? 0 : 1;
+        if (vec_get(phi->preds, from_pre) != pre ||
+                vec_get(phi->preds, 1 - from_pre) != latch) {
+            continue;
+        }
+        int64_t step;
+        if (match_step(phi, vec_get(phi->defs, 1 - from_pre), &step)) {
+            IndVar *iv = malloc(sizeof(IndVar));
+            iv->phi = phi;
+            iv->init = vec_get(phi->defs, from_pre);
+            iv->step = step;
+            vec_push(ivs, iv);
+        }
+    }
+    return ivs;
+}
+
+// Matches an offset of 'sext(iv) * <imm>' (or 'iv * <imm>' for a 64-bit iv)
+static IndVar * match_offset(Vec *ivs, IrIns *offset, int64_t *scale) {
+    if (offset->op != IR_MUL || !is_imm(offset->r) || offset->t->size != 8) {
+        return NULL;
+    }
+    IrIns *idx = offset->l;
+    if (idx->op == IR_SEXT) {
+        idx = idx->l;
+    } else if (idx->t->size != 8) {
+        return NULL;
+    }
+    for (size_t i = 0; i < vec_len(ivs); i++) {
+        IndVar *iv = vec_get(ivs, i);
+        if (iv->phi == idx) {
+            *scale = imm_val(offset->r);
+            return iv;
+        }
+    }
+    return NULL;
+}
+
+// Builds 'base + sext(init) * scale' in the preheader, and a pointer phi in
+// the header that goes up by 'step * scale' along the back edge
+static IrIns * reduce_ptradd(IrIns *ptradd, IndVar *iv, int64_t scale,
+                             BB *pre, BB *latch) {
+    IrIns *offset = ptradd->offset;
+    IrIns *end = pre->ir_last;
+    IrIns *start_off;
+    if (is_imm(iv->init)) {
+        start_off = new_imm(offset->t, imm_val(iv->init) * scale, end);
+    } else {
+        IrIns *idx = iv->init;
+        if (offset->l->op == IR_SEXT) {
+            IrIns *ext = new_ins(IR_SEXT, offset->l->t);
+            ext->l = idx;
+            insert_ir(ext, end);
+            idx = ext;
+        }
+        start_off = new_ins(IR_MUL, offset->t);
+        start_off->l = idx;
+        start_off->r = new_imm(offset->t, scale, end);
+        insert_ir(start_off, end);
+    }
+    IrIns *start = new_ins(IR_PTRADD, ptradd->t);
+    start->base = ptradd->base;
+    start->offset = start_off;
+    insert_ir(start, end);
+
+    IrIns *phi = new_ins(IR_PHI, ptradd->t);
+    insert_ir(phi, iv->phi->bb->ir_head);
+    IrIns *next = new_ins(IR_PTRADD, ptradd->t);
+    next->base = phi;
+    next->offset = new_imm(offset->t, iv->step * scale, latch->ir_last);
+    insert_ir(next, latch->ir_last);
+    vec_push(phi->preds, pre);
+    vec_push(phi->defs, start);
+    vec_push(phi->preds, latch);
+    vec_push(phi->defs, next);
+    return phi;
+}
+
+static BB * find_latch(Loop *loop) {
+    BB *latch = NULL;
+    for (size_t i = 0; i < vec_len(loop->header->pred); i++) {
+        BB *pred = vec_get(loop->header->pred, i);
+        if (!in_loop(pred, loop)) {
+            continue;
+        } else if (latch) {
+            return NULL; // More than one back edge
+        }
+        latch = pred;
+    }
+    return latch;
+}
+
+// Adds pairs of (old, new) values to 'repl' for each address replaced
+static void reduce_loop(Loop *loop, Vec *repl) {
+    BB *pre = find_preheader(loop);
+    BB *latch = find_latch(loop);
+    if (!pre || !latch) {
+        return;
+    }
+    Vec *ivs = find_ivs(loop, pre, latch);
+    for (size_t i = 0; i < vec_len(loop->bbs) && vec_len(ivs) > 0; i++) {
+        BB *bb = vec_get(loop->bbs, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op != IR_PTRADD || in_loop(ins->base->bb, loop)) {
+                continue;
+            }
+            int64_t scale;
+            IndVar *iv = match_offset(ivs, ins->offset, &scale);
+            if (iv) {
+                vec_push(repl, ins);
+                vec_push(repl, reduce_ptradd(ins, iv, scale, pre, latch));
+            }
+        }
+    }
+    for (size_t i = 0; i < vec_len(ivs); i++) {
+        free(vec_get(ivs, i));
+    }
+}
+
+
+// ---- Multiplication --------------------------------------------------------
+
+static int log2_exact(uint64_t v) {
+    if (v == 0 || (v & (v - 1)) != 0) {
+        return -1; // Not a power of 2
+    }
+    int n = 0;
+    while (v > 1) {
+        v >>= 1;
+        n++;
+    }
+    return n;
+}
+
+// 'x * 2^n' becomes 'x << n', and 'x * 1' just 'x'
+static void reduce_mul(IrIns *mul, Vec *repl) {
+    if (mul->t->k == IRT_F32 || mul->t->k == IRT_F64) {
+        return;
+    }
+    IrIns *x = mul->l, *imm = mul->r;
+    if (is_imm(x)) {
+        x = mul->r;
+        imm = mul->l;
+    }
+    if (!is_imm(imm)) {
+        return;
+    }
+    int shift = log2_exact(imm_val(imm));
+    if (shift == 0) {
+        vec_push(repl, mul);
+        vec_push(repl, x);
+    } else if (shift > 0) {
+        mul->op = IR_SHL;
+        mul->l = x;
+        mul->r = new_imm(mul->t, shift, mul);
+    }
+}
+
+
+// ---- Division --------------------------------------------------------------
+
+// Division by a power of 2 is a shift, and modulo by one is a mask. Shifts
+// round down though, where signed division rounds towards 0, so a negative
+// dividend gets '2^n - 1' added first ("Hacker's Delight", section 10-1).
+// Division by any other constant is a multiply instead (see 'asm_div_mod')
+
+static IrIns * new_binop(int op, IrIns *l, IrIns *r, IrIns *before) {
+    IrIns *ins = new_ins(op, l->t);
+    ins->l = l;
+    ins->r = r;
+    insert_ir(ins, before);
+    return ins;
+}
+
+// 'x + (x < 0 ? 2^n - 1 : 0)', for 'n' > 0
+static IrIns * round_to_zero(IrIns *x, int n, IrIns *before) {
+    int bits = (int) x->t->size * 8;
+    IrIns *sign = x; // The sign bit's all that matters for 'n' = 1
+    if (n > 1) {
+        sign = new_binop(IR_SAR, x, new_imm(x->t, bits - 1, before), before);
+    }
+    IrIns *bias = new_binop(IR_SHR, sign, new_imm(x->t, bits - n, before), before);
+    return new_binop(IR_ADD, x, bias, before);
+}
+
+static void reduce_div(IrIns *div, Vec *repl) {
+    if (div->t->k < IRT_I8 || div->t->k > IRT_I64 || !is_imm(div->r)) {
+        return;
+    }
+    IrIns *x = div->l;
+    int is_signed = div->op == IR_SDIV || div->op == IR_SMOD;
+    int64_t v = imm_val(div->r);
+    uint64_t d = (uint64_t) v;
+    if (is_signed && v < 0) {
+        d = -d;
+    } else if (!is_signed && div->t->size < 8) {
+        d &= ((uint64_t) 1 << (div->t->size * 8)) - 1; // Zero extend
+    }
+    int n = log2_exact(d);
+    if (n < 0) {
+        return;
+    }
+    IrIns *sum;
+    switch (div->op) {
+    case IR_UDIV: // 'x >> n'
+        if (n == 0) {
+            vec_push(repl, div);
+            vec_push(repl, x);
+            return;
+        }
+        div->op = IR_SHR;
+        div->r = new_imm(div->t, n, div);
+        break;
+    case IR_UMOD: // 'x & (2^n - 1)'
+        div->op = IR_BIT_AND;
+        div->r = new_imm(div->t, (int64_t) (d - 1), div);
+        break;
+    case IR_SDIV: // '(x + bias) >> n', negated for a negative divisor
+        if (n == 0 && v > 0) {
+            vec_push(repl, div);
+            vec_push(repl, x);
+            return;
+        }
+        if (v > 0) {
+            div->op = IR_SAR;
+            div->l = round_to_zero(x, n, div);
+            div->r = new_imm(div->t, n, div);
+        } else {
+            if (n > 0) {
+                sum = round_to_zero(x, n, div);
+                x = new_binop(IR_SAR, sum, new_imm(div->t, n, div), div);
+            }
+            div->op = IR_SUB;
+            div->l = new_imm(div->t, 0, div);
+            div->r = x;
+        }
+        break;
+    case IR_SMOD: // 'x - ((x + bias) & -2^n)'; the sign's the dividend's
+        if (n == 0) {
+            vec_push(repl, div);
+            vec_push(repl, new_imm(div->t, 0, div));
+            return;
+        }
+        sum = round_to_zero(x, n, div);
+        div->op = IR_SUB;
+        div->r = new_binop(IR_BIT_AND, sum, new_imm(div->t, -(int64_t) d, div), div);
+        break;
+    default: UNREACHABLE();
+    }
+}
+
+// 'x / c' becomes 'x * (1 / c)' for a floating point constant 'c' (or a
+// vector of them, from 'vectorise') when '1 / c' is exact, which it is for a
+// power of 2 whose reciprocal isn't subnormal. Otherwise the product can be
+// out by an ulp, so it's only done with '-freciprocal-math'
+static void reduce_fdiv(IrIns *div) {
+    IrIns *c = div->r->op == IR_SPLAT ? div->r->l : div->r;
+    if (c->op != IR_FP) {
+        return;
+    }
+    int exp;
+    double rcp = c->t->k == IRT_F32 ? (double) (1.0f / (float) c->fp) : 1.0 / c->fp;
+    int is_exact = fabs(frexp(c->fp, &exp)) == 0.5 &&
+                   (c->t->k == IRT_F32 ? isnormal((float) rcp) : isnormal(rcp));
+    if (!is_exact && (!RECIPROCAL_MATH || !isfinite(rcp) || rcp == 0.0)) {
+        return;
+    }
+    IrIns *r = new_ins(IR_FP, c->t); // Defined where 'c' is, so it dominates
+    r->fp = rcp;
+    insert_ir(r, c->next);
+    if (div->r->op == IR_SPLAT) {
+        IrIns *s = new_ins(IR_SPLAT, div->r->t);
+        s->l = r;
+        insert_ir(s, div->r);
+        r = s;
+    }
+    div->op = IR_MUL;
+    div->r = r;
+}
+
+
+// ---- Rewriting -------------------------------------------------------------
+
+static void replace_uses(Fn *fn, Vec *pairs) {
+    size_t num_ins = number_ir(fn);
+    IrIns **repl = calloc(num_ins, sizeof(IrIns *));
+    for (size_t i = 0; i < vec_len(pairs); i += 2) {
+        IrIns *old = vec_get(pairs, i);
+        repl[old->n] = vec_get(pairs, i + 1);
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                while (repl[(*oprs[i])->n]) {
+                    *oprs[i] = repl[(*oprs[i])->n];
+                }
+            }
+            for (size_t i = 0; ins->op == IR_PHI && i < vec_len(ins->defs); i++) {
+                IrIns *def = vec_get(ins->defs, i);
+                while (repl[def->n]) {
+                    def = repl[def->n];
+                }
+                vec_put(ins->defs, i, def);
+            }
+        }
+    }
+    free(repl);
+}
+
+void strength_reduce(Fn *fn) {
+    Vec *repl = vec_new(); // Pairs of (old, new) values
+    for (size_t i = 0; i < vec_len(fn->loops); i++) {
+        reduce_loop(vec_get(fn->loops, i), repl);
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_MUL) {
+                reduce_mul(ins, repl);
+            } else if (ins->op == IR_SDIV || ins->op == IR_UDIV ||
+                       ins->op == IR_SMOD || ins->op == IR_UMOD) {
+                reduce_div(ins, repl);
+            } else if (ins->op == IR_FDIV) {
+                reduce_fdiv(ins);
+            }
+        }
+    }
+    if (vec_len(repl) > 0) {
+        replace_uses(fn, repl);
+    }
+}
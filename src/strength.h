@@ -0,0 +1,16 @@
+
+#ifndef COSEC_STRENGTH_H
+#define COSEC_STRENGTH_H
+
+#include "compile.h"
+
+// Strength reduction. Array accesses indexed by a loop's induction variable
+// ('a[i]', 'p + i') become a pointer that's incremented each iteration
+// instead of a multiply and add, multiplies by powers of 2 become shifts, and
+// divides and modulos by powers of 2 become shifts and masks, and floating
+// point divides by a constant become multiplies by its reciprocal where that's
+// exact (or anywhere, with '-freciprocal-math'). Runs after 'licm', which
+// gives each loop a preheader
+void strength_reduce(Fn *fn);
+
+#endif
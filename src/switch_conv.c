@@ -0,0 +1,811 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "switch_conv.h"
+#include "analysis.h"
+
+// A switch is found from the BB at its head, which ends in the first test of
+// the value 'sel' that picks an arm. The head is one of:
+//   * an IR_SWITCH on 'sel' (a jump table cluster; see 'compile_switch');
+//   * a range check 'sel > k' (or '<', '<=', '>=', unsigned), where values
+//     out of range go to the default and the tests that follow pick between
+//     the ones in range (e.g., a bit test cluster);
+//   * or 'sel == k' (or '!='), the first of a chain of them, as for an 'if'-
+//     'else if' chain or a few 'case's. The constants compared against are
+//     the keys, and any other value fails every test and ends up at the
+//     default (the first BB that doesn't compare 'sel' with a constant).
+//
+// Rather than matching the shape of each kind of test, the tests are run for
+// each value in the range (see 'walk'): starting at the head, each IR_CONDBR
+// or IR_SWITCH whose condition is a pure function of 'sel' is followed to
+// the next test, which has to be a BB with no other predecessor and nothing
+// but pure arithmetic in it. The first BB that isn't a test is the value's
+// arm. The switch is converted if every arm (the default too, or it stays as
+// a branch) is either:
+//   * a BB with only constants, returning one;
+//   * a BB with only constants, branching to 'join';
+//   * or 'join' itself, straight from a test;
+// and each phi in 'join' takes a constant from every arm (that's a table),
+// or the same value from all of them.
+//
+// The head's test is replaced by 'idx = sel - lo' and the tables' loads,
+// which branch to 'join' (or return) instead; the tests and arms are left
+// unreachable, and deleted. A non-constant default is reached by a branch on
+// 'idx > len - 1' in front of the loads; otherwise the default's constants
+// are the entry at 'len' on the end of each table, and 'idx' is clamped to
+// it with an IR_SELECT.
+
+#define MIN_CASES      3    // Fewer branches are left as they are
+#define MAX_TABLE_LEN  1024 // Entries in a table, not counting the default's
+#define MIN_DENSITY    40   // Percent of a table's entries that aren't the default
+#define MAX_BITMASK    64   // Entries in a bitmask (the bits in an 'i64')
+#define MAX_STEPS      64   // Tests followed to find a value's arm
+#define MAX_EVAL_DEPTH 8    // Of the expressions computing a test's condition
+
+enum {
+    ARM_RET = 1, // The arms return a constant
+    ARM_PHI,     // The arms give constants to the phis in 'join'
+};
+
+typedef struct {
+    Vec *globals;
+    Global *fn;        // Being converted
+    size_t num_tables; // In 'fn', for their labels
+} SwitchConv;
+
+typedef struct {
+    BB *head;
+    IrIns *sel;
+    int chain;  // The head compares 'sel' for equality (see 'eval')
+    Vec *keys;  // of 'IrIns *'; the constants 'sel' is compared with
+    Vec *tests; // of 'BB *'; the tests after the head
+    uint64_t lo;    // Entry 'i' in the tables is for 'sel' = 'lo + i'
+    size_t len;
+    BB **arms;      // Per entry; the arm 'sel' = 'lo + i' takes
+    BB **from;      // Per entry; the test that branches to the arm
+    BB *def;        // Where every other value goes (NULL if none can)
+    BB *def_from;
+    int def_const;  // The default's constants go on the end of the tables
+    int kind;       // One of 'ARM_*'
+    BB *join;       // For 'ARM_PHI'
+} Switch;
+
+typedef struct {
+    IrIns *phi;     // NULL for the return value
+    IrType *t;
+    IrIns *same;    // The value from every arm, if it isn't a constant
+    uint64_t *vals; // Otherwise; per entry, then the default's
+} Column;
+
+static int is_int_t(IrType *t) {
+    return t && t->k >= IRT_I8 && t->k <= IRT_I64;
+}
+
+static uint64_t sext(uint64_t v, size_t size) {
+    if (size >= 8) {
+        return v;
+    }
+    int shift = 64 - (int) size * 8;
+    return (uint64_t) ((int64_t) (v << shift) >> shift);
+}
+
+static uint64_t zext(uint64_t v, size_t size) {
+    if (size >= 8) {
+        return v;
+    }
+    return v & ((1ull << (size * 8)) - 1);
+}
+
+
+// ---- Following the tests ---------------------------------------------------
+
+// Whether 'ins' is a pure integer operation that 'eval' can work out
+static int can_eval(IrIns *ins) {
+    if (!is_pure(ins) || !is_int_t(ins->t)) {
+        return 0;
+    }
+    switch (ins->op) {
+    case IR_IMM: case IR_ADD: case IR_SUB: case IR_MUL:
+    case IR_BIT_AND: case IR_BIT_OR: case IR_BIT_XOR:
+    case IR_SHL: case IR_SAR: case IR_SHR:
+    case IR_TRUNC: case IR_SEXT: case IR_ZEXT:
+        return 1;
+    default:
+        return ins->op >= IR_EQ && ins->op <= IR_UGE && is_int_t(ins->l->t);
+    }
+}
+
+static int fold(int op, size_t size, uint64_t l, uint64_t r, uint64_t *out) {
+    int64_t sl = (int64_t) sext(l, size), sr = (int64_t) sext(r, size);
+    uint64_t ul = zext(l, size), ur = zext(r, size);
+    switch (op) {
+    case IR_ADD: *out = l + r; break;
+    case IR_SUB: *out = l - r; break;
+    case IR_MUL: *out = l * r; break;
+    case IR_BIT_AND: *out = l & r; break;
+    case IR_BIT_OR:  *out = l | r; break;
+    case IR_BIT_XOR: *out = l ^ r; break;
+    case IR_SHL: case IR_SAR: case IR_SHR:
+        if (ur >= size * 8) return 0;
+        *out = op == IR_SHL ? ul << ur :
+               op == IR_SAR ? (uint64_t) (sl >> ur) : ul >> ur;
+        break;
+    case IR_EQ:  *out = ul == ur; break;
+    case IR_NEQ: *out = ul != ur; break;
+    case IR_SLT: *out = sl < sr; break;
+    case IR_SLE: *out = sl <= sr; break;
+    case IR_SGT: *out = sl > sr; break;
+    case IR_SGE: *out = sl >= sr; break;
+    case IR_ULT: *out = ul < ur; break;
+    case IR_ULE: *out = ul <= ur; break;
+    case IR_UGT: *out = ul > ur; break;
+    case IR_UGE: *out = ul >= ur; break;
+    default: return 0;
+    }
+    return 1;
+}
+
+static void add_key(Switch *sw, IrIns *k) {
+    for (size_t i = 0; i < vec_len(sw->keys); i++) {
+        IrIns *other = vec_get(sw->keys, i);
+        if (zext(other->imm, k->t->size) == zext(k->imm, k->t->size)) {
+            return;
+        }
+    }
+    vec_push(sw->keys, k);
+}
+
+// Evaluates 'ins' for 'sel' = 'v'. Or, if 'other', for a value of 'sel' that
+// isn't a key: all that's known about it is that it isn't equal to anything
+// it's compared with, which become keys. Returns 0 if 'ins' isn't a pure
+// function of 'sel' (or it's 'other', and isn't just an equality test)
+static int eval(Switch *sw, IrIns *ins, uint64_t v, int other, int depth, uint64_t *out) {
+    if (ins == sw->sel && !other) {
+        *out = v;
+        return 1;
+    }
+    if (ins == sw->sel || depth > MAX_EVAL_DEPTH || !can_eval(ins)) {
+        return 0;
+    }
+    if (ins->op == IR_IMM) {
+        *out = ins->imm;
+        return 1;
+    }
+    if (other && (ins->op == IR_EQ || ins->op == IR_NEQ) &&
+            (ins->l == sw->sel || ins->r == sw->sel)) {
+        IrIns *k = ins->l == sw->sel ? ins->r : ins->l;
+        if (k->op != IR_IMM) {
+            return 0;
+        }
+        add_key(sw, k);
+        *out = ins->op == IR_NEQ;
+        return 1;
+    }
+    uint64_t l, r;
+    if (!eval(sw, ins->l, v, other, depth + 1, &l)) {
+        return 0;
+    }
+    switch (ins->op) {
+    case IR_TRUNC: *out = l; return 1;
+    case IR_SEXT:  *out = sext(l, ins->l->t->size); return 1;
+    case IR_ZEXT:  *out = zext(l, ins->l->t->size); return 1;
+    default: break;
+    }
+    if (!eval(sw, ins->r, v, other, depth + 1, &r)) {
+        return 0;
+    }
+    return fold(ins->op, ins->l->t->size, l, r, out);
+}
+
+// Whether 'bb' only tests 'sel', so it can be skipped over
+static int is_test(BB *bb) {
+    IrIns *br = bb->ir_last;
+    if (!br || (br->op != IR_CONDBR && br->op != IR_SWITCH) ||
+            vec_len(bb->pred) != 1 || bb->addr_taken) {
+        return 0;
+    }
+    for (IrIns *ins = bb->ir_head; ins != br; ins = ins->next) {
+        if (!can_eval(ins)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void add_test(Switch *sw, BB *bb) {
+    for (size_t i = 0; i < vec_len(sw->tests); i++) {
+        if (vec_get(sw->tests, i) == bb) {
+            return;
+        }
+    }
+    vec_push(sw->tests, bb);
+}
+
+// Follows the tests from the head for 'sel' = 'v' (or another value; see
+// 'eval') to the arm it takes, and sets 'from' to the test that branches
+// there. Returns NULL if the head's test can't be followed, or the tests
+// loop back to the head
+static BB * walk(Switch *sw, uint64_t v, int other, BB **from) {
+    BB *prev = NULL, *bb = sw->head;
+    for (int steps = 0; steps < MAX_STEPS; steps++) {
+        IrIns *br = bb->ir_last;
+        BB *next = NULL;
+        uint64_t c;
+        if (br->op == IR_CONDBR && eval(sw, br->cond, v, other, 0, &c)) {
+            next = zext(c, br->cond->t->size) ? br->true : br->false;
+        } else if (br->op == IR_SWITCH && eval(sw, br->idx, v, other, 0, &c)) {
+            if (c < vec_len(br->table)) {
+                next = vec_get(br->table, c);
+            } else if (!br->in_range) {
+                next = br->default_br;
+            } else {
+                return NULL; // Undefined
+            }
+        }
+        if (!next) { // Not a test after all, so it's the arm
+            *from = prev;
+            return prev ? bb : NULL;
+        }
+        if (bb != sw->head) {
+            add_test(sw, bb);
+        }
+        if (next == sw->head) {
+            return NULL;
+        }
+        if (!is_test(next)) {
+            *from = bb;
+            return next;
+        }
+        prev = bb;
+        bb = next;
+    }
+    return NULL;
+}
+
+// The keys of a chain of equality tests span the range that's shortest,
+// comparing them as signed or unsigned
+static int key_range(Switch *sw) {
+    size_t size = sw->sel->t->size;
+    int64_t s_min = INT64_MAX, s_max = INT64_MIN;
+    uint64_t u_min = UINT64_MAX, u_max = 0;
+    for (size_t i = 0; i < vec_len(sw->keys); i++) {
+        IrIns *k = vec_get(sw->keys, i);
+        int64_t s = (int64_t) sext(k->imm, size);
+        uint64_t u = zext(k->imm, size);
+        if (s < s_min) s_min = s;
+        if (s > s_max) s_max = s;
+        if (u < u_min) u_min = u;
+        if (u > u_max) u_max = u;
+    }
+    uint64_t s_span = (uint64_t) s_max - (uint64_t) s_min, u_span = u_max - u_min;
+    uint64_t span = s_span < u_span ? s_span : u_span;
+    if (span >= MAX_TABLE_LEN) {
+        return 0;
+    }
+    sw->lo = zext(s_span < u_span ? (uint64_t) s_min : u_min, size);
+    sw->len = span + 1;
+    return 1;
+}
+
+// Finds the arm each value of 'sel' takes through the tests from 'head'
+static int find_arms(Switch *sw, BB *head) {
+    IrIns *br = head->ir_last;
+    sw->head = head;
+    sw->keys = vec_new();
+    sw->tests = vec_new();
+    sw->lo = 0;
+    sw->chain = 0;
+    sw->def = sw->def_from = NULL;
+    if (br->op == IR_SWITCH) {
+        sw->sel = br->idx;
+        sw->len = vec_len(br->table);
+        if (!br->in_range) {
+            sw->def = br->default_br;
+            sw->def_from = head;
+        }
+    } else if (br->op == IR_CONDBR) {
+        IrIns *cond = br->cond;
+        if (cond->op < IR_EQ || cond->op > IR_UGE || !is_int_t(cond->l->t) ||
+                cond->r->op != IR_IMM) {
+            return 0;
+        }
+        sw->sel = cond->l;
+        uint64_t k = zext(cond->r->imm, cond->l->t->size);
+        switch (cond->op) {
+        case IR_EQ: case IR_NEQ: sw->chain = 1; break;
+        case IR_ULT: sw->len = k;     sw->def = br->false; break;
+        case IR_ULE: sw->len = k + 1; sw->def = br->false; break;
+        case IR_UGT: sw->len = k + 1; sw->def = br->true; break;
+        case IR_UGE: sw->len = k;     sw->def = br->true; break;
+        default: return 0;
+        }
+        sw->def_from = head;
+    } else {
+        return 0;
+    }
+    if (sw->chain) {
+        sw->def = walk(sw, 0, 1, &sw->def_from);
+        if (!sw->def || vec_len(sw->keys) < MIN_CASES || !key_range(sw)) {
+            return 0;
+        }
+    }
+    if (sw->len == 0 || sw->len > MAX_TABLE_LEN) {
+        return 0;
+    }
+    sw->arms = malloc(sizeof(BB *) * sw->len);
+    sw->from = malloc(sizeof(BB *) * sw->len);
+    for (size_t i = 0; i < sw->len; i++) {
+        uint64_t v = zext(sw->lo + i, sw->sel->t->size);
+        sw->arms[i] = walk(sw, v, 0, &sw->from[i]);
+        if (!sw->arms[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+// ---- Arms ------------------------------------------------------------------
+
+// An arm with only constants in it, returning one or branching to 'join'; or 0
+static int arm_kind(BB *bb, BB **join) {
+    IrIns *end = bb->ir_last;
+    for (IrIns *ins = bb->ir_head; ins != end; ins = ins->next) {
+        if (ins->op != IR_IMM) {
+            return 0;
+        }
+    }
+    if (end->op == IR_RET && end->ret && end->ret->op == IR_IMM && is_int_t(end->ret->t)) {
+        return ARM_RET;
+    } else if (end->op == IR_BR) {
+        *join = end->br;
+        return ARM_PHI;
+    }
+    return 0;
+}
+
+// The value the arm 'bb', reached from the test 'from', gives the column
+static IrIns * arm_value(Switch *sw, BB *bb, BB *from, IrIns *phi) {
+    BB *join;
+    int kind = arm_kind(bb, &join);
+    if (sw->kind == ARM_RET) {
+        return kind == ARM_RET ? bb->ir_last->ret : NULL;
+    } else if (bb == sw->join) {
+        return phi_def(phi, from);
+    } else if (kind == ARM_PHI && join == sw->join) {
+        return phi_def(phi, bb);
+    }
+    return NULL;
+}
+
+static int find_join(Switch *sw) {
+    for (size_t i = 0; i <= sw->len; i++) {
+        BB *arm = i < sw->len ? sw->arms[i] : sw->def;
+        if (arm && (sw->kind = arm_kind(arm, &sw->join))) {
+            break;
+        }
+    }
+    if (!sw->kind) {
+        return 0;
+    } else if (sw->kind == ARM_RET) {
+        return 1;
+    }
+    for (size_t i = 0; i < vec_len(sw->tests); i++) {
+        if (vec_get(sw->tests, i) == sw->join) {
+            return 0;
+        }
+    }
+    return sw->join != sw->head;
+}
+
+// Fills in a column's values from every entry, and from the default if they
+// fit in a table too
+static int fill_column(Switch *sw, Column *col) {
+    col->same = NULL;
+    col->vals = malloc(sizeof(uint64_t) * (sw->len + 1));
+    int all_imm = 1;
+    for (size_t i = 0; i < sw->len; i++) {
+        IrIns *v = arm_value(sw, sw->arms[i], sw->from[i], col->phi);
+        if (!v) {
+            return 0;
+        }
+        if (i == 0) {
+            col->same = v;
+            col->t = v->t;
+        } else if (v != col->same) {
+            col->same = NULL;
+        }
+        if (v->op == IR_IMM && v->t == col->t && is_int_t(v->t)) {
+            col->vals[i] = zext(v->imm, v->t->size);
+        } else {
+            all_imm = 0;
+        }
+    }
+    if (all_imm) {
+        col->same = NULL;
+    } else if (!col->same || !dominates(col->same->bb, sw->head)) {
+        return 0;
+    }
+    if (sw->def_const && sw->def) {
+        IrIns *v = arm_value(sw, sw->def, sw->def_from, col->phi);
+        if (col->same) {
+            sw->def_const = v == col->same;
+        } else if (v && v->op == IR_IMM && v->t == col->t) {
+            col->vals[sw->len] = zext(v->imm, v->t->size);
+        } else {
+            sw->def_const = 0;
+        }
+    }
+    return 1;
+}
+
+// Up to 3, as that's enough to rule out a bitmask
+static int num_distinct(Column *col, size_t len, uint64_t *a, uint64_t *b) {
+    *a = *b = col->vals[0];
+    int n = 1;
+    for (size_t i = 1; i < len; i++) {
+        if (col->vals[i] == *a || (n == 2 && col->vals[i] == *b)) {
+            continue;
+        } else if (n == 2) {
+            return 3;
+        }
+        *b = col->vals[i];
+        n = 2;
+    }
+    return n;
+}
+
+static int is_dead(int *dead, BB *bb) {
+    return bb->rpo >= 0 && dead[bb->rpo];
+}
+
+// Whether every value in the region about to be deleted (the tests, and the
+// arms other than 'join' and a default that isn't constant) is only used there
+static int is_self_contained(Fn *fn, Switch *sw) {
+    Vec *rpo = rev_postorder(fn);
+    int *dead = calloc(vec_len(rpo), sizeof(int));
+    vec_free(rpo);
+    for (size_t i = 0; i < vec_len(sw->tests); i++) {
+        BB *bb = vec_get(sw->tests, i);
+        dead[bb->rpo] = 1;
+    }
+    for (size_t i = 0; i < sw->len; i++) {
+        if (sw->arms[i] != sw->join) {
+            dead[sw->arms[i]->rpo] = 1;
+        }
+    }
+    if (sw->def && !sw->def_const) {
+        dead[sw->def->rpo] = 0;
+    }
+    int ok = 1;
+    for (BB *bb = fn->entry; bb && ok; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins && ok; ins = ins->next) {
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    IrIns *def = vec_get(ins->defs, i);
+                    ok &= !is_dead(dead, def->bb) || is_dead(dead, vec_get(ins->preds, i));
+                }
+                continue;
+            }
+            IrIns **oprs[3];
+            int n = ir_operands(ins, oprs);
+            for (int i = 0; i < n; i++) {
+                ok &= !*oprs[i] || !is_dead(dead, (*oprs[i])->bb) || is_dead(dead, bb);
+            }
+        }
+    }
+    free(dead);
+    return ok;
+}
+
+// Collects the columns (one for each phi in 'join', or for the return value)
+// and checks the switch is worth converting
+static Vec * find_columns(Fn *fn, Switch *sw) {
+    if (!find_join(sw)) {
+        return NULL;
+    }
+    size_t num_cases = 0;
+    int distinct_arms = 0;
+    for (size_t i = 0; i < sw->len; i++) {
+        num_cases += sw->arms[i] != sw->def;
+        distinct_arms |= sw->arms[i] != sw->arms[0];
+    }
+    distinct_arms |= sw->def && sw->def != sw->arms[0];
+    if (num_cases < MIN_CASES || !distinct_arms) {
+        return NULL;
+    }
+    Vec *cols = vec_new();
+    if (sw->kind == ARM_RET) {
+        Column *col = calloc(1, sizeof(Column));
+        vec_push(cols, col);
+    } else {
+        for (IrIns *phi = next_phi(sw->join->ir_head); phi; phi = next_phi(phi->next)) {
+            Column *col = calloc(1, sizeof(Column));
+            col->phi = phi;
+            vec_push(cols, col);
+        }
+    }
+    sw->def_const = 1;
+    int any_table = 0, any_vals = 0;
+    for (size_t i = 0; i < vec_len(cols); i++) {
+        Column *col = vec_get(cols, i);
+        if (!fill_column(sw, col)) {
+            return NULL;
+        }
+        any_vals |= !col->same;
+    }
+    if (!sw->def) {
+        sw->def_const = 0;
+    }
+    if (!any_vals) {
+        return NULL;
+    }
+    if (sw->def && !sw->def_const) {
+        // The default keeps its branch, from the head now rather than the
+        // test that went there, which it mustn't already have a phi entry for
+        IrIns *phi = next_phi(sw->def->ir_head);
+        if (phi && sw->def_from != sw->head && phi_def(phi, sw->head)) {
+            return NULL;
+        }
+    }
+    size_t len = sw->len + sw->def_const;
+    for (size_t i = 0; i < vec_len(cols); i++) {
+        Column *col = vec_get(cols, i);
+        uint64_t a, b;
+        any_table |= !col->same && (num_distinct(col, len, &a, &b) > 2 || len > MAX_BITMASK);
+    }
+    if (any_table && num_cases * 100 < sw->len * MIN_DENSITY) {
+        return NULL;
+    }
+    return is_self_contained(fn, sw) ? cols : NULL;
+}
+
+
+// ---- Conversion ------------------------------------------------------------
+
+static IrIns * emit_imm(BB *bb, IrType *t, uint64_t imm) {
+    IrIns *ins = append_ir(bb, new_ins(IR_IMM, t));
+    ins->imm = imm;
+    return ins;
+}
+
+static IrIns * emit_op(BB *bb, int op, IrType *t, IrIns *l, IrIns *r) {
+    IrIns *ins = append_ir(bb, new_ins(op, t));
+    ins->l = l;
+    ins->r = r;
+    return ins;
+}
+
+static void set_phi_def(IrIns *phi, BB *pred, IrIns *def) {
+    for (size_t i = 0; i < vec_len(phi->preds); i++) {
+        if (vec_get(phi->preds, i) == pred) {
+            vec_put(phi->defs, i, def);
+            return;
+        }
+    }
+    vec_push(phi->preds, pred);
+    vec_push(phi->defs, def);
+}
+
+// The smallest element that holds every value in the column, and whether
+// it's sign extended back to the column's type
+static size_t elem_size(Column *col, size_t len, int *is_signed) {
+    size_t size = col->t->size;
+    for (size_t s = 1; s < size; s *= 2) {
+        int fits_s = 1, fits_u = 1;
+        for (size_t i = 0; i < len; i++) {
+            fits_s &= sext(col->vals[i], s) == sext(col->vals[i], size);
+            fits_u &= zext(col->vals[i], s) == col->vals[i];
+        }
+        if (fits_s || fits_u) {
+            *is_signed = !fits_u;
+            return s;
+        }
+    }
+    *is_signed = 0;
+    return size;
+}
+
+static Global * new_table(SwitchConv *sc, IrType *elem, uint64_t *vals, size_t len) {
+    // Named after the function, so they're unique even when each function's
+    // converted on its own (see '-fstream')
+    size_t size = strlen(sc->fn->label) + 32;
+    char *label = malloc(size);
+    snprintf(label, size, "_G.switch.%s.%zu", sc->fn->label, sc->num_tables++);
+    Global *g = arena_alloc(ARENA_IR, sizeof(Global));
+    g->k = G_INIT;
+    g->label = label;
+    g->t = irt_arr(elem, len, len * elem->size, elem->size);
+    g->linkage = LINK_STATIC;
+    g->is_const = 1;
+    g->num_bytes = len * elem->size;
+    g->bytes = malloc(g->num_bytes);
+    for (size_t i = 0; i < len; i++) {
+        for (size_t b = 0; b < elem->size; b++) { // Little endian
+            g->bytes[i * elem->size + b] = (char) (vals[i] >> (b * 8));
+        }
+    }
+    g->relocs = vec_new();
+    vec_push(sc->globals, g);
+    return g;
+}
+
+static IrIns * emit_bitmask(BB *bb, IrIns *idx, Column *col, size_t len, uint64_t a, uint64_t b) {
+    uint64_t lo = a, hi = b;
+    if (a == 1 && b == 0) {
+        lo = 0;
+        hi = 1;
+    }
+    uint64_t mask = 0;
+    for (size_t i = 0; i < len; i++) {
+        mask |= (uint64_t) (col->vals[i] == hi) << i;
+    }
+    IrType *i64 = irt_scalar(IRT_I64);
+    IrIns *shifted = emit_op(bb, IR_SHR, i64, emit_imm(bb, i64, mask), idx);
+    IrIns *bit = emit_op(bb, IR_BIT_AND, i64, shifted, emit_imm(bb, i64, 1));
+    if (col->t->size < 8) {
+        IrIns *trunc = append_ir(bb, new_ins(IR_TRUNC, col->t));
+        trunc->l = bit;
+        bit = trunc;
+    }
+    if (lo == 0 && hi == 1) {
+        return bit;
+    }
+    IrIns *select = emit_op(bb, IR_SELECT, col->t, emit_imm(bb, col->t, hi),
+                            emit_imm(bb, col->t, lo));
+    select->sel = bit;
+    return select;
+}
+
+static IrIns * emit_table(SwitchConv *sc, BB *bb, IrIns *idx, Column *col, size_t len) {
+    int is_signed;
+    size_t size = elem_size(col, len, &is_signed);
+    IrType *elem = irt_scalar(size == 1 ? IRT_I8 : size == 2 ? IRT_I16 :
+                              size == 4 ? IRT_I32 : IRT_I64);
+    IrIns *base = append_ir(bb, new_ins(IR_GLOBAL, irt_scalar(IRT_PTR)));
+    base->g = new_table(sc, elem, col->vals, len);
+    IrIns *offset = idx;
+    if (size > 1) {
+        IrType *i64 = irt_scalar(IRT_I64);
+        offset = emit_op(bb, IR_MUL, i64, idx, emit_imm(bb, i64, size));
+    }
+    IrIns *ptr = append_ir(bb, new_ins(IR_PTRADD, irt_scalar(IRT_PTR)));
+    ptr->base = base;
+    ptr->offset = offset;
+    IrIns *load = append_ir(bb, new_ins(IR_LOAD, elem));
+    load->src = ptr;
+    load->align = 0;
+    if (size == col->t->size) {
+        return load;
+    }
+    IrIns *ext = append_ir(bb, new_ins(is_signed ? IR_SEXT : IR_ZEXT, col->t));
+    ext->l = load;
+    return ext;
+}
+
+static IrIns * emit_column(SwitchConv *sc, BB *bb, IrIns *idx, Column *col, size_t len) {
+    if (col->same) {
+        return col->same;
+    }
+    uint64_t a, b;
+    int n = num_distinct(col, len, &a, &b);
+    if (n == 1) {
+        return emit_imm(bb, col->t, a);
+    } else if (n == 2 && len <= MAX_BITMASK) {
+        return emit_bitmask(bb, idx, col, len, a, b);
+    } else {
+        return emit_table(sc, bb, idx, col, len);
+    }
+}
+
+static void convert(SwitchConv *sc, Fn *fn, Switch *sw, Vec *cols) {
+    BB *head = sw->head;
+    delete_ir(head->ir_last);
+    IrType *i64 = irt_scalar(IRT_I64);
+    IrIns *idx = sw->sel;
+    if (sw->lo != 0) {
+        idx = emit_op(head, IR_SUB, idx->t, idx, emit_imm(head, idx->t, sw->lo));
+    }
+    if (idx->t->size < 8) {
+        IrIns *ext = append_ir(head, new_ins(IR_ZEXT, i64));
+        ext->l = idx;
+        idx = ext;
+    }
+
+    BB *out = head; // Where the loads go
+    size_t len = sw->len;
+    if (sw->def) {
+        IrIns *last = emit_imm(head, i64, sw->len - 1);
+        IrIns *outside = emit_op(head, IR_UGT, irt_scalar(IRT_I32), idx, last);
+        if (sw->def_const) { // Clamp to the default's entry
+            IrIns *clamped = emit_op(head, IR_SELECT, i64, emit_imm(head, i64, sw->len), idx);
+            clamped->sel = outside;
+            idx = clamped;
+            len++;
+        } else {
+            out = new_bb();
+            insert_bb_after(fn, out, head);
+            IrIns *br = append_ir(head, new_ins(IR_CONDBR, NULL));
+            br->cond = outside;
+            br->true = sw->def;
+            br->false = out;
+            br->true_chain = br->false_chain = NULL;
+            br->likely = 0;
+            if (sw->def_from != head) {
+                for (IrIns *phi = next_phi(sw->def->ir_head); phi; phi = next_phi(phi->next)) {
+                    for (size_t i = 0; i < vec_len(phi->preds); i++) {
+                        if (vec_get(phi->preds, i) == sw->def_from) {
+                            vec_put(phi->preds, i, head);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < vec_len(cols); i++) {
+        Column *col = vec_get(cols, i);
+        IrIns *val = emit_column(sc, out, idx, col, len);
+        if (sw->kind == ARM_RET) {
+            IrIns *ret = append_ir(out, new_ins(IR_RET, NULL));
+            ret->ret = val;
+            return;
+        }
+        set_phi_def(col->phi, out, val);
+        if (out != head && sw->def != sw->join) {
+            remove_phi_def(col->phi, head);
+        }
+    }
+    IrIns *br = append_ir(out, new_ins(IR_BR, NULL));
+    br->br = sw->join;
+}
+
+static void free_switch(Switch *sw, Vec *cols) {
+    if (cols) {
+        for (size_t i = 0; i < vec_len(cols); i++) {
+            Column *col = vec_get(cols, i);
+            free(col->vals);
+            free(col);
+        }
+        vec_free(cols);
+    }
+    vec_free(sw->keys);
+    vec_free(sw->tests);
+    free(sw->arms);
+    free(sw->from);
+    sw->arms = sw->from = NULL;
+}
+
+static void convert_fn(SwitchConv *sc, Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        if (!bb->ir_last) {
+            continue;
+        }
+        Switch sw = {0};
+        Vec *cols = NULL;
+        if (find_arms(&sw, bb) && (cols = find_columns(fn, &sw))) {
+            convert(sc, fn, &sw, cols);
+            analyse_cfg(fn);
+            vec_free(rev_postorder(fn));
+            remove_unreachable_bbs(fn);
+            analyse_cfg(fn);
+            analyse_dominators(fn);
+            analyse_loops(fn);
+        }
+        free_switch(&sw, cols);
+    }
+}
+
+void convert_switches(Vec *globals) {
+    SwitchConv sc = { .globals = globals };
+    size_t num_globals = vec_len(globals); // Not the tables added
+    for (size_t i = 0; i < num_globals; i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k == G_FN_DEF) {
+            sc.fn = g;
+            sc.num_tables = 0;
+            convert_fn(&sc, g->fn);
+        }
+    }
+}
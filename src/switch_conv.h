@@ -0,0 +1,18 @@
+#ifndef COSEC_SWITCH_CONV_H
+#define COSEC_SWITCH_CONV_H
+
+#include "compile.h"
+
+// Switch conversion. A 'switch' (or an 'if'-'else if' chain comparing one
+// value against constants) whose arms do nothing but pick constants, either
+// for the phis where the arms meet again or to return, like
+//   switch (c) { case 0: return 7; case 1: return 3; ... default: return 0; }
+// is replaced by a range check and a load from a table of the constants in
+// '.rodata', indexed by the value. If there are only two constants (e.g., a
+// 'bool' result), the table is a bitmask in an immediate instead, shifted
+// by the value. With a constant default, the range check picks the default's
+// entry at the end of the table with a 'cmov', so there are no branches left
+// to mispredict. Requires 'analyse', and keeps it up to date
+void convert_switches(Vec *globals);
+
+#endif
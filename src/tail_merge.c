@@ -0,0 +1,317 @@
+#include <stdlib.h>
+
+#include "tail_merge.h"
+#include "analysis.h"
+
+// Two BBs 'a' and 'b' are compared if both end in IR_RET, or both in an IR_BR
+// to the same successor. Their instructions are matched up from the bottom:
+// each pair has to have the same opcode, type and constant fields, and each
+// pair of operands has to be the same instruction (defined outside both BBs),
+// another matched pair the same distance from the end, or equal constants.
+// Constants are re-materialised wherever they're used, so they're skipped
+// over, and the merged tail gets its own copies of the ones it uses. Where the
+// successor has phis, the values they take from 'a' and 'b' have to match in
+// the same way. The longest such suffix that includes everything its
+// instructions use from their own BBs is split off from 'a' (unless it's all
+// of 'a' already) and 'b' branches to it instead:
+//   a: ...; call f; ret        a: ...; br t     t: call f; ret
+//   b: ...; call f; ret   =>   b: ...; br t
+// Nothing a suffix defines is used anywhere but in it and the successor's
+// phis, since neither BB dominates the other or anything after them.
+//
+// A suffix never starts in the middle of a call's arguments, and never
+// includes phis, allocations or inline assembly. Since the BB a suffix is
+// split from now needs a jump, it's only merged if it saves something: a
+// return's epilogue along with at least one other instruction, or at least
+// two instructions before a branch (not counting constants).
+//
+// Each BB is merged at most once per round, since a merge leaves the
+// numbering of the BBs it changes stale; rounds repeat until nothing changes,
+// so a third BB with the same suffix then branches straight to the merged one.
+
+#define MAX_SUFFIX 32 // Instructions compared
+
+typedef struct {
+    uint32_t *pos; // See 'number_from_end'
+    BB *a, *b;
+    uint32_t need; // The suffix includes everything it uses from 'a' and 'b'
+                   // if it's at least this long
+} Match;
+
+static IrIns * prev_non_const(IrIns *ins) {
+    do {
+        ins = ins->prev;
+    } while (ins && is_const(ins));
+    return ins;
+}
+
+// Numbers the instructions that aren't constants by their position counting
+// back from the end of their BB; only valid for BBs that haven't changed since
+static uint32_t * number_from_end(Fn *fn) {
+    uint32_t *pos = calloc(number_ir(fn), sizeof(uint32_t));
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        uint32_t p = 0;
+        for (IrIns *ins = bb->ir_last; ins; ins = prev_non_const(ins)) {
+            pos[ins->n] = p++;
+        }
+    }
+    return pos;
+}
+
+
+// ---- Matching --------------------------------------------------------------
+
+static int same_fields(IrIns *x, IrIns *y) {
+    switch (x->op) {
+    case IR_IMM: case IR_FP: return x->imm == y->imm; // Same bits for IR_FP
+    case IR_GLOBAL: return x->g == y->g;
+    case IR_BB_ADDR: return x->label_bb == y->label_bb;
+    case IR_LOAD: case IR_STORE: case IR_COPY: return x->align == y->align;
+    case IR_PREFETCH: return x->locality == y->locality;
+    case IR_ATOMIC_LOAD: case IR_ATOMIC_STORE: case IR_ATOMIC_XCHG:
+    case IR_ATOMIC_ADD: case IR_ATOMIC_CAS: case IR_FENCE:
+        return x->order == y->order;
+    case IR_BITCAST: return x->assumed_align == y->assumed_align;
+    case IR_REDUCE: return x->reduce_op == y->reduce_op;
+    case IR_CALL: return x->is_vararg == y->is_vararg;
+    case IR_BR: return x->br == y->br;
+    case IR_PHI: case IR_FARG: case IR_ALLOC: case IR_STACK_SAVE: case IR_ASM:
+    case IR_ASMIN: case IR_ASMOUT: case IR_CONDBR: case IR_SWITCH: case IR_INDIRECT_BR:
+    case IR_UNREACHABLE:
+        return 0;
+    default: return 1;
+    }
+}
+
+// Equal constants count as the same wherever they are, since the tail gets its
+// own copies (see 'copy_consts')
+static int same_opr(Match *m, IrIns *x, IrIns *y) {
+    if (is_const(x) || is_const(y)) {
+        return x->op == y->op && x->t == y->t && same_fields(x, y);
+    } else if (x->bb == m->a && y->bb == m->b) {
+        uint32_t p = m->pos[x->n];
+        if (p != m->pos[y->n]) {
+            return 0;
+        }
+        if (p + 1 > m->need) {
+            m->need = p + 1;
+        }
+        return 1;
+    }
+    return x == y && x->bb != m->a && x->bb != m->b;
+}
+
+static int same_ins(Match *m, IrIns *x, IrIns *y) {
+    if (x->op != y->op || x->t != y->t || !same_fields(x, y)) {
+        return 0;
+    }
+    IrIns **x_oprs[3], **y_oprs[3];
+    int num_oprs = ir_operands(x, x_oprs);
+    if (ir_operands(y, y_oprs) != num_oprs) {
+        return 0; // An IR_RET with and without a value
+    }
+    for (int i = 0; i < num_oprs; i++) {
+        if (!same_opr(m, *x_oprs[i], *y_oprs[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Length of the longest suffix 'a' and 'b' can share (0 if none)
+static size_t match_suffix(uint32_t *pos, BB *a, BB *b) {
+    Match m = { .pos = pos, .a = a, .b = b };
+    BB *succ = a->ir_last->op == IR_BR ? a->ir_last->br : NULL;
+    for (IrIns *phi = succ ? succ->ir_head : NULL; phi && phi->op == IR_PHI;
+            phi = phi->next) {
+        if (!same_opr(&m, phi_def(phi, a), phi_def(phi, b))) {
+            return 0;
+        }
+    }
+    size_t len = 0, best = 0;
+    IrIns *x = a->ir_last, *y = b->ir_last;
+    while (x && y && len < MAX_SUFFIX && same_ins(&m, x, y)) {
+        len++;
+        if (m.need <= len && x->op != IR_CARG) {
+            best = len;
+        }
+        x = prev_non_const(x);
+        y = prev_non_const(y);
+    }
+    return best;
+}
+
+static IrIns * suffix_start(BB *bb, size_t len) {
+    IrIns *ins = bb->ir_last;
+    while (--len > 0) {
+        ins = prev_non_const(ins);
+    }
+    return ins;
+}
+
+static int is_worth_merging(IrIns *start) {
+    int num_ins = 0;
+    for (IrIns *ins = start; ins->next; ins = ins->next) { // Not the branch
+        num_ins += !is_const(ins);
+    }
+    return num_ins >= (start->bb->ir_last->op == IR_RET ? 1 : 2);
+}
+
+static int is_tail(BB *bb) {
+    IrIns *last = bb->ir_last;
+    return last && (last->op == IR_RET || (last->op == IR_BR && last->br != bb));
+}
+
+static int same_exit(BB *a, BB *b) {
+    IrIns *x = a->ir_last, *y = b->ir_last;
+    return x->op == y->op && (x->op == IR_RET || x->br == y->br);
+}
+
+
+// ---- Merging ---------------------------------------------------------------
+
+static void append_br(BB *bb, BB *to) {
+    IrIns *br = new_ins(IR_BR, NULL);
+    br->br = to;
+    append_ir(bb, br);
+}
+
+// Moves 'from' and everything after it into a new BB after 'bb', which 'bb'
+// then branches to
+static BB * split_bb(Fn *fn, BB *bb, IrIns *from) {
+    BB *tail = new_bb();
+    insert_bb_after(fn, tail, bb);
+    tail->ir_head = from;
+    tail->ir_last = bb->ir_last;
+    for (IrIns *ins = from; ins; ins = ins->next) {
+        ins->bb = tail;
+    }
+    bb->ir_last = from->prev;
+    if (from->prev) {
+        from->prev->next = NULL;
+    } else {
+        bb->ir_head = NULL;
+    }
+    from->prev = NULL;
+    append_br(bb, tail);
+    return tail;
+}
+
+static IrIns * copy_const(IrIns *c, IrIns *before) {
+    IrIns *copy = new_ins(c->op, c->t);
+    *copy = *c;
+    copy->users = NULL;
+    insert_ir(copy, before);
+    return copy;
+}
+
+// A constant matched with an equal one elsewhere might not dominate the tail,
+// so it gets its own copies of the ones it uses from outside
+static void copy_consts(BB *tail, BB *succ) {
+    for (IrIns *ins = tail->ir_head; ins; ins = ins->next) {
+        IrIns **oprs[3];
+        int num_oprs = ir_operands(ins, oprs);
+        for (int i = 0; i < num_oprs; i++) {
+            if (is_const(*oprs[i]) && (*oprs[i])->bb != tail) {
+                *oprs[i] = copy_const(*oprs[i], ins);
+            }
+        }
+    }
+    for (IrIns *phi = succ ? succ->ir_head : NULL; phi && phi->op == IR_PHI;
+            phi = phi->next) {
+        for (size_t i = 0; i < vec_len(phi->preds); i++) {
+            IrIns *def = vec_get(phi->defs, i);
+            if (vec_get(phi->preds, i) == tail && is_const(def) && def->bb != tail) {
+                vec_put(phi->defs, i, copy_const(def, tail->ir_last));
+            }
+        }
+    }
+}
+
+static void merge(Fn *fn, BB *a, BB *b, size_t len) {
+    IrIns *from_a = suffix_start(a, len), *from_b = suffix_start(b, len);
+    int a_is_tail = !prev_non_const(from_a) && a != fn->entry;
+    int b_is_tail = !prev_non_const(from_b) && b != fn->entry;
+    if (b_is_tail && !a_is_tail) { // Keep whichever doesn't need splitting
+        BB *bb = a; a = b; b = bb;
+        IrIns *ins = from_a; from_a = from_b; from_b = ins;
+        a_is_tail = 1;
+    }
+    BB *succ = a->ir_last->op == IR_BR ? a->ir_last->br : NULL;
+    BB *tail = a;
+    if (!a_is_tail) {
+        tail = split_bb(fn, a, from_a);
+        if (succ) {
+            replace_phi_pred(succ, a, tail);
+        }
+    }
+    tail->freq = a->freq >= 0 && b->freq >= 0 ? a->freq + b->freq : -1;
+    copy_consts(tail, succ);
+
+    // Replace 'b's copy with a branch to the tail (along with any constants
+    // before it, if that's all there is)
+    IrIns *ins = prev_non_const(from_b) ? from_b : b->ir_head;
+    while (ins) {
+        IrIns *next = ins->next;
+        delete_ir(ins);
+        ins = next;
+    }
+    if (succ) {
+        remove_phi_pred(succ, b);
+    }
+    append_br(b, tail);
+
+    // If that leaves 'b' empty, branch around it (the tail has no phis)
+    if (b->ir_head == b->ir_last && b != fn->entry && !b->addr_taken) {
+        for (size_t i = 0; i < vec_len(b->pred); i++) {
+            BB *pred = vec_get(b->pred, i);
+            retarget_br(pred->ir_last, b, tail);
+        }
+    }
+}
+
+void merge_tails(Fn *fn) {
+    int changed = 0, merged;
+    do {
+        merged = 0;
+        Vec *rpo = rev_postorder(fn);
+        uint32_t *pos = number_from_end(fn);
+        Vec *tails = vec_new();
+        for (BB *bb = fn->entry; bb; bb = bb->next) {
+            if (bb->rpo >= 0 && is_tail(bb)) {
+                vec_push(tails, bb);
+            }
+        }
+        int *done = calloc(vec_len(rpo), sizeof(int)); // By BB 'rpo'
+        for (size_t i = 0; i < vec_len(tails); i++) {
+            BB *a = vec_get(tails, i);
+            for (size_t j = i + 1; !done[a->rpo] && j < vec_len(tails); j++) {
+                BB *b = vec_get(tails, j);
+                if (done[b->rpo] || !same_exit(a, b)) {
+                    continue;
+                }
+                size_t len = match_suffix(pos, a, b);
+                if (len > 0 && is_worth_merging(suffix_start(a, len))) {
+                    merge(fn, a, b, len);
+                    done[a->rpo] = done[b->rpo] = 1;
+                    merged = 1;
+                }
+            }
+        }
+        free(done);
+        free(pos);
+        vec_free(tails);
+        vec_free(rpo);
+        if (merged) {
+            analyse_cfg(fn);
+        }
+        changed |= merged;
+    } while (merged);
+    if (changed) {
+        vec_free(rev_postorder(fn));
+        remove_unreachable_bbs(fn);
+        analyse_cfg(fn);
+        analyse_dominators(fn);
+        analyse_loops(fn);
+    }
+}
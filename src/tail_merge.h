@@ -0,0 +1,13 @@
+#ifndef COSEC_TAIL_MERGE_H
+#define COSEC_TAIL_MERGE_H
+
+#include "compile.h"
+
+// Tail merging (cross-jumping). Where two BBs that both return, or both
+// branch to the same successor, end in the same instructions, e.g. the
+// 'cleanup(); return -1;' at the end of several 'switch' cases, one copy is
+// split off into its own BB and the other jumps to it instead. Shrinks the
+// code at the cost of a jump. Requires 'analyse', and keeps it up to date
+void merge_tails(Fn *fn);
+
+#endif
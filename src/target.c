@@ -0,0 +1,377 @@
+#include <string.h>
+
+#include "target.h"
+#include "encode.h"
+#include "schedule.h"
+#include "peephole.h"
+#include "aarch64.h"
+
+// ---- x86-64 (System V) -----------------------------------------------------
+
+// Caller-saved GPRs come first, so values that aren't live across a call don't
+// cost us a save and restore of a callee-saved one. Values that are live across
+// a call interfere with every caller-saved GPR (see 'x64_clobbers'), so they
+// end up in the callee-saved ones
+static int X64_GPR_ORDER[] = {
+    RAX, RCX, RDX, RSI, RDI, R8, R9, R10, R11,
+    RBX, R12, R13, R14, R15, RBP, RSP, R_NONE,
+};
+
+static int X64_SSE_ORDER[] = {
+    XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7,
+    XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15, R_NONE,
+};
+
+static int X64_GPR_ARGS[] = { RDI, RSI, RDX, RCX, R8, R9, };
+static int X64_SSE_ARGS[] = { XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7, };
+static int X64_GPR_RETS[] = { RAX, RDX, };
+static int X64_SSE_RETS[] = { XMM0, XMM1, };
+static int X64_CALLEE_SAVED[] = { RBX, R12, R13, R14, R15, }; // No SSE regs
+
+// Instructions that define their left operand
+static int X64_DEFS_LEFT[X64_LAST] = {
+    [X64_MOV] = 1, [X64_MOVSX] = 1, [X64_MOVZX] = 1, [X64_MOVSS] = 1,
+    [X64_MOVSD] = 1, [X64_LEA] = 1, [X64_MOVDQU] = 1, [X64_MOVDQA] = 1,
+    [X64_PXOR] = 1, [X64_ADD] = 1, [X64_SUB] = 1, [X64_IMUL] = 1, [X64_AND] = 1,
+    [X64_OR] = 1, [X64_XOR] = 1, [X64_SHL] = 1, [X64_SHR] = 1, [X64_SAR] = 1,
+    [X64_POPCNT] = 1, [X64_BSF] = 1, [X64_BSR] = 1, [X64_BSWAP] = 1,
+    [X64_ADDSS] = 1, [X64_ADDSD] = 1, [X64_SUBSS] = 1, [X64_SUBSD] = 1,
+    [X64_MULSS] = 1, [X64_MULSD] = 1, [X64_DIVSS] = 1, [X64_DIVSD] = 1,
+    [X64_MINSS] = 1, [X64_MINSD] = 1, [X64_MAXSS] = 1, [X64_MAXSD] = 1,
+    [X64_LZCNT] = 1, [X64_TZCNT] = 1, [X64_SHLX] = 1, [X64_SHRX] = 1,
+    [X64_SARX] = 1, [X64_VADDSS] = 1, [X64_VADDSD] = 1, [X64_VSUBSS] = 1,
+    [X64_VSUBSD] = 1, [X64_VMULSS] = 1, [X64_VMULSD] = 1, [X64_VDIVSS] = 1,
+    [X64_VDIVSD] = 1, [X64_VFMADD231SS] = 1, [X64_VFMADD231SD] = 1,
+    [X64_VFMSUB231SS] = 1, [X64_VFMSUB231SD] = 1, [X64_VFNMADD231SS] = 1,
+    [X64_VFNMADD231SD] = 1,
+    [X64_MOVD] = 1, [X64_MOVQ] = 1, [X64_PADDB] = 1, [X64_PADDW] = 1,
+    [X64_PADDD] = 1, [X64_PADDQ] = 1, [X64_PSUBB] = 1, [X64_PSUBW] = 1,
+    [X64_PSUBD] = 1, [X64_PSUBQ] = 1, [X64_PMULLW] = 1, [X64_PMULUDQ] = 1,
+    [X64_PAND] = 1, [X64_POR] = 1, [X64_ADDPS] = 1, [X64_ADDPD] = 1,
+    [X64_SUBPS] = 1, [X64_SUBPD] = 1, [X64_MULPS] = 1, [X64_MULPD] = 1,
+    [X64_DIVPS] = 1, [X64_DIVPD] = 1, [X64_VFMADD231PS] = 1,
+    [X64_VFMADD231PD] = 1, [X64_VFMSUB231PS] = 1, [X64_VFMSUB231PD] = 1,
+    [X64_VFNMADD231PS] = 1, [X64_VFNMADD231PD] = 1, [X64_PSLLW] = 1, [X64_PSLLD] = 1,
+    [X64_PSLLQ] = 1, [X64_PSRLW] = 1, [X64_PSRLD] = 1, [X64_PSRLQ] = 1,
+    [X64_PSRAW] = 1, [X64_PSRAD] = 1, [X64_PSRLDQ] = 1, [X64_PUNPCKLBW] = 1,
+    [X64_PUNPCKLWD] = 1, [X64_PUNPCKLDQ] = 1, [X64_PUNPCKLQDQ] = 1,
+    [X64_PACKSSWB] = 1, [X64_PACKSSDW] = 1,
+    [X64_SETE] = 1, [X64_SETNE] = 1, [X64_SETL] = 1, [X64_SETLE] = 1,
+    [X64_SETG] = 1, [X64_SETGE] = 1, [X64_SETB] = 1, [X64_SETBE] = 1,
+    [X64_SETA] = 1, [X64_SETAE] = 1,
+    [X64_CMOVE] = 1, [X64_CMOVNE] = 1, [X64_CMOVL] = 1, [X64_CMOVLE] = 1,
+    [X64_CMOVG] = 1, [X64_CMOVGE] = 1, [X64_CMOVB] = 1, [X64_CMOVBE] = 1,
+    [X64_CMOVA] = 1, [X64_CMOVAE] = 1,
+    [X64_CVTSS2SD] = 1, [X64_CVTSD2SS] = 1, [X64_CVTSI2SS] = 1,
+    [X64_CVTSI2SD] = 1, [X64_CVTTSS2SI] = 1, [X64_CVTTSD2SI] = 1,
+    [X64_POP] = 1, [X64_XCHG] = 1, [X64_LOCK_XADD] = 1,
+};
+
+// Instructions that define their left operand without reading it. Not 'setcc'
+// or the conversions into an SSE register, which only write part of it (the
+// assembler zeros it first, see 'asm_cmp' and 'fresh_xmm'), or the FMAs, which
+// accumulate into it
+static int X64_ONLY_DEFS_LEFT[X64_LAST] = {
+    [X64_MOV] = 1, [X64_MOVSX] = 1, [X64_MOVZX] = 1, [X64_MOVSS] = 1,
+    [X64_MOVSD] = 1, [X64_LEA] = 1, [X64_MOVDQU] = 1, [X64_MOVDQA] = 1,
+    [X64_MOVD] = 1, [X64_MOVQ] = 1, [X64_POPCNT] = 1, [X64_BSF] = 1, [X64_BSR] = 1,
+    [X64_LZCNT] = 1, [X64_TZCNT] = 1, [X64_SHLX] = 1, [X64_SHRX] = 1,
+    [X64_SARX] = 1, [X64_VADDSS] = 1, [X64_VADDSD] = 1, [X64_VSUBSS] = 1,
+    [X64_VSUBSD] = 1, [X64_VMULSS] = 1, [X64_VMULSD] = 1, [X64_VDIVSS] = 1,
+    [X64_VDIVSD] = 1,
+    [X64_CVTTSS2SI] = 1, [X64_CVTTSD2SI] = 1, [X64_POP] = 1,
+};
+
+#define BIT(r) ((uint64_t) 1 << (r))
+#define X64_CALL_CLOBBERS (BIT(RAX) | BIT(RDI) | BIT(RSI) | BIT(RDX) | BIT(RCX) | \
+                           BIT(R8) | BIT(R9) | BIT(R10) | BIT(R11))
+
+// Some instructions clobber GPRs that aren't explicitly used as arguments
+// (e.g., 'call' clobbers the caller-saved registers)
+static uint64_t X64_CLOBBERS[X64_LAST] = {
+    [X64_CWD]  = BIT(RDX),
+    [X64_CDQ]  = BIT(RDX),
+    [X64_CQO]  = BIT(RDX),
+    [X64_MUL]  = BIT(RAX) | BIT(RDX),
+    [X64_IDIV] = BIT(RAX) | BIT(RDX),
+    [X64_DIV]  = BIT(RAX) | BIT(RDX),
+    [X64_REP_MOVSB] = BIT(RDI) | BIT(RSI) | BIT(RCX),
+    [X64_REP_STOSB] = BIT(RDI) | BIT(RCX),
+    [X64_LOCK_CMPXCHG] = BIT(RAX),
+    [X64_CALL] = X64_CALL_CLOBBERS,
+    [X64_TAIL_CALL] = X64_CALL_CLOBBERS,
+};
+
+// Some instructions read pregs that aren't explicit arguments too (e.g., the
+// dividend for 'idiv', or the arguments to a 'call')
+static uint64_t X64_IMPLICIT_USES[X64_LAST] = {
+    [X64_MUL]  = BIT(RAX),
+    [X64_IDIV] = BIT(RAX) | BIT(RDX),
+    [X64_DIV]  = BIT(RAX) | BIT(RDX),
+    [X64_LOCK_CMPXCHG] = BIT(RAX),
+    [X64_CALL] = BIT(RAX) | BIT(RDI) | BIT(RSI) | BIT(RDX) | BIT(RCX) |
+                 BIT(R8) | BIT(R9),
+};
+
+static int x64_defs_left(AsmIns *ins) {
+    return X64_DEFS_LEFT[ins->op];
+}
+
+// 'pxor' of a reg with itself zeros it, rather than XORing two vectors
+static int x64_only_defs_left(AsmIns *ins) {
+    if (ins->op == X64_PXOR) {
+        return ins->l->k == OPR_XMM && ins->r->k == OPR_XMM &&
+               ins->l->reg == ins->r->reg;
+    }
+    return X64_ONLY_DEFS_LEFT[ins->op];
+}
+
+static uint64_t x64_clobbers(int op) {
+    return op < X64_LAST ? X64_CLOBBERS[op] : 0;
+}
+
+static uint64_t x64_implicit_uses(int op) {
+    return op < X64_LAST ? X64_IMPLICIT_USES[op] : 0;
+}
+
+static int x64_is_move(AsmIns *ins) {
+    if (ins->op >= X64_MOV && ins->op <= X64_MOVZX &&
+            ins->l->k == OPR_GPR && ins->r->k == OPR_GPR) {
+        return ins->op == X64_MOV ? MOV_COPY : MOV_EXTEND;
+    }
+    if ((ins->op == X64_MOVSS || ins->op == X64_MOVSD || ins->op == X64_MOVDQU) &&
+            ins->l->k == OPR_XMM && ins->r->k == OPR_XMM) {
+        return MOV_COPY;
+    }
+    return MOV_NONE;
+}
+
+// Constants, and the addresses of globals (even from the GOT, which is never
+// written) and stack slots, are cheaper to re-emit than to store and load
+// through a stack slot. Not a VLA's, which is off an rsp that moves
+static int x64_is_remat_def(AsmIns *ins) {
+    AsmOpr *src = ins->r;
+    switch (ins->op) {
+    case X64_MOV:
+        return ins->l->k == OPR_GPR && (src->k == OPR_IMM || src->k == OPR_GOTPCREL);
+    case X64_MOVSS: case X64_MOVSD:
+        return src->k == OPR_F32 || src->k == OPR_F64;
+    case X64_PXOR: // Floating point 0
+        return src->k == OPR_XMM && src->reg == ins->l->reg;
+    case X64_LEA:
+        return src->k == OPR_DEREF || src->k == OPR_BB_ADDR ||
+               (src->k == OPR_MEM && src->frame && src->frame != FRAME_DYN &&
+                src->idx == R_NONE);
+    default:
+        return 0;
+    }
+}
+
+Target X64_SYSV = {
+    .name = "x86_64",
+    .num_gprs = LAST_GPR,
+    .num_fprs = LAST_XMM,
+    .gpr_order = X64_GPR_ORDER,
+    .fpr_order = X64_SSE_ORDER,
+    .num_gpr_args = 6,
+    .num_fpr_args = 8,
+    .gpr_args = X64_GPR_ARGS,
+    .fpr_args = X64_SSE_ARGS,
+    .gpr_rets = X64_GPR_RETS,
+    .fpr_rets = X64_SSE_RETS,
+    .num_callee_saved = sizeof(X64_CALLEE_SAVED) / sizeof(X64_CALLEE_SAVED[0]),
+    .callee_saved = X64_CALLEE_SAVED,
+    .sp = RSP,
+    .fp = RBP,
+    .vectors = 1,
+
+    .call = X64_CALL,
+    .tail_call = X64_TAIL_CALL,
+    .jmp = X64_JMP,
+    .defs_left = x64_defs_left,
+    .only_defs_left = x64_only_defs_left,
+    .clobbers = x64_clobbers,
+    .implicit_uses = x64_implicit_uses,
+    .is_move = x64_is_move,
+    .is_remat_def = x64_is_remat_def,
+    .print_gpr = encode_gpr,
+    .print_fpr = encode_xmm,
+
+    .assemble_fn = assemble_fn,
+    .save_callee_saved = save_callee_saved,
+    .spill_load = spill_load,
+    .spill_store = spill_store,
+    .spill_remat = spill_remat,
+    .split_copy = split_copy,
+    .shrink_wrap = shrink_wrap,
+    .patch_stack_sizes = patch_stack_sizes,
+    .schedule_fn = schedule_fn,
+    .peephole_fn = peephole_fn,
+    .encode_fn = encode_nasm_fn,
+    .encode_with = encode_nasm_with,
+};
+
+
+// ---- AArch64 (AAPCS64) -----------------------------------------------------
+
+// As on x86-64, the caller-saved GPRs come first. x16 and x17 are left for the
+// encoder, x18 is the platform register, and x29 and x30 hold the frame
+// pointer and return address, so none of them are handed out. Only the
+// bottom 64 bits of v8-v15 are callee-saved, which the allocator has no way
+// to express, so they're left out too
+static int A64_GPR_ORDER[] = {
+    X0, X1, X2, X3, X4, X5, X6, X7, X8, X9, X10, X11, X12, X13, X14, X15,
+    X19, X20, X21, X22, X23, X24, X25, X26, X27, X28, R_NONE,
+};
+
+static int A64_FPR_ORDER[] = {
+    V0, V1, V2, V3, V4, V5, V6, V7, V16, V17, V18, V19, V20, V21, V22, V23,
+    V24, V25, V26, V27, V28, V29, V30, V31, R_NONE,
+};
+
+static int A64_GPR_ARGS[] = { X0, X1, X2, X3, X4, X5, X6, X7, };
+static int A64_FPR_ARGS[] = { V0, V1, V2, V3, V4, V5, V6, V7, };
+static int A64_GPR_RETS[] = { X0, X1, };
+static int A64_FPR_RETS[] = { V0, V1, };
+static int A64_CALLEE_SAVED[] = { X19, X20, X21, X22, X23, X24, X25, X26, X27, X28, };
+
+#define A64_OPS (A64_LAST - X64_LAST)
+#define A64(op) [(op) - X64_LAST]
+
+// Instructions that define their left operand. The atomic read-modify-writes
+// read it too (see 'aarch64.h'), as does 'cnt', which works in place
+static int A64_DEFS_LEFT[A64_OPS] = {
+    A64(A64_MOV) = 1, A64(A64_FMOV) = 1, A64(A64_SXTB) = 1, A64(A64_SXTH) = 1,
+    A64(A64_SXTW) = 1, A64(A64_UXTB) = 1, A64(A64_UXTH) = 1, A64(A64_UXTW) = 1,
+    A64(A64_LDR) = 1, A64(A64_LEA) = 1,
+    A64(A64_ADD) = 1, A64(A64_SUB) = 1, A64(A64_MUL) = 1, A64(A64_UMULH) = 1,
+    A64(A64_SDIV) = 1, A64(A64_UDIV) = 1, A64(A64_AND) = 1, A64(A64_ORR) = 1,
+    A64(A64_EOR) = 1, A64(A64_LSL) = 1, A64(A64_LSR) = 1, A64(A64_ASR) = 1,
+    A64(A64_CLZ) = 1, A64(A64_RBIT) = 1, A64(A64_REV) = 1, A64(A64_REV16) = 1,
+    A64(A64_CNT) = 1,
+    A64(A64_FADD) = 1, A64(A64_FSUB) = 1, A64(A64_FMUL) = 1, A64(A64_FDIV) = 1,
+    A64(A64_FCVT) = 1, A64(A64_SCVTF) = 1, A64(A64_FCVTZS) = 1,
+    A64(A64_LDAR) = 1, A64(A64_SWP) = 1, A64(A64_LDADD) = 1, A64(A64_CAS) = 1,
+};
+
+#define A64_CALL_CLOBBERS (BIT(X0) | BIT(X1) | BIT(X2) | BIT(X3) | BIT(X4) | \
+                           BIT(X5) | BIT(X6) | BIT(X7) | BIT(X8) | BIT(X9) | \
+                           BIT(X10) | BIT(X11) | BIT(X12) | BIT(X13) | \
+                           BIT(X14) | BIT(X15) | BIT(X16) | BIT(X17))
+
+static int a64_defs_left(AsmIns *ins) {
+    if (ins->op >= A64_CSET && ins->op < A64_FCSEL + NUM_CONDS) {
+        return 1;
+    }
+    return A64_DEFS_LEFT[ins->op - X64_LAST];
+}
+
+static int a64_only_defs_left(AsmIns *ins) {
+    int op = ins->op;
+    return a64_defs_left(ins) && op != A64_CNT && op != A64_SWP &&
+           op != A64_LDADD && op != A64_CAS;
+}
+
+static uint64_t a64_clobbers(int op) {
+    return op == A64_BL || op == A64_TAIL_CALL ? A64_CALL_CLOBBERS : 0;
+}
+
+// A call reads the argument registers, and x8 for where to return an aggregate
+static uint64_t a64_implicit_uses(int op) {
+    return op == A64_BL ? BIT(X0) | BIT(X1) | BIT(X2) | BIT(X3) | BIT(X4) |
+                          BIT(X5) | BIT(X6) | BIT(X7) | BIT(X8) : 0;
+}
+
+static int a64_is_move(AsmIns *ins) {
+    if (ins->op == A64_MOV && ins->l->k == OPR_GPR && ins->r->k == OPR_GPR) {
+        return MOV_COPY;
+    }
+    if (ins->op == A64_FMOV && ins->l->k == OPR_XMM && ins->r->k == OPR_XMM) {
+        return MOV_COPY;
+    }
+    if (ins->op >= A64_SXTB && ins->op <= A64_UXTW &&
+            ins->l->k == OPR_GPR && ins->r->k == OPR_GPR) {
+        return MOV_EXTEND;
+    }
+    return MOV_NONE;
+}
+
+// As on x86-64 (see 'x64_is_remat_def')
+static int a64_is_remat_def(AsmIns *ins) {
+    AsmOpr *src = ins->r;
+    switch (ins->op) {
+    case A64_MOV:
+        return ins->l->k == OPR_GPR && src->k == OPR_IMM;
+    case A64_FMOV:
+        return src->k == OPR_F32 || src->k == OPR_F64 || src->k == OPR_IMM;
+    case A64_LDR:
+        return ins->l->k == OPR_GPR && src->k == OPR_GOTPCREL;
+    case A64_LEA:
+        return src->k == OPR_DEREF || src->k == OPR_BB_ADDR ||
+               (src->k == OPR_MEM && src->frame && src->frame != FRAME_DYN &&
+                src->idx == R_NONE);
+    default:
+        return 0;
+    }
+}
+
+Target A64_AAPCS = {
+    .name = "aarch64",
+    .num_gprs = A64_LAST_GPR,
+    .num_fprs = A64_LAST_FPR,
+    .gpr_order = A64_GPR_ORDER,
+    .fpr_order = A64_FPR_ORDER,
+    .num_gpr_args = 8,
+    .num_fpr_args = 8,
+    .gpr_args = A64_GPR_ARGS,
+    .fpr_args = A64_FPR_ARGS,
+    .gpr_rets = A64_GPR_RETS,
+    .fpr_rets = A64_FPR_RETS,
+    .num_callee_saved = sizeof(A64_CALLEE_SAVED) / sizeof(A64_CALLEE_SAVED[0]),
+    .callee_saved = A64_CALLEE_SAVED,
+    .sp = XSP,
+    .fp = X29,
+    .vectors = 0,
+
+    .call = A64_BL,
+    .tail_call = A64_TAIL_CALL,
+    .jmp = A64_B,
+    .defs_left = a64_defs_left,
+    .only_defs_left = a64_only_defs_left,
+    .clobbers = a64_clobbers,
+    .implicit_uses = a64_implicit_uses,
+    .is_move = a64_is_move,
+    .is_remat_def = a64_is_remat_def,
+    .print_gpr = a64_print_gpr,
+    .print_fpr = a64_print_fpr,
+
+    .assemble_fn = a64_assemble_fn,
+    .save_callee_saved = a64_save_callee_saved,
+    .spill_load = a64_spill_load,
+    .spill_store = a64_spill_store,
+    .spill_remat = a64_spill_remat,
+    .split_copy = a64_split_copy,
+    .shrink_wrap = NULL,
+    .patch_stack_sizes = a64_patch_stack_sizes,
+    .schedule_fn = NULL,
+    .peephole_fn = a64_peephole_fn,
+    .encode_fn = a64_encode_fn,
+    .encode_with = a64_encode_with,
+};
+
+Target *TARGET = &X64_SYSV;
+
+// Only the architecture is looked at, so 'aarch64-linux-gnu' is AArch64
+Target * find_target(char *triple) {
+    Target *targets[] = { &X64_SYSV, &A64_AAPCS, };
+    size_t len = strcspn(triple, "-");
+    for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+        if (strlen(targets[i]->name) == len && strncmp(triple, targets[i]->name, len) == 0) {
+            return targets[i];
+        }
+    }
+    if (len == 5 && strncmp(triple, "arm64", 5) == 0) {
+        return &A64_AAPCS;
+    }
+    return NULL;
+}
@@ -0,0 +1,84 @@
+#ifndef COSEC_TARGET_H
+#define COSEC_TARGET_H
+
+#include <stdio.h>
+
+#include "assemble.h"
+
+// Target description. Everything about the machine that the passes after the
+// IR need, kept out of the passes themselves: the register file and calling
+// convention, what the register allocator needs to know about each opcode,
+// and the target's own instruction selection, stack frame, and encoder.
+// Registers are numbered from 1 in each group (0 is 'R_NONE'), up to
+// 'num_gprs' and 'num_fprs', which separate physical from virtual registers.
+//
+// x86-64 with the System V ABI is the default; AArch64 with AAPCS64 (in
+// 'aarch64.h') is selected with '--target=aarch64'. AArch64's opcodes are
+// numbered after the last x86-64 one, so the two never collide in the tables
+// that are indexed by opcode
+
+enum { // What 'is_move' finds
+    MOV_NONE,
+    MOV_COPY,   // A copy from one register to another
+    MOV_EXTEND, // A sign or zero extension, which isn't redundant from a
+                // register to itself if it widens
+};
+
+typedef struct {
+    char *name;
+
+    // Register file and calling convention
+    int num_gprs, num_fprs; // Physical registers, plus 1
+    int *gpr_order, *fpr_order; // Order the allocator tries them in; only
+                                // these are handed out (ends with R_NONE)
+    int num_gpr_args, num_fpr_args;
+    int *gpr_args, *fpr_args;
+    int *gpr_rets, *fpr_rets; // Up to 2 each
+    int num_callee_saved;     // GPRs, besides the frame pointer; no FPR is
+    int *callee_saved;        // kept across a call
+    int sp, fp;               // Stack and frame pointers
+    int vectors;              // Can assemble IRT_VEC (see 'vectorise.h')
+
+    // For the register allocator. 'defs_left' is whether an instruction
+    // writes its left operand, and 'only_defs_left' whether it does without
+    // reading it. 'clobbers' and 'implicit_uses' are bit sets of the GPRs an
+    // opcode writes and reads besides its operands (e.g., a call's)
+    int call, tail_call, jmp; // Opcodes
+    int (*defs_left)(AsmIns *ins);
+    int (*only_defs_left)(AsmIns *ins);
+    uint64_t (*clobbers)(int op);
+    uint64_t (*implicit_uses)(int op);
+    int (*is_move)(AsmIns *ins); // 'MOV_*'
+    int (*is_remat_def)(AsmIns *ins); // See 'spill_remat'
+    void (*print_gpr)(FILE *out, int reg, int size);
+    void (*print_fpr)(FILE *out, int reg);
+
+    // Instruction selection, the stack frame, and spill code (see
+    // 'assemble.h' for what each does)
+    void (*assemble_fn)(Fn *fn);
+    void (*save_callee_saved)(Fn *fn, int reg);
+    void (*spill_load)(AsmIns *before, int k, int reg, size_t slot);
+    void (*spill_store)(AsmIns *after, int k, int reg, size_t slot);
+    void (*spill_remat)(AsmIns *before, AsmIns *def, int reg);
+    void (*split_copy)(BB *bb, AsmIns *before, int k, int dst, int src);
+    void (*shrink_wrap)(Fn *fn);
+    void (*patch_stack_sizes)(Fn *fn);
+
+    // After register allocation; NULL if the target has no scheduler
+    void (*schedule_fn)(Fn *fn, int after_reg_alloc);
+    void (*peephole_fn)(Fn *fn);
+
+    // Assembly text, a function at a time (for the parallel backend), and the
+    // whole file with any functions already done (see 'encode_nasm_with')
+    void (*encode_fn)(Buf *b, Global *g);
+    void (*encode_with)(FILE *out, Vec *globals, Buf **fn_text);
+} Target;
+
+extern Target *TARGET; // The one being compiled for
+extern Target X64_SYSV;
+extern Target A64_AAPCS;
+
+// The target for a '--target=' triple (e.g., 'aarch64-linux-gnu'), or NULL
+Target * find_target(char *triple);
+
+#endif
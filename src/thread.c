@@ -0,0 +1,429 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread.h"
+#include "analysis.h"
+#include "dce.h"
+
+// A BB 'bb' ending in a conditional branch is threaded along the edge from a
+// predecessor 'pred' if the branch's condition is known on that edge:
+//   * it's a phi in 'bb' (or a comparison in 'bb' of phis and constants) that
+//     takes a constant from 'pred';
+//   * or it's defined before 'bb', and is the condition of a branch whose
+//     true (or false) successor is only reached from that branch, and
+//     dominates 'pred'.
+// 'pred' then branches to a copy of 'bb' instead, which ends in a branch
+// straight to the successor the condition picks:
+//   pred: ...; br bb         pred: ...; br bb'
+//   bb: phis; ...; condbr    bb': ...; br succ
+// Constants in 'bb' that are used elsewhere are moved to the entry BB first.
+// Anything else it defines that's used after it now comes from either 'bb'
+// or one of its copies, so each use looks back through its predecessors for
+// them, putting phis where they meet (like 'unswitch'). Loop headers aren't
+// threaded, since a copy would be a second way into the loop.
+//
+// Each BB threaded changes the CFG, so it's re-analysed before looking for
+// the next one. There's a limit on how many are threaded in a function, to
+// bound the growth in code size.
+
+#define MAX_SIZE 6     // Instructions copied, not counting phis and constants
+#define MAX_THREADED 64 // BBs threaded in each function
+
+typedef struct {
+    BB *bb;      // The copy
+    BB *pred;    // The predecessor it's for
+    IrIns **map; // Per ins in the original; its copy
+} Copy;
+
+typedef struct {
+    Fn *fn;
+    BB *bb;       // Being threaded
+    Vec *copies;  // of 'Copy *'
+    char *escapes; // Per ins; used outside its BB (see 'find_escapes')
+    size_t num_ins;
+    IrIns **at_start; // Per BB (by 'rpo'); the value being fixed up at its start
+} Thread;
+
+// Marks the instructions used outside their own BB, other than by the phis
+// in its successors (i.e., at the end of the BB itself)
+static void find_escapes(Fn *fn, char *escapes) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_PHI) {
+                for (size_t i = 0; i < vec_len(ins->defs); i++) {
+                    IrIns *def = vec_get(ins->defs, i);
+                    if (def->bb != vec_get(ins->preds, i)) {
+                        escapes[def->n] = 1;
+                    }
+                }
+                continue;
+            }
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                if ((*oprs[i])->bb != bb) {
+                    escapes[(*oprs[i])->n] = 1;
+                }
+            }
+        }
+    }
+}
+
+static int can_thread(Fn *fn, BB *bb) {
+    IrIns *br = bb->ir_last;
+    if (bb == fn->entry || bb->addr_taken || !br || br->op != IR_CONDBR ||
+            br->true == br->false || (bb->loop && bb->loop->header == bb)) {
+        return 0;
+    }
+    int size = 0;
+    for (IrIns *ins = bb->ir_head; ins != br; ins = ins->next) {
+        if (!can_copy(ins)) {
+            return 0;
+        }
+        size += ins->op != IR_PHI && !is_const(ins);
+    }
+    return size <= MAX_SIZE;
+}
+
+
+// ---- Known Conditions ------------------------------------------------------
+
+static uint64_t sext(uint64_t v, size_t size) {
+    if (size >= 8) {
+        return v;
+    }
+    int shift = 64 - (int) size * 8;
+    return (uint64_t) ((int64_t) (v << shift) >> shift);
+}
+
+static uint64_t zext(uint64_t v, size_t size) {
+    if (size >= 8) {
+        return v;
+    }
+    return v & ((1ull << (size * 8)) - 1);
+}
+
+static int fold_cmp(int op, size_t size, uint64_t l, uint64_t r) {
+    int64_t sl = (int64_t) sext(l, size), sr = (int64_t) sext(r, size);
+    uint64_t ul = zext(l, size), ur = zext(r, size);
+    switch (op) {
+    case IR_EQ:  return ul == ur;
+    case IR_NEQ: return ul != ur;
+    case IR_SLT: return sl < sr;
+    case IR_SLE: return sl <= sr;
+    case IR_SGT: return sl > sr;
+    case IR_SGE: return sl >= sr;
+    case IR_ULT: return ul < ur;
+    case IR_ULE: return ul <= ur;
+    case IR_UGT: return ul > ur;
+    case IR_UGE: return ul >= ur;
+    default: UNREACHABLE(); return 0;
+    }
+}
+
+// The constant 'v' is on the edge from 'pred' into 'bb', or NULL
+static IrIns * const_from(IrIns *v, BB *bb, BB *pred) {
+    if (v->op == IR_PHI && v->bb == bb) {
+        v = phi_def(v, pred);
+    }
+    return v->op == IR_IMM ? v : NULL;
+}
+
+// Whether 'cond' is the condition of a branch that 'pred' is only reached
+// through one side of (1 for the true side, 0 for the false, -1 if neither)
+static int known_from_dominator(IrIns *cond, BB *pred) {
+    for (BB *d = pred; d; d = d->idom) {
+        IrIns *br = d->ir_last;
+        if (br->op != IR_CONDBR || br->cond != cond || br->true == br->false) {
+            continue;
+        }
+        if (vec_len(br->true->pred) == 1 && dominates(br->true, pred)) {
+            return 1;
+        } else if (vec_len(br->false->pred) == 1 && dominates(br->false, pred)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// 1 if 'cond' is non-zero on the edge from 'pred' into 'bb', 0 if it's zero,
+// or -1 if it isn't known
+static int known_cond(IrIns *cond, BB *bb, BB *pred) {
+    IrIns *k = const_from(cond, bb, pred);
+    if (k) {
+        return zext(k->imm, k->t->size) != 0;
+    } else if (cond->bb != bb) {
+        IrIns *br = pred->ir_last; // The edge itself
+        if (br->op == IR_CONDBR && br->cond == cond && br->true != br->false) {
+            return br->true == bb;
+        }
+        return known_from_dominator(cond, pred);
+    } else if (cond->op >= IR_EQ && cond->op <= IR_UGE) {
+        IrIns *l = const_from(cond->l, bb, pred), *r = const_from(cond->r, bb, pred);
+        if (l && r) {
+            return fold_cmp(cond->op, cond->l->t->size, l->imm, r->imm);
+        }
+    }
+    return -1;
+}
+
+
+// ---- Threading -------------------------------------------------------------
+
+// What 'v' is in the copy of 'bb' for the edge from 'pred'
+static IrIns * mapped(IrIns **map, IrIns *v, BB *bb, BB *pred) {
+    if (v->bb != bb) {
+        return v;
+    } else if (v->op == IR_PHI) {
+        return phi_def(v, pred);
+    }
+    return map[v->n];
+}
+
+static void copy_bb(Thread *t, BB *pred, BB *to) {
+    BB *bb = t->bb;
+    Copy *copy = malloc(sizeof(Copy));
+    copy->bb = new_bb();
+    copy->pred = pred;
+    copy->map = calloc(t->num_ins, sizeof(IrIns *));
+    vec_push(t->copies, copy);
+    insert_bb_after(t->fn, copy->bb, pred);
+    for (IrIns *ins = bb->ir_head; ins != bb->ir_last; ins = ins->next) {
+        if (ins->op == IR_PHI) {
+            copy->map[ins->n] = phi_def(ins, pred);
+            continue;
+        }
+        IrIns *c = new_ins(ins->op, ins->t);
+        *c = *ins;
+        c->users = NULL;
+        IrIns **oprs[3];
+        int num_oprs = ir_operands(c, oprs);
+        for (int i = 0; i < num_oprs; i++) {
+            *oprs[i] = mapped(copy->map, *oprs[i], bb, pred);
+        }
+        append_ir(copy->bb, c);
+        copy->map[ins->n] = c;
+    }
+    IrIns *br = new_ins(IR_BR, NULL);
+    br->br = to;
+    append_ir(copy->bb, br);
+    for (IrIns *phi = to->ir_head; phi; phi = phi->next) {
+        if (phi->op == IR_PHI) {
+            vec_push(phi->preds, copy->bb);
+            vec_push(phi->defs, mapped(copy->map, phi_def(phi, bb), bb, pred));
+        }
+    }
+    retarget_br(pred->ir_last, bb, copy->bb);
+}
+
+// Constants are re-materialised wherever they're used, so one that's used
+// outside 'bb' can go in the entry BB rather than needing phis
+static void hoist_consts(Thread *t) {
+    IrIns *before = t->fn->entry->ir_last;
+    IrIns *ins = t->bb->ir_head;
+    while (ins != t->bb->ir_last) {
+        IrIns *next = ins->next;
+        if (is_const(ins) && t->escapes[ins->n]) {
+            delete_ir(ins);
+            insert_ir(ins, before);
+        }
+        ins = next;
+    }
+}
+
+
+// ---- Fixing Up Uses --------------------------------------------------------
+
+static Copy * copy_for(Thread *t, BB *bb) {
+    for (size_t i = 0; i < vec_len(t->copies); i++) {
+        Copy *copy = vec_get(t->copies, i);
+        if (copy->bb == bb) {
+            return copy;
+        }
+    }
+    return NULL;
+}
+
+static IrIns * at_start(Thread *t, IrIns *def, BB *bb);
+
+// What 'def' is at the end of 'bb'
+static IrIns * at_end(Thread *t, IrIns *def, BB *bb) {
+    Copy *copy;
+    if (bb == t->bb) {
+        return def;
+    } else if ((copy = copy_for(t, bb))) {
+        return copy->map[def->n];
+    }
+    return at_start(t, def, bb);
+}
+
+static IrIns * at_start(Thread *t, IrIns *def, BB *bb) {
+    if (bb->rpo < 0) {
+        return def; // Unreachable, so it doesn't matter
+    } else if (t->at_start[bb->rpo]) {
+        return t->at_start[bb->rpo];
+    } else if (vec_len(bb->pred) == 1) {
+        return t->at_start[bb->rpo] = at_end(t, def, vec_get(bb->pred, 0));
+    }
+    IrIns *phi = new_ins(IR_PHI, def->t);
+    insert_ir(phi, bb->ir_head);
+    t->at_start[bb->rpo] = phi; // First, in case a cycle leads back here
+    for (size_t i = 0; i < vec_len(bb->pred); i++) {
+        BB *pred = vec_get(bb->pred, i);
+        vec_push(phi->preds, pred);
+        vec_push(phi->defs, at_end(t, def, pred));
+        add_user(vec_tail(phi->defs), phi);
+    }
+    return phi;
+}
+
+static int is_outside(Thread *t, BB *site) {
+    return site != t->bb && !copy_for(t, site);
+}
+
+// A branch's condition has to be a comparison (see 'asm_condbr'), so one that
+// becomes a phi of comparisons is tested against 0 instead
+static void fix_cond(IrIns *br) {
+    if (br->cond->op >= IR_EQ && br->cond->op <= IR_FGE) {
+        return;
+    }
+    IrIns *zero = new_ins(IR_IMM, br->cond->t);
+    zero->imm = 0;
+    insert_ir(zero, br);
+    IrIns *cmp = new_ins(IR_NEQ, irt_scalar(IRT_I32));
+    cmp->l = br->cond;
+    cmp->r = zero;
+    insert_ir(cmp, br);
+    br->cond = cmp;
+}
+
+// Points the uses of 'def' outside 'bb' and its copies at what it is there.
+// A phi's entry is a use at the end of its predecessor. The phis this adds are
+// left out, since they already take what 'def' is in each predecessor
+static void fix_uses(Thread *t, IrIns *def, size_t num_bbs) {
+    memset(t->at_start, 0, num_bbs * sizeof(IrIns *));
+    size_t num_users = vec_len(def->users);
+    for (size_t i = 0; i < num_users; i++) {
+        IrIns *user = vec_get(def->users, i);
+        if (user->op == IR_PHI) {
+            for (size_t j = 0; j < vec_len(user->defs); j++) {
+                BB *pred = vec_get(user->preds, j);
+                if (vec_get(user->defs, j) == def && is_outside(t, pred)) {
+                    vec_put(user->defs, j, at_end(t, def, pred));
+                    add_user(vec_get(user->defs, j), user);
+                }
+            }
+            continue;
+        }
+        IrIns **oprs[3];
+        int num_oprs = ir_operands(user, oprs);
+        for (int j = 0; j < num_oprs; j++) {
+            if (*oprs[j] == def && is_outside(t, user->bb)) {
+                *oprs[j] = at_start(t, def, user->bb);
+                add_user(*oprs[j], user);
+            }
+        }
+        if (user->op == IR_CONDBR && is_outside(t, user->bb)) {
+            fix_cond(user);
+        }
+    }
+}
+
+static void fix_escapes(Thread *t) {
+    analyse_cfg(t->fn);
+    Vec *rpo = rev_postorder(t->fn);
+    size_t num_bbs = vec_len(rpo);
+    vec_free(rpo);
+    t->at_start = malloc(num_bbs * sizeof(IrIns *));
+    Vec *defs = vec_new(); // of 'IrIns *'
+    for (IrIns *ins = t->bb->ir_head; ins != t->bb->ir_last; ins = ins->next) {
+        if (t->escapes[ins->n]) {
+            vec_push(defs, ins);
+        }
+    }
+    find_def_use(t->fn);
+    for (size_t i = 0; i < vec_len(defs); i++) {
+        fix_uses(t, vec_get(defs, i), num_bbs);
+    }
+    free_def_use(t->fn);
+    vec_free(defs);
+    free(t->at_start);
+}
+
+
+// ---- Threading -------------------------------------------------------------
+
+// Threads 'bb' along every edge into it that its condition is known on.
+// Returns 1 if it threaded any
+static int thread_bb(Thread *t) {
+    BB *bb = t->bb;
+    IrIns *br = bb->ir_last;
+    Vec *preds = vec_new();
+    vec_push_all(preds, bb->pred);
+    for (size_t i = 0; i < vec_len(preds); i++) {
+        BB *pred = vec_get(preds, i);
+        int op = pred->ir_last->op;
+        if (pred == bb || (op != IR_BR && op != IR_CONDBR && op != IR_SWITCH)) {
+            continue; // An IR_INDIRECT_BR can't be retargeted
+        }
+        int known = known_cond(br->cond, bb, pred);
+        BB *to = known == 1 ? br->true : br->false;
+        if (known < 0 || to == bb) {
+            continue;
+        }
+        if (vec_len(t->copies) == 0) {
+            hoist_consts(t);
+        }
+        copy_bb(t, pred, to);
+        for (size_t j = i + 1; j < vec_len(preds); j++) {
+            if (vec_get(preds, j) == pred) {
+                vec_remove(preds, j--); // Every edge from it is threaded
+            }
+        }
+    }
+    vec_free(preds);
+    if (vec_len(t->copies) == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < vec_len(t->copies); i++) {
+        Copy *copy = vec_get(t->copies, i);
+        remove_phi_pred(bb, copy->pred);
+    }
+    fix_escapes(t);
+    return 1;
+}
+
+void thread_branches(Fn *fn) {
+    int changed = 0;
+    for (int n = 0; n < MAX_THREADED; n++) {
+        Thread t = { .fn = fn, .copies = vec_new() };
+        t.num_ins = number_ir(fn);
+        t.escapes = calloc(t.num_ins, sizeof(char));
+        find_escapes(fn, t.escapes);
+        int threaded = 0;
+        for (BB *bb = fn->entry; bb && !threaded; bb = bb->next) {
+            t.bb = bb;
+            threaded = can_thread(fn, bb) && thread_bb(&t);
+        }
+        for (size_t i = 0; i < vec_len(t.copies); i++) {
+            Copy *copy = vec_get(t.copies, i);
+            free(copy->map);
+            free(copy);
+        }
+        vec_free(t.copies);
+        free(t.escapes);
+        if (!threaded) {
+            break;
+        }
+        changed = 1;
+        analyse_cfg(fn);
+        vec_free(rev_postorder(fn));
+        remove_unreachable_bbs(fn);
+        analyse_cfg(fn);
+        analyse_dominators(fn);
+        analyse_loops(fn);
+    }
+    if (changed) {
+        merge_straight_lines(fn);
+    }
+}
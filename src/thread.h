@@ -0,0 +1,16 @@
+
+#ifndef COSEC_THREAD_H
+#define COSEC_THREAD_H
+
+#include "compile.h"
+
+// Jump threading. A conditional branch whose outcome is already known along
+// some of the edges into its BB, e.g., the second test in
+//   if (p) x(); ...; if (p) y();
+// or the test of a flag that's a constant on some paths (like the phis for a
+// ternary, or a '&&' or '||' used as a value), gets a copy of its BB for each
+// such edge, which branches straight to the successor it would've taken.
+// Only small BBs are copied. Requires 'analyse', and keeps it up to date
+void thread_branches(Fn *fn);
+
+#endif
@@ -0,0 +1,406 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "unroll.h"
+#include "analysis.h"
+#include "profile.h"
+
+// A loop is unrolled if (much as for 'vectorise'):
+//   * it's innermost and has a preheader;
+//   * its header only holds phis and the 'i < n' (or unsigned) that exits the
+//     loop, where 'i' is a 32-bit int that goes up by 1 every iteration and
+//     'n' is invariant;
+//   * and the rest of it is a straight line of BBs back to the header, with
+//     no phis, stack allocations, or inline assembly.
+//
+// A loop with a small constant trip count is replaced by that many copies of
+// its body, one after the other:
+//   preheader: ...; br fb
+//   fb: body[start], body[start + 1], ...; br header
+//   header: i = phi [fb -> start + trip], ...; br exit
+// Anything else is unrolled by a factor in a loop in front of the original
+// one, which picks up the iterations left over:
+//   preheader: ...; lim = ext(n) - (factor - 1); br uh
+//   uh: ui = phi [pre -> start] [ub -> ui + factor], ...
+//       condbr ext(ui) < lim, ub, ux
+//   ub: body[ui], body[ui + 1], ...; br uh
+//   ux: br header
+//   header: i = phi [ux -> ui] [latch -> ...], ...
+// where 'lim' is worked out in 64 bits so it can't overflow. The constant
+// steps that induction variables take in each copy are added up (e.g., 'p + 4
+// + 4' becomes 'p + 8'), so the copies don't wait on each other.
+//
+// For the same reason, with '-fassociative-math' a floating point reduction
+// ('sum = sum + x', where the sum isn't used for anything else in the loop)
+// gets an accumulator for each copy, which are added up in 'ux':
+//   uh: s0 = phi [pre -> start] [ub -> s0 + x0], s1 = phi [pre -> 0] [ub -> s1 + x1]
+//   ux: sum' = s0 + s1; br header
+
+#define MAX_FACTOR    4   // Copies of the body in an unrolled loop
+#define BUDGET        48  // Instructions across them all
+#define MAX_FULL_TRIP 16  // Iterations for a loop to be unrolled completely
+#define FULL_BUDGET   128 // Instructions across all of those copies
+
+#define MAX_FORCED 1024 // Copies that '#pragma unroll' can ask for
+
+typedef struct {
+    Loop *loop;
+    BB *pre, *header, *latch, *exit;
+    Vec *body;    // of 'BB *'; the BBs after the header, in order
+    IrIns *iv, *cond;
+    size_t size;  // Instructions in one copy of the body
+    int64_t trip; // Iterations, if they're constant; otherwise -1
+    int *uses;    // Per ins; number of uses in the loop
+} UnrollLoop;
+
+
+// ---- Loop Shape ------------------------------------------------------------
+
+// Every instruction in the body can be copied
+static int size_body(UnrollLoop *u) {
+    for (size_t i = 0; i < vec_len(u->body); i++) {
+        BB *bb = vec_get(u->body, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_PHI || !can_copy(ins)) {
+                return 0;
+            }
+            if (ins->op != IR_IMM && ins->op != IR_BR) {
+                u->size++;
+            }
+        }
+    }
+    return 1;
+}
+
+// The remainder of a vectorised loop starts where the vector loop's
+// induction variable left off, and runs too few times to be worth unrolling
+static int is_remainder(UnrollLoop *u, IrIns *start) {
+    BB *bb = start->bb;
+    return start->op == IR_PHI && bb->loop && bb->loop->header == bb &&
+           !in_loop(u->pre, bb->loop);
+}
+
+static int match_header(UnrollLoop *u) {
+    IrIns *cond = match_loop_header(u->loop, u->latch);
+    if (!cond || cond->l->t->k != IRT_I32 ||
+            is_remainder(u, phi_def(cond->l, u->pre))) {
+        return 0;
+    }
+    IrIns *iv = cond->l, *n = cond->r;
+    u->iv = iv;
+    u->cond = cond;
+
+    IrIns *start = phi_def(iv, u->pre);
+    u->trip = -1;
+    if (start->op == IR_IMM && n->op == IR_IMM) {
+        u->trip = cond->op == IR_SLT ?
+            (int64_t) (int32_t) n->imm - (int64_t) (int32_t) start->imm :
+            (int64_t) (uint32_t) n->imm - (int64_t) (uint32_t) start->imm;
+        u->trip = u->trip > 0 ? u->trip : 0;
+    }
+    return 1;
+}
+
+// The header's 'i < n' is only used by its branch
+static int is_cond_used(UnrollLoop *u) {
+    for (size_t i = 0; i < vec_len(u->body); i++) {
+        BB *bb = vec_get(u->body, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int j = 0; j < num_oprs; j++) {
+                if (*oprs[j] == u->cond) {
+                    return 1;
+                }
+            }
+        }
+    }
+    for (IrIns *phi = u->header->ir_head; phi->op == IR_PHI; phi = phi->next) {
+        if (phi_def(phi, u->latch) == u->cond) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A reduction phi is only used by its update, which is only used by the phi
+static int is_split_reduction(UnrollLoop *u, IrIns *phi) {
+    IrIns *upd = phi_def(phi, u->latch);
+    return ASSOCIATIVE_MATH && (phi->t->k == IRT_F32 || phi->t->k == IRT_F64) &&
+           (upd->op == IR_ADD || upd->op == IR_MUL) &&
+           (upd->l == phi) != (upd->r == phi) &&
+           u->uses[phi->n] == 1 && u->uses[upd->n] == 1;
+}
+
+static int can_unroll(UnrollLoop *u) {
+    if (!is_innermost(u->loop) || !(u->pre = find_preheader(u->loop)) ||
+            !(u->body = straight_body(u->loop))) {
+        return 0;
+    }
+    u->exit = u->header->ir_last->false;
+    u->latch = vec_tail(u->body);
+    if (!size_body(u) || !match_header(u) || is_cond_used(u)) {
+        return 0;
+    }
+    count_uses(u->loop, u->uses);
+    return 1;
+}
+
+
+// ---- Cost Model ------------------------------------------------------------
+
+// Whether to unroll the loop completely; otherwise returns the factor to
+// unroll it by, or 1 not to
+static int unroll_factor(UnrollLoop *u, int *full) {
+    int hint = u->header->unroll;
+    *full = 0;
+    if (hint == 1 || u->trip == 0 || (hint == 0 && is_cold(u->header))) {
+        return 1; // '#pragma nounroll', or a loop that never runs (or never
+                  // ran, in the profile)
+    }
+    if (u->trip > 0 && ((hint == UNROLL_FULL && u->trip <= MAX_FORCED) ||
+            (hint > 1 && u->trip <= hint) ||
+            (hint == 0 && u->trip <= MAX_FULL_TRIP &&
+             (size_t) u->trip * u->size <= FULL_BUDGET))) {
+        *full = 1;
+        return (int) u->trip;
+    }
+    int factor = MAX_FACTOR;
+    if (hint > 1) {
+        factor = hint < MAX_FORCED ? hint : MAX_FORCED;
+    } else {
+        while (factor > 1 && factor * u->size > BUDGET) {
+            factor /= 2;
+        }
+    }
+    if (u->trip > 0 && u->trip < factor) {
+        return 1; // The unrolled loop would never run
+    }
+    return factor;
+}
+
+
+// ---- Transformation --------------------------------------------------------
+
+static IrIns * mapped(IrIns **map, IrIns *ins) {
+    return map[ins->n] ? map[ins->n] : ins; // Otherwise it's invariant
+}
+
+static uint64_t sext(uint64_t v, size_t size) {
+    if (size >= 8) {
+        return v;
+    }
+    int shift = 64 - (int) size * 8;
+    return (uint64_t) ((int64_t) (v << shift) >> shift);
+}
+
+// Folds 'x + c1 + c2' into 'x + (c1 + c2)' when 'x + c1' is a copy too (in
+// the same BB)
+static void fold_step(IrIns *ins) {
+    if (ins->op == IR_PTRADD) {
+        IrIns *prev = ins->base;
+        if (prev->op == IR_PTRADD && prev->bb == ins->bb &&
+                prev->offset->op == IR_IMM && ins->offset->op == IR_IMM) {
+            ins->base = prev->base;
+            ins->offset = insert_imm(ins->offset->t, prev->offset->imm + ins->offset->imm,
+                                     ins);
+        }
+    } else if (ins->op == IR_ADD && ins->t->k >= IRT_I8 && ins->t->k <= IRT_I64) {
+        IrIns *prev = ins->l;
+        if (prev->op == IR_ADD && prev->bb == ins->bb &&
+                prev->r->op == IR_IMM && ins->r->op == IR_IMM) {
+            ins->l = prev->l;
+            ins->r = insert_imm(ins->t, sext(prev->r->imm + ins->r->imm, ins->t->size),
+                                ins);
+        }
+    }
+}
+
+// Copies the body before 'before', with the header's phis standing for what
+// 'map' has for them, then points 'map' at the phis' values for the next
+// iteration
+static void copy_body(UnrollLoop *u, IrIns **map, Vec *next, IrIns *before) {
+    for (size_t i = 0; i < vec_len(u->body); i++) {
+        BB *bb = vec_get(u->body, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_BR) {
+                continue;
+            }
+            IrIns *copy = new_ins(ins->op, ins->t);
+            *copy = *ins;
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(copy, oprs);
+            for (int j = 0; j < num_oprs; j++) {
+                *oprs[j] = mapped(map, *oprs[j]);
+            }
+            insert_ir(copy, before);
+            fold_step(copy);
+            map[ins->n] = copy;
+        }
+    }
+    vec_empty(next); // All at once, in case one phi's value is another
+    for (IrIns *phi = u->header->ir_head; phi->op == IR_PHI; phi = phi->next) {
+        vec_push(next, mapped(map, phi_def(phi, u->latch)));
+    }
+    size_t i = 0;
+    for (IrIns *phi = u->header->ir_head; phi->op == IR_PHI; phi = phi->next) {
+        map[phi->n] = vec_get(next, i++);
+    }
+}
+
+static void unroll_fully(UnrollLoop *u, IrIns **map, int trip) {
+    BB *h = u->header;
+    IrIns *fb_br = new_ins(IR_BR, NULL);
+    BB *fb = new_bb_before(fb_br, h);
+    fb_br->br = h;
+    retarget_br(u->pre->ir_last, h, fb);
+
+    for (IrIns *phi = h->ir_head; phi->op == IR_PHI; phi = phi->next) {
+        map[phi->n] = phi_def(phi, u->pre);
+    }
+    Vec *next = vec_new();
+    for (int i = 0; i < trip; i++) {
+        copy_body(u, map, next, fb_br);
+    }
+    for (IrIns *phi = h->ir_head; phi->op == IR_PHI; phi = phi->next) {
+        size_t idx = phi_idx(phi, u->pre);
+        vec_put(phi->preds, idx, fb);
+        vec_put(phi->defs, idx, map[phi->n]);
+    }
+
+    // The header falls straight through to the exit, leaving the body
+    // unreachable
+    IrIns *br = h->ir_last;
+    br->op = IR_BR;
+    br->br = u->exit;
+}
+
+static void unroll_loop(UnrollLoop *u, IrIns **map, int factor) {
+    BB *h = u->header;
+    IrIns *pre_br = u->pre->ir_last;
+    IrType *i64 = irt_scalar(IRT_I64);
+    int ext = u->cond->op == IR_SLT ? IR_SEXT : IR_ZEXT;
+
+    // The unrolled loop's BBs, each starting out with its terminator
+    IrIns *uh_br = new_ins(IR_CONDBR, NULL);
+    IrIns *ub_br = new_ins(IR_BR, NULL);
+    IrIns *ux_br = new_ins(IR_BR, NULL);
+    BB *uh = new_bb_before(uh_br, h);
+    BB *ub = new_bb_before(ub_br, h);
+    BB *ux = new_bb_before(ux_br, h);
+    uh_br->true = ub;
+    uh_br->false = ux;
+    uh_br->true_chain = uh_br->false_chain = NULL;
+    uh_br->likely = 1;
+    ub_br->br = uh;
+    ux_br->br = h;
+
+    // Preheader
+    IrIns *n = insert_op(ext, i64, u->cond->r, NULL, pre_br);
+    IrIns *one_less = insert_imm(i64, (uint64_t) factor - 1, pre_br);
+    IrIns *lim = insert_op(IR_SUB, i64, n, one_less, pre_br);
+    retarget_br(pre_br, h, uh);
+
+    // Unrolled loop header, with a phi for each of the original's, and for a
+    // split reduction another accumulator for each copy after the first,
+    // starting at 0 (or 1 for a product)
+    Vec *uphis = vec_new();
+    Vec *splits = vec_new(); // of 'IrIns *'; the split reductions' phis
+    Vec *accs = vec_new();   // of 'Vec *'; each one's accumulators, per copy
+    for (IrIns *phi = h->ir_head; phi->op == IR_PHI; phi = phi->next) {
+        IrIns *uphi = prepend_phi(phi->t, uh);
+        vec_push(uphi->preds, u->pre);
+        vec_push(uphi->defs, phi_def(phi, u->pre));
+        vec_push(uphis, uphi);
+        map[phi->n] = uphi;
+        if (is_split_reduction(u, phi)) {
+            Vec *acc = vec_new();
+            vec_push(acc, uphi);
+            for (int i = 1; i < factor; i++) {
+                IrIns *id = new_ins(IR_FP, phi->t);
+                id->fp = phi_def(phi, u->latch)->op == IR_MUL ? 1.0 : 0.0;
+                insert_ir(id, pre_br);
+                IrIns *aphi = prepend_phi(phi->t, uh);
+                vec_push(aphi->preds, u->pre);
+                vec_push(aphi->defs, id);
+                vec_push(acc, aphi);
+            }
+            vec_push(splits, phi);
+            vec_push(accs, acc);
+        }
+    }
+    IrIns *ui64 = insert_op(ext, i64, map[u->iv->n], NULL, uh_br);
+    uh_br->cond = insert_op(IR_SLT, irt_scalar(IRT_I32), ui64, lim, uh_br);
+
+    // Unrolled loop body, where each copy of a split reduction's update
+    // feeds its own accumulator
+    Vec *next = vec_new();
+    for (int i = 0; i < factor; i++) {
+        for (size_t j = 0; j < vec_len(splits); j++) {
+            IrIns *phi = vec_get(splits, j);
+            map[phi->n] = vec_get(vec_get(accs, j), i);
+        }
+        copy_body(u, map, next, ub_br);
+        for (size_t j = 0; j < vec_len(splits); j++) {
+            IrIns *phi = vec_get(splits, j);
+            IrIns *aphi = vec_get(vec_get(accs, j), i);
+            vec_push(aphi->preds, ub);
+            vec_push(aphi->defs, map[phi->n]);
+        }
+    }
+
+    // Add up each split reduction's accumulators, and hand everything over to
+    // the original loop on the way out
+    size_t i = 0, j = 0;
+    for (IrIns *phi = h->ir_head; phi->op == IR_PHI; phi = phi->next) {
+        IrIns *uphi = vec_get(uphis, i++);
+        IrIns *out = uphi;
+        if (j < vec_len(splits) && vec_get(splits, j) == phi) {
+            Vec *acc = vec_get(accs, j++);
+            int op = phi_def(phi, u->latch)->op;
+            for (size_t k = 1; k < vec_len(acc); k++) {
+                out = insert_op(op, phi->t, out, vec_get(acc, k), ux_br);
+            }
+        } else {
+            vec_push(uphi->preds, ub);
+            vec_push(uphi->defs, map[phi->n]);
+        }
+        size_t idx = phi_idx(phi, u->pre);
+        vec_put(phi->preds, idx, ux);
+        vec_put(phi->defs, idx, out);
+    }
+}
+
+void unroll(Fn *fn) {
+    size_t num_ins = number_ir(fn);
+    IrIns **map = calloc(num_ins, sizeof(IrIns *));
+    int *uses = calloc(num_ins, sizeof(int));
+    int changed = 0;
+    for (size_t i = 0; i < vec_len(fn->loops); i++) {
+        UnrollLoop u = { .loop = vec_get(fn->loops, i), .uses = uses, };
+        u.header = u.loop->header;
+        memset(uses, 0, num_ins * sizeof(int));
+        int full, factor;
+        if (!can_unroll(&u) || (factor = unroll_factor(&u, &full)) <= 1) {
+            continue;
+        }
+        if (full) {
+            unroll_fully(&u, map, factor);
+        } else {
+            unroll_loop(&u, map, factor);
+        }
+        memset(map, 0, num_ins * sizeof(IrIns *)); // Its phis are invariant in later loops
+        changed = 1;
+    }
+    if (changed) {
+        analyse_cfg(fn);
+        vec_free(rev_postorder(fn));
+        remove_unreachable_bbs(fn);
+        analyse_cfg(fn);
+        analyse_dominators(fn);
+        analyse_loops(fn);
+    }
+    free(map);
+    free(uses);
+}
@@ -0,0 +1,21 @@
+
+#ifndef COSEC_UNROLL_H
+#define COSEC_UNROLL_H
+
+#include "compile.h"
+
+// Loop unrolling. A small innermost counted loop like
+//   for (i = start; i < n; i++) { sum += a[i]; }
+// has its body copied several times over, so the compare and branch (and
+// each induction variable's step) are paid once per copy rather than once per
+// iteration. A loop with a small constant trip count is unrolled completely;
+// anything else by a factor chosen to keep the copies under a size budget,
+// with the original loop left to run whatever iterations are left over.
+// With '-fassociative-math', a floating point sum or product like 'sum' above
+// is split over an accumulator per copy, so the copies' adds run in parallel.
+// '#pragma unroll' before a loop overrides the choice (see 'BB.unroll').
+// Requires 'analyse' and 'licm' (for the preheaders), and keeps 'analyse' up
+// to date
+void unroll(Fn *fn);
+
+#endif
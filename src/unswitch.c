@@ -0,0 +1,374 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "unswitch.h"
+#include "analysis.h"
+#include "dce.h"
+
+// A loop is unswitched on a conditional branch in it if:
+//   * the loop has a preheader, holds nothing that can't be copied, and is
+//     small enough to copy;
+//   * the branch's condition is defined outside the loop, or is a comparison
+//     of things that are (LICM leaves comparisons where they are; this moves
+//     it into the preheader);
+//   * and both of the branch's targets are in the loop (so it isn't the test
+//     that exits it).
+// The loop's copied, and the preheader picks between the two, each with a
+// preheader of its own:
+//   preheader: ...; condbr cond, ph, ph'
+//   ph: br header     ph': br header'
+//   header: ...       header': ...
+// The branch in the original always goes to its true target, and in the copy
+// to its false target; the other side of each is left unreachable. Anything
+// in the loop that's used after it now comes from one copy or the other, so
+// each use looks back through its predecessors for the loop, putting phis
+// where the two copies' values meet.
+
+#define MAX_SIZE 48 // Instructions in a loop (not counting constants)
+
+typedef struct {
+    Loop *loop;
+    BB *pre;
+    IrIns *br;   // The branch that's unswitched on
+    BB **bbs;    // Per BB (by 'rpo') in the loop; its copy
+    IrIns **map; // Per ins in the loop; its copy
+    IrIns **at_start; // Per BB (by 'rpo') after the loop; the value being
+                      // fixed up at its start
+} Unswitch;
+
+static int is_invariant(IrIns *ins, Loop *loop) {
+    if (!in_loop(ins->bb, loop)) {
+        return 1;
+    }
+    return ins->op >= IR_EQ && ins->op <= IR_FGE &&
+           !in_loop(ins->l->bb, loop) && !in_loop(ins->r->bb, loop);
+}
+
+
+// ---- Loop Shape ------------------------------------------------------------
+
+static int is_small(Loop *loop) {
+    int size = 0;
+    for (size_t i = 0; i < vec_len(loop->bbs); i++) {
+        BB *bb = vec_get(loop->bbs, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (!can_copy(ins) || ins->op == IR_SWITCH ||
+                    ins->op == IR_INDIRECT_BR) {
+                return 0;
+            }
+            size += ins->op != IR_IMM && ins->op != IR_FP;
+        }
+    }
+    return size <= MAX_SIZE;
+}
+
+static IrIns * find_branch(Loop *loop) {
+    for (size_t i = 0; i < vec_len(loop->bbs); i++) {
+        BB *bb = vec_get(loop->bbs, i);
+        IrIns *br = bb->ir_last;
+        if (bb->loop == loop && br->op == IR_CONDBR && br->true != br->false &&
+                in_loop(br->true, loop) && in_loop(br->false, loop) &&
+                is_invariant(br->cond, loop)) {
+            return br;
+        }
+    }
+    return NULL;
+}
+
+static int can_unswitch(Unswitch *u) {
+    return (u->pre = find_preheader(u->loop)) && is_small(u->loop) &&
+           (u->br = find_branch(u->loop));
+}
+
+
+// ---- Transformation --------------------------------------------------------
+
+static BB * copy_of(Unswitch *u, BB *bb) {
+    return in_loop(bb, u->loop) ? u->bbs[bb->rpo] : bb;
+}
+
+static IrIns * mapped(Unswitch *u, IrIns *ins) {
+    return in_loop(ins->bb, u->loop) ? u->map[ins->n] : ins;
+}
+
+// The copies of the loop's BBs go after its last BB, in the same order
+static void copy_bbs(Unswitch *u, Fn *fn) {
+    Vec *bbs = vec_new(); // of 'BB *'; in order
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        if (in_loop(bb, u->loop)) {
+            vec_push(bbs, bb);
+        }
+    }
+    BB *last = vec_tail(bbs), *after = last;
+    for (size_t i = 0; i < vec_len(bbs); i++) {
+        BB *bb = vec_get(bbs, i);
+        BB *copy = new_bb();
+        copy->unroll = bb->unroll;
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns *ins_copy = new_ins(ins->op, ins->t);
+            *ins_copy = *ins;
+            append_ir(copy, ins_copy);
+            u->map[ins->n] = ins_copy;
+        }
+        u->bbs[bb->rpo] = copy;
+        insert_bb_after(fn, copy, after);
+        after = copy;
+    }
+    if (fn->last == last) {
+        fn->last = after;
+    }
+}
+
+// Points the copies' operands and branches at the other copies, once they've
+// all been made
+static void fix_copies(Unswitch *u) {
+    for (size_t i = 0; i < vec_len(u->loop->bbs); i++) {
+        BB *bb = copy_of(u, vec_get(u->loop->bbs, i));
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_PHI) {
+                Vec *preds = ins->preds, *defs = ins->defs;
+                ins->preds = vec_new();
+                ins->defs = vec_new();
+                for (size_t j = 0; j < vec_len(preds); j++) {
+                    vec_push(ins->preds, copy_of(u, vec_get(preds, j)));
+                    vec_push(ins->defs, mapped(u, vec_get(defs, j)));
+                }
+                continue;
+            }
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int j = 0; j < num_oprs; j++) {
+                *oprs[j] = mapped(u, *oprs[j]);
+            }
+            if (ins->op == IR_BR) {
+                ins->br = copy_of(u, ins->br);
+            } else if (ins->op == IR_CONDBR) {
+                ins->true = copy_of(u, ins->true);
+                ins->false = copy_of(u, ins->false);
+            }
+        }
+    }
+}
+
+// A new preheader for the header 'h', that takes over the edge from 'pre'
+static BB * new_preheader(Fn *fn, BB *h, BB *pre) {
+    BB *ph = new_bb();
+    IrIns *br = new_ins(IR_BR, NULL);
+    br->br = h;
+    br->bb = ph;
+    ph->ir_head = ph->ir_last = br;
+    insert_bb_after(fn, ph, h->prev);
+    for (IrIns *phi = h->ir_head; phi->op == IR_PHI; phi = phi->next) {
+        for (size_t i = 0; i < vec_len(phi->preds); i++) {
+            if (vec_get(phi->preds, i) == pre) {
+                vec_put(phi->preds, i, ph);
+            }
+        }
+    }
+    return ph;
+}
+
+// The copies don't have an 'rpo' until the CFG's re-analysed
+static int is_copy(BB *bb) {
+    return bb->rpo < 0;
+}
+
+// Exits get another entry in their phis for each of their predecessors in
+// the copy
+static void extend_exit_phis(Unswitch *u, Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        if (in_loop(bb, u->loop) || is_copy(bb)) {
+            continue;
+        }
+        for (IrIns *phi = bb->ir_head; phi && phi->op == IR_PHI; phi = phi->next) {
+            size_t num_preds = vec_len(phi->preds);
+            for (size_t i = 0; i < num_preds; i++) {
+                BB *pred = vec_get(phi->preds, i);
+                if (in_loop(pred, u->loop)) {
+                    vec_push(phi->preds, copy_of(u, pred));
+                    vec_push(phi->defs, mapped(u, vec_get(phi->defs, i)));
+                }
+            }
+        }
+    }
+}
+
+static IrIns * at_start(Unswitch *u, IrIns *def, BB *bb);
+
+// What 'def' is at the end of 'bb', which is either in one of the copies of
+// the loop or after it
+static IrIns * at_end(Unswitch *u, IrIns *def, BB *bb) {
+    if (in_loop(bb, u->loop)) {
+        return def;
+    } else if (is_copy(bb)) {
+        return mapped(u, def);
+    }
+    return at_start(u, def, bb);
+}
+
+static IrIns * at_start(Unswitch *u, IrIns *def, BB *bb) {
+    if (u->at_start[bb->rpo]) {
+        return u->at_start[bb->rpo];
+    }
+    if (vec_len(bb->pred) == 1) {
+        return u->at_start[bb->rpo] = at_end(u, def, vec_get(bb->pred, 0));
+    }
+    IrIns *phi = new_ins(IR_PHI, def->t);
+    insert_ir(phi, bb->ir_head);
+    u->at_start[bb->rpo] = phi; // First, in case a cycle leads back here
+    for (size_t i = 0; i < vec_len(bb->pred); i++) {
+        BB *pred = vec_get(bb->pred, i);
+        vec_push(phi->preds, pred);
+        vec_push(phi->defs, at_end(u, def, pred));
+        add_user(vec_tail(phi->defs), phi);
+    }
+    return phi;
+}
+
+static int is_used_after(Unswitch *u, IrIns *def, BB *site) {
+    return in_loop(def->bb, u->loop) && !in_loop(site, u->loop) &&
+           !is_copy(site);
+}
+
+// Points the uses of 'def' after the loop at what it is there. A phi's entry
+// is a use at the end of its predecessor. The phis this adds are left out,
+// since they already take what 'def' is in each predecessor
+static void fix_uses_after(Unswitch *u, IrIns *def, size_t num_bbs) {
+    memset(u->at_start, 0, num_bbs * sizeof(IrIns *));
+    size_t num_users = vec_len(def->users);
+    for (size_t i = 0; i < num_users; i++) {
+        IrIns *user = vec_get(def->users, i);
+        if (user->op == IR_PHI) {
+            for (size_t j = 0; j < vec_len(user->defs); j++) {
+                BB *pred = vec_get(user->preds, j);
+                if (vec_get(user->defs, j) == def && is_used_after(u, def, pred)) {
+                    vec_put(user->defs, j, at_end(u, def, pred));
+                    add_user(vec_get(user->defs, j), user);
+                }
+            }
+            continue;
+        }
+        IrIns **oprs[3];
+        int num_oprs = ir_operands(user, oprs);
+        for (int j = 0; j < num_oprs; j++) {
+            if (*oprs[j] == def && is_used_after(u, def, user->bb)) {
+                *oprs[j] = at_start(u, def, user->bb);
+                add_user(*oprs[j], user);
+            }
+        }
+    }
+}
+
+// Everything in the loop that's used after it
+static Vec * used_after(Unswitch *u, Fn *fn, size_t num_ins) {
+    Vec *defs = vec_new(); // of 'IrIns *'
+    char *seen = calloc(num_ins, sizeof(char));
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        if (in_loop(bb, u->loop) || is_copy(bb)) {
+            continue;
+        }
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            IrIns **oprs[3];
+            int num_oprs = ins->op == IR_PHI ? (int) vec_len(ins->defs) : ir_operands(ins, oprs);
+            for (int i = 0; i < num_oprs; i++) {
+                IrIns *def = ins->op == IR_PHI ? vec_get(ins->defs, i) : *oprs[i];
+                BB *site = ins->op == IR_PHI ? vec_get(ins->preds, i) : bb;
+                if (is_used_after(u, def, site) && !seen[def->n]) {
+                    seen[def->n] = 1;
+                    vec_push(defs, def);
+                }
+            }
+        }
+    }
+    free(seen);
+    return defs;
+}
+
+static void unswitch(Unswitch *u, Fn *fn, size_t num_ins, size_t num_bbs) {
+    // The preheader tests the condition, so a comparison left in the loop is
+    // moved there first (or it'd be left dead in the loop, in the way of
+    // passes that match it)
+    IrIns *br = u->br, *cond = br->cond, *pre_br = u->pre->ir_last;
+    if (in_loop(cond->bb, u->loop)) {
+        delete_ir(cond);
+        insert_ir(cond, pre_br);
+    }
+
+    copy_bbs(u, fn);
+    fix_copies(u);
+    analyse_cfg(fn);
+    extend_exit_phis(u, fn);
+    Vec *defs = used_after(u, fn, num_ins);
+    find_def_use(fn);
+    for (size_t i = 0; i < vec_len(defs); i++) {
+        fix_uses_after(u, vec_get(defs, i), num_bbs);
+    }
+    free_def_use(fn);
+    vec_free(defs);
+
+    // Each copy of the branch always goes the same way
+    IrIns *br_copy = u->map[br->n];
+    fold_condbr(br, 1);
+    fold_condbr(br_copy, 0);
+
+    BB *h = u->loop->header;
+    IrIns *test = new_ins(IR_CONDBR, NULL);
+    test->cond = cond;
+    test->true = new_preheader(fn, h, u->pre);
+    test->false = new_preheader(fn, copy_of(u, h), u->pre);
+    test->true_chain = test->false_chain = NULL;
+    test->likely = 0;
+    insert_ir(test, pre_br);
+    delete_ir(pre_br);
+}
+
+static Loop * next_loop(Fn *fn, Vec *tried) {
+    for (size_t i = vec_len(fn->loops); i > 0; i--) { // Innermost first
+        Loop *loop = vec_get(fn->loops, i - 1);
+        int done = 0;
+        for (size_t j = 0; j < vec_len(tried) && !done; j++) {
+            done = vec_get(tried, j) == loop->header;
+        }
+        if (!done) {
+            return loop;
+        }
+    }
+    return NULL;
+}
+
+void unswitch_loops(Fn *fn) {
+    Vec *tried = vec_new(); // of 'BB *'; headers
+    int changed = 0;
+    Loop *loop;
+    while ((loop = next_loop(fn, tried))) {
+        vec_push(tried, loop->header);
+        Unswitch u = { .loop = loop };
+        if (!can_unswitch(&u)) {
+            continue;
+        }
+        size_t num_ins = number_ir(fn);
+        Vec *rpo = rev_postorder(fn);
+        size_t num_bbs = vec_len(rpo);
+        vec_free(rpo);
+        u.bbs = calloc(num_bbs, sizeof(BB *));
+        u.map = calloc(num_ins, sizeof(IrIns *));
+        u.at_start = malloc(num_bbs * sizeof(IrIns *));
+        unswitch(&u, fn, num_ins, num_bbs);
+        vec_push(tried, copy_of(&u, loop->header)); // Each copy only once
+        free(u.bbs);
+        free(u.map);
+        free(u.at_start);
+        changed = 1;
+
+        analyse_cfg(fn);
+        vec_free(rev_postorder(fn));
+        remove_unreachable_bbs(fn);
+        analyse_cfg(fn);
+        analyse_dominators(fn);
+        analyse_loops(fn);
+    }
+    if (changed) { // Each copy's side of the branch joins up with the rest
+        merge_straight_lines(fn);
+    }
+}
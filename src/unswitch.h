@@ -0,0 +1,17 @@
+
+#ifndef COSEC_UNSWITCH_H
+#define COSEC_UNSWITCH_H
+
+#include "compile.h"
+
+// Loop unswitching. A loop that tests something that doesn't change while it
+// runs, like
+//   for (i = 0; i < n; i++) { if (mode == FAST) ...; else ...; }
+// is copied, with the test moved in front of the two copies to pick between
+// them, and each copy only keeping its side of the test. Only small loops are
+// unswitched, to bound the growth in code size. Requires 'analyse' and 'licm'
+// (for the preheaders, and to hoist what the test depends on), and keeps
+// 'analyse' up to date
+void unswitch_loops(Fn *fn);
+
+#endif
@@ -7,29 +7,161 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stddef.h>
+#include <pthread.h>
+
+// SSE2 is part of x86-64; everywhere else a map's groups are checked one
+// control byte at a time
+#if defined(__SSE2__)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
 
 #include "util.h"
 #include "error.h"
 
 
+// ---- Allocation Sites ------------------------------------------------------
+
+#ifdef ALLOC_SITES
+#include <stdio.h>
+
+enum { SITE_VEC, SITE_BUF, SITE_MAP };
+static char *SITE_KINDS[] = { "Vec", "Buf", "Map" };
+
+struct AllocSite {
+    char *file;
+    int line, kind;
+    size_t created, freed, grows;
+    size_t peak;   // Most elements (or bytes, or slots) any one had room for
+    size_t wasted; // Bytes allocated but unused, summed over those freed
+    AllocSite *next;
+};
+
+#define SITES_SIZE 1024 // Hash chains, by line
+
+static AllocSite *SITES[SITES_SIZE];
+static size_t NUM_SITES = 0;
+static pthread_mutex_t SITES_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static int cmp_site_churn(const void *a, const void *b) {
+    AllocSite *l = *(AllocSite **) a, *r = *(AllocSite **) b;
+    size_t lc = l->created + l->grows, rc = r->created + r->grows;
+    return (lc < rc) - (lc > rc);
+}
+
+// Busiest first, by containers created plus times they grew
+static void print_alloc_sites() {
+    AllocSite **sites = malloc(sizeof(AllocSite *) * NUM_SITES);
+    size_t n = 0;
+    for (size_t i = 0; i < SITES_SIZE; i++) {
+        for (AllocSite *s = SITES[i]; s; s = s->next) {
+            sites[n++] = s;
+        }
+    }
+    qsort(sites, n, sizeof(AllocSite *), cmp_site_churn);
+    fprintf(stderr, "%-28s %4s %10s %10s %10s %10s %11s\n", "allocation site", "kind",
+            "created", "live", "grows", "peak", "wasted (B)");
+    for (size_t i = 0; i < n; i++) {
+        AllocSite *s = sites[i];
+        char *file = strrchr(s->file, '/') ? strrchr(s->file, '/') + 1 : s->file;
+        char name[256];
+        snprintf(name, sizeof(name), "%s:%d", file, s->line);
+        fprintf(stderr, "%-28s %4s %10zu %10zu %10zu %10zu %11zu\n", name,
+                SITE_KINDS[s->kind], s->created, s->created - s->freed, s->grows,
+                s->peak, s->wasted);
+    }
+    free(sites);
+}
+
+static void site_peak(AllocSite *s, size_t cap) {
+    size_t peak = __atomic_load_n(&s->peak, __ATOMIC_RELAXED);
+    while (cap > peak && !__atomic_compare_exchange_n(&s->peak, &peak, cap, 1,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static AllocSite * find_site(char *file, int line, int kind, size_t cap) {
+    pthread_mutex_lock(&SITES_LOCK);
+    AllocSite **chain = &SITES[(size_t) line % SITES_SIZE];
+    AllocSite *s = *chain;
+    while (s && (s->line != line || strcmp(s->file, file) != 0)) {
+        s = s->next;
+    }
+    if (!s) {
+        if (NUM_SITES++ == 0) {
+            atexit(print_alloc_sites);
+        }
+        s = calloc(1, sizeof(AllocSite));
+        s->file = file;
+        s->line = line;
+        s->kind = kind;
+        s->next = *chain;
+        *chain = s;
+    }
+    s->created++;
+    pthread_mutex_unlock(&SITES_LOCK);
+    site_peak(s, cap);
+    return s;
+}
+
+static void site_grew(AllocSite *s, size_t cap) {
+    if (s) {
+        __atomic_fetch_add(&s->grows, 1, __ATOMIC_RELAXED);
+        site_peak(s, cap);
+    }
+}
+
+static void site_freed(AllocSite *s, size_t unused_bytes) {
+    if (s) {
+        __atomic_fetch_add(&s->freed, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&s->wasted, unused_bytes, __ATOMIC_RELAXED);
+    }
+}
+
+#define SITE_NONE(c)            ((c)->site = NULL) // Until the '_at' function sets it
+#define SITE_GREW(c, cap)       site_grew((c)->site, (cap))
+#define SITE_FREED(c, unused)   site_freed((c)->site, (unused))
+#else
+#define SITE_NONE(c)
+#define SITE_GREW(c, cap)
+#define SITE_FREED(c, unused)
+#endif
+
+
 // ---- Vector ----------------------------------------------------------------
 
-Vec * vec_new() {
+// Parenthesised so 'ALLOC_SITES' doesn't turn it into 'vec_new_at'
+Vec * (vec_new)() {
     Vec *v = malloc(sizeof(Vec));
     v->len = 0;
-    v->max = 8;
-    v->data = calloc(v->max, sizeof(void *)); // 'calloc' needed for 'vec_put'
+    v->max = VEC_SMALL;
+    v->data = v->small;
+    memset(v->small, 0, sizeof(v->small)); // Zeroed for 'vec_put'
+    SITE_NONE(v);
     return v;
 }
 
+#ifdef ALLOC_SITES
+Vec * vec_new_at(char *file, int line) {
+    Vec *v = (vec_new)();
+    v->site = find_site(file, line, SITE_VEC, v->max);
+    return v;
+}
+#endif
+
 static void vec_resize(Vec *v, size_t min) {
     if (min >= v->max) {
         size_t prev_max = v->max;
         while (v->max < min) {
             v->max *= 2;
         }
-        v->data = realloc(v->data, sizeof(void *) * v->max);
+        if (v->data == v->small) { // Moves out of the header
+            v->data = malloc(sizeof(void *) * v->max);
+            memcpy(v->data, v->small, sizeof(v->small));
+        } else {
+            v->data = realloc(v->data, sizeof(void *) * v->max);
+        }
         memset(&v->data[prev_max], 0, sizeof(void *) * (v->max - prev_max));
+        SITE_GREW(v, v->max);
     }
 }
 
@@ -46,7 +178,7 @@ void vec_push_all(Vec *v, Vec *to_append) {
 }
 
 void vec_put(Vec *v, size_t i, void *elem) {
-    vec_resize(v, i);
+    vec_resize(v, i + 1);
     v->data[i] = elem;
     if (i >= v->len) {
         v->len = i + 1;
@@ -63,7 +195,7 @@ void * vec_pop(Vec *v) {
 void * vec_remove(Vec *v, size_t i) {
     assert(i < vec_len(v));
     void *elem = v->data[i];
-    memcpy(&v->data[i], &v->data[i + 1], sizeof(void *) * (v->len - i - 1));
+    memmove(&v->data[i], &v->data[i + 1], sizeof(void *) * (v->len - i - 1));
     v->len--;
     return elem;
 }
@@ -91,16 +223,45 @@ void vec_empty(Vec *v) {
     v->len = 0;
 }
 
+void vec_free(Vec *v) {
+    if (v) {
+        if (v->data != v->small) {
+            SITE_FREED(v, sizeof(void *) * (v->max - v->len));
+            free(v->data);
+        } else {
+            SITE_FREED(v, 0); // Nothing on the heap to waste
+        }
+        free(v);
+    }
+}
+
 
 // ---- String Buffer ---------------------------------------------------------
 
-Buf * buf_new() {
+Buf * (buf_new)() {
     Buf *b = malloc(sizeof(Buf));
     b->len = 0;
     b->max = 8;
     b->data = malloc(sizeof(char) * b->max);
+    SITE_NONE(b);
+    return b;
+}
+
+#ifdef ALLOC_SITES
+Buf * buf_new_at(char *file, int line) {
+    Buf *b = (buf_new)();
+    b->site = find_site(file, line, SITE_BUF, b->max);
     return b;
 }
+#endif
+
+void buf_free(Buf *b) {
+    if (b) {
+        SITE_FREED(b, b->max - b->len);
+        free(b->data);
+        free(b);
+    }
+}
 
 void buf_resize(Buf *b, size_t by) {
     if (b->len + by >= b->max) {
@@ -108,6 +269,7 @@ void buf_resize(Buf *b, size_t by) {
             b->max *= 2;
         }
         b->data = realloc(b->data, sizeof(char) * b->max);
+        SITE_GREW(b, b->max);
     }
 }
 
@@ -148,17 +310,30 @@ void buf_print(Buf *b, char *s) {
 
 void buf_nprint(Buf *b, char *s, size_t len) {
     buf_resize(b, len);
-    strncpy(&b->data[b->len], s, len);
+    memcpy(&b->data[b->len], s, len);
     b->len += len;
 }
 
+void buf_zeros(Buf *b, size_t n) {
+    buf_resize(b, n);
+    memset(&b->data[b->len], 0, n);
+    b->len += n;
+}
+
 void buf_printf(Buf *b, char *fmt, ...) {
     va_list args;
+    va_start(args, fmt);
+    buf_vprintf(b, fmt, args);
+    va_end(args);
+}
+
+void buf_vprintf(Buf *b, char *fmt, va_list args) {
     while (1) {
         size_t avail = b->max - b->len;
-        va_start(args, fmt);
-        size_t written = vsnprintf(b->data + b->len, avail, fmt, args);
-        va_end(args);
+        va_list copy;
+        va_copy(copy, args);
+        size_t written = vsnprintf(b->data + b->len, avail, fmt, copy);
+        va_end(copy);
         if (avail <= written) {
             buf_resize(b, written);
             continue;
@@ -169,104 +344,254 @@ void buf_printf(Buf *b, char *fmt, ...) {
 }
 
 
-// ---- Map -------------------------------------------------------------------
+// ---- Interned Strings ------------------------------------------------------
 
-#define MAP_TOMBSTONE ((void *) (-1))
+#define HASH_K 0x9e3779b97f4a7c15ull
 
-static uint32_t hash(char *p) { // FNV hash
-    uint32_t r = 2166136261;
-    for (; *p; p++) {
-        r ^= *p;
-        r *= 16777619;
-    }
-    return r;
+static uint64_t hash_word(uint64_t h, uint64_t w) {
+    return (((h << 5) | (h >> 59)) ^ w) * HASH_K;
 }
 
-Map * map_new() {
-    Map *m = malloc(sizeof(Map));
-    m->size = 16;
-    m->num = 0;
-    m->used = 0; // Includes 'TOMBSTONE' values
-    m->k = calloc(m->size, sizeof(char *));
-    m->v = calloc(m->size, sizeof(void *));
-    return m;
+// 8 bytes at a time, then the rest and the length, with the high bits mixed
+// down at the end (a map uses the low bits for its slots)
+static uint32_t hash(char *p, size_t len) {
+    uint64_t h = 0, w;
+    size_t n = len;
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&w, p, 8);
+        h = hash_word(h, w);
+    }
+    w = 0;
+    memcpy(&w, p, n);
+    h = hash_word(hash_word(h, w), len);
+    h ^= h >> 32;
+    h *= HASH_K;
+    return (uint32_t) (h >> 32);
 }
 
-static void map_rehash(Map *m) {
-    if (m->used < m->size * 0.7) {
+static struct {
+    Atom **atoms;
+    size_t num, size;
+} INTERNED = { NULL, 0, 0 };
+static pthread_mutex_t INTERN_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static void intern_rehash() {
+    if (INTERNED.num < INTERNED.size * 0.7) {
         return;
     }
-    size_t new_size = (m->num < m->size * 0.35) ? m->size : m->size * 2;
-    char **k = calloc(new_size, sizeof(char *));
-    void **v = calloc(new_size, sizeof(void *));
+    size_t new_size = INTERNED.size ? INTERNED.size * 2 : 1024;
+    Atom **atoms = calloc(new_size, sizeof(Atom *));
     size_t mask = new_size - 1;
-    for (size_t i = 0; i < m->size; i++) {
-        if (!m->k[i] || m->k[i] == MAP_TOMBSTONE) {
+    for (size_t i = 0; i < INTERNED.size; i++) {
+        Atom *a = INTERNED.atoms[i];
+        if (!a) {
             continue;
         }
-        uint32_t h = hash(m->k[i]) & mask;
-        while (k[h]) {
+        uint32_t h = a->hash & mask;
+        while (atoms[h]) {
             h = (h + 1) & mask;
         }
-        k[h] = m->k[i];
-        v[h] = m->v[i];
+        atoms[h] = a;
     }
-    free(m->k);
-    free(m->v);
-    m->k = k;
-    m->v = v;
-    m->size = new_size;
-    m->used = m->num; // Removed all 'TOMBSTONE' values
+    free(INTERNED.atoms);
+    INTERNED.atoms = atoms;
+    INTERNED.size = new_size;
 }
 
-static uint32_t map_idx(Map *m, char *k) {
-    size_t mask = m->size - 1;
-    uint32_t h = hash(k) & mask;
-    while (m->k[h]) {
-        if (m->k[h] != MAP_TOMBSTONE && strcmp(k, m->k[h]) == 0) {
-            break;
+char * intern_n(char *s, size_t len) {
+    pthread_mutex_lock(&INTERN_LOCK);
+    intern_rehash();
+    uint32_t hsh = hash(s, len);
+    size_t mask = INTERNED.size - 1;
+    uint32_t h = hsh & mask;
+    Atom *a;
+    while ((a = INTERNED.atoms[h])) {
+        if (a->hash == hsh && a->len == len && memcmp(a->s, s, len) == 0) {
+            pthread_mutex_unlock(&INTERN_LOCK);
+            return a->s;
         }
         h = (h + 1) & mask;
     }
-    return h;
+    a = malloc(sizeof(Atom) + len + 1);
+    a->hash = hsh;
+    a->tag = 0;
+    a->len = len;
+    memcpy(a->s, s, len);
+    a->s[len] = '\0';
+    INTERNED.atoms[h] = a;
+    INTERNED.num++;
+    pthread_mutex_unlock(&INTERN_LOCK);
+    return a->s;
 }
 
-void map_put(Map *m, char *k, void *v) {
-    map_rehash(m);
-    size_t mask = m->size - 1;
-    uint32_t h = hash(k) & mask;
-    while (m->k[h]) {
-        if (m->k[h] == MAP_TOMBSTONE || strcmp(k, m->k[h]) == 0) {
-            break;
+char * intern(char *s) {
+    return intern_n(s, strlen(s));
+}
+
+
+// ---- Map -------------------------------------------------------------------
+
+// Every slot's control byte is one of these, or the low 7 bits of its key's
+// hash; the rest of the hash picks the group of 16 slots to start probing at
+#define MAP_EMPTY   ((uint8_t) 0x80)
+#define MAP_DELETED ((uint8_t) 0xfe)
+#define MAP_GROUP   16
+#define MAP_NOT_FOUND ((size_t) -1)
+#define MAP_SLOT_BYTES (1 + sizeof(char *) + sizeof(void *)) // Control byte, key, value
+
+// Bit 'i' is set if slot 'i' in the group has control byte 'c'
+static inline unsigned int group_match(uint8_t *ctrl, uint8_t c) {
+#ifdef USE_SSE2
+    __m128i g = _mm_loadu_si128((__m128i *) ctrl);
+    return (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char) c)));
+#else
+    unsigned int bits = 0;
+    for (int i = 0; i < MAP_GROUP; i++) {
+        bits |= (unsigned int) (ctrl[i] == c) << i;
+    }
+    return bits;
+#endif
+}
+
+// Empty and deleted slots (the only control bytes with the top bit set)
+static inline unsigned int group_unused(uint8_t *ctrl) {
+#ifdef USE_SSE2
+    return (unsigned int) _mm_movemask_epi8(_mm_loadu_si128((__m128i *) ctrl));
+#else
+    unsigned int bits = 0;
+    for (int i = 0; i < MAP_GROUP; i++) {
+        bits |= (unsigned int) (ctrl[i] >> 7) << i;
+    }
+    return bits;
+#endif
+}
+
+// The control bytes, keys, and values share one allocation
+static void map_alloc(Map *m, size_t size) {
+    m->ctrl = malloc(size * MAP_SLOT_BYTES);
+    m->k = (char **) (m->ctrl + size);
+    m->v = (void **) (m->k + size);
+    memset(m->ctrl, MAP_EMPTY, size);
+    m->size = size;
+}
+
+Map * (map_new)() {
+    Map *m = malloc(sizeof(Map));
+    map_alloc(m, MAP_GROUP);
+    m->num = 0;
+    m->used = 0; // Includes deleted slots
+    SITE_NONE(m);
+    return m;
+}
+
+#ifdef ALLOC_SITES
+Map * map_new_at(char *file, int line) {
+    Map *m = (map_new)();
+    m->site = find_site(file, line, SITE_MAP, m->size);
+    return m;
+}
+#endif
+
+void map_free(Map *m) {
+    if (m) {
+        SITE_FREED(m, MAP_SLOT_BYTES * (m->size - m->num));
+        free(m->ctrl);
+        free(m);
+    }
+}
+
+// Groups are probed triangularly, which visits all of them, since there's a
+// power of 2 of them
+static size_t map_find(Map *m, char *k) {
+    uint32_t h = ATOM(k)->hash;
+    size_t mask = m->size / MAP_GROUP - 1;
+    size_t g = (h >> 7) & mask;
+    for (size_t step = 1; ; step++) {
+        uint8_t *ctrl = &m->ctrl[g * MAP_GROUP];
+        for (unsigned int bits = group_match(ctrl, h & 0x7f); bits; bits &= bits - 1) {
+            size_t i = g * MAP_GROUP + (size_t) __builtin_ctz(bits);
+            if (m->k[i] == k) {
+                return i;
+            }
         }
-        h = (h + 1) & mask;
+        if (group_match(ctrl, MAP_EMPTY)) {
+            return MAP_NOT_FOUND; // Never probed past a group with room
+        }
+        g = (g + step) & mask;
     }
-    if (!m->k[h] || m->k[h] == MAP_TOMBSTONE) {
-        m->v[h] = v; // Doesn't exist
-        m->k[h] = k;
-        m->num++;
-        if (!m->k[h]) {
-            m->used++;
+}
+
+static size_t map_find_unused(Map *m, uint32_t h) {
+    size_t mask = m->size / MAP_GROUP - 1;
+    size_t g = (h >> 7) & mask;
+    for (size_t step = 1; ; step++) {
+        unsigned int bits = group_unused(&m->ctrl[g * MAP_GROUP]);
+        if (bits) {
+            return g * MAP_GROUP + (size_t) __builtin_ctz(bits);
         }
-    } else {
-        m->v[h] = v; // Already exists
+        g = (g + step) & mask;
     }
 }
 
+// Keeps at least one in 8 slots empty, so every probe ends. The hashes are
+// read from the keys' atoms rather than recomputed
+static void map_rehash(Map *m) {
+    if (m->used + 1 <= m->size / 8 * 7) {
+        return;
+    }
+    Map old = *m;
+    map_alloc(m, (m->num + 1 <= old.size / 16 * 7) ? old.size : old.size * 2);
+    SITE_GREW(m, m->size); // Or rebuilt at the same size, without the deleted
+    for (size_t i = 0; i < old.size; i++) {
+        if (old.ctrl[i] & MAP_EMPTY) { // Empty or deleted
+            continue;
+        }
+        size_t j = map_find_unused(m, ATOM(old.k[i])->hash);
+        m->ctrl[j] = old.ctrl[i];
+        m->k[j] = old.k[i];
+        m->v[j] = old.v[i];
+    }
+    free(old.ctrl);
+    m->used = m->num; // Removed all deleted slots
+}
+
+void map_put(Map *m, char *k, void *v) {
+    size_t i = map_find(m, k);
+    if (i != MAP_NOT_FOUND) {
+        m->v[i] = v; // Already exists
+        return;
+    }
+    map_rehash(m);
+    uint32_t h = ATOM(k)->hash;
+    i = map_find_unused(m, h);
+    if (m->ctrl[i] == MAP_EMPTY) {
+        m->used++; // Not re-using a deleted slot
+    }
+    m->ctrl[i] = h & 0x7f;
+    m->k[i] = k;
+    m->v[i] = v;
+    m->num++;
+}
+
+// A slot can go back to empty if its group still has an empty slot, since
+// then no probe has ever gone past the group
 void map_remove(Map *m, char *k) {
-    uint32_t h = map_idx(m, k);
-    m->k[h] = MAP_TOMBSTONE;
-    m->v[h] = NULL;
+    size_t i = map_find(m, k);
+    if (i == MAP_NOT_FOUND) {
+        return; // Doesn't exist
+    }
+    if (group_match(&m->ctrl[i / MAP_GROUP * MAP_GROUP], MAP_EMPTY)) {
+        m->ctrl[i] = MAP_EMPTY;
+        m->used--;
+    } else {
+        m->ctrl[i] = MAP_DELETED;
+    }
     m->num--;
 }
 
 void * map_get(Map *m, char *k) {
-    uint32_t h = map_idx(m, k);
-    if (m->k[h]) {
-        return m->v[h];
-    } else {
-        return NULL;
-    }
+    size_t i = map_find(m, k);
+    return i == MAP_NOT_FOUND ? NULL : m->v[i];
 }
 
 size_t map_count(Map *m) {
@@ -274,74 +599,379 @@ size_t map_count(Map *m) {
 }
 
 
+// ---- Scoped Map ------------------------------------------------------------
+
+ScopedMap * smap_new() {
+    ScopedMap *m = malloc(sizeof(ScopedMap));
+    m->names = map_new();
+    m->last = NULL;
+    m->free = NULL;
+    m->depth = 0;
+    return m;
+}
+
+static void free_bindings(Binding *b) {
+    while (b) {
+        Binding *prev = b->prev;
+        free(b);
+        b = prev;
+    }
+}
+
+void smap_free(ScopedMap *m) {
+    if (m) {
+        map_free(m->names);
+        free_bindings(m->last);
+        free_bindings(m->free);
+        free(m);
+    }
+}
+
+void smap_enter(ScopedMap *m) {
+    m->depth++;
+}
+
+void smap_exit(ScopedMap *m) {
+    assert(m->depth > 0);
+    while (m->last && m->last->depth == m->depth) {
+        Binding *b = m->last;
+        map_put(m->names, b->k, b->shadowed); // Leaves the name's slot to re-use
+        m->last = b->prev;
+        b->prev = m->free;
+        m->free = b;
+    }
+    m->depth--;
+}
+
+void smap_put(ScopedMap *m, char *k, void *v) {
+    Binding *outer = map_get(m->names, k);
+    if (outer && outer->depth == m->depth) {
+        outer->v = v; // Already bound in this scope
+        return;
+    }
+    Binding *b = m->free;
+    if (b) {
+        m->free = b->prev;
+    } else {
+        b = malloc(sizeof(Binding));
+    }
+    b->k = k;
+    b->v = v;
+    b->depth = m->depth;
+    b->shadowed = outer;
+    b->prev = m->last;
+    m->last = b;
+    map_put(m->names, k, b);
+}
+
+void * smap_get(ScopedMap *m, char *k) {
+    Binding *b = map_get(m->names, k);
+    return b ? b->v : NULL;
+}
+
+void * smap_get_local(ScopedMap *m, char *k) {
+    Binding *b = map_get(m->names, k);
+    return b && b->depth == m->depth ? b->v : NULL;
+}
+
+
 // ---- Set -------------------------------------------------------------------
 
-Set * set_new() {
-    return vec_new();
+#define SET_UNION_CACHE_SIZE 256
+
+static struct {
+    Set **sets;
+    size_t num, size;
+} SETS;
+static pthread_mutex_t SETS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+// Per-thread, since the sets they point to are shared
+static THREAD_LOCAL struct {
+    char **scratch; // For building the elements of a new set
+    size_t scratch_size;
+    struct { Set *a, *b, *result; } union_cache[SET_UNION_CACHE_SIZE];
+} SET_SCRATCH;
+
+static char ** set_scratch(size_t len) {
+    if (len > SET_SCRATCH.scratch_size) {
+        SET_SCRATCH.scratch_size = len * 2;
+        SET_SCRATCH.scratch = realloc(SET_SCRATCH.scratch, sizeof(char *) * SET_SCRATCH.scratch_size);
+    }
+    return SET_SCRATCH.scratch;
+}
+
+static void set_rehash() {
+    if (SETS.num < SETS.size * 0.7) {
+        return;
+    }
+    size_t new_size = SETS.size ? SETS.size * 2 : 256;
+    Set **sets = calloc(new_size, sizeof(Set *));
+    size_t mask = new_size - 1;
+    for (size_t i = 0; i < SETS.size; i++) {
+        Set *set = SETS.sets[i];
+        if (!set) {
+            continue;
+        }
+        uint32_t h = set->hash & mask;
+        while (sets[h]) {
+            h = (h + 1) & mask;
+        }
+        sets[h] = set;
+    }
+    free(SETS.sets);
+    SETS.sets = sets;
+    SETS.size = new_size;
+}
+
+// Returns the unique set with the given (sorted) elements
+static Set * set_intern(char **elems, size_t len) {
+    if (len == 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&SETS_LOCK);
+    set_rehash();
+    size_t bytes = sizeof(char *) * len;
+    uint32_t hsh = hash((char *) elems, bytes);
+    size_t mask = SETS.size - 1;
+    uint32_t h = hsh & mask;
+    Set *set;
+    while ((set = SETS.sets[h])) {
+        if (set->hash == hsh && set->len == len &&
+                memcmp(set->elems, elems, bytes) == 0) {
+            pthread_mutex_unlock(&SETS_LOCK);
+            return set;
+        }
+        h = (h + 1) & mask;
+    }
+    set = malloc(sizeof(Set) + bytes);
+    set->hash = hsh;
+    set->len = len;
+    memcpy(set->elems, elems, bytes);
+    SETS.sets[h] = set;
+    SETS.num++;
+    pthread_mutex_unlock(&SETS_LOCK);
+    return set;
 }
 
 int set_has(Set *s, char *v) {
     if (!s) return 0;
-    for (size_t i = 0; i < vec_len(s); i++) {
-        char *vv = vec_get(s, i);
-        if (strcmp(v, vv) == 0) {
+    size_t lo = 0, hi = s->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->elems[mid] == v) {
             return 1;
+        } else if ((uintptr_t) s->elems[mid] < (uintptr_t) v) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
     return 0;
 }
 
-void set_put(Set **s, char *v) {
-    if (!*s) {
-        *s = set_new();
+Set * set_put(Set *s, char *v) {
+    if (set_has(s, v)) {
+        return s;
     }
-    if (!set_has(*s, v)) {
-        vec_push(*s, v);
+    size_t len = s ? s->len : 0;
+    char **elems = set_scratch(len + 1);
+    size_t i = 0;
+    for (; i < len && (uintptr_t) s->elems[i] < (uintptr_t) v; i++) {
+        elems[i] = s->elems[i];
     }
+    elems[i] = v;
+    for (; i < len; i++) {
+        elems[i + 1] = s->elems[i];
+    }
+    return set_intern(elems, len + 1);
 }
 
-void set_union(Set **dst, Set *src) {
-    if (!src) return;
-    for (size_t i = 0; i < vec_len(src); i++) {
-        char *v = vec_get(src, i);
-        set_put(dst, v);
+Set * set_union(Set *a, Set *b) {
+    if (!a || a == b) return b;
+    if (!b) return a;
+    size_t slot = (((uintptr_t) a >> 4) ^ ((uintptr_t) b >> 3)) %
+            SET_UNION_CACHE_SIZE;
+    if (SET_SCRATCH.union_cache[slot].a == a && SET_SCRATCH.union_cache[slot].b == b) {
+        return SET_SCRATCH.union_cache[slot].result;
     }
+    char **elems = set_scratch(a->len + b->len);
+    size_t i = 0, j = 0, n = 0;
+    while (i < a->len && j < b->len) { // Merge the sorted elements
+        if (a->elems[i] == b->elems[j]) {
+            elems[n++] = a->elems[i++];
+            j++;
+        } else if ((uintptr_t) a->elems[i] < (uintptr_t) b->elems[j]) {
+            elems[n++] = a->elems[i++];
+        } else {
+            elems[n++] = b->elems[j++];
+        }
+    }
+    while (i < a->len) elems[n++] = a->elems[i++];
+    while (j < b->len) elems[n++] = b->elems[j++];
+    Set *result = set_intern(elems, n);
+    SET_SCRATCH.union_cache[slot].a = a;
+    SET_SCRATCH.union_cache[slot].b = b;
+    SET_SCRATCH.union_cache[slot].result = result;
+    return result;
 }
 
-void set_intersection(Set **dst, Set *src) {
-    if (!*dst) return;
-    if (!src) {
-        vec_empty(*dst);
-        return;
+Set * set_intersection(Set *a, Set *b) {
+    if (!a || !b) return NULL;
+    if (a == b) return a;
+    char **elems = set_scratch(a->len < b->len ? a->len : b->len);
+    size_t i = 0, j = 0, n = 0;
+    while (i < a->len && j < b->len) {
+        if (a->elems[i] == b->elems[j]) {
+            elems[n++] = a->elems[i++];
+            j++;
+        } else if ((uintptr_t) a->elems[i] < (uintptr_t) b->elems[j]) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    return set_intern(elems, n);
+}
+
+
+// ---- Bit Sets --------------------------------------------------------------
+
+uint64_t * bits_new(size_t num_words) {
+    return calloc(num_words, sizeof(uint64_t));
+}
+
+void bits_or(uint64_t *dst, uint64_t *src, size_t num_words) {
+    for (size_t w = 0; w < num_words; w++) {
+        dst[w] |= src[w];
     }
-    for (size_t i = 0; i < vec_len(*dst); i++) {
-        char *v = vec_get(*dst, i);
-        if (!set_has(src, v)) {
-            vec_remove(*dst, i);
+}
+
+void bits_and(uint64_t *dst, uint64_t *src, size_t num_words) {
+    for (size_t w = 0; w < num_words; w++) {
+        dst[w] &= src[w];
+    }
+}
+
+void bits_andnot(uint64_t *dst, uint64_t *src, size_t num_words) {
+    for (size_t w = 0; w < num_words; w++) {
+        dst[w] &= ~src[w];
+    }
+}
+
+int bits_count(uint64_t *b, size_t num_words) {
+    int count = 0;
+    for (size_t w = 0; w < num_words; w++) {
+        count += __builtin_popcountll(b[w]);
+    }
+    return count;
+}
+
+size_t bits_next(uint64_t *b, size_t num_words, size_t from) {
+    size_t w = from / 64;
+    if (w >= num_words) {
+        return num_words * 64;
+    }
+    uint64_t word = b[w] & (~(uint64_t) 0 << (from % 64)); // Drop those below
+    while (!word) {
+        if (++w == num_words) {
+            return num_words * 64;
         }
+        word = b[w];
     }
+    return w * 64 + (size_t) __builtin_ctzll(word);
 }
 
 
 // ---- Graph -----------------------------------------------------------------
 
-#define G(g, reg1, reg2) ((reg1) * (g)->size + (reg2))
+// A node exists iff it has an edge to itself. Self-edges are only stored in the
+// matrix (not the adjacency lists), but are included in 'num_edges'
+
+// Bit index of an edge in the lower triangle of the adjacency matrix
+static size_t edge_bit(int node1, int node2) {
+    if (node1 < node2) {
+        int tmp = node1;
+        node1 = node2;
+        node2 = tmp;
+    }
+    return (size_t) node1 * (node1 + 1) / 2 + node2;
+}
+
+static size_t matrix_words(int size) {
+    return BITS_WORDS((size_t) size * (size + 1) / 2);
+}
 
 Graph * graph_new(int size) {
     Graph *g = malloc(sizeof(Graph));
     g->size = size;
-    g->matrix = calloc(size * size, sizeof(int));
+    g->matrix = bits_new(matrix_words(size));
     g->num_edges = calloc(size, sizeof(int));
+    g->adj = calloc(size, sizeof(AdjList));
     return g;
 }
 
+void graph_free(Graph *g) {
+    if (!g) {
+        return;
+    }
+    for (int node = 0; node < g->size; node++) {
+        free(g->adj[node].nodes);
+    }
+    free(g->matrix);
+    free(g->num_edges);
+    free(g->adj);
+    free(g);
+}
+
 Graph * graph_copy(Graph *g) {
     Graph *copy = graph_new(g->size);
-    memcpy(copy->matrix, g->matrix, g->size * g->size * sizeof(int));
+    memcpy(copy->matrix, g->matrix, matrix_words(g->size) * sizeof(uint64_t));
     memcpy(copy->num_edges, g->num_edges, g->size * sizeof(int));
+    for (int node = 0; node < g->size; node++) {
+        AdjList *from = &g->adj[node], *to = &copy->adj[node];
+        if (from->num == 0) {
+            continue;
+        }
+        to->num = to->max = from->num;
+        to->nodes = malloc(sizeof(int) * to->max);
+        memcpy(to->nodes, from->nodes, sizeof(int) * from->num);
+    }
     return copy;
 }
 
+// An edge's bit in the matrix doesn't depend on the size of the graph, so the
+// new nodes' rows just go on the end
+void graph_grow(Graph *g, int size) {
+    if (size <= g->size) {
+        return;
+    }
+    size_t old_words = matrix_words(g->size), words = matrix_words(size);
+    g->matrix = realloc(g->matrix, words * sizeof(uint64_t));
+    memset(&g->matrix[old_words], 0, (words - old_words) * sizeof(uint64_t));
+    g->num_edges = realloc(g->num_edges, size * sizeof(int));
+    memset(&g->num_edges[g->size], 0, (size - g->size) * sizeof(int));
+    g->adj = realloc(g->adj, size * sizeof(AdjList));
+    memset(&g->adj[g->size], 0, (size - g->size) * sizeof(AdjList));
+    g->size = size;
+}
+
+static void adj_push(AdjList *adj, int node) {
+    if (adj->num >= adj->max) {
+        adj->max = adj->max ? adj->max * 2 : 8;
+        adj->nodes = realloc(adj->nodes, sizeof(int) * adj->max);
+    }
+    adj->nodes[adj->num++] = node;
+}
+
+static void adj_remove(AdjList *adj, int node) {
+    for (int i = 0; i < adj->num; i++) {
+        if (adj->nodes[i] == node) {
+            adj->nodes[i] = adj->nodes[--adj->num]; // Order doesn't matter
+            return;
+        }
+    }
+}
+
 int has_node(Graph *g, int node) {
     return has_edge(g, node, node);
 }
@@ -351,36 +981,351 @@ void add_node(Graph *g, int node) {
 }
 
 int has_edge(Graph *g, int node1, int node2) {
-    return g->matrix[G(g, node1, node2)];
+    return bits_has(g->matrix, edge_bit(node1, node2));
 }
 
 void add_edge(Graph *g, int node1, int node2) {
-    // Mirror matrix symmetrically about leading diagonal
-    g->num_edges[node1] += !has_edge(g, node1, node2);
-    g->matrix[G(g, node1, node2)] = 1;
-    g->num_edges[node2] += !has_edge(g, node2, node1);
-    g->matrix[G(g, node2, node1)] = 1;
+    size_t bit = edge_bit(node1, node2);
+    if (bits_has(g->matrix, bit)) {
+        return; // Already exists
+    }
+    bits_put(g->matrix, bit);
+    g->num_edges[node1]++;
+    if (node1 != node2) {
+        g->num_edges[node2]++;
+        adj_push(&g->adj[node1], node2);
+        adj_push(&g->adj[node2], node1);
+    }
 }
 
 int num_edges(Graph *g, int node) {
     return g->num_edges[node];
 }
 
+static void clear_edge(Graph *g, int node1, int node2) {
+    bits_remove(g->matrix, edge_bit(node1, node2));
+}
+
 void remove_node(Graph *g, int to_remove) {
-    for (int node = 0; node < g->size; node++) {
-        g->num_edges[node] -= has_edge(g, to_remove, node);
-        g->matrix[G(g, to_remove, node)] = 0;
-        g->matrix[G(g, node, to_remove)] = 0;
+    AdjList *adj = &g->adj[to_remove];
+    for (int i = 0; i < adj->num; i++) {
+        int node = adj->nodes[i];
+        clear_edge(g, to_remove, node);
+        g->num_edges[node]--;
+        adj_remove(&g->adj[node], to_remove);
     }
+    clear_edge(g, to_remove, to_remove);
+    adj->num = 0;
     g->num_edges[to_remove] = 0;
 }
 
 void copy_edges(Graph *g, int from, int to) {
-    for (int node = 0; node < g->size; node++) {
-        if (has_edge(g, from, node)) {
-            add_edge(g, to, node);
+    if (has_node(g, from)) {
+        add_edge(g, to, from);
+    }
+    // 'add_edge' might grow 'from's adjacency list, so don't cache 'nodes'
+    for (int i = 0; i < g->adj[from].num; i++) {
+        add_edge(g, to, g->adj[from].nodes[i]);
+    }
+}
+
+
+// ---- Arena -----------------------------------------------------------------
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN      16
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev;
+    char *p, *end;
+} ArenaBlock;
+
+// Per thread, so the parallel backend's workers can allocate without locking.
+// Blocks stay valid after a worker's done with a loop (whoever called it is
+// still using what it allocated): a 'parallel_for' worker hands its blocks
+// over to 'ORPHANS' as it finishes helping with each loop, until they're freed
+// by 'arena_free_orphans'
+static THREAD_LOCAL ArenaBlock *ARENAS[ARENA_LAST];
+static THREAD_LOCAL size_t ARENA_BYTES, ARENA_PEAK; // Across all arenas, including headers
+static ArenaBlock *ORPHANS; // Linked through 'prev'
+static pthread_mutex_t ORPHANS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static ArenaBlock * arena_block(size_t size) {
+    size_t header = sizeof(ArenaBlock) + pad(sizeof(ArenaBlock), ARENA_ALIGN);
+    ArenaBlock *b = calloc(1, header + size);
+    ARENA_BYTES += header + size;
+    if (ARENA_BYTES > ARENA_PEAK) {
+        ARENA_PEAK = ARENA_BYTES;
+    }
+    b->prev = NULL;
+    b->p = (char *) b + header;
+    b->end = b->p + size;
+    return b;
+}
+
+void * arena_alloc(int arena, size_t size) {
+    assert(arena >= 0 && arena < ARENA_LAST);
+    size += pad(size, ARENA_ALIGN);
+    ArenaBlock *b = ARENAS[arena];
+    if (!b || (size_t) (b->end - b->p) < size) {
+        if (b && size > ARENA_BLOCK_SIZE / 4) {
+            // Give large objects their own block, slotted in behind the
+            // current one so its free space isn't wasted
+            ArenaBlock *big = arena_block(size);
+            big->prev = b->prev;
+            b->prev = big;
+            big->p = big->end;
+            return big->end - size;
         }
+        ArenaBlock *block = arena_block(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+        block->prev = b;
+        ARENAS[arena] = b = block;
     }
+    void *ptr = b->p;
+    b->p += size;
+    return ptr;
+}
+
+ArenaBlock * arena_detach(int arena) {
+    assert(arena >= 0 && arena < ARENA_LAST);
+    ArenaBlock *blocks = ARENAS[arena];
+    for (ArenaBlock *b = blocks; b; b = b->prev) {
+        ARENA_BYTES -= (size_t) (b->end - (char *) b);
+    }
+    ARENAS[arena] = NULL;
+    return blocks;
+}
+
+void arena_free_blocks(ArenaBlock *blocks) {
+    while (blocks) {
+        ArenaBlock *prev = blocks->prev;
+        free(blocks);
+        blocks = prev;
+    }
+}
+
+// The blocks go behind the current one, so its free space isn't wasted
+void arena_adopt(int arena, ArenaBlock *blocks) {
+    assert(arena >= 0 && arena < ARENA_LAST);
+    if (!blocks) {
+        return;
+    }
+    ArenaBlock *last = blocks;
+    while (1) {
+        ARENA_BYTES += (size_t) (last->end - (char *) last);
+        if (!last->prev) {
+            break;
+        }
+        last = last->prev;
+    }
+    ArenaBlock *cur = ARENAS[arena];
+    if (cur) {
+        last->prev = cur->prev;
+        cur->prev = blocks;
+    } else {
+        ARENAS[arena] = blocks;
+    }
+}
+
+void arena_free(int arena) {
+    arena_free_blocks(arena_detach(arena));
+}
+
+static void arena_orphan() {
+    pthread_mutex_lock(&ORPHANS_LOCK);
+    for (int arena = 0; arena < ARENA_LAST; arena++) {
+        ArenaBlock *b = ARENAS[arena];
+        while (b) {
+            ArenaBlock *prev = b->prev;
+            b->prev = ORPHANS;
+            ORPHANS = b;
+            b = prev;
+        }
+        ARENAS[arena] = NULL;
+    }
+    pthread_mutex_unlock(&ORPHANS_LOCK);
+}
+
+void arena_free_orphans() {
+    pthread_mutex_lock(&ORPHANS_LOCK);
+    while (ORPHANS) {
+        ArenaBlock *prev = ORPHANS->prev;
+        free(ORPHANS);
+        ORPHANS = prev;
+    }
+    pthread_mutex_unlock(&ORPHANS_LOCK);
+}
+
+size_t arena_peak() {
+    return ARENA_PEAK;
+}
+
+void arena_reset_peak() {
+    ARENA_PEAK = ARENA_BYTES;
+}
+
+
+// ---- Threads ---------------------------------------------------------------
+
+// Every 'parallel_for' shares one pool of worker threads, which grows to the
+// most threads any loop has asked for (i.e., '-j'), including loops nested in
+// another's iterations (like each file's backend when compiling several files,
+// and each function's register allocation within that). A loop is a group:
+// its caller pushes it onto its own deque, wanting a helper for each extra
+// thread, then runs the loop itself. Idle workers steal from the bottom of the
+// other threads' deques, where the outermost (and so biggest) loops are. The
+// caller and its helpers each take the next index in order until there are
+// none left; then the caller calls off any helpers nobody's taken up (so the
+// loop finishes even with no workers), and waits for the rest. It never runs
+// another group's work while it waits, since that'd allocate in this thread's
+// arenas in the middle of one of its own iterations
+
+#define MAX_WORKERS 256
+
+typedef struct Group {
+    size_t n, next;
+    void (*fn)(void *arg, size_t i);
+    void *arg;
+    pthread_mutex_t lock; // For 'next'
+    struct Deque *deque;  // It's on, while it still wants helpers
+    int wanted, running;  // Helpers still to start, and not finished yet
+    pthread_cond_t done;  // 'running' reached 0
+} Group;
+
+typedef struct Deque {
+    Group **groups; // Oldest first
+    size_t len, cap;
+} Deque;
+
+// Deques, groups, and the workers are all under 'POOL_LOCK'. The first deque
+// is shared by the threads that aren't workers
+static pthread_mutex_t POOL_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t POOL_WORK = PTHREAD_COND_INITIALIZER;
+static Deque DEQUES[MAX_WORKERS + 1];
+static int NUM_WORKERS;
+static THREAD_LOCAL Deque *OWN_DEQUE; // NULL if it's not a worker
+
+static void deque_push(Deque *d, Group *g) {
+    if (d->len == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 8;
+        d->groups = realloc(d->groups, sizeof(Group *) * d->cap);
+    }
+    d->groups[d->len++] = g;
+    g->deque = d;
+}
+
+static void deque_remove(Group *g) {
+    Deque *d = g->deque;
+    size_t i = 0;
+    while (d->groups[i] != g) {
+        i++;
+    }
+    memmove(&d->groups[i], &d->groups[i + 1], sizeof(Group *) * (d->len - i - 1));
+    d->len--;
+    g->deque = NULL;
+}
+
+// Takes a helper's place in the oldest group on another thread's deque
+// (starting with the next worker's, so they don't all try the same one first)
+static Group * steal(Deque *own) {
+    int start = (int) (own - DEQUES);
+    for (int k = 1; k <= NUM_WORKERS + 1; k++) {
+        Deque *d = &DEQUES[(start + k) % (NUM_WORKERS + 1)];
+        if (d == own || d->len == 0) {
+            continue;
+        }
+        Group *g = d->groups[0];
+        g->running++;
+        if (--g->wanted == 0) {
+            deque_remove(g);
+        }
+        return g;
+    }
+    return NULL;
+}
+
+static void run_group(Group *g) {
+    while (1) {
+        pthread_mutex_lock(&g->lock);
+        size_t i = g->next++;
+        pthread_mutex_unlock(&g->lock);
+        if (i >= g->n) {
+            break;
+        }
+        g->fn(g->arg, i);
+    }
+}
+
+static void * pool_worker(void *arg) {
+    OWN_DEQUE = arg;
+    pthread_mutex_lock(&POOL_LOCK);
+    while (1) {
+        Group *g = steal(OWN_DEQUE);
+        if (!g) {
+            pthread_cond_wait(&POOL_WORK, &POOL_LOCK);
+            continue;
+        }
+        pthread_mutex_unlock(&POOL_LOCK);
+        run_group(g);
+        arena_orphan(); // Whoever called the loop still needs what it made
+        pthread_mutex_lock(&POOL_LOCK);
+        if (--g->running == 0) {
+            pthread_cond_signal(&g->done);
+        }
+    }
+    return NULL;
+}
+
+// With 'POOL_LOCK' held. Makes do with fewer if a thread can't be created
+static void start_workers(int num_workers) {
+    num_workers = num_workers > MAX_WORKERS ? MAX_WORKERS : num_workers;
+    while (NUM_WORKERS < num_workers) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, &DEQUES[NUM_WORKERS + 1]) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+        NUM_WORKERS++;
+    }
+}
+
+void parallel_for(size_t n, int num_threads, void (*fn)(void *arg, size_t i), void *arg) {
+    Group g = { .n = n, .next = 0, .fn = fn, .arg = arg };
+    pthread_mutex_init(&g.lock, NULL);
+    if (num_threads <= 1 || n <= 1) { // Not worth involving any other threads
+        run_group(&g);
+        pthread_mutex_destroy(&g.lock);
+        return;
+    }
+    if ((size_t) num_threads > n) {
+        num_threads = (int) n;
+    }
+    pthread_cond_init(&g.done, NULL);
+    pthread_mutex_lock(&POOL_LOCK);
+    start_workers(num_threads - 1);
+    g.wanted = num_threads - 1;
+    deque_push(OWN_DEQUE ? OWN_DEQUE : &DEQUES[0], &g);
+    pthread_cond_broadcast(&POOL_WORK);
+    pthread_mutex_unlock(&POOL_LOCK);
+
+    run_group(&g);
+
+    pthread_mutex_lock(&POOL_LOCK);
+    if (g.deque) { // Helpers that haven't started won't be needed
+        deque_remove(&g);
+        g.wanted = 0;
+    }
+    while (g.running > 0) {
+        pthread_cond_wait(&g.done, &POOL_LOCK);
+    }
+    pthread_mutex_unlock(&POOL_LOCK);
+    pthread_cond_destroy(&g.done);
+    pthread_mutex_destroy(&g.lock);
+}
+
+int num_cores() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
 }
 
 
@@ -394,7 +1339,7 @@ char * str_copy(char *s) {
 char * str_ncopy(char *s, size_t len) {
     char *r = malloc(sizeof(char) * (len + 1));
     strncpy(r, s, len);
-    s[len] = '\0';
+    r[len] = '\0';
     return r;
 }
 
@@ -431,6 +1376,7 @@ static void quote_ch_to_buf(Buf *b, char ch) {
 char * quote_ch(char ch) {
     Buf *b = buf_new();
     quote_ch_to_buf(b, ch);
+    buf_push(b, '\0');
     return b->data;
 }
 
@@ -458,7 +1404,7 @@ static int read_rune(char *s, const char *end, uint32_t *rune) {
         *rune = (uint32_t) s[0];
         return 1;
     }
-    if (s + ones >= end) {
+    if (s + ones > end) {
         return -1;
     }
     for (int i = 1; i < ones; i++) {
@@ -480,43 +1426,37 @@ static int read_rune(char *s, const char *end, uint32_t *rune) {
     }
 }
 
-uint16_t * utf8_to_utf16(char *s, size_t len, size_t *buf_len) {
-    uint16_t *b = malloc(sizeof(uint16_t) * len);
-    size_t n = 0;
+int utf8_to_utf16(char *s, size_t len, uint16_t *out, size_t *n) {
     char *p = s, *end = s + len;
     while (p < end) {
         uint32_t rune;
         int bytes = read_rune(p, end, &rune);
         if (bytes < 0) {
-            return NULL;
+            return 0;
         }
         p += bytes;
         if (rune < 0x10000) {
-            b[n++] = rune;
-        } else {
-            b[n++] = (rune >> 10) + 0xd7c0;
-            b[n++] = (rune & 0x3ff) + 0xdc00;
+            out[(*n)++] = rune;
+        } else { // Surrogate pair; always from 4 bytes, so still fits
+            out[(*n)++] = (rune >> 10) + 0xd7c0;
+            out[(*n)++] = (rune & 0x3ff) + 0xdc00;
         }
     }
-    *buf_len = n;
-    return b;
+    return 1;
 }
 
-uint32_t * utf8_to_utf32(char *s, size_t len, size_t *buf_len) {
-    uint32_t *b = malloc(sizeof(uint32_t) * len);
-    size_t n = 0;
+int utf8_to_utf32(char *s, size_t len, uint32_t *out, size_t *n) {
     char *p = s, *end = s + len;
     while (p < end) {
         uint32_t rune;
         int bytes = read_rune(p, end, &rune);
         if (bytes < 0) {
-            return NULL;
+            return 0;
         }
         p += bytes;
-        b[n++] = rune;
+        out[(*n)++] = rune;
     }
-    *buf_len = n;
-    return b;
+    return 1;
 }
 
 
@@ -535,10 +1475,11 @@ char * get_dir(char *path) {
     size_t len = strlen(path);
     if (len == 0 || strcmp(path, "/") == 0) return path;
     if (path[len - 1] == '/') len--;
-    size_t last = 0;
-    for (; last < len && path[last] != '/'; last++);
-    if (last == len) return "."; // No '/'
-    return str_ncopy(path, last);
+    size_t last = len;
+    while (last > 0 && path[last - 1] != '/') last--;
+    if (last == 0) return "."; // No '/'
+    if (last == 1) return "/"; // In the root directory
+    return str_ncopy(path, last - 1);
 }
 
 static char * simplify_path(char *p) {
@@ -568,15 +1509,29 @@ static char * simplify_path(char *p) {
     return s;
 }
 
+// Shared by every thread, since the pool's workers outlive a compile server
+// job (and its 'chdir')
+static char CWD[PATH_MAX]; // Looked up once
+static pthread_mutex_t CWD_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
 char * full_path(char *path) {
-    static char cwd[PATH_MAX];
     if (path[0] == '/') {
         return simplify_path(path);
     }
-    if (!*cwd && !getcwd(cwd, PATH_MAX)) {
+    pthread_mutex_lock(&CWD_LOCK);
+    if (!*CWD && !getcwd(CWD, PATH_MAX)) {
+        pthread_mutex_unlock(&CWD_LOCK);
         error("can't get current working directory: %s", strerror(errno));
     }
-    return simplify_path(concat_paths(cwd, path));
+    char *joined = concat_paths(CWD, path);
+    pthread_mutex_unlock(&CWD_LOCK);
+    return simplify_path(joined);
+}
+
+void forget_cwd() {
+    pthread_mutex_lock(&CWD_LOCK);
+    CWD[0] = '\0';
+    pthread_mutex_unlock(&CWD_LOCK);
 }
 
 size_t pad(size_t offset, size_t align) {
@@ -586,3 +1541,10 @@ size_t pad(size_t offset, size_t align) {
         return 0;
     }
 }
+
+uint64_t umulh(uint64_t a, uint64_t b) { // From 32-bit pieces
+    uint64_t al = a & 0xffffffff, ah = a >> 32, bl = b & 0xffffffff, bh = b >> 32;
+    uint64_t lo = al * bl, mid1 = ah * bl, mid2 = al * bh;
+    uint64_t carry = ((lo >> 32) + (mid1 & 0xffffffff) + (mid2 & 0xffffffff)) >> 32;
+    return ah * bh + (mid1 >> 32) + (mid2 >> 32) + carry;
+}
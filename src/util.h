@@ -2,6 +2,7 @@
 #ifndef COSEC_UTIL_H
 #define COSEC_UTIL_H
 
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <assert.h>
@@ -9,10 +10,32 @@
 #define UNREACHABLE() (assert(0))
 #define TODO() (assert(0))
 
+// Each of the compiler's worker threads gets its own copy
+#define THREAD_LOCAL __thread
+
+// Allocation sites (built with 'ALLOC_SITES', from '-DCOSEC_ALLOC_SITES=ON')
+// Every 'Vec', 'Buf', and 'Map' is tagged with the file and line that created
+// it, and each site counts how many it created, how often they grew, the most
+// any of them held, and the bytes they'd allocated but not used when they were
+// freed. A table of the sites, busiest first, is printed at exit
+#ifdef ALLOC_SITES
+typedef struct AllocSite AllocSite;
+#define ALLOC_SITE_FIELD AllocSite *site;
+#else
+#define ALLOC_SITE_FIELD
+#endif
+
 // Vector
+// Most vectors (a BB's predecessors and successors, a phi's operands, a macro
+// argument) never hold more than a couple of elements, so the first few are
+// kept in the header itself, and 'data' only moves to the heap past that
+#define VEC_SMALL 2
+
 typedef struct {
-    void **data;
+    void **data; // Points to 'small' until the vector outgrows it
     size_t len, max;
+    void *small[VEC_SMALL];
+    ALLOC_SITE_FIELD
 } Vec;
 
 Vec * vec_new();
@@ -26,11 +49,13 @@ void * vec_get(Vec *v, size_t i);
 void * vec_head(Vec *v);
 void * vec_tail(Vec *v);
 void vec_empty(Vec *v);
+void vec_free(Vec *v); // NULL is fine, as for 'free'
 
 // String buffer
 typedef struct {
     char *data;
     size_t len, max;
+    ALLOC_SITE_FIELD
 } Buf;
 
 Buf * buf_new();
@@ -39,13 +64,36 @@ void buf_push_utf8(Buf *b, uint32_t c);
 char buf_pop(Buf *b);
 void buf_print(Buf *b, char *s);
 void buf_nprint(Buf *b, char *s, size_t len);
+void buf_zeros(Buf *b, size_t n);
 void buf_printf(Buf *b, char *fmt, ...);
+void buf_vprintf(Buf *b, char *fmt, va_list args);
+void buf_free(Buf *b);
+
+// Interned strings
+// Every distinct string is stored exactly once, so interned strings can be
+// compared by pointer. 'ATOM' gets the header stored just before the string
+typedef struct {
+    uint32_t hash;
+    int tag; // Free for the caller to use (e.g., keyword ids); starts as 0
+    size_t len;
+    char s[];
+} Atom;
+
+#define ATOM(str) ((Atom *) ((str) - offsetof(Atom, s)))
+
+char * intern(char *s);
+char * intern_n(char *s, size_t len);
 
 // Map
+// Keys MUST be interned strings (compared by pointer, using the cached hash).
+// Slots come in groups of 16, each with a control byte holding 7 bits of its
+// key's hash, so a probe checks a whole group at once (as in a SwissTable)
 typedef struct {
+    uint8_t *ctrl; // Per slot; 'MAP_EMPTY', 'MAP_DELETED', or the hash bits
     char **k;
     void **v;
     size_t num, used, size;
+    ALLOC_SITE_FIELD
 } Map;
 
 Map * map_new();
@@ -53,25 +101,103 @@ void map_put(Map *m, char *k, void *v);
 void map_remove(Map *m, char *k);
 void * map_get(Map *m, char *k);
 size_t map_count(Map *m);
+void map_free(Map *m);
+
+#ifdef ALLOC_SITES
+Vec * vec_new_at(char *file, int line);
+Buf * buf_new_at(char *file, int line);
+Map * map_new_at(char *file, int line);
+#define vec_new() vec_new_at(__FILE__, __LINE__)
+#define buf_new() buf_new_at(__FILE__, __LINE__)
+#define map_new() map_new_at(__FILE__, __LINE__)
+#endif
+
+// Scoped map
+// A single table for a stack of nested scopes (e.g., the variables in a
+// function's blocks), so a lookup is one probe however deep the scope. Each
+// name maps to its innermost binding, which keeps the one it shadows; the
+// bindings also form an undo log that 'smap_exit' pops back to the outer scope
+typedef struct Binding {
+    char *k;
+    void *v;
+    int depth;                // Of the scope it was made in
+    struct Binding *shadowed; // Same name, in an outer scope
+    struct Binding *prev;     // Made just before this one
+} Binding;
+
+typedef struct {
+    Map *names;    // of 'Binding *'; NULL if a name isn't bound
+    Binding *last; // Most recent binding, in the innermost scope
+    Binding *free; // Popped bindings, to re-use
+    int depth;     // Of the innermost scope; 0 is the outermost
+} ScopedMap;
+
+ScopedMap * smap_new();
+void smap_enter(ScopedMap *m);
+void smap_exit(ScopedMap *m);
+void smap_put(ScopedMap *m, char *k, void *v); // In the innermost scope
+void * smap_get(ScopedMap *m, char *k);
+void * smap_get_local(ScopedMap *m, char *k); // Only in the innermost scope
+void smap_free(ScopedMap *m);
 
 // Set
-typedef Vec Set;
+// Immutable, hash-consed sets of interned strings (e.g., the preprocessor's
+// hide sets). NULL is the empty set, and equal sets are always the same
+// pointer, so sets can be shared freely between tokens
+typedef struct {
+    uint32_t hash;
+    size_t len;
+    char *elems[]; // Sorted by address
+} Set;
 
-Set * set_new();
 int set_has(Set *s, char *v);
-void set_put(Set **s, char *v);
-void set_union(Set **dst, Set *src);
-void set_intersection(Set **dst, Set *src);
+Set * set_put(Set *s, char *v);
+Set * set_union(Set *a, Set *b);
+Set * set_intersection(Set *a, Set *b);
+
+// Bit sets
+// Dense sets of small ints (e.g., regs), as arrays of 64-bit words so unions
+// and intersections go a word at a time. The caller keeps track of how many
+// words a set has ('BITS_WORDS' of its largest possible element + 1)
+#define BITS_WORDS(n) (((size_t) (n) + 63) / 64)
+
+uint64_t * bits_new(size_t num_words); // Empty
+void bits_or(uint64_t *dst, uint64_t *src, size_t num_words);
+void bits_and(uint64_t *dst, uint64_t *src, size_t num_words);
+void bits_andnot(uint64_t *dst, uint64_t *src, size_t num_words);
+int bits_count(uint64_t *b, size_t num_words);
+size_t bits_next(uint64_t *b, size_t num_words, size_t from); // The first
+    // element >= 'from', or 'num_words * 64' if there isn't one
+
+static inline int bits_has(uint64_t *b, size_t i) {
+    return (int) ((b[i / 64] >> (i % 64)) & 1);
+}
+
+static inline void bits_put(uint64_t *b, size_t i) {
+    b[i / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+static inline void bits_remove(uint64_t *b, size_t i) {
+    b[i / 64] &= ~((uint64_t) 1 << (i % 64));
+}
 
 // Graph
+typedef struct {
+    int *nodes; // Neighbours of a node (doesn't include the node itself)
+    int num, max;
+} AdjList;
+
 typedef struct {
     int size;
-    int *matrix;    // Square matrix of edges
-    int *num_edges; // Number of edges for each node
+    uint64_t *matrix; // Lower triangle of the adjacency matrix, as bits
+    int *num_edges;   // Number of edges for each node
+    AdjList *adj;     // For iterating over the edges of a node
 } Graph;
 
 Graph * graph_new(int size);
 Graph * graph_copy(Graph *g);
+void graph_grow(Graph *g, int size); // For new nodes; keeps the edges
+void graph_free(Graph *g);
 int has_node(Graph *g, int node);
 void add_node(Graph *g, int node);
 int has_edge(Graph *g, int node1, int node2);
@@ -80,6 +206,45 @@ int num_edges(Graph *g, int node);
 void remove_node(Graph *g, int to_remove);
 void copy_edges(Graph *g, int from, int to);
 
+// Arena
+// Bump allocators for objects that live until a whole phase of the compiler is
+// done with them. Memory is zero-initialised and can only be freed in bulk
+enum {
+    ARENA_TOKENS,
+    ARENA_AST,
+    ARENA_IR,
+    ARENA_IR_INS, // Just 'IrIns's, so they're packed together
+    ARENA_IR_FN,  // What only lasts as long as a function's IR (e.g., its BBs
+                  // and loops), rather than the whole program's (its globals)
+    ARENA_ASM,
+    ARENA_LAST,
+};
+
+void * arena_alloc(int arena, size_t size);
+void arena_free(int arena);
+void arena_free_orphans(); // Those left by 'parallel_for's workers
+
+// Takes everything allocated in one of this thread's arenas so far, to be freed
+// later (from any thread) by 'arena_free_blocks', or handed to another
+// thread's arena by 'arena_adopt'; the arena starts afresh
+typedef struct ArenaBlock ArenaBlock;
+ArenaBlock * arena_detach(int arena);
+void arena_free_blocks(ArenaBlock *blocks);
+void arena_adopt(int arena, ArenaBlock *blocks);
+
+// Most bytes held by all arenas at once since the last reset, for
+// '--time-report'
+size_t arena_peak();
+void arena_reset_peak();
+
+// Threads
+// Calls 'fn(arg, i)' for every 'i' in [0, n) on up to 'num_threads' threads:
+// this one, and workers from a pool that every call shares (including calls
+// from inside 'fn'). Each takes the next index in order as it finishes the
+// last one. Interned strings and sets are safe to create from any thread
+void parallel_for(size_t n, int num_threads, void (*fn)(void *arg, size_t i), void *arg);
+int num_cores();
+
 // String manipulation
 char * str_copy(char *s);
 char * str_ncopy(char *s, size_t len);
@@ -88,14 +253,18 @@ char * prepend_underscore(char *s);
 char * quote_ch(char ch);
 char * quote_str(char *s, size_t len);
 
-uint16_t * utf8_to_utf16(char *s, size_t len, size_t *buf_len);
-uint32_t * utf8_to_utf32(char *s, size_t len, size_t *buf_len);
+// Decode 'len' bytes of UTF-8, appending to 'out' at 'out[*n]' (which needs
+// room for 'len' more). Return 0 if 's' isn't valid UTF-8
+int utf8_to_utf16(char *s, size_t len, uint16_t *out, size_t *n);
+int utf8_to_utf32(char *s, size_t len, uint32_t *out, size_t *n);
 
 // Path manipulation
 char * concat_paths(char *dir, char *file);
 char * get_dir(char *path);
-char * full_path(char *path);
+char * full_path(char *path); // The working directory's looked up once
+void forget_cwd();             // After a 'chdir'
 
 size_t pad(size_t offset, size_t align);
+uint64_t umulh(uint64_t a, uint64_t b); // Top half of the 128-bit product
 
 #endif
\ No newline at end of file
@@ -0,0 +1,470 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vectorise.h"
+#include "analysis.h"
+#include "alias.h"
+
+// A loop is vectorised if:
+//   * it's innermost and has a preheader;
+//   * its header only holds phis and the 'i < n' (or unsigned) that exits the
+//     loop, where 'i' goes up by 1 every iteration and 'n' is invariant;
+//   * the rest of it is a straight line of BBs back to the header;
+//   * it only accesses memory at 'base + i * size', with 'size' that of the
+//     scalar loaded or stored, through invariant 'base's that can't overlap
+//     if there's a store through either;
+//   * its other phis are reductions (e.g., 'sum = sum + x', where the sum
+//     isn't used for anything else in the loop), which for floating point
+//     need '-fassociative-math' since the lanes add up in a different order;
+//   * and everything else has a packed SSE2 equivalent (e.g., there's no
+//     32-bit integer multiply, see 'is_supported').
+//
+// The vector loop goes in front of the original one, which picks up where it
+// leaves off:
+//   preheader: ...; lim = sext(n) - (width - 1); br vh
+//   vh: vi = phi [pre -> start] [vb -> vi + width]
+//       vsum = phi [pre -> splat(0)] [vb -> vsum + ...]
+//       condbr sext(vi) < lim, vb, vx
+//   vb: the loop's body, widened; br vh
+//   vx: sum' = start_sum + reduce(vsum); br header
+//   header: i = phi [vx -> vi] [latch -> ...], sum = phi [vx -> sum'] ...
+// where 'lim' is worked out in 64 bits so it can't overflow.
+
+#define VEC_SIZE 16    // Bytes in an SSE register
+#define MIN_VEC_SIZE 4 // Smallest vector that can be loaded ('movd')
+
+enum { // What happens to each of the loop's instructions
+    K_NONE, // Not in the loop (so invariant)
+    K_VEC,  // Widened to a vector
+    K_ADDR, // Part of an address, recomputed for the vector loop's 'i'
+    K_RED,  // Reduction phi
+    K_SKIP, // Branches and the induction variable's update
+};
+
+typedef struct {
+    Loop *loop;
+    BB *pre, *header, *latch;
+    Vec *body;       // of 'BB *'; the BBs after the header, in order
+    IrIns *iv, *cond;
+    Vec *reductions; // of 'IrIns *'; the header's other phis
+    size_t width;    // Lanes per vector
+} VecLoop;
+
+typedef struct {
+    int *kind;       // Per ins
+    int64_t *scale;  // Per ins; for K_ADDR, the multiple of 'i' it adds
+    int *uses;       // Per ins; number of uses in the loop
+    IrIns **vec;     // Per ins; its counterpart in the vector loop
+    IrIns **splats;  // Per ins; an invariant broadcast in the preheader
+} Vectoriser;
+
+static int is_int(IrType *t) {
+    return t->k >= IRT_I8 && t->k <= IRT_I64;
+}
+
+static int is_fp(IrType *t) {
+    return t->k == IRT_F32 || t->k == IRT_F64;
+}
+
+
+// ---- Loop Shape ------------------------------------------------------------
+
+static int match_loop(VecLoop *v) {
+    if (!is_innermost(v->loop) || !(v->pre = find_preheader(v->loop)) ||
+            !(v->body = straight_body(v->loop))) {
+        return 0;
+    }
+    v->latch = vec_tail(v->body);
+    IrIns *cond = match_loop_header(v->loop, v->latch);
+    if (!cond || cond->l->t->k != IRT_I32) {
+        return 0;
+    }
+    v->iv = cond->l;
+    v->cond = cond;
+    v->reductions = vec_new();
+    for (IrIns *phi = v->header->ir_head; phi->op == IR_PHI; phi = phi->next) {
+        if (phi != v->iv) {
+            vec_push(v->reductions, phi);
+        }
+    }
+    return 1;
+}
+
+
+// ---- Legality --------------------------------------------------------------
+
+static int is_reduction_op(int op, IrType *t) {
+    if (is_fp(t)) {
+        return ASSOCIATIVE_MATH && (op == IR_ADD || op == IR_MUL);
+    }
+    return is_int(t) && (op == IR_ADD || op == IR_BIT_AND || op == IR_BIT_OR ||
+                         op == IR_BIT_XOR);
+}
+
+// A reduction phi is only used by its update, which is only used by the phi
+static int match_reduction(Vectoriser *z, VecLoop *v, IrIns *phi) {
+    IrIns *upd = phi_def(phi, v->latch);
+    if (!is_reduction_op(upd->op, phi->t) || !in_loop(upd->bb, v->loop) ||
+            upd->bb == v->header ||
+            (upd->l == phi) == (upd->r == phi) ||
+            z->uses[phi->n] != 1 || z->uses[upd->n] != 1) {
+        return 0;
+    }
+    z->kind[phi->n] = K_RED;
+    return 1;
+}
+
+// Addresses 'base + ext(i) * size' are kept as scalars. Returns 1 if 'ins' is
+// part of one
+static int match_addr(Vectoriser *z, VecLoop *v, IrIns *ins) {
+    int64_t scale;
+    if ((ins->op == IR_SEXT || ins->op == IR_ZEXT) && ins->l == v->iv &&
+            ins->t->k == IRT_I64) {
+        scale = 1;
+    } else if (ins->op == IR_MUL && ins->r->op == IR_IMM &&
+               z->kind[ins->l->n] == K_ADDR && ins->l->op != IR_MUL &&
+               ins->l->op != IR_PTRADD) {
+        scale = (int64_t) ins->r->imm;
+    } else if (ins->op == IR_PTRADD && !in_loop(ins->base->bb, v->loop) &&
+               z->kind[ins->offset->n] == K_ADDR &&
+               ins->offset->op != IR_PTRADD) {
+        scale = z->scale[ins->offset->n];
+    } else {
+        return 0;
+    }
+    z->kind[ins->n] = K_ADDR;
+    z->scale[ins->n] = scale;
+    return 1;
+}
+
+static int is_shift(IrIns *ins) {
+    return ins->op == IR_SHL || ins->op == IR_SHR || ins->op == IR_SAR;
+}
+
+// Whether there's an SSE2 instruction (or short sequence of them, see
+// 'assemble.c') for the operation on every lane
+static int is_supported(IrIns *ins) {
+    IrType *t = ins->op == IR_STORE ? ins->src->t : ins->t;
+    switch (ins->op) {
+    case IR_LOAD: case IR_STORE: case IR_ADD: case IR_SUB:
+        return is_int(t) || is_fp(t);
+    case IR_MUL:
+        return t->k == IRT_I16 || is_fp(t); // No 'pmulld' before SSE4.1
+    case IR_FDIV:
+        return is_fp(t);
+    case IR_BIT_AND: case IR_BIT_OR: case IR_BIT_XOR:
+        return is_int(t);
+    case IR_SHL: case IR_SHR: case IR_SAR:
+        return is_int(t) && t->size >= 2 && (ins->op != IR_SAR || t->size <= 4) &&
+               ins->r->op == IR_IMM && ins->r->imm < t->size * 8;
+    case IR_SEXT: case IR_ZEXT:
+        return is_int(t) && is_int(ins->l->t);
+    case IR_TRUNC:
+        return is_int(t) && is_int(ins->l->t) && ins->l->t->size <= 4;
+    default:
+        return 0;
+    }
+}
+
+// An operand of a widened instruction has to be invariant, widened too, or
+// (for a reduction's update) the reduction phi; the pointer operand of a load
+// or store has to be an address of the element it accesses
+static int is_valid_opr(Vectoriser *z, IrIns *ins, IrIns **opr) {
+    IrIns *def = *opr;
+    if ((ins->op == IR_LOAD && opr == &ins->src) ||
+            (ins->op == IR_STORE && opr == &ins->dst)) {
+        IrType *t = ins->op == IR_LOAD ? ins->t : ins->src->t;
+        return def->op == IR_PTRADD && z->kind[def->n] == K_ADDR &&
+               z->scale[def->n] == (int64_t) t->size;
+    }
+    if (is_shift(ins) && opr == &ins->r) {
+        return 1; // An IR_IMM (see 'is_supported')
+    }
+    return z->kind[def->n] == K_NONE || z->kind[def->n] == K_VEC ||
+           z->kind[def->n] == K_RED;
+}
+
+static void note_size(IrType *t, size_t *min, size_t *max) {
+    if (t->size < *min) *min = t->size;
+    if (t->size > *max) *max = t->size;
+}
+
+static int check_body(Vectoriser *z, VecLoop *v, Vec *accesses) {
+    IrIns *iv_next = phi_def(v->iv, v->latch);
+    size_t min = VEC_SIZE, max = 0;
+    for (size_t i = 0; i < vec_len(v->body); i++) {
+        BB *bb = vec_get(v->body, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (ins->op == IR_BR || ins == iv_next) {
+                z->kind[ins->n] = K_SKIP;
+                continue;
+            }
+            if (match_addr(z, v, ins)) {
+                continue;
+            }
+            if (!is_supported(ins)) {
+                return 0;
+            }
+            IrIns **oprs[3];
+            int num_oprs = ir_operands(ins, oprs);
+            for (int j = 0; j < num_oprs; j++) {
+                if (!is_valid_opr(z, ins, oprs[j])) {
+                    return 0;
+                }
+            }
+            z->kind[ins->n] = K_VEC;
+            if (ins->op == IR_LOAD || ins->op == IR_STORE) {
+                vec_push(accesses, ins);
+            }
+            note_size(ins->op == IR_STORE ? ins->src->t : ins->t, &min, &max);
+            if (ins->op == IR_SEXT || ins->op == IR_ZEXT || ins->op == IR_TRUNC) {
+                note_size(ins->l->t, &min, &max);
+            }
+        }
+    }
+    if (z->uses[iv_next->n] != 1 || vec_len(accesses) == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < vec_len(v->reductions); i++) {
+        IrIns *phi = vec_get(v->reductions, i);
+        if (z->kind[phi_def(phi, v->latch)->n] != K_VEC) {
+            return 0;
+        }
+    }
+    v->width = VEC_SIZE / max;
+    return min * v->width >= MIN_VEC_SIZE;
+}
+
+static IrIns * access_ptr(IrIns *access) {
+    return access->op == IR_LOAD ? access->src : access->dst;
+}
+
+// Accesses through the same base and scale touch the same element in the same
+// iteration; anything else mustn't overlap with a store
+static int is_independent(Vectoriser *z, Vec *accesses) {
+    for (size_t i = 0; i < vec_len(accesses); i++) {
+        IrIns *store = vec_get(accesses, i);
+        if (store->op != IR_STORE) {
+            continue;
+        }
+        for (size_t j = 0; j < vec_len(accesses); j++) {
+            IrIns *other = vec_get(accesses, j);
+            IrIns *a = access_ptr(store), *b = access_ptr(other);
+            if (a->base == b->base && z->scale[a->n] == z->scale[b->n]) {
+                continue;
+            }
+            if (may_alias(store, other)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static int can_vectorise(Vectoriser *z, VecLoop *v) {
+    if (!match_loop(v)) {
+        return 0;
+    }
+    count_uses(v->loop, z->uses);
+    z->kind[v->iv->n] = z->kind[v->cond->n] = K_SKIP;
+    for (size_t i = 0; i < vec_len(v->reductions); i++) {
+        if (!match_reduction(z, v, vec_get(v->reductions, i))) {
+            return 0;
+        }
+    }
+    Vec *accesses = vec_new(); // of 'IrIns *'
+    return check_body(z, v, accesses) && is_independent(z, accesses);
+}
+
+
+// ---- Transformation --------------------------------------------------------
+
+// The value that leaves every lane of a reduction alone
+static IrIns * emit_identity(IrType *t, int op, IrIns *before) {
+    if (is_fp(t)) {
+        IrIns *ins = new_ins(IR_FP, t);
+        ins->fp = op == IR_MUL ? 1.0 : 0.0;
+        insert_ir(ins, before);
+        return ins;
+    }
+    return insert_imm(t, op == IR_BIT_AND ? (uint64_t) -1 : 0, before);
+}
+
+static IrIns * splat(Vectoriser *z, VecLoop *v, IrIns *scalar) {
+    if (!z->splats[scalar->n]) {
+        IrType *t = irt_vec(scalar->t, v->width);
+        z->splats[scalar->n] = insert_op(IR_SPLAT, t, scalar, NULL, v->pre->ir_last);
+    }
+    return z->splats[scalar->n];
+}
+
+static IrIns * widen(Vectoriser *z, VecLoop *v, IrIns *ins) {
+    if (z->kind[ins->n] == K_NONE) {
+        return splat(z, v, ins);
+    }
+    assert(z->vec[ins->n]);
+    return z->vec[ins->n];
+}
+
+// A full vector at 'base + i * size' is aligned on every iteration if 'base'
+// is and 'i' starts at a multiple of the width, so it can use an aligned move
+static size_t vec_access_align(VecLoop *v, IrIns *addr, IrType *vt) {
+    IrIns *start = phi_def(v->iv, v->pre);
+    if (vt->size != VEC_SIZE || start->op != IR_IMM ||
+            ptr_align(addr->base) < VEC_SIZE ||
+            (start->imm * vt->elem->size) % VEC_SIZE != 0) {
+        return 0;
+    }
+    return VEC_SIZE;
+}
+
+// Widens (or for addresses, copies) an instruction into the vector loop
+static void emit_vec_ins(Vectoriser *z, VecLoop *v, IrIns *ins, IrIns *vi,
+                         IrIns *before) {
+    IrIns *out;
+    if (z->kind[ins->n] == K_ADDR) {
+        out = new_ins(ins->op, ins->t);
+        if (ins->op == IR_SEXT || ins->op == IR_ZEXT) {
+            out->l = vi;
+            out->r = NULL;
+        } else if (ins->op == IR_MUL) {
+            out->l = z->vec[ins->l->n];
+            out->r = ins->r;
+        } else { // IR_PTRADD
+            out->base = ins->base;
+            out->offset = z->vec[ins->offset->n];
+        }
+        insert_ir(out, before);
+    } else if (ins->op == IR_LOAD) {
+        out = new_ins(IR_LOAD, irt_vec(ins->t, v->width));
+        out->src = z->vec[ins->src->n];
+        out->align = vec_access_align(v, ins->src, out->t);
+        insert_ir(out, before);
+    } else if (ins->op == IR_STORE) {
+        out = new_ins(IR_STORE, NULL);
+        out->src = widen(z, v, ins->src);
+        out->dst = z->vec[ins->dst->n];
+        out->align = vec_access_align(v, ins->dst, out->src->t);
+        insert_ir(out, before);
+    } else if (ins->op == IR_SEXT || ins->op == IR_ZEXT || ins->op == IR_TRUNC) {
+        IrType *t = irt_vec(ins->t, v->width);
+        out = insert_op(ins->op, t, widen(z, v, ins->l), NULL, before);
+    } else {
+        IrType *t = irt_vec(ins->t, v->width);
+        IrIns *r = is_shift(ins) ? ins->r : widen(z, v, ins->r);
+        out = insert_op(ins->op, t, widen(z, v, ins->l), r, before);
+    }
+    z->vec[ins->n] = out;
+}
+
+static void vectorise_loop(Vectoriser *z, VecLoop *v) {
+    BB *h = v->header;
+    IrIns *pre_br = v->pre->ir_last;
+    IrType *i64 = irt_scalar(IRT_I64);
+    int ext = v->cond->op == IR_SLT ? IR_SEXT : IR_ZEXT;
+
+    // The vector loop's BBs, each starting out with its terminator
+    IrIns *vh_br = new_ins(IR_CONDBR, NULL);
+    IrIns *vb_br = new_ins(IR_BR, NULL);
+    IrIns *vx_br = new_ins(IR_BR, NULL);
+    BB *vh = new_bb_before(vh_br, h);
+    BB *vb = new_bb_before(vb_br, h);
+    BB *vx = new_bb_before(vx_br, h);
+    vh_br->true = vb;
+    vh_br->false = vx;
+    vh_br->true_chain = vh_br->false_chain = NULL;
+    vb_br->br = vh;
+    vx_br->br = h;
+
+    // Preheader
+    IrIns *n = insert_op(ext, i64, v->cond->r, NULL, pre_br);
+    IrIns *lim = insert_op(IR_SUB, i64, n, insert_imm(i64, v->width - 1, pre_br), pre_br);
+    retarget_br(pre_br, h, vh);
+
+    // Vector loop header
+    IrIns *vi = prepend_phi(v->iv->t, vh);
+    vec_push(vi->preds, v->pre);
+    vec_push(vi->defs, phi_def(v->iv, v->pre));
+    for (size_t i = 0; i < vec_len(v->reductions); i++) {
+        IrIns *phi = vec_get(v->reductions, i);
+        IrIns *upd = phi_def(phi, v->latch);
+        IrIns *vphi = prepend_phi(irt_vec(phi->t, v->width), vh);
+        IrIns *id = emit_identity(phi->t, upd->op, pre_br);
+        vec_push(vphi->preds, v->pre);
+        vec_push(vphi->defs, insert_op(IR_SPLAT, vphi->t, id, NULL, pre_br));
+        z->vec[phi->n] = vphi;
+    }
+    IrIns *vi64 = insert_op(ext, i64, vi, NULL, vh_br);
+    vh_br->cond = insert_op(IR_SLT, irt_scalar(IRT_I32), vi64, lim, vh_br);
+
+    // Vector loop body
+    for (size_t i = 0; i < vec_len(v->body); i++) {
+        BB *bb = vec_get(v->body, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (z->kind[ins->n] != K_SKIP) {
+                emit_vec_ins(z, v, ins, vi, vb_br);
+            }
+        }
+    }
+    IrIns *step = insert_imm(vi->t, v->width, vb_br);
+    IrIns *vi_next = insert_op(IR_ADD, vi->t, vi, step, vb_br);
+    vec_push(vi->preds, vb);
+    vec_push(vi->defs, vi_next);
+
+    // Combine the lanes of each reduction on the way out, and hand everything
+    // over to the original loop
+    for (size_t i = 0; i < vec_len(v->reductions); i++) {
+        IrIns *phi = vec_get(v->reductions, i);
+        IrIns *upd = phi_def(phi, v->latch);
+        IrIns *vphi = z->vec[phi->n];
+        vec_push(vphi->preds, vb);
+        vec_push(vphi->defs, z->vec[upd->n]);
+
+        IrIns *reduce = new_ins(IR_REDUCE, phi->t);
+        reduce->vec = vphi;
+        reduce->reduce_op = upd->op;
+        insert_ir(reduce, vx_br);
+        IrIns *start = phi_def(phi, v->pre);
+        IrIns *sum = insert_op(upd->op, phi->t, start, reduce, vx_br);
+        vec_put(phi->defs, phi_idx(phi, v->pre), sum);
+    }
+    vec_put(v->iv->defs, phi_idx(v->iv, v->pre), vi);
+    for (IrIns *ins = h->ir_head; ins->op == IR_PHI; ins = ins->next) {
+        vec_put(ins->preds, phi_idx(ins, v->pre), vx);
+    }
+}
+
+void vectorise(Fn *fn) {
+    analyse_escapes(fn);
+    size_t num_ins = number_ir(fn);
+    Vectoriser z;
+    z.kind = calloc(num_ins, sizeof(int));
+    z.scale = calloc(num_ins, sizeof(int64_t));
+    z.uses = calloc(num_ins, sizeof(int));
+    z.vec = calloc(num_ins, sizeof(IrIns *));
+    z.splats = calloc(num_ins, sizeof(IrIns *));
+    int changed = 0;
+    for (size_t i = 0; i < vec_len(fn->loops); i++) {
+        VecLoop v = { .loop = vec_get(fn->loops, i), };
+        v.header = v.loop->header;
+        memset(z.kind, 0, num_ins * sizeof(int)); // A rejected loop leaves marks
+        memset(z.uses, 0, num_ins * sizeof(int));
+        memset(z.vec, 0, num_ins * sizeof(IrIns *));
+        if (can_vectorise(&z, &v)) {
+            memset(z.splats, 0, num_ins * sizeof(IrIns *)); // Per preheader
+            vectorise_loop(&z, &v);
+            changed = 1;
+        }
+    }
+    if (changed) {
+        analyse_cfg(fn);
+        analyse_dominators(fn);
+        analyse_loops(fn);
+    }
+    free(z.kind);
+    free(z.scale);
+    free(z.uses);
+    free(z.vec);
+    free(z.splats);
+}
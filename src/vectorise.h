@@ -0,0 +1,18 @@
+
+#ifndef COSEC_VECTORISE_H
+#define COSEC_VECTORISE_H
+
+#include "compile.h"
+
+// Loop vectorisation. An innermost counted loop like
+//   for (i = start; i < n; i++) { a[i] = b[i] + c[i]; sum += b[i]; }
+// whose iterations are independent (no memory written in one iteration is
+// accessed in another, see 'alias.h') is run 16 bytes' worth of iterations at
+// a time first, with every value widened to an IRT_VEC of that many lanes
+// (in an SSE register). The original loop is left to run whatever
+// iterations are left over. Reductions ('sum' above) are accumulated lane by
+// lane, then combined with IR_REDUCE on the way out. Requires 'analyse' and
+// 'licm' (for the preheaders), and keeps 'analyse' up to date
+void vectorise(Fn *fn);
+
+#endif
@@ -0,0 +1,598 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "vrp.h"
+#include "analysis.h"
+
+// Each int gets a signed interval [lo, hi] in its type. They're computed
+// optimistically, in rounds over the BBs in reverse postorder until nothing
+// changes: a phi starts out with only the entries that have a range yet, and
+// grows. A phi that keeps growing (a loop counter, say) is widened to its
+// type's bounds after a few rounds, so it terminates; a couple more rounds
+// then narrow everything back down, keeping whatever's still implied.
+//
+// A comparison that a branch tests says something about its operands on
+// either side. Like the facts in 'bits.c', each holds in the BB the branch
+// goes to (if it has no other predecessor) and everything it dominates, so an
+// operand's range is looked up where it's used. A phi entry's is looked up on
+// its edge, which also sees the test on the branch at the end of the
+// predecessor itself.
+//
+// Widening would lose the lower bound of a rotated loop's counter, where the
+// test on the back edge is on 'i + 1': once 'i' reaches the top of its type,
+// 'i + 1' might wrap. So a header phi stepping by a constant gets its bound
+// straight from the tests that keep it going: from 'i = 0' and 'i + 1 < n'
+// on the back edge, 'i' is in [0, n - 1], and 'i + 1' can't wrap.
+
+#define WIDEN_AFTER 3   // Rounds a phi can grow for before it's widened
+#define NARROW_ROUNDS 2
+#define MAX_ROUNDS 100  // Gives up on anything that takes longer
+
+typedef struct {
+    int64_t lo, hi;
+} Range;
+
+typedef struct {
+    IrIns *cond; // The branch's condition (NULL if there's no fact)
+    int holds;   // Whether 'cond' is true here
+} Fact;
+
+typedef struct {
+    Fn *fn;
+    Vec *rpo;       // of 'BB *'
+    Range *ranges;  // Per ins
+    int *known;     // Per ins; whether it has a range yet
+    int *grown;     // Per ins; rounds a phi has grown for
+    Fact *facts;    // Per BB (by 'rpo')
+} VRP;
+
+static int is_int(IrType *t) {
+    return t && t->k >= IRT_I8 && t->k <= IRT_I64; // NULL for void
+}
+
+static int is_int_cmp(IrIns *ins) {
+    return ins->op >= IR_EQ && ins->op <= IR_UGE && is_int(ins->l->t);
+}
+
+static int64_t type_min(IrType *t) {
+    return t->size >= 8 ? INT64_MIN : -((int64_t) 1 << (t->size * 8 - 1));
+}
+
+static int64_t type_max(IrType *t) {
+    return t->size >= 8 ? INT64_MAX : ((int64_t) 1 << (t->size * 8 - 1)) - 1;
+}
+
+static int64_t sext(uint64_t v, IrType *t) {
+    if (t->size >= 8) return (int64_t) v;
+    int bits = (int) t->size * 8;
+    uint64_t sign = 1ull << (bits - 1);
+    v &= (1ull << bits) - 1;
+    return (int64_t) (v & sign ? v | ~((1ull << bits) - 1) : v);
+}
+
+static Range full(IrType *t) {
+    return (Range) { type_min(t), type_max(t) };
+}
+
+static Range exact(int64_t v) {
+    return (Range) { v, v };
+}
+
+static Range join(Range a, Range b) {
+    return (Range) { a.lo < b.lo ? a.lo : b.lo, a.hi > b.hi ? a.hi : b.hi };
+}
+
+static Range meet(Range a, Range b) { // Keeps 'a' if they don't overlap
+    Range r = { a.lo > b.lo ? a.lo : b.lo, a.hi < b.hi ? a.hi : b.hi };
+    return r.lo <= r.hi ? r : a;
+}
+
+// Fits in 't', or is the whole of 't' if it doesn't
+static Range fit(int64_t lo, int64_t hi, IrType *t) {
+    if (lo < type_min(t) || hi > type_max(t)) {
+        return full(t);
+    }
+    return (Range) { lo, hi };
+}
+
+// 'a + b' and 'a - b' in 64 bits; return 0 if it overflows
+static int add_ok(int64_t a, int64_t b, int64_t *r) {
+    if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)) return 0;
+    *r = a + b;
+    return 1;
+}
+
+static int sub_ok(int64_t a, int64_t b, int64_t *r) {
+    if ((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b)) return 0;
+    *r = a - b;
+    return 1;
+}
+
+static int64_t add_sat(int64_t a, int64_t b) {
+    int64_t r;
+    return add_ok(a, b, &r) ? r : (b > 0 ? INT64_MAX : INT64_MIN);
+}
+
+
+// ---- Facts -----------------------------------------------------------------
+
+static int swap_cmp(int op) { // 'l op r' is 'r swap_cmp(op) l'
+    switch (op) {
+        case IR_SLT: return IR_SGT; case IR_SLE: return IR_SGE;
+        case IR_SGT: return IR_SLT; case IR_SGE: return IR_SLE;
+        case IR_ULT: return IR_UGT; case IR_ULE: return IR_UGE;
+        case IR_UGT: return IR_ULT; case IR_UGE: return IR_ULE;
+        default: return op; // IR_EQ, IR_NEQ
+    }
+}
+
+static int negate_cmp(int op) {
+    switch (op) {
+        case IR_EQ: return IR_NEQ; case IR_NEQ: return IR_EQ;
+        case IR_SLT: return IR_SGE; case IR_SLE: return IR_SGT;
+        case IR_SGT: return IR_SLE; case IR_SGE: return IR_SLT;
+        case IR_ULT: return IR_UGE; case IR_ULE: return IR_UGT;
+        case IR_UGT: return IR_ULE; case IR_UGE: return IR_ULT;
+        default: UNREACHABLE();
+    }
+    return 0;
+}
+
+static Range range_of(VRP *v, IrIns *ins) {
+    return v->known[ins->n] ? v->ranges[ins->n] : full(ins->t);
+}
+
+// Narrows 'x' (in 'r') given that 'x op o' holds, with 'o' in 'or'. A
+// contradiction means the code can't be reached, so 'r' is left alone
+static Range narrow(Range r, int op, Range or) {
+    Range n = r;
+    int64_t b;
+    switch (op) {
+    case IR_EQ: return meet(r, or);
+    case IR_NEQ:
+        if (or.lo == or.hi && r.lo == or.lo && r.lo < r.hi) n.lo++;
+        if (or.lo == or.hi && r.hi == or.lo && r.lo < r.hi) n.hi--;
+        return n;
+    case IR_SLT: if (!sub_ok(or.hi, 1, &b)) return r; n.hi = b; break;
+    case IR_SLE: n.hi = or.hi; break;
+    case IR_SGT: if (!add_ok(or.lo, 1, &b)) return r; n.lo = b; break;
+    case IR_SGE: n.lo = or.lo; break;
+
+    // Unsigned comparisons with a value that's not negative (as a signed
+    // int) are the same as signed ones, and only a value that's not negative
+    // either can be less than it
+    case IR_ULT: if (or.lo < 0 || or.hi == 0) return r; n = (Range) { 0, or.hi - 1 }; break;
+    case IR_ULE: if (or.lo < 0) return r; n = (Range) { 0, or.hi }; break;
+    case IR_UGT:
+        if (or.lo < 0 || r.lo < 0 || !add_ok(or.lo, 1, &b)) return r;
+        n.lo = b;
+        break;
+    case IR_UGE: if (or.lo < 0 || r.lo < 0) return r; n.lo = or.lo; break;
+    default: UNREACHABLE();
+    }
+    return meet(r, n);
+}
+
+static Range apply_fact(VRP *v, Range r, IrIns *x, IrIns *cond, int holds) {
+    if (!is_int_cmp(cond)) { // Folded to a constant since the fact was found
+        return r;
+    }
+    int op;
+    IrIns *other;
+    if (cond->l == x) {
+        op = cond->op;
+        other = cond->r;
+    } else if (cond->r == x) {
+        op = swap_cmp(cond->op);
+        other = cond->l;
+    } else {
+        return r;
+    }
+    if (other == x) {
+        return r;
+    }
+    return narrow(r, holds ? op : negate_cmp(op), range_of(v, other));
+}
+
+// Narrows 'r' with the facts on every BB dominating 'bb'
+static Range with_facts(VRP *v, Range r, IrIns *x, BB *bb) {
+    for (BB *dom = bb; dom; dom = dom->idom) {
+        Fact *f = &v->facts[dom->rpo];
+        if (f->cond) {
+            r = apply_fact(v, r, x, f->cond, f->holds);
+        }
+    }
+    return r;
+}
+
+// ... and on the edge from 'pred' to 'succ'
+static Range with_edge_facts(VRP *v, Range r, IrIns *x, BB *pred, BB *succ) {
+    r = with_facts(v, r, x, pred);
+    IrIns *br = pred->ir_last;
+    if (br && br->op == IR_CONDBR && br->true != br->false) {
+        r = apply_fact(v, r, x, br->cond, succ == br->true);
+    }
+    return r;
+}
+
+static Range range_at(VRP *v, IrIns *x, BB *bb) {
+    return with_facts(v, range_of(v, x), x, bb);
+}
+
+static void find_facts(VRP *v) {
+    for (size_t i = 0; i < vec_len(v->rpo); i++) {
+        BB *bb = vec_get(v->rpo, i);
+        if (vec_len(bb->pred) != 1) {
+            continue;
+        }
+        BB *pred = vec_get(bb->pred, 0);
+        IrIns *br = pred->ir_last;
+        if (br->op == IR_CONDBR && br->true != br->false && is_int_cmp(br->cond)) {
+            v->facts[bb->rpo] = (Fact) { br->cond, bb == br->true };
+        }
+    }
+}
+
+
+// ---- Transfer Functions ----------------------------------------------------
+
+// 1 or 0 if 'l op r' is always true or always false, otherwise -1
+static int decide(int op, Range l, Range r) {
+    if (op >= IR_ULT) { // Unsigned; only when neither can be negative
+        if (l.lo < 0 || r.lo < 0) return -1;
+        op = op - IR_ULT + IR_SLT;
+    }
+    switch (op) {
+    case IR_EQ:
+        if (l.lo == l.hi && r.lo == r.hi && l.lo == r.lo) return 1;
+        return l.hi < r.lo || r.hi < l.lo ? 0 : -1;
+    case IR_NEQ: { int d = decide(IR_EQ, l, r); return d < 0 ? d : !d; }
+    case IR_SLT: return l.hi < r.lo ? 1 : l.lo >= r.hi ? 0 : -1;
+    case IR_SLE: return l.hi <= r.lo ? 1 : l.lo > r.hi ? 0 : -1;
+    case IR_SGT: return decide(IR_SLT, r, l);
+    case IR_SGE: return decide(IR_SLE, r, l);
+    default: UNREACHABLE();
+    }
+    return 0;
+}
+
+static int64_t bits_up_to(int64_t v) { // Every bit up to the highest set in 'v'
+    uint64_t u = (uint64_t) v;
+    for (int s = 1; s < 64; s *= 2) u |= u >> s;
+    return (int64_t) u;
+}
+
+static Range mul_range(Range l, Range r, IrType *t) {
+    int64_t lim = (int64_t) 1 << 31; // Products of these fit in 64 bits
+    if (l.lo <= -lim || l.hi >= lim || r.lo <= -lim || r.hi >= lim) {
+        return full(t);
+    }
+    int64_t p[] = { l.lo * r.lo, l.lo * r.hi, l.hi * r.lo, l.hi * r.hi };
+    int64_t lo = p[0], hi = p[0];
+    for (int i = 1; i < 4; i++) {
+        if (p[i] < lo) lo = p[i];
+        if (p[i] > hi) hi = p[i];
+    }
+    return fit(lo, hi, t);
+}
+
+static Range div_range(Range l, Range r, IrType *t) { // For a positive divisor
+    if (r.lo <= 0) return full(t);
+    return (Range) {
+        l.lo >= 0 ? l.lo / r.hi : l.lo / r.lo,
+        l.hi >= 0 ? l.hi / r.lo : l.hi / r.hi,
+    };
+}
+
+static Range mod_range(Range l, Range r, IrType *t) { // For a positive divisor
+    if (r.lo <= 0) return full(t);
+    int64_t max = r.hi - 1;
+    if (l.lo >= 0) return (Range) { 0, l.hi < max ? l.hi : max };
+    if (l.hi <= 0) return (Range) { l.lo > -max ? l.lo : -max, 0 };
+    return (Range) { -max, max };
+}
+
+static int shift_amount(IrIns *ins) { // -1 if it's not a constant in range
+    if (ins->r->op != IR_IMM) return -1;
+    uint64_t s = ins->r->imm;
+    return s < ins->t->size * 8 ? (int) s : -1;
+}
+
+// The range of an induction variable: a loop header phi whose entries from
+// inside the loop are all 'next', which steps it by a constant. Returns 0 if
+// it isn't one, or might wrap
+static int iv_range(VRP *v, IrIns *phi, Range *out) {
+    BB *header = phi->bb;
+    IrType *t = phi->t;
+    Range init = { 0, 0 };
+    int has_init = 0;
+    IrIns *next = NULL;
+    for (size_t i = 0; i < vec_len(phi->preds); i++) {
+        BB *pred = vec_get(phi->preds, i);
+        IrIns *def = vec_get(phi->defs, i);
+        if (in_loop(pred, header->loop)) {
+            if (next && def != next) return 0;
+            next = def;
+        } else {
+            Range r = with_edge_facts(v, range_of(v, def), def, pred, header);
+            init = has_init ? join(init, r) : r;
+            has_init = 1;
+        }
+    }
+    if (!next || !has_init) {
+        return 0;
+    }
+    int64_t step;
+    if (next->op == IR_ADD && next->l == phi && next->r->op == IR_IMM) {
+        step = sext(next->r->imm, t);
+    } else if (next->op == IR_ADD && next->r == phi && next->l->op == IR_IMM) {
+        step = sext(next->l->imm, t);
+    } else if (next->op == IR_SUB && next->l == phi && next->r->op == IR_IMM &&
+               sext(next->r->imm, t) != type_min(t)) {
+        step = -sext(next->r->imm, t);
+    } else {
+        return 0;
+    }
+    if (step == 0) {
+        return 0;
+    }
+
+    // What the facts alone say about the phi where 'next' is computed, and
+    // about 'next' on its way around each back edge
+    Range at_step = with_facts(v, full(t), phi, next->bb);
+    Range back = { 0, 0 };
+    int has_back = 0;
+    for (size_t i = 0; i < vec_len(phi->preds); i++) {
+        BB *pred = vec_get(phi->preds, i);
+        if (in_loop(pred, header->loop)) {
+            Range r = with_edge_facts(v, full(t), next, pred, header);
+            back = has_back ? join(back, r) : r;
+            has_back = 1;
+        }
+    }
+    if (step > 0) {
+        int64_t max = add_sat(at_step.hi, step);
+        if (back.hi < max) max = back.hi;
+        if (init.hi > max) max = init.hi;
+        int64_t top = max < at_step.hi ? max : at_step.hi;
+        if (add_sat(top, step) > type_max(t)) return 0; // 'next' might wrap
+        *out = (Range) { init.lo, max };
+    } else {
+        int64_t min = add_sat(at_step.lo, step);
+        if (back.lo > min) min = back.lo;
+        if (init.lo < min) min = init.lo;
+        int64_t bottom = min > at_step.lo ? min : at_step.lo;
+        if (add_sat(bottom, step) < type_min(t)) return 0;
+        *out = (Range) { min, init.hi };
+    }
+    return 1;
+}
+
+// Returns 0 if there's nothing to go on yet (a phi with no entries known)
+static int transfer(VRP *v, IrIns *ins, Range *out) {
+    IrType *t = ins->t;
+    BB *bb = ins->bb;
+    Range l = { 0, 0 }, r = { 0, 0 };
+    switch (ins->op) {
+    case IR_ADD: case IR_SUB: case IR_MUL: case IR_SDIV: case IR_UDIV:
+    case IR_SMOD: case IR_UMOD: case IR_BIT_AND: case IR_BIT_OR:
+    case IR_BIT_XOR: case IR_SHL: case IR_SAR: case IR_SHR:
+        if (!is_int(ins->l->t) || !is_int(ins->r->t)) { // Vectors
+            *out = full(t);
+            return 1;
+        }
+        l = range_at(v, ins->l, bb);
+        r = range_at(v, ins->r, bb);
+        break;
+    case IR_TRUNC: case IR_SEXT: case IR_ZEXT:
+        if (!is_int(ins->l->t)) {
+            *out = full(t);
+            return 1;
+        }
+        l = range_at(v, ins->l, bb);
+        break;
+    default: break;
+    }
+
+    int64_t lo, hi;
+    switch (ins->op) {
+    case IR_IMM: *out = exact(sext(ins->imm, t)); break;
+    case IR_PHI: {
+        int any = 0;
+        for (size_t i = 0; i < vec_len(ins->preds); i++) {
+            BB *pred = vec_get(ins->preds, i);
+            IrIns *def = vec_get(ins->defs, i);
+            if (pred->rpo == -1 || !v->known[def->n]) continue;
+            Range d = with_edge_facts(v, v->ranges[def->n], def, pred, bb);
+            *out = any ? join(*out, d) : d;
+            any = 1;
+        }
+        Range iv;
+        if (bb->loop && bb->loop->header == bb && iv_range(v, ins, &iv)) {
+            *out = any ? meet(*out, iv) : iv;
+            any = 1;
+        }
+        return any;
+    }
+    case IR_SELECT:
+        *out = join(range_at(v, ins->l, bb), range_at(v, ins->r, bb));
+        break;
+    case IR_ADD:
+        *out = add_ok(l.lo, r.lo, &lo) && add_ok(l.hi, r.hi, &hi) ? fit(lo, hi, t) : full(t);
+        break;
+    case IR_SUB:
+        *out = sub_ok(l.lo, r.hi, &lo) && sub_ok(l.hi, r.lo, &hi) ? fit(lo, hi, t) : full(t);
+        break;
+    case IR_MUL: *out = mul_range(l, r, t); break;
+    case IR_SDIV: *out = div_range(l, r, t); break;
+    case IR_UDIV: *out = l.lo >= 0 ? div_range(l, r, t) : full(t); break;
+    case IR_SMOD: *out = mod_range(l, r, t); break;
+    case IR_UMOD: *out = l.lo >= 0 ? mod_range(l, r, t) : full(t); break;
+    case IR_BIT_AND:
+        if (l.lo >= 0 && r.lo >= 0) {
+            *out = (Range) { 0, l.hi < r.hi ? l.hi : r.hi };
+        } else if (l.lo >= 0 || r.lo >= 0) { // Masked by what's not negative
+            *out = (Range) { 0, l.lo >= 0 ? l.hi : r.hi };
+        } else {
+            *out = full(t);
+        }
+        break;
+    case IR_BIT_OR: case IR_BIT_XOR:
+        if (l.lo >= 0 && r.lo >= 0) {
+            lo = ins->op == IR_BIT_OR ? (l.lo > r.lo ? l.lo : r.lo) : 0;
+            *out = (Range) { lo, bits_up_to(l.hi | r.hi) };
+        } else {
+            *out = full(t);
+        }
+        break;
+    case IR_SAR: {
+        int s = shift_amount(ins);
+        *out = s < 0 ? full(t) : (Range) { l.lo >> s, l.hi >> s };
+        break;
+    }
+    case IR_SHR: {
+        int s = shift_amount(ins);
+        if (s < 0) {
+            *out = full(t);
+        } else if (l.lo >= 0) {
+            *out = (Range) { l.lo >> s, l.hi >> s };
+        } else if (s > 0) {
+            *out = (Range) { 0, (int64_t) ((uint64_t) -1 >> (64 - t->size * 8 + s)) };
+        } else {
+            *out = full(t);
+        }
+        break;
+    }
+    case IR_POPCNT: case IR_CTZ: case IR_CLZ:
+        *out = (Range) { 0, (int64_t) ins->l->t->size * 8 };
+        break;
+    case IR_EQ: case IR_NEQ: case IR_SLT: case IR_SLE: case IR_SGT:
+    case IR_SGE: case IR_ULT: case IR_ULE: case IR_UGT: case IR_UGE: {
+        int d = is_int_cmp(ins) ?
+            decide(ins->op, range_at(v, ins->l, bb), range_at(v, ins->r, bb)) : -1;
+        *out = d < 0 ? (Range) { 0, 1 } : exact(d);
+        break;
+    }
+    case IR_TRUNC: *out = fit(l.lo, l.hi, t); break;
+    case IR_SEXT: *out = l; break;
+    case IR_ZEXT:
+        *out = l.lo >= 0 ? l : (Range) { 0, type_max(ins->l->t) * 2 + 1 };
+        break;
+    default: *out = full(t); break;
+    }
+    return 1;
+}
+
+
+// ---- Propagation -----------------------------------------------------------
+
+// One round over every int. Returns 1 if anything changed
+static int run_round(VRP *v, int narrowing) {
+    int changed = 0;
+    for (size_t i = 0; i < vec_len(v->rpo); i++) {
+        BB *bb = vec_get(v->rpo, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            if (!is_int(ins->t)) continue;
+            Range r;
+            if (!transfer(v, ins, &r)) continue;
+            Range *old = &v->ranges[ins->n];
+            if (v->known[ins->n]) {
+                if (narrowing) {
+                    r = meet(*old, r);
+                } else {
+                    r = join(*old, r);
+                    if (ins->op == IR_PHI && (r.lo != old->lo || r.hi != old->hi) &&
+                            ++v->grown[ins->n] > WIDEN_AFTER) {
+                        if (r.lo < old->lo) r.lo = type_min(ins->t);
+                        if (r.hi > old->hi) r.hi = type_max(ins->t);
+                    }
+                }
+                if (r.lo == old->lo && r.hi == old->hi) continue;
+            }
+            *old = r;
+            v->known[ins->n] = 1;
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+static int propagate(VRP *v) {
+    int rounds = 0;
+    while (run_round(v, 0)) {
+        if (++rounds > MAX_ROUNDS) return 0;
+    }
+    for (int i = 0; i < NARROW_ROUNDS && run_round(v, 1); i++);
+    return 1;
+}
+
+
+// ---- Rewriting -------------------------------------------------------------
+
+// A comparison's operands are looked up at the comparison, but a branch can
+// know more about them where it is
+static int decide_at(VRP *v, IrIns *cmp, BB *bb) {
+    return decide(cmp->op, range_at(v, cmp->l, bb), range_at(v, cmp->r, bb));
+}
+
+// Returns 1 if the CFG changed
+static int rewrite(VRP *v) {
+    int changed = 0;
+    for (size_t i = 0; i < vec_len(v->rpo); i++) {
+        BB *bb = vec_get(v->rpo, i);
+        for (IrIns *ins = bb->ir_head; ins; ins = ins->next) {
+            int d;
+            switch (ins->op) {
+            case IR_CONDBR:
+                if (ins->cond->op == IR_IMM) {
+                    fold_condbr(ins, ins->cond->imm != 0);
+                    changed = 1;
+                } else if (is_int_cmp(ins->cond) && (d = decide_at(v, ins->cond, bb)) >= 0) {
+                    fold_condbr(ins, d);
+                    changed = 1;
+                }
+                break;
+            case IR_SDIV: case IR_SMOD: case IR_SAR:
+                if (!is_int(ins->t) || range_at(v, ins->l, bb).lo < 0) break;
+                if (ins->op == IR_SAR) {
+                    ins->op = IR_SHR;
+                } else if (range_at(v, ins->r, bb).lo > 0) {
+                    ins->op = ins->op == IR_SDIV ? IR_UDIV : IR_UMOD;
+                }
+                break;
+            default:
+                if (is_int_cmp(ins) && (d = decide_at(v, ins, bb)) >= 0) {
+                    ins->op = IR_IMM; // In place, so its users don't change
+                    ins->imm = d;
+                }
+                break;
+            }
+        }
+    }
+    return changed;
+}
+
+void propagate_ranges(Fn *fn) {
+    size_t num_ins = number_ir(fn);
+    VRP v = { .fn = fn };
+    v.rpo = rev_postorder(fn);
+    v.ranges = malloc(sizeof(Range) * num_ins);
+    v.known = calloc(num_ins, sizeof(int));
+    v.grown = calloc(num_ins, sizeof(int));
+    v.facts = calloc(vec_len(v.rpo), sizeof(Fact));
+
+    find_facts(&v);
+    if (propagate(&v) && rewrite(&v)) {
+        analyse_cfg(fn);
+        vec_free(rev_postorder(fn));
+        remove_unreachable_bbs(fn);
+        analyse_cfg(fn);
+        analyse_dominators(fn);
+        analyse_loops(fn);
+    }
+    vec_free(v.rpo);
+    free(v.ranges);
+    free(v.known);
+    free(v.grown);
+    free(v.facts);
+}
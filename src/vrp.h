@@ -0,0 +1,15 @@
+#ifndef COSEC_VRP_H
+#define COSEC_VRP_H
+
+#include "compile.h"
+
+// Value range propagation. Works out a signed interval for every int, from
+// constants, masks and zero extensions, the comparisons on the branches that
+// lead to each use, and the bounds of loop induction variables. Folds the
+// comparisons (and the IR_CONDBRs) that the ranges decide, e.g. 'i >= 0'
+// inside 'for (i = 0; i < n; i++)', and turns signed divisions, modulos and
+// right shifts of values that can't be negative into unsigned ones, which
+// lower to shorter sequences. Requires 'analyse', and keeps it up to date
+void propagate_ranges(Fn *fn);
+
+#endif
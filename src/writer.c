@@ -0,0 +1,209 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // For 'fopencookie'
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+#define USE_WRITER_THREAD
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#include "writer.h"
+#include "util.h"
+
+#ifdef USE_WRITER_THREAD
+
+#define WRITER_BUF (1024 * 1024) // Bytes in each buffer
+
+// 'bufs[fill]' is being filled by whoever's writing to the stream, while the
+// thread writes 'pending' bytes of the other one out. The thread's only
+// started once the first buffer fills, so small files are written directly
+typedef struct {
+    int fd;
+    char *path, *tmp;
+    char *bufs[2];
+    size_t len, pending; // Of 'bufs[fill]', and of the other one
+    int fill, done, failed;
+    int has_thread;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Writer;
+
+static int write_all(int fd, char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        data += n;
+        len -= (size_t) n;
+    }
+    return 1;
+}
+
+static void * write_thread(void *arg) {
+    Writer *w = arg;
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        while (w->pending == 0 && !w->done) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->pending == 0) {
+            break; // Done
+        }
+        char *data = w->bufs[1 - w->fill];
+        size_t len = w->pending;
+        pthread_mutex_unlock(&w->lock);
+        int ok = write_all(w->fd, data, len);
+        pthread_mutex_lock(&w->lock);
+        w->failed |= !ok;
+        w->pending = 0;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Gives the full buffer to the thread, once it's done with the other one
+static void hand_off(Writer *w) {
+    if (!w->has_thread) {
+        w->bufs[1] = malloc(WRITER_BUF);
+        w->has_thread = pthread_create(&w->thread, NULL, write_thread, w) == 0;
+        if (!w->has_thread) { // Fall back to writing it here
+            w->failed |= !write_all(w->fd, w->bufs[w->fill], w->len);
+            w->len = 0;
+            return;
+        }
+    }
+    pthread_mutex_lock(&w->lock);
+    while (w->pending > 0) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    w->pending = w->len;
+    w->fill = 1 - w->fill;
+    w->len = 0;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static size_t put(Writer *w, const char *data, size_t len) {
+    for (size_t left = len; left > 0;) {
+        size_t n = WRITER_BUF - w->len < left ? WRITER_BUF - w->len : left;
+        memcpy(w->bufs[w->fill] + w->len, data, n);
+        w->len += n;
+        data += n;
+        left -= n;
+        if (w->len == WRITER_BUF) {
+            hand_off(w);
+        }
+    }
+    return len;
+}
+
+static int finish(Writer *w) {
+    if (w->has_thread) {
+        if (w->len > 0) {
+            hand_off(w);
+        }
+        pthread_mutex_lock(&w->lock);
+        w->done = 1;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+    } else {
+        w->failed |= !write_all(w->fd, w->bufs[w->fill], w->len);
+    }
+    int ok = close(w->fd) == 0 && !w->failed;
+    if (!ok || rename(w->tmp, w->path) != 0) {
+        unlink(w->tmp);
+        ok = 0;
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    free(w->bufs[0]);
+    free(w->bufs[1]);
+    free(w->tmp);
+    free(w->path);
+    free(w);
+    return ok ? 0 : EOF;
+}
+
+#ifdef __APPLE__
+static int apple_write(void *cookie, const char *data, int len) {
+    return (int) put(cookie, data, (size_t) len);
+}
+
+static int apple_close(void *cookie) {
+    return finish(cookie);
+}
+#else
+static ssize_t cookie_write(void *cookie, const char *data, size_t len) {
+    return (ssize_t) put(cookie, data, len);
+}
+
+static int cookie_close(void *cookie) {
+    return finish(cookie);
+}
+#endif
+
+// Unique between threads writing the same path, as well as processes
+static char * tmp_path(char *path) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static unsigned counter = 0;
+    pthread_mutex_lock(&lock);
+    unsigned n = counter++;
+    pthread_mutex_unlock(&lock);
+    Buf *b = buf_new();
+    buf_printf(b, "%s.%d.%u.tmp", path, (int) getpid(), n);
+    char *tmp = b->data;
+    free(b);
+    return tmp;
+}
+
+FILE * open_writer(char *path, int is_text) {
+    (void) is_text;
+    char *tmp = tmp_path(path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) {
+        free(tmp);
+        return NULL;
+    }
+    Writer *w = calloc(1, sizeof(Writer));
+    w->fd = fd;
+    w->path = str_copy(path);
+    w->tmp = tmp;
+    w->bufs[0] = malloc(WRITER_BUF);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+#ifdef __APPLE__
+    FILE *f = funopen(w, NULL, apple_write, NULL, apple_close);
+#else
+    FILE *f = fopencookie(w, "w", (cookie_io_functions_t) {
+        .write = cookie_write, .close = cookie_close,
+    });
+#endif
+    if (!f) {
+        close(fd);
+        unlink(tmp);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IONBF, 0); // It has buffers of its own
+    return f;
+}
+
+#else
+
+FILE * open_writer(char *path, int is_text) {
+    return fopen(path, is_text ? "w" : "wb");
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef COSEC_WRITER_H
+#define COSEC_WRITER_H
+
+#include <stdio.h>
+
+// Output files. The stream returned gathers what's written into one of two
+// large buffers; once one fills up, a background thread writes it out while
+// the other fills, so encoding carries on while the file system catches up
+// (which matters most when it's slow, e.g., over the network). The file is
+// written under a temporary name beside 'path', and only renamed to 'path'
+// once 'fclose' has written all of it, so a failed compile never leaves half
+// an output file behind; 'fclose' returns EOF if anything couldn't be written.
+// Returns NULL if the file can't be created. 'is_text' is as for 'fopen', on
+// systems where it matters
+FILE * open_writer(char *path, int is_text);
+
+#endif
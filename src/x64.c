@@ -0,0 +1,1617 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "x64.h"
+#include "encode.h"
+#include "error.h"
+
+// Each instruction is encoded on its own into at most 15 bytes, in the usual
+// order: legacy prefix (0x66 for 16-bit operands, or the mandatory prefix for
+// SSE), REX, opcode, ModRM, SIB, displacement, then immediate. Memory operands
+// that refer to a label are always RIP-relative.
+//
+// Jumps to BBs are encoded separately, once the layout of the function is
+// known. They start out short (rel8) and are relaxed to rel32 wherever the
+// target's out of range, until nothing changes. Lengthening a jump can only
+// push other targets further away, so this always terminates.
+//
+// A function's jump tables go just before its code (as in the NASM output), so
+// references to them are resolved here rather than by the linker. Everything
+// else that refers to a label gets a relocation, including the floating point
+// constants, which are in a pool shared by the whole file (see 'fp_pool').
+
+// ---- Instructions ----------------------------------------------------------
+
+enum { // What the 32-bit field at 'fix_at' in an instruction refers to
+    FIX_NONE,
+    FIX_LABEL, // '[rel <label>]'
+    FIX_CALL,  // 'call <label>' or 'jmp <label>' (for a tail call)
+    FIX_TABLE, // A per-function jump table
+    FIX_BB,    // '[rel <bb>]' in the same function (for '&&label')
+    FIX_TPOFF,    // '[fs:<label>@tpoff]' (NULL 'label' for '[fs:0]')
+    FIX_GOTTPOFF, // '[rel <label>@gottpoff]'
+    FIX_GOT_LOAD, // '[rel <label>@gotpcrel]' in a 'mov'
+    FIX_GOT_CALL, // Likewise, in a 'call' or 'jmp'
+};
+
+typedef struct {
+    uint8_t bytes[16];
+    int len;
+    int fix, fix_at;
+    char *label;  // FIX_LABEL, FIX_CALL, FIX_TPOFF, FIX_GOTTPOFF, FIX_GOT_*
+    size_t table; // FIX_TABLE
+    BB *bb;       // FIX_BB
+} MachIns;
+
+static int CC[X64_LAST] = { // Condition codes, for 'jcc' and 'setcc'
+    [X64_JE]  = 0x4, [X64_JNE]  = 0x5, [X64_JL]   = 0xc, [X64_JLE]  = 0xe,
+    [X64_JG]  = 0xf, [X64_JGE]  = 0xd, [X64_JB]   = 0x2, [X64_JBE]  = 0x6,
+    [X64_JA]  = 0x7, [X64_JAE]  = 0x3,
+    [X64_SETE] = 0x4, [X64_SETNE] = 0x5, [X64_SETL] = 0xc, [X64_SETLE] = 0xe,
+    [X64_SETG] = 0xf, [X64_SETGE] = 0xd, [X64_SETB] = 0x2, [X64_SETBE] = 0x6,
+    [X64_SETA] = 0x7, [X64_SETAE] = 0x3,
+    [X64_CMOVE] = 0x4, [X64_CMOVNE] = 0x5, [X64_CMOVL] = 0xc, [X64_CMOVLE] = 0xe,
+    [X64_CMOVG] = 0xf, [X64_CMOVGE] = 0xd, [X64_CMOVB] = 0x2, [X64_CMOVBE] = 0x6,
+    [X64_CMOVA] = 0x7, [X64_CMOVAE] = 0x3,
+};
+
+static int ALU_EXT[X64_LAST] = { // ModRM.reg opcode extensions
+    [X64_ADD] = 0, [X64_OR] = 1, [X64_AND] = 4, [X64_SUB] = 5, [X64_XOR] = 6,
+    [X64_CMP] = 7,
+    [X64_SHL] = 4, [X64_SHR] = 5, [X64_SAR] = 7,
+    [X64_MUL] = 4, [X64_DIV] = 6, [X64_IDIV] = 7,
+    [X64_PSLLW] = 6, [X64_PSLLD] = 6, [X64_PSLLQ] = 6,
+    [X64_PSRLW] = 2, [X64_PSRLD] = 2, [X64_PSRLQ] = 2,
+    [X64_PSRAW] = 4, [X64_PSRAD] = 4, [X64_PSRLDQ] = 3,
+};
+
+static int SSE_OP[X64_LAST] = { // Mandatory prefix in the top byte
+    [X64_ADDSS] = 0xf30f58, [X64_ADDSD] = 0xf20f58,
+    [X64_SUBSS] = 0xf30f5c, [X64_SUBSD] = 0xf20f5c,
+    [X64_MULSS] = 0xf30f59, [X64_MULSD] = 0xf20f59,
+    [X64_DIVSS] = 0xf30f5e, [X64_DIVSD] = 0xf20f5e,
+    [X64_MINSS] = 0xf30f5d, [X64_MINSD] = 0xf20f5d,
+    [X64_MAXSS] = 0xf30f5f, [X64_MAXSD] = 0xf20f5f,
+    [X64_UCOMISS] = 0x000f2e, [X64_UCOMISD] = 0x660f2e,
+    [X64_CVTSS2SD] = 0xf30f5a, [X64_CVTSD2SS] = 0xf20f5a,
+    [X64_PADDB] = 0x660ffc, [X64_PADDW] = 0x660ffd, [X64_PADDD] = 0x660ffe,
+    [X64_PADDQ] = 0x660fd4, [X64_PSUBB] = 0x660ff8, [X64_PSUBW] = 0x660ff9,
+    [X64_PSUBD] = 0x660ffa, [X64_PSUBQ] = 0x660ffb, [X64_PMULLW] = 0x660fd5,
+    [X64_PMULUDQ] = 0x660ff4,
+    [X64_PAND] = 0x660fdb, [X64_POR] = 0x660feb, [X64_PXOR] = 0x660fef,
+    [X64_ADDPS] = 0x000f58, [X64_ADDPD] = 0x660f58,
+    [X64_SUBPS] = 0x000f5c, [X64_SUBPD] = 0x660f5c,
+    [X64_MULPS] = 0x000f59, [X64_MULPD] = 0x660f59,
+    [X64_DIVPS] = 0x000f5e, [X64_DIVPD] = 0x660f5e,
+    [X64_PUNPCKLBW] = 0x660f60, [X64_PUNPCKLWD] = 0x660f61,
+    [X64_PUNPCKLDQ] = 0x660f62, [X64_PUNPCKLQDQ] = 0x660f6c,
+    [X64_PACKSSWB] = 0x660f63, [X64_PACKSSDW] = 0x660f6b,
+};
+
+static void emit_byte(MachIns *m, uint8_t b) {
+    assert(m->len < 15);
+    m->bytes[m->len++] = b;
+}
+
+static void emit_imm(MachIns *m, uint64_t imm, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        emit_byte(m, (uint8_t) (imm >> (i * 8)));
+    }
+}
+
+static void emit_opcode(MachIns *m, uint32_t op) { // 1 to 3 bytes
+    if (op > 0xffff) emit_byte(m, (uint8_t) (op >> 16));
+    if (op > 0xff)   emit_byte(m, (uint8_t) (op >> 8));
+    emit_byte(m, (uint8_t) op);
+}
+
+static int fits_i8(int64_t v) {
+    return v >= INT8_MIN && v <= INT8_MAX;
+}
+
+static int fits_i32(int64_t v) {
+    return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+// Hardware register number (0-15)
+static int hw_reg(AsmOpr *opr) {
+    if (opr->k == OPR_XMM) {
+        assert(opr->reg >= XMM0 && opr->reg < LAST_XMM);
+        return opr->reg - XMM0;
+    }
+    assert(opr->k == OPR_GPR && opr->reg > R_NONE && opr->reg < LAST_GPR);
+    if (opr->size == R8H) { // ah, ch, dh, bh
+        assert(opr->reg <= RBX);
+        return 4 + opr->reg - RAX;
+    }
+    return opr->reg - RAX;
+}
+
+// Size in bytes of the value an operand reads or writes
+static int opr_bytes(AsmOpr *opr) {
+    switch (opr->k) {
+    case OPR_GPR:
+        switch (opr->size) {
+            case R8L: case R8H: return 1;
+            case R16: return 2;
+            case R32: return 4;
+            case R64: return 8;
+            default: UNREACHABLE();
+        }
+        break;
+    case OPR_MEM: case OPR_DEREF: case OPR_TPOFF: case OPR_GOTTPOFF: case OPR_GOTPCREL:
+        return (int) opr->bytes;
+    case OPR_F32: return 4;
+    case OPR_F64: return 8;
+    case OPR_XMM: return 16;
+    default: UNREACHABLE();
+    }
+    return 0;
+}
+
+// Operand size for an instruction (a memory operand might not have one if the
+// other operand's a register)
+static int ins_bytes(AsmOpr *l, AsmOpr *r) {
+    if (l->k == OPR_GPR || !r || r->k != OPR_GPR) {
+        return opr_bytes(l);
+    }
+    return opr_bytes(r);
+}
+
+static int size_prefix(int bytes) {
+    return bytes == 2 ? 0x66 : 0;
+}
+
+// spl, bpl, sil, and dil can only be encoded with a REX prefix; ah, ch, dh,
+// and bh only without one
+static int needs_rex(AsmOpr *opr) {
+    return opr && opr->k == OPR_GPR && opr->size == R8L &&
+           opr->reg >= RSP && opr->reg <= RDI;
+}
+
+#ifndef NDEBUG
+static int forbids_rex(AsmOpr *opr) {
+    return opr && opr->k == OPR_GPR && opr->size == R8H;
+}
+#endif
+
+// A REX prefix with 'rex' as its low bits, if any are set or 'force' is
+static int emit_rex(MachIns *m, int rex, int force) {
+    if (rex || force) {
+        emit_byte(m, (uint8_t) (0x40 | rex));
+        return 1;
+    }
+    return 0;
+}
+
+static int SCALE[] = { [1] = 0, [2] = 1, [4] = 2, [8] = 3 };
+
+// The REX.X and REX.B bits for register or memory operand 'rm'
+static int rm_rex(AsmOpr *rm) {
+    if (rm->k == OPR_GPR || rm->k == OPR_XMM) {
+        return hw_reg(rm) >> 3;
+    } else if (rm->k == OPR_MEM) {
+        assert(rm->base_size == R64);
+        int rex = (rm->base - RAX) >> 3;
+        if (rm->idx != R_NONE) {
+            assert(rm->idx_size == R64 && rm->idx != RSP);
+            rex |= ((rm->idx - RAX) >> 3) << 1;
+        }
+        return rex;
+    }
+    return 0;
+}
+
+// Emits '<ModRM> <SIB> <disp>' with the low 3 bits of 'reg_num' in ModRM.reg
+static void emit_rm(MachIns *m, int reg_num, AsmOpr *rm) {
+    reg_num &= 7;
+    switch (rm->k) {
+    case OPR_GPR: case OPR_XMM:
+        emit_byte(m, (uint8_t) (0xc0 | (reg_num << 3) | (hw_reg(rm) & 7)));
+        break;
+    case OPR_MEM: {
+        int base = (rm->base - RAX) & 7;
+        int has_sib = rm->idx != R_NONE || base == 4; // rsp and r12 need a SIB
+        int mod;
+        if (rm->disp == 0 && base != 5) { // rbp and r13 need a displacement
+            mod = 0;
+        } else if (fits_i8(rm->disp)) {
+            mod = 1;
+        } else {
+            assert(fits_i32(rm->disp));
+            mod = 2;
+        }
+        emit_byte(m, (uint8_t) ((mod << 6) | (reg_num << 3) | (has_sib ? 4 : base)));
+        if (has_sib) {
+            int scale = rm->idx != R_NONE ? SCALE[rm->scale] : 0;
+            int idx_num = rm->idx != R_NONE ? rm->idx - RAX : 4; // 4 for none
+            emit_byte(m, (uint8_t) ((scale << 6) | ((idx_num & 7) << 3) | base));
+        }
+        if (mod == 1) {
+            emit_imm(m, (uint64_t) rm->disp, 1);
+        } else if (mod == 2) {
+            emit_imm(m, (uint64_t) rm->disp, 4);
+        }
+        break;
+    }
+    case OPR_DEREF: case OPR_F32: case OPR_F64: case OPR_TABLE: // [rip + <disp32>]
+    case OPR_BB_ADDR:
+        emit_byte(m, (uint8_t) (0x05 | (reg_num << 3)));
+        m->fix_at = m->len;
+        switch (rm->k) {
+        case OPR_DEREF: m->fix = FIX_LABEL; m->label = rm->label; break;
+        case OPR_F32: case OPR_F64:
+            m->fix = FIX_LABEL;
+            m->label = fp_label(rm->k, rm->fp);
+            break;
+        case OPR_TABLE: m->fix = FIX_TABLE; m->table = rm->table; break;
+        case OPR_BB_ADDR: m->fix = FIX_BB; m->bb = rm->bb; break;
+        default: UNREACHABLE();
+        }
+        emit_imm(m, 0, 4);
+        break;
+    case OPR_TPOFF: // [<disp32>], with the 'fs' prefix
+        emit_byte(m, (uint8_t) (0x04 | (reg_num << 3)));
+        emit_byte(m, 0x25); // SIB: no base or index
+        m->fix_at = m->len;
+        m->fix = rm->label ? FIX_TPOFF : FIX_NONE;
+        m->label = rm->label;
+        emit_imm(m, 0, 4);
+        break;
+    case OPR_GOTTPOFF: case OPR_GOTPCREL: // [rip + <disp32>]
+        emit_byte(m, (uint8_t) (0x05 | (reg_num << 3)));
+        m->fix_at = m->len;
+        m->fix = rm->k == OPR_GOTTPOFF ? FIX_GOTTPOFF : FIX_GOT_LOAD;
+        m->label = rm->label;
+        emit_imm(m, 0, 4);
+        break;
+    default: UNREACHABLE();
+    }
+}
+
+// Emits '<prefix> <REX> <opcode> <ModRM> <SIB> <disp>' for an instruction with
+// register or memory operand 'rm'. The ModRM.reg field is either the register
+// 'reg' or, if that's NULL, the opcode extension 'ext'
+static void emit_modrm(MachIns *m, int prefix, int w, uint32_t op, int ext,
+                       AsmOpr *reg, AsmOpr *rm) {
+    if (prefix) {
+        emit_byte(m, (uint8_t) prefix);
+    }
+    int reg_num = reg ? hw_reg(reg) : ext;
+    int rex = (w << 3) | ((reg_num >> 3) << 2) | rm_rex(rm);
+    if (emit_rex(m, rex, needs_rex(reg) || needs_rex(rm))) {
+        assert(!forbids_rex(reg) && !forbids_rex(rm));
+    }
+    emit_opcode(m, op);
+    emit_rm(m, reg_num, rm);
+}
+
+// VEX opcode maps and the legacy prefixes that 'pp' stands in for
+enum { VEX_0F = 1, VEX_0F38 = 2 };
+enum { VEX_66 = 1, VEX_F3 = 2, VEX_F2 = 3 };
+
+// Emits '<VEX> <opcode> <ModRM> <SIB> <disp>' for a VEX encoded instruction
+// (128-bit, so VEX.L is 0), with a second source register 'v' in VEX.vvvv.
+// The 2-byte form only covers the 0F map without REX.W, X, or B
+static void emit_vex(MachIns *m, int pp, int map, int w, uint8_t op,
+                     AsmOpr *reg, AsmOpr *v, AsmOpr *rm) {
+    int r = hw_reg(reg) >> 3, xb = rm_rex(rm), vvvv = (~hw_reg(v)) & 15;
+    if (map == VEX_0F && !w && !xb) {
+        emit_byte(m, 0xc5);
+        emit_byte(m, (uint8_t) ((!r << 7) | (vvvv << 3) | pp));
+    } else {
+        emit_byte(m, 0xc4);
+        emit_byte(m, (uint8_t) ((!r << 7) | (!(xb & 2) << 6) | (!(xb & 1) << 5) | map));
+        emit_byte(m, (uint8_t) ((w << 7) | (vvvv << 3) | pp));
+    }
+    emit_byte(m, op);
+    emit_rm(m, hw_reg(reg), rm);
+}
+
+// Sign extends an immediate from the size of the instruction it's in
+static int64_t imm_val(AsmOpr *imm, int bytes) {
+    int shift = 64 - bytes * 8;
+    return shift == 0 ? (int64_t) imm->imm : (int64_t) (imm->imm << shift) >> shift;
+}
+
+static void encode_mov(MachIns *m, AsmOpr *l, AsmOpr *r) {
+    if (l->k == OPR_XMM) { // movd/movq from a GPR
+        emit_modrm(m, 0x66, opr_bytes(r) == 8, 0x0f6e, 0, l, r);
+        return;
+    } else if (r->k == OPR_XMM) { // movd/movq to a GPR
+        emit_modrm(m, 0x66, opr_bytes(l) == 8, 0x0f7e, 0, r, l);
+        return;
+    }
+    int bytes = ins_bytes(l, r);
+    int prefix = size_prefix(bytes), w = bytes == 8, is_byte = bytes == 1;
+    if (r->k == OPR_IMM && l->k == OPR_GPR) {
+        int imm_bytes = bytes;
+        if (bytes == 8 && r->imm <= UINT32_MAX) {
+            imm_bytes = 4, w = 0; // 'mov r32, imm32' zeros the top half
+        } else if (bytes == 8 && fits_i32((int64_t) r->imm)) {
+            emit_modrm(m, 0, 1, 0xc7, 0, NULL, l); // Sign extends imm32
+            emit_imm(m, r->imm, 4);
+            return;
+        }
+        if (prefix) {
+            emit_byte(m, (uint8_t) prefix);
+        }
+        int n = hw_reg(l);
+        if (emit_rex(m, (w << 3) | (n >> 3), needs_rex(l))) {
+            assert(!forbids_rex(l));
+        }
+        emit_byte(m, (uint8_t) ((is_byte ? 0xb0 : 0xb8) + (n & 7)));
+        emit_imm(m, r->imm, imm_bytes);
+    } else if (r->k == OPR_IMM) {
+        emit_modrm(m, prefix, w, is_byte ? 0xc6 : 0xc7, 0, NULL, l);
+        assert(bytes < 8 || fits_i32((int64_t) r->imm));
+        emit_imm(m, r->imm, bytes == 8 ? 4 : bytes);
+    } else if (l->k == OPR_GPR && r->k != OPR_GPR) { // Load
+        emit_modrm(m, prefix, w, is_byte ? 0x8a : 0x8b, 0, l, r);
+    } else { // Store, or register to register
+        assert(r->k == OPR_GPR);
+        emit_modrm(m, prefix, w, is_byte ? 0x88 : 0x89, 0, r, l);
+    }
+}
+
+static void encode_ext(MachIns *m, int op, AsmOpr *l, AsmOpr *r) {
+    int dst = opr_bytes(l), src = opr_bytes(r);
+    int prefix = size_prefix(dst), w = dst == 8;
+    if (src == 4) {
+        assert(dst == 8);
+        if (op == X64_MOVSX) {
+            emit_modrm(m, 0, 1, 0x63, 0, l, r); // movsxd
+        } else { // 32-bit mov zeros the top half
+            AsmOpr l32 = *l;
+            l32.size = R32;
+            emit_modrm(m, 0, 0, 0x8b, 0, &l32, r);
+        }
+        return;
+    }
+    assert(src == 1 || src == 2);
+    uint32_t base = op == X64_MOVSX ? 0x0fbe : 0x0fb6;
+    emit_modrm(m, prefix, w, src == 1 ? base : base + 1, 0, l, r);
+}
+
+static void encode_alu(MachIns *m, int op, AsmOpr *l, AsmOpr *r) {
+    int bytes = ins_bytes(l, r);
+    int prefix = size_prefix(bytes), w = bytes == 8, is_byte = bytes == 1;
+    int ext = ALU_EXT[op];
+    if (r->k == OPR_IMM) {
+        int64_t v = imm_val(r, bytes);
+        if (is_byte) {
+            emit_modrm(m, prefix, w, 0x80, ext, NULL, l);
+            emit_imm(m, r->imm, 1);
+        } else if (fits_i8(v)) {
+            emit_modrm(m, prefix, w, 0x83, ext, NULL, l);
+            emit_imm(m, (uint64_t) v, 1);
+        } else {
+            assert(fits_i32(v));
+            emit_modrm(m, prefix, w, 0x81, ext, NULL, l);
+            emit_imm(m, (uint64_t) v, bytes == 2 ? 2 : 4);
+        }
+    } else if (l->k == OPR_GPR && r->k != OPR_GPR) { // 'op r, r/m'
+        emit_modrm(m, prefix, w, ext * 8 + (is_byte ? 2 : 3), 0, l, r);
+    } else { // 'op r/m, r'
+        assert(r->k == OPR_GPR);
+        emit_modrm(m, prefix, w, ext * 8 + (is_byte ? 0 : 1), 0, r, l);
+    }
+}
+
+static void encode_imul(MachIns *m, AsmOpr *l, AsmOpr *r) {
+    int bytes = ins_bytes(l, r);
+    assert(bytes > 1 && l->k == OPR_GPR);
+    int prefix = size_prefix(bytes), w = bytes == 8;
+    if (r->k == OPR_IMM) { // 'imul r, r, imm'
+        int64_t v = imm_val(r, bytes);
+        if (fits_i8(v)) {
+            emit_modrm(m, prefix, w, 0x6b, 0, l, l);
+            emit_imm(m, (uint64_t) v, 1);
+        } else {
+            assert(fits_i32(v));
+            emit_modrm(m, prefix, w, 0x69, 0, l, l);
+            emit_imm(m, (uint64_t) v, bytes == 2 ? 2 : 4);
+        }
+    } else {
+        emit_modrm(m, prefix, w, 0x0faf, 0, l, r);
+    }
+}
+
+static void encode_shift(MachIns *m, int op, AsmOpr *l, AsmOpr *r) {
+    int bytes = opr_bytes(l);
+    int prefix = size_prefix(bytes), w = bytes == 8, is_byte = bytes == 1;
+    if (r->k == OPR_IMM && r->imm == 1) { // Shorter form without the immediate
+        emit_modrm(m, prefix, w, is_byte ? 0xd0 : 0xd1, ALU_EXT[op], NULL, l);
+    } else if (r->k == OPR_IMM) {
+        emit_modrm(m, prefix, w, is_byte ? 0xc0 : 0xc1, ALU_EXT[op], NULL, l);
+        emit_imm(m, r->imm, 1);
+    } else { // Shift by 'cl'
+        assert(r->k == OPR_GPR && r->reg == RCX);
+        emit_modrm(m, prefix, w, is_byte ? 0xd2 : 0xd3, ALU_EXT[op], NULL, l);
+    }
+}
+
+// 'popcnt', 'bsf', 'bsr', 'lzcnt', and 'tzcnt' only have 16, 32, and 64-bit
+// forms; 'lzcnt' and 'tzcnt' are 'bsr' and 'bsf' with an 'F3' prefix
+static void encode_bits(MachIns *m, int op, AsmOpr *l, AsmOpr *r) {
+    int bytes = opr_bytes(l);
+    assert(l->k == OPR_GPR && bytes >= 4);
+    uint32_t code = op == X64_POPCNT ? 0x0fb8 :
+                    (op == X64_BSF || op == X64_TZCNT) ? 0x0fbc : 0x0fbd;
+    int prefix = op == X64_POPCNT || op == X64_LZCNT || op == X64_TZCNT ? 0xf3 : 0;
+    emit_modrm(m, prefix, bytes == 8, code, 0, l, r);
+}
+
+// 'shlx dst, src, count' puts the count in VEX.vvvv; 'pp' picks the shift
+static void encode_bmi_shift(MachIns *m, int op, AsmIns *ins) {
+    int bytes = opr_bytes(ins->l);
+    assert(ins->l->k == OPR_GPR && ins->r2->k == OPR_GPR && bytes >= 4);
+    int pp = op == X64_SHLX ? VEX_66 : op == X64_SARX ? VEX_F3 : VEX_F2;
+    emit_vex(m, pp, VEX_0F38, bytes == 8, 0xf7, ins->l, ins->r2, ins->r);
+}
+
+// 'vaddss dst, l, r' puts 'l' in VEX.vvvv and 'r' in ModRM.rm, as do the FMAs
+// (where 'dst' is also the addend)
+typedef struct {
+    int pp, map, w;
+    uint8_t op;
+} VexOp;
+
+static VexOp VEX_OP[X64_LAST] = {
+    [X64_VADDSS] = { VEX_F3, VEX_0F, 0, 0x58 }, [X64_VADDSD] = { VEX_F2, VEX_0F, 0, 0x58 },
+    [X64_VSUBSS] = { VEX_F3, VEX_0F, 0, 0x5c }, [X64_VSUBSD] = { VEX_F2, VEX_0F, 0, 0x5c },
+    [X64_VMULSS] = { VEX_F3, VEX_0F, 0, 0x59 }, [X64_VMULSD] = { VEX_F2, VEX_0F, 0, 0x59 },
+    [X64_VDIVSS] = { VEX_F3, VEX_0F, 0, 0x5e }, [X64_VDIVSD] = { VEX_F2, VEX_0F, 0, 0x5e },
+    [X64_VFMADD231SS] = { VEX_66, VEX_0F38, 0, 0xb9 },
+    [X64_VFMADD231SD] = { VEX_66, VEX_0F38, 1, 0xb9 },
+    [X64_VFMSUB231SS] = { VEX_66, VEX_0F38, 0, 0xbb },
+    [X64_VFMSUB231SD] = { VEX_66, VEX_0F38, 1, 0xbb },
+    [X64_VFNMADD231SS] = { VEX_66, VEX_0F38, 0, 0xbd },
+    [X64_VFNMADD231SD] = { VEX_66, VEX_0F38, 1, 0xbd },
+    [X64_VFMADD231PS] = { VEX_66, VEX_0F38, 0, 0xb8 },
+    [X64_VFMADD231PD] = { VEX_66, VEX_0F38, 1, 0xb8 },
+    [X64_VFMSUB231PS] = { VEX_66, VEX_0F38, 0, 0xba },
+    [X64_VFMSUB231PD] = { VEX_66, VEX_0F38, 1, 0xba },
+    [X64_VFNMADD231PS] = { VEX_66, VEX_0F38, 0, 0xbc },
+    [X64_VFNMADD231PD] = { VEX_66, VEX_0F38, 1, 0xbc },
+};
+
+static void encode_vex_sse(MachIns *m, int op, AsmIns *ins) {
+    VexOp v = VEX_OP[op];
+    assert(v.op != 0 && ins->l->k == OPR_XMM && ins->r->k == OPR_XMM);
+    emit_vex(m, v.pp, v.map, v.w, v.op, ins->l, ins->r, ins->r2);
+}
+
+static void encode_bswap(MachIns *m, AsmOpr *l) {
+    assert(l->k == OPR_GPR && opr_bytes(l) >= 4);
+    int n = hw_reg(l);
+    emit_rex(m, ((opr_bytes(l) == 8) << 3) | (n >> 3), 0);
+    emit_byte(m, 0x0f);
+    emit_byte(m, (uint8_t) (0xc8 + (n & 7)));
+}
+
+static void encode_sse(MachIns *m, int op, AsmOpr *l, AsmOpr *r) {
+    uint32_t code = (uint32_t) SSE_OP[op];
+    assert(code != 0);
+    emit_modrm(m, (int) (code >> 16), 0, code & 0xffff, 0, l, r);
+}
+
+static void encode_mov_sse(MachIns *m, int op, AsmOpr *l, AsmOpr *r) {
+    int prefix = op == X64_MOVSS ? 0xf3 : 0xf2;
+    if (l->k == OPR_XMM) {
+        emit_modrm(m, prefix, 0, 0x0f10, 0, l, r);
+    } else { // Store
+        emit_modrm(m, prefix, 0, 0x0f11, 0, r, l);
+    }
+}
+
+static void encode_movd(MachIns *m, int op, AsmOpr *l, AsmOpr *r) {
+    int w = op == X64_MOVQ;
+    if (l->k == OPR_XMM) { // Load, or from a GPR
+        emit_modrm(m, 0x66, w, 0x0f6e, 0, l, r);
+    } else { // Store, or to a GPR
+        emit_modrm(m, 0x66, w, 0x0f7e, 0, r, l);
+    }
+}
+
+// Shifts of each lane (or the whole register, for 'psrldq') by an immediate
+static void encode_vec_shift(MachIns *m, int op, AsmOpr *l, AsmOpr *r) {
+    uint32_t code;
+    switch (op) {
+        case X64_PSLLW: case X64_PSRLW: case X64_PSRAW: code = 0x0f71; break;
+        case X64_PSLLD: case X64_PSRLD: case X64_PSRAD: code = 0x0f72; break;
+        default: code = 0x0f73; break;
+    }
+    assert(r->k == OPR_IMM);
+    emit_modrm(m, 0x66, 0, code, ALU_EXT[op], NULL, l);
+    emit_imm(m, r->imm, 1);
+}
+
+// Thread-locals are addressed off the 'fs' segment
+static int is_fs(AsmOpr *opr) {
+    return opr && (opr->k == OPR_TPOFF || (opr->k == OPR_MEM && opr->fs));
+}
+
+static void encode_ins(MachIns *m, AsmIns *ins) {
+    AsmOpr *l = ins->l, *r = ins->r;
+    if (is_fs(l) || is_fs(r)) {
+        emit_byte(m, 0x64);
+    }
+    switch (ins->op) {
+    case X64_MOV: encode_mov(m, l, r); break;
+    case X64_MOVSX: case X64_MOVZX: encode_ext(m, ins->op, l, r); break;
+    case X64_MOVSS: case X64_MOVSD: encode_mov_sse(m, ins->op, l, r); break;
+    case X64_LEA: emit_modrm(m, 0, opr_bytes(l) == 8, 0x8d, 0, l, r); break;
+
+    case X64_MOVDQU: case X64_MOVDQA: {
+        int prefix = ins->op == X64_MOVDQU ? 0xf3 : 0x66;
+        if (l->k == OPR_XMM) {
+            emit_modrm(m, prefix, 0, 0x0f6f, 0, l, r);
+        } else { // Store
+            emit_modrm(m, prefix, 0, 0x0f7f, 0, r, l);
+        }
+        break;
+    }
+    case X64_REP_MOVSB: emit_byte(m, 0xf3); emit_byte(m, 0xa4); break;
+    case X64_REP_STOSB: emit_byte(m, 0xf3); emit_byte(m, 0xaa); break;
+
+    case X64_ADD: case X64_SUB: case X64_AND: case X64_OR: case X64_XOR:
+    case X64_CMP:
+        encode_alu(m, ins->op, l, r);
+        break;
+    case X64_TEST: {
+        int bytes = ins_bytes(l, r);
+        assert(r->k == OPR_GPR);
+        emit_modrm(m, size_prefix(bytes), bytes == 8, bytes == 1 ? 0x84 : 0x85, 0, r, l);
+        break;
+    }
+    case X64_IMUL: encode_imul(m, l, r); break;
+    case X64_CWD: emit_byte(m, 0x66); emit_byte(m, 0x99); break;
+    case X64_CDQ: emit_byte(m, 0x99); break;
+    case X64_CQO: emit_byte(m, 0x48); emit_byte(m, 0x99); break;
+    case X64_MUL: case X64_IDIV: case X64_DIV: {
+        int bytes = opr_bytes(l);
+        emit_modrm(m, size_prefix(bytes), bytes == 8, bytes == 1 ? 0xf6 : 0xf7,
+                   ALU_EXT[ins->op], NULL, l);
+        break;
+    }
+    case X64_SHL: case X64_SHR: case X64_SAR: encode_shift(m, ins->op, l, r); break;
+    case X64_POPCNT: case X64_BSF: case X64_BSR: case X64_LZCNT: case X64_TZCNT:
+        encode_bits(m, ins->op, l, r);
+        break;
+    case X64_BSWAP: encode_bswap(m, l); break;
+    case X64_SHLX: case X64_SHRX: case X64_SARX: encode_bmi_shift(m, ins->op, ins); break;
+
+    case X64_ADDSS: case X64_ADDSD: case X64_SUBSS: case X64_SUBSD:
+    case X64_MULSS: case X64_MULSD: case X64_DIVSS: case X64_DIVSD:
+    case X64_MINSS: case X64_MINSD: case X64_MAXSS: case X64_MAXSD:
+    case X64_UCOMISS: case X64_UCOMISD: case X64_CVTSS2SD: case X64_CVTSD2SS:
+        encode_sse(m, ins->op, l, r);
+        break;
+    case X64_VADDSS: case X64_VADDSD: case X64_VSUBSS: case X64_VSUBSD:
+    case X64_VMULSS: case X64_VMULSD: case X64_VDIVSS: case X64_VDIVSD:
+    case X64_VFMADD231SS: case X64_VFMADD231SD: case X64_VFMSUB231SS:
+    case X64_VFMSUB231SD: case X64_VFNMADD231SS: case X64_VFNMADD231SD:
+    case X64_VFMADD231PS: case X64_VFMADD231PD: case X64_VFMSUB231PS:
+    case X64_VFMSUB231PD: case X64_VFNMADD231PS: case X64_VFNMADD231PD:
+        encode_vex_sse(m, ins->op, ins);
+        break;
+
+    case X64_MOVD: case X64_MOVQ: encode_movd(m, ins->op, l, r); break;
+    case X64_PXOR: case X64_PADDB: case X64_PADDW: case X64_PADDD:
+    case X64_PADDQ: case X64_PSUBB: case X64_PSUBW: case X64_PSUBD:
+    case X64_PSUBQ: case X64_PMULLW: case X64_PMULUDQ: case X64_PAND:
+    case X64_POR:
+    case X64_ADDPS: case X64_ADDPD: case X64_SUBPS: case X64_SUBPD:
+    case X64_MULPS: case X64_MULPD: case X64_DIVPS: case X64_DIVPD:
+    case X64_PUNPCKLBW: case X64_PUNPCKLWD: case X64_PUNPCKLDQ:
+    case X64_PUNPCKLQDQ: case X64_PACKSSWB: case X64_PACKSSDW:
+        encode_sse(m, ins->op, l, r);
+        break;
+    case X64_PSLLW: case X64_PSLLD: case X64_PSLLQ: case X64_PSRLW:
+    case X64_PSRLD: case X64_PSRLQ: case X64_PSRAW: case X64_PSRAD:
+    case X64_PSRLDQ:
+        encode_vec_shift(m, ins->op, l, r);
+        break;
+    case X64_CVTSI2SS: case X64_CVTSI2SD:
+        emit_modrm(m, ins->op == X64_CVTSI2SS ? 0xf3 : 0xf2, opr_bytes(r) == 8,
+                   0x0f2a, 0, l, r);
+        break;
+    case X64_CVTTSS2SI: case X64_CVTTSD2SI:
+        emit_modrm(m, ins->op == X64_CVTTSS2SI ? 0xf3 : 0xf2, opr_bytes(l) == 8,
+                   0x0f2c, 0, l, r);
+        break;
+
+    case X64_SETE: case X64_SETNE: case X64_SETL: case X64_SETLE:
+    case X64_SETG: case X64_SETGE: case X64_SETB: case X64_SETBE:
+    case X64_SETA: case X64_SETAE:
+        emit_modrm(m, 0, 0, 0x0f90 + CC[ins->op], 0, NULL, l);
+        break;
+    case X64_CMOVE: case X64_CMOVNE: case X64_CMOVL: case X64_CMOVLE:
+    case X64_CMOVG: case X64_CMOVGE: case X64_CMOVB: case X64_CMOVBE:
+    case X64_CMOVA: case X64_CMOVAE: {
+        int bytes = ins_bytes(l, r);
+        assert(l->k == OPR_GPR && bytes >= 4);
+        emit_modrm(m, 0, bytes == 8, 0x0f40 + CC[ins->op], 0, l, r);
+        break;
+    }
+
+    case X64_PUSH: case X64_POP: {
+        assert(l->k == OPR_GPR && l->size == R64);
+        int n = hw_reg(l);
+        emit_rex(m, n >> 3, 0);
+        emit_byte(m, (uint8_t) ((ins->op == X64_PUSH ? 0x50 : 0x58) + (n & 7)));
+        break;
+    }
+    case X64_PREFETCHT0: case X64_PREFETCHT1: case X64_PREFETCHT2:
+    case X64_PREFETCHNTA: {
+        static int EXT[] = { 1, 2, 3, 0 }; // In the ModR/M 'reg' field
+        assert(l->k == OPR_MEM);
+        emit_modrm(m, 0, 0, 0x0f18, EXT[ins->op - X64_PREFETCHT0], NULL, l);
+        break;
+    }
+    case X64_CALL:
+        if (l->k == OPR_LABEL) {
+            emit_byte(m, 0xe8);
+            m->fix = FIX_CALL;
+            m->fix_at = m->len;
+            m->label = l->label;
+            emit_imm(m, 0, 4);
+        } else { // Indirect
+            emit_modrm(m, 0, 0, 0xff, 2, NULL, l);
+            m->fix = l->k == OPR_GOTPCREL ? FIX_GOT_CALL : m->fix;
+        }
+        break;
+    case X64_TAIL_CALL:
+        if (l->k == OPR_LABEL) {
+            emit_byte(m, 0xe9);
+            m->fix = FIX_CALL;
+            m->fix_at = m->len;
+            m->label = l->label;
+            emit_imm(m, 0, 4);
+        } else { // Indirect
+            emit_modrm(m, 0, 0, 0xff, 4, NULL, l);
+            m->fix = l->k == OPR_GOTPCREL ? FIX_GOT_CALL : m->fix;
+        }
+        break;
+    case X64_JMP: // Indirect (through a jump table)
+        emit_modrm(m, 0, 0, 0xff, 4, NULL, l);
+        break;
+    case X64_RET: emit_byte(m, 0xc3); break;
+    case X64_SYSCALL: emit_byte(m, 0x0f); emit_byte(m, 0x05); break;
+    case X64_UD2:     emit_byte(m, 0x0f); emit_byte(m, 0x0b); break;
+
+    case X64_LOCK:   emit_byte(m, 0xf0); break;
+    case X64_PAUSE:  emit_byte(m, 0xf3); emit_byte(m, 0x90); break;
+    case X64_RDTSC:  emit_byte(m, 0x0f); emit_byte(m, 0x31); break;
+    case X64_MFENCE: emit_opcode(m, 0x0faef0); break;
+    case X64_LFENCE: emit_opcode(m, 0x0faee8); break;
+    case X64_SFENCE: emit_opcode(m, 0x0faef8); break;
+    case X64_NOP:    emit_byte(m, 0x90); break;
+    case X64_LOCK_CMPXCHG: case X64_LOCK_XADD:
+        emit_byte(m, 0xf0); // Fall through
+    case X64_CMPXCHG: case X64_XADD: case X64_XCHG: {
+        if (l->k == OPR_GPR && r->k != OPR_GPR) { // 'xchg r, m' is 'xchg m, r'
+            AsmOpr *tmp = l;
+            l = r, r = tmp;
+        }
+        int bytes = ins_bytes(l, r), is_byte = bytes == 1;
+        uint32_t code = ins->op == X64_CMPXCHG || ins->op == X64_LOCK_CMPXCHG ? 0x0fb0 :
+                        ins->op == X64_XADD || ins->op == X64_LOCK_XADD ? 0x0fc0 : 0x86;
+        assert(r->k == OPR_GPR);
+        emit_modrm(m, size_prefix(bytes), bytes == 8, is_byte ? code : code + 1, 0, r, l);
+        break;
+    }
+    default: UNREACHABLE(); // Jumps to BBs are encoded by 'encode_fn'
+    }
+}
+
+
+// ---- Inline Assembly -------------------------------------------------------
+
+// Templates are parsed into instructions here, with the block's operands in
+// place of each '%0', etc. Only instructions that 'encode_ins' knows how to
+// encode can be written, and there's no way to jump or call out of a block
+
+typedef struct {
+    AsmIns *block; // X64_ASM
+    char *c;       // Current position in the template
+    AsmIns *head, *last;
+} AsmParser;
+
+static int is_word_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_';
+}
+
+static void skip_spaces(AsmParser *p) {
+    while (*p->c == ' ' || *p->c == '\t') {
+        p->c++;
+    }
+}
+
+static int at_end_of_line(AsmParser *p) {
+    skip_spaces(p);
+    return *p->c == '\0' || *p->c == '\n' || *p->c == ';';
+}
+
+static size_t read_word(AsmParser *p, char **word) {
+    skip_spaces(p);
+    *word = p->c;
+    while (is_word_char(*p->c)) {
+        p->c++;
+    }
+    return (size_t) (p->c - *word);
+}
+
+static int next_is(AsmParser *p, char c) {
+    skip_spaces(p);
+    if (*p->c == c) {
+        p->c++;
+        return 1;
+    }
+    return 0;
+}
+
+static void asm_error(AsmParser *p, char *msg) {
+    char *end = p->c;
+    while (*end && *end != '\n') {
+        end++;
+    }
+    error("%s in inline assembly, at '%.*s'", msg, (int) (end - p->c), p->c);
+}
+
+static AsmOpr * new_opr(int k) {
+    AsmOpr *opr = arena_alloc(ARENA_ASM, sizeof(AsmOpr));
+    memset(opr, 0, sizeof(AsmOpr));
+    opr->k = k;
+    return opr;
+}
+
+static AsmOpr * read_template_opr(AsmParser *p) {
+    int modifier;
+    int idx = read_asm_opr(p->block->block->inline_asm, &p->c, &modifier);
+    assert(idx >= 0); // Checked by the parser
+    return asm_template_opr(p->block, idx, modifier);
+}
+
+static int64_t read_number(AsmParser *p) {
+    char *word;
+    size_t len = read_word(p, &word);
+    char *end;
+    int64_t v = (int64_t) strtoull(word, &end, 0);
+    if (len == 0 || end != word + len) {
+        asm_error(p, "expected a number");
+    }
+    return v;
+}
+
+// '[base + idx*scale + disp]'; each part can be an operand from the block
+static AsmOpr * read_mem(AsmParser *p) {
+    AsmOpr *mem = new_opr(OPR_MEM);
+    mem->scale = 1;
+    int sign = 1;
+    do {
+        skip_spaces(p);
+        char *word;
+        size_t len;
+        AsmOpr *part = NULL;
+        int size;
+        if (*p->c == '%') {
+            p->c++;
+            part = read_template_opr(p);
+        } else if (*p->c >= '0' && *p->c <= '9') {
+            mem->disp += sign * read_number(p);
+            continue;
+        } else if ((len = read_word(p, &word)) > 0) {
+            int reg = nasm_gpr(word, len, &size);
+            if (reg == R_NONE || size != R64) {
+                asm_error(p, "expected a 64-bit register");
+            }
+            part = new_opr(OPR_GPR);
+            part->reg = reg;
+            part->size = size;
+        }
+        if (!part) {
+            asm_error(p, "bad memory operand");
+        } else if (part->k == OPR_MEM && sign > 0 && !mem->base) {
+            int64_t disp = mem->disp; // The whole address of a memory operand
+            *mem = *part;
+            mem->disp += disp;
+        } else if (part->k == OPR_IMM) {
+            mem->disp += sign * (int64_t) part->imm;
+        } else if (part->k == OPR_GPR && sign > 0 && next_is(p, '*')) {
+            mem->idx = part->reg;
+            mem->idx_size = R64;
+            mem->scale = (int) read_number(p);
+        } else if (part->k == OPR_GPR && sign > 0 && !mem->base) {
+            mem->base = part->reg;
+            mem->base_size = R64;
+        } else if (part->k == OPR_GPR && sign > 0 && !mem->idx) {
+            mem->idx = part->reg;
+            mem->idx_size = R64;
+        } else {
+            asm_error(p, "bad memory operand");
+        }
+    } while ((next_is(p, '+') && (sign = 1)) || (next_is(p, '-') && (sign = -1)));
+    if (!next_is(p, ']')) {
+        asm_error(p, "expected ']'");
+    }
+    if (mem->k == OPR_MEM && (!mem->base || (mem->scale != 1 && mem->scale != 2 &&
+            mem->scale != 4 && mem->scale != 8))) {
+        asm_error(p, "bad memory operand");
+    }
+    return mem;
+}
+
+static size_t MEM_SIZES[] = { 1, 2, 4, 8, 16 };
+static char *MEM_SIZE_NAMES[] = { "byte", "word", "dword", "qword", "oword" };
+
+static AsmOpr * read_opr(AsmParser *p) {
+    skip_spaces(p);
+    size_t bytes = 0;
+    char *word = p->c;
+    size_t len = read_word(p, &word);
+    for (int i = 0; i < 5 && len > 0; i++) {
+        if (strlen(MEM_SIZE_NAMES[i]) == len && strncmp(word, MEM_SIZE_NAMES[i], len) == 0) {
+            bytes = MEM_SIZES[i];
+            len = read_word(p, &word);
+            break;
+        }
+    }
+    AsmOpr *opr = NULL;
+    int size, reg;
+    if (len > 0 && (reg = nasm_gpr(word, len, &size)) != R_NONE) {
+        opr = new_opr(OPR_GPR);
+        opr->reg = reg;
+        opr->size = size;
+    } else if (len > 0 && (reg = nasm_xmm(word, len)) != R_NONE) {
+        opr = new_opr(OPR_XMM);
+        opr->reg = reg;
+    } else if (len > 0 && *word >= '0' && *word <= '9') {
+        p->c = word;
+        opr = new_opr(OPR_IMM);
+        opr->imm = (uint64_t) read_number(p);
+    } else if (len > 0) {
+        asm_error(p, "unknown operand");
+    } else if (next_is(p, '-')) {
+        opr = new_opr(OPR_IMM);
+        opr->imm = (uint64_t) -read_number(p);
+    } else if (next_is(p, '%')) {
+        opr = read_template_opr(p);
+    } else if (next_is(p, '[')) {
+        opr = read_mem(p);
+    } else {
+        asm_error(p, "expected an operand");
+    }
+    if (bytes && (opr->k == OPR_MEM || opr->k == OPR_DEREF)) {
+        AsmOpr *sized = new_opr(opr->k);
+        *sized = *opr;
+        sized->bytes = bytes;
+        opr = sized;
+    }
+    return opr;
+}
+
+static void add_ins(AsmParser *p, int op, AsmOpr *l, AsmOpr *r) {
+    AsmIns *ins = arena_alloc(ARENA_ASM, sizeof(AsmIns));
+    memset(ins, 0, sizeof(AsmIns));
+    ins->op = op;
+    ins->line = p->block->line;
+    ins->l = l;
+    ins->r = r;
+    ins->block = p->block->block; // Marks it as from inline assembly
+    ins->bb = p->block->bb;
+    ins->prev = p->last;
+    if (p->last) {
+        p->last->next = ins;
+    } else {
+        p->head = ins;
+    }
+    p->last = ins;
+}
+
+static int num_oprs_for(int op) {
+    switch (op) {
+    case X64_CWD: case X64_CDQ: case X64_CQO: case X64_REP_MOVSB:
+    case X64_REP_STOSB: case X64_SYSCALL: case X64_UD2: case X64_LOCK: case X64_PAUSE:
+    case X64_RDTSC: case X64_MFENCE: case X64_LFENCE: case X64_SFENCE:
+    case X64_NOP:
+        return 0;
+    case X64_MUL: case X64_IDIV: case X64_DIV: case X64_BSWAP: case X64_PUSH: case X64_POP:
+    case X64_PREFETCHT0: case X64_PREFETCHT1: case X64_PREFETCHT2: case X64_PREFETCHNTA:
+        return 1;
+    case X64_SHLX: case X64_SHRX: case X64_SARX:
+        return 3;
+    default:
+        if ((op >= X64_VADDSS && op <= X64_VFNMADD231SD) ||
+                (op >= X64_VFMADD231PS && op <= X64_VFNMADD231PD)) {
+            return 3;
+        }
+        return (op >= X64_SETE && op <= X64_SETAE) ? 1 : 2;
+    }
+}
+
+static void read_ins(AsmParser *p) {
+    char *start = p->c, *name;
+    size_t len = read_word(p, &name);
+    if (len == 4 && strncmp(name, "lock", 4) == 0) {
+        add_ins(p, X64_LOCK, NULL, NULL);
+        start = p->c;
+        len = read_word(p, &name);
+    }
+    char rep[16];
+    if (len == 3 && strncmp(name, "rep", 3) == 0) { // 'rep movsb' is one opcode
+        len = read_word(p, &name);
+        snprintf(rep, sizeof(rep), "rep %.*s", len < 8 ? (int) len : 8, name);
+        name = rep;
+        len = strlen(rep);
+    }
+    int op = nasm_opcode(name, len);
+    if (op < 0 || (op >= X64_JMP && op <= X64_RET) || op == X64_ASM ||
+            op == X64_ASM_CLOBBER) {
+        p->c = start;
+        asm_error(p, "unsupported instruction");
+    }
+    AsmOpr *l = NULL, *r = NULL, *r2 = NULL;
+    int num_oprs = 0;
+    if (!at_end_of_line(p)) {
+        l = read_opr(p);
+        num_oprs++;
+        if (next_is(p, ',')) {
+            r = read_opr(p);
+            num_oprs++;
+            if (next_is(p, ',')) {
+                r2 = read_opr(p);
+                num_oprs++;
+            }
+        }
+    }
+    if (!at_end_of_line(p) || num_oprs != num_oprs_for(op)) {
+        p->c = start;
+        asm_error(p, "wrong number of operands");
+    }
+    add_ins(p, op, l, r);
+    p->last->r2 = r2;
+}
+
+// The 'mov's into fixed pregs, then the template's instructions
+static void parse_inline_asm(AsmParser *p, AsmIns *clobber) {
+    AsmBlock *b = clobber->block;
+    for (int i = 0; i < b->inline_asm->num_oprs; i++) {
+        if (b->fixed[i]) {
+            add_ins(p, X64_MOV, b->oprs[i], b->fixed[i]);
+        }
+    }
+    if (b->inline_asm->is_basic && strchr(b->inline_asm->template, '%')) {
+        p->c = strchr(b->inline_asm->template, '%');
+        asm_error(p, "unexpected '%'");
+    }
+    p->c = b->inline_asm->template;
+    while (*p->c) {
+        if (!at_end_of_line(p)) {
+            read_ins(p);
+        }
+        while (*p->c && *p->c != '\n') { // Skip comments
+            p->c++;
+        }
+        if (*p->c == '\n') {
+            p->c++;
+        }
+    }
+}
+
+// Replaces each X64_ASM_CLOBBER and X64_ASM pair with the instructions they
+// stand for
+static void expand_inline_asm(Fn *fn) {
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        AsmIns *next;
+        for (AsmIns *ins = bb->asm_head; ins; ins = next) {
+            next = ins->next;
+            if (ins->op != X64_ASM_CLOBBER) {
+                continue;
+            }
+            AsmIns *block = ins->next;
+            assert(block && block->op == X64_ASM);
+            next = block->next;
+            AsmParser p = { .block = block, .c = NULL, .head = NULL, .last = NULL };
+            parse_inline_asm(&p, ins);
+            AsmIns *before = ins->prev;
+            if (p.head) {
+                p.head->prev = before;
+                p.last->next = next;
+            }
+            AsmIns *first = p.head ? p.head : next, *last = p.last ? p.last : before;
+            if (before) before->next = first; else bb->asm_head = first;
+            if (next) next->prev = last; else bb->asm_last = last;
+        }
+    }
+}
+
+
+// ---- Symbols ---------------------------------------------------------------
+
+struct Encoder {
+    Object *obj;
+    Map *syms; // of 'Symbol *'; by interned label
+};
+
+// Symbols that are referenced before (or without) being defined start off
+// undefined. The name's interned, since the label can be in a function's
+// assembly, which is freed once it's encoded
+static Symbol * find_sym(Encoder *e, char *label) {
+    char *key = intern(label);
+    Symbol *sym = map_get(e->syms, key);
+    if (!sym) {
+        sym = calloc(1, sizeof(Symbol));
+        sym->name = key;
+        sym->section = SEC_UNDEF;
+        sym->is_global = 1;
+        map_put(e->syms, key, sym);
+        vec_push(e->obj->syms, sym);
+    }
+    return sym;
+}
+
+static Symbol * def_sym(Encoder *e, Global *g, int section, uint64_t offset) {
+    Symbol *sym = find_sym(e, g->label);
+    sym->section = section;
+    sym->offset = sym->start = offset;
+    sym->align = g->t->align > 0 ? g->t->align : 1;
+    sym->is_global = g->linkage != LINK_STATIC;
+    sym->is_hidden = is_hidden(g);
+    sym->is_fn = g->k == G_FN_DEF;
+    sym->fn_attrs = g->fn_attrs;
+    sym->is_tls = g->is_tls;
+    return sym;
+}
+
+static void add_reloc(Vec *relocs, int k, uint64_t offset, Symbol *sym,
+                      int64_t addend, int pc_bias) {
+    Reloc *r = malloc(sizeof(Reloc));
+    r->k = k;
+    r->offset = offset;
+    r->sym = sym;
+    r->addend = addend;
+    r->pc_bias = pc_bias;
+    vec_push(relocs, r);
+}
+
+static void push_bytes(Buf *b, uint64_t v, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        buf_push(b, (char) (v >> (i * 8)));
+    }
+}
+
+static void pad_to(Buf *b, size_t align) {
+    while (align > 1 && b->len % align != 0) {
+        buf_push(b, 0);
+    }
+}
+
+// The longest single 'nop's (the recommended forms of '0f 1f /0'), so padding
+// decodes as few instructions as possible
+#define MAX_NOP 9
+static uint8_t NOPS[MAX_NOP][MAX_NOP] = {
+    { 0x90 },
+    { 0x66, 0x90 },
+    { 0x0f, 0x1f, 0x00 },
+    { 0x0f, 0x1f, 0x40, 0x00 },
+    { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+    { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+    { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+    { 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    { 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+};
+
+static void emit_nops(Buf *b, size_t n) {
+    while (n > 0) {
+        size_t len = n < MAX_NOP ? n : MAX_NOP;
+        for (size_t i = 0; i < len; i++) {
+            buf_push(b, (char) NOPS[len - 1][i]);
+        }
+        n -= len;
+    }
+}
+
+
+// ---- Stack Frames ----------------------------------------------------------
+
+// The frame is followed through the prologue ('push rbp', 'mov rbp, rsp',
+// 'sub rsp', and the 'mov's that save callee-saved GPRs, which are all in one
+// BB: the entry BB, unless 'shrink_wrap' moved them) and each epilogue ('add
+// rsp', or 'mov rsp, rbp' if the prologue realigned rsp, then 'pop rbp'). Code
+// after a 'ret' or a tail call is reached by a jump from the body of the
+// function, so the frame goes back to how it was at the end of the prologue
+// (or to no frame at all, for an early return laid out before the prologue)
+
+typedef struct {
+    FrameRow cur, body; // 'body' is the frame once the prologue's done
+    int64_t sp, body_sp; // rsp is the CFA - 'sp'
+    int64_t fp;          // rbp is the CFA - 'fp', once it's set
+    int in_epilogue;
+} Frame;
+
+static int is_callee_saved(int reg) {
+    return reg == RBX || reg == RBP || (reg >= R12 && reg <= R15);
+}
+
+static int is_gpr64(AsmOpr *opr, int reg) {
+    return opr && opr->k == OPR_GPR && opr->size == R64 && (reg == R_NONE || opr->reg == reg);
+}
+
+// Saves that end up below rsp as the frame's popped have already been
+// restored (by the epilogue's 'mov's before the 'add rsp')
+static void set_sp(Frame *f, int64_t sp) {
+    for (int reg = RAX; sp < f->sp && reg < LAST_GPR; reg++) {
+        if (f->cur.saved[reg] > sp) {
+            f->cur.saved[reg] = 0;
+        }
+    }
+    f->sp = sp;
+    if (f->cur.cfa_reg == RSP) {
+        f->cur.cfa_off = sp;
+    }
+}
+
+// 'mov [rsp/rbp + disp], <callee-saved GPR>', the first time that GPR's saved
+static int is_save(Frame *f, AsmIns *ins) {
+    AsmOpr *dst = ins->l;
+    if (!dst || dst->k != OPR_MEM || dst->idx != R_NONE || dst->bytes != 8 ||
+            !is_gpr64(ins->r, R_NONE) || !is_callee_saved(ins->r->reg) ||
+            f->cur.saved[ins->r->reg] != 0) {
+        return 0;
+    }
+    return dst->base == RSP || (dst->base == RBP && f->cur.cfa_reg == RBP);
+}
+
+// Returns 1 if 'ins' changes the frame
+static int track_frame(Frame *f, AsmIns *ins, int in_prologue) {
+    if (ins->block) {
+        return 0; // Inline assembly
+    }
+    FrameRow prev = f->cur;
+    int grows = 0;
+    switch (ins->op) {
+    case X64_PUSH:
+        set_sp(f, f->sp + 8);
+        if (is_gpr64(ins->l, R_NONE) && is_callee_saved(ins->l->reg) &&
+                f->cur.saved[ins->l->reg] == 0) {
+            f->cur.saved[ins->l->reg] = f->sp;
+        }
+        grows = 1;
+        break;
+    case X64_POP:
+        if (is_gpr64(ins->l, RBP) && f->cur.cfa_reg == RBP) {
+            f->cur.cfa_reg = RSP;
+        }
+        set_sp(f, f->sp - 8);
+        f->in_epilogue = 1;
+        break;
+    case X64_SUB: case X64_ADD:
+        if (!is_gpr64(ins->l, RSP) || ins->r->k != OPR_IMM) {
+            break;
+        }
+        grows = ins->op == X64_SUB;
+        f->in_epilogue |= !grows;
+        set_sp(f, f->sp + (grows ? 1 : -1) * (int64_t) ins->r->imm);
+        break;
+    case X64_MOV:
+        if (is_gpr64(ins->l, RBP) && is_gpr64(ins->r, RSP)) {
+            f->cur.cfa_reg = RBP;
+            f->cur.cfa_off = f->fp = f->sp;
+            grows = 1;
+        } else if (is_gpr64(ins->l, RSP) && is_gpr64(ins->r, RBP)) {
+            set_sp(f, f->fp); // Epilogue of a realigned frame
+            f->in_epilogue = 1;
+        } else if (in_prologue && !f->in_epilogue && is_save(f, ins)) {
+            AsmOpr *dst = ins->l;
+            f->cur.saved[ins->r->reg] = (dst->base == RSP ? f->sp : f->fp) - dst->disp;
+            grows = 1;
+        }
+        break;
+    case X64_RET: case X64_TAIL_CALL:
+        f->cur = f->body;
+        f->sp = f->body_sp;
+        break;
+    }
+    if (grows && !f->in_epilogue) {
+        f->body = f->cur;
+        f->body_sp = f->sp;
+    }
+    return prev.cfa_reg != f->cur.cfa_reg || prev.cfa_off != f->cur.cfa_off ||
+           memcmp(prev.saved, f->cur.saved, sizeof(prev.saved)) != 0;
+}
+
+
+// ---- Functions -------------------------------------------------------------
+
+typedef struct {
+    MachIns m;    // For everything other than jumps to BBs
+    BB *target;   // 'jmp' or 'jcc' to a BB
+    int op, is_long;
+    size_t offset; // From the start of the function's code
+    FrameRow *frame; // If the frame changes after it
+    int line;
+} Slot;
+
+static int is_jmp(int op) {
+    return op >= X64_JMP && op <= X64_JAE;
+}
+
+static size_t slot_len(Slot *s) {
+    if (!s->target) {
+        return (size_t) s->m.len;
+    } else if (!s->is_long) {
+        return 2; // 'eb/7x <rel8>'
+    }
+    return s->op == X64_JMP ? 5 : 6; // 'e9 <rel32>' or '0f 8x <rel32>'
+}
+
+static void emit_jmp(Buf *text, Slot *s, int64_t disp) {
+    if (!s->is_long) {
+        assert(fits_i8(disp));
+        buf_push(text, (char) (s->op == X64_JMP ? 0xeb : 0x70 + CC[s->op]));
+        push_bytes(text, (uint64_t) disp, 1);
+    } else {
+        assert(fits_i32(disp));
+        if (s->op == X64_JMP) {
+            buf_push(text, (char) 0xe9);
+        } else {
+            buf_push(text, 0x0f);
+            buf_push(text, (char) (0x80 + CC[s->op]));
+        }
+        push_bytes(text, (uint64_t) disp, 4);
+    }
+}
+
+// Assigns offsets to every instruction and BB, with the start of each loop at
+// 'ALIGN_LOOPS' (given the code starts at 'code_start' in '.text'); returns
+// the size of the code
+static size_t layout_slots(Fn *fn, Slot *slots, size_t code_start, size_t *bb_first,
+                           size_t *bb_off) {
+    size_t off = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        if (is_loop_start(bb)) {
+            off += pad(code_start + off, (size_t) ALIGN_LOOPS);
+        }
+        bb_off[bb->n] = off;
+        for (size_t i = bb_first[bb->n]; i < bb_first[bb->n + 1]; i++) {
+            slots[i].offset = off;
+            off += slot_len(&slots[i]);
+        }
+    }
+    return off;
+}
+
+static void relax_jmps(Fn *fn, Slot *slots, size_t num_slots, size_t code_start,
+                       size_t *bb_first, size_t *bb_off) {
+    int changed = 1;
+    while (changed) {
+        layout_slots(fn, slots, code_start, bb_first, bb_off);
+        changed = 0;
+        for (size_t i = 0; i < num_slots; i++) {
+            Slot *s = &slots[i];
+            if (!s->target || s->is_long) {
+                continue;
+            }
+            int64_t disp = (int64_t) bb_off[s->target->n] - (int64_t) (s->offset + 2);
+            if (!fits_i8(disp)) {
+                s->is_long = 1;
+                changed = 1;
+            }
+        }
+    }
+}
+
+static void emit_slot(Encoder *e, Slot *s, size_t code_start, size_t *table_start,
+                      size_t *bb_off) {
+    Buf *text = e->obj->text;
+    size_t start = code_start + s->offset;
+    if (s->target) {
+        int64_t disp = (int64_t) bb_off[s->target->n] - (int64_t) (s->offset + slot_len(s));
+        emit_jmp(text, s, disp);
+        return;
+    }
+    MachIns *m = &s->m;
+    for (int i = 0; i < m->len; i++) {
+        buf_push(text, (char) m->bytes[i]);
+    }
+    size_t field = start + m->fix_at;
+    int pc_bias = m->len - m->fix_at; // To the end of the instruction
+    switch (m->fix) {
+    case FIX_NONE: break;
+    case FIX_LABEL:
+        add_reloc(e->obj->text_relocs, RELOC_PC32, field, find_sym(e, m->label), 0, pc_bias);
+        break;
+    case FIX_CALL:
+        add_reloc(e->obj->text_relocs, RELOC_CALL, field, find_sym(e, m->label), 0, pc_bias);
+        break;
+    case FIX_TPOFF:
+        add_reloc(e->obj->text_relocs, RELOC_TPOFF32, field, find_sym(e, m->label), 0, 0);
+        break;
+    case FIX_GOTTPOFF:
+        add_reloc(e->obj->text_relocs, RELOC_GOTTPOFF, field, find_sym(e, m->label), 0, pc_bias);
+        break;
+    case FIX_GOT_LOAD:
+        add_reloc(e->obj->text_relocs, RELOC_GOT_LOAD, field, find_sym(e, m->label), 0, pc_bias);
+        break;
+    case FIX_GOT_CALL:
+        add_reloc(e->obj->text_relocs, RELOC_GOT_CALL, field, find_sym(e, m->label), 0, pc_bias);
+        break;
+    case FIX_TABLE: case FIX_BB: {
+        size_t target = m->fix == FIX_TABLE ? table_start[m->table] :
+                        code_start + bb_off[m->bb->n];
+        int64_t disp = (int64_t) target - (int64_t) (start + (size_t) m->len);
+        uint32_t d = (uint32_t) disp;
+        for (int i = 0; i < 4; i++) {
+            text->data[field + i] = (char) (d >> (i * 8));
+        }
+        break;
+    }
+    default: UNREACHABLE();
+    }
+}
+
+// The frame changes after a slot, and the line at it. Code before the first
+// line (i.e., the prologue) is given the first line
+static void add_rows(Symbol *sym, Slot *s) {
+    uint64_t end = s->offset + slot_len(s);
+    if (s->frame && end < sym->size) {
+        s->frame->offset = end;
+        vec_push(sym->frame, s->frame);
+    } else {
+        free(s->frame);
+    }
+    LineRow *last = vec_len(sym->lines) > 0 ? vec_tail(sym->lines) : NULL;
+    if (s->line != 0 && (!last || last->line != s->line)) {
+        LineRow *row = malloc(sizeof(LineRow));
+        row->offset = last ? s->offset : 0;
+        row->line = s->line;
+        vec_push(sym->lines, row);
+    }
+}
+
+static void encode_fn(Encoder *e, Global *g) {
+    Fn *fn = g->fn;
+    Buf *text = e->obj->text;
+    size_t fn_start = text->len;
+    size_t num_tables = vec_len(fn->jump_tables);
+    size_t *table_start = malloc(sizeof(size_t) * (num_tables + 1));
+    for (size_t i = 0; i < num_tables; i++) { // Filled in once the code's laid out
+        table_start[i] = text->len;
+        buf_zeros(text, vec_len(vec_get(fn->jump_tables, i)) * 8);
+    }
+    emit_nops(text, pad(text->len, (size_t) ALIGN_FUNCTIONS));
+    size_t code_start = text->len;
+    Symbol *sym = def_sym(e, g, SEC_TEXT, code_start);
+    sym->start = fn_start;
+    sym->align = e->obj->text_align;
+
+    expand_inline_asm(fn);
+    size_t num_bbs = 0, num_slots = 0;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb->n = num_bbs++;
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            num_slots++;
+        }
+    }
+    Slot *slots = calloc(num_slots, sizeof(Slot));
+    size_t *bb_first = malloc(sizeof(size_t) * (num_bbs + 1));
+    size_t *bb_off = malloc(sizeof(size_t) * num_bbs);
+    size_t i = 0;
+    AsmIns *prologue = vec_get(fn->patch_with_stack_size, 0); // Even if deleted
+    Frame frame = { .cur = { .cfa_reg = RSP, .cfa_off = 8 }, .sp = 8 };
+    frame.body = frame.cur;
+    frame.body_sp = frame.sp;
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        bb_first[bb->n] = i;
+        for (AsmIns *ins = bb->asm_head; ins; ins = ins->next) {
+            Slot *s = &slots[i++];
+            s->op = ins->op;
+            s->line = ins->line;
+            if (track_frame(&frame, ins, bb == prologue->bb)) {
+                s->frame = malloc(sizeof(FrameRow));
+                *s->frame = frame.cur;
+            }
+            if (is_jmp(ins->op) && ins->l->k == OPR_BB) {
+                s->target = ins->l->bb;
+            } else {
+                encode_ins(&s->m, ins);
+            }
+        }
+    }
+    bb_first[num_bbs] = num_slots;
+
+    relax_jmps(fn, slots, num_slots, code_start, bb_first, bb_off);
+    for (i = 0; i < num_tables; i++) { // Offsets from the start of the table
+        Vec *table = vec_get(fn->jump_tables, i);
+        for (size_t j = 0; j < vec_len(table); j++) {
+            BB *target = vec_get(table, j);
+            uint64_t off = code_start + bb_off[target->n] - table_start[i];
+            for (int k = 0; k < 8; k++) {
+                text->data[table_start[i] + j * 8 + k] = (char) (off >> (k * 8));
+            }
+        }
+    }
+    for (BB *bb = fn->entry; bb; bb = bb->next) {
+        emit_nops(text, code_start + bb_off[bb->n] - text->len); // Loop alignment
+        for (i = bb_first[bb->n]; i < bb_first[bb->n + 1]; i++) {
+            emit_slot(e, &slots[i], code_start, table_start, bb_off);
+        }
+    }
+    sym->size = text->len - code_start;
+    sym->frame = vec_new();
+    sym->lines = vec_new();
+    sym->file = fn->file;
+    for (i = 0; i < num_slots; i++) {
+        add_rows(sym, &slots[i]);
+    }
+    free(table_start);
+    free(slots);
+    free(bb_first);
+    free(bb_off);
+}
+
+
+// ---- Data ------------------------------------------------------------------
+
+// Relocations are only ever in '.data' (or '.tdata'); 'global_section' keeps
+// anything with one out of '.rodata'
+static void encode_val(Encoder *e, Buf *data, Vec *relocs, Global *g) {
+    switch (g->k) {
+    case G_IMM: push_bytes(data, g->imm, g->t->size); break;
+    case G_FP:
+        if (g->t->size == 4) {
+            float f = (float) g->fp;
+            uint32_t bits;
+            memcpy(&bits, &f, sizeof(bits));
+            push_bytes(data, bits, 4);
+        } else {
+            uint64_t bits;
+            memcpy(&bits, &g->fp, sizeof(bits));
+            push_bytes(data, bits, 8);
+        }
+        break;
+    case G_INIT: {
+        size_t start = data->len;
+        buf_nprint(data, g->bytes, g->num_bytes);
+        buf_zeros(data, g->t->size - g->num_bytes);
+        for (size_t i = 0; i < vec_len(g->relocs); i++) {
+            InitReloc *r = vec_get(g->relocs, i);
+            add_reloc(relocs, RELOC_ABS64, start + r->offset,
+                      find_sym(e, r->g->label), r->addend, 0);
+        }
+        break;
+    }
+    case G_PTR:
+        add_reloc(relocs, RELOC_ABS64, data->len, find_sym(e, g->g->label),
+                  g->offset, 0);
+        push_bytes(data, 0, 8);
+        break;
+    default: UNREACHABLE();
+    }
+}
+
+static void encode_global(Encoder *e, Global *g) {
+    Object *obj = e->obj;
+    size_t align = g->t->align > 0 ? g->t->align : 1;
+    int section = global_section(g);
+    if (section == SEC_BSS || section == SEC_TBSS) { // No contents, just a size
+        uint64_t *size = section == SEC_BSS ? &obj->bss_size : &obj->tbss_size;
+        size_t *max_align = section == SEC_BSS ? &obj->bss_align : &obj->tbss_align;
+        *size += pad(*size, align);
+        if (align > *max_align) {
+            *max_align = align;
+        }
+        Symbol *sym = def_sym(e, g, section, *size);
+        sym->size = g->t->size;
+        *size += g->t->size;
+        return;
+    }
+    if (section == SEC_CSTRING) { // Nothing in between, so the linker can split them up
+        Symbol *sym = def_sym(e, g, SEC_CSTRING, obj->cstrings->len);
+        encode_val(e, obj->cstrings, obj->data_relocs, g);
+        sym->size = obj->cstrings->len - sym->offset;
+        return;
+    }
+    Buf *data = obj->data;
+    size_t *max_align = &obj->data_align;
+    Vec *relocs = obj->data_relocs;
+    if (section == SEC_RODATA) {
+        data = obj->rodata;
+        max_align = &obj->rodata_align;
+    } else if (section == SEC_TDATA) {
+        data = obj->tdata;
+        max_align = &obj->tdata_align;
+        relocs = obj->tdata_relocs;
+    }
+    pad_to(data, align);
+    if (align > *max_align) {
+        *max_align = align;
+    }
+    Symbol *sym = def_sym(e, g, section, data->len);
+    encode_val(e, data, relocs, g);
+    sym->size = data->len - sym->offset;
+}
+
+// Each constant gets a local symbol, which still points at it once the linker
+// has merged the pool with other objects'
+static void encode_fp_pool(Encoder *e, Vec *globals) {
+    for (int k = OPR_F32; k <= OPR_F64; k++) {
+        size_t size = k == OPR_F32 ? 4 : 8;
+        Buf *pool = k == OPR_F32 ? e->obj->cst4 : e->obj->cst8;
+        Vec *fps = fp_pool(globals, k);
+        for (size_t i = 0; i < vec_len(fps); i++) {
+            uint64_t bits = *((uint64_t *) vec_get(fps, i));
+            Symbol *sym = find_sym(e, fp_label(k, bits));
+            sym->section = k == OPR_F32 ? SEC_CST4 : SEC_CST8;
+            sym->offset = sym->start = pool->len;
+            sym->size = sym->align = size;
+            sym->is_global = 0;
+            push_bytes(pool, bits, size);
+        }
+    }
+}
+
+Encoder * x64_begin() {
+    Object *obj = calloc(1, sizeof(Object));
+    obj->text = buf_new();
+    obj->rodata = buf_new();
+    obj->cst4 = buf_new();
+    obj->cst8 = buf_new();
+    obj->cstrings = buf_new();
+    obj->data = buf_new();
+    obj->tdata = buf_new();
+    obj->rodata_align = obj->data_align = obj->bss_align = 1;
+    obj->tdata_align = obj->tbss_align = 1;
+    obj->text_align = 16; // Enough for whatever '-falign-' asks for
+    if ((size_t) ALIGN_FUNCTIONS > obj->text_align) {
+        obj->text_align = (size_t) ALIGN_FUNCTIONS;
+    }
+    if ((size_t) ALIGN_LOOPS > obj->text_align) {
+        obj->text_align = (size_t) ALIGN_LOOPS;
+    }
+    obj->text_relocs = vec_new();
+    obj->data_relocs = vec_new();
+    obj->tdata_relocs = vec_new();
+    obj->syms = vec_new();
+    Encoder *e = malloc(sizeof(Encoder));
+    e->obj = obj;
+    e->syms = map_new();
+    return e;
+}
+
+void x64_encode_fn(Encoder *e, Global *g) {
+    encode_fn(e, g);
+}
+
+Object * x64_end(Encoder *e, Vec *globals) {
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k != G_FN_DEF && g->k != G_NONE) {
+            encode_global(e, g);
+        } else if (g->is_tls) { // Referenced thread-locals defined elsewhere
+            Symbol *sym = map_get(e->syms, intern(g->label));
+            if (sym) {
+                sym->is_tls = 1;
+            }
+        }
+    }
+    encode_fp_pool(e, globals);
+    Object *obj = e->obj;
+    map_free(e->syms);
+    free(e);
+    return obj;
+}
+
+Object * encode_x64(Vec *globals) {
+    Encoder *e = x64_begin();
+    for (size_t i = 0; i < vec_len(globals); i++) {
+        Global *g = vec_get(globals, i);
+        if (g->k == G_FN_DEF) {
+            x64_encode_fn(e, g);
+        }
+    }
+    return x64_end(e, globals);
+}
@@ -0,0 +1,104 @@
+
+#ifndef COSEC_X64_H
+#define COSEC_X64_H
+
+#include "assemble.h"
+
+// Machine code for x86-64. Encodes the assembly for a whole program into the
+// bytes for its text, read-only data, and data sections (plus the size of its
+// zero-filled '.bss'), and the same for its thread-locals, the symbols they
+// define, and the relocations the linker has to fill in; 'object.h' writes
+// these out in an object file format. Runs after 'reg_alloc', on physical
+// registers
+
+// A function's stack frame, for unwinding through it (see '.eh_frame' in
+// 'object.c'), from the end of the instruction at 'offset' on. The canonical
+// frame address (rsp before the call to the function) is 'cfa_reg' (RSP or
+// RBP) + 'cfa_off', and a callee-saved GPR 'reg' is saved 'saved[reg]' bytes
+// below it (0 if it isn't saved). Stack adjustments in inline assembly aren't
+// tracked
+typedef struct {
+    uint64_t offset; // From the function's symbol
+    int cfa_reg;
+    int64_t cfa_off;
+    int64_t saved[LAST_GPR];
+} FrameRow;
+
+// With '-g', the source line of the code from 'offset' on
+typedef struct {
+    uint64_t offset; // From the function's symbol
+    int line;
+} LineRow;
+
+typedef struct {
+    char *name; // Label, as in the assembly (e.g., '_main')
+    int section;
+    uint64_t offset, size; // Within 'section'
+    uint64_t start; // Where its bytes begin; before 'offset' for a function's
+                    // jump tables
+    size_t align;
+    int is_global, is_fn;
+    int is_hidden; // Global, but not exported from a shared library
+    int fn_attrs; // For a function; 'FA_*' (see 'section_name')
+    int is_tls; // A thread-local; its address is an offset into each thread's
+                // copy of '.tdata' and '.tbss'
+    size_t idx;  // For the object file writer
+    void *piece; // Likewise; the ELF section it ends up in
+
+    // For functions
+    Vec *frame; // of 'FrameRow *'; where the stack frame changes
+    Vec *lines; // of 'LineRow *'; with '-g', where the source line changes
+    char *file; // With '-g', the source file it's defined in
+} Symbol;
+
+enum { // Relocations
+    RELOC_ABS64, // 64-bit address of the symbol, e.g., in 'dq _x'
+    RELOC_PC32,  // 32-bit displacement from 'rip', e.g., in '[rel _x]'
+    RELOC_CALL,  // 32-bit displacement of a 'call' target
+    RELOC_TPOFF32,  // 32-bit offset of a thread-local from the thread pointer
+    RELOC_GOTTPOFF, // 32-bit displacement from 'rip' to a GOT entry with that
+                    // offset in it
+    RELOC_GOT_LOAD, // 32-bit displacement from 'rip' to a GOT entry with the
+                    // symbol's address in it, in a 'mov' (which the linker can
+                    // turn into a 'lea' if the symbol isn't preemptible)
+    RELOC_GOT_CALL, // Likewise, in a 'call' or 'jmp' through the GOT
+};
+
+typedef struct {
+    int k;
+    uint64_t offset; // Of the bytes to patch, within their section
+    Symbol *sym;
+    int64_t addend;  // Added to the symbol's address
+    int pc_bias;     // For PC-relative relocations, the number of bytes from
+                     // 'offset' to the end of the instruction (4 plus the size
+                     // of any immediate after the displacement)
+} Reloc;
+
+typedef struct {
+    Buf *text, *rodata, *data;
+    Buf *cst4, *cst8; // The floating point constant pool (see 'fp_pool')
+    Buf *cstrings;    // 'char' string literals, packed one after the other
+    size_t text_align, rodata_align, data_align;
+    uint64_t bss_size; // '.bss' has no contents
+    size_t bss_align;
+    Buf *tdata;          // Thread-locals, likewise
+    size_t tdata_align;
+    uint64_t tbss_size;
+    size_t tbss_align;
+    Vec *text_relocs, *data_relocs, *tdata_relocs; // of 'Reloc *'
+    Vec *syms; // of 'Symbol *'
+} Object;
+
+Object * encode_x64(Vec *globals);
+
+// The same, a function at a time: 'x64_encode_fn' is called on each function
+// definition in the order of 'globals' (as soon as it's through 'reg_alloc',
+// so its assembly can be freed straight after), then 'x64_end' encodes the
+// data and returns the object
+typedef struct Encoder Encoder;
+
+Encoder * x64_begin();
+void x64_encode_fn(Encoder *e, Global *g);
+Object * x64_end(Encoder *e, Vec *globals);
+
+#endif
@@ -1,8 +1,13 @@
 # Usage:
-#   python3 RunTests.py <path to Cosec executable> <path to test directory>
+#   python3 RunTests.py <path to Cosec executable> <path to test directory> [-j <jobs>]
 #   python3 ../tests/RunTests.py ./Cosec ../tests
+#
+# Each test is compiled, assembled, linked and run in its own temporary
+# directory, so they're run in parallel on a pool of workers (one per core by
+# default). Results are printed in order once they're all done.
 
-import subprocess, sys, os, re
+import subprocess, sys, os, re, time, tempfile, shutil
+from concurrent.futures import ThreadPoolExecutor
 
 GREEN = "\033[1m\033[92m"
 RED =   "\033[1m\033[91m"
@@ -13,67 +18,99 @@ nasm_args = ["-f", "macho64"]
 ld_bin = "ld"
 ld_args = ["-L/Library/Developer/CommandLineTools/SDKs/MacOSX.sdk/usr/lib", "-lSystem"]
 
+class Result:
+    def __init__(self, path):
+        self.path = path
+        self.passed = False
+        self.messages = []
+        self.compile_time = None
+
+    def fail(self, *messages):
+        self.messages += messages
+        return self
+
+def check_error(r, cosec_bin, path, flags, expected_error):
+    result = subprocess.run([cosec_bin, path, "-o", os.devnull] + flags, capture_output=True, text=True)
+    if result.returncode == 0:
+        return r.fail("Expected error: " + expected_error, "Compiled successfully")
+    if expected_error not in result.stdout + result.stderr:
+        return r.fail("Expected error: " + expected_error, "Output:", result.stdout + result.stderr)
+    r.passed = True
+    return r
+
 def run_test(cosec_bin, path):
-    f = open(path, "r")
-    contents = f.read()
-    print("Test '" + path + "': ", end="", flush=True)
+    r = Result(path)
+    with open(path, "r") as f:
+        contents = f.read()
+
+    # Any extra options to compile with
+    re_search = re.search(r'\/\/ flags\: (.*)', contents)
+    flags = [] if re_search is None else re_search.group(1).split()
+
+    # A test with '// error: ' has to be rejected with that message instead
+    re_search = re.search(r'\/\/ error\: (.*)', contents)
+    if re_search is not None:
+        return check_error(r, cosec_bin, path, flags, re_search.group(1).strip())
 
     # Find expected return code
     re_search = re.search(r'\/\/ expect\: (\d+)', contents)
     if re_search is None:
-        print(RED + "FAILED" + CLEAR)
-        print("\tNo '// expect: ' in file")
-        return
+        return r.fail("No '// expect: ' in file")
     groups = re_search.groups()
     if len(groups) == 0:
-        print(RED + "FAILED" + CLEAR)
-        print("\tNo matching regex '// expect: (\\d+)' in file")
-        return
+        return r.fail("No matching regex '// expect: (\\d+)' in file")
     expected_output = int(groups[0])
 
-    # Compile
-    result = subprocess.run([cosec_bin, path, "-o", "out.s"], capture_output=True, text=True)
-    if result.returncode != 0:
-        print(RED + "FAILED" + CLEAR)
-        print("\tFailed to compile")
-        print("\tOutput:")
-        print(result.stdout + result.stderr)
-        return
-
-    # Assemble
-    result = subprocess.run([nasm_bin] + nasm_args + ["-o", "out.o", "out.s"], capture_output=True, text=True)
-    if result.returncode != 0:
-        print(RED + "FAILED" + CLEAR)
-        print("\tFailed to assemble")
-        print("\tOutput:")
-        print(result.stdout + result.stderr)
-        return
-
-    # Link
-    result = subprocess.run([ld_bin] + ld_args + ["-o", "a.out", "out.o"], capture_output=True, text=True)
-    if result.returncode != 0:
-        print(RED + "FAILED" + CLEAR)
-        print("\tFailed to link")
-        print("\tOutput:")
-        print(result.stdout + result.stderr)
-        return
-
-    # Run
-    result = subprocess.run(["./a.out"], capture_output=True, text=True)
-    if result.returncode != expected_output:
-        print(RED + "FAILED" + CLEAR)
-        print("\tExpected return code: " + str(expected_output))
-        print("\tGot return code: " + str(result.returncode))
-        if len(result.stdout) > 0:
-            print("\tOutput: ")
-            print(result.stdout + result.stderr)
-    else:
-        print(GREEN + "PASSED" + CLEAR)
-
-def run_tests(cosec_bin, test_dir):
+    work_dir = tempfile.mkdtemp(prefix="cosec-test-")
+    try:
+        out_s = os.path.join(work_dir, "out.s")
+        out_o = os.path.join(work_dir, "out.o")
+        a_out = os.path.join(work_dir, "a.out")
+
+        # Compile
+        start = time.perf_counter()
+        result = subprocess.run([cosec_bin, path, "-o", out_s] + flags, capture_output=True, text=True)
+        r.compile_time = time.perf_counter() - start
+        if result.returncode != 0:
+            return r.fail("Failed to compile", "Output:", result.stdout + result.stderr)
+
+        # Each '// stack usage: ' line has to be in the '.su' file, less its
+        # '<file>:' prefix
+        expected_su = re.findall(r'\/\/ stack usage\: (.*)', contents)
+        if expected_su:
+            with open(os.path.join(work_dir, "out.su"), "r") as f:
+                su = [" ".join(line.rsplit(":", 1)[1].split()) for line in f]
+            for line in expected_su:
+                if " ".join(line.split()) not in su:
+                    return r.fail("Expected stack usage: " + line, "Got:", *su)
+
+        # Assemble
+        result = subprocess.run([nasm_bin] + nasm_args + ["-o", out_o, out_s], capture_output=True, text=True)
+        if result.returncode != 0:
+            return r.fail("Failed to assemble", "Output:", result.stdout + result.stderr)
+
+        # Link
+        result = subprocess.run([ld_bin] + ld_args + ["-o", a_out, out_o], capture_output=True, text=True)
+        if result.returncode != 0:
+            return r.fail("Failed to link", "Output:", result.stdout + result.stderr)
+
+        # Run
+        result = subprocess.run([a_out], capture_output=True, text=True)
+        if result.returncode != expected_output:
+            r.fail("Expected return code: " + str(expected_output),
+                   "Got return code: " + str(result.returncode))
+            if len(result.stdout) > 0:
+                r.fail("Output: ", result.stdout + result.stderr)
+            return r
+        r.passed = True
+        return r
+    finally:
+        shutil.rmtree(work_dir)
+
+def find_tests(test_dir):
     files = os.listdir(test_dir)
     files.sort()
-    subdirs = []
+    tests, subdirs = [], []
     for file in files:
         path = os.path.join(test_dir, file)
         if os.path.isdir(path):
@@ -84,12 +121,37 @@ def run_tests(cosec_bin, test_dir):
         _, extension = os.path.splitext(path)
         if extension != ".c":
             continue # Not a .c test file
-        run_test(cosec_bin, path)
+        tests.append(path)
 
-    # Recursively run tests in subdirectories
+    # Tests in subdirectories come after the ones in this directory
     for subdir in subdirs:
-        run_tests(cosec_bin, subdir)
+        tests += find_tests(subdir)
+    return tests
+
+def run_tests(cosec_bin, test_dir, jobs):
+    tests = find_tests(test_dir)
+    start = time.perf_counter()
+    with ThreadPoolExecutor(max_workers=jobs) as pool: # Work is in subprocesses
+        results = list(pool.map(lambda path: run_test(cosec_bin, path), tests))
+    elapsed = time.perf_counter() - start
+
+    num_passed = 0
+    for r in results:
+        print("Test '" + r.path + "': ", end="")
+        compile_time = "" if r.compile_time is None else " (compiled in %.1f ms)" % (r.compile_time * 1e3)
+        if r.passed:
+            print(GREEN + "PASSED" + CLEAR + compile_time)
+            num_passed += 1
+        else:
+            print(RED + "FAILED" + CLEAR + compile_time)
+            for message in r.messages:
+                print("\t" + message)
+    print("%d/%d tests passed in %.2f s with %d workers" % (num_passed, len(results), elapsed, jobs))
+    return num_passed == len(results)
 
-cosec_bin = sys.argv[1]
+cosec_bin = os.path.abspath(sys.argv[1])
 test_dir = sys.argv[2]
-run_tests(cosec_bin, test_dir)
+jobs = os.cpu_count() or 1
+if len(sys.argv) > 4 and sys.argv[3] == "-j":
+    jobs = int(sys.argv[4])
+sys.exit(0 if run_tests(cosec_bin, test_dir, jobs) else 1)
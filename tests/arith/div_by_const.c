@@ -0,0 +1,40 @@
+// expect: 36
+
+// Divisions by constants are multiplies by a 'magic number', and by powers of
+// 2 are shifts; negative dividends have to round towards 0 and remainders
+// take the dividend's sign
+int xs[] = { 0, 7, -7, 100, -100, 2147483647, -2147483647 - 1, 123456789 };
+long long ls[] = { // Odd ones are negated (less 1)
+    0, 6, 7, 999999999999, 1000000000000, 9223372036854775807LL,
+    9223372036854775807LL, 1234567890123456789LL,
+};
+
+unsigned long long h;
+
+void mix(unsigned long long v) {
+    h = h * 31 + v;
+}
+
+int main() {
+    for (int i = 0; i < 8; i++) {
+        int x = xs[i];
+        unsigned u = (unsigned) x;
+        mix(x / 7); mix(x % 7); mix(x / -10); mix(x % -10);
+        mix(x / 8); mix(x % 8); mix(x / -2); mix(x % 1024);
+        mix(x / 2147483647); mix(x % 641);
+        mix(u / 7); mix(u % 7); mix(u / 10); mix(u % 1000);
+        mix(u / 16); mix(u % 16); mix(u / 4294967295u);
+        mix(u / 2147483649u); mix(u % 3221225472u);
+
+        long long l = i % 2 ? -ls[i] - 1 : ls[i];
+        unsigned long long ul = (unsigned long long) l;
+        mix(l / 7); mix(l % 7); mix(l / -1000000007); mix(l % -3);
+        mix(l / 4096); mix(l % 4096); mix(l / (-9223372036854775807LL - 1));
+        mix(ul / 7); mix(ul % 7); mix(ul / 10); mix(ul % 1000);
+        mix(ul / 18446744073709551615ULL); mix(ul / 9223372036854775809ULL);
+        mix(ul % 12345678901ULL); mix(ul / 32); mix(ul % 32);
+        unsigned t = (unsigned) (ul >> 7); // Whatever's in the upper half is cut off
+        mix(t / 100); mix(t % 100); mix((unsigned) ul / 641);
+    }
+    return h % 256;
+}
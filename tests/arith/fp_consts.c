@@ -0,0 +1,18 @@
+// expect: 42
+
+// Constants shared between functions come from the same slot in the pool, and
+// 0.0 is made with 'pxor' instead of being loaded
+double half(double x) { return x * 0.5; }
+float halff(float x) { return x * 0.5f; }
+double add_one(double x) { return x + 1.0; }
+double zero() { return 0.0; }
+
+int main() {
+    double z = zero();
+    float f = 0.0f;
+    for (int i = 0; i < 4; i++) {
+        f = f + halff(3.0f);
+    }
+    double d = half(9.0) + add_one(0.5) + z;
+    return (int) (d * 4.0) + (int) f + (z == 0.0) * 10 + (1.0 / z > 0.0) * 2;
+}
@@ -0,0 +1,30 @@
+typedef unsigned long long u64;
+__int128 g = -5;
+unsigned __int128 big = (unsigned __int128) 1 << 100;
+static __int128 add(__int128 a, __int128 b) { return a + b; }
+unsigned __int128 mul64(u64 a, u64 b) { return (unsigned __int128) a * b; }
+int main() {
+	__int128 x = 0xffffffffffffffffULL;
+	x += 1;                              // carry into the high half
+	int r = (int) (x >> 64);             // 1
+	__uint128_t p = mul64(0x100000000ULL, 0x100000000ULL); // 2^64
+	r += (int) (p >> 64);                // 2
+	r += g < 0;                          // 3
+	r += (int) (add(g, 10));             // 8
+	r += (big >> 98) == 4;               // 9
+	__int128 y = -1;
+	y <<= 70;
+	r += y < 0 && (int)(y >> 70) == -1;  // 10
+	unsigned __int128 z = ~(unsigned __int128) 0;
+	int n = 127;
+	r += (int) (z >> n);                 // 11
+	r += (int) (((__int128) 3 << n) >> 126); // -2 -> 9
+	__int128 c = 7;
+	c++;
+	++c;
+	r += (int) c--;                      // 18
+	r += (int) c;                        // 26
+	if (x) r++;                          // 27
+	r += sizeof(__int128) + __SIZEOF_INT128__; // 59
+	return r; // expect: 59
+}
@@ -0,0 +1,36 @@
+// expect: 94
+
+// Extensions whose new bits are never looked at, masks that don't clear
+// anything, and chars compared as they are all have to give the same results
+unsigned char sum(unsigned char *p, int n) {
+    unsigned char s = 0;
+    for (int i = 0; i < n; i++) {
+        s += p[i] ^ 0x5a;
+    }
+    return s;
+}
+int eq(signed char a, signed char b) { return (signed char) (a + b) == 'x'; }
+int below(unsigned char a, unsigned char b) { return a < b; }
+int neg(signed char a) { return a < -3; }
+short mix(short a, short b) { return (short) (a * b + 3); }
+int lo(int x) { unsigned char c = x; return c & 0x0f; }
+int bits(unsigned char *p) { return (p[0] | (p[1] << 8)) & 0xffff; }
+int flag(int a, int b) { return (a < b) & 1; }
+int same(int a) { unsigned char c = a > 0; return c; }
+unsigned short twice(unsigned short a) { unsigned short x = (unsigned short) ((a & 0xf) << 3); return (unsigned short) (x + x); }
+
+int main() {
+    unsigned char buf[] = { 1, 200, 0x5a, 255, 7, 128 };
+    int s = 0;
+    s += sum(buf, 6) == (unsigned char) (0x5b + (200 ^ 0x5a) + 0 + 0xa5 + 0x5d + 0xda);
+    s += eq(100, 20) + eq(-100, -36) * 2 + eq(60, 61) * 4;
+    s += below(1, 255) + below(255, 1);
+    s += neg(-4) + neg(-3) + neg(127);
+    s += mix(300, 300) == (short) (300 * 300 + 3);
+    s += lo(0x1234) + lo(-1);                                 // 4 + 15
+    s += bits(buf) == (1 | (200 << 8));
+    s += flag(1, 2) + flag(2, 1);
+    s += same(5) + same(-5);
+    s += twice(0xffff) == 240;
+    return s * 3 + 4;
+}
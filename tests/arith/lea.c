@@ -0,0 +1,24 @@
+// expect: 109
+
+// Adds, small multiplies, and subtractions of constants become 'lea's
+int idx(int a, int b) { return a + b * 4 + 8; }
+int times(int x) { return x * 3 + x * 5 + x * 9 + (x << 1); }
+long long wide(long long a, long long b) { return a * 9 + (b << 3) - 5; }
+long long far(long long a) { return a + 0x100000000LL; }
+unsigned wrap(unsigned x) { return x + 0xfffffff0u; }
+
+int shared(int a, int b) {
+    int s = b << 2; // Also used on its own
+    return (a + s) + s;
+}
+
+int main() {
+    int s = idx(3, -2);                   // 3
+    s += times(2);                         // 38
+    s += (int) (wide(2, 3) - 37);          // 0
+    s += far(-0x100000000LL + 7) == 7;     // 1
+    s += wrap(20) == 4;                    // 1
+    s += shared(10, 5);                    // 50
+    s += idx(0x7fffffff, 0) == (int) 0x80000007u; // 1
+    return s + 15;
+}
@@ -0,0 +1,13 @@
+// expect: 42
+
+// A scaled operand folded into a 'lea' when the other operand is a load
+// that could have been a memory operand instead
+int a = 5, b = 7;
+long long c = 3, d = 4;
+
+int main() {
+    int s = a * 2 + b;         // 17
+    s += (int) (d + (c << 2)); // 16
+    s += b * 4 + a - 31;       // 2
+    return s + 7;
+}
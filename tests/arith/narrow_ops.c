@@ -0,0 +1,31 @@
+// expect: 29
+
+// 8 and 16-bit arithmetic is done on 32-bit registers, so it has to wrap and
+// extend exactly as if it weren't
+signed char mul8(signed char a, signed char b) { return (signed char) (a * b); }
+unsigned char add8(unsigned char a, unsigned char b) { return (unsigned char) (a + b); }
+short sar16(short a, int n) { return (short) (a >> n); }
+unsigned short shr16(unsigned short a, int n) { return (unsigned short) (a >> n); }
+short narrow(short a) { return (short) (signed char) a; }
+int less(int a, int b) { return a < b; }
+double to_fp(int x, float f) { return x + (double) f; }
+
+int main() {
+    int s = 0;
+    s += mul8(16, 9) == (signed char) 144;      // Wraps to -112
+    s += add8(200, 100) == 44;
+    s += sar16(-32768, 3) == -4096;
+    s += shr16(0x8000, 3) == 0x1000;
+    s += narrow(0x1ff) == -1;
+    s += less(-1, 0) + less(0, -1) * 10;
+    s += to_fp(3, 0.5f) == 3.5;
+    signed char c = 127;
+    c = (signed char) (c + 1);
+    s += c == -128;
+    short h = 1;
+    for (int i = 0; i < 15; i++) {
+        h = (short) (h * 2);
+    }
+    s += h == -32768;
+    return s * 3 + 2;
+}
@@ -0,0 +1,24 @@
+int main() {
+	int v0 = 0;
+	int v1 = 1;
+	int v2 = 2;
+	int v3 = 0;
+	int v4 = 1;
+	int v5 = 2;
+	int v6 = 0;
+	int v7 = 1;
+	int v8 = 2;
+	int v9 = 0;
+	int v10 = 1;
+	int v11 = 2;
+	int v12 = 0;
+	int v13 = 1;
+	int v14 = 2;
+	int v15 = 0;
+	int v16 = 1;
+	int v17 = 2;
+	int v18 = 0;
+	int v19 = 1;
+	int r = v19 * (v19 + 1) + (v18 * (v18 + 1) + (v17 * (v17 + 1) + (v16 * (v16 + 1) + (v15 * (v15 + 1) + (v14 * (v14 + 1) + (v13 * (v13 + 1) + (v12 * (v12 + 1) + (v11 * (v11 + 1) + (v10 * (v10 + 1) + (v9 * (v9 + 1) + (v8 * (v8 + 1) + (v7 * (v7 + 1) + (v6 * (v6 + 1) + (v5 * (v5 + 1) + (v4 * (v4 + 1) + (v3 * (v3 + 1) + (v2 * (v2 + 1) + (v1 * (v1 + 1) + (v0)))))))))))))))))));
+	return r; // expect: 50
+}
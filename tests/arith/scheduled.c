@@ -0,0 +1,25 @@
+// expect: 137
+
+// Independent loads, divisions, and compares that the scheduler interleaves;
+// each 'setcc' has to stay after its own 'cmp'
+int mix(int *a, int b, int c) {
+	int q = a[0] / b;
+	int r = a[1] % c;
+	int lt = a[2] < a[3];
+	int s = a[4] + a[5];
+	int eq = s == 11;
+	unsigned u = (unsigned) a[5] / 2;
+	return q + r + lt * 10 + eq * 20 + (int) u + s;
+}
+
+double fp(double *x) {
+	double a = x[0] * x[1];
+	double b = x[2] / x[3];
+	return a + b - (x[0] < x[2]);
+}
+
+int main() {
+	int a[6] = {50, 17, 1, 2, 5, 6};
+	double x[4] = {2.0, 3.0, 9.0, 4.5};
+	return mix(a, 7, 5) + (int) fp(x) + 77;
+}
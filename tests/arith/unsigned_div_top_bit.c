@@ -0,0 +1,10 @@
+// expect: 178
+
+// 'div' divides edx:eax, so edx has to be zeroed rather than sign extended
+unsigned d = 3;
+
+int main() {
+    unsigned a = 0x80000000u;
+    unsigned long long b = 0x8000000000000000ULL;
+    return (a / d + b % (d + 7)) % 256;
+}
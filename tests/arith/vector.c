@@ -0,0 +1,23 @@
+typedef int v4si __attribute__((vector_size(16)));
+typedef float v4sf __attribute__((vector_size(16)));
+typedef short v8hi __attribute__((vector_size(16)));
+
+v4si g = {1, 2, 3, 4};
+
+v4si mul_add(v4si a, v4si b) {
+	return a * b + 1;
+}
+
+int main() {
+	v4si a = {5, -6, 7, 8};
+	v4si b = mul_add(a, g);
+	b += a << 2;
+	b = -b ^ ~a;
+	b[3] = 100;
+	v4sf f = {1.5f, 2.0f, 3.0f, 4.0f};
+	f = f * 2.0f - f;
+	v8hi h = {1, 2, 3, 4, 5, 6, 7, 8};
+	h = (h * h) >> 2;
+	int s = b[0] + b[1] + b[2] + b[3];
+	return s + (int) (f[0] * 2) + h[7]; // expect: 239
+}
@@ -0,0 +1,19 @@
+struct Small { int a, b, c; };
+struct Big { long long v[40]; };
+
+int main() {
+	struct Small s = {1, 2, 3};
+	struct Small t;
+	t = s;
+	int z[9] = {4};
+	struct Big b;
+	for (int i = 0; i < 40; i++) b.v[i] = i;
+	struct Big c;
+	c = b;
+	long long big[64] = {5};
+	int x = t.a;
+	int zs[6] = {x};
+	long long zb[40] = {x, x};
+	int r = t.a + t.b + t.c + z[0] + z[8] + (int) c.v[39] + (int) big[0] + (int) big[63];
+	return r + zs[0] + zs[5] + (int) zb[1] + (int) zb[39]; // expect: 56
+}
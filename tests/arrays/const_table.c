@@ -0,0 +1,23 @@
+// expect: 58
+static const short T[] = {-1, 2, 300, 4};
+static const double D[] = {0.5, 1.5};
+static const char S[8] = "abc";
+
+int lookup(int i) {
+	const int L[4] = {5, 6, 7, 8};
+	return L[i] + L[0];
+}
+
+int written(int i) {
+	int W[3] = {1, 2, 3};
+	W[i] = 10;
+	return W[1];
+}
+
+int main() {
+	int r = T[0] + T[2] / 100 + (int) (D[1] * 2.0); // -1 + 3 + 3
+	r += S[1] - 'a' + S[5];                         // 1 + 0
+	r += lookup(3);                                 // 13
+	r += written(1) + written(2);                   // 10 + 2
+	return r + 27;
+}
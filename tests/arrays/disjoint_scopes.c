@@ -0,0 +1,19 @@
+int main() {
+	int r = 0;
+	int keep[4];
+	keep[0] = 7;
+	for (int j = 0; j < 3; j++) {
+		{
+			int a[16];
+			for (int i = 0; i < 16; i++) a[i] = i + keep[0];
+			r += a[3] + a[15];
+		}
+		{
+			int b[16];
+			for (int i = 0; i < 16; i++) b[i] = 2 * i;
+			r += b[4] + b[10];
+		}
+		keep[0] = keep[0] - 1;
+	}
+	return r; // expect: 174
+}
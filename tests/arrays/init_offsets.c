@@ -0,0 +1,33 @@
+// expect: 113
+
+// Element addresses built on one another are reassociated into constant
+// offsets from the array
+struct P { int x, y; };
+
+int sum(int *a, int n) {
+    int s = 0;
+    for (int i = 0; i < n; i++) {
+        s += a[i];
+    }
+    return s;
+}
+
+int m[4][8];
+
+int col(int j) {
+    return m[2][j] + m[3][j];
+}
+
+int main() {
+    int x = 3;
+    int a[6] = {x, x + 1, x + 2, x + 3, x + 4, x + 5};
+    struct P ps[3] = {{x, 1}, {2, x}, {x * 2, x * 3}};
+    for (int j = 0; j < 8; j++) {
+        m[2][j] = j;
+        m[3][j] = j * 2;
+    }
+    int s = sum(a, 6);                          // 33
+    s += ps[0].x + ps[1].y + ps[2].x + ps[2].y; // 21
+    s += col(5) + col(7);                       // 15 + 21
+    return s + 23;
+}
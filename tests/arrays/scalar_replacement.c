@@ -0,0 +1,23 @@
+typedef struct { int x, y; } Vec2;
+typedef struct { Vec2 a, b; double w; } Box;
+
+static Vec2 add(Vec2 a, Vec2 b) {
+	Vec2 r = {a.x + b.x, a.y + b.y};
+	return r;
+}
+
+int main() {
+	Box box = {{1, 2}, {3, 4}};
+	Box copy = box;
+	copy.w = 1.5;
+	int sum = 0;
+	for (int i = 0; i < 3; i++) {
+		Vec2 p = add((Vec2) {i, 0}, (Vec2) {0, i * 2});
+		copy.a.x += p.x;
+		copy.b.y += p.y;
+	}
+	int arr[3] = {5};
+	arr[2] = arr[0] + copy.b.y;
+	sum = copy.a.x + copy.a.y + copy.b.x + copy.b.y + (int) (copy.w * 2) + arr[1] + arr[2];
+	return sum; // expect: 37
+}
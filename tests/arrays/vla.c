@@ -0,0 +1,51 @@
+int sum_squares(int n) {
+	int a[n];
+	for (int i = 0; i < n; i++) a[i] = i * i;
+	int s = 0;
+	for (int i = 0; i < n; i++) s += a[i];
+	return s;
+}
+
+int fill(char *p, int n) {
+	for (int i = 0; i < n; i++) p[i] = (char) i;
+	return p[n - 1];
+}
+
+int scratch(int n) {
+	int r = 0;
+	for (int k = 0; k < 100000; k++) { // Each buffer's freed every iteration
+		char buf[n + (k & 7)];
+		r += fill(buf, n + (k & 7)) & 1;
+		if (k & 1) continue;
+		r++;
+	}
+	return r;
+}
+
+int until(int n) {
+	int r = 0;
+	while (1) {
+		long v[n];
+		v[n - 1] = n;
+		r += (int) v[n - 1];
+		if (r > 4000000) break;
+	}
+	return r;
+}
+
+int corner(int rows, int cols) {
+	int m[rows][cols];
+	for (int i = 0; i < rows; i++) {
+		for (int j = 0; j < cols; j++) m[i][j] = i * cols + j;
+	}
+	return m[rows - 1][cols - 1];
+}
+
+int main() {
+	int n = 8;
+	int fixed[n];
+	for (int i = 0; i < n; i++) fixed[i] = i;
+	int r = sum_squares(10) + corner(5, 7) + fixed[7];
+	r += scratch(1000) + until(3);
+	return r % 251; // expect: 243
+}
@@ -0,0 +1,25 @@
+// expect: 42
+_Atomic int counter;
+_Atomic(char) flag;
+
+int main() {
+	int *_Atomic p = 0;
+	int x = 5;
+	counter = 10;
+	counter++;
+	++counter;
+	counter += 3;
+	counter *= 2;
+	counter -= 4;
+	flag = 200;
+	flag += 100;
+	p = &x;
+	__atomic_fetch_add(&x, 2, __ATOMIC_RELAXED);
+	int old = __atomic_exchange_n(&x, 1, __ATOMIC_SEQ_CST);
+	int expected = 1;
+	int ok = __atomic_compare_exchange_n(&x, &expected, 3, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	int fail = __atomic_compare_exchange_n(&x, &expected, 9, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int y = __atomic_or_fetch(&x, 4, __ATOMIC_ACQ_REL);
+	return counter - 26 + flag - 44 + old - 7 + ok + !fail + expected - 3 + y - 7 + *p - 7 + 40;
+}
@@ -0,0 +1,50 @@
+struct Hdr {
+	unsigned version : 4;
+	unsigned ihl : 4;
+	unsigned tos : 8;
+	unsigned len : 16;
+	int delta : 5;
+	char tag;
+	long long big : 40;
+	long long small : 20;
+};
+struct Node { int a : 3; int : 0; unsigned b : 2; char c; };
+struct S3 { char x; int y : 12; char z; };
+struct Hdr g = { 4, 5, 0x10, 1500, -7, 'q', -123456789LL, 77 };
+
+int get_len(struct Hdr *h) { return h->len; }
+void set_two(struct Hdr *h, int v, int i) { h->version = v; h->ihl = i; }
+
+int main() {
+	int r = 0;
+	r += sizeof(struct Hdr) == 16;
+	r += sizeof(struct Node) == 8;
+	r += sizeof(struct S3) == 4;
+	r += g.version == 4 && g.ihl == 5 && g.tos == 0x10 && g.len == 1500;
+	r += g.delta == -7 && g.tag == 'q' && g.big == -123456789LL && g.small == 77;
+	struct Hdr h = { 1, 2, 3, 4, 5 };
+	h.len += 65535;           // wraps to 3
+	r += h.len == 3;
+	h.delta = 15;             // 5-bit signed: 15
+	r += h.delta == 15;
+	h.delta++;                // 16 -> -16
+	r += h.delta == -16;
+	r += (h.delta = 17) == -15;
+	set_two(&h, 9, 10);
+	r += h.version == 9 && h.ihl == 10 && h.tos == 3;
+	unsigned char *p = (void *) &h;
+	r += p[0] == 0xa9;
+	struct Node n = { -1, 3, 7 };
+	r += n.a == -1 && n.b == 3 && n.c == 7;
+	n.b--;
+	r += n.b == 2 && n.a == -1;
+	r += get_len(&g) == 1500;
+	struct S3 s = { 1, -2, 3 };
+	r += s.x == 1 && s.y == -2 && s.z == 3;
+	s.y = 2047; s.z = 9;
+	r += s.x == 1 && s.y == 2047 && s.z == 9;
+	char c = 127;
+	long long k = -8;
+	r += ++c == -128 && c == -128 && k == -8; // Not bit-fields, but found with them
+	return r; // expect: 17
+}
@@ -0,0 +1,25 @@
+int bits(unsigned x, unsigned long long y) {
+	return __builtin_popcount(x) + __builtin_ctz(x) + __builtin_clz(x) +
+		__builtin_popcountll(y) + __builtin_ctzll(y) + __builtin_clzll(y);
+}
+
+int check(int x) {
+	if (__builtin_expect(x < 0, 0)) {
+		return 1;
+	}
+	return 2;
+}
+
+int main() {
+	int a[4] = {1, 2, 3, 4};
+	int b[4];
+	__builtin_memcpy(b, a, sizeof(a));
+	__builtin_memset(a, 0, sizeof(a));
+	int n = 3;
+	__builtin_memset(b, 0, n);
+	unsigned short s = __builtin_bswap16(0x0102);
+	unsigned w = __builtin_bswap32(0x01020304);
+	unsigned long long l = __builtin_bswap64(0x0100000000000000ULL);
+	int r = bits(0xf0, 0x100) + check(-1) + check(5) + a[3] + b[1];
+	return r + (s == 0x0201) + (w == 0x04030201) + (int) l; // expect: 104
+}
@@ -0,0 +1,48 @@
+// expect: 126
+
+// Constant arguments are propagated into static functions, which are copied
+// for the constants that calls in loops pass
+static int sum(int *a, int n, int twice) {
+    int s = 0;
+    for (int i = 0; i < n; i++) {
+        s += twice ? a[i] * 2 : a[i];
+    }
+    return s;
+}
+
+static int mix(int x, int by) {
+    int r = x;
+    for (int i = 0; i < 3; i++) {
+        r = (r << by) ^ (r >> 1);
+        r += by * 7;
+    }
+    return r & 63;
+}
+
+static double lerp(double a, double b, double t) {
+    return a + (b - a) * t;
+}
+
+int table[4] = {5, 6, 7, 8};
+
+static int pick(int *t, int i) {
+    return t[i];
+}
+
+static int by_ptr(int x, int k) { // Address taken, so left alone
+    return x * k;
+}
+
+int main() {
+    int a[5] = {1, 2, 3, 4, 5};
+    int s = sum(a, 5, 1) + sum(a, 5, 1);                 // 60
+    for (int i = 0; i < 3; i++) {
+        s += mix(i, 2) + mix(i, 3);                       // 288
+    }
+    s += mix(9, 1);                                       // 50
+    s += (int) (lerp(0.0, 10.0, 0.5) + lerp(2.0, 10.0, 0.5)); // 11
+    s += pick(table, 1) + pick(table, 3);                 // 14
+    int (*f)(int, int) = by_ptr;
+    s += f(1, 3) + by_ptr(0, 3);                          // 3
+    return s - 300;
+}
@@ -0,0 +1,36 @@
+typedef int (*Op)(int);
+
+static int inc(int x) {
+	return x + 1;
+}
+
+static int dbl(int x) {
+	return x * 2;
+}
+
+static int neg(int x) {
+	return -x;
+}
+
+static Op const ops[3] = { &inc, &dbl, &neg };
+static Op hooks[2] = { &inc, &dbl }; // Not 'const', so could change
+
+static int apply(int i, int x) {
+	return ops[i](x);
+}
+
+int main() {
+	Op a = &inc;
+	int r = a(1);              // 2
+	r += ops[1](5);            // 10
+	Op b = r > 3 ? &dbl : &neg;
+	r += b(2);                 // 4
+	Op c = ops[2];
+	r += c(-7);                // 7
+	hooks[0] = &neg;
+	r += hooks[0](1);          // -1
+	for (int i = 0; i < 3; i++) {
+		r += apply(i, 3);      // 4 + 6 - 3
+	}
+	return r; // expect: 29
+}
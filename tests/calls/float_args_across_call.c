@@ -0,0 +1,13 @@
+int z;
+void set_z() {
+	z = 1;
+}
+float sub(float a, float b) {
+	if (z == 0) {
+		set_z();
+	}
+	return a - b;
+}
+int main() {
+	return (int) sub(9.5, 1.5); // expect: 8
+}
@@ -0,0 +1,10 @@
+double triple(double x) {
+	return x * 3.0;
+}
+
+int main() {
+	double a = triple(1.0);
+	double b = triple(2.0);
+	double c = triple(a);
+	return (int) (a + b + c); // expect: 18
+}
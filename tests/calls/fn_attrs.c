@@ -0,0 +1,14 @@
+__attribute__((no_instrument_function)) int inc(int x);
+
+int inc(int x) {
+	return x + 1;
+}
+
+__attribute__((patchable_function_entry(4), no_instrument_function))
+int twice(int x) {
+	return inc(x) * 2;
+}
+
+int main() {
+	return twice(inc(4)); // expect: 12
+}
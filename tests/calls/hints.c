@@ -0,0 +1,61 @@
+int data[64];
+
+int sum(int *p, int n) {
+	int s = 0;
+	for (int i = 0; i < n; i++) {
+		__builtin_prefetch(&p[i + 16]);
+		__builtin_prefetch(&p[i + 32], 0, 0);
+		s += p[i];
+	}
+	return s;
+}
+
+int low_bits(int x) {
+	__builtin_assume(x >= 0 && x < 16);
+	return (x & 15) + (x < 16);
+}
+
+int aligned(unsigned x) {
+	__builtin_assume(x % 4 == 0);
+	return x & ~3u;
+}
+
+int pick(int k) {
+	switch (k) {
+	case 0: return 10;
+	case 1: return 20;
+	case 2: return 30;
+	case 3: return 40;
+	default: __builtin_unreachable();
+	}
+}
+
+int bucket(int k) {
+	__builtin_assume(k >= 0 && k < 4);
+	switch (k) {
+	case 0: return 1;
+	case 1: return 2;
+	case 2: return 3;
+	case 3: return 4;
+	}
+	return 0;
+}
+
+int ignored(int x) {
+	__builtin_assume(x++ > 100); // Has side effects, so isn't evaluated
+	return x;
+}
+
+int main() {
+	for (int i = 0; i < 64; i++) {
+		data[i] = i;
+	}
+	int s = sum(data, 16);                 // 120
+	s += low_bits(9);                      // 10
+	s += aligned(12);                      // 12
+	s += pick(2) + pick(3);                // 70
+	s += bucket(1);                        // 2
+	s += ignored(5);                       // 5
+	return s - 200;
+}
+// expect: 19
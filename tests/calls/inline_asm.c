@@ -0,0 +1,50 @@
+int add(int a, int b) {
+	int r;
+	__asm__("mov %0, %1\n\tadd %0, %2" : "=&r"(r) : "r"(a), "r"(b));
+	return r;
+}
+
+int twice(int a) {
+	__asm__("add %0, %0" : "+r"(a));
+	return a;
+}
+
+int tied(int a) {
+	int r;
+	__asm__("add %0, %0" : "=r"(r) : "0"(a));
+	return r;
+}
+
+long fetch_add(long *p, long v) {
+	__asm__ volatile("lock xadd %1, %0" : "+m"(*p), "+r"(v) :: "memory");
+	return v;
+}
+
+int cas(int *p, int old, int new) {
+	int prev;
+	__asm__ volatile("lock cmpxchg %2, %1"
+		: "=a"(prev), "+m"(*p) : "r"(new), "0"(old) : "memory", "cc");
+	return prev;
+}
+
+unsigned long long cycles(void) {
+	unsigned lo, hi;
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((unsigned long long) hi << 32) | lo;
+}
+
+int main() {
+	__asm__("nop");
+	__asm__ volatile("pause\n\tmfence" ::: "memory");
+	int x = 5;
+	int y;
+	__asm__("mov %k0, %1" : "=r"(y) : "i"(7));
+	long counter = 10;
+	long old = fetch_add(&counter, 3);
+	int z = 4;
+	int ok = cas(&z, 4, 9);
+	int bad = cas(&z, 4, 1);
+	unsigned long long t = cycles();
+	return add(x, y) + twice(3) + tied(2) + (int) old + (int) counter +
+		ok + bad + z + (t != 0); // expect: 68
+}
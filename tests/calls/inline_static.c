@@ -0,0 +1,25 @@
+static int sign(int a) {
+	if (a < 0) {
+		return -1;
+	} else if (a > 0) {
+		return 1;
+	}
+	return 0;
+}
+
+static int add(int a, int b) {
+	return a + b;
+}
+
+static int fact(int n) {
+	return n <= 1 ? 1 : n * fact(n - 1);
+}
+
+int main() {
+	int (*f)(int) = sign;
+	int r = 0;
+	for (int i = -2; i < 3; i++) {
+		r = add(r, sign(i) + 2);
+	}
+	return r + fact(4) + f(-5); // expect: 33
+}
@@ -0,0 +1,39 @@
+// Calls to static functions only clobber the registers the function uses, so
+// values can stay in the others across them
+
+__attribute__((noinline)) static int sq(int x) {
+	return x * x;
+}
+
+__attribute__((noinline)) static int add3(int a, int b, int c) {
+	return a + b + c;
+}
+
+// Calls 'sq', so clobbers what it does too
+__attribute__((noinline)) static int sq_plus(int x, int y) {
+	return sq(x) + y;
+}
+
+// Recursive, so its calls to itself clobber everything
+__attribute__((noinline)) static int tri(int n) {
+	return n ? n + tri(n - 1) : 0;
+}
+
+__attribute__((noinline)) static double half(double x) {
+	return x * 0.5;
+}
+
+int main() {
+	int s = 0, t = 7, u = 3, v = 1, w = 2;
+	double d = 1.0, e = 0.25;
+	for (int i = 0; i < 10; i++) {
+		s += sq(i) + t * u;
+		t = add3(t, u, i) & 15;
+		u += tri(i & 3);
+		v = sq_plus(v & 7, w) + w;
+		w = (w * 3 + v) & 31;
+		d = d + half(d) - e;
+		e = half(e) + e;
+	}
+	return (s + t + u + v + w + (int) d) & 255; // expect: 228
+}
@@ -0,0 +1,56 @@
+struct __attribute__((aligned(16))) Pair {
+	int a, b;
+};
+
+struct Line {
+	char c;
+	int x __attribute__((aligned(8)));
+} __attribute__((aligned(32)));
+
+int table[4] = {3, 1, 4, 1};
+
+__attribute__((const)) int square(int x);
+__attribute__((pure)) int lookup(int i);
+
+int square(int x) {
+	return x * x;
+}
+
+int lookup(int i) {
+	return table[i];
+}
+
+static __attribute__((always_inline)) int add(int x, int y) {
+	return x + y;
+}
+
+__attribute__((noinline)) static int sub(int x, int y) {
+	return x - y;
+}
+
+__attribute__((cold)) int fail(void) {
+	return 100;
+}
+
+__attribute__((hot)) int sum(int n) {
+	int s = 0;
+	for (int i = 0; i < n; i++) {
+		s = add(s, lookup(i) + lookup(i));
+	}
+	return s;
+}
+
+struct Pair pairs[2];
+int aligned_buf[3] __attribute__((aligned(16)));
+
+int main() {
+	if (sizeof(struct Pair) != 16 || sizeof(struct Line) != 32) {
+		return fail();
+	}
+	if ((long long) &pairs[1] % 16 != 0 || (long long) aligned_buf % 16 != 0) {
+		return fail();
+	}
+	int x = square(3) + square(3);
+	table[0] = 5;
+	return sum(4) + sub(x, 1) - lookup(0); // expect: 34
+}
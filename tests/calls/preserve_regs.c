@@ -0,0 +1,11 @@
+int f(int x) {
+	int a = x;
+	int b = 3;
+	return (a << b) + (a / b);
+}
+int main() {
+	int a = 3;
+	int b = 4;
+	int c = 5;
+	return a * b + c * a + b * c + f(a) + a * b; // expect: 84
+}
@@ -0,0 +1,16 @@
+// expect: 41
+
+static int mix(int a, int b, int c, int d) {
+    return a * 1000 + b * 100 + c * 10 + d;
+}
+
+static int shift_div(int x, int n, int d) {
+    return (x << n) / d + (x >> n) % d;
+}
+
+int main() {
+    int a = 1, b = 2, c = 3, d = 4;
+    int r = mix(d, c, b, a); // Arguments in the opposite order
+    r = mix(r % 10, r / 10 % 10, r / 100 % 10, r / 1000); // 1234
+    return (r == 1234 ? 40 : 0) + shift_div(a, b, c);
+}
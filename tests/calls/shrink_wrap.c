@@ -0,0 +1,44 @@
+// Early returns that don't need the stack frame skip the prologue, and leaf
+// functions keep small frames below rsp without moving it
+
+__attribute__((noinline)) static int id(int x) {
+	return x;
+}
+
+// Sets up the frame (and saves rbx) only once 'p' isn't NULL
+__attribute__((noinline)) int sum(int *p, int n) {
+	if (!p) {
+		return -1;
+	}
+	int s = 0;
+	for (int i = 0; i < n; i++) {
+		s += id(p[i]) * n;
+	}
+	return s;
+}
+
+// The early return's a tail call
+__attribute__((noinline)) int twice(int x) {
+	if (x < 0) {
+		return id(-x);
+	}
+	return id(id(x) + 1) + id(x);
+}
+
+// A leaf function with an array in the red zone
+__attribute__((noinline)) int pick(int *p, int i) {
+	int a[16];
+	for (int j = 0; j < 16; j++) {
+		a[j] = p[j] * 3;
+	}
+	return a[i & 15] + a[(i + 5) & 15];
+}
+
+int main() {
+	int a[16];
+	for (int i = 0; i < 16; i++) {
+		a[i] = i + 1;
+	}
+	int r = sum(0, 3) + sum(a, 4) + twice(-5) + twice(9) + pick(a, 7);
+	return r; // expect: 126
+}
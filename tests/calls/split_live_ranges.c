@@ -0,0 +1,40 @@
+int sink(int x) {
+	return x + 1;
+}
+
+int loops() {
+	int v0 = sink(0), v1 = sink(1), v2 = sink(2), v3 = sink(3), v4 = sink(4);
+	int v5 = sink(5), v6 = sink(6), v7 = sink(7), v8 = sink(8), v9 = sink(9);
+	int v10 = sink(10), v11 = sink(11), v12 = sink(12), v13 = sink(13);
+	int v14 = sink(14), v15 = sink(15), v16 = sink(16), v17 = sink(17);
+	int s = 0;
+	for (int i = 0; i < 100; i += 1) {
+		s = s * 3 + v0 + (v1 ^ i) + (v2 & i);
+		s = s ^ (v0 << 2);
+		s = s % 1000003;
+	}
+	for (int i = 0; i < 10; i += 1) {
+		int t = sink(s) + v3 * v3 + v4 * v3 + v3;
+		s = (s + t) % 999983;
+		s = sink(s) + v3;
+	}
+	return (s + v5 + v6 + v7 + v8 + v9 + v10 + v11 + v12 + v13 + v14 + v15 +
+		v16 + v17 + v0 + v1 + v2 + v4) & 255;
+}
+
+int across(int a) {
+	int x0 = a * 3, x1 = a * 5, x2 = a * 7, x3 = a * 11, x4 = a * 13;
+	int x5 = a * 17, x6 = a * 19, x7 = a * 23, x8 = a * 29;
+	int r = 0;
+	for (int i = 0; i < 50; i += 1) {
+		r += (x0 ^ i) + (x1 & i) + (x2 | i) + (x3 ^ i) + (x4 & i) + (x5 | i) +
+			(x6 ^ i) + (x7 & i) + (x8 | i);
+		r = r % 65521;
+	}
+	r += sink(r);
+	return r + x0 + x1 + x2 + x3 + x4 + x5 + x6 + x7 + x8;
+}
+
+int main() {
+	return (loops() + across(3)) & 255; // expect: 63
+}
@@ -0,0 +1,11 @@
+int sum(int a, int b, int c, int d, int e, int f, int g, int h, int i) {
+	return a + b + c + d + e + f + g + h + i * 2;
+}
+
+double mix(int a, double b, int c, double d) {
+	return a + b * 2 + c * 3 + d * 4;
+}
+
+int main() {
+	return sum(1, 2, 3, 4, 5, 6, 7, 8, 9) + (int) mix(1, 2.0, 3, 4.0); // expect: 84
+}
@@ -0,0 +1,46 @@
+int memcmp(const void *a, const void *b, unsigned long long n);
+int strcmp(const char *a, const char *b);
+unsigned long long strlen(const char *s);
+
+// One 32-bit compare against an immediate
+int is_get(char *req) {
+	return memcmp(req, "GET ", 4) == 0;
+}
+
+// Two 64-bit compares, then the order of the pair that differs
+int cmp16(char *a, char *b) {
+	return memcmp(a, b, 16);
+}
+
+// 2 bytes then 1
+int cmp3(char *a, char *b) {
+	return memcmp(a, b, 3);
+}
+
+// A byte at a time, stopping at the first that differs
+int tag(char *t) {
+	if (!strcmp(t, "id")) {
+		return 1;
+	} else if (strcmp("class", t) == 0) {
+		return 2;
+	}
+	return strcmp(t, "m") < 0 ? 3 : 4;
+}
+
+char get[] = "GET /index.html", post[] = "POST /form";
+char a[] = "0123456789abcdef", b[] = "0123456789abcdef";
+
+int main() {
+	int r = is_get(get) * 10 + is_get(post);  // 10
+	r += cmp16(a, b) == 0;                     // 11
+	b[9] = 'A';
+	r += (cmp16(a, b) < 0) * 2;                // 13 ('9' < 'A')
+	r += (cmp16(b, a) > 0) * 4;                // 17
+	r += cmp3("abc", a) > 0;                   // 18
+	r += (cmp3(a, b) == 0) * 8;                // 26
+	r += tag("id") + tag("class") * 10;        // 47
+	r += tag("i") + tag("idx") + tag("z");     // 57
+	r += (int) strlen("hello") + (int) __builtin_strlen("a\0b"); // 63
+	r += (strcmp("abc", "abd") < 0) + (memcmp("xy", "xz", 2) < 0); // 65
+	return r; // expect: 65
+}
@@ -0,0 +1,10 @@
+int count(int n, int acc) {
+	if (n == 0) {
+		return acc;
+	}
+	return count(n - 1, acc + 1); // Must not overflow the stack
+}
+
+int main() {
+	return count(50000000, 0) / 1000000; // expect: 50
+}
@@ -0,0 +1,28 @@
+// Hidden symbols bind directly, even when they're declared before they're
+// defined (the uses go through the definition's global)
+
+extern int counter;
+__attribute__((visibility("hidden"))) int bump(int x);
+int twice(int x) __attribute__((visibility("default")));
+
+__attribute__((noinline)) int use(int x) {
+	int b = bump(x);
+	return b + counter;
+}
+
+int counter = 7;
+
+__attribute__((noinline)) int bump(int x) {
+	counter += x;
+	return counter;
+}
+
+__attribute__((noinline)) int twice(int x) {
+	return x * 2;
+}
+
+int main() {
+	int *p = &counter;
+	int r = use(3) + twice(*p) + bump(1);
+	return r; // expect: 51
+}
@@ -0,0 +1,15 @@
+int sign(int x) {
+	int s = 0;
+	if (x > 0) s = 1;
+	if (x < 0) s = 0 - 1;
+	return s;
+}
+int main() {
+	int z = 0;
+	int n = 0;
+	for (int i = 0; i != 5; i++) {
+		n = n + sign(i - 2) + 1;
+		if (n == 0) z = 0;
+	}
+	return n + z; // expect: 5
+}
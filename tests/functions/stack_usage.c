@@ -0,0 +1,36 @@
+// '-fstack-usage=callgraph': each function's frame, and the deepest chain of
+// calls from it, which is only a lower bound past a VLA or recursion
+// flags: -fstack-usage=callgraph
+// stack usage: leaf 8 static 0 8 static
+// stack usage: buffer 112 static 0 120 static
+// stack usage: vla 32 dynamic 0 40 dynamic
+// stack usage: count 16 static 0 16 recursive
+// stack usage: main 32 static 0 152 dynamic,recursive
+
+int leaf(int x) {
+	return x * 2;
+}
+
+int buffer(int n) {
+	int buf[16];
+	for (int i = 0; i < 16; i++) {
+		buf[i] = leaf(i + n);
+	}
+	return buf[n & 15];
+}
+
+int vla(int n) {
+	int buf[n];
+	for (int i = 0; i < n; i++) {
+		buf[i] = i;
+	}
+	return buf[n - 1] + leaf(n);
+}
+
+int count(int n) {
+	return n == 0 ? 0 : 1 + count(n - 1);
+}
+
+int main() {
+	return buffer(3) + vla(4) + count(2); // expect: 25
+}
@@ -0,0 +1,27 @@
+int run(int *code) {
+	void *ops[] = { &&push, &&add, &&dup, &&halt };
+	int stack[8];
+	int sp = 0, pc = 0, steps = 0;
+	goto *ops[code[pc++]];
+push:
+	stack[sp++] = code[pc++];
+	steps++;
+	goto *ops[code[pc++]];
+add:
+	sp--;
+	stack[sp - 1] += stack[sp];
+	steps++;
+	goto *ops[code[pc++]];
+dup:
+	stack[sp] = stack[sp - 1];
+	sp++;
+	steps++;
+	goto *ops[code[pc++]];
+halt:
+	return stack[sp - 1] + steps;
+}
+
+int main() {
+	int code[] = { 0, 5, 2, 1, 0, 7, 1, 3 };
+	return run(code); // expect: 22
+}
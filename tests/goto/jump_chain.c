@@ -0,0 +1,17 @@
+int main() {
+	int a = 2;
+	int unused = a * 7;
+	goto one;
+two:
+	goto three;
+one:
+	a = a + 3;
+	goto two;
+three:
+	if (a > 4) {
+	} else {
+		a = 0;
+	}
+	return a * 4; // expect: 20
+	a = 100;
+}
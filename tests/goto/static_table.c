@@ -0,0 +1,17 @@
+// A dispatch table of label addresses has to be a local array (see
+// 'computed.c'); a static one is rejected rather than miscompiled
+// error: label address in a static initializer isn't supported
+
+int run(int op) {
+	static void *ops[] = { &&inc, &&dec };
+	int x = 10;
+	goto *ops[op];
+inc:
+	return x + 1;
+dec:
+	return x - 1;
+}
+
+int main() {
+	return run(0);
+}
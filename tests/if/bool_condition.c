@@ -0,0 +1,12 @@
+int f(int a, int c) {
+	int s = 0;
+	int b = a < c;
+	for (int i = 0; i < 10; i++) {
+		if (!b) s += 2;
+		if (b) s += 1;
+	}
+	return s;
+}
+int main() {
+	return f(1, 2) + f(3, 2) * 3; // expect: 70
+}
@@ -0,0 +1,16 @@
+int main() {
+	int feature = 0;
+	int x = 5;
+	int y;
+	if (feature) {
+		y = x / feature;
+	} else if (x > 3) {
+		y = x + 2;
+	} else {
+		y = 0;
+	}
+	while (feature) {
+		y = y + 1;
+	}
+	return y * 6 - (-1 / 1); // expect: 43
+}
@@ -0,0 +1,42 @@
+// expect: 173
+
+// A branch whose outcome is known on some of the edges into it gets a copy
+// along those edges that jumps straight to the successor it would take
+
+int calls;
+
+void x(void) { calls += 1; }
+void y(void) { calls += 10; }
+
+int same_cond(int p, int q) {
+    if (p) x();
+    calls += q;
+    if (p) y();
+    return calls;
+}
+
+int flag(int a) {
+    int set = 0;
+    if (a > 10) { set = 1; calls++; }
+    calls += 2;
+    if (set) return calls * 2;
+    return calls;
+}
+
+int in_loop(int n) {
+    int sum = 0;
+    for (int i = 0; i < n; i++) {
+        int odd = i & 1;
+        int v = odd ? i * 3 : 0;
+        if (odd) sum += 2;
+        sum += v;
+    }
+    return sum;
+}
+
+int main() {
+    int s = same_cond(1, 2) + same_cond(0, 3);
+    s += flag(11) + flag(1);
+    s += in_loop(10);
+    return s;
+}
@@ -0,0 +1,27 @@
+// expect: 146
+
+// '&&', '||' and '!' used as values, with cheap operands, become 'setcc's
+// combined with 'and' and 'or'
+int both(int a, int b, int c) { return a > 3 && b < c; }
+int either(int a, int b) { return a == 1 || b != 2; }
+int all3(int a, int b, int c) { return a > 0 && b > 0 && c > 0; }
+int any3(unsigned a, unsigned b, unsigned c) { return a < 2 || b < 2 || c < 2; }
+int neither(int a, int b) { return !(a > 3 || b > 3); }
+int not_both(int a, int b) { return !(a && b); }
+int in_range(float x) { return x >= 0.0f && x < 1.0f; }
+
+// A load could fault, so the branch stays
+int deref(int *p, int b) { return p && *p > b; }
+
+int main() {
+    int x = 5;
+    int s = both(4, 1, 2) + both(3, 1, 2) + both(4, 2, 1);         // 1
+    s += either(1, 2) * 2 + either(0, 3) * 4 + either(0, 2) * 8;   // 6
+    s += all3(1, 2, 3) * 16 + all3(1, 0, 3) + all3(0, 1, 1);       // 16
+    s += any3(5, 5, 1) * 32 + any3(5, 5, 5);                       // 32
+    s += neither(1, 2) * 64 + neither(4, 0) + neither(0, 4);       // 64
+    s += not_both(1, 1) + not_both(0, 1) * 2 + not_both(1, 0) * 4; // 6
+    s += in_range(0.5f) * 8 + in_range(1.0f) + in_range(-0.5f);    // 8
+    s += deref(0, 1) + deref(&x, 4) * 13 + deref(&x, 5);           // 13
+    return s;
+}
@@ -0,0 +1,25 @@
+// expect: 42
+
+// A floating point ternary picking the smaller or larger of the two values
+// it compares becomes 'minss' or 'maxss'
+float fmin(float a, float b) { return a < b ? a : b; }
+float fmax(float a, float b) { return b < a ? a : b; }
+double dmax(double a, double b) { return a > b ? a : b; }
+double dmin(double a, double b) { return b > a ? a : b; }
+
+int main() {
+    int s = 0;
+    s += fmin(1.5f, -2.5f) == -2.5f;
+    s += fmin(-2.5f, 1.5f) == -2.5f;
+    s += fmax(1.5f, -2.5f) == 1.5f;
+    s += fmax(-2.5f, 1.5f) == 1.5f;
+    s += dmax(3.0, 7.0) == 7.0;
+    s += dmax(7.0, 3.0) == 7.0;
+    s += dmin(3.0, 7.0) == 3.0;
+    s += dmin(7.0, 3.0) == 3.0;
+    double m = -100.0;
+    for (int i = 0; i < 10; i++) {
+        m = dmax(m, (double) ((i * 7) % 10));
+    }
+    return s * 4 + (int) m + 1;
+}
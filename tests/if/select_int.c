@@ -0,0 +1,47 @@
+// expect: 183
+
+// Ternaries and small if/else diamonds become branchless selects
+int min(int a, int b) { return a < b ? a : b; }
+unsigned umax(unsigned a, unsigned b) { return a > b ? a : b; }
+int clamp(int x, int lo, int hi) { return x < lo ? lo : x > hi ? hi : x; }
+char pick(int c, char a, char b) { return c ? a : b; }
+
+long long abs_sum(long long *p, int n) {
+    long long s = 0;
+    for (int i = 0; i < n; i++) {
+        long long v = p[i];
+        if (v < 0) {
+            v = -v;
+        }
+        s += v;
+    }
+    return s;
+}
+
+int *later(int *a, int *b) { return a > b ? a : b; }
+
+int diamond(int x, int y) {
+    int r, s;
+    if (x == y) {
+        r = x + 1; s = 2;
+    } else {
+        r = y * 3; s = x - y;
+    }
+    return r + s;
+}
+
+int main() {
+    long long a[4];
+    for (int i = 0; i < 4; i++) {
+        a[i] = i % 2 ? -i - 1 : i;
+    }
+    int arr[2];
+    int s = min(3, -4) + min(-4, 3) + min(5, 5);          // -3
+    s += umax(4000000000u, 2) == 4000000000u;             // 1
+    s += clamp(-7, 0, 10) + clamp(15, 0, 10) + clamp(7, 0, 10); // 17
+    s += pick(0, 'a', 'b') - pick(1, 'a', 'b');           // 1
+    s += (int) abs_sum(a, 4);                              // 8
+    s += (later(&arr[0], &arr[1]) == &arr[1]) * 100;      // 100
+    s += diamond(4, 4) + diamond(5, 2);                   // 7 + 6 + 3 = 16
+    return s + 43;
+}
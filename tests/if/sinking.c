@@ -0,0 +1,38 @@
+int g;
+
+// 'v' is only needed when 'n' is bad
+static int check(int *p, int n, int k) {
+	int v = p[k] * 37 + n / 3;
+	if (n < 0) {
+		return v;
+	}
+	return n + k;
+}
+
+// The load can't move past the store
+static int stale(int *p, int n) {
+	int v = *p;
+	*p = 9;
+	if (n > 100) {
+		return v;
+	}
+	return *p;
+}
+
+// Nor into the loop
+static int scale(int *p, int n) {
+	int v = p[1] + n;
+	int s = 0;
+	for (int i = 0; i < n; i++) {
+		s += v * i;
+	}
+	return s;
+}
+
+int main() {
+	int a[2] = { 4, 5 };
+	int r = check(a, 7, 1) + check(a, -3, 0); // 8 + 147
+	r += stale(a, 200) + stale(a, 1);         // 4 + 9
+	r += scale(a, 4);                         // 9 * 6
+	return r; // expect: 222
+}
@@ -0,0 +1,18 @@
+// Threading these branches leaves a later one branching on a phi of
+// comparisons, which has to be tested against 0 instead
+int a[16];
+int g0;
+int g2;
+
+int main() {
+	int v1 = 2, v2 = 13;
+	if (a[3] == 7) {
+		v2 += a[2];
+	}
+	if (v2 == 8) {
+		while (v1 > 0) {
+			v1--;
+		}
+	}
+	return (v2 ? 5 : v1) & (v2 ? g0 : g2); // expect: 0
+}
@@ -0,0 +1,41 @@
+// Over-aligned objects, and loops over them that use aligned vector moves
+_Alignas(32) int g[16];
+
+struct S {
+	char c;
+	_Alignas(16) int x;
+};
+
+int is_aligned(void *p, int align) {
+	return ((unsigned long long) p & (unsigned long long) (align - 1)) == 0;
+}
+
+int sum(int *p, int n) {
+	int *a = __builtin_assume_aligned(p, 16);
+	int s = 0;
+	for (int i = 0; i < n; i++) {
+		s += a[i];
+	}
+	return s;
+}
+
+int add8(int a, int b, int c, int d, int e, int f, int g, int h) {
+	return a + b + c + d + e + f + g + h;
+}
+
+int main() {
+	_Alignas(64) int buf[16];
+	_Alignas(32) int x = 5;
+	struct S s;
+	for (int i = 0; i < 16; i++) {
+		buf[i] = i;
+		g[i] = 2 * i;
+	}
+	for (int i = 0; i < 16; i++) {
+		buf[i] += g[i];
+	}
+	int ok = is_aligned(buf, 64) + is_aligned(&x, 32) + is_aligned(g, 32) +
+	         ((unsigned long long) &s.x - (unsigned long long) &s == 16);
+	int args = add8(1, 2, 3, 4, 5, 6, 7, buf[1]); // Passes some on the stack
+	return sum(buf, 16) - 360 + ok * 10 + x + args; // expect: 76
+}
@@ -0,0 +1,5 @@
+// 'aligned_access.c' without a frame pointer; a function with over-aligned
+// locals keeps one anyway, so they still get their alignment
+// flags: -fomit-frame-pointer
+// expect: 76
+#include "aligned_access.c"
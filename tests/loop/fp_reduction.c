@@ -0,0 +1,39 @@
+double sum(double *a, int n) {
+	double s = 0.0;
+	for (int i = 0; i < n; i++) {
+		s += a[i];
+	}
+	return s;
+}
+
+float product(float *a, int n) {
+	float p = 1.0f;
+	for (int i = 0; i < n; i++) {
+		p *= a[i];
+	}
+	return p;
+}
+
+double harmonic(int n) {
+	double s = 0.0;
+	for (int i = 0; i < n; i++) {
+		s += (double) i / 4.0;
+	}
+	return s;
+}
+
+int main() {
+	double a[23];
+	float b[9];
+	for (int i = 0; i < 23; i++) {
+		a[i] = (double) (i * 3);
+	}
+	for (int i = 0; i < 9; i++) {
+		b[i] = i % 3 == 0 ? 2.0f : 1.0f;
+	}
+	int r = (int) sum(a, 23);       // 759
+	r += (int) product(b, 9);       // 8
+	r += (int) harmonic(17) * 2;    // 34 * 2
+	r += (int) (sum(a, 5) / 10.0);  // 3
+	return r - 600; // expect: 238
+}
@@ -0,0 +1,74 @@
+int a[100], b[100];
+double d[50];
+char buf[300];
+
+void zero_n(int *p, int n) {
+	for (int i = 0; i < n; i++) {
+		p[i] = 0;
+	}
+}
+
+void copy_n(int *restrict p, int *restrict q, int n) {
+	for (int i = 0; i < n; i++) {
+		p[i] = q[i];
+	}
+}
+
+void zero_from(long *p, int s, int n) {
+	for (int i = s; i < n; i++) {
+		p[i] = 0;
+	}
+}
+
+void copy_u(char *restrict p, char *restrict q, unsigned n) {
+	for (unsigned i = 0; i < n; i++) {
+		p[i] = q[i];
+	}
+}
+
+void copy_l(short *restrict p, short *restrict q, long n) {
+	for (long i = 2; i < n; i++) {
+		p[i] = q[i];
+	}
+}
+
+int main() {
+	for (int i = 0; i < 100; i++) {
+		a[i] = i + 1;
+		b[i] = 2 * i;
+	}
+	for (int i = 0; i < 50; i++) {
+		d[i] = 1.5;
+	}
+	for (int i = 10; i < 40; i++) {
+		d[i] = 0.0;
+	}
+	for (int i = 0; i < 300; i++) {
+		buf[i] = (char) i;
+	}
+	zero_n(a, 10);
+	copy_n(a + 50, b, 20);
+	long l[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+	zero_from(l, 3, 6);
+	zero_from(l, 6, 3); // Empty
+	copy_u(buf, buf + 150, 100);
+	short s1[10] = {0}, s2[10] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+	copy_l(s1, s2, 10);
+	int s = 0;
+	for (int i = 0; i < 100; i++) {
+		s += a[i] * (i + 1);
+	}
+	for (int i = 0; i < 50; i++) {
+		s += (int) d[i];
+	}
+	for (int i = 0; i < 8; i++) {
+		s += l[i] * i;
+	}
+	for (int i = 0; i < 300; i++) {
+		s += buf[i] * i;
+	}
+	for (int i = 0; i < 10; i++) {
+		s += s1[i] * i;
+	}
+	return s % 251; // expect: 108
+}
@@ -0,0 +1,40 @@
+int a[16][16];
+
+int col_sum(int n, int m) {
+	int s = 0;
+	for (int j = 0; j < m; j++) {
+		for (int i = 0; i < n; i++) {
+			s += a[i][j];
+		}
+	}
+	return s;
+}
+
+void scale(void) {
+	for (int j = 0; j < 16; j++) {
+		for (int i = 0; i < 16; i++) {
+			a[i][j] = a[i][j] * 3 + i - j;
+		}
+	}
+}
+
+void skew(void) { // Can't be swapped
+	for (int j = 1; j < 15; j++) {
+		for (int i = 1; i < 15; i++) {
+			a[i][j] = a[i - 1][j + 1] + 1;
+		}
+	}
+}
+
+int main() {
+	for (int i = 0; i < 16; i++) {
+		for (int j = 0; j < 16; j++) {
+			a[i][j] = i * 7 + j % 5;
+		}
+	}
+	int r = col_sum(16, 10);
+	scale();
+	skew();
+	r += col_sum(16, 16) + a[14][1];
+	return r % 256; // expect: 81
+}
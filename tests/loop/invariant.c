@@ -0,0 +1,13 @@
+int sum(int *a, int *n, int k) {
+	int s = 0;
+	for (int i = 0; i < *n; i++) {
+		s += a[i] * (k + 3);
+	}
+	return s;
+}
+int main() {
+	int a[4];
+	a[0] = 1; a[1] = 2; a[2] = 3; a[3] = 4;
+	int n = 4;
+	return sum(a, &n, 2); // expect: 50
+}
@@ -0,0 +1,20 @@
+int fill(int *restrict out, int *restrict n) {
+	int i = 0;
+	while (i < *n) {
+		out[i] = i * 2;
+		i++;
+	}
+	return out[*n - 1];
+}
+
+int main() {
+	int a[8];
+	int n = 8;
+	short c = 3;
+	int t = 0;
+	for (int i = 0; i < n; i++) {
+		a[i] = c;
+		t += a[i] + n;
+	}
+	return fill(a, &n) + t; // expect: 102
+}
@@ -0,0 +1,17 @@
+int find(int n) {
+	int i = 0;
+	while (i < n) {
+		for (int j = 0; j < i; j++) {
+			if (i * j == 42) return i + j;
+		}
+		i++;
+	}
+	return 0;
+}
+int main() {
+	int s = 0;
+	for (int k = 0; k < 3; k++) {
+		s += find(10) + find(5);
+	}
+	return s; // expect: 39
+}
@@ -0,0 +1,25 @@
+// expect: 204
+
+// Values reloaded or rematerialised right before a division mustn't end up in
+// the registers it reads implicitly (rax and rdx)
+long f(long *y, int m) {
+    long acc = 0;
+    for (int k = 0; k < m; k++) {
+        long i0 = y[k];
+        long i1 = (i0 ^ y[(k + 1) % 8]) + (i0 & 1023) * 2;
+        long i2 = (i1 ^ y[(k + 2) % 8]) + (i0 & 1023) * 3;
+        long i3 = (i0 ^ y[(k + 3) % 8]) + (i2 & 1023) * 4;
+        long i4 = (i0 ^ y[(k + 4) % 8]) + (i2 & 1023) * 5;
+        long i5 = (i4 ^ y[(k + 5) % 8]) + (i0 & 1023) * 6;
+        acc += i1 + i2 + i3 + i5;
+    }
+    return acc;
+}
+
+int main() {
+    long y[8];
+    for (int i = 0; i < 8; i++) {
+        y[i] = i * 7 + 1;
+    }
+    return f(y, 5) % 256;
+}
@@ -0,0 +1,27 @@
+int main() {
+	double v0 = 0;
+	double v1 = 1;
+	double v2 = 2;
+	double v3 = 0;
+	double v4 = 1;
+	double v5 = 2;
+	double v6 = 0;
+	double v7 = 1;
+	double v8 = 2;
+	double v9 = 0;
+	double v10 = 1;
+	double v11 = 2;
+	double v12 = 0;
+	double v13 = 1;
+	double v14 = 2;
+	double v15 = 0;
+	double v16 = 1;
+	double v17 = 2;
+	double v18 = 0;
+	double v19 = 1;
+	int r = 0;
+	for (int i = 0; i < 2; i++) {
+		r = r + v19 * (v19 + 1.0) + (v18 * (v18 + 1.0) + (v17 * (v17 + 1.0) + (v16 * (v16 + 1.0) + (v15 * (v15 + 1.0) + (v14 * (v14 + 1.0) + (v13 * (v13 + 1.0) + (v12 * (v12 + 1.0) + (v11 * (v11 + 1.0) + (v10 * (v10 + 1.0) + (v9 * (v9 + 1.0) + (v8 * (v8 + 1.0) + (v7 * (v7 + 1.0) + (v6 * (v6 + 1.0) + (v5 * (v5 + 1.0) + (v4 * (v4 + 1.0) + (v3 * (v3 + 1.0) + (v2 * (v2 + 1.0) + (v1 * (v1 + 1.0) + (v0)))))))))))))))))));
+	}
+	return r; // expect: 100
+}
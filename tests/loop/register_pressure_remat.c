@@ -0,0 +1,126 @@
+int g0[4];
+int g1[4];
+int g2[4];
+int g3[4];
+int g4[4];
+int g5[4];
+int g6[4];
+int g7[4];
+int g8[4];
+int g9[4];
+int g10[4];
+int g11[4];
+int g12[4];
+int g13[4];
+int g14[4];
+int g15[4];
+int g16[4];
+int g17[4];
+int g18[4];
+int g19[4];
+int g20[4];
+int g21[4];
+int g22[4];
+int g23[4];
+int main() {
+	int s0 = 0;
+	int s1 = 1;
+	int s2 = 2;
+	int s3 = 3;
+	int s4 = 4;
+	int s5 = 5;
+	int s6 = 6;
+	int s7 = 7;
+	int s8 = 8;
+	int s9 = 9;
+	int s10 = 10;
+	int s11 = 11;
+	int s12 = 12;
+	int s13 = 13;
+	int s14 = 14;
+	int s15 = 15;
+	for (int i = 0; i < 4; i += 1) {
+		g0[i] = i * 1 + s0;
+		g1[i] = i * 2 + s1;
+		g2[i] = i * 3 + s2;
+		g3[i] = i * 4 + s3;
+		g4[i] = i * 5 + s4;
+		g5[i] = i * 6 + s5;
+		g6[i] = i * 7 + s6;
+		g7[i] = i * 8 + s7;
+		g8[i] = i * 9 + s8;
+		g9[i] = i * 10 + s9;
+		g10[i] = i * 11 + s10;
+		g11[i] = i * 12 + s11;
+		g12[i] = i * 13 + s12;
+		g13[i] = i * 14 + s13;
+		g14[i] = i * 15 + s14;
+		g15[i] = i * 16 + s15;
+		g16[i] = i * 17 + s0;
+		g17[i] = i * 18 + s1;
+		g18[i] = i * 19 + s2;
+		g19[i] = i * 20 + s3;
+		g20[i] = i * 21 + s4;
+		g21[i] = i * 22 + s5;
+		g22[i] = i * 23 + s6;
+		g23[i] = i * 24 + s7;
+		s0 = s0 * 3 + g0[i] + g5[i] + 100000;
+		s1 = s1 * 3 + g1[i] + g6[i] + 100001;
+		s2 = s2 * 3 + g2[i] + g7[i] + 100002;
+		s3 = s3 * 3 + g3[i] + g8[i] + 100003;
+		s4 = s4 * 3 + g4[i] + g9[i] + 100004;
+		s5 = s5 * 3 + g5[i] + g10[i] + 100005;
+		s6 = s6 * 3 + g6[i] + g11[i] + 100006;
+		s7 = s7 * 3 + g7[i] + g12[i] + 100007;
+		s8 = s8 * 3 + g8[i] + g13[i] + 100008;
+		s9 = s9 * 3 + g9[i] + g14[i] + 100009;
+		s10 = s10 * 3 + g10[i] + g15[i] + 100010;
+		s11 = s11 * 3 + g11[i] + g16[i] + 100011;
+		s12 = s12 * 3 + g12[i] + g17[i] + 100012;
+		s13 = s13 * 3 + g13[i] + g18[i] + 100013;
+		s14 = s14 * 3 + g14[i] + g19[i] + 100014;
+		s15 = s15 * 3 + g15[i] + g20[i] + 100015;
+	}
+	int r = 0;
+	r = r * 7 + s0;
+	r = r * 7 + s1;
+	r = r * 7 + s2;
+	r = r * 7 + s3;
+	r = r * 7 + s4;
+	r = r * 7 + s5;
+	r = r * 7 + s6;
+	r = r * 7 + s7;
+	r = r * 7 + s8;
+	r = r * 7 + s9;
+	r = r * 7 + s10;
+	r = r * 7 + s11;
+	r = r * 7 + s12;
+	r = r * 7 + s13;
+	r = r * 7 + s14;
+	r = r * 7 + s15;
+	r += g0[3];
+	r += g1[3];
+	r += g2[3];
+	r += g3[3];
+	r += g4[3];
+	r += g5[3];
+	r += g6[3];
+	r += g7[3];
+	r += g8[3];
+	r += g9[3];
+	r += g10[3];
+	r += g11[3];
+	r += g12[3];
+	r += g13[3];
+	r += g14[3];
+	r += g15[3];
+	r += g16[3];
+	r += g17[3];
+	r += g18[3];
+	r += g19[3];
+	r += g20[3];
+	r += g21[3];
+	r += g22[3];
+	r += g23[3];
+	return r & 255; // expect: 252
+}
@@ -0,0 +1,33 @@
+int count(int *a, int n, int x) {
+	int i = 0;
+	while (i < n && a[i] != x) {
+		i++;
+	}
+	return i;
+}
+
+int fib(int n) {
+	int a = 0, b = 1, i = 0;
+	while (i < n) {
+		int t = a + b;
+		a = b;
+		b = t;
+		i++;
+	}
+	return a;
+}
+
+int last(int n) {
+	int i, k = -1;
+	for (i = 3; i * i < n; i += 2) {
+		k = i;
+	}
+	return i * 100 + k;
+}
+
+int main() {
+	int a[5] = {4, 8, 15, 16, 23};
+	int r = count(a, 5, 15) + count(a, 5, 42) * 10 + count(a, 0, 4) * 100;
+	r += fib(10) * 1000 + fib(0) + last(50) % 7 + last(5) % 11;
+	return r % 251; // expect: 89
+}
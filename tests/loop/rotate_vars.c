@@ -0,0 +1,24 @@
+int main() {
+	int a = 1;
+	int b = 2;
+	int c = 3;
+	double x = 1.5;
+	double y = 4.0;
+	int arr[2] = {5, 7};
+	int *p = arr;
+	int d = 0;
+	int sum = 0;
+	for (int i = 0; i < 7; i += 1) {
+		int t = a;
+		a = b;
+		b = c;
+		c = t;
+		double u = x;
+		x = y;
+		y = u;
+		d = *p;
+		p = (i % 2 == 0) ? arr + 1 : arr;
+		sum = sum * 3 + a * 4 + c + d;
+	}
+	return sum % 251 + (int) x; // expect: 127
+}
@@ -0,0 +1,15 @@
+int main() {
+	int a[10];
+	for (int i = 0; i < 10; i++) {
+		a[i] = i * 8;
+	}
+	int s = 0;
+	for (int i = 9; i >= 0; i -= 2) {
+		s += a[i];
+	}
+	char c[4];
+	for (int i = 0; i < 4; i++) {
+		c[i] = i;
+	}
+	return s + c[3]; // expect: 203
+}
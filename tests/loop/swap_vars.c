@@ -0,0 +1,12 @@
+int main() {
+	int a = 3;
+	int b = 10;
+	int c = 0;
+	for (int i = 0; i < 5; i += 1) {
+		int t = a;
+		a = b;
+		b = t;
+		c = c * 2 + a;
+	}
+	return c; // expect: 240
+}
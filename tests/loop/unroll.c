@@ -0,0 +1,54 @@
+int sum(int *a, int n) {
+	int s = 0;
+	for (int i = 0; i < n; i++) {
+		s += a[i] * (i + 1);
+	}
+	return s;
+}
+
+int fixed(int *a) {
+	int s = 0;
+	for (int i = 0; i < 6; i++) {
+		s = s * 3 + a[i];
+	}
+	return s;
+}
+
+int forced(int *a, int n) {
+	int s = 0;
+#pragma unroll 8
+	for (int i = 2; i < n; i++) {
+		s ^= a[i] << (i & 7);
+	}
+	return s;
+}
+
+int kept(int *a, int n) {
+	int s = 0, i = 0;
+#pragma nounroll
+	while (i < n) {
+		s += a[i];
+		i++;
+	}
+	return s;
+}
+
+int gcc_form(int *a, unsigned n) {
+	int s = 0;
+#pragma GCC unroll 2
+	for (unsigned i = 0; i < n; i++) {
+		s -= a[i];
+	}
+	return s;
+}
+
+int main() {
+	int a[11];
+	for (int i = 0; i < 11; i++) {
+		a[i] = i * 7 - 20;
+	}
+	int r = sum(a, 11) + sum(a, 3) + sum(a, 0) + fixed(a);
+	r += forced(a, 11) + forced(a, 5) + forced(a, 1);
+	r += kept(a, 9) + gcc_form(a, 7) + gcc_form(a, 0);
+	return r & 255; // expect: 240
+}
@@ -0,0 +1,23 @@
+// Comparison results used arithmetically inside a loop that's unrolled with a
+// remainder loop; used to make the register allocator spin forever
+int a[16];
+int g0;
+int g1;
+
+int main() {
+	int v1 = 1, v2 = 16, v3 = 15, v4 = 13;
+	for (int j = 0; j < 16; j++) {
+		a[j] = j * 3 - 7;
+	}
+	int n = 24;
+	for (int i = 0; i < n; i++) {
+		v3 += (v4 == 3);
+		g1 = (v3 <= g0);
+		g1 = g0;
+		a[i & 15] = ((v2 | (i != v1)) | ((v3 ^ a[i & 15]) & g0));
+		v4 += (v1 > g1);
+		v2 = (((1 & g0) + (i - 1)) * (v4 <= i));
+		v1 += (v1 <= i);
+	}
+	return (v1 + v2 + v3 + v4 + g0 + g1 + a[3]) & 255; // expect: 76
+}
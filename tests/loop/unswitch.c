@@ -0,0 +1,47 @@
+int mode;
+
+int scale(int *a, int n, int fast) {
+	int s = 0;
+	for (int i = 0; i < n; i++) {
+		if (fast == 2) {
+			s += a[i];
+		} else {
+			s -= a[i] * 3;
+		}
+	}
+	return s;
+}
+
+int find(int *a, int n, int k) {
+	int i, last = 0;
+	for (i = 0; i < n; i++) {
+		if (k) {
+			last = a[i];
+			if (a[i] > 100) break;
+		} else {
+			a[i] += 1;
+		}
+	}
+	return i * 1000 + last;
+}
+
+int nested(int *a, int n) {
+	int s = 0;
+	for (int j = 0; j < 3; j++) {
+		for (int i = 0; i < n; i++) {
+			if (mode > 1) s += a[i] << j; else s ^= a[i];
+		}
+	}
+	return s;
+}
+
+int main() {
+	int a[6] = {1, 2, 300, 4, 5, 6};
+	int r = scale(a, 6, 2) + scale(a, 6, 1) * 7 + scale(a, 0, 2);
+	r += find(a, 6, 1) + find(a, 6, 0) + find(a, 0, 1);
+	mode = 2;
+	r += nested(a, 6);
+	mode = 0;
+	r += nested(a, 6);
+	return r & 255; // expect: 152
+}
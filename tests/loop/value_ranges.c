@@ -0,0 +1,34 @@
+int sum(int *a, int n) {
+	int s = 0;
+	for (int i = 0; i < n; i++) {
+		if (i >= 0) s += a[i / 4] + i % 3;
+	}
+	return s;
+}
+
+int down(int n) {
+	int s = 0;
+	for (int i = n; i > -6; i--) {
+		s += i / 2 + i % 4;
+	}
+	return s;
+}
+
+int masked(int x) {
+	int m = x & 15;
+	if (m < 16) return m / 4;
+	return 100;
+}
+
+int small(unsigned char c, int x) {
+	int s = 0;
+	if (c < 256) s += 1;
+	if (x > 10 && x < 20) s += x % 8;
+	if (x < 0) s += x / 3;
+	return s;
+}
+
+int main() {
+	int a[] = {1, 2, 3, 4, 5};
+	return sum(a, 17) + down(7) + masked(-3) + small(200, 15) + small(1, -7); // expect: 82
+}
@@ -0,0 +1,49 @@
+void blend(unsigned char *restrict out, unsigned char *restrict a, unsigned char *restrict b, int n) {
+	for (int i = 0; i < n; i++) {
+		out[i] = (a[i] + b[i]) >> 1;
+	}
+}
+
+unsigned checksum(unsigned char *buf, int n) {
+	unsigned sum = 0;
+	for (int i = 0; i < n; i++) {
+		sum += buf[i];
+	}
+	return sum;
+}
+
+void scale(float *restrict out, float *restrict in, float k, int n) {
+	for (int i = 0; i < n; i++) {
+		out[i] = in[i] * k + 1.0f;
+	}
+}
+
+short diff_hash(short *restrict a, short *restrict b, short *restrict c, int n) {
+	int x = 0;
+	for (int i = 0; i < n; i++) {
+		c[i] = (short) (a[i] - b[i]);
+		x ^= a[i] << 2;
+	}
+	return (short) x;
+}
+
+int main() {
+	unsigned char a[37], b[37], out[37];
+	for (int i = 0; i < 37; i++) {
+		a[i] = (unsigned char) (i * 7);
+		b[i] = (unsigned char) (200 - i * 3);
+	}
+	blend(out, a, b, 37);
+	float f[19], g[19];
+	for (int i = 0; i < 19; i++) {
+		f[i] = (float) i;
+	}
+	scale(g, f, 2.0f, 19);
+	short s[11], t[11], u[11];
+	for (int i = 0; i < 11; i++) {
+		s[i] = (short) (i * 300);
+		t[i] = (short) (i - 5);
+	}
+	short x = diff_hash(s, t, u, 11);
+	return (int) ((checksum(out, 37) + (int) g[18] + u[10] + x) & 0xff); // expect: 80
+}
@@ -0,0 +1,19 @@
+// A loop that isn't vectorised, between two that are; what was worked out for
+// it used to be left behind for the next loop, and crashed the vectoriser
+unsigned test(unsigned b) {
+	unsigned arr[16];
+	for (int j = 0; j < 16; j++) {
+		arr[j] = j;
+	}
+	for (int i0 = 0; i0 < 10; i0++) {
+		b += i0;
+	}
+	for (int j = 0; j < 16; j++) {
+		arr[j] = arr[j] + b;
+	}
+	return arr[3] + arr[15];
+}
+
+int main() {
+	return test(1) & 255; // expect: 110
+}
@@ -0,0 +1,14 @@
+struct P { int x; int y; };
+int sum(struct P *p, int *a, int i) {
+	a[i] = a[i + 1] + p[i].y;
+	return a[i] + p[i + 1].x;
+}
+int main() {
+	int a[4];
+	a[0] = 1; a[1] = 2; a[2] = 3; a[3] = 4;
+	struct P p[3];
+	p[0].x = 5; p[0].y = 6;
+	p[1].x = 7; p[1].y = 8;
+	p[2].x = 9; p[2].y = 10;
+	return sum(p, a, 1) + a[1]; // expect: 31
+}
@@ -0,0 +1,24 @@
+struct Point {
+	int x, y, z;
+	double w;
+	int *p;
+};
+
+int read_back(int *a, float *b) {
+	*a = 5;
+	*b = 2.0f;
+	return *a; // Forwarded past the float store
+}
+
+int main() {
+	struct Point p = {1, 2};
+	p.z = p.x + p.y;
+	p.x = 7;
+	p.x = p.z * 2;
+	int a[4] = {0};
+	a[1] = 4;
+	a[1] = a[1] + p.x;
+	float f;
+	int n = read_back(&a[3], &f);
+	return p.x + p.y + p.z + (int) p.w + (p.p == 0) + a[1] + a[0] + n; // expect: 27
+}
@@ -0,0 +1,15 @@
+struct P { int x; int y; };
+int f(int *a, struct P *p, int i) {
+	int s = a[i] + a[i];
+	s = s + p->x * p->y + p->x;
+	a[0] = s;
+	return s + a[0] + p->x;
+}
+int main() {
+	int a[3];
+	a[0] = 1; a[1] = 2; a[2] = 3;
+	struct P p;
+	p.x = 4; p.y = 5;
+	int r = f(a, &p, 2);
+	return r; // expect: 64
+}
@@ -0,0 +1,10 @@
+// expect: 3
+int second(char *s) {
+	return s[1];
+}
+
+int main() {
+	char *a = "hello";
+	char *b = "hello"; // Shares 'a's copy
+	return (a == b) + (second("xyz") == 'y') + ("abc"[2] == 'c');
+}
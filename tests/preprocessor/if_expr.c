@@ -0,0 +1,37 @@
+// expect: 63
+#define A 3
+#define F(x) ((x) * 2)
+#if A + 1 == 4 && F(A) == 6
+int a = 1;
+#else
+int a = 0;
+#endif
+#if -1 > 0u && (-1 >> 1) < 0 && 7 / 2 == 3 && -7 % 2 == -1
+int b = 2;
+#else
+int b = 0;
+#endif
+#if 0 && 1 / 0 || 1 ? 2 : (1 % 0)
+int c = 4;
+#else
+int c = 0;
+#endif
+#if defined(A) && !defined B && UNDEFINED == 0 && 'a' == 97 && 0x10 == 020
+int d = 8;
+#else
+int d = 0;
+#endif
+#if defined(__has_include) && __has_include("include_guard.h") && \
+    !__has_include(<no_such_header.h>)
+int e = 16;
+#else
+int e = 0;
+#endif
+#if (1, 0) == 0 && 18446744073709551615 == -1 && (1 ? -1 : 0u) > 0
+int f = 32;
+#else
+int f = 0;
+#endif
+int main() {
+	return a + b + c + d + e + f;
+}
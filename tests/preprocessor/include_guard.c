@@ -0,0 +1,8 @@
+int main() {
+	int count = 0;
+#include "include_guard.h"
+#include "include_guard.h"
+#undef INCLUDE_GUARD_H
+#include "include_guard.h"
+	return count; // expect: 4
+}
@@ -0,0 +1,8 @@
+int main() {
+	int count = 0;
+#include "include_twice.h"
+#include "include_twice.h"
+#define STEP 3
+#include "include_twice.h"
+	return count; // expect: 5
+}
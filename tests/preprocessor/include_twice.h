@@ -0,0 +1,5 @@
+#ifdef STEP
+	count += STEP;
+#else
+	count += __LINE__ - 3;
+#endif
@@ -0,0 +1,14 @@
+// expect: 48
+#define STR(x) #x
+#define TWICE(x) ((x) + (x))
+#define F(x) x + 1
+#define G(x) F(x) * 2
+#define CAT(a, b) a ## b
+#define ID(x) x
+int main() {
+	int v1 = 3, v12 = 9;
+	int a = TWICE(G(v1));
+	int b = ID(CAT(v, 12)) + CAT(v, 1);
+	int c = TWICE(TWICE(ID(1))) + ID(ID(CAT(1, 2)));
+	return a + b + c + sizeof(STR(ID(v1)  +  x)) - 1;
+}
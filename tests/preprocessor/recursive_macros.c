@@ -0,0 +1,10 @@
+// expect: 13
+int main() {
+	int x = 3;
+	int f = 2;
+	int y = 4;
+#define f(a) a + g(a)
+#define g(a) f + a
+#define y y + 1
+	return f(x) + y;
+}
@@ -0,0 +1,22 @@
+// expect: 53
+#define A B + 1
+#define B 2
+#define F(x) (x * 2)
+#define G F
+#define C D
+#define L __LINE__
+int main() {
+	int D = 10;
+	int r = A + A;  // 6
+#undef B
+#define B 5
+	r += A;         // 6
+	r += G(3);      // 6
+	r += C;         // 10
+#define D 20
+	r += C + C;     // 40
+#undef G
+#define G 1
+	r += L - __LINE__;
+	return r + G - 16;
+}
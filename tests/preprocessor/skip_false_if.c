@@ -0,0 +1,21 @@
+// expect: 42
+#if 0
+This isn't C, and the apostrophe doesn't end until the end of the line
+/* A comment hiding a directive
+#endif
+*/
+char *s = "/* not a comment";
+#define X 1 \
+	+ 2
+#if 1
+#error nested
+#else
+#endif
+#elif 0
+#error elif
+#else
+#define X 21
+#endif
+int main() {
+	return X + __LINE__ + 1;
+}
@@ -0,0 +1,22 @@
+// Structs and unions are padded up to their alignment, so elements of an
+// array of them stay aligned; the sizes and offsets are gcc's
+struct A { int a; char b; };
+struct B { long a; char b; };
+struct C { char a; short b; char c; };
+struct D { struct A a; char b; };
+union U { char a[5]; int b; };
+struct E { char a; union U u; };
+
+int main() {
+	struct C c;
+	struct D d;
+	struct E e;
+	struct A arr[3];
+	int off_c = (long long) &c.c - (long long) &c;
+	int off_d = (long long) &d.b - (long long) &d;
+	int off_e = (long long) &e.u - (long long) &e;
+	int stride = (long long) &arr[1] - (long long) &arr[0];
+	return sizeof(struct A) + sizeof(struct B) + sizeof(struct C) +
+		sizeof(struct D) + sizeof(union U) + sizeof(struct E) +
+		off_c + off_d + off_e + stride; // expect: 86
+}
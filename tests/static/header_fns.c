@@ -0,0 +1,8 @@
+#include "header_fns.h"
+
+int main() {
+	int (*f)() = next;
+	f();
+	f();
+	return quad(3) + next(); // expect: 15
+}
@@ -0,0 +1,17 @@
+static int counter = 0;
+
+static inline int twice(int x) {
+	return x * 2;
+}
+
+static inline int quad(int x) {
+	return twice(twice(x));
+}
+
+static int next() {
+	return ++counter;
+}
+
+static inline int unused(int x) {
+	return x + undefined_elsewhere;
+}
@@ -0,0 +1,23 @@
+// expect: 7
+static int a = 3;
+static int b = 4;
+static int *p = &b; // Only reachable through 'p'
+static int never = 5;
+
+static int odd(int n);
+
+static int even(int n) {
+	return n == 0 ? 1 : odd(n - 1);
+}
+
+static int odd(int n) {
+	return n == 0 ? 0 : even(n - 1);
+}
+
+static int unused_fn() {
+	return never + unused_fn();
+}
+
+int main() {
+	return a + *p;
+}
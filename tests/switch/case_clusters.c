@@ -0,0 +1,45 @@
+// Sparse cases, each compared on its own, mixed with a dense run. Each
+// case's immediate has to be defined before the comparison that uses it,
+// or GVN can delete it as a duplicate of a later one
+int g;
+
+int classify(int x) {
+	int r = 0;
+	switch (x) {
+		case -700: r = x * 3; break;
+		case -9: g += x; r = 4;
+		case 1: case 2: case 3: case 4: case 5: r += x; break;
+		case 90: r = g - x; break;
+		case 4000: g = r; r = 11; break;
+		case 123456: r = x / 1000; break;
+		default: r = x & 7; break;
+	}
+	return r;
+}
+
+// No default, on a value that isn't the parameter itself
+int scaled(int x, int y) {
+	switch (x * 3) {
+		case 1090: return (1 | (g + 7)) & x;
+		case 3: g += 7 | -5;
+		case -60218: return y | 100;
+		case 7: y = 3 & -5; break;
+		case 97568: y ^= ((y | 100) | (y | x)) + 3;
+		case 1708: return (7 | g | 3) - 3;
+		case 87992: y ^= (3 * y) & g & 100;
+	}
+	return y + g;
+}
+
+int main() {
+	int sum = 0;
+	int vals[] = { -700, -9, 1, 3, 5, 6, 90, 4000, 123456, 77 };
+	for (int i = 0; i < 10; i++) {
+		sum += classify(vals[i]);
+	}
+	g = 0;
+	for (int i = -60; i < 60; i++) {
+		sum += scaled(i * 7 + 2, i);
+	}
+	return sum & 255; // expect: 194
+}
@@ -0,0 +1,55 @@
+int dense(int x) {
+	switch (x) {
+		case 0: return 3;
+		case 1: return 5;
+		case 2: return 7;
+		case 4: return 11;
+		case 5: return 13;
+		case 6: x = 17;
+		case 7: return x + 1;
+		default: return -1;
+	}
+}
+
+int bits(int x) {
+	switch (x) {
+		case 10: case 12: case 14: case 40: return 1;
+		case 11: case 13: case 70: return 2;
+	}
+	return 0;
+}
+
+int sparse(int x) {
+	switch (x) {
+		case -1000: return 1;
+		case -3: return 2;
+		case 7: return 3;
+		case 100: return 4;
+		case 1000: return 5;
+		case 5000: return 6;
+		case 100000: return 7;
+	}
+	return 8;
+}
+
+int chars(unsigned char c) {
+	switch (c) {
+		case 250: case 251: case 252: case 253: return 9;
+		case 1: case 3: case 5: case 7: case 9: return 4;
+	}
+	return 0;
+}
+
+int main() {
+	int sum = 0;
+	for (int i = -2; i < 80; i++) {
+		sum += dense(i) * 3 + bits(i) * 5;
+	}
+	int s = sparse(-1000) + sparse(-3) + sparse(7) + sparse(100) + sparse(1000) +
+		sparse(5000) + sparse(100000) + sparse(0) + sparse(-4) + sparse(99999);
+	int c = 0;
+	for (int i = 0; i < 256; i++) {
+		c += chars(i);
+	}
+	return (sum + s + c) & 255; // expect: 128
+}
@@ -0,0 +1,68 @@
+// Each case only returns a constant
+int days(int month) {
+	switch (month) {
+		case 1: return 31;
+		case 2: return 28;
+		case 3: return 31;
+		case 4: return 30;
+		case 5: return 31;
+		case 6: return 30;
+		case 7: return 31;
+		case 8: return 31;
+		case 9: return 30;
+		case 10: return 31;
+		case 11: return 30;
+		case 12: return 31;
+		default: return 0;
+	}
+}
+
+// Two constants, for a bitmask
+int is_vowel(int c) {
+	switch (c) {
+		case 'a': case 'e': case 'i': case 'o': case 'u': return 1;
+		default: return 0;
+	}
+}
+
+// Each case sets two variables, which meet in phis
+int weights(int x) {
+	int a, b;
+	switch (x) {
+		case -2: a = 7; b = -100; break;
+		case -1: a = 1; b = 300; break;
+		case 0: a = 4; b = 70000; break;
+		case 1: a = 9; b = 2; break;
+		default: a = 0; b = 1; break;
+	}
+	return a * b;
+}
+
+// An 'if'-'else if' chain, with a default that isn't constant
+int chain(int x, int y) {
+	if (x == 100) {
+		return 3;
+	} else if (x == 101) {
+		return 8;
+	} else if (x == 102) {
+		return 21;
+	}
+	return y + x;
+}
+
+int main() {
+	int d = 0, v = 0, w = 0, c = 0;
+	for (int i = -3; i < 15; i++) {
+		d += days(i);
+	}
+	for (int i = 0; i < 128; i++) {
+		v += is_vowel(i) * i;
+	}
+	for (int i = -4; i < 4; i++) {
+		w += weights(i);
+	}
+	for (int i = 98; i < 106; i++) {
+		c += chain(i, 2);
+	}
+	return (d + v + w + c) & 255; // expect: 233
+}
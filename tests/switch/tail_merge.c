@@ -0,0 +1,41 @@
+int cleanups;
+
+static void cleanup(int code) {
+	cleanups += code;
+}
+
+// Each case ends in the same call and return
+static int dispatch(int op, int x) {
+	switch (op) {
+	case 0: x += 3; cleanup(2); return -1;
+	case 1: return x * 2;
+	case 2: x -= 1; cleanup(2); return -1;
+	case 3: cleanup(2); return -1;
+	case 4: cleanup(3); return -1; // Different argument
+	}
+	return x;
+}
+
+// Both arms end in the same arithmetic before joining
+static int join(int *p, int n) {
+	int r;
+	if (n & 1) {
+		p[0] = n;
+		r = p[1] * n + 7;
+	} else {
+		p[1] = n;
+		r = p[1] * n + 7;
+	}
+	return r;
+}
+
+int main() {
+	int r = 0;
+	for (int op = 0; op < 6; op++) {
+		r += dispatch(op, 10); // -1 * 4 + 20 + 10
+	}
+	int a[2] = { 1, 2 };
+	r += join(a, 3); // 13
+	r += join(a, 4); // 23
+	return r + cleanups; // expect: 71
+}